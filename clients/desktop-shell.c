@@ -34,6 +34,7 @@
 #include <math.h>
 #include <cairo.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
 #include <linux/input.h>
 #include <libgen.h>
 #include <ctype.h>
@@ -43,6 +44,7 @@
 #include <wayland-client.h>
 #include "window.h"
 #include "shared/cairo-util.h"
+#include "shared/image-loader.h"
 #include <libweston/config-parser.h>
 #include "shared/helpers.h"
 #include "shared/xalloc.h"
@@ -79,6 +81,9 @@ struct desktop {
 	struct weston_config *config;
 	bool locking;
 
+	struct image_loader_queue *image_loader;
+	struct task image_loader_task;
+
 	enum cursor_type grab_cursor;
 
 	int painted;
@@ -111,6 +116,7 @@ struct panel {
 struct background {
 	struct surface base;
 
+	struct desktop *desktop;
 	struct output *owner;
 
 	struct window *window;
@@ -120,6 +126,11 @@ struct background {
 	char *image;
 	int type;
 	uint32_t color;
+
+	/* decoded once, the solid color is painted until it is ready */
+	bool image_requested;
+	struct image_load_request *image_request;
+	cairo_surface_t *image_surface;
 };
 
 struct output {
@@ -739,6 +750,44 @@ enum {
 	BACKGROUND_CENTERED
 };
 
+static void
+background_image_loaded(pixman_image_t *image, void *data)
+{
+	struct background *background = data;
+
+	background->image_request = NULL;
+	if (image)
+		background->image_surface =
+			cairo_surface_from_pixman_image(image);
+
+	widget_schedule_redraw(background->widget);
+}
+
+static void
+background_load_image(struct background *background)
+{
+	struct desktop *desktop = background->desktop;
+	char *name;
+
+	background->image_requested = true;
+
+	if (background->image)
+		name = xstrdup(background->image);
+	else if (background->color == 0)
+		name = file_name_with_datadir("pattern.png");
+	else
+		return;
+
+	if (desktop->image_loader)
+		background->image_request =
+			load_image_async(desktop->image_loader, name,
+					 background_image_loaded, background);
+	if (!background->image_request)
+		background->image_surface = load_cairo_surface(name);
+
+	free(name);
+}
+
 static void
 background_draw(struct widget *widget, void *data)
 {
@@ -763,15 +812,9 @@ background_draw(struct widget *widget, void *data)
 	cairo_paint(cr);
 
 	widget_get_allocation(widget, &allocation);
-	image = NULL;
-	if (background->image)
-		image = load_cairo_surface(background->image);
-	else if (background->color == 0) {
-		char *name = file_name_with_datadir("pattern.png");
-
-		image = load_cairo_surface(name);
-		free(name);
-	}
+	if (!background->image_requested)
+		background_load_image(background);
+	image = background->image_surface;
 
 	if (image && background->type != -1) {
 		im_w = cairo_image_surface_get_width(image);
@@ -817,7 +860,6 @@ background_draw(struct widget *widget, void *data)
 
 		cairo_set_source(cr, pattern);
 		cairo_pattern_destroy (pattern);
-		cairo_surface_destroy(image);
 		cairo_mask(cr, pattern);
 	}
 
@@ -1120,6 +1162,11 @@ static const struct weston_desktop_shell_listener listener = {
 static void
 background_destroy(struct background *background)
 {
+	if (background->image_request)
+		image_load_request_cancel(background->image_request);
+	if (background->image_surface)
+		cairo_surface_destroy(background->image_surface);
+
 	widget_destroy(background->widget);
 	window_destroy(background->window);
 
@@ -1135,6 +1182,7 @@ background_create(struct desktop *desktop, struct output *output)
 	char *type;
 
 	background = xzalloc(sizeof *background);
+	background->desktop = desktop;
 	background->owner = output;
 	background->base.configure = background_configure;
 	background->window = window_create_custom(desktop->display);
@@ -1505,6 +1553,15 @@ parse_clock_format(struct desktop *desktop, struct weston_config_section *s)
 	free(clock_format);
 }
 
+static void
+image_loader_func(struct task *task, uint32_t events)
+{
+	struct desktop *desktop =
+		container_of(task, struct desktop, image_loader_task);
+
+	image_loader_queue_dispatch(desktop->image_loader);
+}
+
 int main(int argc, char *argv[])
 {
 	struct desktop desktop = { 0 };
@@ -1529,6 +1586,16 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	/* Backgrounds are decoded off the main thread, falling back to
+	 * loading them synchronously if no worker could be started. */
+	desktop.image_loader = image_loader_queue_create(1);
+	if (desktop.image_loader) {
+		desktop.image_loader_task.run = image_loader_func;
+		display_watch_fd(desktop.display,
+				 image_loader_queue_get_fd(desktop.image_loader),
+				 EPOLLIN, &desktop.image_loader_task);
+	}
+
 	display_set_user_data(desktop.display, &desktop);
 	display_set_global_handler(desktop.display, global_handler);
 	display_set_global_handler_remove(desktop.display, global_handler_remove);
@@ -1553,6 +1620,11 @@ int main(int argc, char *argv[])
 	if (desktop.unlock_dialog)
 		unlock_dialog_destroy(desktop.unlock_dialog);
 	weston_desktop_shell_destroy(desktop.shell);
+	if (desktop.image_loader) {
+		display_unwatch_fd(desktop.display,
+				   image_loader_queue_get_fd(desktop.image_loader));
+		image_loader_queue_destroy(desktop.image_loader);
+	}
 	display_destroy(desktop.display);
 
 	return 0;
@@ -44,17 +44,36 @@
 #include "shared/os-compatibility.h"
 #include "presentation-time-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
+#include "weston-test-client-protocol.h"
 
 enum run_mode {
 	RUN_MODE_FEEDBACK,
 	RUN_MODE_FEEDBACK_IDLE,
 	RUN_MODE_PRESENT,
+	RUN_MODE_INPUT_LATENCY,
 };
 
 static const char * const run_mode_name[] = {
 	[RUN_MODE_FEEDBACK] = "feedback",
 	[RUN_MODE_FEEDBACK_IDLE] = "feedback-idle",
 	[RUN_MODE_PRESENT] = "low-lat present",
+	[RUN_MODE_INPUT_LATENCY] = "input latency",
+};
+
+/* The stages of an input latency sample, in usec. */
+enum latency_stage {
+	LATENCY_INJECT_TO_INPUT,
+	LATENCY_INPUT_TO_COMMIT,
+	LATENCY_COMMIT_TO_PRESENT,
+	LATENCY_INJECT_TO_PRESENT,
+	LATENCY_STAGE_COUNT,
+};
+
+static const char * const latency_stage_name[] = {
+	[LATENCY_INJECT_TO_INPUT] = "inject_to_input_us",
+	[LATENCY_INPUT_TO_COMMIT] = "input_to_commit_us",
+	[LATENCY_COMMIT_TO_PRESENT] = "commit_to_present_us",
+	[LATENCY_INJECT_TO_PRESENT] = "inject_to_present_us",
 };
 
 struct output {
@@ -76,6 +95,18 @@ struct display {
 	clockid_t clk_id;
 
 	struct wl_list output_list; /* struct output::link */
+
+	/* input latency mode only */
+	struct weston_test *test;
+	struct wl_list seat_list; /* struct seat::link */
+	struct window *input_window;
+};
+
+struct seat {
+	struct display *display;
+	struct wl_seat *seat;
+	struct wl_pointer *pointer;
+	struct wl_list link;
 };
 
 struct feedback {
@@ -87,6 +118,24 @@ struct feedback {
 	uint32_t frame_stamp;
 	struct wl_list link;
 	struct timespec present;
+
+	/* input latency mode only */
+	struct timespec inject;
+	struct timespec input;
+};
+
+/* Input latency mode: each sample injects a pointer motion through
+ * weston-test, commits a new frame when the motion arrives and waits for
+ * its presentation before injecting the next one. */
+struct latency_bench {
+	const char *label;
+	int num_samples;
+	int done;
+	int discarded;
+	int32_t *samples[LATENCY_STAGE_COUNT];
+
+	bool pending; /* a motion is injected and not yet presented */
+	struct timespec inject;
 };
 
 struct buffer {
@@ -114,10 +163,14 @@ struct window {
 	struct wl_list feedback_list;
 
 	struct feedback *received_feedback;
+
+	struct latency_bench bench;
 };
 
 #define NSEC_PER_SEC 1000000000
 
+static int running = 1;
+
 static void
 buffer_release(void *data, struct wl_buffer *buffer)
 {
@@ -252,27 +305,35 @@ create_window(struct display *display, int width, int height,
 	window->width = width;
 	window->height = height;
 	window->surface = wl_compositor_create_surface(display->compositor);
-	window->xdg_surface = xdg_wm_base_get_xdg_surface(display->wm_base,
-							  window->surface);
-
-	if (!window->xdg_surface)
-		return NULL;
-
-	window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
-
-	if (!window->xdg_toplevel)
-		return NULL;
-
-	xdg_wm_base_add_listener(display->wm_base, &xdg_wm_base_listener,
-				 NULL);
-	xdg_surface_add_listener(window->xdg_surface, &xdg_surface_listener,
-				 window);
-	xdg_toplevel_add_listener(window->xdg_toplevel, &xdg_toplevel_listener,
-				  window);
 
-	xdg_toplevel_set_title(window->xdg_toplevel, title);
-	xdg_toplevel_set_min_size(window->xdg_toplevel, width, height);
-	xdg_toplevel_set_max_size(window->xdg_toplevel, width, height);
+	if (mode == RUN_MODE_INPUT_LATENCY) {
+		/* weston-test maps it at a known position, for the injected
+		 * pointer motion to land on */
+		weston_test_move_surface(display->test, window->surface, 0, 0);
+		display->input_window = window;
+	} else {
+		window->xdg_surface =
+			xdg_wm_base_get_xdg_surface(display->wm_base,
+						    window->surface);
+		if (!window->xdg_surface)
+			return NULL;
+
+		window->xdg_toplevel =
+			xdg_surface_get_toplevel(window->xdg_surface);
+		if (!window->xdg_toplevel)
+			return NULL;
+
+		xdg_wm_base_add_listener(display->wm_base,
+					 &xdg_wm_base_listener, NULL);
+		xdg_surface_add_listener(window->xdg_surface,
+					 &xdg_surface_listener, window);
+		xdg_toplevel_add_listener(window->xdg_toplevel,
+					  &xdg_toplevel_listener, window);
+
+		xdg_toplevel_set_title(window->xdg_toplevel, title);
+		xdg_toplevel_set_min_size(window->xdg_toplevel, width, height);
+		xdg_toplevel_set_max_size(window->xdg_toplevel, width, height);
+	}
 
 	wl_surface_commit(window->surface);
 	wl_display_roundtrip(window->display->display);
@@ -315,7 +376,11 @@ destroy_window(struct window *window)
 	if (window->callback)
 		wl_callback_destroy(window->callback);
 
-	xdg_surface_destroy(window->xdg_surface);
+	for (i = 0; i < LATENCY_STAGE_COUNT; i++)
+		free(window->bench.samples[i]);
+
+	if (window->xdg_surface)
+		xdg_surface_destroy(window->xdg_surface);
 	wl_surface_destroy(window->surface);
 
 	for (i = 0; i < window->num_buffers; i++)
@@ -477,6 +542,7 @@ feedback_presented(void *data,
 		break;
 	case RUN_MODE_FEEDBACK:
 	case RUN_MODE_FEEDBACK_IDLE:
+	case RUN_MODE_INPUT_LATENCY:
 		printf("%6u: f2c %2u ms, c2p %2u ms, f2p %2u ms, p2p %5d us, "
 			"t2p %6d, [%s], seq %" PRIu64 "\n", feedback->frame_no,
 			f2c, c2p, f2p, p2p, t2p,
@@ -637,6 +703,7 @@ feedkick_presented(void *data,
 		break;
 	case RUN_MODE_FEEDBACK:
 	case RUN_MODE_FEEDBACK_IDLE:
+	case RUN_MODE_INPUT_LATENCY:
 		assert(0 && "bad mode");
 	}
 }
@@ -658,6 +725,7 @@ feedkick_discarded(void *data,
 		break;
 	case RUN_MODE_FEEDBACK:
 	case RUN_MODE_FEEDBACK_IDLE:
+	case RUN_MODE_INPUT_LATENCY:
 		assert(0 && "bad mode");
 	}
 }
@@ -679,6 +747,7 @@ firstdraw_mode_burst(struct window *window)
 		break;
 	case RUN_MODE_FEEDBACK:
 	case RUN_MODE_FEEDBACK_IDLE:
+	case RUN_MODE_INPUT_LATENCY:
 		assert(0 && "bad mode");
 	}
 
@@ -686,6 +755,181 @@ firstdraw_mode_burst(struct window *window)
 	window_commit_next(window);
 }
 
+static const struct wp_presentation_feedback_listener bench_feedback_listener;
+
+static void
+bench_inject(struct window *window)
+{
+	struct latency_bench *bench = &window->bench;
+	struct display *display = window->display;
+	uint32_t tv_sec_hi, tv_sec_lo, tv_nsec;
+	int x;
+
+	/* alternate between two points, for every sample to be a motion */
+	if ((bench->done + bench->discarded) % 2)
+		x = window->width / 4;
+	else
+		x = window->width * 3 / 4;
+
+	clock_gettime(display->clk_id, &bench->inject);
+	timespec_to_proto(&bench->inject, &tv_sec_hi, &tv_sec_lo, &tv_nsec);
+	weston_test_move_pointer(display->test, tv_sec_hi, tv_sec_lo, tv_nsec,
+				 x, window->height / 2);
+	bench->pending = true;
+}
+
+/* The injected motion arrived: commit a frame in response to it. */
+static void
+bench_handle_input(struct window *window)
+{
+	struct latency_bench *bench = &window->bench;
+	struct display *display = window->display;
+	struct feedback *feedback;
+
+	if (!bench->pending)
+		return;
+	bench->pending = false;
+
+	feedback = zalloc(sizeof *feedback);
+	assert(feedback);
+
+	clock_gettime(display->clk_id, &feedback->input);
+	feedback->window = window;
+	feedback->frame_no = bench->done + bench->discarded + 1;
+	feedback->inject = bench->inject;
+	feedback->feedback = wp_presentation_feedback(display->presentation,
+						      window->surface);
+	wp_presentation_feedback_add_listener(feedback->feedback,
+					      &bench_feedback_listener,
+					      feedback);
+	wl_list_insert(&window->feedback_list, &feedback->link);
+
+	clock_gettime(display->clk_id, &feedback->commit);
+	window_commit_next(window);
+}
+
+static int
+compare_int32(const void *a, const void *b)
+{
+	int32_t x = *(const int32_t *)a;
+	int32_t y = *(const int32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+bench_print_json(struct window *window)
+{
+	struct latency_bench *bench = &window->bench;
+	int n = bench->done;
+	int i, j;
+
+	printf("{\n");
+	printf("  \"label\": \"%s\",\n", bench->label ? bench->label : "");
+	printf("  \"samples\": %d,\n", n);
+	printf("  \"discarded\": %d,\n", bench->discarded);
+	printf("  \"refresh_nsec\": %d", window->refresh_nsec);
+
+	for (i = 0; i < LATENCY_STAGE_COUNT; i++) {
+		int32_t *v = bench->samples[i];
+		int64_t sum = 0;
+
+		qsort(v, n, sizeof(*v), compare_int32);
+		for (j = 0; j < n; j++)
+			sum += v[j];
+
+		printf(",\n  \"%s\": { \"min\": %d, \"p50\": %d, "
+		       "\"p90\": %d, \"p99\": %d, \"max\": %d, "
+		       "\"mean\": %.1f }", latency_stage_name[i],
+		       v[0], v[(n - 1) * 50 / 100], v[(n - 1) * 90 / 100],
+		       v[(n - 1) * 99 / 100], v[n - 1], (double)sum / n);
+	}
+
+	printf("\n}\n");
+	fflush(stdout);
+}
+
+static void
+bench_next(struct window *window)
+{
+	struct latency_bench *bench = &window->bench;
+
+	if (bench->done < bench->num_samples) {
+		bench_inject(window);
+		return;
+	}
+
+	bench_print_json(window);
+	running = 0;
+}
+
+static void
+bench_feedback_presented(void *data,
+			 struct wp_presentation_feedback *presentation_feedback,
+			 uint32_t tv_sec_hi,
+			 uint32_t tv_sec_lo,
+			 uint32_t tv_nsec,
+			 uint32_t refresh_nsec,
+			 uint32_t seq_hi,
+			 uint32_t seq_lo,
+			 uint32_t flags)
+{
+	struct feedback *feedback = data;
+	struct window *window = feedback->window;
+	struct latency_bench *bench = &window->bench;
+	int i = bench->done;
+
+	timespec_from_proto(&feedback->present, tv_sec_hi, tv_sec_lo, tv_nsec);
+	window->refresh_nsec = refresh_nsec;
+
+	bench->samples[LATENCY_INJECT_TO_INPUT][i] =
+		timespec_diff_to_usec(&feedback->input, &feedback->inject);
+	bench->samples[LATENCY_INPUT_TO_COMMIT][i] =
+		timespec_diff_to_usec(&feedback->commit, &feedback->input);
+	bench->samples[LATENCY_COMMIT_TO_PRESENT][i] =
+		timespec_diff_to_usec(&feedback->present, &feedback->commit);
+	bench->samples[LATENCY_INJECT_TO_PRESENT][i] =
+		timespec_diff_to_usec(&feedback->present, &feedback->inject);
+	bench->done++;
+
+	destroy_feedback(feedback);
+	bench_next(window);
+}
+
+static void
+bench_feedback_discarded(void *data,
+			 struct wp_presentation_feedback *presentation_feedback)
+{
+	struct feedback *feedback = data;
+	struct window *window = feedback->window;
+
+	window->bench.discarded++;
+
+	destroy_feedback(feedback);
+	bench_next(window);
+}
+
+static const struct wp_presentation_feedback_listener bench_feedback_listener = {
+	feedback_sync_output,
+	bench_feedback_presented,
+	bench_feedback_discarded
+};
+
+static void
+bench_init(struct window *window, int num_samples, const char *label)
+{
+	struct latency_bench *bench = &window->bench;
+	int i;
+
+	bench->label = label;
+	bench->num_samples = num_samples;
+	for (i = 0; i < LATENCY_STAGE_COUNT; i++) {
+		bench->samples[i] = calloc(num_samples,
+					   sizeof(*bench->samples[i]));
+		assert(bench->samples[i]);
+	}
+}
+
 static void
 window_prerender(struct window *window)
 {
@@ -705,6 +949,117 @@ window_prerender(struct window *window)
 	}
 }
 
+static void
+pointer_handle_enter(void *data, struct wl_pointer *pointer,
+		     uint32_t serial, struct wl_surface *surface,
+		     wl_fixed_t sx, wl_fixed_t sy)
+{
+	struct seat *seat = data;
+	struct window *window = seat->display->input_window;
+
+	if (window && surface == window->surface)
+		bench_handle_input(window);
+}
+
+static void
+pointer_handle_leave(void *data, struct wl_pointer *pointer,
+		     uint32_t serial, struct wl_surface *surface)
+{
+}
+
+static void
+pointer_handle_motion(void *data, struct wl_pointer *pointer,
+		      uint32_t time, wl_fixed_t sx, wl_fixed_t sy)
+{
+	struct seat *seat = data;
+	struct window *window = seat->display->input_window;
+
+	if (window)
+		bench_handle_input(window);
+}
+
+static void
+pointer_handle_button(void *data, struct wl_pointer *pointer,
+		      uint32_t serial, uint32_t time, uint32_t button,
+		      uint32_t state)
+{
+}
+
+static void
+pointer_handle_axis(void *data, struct wl_pointer *pointer,
+		    uint32_t time, uint32_t axis, wl_fixed_t value)
+{
+}
+
+static const struct wl_pointer_listener pointer_listener = {
+	pointer_handle_enter,
+	pointer_handle_leave,
+	pointer_handle_motion,
+	pointer_handle_button,
+	pointer_handle_axis,
+};
+
+static void
+seat_handle_capabilities(void *data, struct wl_seat *wl_seat,
+			 uint32_t caps)
+{
+	struct seat *seat = data;
+
+	if ((caps & WL_SEAT_CAPABILITY_POINTER) && !seat->pointer) {
+		seat->pointer = wl_seat_get_pointer(wl_seat);
+		wl_pointer_add_listener(seat->pointer, &pointer_listener,
+					seat);
+	} else if (!(caps & WL_SEAT_CAPABILITY_POINTER) && seat->pointer) {
+		wl_pointer_destroy(seat->pointer);
+		seat->pointer = NULL;
+	}
+}
+
+static const struct wl_seat_listener seat_listener = {
+	seat_handle_capabilities,
+};
+
+static void
+display_add_seat(struct display *d, uint32_t name)
+{
+	struct seat *seat;
+
+	seat = zalloc(sizeof(*seat));
+	assert(seat);
+
+	seat->display = d;
+	seat->seat = wl_registry_bind(d->registry, name,
+				      &wl_seat_interface, 1);
+	wl_seat_add_listener(seat->seat, &seat_listener, seat);
+	wl_list_insert(&d->seat_list, &seat->link);
+}
+
+static void
+seat_destroy(struct seat *seat)
+{
+	if (seat->pointer)
+		wl_pointer_destroy(seat->pointer);
+	wl_seat_destroy(seat->seat);
+	wl_list_remove(&seat->link);
+	free(seat);
+}
+
+static void
+test_handle_pointer_position(void *data, struct weston_test *weston_test,
+			     wl_fixed_t x, wl_fixed_t y)
+{
+}
+
+static void
+test_handle_capture_screenshot_done(void *data, struct weston_test *test)
+{
+}
+
+static const struct weston_test_listener test_listener = {
+	test_handle_pointer_position,
+	test_handle_capture_screenshot_done,
+};
+
 static void
 output_destroy(struct output *o)
 {
@@ -772,6 +1127,12 @@ registry_handle_global(void *data, struct wl_registry *registry,
 		wl_shm_add_listener(d->shm, &shm_listener, d);
 	} else if (strcmp(interface, "wl_output") == 0) {
 		display_add_output(d, name, version);
+	} else if (strcmp(interface, "wl_seat") == 0) {
+		display_add_seat(d, name);
+	} else if (strcmp(interface, weston_test_interface.name) == 0) {
+		d->test = wl_registry_bind(registry,
+					   name, &weston_test_interface, 1);
+		weston_test_add_listener(d->test, &test_listener, d);
 	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
 		d->presentation =
 			wl_registry_bind(registry,
@@ -806,7 +1167,7 @@ create_display(void)
 {
 	struct display *display;
 
-	display = malloc(sizeof *display);
+	display = zalloc(sizeof *display);
 	if (display == NULL) {
 		fprintf(stderr, "out of memory\n");
 		exit(1);
@@ -817,6 +1178,7 @@ create_display(void)
 	display->formats = 0;
 	display->clk_id = -1;
 	wl_list_init(&display->output_list);
+	wl_list_init(&display->seat_list);
 	display->registry = wl_display_get_registry(display->display);
 	wl_registry_add_listener(display->registry,
 				 &registry_listener, display);
@@ -848,6 +1210,16 @@ destroy_display(struct display *display)
 		output_destroy(o);
 	}
 
+	while (!wl_list_empty(&display->seat_list)) {
+		struct seat *s;
+
+		s = wl_container_of(display->seat_list.next, s, link);
+		seat_destroy(s);
+	}
+
+	if (display->test)
+		weston_test_destroy(display->test);
+
 	if (display->shm)
 		wl_shm_destroy(display->shm);
 
@@ -863,8 +1235,6 @@ destroy_display(struct display *display)
 	free(display);
 }
 
-static int running = 1;
-
 static void
 signal_int(int signum)
 {
@@ -879,9 +1249,15 @@ usage(const char *prog, int exit_code)
 		"  -f\t\trun in feedback mode (default)\n"
 		"  -i\t\trun in feedback-idle mode; sleep 1s between frames\n"
 		"  -p\t\trun in low-latency presentation mode\n"
+		"  -l samples\tbenchmark the latency from injected input to\n"
+		"\t\tpresentation over the given number of samples and\n"
+		"\t\tprint the distributions as JSON; needs the compositor\n"
+		"\t\tto run with the weston-test.so module\n"
 		"and 'options' may include\n"
 		"  -d msecs\temulate the time used for rendering by a delay \n"
-		"\t\tof the given milliseconds before commit\n\n",
+		"\t\tof the given milliseconds before commit\n"
+		"  -t label\tlabel of the -l run in the JSON, such as the\n"
+		"\t\tbackend and renderer under test\n\n",
 		prog);
 
 	fprintf(stderr, "Printed timing statistics, depending on mode:\n"
@@ -891,7 +1267,13 @@ usage(const char *prog, int exit_code)
 		"  f2p: time from frame callback timestamp to presentation\n"
 		"  p2p: time from previous presentation to this one\n"
 		"  t2p: time from target timestamp to presentation\n"
-		"  seq: MSC\n");
+		"  seq: MSC\n"
+		"and in -l mode, in microseconds:\n"
+		"  inject_to_input: from injecting the motion to the client\n"
+		"\treceiving it\n"
+		"  input_to_commit: from receiving it to committing a frame\n"
+		"  commit_to_present: from commit to presentation\n"
+		"  inject_to_present: from injecting it to presentation\n");
 
 
 	exit(exit_code);
@@ -907,6 +1289,8 @@ main(int argc, char **argv)
 	enum run_mode mode = RUN_MODE_FEEDBACK;
 	int i;
 	int commit_delay_msecs = 0;
+	int num_samples = 0;
+	const char *label = NULL;
 
 	for (i = 1; i < argc; i++) {
 		if (strcmp("-f", argv[i]) == 0)
@@ -915,15 +1299,39 @@ main(int argc, char **argv)
 			mode = RUN_MODE_FEEDBACK_IDLE;
 		else if (strcmp("-p", argv[i]) == 0)
 			mode = RUN_MODE_PRESENT;
+		else if ((strcmp("-l", argv[i]) == 0) && (i + 1 < argc)) {
+			i++;
+			mode = RUN_MODE_INPUT_LATENCY;
+			num_samples = atoi(argv[i]);
+		}
 		else if ((strcmp("-d", argv[i]) == 0) && (i + 1 < argc)) {
 			i++;
 			commit_delay_msecs = atoi(argv[i]);
 		}
+		else if ((strcmp("-t", argv[i]) == 0) && (i + 1 < argc)) {
+			i++;
+			label = argv[i];
+		}
 		else
 			usage(argv[0], EXIT_FAILURE);
 	}
 
+	if (mode == RUN_MODE_INPUT_LATENCY && num_samples <= 0)
+		usage(argv[0], EXIT_FAILURE);
+	if (label && strpbrk(label, "\"\\")) {
+		fprintf(stderr, "label must not contain quotes or "
+			"backslashes\n");
+		return 1;
+	}
+
 	display = create_display();
+	if (mode == RUN_MODE_INPUT_LATENCY &&
+	    (!display->test || !display->presentation)) {
+		fprintf(stderr, "-l needs the weston_test and wp_presentation "
+			"globals\n");
+		return 1;
+	}
+
 	window = create_window(display, 250, 250, mode, commit_delay_msecs);
 	if (!window)
 		return 1;
@@ -936,6 +1344,11 @@ main(int argc, char **argv)
 	window_prerender(window);
 
 	switch (mode) {
+	case RUN_MODE_INPUT_LATENCY:
+		bench_init(window, num_samples, label);
+		window_commit_next(window);
+		bench_inject(window);
+		break;
 	case RUN_MODE_FEEDBACK:
 	case RUN_MODE_FEEDBACK_IDLE:
 		redraw_mode_feedback(window, NULL, 0);
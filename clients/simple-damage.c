@@ -31,11 +31,14 @@
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 
 #include <wayland-client.h>
 #include "shared/os-compatibility.h"
@@ -43,9 +46,41 @@
 #include "xdg-shell-client-protocol.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 #include "viewporter-client-protocol.h"
+#include "weston-debug-client-protocol.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
 
 int print_debug = 0;
 
+/* Durations collected by the benchmark mode, in usec. */
+struct bench_samples {
+	int32_t *v;
+	int len;
+	int alloc;
+};
+
+/* Compositor-side cost of the benchmark, from the 'timeline' debug scope:
+ * how long each repaint cycle spent rendering, and each output repaint
+ * took from begin to posted. Covers every repaint in the run, including
+ * those caused by other clients. */
+struct timeline_stats {
+	struct weston_debug_stream_v1 *stream;
+	int fd; /* read end of the stream pipe, -1 if not subscribed */
+	char buf[4096];
+	size_t len;
+
+	bool in_render;
+	struct timespec render_begin;
+	struct {
+		uint32_t id;
+		bool in_repaint;
+		struct timespec begin;
+	} outputs[8];
+
+	struct bench_samples render;
+	struct bench_samples repaint;
+};
+
 struct display {
 	struct wl_display *display;
 	struct wl_registry *registry;
@@ -56,6 +91,8 @@ struct display {
 	struct zwp_fullscreen_shell_v1 *fshell;
 	struct wl_shm *shm;
 	uint32_t formats;
+	struct weston_debug_v1 *debug;
+	struct timeline_stats timeline;
 };
 
 struct buffer {
@@ -70,6 +107,22 @@ enum window_flags {
 	WINDOW_FLAG_USE_DAMAGE_BUFFER = 0x4,
 };
 
+enum bench_pattern {
+	BENCH_NONE = 0,
+	BENCH_SPARSE, /* a few small rectangles at random positions */
+	BENCH_BANDS, /* a full-width band scrolling down the surface */
+	BENCH_FULL, /* the whole surface, in a single color */
+	BENCH_NOISE, /* the whole surface, in random pixels */
+};
+
+static const char * const bench_pattern_name[] = {
+	[BENCH_NONE] = "none",
+	[BENCH_SPARSE] = "sparse",
+	[BENCH_BANDS] = "bands",
+	[BENCH_FULL] = "full",
+	[BENCH_NOISE] = "noise",
+};
+
 struct window {
 	struct display *display;
 	int width, height, border;
@@ -92,6 +145,14 @@ struct window {
 		int radius; /* radius in pixels */
 		uint32_t prev_time;
 	} ball;
+
+	struct {
+		enum bench_pattern pattern;
+		int frames; /* to run */
+		int frame;
+		struct timespec start;
+		struct timespec end;
+	} bench;
 };
 
 static int running = 1;
@@ -502,6 +563,344 @@ window_get_transformed_ball(struct window *window, float *bx, float *by)
 
 static const struct wl_callback_listener frame_listener;
 
+static void
+bench_samples_add(struct bench_samples *s, int32_t usec)
+{
+	if (s->len == s->alloc) {
+		int alloc = s->alloc ? s->alloc * 2 : 256;
+		int32_t *v = realloc(s->v, alloc * sizeof(*v));
+
+		if (!v)
+			return;
+		s->v = v;
+		s->alloc = alloc;
+	}
+
+	s->v[s->len++] = usec;
+}
+
+static int
+compare_int32(const void *a, const void *b)
+{
+	int32_t x = *(const int32_t *)a;
+	int32_t y = *(const int32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+bench_samples_print(const char *name, struct bench_samples *s)
+{
+	int64_t sum = 0;
+	int n = s->len;
+	int i;
+
+	if (n == 0) {
+		printf(",\n  \"%s\": null", name);
+		return;
+	}
+
+	qsort(s->v, n, sizeof(*s->v), compare_int32);
+	for (i = 0; i < n; i++)
+		sum += s->v[i];
+
+	printf(",\n  \"%s\": { \"count\": %d, \"min\": %d, \"p50\": %d, "
+	       "\"p90\": %d, \"p99\": %d, \"max\": %d, \"mean\": %.1f }",
+	       name, n, s->v[0], s->v[(n - 1) * 50 / 100],
+	       s->v[(n - 1) * 90 / 100], s->v[(n - 1) * 99 / 100], s->v[n - 1],
+	       (double)sum / n);
+}
+
+static void
+timeline_subscribe(struct display *display)
+{
+	struct timeline_stats *tl = &display->timeline;
+	int fds[2];
+
+	tl->fd = -1;
+	if (!display->debug) {
+		fprintf(stderr, "weston_debug_v1 not available (run weston "
+			"with --debug), reporting client-side numbers only\n");
+		return;
+	}
+
+	if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+		fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+		return;
+	}
+
+	tl->stream = weston_debug_v1_subscribe(display->debug, "timeline",
+					       fds[1]);
+	close(fds[1]);
+	tl->fd = fds[0];
+}
+
+static struct timespec *
+timeline_output_begin(struct timeline_stats *tl, uint32_t id, bool create,
+		      bool **in_repaint)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(tl->outputs); i++) {
+		if (tl->outputs[i].id == id && (tl->outputs[i].in_repaint ||
+						create))
+			goto found;
+	}
+
+	if (!create)
+		return NULL;
+
+	for (i = 0; i < ARRAY_LENGTH(tl->outputs); i++) {
+		if (!tl->outputs[i].in_repaint)
+			goto found;
+	}
+
+	return NULL;
+
+found:
+	tl->outputs[i].id = id;
+	*in_repaint = &tl->outputs[i].in_repaint;
+	return &tl->outputs[i].begin;
+}
+
+/* Parses a timeline point, { "T":[sec, nsec], "N":"name", ... }; other
+ * lines describe the objects the points refer to and are skipped. */
+static void
+timeline_parse_line(struct timeline_stats *tl, const char *line)
+{
+	struct timespec ts, *begin;
+	int64_t sec;
+	long nsec;
+	char name[64];
+	const char *wo;
+	uint32_t id = 0;
+	bool *in_repaint;
+
+	if (sscanf(line, "{ \"T\":[%" SCNd64 ", %ld], \"N\":\"%63[^\"]\"",
+		   &sec, &nsec, name) != 3)
+		return;
+
+	ts.tv_sec = sec;
+	ts.tv_nsec = nsec;
+
+	wo = strstr(line, "\"wo\":");
+	if (wo)
+		sscanf(wo, "\"wo\":%" SCNu32, &id);
+
+	if (strcmp(name, "core_repaint_render_begin") == 0) {
+		tl->render_begin = ts;
+		tl->in_render = true;
+	} else if (strcmp(name, "core_repaint_render_end") == 0) {
+		if (tl->in_render)
+			bench_samples_add(&tl->render,
+				timespec_sub_to_nsec(&ts, &tl->render_begin) /
+				1000);
+		tl->in_render = false;
+	} else if (strcmp(name, "core_repaint_begin") == 0) {
+		begin = timeline_output_begin(tl, id, true, &in_repaint);
+		if (begin) {
+			*begin = ts;
+			*in_repaint = true;
+		}
+	} else if (strcmp(name, "core_repaint_posted") == 0) {
+		begin = timeline_output_begin(tl, id, false, &in_repaint);
+		if (begin) {
+			bench_samples_add(&tl->repaint,
+				timespec_sub_to_nsec(&ts, begin) / 1000);
+			*in_repaint = false;
+		}
+	}
+}
+
+static void
+timeline_read(struct timeline_stats *tl)
+{
+	char *line, *eol;
+	ssize_t ret;
+
+	if (tl->fd < 0)
+		return;
+
+	for (;;) {
+		ret = read(tl->fd, tl->buf + tl->len,
+			   sizeof(tl->buf) - 1 - tl->len);
+		if (ret <= 0)
+			break;
+		tl->len += ret;
+		tl->buf[tl->len] = '\0';
+
+		line = tl->buf;
+		while ((eol = strchr(line, '\n'))) {
+			*eol = '\0';
+			timeline_parse_line(tl, line);
+			line = eol + 1;
+		}
+
+		/* a line longer than the buffer is not a point we know */
+		if (line == tl->buf && tl->len == sizeof(tl->buf) - 1)
+			line = tl->buf + tl->len;
+
+		tl->len -= line - tl->buf;
+		memmove(tl->buf, line, tl->len);
+	}
+}
+
+static void
+timeline_unsubscribe(struct display *display)
+{
+	struct timeline_stats *tl = &display->timeline;
+
+	if (tl->fd < 0)
+		return;
+
+	/* points of the last frames may still be in flight */
+	wl_display_roundtrip(display->display);
+	timeline_read(tl);
+
+	weston_debug_stream_v1_destroy(tl->stream);
+	close(tl->fd);
+	tl->fd = -1;
+}
+
+static void
+bench_report(struct window *window)
+{
+	struct timeline_stats *tl = &window->display->timeline;
+	double secs = timespec_sub_to_nsec(&window->bench.end,
+					   &window->bench.start) / 1e9;
+
+	printf("{\n");
+	printf("  \"pattern\": \"%s\",\n",
+	       bench_pattern_name[window->bench.pattern]);
+	printf("  \"width\": %d,\n  \"height\": %d,\n",
+	       window->width, window->height);
+	printf("  \"frames\": %d,\n", window->bench.frame);
+	printf("  \"seconds\": %.3f,\n", secs);
+	printf("  \"fps\": %.1f", secs > 0 ? window->bench.frame / secs : 0);
+	bench_samples_print("render_us", &tl->render);
+	bench_samples_print("repaint_us", &tl->repaint);
+	printf("\n}\n");
+	fflush(stdout);
+
+	free(tl->render.v);
+	free(tl->repaint.v);
+}
+
+static void
+window_get_buffer_size(struct window *window, int *bwidth, int *bheight)
+{
+	switch (window->transform) {
+	default:
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+	case WL_OUTPUT_TRANSFORM_180:
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		*bwidth = window->width * window->scale;
+		*bheight = window->height * window->scale;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+	case WL_OUTPUT_TRANSFORM_270:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		*bwidth = window->height * window->scale;
+		*bheight = window->width * window->scale;
+		break;
+	}
+}
+
+/* Paints this frame's pattern and damages it, in buffer coordinates. */
+static void
+bench_paint(struct window *window, struct buffer *buffer)
+{
+	struct wl_surface *surface = window->surface;
+	uint32_t *pixels = buffer->shm_data;
+	uint32_t color = 0xff000000 | ((window->bench.frame * 0x050301) &
+				       0xffffff);
+	int bwidth, bheight, x, y, w, h, i;
+
+	window_get_buffer_size(window, &bwidth, &bheight);
+
+	switch (window->bench.pattern) {
+	case BENCH_NONE:
+		assert(0 && "not benchmarking");
+		break;
+	case BENCH_SPARSE:
+		w = MIN(16, bwidth);
+		h = MIN(16, bheight);
+		for (i = 0; i < 16; i++) {
+			x = rand() % (bwidth - w + 1);
+			y = rand() % (bheight - h + 1);
+			paint_box(pixels, bwidth, x, y, w, h, color);
+			wl_surface_damage_buffer(surface, x, y, w, h);
+		}
+		break;
+	case BENCH_BANDS:
+		h = MAX(bheight / 8, 1);
+		y = (window->bench.frame * MAX(h / 4, 1)) % (bheight - h + 1);
+		paint_box(pixels, bwidth, 0, y, bwidth, h, color);
+		wl_surface_damage_buffer(surface, 0, y, bwidth, h);
+		break;
+	case BENCH_FULL:
+		paint_box(pixels, bwidth, 0, 0, bwidth, bheight, color);
+		wl_surface_damage_buffer(surface, 0, 0, bwidth, bheight);
+		break;
+	case BENCH_NOISE:
+		for (i = 0; i < bwidth * bheight; i++)
+			pixels[i] = 0xff000000 | (rand() & 0xffffff);
+		wl_surface_damage_buffer(surface, 0, 0, bwidth, bheight);
+		break;
+	}
+}
+
+static void
+bench_redraw(struct window *window, struct wl_callback *callback)
+{
+	struct buffer *buffer;
+
+	timeline_read(&window->display->timeline);
+
+	if (window->bench.frame == 0)
+		clock_gettime(CLOCK_MONOTONIC, &window->bench.start);
+
+	if (callback)
+		wl_callback_destroy(callback);
+	window->callback = NULL;
+
+	if (window->bench.frame == window->bench.frames) {
+		clock_gettime(CLOCK_MONOTONIC, &window->bench.end);
+		running = 0;
+		return;
+	}
+
+	buffer = window_next_buffer(window);
+	if (!buffer) {
+		fprintf(stderr,
+			!callback ? "Failed to create the first buffer.\n" :
+			"Both buffers busy at redraw(). Server bug?\n");
+		abort();
+	}
+
+	bench_paint(window, buffer);
+	wl_surface_attach(window->surface, buffer->buffer, 0, 0);
+
+	if (window->transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		wl_surface_set_buffer_transform(window->surface,
+						window->transform);
+	if (window->viewport)
+		wp_viewport_set_destination(window->viewport,
+					    window->width,
+					    window->height);
+	if (window->scale != 1)
+		wl_surface_set_buffer_scale(window->surface,
+					    window->scale);
+
+	window->callback = wl_surface_frame(window->surface);
+	wl_callback_add_listener(window->callback, &frame_listener, window);
+	wl_surface_commit(window->surface);
+	buffer->busy = 1;
+	window->bench.frame++;
+}
+
 static void
 redraw(void *data, struct wl_callback *callback, uint32_t time)
 {
@@ -511,6 +910,11 @@ redraw(void *data, struct wl_callback *callback, uint32_t time)
 	int bwidth, bheight, bborder, bpitch, bradius;
 	float bx, by;
 
+	if (window->bench.pattern != BENCH_NONE) {
+		bench_redraw(window, callback);
+		return;
+	}
+
 	buffer = window_next_buffer(window);
 	if (!buffer) {
 		fprintf(stderr,
@@ -755,6 +1159,9 @@ registry_handle_global(void *data, struct wl_registry *registry,
 		d->shm = wl_registry_bind(registry,
 					  id, &wl_shm_interface, 1);
 		wl_shm_add_listener(d->shm, &shm_listener, d);
+	} else if (strcmp(interface, weston_debug_v1_interface.name) == 0) {
+		d->debug = wl_registry_bind(registry, id,
+					    &weston_debug_v1_interface, 1);
 	}
 }
 
@@ -774,7 +1181,7 @@ create_display(int version)
 {
 	struct display *display;
 
-	display = malloc(sizeof *display);
+	display = zalloc(sizeof *display);
 	if (display == NULL) {
 		fprintf(stderr, "out of memory\n");
 		exit(1);
@@ -818,6 +1225,9 @@ destroy_display(struct display *display)
 	if (display->viewporter)
 		wp_viewporter_destroy(display->viewporter);
 
+	if (display->debug)
+		weston_debug_v1_destroy(display->debug);
+
 	if (display->compositor)
 		wl_compositor_destroy(display->compositor);
 
@@ -849,6 +1259,13 @@ print_usage(int retval)
 		"  --rotating-transform\tUse a different buffer_transform for each frame\n"
 		"  --use-viewport\tUse wp_viewport\n"
 		"  --use-damage-buffer\tUse damage_buffer to post damage\n"
+		"  --bench=PATTERN\tInstead of the ball, damage the surface in\n"
+		"\t\t\tthe given pattern for --frames frames, then print\n"
+		"\t\t\tthe frame rate and, from the compositor's timeline\n"
+		"\t\t\tdebug scope when weston runs with --debug, the\n"
+		"\t\t\trender and repaint durations as JSON. PATTERN is\n"
+		"\t\t\tone of sparse, bands, full or noise\n"
+		"  --frames=FRAMES\tLength of the --bench run, default 600\n"
 	);
 
 	exit(retval);
@@ -882,6 +1299,21 @@ parse_transform(const char *str, enum wl_output_transform *transform)
 	return 0;
 }
 
+static int
+parse_bench_pattern(const char *str, enum bench_pattern *pattern)
+{
+	unsigned i;
+
+	for (i = BENCH_SPARSE; i < ARRAY_LENGTH(bench_pattern_name); i++) {
+		if (strcmp(bench_pattern_name[i], str) == 0) {
+			*pattern = i;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -893,6 +1325,8 @@ main(int argc, char **argv)
 	int width = 300, height = 200, scale = 1;
 	enum wl_output_transform transform = WL_OUTPUT_TRANSFORM_NORMAL;
 	enum window_flags flags = 0;
+	enum bench_pattern bench = BENCH_NONE;
+	int bench_frames = 600;
 
 	for (i = 1; i < argc; ++i) {
 		if (strcmp(argv[i], "--help") == 0 ||
@@ -926,6 +1360,15 @@ main(int argc, char **argv)
 		} else if (strcmp(argv[i], "--use-damage-buffer") == 0) {
 			flags |= WINDOW_FLAG_USE_DAMAGE_BUFFER;
 			continue;
+		} else if (strncmp(argv[i], "--bench=", 8) == 0 &&
+			   parse_bench_pattern(argv[i] + 8, &bench) > 0) {
+			/* patterns are painted in buffer coordinates */
+			flags |= WINDOW_FLAG_USE_DAMAGE_BUFFER;
+			flags &= ~WINDOW_FLAG_ROTATING_TRANSFORM;
+			continue;
+		} else if (sscanf(argv[i], "--frames=%d", &bench_frames) > 0 &&
+			   bench_frames > 0) {
+			continue;
 		} else {
 			printf("Invalid option: %s\n", argv[i]);
 			print_usage(255);
@@ -938,6 +1381,12 @@ main(int argc, char **argv)
 	if (!window)
 		return 1;
 
+	if (bench != BENCH_NONE) {
+		window->bench.pattern = bench;
+		window->bench.frames = bench_frames;
+		timeline_subscribe(display);
+	}
+
 	sigint.sa_handler = signal_int;
 	sigemptyset(&sigint.sa_mask);
 	sigint.sa_flags = SA_RESETHAND;
@@ -949,6 +1398,11 @@ main(int argc, char **argv)
 	while (running && ret != -1)
 		ret = wl_display_dispatch(display->display);
 
+	if (bench != BENCH_NONE) {
+		timeline_unsubscribe(display);
+		bench_report(window);
+	}
+
 	fprintf(stderr, "simple-shm exiting\n");
 	destroy_window(window);
 	destroy_display(display);
@@ -472,6 +472,7 @@ struct terminal {
 	cairo_font_extents_t extents;
 	double average_width;
 	cairo_scaled_font_t *font_normal, *font_bold;
+	struct glyph_cache *glyphs_normal, *glyphs_bold;
 	uint32_t hide_cursor_serial;
 	int size_in_title;
 
@@ -484,6 +485,18 @@ struct terminal {
 	int selection_end_row, selection_end_col;
 	struct wl_list link;
 	int pace_pipe;
+
+	/* The grid as last drawn, see terminal_update_cache(). cache_data
+	 * and cache_attr hold the characters and decoded attributes each
+	 * row was drawn with, cache_attr has one extra slot per row for
+	 * the outline cursor. */
+	cairo_surface_t *cache;
+	int cache_scale, cache_rows, cache_columns;
+	double cache_row_height, cache_average_width;
+	uint32_t cache_start;
+	union utf8_char *cache_data;
+	uint32_t *cache_attr;
+	uint8_t *cache_dirty;
 };
 
 /* Create default tab stops, every 8 characters */
@@ -1018,105 +1031,85 @@ static void
 glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
 {
 	int num_glyphs;
-	cairo_scaled_font_t *font;
-
-	num_glyphs = ARRAY_LENGTH(run->glyphs) - run->count;
+	struct glyph_cache *cache;
 
 	if (run->attr.attr.a & (ATTRMASK_BOLD | ATTRMASK_BLINK))
-		font = run->terminal->font_bold;
+		cache = run->terminal->glyphs_bold;
 	else
-		font = run->terminal->font_normal;
+		cache = run->terminal->glyphs_normal;
 
 	cairo_move_to(run->cr, x, y);
-	cairo_scaled_font_text_to_glyphs (font, x, y,
-					  (char *) c->byte, 4,
-					  &run->g, &num_glyphs,
-					  NULL, NULL, NULL);
+	num_glyphs = glyph_cache_text_to_glyphs(cache, (char *) c->byte, 4,
+						x, y, run->g,
+						ARRAY_LENGTH(run->glyphs) - run->count);
 	run->g += num_glyphs;
 	run->count += num_glyphs;
 }
 
 
+#define CACHE_ROW_INVALID	UINT32_MAX
+
+/* Draw one row of the grid, cr is translated to the grid origin. Glyphs
+ * of the neighbouring rows are drawn too, clipped to this row, for the
+ * parts of them that overflow into it. */
 static void
-redraw_handler(struct widget *widget, void *data)
+terminal_draw_row(struct terminal *terminal, cairo_t *cr, int row,
+		  double x, double width)
 {
-	struct terminal *terminal = data;
-	struct rectangle allocation;
-	cairo_t *cr;
-	int top_margin, side_margin;
-	int row, col, cursor_x, cursor_y;
+	cairo_font_extents_t extents = terminal->extents;
+	double average_width = terminal->average_width;
+	double unichar_width, d;
 	union utf8_char *p_row;
 	union decoded_attr attr;
-	int text_x, text_y;
-	cairo_surface_t *surface;
-	double d;
 	struct glyph_run run;
-	cairo_font_extents_t extents;
-	double average_width;
-	double unichar_width;
+	int r, col, text_x, text_y;
 
-	surface = window_get_surface(terminal->window);
-	widget_get_allocation(terminal->widget, &allocation);
-	cr = widget_cairo_create(terminal->widget);
-	cairo_rectangle(cr, allocation.x, allocation.y,
-			allocation.width, allocation.height);
+	cairo_save(cr);
+	cairo_rectangle(cr, x, row * extents.height, width, extents.height);
 	cairo_clip(cr);
-	cairo_push_group(cr);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	terminal_set_color(terminal, cr, terminal->color_scheme->border);
 	cairo_paint(cr);
 
-	cairo_set_scaled_font(cr, terminal->font_normal);
-
-	extents = terminal->extents;
-	average_width = terminal->average_width;
-	side_margin = (allocation.width - terminal->width * average_width) / 2;
-	top_margin = (allocation.height - terminal->height * extents.height) / 2;
-
-	cairo_set_line_width(cr, 1.0);
-	cairo_translate(cr, allocation.x + side_margin,
-			allocation.y + top_margin);
 	/* paint the background */
-	for (row = 0; row < terminal->height; row++) {
-		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
-			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
+	p_row = terminal_get_row(terminal, row);
+	for (col = 0; col < terminal->width; col++) {
+		/* get the attributes for this character cell */
+		terminal_decode_attr(terminal, row, col, &attr);
 
-			if (attr.attr.bg == terminal->color_scheme->border)
-				continue;
-
-			if (is_wide(p_row[col]))
-				unichar_width = 2 * average_width;
-			else
-				unichar_width = average_width;
+		if (attr.attr.bg == terminal->color_scheme->border)
+			continue;
 
-			terminal_set_color(terminal, cr, attr.attr.bg);
-			cairo_move_to(cr, col * average_width,
-				      row * extents.height);
-			cairo_rel_line_to(cr, unichar_width, 0);
-			cairo_rel_line_to(cr, 0, extents.height);
-			cairo_rel_line_to(cr, -unichar_width, 0);
-			cairo_close_path(cr);
-			cairo_fill(cr);
-		}
+		if (is_wide(p_row[col]))
+			unichar_width = 2 * average_width;
+		else
+			unichar_width = average_width;
+
+		terminal_set_color(terminal, cr, attr.attr.bg);
+		cairo_move_to(cr, col * average_width,
+			      row * extents.height);
+		cairo_rel_line_to(cr, unichar_width, 0);
+		cairo_rel_line_to(cr, 0, extents.height);
+		cairo_rel_line_to(cr, -unichar_width, 0);
+		cairo_close_path(cr);
+		cairo_fill(cr);
 	}
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
 	/* paint the foreground */
 	glyph_run_init(&run, terminal, cr);
-	for (row = 0; row < terminal->height; row++) {
-		p_row = terminal_get_row(terminal, row);
+	for (r = MAX(row - 1, 0); r <= MIN(row + 1, terminal->height - 1); r++) {
+		p_row = terminal_get_row(terminal, r);
 		for (col = 0; col < terminal->width; col++) {
 			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
+			terminal_decode_attr(terminal, r, col, &attr);
 
 			glyph_run_flush(&run, attr);
 
 			text_x = col * average_width;
-			text_y = extents.ascent + row * extents.height;
+			text_y = extents.ascent + r * extents.height;
 			if (attr.attr.a & ATTRMASK_UNDERLINE) {
 				terminal_set_color(terminal, cr, attr.attr.fg);
 				cairo_move_to(cr, text_x, (double)text_y + 1.5);
@@ -1138,7 +1131,7 @@ redraw_handler(struct widget *widget, void *data)
 	glyph_run_flush(&run, attr);
 
 	if ((terminal->mode & MODE_SHOW_CURSOR) &&
-	    !window_has_focus(terminal->window)) {
+	    !window_has_focus(terminal->window) && terminal->row == row) {
 		d = 0.5;
 
 		cairo_set_line_width(cr, 1);
@@ -1152,16 +1145,261 @@ redraw_handler(struct widget *widget, void *data)
 		cairo_stroke(cr);
 	}
 
-	cairo_pop_group_to_source(cr);
+	cairo_restore(cr);
+}
+
+static void
+terminal_release_cache(struct terminal *terminal)
+{
+	if (terminal->cache)
+		cairo_surface_destroy(terminal->cache);
+	terminal->cache = NULL;
+
+	free(terminal->cache_data);
+	terminal->cache_data = NULL;
+	free(terminal->cache_attr);
+	terminal->cache_attr = NULL;
+	free(terminal->cache_dirty);
+	terminal->cache_dirty = NULL;
+}
+
+/* Move the cached rows along with a scroll of the buffer start, so that
+ * only the rows scrolled in need drawing. Returns true if the cache
+ * contents moved. */
+static bool
+terminal_scroll_cache(struct terminal *terminal, int top_margin)
+{
+	int32_t d = terminal->start - terminal->cache_start;
+	int rows = terminal->height, columns = terminal->width;
+	double row_pixels = terminal->extents.height * terminal->cache_scale;
+	int stride, y, n, i;
+	unsigned char *pixels;
+
+	terminal->cache_start = terminal->start;
+
+	if (d == 0)
+		return false;
+
+	y = top_margin * terminal->cache_scale;
+
+	/* rows that are not whole pixels tall can't be moved exactly */
+	if (abs(d) >= rows || row_pixels != floor(row_pixels) || y < 0 ||
+	    y + rows * row_pixels > cairo_image_surface_get_height(terminal->cache)) {
+		for (i = 0; i < rows; i++)
+			terminal->cache_attr[i * (columns + 1) + columns] =
+				CACHE_ROW_INVALID;
+		return false;
+	}
+
+	cairo_surface_flush(terminal->cache);
+	pixels = cairo_image_surface_get_data(terminal->cache);
+	stride = cairo_image_surface_get_stride(terminal->cache);
+	n = abs(d) * row_pixels;
+
+	if (d > 0) {
+		memmove(pixels + y * stride, pixels + (y + n) * stride,
+			((size_t) rows * row_pixels - n) * stride);
+		memmove(terminal->cache_data,
+			terminal->cache_data + d * columns,
+			(size_t) (rows - d) * columns * sizeof *terminal->cache_data);
+		memmove(terminal->cache_attr,
+			terminal->cache_attr + d * (columns + 1),
+			(size_t) (rows - d) * (columns + 1) * sizeof *terminal->cache_attr);
+		for (i = rows - d; i < rows; i++)
+			terminal->cache_attr[i * (columns + 1) + columns] =
+				CACHE_ROW_INVALID;
+	} else {
+		d = -d;
+		memmove(pixels + (y + n) * stride, pixels + y * stride,
+			((size_t) rows * row_pixels - n) * stride);
+		memmove(terminal->cache_data + d * columns,
+			terminal->cache_data,
+			(size_t) (rows - d) * columns * sizeof *terminal->cache_data);
+		memmove(terminal->cache_attr + d * (columns + 1),
+			terminal->cache_attr,
+			(size_t) (rows - d) * (columns + 1) * sizeof *terminal->cache_attr);
+		for (i = 0; i < d; i++)
+			terminal->cache_attr[i * (columns + 1) + columns] =
+				CACHE_ROW_INVALID;
+	}
+	cairo_surface_mark_dirty(terminal->cache);
+
+	return true;
+}
+
+/* Bring the cached rendering of the grid up to date. Rows are compared
+ * against what they were drawn with and only the changed ones, and their
+ * neighbours for glyph overflow, are drawn again. The changed area is
+ * reported as damage. Returns false if there is no cache to draw from. */
+static bool
+terminal_update_cache(struct terminal *terminal,
+		      struct rectangle *allocation,
+		      int side_margin, int top_margin, int scale)
+{
+	int rows = terminal->height, columns = terminal->width;
+	double row_height = terminal->extents.height;
+	uint32_t *row_attr, cursor;
+	union utf8_char *p_row;
+	union decoded_attr attr;
+	bool full = false, scrolled;
+	int row, col, first, y0, y1;
+	cairo_t *cr;
+
+	if (!terminal->cache ||
+	    cairo_image_surface_get_width(terminal->cache) != allocation->width * scale ||
+	    cairo_image_surface_get_height(terminal->cache) != allocation->height * scale ||
+	    terminal->cache_scale != scale ||
+	    terminal->cache_rows != rows ||
+	    terminal->cache_columns != columns ||
+	    terminal->cache_row_height != row_height ||
+	    terminal->cache_average_width != terminal->average_width) {
+		terminal_release_cache(terminal);
+		terminal->cache =
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+						   allocation->width * scale,
+						   allocation->height * scale);
+		if (cairo_surface_status(terminal->cache) !=
+		    CAIRO_STATUS_SUCCESS) {
+			terminal_release_cache(terminal);
+			return false;
+		}
+		terminal->cache_data =
+			xzalloc(rows * columns * sizeof *terminal->cache_data);
+		terminal->cache_attr =
+			xzalloc(rows * (columns + 1) * sizeof *terminal->cache_attr);
+		terminal->cache_dirty = xzalloc(rows);
+		terminal->cache_scale = scale;
+		terminal->cache_rows = rows;
+		terminal->cache_columns = columns;
+		terminal->cache_row_height = row_height;
+		terminal->cache_average_width = terminal->average_width;
+		terminal->cache_start = terminal->start;
+		for (row = 0; row < rows; row++)
+			terminal->cache_attr[row * (columns + 1) + columns] =
+				CACHE_ROW_INVALID;
+		full = true;
+	}
+
+	scrolled = !full && terminal_scroll_cache(terminal, top_margin);
+
+	for (row = 0; row < rows; row++) {
+		p_row = terminal_get_row(terminal, row);
+		row_attr = terminal->cache_attr + row * (columns + 1);
+
+		cursor = 0;
+		if ((terminal->mode & MODE_SHOW_CURSOR) &&
+		    !window_has_focus(terminal->window) && terminal->row == row)
+			cursor = terminal->column + 1;
+
+		terminal->cache_dirty[row] =
+			row_attr[columns] != cursor ||
+			memcmp(terminal->cache_data + row * columns, p_row,
+			       columns * sizeof *p_row) != 0;
+		row_attr[columns] = cursor;
+
+		for (col = 0; col < columns; col++) {
+			terminal_decode_attr(terminal, row, col, &attr);
+			if (row_attr[col] != attr.key) {
+				row_attr[col] = attr.key;
+				terminal->cache_dirty[row] = 1;
+			}
+		}
+
+		memcpy(terminal->cache_data + row * columns, p_row,
+		       columns * sizeof *p_row);
+	}
+
+	cr = cairo_create(terminal->cache);
+	cairo_scale(cr, scale, scale);
+	if (full) {
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		terminal_set_color(terminal, cr,
+				   terminal->color_scheme->border);
+		cairo_paint(cr);
+	}
+
+	cairo_set_scaled_font(cr, terminal->font_normal);
+	cairo_set_line_width(cr, 1.0);
+	cairo_translate(cr, side_margin, top_margin);
+
+	first = -1;
+	for (row = 0; row <= rows; row++) {
+		if (row < rows &&
+		    (terminal->cache_dirty[row] ||
+		     (row > 0 && terminal->cache_dirty[row - 1]) ||
+		     (row + 1 < rows && terminal->cache_dirty[row + 1]))) {
+			terminal_draw_row(terminal, cr, row, -side_margin,
+					  allocation->width);
+			if (first < 0)
+				first = row;
+			continue;
+		}
+
+		if (first < 0 || full || scrolled)
+			continue;
+
+		y0 = floor(first * row_height);
+		y1 = ceil(row * row_height);
+		widget_add_damage(terminal->widget, allocation->x,
+				  allocation->y + top_margin + y0,
+				  allocation->width, y1 - y0);
+		first = -1;
+	}
+	cairo_destroy(cr);
+
+	if (full)
+		widget_add_damage(terminal->widget, allocation->x,
+				  allocation->y, allocation->width,
+				  allocation->height);
+	else if (scrolled)
+		widget_add_damage(terminal->widget, allocation->x,
+				  allocation->y + top_margin, allocation->width,
+				  ceil(rows * row_height));
+
+	return true;
+}
+
+static void
+redraw_handler(struct widget *widget, void *data)
+{
+	struct terminal *terminal = data;
+	struct rectangle allocation;
+	cairo_t *cr;
+	int top_margin, side_margin;
+	int cursor_x, cursor_y;
+	cairo_surface_t *surface;
+	int scale;
+
+	surface = window_get_surface(terminal->window);
+	widget_get_allocation(terminal->widget, &allocation);
+
+	side_margin = (allocation.width - terminal->width * terminal->average_width) / 2;
+	top_margin = (allocation.height - terminal->height * terminal->extents.height) / 2;
+
+	scale = window_get_buffer_scale(terminal->window);
+	if (!terminal_update_cache(terminal, &allocation,
+				   side_margin, top_margin, scale)) {
+		cairo_surface_destroy(surface);
+		return;
+	}
+
+	cr = widget_cairo_create(terminal->widget);
+	cairo_rectangle(cr, allocation.x, allocation.y,
+			allocation.width, allocation.height);
+	cairo_clip(cr);
+	cairo_scale(cr, 1.0 / scale, 1.0 / scale);
+	cairo_set_source_surface(cr, terminal->cache,
+				 allocation.x * scale, allocation.y * scale);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	cairo_paint(cr);
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
 
 	if (terminal->send_cursor_position) {
 		cursor_x = side_margin + allocation.x +
-				terminal->column * average_width;
+				terminal->column * terminal->average_width;
 		cursor_y = top_margin + allocation.y +
-				terminal->row * extents.height;
+				terminal->row * terminal->extents.height;
 		window_set_text_cursor_position(terminal->window,
 						cursor_x, cursor_y);
 		terminal->send_cursor_position = 0;
@@ -2182,7 +2420,7 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 		} /* if */
 	} /* for */
 
-	window_schedule_redraw(terminal->window);
+	widget_schedule_partial_redraw(terminal->widget);
 }
 
 static void
@@ -2344,7 +2582,7 @@ handle_bound_key(struct terminal *terminal,
 		terminal->row++;
 		terminal->selection_start_row++;
 		terminal->selection_end_row++;
-		widget_schedule_redraw(terminal->widget);
+		widget_schedule_partial_redraw(terminal->widget);
 		return 1;
 
 	case XKB_KEY_Down:
@@ -2359,7 +2597,7 @@ handle_bound_key(struct terminal *terminal,
 		terminal->row--;
 		terminal->selection_start_row--;
 		terminal->selection_end_row--;
-		widget_schedule_redraw(terminal->widget);
+		widget_schedule_partial_redraw(terminal->widget);
 		return 1;
 
 	default:
@@ -2586,7 +2824,7 @@ key_handler(struct window *window, struct input *input, uint32_t time,
 			terminal->selection_end_row -= d;
 			terminal->start = terminal->saved_start;
 			terminal->scrolling = 0;
-			widget_schedule_redraw(terminal->widget);
+			widget_schedule_partial_redraw(terminal->widget);
 		}
 
 		terminal_write(terminal, ch, len);
@@ -2777,7 +3015,7 @@ click_handler(struct widget *widget, struct terminal *terminal,
 	terminal->selection_end_x = terminal->selection_start_x = x;
 	terminal->selection_end_y = terminal->selection_start_y = y;
 	if (recompute_selection(terminal))
-			widget_schedule_redraw(widget);
+			widget_schedule_partial_redraw(widget);
 }
 
 static void
@@ -2826,7 +3064,7 @@ motion_handler(struct widget *widget,
 				   &terminal->selection_end_y);
 
 		if (recompute_selection(terminal))
-			widget_schedule_redraw(widget);
+			widget_schedule_partial_redraw(widget);
 	}
 
 	return CURSOR_IBEAM;
@@ -2877,7 +3115,7 @@ axis_handler(struct widget *widget,
 		terminal->selection_start_row -= lines;
 		terminal->selection_end_row -= lines;
 
-		widget_schedule_redraw(widget);
+		widget_schedule_partial_redraw(widget);
 	}
 }
 
@@ -2924,7 +3162,7 @@ touch_motion_handler(struct widget *widget, struct input *input,
 		terminal->selection_end_y = (int)y;
 
 		if (recompute_selection(terminal))
-			widget_schedule_redraw(widget);
+			widget_schedule_partial_redraw(widget);
 	}
 }
 
@@ -2996,6 +3234,9 @@ terminal_create(struct display *display)
 	terminal->font_normal = cairo_get_scaled_font (cr);
 	cairo_scaled_font_reference(terminal->font_normal);
 
+	terminal->glyphs_bold = glyph_cache_create(terminal->font_bold);
+	terminal->glyphs_normal = glyph_cache_create(terminal->font_normal);
+
 	cairo_font_extents(cr, &terminal->extents);
 
 	/* Compute the average ascii glyph width */
@@ -3028,6 +3269,9 @@ terminal_destroy(struct terminal *terminal)
 	if (wl_list_empty(&terminal_list))
 		display_exit(terminal->display);
 
+	terminal_release_cache(terminal);
+	glyph_cache_destroy(terminal->glyphs_bold);
+	glyph_cache_destroy(terminal->glyphs_normal);
 	free(terminal->title);
 	free(terminal);
 }
@@ -53,6 +53,7 @@
 #endif
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
+#include "shared/weston-egl-ext.h"
 
 #include <cairo-gl.h>
 #elif !defined(ENABLE_EGL) /* platform.h defines these if EGL is enabled */
@@ -71,6 +72,7 @@ typedef void *EGLContext;
 #include <linux/input.h>
 #include <wayland-client.h>
 #include "shared/cairo-util.h"
+#include "shared/hash.h"
 #include "shared/helpers.h"
 #include "shared/xalloc.h"
 #include <libweston/zalloc.h>
@@ -113,6 +115,11 @@ struct display {
 	EGLConfig argb_config;
 	EGLContext argb_ctx;
 	cairo_device_t *argb_device;
+#ifdef HAVE_CAIRO_EGL
+	/* set when both EGL_EXT_buffer_age and swap_buffers_with_damage
+	 * are supported */
+	PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
+#endif
 	uint32_t serial;
 
 	int display_fd;
@@ -173,9 +180,12 @@ struct toysurface {
 	 * Post the surface to the server, returning the server allocation
 	 * rectangle. The Cairo surface from prepare() must be destroyed
 	 * after calling this.
+	 * damage is an array of struct rectangle in surface coordinates,
+	 * or NULL to damage the whole surface.
 	 */
 	void (*swap)(struct toysurface *base,
 		     enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		     const struct wl_array *damage,
 		     struct rectangle *server_allocation);
 
 	/*
@@ -195,6 +205,13 @@ struct toysurface {
 	 * backing storage, and the Wayland protocol objects.
 	 */
 	void (*destroy)(struct toysurface *base);
+
+	/*
+	 * Return the age of the buffer returned by prepare(), as defined
+	 * by EGL_EXT_buffer_age: 1 if it holds the previous frame, 2 for
+	 * the frame before, and 0 if its contents are undefined.
+	 */
+	int (*get_buffer_age)(struct toysurface *base);
 };
 
 struct surface {
@@ -222,6 +239,11 @@ struct surface {
 
 	cairo_surface_t *cairo_surface;
 
+	/* Damage of the next commit. Unless damage_all is set, only the
+	 * rectangles added with widget_add_damage() are posted. */
+	int damage_all;
+	struct wl_array damage;
+
 	struct wl_list link;
 	struct wp_viewport *viewport;
 };
@@ -443,6 +465,7 @@ struct tooltip {
 
 struct shm_pool {
 	struct wl_shm_pool *pool;
+	int fd;
 	size_t size;
 	size_t used;
 	void *data;
@@ -574,14 +597,70 @@ egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 	return cairo_surface_reference(surface->cairo_surface);
 }
 
+static int
+egl_window_surface_acquire(struct toysurface *base, EGLContext ctx);
+
+static void
+egl_window_surface_release(struct toysurface *base);
+
+/* Swap with the damage rectangles converted to buffer coordinates, which
+ * EGL has start at the bottom left corner. Only done for untransformed
+ * buffers, returns false without swapping if the caller should swap the
+ * whole buffer instead. */
+static bool
+egl_window_surface_swap_damage(struct egl_window_surface *surface,
+			       enum wl_output_transform buffer_transform,
+			       int32_t buffer_scale,
+			       const struct wl_array *damage)
+{
+	struct display *display = surface->display;
+	const struct rectangle *rect;
+	EGLint *rects, *r;
+	int height;
+
+	if (!damage || !display->swap_buffers_with_damage ||
+	    buffer_transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    damage->size == 0)
+		return false;
+
+	rects = malloc(damage->size / sizeof *rect * 4 * sizeof *rects);
+	if (!rects)
+		return false;
+
+	height = cairo_gl_surface_get_height(surface->cairo_surface);
+	r = rects;
+	wl_array_for_each(rect, damage) {
+		r[0] = rect->x * buffer_scale;
+		r[1] = height - (rect->y + rect->height) * buffer_scale;
+		r[2] = rect->width * buffer_scale;
+		r[3] = rect->height * buffer_scale;
+		r += 4;
+	}
+
+	cairo_surface_flush(surface->cairo_surface);
+	egl_window_surface_acquire(&surface->base, NULL);
+	if (!display->swap_buffers_with_damage(display->dpy,
+					       surface->egl_surface, rects,
+					       (r - rects) / 4))
+		fprintf(stderr, "failed to swap buffers with damage\n");
+	egl_window_surface_release(&surface->base);
+
+	free(rects);
+
+	return true;
+}
+
 static void
 egl_window_surface_swap(struct toysurface *base,
 			enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			const struct wl_array *damage,
 			struct rectangle *server_allocation)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
 
-	cairo_gl_surface_swapbuffers(surface->cairo_surface);
+	if (!egl_window_surface_swap_damage(surface, buffer_transform,
+					    buffer_scale, damage))
+		cairo_gl_surface_swapbuffers(surface->cairo_surface);
 	wl_egl_window_get_attached_size(surface->egl_window,
 					&server_allocation->width,
 					&server_allocation->height);
@@ -634,6 +713,25 @@ egl_window_surface_release(struct toysurface *base)
 	cairo_device_release(device);
 }
 
+static int
+egl_window_surface_get_buffer_age(struct toysurface *base)
+{
+	struct egl_window_surface *surface = to_egl_window_surface(base);
+	EGLint buffer_age = 0;
+
+	if (!surface->display->swap_buffers_with_damage)
+		return 0;
+
+	/* the surface has to be current for the query */
+	egl_window_surface_acquire(base, NULL);
+	if (!eglQuerySurface(surface->display->dpy, surface->egl_surface,
+			     EGL_BUFFER_AGE_EXT, &buffer_age))
+		buffer_age = 0;
+	egl_window_surface_release(base);
+
+	return buffer_age;
+}
+
 static void
 egl_window_surface_destroy(struct toysurface *base)
 {
@@ -668,6 +766,7 @@ egl_window_surface_create(struct display *display,
 	surface->base.acquire = egl_window_surface_acquire;
 	surface->base.release = egl_window_surface_release;
 	surface->base.destroy = egl_window_surface_destroy;
+	surface->base.get_buffer_age = egl_window_surface_get_buffer_age;
 
 	surface->display = display;
 	surface->surface = wl_surface;
@@ -734,51 +833,75 @@ shm_surface_data_destroy(void *p)
 	free(data);
 }
 
-static struct wl_shm_pool *
-make_shm_pool(struct display *display, int size, void **data)
+static struct shm_pool *
+shm_pool_create(struct display *display, size_t size)
 {
-	struct wl_shm_pool *pool;
-	int fd;
+	struct shm_pool *pool = malloc(sizeof *pool);
+
+	if (!pool)
+		return NULL;
 
-	fd = os_create_anonymous_file(size);
-	if (fd < 0) {
-		fprintf(stderr, "creating a buffer file for %d B failed: %s\n",
+	/* The fd stays open for shm_pool_resize() */
+	pool->fd = os_create_anonymous_file(size);
+	if (pool->fd < 0) {
+		fprintf(stderr, "creating a buffer file for %zu B failed: %s\n",
 			size, strerror(errno));
+		free(pool);
 		return NULL;
 	}
 
-	*data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (*data == MAP_FAILED) {
+	pool->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  pool->fd, 0);
+	if (pool->data == MAP_FAILED) {
 		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
-		close(fd);
+		close(pool->fd);
+		free(pool);
 		return NULL;
 	}
 
-	pool = wl_shm_create_pool(display->shm, fd, size);
-
-	close(fd);
+	pool->pool = wl_shm_create_pool(display->shm, pool->fd, size);
+	pool->size = size;
+	pool->used = 0;
 
 	return pool;
 }
 
-static struct shm_pool *
-shm_pool_create(struct display *display, size_t size)
+/* Grow the pool to hold at least 'size' bytes, keeping the same
+ * wl_shm_pool. The pool at least doubles, so a window being resized
+ * only reallocates a handful of times. Nothing allocated from the pool
+ * may be in use, as the mapping moves; reset the pool first. */
+static int
+shm_pool_resize(struct shm_pool *pool, size_t size)
 {
-	struct shm_pool *pool = malloc(sizeof *pool);
+	void *data;
 
-	if (!pool)
-		return NULL;
+	assert(pool->used == 0);
 
-	pool->pool = make_shm_pool(display, size, &pool->data);
-	if (!pool->pool) {
-		free(pool);
-		return NULL;
+	if (size <= pool->size)
+		return 0;
+
+	if (size < pool->size * 2)
+		size = pool->size * 2;
+
+	if (os_resize_anonymous_file(pool->fd, size) < 0) {
+		fprintf(stderr, "growing a buffer file to %zu B failed: %s\n",
+			size, strerror(errno));
+		return -1;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    pool->fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+		return -1;
 	}
 
+	munmap(pool->data, pool->size);
+	wl_shm_pool_resize(pool->pool, size);
+	pool->data = data;
 	pool->size = size;
-	pool->used = 0;
 
-	return pool;
+	return 0;
 }
 
 static void *
@@ -799,6 +922,7 @@ shm_pool_destroy(struct shm_pool *pool)
 {
 	munmap(pool->data, pool->size);
 	wl_shm_pool_destroy(pool->pool);
+	close(pool->fd);
 	free(pool);
 }
 
@@ -944,8 +1068,11 @@ struct shm_surface_leaf {
 	/* 'data' is automatically destroyed, when 'cairo_surface' is */
 	struct shm_surface_data *data;
 
-	struct shm_pool *resize_pool;
+	/* Owned by the leaf and reused across sizes, see
+	 * shm_surface_prepare() */
+	struct shm_pool *pool;
 	int busy;
+	uint32_t frame; /* frame count at the last swap, 0 if never shown */
 };
 
 static void
@@ -955,8 +1082,8 @@ shm_surface_leaf_release(struct shm_surface_leaf *leaf)
 		cairo_surface_destroy(leaf->cairo_surface);
 	/* leaf->data already destroyed via cairo private */
 
-	if (leaf->resize_pool)
-		shm_pool_destroy(leaf->resize_pool);
+	if (leaf->pool)
+		shm_pool_destroy(leaf->pool);
 
 	memset(leaf, 0, sizeof *leaf);
 }
@@ -972,6 +1099,7 @@ struct shm_surface {
 
 	struct shm_surface_leaf leaf[MAX_LEAVES];
 	struct shm_surface_leaf *current;
+	uint32_t frame_count;
 };
 
 static struct shm_surface *
@@ -1053,6 +1181,8 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 	struct shm_surface *surface = to_shm_surface(base);
 	struct rectangle rect = { 0};
 	struct shm_surface_leaf *leaf = NULL;
+	size_t pool_size;
+	int length;
 	int i;
 
 	surface->dx = dx;
@@ -1076,15 +1206,24 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		return NULL;
 	}
 
-	if (!resize_hint && leaf->resize_pool) {
-		cairo_surface_destroy(leaf->cairo_surface);
+	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
+
+	rect.width = width;
+	rect.height = height;
+	length = data_length_for_shm_surface(&rect);
+
+	/* Once resizing is over, give back a pool that grew well past
+	 * what the final size needs. The file is sealed against
+	 * shrinking, so this means starting over with a new pool. */
+	if (!resize_hint && leaf->pool &&
+	    leaf->pool->size / 2 > (size_t) length) {
+		if (leaf->cairo_surface)
+			cairo_surface_destroy(leaf->cairo_surface);
 		leaf->cairo_surface = NULL;
-		shm_pool_destroy(leaf->resize_pool);
-		leaf->resize_pool = NULL;
+		shm_pool_destroy(leaf->pool);
+		leaf->pool = NULL;
 	}
 
-	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
-
 	if (leaf->cairo_surface &&
 	    cairo_image_surface_get_width(leaf->cairo_surface) == width &&
 	    cairo_image_surface_get_height(leaf->cairo_surface) == height)
@@ -1092,27 +1231,36 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 
 	if (leaf->cairo_surface)
 		cairo_surface_destroy(leaf->cairo_surface);
+	leaf->cairo_surface = NULL;
+
+	/* Mmapping a new pool in the server is relatively expensive, so
+	 * the leaf keeps its pool and grows it in place with
+	 * wl_shm_pool_resize when the window gets bigger. */
+	if (leaf->pool) {
+		shm_pool_reset(leaf->pool);
+		if (shm_pool_resize(leaf->pool, length) < 0) {
+			shm_pool_destroy(leaf->pool);
+			leaf->pool = NULL;
+		}
+	}
 
+	if (!leaf->pool) {
+		pool_size = length;
 #ifdef USE_RESIZE_POOL
-	if (resize_hint && !leaf->resize_pool) {
-		/* Create a big pool to allocate from, while continuously
-		 * resizing. Mmapping a new pool in the server
-		 * is relatively expensive, so reusing a pool performs
-		 * better, but may temporarily reserve unneeded memory.
-		 */
-		/* We should probably base this number on the output size. */
-		leaf->resize_pool = shm_pool_create(surface->display,
-						    6 * 1024 * 1024);
-	}
+		/* Start big while continuously resizing, at the cost of
+		 * temporarily reserving unneeded memory. We should
+		 * probably base this number on the output size. */
+		if (resize_hint && pool_size < 6 * 1024 * 1024)
+			pool_size = 6 * 1024 * 1024;
 #endif
+		leaf->pool = shm_pool_create(surface->display, pool_size);
+	}
 
-	rect.width = width;
-	rect.height = height;
-
+	leaf->frame = 0;
 	leaf->cairo_surface =
 		display_create_shm_surface(surface->display, &rect,
 					   surface->flags,
-					   leaf->resize_pool,
+					   leaf->pool,
 					   &leaf->data);
 	if (!leaf->cairo_surface)
 		return NULL;
@@ -1129,10 +1277,12 @@ out:
 static void
 shm_surface_swap(struct toysurface *base,
 		 enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		 const struct wl_array *damage,
 		 struct rectangle *server_allocation)
 {
 	struct shm_surface *surface = to_shm_surface(base);
 	struct shm_surface_leaf *leaf = surface->current;
+	const struct rectangle *rect;
 
 	server_allocation->width =
 		cairo_image_surface_get_width(leaf->cairo_surface);
@@ -1145,17 +1295,39 @@ shm_surface_swap(struct toysurface *base,
 
 	wl_surface_attach(surface->surface, leaf->data->buffer,
 			  surface->dx, surface->dy);
-	wl_surface_damage(surface->surface, 0, 0,
-			  server_allocation->width, server_allocation->height);
+	if (damage) {
+		/* wl_surface_damage_buffer needs wl_compositor version 4,
+		 * we bind version 3 */
+		wl_array_for_each(rect, damage)
+			wl_surface_damage(surface->surface, rect->x, rect->y,
+					  rect->width, rect->height);
+	} else {
+		wl_surface_damage(surface->surface, 0, 0,
+				  server_allocation->width,
+				  server_allocation->height);
+	}
 	wl_surface_commit(surface->surface);
 
 	DBG_OBJ(surface->surface, "leaf %d busy\n",
 		(int)(leaf - &surface->leaf[0]));
 
 	leaf->busy = 1;
+	leaf->frame = ++surface->frame_count;
 	surface->current = NULL;
 }
 
+static int
+shm_surface_get_buffer_age(struct toysurface *base)
+{
+	struct shm_surface *surface = to_shm_surface(base);
+	struct shm_surface_leaf *leaf = surface->current;
+
+	if (!leaf || leaf->frame == 0)
+		return 0;
+
+	return surface->frame_count - leaf->frame + 1;
+}
+
 static int
 shm_surface_acquire(struct toysurface *base, EGLContext ctx)
 {
@@ -1192,6 +1364,7 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 	surface->base.acquire = shm_surface_acquire;
 	surface->base.release = shm_surface_release;
 	surface->base.destroy = shm_surface_destroy;
+	surface->base.get_buffer_age = shm_surface_get_buffer_age;
 
 	surface->display = display;
 	surface->surface = wl_surface;
@@ -1416,8 +1589,12 @@ surface_flush(struct surface *surface)
 
 	surface->toysurface->swap(surface->toysurface,
 				  surface->buffer_transform, surface->buffer_scale,
+				  surface->damage_all ? NULL : &surface->damage,
 				  &surface->server_allocation);
 
+	surface->damage_all = 0;
+	surface->damage.size = 0;
+
 	cairo_surface_destroy(surface->cairo_surface);
 	surface->cairo_surface = NULL;
 }
@@ -1549,6 +1726,7 @@ surface_destroy(struct surface *surface)
 	if (surface->toysurface)
 		surface->toysurface->destroy(surface->toysurface);
 
+	wl_array_release(&surface->damage);
 	wl_list_remove(&surface->link);
 	free(surface);
 }
@@ -2029,9 +2207,64 @@ widget_schedule_redraw(struct widget *widget)
 {
 	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
 	widget->surface->redraw_needed = 1;
+	widget->surface->damage_all = 1;
 	window_schedule_redraw_task(widget->window);
 }
 
+/*
+ * Like widget_schedule_redraw(), but the redraw handler reports what it
+ * changed with widget_add_damage() instead of the whole surface being
+ * damaged. Redraws requested any other way still damage everything.
+ */
+void
+widget_schedule_partial_redraw(struct widget *widget)
+{
+	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
+	widget->surface->redraw_needed = 1;
+	window_schedule_redraw_task(widget->window);
+}
+
+/*
+ * Age of the buffer being drawn, see EGL_EXT_buffer_age. A redraw handler
+ * that added damage in the frames before can repaint only the union of
+ * that damage when the age is not 0, all other widgets of the surface
+ * still have to draw everything.
+ */
+int
+widget_get_buffer_age(struct widget *widget)
+{
+	struct surface *surface = widget->surface;
+
+	if (!surface->toysurface || !surface->cairo_surface)
+		return 0;
+
+	return surface->toysurface->get_buffer_age(surface->toysurface);
+}
+
+/* Add a rectangle, in surface coordinates, to the damage of the commit
+ * being drawn. Meant to be called from a redraw handler. */
+void
+widget_add_damage(struct widget *widget,
+		  int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct surface *surface = widget->surface;
+	struct rectangle *rect;
+
+	if (surface->damage_all)
+		return;
+
+	rect = wl_array_add(&surface->damage, sizeof *rect);
+	if (!rect) {
+		surface->damage_all = 1;
+		return;
+	}
+
+	rect->x = x;
+	rect->y = y;
+	rect->width = width;
+	rect->height = height;
+}
+
 void
 widget_set_use_cairo(struct widget *widget,
 		     int use_cairo)
@@ -4573,6 +4806,8 @@ surface_redraw(struct surface *surface)
 	DBG_OBJ(surface->frame_cb, "new\n");
 
 	surface->redraw_needed = 0;
+	if (surface->window->redraw_needed)
+		surface->damage_all = 1;
 	DBG_OBJ(surface->surface, "-> widget_redraw\n");
 	widget_redraw(surface->widget);
 	DBG_OBJ(surface->surface, "done\n");
@@ -4651,8 +4886,10 @@ window_schedule_redraw(struct window *window)
 
 	DBG_OBJ(window->main_surface->surface, "window %p\n", window);
 
-	wl_list_for_each(surface, &window->subsurface_list, link)
+	wl_list_for_each(surface, &window->subsurface_list, link) {
 		surface->redraw_needed = 1;
+		surface->damage_all = 1;
+	}
 
 	window_schedule_redraw_task(window);
 }
@@ -5215,6 +5452,8 @@ surface_create(struct window *window)
 	surface->window = window;
 	surface->surface = wl_compositor_create_surface(display->compositor);
 	surface->buffer_scale = 1;
+	surface->damage_all = 1;
+	wl_array_init(&surface->damage);
 	wl_surface_add_listener(surface->surface, &surface_listener, window);
 
 	wl_list_insert(&window->subsurface_list, &surface->link);
@@ -6088,8 +6327,22 @@ static const struct wl_registry_listener registry_listener = {
 static int
 init_egl(struct display *d)
 {
+	static const struct {
+		char *extension, *entrypoint;
+	} swap_damage_ext_to_entrypoint[] = {
+		{
+			.extension = "EGL_EXT_swap_buffers_with_damage",
+			.entrypoint = "eglSwapBuffersWithDamageEXT",
+		},
+		{
+			.extension = "EGL_KHR_swap_buffers_with_damage",
+			.entrypoint = "eglSwapBuffersWithDamageKHR",
+		},
+	};
+	const char *extensions;
 	EGLint major, minor;
 	EGLint n;
+	unsigned int i;
 
 #ifdef USE_CAIRO_GLESV2
 #  define GL_BIT EGL_OPENGL_ES2_BIT
@@ -6152,6 +6405,22 @@ init_egl(struct display *d)
 		return -1;
 	}
 
+	d->swap_buffers_with_damage = NULL;
+	extensions = eglQueryString(d->dpy, EGL_EXTENSIONS);
+	if (extensions &&
+	    weston_check_egl_extension(extensions, "EGL_EXT_buffer_age")) {
+		for (i = 0; i < ARRAY_LENGTH(swap_damage_ext_to_entrypoint); i++) {
+			if (weston_check_egl_extension(extensions,
+						       swap_damage_ext_to_entrypoint[i].extension)) {
+				/* The EXTPROC is identical to the KHR one */
+				d->swap_buffers_with_damage =
+					(PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC)
+					eglGetProcAddress(swap_damage_ext_to_entrypoint[i].entrypoint);
+				break;
+			}
+		}
+	}
+
 	return 0;
 }
 
@@ -6671,3 +6940,110 @@ toytimer_disarm(struct toytimer *tt)
 
 	toytimer_arm(tt, &its);
 }
+
+/* Characters whose text maps to more glyphs than this are not cached. */
+#define GLYPH_CACHE_MAX_GLYPHS 4
+
+struct glyph_cache_entry {
+	int num_glyphs;
+	cairo_glyph_t glyphs[GLYPH_CACHE_MAX_GLYPHS];
+};
+
+struct glyph_cache {
+	cairo_scaled_font_t *font;
+	struct hash_table *table;
+};
+
+/*
+ * A glyph cache remembers what the UTF-8 text of a single character,
+ * passed as 4 NUL padded bytes, maps to in a scaled font, so that text
+ * drawn over and over does not go through
+ * cairo_scaled_font_text_to_glyphs() again. Other lengths are converted
+ * without caching.
+ * Rasterized glyphs are already cached by cairo per scaled font, the
+ * lookup of the glyphs is what is left per frame.
+ */
+struct glyph_cache *
+glyph_cache_create(cairo_scaled_font_t *font)
+{
+	struct glyph_cache *cache;
+
+	cache = xzalloc(sizeof *cache);
+	cache->table = hash_table_create();
+	if (!cache->table) {
+		fprintf(stderr, "%s: out of memory\n",
+			program_invocation_short_name);
+		abort();
+	}
+	cache->font = cairo_scaled_font_reference(font);
+
+	return cache;
+}
+
+static void
+glyph_cache_entry_free(void *element, void *data)
+{
+	free(element);
+}
+
+void
+glyph_cache_destroy(struct glyph_cache *cache)
+{
+	hash_table_for_each(cache->table, glyph_cache_entry_free, NULL);
+	hash_table_destroy(cache->table);
+	cairo_scaled_font_destroy(cache->font);
+	free(cache);
+}
+
+/*
+ * Convert the text of one character to glyphs positioned at x, y, like
+ * cairo_scaled_font_text_to_glyphs(). Writes at most max_glyphs glyphs
+ * and returns how many were written.
+ */
+int
+glyph_cache_text_to_glyphs(struct glyph_cache *cache,
+			   const char *utf8, int len, double x, double y,
+			   cairo_glyph_t *glyphs, int max_glyphs)
+{
+	struct glyph_cache_entry *entry = NULL;
+	cairo_glyph_t *g = NULL;
+	uint32_t key = 0;
+	int i, num_glyphs = 0;
+
+	if (len == sizeof key) {
+		memcpy(&key, utf8, len);
+		entry = hash_table_lookup(cache->table, key);
+	}
+
+	if (!entry) {
+		if (cairo_scaled_font_text_to_glyphs(cache->font, 0, 0,
+						     utf8, len,
+						     &g, &num_glyphs,
+						     NULL, NULL, NULL) !=
+		    CAIRO_STATUS_SUCCESS)
+			return 0;
+
+		if (len == sizeof key &&
+		    num_glyphs <= GLYPH_CACHE_MAX_GLYPHS) {
+			entry = xzalloc(sizeof *entry);
+			entry->num_glyphs = num_glyphs;
+			memcpy(entry->glyphs, g, num_glyphs * sizeof *g);
+			hash_table_insert(cache->table, key, entry);
+		}
+	} else {
+		g = entry->glyphs;
+		num_glyphs = entry->num_glyphs;
+	}
+
+	num_glyphs = MIN(num_glyphs, max_glyphs);
+	for (i = 0; i < num_glyphs; i++) {
+		glyphs[i].index = g[i].index;
+		glyphs[i].x = g[i].x + x;
+		glyphs[i].y = g[i].y + y;
+	}
+
+	if (!entry || g != entry->glyphs)
+		cairo_glyph_free(g);
+
+	return num_glyphs;
+}
@@ -600,6 +600,13 @@ window_uninhibit_redraw(struct window *window);
 void
 widget_schedule_redraw(struct widget *widget);
 void
+widget_schedule_partial_redraw(struct widget *widget);
+int
+widget_get_buffer_age(struct widget *widget);
+void
+widget_add_damage(struct widget *widget,
+		  int32_t x, int32_t y, int32_t width, int32_t height);
+void
 widget_set_use_cairo(struct widget *widget, int use_cairo);
 
 /*
@@ -741,4 +748,17 @@ toytimer_arm_once_usec(struct toytimer *tt, uint32_t usec);
 void
 toytimer_disarm(struct toytimer *tt);
 
+struct glyph_cache;
+
+struct glyph_cache *
+glyph_cache_create(cairo_scaled_font_t *font);
+
+void
+glyph_cache_destroy(struct glyph_cache *cache);
+
+int
+glyph_cache_text_to_glyphs(struct glyph_cache *cache,
+			   const char *utf8, int len, double x, double y,
+			   cairo_glyph_t *glyphs, int max_glyphs);
+
 #endif
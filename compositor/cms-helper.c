@@ -37,6 +37,136 @@
 #include <libweston/libweston.h>
 #include "cms-helper.h"
 
+/* A 3D LUT baked from a pair of profiles, shared by the outputs using the
+ * same pair. Keyed by file name, NULL standing for sRGB. */
+struct weston_cms_lut {
+	struct wl_list link; /* lut_cache */
+	char *source;
+	char *output;
+	int refcount;
+	uint16_t data[];
+};
+
+static struct wl_list lut_cache = { &lut_cache, &lut_cache };
+
+static bool
+lut_key_equal(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+
+	return strcmp(a, b) == 0;
+}
+
+#ifdef HAVE_LCMS
+static struct weston_cms_lut *
+weston_cms_lut_bake(struct weston_color_profile *source,
+		    struct weston_color_profile *output)
+{
+	const unsigned int n = WESTON_CMS_LUT_SIZE;
+	struct weston_cms_lut *lut;
+	cmsHPROFILE src_profile;
+	cmsHTRANSFORM xform;
+	uint16_t in[WESTON_CMS_LUT_SIZE * 3];
+	unsigned int r, g, b;
+	uint16_t *row;
+
+	if (cmsGetColorSpace(output->lcms_handle) != cmsSigRgbData)
+		return NULL;
+
+	if (source)
+		src_profile = source->lcms_handle;
+	else
+		src_profile = cmsCreate_sRGBProfile();
+	if (!src_profile)
+		return NULL;
+
+	xform = cmsCreateTransform(src_profile, TYPE_RGB_16,
+				   output->lcms_handle, TYPE_RGB_16,
+				   INTENT_RELATIVE_COLORIMETRIC,
+				   cmsFLAGS_BLACKPOINTCOMPENSATION);
+	if (!source)
+		cmsCloseProfile(src_profile);
+	if (!xform)
+		return NULL;
+
+	lut = zalloc(sizeof *lut + n * n * n * 3 * sizeof lut->data[0]);
+	if (!lut) {
+		cmsDeleteTransform(xform);
+		return NULL;
+	}
+
+	/* red varies fastest, a row of it per transform call */
+	row = lut->data;
+	for (b = 0; b < n; b++) {
+		for (g = 0; g < n; g++) {
+			for (r = 0; r < n; r++) {
+				in[r * 3 + 0] = 0xffff * r / (n - 1);
+				in[r * 3 + 1] = 0xffff * g / (n - 1);
+				in[r * 3 + 2] = 0xffff * b / (n - 1);
+			}
+			cmsDoTransform(xform, in, row, n);
+			row += n * 3;
+		}
+	}
+	cmsDeleteTransform(xform);
+
+	return lut;
+}
+#endif
+
+/** Get the 3D LUT converting colors from one profile to another
+ *
+ * \param source The profile of the content, NULL for sRGB.
+ * \param output The profile of the output.
+ * \return A reference to the LUT, or NULL if it can't be made.
+ *
+ * LUTs are cached by file names, so outputs with the same profile share a
+ * LUT which is baked only once.
+ */
+struct weston_cms_lut *
+weston_cms_lut_get(struct weston_color_profile *source,
+		   struct weston_color_profile *output)
+{
+	const char *source_name = source ? source->filename : NULL;
+	struct weston_cms_lut *lut = NULL;
+
+	wl_list_for_each(lut, &lut_cache, link) {
+		if (lut_key_equal(lut->source, source_name) &&
+		    lut_key_equal(lut->output, output->filename)) {
+			lut->refcount++;
+			return lut;
+		}
+	}
+
+#ifdef HAVE_LCMS
+	lut = weston_cms_lut_bake(source, output);
+#else
+	lut = NULL;
+#endif
+	if (!lut)
+		return NULL;
+
+	lut->source = source_name ? strdup(source_name) : NULL;
+	lut->output = output->filename ? strdup(output->filename) : NULL;
+	lut->refcount = 1;
+	wl_list_insert(&lut_cache, &lut->link);
+
+	return lut;
+}
+
+void
+weston_cms_lut_unref(struct weston_cms_lut *lut)
+{
+	if (!lut || --lut->refcount > 0)
+		return;
+
+	wl_list_remove(&lut->link);
+	free(lut->source);
+	free(lut->output);
+	free(lut);
+}
+
 #ifdef HAVE_LCMS
 static void
 weston_cms_gamma_clear(struct weston_output *o)
@@ -68,14 +198,27 @@ weston_cms_set_color_profile(struct weston_output *o,
 	uint16_t *green = NULL;
 	uint16_t *blue = NULL;
 
-	if (!o->set_gamma)
-		return;
 	if (!p) {
+		weston_output_set_color_lut(o, NULL, 0);
 		weston_cms_gamma_clear(o);
 		return;
 	}
 
 	weston_log("Using ICC profile %s\n", p->filename);
+
+	/* Content is converted by the renderer, calibration is left to
+	 * the gamma ramps. */
+	if (!p->lut)
+		p->lut = weston_cms_lut_get(NULL, p);
+	if (!p->lut ||
+	    weston_output_set_color_lut(o, p->lut->data,
+					WESTON_CMS_LUT_SIZE) < 0)
+		weston_log("ICC profile %s: colors are not converted on %s\n",
+			   p->filename, o->name);
+
+	if (!o->set_gamma)
+		return;
+
 	vcgt = cmsReadTag (p->lcms_handle, cmsSigVcgtTag);
 	if (vcgt == NULL || vcgt[0] == NULL) {
 		weston_cms_gamma_clear(o);
@@ -104,6 +247,7 @@ weston_cms_destroy_profile(struct weston_color_profile *p)
 {
 	if (!p)
 		return;
+	weston_cms_lut_unref(p->lut);
 #ifdef HAVE_LCMS
 	cmsCloseProfile(p->lcms_handle);
 #endif
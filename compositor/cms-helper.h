@@ -56,9 +56,15 @@
  * The CMF can be selected using the 'modules' key in the [core] section.
  */
 
+/* Grid points on each axis of the 3D LUTs given to the renderer */
+#define WESTON_CMS_LUT_SIZE 33
+
+struct weston_cms_lut;
+
 struct weston_color_profile {
 	char	*filename;
 	void	*lcms_handle;
+	struct weston_cms_lut *lut; /* from sRGB, baked on first use */
 };
 
 void
@@ -71,5 +77,10 @@ struct weston_color_profile *
 weston_cms_load_profile(const char *filename);
 void
 weston_cms_destroy_profile(struct weston_color_profile *p);
+struct weston_cms_lut *
+weston_cms_lut_get(struct weston_color_profile *source,
+		   struct weston_color_profile *output);
+void
+weston_cms_lut_unref(struct weston_cms_lut *lut);
 
 #endif
@@ -51,6 +51,7 @@
 #include "shared/os-compatibility.h"
 #include "shared/helpers.h"
 #include "shared/string-helpers.h"
+#include "shared/timespec-util.h"
 #include "git-version.h"
 #include <libweston/version.h>
 #include "weston.h"
@@ -72,6 +73,7 @@
 #define WINDOW_TITLE "Weston Compositor"
 /* flight recorder size (in bytes) */
 #define DEFAULT_FLIGHT_REC_SIZE (5 * 1024 * 1024)
+#define DEFAULT_LOG_BUFFER_KIB 256
 
 struct wet_output_config {
 	int width;
@@ -126,6 +128,16 @@ struct wet_compositor {
 	bool init_failed;
 	struct wl_list layoutput_list;	/**< wet_layoutput::compositor_link */
 	struct wet_rdp_params rdp_params;
+
+	/* modules loaded once the first frame is out, see
+	 * wet_schedule_deferred_modules() */
+	struct {
+		char *modules;
+		struct weston_output *output;
+		struct wl_listener frame_listener;
+		struct wl_listener output_destroy_listener;
+		struct wl_event_source *timer;
+	} deferred;
 };
 
 static FILE *weston_logfile = NULL;
@@ -668,6 +680,10 @@ usage(int error_code)
 #endif
 		"  --modules\t\tLoad the comma-separated list of modules\n"
 		"  --log=FILE\t\tLog to the given file\n"
+		"  --log-buffer=KIB\tWrite the log file from a thread through a\n"
+			"\t\t\tbuffer of KIB kilobytes, 0 writes synchronously\n"
+		"  --log-overflow=POLICY\tWhen the log buffer is full: block\n"
+			"\t\t\t(default) or drop\n"
 		"  -c, --config=FILE\tConfig file to load, defaults to weston.ini\n"
 		"  --no-config\t\tDo not read weston.ini\n"
 		"  --wait-for-debugger\tRaise SIGSTOP on start-up\n"
@@ -686,6 +702,7 @@ usage(int error_code)
 		"  --seat=SEAT\t\tThe seat that weston should run on, instead of the seat defined in XDG_SEAT\n"
 		"  --tty=TTY\t\tThe tty to use\n"
 		"  --drm-device=CARD\tThe DRM device to use, e.g. \"card0\".\n"
+		"  --drm-render-device=NODE\tThe DRM device to render on, e.g. \"renderD129\".\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
 		"  --current-mode\tPrefer current KMS mode over EDID preferred mode\n"
 		"  --continue-without-input\tAllow the compositor to start without input devices\n\n");
@@ -711,6 +728,8 @@ usage(int error_code)
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
 		"  --use-gl\t\tUse the GL renderer (default: no rendering)\n"
 		"  --no-outputs\t\tDo not create any virtual outputs\n"
+		"  --refresh=RATE\tRefresh rate of outputs in mHz (default: 60000)\n"
+		"  --unthrottled\t\tRepaint as fast as possible, not at the refresh rate\n"
 		"\n");
 #endif
 
@@ -904,18 +923,34 @@ wet_load_module_entrypoint(const char *name, const char *entrypoint)
 	return init;
 }
 
+/* Logs how long loading and initializing something took, to see what
+ * startup spends its time on. */
+static void
+wet_log_init_time(const char *what, const char *name,
+		  const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	weston_log("%s '%s' initialized in %.1f ms\n", what, name,
+		   timespec_sub_to_nsec(&now, start) / 1e6);
+}
+
 WL_EXPORT int
 wet_load_module(struct weston_compositor *compositor,
 	        const char *name, int *argc, char *argv[])
 {
 	int (*module_init)(struct weston_compositor *ec,
 			   int *argc, char *argv[]);
+	struct timespec start;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	module_init = wet_load_module_entrypoint(name, "wet_module_init");
 	if (!module_init)
 		return -1;
 	if (module_init(compositor, argc, argv) < 0)
 		return -1;
+	wet_log_init_time("Module", name, &start);
 	return 0;
 }
 
@@ -925,15 +960,152 @@ wet_load_shell(struct weston_compositor *compositor,
 {
 	int (*shell_init)(struct weston_compositor *ec,
 			  int *argc, char *argv[]);
+	struct timespec start;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	shell_init = wet_load_module_entrypoint(name, "wet_shell_init");
 	if (!shell_init)
 		return -1;
 	if (shell_init(compositor, argc, argv) < 0)
 		return -1;
+	wet_log_init_time("Shell", name, &start);
 	return 0;
 }
 
+/* Deferred modules.
+ *
+ * Modules listed in the deferred-modules key of the [core] section are not
+ * needed to show the first frame, so they are loaded only once the first
+ * output has repainted, which leaves their initialization out of the time
+ * to the first window. In case nothing gets repainted for a while, say
+ * because the compositor sleeps until a remote client connects, they are
+ * loaded after WET_DEFERRED_MODULES_TIMEOUT_MS regardless.
+ */
+#define WET_DEFERRED_MODULES_TIMEOUT_MS 2000
+
+static int
+load_modules(struct weston_compositor *ec, const char *modules,
+	     int *argc, char *argv[]);
+
+static void
+wet_cancel_deferred_modules(struct wet_compositor *wet)
+{
+	if (wet->deferred.output) {
+		wl_list_remove(&wet->deferred.frame_listener.link);
+		wl_list_remove(&wet->deferred.output_destroy_listener.link);
+		wet->deferred.output = NULL;
+	}
+
+	if (wet->deferred.timer) {
+		wl_event_source_remove(wet->deferred.timer);
+		wet->deferred.timer = NULL;
+	}
+
+	free(wet->deferred.modules);
+	wet->deferred.modules = NULL;
+}
+
+static void
+wet_load_deferred_modules(struct wet_compositor *wet)
+{
+	/* Options were all consumed at startup. */
+	char *argv[] = { (char *) "weston", NULL };
+	int argc = 1;
+	char *modules = wet->deferred.modules;
+
+	wet->deferred.modules = NULL;
+	wet_cancel_deferred_modules(wet);
+
+	weston_log("Loading deferred modules\n");
+	if (load_modules(wet->compositor, modules, &argc, argv) < 0)
+		weston_log("Failed to load deferred modules '%s'\n", modules);
+
+	free(modules);
+}
+
+/* Not loaded right from the frame signal, which is emitted while
+ * repainting. */
+static void
+wet_load_deferred_modules_soon(struct wet_compositor *wet)
+{
+	wl_list_remove(&wet->deferred.frame_listener.link);
+	wl_list_remove(&wet->deferred.output_destroy_listener.link);
+	wet->deferred.output = NULL;
+
+	wl_event_source_timer_update(wet->deferred.timer, 1);
+}
+
+static void
+deferred_modules_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct wet_compositor *wet =
+		container_of(listener, struct wet_compositor,
+			     deferred.frame_listener);
+
+	wet_load_deferred_modules_soon(wet);
+}
+
+static void
+deferred_modules_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct wet_compositor *wet =
+		container_of(listener, struct wet_compositor,
+			     deferred.output_destroy_listener);
+
+	wet_load_deferred_modules_soon(wet);
+}
+
+static int
+deferred_modules_timeout(void *data)
+{
+	struct wet_compositor *wet = data;
+
+	wet_load_deferred_modules(wet);
+
+	return 0;
+}
+
+static void
+wet_schedule_deferred_modules(struct wet_compositor *wet, const char *modules)
+{
+	struct weston_compositor *ec = wet->compositor;
+	struct wl_event_loop *loop = wl_display_get_event_loop(ec->wl_display);
+	struct weston_output *output;
+	char *argv[] = { (char *) "weston", NULL };
+	int argc = 1;
+
+	if (!modules || modules[0] == '\0')
+		return;
+
+	wet->deferred.timer = wl_event_loop_add_timer(loop,
+						      deferred_modules_timeout,
+						      wet);
+	if (!wet->deferred.timer) {
+		weston_log("Failed to defer modules, loading them now\n");
+		load_modules(ec, modules, &argc, argv);
+		return;
+	}
+	wl_event_source_timer_update(wet->deferred.timer,
+				     WET_DEFERRED_MODULES_TIMEOUT_MS);
+
+	wet->deferred.modules = strdup(modules);
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		wet->deferred.output = output;
+		wet->deferred.frame_listener.notify =
+			deferred_modules_frame_notify;
+		wl_signal_add(&output->frame_signal,
+			      &wet->deferred.frame_listener);
+		wet->deferred.output_destroy_listener.notify =
+			deferred_modules_output_destroyed;
+		wl_signal_add(&output->destroy_signal,
+			      &wet->deferred.output_destroy_listener);
+		break;
+	}
+
+	weston_log("Deferring modules '%s' until the first frame\n", modules);
+}
+
 static char *
 wet_get_binary_path(const char *name, const char *dir)
 {
@@ -1062,6 +1234,8 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int repaint_threads;
+	char *metrics_file;
 	bool cal;
 
 	/* weston.ini [keyboard] */
@@ -1101,12 +1275,38 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	weston_log("Output repaint window is %d ms maximum.\n",
 		   ec->repaint_msec);
 
+	weston_config_section_get_int(s, "surface-damage-max-rects",
+				      &ec->surface_damage_max_rects, 0);
+
+	weston_config_section_get_int(s, "parallel-repaint", &repaint_threads, 0);
+	if (repaint_threads > 1) {
+		if (weston_compositor_set_parallel_repaint(ec, repaint_threads) < 0)
+			weston_log("Failed to start parallel repaint threads.\n");
+		else
+			weston_log("Outputs are rendered by up to %d threads.\n",
+				   repaint_threads);
+	}
+
+	weston_config_section_get_string(s, "metrics-file", &metrics_file,
+					 NULL);
+	if (metrics_file) {
+		if (weston_compositor_set_metrics_file(ec, metrics_file) < 0)
+			weston_log("Failed to set up metrics file %s.\n",
+				   metrics_file);
+		else
+			weston_log("Output metrics are written to %s.\n",
+				   metrics_file);
+		free(metrics_file);
+	}
+
 	/* weston.ini [libinput] */
 	s = weston_config_get_section(config, "libinput", NULL, NULL);
 	weston_config_section_get_bool(s, "touchscreen_calibrator", &cal, 0);
 	if (cal)
 		weston_compositor_enable_touch_calibrator(ec,
 						save_touch_device_calibration);
+	weston_config_section_get_bool(s, "accumulate-motion",
+				       &ec->accumulate_pointer_motion, false);
 
 	return 0;
 }
@@ -1758,6 +1958,7 @@ drm_backend_output_configure(struct weston_output *output,
 	char *modeline = NULL;
 	char *gbm_format = NULL;
 	char *seat = NULL;
+	bool vrr, allow_tearing;
 
 	api = weston_drm_output_get_api(output->compositor);
 	if (!api) {
@@ -1807,6 +2008,13 @@ drm_backend_output_configure(struct weston_output *output,
 	api->set_seat(output, seat);
 	free(seat);
 
+	weston_config_section_get_bool(section, "vrr", &vrr, false);
+	api->set_vrr(output, vrr);
+
+	weston_config_section_get_bool(section, "allow-tearing",
+				       &allow_tearing, false);
+	api->set_allow_tearing(output, allow_tearing);
+
 	allow_content_protection(output, section);
 
 	return 0;
@@ -2570,6 +2778,7 @@ load_drm_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_STRING, "seat", 0, &config.seat_id },
 		{ WESTON_OPTION_INTEGER, "tty", 0, &config.tty },
 		{ WESTON_OPTION_STRING, "drm-device", 0, &config.specific_device },
+		{ WESTON_OPTION_STRING, "drm-render-device", 0, &config.render_device },
 		{ WESTON_OPTION_BOOLEAN, "current-mode", 0, &wet->drm_use_current_mode },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &config.use_pixman },
 		{ WESTON_OPTION_BOOLEAN, "continue-without-input", 0, &config.continue_without_input },
@@ -2585,6 +2794,8 @@ load_drm_backend(struct weston_compositor *c,
 	                               &config.pageflip_timeout, 0);
 	weston_config_section_get_bool(section, "pixman-shadow",
 				       &config.use_pixman_shadow, true);
+	weston_config_section_get_bool(section, "late-latching",
+				       &config.late_latching, false);
 
 	config.base.struct_version = WESTON_DRM_BACKEND_CONFIG_VERSION;
 	config.base.struct_size = sizeof(struct weston_drm_backend_config);
@@ -2651,6 +2862,8 @@ load_headless_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_BOOLEAN, "use-gl", 0, &config.use_gl },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
 		{ WESTON_OPTION_BOOLEAN, "no-outputs", 0, &no_outputs },
+		{ WESTON_OPTION_INTEGER, "refresh", 0, &config.refresh },
+		{ WESTON_OPTION_BOOLEAN, "unthrottled", 0, &config.unthrottled },
 	};
 
 	parse_options(options, ARRAY_LENGTH(options), argc, argv);
@@ -2710,6 +2923,7 @@ weston_rdp_backend_config_init(struct weston_rdp_backend_config *config)
 	config->audio_out_setup = NULL;
 	config->audio_out_teardown = NULL;
 	config->rdp_monitor_refresh_rate = WESTON_RDP_MODE_FREQ;
+	config->monitor_refresh_rates = NULL;
 	config->rail_config.use_rdpapplist = false;
 	config->rail_config.use_shared_memory = false;
 	config->rail_config.enable_hi_dpi_support = false;
@@ -2722,6 +2936,36 @@ weston_rdp_backend_config_init(struct weston_rdp_backend_config *config)
 	config->rail_config.enable_distro_name_title = false;
 	config->rail_config.enable_copy_warning_title = false;
 	config->rail_config.enable_display_power_by_screenupdate = false;
+	config->rail_config.gfx_codec = WESTON_RDP_GFX_CODEC_AUTO;
+	config->rail_config.gfx_codec_progressive_min_area =
+		WESTON_RDP_GFX_CODEC_PROGRESSIVE_MIN_AREA;
+	config->rail_config.enable_gfx_avc = true;
+	config->rail_config.gfx_avc_min_area = WESTON_RDP_GFX_AVC_MIN_AREA;
+	config->rail_config.enable_gfx_scroll = false;
+	config->rail_config.enable_gfx_cache = false;
+	config->rail_config.enable_gfx_downscale = false;
+	config->rail_config.enable_frame_pacing = false;
+	config->rail_config.enable_shm_direct_copy = false;
+	config->rail_config.preview_refresh_interval = 0;
+	config->rail_config.enable_gfx_classify = false;
+	config->rail_config.gfx_content_overrides = NULL;
+	config->rail_config.reconnect_grace_sec = 0;
+	config->rail_config.enable_subsurface_flattening = false;
+	config->encoder_threads = WESTON_RDP_ENCODER_THREADS_AUTO;
+	config->render_threads = 0;
+	config->damage_max_rects = WESTON_RDP_DAMAGE_MAX_RECTS;
+	config->damage_rect_cost = WESTON_RDP_DAMAGE_RECT_COST;
+	config->shared_encoding = false;
+	config->coalesce_mouse_motion = false;
+	config->session_tls_cache = false;
+	config->redirect_touch = false;
+	config->refine_quality = false;
+	config->network_autodetect = false;
+	config->loop_channels = false;
+	config->socket_buffer_size = 0;
+	config->tcp_nodelay = true;
+	config->cork_frames = false;
+	config->client_cursor = false;
 }
 
 static bool
@@ -2759,6 +3003,26 @@ read_rdp_config_int(char *config_name, int default_value)
 	return default_value;
 }
 
+static int
+read_rdp_config_gfx_codec(char *config_name, int default_value)
+{
+	char *s;
+
+	s = getenv(config_name);
+	if (s) {
+		if (strcmp(s, "auto") == 0)
+			return WESTON_RDP_GFX_CODEC_AUTO;
+		else if (strcmp(s, "uncompressed") == 0)
+			return WESTON_RDP_GFX_CODEC_UNCOMPRESSED;
+		else if (strcmp(s, "planar") == 0)
+			return WESTON_RDP_GFX_CODEC_PLANAR;
+		else if (strcmp(s, "progressive") == 0)
+			return WESTON_RDP_GFX_CODEC_PROGRESSIVE;
+	}
+
+	return default_value;
+}
+
 struct wet_rdp_params *
 wet_get_rdp_params(struct weston_compositor *ec)
 {
@@ -2828,6 +3092,14 @@ load_rdp_backend(struct weston_compositor *c,
 
 	/* certain configurations are read from environment variables */
 	config.redirect_clipboard = read_rdp_config_bool("WESTON_RDP_CLIPBOARD", true);
+	config.redirect_touch = read_rdp_config_bool("WESTON_RDP_TOUCH", true);
+	config.refine_quality = read_rdp_config_bool("WESTON_RDP_REFINE_QUALITY", true);
+	config.network_autodetect = read_rdp_config_bool("WESTON_RDP_NETWORK_AUTODETECT", true);
+	config.loop_channels = read_rdp_config_bool("WESTON_RDP_LOOP_CHANNELS", false);
+	config.socket_buffer_size = read_rdp_config_int("WESTON_RDP_SOCKET_BUFFER_SIZE", 0);
+	config.tcp_nodelay = read_rdp_config_bool("WESTON_RDP_TCP_NODELAY", true);
+	config.cork_frames = read_rdp_config_bool("WESTON_RDP_CORK_FRAMES", true);
+	config.client_cursor = read_rdp_config_bool("WESTON_RDP_CLIENT_CURSOR", true);
 
 	audio_tmp = read_rdp_config_bool("WESTON_RDP_AUDIO_PLAYBACK", true);
 	if (audio_tmp) {
@@ -2842,6 +3114,14 @@ load_rdp_backend(struct weston_compositor *c,
 	}
 
 	config.rdp_monitor_refresh_rate = read_rdp_config_int("WESTON_RDP_MONITOR_REFRESH_RATE", WESTON_RDP_MODE_FREQ);
+	config.monitor_refresh_rates = getenv("WESTON_RDP_MONITOR_REFRESH_RATES");
+	config.encoder_threads = read_rdp_config_int("WESTON_RDP_ENCODER_THREADS", WESTON_RDP_ENCODER_THREADS_AUTO);
+	config.render_threads = read_rdp_config_int("WESTON_RDP_RENDER_THREADS", 0);
+	config.damage_max_rects = read_rdp_config_int("WESTON_RDP_DAMAGE_MAX_RECTS", WESTON_RDP_DAMAGE_MAX_RECTS);
+	config.damage_rect_cost = read_rdp_config_int("WESTON_RDP_DAMAGE_RECT_COST", WESTON_RDP_DAMAGE_RECT_COST);
+	config.shared_encoding = read_rdp_config_bool("WESTON_RDP_SHARED_ENCODING", true);
+	config.coalesce_mouse_motion = read_rdp_config_bool("WESTON_RDP_COALESCE_MOUSE_MOTION", false);
+	config.session_tls_cache = read_rdp_config_bool("WESTON_RDP_SESSION_TLS_CACHE", false);
 
 	config.rail_config.use_rdpapplist = read_rdp_config_bool("WESTON_RDP_APPLIST", true);
 	config.rail_config.use_shared_memory = read_rdp_config_bool("WESTON_RDP_SHARED_MEMORY", true);
@@ -2888,6 +3168,37 @@ load_rdp_backend(struct weston_compositor *c,
 	config.rail_config.enable_display_power_by_screenupdate =
 		read_rdp_config_bool("WESTON_RDP_DISPLAY_POWER_BY_SCREENUPDATE", false);
 
+	config.rail_config.gfx_codec =
+		read_rdp_config_gfx_codec("WESTON_RDP_GFX_CODEC", WESTON_RDP_GFX_CODEC_AUTO);
+	config.rail_config.gfx_codec_progressive_min_area =
+		read_rdp_config_int("WESTON_RDP_GFX_CODEC_PROGRESSIVE_MIN_AREA",
+				    WESTON_RDP_GFX_CODEC_PROGRESSIVE_MIN_AREA);
+	config.rail_config.enable_gfx_avc =
+		read_rdp_config_bool("WESTON_RDP_GFX_AVC", true);
+	config.rail_config.gfx_avc_min_area =
+		read_rdp_config_int("WESTON_RDP_GFX_AVC_MIN_AREA",
+				    WESTON_RDP_GFX_AVC_MIN_AREA);
+	config.rail_config.enable_gfx_scroll =
+		read_rdp_config_bool("WESTON_RDP_GFX_SCROLL", true);
+	config.rail_config.enable_gfx_cache =
+		read_rdp_config_bool("WESTON_RDP_GFX_CACHE", true);
+	config.rail_config.enable_gfx_downscale =
+		read_rdp_config_bool("WESTON_RDP_GFX_DOWNSCALE", true);
+	config.rail_config.enable_frame_pacing =
+		read_rdp_config_bool("WESTON_RDP_FRAME_PACING", true);
+	config.rail_config.enable_shm_direct_copy =
+		read_rdp_config_bool("WESTON_RDP_SHM_DIRECT_COPY", true);
+	config.rail_config.preview_refresh_interval =
+		read_rdp_config_int("WESTON_RDP_PREVIEW_REFRESH_INTERVAL", 0);
+	config.rail_config.enable_gfx_classify =
+		read_rdp_config_bool("WESTON_RDP_GFX_CLASSIFY", true);
+	config.rail_config.gfx_content_overrides =
+		getenv("WESTON_RDP_GFX_CONTENT_OVERRIDES");
+	config.rail_config.reconnect_grace_sec =
+		read_rdp_config_int("WESTON_RDP_RECONNECT_GRACE_SEC", 60);
+	config.rail_config.enable_subsurface_flattening =
+		read_rdp_config_bool("WESTON_RDP_FLATTEN_SUBSURFACES", true);
+
 	config.rail_config.enable_distro_name_title = read_rdp_config_bool("WESTON_RDP_APPEND_DISTRONAME_TITLE", true);
 #if defined(__arm__) || defined(__aarch64__)
 	config.rail_config.enable_copy_warning_title = read_rdp_config_bool("WESTON_RDP_COPY_WARNING_TITLE", false);
@@ -3310,14 +3621,21 @@ wet_main(int argc, char *argv[])
 	char *shell = NULL;
 	bool xwayland = false;
 	char *modules = NULL;
+	char *deferred_modules = NULL;
 	char *option_modules = NULL;
 	char *log = NULL;
+	int32_t log_buffer = -1;
+	char *log_overflow = NULL;
+	enum weston_log_file_overflow overflow = WESTON_LOG_FILE_OVERFLOW_BLOCK;
 	char *log_scopes = NULL;
 	char *log_scopes_env = NULL;
 	char *flight_rec_scopes = NULL;
 	char *server_socket = NULL;
 	char *idle_time_env = NULL;
 	int32_t idle_time = -1;
+	int32_t occluded_frame_rate = 0;
+	int32_t client_commit_rate = 0;
+	struct timespec init_start;
 	int32_t help = 0;
 	char *socket_name = NULL;
 	int32_t version = 0;
@@ -3351,6 +3669,8 @@ wet_main(int argc, char *argv[])
 #endif
 		{ WESTON_OPTION_STRING, "modules", 0, &option_modules },
 		{ WESTON_OPTION_STRING, "log", 0, &log },
+		{ WESTON_OPTION_INTEGER, "log-buffer", 0, &log_buffer },
+		{ WESTON_OPTION_STRING, "log-overflow", 0, &log_overflow },
 		{ WESTON_OPTION_BOOLEAN, "help", 'h', &help },
 		{ WESTON_OPTION_BOOLEAN, "version", 0, &version },
 		{ WESTON_OPTION_BOOLEAN, "no-config", 0, &noconfig },
@@ -3394,7 +3714,19 @@ wet_main(int argc, char *argv[])
 
 	weston_log_set_handler(vlog, vlog_continue);
 
-	logger = weston_log_subscriber_create_log(weston_logfile);
+	/* a log file on a slow disk should not stall the compositor, stderr
+	 * stays synchronous so nothing is lost on a crash */
+	if (log_buffer < 0)
+		log_buffer = log ? DEFAULT_LOG_BUFFER_KIB : 0;
+	if (log_overflow && strcmp(log_overflow, "drop") == 0)
+		overflow = WESTON_LOG_FILE_OVERFLOW_DROP;
+	else if (log_overflow && strcmp(log_overflow, "block") != 0)
+		fprintf(stderr, "warning: unrecognized --log-overflow '%s', "
+			"using 'block'\n", log_overflow);
+
+	logger = weston_log_subscriber_create_log_async(weston_logfile,
+							(size_t)log_buffer * 1024,
+							overflow);
 	flight_rec = weston_log_subscriber_create_flight_rec(DEFAULT_FLIGHT_REC_SIZE);
 
 	weston_log_subscribe_to_scopes(log_ctx, logger, flight_rec,
@@ -3513,11 +3845,25 @@ wet_main(int argc, char *argv[])
 
 	weston_config_section_get_bool(section, "require-input",
 				       &wet.compositor->require_input, true);
-
+	weston_config_section_get_bool(section, "defer-fenced-commits",
+				       &wet.compositor->defer_fenced_commits,
+				       false);
+	weston_config_section_get_int(section, "occluded-frame-rate",
+				      &occluded_frame_rate, 0);
+	if (occluded_frame_rate > 0)
+		wet.compositor->occluded_frame_interval_msec =
+			MAX(1000 / occluded_frame_rate, 1);
+	weston_config_section_get_int(section, "client-commit-rate",
+				      &client_commit_rate, 0);
+	if (client_commit_rate > 0)
+		wet.compositor->client_commit_rate = client_commit_rate;
+
+	clock_gettime(CLOCK_MONOTONIC, &init_start);
 	if (load_backend(wet.compositor, backend, &argc, argv, config) < 0) {
 		weston_log("fatal: failed to create compositor backend\n");
 		goto out;
 	}
+	wet_log_init_time("Backend", backend, &init_start);
 
 	weston_compositor_flush_heads_changed(wet.compositor);
 	if (wet.init_failed)
@@ -3577,8 +3923,10 @@ wet_main(int argc, char *argv[])
 					       false);
 	}
 	if (xwayland) {
+		clock_gettime(CLOCK_MONOTONIC, &init_start);
 		if (wet_load_xwayland(wet.compositor) < 0)
 			goto out;
+		wet_log_init_time("Module", "xwayland", &init_start);
 	}
 
 	weston_config_section_get_string(section, "modules", &modules, "");
@@ -3588,6 +3936,10 @@ wet_main(int argc, char *argv[])
 	if (load_modules(wet.compositor, option_modules, &argc, argv) < 0)
 		goto out;
 
+	weston_config_section_get_string(section, "deferred-modules",
+					 &deferred_modules, "");
+	wet_schedule_deferred_modules(&wet, deferred_modules);
+
 	section = weston_config_get_section(config, "keyboard", NULL, NULL);
 	weston_config_section_get_bool(section, "numlock-on", &numlock_on, false);
 	if (numlock_on) {
@@ -3621,6 +3973,7 @@ wet_main(int argc, char *argv[])
 	ret = wet.compositor->exit_code;
 
 out:
+	wet_cancel_deferred_modules(&wet);
 	wet_compositor_destroy_layout(&wet);
 
 	/* free(NULL) is valid, and it won't be NULL if it's used */
@@ -3635,6 +3988,7 @@ out:
 	weston_log_scope_destroy(log_scope);
 	log_scope = NULL;
 	weston_log_subscriber_destroy(logger);
+	logger = NULL;
 	weston_log_subscriber_destroy(flight_rec);
 	weston_log_ctx_destroy(log_ctx);
 
@@ -3647,6 +4001,9 @@ out_config:
 	wl_display_destroy(display);
 
 out_display:
+	/* its writer thread must be done with the file before it closes */
+	if (logger)
+		weston_log_subscriber_destroy(logger);
 	weston_log_file_close();
 
 	if (config)
@@ -3657,7 +4014,9 @@ out_display:
 	free(socket_name);
 	free(option_modules);
 	free(log);
+	free(log_overflow);
 	free(modules);
+	free(deferred_modules);
 
 	return ret;
 }
@@ -26,6 +26,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
@@ -33,20 +34,33 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/eventfd.h>
+#include <poll.h>
 #include <time.h>
 #include <sys/un.h>
 #include <fcntl.h>
 #include <linux/vm_sockets.h>
 #include "rdpaudio.h"
+#include <freerdp/codec/dsp.h>
 #include <libweston/libweston.h>
+#include <libweston/backend-rdp.h>
 #include <shared/xalloc.h>
 
+/* PCM from the sink, encoded by FreeRDP when client agreed on other format. */
+static AUDIO_FORMAT rdp_audio_source_audio_format =
+		{ WAVE_FORMAT_PCM, 2, 44100, 176400, 4, 16, 0, NULL };
+
+/* in order of preference, compressed formats are offered only when FreeRDP
+   is built with their encoder. */
 static AUDIO_FORMAT rdp_audio_supported_audio_formats[] = {
+		{ WAVE_FORMAT_AAC_MS, 2, 44100, 176400, 4, 16, 0, NULL },
+		{ WAVE_FORMAT_DVI_ADPCM, 2, 44100, 44359, 2048, 4, 0, NULL },
 		{ WAVE_FORMAT_PCM, 2, 44100, 176400, 4, 16, 0, NULL },
 	};
 
 #define AUDIO_LATENCY 5
 #define AUDIO_FRAMES_PER_RDP_PACKET (44100 * AUDIO_LATENCY / 1000)
+/* initial size of audio buffer, grows if sink sends larger chunk. */
+#define AUDIO_BUFFER_PACKETS 16
 
 #define RDP_SINK_INTERFACE_VERSION 1
 
@@ -337,6 +351,23 @@ rdp_audio_timestamp()
 	return time.tv_sec * 1000000 + time.tv_nsec / 1000;
 }
 
+/*
+ * Sink stamps samples with rdp_audio_timestamp(), move that to the RDP
+ * media clock graphics frames are stamped with, keeping how long ago
+ * the samples were produced. RDPSND carries the low 16 bits of msec.
+ */
+static UINT16
+rdp_audio_media_timestamp(UINT64 sinkTimestamp)
+{
+	UINT64 now = rdp_audio_timestamp();
+	UINT64 media = weston_rdp_media_clock_msec();
+
+	if (sinkTimestamp && sinkTimestamp < now)
+		media -= MIN((now - sinkTimestamp) / 1000, media);
+
+	return (UINT16)media;
+}
+
 static UINT 
 rdp_audio_client_confirm_block(
 	RdpsndServerContext* context, 
@@ -356,12 +387,17 @@ rdp_audio_client_confirm_block(
 		if (priv->nextValidBlock == -1 || priv->nextValidBlock == confirmBlockNum) {
 			priv->nextValidBlock = -1;
 
-			priv->accumulatedRenderedLatency +=
-			priv->blockInfo[confirmBlockNum].ackPlayedTime -
-			priv->blockInfo[confirmBlockNum].submissionTime;
+			UINT64 latency = priv->blockInfo[confirmBlockNum].ackPlayedTime -
+					 priv->blockInfo[confirmBlockNum].submissionTime;
+
+			priv->accumulatedRenderedLatency += latency;
 			priv->accumulatedRenderedLatencyCount++;
+			if (latency > priv->maxRenderedLatency)
+				priv->maxRenderedLatency = latency;
 		}
 
+		__atomic_sub_fetch(&priv->blocksInFlight, 1, __ATOMIC_RELAXED);
+
 		uint64_t one = 1;
 		if (write(priv->audioSem, &one, sizeof(one)) != sizeof(uint64_t)) {
 			weston_log("RDP Audio error at confirm_block while writing to audioSem (%s)\n", strerror(errno));
@@ -403,6 +439,29 @@ rdp_audio_handle_version(
 	return 0;
 }
 
+/*
+ * Take one slot of outstanding RDP audio blocks, wait for the client to
+ * play one if all are in use. The wait is overrun, the client can't keep up.
+ */
+static int
+rdp_audio_wait_block_slot(struct audio_out_private *priv)
+{
+	struct pollfd pfd = { .fd = priv->audioSem, .events = POLLIN };
+	uint64_t dummy;
+
+	while (read(priv->audioSem, &dummy, sizeof(dummy)) != sizeof(uint64_t)) {
+		if (errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (errno == EAGAIN) {
+			priv->overrunCount++;
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int
 rdp_audio_handle_transfer(
 	struct audio_out_private *priv,
@@ -414,15 +473,19 @@ rdp_audio_handle_transfer(
 	ssize_t sizeRead = 0;
 
 	if (bytesLeft > priv->audioBufferSize) {
-		if(priv->audioBuffer)
-			free(priv->audioBuffer);
-
-		priv->audioBuffer = zalloc(bytesLeft);
+		/* grow geometrically so varying chunk size doesn't realloc each time */
+		UINT size = priv->audioBufferSize * 2;
+
+		if (size < bytesLeft)
+			size = bytesLeft;
+		free(priv->audioBuffer);
+		priv->audioBufferSize = 0;
+		priv->audioBuffer = malloc(size);
 		if (!priv->audioBuffer) {
-			weston_log("RDP Audio error zalloc(%d) failed.\n", bytesLeft);
+			weston_log("RDP Audio error malloc(%d) failed.\n", size);
 			return -1;
 		}
-		priv->audioBufferSize = bytesLeft;
+		priv->audioBufferSize = size;
 	}
 
 	assert((bytesLeft % priv->bytesPerFrame) == 0);
@@ -442,6 +505,7 @@ rdp_audio_handle_transfer(
 	}
 
 	BYTE* audioBuffer = priv->audioBuffer;
+	UINT64 packetTimestamp = timestamp;
 	while (nbFrames > 0) {
 		/*
 		 * Ensure we don't overrun our audio buffers.
@@ -451,8 +515,7 @@ rdp_audio_handle_transfer(
 		 * submit more than one packet of audio over the RDP channel for one
 		 * of our incoming audio packet from pulse.
 		 */
-		uint64_t dummy;
-		if (read(priv->audioSem, &dummy, sizeof(dummy)) != sizeof(uint64_t)) {
+		if (rdp_audio_wait_block_slot(priv) < 0) {
 			weston_log("RDP Audio error at handle_transfer while reading from audioSem (%s)\n", strerror(errno));
 			return -1;
 		}
@@ -461,7 +524,8 @@ rdp_audio_handle_transfer(
 		 * Setup tracking of all block sent by RDP so we can compute latency later
 		 * when those block gets acknowledge by the client.
 		 *
-		 * Set 0 to timestamp to disable A/V sync at client side.
+		 * The block is stamped on the media clock of graphics frames
+		 * so the client can play it in sync with them.
 		 */
 		BYTE block_no = priv->rdpsnd_server_context->block_no;
 		priv->blockInfo[block_no].submissionTime = timestamp;
@@ -470,7 +534,7 @@ rdp_audio_handle_transfer(
 		if (priv->rdpsnd_server_context->SendSamples(priv->rdpsnd_server_context,
 							    audioBuffer,
 							    MIN(nbFrames, AUDIO_FRAMES_PER_RDP_PACKET),
-							    0) != 0) {
+							    rdp_audio_media_timestamp(packetTimestamp)) != 0) {
 			weston_log("RDP Audio error while SendSamples\n");
 			return -1;
 		}
@@ -485,6 +549,14 @@ rdp_audio_handle_transfer(
 				return -1;
 			}
 		} else {
+			/*
+			 * Client played everything sent so far, so it has been starving.
+			 */
+			if (__atomic_fetch_add(&priv->blocksInFlight, 1, __ATOMIC_RELAXED) <= 0 &&
+			    priv->blockSent)
+				priv->underrunCount++;
+			priv->blockSent = TRUE;
+
 			/*
 			 * There shouldn't be more than one packet of audio sent by RDP.
 			 */
@@ -494,6 +566,8 @@ rdp_audio_handle_transfer(
 
 		audioBuffer += AUDIO_FRAMES_PER_RDP_PACKET * priv->bytesPerFrame;
 		nbFrames -= AUDIO_FRAMES_PER_RDP_PACKET;
+		if (packetTimestamp)
+			packetTimestamp += AUDIO_LATENCY * 1000;
 	}
 
 	return 0;
@@ -527,6 +601,10 @@ rdp_audio_handle_get_latency(struct audio_out_private *priv)
 	if (renderedLatency > networkLatency)
 		renderedLatency -= networkLatency;
 
+	rdp_audio_debug(priv, "Audio sink latency: network:%d usec, rendered:%d usec, max end-to-end:%" PRIu64 " usec, underrun:%" PRIu64 ", overrun:%" PRIu64 "\n",
+			networkLatency, renderedLatency, priv->maxRenderedLatency,
+			priv->underrunCount, priv->overrunCount);
+
 	sizeSent = send(priv->pulseAudioSinkFd, &renderedLatency,
 				sizeof(renderedLatency), MSG_DONTWAIT);
 	if (sizeSent != sizeof(renderedLatency)) {
@@ -570,6 +648,18 @@ rdp_audio_pulse_audio_sink_thread(void *context)
 					priv->pulseAudioSinkFd);
 		}
 
+		priv->blockSent = FALSE;
+		__atomic_store_n(&priv->blocksInFlight, 0, __ATOMIC_RELAXED);
+		priv->underrunCount = 0;
+		priv->overrunCount = 0;
+		priv->maxRenderedLatency = 0;
+
+		if (!priv->audioBuffer) {
+			priv->audioBufferSize = AUDIO_FRAMES_PER_RDP_PACKET *
+						AUDIO_BUFFER_PACKETS * priv->bytesPerFrame;
+			priv->audioBuffer = xmalloc(priv->audioBufferSize);
+		}
+
 		/*
 		 * Read audio from the socket and stream to the RDP Client.
 		 */
@@ -636,12 +726,16 @@ rdp_audio_client_activated(RdpsndServerContext* context)
 				context->client_formats[i].wBitsPerSample,
 				context->client_formats[i].nChannels,
 				context->client_formats[i].nSamplesPerSec);
+	}
 
-		for (j = 0; j < (int)context->num_server_formats; j++) {
+	/* server formats are in order of preference, take the first client has. */
+	for (j = 0; j < (int)context->num_server_formats && format == -1; j++) {
+		for (i = 0; i < context->num_client_formats; i++) {
 			if ((context->client_formats[i].wFormatTag == context->server_formats[j].wFormatTag) &&
 			    (context->client_formats[i].nChannels == context->server_formats[j].nChannels) &&
 			    (context->client_formats[i].nSamplesPerSec == context->server_formats[j].nSamplesPerSec)) {
-				rdp_audio_debug(priv, "RDPAudio - Agreed on format %d.\n", i);
+				rdp_audio_debug(priv, "RDPAudio - Agreed on format %d (%s).\n", i,
+						AUDIO_FORMAT_to_String(context->client_formats[i].wFormatTag));
 				format = i;
 				break;
 			}
@@ -650,7 +744,8 @@ rdp_audio_client_activated(RdpsndServerContext* context)
 
 	if (format != -1) {
 		priv->nextValidBlock = -1;
-		priv->bytesPerFrame = (context->client_formats[format].wBitsPerSample / 8) * context->client_formats[format].nChannels;
+		/* sink always sends PCM in source format, encoding is done by SendSamples */
+		priv->bytesPerFrame = (context->src_format->wBitsPerSample / 8) * context->src_format->nChannels;
 		context->latency = AUDIO_LATENCY;
 
 		rdp_audio_debug(priv, "rdp_audio_server_activated: bytesPerFrame:%d, latency:%d\n", 
@@ -674,6 +769,9 @@ void *
 rdp_audio_out_init(struct weston_compositor *c, HANDLE vcm)
 {
 	struct audio_out_private *priv;
+	BOOL allow_compression = TRUE;
+	UINT32 num_formats = 0;
+	size_t i;
 	char *s;
 
 	priv = xzalloc(sizeof *priv);
@@ -693,26 +791,39 @@ rdp_audio_out_init(struct weston_compositor *c, HANDLE vcm)
 	priv->pulseAudioSinkFd = -1;
 	priv->audioBuffer = NULL;
 
-	priv->audioSem = eventfd(256, EFD_SEMAPHORE | EFD_CLOEXEC);
+	priv->audioSem = eventfd(256, EFD_SEMAPHORE | EFD_CLOEXEC | EFD_NONBLOCK);
 	if (!priv->audioSem) {
 		weston_log("RDPAudio - Couldn't initialize event semaphore.\n");
 		goto Error_Exit;
 	}
 
+	s = getenv("WESTON_RDP_DISABLE_AUDIO_PLAYBACK_COMPRESSION");
+	if (s && strcmp(s, "true") == 0) {
+		allow_compression = FALSE;
+		weston_log("RDPAudio - force PCM playback.\n");
+	}
+
 	/* this will be freed by FreeRDP at rdpsnd_server_context_free. */
 	AUDIO_FORMAT *audio_formats = malloc(sizeof rdp_audio_supported_audio_formats);
 	if (!audio_formats) {
 		weston_log("RDPAudio - Couldn't allocate memory for audio formats.\n");
 		goto Error_Exit;
 	}
-	memcpy(audio_formats, rdp_audio_supported_audio_formats, sizeof rdp_audio_supported_audio_formats);
-    
+	for (i = 0; i < ARRAYSIZE(rdp_audio_supported_audio_formats); i++) {
+		AUDIO_FORMAT *format = &rdp_audio_supported_audio_formats[i];
+
+		if (format->wFormatTag != WAVE_FORMAT_PCM &&
+		    (!allow_compression || !freerdp_dsp_supports_format(format, TRUE)))
+			continue;
+		audio_formats[num_formats++] = *format;
+	}
+
 	priv->rdpsnd_server_context->data = (void*)priv;
 	priv->rdpsnd_server_context->Activated = rdp_audio_client_activated;
 	priv->rdpsnd_server_context->ConfirmBlock = rdp_audio_client_confirm_block;
-	priv->rdpsnd_server_context->num_server_formats = ARRAYSIZE(rdp_audio_supported_audio_formats);
+	priv->rdpsnd_server_context->num_server_formats = num_formats;
 	priv->rdpsnd_server_context->server_formats = audio_formats;
-	priv->rdpsnd_server_context->src_format = &rdp_audio_supported_audio_formats[0];
+	priv->rdpsnd_server_context->src_format = &rdp_audio_source_audio_format;
 #if HAVE_RDPSND_DYNAMIC_VIRTUAL_CHANNEL
 	priv->rdpsnd_server_context->use_dynamic_virtual_channel = TRUE;
 	s = getenv("WESTON_RDP_DISABLE_AUDIO_PLAYBACK_DYNAMIC_VIRTUAL_CHANNEL");
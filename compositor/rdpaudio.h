@@ -61,6 +61,12 @@ struct audio_out_private {
 	int nextValidBlock;
 	UINT PAVersion;
 	int audioSem;
+	/* stats, reset at each sink connection. */
+	BOOL blockSent;
+	int blocksInFlight; /* accessed with atomics, acks come on channel thread */
+	UINT64 underrunCount;
+	UINT64 overrunCount;
+	UINT64 maxRenderedLatency;
 };
 
 struct audio_in_private {
@@ -72,6 +78,17 @@ struct audio_in_private {
 	int closeAudioSourceFd;
 	pthread_t pulseAudioSourceThread;
 	BOOL isAudioInStreamOpened;
+	/* samples are batched up to target latency before sent to source. */
+	UINT targetLatency; /* msec */
+	BYTE *batchBuffer;
+	UINT batchBufferSize;
+	UINT batchBytes;
+	/* stats, reset at each source connection. */
+	UINT64 packetsReceived;
+	UINT64 writesToSource;
+	UINT64 lastReceivedTime;
+	UINT64 accumulatedReceiveInterval;
+	UINT64 maxReceiveInterval;
 };
 
 void *
@@ -26,6 +26,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
@@ -46,6 +47,9 @@ static AUDIO_FORMAT rdp_audioin_supported_audio_formats[] = {
 		{ WAVE_FORMAT_PCM, 1, 44100, 88200, 2, 16, 0, NULL },
 	};
 
+#define AUDIOIN_DEFAULT_LATENCY 10 /* msec */
+#define AUDIOIN_MAX_LATENCY 100 /* msec */
+
 static char*
 AUDIO_FORMAT_to_String(UINT16 format)
 {
@@ -267,6 +271,50 @@ AUDIO_FORMAT_to_String(UINT16 format)
 	return "WAVE_FORMAT_UNKNOWN";
 }
 
+static UINT64
+rdp_audioin_timestamp(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+static void
+rdp_audioin_reset_stats(struct audio_in_private *priv)
+{
+	priv->batchBytes = 0;
+	priv->packetsReceived = 0;
+	priv->writesToSource = 0;
+	priv->lastReceivedTime = 0;
+	priv->accumulatedReceiveInterval = 0;
+	priv->maxReceiveInterval = 0;
+}
+
+static void
+rdp_audioin_dump_stats(struct audio_in_private *priv)
+{
+	rdp_audio_debug(priv, "RDP AudioIn stats: packets:%" PRIu64 ", writes:%" PRIu64
+			", receive interval avg:%" PRIu64 " usec, max:%" PRIu64 " usec\n",
+			priv->packetsReceived, priv->writesToSource,
+			priv->packetsReceived > 1 ?
+				priv->accumulatedReceiveInterval / (priv->packetsReceived - 1) : 0,
+			priv->maxReceiveInterval);
+}
+
+/* returns number of bytes sent, < bytes when pulseaudio end failed. */
+static int
+rdp_audioin_send_to_source(struct audio_in_private *priv, const BYTE *data, int bytes)
+{
+	int sent = send(priv->pulseAudioSourceFd, data, bytes, 0);
+
+	priv->writesToSource++;
+	if (sent != bytes) {
+		rdp_audio_debug(priv, "RDP AudioIn source send failed (sent:%d, bytes:%d) %s\n",
+				sent, bytes, strerror(errno));
+	}
+	return sent;
+}
+
 static int
 rdp_audioin_setup_listener(struct audio_in_private *priv)
 {
@@ -380,11 +428,52 @@ rdp_audioin_client_receive_samples(
 		assert(format->wBitsPerSample == 16);
 		assert(buf != NULL);
 
+		const BYTE *data = Stream_Buffer(buf);
 		int bytes = nframes * format->wBitsPerSample / 8;
-		int sent = send(priv->pulseAudioSourceFd, buf->buffer, bytes, 0);
-		if (sent != bytes) {
-			rdp_audio_debug(priv, "RDP AudioIn source send failed (sent:%d, bytes:%d) %s\n",
-					sent, bytes, strerror(errno));
+		int sent = 0;
+		BOOL failed = FALSE;
+		UINT64 now = rdp_audioin_timestamp();
+
+		if (priv->lastReceivedTime) {
+			UINT64 interval = now - priv->lastReceivedTime;
+
+			priv->accumulatedReceiveInterval += interval;
+			if (interval > priv->maxReceiveInterval)
+				priv->maxReceiveInterval = interval;
+		}
+		priv->lastReceivedTime = now;
+		priv->packetsReceived++;
+
+		/*
+		 * Batch samples up to target latency so pulseaudio is woken up once
+		 * per batch, larger packets from client go through without copy.
+		 */
+		if (priv->batchBytes) {
+			UINT copy = MIN((UINT)bytes, priv->batchBufferSize - priv->batchBytes);
+
+			memcpy(priv->batchBuffer + priv->batchBytes, data, copy);
+			priv->batchBytes += copy;
+			data += copy;
+			bytes -= copy;
+			if (priv->batchBytes == priv->batchBufferSize) {
+				sent = rdp_audioin_send_to_source(priv, priv->batchBuffer,
+								  priv->batchBytes);
+				if (sent != (int)priv->batchBytes)
+					failed = TRUE;
+				priv->batchBytes = 0;
+			}
+		}
+		if (!failed && (UINT)bytes >= priv->batchBufferSize) {
+			sent = rdp_audioin_send_to_source(priv, data, bytes);
+			if (sent != bytes)
+				failed = TRUE;
+		} else if (!failed && bytes) {
+			memcpy(priv->batchBuffer, data, bytes);
+			priv->batchBytes = bytes;
+		}
+
+		if (failed) {
+			priv->batchBytes = 0;
 
 			/* Unblock worker thread to close pipe to pulseaudio */
 			uint64_t one=1;
@@ -431,6 +520,7 @@ rdp_audioin_source_thread(void *context)
 			continue;
 		} else {
 			rdp_audio_debug(priv, "AudioIn connection successful on socket (%d).\n", priv->pulseAudioSourceFd);
+			rdp_audioin_reset_stats(priv);
 			if (priv->audin_server_context->Open(priv->audin_server_context)) {
 				rdp_audio_debug(priv, "RDP AudioIn opened.\n");
 				/*
@@ -443,6 +533,7 @@ rdp_audioin_source_thread(void *context)
 				}
 				priv->audin_server_context->Close(priv->audin_server_context);
 				rdp_audio_debug(priv, "RDP AudioIn closed.\n");
+				rdp_audioin_dump_stats(priv);
 			} else {
 				weston_log("Failed to open audio in connection with RDP client.\n");
 			}
@@ -467,6 +558,8 @@ void *
 rdp_audio_in_init(struct weston_compositor *c, HANDLE vcm)
 {
 	struct audio_in_private *priv;
+	AUDIO_FORMAT *dst_format;
+	char *s;
 
 	priv = xzalloc(sizeof *priv);
 	priv->audin_server_context = audin_server_context_new(vcm);
@@ -484,6 +577,16 @@ rdp_audio_in_init(struct weston_compositor *c, HANDLE vcm)
 	priv->pulseAudioSourceFd = -1;
 	priv->closeAudioSourceFd = -1;
 
+	priv->targetLatency = AUDIOIN_DEFAULT_LATENCY;
+	s = getenv("WESTON_RDP_AUDIO_IN_LATENCY");
+	if (s) {
+		int latency = atoi(s);
+
+		if (latency > 0 && latency <= AUDIOIN_MAX_LATENCY)
+			priv->targetLatency = latency;
+		rdp_audio_debug(priv, "RDPAudioIn - target latency %d msec.\n", priv->targetLatency);
+	}
+
 	// this will be freed by FreeRDP at audin_server_context_free.
 	AUDIO_FORMAT *audio_formats = malloc(sizeof rdp_audioin_supported_audio_formats);
 	if (!audio_formats) {
@@ -498,8 +601,13 @@ rdp_audio_in_init(struct weston_compositor *c, HANDLE vcm)
 	priv->audin_server_context->ReceiveSamples = rdp_audioin_client_receive_samples;
 	priv->audin_server_context->num_server_formats = ARRAYSIZE(rdp_audioin_supported_audio_formats);
 	priv->audin_server_context->server_formats = audio_formats;
-	priv->audin_server_context->dst_format = &rdp_audioin_supported_audio_formats[0];
-	priv->audin_server_context->frames_per_packet = rdp_audioin_supported_audio_formats[0].nSamplesPerSec / 100; // 10ms per packet
+	dst_format = &rdp_audioin_supported_audio_formats[0];
+	priv->audin_server_context->dst_format = dst_format;
+	priv->audin_server_context->frames_per_packet = dst_format->nSamplesPerSec * priv->targetLatency / 1000;
+
+	/* in case client doesn't honor frames_per_packet, batch on our side too. */
+	priv->batchBufferSize = priv->audin_server_context->frames_per_packet * dst_format->nBlockAlign;
+	priv->batchBuffer = xmalloc(priv->batchBufferSize);
 
 	priv->closeAudioSourceFd = eventfd(0, EFD_CLOEXEC);
 	if (priv->closeAudioSourceFd < 0) {
@@ -538,6 +646,7 @@ Error_Exit:
 		audin_server_context_free(priv->audin_server_context);
 		priv->audin_server_context = NULL;
 	}
+	free(priv->batchBuffer);
 	free(priv);
 
 	return NULL; // Continue without audio
@@ -576,5 +685,6 @@ rdp_audio_in_destroy(void *audio_in_private)
 		audin_server_context_free(priv->audin_server_context);
 		priv->audin_server_context = NULL;
 	}
+	free(priv->batchBuffer);
 	free(priv);
 }
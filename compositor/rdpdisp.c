@@ -401,6 +401,10 @@ disp_monitor_validate_and_compute_layout(struct weston_compositor *ec)
 				weston_output_enable(output);
 		}
 
+		/* clients supporting fractional scale render at the exact
+		   client scale instead of the rounded output scale. */
+		weston_output_set_fractional_scale(output, client_scale);
+
 		/* Notify clients for updated resolution/scale. */
 		weston_output_set_transform(output, WL_OUTPUT_TRANSFORM_NORMAL);
 
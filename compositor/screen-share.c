@@ -79,8 +79,8 @@ struct shared_output {
 
 	int cache_dirty;
 	pixman_image_t *cache_image;
-	uint32_t *tmp_data;
-	size_t tmp_data_size;
+	/* ss_read::link, read backs in flight in repaint order */
+	struct wl_list reads;
 };
 
 struct ss_seat {
@@ -574,42 +574,6 @@ output_compute_transform(struct weston_output *output,
 static void
 shared_output_destroy(struct shared_output *so);
 
-static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
-{
-	pixman_box32_t *ext;
-	size_t size;
-
-	if (!pixman_region32_not_empty(region))
-		return 0;
-
-	ext = pixman_region32_extents(region);
-
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
-
-	if (so->tmp_data != NULL && size <= so->tmp_data_size)
-		return 0;
-
-	free(so->tmp_data);
-	so->tmp_data = malloc(size);
-	if (so->tmp_data == NULL) {
-		so->tmp_data_size = 0;
-		errno = ENOMEM;
-		return -1;
-	}
-
-	so->tmp_data_size = size;
-
-	return 0;
-}
-
 static void
 shared_output_update(struct shared_output *so);
 
@@ -813,24 +777,130 @@ struct zwp_fullscreen_shell_mode_feedback_v1_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
+/* Damage of one repaint, read back from the renderer without stalling on
+ * it. The damage reaches the shm buffers only once its pixels are in the
+ * cache, so a buffer sent meanwhile does not lose it. */
+struct ss_read {
+	struct shared_output *so;	/* NULL once the share is gone */
+	struct wl_list link;		/* shared_output::reads */
+	pixman_region32_t damage;	/* output coordinates */
+	pixman_region32_t buffer_damage; /* read back, buffer coordinates */
+	uint32_t *pixels;		/* each rectangle tightly packed */
+	int pending;
+	bool failed;
+};
+
+static void
+ss_read_destroy(struct ss_read *read)
+{
+	wl_list_remove(&read->link);
+	pixman_region32_fini(&read->damage);
+	pixman_region32_fini(&read->buffer_damage);
+	free(read->pixels);
+	free(read);
+}
+
+static void
+shared_output_read_complete(struct shared_output *so, struct ss_read *read)
+{
+	struct ss_shm_buffer *sb;
+	pixman_image_t *damaged_image;
+	pixman_transform_t transform;
+	pixman_box32_t *r;
+	uint32_t *pixels = read->pixels;
+	int32_t width, height;
+	int i, nrects, do_yflip;
+
+	do_yflip = !!(so->output->compositor->capabilities &
+		      WESTON_CAP_CAPTURE_YFLIP);
+
+	r = pixman_region32_rectangles(&read->buffer_damage, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		damaged_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+							 width, height,
+							 pixels,
+				(PIXMAN_FORMAT_BPP(PIXMAN_a8r8g8b8) / 8) * width);
+		pixels += width * height;
+		if (!damaged_image)
+			continue;
+
+		if (do_yflip) {
+			pixman_transform_init_scale(&transform,
+						    pixman_fixed_1,
+						    pixman_fixed_minus_1);
+
+			pixman_transform_translate(&transform, NULL,
+						   0,
+						   pixman_int_to_fixed(height));
+
+			pixman_image_set_transform(damaged_image, &transform);
+		}
+
+		pixman_image_composite32(PIXMAN_OP_SRC,
+					 damaged_image,
+					 NULL,
+					 so->cache_image,
+					 0, 0,
+					 0, 0,
+					 r[i].x1, r[i].y1,
+					 width, height);
+		pixman_image_unref(damaged_image);
+	}
+
+	/* Apply damage to all buffers */
+	wl_list_for_each(sb, &so->shm.buffers, link)
+		pixman_region32_union(&sb->damage, &sb->damage, &read->damage);
+
+	so->cache_dirty = 1;
+	shared_output_update(so);
+}
+
+static void
+shared_output_read_done(void *data, int status)
+{
+	struct ss_read *read = data;
+	struct shared_output *so = read->so;
+
+	if (status < 0)
+		read->failed = true;
+
+	if (--read->pending > 0)
+		return;
+
+	if (so && !read->failed)
+		shared_output_read_complete(so, read);
+
+	ss_read_destroy(read);
+}
+
 static void
 shared_output_repainted(struct wl_listener *listener, void *data)
 {
 	struct shared_output *so =
 		container_of(listener, struct shared_output, frame_listener);
-	pixman_region32_t damage;
 	pixman_region32_t *current_damage = data;
-	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
+	struct ss_read *read;
+	int32_t width, height, stride;
 	int i, nrects, do_yflip, y_orig;
 	pixman_box32_t *r;
-	pixman_image_t *damaged_image;
-	pixman_transform_t transform;
+	uint32_t *pixels;
+	size_t size;
 
 	width = so->output->current_mode->width;
 	height = so->output->current_mode->height;
 	stride = width;
 
+	read = zalloc(sizeof *read);
+	if (!read)
+		goto err_shared_output;
+	read->so = so;
+	wl_list_insert(so->reads.prev, &read->link);
+	pixman_region32_init(&read->damage);
+	pixman_region32_init(&read->buffer_damage);
+
 	if (!so->cache_image ||
 	    pixman_image_get_width(so->cache_image) != width ||
 	    pixman_image_get_height(so->cache_image) != height) {
@@ -842,86 +912,71 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 						 width, height, NULL,
 						 stride);
 		if (!so->cache_image)
-			goto err_shared_output;
+			goto err_read;
 
-		pixman_region32_init_rect(&damage, 0, 0, width, height);
+		pixman_region32_union_rect(&read->damage, &read->damage,
+					   0, 0, width, height);
 	} else {
 		/* Damage in output coordinates */
-		pixman_region32_init(&damage);
-		pixman_region32_intersect(&damage, &so->output->region, current_damage);
-		pixman_region32_translate(&damage, -so->output->x, -so->output->y);
+		pixman_region32_intersect(&read->damage, &so->output->region,
+					  current_damage);
+		pixman_region32_translate(&read->damage,
+					  -so->output->x, -so->output->y);
 	}
 
-	/* Apply damage to all buffers */
-	wl_list_for_each(sb, &so->shm.buffers, link)
-		pixman_region32_union(&sb->damage, &sb->damage, &damage);
-
 	/* Transform to buffer coordinates */
 	weston_transformed_region(so->output->width, so->output->height,
 				  so->output->transform,
 				  so->output->current_scale,
-				  &damage, &damage);
+				  &read->damage, &read->buffer_damage);
 
-	if (shared_output_ensure_tmp_data(so, &damage) < 0)
-		goto err_pixman_init;
+	r = pixman_region32_rectangles(&read->buffer_damage, &nrects);
+	if (nrects == 0) {
+		ss_read_destroy(read);
+		return;
+	}
+
+	size = 0;
+	for (i = 0; i < nrects; ++i)
+		size += (size_t) (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+	read->pixels = malloc(size * 4);
+	if (!read->pixels)
+		goto err_read;
 
 	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
-	r = pixman_region32_rectangles(&damage, &nrects);
+	/* read backs complete from the event loop, never from here */
+	read->pending = nrects;
+	pixels = read->pixels;
 	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
 		if (do_yflip)
 			y_orig = so->output->current_mode->height - r[i].y2;
 		else
-			y_orig = y;
-
-		so->output->compositor->renderer->read_pixels(
-			so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-			x, y_orig, width, height);
-
-		damaged_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
-							 width, height,
-							 so->tmp_data,
-				(PIXMAN_FORMAT_BPP(PIXMAN_a8r8g8b8) / 8) * width);
-		if (!damaged_image)
-			goto err_pixman_init;
-
-		if (do_yflip) {
-			pixman_transform_init_scale(&transform,
-						    pixman_fixed_1,
-						    pixman_fixed_minus_1);
-
-			pixman_transform_translate(&transform, NULL,
-						   0,
-						   pixman_int_to_fixed(height));
-
-			pixman_image_set_transform(damaged_image, &transform);
+			y_orig = r[i].y1;
+
+		if (weston_renderer_read_pixels_async(so->output,
+						      PIXMAN_a8r8g8b8, pixels,
+						      r[i].x1, y_orig,
+						      width, height,
+						      shared_output_read_done,
+						      read) < 0) {
+			read->failed = true;
+			read->pending--;
 		}
 
-		pixman_image_composite32(PIXMAN_OP_SRC,
-					 damaged_image,
-					 NULL,
-					 so->cache_image,
-					 0, 0,
-					 0, 0,
-					 x, y,
-					 width, height);
-		pixman_image_unref(damaged_image);
+		pixels += width * height;
 	}
 
-	so->cache_dirty = 1;
-
-	pixman_region32_fini(&damage);
-	shared_output_update(so);
+	if (read->pending == 0)
+		ss_read_destroy(read);
 
 	return;
 
-err_pixman_init:
-	pixman_region32_fini(&damage);
+err_read:
+	ss_read_destroy(read);
 err_shared_output:
 	shared_output_destroy(so);
 }
@@ -1006,6 +1061,7 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	wl_list_init(&so->reads);
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
@@ -1033,9 +1089,17 @@ static void
 shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
+	struct ss_read *read, *rnext;
 
 	weston_output_disable_planes_decr(so->output);
 
+	/* their done callbacks still come, and free them */
+	wl_list_for_each_safe(read, rnext, &so->reads, link) {
+		read->so = NULL;
+		wl_list_remove(&read->link);
+		wl_list_init(&read->link);
+	}
+
 	wl_list_for_each_safe(buffer, bnext, &so->shm.buffers, link)
 		ss_shm_buffer_destroy(buffer);
 	wl_list_for_each_safe(buffer, bnext, &so->shm.free_buffers, free_link)
@@ -1048,7 +1112,6 @@ shared_output_destroy(struct shared_output *so)
 	wl_list_remove(&so->frame_listener.link);
 
 	pixman_image_unref(so->cache_image);
-	free(so->tmp_data);
 
 	free(so);
 }
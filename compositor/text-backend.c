@@ -122,6 +122,16 @@ input_method_context_end_keyboard_grab(struct input_method_context *context);
 static void
 input_method_init_seat(struct weston_seat *seat);
 
+/* Events are otherwise flushed to clients once per event loop iteration,
+ * after everything else the compositor does in it. A key press goes to the
+ * input method, its preedit or commit to the text input, and each hop could
+ * wait that long, so the events ending a hop are sent right away. */
+static void
+text_backend_flush(struct wl_resource *resource)
+{
+	wl_client_flush(wl_resource_get_client(resource));
+}
+
 static void
 deactivate_input_method(struct input_method *input_method)
 {
@@ -258,6 +268,7 @@ text_input_reset(struct wl_client *client,
 			continue;
 		zwp_input_method_context_v1_send_reset(
 			input_method->context->resource);
+		text_backend_flush(input_method->context->resource);
 	}
 }
 
@@ -314,6 +325,7 @@ text_input_invoke_action(struct wl_client *client,
 			continue;
 		zwp_input_method_context_v1_send_invoke_action(
 			input_method->context->resource, button, index);
+		text_backend_flush(input_method->context->resource);
 	}
 }
 
@@ -331,6 +343,7 @@ text_input_commit_state(struct wl_client *client,
 			continue;
 		zwp_input_method_context_v1_send_commit_state(
 			input_method->context->resource, serial);
+		text_backend_flush(input_method->context->resource);
 	}
 }
 
@@ -496,9 +509,11 @@ input_method_context_commit_string(struct wl_client *client,
 	struct input_method_context *context =
 		wl_resource_get_user_data(resource);
 
-	if (context->input)
+	if (context->input) {
 		zwp_text_input_v1_send_commit_string(context->input->resource,
 						     serial, text);
+		text_backend_flush(context->input->resource);
+	}
 }
 
 static void
@@ -511,9 +526,11 @@ input_method_context_preedit_string(struct wl_client *client,
 	struct input_method_context *context =
 		wl_resource_get_user_data(resource);
 
-	if (context->input)
+	if (context->input) {
 		zwp_text_input_v1_send_preedit_string(context->input->resource,
 						      serial, text, commit);
+		text_backend_flush(context->input->resource);
+	}
 }
 
 static void
@@ -597,10 +614,12 @@ input_method_context_keysym(struct wl_client *client,
 	struct input_method_context *context =
 		wl_resource_get_user_data(resource);
 
-	if (context->input)
+	if (context->input) {
 		zwp_text_input_v1_send_keysym(context->input->resource,
 					      serial, time,
 					      sym, state, modifiers);
+		text_backend_flush(context->input->resource);
+	}
 }
 
 static void
@@ -632,6 +651,7 @@ input_method_context_grab_key(struct weston_keyboard_grab *grab,
 	msecs = timespec_to_msec(time);
 	wl_keyboard_send_key(keyboard->input_method_resource,
 			     serial, msecs, key, state_w);
+	text_backend_flush(keyboard->input_method_resource);
 }
 
 static void
@@ -79,8 +79,31 @@ screenshooter_shoot(struct wl_client *client,
 	weston_screenshooter_shoot(output, buffer, screenshooter_done, resource);
 }
 
+static void
+screenshooter_shoot_region(struct wl_client *client,
+			   struct wl_resource *resource,
+			   struct wl_resource *output_resource,
+			   struct wl_resource *buffer_resource,
+			   int32_t x, int32_t y,
+			   int32_t width, int32_t height)
+{
+	struct weston_output *output =
+		weston_head_from_resource(output_resource)->output;
+	struct weston_buffer *buffer =
+		weston_buffer_from_resource(buffer_resource);
+
+	if (buffer == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	weston_screenshooter_shoot_region(output, buffer, x, y, width, height,
+					  screenshooter_done, resource);
+}
+
 struct weston_screenshooter_interface screenshooter_implementation = {
-	screenshooter_shoot
+	screenshooter_shoot,
+	screenshooter_shoot_region
 };
 
 static void
@@ -93,7 +116,8 @@ bind_shooter(struct wl_client *client,
 		weston_compositor_is_debug_protocol_enabled(shooter->ec);
 
 	resource = wl_resource_create(client,
-				      &weston_screenshooter_interface, 1, id);
+				      &weston_screenshooter_interface,
+				      MIN(version, 2), id);
 
 	if (!debug_enabled && !shooter->client) {
 		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
@@ -188,7 +212,7 @@ screenshooter_create(struct weston_compositor *ec)
 	shooter->ec = ec;
 
 	shooter->global = wl_global_create(ec->wl_display,
-					   &weston_screenshooter_interface, 1,
+					   &weston_screenshooter_interface, 2,
 					   shooter, bind_shooter);
 	weston_compositor_add_key_binding(ec, KEY_S, MODIFIER_SUPER,
 					  screenshooter_binding, shooter);
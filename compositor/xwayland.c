@@ -45,6 +45,8 @@ struct wet_xwayland {
 	struct wl_client *client;
 	int wm_fd;
 	struct weston_process process;
+	int32_t idle_timeout;
+	struct wl_event_source *prewarm_source;
 };
 
 static int
@@ -137,13 +139,18 @@ spawn_xserver(void *user_data, const char *display, int abstract_fd, int unix_fd
 			"-core",				// 3
 			"-listen", unix_fd_str,	// 4, 5
 			"-wm", wm_fd_str,		// 6, 7
-			"-terminate",			// 8
+			NULL,					// 8 (-terminate)
 			NULL, NULL, 			// 9, 10 (-listen, abstract_fd_str)
 			NULL, 					// 11 (-ac)
 			NULL					// 12
 		};
 
-		int argc = 9;
+		int argc = 8;
+		/* With an idle timeout the compositor decides when the
+		 * server goes away. */
+		if (wxw->idle_timeout <= 0) {
+			argv[argc++] = "-terminate";
+		}
 		if (abstract_fd) {
 			argv[argc++] = "-listen";
 			argv[argc++] = abstract_fd_str;
@@ -201,6 +208,16 @@ xserver_cleanup(struct weston_process *process, int status)
 	wxw->client = NULL;
 }
 
+static void
+prewarm_xserver(void *data)
+{
+	struct wet_xwayland *wxw = data;
+
+	wxw->prewarm_source = NULL;
+	if (wxw->api->prewarm(wxw->xwayland) < 0)
+		weston_log("Failed to prewarm the Xwayland server.\n");
+}
+
 int
 wet_load_xwayland(struct weston_compositor *comp)
 {
@@ -208,6 +225,9 @@ wet_load_xwayland(struct weston_compositor *comp)
 	struct weston_xwayland *xwayland;
 	struct wet_xwayland *wxw;
 	struct wl_event_loop *loop;
+	struct weston_config *config = wet_get_config(comp);
+	struct weston_config_section *section;
+	bool prewarm;
 
 	if (weston_compositor_load_xwayland(comp) < 0)
 		return -1;
@@ -239,5 +259,23 @@ wet_load_xwayland(struct weston_compositor *comp)
 	wxw->sigusr1_source = wl_event_loop_add_signal(loop, SIGUSR1,
 						       handle_sigusr1, wxw);
 
+	section = weston_config_get_section(config, "xwayland", NULL, NULL);
+	weston_config_section_get_bool(section, "prewarm", &prewarm, false);
+	weston_config_section_get_int(section, "idle-timeout",
+				      &wxw->idle_timeout, 0);
+
+	if (wxw->idle_timeout > 0 &&
+	    api->set_idle_timeout(xwayland, wxw->idle_timeout * 1000) < 0) {
+		weston_log("Failed to set the Xwayland idle timeout.\n");
+		wxw->idle_timeout = 0;
+	}
+
+	/* Start the X server once the compositor has finished starting
+	 * up and goes idle, so the first X client does not pay for it. */
+	if (prewarm)
+		wxw->prewarm_source = wl_event_loop_add_idle(loop,
+							     prewarm_xserver,
+							     wxw);
+
 	return 0;
 }
@@ -31,6 +31,13 @@
 #include "shell.h"
 #include "shared/helpers.h"
 
+/* Upper bound on the number of views animated into or out of the
+ * overview at once. Every animated view is re-transformed and repainted
+ * on each frame of the transition, so with many windows the transition
+ * would no longer fit in the frame. The remaining views are moved
+ * straight to their final place. */
+#define EXPOSAY_MAX_ANIMATIONS 16
+
 struct exposay_surface {
 	struct desktop_shell *shell;
 	struct exposay_output *eoutput;
@@ -48,6 +55,10 @@ struct exposay_surface {
 	int row;
 	int column;
 
+	/* Whether the view takes part in the transition animations, see
+	 * EXPOSAY_MAX_ANIMATIONS */
+	bool animate;
+
 	/* The animations only apply a transformation for their own lifetime,
 	 * and don't have an option to indefinitely maintain the
 	 * transformation in a steady state - so, we apply our own once the
@@ -90,10 +101,8 @@ exposay_in_flight_dec(struct desktop_shell *shell)
 }
 
 static void
-exposay_animate_in_done(struct weston_view_animation *animation, void *data)
+exposay_surface_set_transform(struct exposay_surface *esurface)
 {
-	struct exposay_surface *esurface = data;
-
 	wl_list_insert(&esurface->view->geometry.transformation_list,
 	               &esurface->transform.link);
 	weston_matrix_init(&esurface->transform.matrix);
@@ -106,6 +115,14 @@ exposay_animate_in_done(struct weston_view_animation *animation, void *data)
 
 	weston_view_geometry_dirty(esurface->view);
 	weston_compositor_schedule_repaint(esurface->view->surface->compositor);
+}
+
+static void
+exposay_animate_in_done(struct weston_view_animation *animation, void *data)
+{
+	struct exposay_surface *esurface = data;
+
+	exposay_surface_set_transform(esurface);
 
 	exposay_in_flight_dec(esurface->shell);
 }
@@ -113,6 +130,11 @@ exposay_animate_in_done(struct weston_view_animation *animation, void *data)
 static void
 exposay_animate_in(struct exposay_surface *esurface)
 {
+	if (!esurface->animate) {
+		exposay_surface_set_transform(esurface);
+		return;
+	}
+
 	exposay_in_flight_inc(esurface->shell);
 
 	weston_move_scale_run(esurface->view,
@@ -136,13 +158,19 @@ exposay_animate_out_done(struct weston_view_animation *animation, void *data)
 static void
 exposay_animate_out(struct exposay_surface *esurface)
 {
-	exposay_in_flight_inc(esurface->shell);
-
 	/* Remove the static transformation set up by
-	 * exposay_transform_in_done(). */
+	 * exposay_surface_set_transform(). */
 	wl_list_remove(&esurface->transform.link);
 	weston_view_geometry_dirty(esurface->view);
 
+	if (!esurface->animate) {
+		weston_view_schedule_repaint(esurface->view);
+		exposay_surface_destroy(esurface);
+		return;
+	}
+
+	exposay_in_flight_inc(esurface->shell);
+
 	weston_move_scale_run(esurface->view,
 	                      esurface->x - esurface->view->geometry.x,
 	                      esurface->y - esurface->view->geometry.y,
@@ -361,6 +389,13 @@ exposay_layout(struct desktop_shell *shell, struct shell_output *shell_output)
 		if (shell->exposay.focus_current == esurface->view)
 			highlight = esurface;
 
+		/* Views are visited top of the stack first, so the cap
+		 * leaves out the ones most likely to be obscured anyway */
+		esurface->animate =
+			shell->exposay.num_animated < EXPOSAY_MAX_ANIMATIONS;
+		if (esurface->animate)
+			shell->exposay.num_animated++;
+
 		exposay_animate_in(esurface);
 
 		/* We want our destroy handler to be after the animation
@@ -610,7 +645,7 @@ exposay_set_inactive(struct desktop_shell *shell)
 static enum exposay_layout_state
 exposay_transition_inactive(struct desktop_shell *shell, int switch_focus)
 {
-	struct exposay_surface *esurface;
+	struct exposay_surface *esurface, *tmp;
 
 	/* Call activate() before we start the animations to avoid
 	 * animating back the old state and then immediately transitioning
@@ -624,10 +659,15 @@ exposay_transition_inactive(struct desktop_shell *shell, int switch_focus)
 		         shell->exposay.seat,
 			 WESTON_ACTIVATE_FLAG_CONFIGURE);
 
-	wl_list_for_each(esurface, &shell->exposay.surface_list, link)
+	wl_list_for_each_safe(esurface, tmp, &shell->exposay.surface_list, link)
 		exposay_animate_out(esurface);
 	weston_compositor_schedule_repaint(shell->compositor);
 
+	/* None of the remaining views was animated in, so there is no
+	 * animation to wait for. */
+	if (shell->exposay.in_flight == 0)
+		return exposay_set_inactive(shell);
+
 	return EXPOSAY_LAYOUT_ANIMATE_TO_INACTIVE;
 }
 
@@ -644,6 +684,7 @@ exposay_transition_active(struct desktop_shell *shell)
 	shell->exposay.focus_prev = get_default_view(keyboard->focus);
 	shell->exposay.focus_current = get_default_view(keyboard->focus);
 	shell->exposay.clicked = NULL;
+	shell->exposay.num_animated = 0;
 	wl_list_init(&shell->exposay.surface_list);
 
 	lower_fullscreen_layer(shell, NULL);
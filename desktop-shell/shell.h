@@ -81,6 +81,7 @@ struct exposay {
 	enum exposay_target_state state_target;
 	enum exposay_layout_state state_cur;
 	int in_flight; /* number of animations still running */
+	int num_animated; /* views animated in the current transition */
 
 	int row_current;
 	int column_current;
@@ -528,6 +528,23 @@ fs_output_configure_simple(struct fs_output *fsout,
 				fsout->output->height);
 }
 
+/* Whether the output already runs the mode a client asked for, in which case
+ * presenting for that mode needs no mode set and no full repaint. */
+static bool
+fs_output_mode_is_current(struct fs_output *fsout, struct weston_mode *mode)
+{
+	struct weston_output *output = fsout->output;
+	struct weston_mode *current = output->current_mode;
+
+	if (!current || output->current_scale != output->native_scale)
+		return false;
+
+	if (current->width != mode->width || current->height != mode->height)
+		return false;
+
+	return mode->refresh == 0 || mode->refresh == current->refresh;
+}
+
 static void
 fs_output_configure_for_mode(struct fs_output *fsout,
 			     struct weston_surface *configured_surface)
@@ -572,8 +589,11 @@ fs_output_configure_for_mode(struct fs_output *fsout,
 	mode.flags = 0;
 	mode.refresh = fsout->pending.framerate;
 
-	ret = weston_output_mode_switch_to_temporary(fsout->output, &mode,
-					fsout->output->native_scale);
+	if (fs_output_mode_is_current(fsout, &mode))
+		ret = 0;
+	else
+		ret = weston_output_mode_switch_to_temporary(fsout->output, &mode,
+						fsout->output->native_scale);
 
 	if (ret != 0) {
 		/* The mode switch failed.  Clear the pending and
@@ -48,6 +48,17 @@ struct weston_desktop;
 struct weston_desktop_client;
 struct weston_desktop_surface;
 
+/** Counters of the configure events of a surface, for debugging clients
+ * that redraw more often than needed. */
+struct weston_desktop_surface_configure_stats {
+	/** State changes the compositor made to the surface */
+	uint32_t changes;
+	/** Configure events sent, each coalescing one or more changes */
+	uint32_t sent;
+	/** Configure events acked while a newer one was already sent */
+	uint32_t superseded;
+};
+
 struct weston_desktop_api {
 	size_t struct_size;
 	void (*ping_timeout)(struct weston_desktop_client *client,
@@ -207,6 +218,9 @@ struct weston_size
 weston_desktop_surface_get_max_size(struct weston_desktop_surface *surface);
 struct weston_size
 weston_desktop_surface_get_min_size(struct weston_desktop_surface *surface);
+void
+weston_desktop_surface_get_configure_stats(struct weston_desktop_surface *surface,
+					   struct weston_desktop_surface_configure_stats *stats);
 
 void
 weston_desktop_api_maximized_requested(struct weston_desktop *desktop,
@@ -78,6 +78,19 @@ struct weston_drm_output_api {
 	 */
 	void (*set_seat)(struct weston_output *output,
 			 const char *seat);
+
+	/** Whether to use variable refresh rate, if all the heads and the
+	 *  CRTC of the output support it. The output then shows each frame
+	 *  as soon as it is ready, up to the rate of the mode, and repaints
+	 *  as soon as there is damage. Needs atomic modesetting.
+	 */
+	void (*set_vrr)(struct weston_output *output, bool enabled);
+
+	/** Whether a client buffer scanned out alone on the output may be
+	 *  flipped to without waiting for vblank, at the cost of tearing.
+	 *  Needs kernel support for asynchronous page flips.
+	 */
+	void (*set_allow_tearing)(struct weston_output *output, bool allow);
 };
 
 static inline const struct weston_drm_output_api *
@@ -226,6 +239,20 @@ struct weston_drm_backend_config {
 
 	/** Allow compositor to start without input devices. */
 	bool continue_without_input;
+
+	/** Start each repaint as late before vblank as the recent repaint
+	 * durations of the output allow, instead of a fixed repaint window.
+	 * Needs the GL renderer with native fence sync to see when the GPU
+	 * finished, otherwise only the CPU part of a repaint is counted. */
+	bool late_latching;
+
+	/** DRM device for the GL renderer, like "renderD129"
+	 *
+	 * If NULL or the same as the KMS device, render on the KMS device.
+	 * Otherwise frames are rendered on this GPU into linear buffers
+	 * which the KMS device imports for scanout, or copies if it cannot.
+	 */
+	char *render_device;
 };
 
 #ifdef  __cplusplus
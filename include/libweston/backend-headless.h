@@ -34,7 +34,7 @@ extern "C" {
 
 #include <libweston/libweston.h>
 
-#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 2
+#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 4
 
 struct weston_headless_backend_config {
 	struct weston_backend_config base;
@@ -44,6 +44,15 @@ struct weston_headless_backend_config {
 
 	/** Whether to use the GL renderer, conflicts with use_pixman */
 	bool use_gl;
+
+	/** Refresh rate of the outputs in mHz, at most 1000 Hz, or 0 for
+	 * the default of 60 Hz */
+	int refresh;
+
+	/** Whether outputs finish their frames as soon as they are
+	 * repainted and start the next one right away, rather than at
+	 * the refresh rate, to measure compositor throughput */
+	bool unthrottled;
 };
 
 #ifdef  __cplusplus
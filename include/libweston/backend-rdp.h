@@ -30,6 +30,9 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+#include <time.h>
+
 #include <libweston/libweston.h>
 #include <libweston/plugin-registry.h>
 
@@ -61,6 +64,35 @@ weston_rdp_output_get_api(struct weston_compositor *compositor)
 	return (const struct weston_rdp_output_api *)api;
 }
 
+/** Media clock of RDP sessions, in milliseconds of CLOCK_MONOTONIC
+ *
+ * Graphics frames and audio blocks sent to the client are both stamped
+ * with this clock, so the client can present audio in sync with frames
+ * instead of buffering it deep enough to hide the drift. RDPSND carries
+ * the low 16 bits, RDPGFX the form of weston_rdp_media_clock_to_gfx().
+ */
+static inline uint64_t
+weston_rdp_media_clock_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Media clock as RDPGFX StartFrame timestamp, hours, minutes, seconds
+ * and milliseconds in 10, 6, 6 and 10 bits. */
+static inline uint32_t
+weston_rdp_media_clock_to_gfx(uint64_t msec)
+{
+	uint32_t ms = msec % 1000;
+	uint32_t sec = (msec / 1000) % 60;
+	uint32_t min = (msec / 60000) % 60;
+	uint32_t hour = (msec / 3600000) % 1024;
+
+	return hour << 22 | min << 16 | sec << 10 | ms;
+}
+
 /* RDPRAIL api extension */
 
 struct weston_rdprail_shell_api {
@@ -162,7 +194,7 @@ struct weston_rdprail_api {
 	void (*start_window_move)(struct weston_surface *surface, 
 		int pointerGrabX, int pointerGrabY);
 
-	/** End local window move operation
+	/** End local window move or resize operation
 	 */
 	void (*end_window_move)(struct weston_surface *surface);
 
@@ -194,6 +226,13 @@ struct weston_rdprail_api {
 	/** Notify window proxy surface
 	 */
 	void (*notify_window_proxy_surface)(struct weston_surface *proxy_surface);
+
+	/** Start a local window resize operation, edges is a combination of
+	 * WL_SHELL_SURFACE_RESIZE_* values. The client reports the final
+	 * window rectangle once the resize is over.
+	 */
+	void (*start_window_resize)(struct weston_surface *surface,
+		int pointerGrabX, int pointerGrabY, uint32_t edges);
 };
 
 static inline const struct weston_rdprail_api *
@@ -215,6 +254,21 @@ struct weston_rdp_shared_memory {
 	char name[RDP_SHARED_MEMORY_NAME_SIZE + 1]; // +1 for NULL
 };
 
+/* grow only buffer reused across updates */
+struct weston_rdp_staging_buffer {
+	void *data;
+	size_t size;
+};
+
+/* content hash of each tile of an image as last sent, 0 if unknown */
+struct weston_rdp_tile_hashes {
+	uint64_t *hashes;
+	int columns;
+	int rows;
+	int width;
+	int height;
+};
+
 /* weston_surface_rail_state.showState_requested */
 #define RDP_WINDOW_HIDE 0x00
 #define RDP_WINDOW_SHOW_MINIMIZED 0x02
@@ -223,8 +277,10 @@ struct weston_rdp_shared_memory {
 #define RDP_WINDOW_SHOW 0x05
 
 struct weston_surface_rail_state {
+	struct weston_surface *surface;
 	struct wl_listener destroy_listener;
 	struct wl_listener repaint_listener;
+	struct wl_list dirty_link; /* to be visited at next repaint */
 	uint32_t window_id;
 	struct weston_rdp_rail_window_pos pos;
 	struct weston_rdp_rail_window_pos clientPos;
@@ -240,6 +296,7 @@ struct weston_surface_rail_state {
 	bool isCursor;
 	bool isWindowCreated;
 	bool isWindowSnapped;
+	uint16_t localMoveSizeType; /* RAIL_WMSZ_* of the local move/resize in progress, 0 if none */
 	uint32_t showState_requested;
 	uint32_t showState;
 	bool forceRecreateSurface;
@@ -247,6 +304,10 @@ struct weston_surface_rail_state {
 	bool error;
 	bool isUpdatePending;
 	bool isFirstUpdateDone;
+	bool isPreviewRefreshDue; /* send content while minimized or covered */
+	uint32_t contentGeneration; /* bumped by each commit bringing new content */
+	uint32_t sentContentGeneration; /* contentGeneration last sent to client */
+	char *title; /* window title last sent to client */
 	void *get_label;
 	int taskbarButton;
 
@@ -255,17 +316,85 @@ struct weston_surface_rail_state {
 	uint32_t window_margin_right;
 	uint32_t window_margin_bottom;
 
+	/* remoted window shadow, damage on it is held back while the
+	   window content is being updated (see rdp_rail_hold_shadow_damage). */
+	pixman_region32_t shadow_damage;
+	struct weston_geometry shadowGeometry; /* window geometry shadow was sent for */
+	bool isShadowRefreshDue;
+
 	/* gfxredir shared memory */
 	uint32_t pool_id;
 	uint32_t buffer_id;
 	void *surfaceBuffer;
-	struct weston_rdp_shared_memory shared_memory;
+	struct rdp_shared_memory_section *shared_memory_section; /* pooled */
 
 	/* rdpgfx surface */
 	uint32_t surface_id;
+	int surfaceWidth; /* allocated size, bufferWidth of it is mapped */
+	int surfaceHeight;
+	struct weston_rdp_staging_buffer staging_damage; /* packed damage */
+	struct weston_rdp_staging_buffer staging_alpha; /* alpha codec */
+	struct weston_rdp_staging_buffer staging_surface; /* window image as sent to client */
+	bool isStagingSurfaceValid; /* staging_surface holds entire window */
+	struct weston_rdp_tile_hashes tileHashes; /* of window image as sent */
+
+	/* rdpgfx AVC420 video mode */
+	void *avc_context; /* H264_CONTEXT */
+	bool isAvcEnabled;
+	uint32_t avc_large_update_count;
+	uint32_t avc_small_update_count;
+	struct timespec avc_last_update_time;
+
+	/* content sent with lossy codec, re-sent lossless once the window
+	   stays idle (see rdp_rail_schedule_refine). */
+	pixman_region32_t refineRegion; /* in rdpgfx surface coordinate */
+	uint32_t refine_motion_count;
+	struct timespec refine_last_update_time;
+	bool isRefineDue;
+	bool isRefining;
+
+	/* content type feeding codec choice, see rdp_gfx_codec_classify */
+	int content; /* enum rdp_gfx_content, as classified at last update */
+	int contentOverride; /* by app_id, from rail_config.gfx_content_overrides */
+	bool isContentOverrideResolved;
+
+	/* window of a disconnected client, kept for its reconnect, see
+	   rdp_rail_park_window. window_id stays reserved for it. */
+	bool isParked;
+	struct wl_list parked_link; /* rdp_backend::parked_window_list */
+
+	/* subsurface composited into its parent's window content instead of
+	   being remoted as a window, see rdp_rail_subsurface_can_flatten. */
+	bool isFlattened;
+	struct weston_geometry flattenedGeometry; /* in parent surface coordinate */
 };
 
-#define WESTON_RDP_BACKEND_CONFIG_VERSION 3
+#define WESTON_RDP_BACKEND_CONFIG_VERSION 4
+
+/* weston_rdp_backend_config.rail_config.gfx_codec */
+enum weston_rdp_gfx_codec {
+	WESTON_RDP_GFX_CODEC_AUTO = 0,
+	WESTON_RDP_GFX_CODEC_UNCOMPRESSED,
+	WESTON_RDP_GFX_CODEC_PLANAR,
+	WESTON_RDP_GFX_CODEC_PROGRESSIVE,
+};
+
+/* default damage area (in pixels) to switch from planar to progressive. */
+#define WESTON_RDP_GFX_CODEC_PROGRESSIVE_MIN_AREA (256 * 256)
+
+/* default window area (in pixels) to be considered for AVC420 video mode. */
+#define WESTON_RDP_GFX_AVC_MIN_AREA (320 * 240)
+
+/* weston_rdp_backend_config.encoder_threads, choose by number of CPUs. */
+#define WESTON_RDP_ENCODER_THREADS_AUTO (-1)
+
+/* weston_rdp_backend_config.render_threads, choose by number of CPUs. */
+#define WESTON_RDP_RENDER_THREADS_AUTO (-1)
+
+/* default damage optimizer limits, rects per update, and cost of one
+   more rect expressed in pixels it is worth sending to avoid it. */
+#define WESTON_RDP_DAMAGE_MAX_RECTS 16
+#define WESTON_RDP_DAMAGE_RECT_COST (32 * 32)
 
 typedef void *(*rdp_audio_in_setup)(struct weston_compositor *c, void *vcm);
 typedef void (*rdp_audio_in_teardown)(void *audio_private);
@@ -301,7 +430,39 @@ struct weston_rdp_backend_config {
 		bool enable_distro_name_title;
 		bool enable_copy_warning_title;
 		bool enable_display_power_by_screenupdate;
+		int gfx_codec; /* enum weston_rdp_gfx_codec */
+		int gfx_codec_progressive_min_area;
+		bool enable_gfx_avc;
+		int gfx_avc_min_area;
+		bool enable_gfx_scroll;
+		bool enable_gfx_cache;
+		bool enable_gfx_downscale;
+		bool enable_frame_pacing;
+		bool enable_shm_direct_copy; /* gfxredir only */
+		int preview_refresh_interval; /* msec, 0 to hold content of unseen windows until shown */
+		bool enable_gfx_classify; /* text lossless, image progressive, see rdp_gfx_codec_classify */
+		const char *gfx_content_overrides; /* "app_id=text|image|video,..." */
+		int reconnect_grace_sec; /* windows kept for client to reconnect, 0 to destroy at disconnect */
+		bool enable_subsurface_flattening; /* composite simple subsurfaces into parent window */
 	} rail_config;
+	int encoder_threads; /* 0 to encode at display loop */
+	int damage_max_rects; /* 0 to send damage as is */
+	int damage_rect_cost;
+	bool shared_encoding; /* encode once for peers with same codec */
+	bool coalesce_mouse_motion; /* merge motion within one input dispatch */
+	bool session_tls_cache; /* keep session TLS key in XDG_RUNTIME_DIR */
+	int render_threads; /* 0 or 1 to composite desktop at display loop */
+	bool redirect_touch; /* multi-touch input through RDPEI */
+	bool refine_quality; /* coarse updates while in motion, refined once idle */
+	bool network_autodetect; /* adapt to link measured by network auto-detect */
+	bool loop_channels; /* graphics and clipboard channels at display loop, not own threads */
+	int socket_buffer_size; /* SO_SNDBUF/SO_RCVBUF of peers, 0 for default */
+	bool tcp_nodelay;
+	bool cork_frames; /* TCP_CORK while frame is sent */
+	bool client_cursor; /* full desktop pointer drawn by client, not composited */
+	/* refresh rate in Hz of each client monitor, comma separated in
+	   client layout order, rdp_monitor_refresh_rate for the rest. */
+	const char *monitor_refresh_rates;
 };
 
 #ifdef  __cplusplus
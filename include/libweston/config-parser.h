@@ -114,6 +114,12 @@ weston_config_parse(const char *name);
 const char *
 weston_config_get_full_path(struct weston_config *config);
 
+bool
+weston_config_has_changed(struct weston_config *config);
+
+int
+weston_config_reload(struct weston_config **config);
+
 void
 weston_config_destroy(struct weston_config *config);
 
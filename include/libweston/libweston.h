@@ -161,6 +161,16 @@ struct weston_output_zoom {
 	struct weston_animation animation_z;
 	struct weston_spring spring_z;
 	struct wl_listener motion_listener;
+
+	/* Set by renderers that keep the unzoomed scene offscreen and
+	 * apply the zoom when presenting it. Panning or changing the zoom
+	 * level then resamples the offscreen scene instead of repainting
+	 * every view, and scene damage is repainted unzoomed. */
+	bool offscreen;
+	bool resample;
+	pixman_region32_t scene_damage; /* global, current frame */
+	struct weston_matrix scene_matrix; /* global to unzoomed output */
+	struct weston_matrix scene_inverse;
 };
 
 /* bit compatible with drm definitions. */
@@ -226,6 +236,8 @@ struct weston_head {
 	enum weston_hdcp_protection current_protection;
 };
 
+typedef void (*weston_renderer_read_done_func_t)(void *data, int status);
+
 /** Content producer for heads
  *
  * \rst
@@ -275,6 +287,18 @@ struct weston_output {
 	 *  next repaint should be run */
 	struct timespec next_repaint;
 
+	/** How long before the next vblank to start repainting, in ns.
+	 *  Zero means the compositor's repaint_msec; backends which predict
+	 *  their repaint duration set this to start as late as possible. */
+	int64_t repaint_window_nsec;
+
+	/** Set by the backend while the output shows a new frame as soon as
+	 *  it is submitted, up to the rate of current_mode, instead of at a
+	 *  fixed refresh (variable refresh rate, asynchronous flips). The
+	 *  next repaint then runs as soon as the previous one completes, so
+	 *  the frame rate follows client commits. */
+	bool unpaced_repaint;
+
 	/** For cancelling the idle_repaint callback on output destruction. */
 	struct wl_event_source *idle_repaint_source;
 
@@ -288,6 +312,8 @@ struct weston_output {
 	int disable_planes;
 	int destroying;
 	struct wl_list feedback_list;
+	/* frame time and latency histograms, see output-metrics.c */
+	struct weston_output_metrics *metrics;
 
 	uint32_t transform;
 	int32_t native_scale;
@@ -309,6 +335,16 @@ struct weston_output {
 	int (*repaint)(struct weston_output *output,
 			pixman_region32_t *damage,
 			void *repaint_data);
+	/* Optional renderer-only part of repaint. With parallel repaint
+	 * this is called on a worker thread before repaint(), with
+	 * repaint_offloaded set, and must not touch anything but the
+	 * renderer and the output's own buffers; renderers leave
+	 * frame_signal to the core meanwhile. Returns false if it rendered
+	 * nothing. repaint_offloaded stays set for repaint() only if it
+	 * did, and repaint() must not render again then. */
+	bool (*repaint_render)(struct weston_output *output,
+			       pixman_region32_t *damage);
+	bool repaint_offloaded;
 	void (*destroy)(struct weston_output *output);
 	void (*assign_planes)(struct weston_output *output, void *repaint_data);
 	int (*switch_mode)(struct weston_output *output, struct weston_mode *mode);
@@ -325,8 +361,21 @@ struct weston_output {
 			  uint16_t *g,
 			  uint16_t *b);
 
+	/** Captures a region of the next frame shown on the output, as
+	 *  composed by the display hardware, planes included. NULL if the
+	 *  backend cannot; on error, or when done is called with a
+	 *  negative status, read back the renderer instead. */
+	int (*capture_pixels_async)(struct weston_output *output,
+				    pixman_format_code_t format, void *pixels,
+				    uint32_t x, uint32_t y,
+				    uint32_t width, uint32_t height,
+				    weston_renderer_read_done_func_t done,
+				    void *data);
+
 	bool enabled; /**< is in the output_list, not pending list */
 	int scale;
+	/** Preferred scale for wp_fractional_scale_v1, 0 to use current_scale */
+	float fractional_scale;
 
 	int (*enable)(struct weston_output *output);
 	int (*disable)(struct weston_output *output);
@@ -512,6 +561,9 @@ struct weston_pointer {
 	struct wl_listener output_destroy_listener;
 
 	struct wl_list timestamps_list;
+	/* zwp_input_timestamps_v1 resources of the focus resources */
+	struct wl_array focus_timestamps;
+	bool focus_timestamps_valid;
 };
 
 /** libinput style calibration matrix
@@ -609,6 +661,9 @@ struct weston_touch {
 	struct timespec grab_time;
 
 	struct wl_list timestamps_list;
+	/* zwp_input_timestamps_v1 resources of the focus resources */
+	struct wl_array focus_timestamps;
+	bool focus_timestamps_valid;
 };
 
 void
@@ -761,6 +816,9 @@ struct weston_keyboard {
 	struct xkb_keymap *pending_keymap;
 
 	struct wl_list timestamps_list;
+	/* zwp_input_timestamps_v1 resources of the focus resources */
+	struct wl_array focus_timestamps;
+	bool focus_timestamps_valid;
 };
 
 struct weston_seat {
@@ -875,6 +933,8 @@ struct weston_layer {
 	enum weston_layer_position position;
 	pixman_box32_t mask;
 	struct weston_layer_entry view_list;
+	/* content rarely changes, see weston_layer_set_static() */
+	bool is_static;
 };
 
 struct weston_plane {
@@ -890,6 +950,14 @@ struct weston_renderer {
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+
+	/** See weston_renderer_read_pixels_async(), optional */
+	int (*read_pixels_async)(struct weston_output *output,
+				 pixman_format_code_t format, void *pixels,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_renderer_read_done_func_t done,
+				 void *data);
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
 	void (*flush_damage)(struct weston_surface *surface);
@@ -924,6 +992,10 @@ struct weston_renderer {
 	void (*query_dmabuf_modifiers)(struct weston_compositor *ec,
 				int format, uint64_t **modifiers,
 				int *num_modifiers);
+
+	/** See weston_output_set_color_lut(), optional */
+	int (*output_set_color_lut)(struct weston_output *output,
+				    const uint16_t *lut, unsigned int size);
 };
 
 enum weston_capability {
@@ -1017,6 +1089,10 @@ struct weston_compositor {
 	struct wl_display *wl_display;
 	struct weston_desktop_xwayland *xwayland;
 	const struct weston_desktop_xwayland_interface *xwayland_interface;
+	/* Set by shells whose windows are decorated elsewhere (e.g. by the
+	 * RDP client in RAIL mode); the Xwayland window manager then draws
+	 * no frames or shadows for X11 windows. */
+	bool shell_draws_xwayland_decorations;
 
 	/* surface signals */
 	struct wl_signal create_surface_signal;
@@ -1045,6 +1121,10 @@ struct weston_compositor {
 	struct wl_signal session_signal;
 	bool session_active;
 
+	/* see weston_compositor_trim_memory() */
+	struct wl_signal memory_report_signal; /* arg: weston_memory_report */
+	struct wl_signal memory_trim_signal; /* arg: weston_compositor */
+
 	struct weston_layer fade_layer;
 	struct weston_layer cursor_layer;
 
@@ -1054,6 +1134,21 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
+	/* view_list must be rebuilt from the layers, see
+	 * weston_compositor_build_view_list() */
+	bool view_list_dirty;
+
+	/* Views of view_list bucketed into vertical strips between the
+	 * x edges of their bounding boxes, see weston_compositor_pick_view().
+	 * Rebuilt on next pick once dirty. */
+	struct {
+		bool dirty;
+		struct wl_array views;	/* struct weston_view *, view_list order */
+		struct wl_array edges;	/* int32_t, sorted unique x edges */
+		struct wl_array strips;	/* uint32_t, first entry of each strip */
+		struct wl_array entries;	/* uint32_t, index into views */
+	} pick_index;
+
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -1090,6 +1185,17 @@ struct weston_compositor {
 	struct xkb_rule_names xkb_names;
 	struct xkb_context *xkb_context;
 	struct weston_xkb_info *xkb_info;
+	/* most recently used first */
+	struct wl_list keymap_cache_list; /* weston_keymap_cache_entry::link */
+	uint32_t keymap_cache_count;
+
+	/* Merge relative pointer motion from libinput over one batch of
+	 * events, so that high rate mice cause one repick per batch. */
+	bool accumulate_pointer_motion;
+
+	/* Damage of one commit with more rectangles than this is reduced to
+	 * its extents, 0 means no limit. */
+	int surface_damage_max_rects;
 
 	int32_t kb_repeat_rate;
 	int32_t kb_repeat_delay;
@@ -1098,6 +1204,8 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	/* see weston_compositor_set_parallel_repaint() */
+	struct weston_repaint_pool *repaint_pool;
 
 	unsigned int activate_serial;
 
@@ -1111,6 +1219,25 @@ struct weston_compositor {
 	/* Whether to let the compositor run without any input device. */
 	bool require_input;
 
+	/* Hold back commits whose acquire fence has not signaled yet,
+	 * instead of having the renderer wait for it during repaint. */
+	bool defer_fenced_commits;
+
+	/* Frame callbacks of surfaces with nothing visible on any output
+	 * are sent at most this often; 0 sends them on every repaint. */
+	uint32_t occluded_frame_interval_msec;
+	/* Clients committing more often than this per second have their
+	 * frame callbacks held back for the rest of that second; 0 never
+	 * does. See client-stats.c. */
+	uint32_t client_commit_rate;
+	struct wl_list throttled_surface_list; /* weston_surface::throttle_link */
+	struct wl_event_source *throttle_timer;
+
+	/* Cursor images shared by the Xwayland WM and the backends */
+	struct wl_list cursor_image_list; /* weston_cursor_image::link */
+	uint32_t cursor_image_count;
+	size_t cursor_image_bytes;
+
 	/* Signal for a backend to inform a frontend about possible changes
 	 * in head status.
 	 */
@@ -1127,8 +1254,24 @@ struct weston_compositor {
 	struct weston_log_context *weston_log_ctx;
 	struct weston_log_scope *debug_scene;
 	struct weston_log_scope *timeline;
+	struct weston_log_scope *timeline_binary;
+	struct weston_log_scope *debug_output_metrics;
+	struct weston_log_scope *debug_memory;
+	struct weston_log_scope *debug_memory_trim;
+	struct weston_log_scope *debug_client_stats;
+	struct weston_log_scope *debug_client_stats_dump;
+	struct wl_event_source *client_stats_timer;
+	struct timespec client_stats_window_start;
+	/* see weston_compositor_set_metrics_file() */
+	char *metrics_file;
+	struct wl_event_source *metrics_timer;
 
 	struct content_protection *content_protection;
+
+	/* linux-dmabuf feedback, set up by the backend if it can tell
+	 * clients which buffers it is able to scan out */
+	struct weston_dmabuf_feedback *default_dmabuf_feedback;
+	struct weston_dmabuf_feedback_format_table *dmabuf_feedback_format_table;
 };
 
 struct weston_buffer {
@@ -1244,6 +1387,9 @@ struct weston_view {
 	unsigned int click_to_activate_serial;
 
 	pixman_region32_t clip;          /* See weston_view_damage_below() */
+	/* Fully covered by opaque views in front of it as of the last
+	 * repaint, so renderers can skip it. Updated with clip. */
+	bool occluded;
 	float alpha;                     /* part of geometry, see below */
 
 	void *renderer_state;
@@ -1311,6 +1457,10 @@ struct weston_view {
 	/* Per-surface Presentation feedback flags, controlled by backend. */
 	uint32_t psf_flags;
 
+	/* Why the backend could not put the view on a plane in the last
+	 * repaint, backend defined */
+	uint32_t try_view_on_plane_failure_reasons;
+
 	bool is_mapped;
 };
 
@@ -1326,6 +1476,11 @@ struct weston_surface_state {
 	pixman_region32_t damage_surface;
 	/* wl_surface.damage_buffer */
 	pixman_region32_t damage_buffer;
+	/* Rectangles of wl_surface.damage and wl_surface.damage_buffer not
+	 * yet added to the regions above, pixman_box32_t. Kept allocated
+	 * between commits. */
+	struct wl_array damage_surface_rects;
+	struct wl_array damage_buffer_rects;
 
 	/* wl_surface.set_opaque_region */
 	pixman_region32_t opaque;
@@ -1432,6 +1587,12 @@ struct weston_surface {
 	struct wl_list frame_callback_list;
 	struct wl_list feedback_list;
 
+	/* weston_compositor::throttled_surface_list, while the frame
+	 * callbacks are held back because the surface is occluded or its
+	 * client is over its commit budget, until throttle_deadline */
+	struct wl_list throttle_link;
+	struct timespec throttle_deadline;
+
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_viewport buffer_viewport;
 	int32_t width_from_buffer; /* before applying viewport */
@@ -1441,6 +1602,11 @@ struct weston_surface {
 	/* wp_viewport resource for this surface */
 	struct wl_resource *viewport_resource;
 
+	/* wp_fractional_scale_v1 resource for this surface, and the
+	 * preferred scale (in 1/120) last sent on it */
+	struct wl_resource *fractional_scale_resource;
+	uint32_t fractional_scale_sent;
+
 	/* All the pending state, that wl_surface.commit will apply. */
 	struct weston_surface_state pending;
 
@@ -1490,6 +1656,18 @@ struct weston_surface {
 	enum weston_hdcp_protection desired_protection;
 	enum weston_hdcp_protection current_protection;
 	enum weston_surface_protection_mode protection_mode;
+
+	/* created on the first zwp_linux_dmabuf_v1.get_surface_feedback */
+	struct weston_dmabuf_feedback *dmabuf_feedback;
+
+	/* Commits waiting for their acquire fence, see
+	 * weston_compositor::defer_fenced_commits */
+	struct {
+		struct weston_surface_state state;
+		struct weston_buffer_reference buffer_ref;
+		struct wl_event_source *fence_source;
+		bool has_data;
+	} deferred;
 };
 
 struct weston_subsurface {
@@ -1520,6 +1698,10 @@ struct weston_subsurface {
 
 	int synchronized;
 
+	/* This sub-surface or one below it has cached data or a pending
+	 * position, so a parent commit has to visit this branch. */
+	bool branch_dirty;
+
 	/* Used for constructing the view tree */
 	struct wl_list unused_views;
 };
@@ -1607,6 +1789,9 @@ weston_layer_set_mask_infinite(struct weston_layer *layer);
 bool
 weston_layer_mask_is_infinite(struct weston_layer *layer);
 
+void
+weston_layer_set_static(struct weston_layer *layer, bool is_static);
+
 /* An invalid flag in presented_flags to catch logic errors. */
 #define WP_PRESENTATION_FEEDBACK_INVALID (1U << 31)
 
@@ -1694,6 +1879,14 @@ void
 weston_compositor_set_default_pointer_grab(struct weston_compositor *compositor,
 			const struct weston_pointer_grab_interface *interface);
 
+int
+weston_compositor_set_parallel_repaint(struct weston_compositor *compositor,
+				       int num_threads);
+
+int
+weston_compositor_set_metrics_file(struct weston_compositor *compositor,
+				   const char *path);
+
 struct weston_surface *
 weston_surface_create(struct weston_compositor *compositor);
 
@@ -1774,6 +1967,58 @@ weston_surface_copy_content(struct weston_surface *surface,
 			    int src_width, int src_height,
 			    bool y_flip, bool is_argb);
 
+/** A cursor image in the compositor's cursor cache
+ *
+ * Images are either named, when loaded from a cursor theme, or keyed
+ * by a content hash, when produced from a client buffer. Either way a
+ * producer can show a cursor again without reloading or reading it
+ * back.
+ *
+ * \ingroup compositor
+ */
+struct weston_cursor_image {
+	struct wl_list link; /* weston_compositor::cursor_image_list */
+	char *name;
+	int size;
+	uint64_t key;
+	int32_t width, height;
+	int32_t hotspot_x, hotspot_y;
+	uint32_t *pixels; /* ARGB8888, stride width * 4 */
+};
+
+const struct weston_cursor_image *
+weston_compositor_find_cursor_image(struct weston_compositor *compositor,
+				    const char *name, int size);
+
+const struct weston_cursor_image *
+weston_compositor_find_cursor_image_by_key(struct weston_compositor *compositor,
+					   uint64_t key);
+
+const struct weston_cursor_image *
+weston_compositor_add_cursor_image(struct weston_compositor *compositor,
+				   const char *name, int size, uint64_t key,
+				   int32_t width, int32_t height,
+				   int32_t hotspot_x, int32_t hotspot_y,
+				   const void *pixels);
+
+struct weston_memory_report;
+
+void
+weston_memory_report_add(struct weston_memory_report *report,
+			 const char *subsystem, const char *item,
+			 unsigned int count, uint64_t bytes);
+
+void
+weston_compositor_trim_memory(struct weston_compositor *compositor);
+
+int
+weston_renderer_read_pixels_async(struct weston_output *output,
+				  pixman_format_code_t format, void *pixels,
+				  uint32_t x, uint32_t y,
+				  uint32_t width, uint32_t height,
+				  weston_renderer_read_done_func_t done,
+				  void *data);
+
 struct weston_buffer *
 weston_buffer_from_resource(struct wl_resource *resource);
 
@@ -1854,6 +2099,13 @@ typedef void (*weston_screenshooter_done_func_t)(void *data,
 int
 weston_screenshooter_shoot(struct weston_output *output, struct weston_buffer *buffer,
 			   weston_screenshooter_done_func_t done, void *data);
+int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data);
 struct weston_recorder *
 weston_recorder_start(struct weston_output *output, const char *filename);
 void
@@ -2025,10 +2277,18 @@ void
 weston_output_set_scale(struct weston_output *output,
 			int32_t scale);
 
+void
+weston_output_set_fractional_scale(struct weston_output *output,
+				   float scale);
+
 void
 weston_output_set_transform(struct weston_output *output,
 			    uint32_t transform);
 
+int
+weston_output_set_color_lut(struct weston_output *output,
+			    const uint16_t *lut, unsigned int size);
+
 void
 weston_output_init(struct weston_output *output,
 		   struct weston_compositor *compositor,
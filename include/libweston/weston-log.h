@@ -121,6 +121,21 @@ weston_log_subscribe(struct weston_log_context *log_ctx,
 struct weston_log_subscriber *
 weston_log_subscriber_create_log(FILE *dump_to);
 
+/** What an asynchronous log file subscriber does when its buffer is full
+ *
+ * @sa weston_log_subscriber_create_log_async
+ */
+enum weston_log_file_overflow {
+	/** the writing thread waits for the writer to make room */
+	WESTON_LOG_FILE_OVERFLOW_BLOCK = 0,
+	/** the message is dropped and counted */
+	WESTON_LOG_FILE_OVERFLOW_DROP,
+};
+
+struct weston_log_subscriber *
+weston_log_subscriber_create_log_async(FILE *dump_to, size_t buffer_size,
+				       enum weston_log_file_overflow overflow);
+
 struct weston_log_subscriber *
 weston_log_subscriber_create_flight_rec(size_t size);
 
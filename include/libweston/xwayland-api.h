@@ -30,6 +30,7 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <unistd.h>
 
 #include <libweston/plugin-registry.h>
@@ -109,6 +110,36 @@ struct weston_xwayland_api {
 	 */
 	void
 	(*xserver_exited)(struct weston_xwayland *xwayland, int exit_status);
+
+	/** Start the Xwayland server before any X client connects.
+	 *
+	 * Must be called after listen(). The server is spawned through the
+	 * \a spawn_func given there. Does nothing if it is already running.
+	 *
+	 * \param xwayland The Xwayland context object.
+	 *
+	 * \return 0 on success, a negative number otherwise.
+	 */
+	int
+	(*prewarm)(struct weston_xwayland *xwayland);
+
+	/** Stop the Xwayland server once it has been without X11 windows
+	 * for a while.
+	 *
+	 * Must be called after listen(). The server is started again on the
+	 * next X client connection. The spawn function should not pass
+	 * -terminate when this is used, so that the server outlives its
+	 * last client until the timeout.
+	 *
+	 * \param xwayland The Xwayland context object.
+	 * \param timeout_msec Time without windows before the server is
+	 *                     stopped, 0 to keep it running.
+	 *
+	 * \return 0 on success, a negative number otherwise.
+	 */
+	int
+	(*set_idle_timeout)(struct weston_xwayland *xwayland,
+			    uint32_t timeout_msec);
 };
 
 /** Retrieve the API object for the libweston Xwayland module.
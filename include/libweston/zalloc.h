@@ -38,6 +38,18 @@ zalloc(size_t size)
 	return calloc(1, size);
 }
 
+#ifdef WESTON_ALLOC_PROFILE
+/* see shared/alloc-profile.h */
+void
+weston_alloc_profile_note(const char *file, int line, const char *func,
+			  size_t size) __attribute__((weak));
+
+#define zalloc(size) \
+	(weston_alloc_profile_note ? \
+	 weston_alloc_profile_note(__FILE__, __LINE__, __func__, (size)) : \
+	 (void)0, zalloc(size))
+#endif
+
 #ifdef  __cplusplus
 }
 #endif
@@ -271,8 +271,8 @@ mode_divided_into_tiling(struct hmi_controller *hmi_ctrl,
 					IVI_LAYOUT_TRANSITION_LAYER_VIEW_ORDER,
 					duration);
 	}
-	for (i = idx; i < surf_num; i++)
-		hmi_ctrl->interface->surface_set_visibility(surfaces[i], false);
+	hmi_ctrl->interface->surfaces_set_visibility(surfaces + idx,
+						     surf_num - idx, false);
 
 	free(surfaces);
 	free(new_order);
@@ -336,12 +336,12 @@ mode_divided_into_sidebyside(struct hmi_controller *hmi_ctrl,
 		hmi_ctrl->interface->layer_set_render_order(ivilayer, new_order, i);
 	}
 
-	for (i = idx; i < surf_num; i++) {
-		hmi_ctrl->interface->surface_set_transition(surfaces[i],
-						IVI_LAYOUT_TRANSITION_VIEW_FADE_ONLY,
-						duration);
-		hmi_ctrl->interface->surface_set_visibility(surfaces[i], false);
-	}
+	hmi_ctrl->interface->surfaces_set_transition(surfaces + idx,
+					surf_num - idx,
+					IVI_LAYOUT_TRANSITION_VIEW_FADE_ONLY,
+					duration);
+	hmi_ctrl->interface->surfaces_set_visibility(surfaces + idx,
+						     surf_num - idx, false);
 
 	free(surfaces);
 	free(new_order);
@@ -591,6 +591,34 @@ struct ivi_layout_interface {
 	 */
 	int32_t (*screen_remove_layer)(struct weston_output *output,
 				       struct ivi_layout_layer *removelayer);
+
+	/**
+	 * \brief Set the visibility of several ivi_surfaces at once.
+	 *
+	 * Same as surface_set_visibility() on each of the 'number' surfaces
+	 * in 'surfaces'.
+	 *
+	 * \return IVI_SUCCEEDED if the method call was successful
+	 * \return IVI_FAILED if the method call was failed
+	 */
+	int32_t (*surfaces_set_visibility)(struct ivi_layout_surface **surfaces,
+					   int32_t number,
+					   bool newVisibility);
+
+	/**
+	 * \brief Set the type of transition animation of several ivi_surfaces
+	 * at once.
+	 *
+	 * Same as surface_set_transition() on each of the 'number' surfaces
+	 * in 'surfaces'.
+	 *
+	 * \return IVI_SUCCEEDED if the method call was successful
+	 * \return IVI_FAILED if the method call was failed
+	 */
+	int32_t (*surfaces_set_transition)(struct ivi_layout_surface **surfaces,
+					   int32_t number,
+					   enum ivi_layout_transition_type type,
+					   uint32_t duration);
 };
 
 static inline const struct ivi_layout_interface *
@@ -26,6 +26,7 @@
 #ifndef _ivi_layout_PRIVATE_H_
 #define _ivi_layout_PRIVATE_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <libweston/libweston.h>
@@ -47,6 +48,8 @@ struct ivi_layout_view {
 
 struct ivi_layout_surface {
 	struct wl_list link;	/* ivi_layout::surface_list */
+	struct wl_list dirty_link;	/* ivi_layout::dirty_surface_list */
+	struct wl_list commit_link;	/* ivi_layout::commit_surface_list */
 	struct wl_signal property_changed;
 	int32_t update_count;
 	uint32_t id_surface;
@@ -66,6 +69,8 @@ struct ivi_layout_surface {
 
 struct ivi_layout_layer {
 	struct wl_list link;	/* ivi_layout::layer_list */
+	struct wl_list dirty_link;	/* ivi_layout::dirty_layer_list */
+	struct wl_list commit_link;	/* ivi_layout::commit_layer_list */
 	struct wl_signal property_changed;
 	uint32_t id_layer;
 
@@ -97,6 +102,22 @@ struct ivi_layout {
 	struct wl_list screen_list;	/* ivi_layout_screen::link */
 	struct wl_list view_list;	/* ivi_layout_view::link */
 
+	/* Surfaces by id_surface, except IVI_INVALID_ID, and layers by
+	 * id_layer */
+	struct hash_table *surface_index;
+	struct hash_table *layer_index;
+
+	/* Surfaces and layers with pending changes since the last commit */
+	struct wl_list dirty_surface_list;	/* ivi_layout_surface::dirty_link */
+	struct wl_list dirty_layer_list;	/* ivi_layout_layer::dirty_link */
+
+	/* Surfaces and layers whose properties change in the commit being
+	 * processed: the dirty ones, plus the ones added to or removed
+	 * from a layer or screen */
+	struct wl_list commit_surface_list;	/* ivi_layout_surface::commit_link */
+	struct wl_list commit_layer_list;	/* ivi_layout_layer::commit_link */
+	bool view_list_dirty;
+
 	struct {
 		struct wl_signal created;
 		struct wl_signal removed;
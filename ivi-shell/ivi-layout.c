@@ -68,6 +68,7 @@
 #include "ivi-layout-private.h"
 #include "ivi-layout-shell.h"
 
+#include "shared/hash.h"
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
 
@@ -108,14 +109,18 @@ get_instance(void)
 }
 
 /**
- * Internal API to add/remove an ivi_layer to/from ivi_screen.
+ * Internal API to look up an ivi_surface/ivi_layer by id.
  */
 static struct ivi_layout_surface *
-get_surface(struct wl_list *surf_list, uint32_t id_surface)
+get_surface(struct ivi_layout *layout, uint32_t id_surface)
 {
 	struct ivi_layout_surface *ivisurf;
 
-	wl_list_for_each(ivisurf, surf_list, link) {
+	if (id_surface != IVI_INVALID_ID)
+		return hash_table_lookup(layout->surface_index, id_surface);
+
+	/* Desktop surfaces all share the invalid id and are not indexed */
+	wl_list_for_each(ivisurf, &layout->surface_list, link) {
 		if (ivisurf->id_surface == id_surface) {
 			return ivisurf;
 		}
@@ -125,17 +130,9 @@ get_surface(struct wl_list *surf_list, uint32_t id_surface)
 }
 
 static struct ivi_layout_layer *
-get_layer(struct wl_list *layer_list, uint32_t id_layer)
+get_layer(struct ivi_layout *layout, uint32_t id_layer)
 {
-	struct ivi_layout_layer *ivilayer;
-
-	wl_list_for_each(ivilayer, layer_list, link) {
-		if (ivilayer->id_layer == id_layer) {
-			return ivilayer;
-		}
-	}
-
-	return NULL;
+	return hash_table_lookup(layout->layer_index, id_layer);
 }
 
 static bool
@@ -245,7 +242,12 @@ ivi_layout_surface_destroy(struct ivi_layout_surface *ivisurf)
 		return;
 	}
 
+	if (ivisurf->id_surface != IVI_INVALID_ID)
+		hash_table_remove(layout->surface_index, ivisurf->id_surface);
+
 	wl_list_remove(&ivisurf->link);
+	wl_list_remove(&ivisurf->dirty_link);
+	wl_list_remove(&ivisurf->commit_link);
 
 	wl_list_for_each_safe(ivi_view, next, &ivisurf->view_list, surf_link) {
 		ivi_view_destroy(ivi_view);
@@ -315,6 +317,43 @@ init_surface_properties(struct ivi_layout_surface_properties *prop)
 	prop->dest_height = 1;
 }
 
+/**
+ * Internal APIs to track which ivi_surfaces and ivi_layers have to be
+ * looked at by the next ivi_layout_commit_changes.
+ */
+static void
+surface_mark_dirty(struct ivi_layout_surface *ivisurf)
+{
+	if (wl_list_empty(&ivisurf->dirty_link))
+		wl_list_insert(ivisurf->layout->dirty_surface_list.prev,
+			       &ivisurf->dirty_link);
+}
+
+static void
+layer_mark_dirty(struct ivi_layout_layer *ivilayer)
+{
+	if (wl_list_empty(&ivilayer->dirty_link))
+		wl_list_insert(ivilayer->layout->dirty_layer_list.prev,
+			       &ivilayer->dirty_link);
+}
+
+static void
+commit_add_surface(struct ivi_layout *layout,
+		   struct ivi_layout_surface *ivisurf)
+{
+	if (wl_list_empty(&ivisurf->commit_link))
+		wl_list_insert(layout->commit_surface_list.prev,
+			       &ivisurf->commit_link);
+}
+
+static void
+commit_add_layer(struct ivi_layout *layout, struct ivi_layout_layer *ivilayer)
+{
+	if (wl_list_empty(&ivilayer->commit_link))
+		wl_list_insert(layout->commit_layer_list.prev,
+			       &ivilayer->commit_link);
+}
+
 /**
  * Internal APIs to be called from ivi_layout_commit_changes.
  */
@@ -610,17 +649,36 @@ ivi_view_is_mapped(struct ivi_layout_view *ivi_view)
 static void
 commit_changes(struct ivi_layout *layout)
 {
+	struct ivi_layout_surface *ivisurf = NULL;
+	struct ivi_layout_layer *ivilayer = NULL;
 	struct ivi_layout_view *ivi_view  = NULL;
 
-	wl_list_for_each(ivi_view, &layout->view_list, link) {
-		/*
-		 * If the view is not on the currently rendered scenegraph,
-		 * we do not need to update its properties.
-		 */
-		if (!ivi_view_is_mapped(ivi_view))
-			continue;
+	/*
+	 * Only the views of changed surfaces and layers need their
+	 * properties updated. If the view is not on the currently rendered
+	 * scenegraph, we do not need to update its properties either.
+	 */
+	wl_list_for_each(ivisurf, &layout->commit_surface_list, commit_link) {
+		wl_list_for_each(ivi_view, &ivisurf->view_list, surf_link) {
+			if (!ivi_view_is_mapped(ivi_view))
+				continue;
 
-		update_prop(ivi_view);
+			update_prop(ivi_view);
+		}
+	}
+
+	wl_list_for_each(ivilayer, &layout->commit_layer_list, commit_link) {
+		wl_list_for_each(ivi_view, &ivilayer->order.view_list,
+				 order_link) {
+			/* already done with its surface */
+			if (!wl_list_empty(&ivi_view->ivisurf->commit_link))
+				continue;
+
+			if (!ivi_view_is_mapped(ivi_view))
+				continue;
+
+			update_prop(ivi_view);
+		}
 	}
 }
 
@@ -634,7 +692,7 @@ commit_surface_list(struct ivi_layout *layout)
 	int32_t dest_height = 0;
 	int32_t configured = 0;
 
-	wl_list_for_each(ivisurf, &layout->surface_list, link) {
+	wl_list_for_each(ivisurf, &layout->commit_surface_list, commit_link) {
 		if (ivisurf->pending.prop.transition_type == IVI_LAYOUT_TRANSITION_VIEW_DEFAULT) {
 			dest_x = ivisurf->prop.dest_x;
 			dest_y = ivisurf->prop.dest_y;
@@ -733,7 +791,7 @@ commit_layer_list(struct ivi_layout *layout)
 	struct ivi_layout_layer   *ivilayer = NULL;
 	struct ivi_layout_view *next     = NULL;
 
-	wl_list_for_each(ivilayer, &layout->layer_list, link) {
+	wl_list_for_each(ivilayer, &layout->commit_layer_list, commit_link) {
 		if (ivilayer->pending.prop.transition_type == IVI_LAYOUT_TRANSITION_LAYER_MOVE) {
 			ivi_layout_transition_move_layer(ivilayer, ivilayer->pending.prop.dest_x, ivilayer->pending.prop.dest_y, ivilayer->pending.prop.transition_duration);
 		} else if (ivilayer->pending.prop.transition_type == IVI_LAYOUT_TRANSITION_LAYER_FADE) {
@@ -755,6 +813,7 @@ commit_layer_list(struct ivi_layout *layout)
 			wl_list_remove(&ivi_view->order_link);
 			wl_list_init(&ivi_view->order_link);
 			ivi_view->ivisurf->prop.event_mask |= IVI_NOTIFICATION_REMOVE;
+			commit_add_surface(layout, ivi_view->ivisurf);
 		}
 
 		assert(wl_list_empty(&ivilayer->order.view_list));
@@ -764,6 +823,7 @@ commit_layer_list(struct ivi_layout *layout)
 			wl_list_remove(&ivi_view->order_link);
 			wl_list_insert(&ivilayer->order.view_list, &ivi_view->order_link);
 			ivi_view->ivisurf->prop.event_mask |= IVI_NOTIFICATION_ADD;
+			commit_add_surface(layout, ivi_view->ivisurf);
 		}
 
 		ivilayer->order.dirty = 0;
@@ -785,6 +845,7 @@ commit_screen_list(struct ivi_layout *layout)
 				wl_list_remove(&ivilayer->order.link);
 				wl_list_init(&ivilayer->order.link);
 				ivilayer->prop.event_mask |= IVI_NOTIFICATION_REMOVE;
+				commit_add_layer(layout, ivilayer);
 			}
 
 			assert(wl_list_empty(&iviscrn->order.layer_list));
@@ -798,6 +859,7 @@ commit_screen_list(struct ivi_layout *layout)
 					       &ivilayer->order.link);
 				ivilayer->on_screen = iviscrn;
 				ivilayer->prop.event_mask |= IVI_NOTIFICATION_ADD;
+				commit_add_layer(layout, ivilayer);
 			}
 
 			iviscrn->order.dirty = 0;
@@ -877,17 +939,83 @@ send_prop(struct ivi_layout *layout)
 	struct ivi_layout_layer   *ivilayer = NULL;
 	struct ivi_layout_surface *ivisurf  = NULL;
 
-	wl_list_for_each_reverse(ivilayer, &layout->layer_list, link) {
+	wl_list_for_each(ivilayer, &layout->commit_layer_list, commit_link) {
 		if (ivilayer->prop.event_mask)
 			send_layer_prop(ivilayer);
 	}
 
-	wl_list_for_each_reverse(ivisurf, &layout->surface_list, link) {
+	wl_list_for_each(ivisurf, &layout->commit_surface_list, commit_link) {
 		if (ivisurf->prop.event_mask)
 			send_surface_prop(ivisurf);
 	}
 }
 
+/* Take the surfaces and layers changed since the last commit */
+static void
+commit_begin(struct ivi_layout *layout)
+{
+	struct ivi_layout_surface *ivisurf, *next_surf;
+	struct ivi_layout_layer *ivilayer, *next_layer;
+
+	wl_list_for_each_safe(ivisurf, next_surf,
+			      &layout->dirty_surface_list, dirty_link) {
+		wl_list_remove(&ivisurf->dirty_link);
+		wl_list_init(&ivisurf->dirty_link);
+		commit_add_surface(layout, ivisurf);
+	}
+
+	wl_list_for_each_safe(ivilayer, next_layer,
+			      &layout->dirty_layer_list, dirty_link) {
+		wl_list_remove(&ivilayer->dirty_link);
+		wl_list_init(&ivilayer->dirty_link);
+		commit_add_layer(layout, ivilayer);
+	}
+}
+
+/* Check whether the commit changed what is in the scenegraph */
+static void
+commit_check_view_list(struct ivi_layout *layout)
+{
+	const uint32_t mask = IVI_NOTIFICATION_VISIBILITY |
+			      IVI_NOTIFICATION_ADD |
+			      IVI_NOTIFICATION_REMOVE;
+	struct ivi_layout_surface *ivisurf;
+	struct ivi_layout_layer *ivilayer;
+
+	wl_list_for_each(ivisurf, &layout->commit_surface_list, commit_link) {
+		if (ivisurf->prop.event_mask & mask)
+			layout->view_list_dirty = true;
+	}
+
+	wl_list_for_each(ivilayer, &layout->commit_layer_list, commit_link) {
+		if (ivilayer->prop.event_mask & mask)
+			layout->view_list_dirty = true;
+	}
+}
+
+/* The properties have been sent, nothing is pending anymore for the
+ * committed surfaces and layers. */
+static void
+commit_end(struct ivi_layout *layout)
+{
+	struct ivi_layout_surface *ivisurf, *next_surf;
+	struct ivi_layout_layer *ivilayer, *next_layer;
+
+	wl_list_for_each_safe(ivisurf, next_surf,
+			      &layout->commit_surface_list, commit_link) {
+		ivisurf->prop.event_mask = 0;
+		wl_list_remove(&ivisurf->commit_link);
+		wl_list_init(&ivisurf->commit_link);
+	}
+
+	wl_list_for_each_safe(ivilayer, next_layer,
+			      &layout->commit_layer_list, commit_link) {
+		ivilayer->prop.event_mask = 0;
+		wl_list_remove(&ivilayer->commit_link);
+		wl_list_init(&ivilayer->commit_link);
+	}
+}
+
 static void
 clear_view_pending_list(struct ivi_layout_layer *ivilayer)
 {
@@ -1011,30 +1139,16 @@ static struct ivi_layout_layer *
 ivi_layout_get_layer_from_id(uint32_t id_layer)
 {
 	struct ivi_layout *layout = get_instance();
-	struct ivi_layout_layer *ivilayer = NULL;
 
-	wl_list_for_each(ivilayer, &layout->layer_list, link) {
-		if (ivilayer->id_layer == id_layer) {
-			return ivilayer;
-		}
-	}
-
-	return NULL;
+	return get_layer(layout, id_layer);
 }
 
 struct ivi_layout_surface *
 ivi_layout_get_surface_from_id(uint32_t id_surface)
 {
 	struct ivi_layout *layout = get_instance();
-	struct ivi_layout_surface *ivisurf = NULL;
 
-	wl_list_for_each(ivisurf, &layout->surface_list, link) {
-		if (ivisurf->id_surface == id_surface) {
-			return ivisurf;
-		}
-	}
-
-	return NULL;
+	return get_surface(layout, id_surface);
 }
 
 static int32_t
@@ -1279,7 +1393,7 @@ ivi_layout_layer_create_with_dimension(uint32_t id_layer,
 	struct ivi_layout *layout = get_instance();
 	struct ivi_layout_layer *ivilayer = NULL;
 
-	ivilayer = get_layer(&layout->layer_list, id_layer);
+	ivilayer = get_layer(layout, id_layer);
 	if (ivilayer != NULL) {
 		weston_log("id_layer is already created\n");
 		++ivilayer->ref_count;
@@ -1292,6 +1406,12 @@ ivi_layout_layer_create_with_dimension(uint32_t id_layer,
 		return NULL;
 	}
 
+	if (hash_table_insert(layout->layer_index, id_layer, ivilayer) < 0) {
+		weston_log("fails to allocate memory\n");
+		free(ivilayer);
+		return NULL;
+	}
+
 	ivilayer->ref_count = 1;
 	wl_signal_init(&ivilayer->property_changed);
 	ivilayer->layout = layout;
@@ -1305,6 +1425,8 @@ ivi_layout_layer_create_with_dimension(uint32_t id_layer,
 
 	wl_list_init(&ivilayer->order.view_list);
 	wl_list_init(&ivilayer->order.link);
+	wl_list_init(&ivilayer->dirty_link);
+	wl_list_init(&ivilayer->commit_link);
 
 	wl_list_insert(&layout->layer_list, &ivilayer->link);
 
@@ -1335,8 +1457,12 @@ ivi_layout_layer_destroy(struct ivi_layout_layer *ivilayer)
 
 	wl_signal_emit(&layout->layer_notification.removed, ivilayer);
 
+	hash_table_remove(layout->layer_index, ivilayer->id_layer);
+
 	wl_list_remove(&ivilayer->pending.link);
 	wl_list_remove(&ivilayer->order.link);
+	wl_list_remove(&ivilayer->dirty_link);
+	wl_list_remove(&ivilayer->commit_link);
 	wl_list_remove(&ivilayer->link);
 
 	free(ivilayer);
@@ -1353,6 +1479,7 @@ ivi_layout_layer_set_visibility(struct ivi_layout_layer *ivilayer,
 		return IVI_FAILED;
 	}
 
+	layer_mark_dirty(ivilayer);
 	prop = &ivilayer->pending.prop;
 	prop->visibility = newVisibility;
 
@@ -1377,6 +1504,7 @@ ivi_layout_layer_set_opacity(struct ivi_layout_layer *ivilayer,
 		return IVI_FAILED;
 	}
 
+	layer_mark_dirty(ivilayer);
 	prop = &ivilayer->pending.prop;
 	prop->opacity = opacity;
 
@@ -1400,6 +1528,7 @@ ivi_layout_layer_set_source_rectangle(struct ivi_layout_layer *ivilayer,
 		return IVI_FAILED;
 	}
 
+	layer_mark_dirty(ivilayer);
 	prop = &ivilayer->pending.prop;
 	prop->source_x = x;
 	prop->source_y = y;
@@ -1428,6 +1557,7 @@ ivi_layout_layer_set_destination_rectangle(struct ivi_layout_layer *ivilayer,
 		return IVI_FAILED;
 	}
 
+	layer_mark_dirty(ivilayer);
 	prop = &ivilayer->pending.prop;
 	prop->dest_x = x;
 	prop->dest_y = y;
@@ -1471,6 +1601,7 @@ ivi_layout_layer_set_render_order(struct ivi_layout_layer *ivilayer,
 	}
 
 	ivilayer->order.dirty = 1;
+	layer_mark_dirty(ivilayer);
 
 	return IVI_SUCCEEDED;
 }
@@ -1486,6 +1617,7 @@ ivi_layout_surface_set_visibility(struct ivi_layout_surface *ivisurf,
 		return IVI_FAILED;
 	}
 
+	surface_mark_dirty(ivisurf);
 	prop = &ivisurf->pending.prop;
 	prop->visibility = newVisibility;
 
@@ -1510,6 +1642,7 @@ ivi_layout_surface_set_opacity(struct ivi_layout_surface *ivisurf,
 		return IVI_FAILED;
 	}
 
+	surface_mark_dirty(ivisurf);
 	prop = &ivisurf->pending.prop;
 	prop->opacity = opacity;
 
@@ -1533,6 +1666,7 @@ ivi_layout_surface_set_destination_rectangle(struct ivi_layout_surface *ivisurf,
 		return IVI_FAILED;
 	}
 
+	surface_mark_dirty(ivisurf);
 	prop = &ivisurf->pending.prop;
 	prop->start_x = prop->dest_x;
 	prop->start_y = prop->dest_y;
@@ -1732,6 +1866,7 @@ ivi_layout_layer_add_surface(struct ivi_layout_layer *ivilayer,
 	wl_list_insert(&ivilayer->pending.view_list, &ivi_view->pending_link);
 
 	ivilayer->order.dirty = 1;
+	layer_mark_dirty(ivilayer);
 
 	return IVI_SUCCEEDED;
 }
@@ -1753,6 +1888,7 @@ ivi_layout_layer_remove_surface(struct ivi_layout_layer *ivilayer,
 		wl_list_init(&ivi_view->pending_link);
 
 		ivilayer->order.dirty = 1;
+		layer_mark_dirty(ivilayer);
 	}
 }
 
@@ -1768,6 +1904,7 @@ ivi_layout_surface_set_source_rectangle(struct ivi_layout_surface *ivisurf,
 		return IVI_FAILED;
 	}
 
+	surface_mark_dirty(ivisurf);
 	prop = &ivisurf->pending.prop;
 	prop->source_x = x;
 	prop->source_y = y;
@@ -1789,16 +1926,25 @@ ivi_layout_commit_changes(void)
 {
 	struct ivi_layout *layout = get_instance();
 
+	commit_begin(layout);
+
 	commit_surface_list(layout);
 	commit_layer_list(layout);
 	commit_screen_list(layout);
-	build_view_list(layout);
+
+	commit_check_view_list(layout);
+	if (layout->view_list_dirty) {
+		build_view_list(layout);
+		layout->view_list_dirty = false;
+	}
 
 	commit_transition(layout);
 
 	commit_changes(layout);
 	send_prop(layout);
 
+	commit_end(layout);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1812,6 +1958,7 @@ ivi_layout_layer_set_transition(struct ivi_layout_layer *ivilayer,
 		return -1;
 	}
 
+	layer_mark_dirty(ivilayer);
 	ivilayer->pending.prop.transition_type = type;
 	ivilayer->pending.prop.transition_duration = duration;
 
@@ -1828,6 +1975,7 @@ ivi_layout_layer_set_fade_info(struct ivi_layout_layer* ivilayer,
 		return -1;
 	}
 
+	layer_mark_dirty(ivilayer);
 	ivilayer->pending.prop.is_fade_in = is_fade_in;
 	ivilayer->pending.prop.start_alpha = start_alpha;
 	ivilayer->pending.prop.end_alpha = end_alpha;
@@ -1846,6 +1994,7 @@ ivi_layout_surface_set_transition_duration(struct ivi_layout_surface *ivisurf,
 		return -1;
 	}
 
+	surface_mark_dirty(ivisurf);
 	prop = &ivisurf->pending.prop;
 	prop->transition_duration = duration*10;
 	return 0;
@@ -1874,12 +2023,18 @@ ivi_layout_surface_set_id(struct ivi_layout_surface *ivisurf,
 		return IVI_FAILED;
 	}
 
-	search_ivisurf = get_surface(&layout->surface_list, id_surface);
+	search_ivisurf = get_surface(layout, id_surface);
 	if (search_ivisurf) {
 		weston_log("id_surface(%d) is already created\n", id_surface);
 		return IVI_FAILED;
 	}
 
+	if (id_surface != IVI_INVALID_ID &&
+	    hash_table_insert(layout->surface_index, id_surface, ivisurf) < 0) {
+		weston_log("fails to allocate memory\n");
+		return IVI_FAILED;
+	}
+
 	ivisurf->id_surface = id_surface;
 
 	wl_signal_emit(&layout->surface_notification.created, ivisurf);
@@ -1901,12 +2056,55 @@ ivi_layout_surface_set_transition(struct ivi_layout_surface *ivisurf,
 		return -1;
 	}
 
+	surface_mark_dirty(ivisurf);
 	prop = &ivisurf->pending.prop;
 	prop->transition_type = type;
 	prop->transition_duration = duration;
 	return 0;
 }
 
+static int32_t
+ivi_layout_surfaces_set_visibility(struct ivi_layout_surface **surfaces,
+				   int32_t number, bool newVisibility)
+{
+	int32_t i;
+
+	if (surfaces == NULL && number > 0) {
+		weston_log("%s: invalid argument\n", __func__);
+		return IVI_FAILED;
+	}
+
+	for (i = 0; i < number; i++) {
+		if (ivi_layout_surface_set_visibility(surfaces[i],
+						      newVisibility) != IVI_SUCCEEDED)
+			return IVI_FAILED;
+	}
+
+	return IVI_SUCCEEDED;
+}
+
+static int32_t
+ivi_layout_surfaces_set_transition(struct ivi_layout_surface **surfaces,
+				   int32_t number,
+				   enum ivi_layout_transition_type type,
+				   uint32_t duration)
+{
+	int32_t i;
+
+	if (surfaces == NULL && number > 0) {
+		weston_log("%s: invalid argument\n", __func__);
+		return IVI_FAILED;
+	}
+
+	for (i = 0; i < number; i++) {
+		if (ivi_layout_surface_set_transition(surfaces[i], type,
+						      duration) != 0)
+			return IVI_FAILED;
+	}
+
+	return IVI_SUCCEEDED;
+}
+
 static int32_t
 ivi_layout_surface_dump(struct weston_surface *surface,
 			void *target, size_t size,int32_t x, int32_t y,
@@ -1947,6 +2145,13 @@ surface_create(struct weston_surface *wl_surface, uint32_t id_surface)
 		return NULL;
 	}
 
+	if (id_surface != IVI_INVALID_ID &&
+	    hash_table_insert(layout->surface_index, id_surface, ivisurf) < 0) {
+		weston_log("fails to allocate memory\n");
+		free(ivisurf);
+		return NULL;
+	}
+
 	wl_signal_init(&ivisurf->property_changed);
 	ivisurf->id_surface = id_surface;
 	ivisurf->layout = layout;
@@ -1961,6 +2166,8 @@ surface_create(struct weston_surface *wl_surface, uint32_t id_surface)
 	ivisurf->pending.prop = ivisurf->prop;
 
 	wl_list_init(&ivisurf->view_list);
+	wl_list_init(&ivisurf->dirty_link);
+	wl_list_init(&ivisurf->commit_link);
 
 	wl_list_insert(&layout->surface_list, &ivisurf->link);
 
@@ -2002,7 +2209,7 @@ ivi_layout_surface_create(struct weston_surface *wl_surface,
 	struct ivi_layout *layout = get_instance();
 	struct ivi_layout_surface *ivisurf = NULL;
 
-	ivisurf = get_surface(&layout->surface_list, id_surface);
+	ivisurf = get_surface(layout, id_surface);
 	if (ivisurf) {
 		weston_log("id_surface(%d) is already created\n", id_surface);
 		return NULL;
@@ -2018,17 +2225,30 @@ ivi_layout_surface_create(struct weston_surface *wl_surface,
 
 static struct ivi_layout_interface ivi_layout_interface;
 
-void
+int
 ivi_layout_init_with_compositor(struct weston_compositor *ec)
 {
 	struct ivi_layout *layout = get_instance();
 
+	layout->surface_index = hash_table_create();
+	layout->layer_index = hash_table_create();
+	if (!layout->surface_index || !layout->layer_index) {
+		weston_log("fails to allocate memory\n");
+		hash_table_destroy(layout->surface_index);
+		hash_table_destroy(layout->layer_index);
+		return IVI_FAILED;
+	}
+
 	layout->compositor = ec;
 
 	wl_list_init(&layout->surface_list);
 	wl_list_init(&layout->layer_list);
 	wl_list_init(&layout->screen_list);
 	wl_list_init(&layout->view_list);
+	wl_list_init(&layout->dirty_surface_list);
+	wl_list_init(&layout->dirty_layer_list);
+	wl_list_init(&layout->commit_surface_list);
+	wl_list_init(&layout->commit_layer_list);
 
 	wl_signal_init(&layout->layer_notification.created);
 	wl_signal_init(&layout->layer_notification.removed);
@@ -2051,6 +2271,8 @@ ivi_layout_init_with_compositor(struct weston_compositor *ec)
 	weston_plugin_api_register(ec, IVI_LAYOUT_API_NAME,
 				   &ivi_layout_interface,
 				   sizeof(struct ivi_layout_interface));
+
+	return IVI_SUCCEEDED;
 }
 
 static struct ivi_layout_interface ivi_layout_interface = {
@@ -2081,6 +2303,8 @@ static struct ivi_layout_interface ivi_layout_interface = {
 	.surface_set_transition			= ivi_layout_surface_set_transition,
 	.surface_set_transition_duration	= ivi_layout_surface_set_transition_duration,
 	.surface_set_id				= ivi_layout_surface_set_id,
+	.surfaces_set_visibility		= ivi_layout_surfaces_set_visibility,
+	.surfaces_set_transition		= ivi_layout_surfaces_set_transition,
 
 	/**
 	 * layer controller interfaces
@@ -644,7 +644,9 @@ wet_shell_init(struct weston_compositor *compositor,
 			     shell, bind_ivi_application) == NULL)
 		goto err_desktop;
 
-	ivi_layout_init_with_compositor(compositor);
+	if (ivi_layout_init_with_compositor(compositor) < 0)
+		goto err_desktop;
+
 	shell_add_bindings(compositor, shell);
 
 	return IVI_SUCCEEDED;
@@ -420,6 +420,8 @@ kiosk_shell_output_recreate_background(struct kiosk_shell_output *shoutput)
 
 	if (shoutput->background_view)
 		weston_surface_destroy(shoutput->background_view->surface);
+	shoutput->background_view = NULL;
+	shoutput->background_hidden = false;
 
 	if (!output)
 		return;
@@ -445,6 +447,79 @@ kiosk_shell_output_recreate_background(struct kiosk_shell_output *shoutput)
 	weston_view_set_output(shoutput->background_view, output);
 }
 
+static struct kiosk_shell_output *
+kiosk_shell_find_shell_output(struct kiosk_shell *shell,
+			      struct weston_output *output)
+{
+	struct kiosk_shell_output *shoutput;
+
+	wl_list_for_each(shoutput, &shell->output_list, link) {
+		if (shoutput->output == output)
+			return shoutput;
+	}
+
+	return NULL;
+}
+
+static bool
+kiosk_shell_view_covers_output(struct weston_view *view,
+			       struct weston_output *output)
+{
+	pixman_region32_t uncovered;
+	bool ret;
+
+	if (!view->is_mapped || view->output != output)
+		return false;
+
+	weston_view_update_transform(view);
+
+	pixman_region32_init(&uncovered);
+	pixman_region32_subtract(&uncovered, &output->region,
+				 &view->transform.boundingbox);
+	ret = !pixman_region32_not_empty(&uncovered);
+	pixman_region32_fini(&uncovered);
+
+	return ret && weston_view_is_opaque(view, &output->region);
+}
+
+/* Take the background view out of the scene graph while an opaque app view
+ * covers the whole output, so that the app is the only thing left for the
+ * backend to assign to the output, and put it back otherwise. */
+static void
+kiosk_shell_output_update_background(struct kiosk_shell_output *shoutput)
+{
+	struct kiosk_shell *shell = shoutput->shell;
+	struct weston_view *background = shoutput->background_view;
+	struct weston_view *view;
+	bool covered = false;
+
+	if (!background || !shoutput->output)
+		return;
+
+	wl_list_for_each(view, &shell->normal_layer.view_list.link,
+			 layer_link.link) {
+		if (kiosk_shell_view_covers_output(view, shoutput->output)) {
+			covered = true;
+			break;
+		}
+	}
+
+	if (covered == shoutput->background_hidden)
+		return;
+
+	if (covered) {
+		weston_view_damage_below(background);
+		weston_layer_entry_remove(&background->layer_link);
+	} else {
+		weston_layer_entry_insert(&shell->background_layer.view_list,
+					  &background->layer_link);
+		weston_view_geometry_dirty(background);
+		weston_surface_damage(background->surface);
+	}
+
+	shoutput->background_hidden = covered;
+}
+
 static void
 kiosk_shell_output_destroy(struct kiosk_shell_output *shoutput)
 {
@@ -602,6 +677,8 @@ desktop_surface_removed(struct weston_desktop_surface *desktop_surface,
 		weston_desktop_surface_get_user_data(desktop_surface);
 	struct weston_surface *surface =
 		weston_desktop_surface_get_surface(desktop_surface);
+	struct kiosk_shell_output *shoutput;
+	struct weston_output *output;
 	struct weston_view *focus_view;
 	struct weston_seat *seat;
 
@@ -618,7 +695,12 @@ desktop_surface_removed(struct weston_desktop_surface *desktop_surface,
 		}
 	}
 
+	output = shsurf->output;
 	kiosk_shell_surface_destroy(shsurf);
+
+	shoutput = kiosk_shell_find_shell_output(shell, output);
+	if (shoutput)
+		kiosk_shell_output_update_background(shoutput);
 }
 
 static void
@@ -629,6 +711,7 @@ desktop_surface_committed(struct weston_desktop_surface *desktop_surface,
 		weston_desktop_surface_get_user_data(desktop_surface);
 	struct weston_surface *surface =
 		weston_desktop_surface_get_surface(desktop_surface);
+	struct kiosk_shell_output *shoutput;
 	bool is_resized;
 	bool is_fullscreen;
 
@@ -683,6 +766,10 @@ desktop_surface_committed(struct weston_desktop_surface *desktop_surface,
 
 	shsurf->last_width = surface->width;
 	shsurf->last_height = surface->height;
+
+	shoutput = kiosk_shell_find_shell_output(shsurf->shell, shsurf->output);
+	if (shoutput)
+		kiosk_shell_output_update_background(shoutput);
 }
 
 static void
@@ -844,20 +931,6 @@ static const struct weston_desktop_api kiosk_shell_desktop_api = {
  * kiosk_shell
  */
 
-static struct kiosk_shell_output *
-kiosk_shell_find_shell_output(struct kiosk_shell *shell,
-			      struct weston_output *output)
-{
-	struct kiosk_shell_output *shoutput;
-
-	wl_list_for_each(shoutput, &shell->output_list, link) {
-		if (shoutput->output == output)
-			return shoutput;
-	}
-
-	return NULL;
-}
-
 static void
 kiosk_shell_activate_view(struct kiosk_shell *shell,
 			  struct weston_view *view,
@@ -965,6 +1038,8 @@ kiosk_shell_handle_output_resized(struct wl_listener *listener, void *data)
 			continue;
 		kiosk_shell_surface_reconfigure_for_output(shsurf);
 	}
+
+	kiosk_shell_output_update_background(shoutput);
 }
 
 static void
@@ -973,8 +1048,18 @@ kiosk_shell_handle_output_moved(struct wl_listener *listener, void *data)
 	struct kiosk_shell *shell =
 		container_of(listener, struct kiosk_shell, output_moved_listener);
 	struct weston_output *output = data;
+	struct kiosk_shell_output *shoutput =
+		kiosk_shell_find_shell_output(shell, output);
 	struct weston_view *view;
 
+	/* A hidden background is not on the layer, move it by hand. */
+	if (shoutput && shoutput->background_hidden) {
+		view = shoutput->background_view;
+		weston_view_set_position(view,
+					 view->geometry.x + output->move_x,
+					 view->geometry.y + output->move_y);
+	}
+
 	wl_list_for_each(view, &shell->background_layer.view_list.link,
 			 layer_link.link) {
 		if (view->output != output)
@@ -81,6 +81,9 @@ struct kiosk_shell_output {
 	struct weston_output *output;
 	struct wl_listener output_destroy_listener;
 	struct weston_view *background_view;
+	/* The background view is out of the background layer because an
+	 * opaque app view covers the whole output. */
+	bool background_hidden;
 
 	struct kiosk_shell *shell;
 	struct wl_list link;
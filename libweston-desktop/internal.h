@@ -122,6 +122,9 @@ struct weston_desktop_surface_implementation {
 	void (*ping)(struct weston_desktop_surface *surface, uint32_t serial,
 		     void *user_data);
 	void (*close)(struct weston_desktop_surface *surface, void *user_data);
+	void (*get_configure_stats)(struct weston_desktop_surface *surface,
+				    void *user_data,
+				    struct weston_desktop_surface_configure_stats *stats);
 
 	bool (*get_activated)(struct weston_desktop_surface *surface,
 			      void *user_data);
@@ -685,6 +685,19 @@ weston_desktop_surface_get_min_size(struct weston_desktop_surface *surface)
 						     surface->implementation_data);
 }
 
+WL_EXPORT void
+weston_desktop_surface_get_configure_stats(struct weston_desktop_surface *surface,
+					   struct weston_desktop_surface_configure_stats *stats)
+{
+	if (surface->implementation->get_configure_stats == NULL) {
+		*stats = (struct weston_desktop_surface_configure_stats) { 0 };
+		return;
+	}
+	surface->implementation->get_configure_stats(surface,
+						     surface->implementation_data,
+						     stats);
+}
+
 void
 weston_desktop_surface_set_title(struct weston_desktop_surface *surface,
 				 const char *title)
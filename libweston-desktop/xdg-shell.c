@@ -76,6 +76,7 @@ struct weston_desktop_xdg_surface {
 	bool configured;
 	struct wl_event_source *configure_idle;
 	struct wl_list configure_list; /* weston_desktop_xdg_surface_configure::link */
+	struct weston_desktop_surface_configure_stats configure_stats;
 
 	bool has_next_geometry;
 	struct weston_geometry next_geometry;
@@ -968,6 +969,7 @@ weston_desktop_xdg_surface_send_configure(void *user_data)
 		break;
 	}
 
+	surface->configure_stats.sent++;
 	xdg_surface_send_configure(surface->resource, configure->serial);
 }
 
@@ -1034,6 +1036,11 @@ weston_desktop_xdg_surface_schedule_configure(struct weston_desktop_xdg_surface
 		break;
 	}
 
+	/* Changes made before the idle configure runs all go into it, so
+	 * a client gets one configure per event loop iteration. */
+	if (!pending_same)
+		surface->configure_stats.changes++;
+
 	if (surface->configure_idle != NULL) {
 		if (!pending_same)
 			return;
@@ -1209,6 +1216,10 @@ weston_desktop_xdg_surface_protocol_ack_configure(struct wl_client *wl_client,
 		} else if (configure->serial == serial) {
 			wl_list_remove(&configure->link);
 			found = true;
+			/* The client is drawing a state that is
+			 * already stale. */
+			if (!wl_list_empty(&surface->configure_list))
+				surface->configure_stats.superseded++;
 			break;
 		} else {
 			break;
@@ -1309,6 +1320,16 @@ weston_desktop_xdg_surface_close(struct weston_desktop_surface *dsurface,
 	}
 }
 
+static void
+weston_desktop_xdg_surface_get_configure_stats(struct weston_desktop_surface *dsurface,
+					       void *user_data,
+					       struct weston_desktop_surface_configure_stats *stats)
+{
+	struct weston_desktop_xdg_surface *surface = user_data;
+
+	*stats = surface->configure_stats;
+}
+
 static void
 weston_desktop_xdg_surface_destroy(struct weston_desktop_surface *dsurface,
 				   void *user_data)
@@ -1364,6 +1385,7 @@ static const struct weston_desktop_surface_implementation weston_desktop_xdg_sur
 	.committed = weston_desktop_xdg_surface_committed,
 	.ping = weston_desktop_xdg_surface_ping,
 	.close = weston_desktop_xdg_surface_close,
+	.get_configure_stats = weston_desktop_xdg_surface_get_configure_stats,
 
 	.destroy = weston_desktop_xdg_surface_destroy,
 };
@@ -0,0 +1,273 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <linux/input.h>
+
+#include <libweston/libweston.h>
+#include "libweston-internal.h"
+#include "shared/alloc-profile.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Counts are kept per (call site, scope), in a fixed table so that
+ * recording never allocates. Entries past its size are only counted. */
+#define ALLOC_PROFILE_SITES 4096
+#define ALLOC_PROFILE_MAX_DEPTH 16
+#define ALLOC_PROFILE_REPORT_LINES 64
+
+struct alloc_site {
+	const char *file;	/* NULL for allocations seen by malloc() */
+	const char *func;
+	int line;
+	const char *scope;	/* innermost scope, NULL if none */
+	uint64_t count;
+	uint64_t bytes;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct alloc_site sites[ALLOC_PROFILE_SITES];
+	uint64_t dropped;
+	struct timespec since;
+} profile = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* initial-exec, as malloc() may be called before the TLS of a new
+ * thread is set up otherwise. */
+#define ALLOC_PROFILE_TLS __thread __attribute__((tls_model("initial-exec")))
+
+static ALLOC_PROFILE_TLS const char *scope_stack[ALLOC_PROFILE_MAX_DEPTH];
+static ALLOC_PROFILE_TLS int scope_depth;
+/* the next malloc() is the one weston_alloc_profile_note() counted */
+static ALLOC_PROFILE_TLS bool noted;
+
+static void
+alloc_profile_record(const char *file, int line, const char *func, size_t size)
+{
+	int depth = MIN(scope_depth, ALLOC_PROFILE_MAX_DEPTH);
+	const char *scope = depth ? scope_stack[depth - 1] : NULL;
+	uint32_t hash;
+
+	hash = ((uintptr_t)file >> 3) ^ ((uintptr_t)scope >> 3) ^
+	       (uint32_t)line * 2654435761u;
+
+	pthread_mutex_lock(&profile.mutex);
+	for (int i = 0; i < ALLOC_PROFILE_SITES; i++) {
+		struct alloc_site *site =
+			&profile.sites[(hash + i) % ALLOC_PROFILE_SITES];
+
+		if (site->count == 0) {
+			site->file = file;
+			site->func = func;
+			site->line = line;
+			site->scope = scope;
+		} else if (site->file != file || site->line != line ||
+			   site->scope != scope) {
+			continue;
+		}
+
+		site->count++;
+		site->bytes += size;
+		pthread_mutex_unlock(&profile.mutex);
+		return;
+	}
+	profile.dropped++;
+	pthread_mutex_unlock(&profile.mutex);
+}
+
+WL_EXPORT void
+weston_alloc_profile_note(const char *file, int line, const char *func,
+			  size_t size)
+{
+	alloc_profile_record(file, line, func, size);
+	noted = true;
+}
+
+WL_EXPORT void
+weston_alloc_profile_push(const char *scope)
+{
+	if (scope_depth < ALLOC_PROFILE_MAX_DEPTH)
+		scope_stack[scope_depth] = scope;
+	scope_depth++;
+}
+
+WL_EXPORT void
+weston_alloc_profile_pop(void)
+{
+	assert(scope_depth > 0);
+	scope_depth--;
+}
+
+#ifdef WESTON_ALLOC_PROFILE_MALLOC
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+/* Allocations which did not come through zalloc() or x*alloc() are
+ * only counted within a scope, where they are attributed to the scope. */
+static void
+alloc_profile_library(size_t size)
+{
+	if (noted) {
+		noted = false;
+		return;
+	}
+
+	if (scope_depth)
+		alloc_profile_record(NULL, 0, NULL, size);
+}
+
+WL_EXPORT void *
+malloc(size_t size)
+{
+	alloc_profile_library(size);
+	return __libc_malloc(size);
+}
+
+WL_EXPORT void *
+calloc(size_t nmemb, size_t size)
+{
+	alloc_profile_library(nmemb * size);
+	return __libc_calloc(nmemb, size);
+}
+
+WL_EXPORT void *
+realloc(void *ptr, size_t size)
+{
+	alloc_profile_library(size);
+	return __libc_realloc(ptr, size);
+}
+#endif /* WESTON_ALLOC_PROFILE_MALLOC */
+
+static int
+alloc_site_compare(const void *a, const void *b)
+{
+	const struct alloc_site *x = a;
+	const struct alloc_site *y = b;
+
+	if (x->bytes != y->bytes)
+		return x->bytes < y->bytes ? 1 : -1;
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return 0;
+}
+
+static void
+alloc_profile_print(FILE *fp)
+{
+	static struct alloc_site snapshot[ALLOC_PROFILE_SITES];
+	struct timespec now, since;
+	uint64_t count = 0, bytes = 0, dropped;
+	int num_sites = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* counting goes on while the report is built, from a snapshot */
+	pthread_mutex_lock(&profile.mutex);
+	for (int i = 0; i < ALLOC_PROFILE_SITES; i++)
+		if (profile.sites[i].count)
+			snapshot[num_sites++] = profile.sites[i];
+	memset(profile.sites, 0, sizeof profile.sites);
+	dropped = profile.dropped;
+	profile.dropped = 0;
+	since = profile.since;
+	profile.since = now;
+	pthread_mutex_unlock(&profile.mutex);
+
+	qsort(snapshot, num_sites, sizeof snapshot[0], alloc_site_compare);
+	for (int i = 0; i < num_sites; i++) {
+		count += snapshot[i].count;
+		bytes += snapshot[i].bytes;
+	}
+
+	fprintf(fp, "\nallocations in the last %.1f s: %" PRIu64 " (%" PRIu64
+		" bytes) at %d call sites\n",
+		timespec_sub_to_msec(&now, &since) / 1000.0, count, bytes,
+		num_sites);
+	fprintf(fp, "%10s %12s  %s\n", "count", "bytes", "site [scope]");
+	for (int i = 0; i < MIN(num_sites, ALLOC_PROFILE_REPORT_LINES); i++) {
+		struct alloc_site *site = &snapshot[i];
+
+		fprintf(fp, "%10" PRIu64 " %12" PRIu64 "  ",
+			site->count, site->bytes);
+		if (site->file)
+			fprintf(fp, "%s:%d %s()", site->file, site->line,
+				site->func);
+		else
+			fprintf(fp, "(other malloc within scope)");
+		if (site->scope)
+			fprintf(fp, " [%s]", site->scope);
+		fprintf(fp, "\n");
+	}
+	if (num_sites > ALLOC_PROFILE_REPORT_LINES)
+		fprintf(fp, "... %d more call sites\n",
+			num_sites - ALLOC_PROFILE_REPORT_LINES);
+	if (dropped)
+		fprintf(fp, "%" PRIu64 " allocations not attributed, table full\n",
+			dropped);
+}
+
+static void
+alloc_profile_binding(struct weston_keyboard *keyboard,
+		      const struct timespec *time, uint32_t key, void *data)
+{
+	char *str;
+	size_t len;
+	FILE *fp;
+
+	fp = open_memstream(&str, &len);
+	if (!fp)
+		return;
+
+	fprintf(fp, "debug binding 'A' - allocation profile, counters are reset");
+	alloc_profile_print(fp);
+	if (fclose(fp) == 0)
+		weston_log("%s", str);
+	free(str);
+}
+
+void
+weston_alloc_profile_init(struct weston_compositor *compositor)
+{
+	pthread_mutex_lock(&profile.mutex);
+	clock_gettime(CLOCK_MONOTONIC, &profile.since);
+	pthread_mutex_unlock(&profile.mutex);
+
+	/* A to dump the allocation profile */
+	weston_compositor_add_debug_binding(compositor, KEY_A,
+					    alloc_profile_binding, NULL);
+}
@@ -100,7 +100,7 @@ drm_backend_create_gl_renderer(struct drm_backend *b)
 	};
 	struct gl_renderer_display_options options = {
 		.egl_platform = EGL_PLATFORM_GBM_KHR,
-		.egl_native_display = b->gbm,
+		.egl_native_display = b->render.gbm ? b->render.gbm : b->gbm,
 		.egl_surface_type = EGL_WINDOW_BIT,
 		.drm_formats = format,
 		.drm_formats_count = 2,
@@ -123,12 +123,29 @@ init_egl(struct drm_backend *b)
 	if (!b->gbm)
 		return -1;
 
-	if (drm_backend_create_gl_renderer(b) < 0) {
-		gbm_device_destroy(b->gbm);
-		return -1;
+	/* The KMS device keeps its own GBM device, for cursors and for
+	 * importing client buffers onto planes. */
+	if (b->render.fd >= 0) {
+		b->render.gbm = gbm_create_device(b->render.fd);
+		if (!b->render.gbm) {
+			weston_log("failed to create GBM device for the "
+				   "render GPU\n");
+			goto err;
+		}
 	}
 
+	if (drm_backend_create_gl_renderer(b) < 0)
+		goto err;
+
 	return 0;
+
+err:
+	if (b->render.gbm)
+		gbm_device_destroy(b->render.gbm);
+	b->render.gbm = NULL;
+	gbm_device_destroy(b->gbm);
+	b->gbm = NULL;
+	return -1;
 }
 
 static void drm_output_fini_cursor_egl(struct drm_output *output)
@@ -206,6 +223,29 @@ drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
 		return -1;
 	}
 
+	if (b->render.gbm) {
+		/* Only linear buffers of another GPU can be read by the
+		 * display engine. */
+#ifdef HAVE_GBM_MODIFIERS
+		uint64_t linear = DRM_FORMAT_MOD_LINEAR;
+
+		output->gbm_surface =
+			gbm_surface_create_with_modifiers(b->render.gbm,
+							  mode->width,
+							  mode->height,
+							  output->gbm_format,
+							  &linear, 1);
+		if (!output->gbm_surface)
+#endif
+			output->gbm_surface =
+				gbm_surface_create(b->render.gbm,
+						   mode->width, mode->height,
+						   output->gbm_format,
+						   GBM_BO_USE_RENDERING |
+						   GBM_BO_USE_LINEAR);
+		goto created;
+	}
+
 #ifdef HAVE_GBM_MODIFIERS
 	if (plane->formats[i].count_modifiers > 0) {
 		output->gbm_surface =
@@ -229,6 +269,7 @@ drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
 				       output->gbm_bo_flags);
 	}
 
+created:
 	if (!output->gbm_surface) {
 		weston_log("failed to create gbm surface\n");
 		return -1;
@@ -254,6 +295,7 @@ void
 drm_output_fini_egl(struct drm_output *output)
 {
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	unsigned int i;
 
 	/* Destroying the GBM surface will destroy all our GBM buffers,
 	 * regardless of refcount. Ensure we destroy them here. */
@@ -267,6 +309,78 @@ drm_output_fini_egl(struct drm_output *output)
 	gbm_surface_destroy(output->gbm_surface);
 	output->gbm_surface = NULL;
 	drm_output_fini_cursor_egl(output);
+
+	for (i = 0; i < ARRAY_LENGTH(output->render_copy_fb); i++) {
+		drm_fb_unref(output->render_copy_fb[i]);
+		output->render_copy_fb[i] = NULL;
+	}
+	output->render_copy = false;
+}
+
+/* Copies a frame of the render GPU into a dumb buffer of the KMS device,
+ * for when the KMS device cannot import it. */
+static struct drm_fb *
+drm_output_copy_render_bo(struct drm_output *output, struct gbm_bo *bo)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	uint32_t width = gbm_bo_get_width(bo);
+	uint32_t height = gbm_bo_get_height(bo);
+	struct drm_fb *fb;
+	uint32_t stride, y;
+	void *map_data = NULL;
+	uint8_t *src, *dst;
+
+	output->current_render_copy ^= 1;
+	fb = output->render_copy_fb[output->current_render_copy];
+	if (!fb) {
+		fb = drm_fb_create_dumb(b, width, height, output->gbm_format);
+		if (!fb)
+			return NULL;
+		output->render_copy_fb[output->current_render_copy] = fb;
+	}
+
+	src = gbm_bo_map(bo, 0, 0, width, height, GBM_BO_TRANSFER_READ,
+			 &stride, &map_data);
+	if (!src) {
+		weston_log("failed to map render buffer\n");
+		return NULL;
+	}
+
+	dst = fb->map;
+	for (y = 0; y < height; y++)
+		memcpy(dst + y * fb->strides[0], src + y * stride,
+		       MIN(stride, fb->strides[0]));
+
+	gbm_bo_unmap(bo, map_data);
+
+	return drm_fb_ref(fb);
+}
+
+/* A renderer buffer of another GPU, scanned out directly when the KMS
+ * device can import it. The copy fallback is taken once and kept. */
+static struct drm_fb *
+drm_output_fb_from_render_bo(struct drm_output *output, struct gbm_bo *bo)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_fb *fb;
+
+	if (!output->render_copy) {
+		fb = drm_fb_get_from_render_bo(bo, b);
+		if (fb) {
+			fb->gbm_surface = output->gbm_surface;
+			return fb;
+		}
+
+		weston_log("Output %s: the KMS device cannot import buffers "
+			   "of the render GPU, copying them\n",
+			   output->base.name);
+		output->render_copy = true;
+	}
+
+	fb = drm_output_copy_render_bo(output, bo);
+	gbm_surface_release_buffer(output->gbm_surface, bo);
+
+	return fb;
 }
 
 struct drm_fb *
@@ -280,6 +394,10 @@ drm_output_render_gl(struct drm_output_state *state, pixman_region32_t *damage)
 	output->base.compositor->renderer->repaint_output(&output->base,
 							  damage);
 
+	if (output->late_latch.pending && output->late_latch.fence_fd < 0)
+		output->late_latch.fence_fd =
+			gl_renderer->create_fence_fd(&output->base);
+
 	bo = gbm_surface_lock_front_buffer(output->gbm_surface);
 	if (!bo) {
 		weston_log("failed to lock front buffer: %s\n",
@@ -287,6 +405,9 @@ drm_output_render_gl(struct drm_output_state *state, pixman_region32_t *damage)
 		return NULL;
 	}
 
+	if (b->render.gbm)
+		return drm_output_fb_from_render_bo(output, bo);
+
 	/* The renderer always produces an opaque image. */
 	ret = drm_fb_get_from_bo(bo, b, true, BUFFER_GBM_SURFACE);
 	if (!ret) {
@@ -177,6 +177,8 @@ enum wdrm_plane_property {
 	WDRM_PLANE_IN_FENCE_FD,
 	WDRM_PLANE_FB_DAMAGE_CLIPS,
 	WDRM_PLANE_ZPOS,
+	WDRM_PLANE_COLOR_ENCODING,
+	WDRM_PLANE_COLOR_RANGE,
 	WDRM_PLANE__COUNT
 };
 
@@ -190,6 +192,25 @@ enum wdrm_plane_type {
 	WDRM_PLANE_TYPE__COUNT
 };
 
+/**
+ * Possible values for the WDRM_PLANE_COLOR_ENCODING property.
+ */
+enum wdrm_plane_color_encoding {
+	WDRM_PLANE_COLOR_ENCODING_BT601 = 0,
+	WDRM_PLANE_COLOR_ENCODING_BT709,
+	WDRM_PLANE_COLOR_ENCODING_BT2020,
+	WDRM_PLANE_COLOR_ENCODING__COUNT
+};
+
+/**
+ * Possible values for the WDRM_PLANE_COLOR_RANGE property.
+ */
+enum wdrm_plane_color_range {
+	WDRM_PLANE_COLOR_RANGE_LIMITED = 0,
+	WDRM_PLANE_COLOR_RANGE_FULL,
+	WDRM_PLANE_COLOR_RANGE__COUNT
+};
+
 /**
  * List of properties attached to a DRM connector
  */
@@ -201,6 +222,7 @@ enum wdrm_connector_property {
 	WDRM_CONNECTOR_CONTENT_PROTECTION,
 	WDRM_CONNECTOR_HDCP_CONTENT_TYPE,
 	WDRM_CONNECTOR_PANEL_ORIENTATION,
+	WDRM_CONNECTOR_VRR_CAPABLE,
 	WDRM_CONNECTOR__COUNT
 };
 
@@ -239,9 +261,41 @@ enum wdrm_panel_orientation {
 enum wdrm_crtc_property {
 	WDRM_CRTC_MODE_ID = 0,
 	WDRM_CRTC_ACTIVE,
+	WDRM_CRTC_VRR_ENABLED,
 	WDRM_CRTC__COUNT
 };
 
+/**
+ * List of properties attached to DRM writeback connectors
+ */
+enum wdrm_writeback_property {
+	WDRM_WRITEBACK_CRTC_ID = 0,
+	WDRM_WRITEBACK_FB_ID,
+	WDRM_WRITEBACK_OUT_FENCE_PTR,
+	WDRM_WRITEBACK_PIXEL_FORMATS,
+	WDRM_WRITEBACK__COUNT
+};
+
+/**
+ * Reasons for a view not landing on a plane, in
+ * weston_view::try_view_on_plane_failure_reasons
+ */
+enum try_view_on_plane_failure_reasons {
+	FAILURE_REASONS_NONE = 0,
+	FAILURE_REASONS_FORCE_RENDERER = 1 << 0,
+	FAILURE_REASONS_FB_FORMAT_INCOMPATIBLE = 1 << 1,
+};
+
+#define DRM_TEST_CACHE_SIZE 32
+
+/* Late latching predicts the repaint duration of an output as the longest
+ * of this many recent repaints, once it has seen at least MIN of them. */
+#define DRM_LATE_LATCH_SAMPLES 16
+#define DRM_LATE_LATCH_MIN_SAMPLES 4
+/* Added to the prediction for the commit to reach the hardware and for
+ * timer slack. */
+#define DRM_LATE_LATCH_MARGIN_NSEC 1000000
+
 struct drm_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -259,6 +313,13 @@ struct drm_backend {
 		dev_t devnum;
 	} drm;
 	struct gbm_device *gbm;
+	/* GPU the GL renderer runs on when it is not the KMS device, see
+	 * init_egl(); fd is -1 otherwise. */
+	struct {
+		int fd;
+		dev_t devnum;
+		struct gbm_device *gbm;
+	} render;
 	struct wl_listener session_listener;
 	uint32_t gbm_format;
 
@@ -271,6 +332,10 @@ struct drm_backend {
 
 	struct wl_list plane_list;
 
+	/* DRM_CLIENT_CAP_WRITEBACK_CONNECTORS; drm_writeback::link */
+	bool writeback_connectors;
+	struct wl_list writeback_list;
+
 	void *repaint_data;
 
 	bool state_invalid;
@@ -284,6 +349,18 @@ struct drm_backend {
 	bool universal_planes;
 	bool atomic_modeset;
 
+	/* Results of atomic TEST_ONLY commits, keyed by a signature of the
+	 * tested configuration, see drm_pending_state_test() */
+	struct {
+		bool enabled;
+		struct drm_test_cache_entry {
+			uint64_t key;
+			int result;
+			bool valid;
+		} entries[DRM_TEST_CACHE_SIZE];
+		unsigned int next;
+	} test_cache;
+
 	bool use_pixman;
 	bool use_pixman_shadow;
 
@@ -294,12 +371,21 @@ struct drm_backend {
 
 	uint32_t pageflip_timeout;
 
+	bool late_latching;
+	/* CLOCK_MONOTONIC time of the last drm_repaint_begin() */
+	struct timespec repaint_begin_time;
+
 	bool shutting_down;
 
 	bool aspect_ratio_supported;
 
 	bool fb_modifiers;
 
+	/* DRM_MODE_PAGE_FLIP_ASYNC with drmModePageFlip, respectively
+	 * drmModeAtomicCommit */
+	bool async_page_flip;
+	bool atomic_async_page_flip;
+
 	struct weston_log_scope *debug;
 };
 
@@ -378,6 +464,7 @@ struct drm_output_state {
 	enum dpms_enum dpms;
 	enum weston_hdcp_protection protection;
 	struct wl_list plane_list;
+	bool tearing; /* flipped to without waiting for vblank */
 };
 
 /**
@@ -479,6 +566,8 @@ struct drm_head {
 
 	struct backlight *backlight;
 
+	bool vrr_capable;
+
 	drmModeModeInfo inherited_mode;	/**< Original mode on the connector */
 	uint32_t inherited_crtc_id;	/**< Original CRTC assignment */
 };
@@ -509,6 +598,16 @@ struct drm_output {
 	uint32_t gbm_format;
 	uint32_t gbm_bo_flags;
 
+	/* Rendering on another GPU whose buffers the KMS device cannot
+	 * import: frames are copied into these instead. */
+	bool render_copy;
+	struct drm_fb *render_copy_fb[2];
+	int current_render_copy;
+
+	bool vrr_requested;
+	bool vrr_enabled; /* requested and supported by CRTC and heads */
+	bool allow_tearing;
+
 	/* Plane being displayed directly on the CRTC */
 	struct drm_plane *scanout_plane;
 
@@ -528,11 +627,61 @@ struct drm_output {
 
 	struct wl_event_source *pageflip_timer;
 
+	/* drm_capture_request::link, waiting for a commit to start them */
+	struct wl_list capture_requests;
+
+	/* Repaint duration tracking for late latching, see
+	 * drm_output_late_latch_update() */
+	struct {
+		bool pending;			/* a frame is in flight */
+		struct timespec begin;		/* CLOCK_MONOTONIC */
+		struct timespec submit;
+		int fence_fd;			/* GPU done, or -1 */
+		int64_t frame_prediction_nsec;	/* for the frame in flight */
+		int64_t prediction_nsec;	/* 0 while unknown */
+		int64_t samples[DRM_LATE_LATCH_SAMPLES];
+		unsigned int next;
+		unsigned int count;
+	} late_latch;
+
 	bool virtual;
 
 	submit_frame_cb virtual_submit_frame;
 };
 
+struct drm_capture_request {
+	struct wl_list link;
+	pixman_format_code_t format;
+	void *pixels;
+	uint32_t x, y, width, height;
+	weston_renderer_read_done_func_t done;
+	void *data;
+};
+
+struct drm_writeback {
+	struct drm_backend *backend;
+	struct wl_list link; /* drm_backend::writeback_list */
+
+	uint32_t connector_id;
+	uint32_t possible_crtcs;
+	struct drm_property_info props[WDRM_WRITEBACK__COUNT];
+	uint32_t format;
+	pixman_format_code_t pixman_format;
+
+	/* Output the connector is routed to, or NULL */
+	struct drm_output *output;
+	unsigned int idle_commits;
+	bool committing; /* in the commit being built or made */
+	bool detaching;
+	bool broken;
+
+	struct drm_fb *fb;
+	int out_fence_fd;
+	/* drm_capture_request::link, written by the commit in flight */
+	struct wl_list requests;
+	struct wl_event_source *fence_source;
+};
+
 static inline struct drm_head *
 to_drm_head(struct weston_head *base)
 {
@@ -657,6 +806,32 @@ drm_pending_state_apply(struct drm_pending_state *pending_state);
 int
 drm_pending_state_apply_sync(struct drm_pending_state *pending_state);
 
+bool
+drm_backend_add_writeback(struct drm_backend *b, uint32_t connector_id);
+bool
+drm_backend_is_writeback(struct drm_backend *b, uint32_t connector_id);
+void
+drm_backend_destroy_writebacks(struct drm_backend *b);
+bool
+drm_output_can_writeback(struct drm_output *output);
+int
+drm_output_capture_pixels_async(struct weston_output *base,
+				pixman_format_code_t format, void *pixels,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_renderer_read_done_func_t done,
+				void *data);
+void
+drm_output_fail_captures(struct drm_output *output);
+bool
+drm_pending_state_add_writeback(struct drm_pending_state *pending_state,
+				drmModeAtomicReq *req, uint32_t *flags,
+				bool capture);
+void
+drm_writeback_commit_done(struct drm_backend *b, bool success);
+void
+drm_writeback_add_reset(struct drm_backend *b, drmModeAtomicReq *req);
+
 void
 drm_output_set_gamma(struct weston_output *output_base,
 		     uint16_t size, uint16_t *r, uint16_t *g, uint16_t *b);
@@ -680,6 +855,8 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 struct drm_fb *
 drm_fb_get_from_bo(struct gbm_bo *bo, struct drm_backend *backend,
 		   bool is_opaque, enum drm_fb_type type);
+struct drm_fb *
+drm_fb_get_from_render_bo(struct gbm_bo *bo, struct drm_backend *backend);
 
 #ifdef BUILD_DRM_GBM
 extern struct drm_fb *
@@ -273,6 +273,7 @@ drm_virtual_output_create(struct weston_compositor *c, char *name)
 		return NULL;
 
 	output->virtual = true;
+	output->late_latch.fence_fd = -1;
 	output->gbm_bo_flags = GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING;
 
 	weston_output_init(&output->base, c, name);
@@ -65,6 +65,7 @@
 #include "linux-dmabuf.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 #include "linux-explicit-synchronization.h"
+#include "linux-sync-file.h"
 
 static const char default_seat[] = "seat0";
 
@@ -267,6 +268,93 @@ drm_output_get_disable_state(struct drm_pending_state *pending_state,
 }
 
 
+/* Late latching: instead of a fixed repaint window, every output starts
+ * repainting as late before vblank as its recent repaints allow. A repaint
+ * lasts from drm_repaint_begin() until its commit was submitted and the
+ * GPU finished rendering it, as the renderer's fence tells. The prediction
+ * is the longest of the last DRM_LATE_LATCH_SAMPLES repaints, so one slow
+ * frame widens the window at once and it only narrows again slowly. */
+static void
+drm_output_late_latch_reset_frame(struct drm_output *output)
+{
+	output->late_latch.pending = false;
+	if (output->late_latch.fence_fd >= 0)
+		close(output->late_latch.fence_fd);
+	output->late_latch.fence_fd = -1;
+}
+
+static void
+drm_output_late_latch_begin_frame(struct drm_output *output)
+{
+	struct drm_backend *b = output->backend;
+
+	drm_output_late_latch_reset_frame(output);
+	if (!b->late_latching)
+		return;
+
+	output->late_latch.pending = true;
+	output->late_latch.begin = b->repaint_begin_time;
+	output->late_latch.frame_prediction_nsec =
+		output->late_latch.prediction_nsec;
+}
+
+/* On completion of a frame, account its repaint duration and set the
+ * repaint window for the next one. */
+static void
+drm_output_late_latch_update(struct drm_output *output)
+{
+	struct drm_backend *b = output->backend;
+	struct timespec ready, gpu_done;
+	int64_t duration, window, refresh_nsec;
+	unsigned int i;
+
+	if (!output->late_latch.pending)
+		return;
+
+	ready = output->late_latch.submit;
+	if (output->late_latch.fence_fd >= 0 &&
+	    weston_linux_sync_file_read_timestamp(output->late_latch.fence_fd,
+						  &gpu_done) == 0 &&
+	    timespec_sub_to_nsec(&gpu_done, &ready) > 0)
+		ready = gpu_done;
+	duration = timespec_sub_to_nsec(&ready, &output->late_latch.begin);
+	drm_output_late_latch_reset_frame(output);
+	if (duration < 0)
+		return;
+
+	if (output->late_latch.frame_prediction_nsec > 0) {
+		int64_t error = duration -
+				output->late_latch.frame_prediction_nsec;
+
+		weston_output_metrics_add(&output->base,
+					  WESTON_OUTPUT_METRIC_REPAINT_PREDICTION,
+					  llabs(error) / 1000);
+		drm_debug(b, "\t[repaint] output %s: repaint took %lld us, "
+			  "predicted %lld us\n", output->base.name,
+			  (long long) duration / 1000,
+			  (long long) output->late_latch.frame_prediction_nsec /
+			  1000);
+	}
+
+	output->late_latch.samples[output->late_latch.next] = duration;
+	output->late_latch.next =
+		(output->late_latch.next + 1) % DRM_LATE_LATCH_SAMPLES;
+	if (output->late_latch.count < DRM_LATE_LATCH_SAMPLES)
+		output->late_latch.count++;
+	if (output->late_latch.count < DRM_LATE_LATCH_MIN_SAMPLES)
+		return;
+
+	output->late_latch.prediction_nsec = 0;
+	for (i = 0; i < output->late_latch.count; i++)
+		output->late_latch.prediction_nsec =
+			MAX(output->late_latch.prediction_nsec,
+			    output->late_latch.samples[i]);
+
+	refresh_nsec = millihz_to_nsec(output->base.current_mode->refresh);
+	window = output->late_latch.prediction_nsec + DRM_LATE_LATCH_MARGIN_NSEC;
+	output->base.repaint_window_nsec = MIN(window, refresh_nsec);
+}
+
 /**
  * Mark a drm_output_state (the output's last state) as complete. This handles
  * any post-completion actions such as updating the repaint timer, disabling the
@@ -317,6 +405,11 @@ drm_output_update_complete(struct drm_output *output, uint32_t flags,
 		return;
 	}
 
+	drm_output_late_latch_update(output);
+
+	output->base.unpaced_repaint = output->vrr_enabled ||
+				       output->state_cur->tearing;
+
 	ts.tv_sec = sec;
 	ts.tv_nsec = usec * 1000;
 	weston_output_finish_frame(&output->base, &ts, flags);
@@ -447,6 +540,42 @@ drm_output_render(struct drm_output_state *state, pixman_region32_t *damage)
 	pixman_region32_fini(&scanout_damage);
 }
 
+/* Whether the state may be flipped to without waiting for vblank: when
+ * the output allows it, and the only change is a client buffer on the
+ * scanout plane, as kernels only flip the primary plane asynchronously. */
+static bool
+drm_output_state_can_tear(struct drm_output_state *state)
+{
+	struct drm_output *output = state->output;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane_state *ps;
+
+	if (!output->allow_tearing || b->state_invalid)
+		return false;
+
+	if (b->atomic_modeset ? !b->atomic_async_page_flip :
+				!b->async_page_flip)
+		return false;
+
+	if (state->dpms != output->state_cur->dpms ||
+	    state->protection != output->state_cur->protection)
+		return false;
+
+	wl_list_for_each(ps, &state->plane_list, link) {
+		if (ps->plane != output->scanout_plane) {
+			if (ps->fb || ps->plane->state_cur->fb)
+				return false;
+			continue;
+		}
+
+		if (!ps->fb || (ps->fb->type != BUFFER_CLIENT &&
+				ps->fb->type != BUFFER_DMABUF))
+			return false;
+	}
+
+	return true;
+}
+
 static int
 drm_output_repaint(struct weston_output *output_base,
 		   pixman_region32_t *damage,
@@ -479,15 +608,19 @@ drm_output_repaint(struct weston_output *output_base,
 	else
 		state->protection = WESTON_HDCP_DISABLE;
 
+	drm_output_late_latch_begin_frame(output);
 	drm_output_render(state, damage);
 	scanout_state = drm_output_state_get_plane(state,
 						   output->scanout_plane);
 	if (!scanout_state || !scanout_state->fb)
 		goto err;
 
+	state->tearing = drm_output_state_can_tear(state);
+
 	return 0;
 
 err:
+	drm_output_late_latch_reset_frame(output);
 	drm_output_state_free(state);
 	return -1;
 }
@@ -622,6 +755,9 @@ drm_repaint_begin(struct weston_compositor *compositor)
 	ret = drm_pending_state_alloc(b);
 	b->repaint_data = ret;
 
+	if (b->late_latching)
+		clock_gettime(CLOCK_MONOTONIC, &b->repaint_begin_time);
+
 	if (weston_log_scope_is_enabled(b->debug)) {
 		char *dbg = weston_compositor_print_scene_graph(compositor);
 		drm_debug(b, "[repaint] Beginning repaint; pending_state %p\n",
@@ -647,12 +783,28 @@ drm_repaint_flush(struct weston_compositor *compositor, void *repaint_data)
 {
 	struct drm_backend *b = to_drm_backend(compositor);
 	struct drm_pending_state *pending_state = repaint_data;
+	struct weston_output *base;
+	struct timespec now;
 	int ret;
 
 	ret = drm_pending_state_apply(pending_state);
 	if (ret != 0)
 		weston_log("repaint-flush failed: %s\n", strerror(errno));
 
+	if (b->late_latching) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wl_list_for_each(base, &compositor->output_list, link) {
+			struct drm_output *output = to_drm_output(base);
+
+			if (!output->late_latch.pending)
+				continue;
+			if (ret != 0)
+				drm_output_late_latch_reset_frame(output);
+			else
+				output->late_latch.submit = now;
+		}
+	}
+
 	drm_debug(b, "[repaint] flushed pending_state %p\n", pending_state);
 	b->repaint_data = NULL;
 
@@ -670,6 +822,14 @@ drm_repaint_cancel(struct weston_compositor *compositor, void *repaint_data)
 {
 	struct drm_backend *b = to_drm_backend(compositor);
 	struct drm_pending_state *pending_state = repaint_data;
+	struct weston_output *base;
+
+	wl_list_for_each(base, &compositor->output_list, link) {
+		struct drm_output *output = to_drm_output(base);
+
+		if (output->late_latch.pending)
+			drm_output_late_latch_reset_frame(output);
+	}
 
 	drm_pending_state_free(pending_state);
 	drm_debug(b, "[repaint] cancel pending_state %p\n", pending_state);
@@ -1428,6 +1588,41 @@ drm_output_set_seat(struct weston_output *base,
 				     seat ? seat : "");
 }
 
+static void
+drm_output_set_vrr(struct weston_output *base, bool enabled)
+{
+	struct drm_output *output = to_drm_output(base);
+
+	output->vrr_requested = enabled;
+}
+
+static void
+drm_output_set_allow_tearing(struct weston_output *base, bool allow)
+{
+	struct drm_output *output = to_drm_output(base);
+
+	output->allow_tearing = allow;
+}
+
+/* VRR_ENABLED is only set through atomic commits. */
+static bool
+drm_output_vrr_supported(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_head *base;
+
+	if (!b->atomic_modeset ||
+	    output->props_crtc[WDRM_CRTC_VRR_ENABLED].prop_id == 0)
+		return false;
+
+	wl_list_for_each(base, &output->base.head_list, output_link) {
+		if (!to_drm_head(base)->vrr_capable)
+			return false;
+	}
+
+	return true;
+}
+
 static int
 drm_output_init_gamma_size(struct drm_output *output)
 {
@@ -1681,6 +1876,12 @@ drm_output_fini_crtc(struct drm_output *output)
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
 	uint32_t *unused;
 
+	output->vrr_enabled = false;
+	output->base.unpaced_repaint = false;
+
+	drm_output_fail_captures(output);
+	output->base.capture_pixels_async = NULL;
+
 	/* If the compositor is already shutting down, the planes have already
 	 * been destroyed. */
 	if (!b->shutting_down) {
@@ -1744,6 +1945,13 @@ drm_output_enable(struct weston_output *base)
 	if (drm_output_init_gamma_size(output) < 0)
 		goto err;
 
+	if (output->vrr_requested) {
+		output->vrr_enabled = drm_output_vrr_supported(output);
+		weston_log("Output %s: %s variable refresh rate\n",
+			   output->base.name,
+			   output->vrr_enabled ? "using" : "does not support");
+	}
+
 	if (b->pageflip_timeout)
 		drm_output_pageflip_timer_create(output);
 
@@ -1765,6 +1973,9 @@ drm_output_enable(struct weston_output *base)
 	output->base.set_dpms = drm_set_dpms;
 	output->base.switch_mode = drm_output_switch_mode;
 	output->base.set_gamma = drm_output_set_gamma;
+	if (drm_output_can_writeback(output))
+		output->base.capture_pixels_async =
+			drm_output_capture_pixels_async;
 
 	if (output->cursor_plane)
 		weston_compositor_stack_plane(b->compositor,
@@ -1844,6 +2055,8 @@ drm_output_destroy(struct weston_output *base)
 	if (output->pageflip_timer)
 		wl_event_source_remove(output->pageflip_timer);
 
+	drm_output_late_latch_reset_frame(output);
+
 	weston_output_release(&output->base);
 
 	assert(!output->state_last);
@@ -2020,6 +2233,9 @@ drm_head_assign_connector_info(struct drm_head *head,
 				   WDRM_CONNECTOR__COUNT, props);
 	update_head_from_connector(head, props);
 
+	head->vrr_capable = drm_property_get_value(
+		&head->props_conn[WDRM_CONNECTOR_VRR_CAPABLE], props, 0) == 1;
+
 	weston_head_set_content_protection_status(&head->base,
 					 drm_head_get_current_protection(head, props));
 	drmModeFreeObjectProperties(props);
@@ -2177,6 +2393,8 @@ drm_output_create(struct weston_compositor *compositor, const char *name)
 		return NULL;
 
 	output->backend = b;
+	output->late_latch.fence_fd = -1;
+	wl_list_init(&output->capture_requests);
 #ifdef BUILD_DRM_GBM
 	output->gbm_bo_flags = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
 #endif
@@ -2220,6 +2438,9 @@ drm_backend_create_heads(struct drm_backend *b, struct udev_device *drm_device)
 	for (i = 0; i < resources->count_connectors; i++) {
 		uint32_t connector_id = resources->connectors[i];
 
+		if (drm_backend_add_writeback(b, connector_id))
+			continue;
+
 		head = drm_head_create(b, connector_id, drm_device);
 		if (!head) {
 			weston_log("DRM: failed to create head for connector %d.\n",
@@ -2252,6 +2473,9 @@ drm_backend_update_heads(struct drm_backend *b, struct udev_device *drm_device)
 	for (i = 0; i < resources->count_connectors; i++) {
 		uint32_t connector_id = resources->connectors[i];
 
+		if (drm_backend_is_writeback(b, connector_id))
+			continue;
+
 		head = drm_head_find_by_connector(b, connector_id);
 		if (head) {
 			drm_head_update_info(head);
@@ -2427,10 +2651,16 @@ drm_destroy(struct weston_compositor *ec)
 	wl_list_for_each_safe(base, next, &ec->head_list, compositor_link)
 		drm_head_destroy(to_drm_head(base));
 
+	drm_backend_destroy_writebacks(b);
+
 #ifdef BUILD_DRM_GBM
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
+	if (b->render.gbm)
+		gbm_device_destroy(b->render.gbm);
 #endif
+	if (b->render.fd >= 0)
+		close(b->render.fd);
 
 	udev_monitor_unref(b->udev_monitor);
 	udev_unref(b->udev);
@@ -2687,6 +2917,57 @@ open_specific_drm_device(struct drm_backend *b, const char *name)
 	return device;
 }
 
+/* Opens the GPU to render on, unless it is the KMS device anyway. Render
+ * nodes need no DRM master, so they are opened without the launcher. */
+static int
+open_render_device(struct drm_backend *b, const char *name)
+{
+	struct udev_device *device;
+	drmDevicePtr render_dev, kms_dev;
+	const char *filename;
+	bool same = false;
+	int fd;
+
+	device = udev_device_new_from_subsystem_sysname(b->udev, "drm", name);
+	filename = device ? udev_device_get_devnode(device) : NULL;
+	if (!filename) {
+		weston_log("ERROR: could not find render device '%s'\n", name);
+		goto err;
+	}
+
+	fd = open(filename, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		weston_log("ERROR: could not open render device %s: %s\n",
+			   filename, strerror(errno));
+		goto err;
+	}
+
+	if (drmGetDevice2(fd, 0, &render_dev) == 0) {
+		if (drmGetDevice2(b->drm.fd, 0, &kms_dev) == 0) {
+			same = drmDevicesEqual(render_dev, kms_dev);
+			drmFreeDevice(&kms_dev);
+		}
+		drmFreeDevice(&render_dev);
+	}
+
+	if (same) {
+		close(fd);
+	} else {
+		b->render.fd = fd;
+		b->render.devnum = udev_device_get_devnum(device);
+		weston_log("Rendering on %s, another GPU than %s\n",
+			   filename, b->drm.filename);
+	}
+
+	udev_device_unref(device);
+	return 0;
+
+err:
+	if (device)
+		udev_device_unref(device);
+	return -1;
+}
+
 static void
 planes_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	       uint32_t key, void *data)
@@ -2819,10 +3100,48 @@ recorder_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 #endif
 
 
+/* The default feedback only has the renderer tranche; scanout tranches are
+ * added per surface by drm_assign_planes(), targeting the KMS device also
+ * when rendering on another GPU. */
+static int
+drm_backend_create_dmabuf_feedback(struct drm_backend *b)
+{
+	struct weston_compositor *compositor = b->compositor;
+	dev_t render_devnum = b->render.fd >= 0 ? b->render.devnum :
+						  b->drm.devnum;
+
+	compositor->dmabuf_feedback_format_table =
+		weston_dmabuf_feedback_format_table_create(compositor);
+	if (!compositor->dmabuf_feedback_format_table)
+		return -1;
+
+	compositor->default_dmabuf_feedback =
+		weston_dmabuf_feedback_create(render_devnum);
+	if (!compositor->default_dmabuf_feedback)
+		goto err_table;
+
+	if (!weston_dmabuf_feedback_tranche_create(compositor->default_dmabuf_feedback,
+						   compositor->dmabuf_feedback_format_table,
+						   render_devnum, 0, RENDERER_PREF))
+		goto err_feedback;
+
+	return 0;
+
+err_feedback:
+	weston_dmabuf_feedback_destroy(compositor->default_dmabuf_feedback);
+	compositor->default_dmabuf_feedback = NULL;
+err_table:
+	weston_dmabuf_feedback_format_table_destroy(compositor->dmabuf_feedback_format_table);
+	compositor->dmabuf_feedback_format_table = NULL;
+	return -1;
+}
+
 static const struct weston_drm_output_api api = {
 	drm_output_set_mode,
 	drm_output_set_gbm_format,
 	drm_output_set_seat,
+	drm_output_set_vrr,
+	drm_output_set_allow_tearing,
 };
 
 static struct drm_backend *
@@ -2851,11 +3170,13 @@ drm_backend_create(struct weston_compositor *compositor,
 
 	b->state_invalid = true;
 	b->drm.fd = -1;
+	b->render.fd = -1;
 	wl_array_init(&b->unused_crtcs);
 
 	b->compositor = compositor;
 	b->use_pixman = config->use_pixman;
 	b->pageflip_timeout = config->pageflip_timeout;
+	b->late_latching = config->late_latching;
 	b->use_pixman_shadow = config->use_pixman_shadow;
 
 	b->debug = weston_compositor_add_log_scope(compositor, "drm-backend",
@@ -2901,6 +3222,10 @@ drm_backend_create(struct weston_compositor *compositor,
 		goto err_udev_dev;
 	}
 
+	if (config->render_device && !b->use_pixman &&
+	    open_render_device(b, config->render_device) < 0)
+		goto err_udev_dev;
+
 	if (b->use_pixman) {
 		if (init_pixman(b) < 0) {
 			weston_log("failed to initialize pixman renderer\n");
@@ -2924,6 +3249,7 @@ drm_backend_create(struct weston_compositor *compositor,
 	weston_setup_vt_switch_bindings(compositor);
 
 	wl_list_init(&b->plane_list);
+	wl_list_init(&b->writeback_list);
 	create_sprites(b);
 
 	if (udev_input_init(&b->input,
@@ -2982,6 +3308,9 @@ drm_backend_create(struct weston_compositor *compositor,
 					    renderer_switch_binding, b);
 
 	if (compositor->renderer->import_dmabuf) {
+		if (drm_backend_create_dmabuf_feedback(b) < 0)
+			weston_log("Error: initializing dmabuf feedback "
+				   "failed.\n");
 		if (linux_dmabuf_setup(compositor) < 0)
 			weston_log("Error: initializing dmabuf "
 				   "support failed.\n");
@@ -3024,13 +3353,18 @@ err_drm_source:
 	wl_event_source_remove(b->drm_source);
 err_udev_input:
 	udev_input_destroy(&b->input);
+	drm_backend_destroy_writebacks(b);
 err_sprite:
 #ifdef BUILD_DRM_GBM
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
+	if (b->render.gbm)
+		gbm_device_destroy(b->render.gbm);
 #endif
 	destroy_sprites(b);
 err_udev_dev:
+	if (b->render.fd >= 0)
+		close(b->render.fd);
 	udev_device_unref(drm_device);
 err_udev:
 	udev_unref(b->udev);
@@ -172,7 +172,7 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 	if (ret)
 		goto err_add_fb;
 
-	fb->map = mmap(NULL, fb->size, PROT_WRITE,
+	fb->map = mmap(NULL, fb->size, PROT_READ | PROT_WRITE,
 		       MAP_SHARED, b->drm.fd, map_arg.offset);
 	if (fb->map == MAP_FAILED)
 		goto err_add_fb;
@@ -460,6 +460,93 @@ err_free:
 	return NULL;
 }
 
+static void
+drm_fb_destroy_render(struct gbm_bo *bo, void *data)
+{
+	struct drm_fb *fb = data;
+	struct drm_gem_close gem_close = { .handle = fb->handles[0] };
+	int fd = fb->fd;
+
+	assert(fb->type == BUFFER_GBM_SURFACE);
+	drm_fb_destroy(fb);
+
+	/* The handle is ours, imported from the render GPU. */
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+}
+
+/** Imports a renderer buffer of another GPU on the KMS device
+ *
+ * @param bo A buffer of the render GPU, linear and single-planar.
+ * @param backend The backend.
+ * @return A framebuffer of the KMS device scanning out bo, or NULL if the
+ * KMS device cannot import it.
+ */
+struct drm_fb *
+drm_fb_get_from_render_bo(struct gbm_bo *bo, struct drm_backend *backend)
+{
+	struct drm_fb *fb = gbm_bo_get_user_data(bo);
+	int fd;
+
+	if (fb) {
+		assert(fb->type == BUFFER_GBM_SURFACE);
+		return drm_fb_ref(fb);
+	}
+
+	fb = zalloc(sizeof *fb);
+	if (fb == NULL)
+		return NULL;
+
+	fb->type = BUFFER_GBM_SURFACE;
+	fb->refcnt = 1;
+	fb->bo = bo;
+	fb->fd = backend->drm.fd;
+
+	fb->width = gbm_bo_get_width(bo);
+	fb->height = gbm_bo_get_height(bo);
+	fb->format = pixel_format_get_info(gbm_bo_get_format(bo));
+	fb->size = 0;
+	fb->num_planes = 1;
+	fb->strides[0] = gbm_bo_get_stride(bo);
+	fb->modifier = DRM_FORMAT_MOD_LINEAR;
+
+	if (!fb->format) {
+		weston_log("couldn't look up format 0x%lx\n",
+			   (unsigned long) gbm_bo_get_format(bo));
+		goto err_free;
+	}
+
+	/* The renderer always produces an opaque image. */
+	fb->format = pixel_format_get_opaque_substitute(fb->format);
+
+	fd = gbm_bo_get_fd(bo);
+	if (fd < 0)
+		goto err_free;
+	if (drmPrimeFDToHandle(backend->drm.fd, fd, &fb->handles[0]) != 0) {
+		drm_debug(backend, "\t\t[render] dmabuf import failed: %s\n",
+			  strerror(errno));
+		close(fd);
+		goto err_free;
+	}
+	close(fd);
+
+	if (drm_fb_addfb(backend, fb) != 0) {
+		struct drm_gem_close gem_close = { .handle = fb->handles[0] };
+
+		drm_debug(backend, "\t\t[render] addfb failed: %s\n",
+			  strerror(errno));
+		drmIoctl(backend->drm.fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		goto err_free;
+	}
+
+	gbm_bo_set_user_data(bo, fb, drm_fb_destroy_render);
+
+	return fb;
+
+err_free:
+	free(fb);
+	return NULL;
+}
+
 static void
 drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer,
 		  struct weston_buffer_release *buffer_release)
@@ -30,6 +30,7 @@
 #include "config.h"
 
 #include <stdint.h>
+#include <inttypes.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -58,6 +59,27 @@ struct drm_property_enum_info plane_type_enums[] = {
 	},
 };
 
+struct drm_property_enum_info plane_color_encoding_enums[] = {
+	[WDRM_PLANE_COLOR_ENCODING_BT601] = {
+		.name = "ITU-R BT.601 YCbCr",
+	},
+	[WDRM_PLANE_COLOR_ENCODING_BT709] = {
+		.name = "ITU-R BT.709 YCbCr",
+	},
+	[WDRM_PLANE_COLOR_ENCODING_BT2020] = {
+		.name = "ITU-R BT.2020 YCbCr",
+	},
+};
+
+struct drm_property_enum_info plane_color_range_enums[] = {
+	[WDRM_PLANE_COLOR_RANGE_LIMITED] = {
+		.name = "YCbCr limited range",
+	},
+	[WDRM_PLANE_COLOR_RANGE_FULL] = {
+		.name = "YCbCr full range",
+	},
+};
+
 const struct drm_property_info plane_props[] = {
 	[WDRM_PLANE_TYPE] = {
 		.name = "type",
@@ -78,6 +100,16 @@ const struct drm_property_info plane_props[] = {
 	[WDRM_PLANE_IN_FENCE_FD] = { .name = "IN_FENCE_FD" },
 	[WDRM_PLANE_FB_DAMAGE_CLIPS] = { .name = "FB_DAMAGE_CLIPS" },
 	[WDRM_PLANE_ZPOS] = { .name = "zpos" },
+	[WDRM_PLANE_COLOR_ENCODING] = {
+		.name = "COLOR_ENCODING",
+		.enum_values = plane_color_encoding_enums,
+		.num_enum_values = WDRM_PLANE_COLOR_ENCODING__COUNT,
+	},
+	[WDRM_PLANE_COLOR_RANGE] = {
+		.name = "COLOR_RANGE",
+		.enum_values = plane_color_range_enums,
+		.num_enum_values = WDRM_PLANE_COLOR_RANGE__COUNT,
+	},
 };
 
 struct drm_property_enum_info dpms_state_enums[] = {
@@ -147,11 +179,13 @@ const struct drm_property_info connector_props[] = {
 		.enum_values = panel_orientation_enums,
 		.num_enum_values = WDRM_PANEL_ORIENTATION__COUNT,
 	},
+	[WDRM_CONNECTOR_VRR_CAPABLE] = { .name = "vrr_capable", },
 };
 
 const struct drm_property_info crtc_props[] = {
 	[WDRM_CRTC_MODE_ID] = { .name = "MODE_ID", },
 	[WDRM_CRTC_ACTIVE] = { .name = "ACTIVE", },
+	[WDRM_CRTC_VRR_ENABLED] = { .name = "VRR_ENABLED", },
 };
 
 
@@ -752,7 +786,19 @@ drm_output_apply_state_legacy(struct drm_output_state *state)
 			   output->crtc_id, scanout_state->plane->plane_id,
 			   pinfo ? pinfo->drm_format_name : "UNKNOWN");
 
-	if (drmModePageFlip(backend->drm.fd, output->crtc_id,
+	if (state->tearing &&
+	    drmModePageFlip(backend->drm.fd, output->crtc_id,
+			    scanout_state->fb->fb_id,
+			    DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC,
+			    output) < 0) {
+		drm_debug(backend, "\t[CRTC:%u] async flip failed, waiting "
+				   "for vblank: %s\n", output->crtc_id,
+			  strerror(errno));
+		state->tearing = false;
+	}
+
+	if (!state->tearing &&
+	    drmModePageFlip(backend->drm.fd, output->crtc_id,
 			    scanout_state->fb->fb_id,
 			    DRM_MODE_PAGE_FLIP_EVENT, output) < 0) {
 		weston_log("queueing pageflip failed: %s\n", strerror(errno));
@@ -851,6 +897,39 @@ plane_add_prop(drmModeAtomicReq *req, struct drm_plane *plane,
 	return (ret <= 0) ? -1 : 0;
 }
 
+static int
+plane_add_enum_prop(drmModeAtomicReq *req, struct drm_plane *plane,
+		    enum wdrm_plane_property prop, unsigned int enum_idx)
+{
+	struct drm_property_info *info = &plane->props[prop];
+
+	if (info->prop_id == 0 || !info->enum_values[enum_idx].valid)
+		return 0;
+
+	return plane_add_prop(req, plane, prop,
+			      info->enum_values[enum_idx].value);
+}
+
+/* YUV frame buffers are converted the same way as the GL renderer's
+ * shaders do, BT.601 limited range, so moving a video between an overlay
+ * and composition does not change its colours. */
+static int
+plane_add_yuv_props(drmModeAtomicReq *req, struct drm_plane_state *state)
+{
+	int ret = 0;
+
+	if (!state->fb || !state->fb->format ||
+	    !pixel_format_is_yuv(state->fb->format))
+		return 0;
+
+	ret |= plane_add_enum_prop(req, state->plane, WDRM_PLANE_COLOR_ENCODING,
+				   WDRM_PLANE_COLOR_ENCODING_BT601);
+	ret |= plane_add_enum_prop(req, state->plane, WDRM_PLANE_COLOR_RANGE,
+				   WDRM_PLANE_COLOR_RANGE_LIMITED);
+
+	return ret;
+}
+
 static bool
 drm_head_has_prop(struct drm_head *head,
 		  enum wdrm_connector_property prop)
@@ -961,6 +1040,9 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 		ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID,
 				     current_mode->blob_id);
 		ret |= crtc_add_prop(req, output, WDRM_CRTC_ACTIVE, 1);
+		if (output->props_crtc[WDRM_CRTC_VRR_ENABLED].prop_id)
+			ret |= crtc_add_prop(req, output, WDRM_CRTC_VRR_ENABLED,
+					     output->vrr_enabled);
 
 		/* No need for the DPMS property, since it is implicit in
 		 * routing and CRTC activity. */
@@ -1027,6 +1109,8 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 					      plane_state->in_fence_fd);
 		}
 
+		ret |= plane_add_yuv_props(req, plane_state);
+
 		/* do note, that 'invented' zpos values are set as immutable */
 		if (plane_state->zpos != DRM_PLANE_ZPOS_INVALID_PLANE &&
 		    plane_state->plane->zpos_min != plane_state->plane->zpos_max)
@@ -1043,6 +1127,128 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 	return 0;
 }
 
+static void
+drm_test_cache_clear(struct drm_backend *b)
+{
+	memset(b->test_cache.entries, 0, sizeof(b->test_cache.entries));
+	b->test_cache.next = 0;
+}
+
+static uint64_t
+drm_test_key_add(uint64_t key, uint64_t value)
+{
+	int i;
+
+	/* FNV-1a over the bytes of value */
+	for (i = 0; i < 8; i++) {
+		key ^= (value >> (i * 8)) & 0xff;
+		key *= 0x100000001b3ull;
+	}
+
+	return key;
+}
+
+static uint64_t
+drm_test_key_add_output(uint64_t key, struct drm_output_state *output_state)
+{
+	struct drm_output *output = output_state->output;
+	struct drm_mode *mode = to_drm_mode(output->base.current_mode);
+	struct drm_plane_state *ps;
+	struct drm_head *head;
+
+	key = drm_test_key_add(key, output->crtc_id);
+	key = drm_test_key_add(key, mode->blob_id);
+	key = drm_test_key_add(key, output_state->dpms);
+	key = drm_test_key_add(key, output->state_cur->dpms);
+	key = drm_test_key_add(key, output_state->protection);
+	wl_list_for_each(head, &output->base.head_list, base.output_link)
+		key = drm_test_key_add(key, head->connector_id);
+
+	wl_list_for_each(ps, &output_state->plane_list, link) {
+		struct drm_fb *fb = ps->fb;
+
+		key = drm_test_key_add(key, ps->plane->plane_id);
+		if (!fb) {
+			key = drm_test_key_add(key, 0);
+			continue;
+		}
+
+		key = drm_test_key_add(key, fb->format ? fb->format->format : 0);
+		key = drm_test_key_add(key, fb->modifier);
+		key = drm_test_key_add(key, fb->width);
+		key = drm_test_key_add(key, fb->height);
+		key = drm_test_key_add(key, fb->strides[0]);
+		key = drm_test_key_add(key, fb->num_planes);
+		key = drm_test_key_add(key, ((uint64_t)ps->src_x << 32) |
+					    (uint32_t)ps->src_y);
+		key = drm_test_key_add(key, ((uint64_t)ps->src_w << 32) |
+					    ps->src_h);
+		key = drm_test_key_add(key, ((uint64_t)ps->dest_x << 32) |
+					    (uint32_t)ps->dest_y);
+		key = drm_test_key_add(key, ((uint64_t)ps->dest_w << 32) |
+					    ps->dest_h);
+		key = drm_test_key_add(key, ps->zpos);
+		key = drm_test_key_add(key, ps->in_fence_fd >= 0);
+	}
+
+	return key;
+}
+
+/**
+ * Computes the signature of everything drm_output_apply_state_atomic()
+ * puts into a TEST_ONLY commit, except for the framebuffer IDs: the
+ * buffers are replaced by their format, modifier, size and pitch, so that
+ * a new frame of the same scene maps to the same key.
+ *
+ * The current state of the outputs not in pending_state is included too,
+ * since what they use limits what the tested ones can get.
+ */
+static uint64_t
+drm_pending_state_test_key(struct drm_pending_state *pending_state)
+{
+	struct drm_backend *b = pending_state->backend;
+	struct drm_output_state *output_state;
+	struct weston_output *base;
+	uint64_t key = 0xcbf29ce484222325ull;
+
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		if (!output_state->output->virtual)
+			key = drm_test_key_add_output(key, output_state);
+	}
+
+	key = drm_test_key_add(key, 0);
+
+	wl_list_for_each(base, &b->compositor->output_list, link) {
+		struct drm_output *output = to_drm_output(base);
+
+		if (output->virtual || !output->state_cur ||
+		    drm_pending_state_get_output(pending_state, output))
+			continue;
+
+		key = drm_test_key_add_output(key, output->state_cur);
+	}
+
+	return key;
+}
+
+/* Whether every output of the pending state is to be flipped to without
+ * waiting for vblank; asynchronous atomic commits apply to all of them. */
+static bool
+drm_pending_state_is_tearing(struct drm_pending_state *pending_state)
+{
+	struct drm_output_state *output_state;
+
+	if (wl_list_empty(&pending_state->output_list))
+		return false;
+
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		if (!output_state->tearing)
+			return false;
+	}
+
+	return true;
+}
+
 /**
  * Helper function used only by drm_pending_state_apply, with the same
  * guarantees and constraints as that function.
@@ -1082,6 +1288,9 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 		drm_debug(b, "\t\t[atomic] previous state invalid; "
 			     "starting with fresh state\n");
 
+		/* Whatever changed may also change what the kernel accepts. */
+		drm_test_cache_clear(b);
+
 		/* If we need to reset all our state (e.g. because we've
 		 * just started, or just been VT-switched in), explicitly
 		 * disable all the CRTCs and connectors we aren't using. */
@@ -1172,6 +1381,8 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 			plane_add_prop(req, plane, WDRM_PLANE_FB_ID, 0);
 		}
 
+		drm_writeback_add_reset(b, req);
+
 		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 	}
 
@@ -1188,6 +1399,49 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 		goto out;
 	}
 
+	/* Writeback is tried on top of the state, which is committed
+	 * again without it if the kernel refuses the combination. */
+	if (mode != DRM_STATE_TEST_ONLY) {
+		int cursor = drmModeAtomicGetCursor(req);
+		uint32_t wb_flags = flags;
+
+		if (drm_pending_state_add_writeback(pending_state, req,
+						    &wb_flags,
+						    mode == DRM_STATE_APPLY_ASYNC)) {
+			ret = drmModeAtomicCommit(b->drm.fd, req, wb_flags, b);
+			drm_debug(b, "[atomic] drmModeAtomicCommit, writeback\n");
+			drm_writeback_commit_done(b, ret == 0);
+			if (ret == 0) {
+				wl_list_for_each(output_state,
+						 &pending_state->output_list,
+						 link)
+					output_state->tearing = false;
+				goto committed;
+			}
+
+			drm_debug(b, "[atomic] writeback commit failed: %s\n",
+				  strerror(errno));
+			drmModeAtomicSetCursor(req, cursor);
+		}
+	}
+
+	if (mode == DRM_STATE_APPLY_ASYNC &&
+	    !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET) &&
+	    drm_pending_state_is_tearing(pending_state)) {
+		ret = drmModeAtomicCommit(b->drm.fd, req,
+					  flags | DRM_MODE_PAGE_FLIP_ASYNC, b);
+		drm_debug(b, "[atomic] drmModeAtomicCommit, async\n");
+		if (ret == 0)
+			goto committed;
+
+		/* The kernel only flips some changes asynchronously, and
+		 * does not say which beforehand; wait for vblank instead. */
+		drm_debug(b, "[atomic] async commit failed, waiting for "
+			     "vblank: %s\n", strerror(errno));
+	}
+	wl_list_for_each(output_state, &pending_state->output_list, link)
+		output_state->tearing = false;
+
 	ret = drmModeAtomicCommit(b->drm.fd, req, flags, b);
 	drm_debug(b, "[atomic] drmModeAtomicCommit\n");
 
@@ -1201,9 +1455,11 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 	if (ret != 0) {
 		weston_log("atomic: couldn't commit new state: %s\n",
 			   strerror(errno));
+		drm_test_cache_clear(b);
 		goto out;
 	}
 
+committed:
 	wl_list_for_each_safe(output_state, tmp, &pending_state->output_list,
 			      link)
 		drm_output_assign_state(output_state, mode);
@@ -1235,19 +1491,52 @@ out:
  * Unlike drm_pending_state_apply() and drm_pending_state_apply_sync(), this
  * function does _not_ take ownership of pending_state, nor does it clear
  * state_invalid.
+ *
+ * Each test is a round trip to the kernel, and drm_output_propose_state()
+ * makes several per output and repaint, whose outcome does not change as
+ * long as the scene does not. Results are therefore remembered by a
+ * signature of the tested configuration, see drm_pending_state_test_key(),
+ * and cleared when the state gets invalidated or a real commit fails.
  */
 int
 drm_pending_state_test(struct drm_pending_state *pending_state)
 {
 	struct drm_backend *b = pending_state->backend;
+	struct drm_test_cache_entry *entry;
+	uint64_t key;
+	unsigned int i;
+	int ret;
 
-	if (b->atomic_modeset)
+	/* We have no way to test state before application on the legacy
+	 * modesetting API, so just claim it succeeded. */
+	if (!b->atomic_modeset)
+		return 0;
+
+	if (!b->test_cache.enabled || b->state_invalid)
 		return drm_pending_state_apply_atomic(pending_state,
 						      DRM_STATE_TEST_ONLY);
 
-	/* We have no way to test state before application on the legacy
-	 * modesetting API, so just claim it succeeded. */
-	return 0;
+	key = drm_pending_state_test_key(pending_state);
+	for (i = 0; i < ARRAY_LENGTH(b->test_cache.entries); i++) {
+		entry = &b->test_cache.entries[i];
+		if (entry->valid && entry->key == key) {
+			drm_debug(b, "\t\t[atomic] test result %d cached for "
+				     "key %016" PRIx64 "\n", entry->result, key);
+			return entry->result;
+		}
+	}
+
+	ret = drm_pending_state_apply_atomic(pending_state,
+					     DRM_STATE_TEST_ONLY);
+
+	entry = &b->test_cache.entries[b->test_cache.next];
+	entry->key = key;
+	entry->result = ret;
+	entry->valid = true;
+	b->test_cache.next = (b->test_cache.next + 1) %
+			     ARRAY_LENGTH(b->test_cache.entries);
+
+	return ret;
 }
 
 /**
@@ -1377,6 +1666,9 @@ page_flip_handler(int fd, unsigned int frame,
 			 WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION |
 			 WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
 
+	if (output->state_cur->tearing)
+		flags &= ~WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
+
 	drm_output_update_msc(output, frame);
 
 	assert(!b->atomic_modeset);
@@ -1402,6 +1694,9 @@ atomic_flip_handler(int fd, unsigned int frame, unsigned int sec,
 	if (!output || !output->base.enabled)
 		return;
 
+	if (output->state_cur->tearing)
+		flags &= ~WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
+
 	drm_output_update_msc(output, frame);
 
 	drm_debug(b, "[atomic][CRTC:%u] flip processing started\n", crtc_id);
@@ -1475,6 +1770,8 @@ init_kms_caps(struct drm_backend *b)
 		ret = drmSetClientCap(b->drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
 		b->atomic_modeset = ((ret == 0) && (cap == 1));
 	}
+	b->test_cache.enabled = b->atomic_modeset &&
+				!getenv("WESTON_DISABLE_ATOMIC_TEST_CACHE");
 	weston_log("DRM: %s atomic modesetting\n",
 		   b->atomic_modeset ? "supports" : "does not support");
 
@@ -1497,10 +1794,32 @@ init_kms_caps(struct drm_backend *b)
 	if (!b->atomic_modeset || getenv("WESTON_FORCE_RENDERER"))
 		b->sprites_are_broken = true;
 
+	if (b->atomic_modeset) {
+#ifdef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+		ret = drmGetCap(b->drm.fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP,
+				&cap);
+		b->atomic_async_page_flip = (ret == 0 && cap == 1);
+#endif
+	} else {
+		ret = drmGetCap(b->drm.fd, DRM_CAP_ASYNC_PAGE_FLIP, &cap);
+		b->async_page_flip = (ret == 0 && cap == 1);
+	}
+	weston_log("DRM: %s asynchronous page flips\n",
+		   b->async_page_flip || b->atomic_async_page_flip ?
+		   "supports" : "does not support");
+
 	ret = drmSetClientCap(b->drm.fd, DRM_CLIENT_CAP_ASPECT_RATIO, 1);
 	b->aspect_ratio_supported = (ret == 0);
 	weston_log("DRM: %s picture aspect ratio\n",
 		   b->aspect_ratio_supported ? "supports" : "does not support");
 
+	if (b->atomic_modeset && !getenv("WESTON_DISABLE_WRITEBACK")) {
+		ret = drmSetClientCap(b->drm.fd,
+				      DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1);
+		b->writeback_connectors = (ret == 0);
+	}
+	weston_log("DRM: %s writeback connectors\n",
+		   b->writeback_connectors ? "supports" : "does not support");
+
 	return 0;
 }
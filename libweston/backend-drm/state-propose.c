@@ -39,6 +39,7 @@
 #include "drm-internal.h"
 
 #include "linux-dmabuf.h"
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
 #include "presentation-time-server-protocol.h"
 
 enum drm_output_propose_state_mode {
@@ -124,17 +125,10 @@ drm_output_check_plane_has_view_assigned(struct drm_plane *plane,
 }
 
 static bool
-drm_output_plane_has_valid_format(struct drm_plane *plane,
-				  struct drm_output_state *state,
-				  struct drm_fb *fb)
+drm_plane_supports_fb_format(struct drm_plane *plane, struct drm_fb *fb)
 {
-	struct drm_backend *b = plane->backend;
 	unsigned int i;
 
-	if (!fb)
-		return false;
-
-	/* Check whether the format is supported */
 	for (i = 0; i < plane->count_formats; i++) {
 		unsigned int j;
 
@@ -150,6 +144,23 @@ drm_output_plane_has_valid_format(struct drm_plane *plane,
 		}
 	}
 
+	return false;
+}
+
+static bool
+drm_output_plane_has_valid_format(struct drm_plane *plane,
+				  struct drm_output_state *state,
+				  struct drm_fb *fb)
+{
+	struct drm_backend *b = plane->backend;
+
+	if (!fb)
+		return false;
+
+	/* Check whether the format is supported */
+	if (drm_plane_supports_fb_format(plane, fb))
+		return true;
+
 	drm_debug(b, "\t\t\t\t[%s] not placing view on %s: "
 		  "no free %s planes matching format %s (0x%lx) "
 		  "modifier 0x%llx\n",
@@ -175,6 +186,28 @@ drm_output_plane_cursor_has_valid_format(struct weston_view *ev)
 	return false;
 }
 
+/* Planes of subsampled YUV formats can only be cut at whole chroma samples
+ * on most hardware; widen the source rectangle out to them. */
+static void
+drm_plane_state_align_src_to_chroma(struct drm_plane_state *state,
+				    struct drm_fb *fb)
+{
+	int32_t hsub = MAX(fb->format->hsub, 1) << 16;
+	int32_t vsub = MAX(fb->format->vsub, 1) << 16;
+	int32_t x2 = state->src_x + state->src_w;
+	int32_t y2 = state->src_y + state->src_h;
+
+	if (hsub == 1 << 16 && vsub == 1 << 16)
+		return;
+
+	state->src_x -= state->src_x % hsub;
+	state->src_y -= state->src_y % vsub;
+	x2 = MIN(x2 + (hsub - x2 % hsub) % hsub, fb->width << 16);
+	y2 = MIN(y2 + (vsub - y2 % vsub) % vsub, fb->height << 16);
+	state->src_w = x2 - state->src_x;
+	state->src_h = y2 - state->src_y;
+}
+
 static struct drm_plane_state *
 drm_output_prepare_overlay_view(struct drm_plane *plane,
 				struct drm_output_state *output_state,
@@ -212,6 +245,9 @@ drm_output_prepare_overlay_view(struct drm_plane *plane,
 		goto out;
 	}
 
+	if (pixel_format_is_yuv(fb->format))
+		drm_plane_state_align_src_to_chroma(state, fb);
+
 	/* If the surface buffer has an in-fence fd, but the plane
 	 * doesn't support fences, we can't place the buffer on this
 	 * plane. */
@@ -540,14 +576,17 @@ drm_output_try_view_on_plane(struct drm_plane *plane,
 	case WDRM_PLANE_TYPE_OVERLAY:
 		/* do not attempt to place it in the overlay if we don't have
 		 * anything in the scanout/primary and the view doesn't cover
-		 * the entire output  */
+		 * the entire output; unless the primary plane cannot take its
+		 * format anyway, as with most YUV video, and the renderer
+		 * fills the primary plane below it */
 		view_matches_entire_output =
 			weston_view_matches_output_entirely(ev, wet_output);
 		scanout_has_view_assigned =
 			drm_output_check_plane_has_view_assigned(scanout_plane,
 								 state);
 
-		if (view_matches_entire_output && !scanout_has_view_assigned) {
+		if (view_matches_entire_output && !scanout_has_view_assigned &&
+		    (!fb || drm_plane_supports_fb_format(scanout_plane, fb))) {
 			availability = NO_PLANES_ACCEPTED;
 			goto out;
 		}
@@ -657,6 +696,11 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 
 	fb = drm_fb_get_from_view(state, ev);
 
+	/* KMS refused to import the dmabuf, most likely its modifier */
+	if (!fb && linux_dmabuf_buffer_get(ev->surface->buffer_ref.buffer->resource))
+		ev->try_view_on_plane_failure_reasons |=
+			FAILURE_REASONS_FB_FORMAT_INCOMPATIBLE;
+
 	/* assemble a list with possible candidates */
 	wl_list_for_each(plane, &b->plane_list, link) {
 		if (!drm_plane_is_available(plane, output))
@@ -713,6 +757,9 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to "
 				     "candidate list: invalid pixel format\n",
 				     plane->plane_id);
+			if (plane->type != WDRM_PLANE_TYPE_CURSOR)
+				ev->try_view_on_plane_failure_reasons |=
+					FAILURE_REASONS_FB_FORMAT_INCOMPATIBLE;
 			continue;
 		}
 
@@ -919,6 +966,10 @@ drm_output_propose_state(struct weston_output *output_base,
 			force_renderer = true;
 		}
 
+		if (force_renderer)
+			ev->try_view_on_plane_failure_reasons |=
+				FAILURE_REASONS_FORCE_RENDERER;
+
 		if (!force_renderer) {
 			drm_debug(b, "\t\t\t[plane] started with zpos %"PRIu64"\n",
 				      current_lowest_zpos);
@@ -1029,6 +1080,114 @@ err:
 	return NULL;
 }
 
+static bool
+drm_output_add_scanout_formats(struct drm_output *output,
+			       struct weston_dmabuf_feedback_tranche *tranche,
+			       struct weston_dmabuf_feedback_format_table *table)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *plane;
+	unsigned int i, j;
+	bool added = false;
+
+	wl_list_for_each(plane, &b->plane_list, link) {
+		if (plane->type == WDRM_PLANE_TYPE_CURSOR ||
+		    !drm_plane_is_available(plane, output))
+			continue;
+
+		for (i = 0; i < plane->count_formats; i++) {
+			uint32_t format = plane->formats[i].format;
+
+			/* without IN_FORMATS the plane takes implicit
+			 * modifiers, which EGL reports either way */
+			if (plane->formats[i].count_modifiers == 0) {
+				added |= weston_dmabuf_feedback_tranche_add_format(tranche, table, format,
+										   DRM_FORMAT_MOD_INVALID);
+				added |= weston_dmabuf_feedback_tranche_add_format(tranche, table, format,
+										   DRM_FORMAT_MOD_LINEAR);
+				continue;
+			}
+
+			for (j = 0; j < plane->formats[i].count_modifiers; j++)
+				added |= weston_dmabuf_feedback_tranche_add_format(tranche, table, format,
+										   plane->formats[i].modifiers[j]);
+		}
+	}
+
+	return added;
+}
+
+/* Add a scanout tranche to the surface feedback of views that could be on
+ * a plane if only the client allocated a buffer the planes take, and take
+ * it away again once the view can't go on a plane for other reasons. */
+static void
+drm_output_update_dmabuf_feedback(struct drm_output *output,
+				  struct weston_view *ev,
+				  struct drm_plane *target_plane)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_compositor *compositor = output->base.compositor;
+	struct weston_dmabuf_feedback *dmabuf_feedback =
+		ev->surface->dmabuf_feedback;
+	struct weston_dmabuf_feedback_format_table *table =
+		compositor->dmabuf_feedback_format_table;
+	struct weston_dmabuf_feedback_tranche *scanout_tranche;
+	enum weston_dmabuf_feedback_action action = ACTION_NONE;
+	uint32_t reasons = ev->try_view_on_plane_failure_reasons;
+	struct timespec now;
+
+	if (!dmabuf_feedback || !table)
+		return;
+
+	if (!weston_view_has_valid_buffer(ev) ||
+	    !linux_dmabuf_buffer_get(ev->surface->buffer_ref.buffer->resource))
+		return;
+
+	scanout_tranche = weston_dmabuf_feedback_find_tranche(dmabuf_feedback,
+							      SCANOUT_PREF);
+
+	if (target_plane && target_plane->type != WDRM_PLANE_TYPE_CURSOR)
+		action = ACTION_NONE;
+	else if (reasons & FAILURE_REASONS_FORCE_RENDERER)
+		action = scanout_tranche ? ACTION_REMOVE_SCANOUT_TRANCHE :
+					   ACTION_NONE;
+	else if (reasons & FAILURE_REASONS_FB_FORMAT_INCOMPATIBLE)
+		action = scanout_tranche ? ACTION_NONE :
+					   ACTION_ADD_SCANOUT_TRANCHE;
+
+	weston_compositor_read_presentation_clock(compositor, &now);
+	if (!weston_dmabuf_feedback_action_ready(dmabuf_feedback, action, &now))
+		return;
+
+	switch (action) {
+	case ACTION_ADD_SCANOUT_TRANCHE:
+		scanout_tranche =
+			weston_dmabuf_feedback_tranche_create(dmabuf_feedback, table,
+							      b->drm.devnum,
+							      ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT,
+							      SCANOUT_PREF);
+		if (!scanout_tranche)
+			return;
+		if (!drm_output_add_scanout_formats(output, scanout_tranche,
+						    table)) {
+			weston_dmabuf_feedback_tranche_destroy(scanout_tranche);
+			return;
+		}
+		drm_debug(b, "\t[repaint] view %p: sending scanout tranche\n",
+			  ev);
+		break;
+	case ACTION_REMOVE_SCANOUT_TRANCHE:
+		weston_dmabuf_feedback_tranche_destroy(scanout_tranche);
+		drm_debug(b, "\t[repaint] view %p: removing scanout tranche\n",
+			  ev);
+		break;
+	case ACTION_NONE:
+		return;
+	}
+
+	weston_dmabuf_feedback_send_all(dmabuf_feedback, table);
+}
+
 void
 drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 {
@@ -1044,6 +1203,12 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	drm_debug(b, "\t[repaint] preparing state for output %s (%lu)\n",
 		  output_base->name, (unsigned long) output_base->id);
 
+	wl_list_for_each(ev, &output_base->compositor->view_list, link) {
+		if (ev->output_mask & (1u << output->base.id))
+			ev->try_view_on_plane_failure_reasons =
+				FAILURE_REASONS_NONE;
+	}
+
 	if (!b->sprites_are_broken && !output->virtual) {
 		drm_debug(b, "\t[repaint] trying planes-only build state\n");
 		state = drm_output_propose_state(output_base, pending_state, mode);
@@ -1122,6 +1287,8 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 			weston_view_move_to_plane(ev, primary);
 		}
 
+		drm_output_update_dmabuf_feedback(output, ev, target_plane);
+
 		if (!target_plane ||
 		    target_plane->type == WDRM_PLANE_TYPE_CURSOR) {
 			/* cursor plane & renderer involve a copy */
@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -46,6 +47,7 @@
 #include <va/va_vpp.h>
 
 #include <libweston/libweston.h>
+#include "shared/timespec-util.h"
 #include "vaapi-recorder.h"
 
 #define NAL_REF_IDC_NONE        0
@@ -70,11 +72,30 @@
 #define PROFILE_IDC_MAIN        77
 #define PROFILE_IDC_HIGH        100
 
+/* Frames that may wait for the encoder while another one is being encoded.
+ * The queued buffers are live scanout buffers, so keep this short. */
+#define VAAPI_RECORDER_INPUT_QUEUE_SIZE	2
+
+/* Upper bound of slices per picture, the driver may support less */
+#define VAAPI_RECORDER_MAX_SLICES	4
+
+struct vaapi_recorder_input {
+	int prime_fd, stride;
+};
+
+/* A coded frame waiting to be written out by the writer thread */
+struct vaapi_recorder_chunk {
+	struct vaapi_recorder_chunk *next;
+	size_t size;
+	uint8_t data[];
+};
+
 struct vaapi_recorder {
 	int drm_fd, output_fd;
 	int width, height;
 	int frame_count;
 
+	/* protected by mutex: error, destroying, input, output and stats */
 	int error;
 	int destroying;
 	pthread_t worker_thread;
@@ -82,10 +103,24 @@ struct vaapi_recorder {
 	pthread_cond_t input_cond;
 
 	struct {
-		int valid;
-		int prime_fd, stride;
+		struct vaapi_recorder_input queue[VAAPI_RECORDER_INPUT_QUEUE_SIZE];
+		int head, count;
 	} input;
 
+	struct {
+		pthread_t thread;
+		pthread_cond_t cond;
+		struct vaapi_recorder_chunk *first, **last;
+		int done;
+	} output;
+
+	struct {
+		unsigned int encoded;
+		unsigned int dropped;
+		uint64_t encode_usec_total;
+		uint64_t encode_usec_max;
+	} stats;
+
 	VADisplay va_dpy;
 
 	/* video post processing is used for colorspace conversion */
@@ -104,11 +139,12 @@ struct vaapi_recorder {
 		int intra_period;
 		int output_size;
 		int constraint_set_flag;
+		int num_slices;
 
 		struct {
 			VAEncSequenceParameterBufferH264 seq;
 			VAEncPictureParameterBufferH264 pic;
-			VAEncSliceParameterBufferH264 slice;
+			VAEncSliceParameterBufferH264 slice[VAAPI_RECORDER_MAX_SLICES];
 		} param;
 	} encoder;
 };
@@ -116,6 +152,9 @@ struct vaapi_recorder {
 static void *
 worker_thread_function(void *);
 
+static void *
+writer_thread_function(void *);
+
 /* bitstream code used for writing the packed headers */
 
 #define BITSTREAM_ALLOCATE_STEPPING	 4096
@@ -235,6 +274,33 @@ bitstream_byte_aligning(struct bitstream *bs, int bit)
 	bitstream_put_ui(bs, new_val, bit_left);
 }
 
+/* Splitting the picture lets drivers with several encoder pipes work on
+ * the slices in parallel. */
+static void
+encoder_init_num_slices(struct vaapi_recorder *r)
+{
+	VAConfigAttrib attrib;
+	VAStatus status;
+	int height_in_mbs = (r->height + 15) / 16;
+	int num_slices = VAAPI_RECORDER_MAX_SLICES;
+
+	attrib.type = VAConfigAttribEncMaxSlices;
+	status = vaGetConfigAttributes(r->va_dpy, VAProfileH264Main,
+				       VAEntrypointEncSlice, &attrib, 1);
+	if (status != VA_STATUS_SUCCESS ||
+	    attrib.value == VA_ATTRIB_NOT_SUPPORTED)
+		num_slices = 1;
+	else if (attrib.value < (uint32_t) num_slices)
+		num_slices = attrib.value;
+
+	if (num_slices > height_in_mbs)
+		num_slices = height_in_mbs;
+	if (num_slices < 1)
+		num_slices = 1;
+
+	r->encoder.num_slices = num_slices;
+}
+
 static VAStatus
 encoder_create_config(struct vaapi_recorder *r)
 {
@@ -251,6 +317,8 @@ encoder_create_config(struct vaapi_recorder *r)
 	attrib[1].type = VAConfigAttribRateControl;
 	attrib[1].value = VA_RC_CQP;
 
+	encoder_init_num_slices(r);
+
 	status = vaCreateConfig(r->va_dpy, VAProfileH264Main,
 				VAEntrypointEncSlice, attrib, 2,
 				&r->encoder.cfg);
@@ -379,21 +447,33 @@ encoder_update_slice_parameter(struct vaapi_recorder *r, int slice_type)
 	VABufferID slice_param_buf;
 	VAStatus status;
 
+	VAEncSliceParameterBufferH264 *slice;
 	int width_in_mbs = (r->width + 15) / 16;
 	int height_in_mbs = (r->height + 15) / 16;
+	int num_slices = r->encoder.num_slices;
+	int i, first_row, last_row;
+
+	memset(r->encoder.param.slice, 0, sizeof r->encoder.param.slice);
 
-	memset(&r->encoder.param.slice, 0, sizeof r->encoder.param.slice);
+	/* Slices are made of whole macroblock rows */
+	for (i = 0; i < num_slices; i++) {
+		slice = &r->encoder.param.slice[i];
 
-	r->encoder.param.slice.num_macroblocks = width_in_mbs * height_in_mbs;
-	r->encoder.param.slice.slice_type = slice_type;
+		first_row = height_in_mbs * i / num_slices;
+		last_row = height_in_mbs * (i + 1) / num_slices;
 
-	r->encoder.param.slice.slice_alpha_c0_offset_div2 = 2;
-	r->encoder.param.slice.slice_beta_offset_div2 = 2;
+		slice->macroblock_address = first_row * width_in_mbs;
+		slice->num_macroblocks = (last_row - first_row) * width_in_mbs;
+		slice->slice_type = slice_type;
+
+		slice->slice_alpha_c0_offset_div2 = 2;
+		slice->slice_beta_offset_div2 = 2;
+	}
 
 	status = vaCreateBuffer(r->va_dpy, r->encoder.ctx,
 				VAEncSliceParameterBufferType,
-				sizeof(r->encoder.param.slice), 1,
-				&r->encoder.param.slice,
+				sizeof(r->encoder.param.slice[0]), num_slices,
+				r->encoder.param.slice,
 				&slice_param_buf);
 
 	if (status == VA_STATUS_SUCCESS)
@@ -750,34 +830,63 @@ enum output_write_status {
 	OUTPUT_WRITE_FATAL
 };
 
+static void
+queue_output_chunk(struct vaapi_recorder *r, struct vaapi_recorder_chunk *chunk)
+{
+	pthread_mutex_lock(&r->mutex);
+
+	chunk->next = NULL;
+	*r->output.last = chunk;
+	r->output.last = &chunk->next;
+	pthread_cond_signal(&r->output.cond);
+
+	pthread_mutex_unlock(&r->mutex);
+}
+
+/* Copies the coded frame out of the VA buffer, the file write itself is
+ * done by the writer thread so a slow disk doesn't stall the encoder. */
 static enum output_write_status
 encoder_write_output(struct vaapi_recorder *r, VABufferID output_buf)
 {
-	VACodedBufferSegment *segment;
+	VACodedBufferSegment *first, *segment;
+	struct vaapi_recorder_chunk *chunk;
 	VAStatus status;
-	int count;
+	size_t size = 0;
 
-	status = vaMapBuffer(r->va_dpy, output_buf, (void **) &segment);
+	status = vaMapBuffer(r->va_dpy, output_buf, (void **) &first);
 	if (status != VA_STATUS_SUCCESS)
 		return OUTPUT_WRITE_FATAL;
 
-	if (segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
-		r->encoder.output_size *= 2;
+	for (segment = first; segment; segment = segment->next) {
+		if (segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
+			r->encoder.output_size *= 2;
+			vaUnmapBuffer(r->va_dpy, output_buf);
+			return OUTPUT_WRITE_OVERFLOW;
+		}
+		size += segment->size;
+	}
+
+	chunk = malloc(sizeof *chunk + size);
+	if (!chunk) {
 		vaUnmapBuffer(r->va_dpy, output_buf);
-		return OUTPUT_WRITE_OVERFLOW;
+		return OUTPUT_WRITE_FATAL;
 	}
 
-	count = write(r->output_fd, segment->buf, segment->size);
+	chunk->size = 0;
+	for (segment = first; segment; segment = segment->next) {
+		memcpy(chunk->data + chunk->size, segment->buf, segment->size);
+		chunk->size += segment->size;
+	}
 
 	vaUnmapBuffer(r->va_dpy, output_buf);
 
-	if (count < 0)
-		return OUTPUT_WRITE_FATAL;
+	queue_output_chunk(r, chunk);
 
 	return OUTPUT_WRITE_SUCCESS;
 }
 
-static void
+/* Returns an errno value on fatal errors, 0 otherwise */
+static int
 encoder_encode(struct vaapi_recorder *r, VASurfaceID input)
 {
 	VABufferID output_buf = VA_INVALID_ID;
@@ -785,6 +894,7 @@ encoder_encode(struct vaapi_recorder *r, VASurfaceID input)
 	VABufferID buffers[8];
 	int count = 0;
 	int i, slice_type;
+	int error = 0;
 	enum output_write_status ret;
 
 	if ((r->frame_count % r->encoder.intra_period) == 0)
@@ -823,19 +933,21 @@ encoder_encode(struct vaapi_recorder *r, VASurfaceID input)
 	} while (ret == OUTPUT_WRITE_OVERFLOW);
 
 	if (ret == OUTPUT_WRITE_FATAL)
-		r->error = errno;
+		error = errno ? errno : EIO;
 
 	for (i = 0; i < count; i++)
 		vaDestroyBuffer(r->va_dpy, buffers[i]);
 
 	r->frame_count++;
-	return;
+	return error;
 
 bail:
 	for (i = 0; i < count; i++)
 		vaDestroyBuffer(r->va_dpy, buffers[i]);
 	if (output_buf != VA_INVALID_ID)
 		vaDestroyBuffer(r->va_dpy, output_buf);
+
+	return 0;
 }
 
 
@@ -902,7 +1014,13 @@ setup_worker_thread(struct vaapi_recorder *r)
 {
 	pthread_mutex_init(&r->mutex, NULL);
 	pthread_cond_init(&r->input_cond, NULL);
+	pthread_cond_init(&r->output.cond, NULL);
+
+	r->output.first = NULL;
+	r->output.last = &r->output.first;
+
 	pthread_create(&r->worker_thread, NULL, worker_thread_function, r);
+	pthread_create(&r->output.thread, NULL, writer_thread_function, r);
 
 	return 1;
 }
@@ -910,6 +1028,8 @@ setup_worker_thread(struct vaapi_recorder *r)
 static void
 destroy_worker_thread(struct vaapi_recorder *r)
 {
+	struct vaapi_recorder_input *input;
+
 	pthread_mutex_lock(&r->mutex);
 
 	/* Make sure the worker thread finishes */
@@ -920,8 +1040,27 @@ destroy_worker_thread(struct vaapi_recorder *r)
 
 	pthread_join(r->worker_thread, NULL);
 
+	/* Frames still queued are not encoded */
+	while (r->input.count > 0) {
+		input = &r->input.queue[r->input.head];
+		close(input->prime_fd);
+		r->input.head = (r->input.head + 1) %
+				VAAPI_RECORDER_INPUT_QUEUE_SIZE;
+		r->input.count--;
+		r->stats.dropped++;
+	}
+
+	/* The writer flushes everything already encoded before leaving */
+	pthread_mutex_lock(&r->mutex);
+	r->output.done = 1;
+	pthread_cond_signal(&r->output.cond);
+	pthread_mutex_unlock(&r->mutex);
+
+	pthread_join(r->output.thread, NULL);
+
 	pthread_mutex_destroy(&r->mutex);
 	pthread_cond_destroy(&r->input_cond);
+	pthread_cond_destroy(&r->output.cond);
 }
 
 struct vaapi_recorder *
@@ -990,6 +1129,13 @@ vaapi_recorder_destroy(struct vaapi_recorder *r)
 {
 	destroy_worker_thread(r);
 
+	weston_log("[libva recorder] %u frames encoded in %d slices, "
+		   "%u dropped, encode time avg %.2f ms max %.2f ms\n",
+		   r->stats.encoded, r->encoder.num_slices, r->stats.dropped,
+		   r->stats.encoded ? r->stats.encode_usec_total /
+				      (r->stats.encoded * 1000.0) : 0.0,
+		   r->stats.encode_usec_max / 1000.0);
+
 	encoder_destroy(r);
 	vpp_destroy(r);
 
@@ -1079,52 +1225,139 @@ convert_rgb_to_yuv(struct vaapi_recorder *r, VASurfaceID rgb_surface)
 	return status;
 }
 
-static void
-recorder_frame(struct vaapi_recorder *r)
+/* Called from the worker thread without the mutex held. Returns an errno
+ * value on fatal errors, 0 otherwise. */
+static int
+recorder_frame(struct vaapi_recorder *r, struct vaapi_recorder_input *input)
 {
 	VASurfaceID rgb_surface;
 	VAStatus status;
+	int error;
 
-	status = create_surface_from_fd(r, r->input.prime_fd,
-					r->input.stride, &rgb_surface);
+	status = create_surface_from_fd(r, input->prime_fd,
+					input->stride, &rgb_surface);
+	close(input->prime_fd);
 	if (status != VA_STATUS_SUCCESS) {
 		weston_log("[libva recorder] "
 			   "failed to create surface from bo\n");
-		return;
+		return 0;
 	}
 
-	close(r->input.prime_fd);
-
 	status = convert_rgb_to_yuv(r, rgb_surface);
 	if (status != VA_STATUS_SUCCESS) {
 		weston_log("[libva recorder] "
 			   "color space conversion failed\n");
-		return;
+		vaDestroySurfaces(r->va_dpy, &rgb_surface, 1);
+		return 0;
 	}
 
-	encoder_encode(r, r->vpp.output);
+	error = encoder_encode(r, r->vpp.output);
 
 	vaDestroySurfaces(r->va_dpy, &rgb_surface, 1);
+
+	return error;
 }
 
 static void *
 worker_thread_function(void *data)
 {
 	struct vaapi_recorder *r = data;
+	struct vaapi_recorder_input input;
+	struct timespec begin, end;
+	uint64_t usec;
+	int error;
 
 	pthread_mutex_lock(&r->mutex);
 
 	while (!r->destroying) {
-		if (!r->input.valid)
+		if (r->input.count == 0) {
 			pthread_cond_wait(&r->input_cond, &r->mutex);
+			/* If the thread is awaken by destroy_worker_thread(),
+			 * there might not be valid input */
+			continue;
+		}
+
+		input = r->input.queue[r->input.head];
+		r->input.head = (r->input.head + 1) %
+				VAAPI_RECORDER_INPUT_QUEUE_SIZE;
+		r->input.count--;
+
+		/* Let the compositor queue the next frames while encoding */
+		pthread_mutex_unlock(&r->mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		error = recorder_frame(r, &input);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		usec = timespec_sub_to_nsec(&end, &begin) / 1000;
+
+		pthread_mutex_lock(&r->mutex);
+
+		if (error && !r->error)
+			r->error = error;
+
+		r->stats.encoded++;
+		r->stats.encode_usec_total += usec;
+		if (usec > r->stats.encode_usec_max)
+			r->stats.encode_usec_max = usec;
+	}
+
+	pthread_mutex_unlock(&r->mutex);
 
-		/* If the thread is awaken by destroy_worker_thread(),
-		 * there might not be valid input */
-		if (!r->input.valid)
+	return NULL;
+}
+
+static int
+write_all(int fd, const uint8_t *data, size_t size)
+{
+	ssize_t count;
+
+	while (size > 0) {
+		count = write(fd, data, size);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += count;
+		size -= count;
+	}
+
+	return 0;
+}
+
+static void *
+writer_thread_function(void *data)
+{
+	struct vaapi_recorder *r = data;
+	struct vaapi_recorder_chunk *chunk;
+	int failed = 0;
+
+	pthread_mutex_lock(&r->mutex);
+
+	while (r->output.first || !r->output.done) {
+		if (!r->output.first) {
+			pthread_cond_wait(&r->output.cond, &r->mutex);
 			continue;
+		}
+
+		chunk = r->output.first;
+		r->output.first = chunk->next;
+		if (!r->output.first)
+			r->output.last = &r->output.first;
 
-		recorder_frame(r);
-		r->input.valid = 0;
+		pthread_mutex_unlock(&r->mutex);
+
+		/* After a write error the rest is discarded, the error is
+		 * reported on the next vaapi_recorder_frame() call. */
+		if (!failed && write_all(r->output_fd, chunk->data,
+					 chunk->size) < 0)
+			failed = errno;
+		free(chunk);
+
+		pthread_mutex_lock(&r->mutex);
+
+		if (failed && !r->error)
+			r->error = failed;
 	}
 
 	pthread_mutex_unlock(&r->mutex);
@@ -1135,6 +1368,7 @@ worker_thread_function(void *data)
 int
 vaapi_recorder_frame(struct vaapi_recorder *r, int prime_fd, int stride)
 {
+	struct vaapi_recorder_input *input;
 	int ret = 0;
 
 	pthread_mutex_lock(&r->mutex);
@@ -1145,13 +1379,18 @@ vaapi_recorder_frame(struct vaapi_recorder *r, int prime_fd, int stride)
 		goto unlock;
 	}
 
-	/* The mutex is never released while encoding, so this point should
-	 * never be reached if input.valid is true. */
-	assert(!r->input.valid);
+	/* Don't wait for the encoder, drop the frame if it is behind */
+	if (r->input.count == VAAPI_RECORDER_INPUT_QUEUE_SIZE) {
+		close(prime_fd);
+		r->stats.dropped++;
+		goto unlock;
+	}
 
-	r->input.prime_fd = prime_fd;
-	r->input.stride = stride;
-	r->input.valid = 1;
+	input = &r->input.queue[(r->input.head + r->input.count) %
+				VAAPI_RECORDER_INPUT_QUEUE_SIZE];
+	input->prime_fd = prime_fd;
+	input->stride = stride;
+	r->input.count++;
 	pthread_cond_signal(&r->input_cond);
 
 unlock:
@@ -0,0 +1,552 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* DRM writeback connectors, to capture what the display engine shows on
+ * an output without rendering it again and without keeping views off the
+ * planes.
+ *
+ * A capture request queued on an output is served by the next atomic
+ * commit for it: the commit routes a writeback connector to the output's
+ * CRTC and points it at a dumb buffer, where the display engine writes the
+ * frame it composes, planes included. Once the out fence of the connector
+ * signals, the requested region is converted into the pixels of each
+ * request. Routing a connector is a modeset, so it stays routed while
+ * captures keep coming, and is released after DRM_WRITEBACK_IDLE_COMMITS
+ * commits without any.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include <libweston/libweston.h>
+#include "shared/helpers.h"
+#include "drm-internal.h"
+#include "pixel-formats.h"
+
+#define DRM_WRITEBACK_IDLE_COMMITS 60
+
+static const struct drm_property_info writeback_props[] = {
+	[WDRM_WRITEBACK_CRTC_ID] = { .name = "CRTC_ID", },
+	[WDRM_WRITEBACK_FB_ID] = { .name = "WRITEBACK_FB_ID", },
+	[WDRM_WRITEBACK_OUT_FENCE_PTR] = { .name = "WRITEBACK_OUT_FENCE_PTR", },
+	[WDRM_WRITEBACK_PIXEL_FORMATS] = { .name = "WRITEBACK_PIXEL_FORMATS", },
+};
+
+static int
+writeback_add_prop(drmModeAtomicReq *req, struct drm_writeback *wb,
+		   enum wdrm_writeback_property prop, uint64_t val)
+{
+	struct drm_property_info *info = &wb->props[prop];
+	int ret;
+
+	if (info->prop_id == 0)
+		return -1;
+
+	ret = drmModeAtomicAddProperty(req, wb->connector_id, info->prop_id,
+				       val);
+	drm_debug(wb->backend, "\t\t\t[WRITEBACK:%lu] %lu (%s) -> %llu (0x%llx)\n",
+		  (unsigned long) wb->connector_id,
+		  (unsigned long) info->prop_id, info->name,
+		  (unsigned long long) val, (unsigned long long) val);
+	return (ret <= 0) ? -1 : 0;
+}
+
+/* Picks the capture format among those the connector writes: one that
+ * pixman reads, so requests can be converted from it. */
+static void
+writeback_pick_format(struct drm_backend *b, drmModeObjectProperties *props,
+		      struct drm_writeback *wb)
+{
+	static const struct {
+		uint32_t drm_format;
+		pixman_format_code_t pixman_format;
+	} preferred[] = {
+		{ DRM_FORMAT_XRGB8888, PIXMAN_x8r8g8b8 },
+		{ DRM_FORMAT_ARGB8888, PIXMAN_a8r8g8b8 },
+		{ DRM_FORMAT_XBGR8888, PIXMAN_x8b8g8r8 },
+		{ DRM_FORMAT_ABGR8888, PIXMAN_a8b8g8r8 },
+	};
+	drmModePropertyBlobRes *blob;
+	const uint32_t *formats;
+	uint64_t blob_id;
+	unsigned int i, j, count;
+
+	blob_id = drm_property_get_value(&wb->props[WDRM_WRITEBACK_PIXEL_FORMATS],
+					 props, 0);
+	if (blob_id == 0)
+		return;
+
+	blob = drmModeGetPropertyBlob(b->drm.fd, blob_id);
+	if (!blob)
+		return;
+
+	formats = blob->data;
+	count = blob->length / sizeof(*formats);
+	for (i = 0; i < ARRAY_LENGTH(preferred) && !wb->format; i++) {
+		for (j = 0; j < count; j++) {
+			if (formats[j] == preferred[i].drm_format) {
+				wb->format = preferred[i].drm_format;
+				wb->pixman_format = preferred[i].pixman_format;
+				break;
+			}
+		}
+	}
+
+	drmModeFreePropertyBlob(blob);
+}
+
+/** Claims the connector for writeback if it is a writeback connector
+ *
+ * @param b The backend.
+ * @param connector_id DRM connector ID.
+ * @return true if the connector is a writeback connector, usable or not,
+ * and must not become a head. Unusable ones are kept as broken, for
+ * drm_backend_is_writeback().
+ */
+bool
+drm_backend_add_writeback(struct drm_backend *b, uint32_t connector_id)
+{
+	struct drm_writeback *wb;
+	drmModeConnector *connector;
+	drmModeEncoder *encoder;
+	drmModeObjectProperties *props;
+
+	if (!b->writeback_connectors)
+		return false;
+
+	connector = drmModeGetConnector(b->drm.fd, connector_id);
+	if (!connector)
+		return false;
+
+	if (connector->connector_type != DRM_MODE_CONNECTOR_WRITEBACK) {
+		drmModeFreeConnector(connector);
+		return false;
+	}
+
+	wb = zalloc(sizeof *wb);
+	if (!wb)
+		goto out;
+
+	wb->backend = b;
+	wb->connector_id = connector_id;
+	wb->out_fence_fd = -1;
+	wl_list_init(&wb->requests);
+
+	if (connector->count_encoders > 0) {
+		encoder = drmModeGetEncoder(b->drm.fd, connector->encoders[0]);
+		if (encoder) {
+			wb->possible_crtcs = encoder->possible_crtcs;
+			drmModeFreeEncoder(encoder);
+		}
+	}
+
+	props = drmModeObjectGetProperties(b->drm.fd, connector_id,
+					   DRM_MODE_OBJECT_CONNECTOR);
+	if (props) {
+		drm_property_info_populate(b, writeback_props, wb->props,
+					   WDRM_WRITEBACK__COUNT, props);
+		writeback_pick_format(b, props, wb);
+		drmModeFreeObjectProperties(props);
+	}
+
+	if (wb->format == 0 || wb->possible_crtcs == 0 ||
+	    wb->props[WDRM_WRITEBACK_FB_ID].prop_id == 0 ||
+	    wb->props[WDRM_WRITEBACK_OUT_FENCE_PTR].prop_id == 0) {
+		weston_log("DRM: writeback connector %u is not usable\n",
+			   connector_id);
+		wb->broken = true;
+	} else {
+		weston_log("DRM: writeback connector %u, CRTC mask 0x%x, "
+			   "format %s\n", connector_id, wb->possible_crtcs,
+			   pixel_format_get_info(wb->format)->drm_format_name);
+	}
+	wl_list_insert(b->writeback_list.prev, &wb->link);
+
+out:
+	drmModeFreeConnector(connector);
+	return true;
+}
+
+bool
+drm_backend_is_writeback(struct drm_backend *b, uint32_t connector_id)
+{
+	struct drm_writeback *wb;
+
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (wb->connector_id == connector_id)
+			return true;
+	}
+
+	return false;
+}
+
+static void
+capture_requests_fail(struct wl_list *requests)
+{
+	struct drm_capture_request *req, *tmp;
+
+	wl_list_for_each_safe(req, tmp, requests, link) {
+		wl_list_remove(&req->link);
+		req->done(req->data, -1);
+		free(req);
+	}
+}
+
+static void
+drm_writeback_destroy(struct drm_writeback *wb)
+{
+	if (wb->fence_source)
+		wl_event_source_remove(wb->fence_source);
+	if (wb->out_fence_fd >= 0)
+		close(wb->out_fence_fd);
+	capture_requests_fail(&wb->requests);
+	drm_fb_unref(wb->fb);
+	drm_property_info_free(wb->props, WDRM_WRITEBACK__COUNT);
+	wl_list_remove(&wb->link);
+	free(wb);
+}
+
+void
+drm_backend_destroy_writebacks(struct drm_backend *b)
+{
+	struct drm_writeback *wb, *tmp;
+
+	wl_list_for_each_safe(wb, tmp, &b->writeback_list, link)
+		drm_writeback_destroy(wb);
+}
+
+/* A connector for the output: the one routed to it, else a free one which
+ * can be. */
+static struct drm_writeback *
+drm_output_find_writeback(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_writeback *wb, *found = NULL;
+
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (wb->broken)
+			continue;
+		if (wb->output == output)
+			return wb;
+		if (!wb->output && !found &&
+		    (wb->possible_crtcs & (1 << output->pipe)))
+			found = wb;
+	}
+
+	return found;
+}
+
+bool
+drm_output_can_writeback(struct drm_output *output)
+{
+	return drm_output_find_writeback(output) != NULL;
+}
+
+/** Captures the next frame shown on the output, see
+ * weston_output::capture_pixels_async */
+int
+drm_output_capture_pixels_async(struct weston_output *base,
+				pixman_format_code_t format, void *pixels,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_renderer_read_done_func_t done,
+				void *data)
+{
+	struct drm_output *output = to_drm_output(base);
+	struct drm_capture_request *req;
+
+	if (!drm_output_find_writeback(output) ||
+	    x + width > (uint32_t) base->current_mode->width ||
+	    y + height > (uint32_t) base->current_mode->height)
+		return -1;
+
+	req = zalloc(sizeof *req);
+	if (!req)
+		return -1;
+
+	req->format = format;
+	req->pixels = pixels;
+	req->x = x;
+	req->y = y;
+	req->width = width;
+	req->height = height;
+	req->done = done;
+	req->data = data;
+	wl_list_insert(output->capture_requests.prev, &req->link);
+
+	weston_output_schedule_repaint(base);
+
+	return 0;
+}
+
+void
+drm_output_fail_captures(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_writeback *wb;
+
+	capture_requests_fail(&output->capture_requests);
+
+	/* the CRTC goes away, the kernel unroutes the connector with it */
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (wb->output == output)
+			wb->output = NULL;
+	}
+}
+
+static int
+drm_writeback_fence_signaled(int fd, uint32_t mask, void *data)
+{
+	struct drm_writeback *wb = data;
+	struct drm_capture_request *req, *tmp;
+	pixman_image_t *src, *dst;
+
+	wl_event_source_remove(wb->fence_source);
+	wb->fence_source = NULL;
+	close(wb->out_fence_fd);
+	wb->out_fence_fd = -1;
+
+	src = pixman_image_create_bits(wb->pixman_format,
+				       wb->fb->width, wb->fb->height,
+				       wb->fb->map, wb->fb->strides[0]);
+
+	wl_list_for_each_safe(req, tmp, &wb->requests, link) {
+		int status = -1;
+
+		dst = pixman_image_create_bits(req->format,
+					       req->width, req->height,
+					       req->pixels,
+					       req->width *
+					       PIXMAN_FORMAT_BPP(req->format) / 8);
+		if (src && dst) {
+			pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+						 req->x, req->y, 0, 0, 0, 0,
+						 req->width, req->height);
+			status = 0;
+		}
+		if (dst)
+			pixman_image_unref(dst);
+
+		wl_list_remove(&req->link);
+		req->done(req->data, status);
+		free(req);
+	}
+
+	if (src)
+		pixman_image_unref(src);
+
+	return 0;
+}
+
+static bool
+drm_writeback_add_capture(struct drm_writeback *wb, struct drm_output *output,
+			  drmModeAtomicReq *req)
+{
+	struct drm_backend *b = wb->backend;
+	struct weston_mode *mode = output->base.current_mode;
+	int ret = 0;
+
+	if (wb->fb && (wb->fb->width != mode->width ||
+		       wb->fb->height != mode->height)) {
+		drm_fb_unref(wb->fb);
+		wb->fb = NULL;
+	}
+	if (!wb->fb)
+		wb->fb = drm_fb_create_dumb(b, mode->width, mode->height,
+					    wb->format);
+	if (!wb->fb) {
+		wb->broken = true;
+		capture_requests_fail(&output->capture_requests);
+		return false;
+	}
+
+	wb->out_fence_fd = -1;
+	ret |= writeback_add_prop(req, wb, WDRM_WRITEBACK_CRTC_ID,
+				  output->crtc_id);
+	ret |= writeback_add_prop(req, wb, WDRM_WRITEBACK_FB_ID,
+				  wb->fb->fb_id);
+	ret |= writeback_add_prop(req, wb, WDRM_WRITEBACK_OUT_FENCE_PTR,
+				  (uint64_t)(uintptr_t) &wb->out_fence_fd);
+	if (ret != 0)
+		return false;
+
+	wb->output = output;
+	wb->committing = true;
+	wb->idle_commits = 0;
+
+	return true;
+}
+
+/** Adds writeback connector updates to an atomic request
+ *
+ * @param pending_state The state being committed.
+ * @param req The request being built for it.
+ * @param flags The commit flags, gets DRM_MODE_ATOMIC_ALLOW_MODESET when
+ * a connector is routed or released.
+ * @param capture Whether captures may be started; they need the
+ * completion event of a non-blocking commit.
+ * @return true if anything was added; drm_writeback_commit_done() must
+ * then be called with the outcome of the commit.
+ */
+bool
+drm_pending_state_add_writeback(struct drm_pending_state *pending_state,
+				drmModeAtomicReq *req, uint32_t *flags,
+				bool capture)
+{
+	struct drm_backend *b = pending_state->backend;
+	struct drm_output_state *state;
+	struct drm_writeback *wb;
+	struct drm_output *output;
+	bool added = false;
+
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (wb->broken || !wl_list_empty(&wb->requests))
+			continue;
+
+		if (wb->output) {
+			state = drm_pending_state_get_output(pending_state,
+							     wb->output);
+			if (!state)
+				continue;
+
+			if (state->dpms == WESTON_DPMS_ON && capture &&
+			    !wl_list_empty(&wb->output->capture_requests)) {
+				added |= drm_writeback_add_capture(wb,
+								   wb->output,
+								   req);
+				continue;
+			}
+
+			if (state->dpms == WESTON_DPMS_ON &&
+			    ++wb->idle_commits < DRM_WRITEBACK_IDLE_COMMITS)
+				continue;
+
+			if (writeback_add_prop(req, wb, WDRM_WRITEBACK_CRTC_ID,
+					       0) == 0) {
+				wb->committing = true;
+				wb->detaching = true;
+				*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+				added = true;
+			}
+			continue;
+		}
+
+		if (!capture)
+			continue;
+
+		wl_list_for_each(state, &pending_state->output_list, link) {
+			output = state->output;
+			if (output->virtual || state->dpms != WESTON_DPMS_ON ||
+			    wl_list_empty(&output->capture_requests) ||
+			    drm_output_find_writeback(output) != wb)
+				continue;
+
+			if (drm_writeback_add_capture(wb, output, req)) {
+				*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+				added = true;
+			}
+			break;
+		}
+	}
+
+	return added;
+}
+
+/** Completes drm_pending_state_add_writeback() after the commit
+ *
+ * @param b The backend.
+ * @param success Whether the commit went through. If it did not, the
+ * connectors it set up are not used again, and their captures fail for
+ * the caller to fall back to reading back the renderer.
+ */
+void
+drm_writeback_commit_done(struct drm_backend *b, bool success)
+{
+	struct wl_event_loop *loop;
+	struct drm_writeback *wb;
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (!wb->committing)
+			continue;
+		wb->committing = false;
+
+		if (wb->detaching) {
+			wb->detaching = false;
+			if (success)
+				wb->output = NULL;
+			continue;
+		}
+
+		if (!success) {
+			weston_log("DRM: writeback connector %u failed, "
+				   "not using it anymore\n", wb->connector_id);
+			wb->broken = true;
+			capture_requests_fail(&wb->output->capture_requests);
+			wb->output = NULL;
+			continue;
+		}
+
+		wl_list_insert_list(&wb->requests,
+				    &wb->output->capture_requests);
+		wl_list_init(&wb->output->capture_requests);
+
+		if (wb->out_fence_fd >= 0)
+			wb->fence_source =
+				wl_event_loop_add_fd(loop, wb->out_fence_fd,
+						     WL_EVENT_READABLE,
+						     drm_writeback_fence_signaled,
+						     wb);
+		if (!wb->fence_source) {
+			if (wb->out_fence_fd >= 0)
+				close(wb->out_fence_fd);
+			wb->out_fence_fd = -1;
+			capture_requests_fail(&wb->requests);
+		}
+	}
+}
+
+/* After a VT switch or at start, the connectors are in an unknown state. */
+void
+drm_writeback_add_reset(struct drm_backend *b, drmModeAtomicReq *req)
+{
+	struct drm_writeback *wb;
+
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (wb->committing || !wl_list_empty(&wb->requests))
+			continue;
+		writeback_add_prop(req, wb, WDRM_WRITEBACK_CRTC_ID, 0);
+		wb->output = NULL;
+	}
+}
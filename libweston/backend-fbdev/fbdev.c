@@ -96,9 +96,15 @@ struct fbdev_output {
 	/* framebuffer mmap details */
 	size_t buffer_length;
 	void *fb;
-
-	/* pixman details. */
-	pixman_image_t *hw_surface;
+	/* kept open while panning between two buffers, -1 otherwise */
+	int fd;
+
+	/* pixman details. Without panning, only hw_surface[0] exists. */
+	pixman_image_t *hw_surface[2];
+	int current_image;
+	bool pan;
+	/* painted into the front buffer, but not the back one yet */
+	pixman_region32_t previous_damage;
 };
 
 static const char default_seat[] = "seat0";
@@ -142,25 +148,62 @@ fbdev_output_start_repaint_loop(struct weston_output *output)
 	return 0;
 }
 
+static void
+fbdev_output_pan(struct fbdev_output *output, int image)
+{
+	struct fbdev_head *head = fbdev_output_get_head(output);
+	struct fb_var_screeninfo varinfo;
+
+	if (ioctl(output->fd, FBIOGET_VSCREENINFO, &varinfo) == 0) {
+		varinfo.xoffset = 0;
+		varinfo.yoffset = image * head->fb_info.y_resolution;
+		varinfo.activate = FB_ACTIVATE_VBL;
+
+		if (ioctl(output->fd, FBIOPAN_DISPLAY, &varinfo) == 0) {
+			output->current_image = image;
+			return;
+		}
+	}
+
+	/* Keep painting into the buffer that is still scanned out, and
+	 * repaint all of it, since the other one got this frame. */
+	weston_log("Failed to pan frame buffer, disabling panning: %s\n",
+		   strerror(errno));
+	output->pan = false;
+	weston_output_damage(&output->base);
+}
+
 static int
 fbdev_output_repaint(struct weston_output *base, pixman_region32_t *damage,
 		     void *repaint_data)
 {
 	struct fbdev_output *output = to_fbdev_output(base);
 	struct weston_compositor *ec = output->base.compositor;
-
-	/* Repaint the damaged region onto the back buffer. */
-	pixman_renderer_output_set_buffer(base, output->hw_surface);
+	int image = output->current_image;
+
+	/* Repaint the damaged region onto the back buffer. When panning,
+	 * that buffer also misses what went into the front one last time. */
+	if (output->pan) {
+		image ^= 1;
+		pixman_renderer_output_set_hw_extra_damage(base,
+						&output->previous_damage);
+	}
+	pixman_renderer_output_set_buffer(base, output->hw_surface[image]);
 	ec->renderer->repaint_output(base, damage);
 
+	if (output->pan) {
+		pixman_region32_copy(&output->previous_damage, damage);
+		fbdev_output_pan(output, image);
+	}
+
 	/* Update the damage region. */
 	pixman_region32_subtract(&ec->primary_plane.damage,
 	                         &ec->primary_plane.damage, damage);
 
 	/* Schedule the end of the frame. We do not sync this to the frame
 	 * buffer clock because users who want that should be using the DRM
-	 * compositor. FBIO_WAITFORVSYNC blocks and FB_ACTIVATE_VBL requires
-	 * panning, which is broken in most kernel drivers.
+	 * compositor. FBIO_WAITFORVSYNC blocks, and panning with
+	 * FB_ACTIVATE_VBL, where the driver supports it, only avoids tearing.
 	 *
 	 * Finish the frame synchronised to the specified refresh rate. The
 	 * refresh rate is given in mHz and the interval in ms. */
@@ -385,6 +428,45 @@ fbdev_wakeup_screen(int fd, struct fbdev_screeninfo *info)
 	return 1;
 }
 
+/* Makes the virtual screen two buffers high and checks that the device
+ * pans between them. */
+static bool
+fbdev_frame_buffer_setup_pan(int fd, const struct fbdev_screeninfo *info)
+{
+	struct fb_var_screeninfo varinfo, old_varinfo;
+	struct fb_fix_screeninfo fixinfo;
+
+	if (getenv("WESTON_FBDEV_NO_PAN"))
+		return false;
+
+	if (info->buffer_length < 2 * info->line_length * info->y_resolution)
+		return false;
+
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &varinfo) < 0)
+		return false;
+	old_varinfo = varinfo;
+
+	if (varinfo.yres_virtual < 2 * varinfo.yres) {
+		varinfo.yres_virtual = 2 * varinfo.yres;
+		if (ioctl(fd, FBIOPUT_VSCREENINFO, &varinfo) < 0)
+			return false;
+
+		/* The driver may have picked a different layout. */
+		if (varinfo.yres_virtual < 2 * varinfo.yres ||
+		    ioctl(fd, FBIOGET_FSCREENINFO, &fixinfo) < 0 ||
+		    fixinfo.line_length != info->line_length) {
+			ioctl(fd, FBIOPUT_VSCREENINFO, &old_varinfo);
+			return false;
+		}
+	}
+
+	varinfo.xoffset = 0;
+	varinfo.yoffset = 0;
+	varinfo.activate = FB_ACTIVATE_NOW;
+
+	return ioctl(fd, FBIOPAN_DISPLAY, &varinfo) == 0;
+}
+
 /* Returns an FD for the frame buffer device. */
 static int
 fbdev_frame_buffer_open(const char *fb_dev,
@@ -422,12 +504,13 @@ fbdev_frame_buffer_open(const char *fb_dev,
 	return fd;
 }
 
-/* Closes the FD on success or failure. */
+/* Closes the FD on failure, and on success unless it is kept for panning. */
 static int
 fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 {
 	struct fbdev_head *head;
 	int retval = -1;
+	int i;
 
 	head = fbdev_output_get_head(output);
 
@@ -445,30 +528,51 @@ fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 		goto out_close;
 	}
 
-	/* Create a pixman image to wrap the memory mapped frame buffer. */
-	output->hw_surface =
-		pixman_image_create_bits(head->fb_info.pixel_format,
-		                         head->fb_info.x_resolution,
-		                         head->fb_info.y_resolution,
-		                         output->fb,
-		                         head->fb_info.line_length);
-	if (output->hw_surface == NULL) {
-		weston_log("Failed to create surface for frame buffer.\n");
-		goto out_unmap;
+	output->pan = fbdev_frame_buffer_setup_pan(fd, &head->fb_info);
+	output->current_image = 0;
+	weston_log("%s fbdev frame buffer.\n",
+		   output->pan ? "Double-buffering" : "Single-buffering");
+
+	/* Create pixman images to wrap the memory mapped frame buffer. */
+	for (i = 0; i < (output->pan ? 2 : 1); i++) {
+		output->hw_surface[i] =
+			pixman_image_create_bits(head->fb_info.pixel_format,
+			                         head->fb_info.x_resolution,
+			                         head->fb_info.y_resolution,
+			                         (uint8_t *)output->fb +
+			                         i * head->fb_info.y_resolution *
+			                         head->fb_info.line_length,
+			                         head->fb_info.line_length);
+		if (output->hw_surface[i] == NULL) {
+			weston_log("Failed to create surface for frame buffer.\n");
+			goto out_unmap;
+		}
 	}
 
+	/* Neither buffer has anything painted yet. */
+	pixman_region32_copy(&output->previous_damage, &output->base.region);
+
 	/* Success! */
 	retval = 0;
 
 out_unmap:
 	if (retval != 0 && output->fb != NULL) {
+		for (i = 0; i < 2; i++) {
+			if (output->hw_surface[i])
+				pixman_image_unref(output->hw_surface[i]);
+			output->hw_surface[i] = NULL;
+		}
 		munmap(output->fb, output->buffer_length);
 		output->fb = NULL;
 	}
 
 out_close:
-	if (fd >= 0)
+	if (retval == 0 && output->pan) {
+		output->fd = fd;
+	} else if (fd >= 0) {
+		output->pan = false;
 		close(fd);
+	}
 
 	return retval;
 }
@@ -476,16 +580,26 @@ out_close:
 static void
 fbdev_frame_buffer_unmap(struct fbdev_output *output)
 {
+	int i;
+
 	if (!output->fb) {
-		assert(!output->hw_surface);
+		assert(!output->hw_surface[0]);
 		return;
 	}
 
 	weston_log("Unmapping fbdev frame buffer.\n");
 
-	if (output->hw_surface)
-		pixman_image_unref(output->hw_surface);
-	output->hw_surface = NULL;
+	for (i = 0; i < 2; i++) {
+		if (output->hw_surface[i])
+			pixman_image_unref(output->hw_surface[i]);
+		output->hw_surface[i] = NULL;
+	}
+
+	if (output->fd >= 0) {
+		close(output->fd);
+		output->fd = -1;
+	}
+	output->pan = false;
 
 	if (munmap(output->fb, output->buffer_length) < 0)
 		weston_log("Failed to munmap frame buffer: %s\n",
@@ -530,6 +644,7 @@ fbdev_output_enable(struct weston_output *base)
 	struct wl_event_loop *loop;
 	const struct pixman_renderer_output_options options = {
 		.use_shadow = true,
+		.hw_buffer_uncached = true,
 	};
 
 	head = fbdev_output_get_head(output);
@@ -649,6 +764,8 @@ fbdev_output_create(struct weston_compositor *compositor,
 		return NULL;
 
 	output->backend = to_fbdev_backend(compositor);
+	output->fd = -1;
+	pixman_region32_init(&output->previous_damage);
 
 	weston_output_init(&output->base, compositor, name);
 
@@ -674,6 +791,8 @@ fbdev_output_destroy(struct weston_output *base)
 	/* Remove the output. */
 	weston_output_release(&output->base);
 
+	pixman_region32_fini(&output->previous_damage);
+
 	free(output);
 }
 
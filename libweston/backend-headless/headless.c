@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <sys/time.h>
 #include <stdbool.h>
 #include <drm_fourcc.h>
@@ -37,6 +38,7 @@
 #include <libweston/libweston.h>
 #include <libweston/backend-headless.h>
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "linux-explicit-synchronization.h"
 #include "pixman-renderer.h"
 #include "renderer-gl/gl-renderer.h"
@@ -57,6 +59,8 @@ struct headless_backend {
 
 	struct weston_seat fake_seat;
 	enum headless_renderer_type renderer_type;
+	int refresh;
+	bool unthrottled;
 
 	struct gl_renderer_interface *glri;
 };
@@ -70,8 +74,13 @@ struct headless_output {
 
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	struct wl_event_source *finish_frame_idle; /* when unthrottled */
 	uint32_t *image_buf;
 	pixman_image_t *image;
+
+	/* repaints since the output was enabled */
+	uint64_t frame_count;
+	struct timespec enable_time;
 };
 
 static const uint32_t headless_formats[] = {
@@ -120,6 +129,15 @@ finish_frame_handler(void *data)
 	return 1;
 }
 
+static void
+finish_frame_idle_handler(void *data)
+{
+	struct headless_output *output = data;
+
+	output->finish_frame_idle = NULL;
+	finish_frame_handler(output);
+}
+
 static int
 headless_output_repaint(struct weston_output *output_base,
 		       pixman_region32_t *damage,
@@ -127,17 +145,49 @@ headless_output_repaint(struct weston_output *output_base,
 {
 	struct headless_output *output = to_headless_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct headless_backend *b = to_headless_backend(ec);
+	struct wl_event_loop *loop;
 
 	ec->renderer->repaint_output(&output->base, damage);
+	output->frame_count++;
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	/* The frame can't finish before weston_output_repaint() returns. */
+	if (b->unthrottled) {
+		loop = wl_display_get_event_loop(ec->wl_display);
+		output->finish_frame_idle =
+			wl_event_loop_add_idle(loop, finish_frame_idle_handler,
+					       output);
+		if (output->finish_frame_idle)
+			return 0;
+	}
+
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     MAX(1000000 / output->mode.refresh, 1));
 
 	return 0;
 }
 
+static void
+headless_output_log_frames(struct headless_output *output)
+{
+	struct timespec now;
+	int64_t elapsed_usec;
+
+	weston_compositor_read_presentation_clock(output->base.compositor,
+						  &now);
+	elapsed_usec = timespec_sub_to_nsec(&now, &output->enable_time) / 1000;
+	if (elapsed_usec <= 0)
+		return;
+
+	weston_log("Output %s: %" PRIu64 " frames in %.3f s, %.1f fps\n",
+		   output->base.name, output->frame_count,
+		   elapsed_usec / 1e6,
+		   output->frame_count * 1e6 / elapsed_usec);
+}
+
 static void
 headless_output_disable_gl(struct headless_output *output)
 {
@@ -165,6 +215,13 @@ headless_output_disable(struct weston_output *base)
 		return 0;
 
 	wl_event_source_remove(output->finish_frame_timer);
+	if (output->finish_frame_idle) {
+		wl_event_source_remove(output->finish_frame_idle);
+		output->finish_frame_idle = NULL;
+	}
+
+	if (b->unthrottled)
+		headless_output_log_frames(output);
 
 	switch (b->renderer_type) {
 	case HEADLESS_GL:
@@ -271,6 +328,16 @@ headless_output_enable(struct weston_output *base)
 		return -1;
 	}
 
+	/* Start repainting as soon as the previous frame finished, the
+	 * whole refresh period ahead of the next one. */
+	if (b->unthrottled)
+		output->base.repaint_window_nsec =
+			millihz_to_nsec(output->mode.refresh);
+
+	output->frame_count = 0;
+	weston_compositor_read_presentation_clock(b->compositor,
+						  &output->enable_time);
+
 	return 0;
 }
 
@@ -279,6 +346,7 @@ headless_output_set_size(struct weston_output *base,
 			 int width, int height)
 {
 	struct headless_output *output = to_headless_output(base);
+	struct headless_backend *b = to_headless_backend(base->compositor);
 	struct weston_head *head;
 	int output_width, output_height;
 
@@ -303,7 +371,7 @@ headless_output_set_size(struct weston_output *base,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = output_width;
 	output->mode.height = output_height;
-	output->mode.refresh = 60000;
+	output->mode.refresh = b->refresh;
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
 	output->base.current_mode = &output->mode;
@@ -444,6 +512,14 @@ headless_backend_create(struct weston_compositor *compositor,
 	else
 		b->renderer_type = HEADLESS_NOOP;
 
+	if (config->refresh < 0 || config->refresh > 1000000) {
+		weston_log("Error: invalid refresh rate %d mHz.\n",
+			   config->refresh);
+		goto err_free;
+	}
+	b->refresh = config->refresh ? config->refresh : 60000;
+	b->unthrottled = config->unthrottled;
+
 	switch (b->renderer_type) {
 	case HEADLESS_GL:
 		ret = headless_gl_renderer_init(b);
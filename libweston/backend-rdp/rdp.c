@@ -30,16 +30,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
 #include <linux/input.h>
 
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/eventfd.h>
 #include <netdb.h>
 #include <linux/vm_sockets.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 
@@ -90,99 +95,238 @@ rdp_get_first_output(struct rdp_backend *b)
 	return NULL;
 }
 
+/* RemoteFX tile size */
+#define RDP_RFX_TILE_SIZE 64
+
+/* NSCodec color loss level of coarse refresh, 1 is lossless, 7 the most lossy. */
+#define RDP_NSC_COARSE_COLOR_LOSS_LEVEL 3
+
+/* bandwidth is measured every this many link probes. */
+#define RDP_LINK_BANDWIDTH_PROBE_PERIOD 5
+
+/* NSCodec defaults of FreeRDP, used by refresh of default quality. */
+#define RDP_NSC_DEFAULT_COLOR_LOSS_LEVEL 3
+
+/* refresh of at least this area is split into bands, which the encoder
+   threads of peer encode in parallel. */
+#define RDP_REFRESH_BAND_MIN_AREA (256 * 256)
+
+struct rdp_peer_refresh_job {
+	struct rdp_encoder_job base;
+	pixman_region32_t damage;
+	pixman_image_t *image;
+	enum rdp_gfx_quality quality;
+	uint32_t generation; /* of RdpPeerContext::refresh_generation */
+	wStream *stream; /* encoded bitmap data of all cmds */
+	int numCmds;
+	SURFACE_BITS_COMMAND *cmds;
+	/* other peers sent same encoded refresh, see rdp_output_refresh_peers */
+	struct wl_array followers; /* freerdp_peer * */
+};
+
+/* rfx and nsc contexts are per encoder thread, RemoteFX context keeps the
+   desktop size, and is reset as client resets its decoder, so codec
+   headers are sent again. */
+static RFX_CONTEXT *
+rdp_peer_refresh_get_rfx(struct rdp_gfx_codec_context *codec,
+			 struct rdp_peer_refresh_job *job)
+{
+	int width = pixman_image_get_width(job->image);
+	int height = pixman_image_get_height(job->image);
+
+	if (!codec->rfx_context) {
+		codec->rfx_context = rfx_context_new(TRUE);
+		if (!codec->rfx_context)
+			return NULL;
+
+		codec->rfx_context->mode = RLGR3;
+		rfx_context_set_pixel_format(codec->rfx_context, DEFAULT_PIXEL_FORMAT);
+		rfx_context_reset(codec->rfx_context, width, height);
+		codec->rfx_generation = job->generation;
+	} else if (codec->rfx_generation != job->generation ||
+		   codec->rfx_context->width != (UINT32)width ||
+		   codec->rfx_context->height != (UINT32)height) {
+		rfx_context_reset(codec->rfx_context, width, height);
+		codec->rfx_generation = job->generation;
+	}
+
+	return codec->rfx_context;
+}
+
+static NSC_CONTEXT *
+rdp_peer_refresh_get_nsc(struct rdp_gfx_codec_context *codec)
+{
+	if (!codec->nsc_context) {
+		codec->nsc_context = nsc_context_new();
+		if (!codec->nsc_context)
+			return NULL;
+
+		nsc_context_set_parameters(codec->nsc_context, NSC_COLOR_FORMAT,
+					   DEFAULT_PIXEL_FORMAT);
+	}
+
+	return codec->nsc_context;
+}
+
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_refresh_rfx(struct rdp_encoder_job *base, struct rdp_gfx_codec_context *codec)
 {
+	struct rdp_peer_refresh_job *job = container_of(base, struct rdp_peer_refresh_job, base);
+	pixman_region32_t *damage = &job->damage;
+	pixman_image_t *image = job->image;
+	RFX_CONTEXT *rfx = rdp_peer_refresh_get_rfx(codec, job);
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
-	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->context->update;
-	SURFACE_BITS_COMMAND cmd = { 0 };
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	RFX_RECT *rfxRects;
+	RdpPeerContext *context = base->peerCtx;
+	freerdp_peer *peer = context->item.peer;
+	SURFACE_BITS_COMMAND *cmd;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	if (!rfx)
+		return;
 
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-	cmd.skipCompression = TRUE;
-	cmd.cmdType = CMDTYPE_STREAM_SURFACE_BITS;
-	cmd.destLeft = damage->extents.x1;
-	cmd.destTop = damage->extents.y1;
-	cmd.destRight = damage->extents.x2;
-	cmd.destBottom = damage->extents.y2;
-	cmd.bmp.bpp = 32;
-	cmd.bmp.codecID = peer->context->settings->RemoteFxCodecId;
-	cmd.bmp.width = width;
-	cmd.bmp.height = height;
+	job->cmds = xzalloc(sizeof *job->cmds);
+	cmd = &job->cmds[0];
+	cmd->skipCompression = TRUE;
+	cmd->cmdType = CMDTYPE_STREAM_SURFACE_BITS;
+	cmd->destLeft = damage->extents.x1;
+	cmd->destTop = damage->extents.y1;
+	cmd->destRight = damage->extents.x2;
+	cmd->destBottom = damage->extents.y2;
+	cmd->bmp.bpp = 32;
+	cmd->bmp.codecID = peer->context->settings->RemoteFxCodecId;
+	cmd->bmp.width = width;
+	cmd->bmp.height = height;
 
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
 	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+	rfxRects = xmalloc(nrects * sizeof *rfxRects);
 
 	for (i = 0; i < nrects; i++) {
 		region = &rects[i];
-		rfxRect = &context->rfx_rects[i];
 
-		rfxRect->x = (region->x1 - damage->extents.x1);
-		rfxRect->y = (region->y1 - damage->extents.y1);
-		rfxRect->width = (region->x2 - region->x1);
-		rfxRect->height = (region->y2 - region->y1);
+		rfxRects[i].x = (region->x1 - damage->extents.x1);
+		rfxRects[i].y = (region->y1 - damage->extents.y1);
+		rfxRects[i].width = (region->x2 - region->x1);
+		rfxRects[i].height = (region->y2 - region->y1);
 	}
 
-	rfx_compose_message(context->rfx_context, context->encode_stream, context->rfx_rects, nrects,
+	/* tiles of message are encoded by FreeRDP's own thread pool. */
+	rfx_compose_message(rfx, job->stream, rfxRects, nrects,
 			(BYTE *)ptr, width, height,
 			pixman_image_get_stride(image)
 	);
+	free(rfxRects);
 
-	cmd.bmp.bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd.bmp.bitmapData = Stream_Buffer(context->encode_stream);
-
-	update->SurfaceBits(update->context, &cmd);
+	cmd->bmp.bitmapDataLength = Stream_GetPosition(job->stream);
+	cmd->bmp.bitmapData = Stream_Buffer(job->stream);
+	job->numCmds = 1;
 }
 
-
+/* NSCodec takes one bitmap per command, so each rect is sent by its own
+   command, instead of bounding box of all of them. */
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_refresh_nsc(struct rdp_encoder_job *base, struct rdp_gfx_codec_context *codec)
 {
-	int width, height;
-	uint32_t *ptr;
-	rdpUpdate *update = peer->context->update;
-	SURFACE_BITS_COMMAND cmd = { 0 };
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
-
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
-
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
+	struct rdp_peer_refresh_job *job = container_of(base, struct rdp_peer_refresh_job, base);
+	pixman_image_t *image = job->image;
+	NSC_CONTEXT *nsc = rdp_peer_refresh_get_nsc(codec);
+	int stride = pixman_image_get_stride(image);
+	pixman_box32_t *rects;
+	int nrects, i;
+	size_t *offsets;
+	RdpPeerContext *context = base->peerCtx;
+	freerdp_peer *peer = context->item.peer;
 
-	cmd.skipCompression = TRUE;
-	cmd.cmdType = CMDTYPE_SET_SURFACE_BITS;
-	cmd.destLeft = damage->extents.x1;
-	cmd.destTop = damage->extents.y1;
-	cmd.destRight = damage->extents.x2;
-	cmd.destBottom = damage->extents.y2;
-	cmd.bmp.bpp = 32;
-	cmd.bmp.codecID = peer->context->settings->NSCodecId;
-	cmd.bmp.width = width;
-	cmd.bmp.height = height;
+	if (!nsc)
+		return;
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+	/* coarse takes as much color loss as client allows, and lossless
+	   takes none, followers are sent the same, see rdp_peer_same_codec.
+	   Context of thread may have been used with other quality before. */
+	if (job->quality == RDP_GFX_QUALITY_COARSE) {
+		nsc_context_set_parameters(nsc, NSC_COLOR_LOSS_LEVEL,
+					   MIN(RDP_NSC_COARSE_COLOR_LOSS_LEVEL,
+					       peer->context->settings->NSCodecColorLossLevel));
+		nsc_context_set_parameters(nsc, NSC_ALLOW_SUBSAMPLING,
+					   peer->context->settings->NSCodecAllowSubsampling);
+	} else if (job->quality == RDP_GFX_QUALITY_LOSSLESS) {
+		nsc_context_set_parameters(nsc, NSC_COLOR_LOSS_LEVEL, 1);
+		nsc_context_set_parameters(nsc, NSC_ALLOW_SUBSAMPLING, FALSE);
+	} else {
+		nsc_context_set_parameters(nsc, NSC_COLOR_LOSS_LEVEL,
+					   RDP_NSC_DEFAULT_COLOR_LOSS_LEVEL);
+		nsc_context_set_parameters(nsc, NSC_ALLOW_SUBSAMPLING, TRUE);
+	}
 
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			width, height,
-			pixman_image_get_stride(image));
+	rects = pixman_region32_rectangles(&job->damage, &nrects);
+	job->cmds = xzalloc(MAX(nrects, 1) * sizeof *job->cmds);
+	offsets = xmalloc(MAX(nrects, 1) * sizeof *offsets);
+	for (i = 0; i < nrects; i++) {
+		SURFACE_BITS_COMMAND *cmd = &job->cmds[i];
+		int width = rects[i].x2 - rects[i].x1;
+		int height = rects[i].y2 - rects[i].y1;
+		BYTE *ptr = (BYTE *)pixman_image_get_data(image) +
+			    rects[i].y1 * stride + rects[i].x1 * 4;
+
+		cmd->skipCompression = TRUE;
+		cmd->cmdType = CMDTYPE_SET_SURFACE_BITS;
+		cmd->destLeft = rects[i].x1;
+		cmd->destTop = rects[i].y1;
+		cmd->destRight = rects[i].x2;
+		cmd->destBottom = rects[i].y2;
+		cmd->bmp.bpp = 32;
+		cmd->bmp.codecID = peer->context->settings->NSCodecId;
+		cmd->bmp.width = width;
+		cmd->bmp.height = height;
+
+		offsets[i] = Stream_GetPosition(job->stream);
+		nsc_compose_message(nsc, job->stream, ptr, width, height, stride);
+		cmd->bmp.bitmapDataLength = Stream_GetPosition(job->stream) - offsets[i];
+	}
+
+	/* stream may have been grown while encoding. */
+	for (i = 0; i < nrects; i++)
+		job->cmds[i].bmp.bitmapData = Stream_Buffer(job->stream) + offsets[i];
+	job->numCmds = nrects;
+	free(offsets);
+}
 
-	cmd.bmp.bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd.bmp.bitmapData = Stream_Buffer(context->encode_stream);
+static void
+rdp_peer_refresh_done(bool freeOnly, struct rdp_encoder_job *base)
+{
+	struct rdp_peer_refresh_job *job = container_of(base, struct rdp_peer_refresh_job, base);
+
+	if (!freeOnly) {
+		rdpUpdate *update = base->peerCtx->item.peer->context->update;
+		freerdp_peer **follower;
+
+		rdp_peer_frame_sent(base->peerCtx);
+		wl_array_for_each(follower, &job->followers)
+			rdp_peer_frame_sent((RdpPeerContext *)(*follower)->context);
+		for (int i = 0; i < job->numCmds; i++) {
+			update->SurfaceBits(update->context, &job->cmds[i]);
+			wl_array_for_each(follower, &job->followers) {
+				rdpUpdate *followerUpdate = (*follower)->context->update;
+
+				followerUpdate->SurfaceBits(followerUpdate->context,
+							    &job->cmds[i]);
+			}
+		}
+	}
 
-	update->SurfaceBits(update->context, &cmd);
+	wl_array_release(&job->followers);
+	pixman_region32_fini(&job->damage);
+	pixman_image_unref(job->image);
+	Stream_Free(job->stream, TRUE);
+	free(job->cmds);
+	free(job);
 }
 
 static void
@@ -202,6 +346,8 @@ pixman_image_flipped_subrect(const pixman_box32_t *rect, pixman_image_t *img, BY
 static void
 rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_peer *peer)
 {
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_backend *b = context->rdpBackend;
 	rdpUpdate *update = peer->context->update;
 	SURFACE_BITS_COMMAND cmd = { 0 };
 	SURFACE_FRAME_MARKER marker;
@@ -209,6 +355,9 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
 
+	/* every rect is at least one SurfaceBits, merge small ones. */
+	rdp_damage_optimize(region, NULL, 1, b->damage_max_rects,
+			    b->damage_rect_cost);
 	rect = pixman_region32_rectangles(region, &nrects);
 	if (!nrects)
 		return;
@@ -239,7 +388,8 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 			   cmd.destTop = top;
 			   cmd.destBottom = top + cmd.bmp.height;
 			   cmd.bmp.bitmapDataLength = cmd.bmp.width * cmd.bmp.height * 4;
-			   cmd.bmp.bitmapData = (BYTE *)realloc(cmd.bmp.bitmapData, cmd.bmp.bitmapDataLength);
+			   cmd.bmp.bitmapData = rdp_staging_buffer_reserve(&context->raw_staging,
+									   cmd.bmp.bitmapDataLength);
 
 			   subrect.y1 = top;
 			   subrect.y2 = top + cmd.bmp.height;
@@ -253,25 +403,323 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 		}
 	}
 
-	free(cmd.bmp.bitmapData);
-
 	marker.frameAction = SURFACECMD_FRAMEACTION_END;
 	update->SurfaceFrameMarker(peer->context, &marker);
 }
 
 static void
-rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+rdp_peer_refresh_submit(pixman_region32_t *damage, freerdp_peer *peer,
+			struct wl_array *followers, enum rdp_gfx_quality quality)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = rdp_get_first_output(context->rdpBackend);
 	rdpSettings *settings = peer->context->settings;
+	struct rdp_peer_refresh_job *job = xzalloc(sizeof *job);
+
+	/* shadow surface is not updated until this job is flushed. */
+	pixman_region32_init(&job->damage);
+	pixman_region32_copy(&job->damage, damage);
+	job->image = pixman_image_ref(output->shadow_surface);
+	job->quality = quality;
+	job->generation = context->refresh_generation;
+	job->stream = fail_on_null(Stream_New(NULL, 65536), 0, __FILE__, __LINE__);
+	wl_array_init(&job->followers);
+	if (followers)
+		wl_array_copy(&job->followers, followers);
+	rdp_encoder_submit(context, &job->base,
+			   settings->RemoteFxCodec ?
+				rdp_peer_refresh_rfx : rdp_peer_refresh_nsc,
+			   rdp_peer_refresh_done);
+}
 
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
-	else
-		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+/* followers get the same refresh as peer, and must have same codec settings. */
+static void
+rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer,
+			struct wl_array *followers, enum rdp_gfx_quality quality)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_backend *b = context->rdpBackend;
+	struct rdp_output *output = rdp_get_first_output(b);
+	rdpSettings *settings = peer->context->settings;
+	pixman_region32_t damage;
+
+	if (quality == RDP_GFX_QUALITY_DEFAULT &&
+	    rdp_link_is_constrained(&context->link))
+		quality = RDP_GFX_QUALITY_COARSE;
+
+	/* damage is shared by all peers, optimize a copy of it. */
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, region);
+
+	if (settings->RemoteFxCodec || settings->NSCodec) {
+		pixman_box32_t *extents;
+		int numBands, bandHeight, y;
+
+		if (settings->RemoteFxCodec) {
+			/* RemoteFX encodes whole 64x64 tiles anyway. */
+			pixman_box32_t bounds = {
+				0, 0,
+				pixman_image_get_width(output->shadow_surface),
+				pixman_image_get_height(output->shadow_surface),
+			};
+
+			rdp_damage_optimize(&damage, &bounds, RDP_RFX_TILE_SIZE,
+					    b->damage_max_rects, b->damage_rect_cost);
+		} else {
+			/* every rect is its own NSCodec command, merge small ones. */
+			rdp_damage_optimize(&damage, NULL, 1, b->damage_max_rects,
+					    b->damage_rect_cost);
+		}
+
+		/* large refresh is split into bands of whole tiles, one per
+		   encoder thread, and sent in order as they are done. */
+		extents = pixman_region32_extents(&damage);
+		numBands = rdp_encoder_get_num_threads(context);
+		if (numBands > 1 &&
+		    (extents->x2 - extents->x1) * (extents->y2 - extents->y1) >=
+		    RDP_REFRESH_BAND_MIN_AREA) {
+			bandHeight = (extents->y2 - extents->y1 + numBands - 1) / numBands;
+			bandHeight = (bandHeight + RDP_RFX_TILE_SIZE - 1) &
+				     ~(RDP_RFX_TILE_SIZE - 1);
+		} else {
+			bandHeight = extents->y2 - extents->y1;
+		}
+
+		for (y = extents->y1; y < extents->y2; y += bandHeight) {
+			pixman_region32_t band;
+
+			pixman_region32_init_rect(&band, extents->x1, y,
+						  extents->x2 - extents->x1,
+						  MIN(bandHeight, extents->y2 - y));
+			pixman_region32_intersect(&band, &band, &damage);
+			if (pixman_region32_not_empty(&band))
+				rdp_peer_refresh_submit(&band, peer, followers, quality);
+			pixman_region32_fini(&band);
+		}
+		context->shared_refresh_ready = true;
+	} else {
+		rdp_peer_refresh_raw(&damage, output->shadow_surface, peer);
+	}
+	pixman_region32_fini(&damage);
+}
+
+/* outstanding refresh refers shadow surface and may be sent to any peer. */
+static void
+rdp_peers_flush_refresh(struct rdp_backend *b)
+{
+	struct rdp_peers_item *peer;
+
+	wl_list_for_each(peer, &b->peers, link)
+		rdp_encoder_flush((RdpPeerContext *)peer->peer->context);
+}
+
+static bool
+rdp_peer_same_codec(rdpSettings *a, rdpSettings *b)
+{
+	if (a->RemoteFxCodec || b->RemoteFxCodec)
+		return a->RemoteFxCodec && b->RemoteFxCodec &&
+		       a->RemoteFxCodecId == b->RemoteFxCodecId;
+
+	return a->NSCodec && b->NSCodec && a->NSCodecId == b->NSCodecId &&
+	       a->NSCodecColorLossLevel == b->NSCodecColorLossLevel &&
+	       a->NSCodecAllowSubsampling == b->NSCodecAllowSubsampling;
+}
+
+/* Refresh damage on all peers. Peers with same codec share one encoded
+ * refresh of the first of them, so encoding cost doesn't grow with viewers.
+ * Peer which can't keep up is skipped and its damage is held, then sent
+ * as its own refresh once it caught up, so it doesn't hold up others.
+ * Refinement only goes to peers which took coarse refresh, see
+ * rdp_output_refresh().
+ */
+static void
+rdp_output_refresh_peers(struct rdp_backend *b, pixman_region32_t *damage,
+			 enum rdp_gfx_quality quality, bool isRefine)
+{
+	struct rdp_peers_item *peer;
+	freerdp_peer *leaders[2] = {}; /* RemoteFX and NSCodec */
+	struct wl_array followers[2];
+	int i;
+
+	for (i = 0; i < 2; i++)
+		wl_array_init(&followers[i]);
+
+	wl_list_for_each(peer, &b->peers, link) {
+		RdpPeerContext *context = (RdpPeerContext *)peer->peer->context;
+		rdpSettings *settings = peer->peer->context->settings;
+		freerdp_peer **follower;
+
+		if (!(peer->flags & RDP_PEER_ACTIVATED) ||
+		    !(peer->flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
+
+		if (isRefine && (settings->RemoteFxCodec || !settings->NSCodec))
+			continue;
+
+		if (b->shared_encoding && peer->peer->IsWriteBlocked &&
+		    peer->peer->IsWriteBlocked(peer->peer)) {
+			pixman_region32_union(&context->pending_damage,
+					      &context->pending_damage, damage);
+			continue;
+		}
+
+		if (pixman_region32_not_empty(&context->pending_damage)) {
+			pixman_region32_union(&context->pending_damage,
+					      &context->pending_damage, damage);
+			rdp_peer_refresh_region(&context->pending_damage,
+						peer->peer, NULL, quality);
+			pixman_region32_clear(&context->pending_damage);
+			continue;
+		}
+
+		if (!b->shared_encoding || !context->shared_refresh_ready ||
+		    !(settings->RemoteFxCodec || settings->NSCodec)) {
+			rdp_peer_refresh_region(damage, peer->peer, NULL, quality);
+			continue;
+		}
+
+		i = settings->RemoteFxCodec ? 0 : 1;
+		if (!leaders[i]) {
+			leaders[i] = peer->peer;
+		} else if (rdp_peer_same_codec(leaders[i]->context->settings,
+					       settings)) {
+			follower = wl_array_add(&followers[i], sizeof *follower);
+			*follower = peer->peer;
+		} else {
+			rdp_peer_refresh_region(damage, peer->peer, NULL, quality);
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (leaders[i])
+			rdp_peer_refresh_region(damage, leaders[i], &followers[i],
+						quality);
+		wl_array_release(&followers[i]);
+	}
+}
+
+/* Drop tiles of damage whose content peers already have, clients often
+ * commit with full damage while little or nothing changed. */
+static void
+rdp_output_drop_unchanged(struct rdp_backend *b, struct rdp_output *output,
+			  pixman_region32_t *damage)
+{
+	pixman_image_t *image = output->shadow_surface;
+	pixman_box32_t rect = {
+		0, 0,
+		pixman_image_get_width(image), pixman_image_get_height(image)
+	};
+	int checked;
+	int unchanged;
+
+	checked = rdp_tile_hashes_filter(&output->tileHashes,
+					 rect.x2, rect.y2, damage, &rect,
+					 (const BYTE *)pixman_image_get_data(image),
+					 pixman_image_get_stride(image),
+					 false, &unchanged);
+	rdp_tile_hashes_account(b, checked, unchanged,
+				!pixman_region32_not_empty(damage));
+}
+
+static int
+rdp_output_refine_timer_func(void *data)
+{
+	struct rdp_output *output = data;
+	struct rdp_backend *b = to_rdp_backend(output->base.compositor);
+	struct timespec now;
+	int64_t idle;
+
+	if (!output->shadow_surface ||
+	    !pixman_region32_not_empty(&output->refineRegion))
+		return 0;
+
+	weston_compositor_read_presentation_clock(b->compositor, &now);
+	idle = timespec_sub_to_msec(&now, &output->refine_last_update_time);
+	if (idle < RDP_REFINE_IDLE_MSEC) {
+		wl_event_source_timer_update(output->refine_timer,
+					     RDP_REFINE_IDLE_MSEC - idle);
+		return 0;
+	}
+
+	/* shadow surface still holds what was sent coarse. */
+	rdp_peers_flush_refresh(b);
+	rdp_output_refresh_peers(b, &output->refineRegion,
+				 RDP_GFX_QUALITY_LOSSLESS, true);
+	pixman_region32_clear(&output->refineRegion);
+
+	return 0;
+}
+
+static bool
+rdp_peers_link_constrained(struct rdp_backend *b)
+{
+	struct rdp_peers_item *peer;
+
+	wl_list_for_each(peer, &b->peers, link) {
+		RdpPeerContext *context = (RdpPeerContext *)peer->peer->context;
+
+		if (rdp_link_is_constrained(&context->link))
+			return true;
+	}
+
+	return false;
+}
+
+/* time to send an average frame over the slowest link, 0 when unknown. */
+static int
+rdp_peers_link_interval(struct rdp_backend *b)
+{
+	struct rdp_peers_item *peer;
+	int interval = 0;
+
+	wl_list_for_each(peer, &b->peers, link) {
+		RdpPeerContext *context = (RdpPeerContext *)peer->peer->context;
+
+		interval = MAX(interval, rdp_link_get_interval(&context->link));
+	}
+
+	return interval;
+}
+
+/* Desktop content in motion, or sent over a constrained link, is sent to
+ * NSCodec peers with color loss and chroma subsampling, and re-sent
+ * lossless once it stays idle for RDP_REFINE_IDLE_MSEC. RemoteFX is lossy
+ * at any rate, and raw bitmaps are lossless. */
+static void
+rdp_output_refresh(struct rdp_backend *b, struct rdp_output *output,
+		   pixman_region32_t *damage)
+{
+	struct wl_event_loop *loop;
+	struct timespec now;
+	bool isMotion;
+
+	if (!b->refine_quality) {
+		rdp_output_refresh_peers(b, damage, RDP_GFX_QUALITY_DEFAULT, false);
+		return;
+	}
+
+	if (!output->refine_timer) {
+		loop = wl_display_get_event_loop(b->compositor->wl_display);
+		output->refine_timer =
+			wl_event_loop_add_timer(loop, rdp_output_refine_timer_func,
+						output);
+	}
+
+	weston_compositor_read_presentation_clock(b->compositor, &now);
+	isMotion = rdp_motion_update(&output->refine_last_update_time,
+				     &output->refine_motion_count, &now);
+	if (output->refine_timer &&
+	    (isMotion || rdp_peers_link_constrained(b))) {
+		rdp_output_refresh_peers(b, damage, RDP_GFX_QUALITY_COARSE, false);
+		pixman_region32_union(&output->refineRegion,
+				      &output->refineRegion, damage);
+		wl_event_source_timer_update(output->refine_timer,
+					     RDP_REFINE_IDLE_MSEC);
+	} else {
+		rdp_output_refresh_peers(b, damage, RDP_GFX_QUALITY_LOSSLESS, false);
+		pixman_region32_subtract(&output->refineRegion,
+					 &output->refineRegion, damage);
+	}
 }
 
 static int
@@ -285,13 +733,231 @@ rdp_output_start_repaint_loop(struct weston_output *output)
 	return 0;
 }
 
+/* With parallel repaint, all outputs are rendered before any of them is
+ * repainted, so do here what rdp_output_repaint() does before rendering.
+ */
+static void *
+rdp_repaint_begin(struct weston_compositor *ec)
+{
+	struct rdp_backend *b = to_rdp_backend(ec);
+	struct rdp_output *output;
+
+	if (!ec->repaint_pool)
+		return NULL;
+
+	rdp_peers_flush_refresh(b);
+
+	wl_list_for_each(output, &b->output_list, link) {
+		if (output->shadow_surface && output->base.renderer_state)
+			pixman_renderer_output_set_buffer(&output->base,
+							  output->shadow_surface);
+	}
+
+	return NULL;
+}
+
+/* Runs on a repaint worker, see weston_output::repaint_render. */
+static bool
+rdp_output_repaint_render(struct weston_output *output_base,
+			  pixman_region32_t *damage)
+{
+	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
+	struct weston_compositor *ec = output->base.compositor;
+	struct rdp_backend *b = to_rdp_backend(ec);
+
+	/* RAIL windows are sent by rdp_rail_output_repaint() instead. */
+	if (b->rdp_peer &&
+		b->rdp_peer->context->settings->HiDefRemoteApp)
+		return false;
+
+	if (!output->shadow_surface || !output_base->renderer_state)
+		return false;
+
+	ec->renderer->repaint_output(output_base, damage);
+	return true;
+}
+
+static void
+rdp_peer_set_desktop_cursor(RdpPeerContext *peer_ctx,
+			    struct weston_surface *surface);
+
+static void
+rdp_peer_desktop_cursor_committed(struct wl_listener *listener, void *data)
+{
+	RdpPeerContext *peer_ctx =
+		container_of(listener, RdpPeerContext,
+			     desktop_cursor_commit_listener);
+
+	peer_ctx->is_desktop_cursor_dirty = true;
+}
+
+static void
+rdp_peer_desktop_cursor_destroyed(struct wl_listener *listener, void *data)
+{
+	RdpPeerContext *peer_ctx =
+		container_of(listener, RdpPeerContext,
+			     desktop_cursor_destroy_listener);
+
+	rdp_peer_set_desktop_cursor(peer_ctx, NULL);
+}
+
+static void
+rdp_peer_set_desktop_cursor(RdpPeerContext *peer_ctx,
+			    struct weston_surface *surface)
+{
+	if (peer_ctx->desktop_cursor == surface)
+		return;
+
+	if (peer_ctx->desktop_cursor) {
+		wl_list_remove(&peer_ctx->desktop_cursor_commit_listener.link);
+		wl_list_remove(&peer_ctx->desktop_cursor_destroy_listener.link);
+		peer_ctx->desktop_cursor->keep_buffer = false;
+	}
+
+	peer_ctx->desktop_cursor = surface;
+	peer_ctx->is_desktop_cursor_dirty = true;
+	if (!surface)
+		return;
+
+	/* hold client buffer past repaint to hash shape from it. */
+	surface->keep_buffer = true;
+	peer_ctx->desktop_cursor_commit_listener.notify =
+		rdp_peer_desktop_cursor_committed;
+	wl_signal_add(&surface->commit_signal,
+		      &peer_ctx->desktop_cursor_commit_listener);
+	peer_ctx->desktop_cursor_destroy_listener.notify =
+		rdp_peer_desktop_cursor_destroyed;
+	wl_signal_add(&surface->destroy_signal,
+		      &peer_ctx->desktop_cursor_destroy_listener);
+}
+
+static void
+rdp_peer_send_cursor_position(RdpPeerContext *peer_ctx,
+			      struct weston_pointer *pointer)
+{
+	struct weston_compositor *ec = peer_ctx->rdpBackend->compositor;
+	rdpUpdate *update = peer_ctx->item.peer->context->update;
+	POINTER_POSITION_UPDATE position = {};
+	struct weston_output *output;
+	int32_t x = wl_fixed_to_int(pointer->x);
+	int32_t y = wl_fixed_to_int(pointer->y);
+
+	peer_ctx->client_pointer_x = pointer->x;
+	peer_ctx->client_pointer_y = pointer->y;
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		if (!pixman_region32_contains_point(&output->region, x, y, NULL))
+			continue;
+
+		to_client_coordinate(peer_ctx, output, &x, &y, NULL, NULL);
+		position.xPos = MAX(x - peer_ctx->desktop_left, 0);
+		position.yPos = MAX(y - peer_ctx->desktop_top, 0);
+		update->BeginPaint(update->context);
+		update->pointer->PointerPosition(update->context, &position);
+		update->EndPaint(update->context);
+		return;
+	}
+}
+
+/* In full desktop mode each client draws the pointer of its own seat, so
+ * motion costs no encoding. Shape is sent when the sprite or its content
+ * changes, position only when the compositor moved the pointer away from
+ * where the client put it (warp, confinement). */
+static void
+rdp_peer_update_cursor(RdpPeerContext *peer_ctx)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct weston_pointer *pointer;
+	struct weston_surface *surface = NULL;
+	int32_t hotspot_x = 0;
+	int32_t hotspot_y = 0;
+	int scale = 1;
+
+	if (!(peer_ctx->item.flags & RDP_PEER_ACTIVATED))
+		return;
+
+	pointer = weston_seat_get_pointer(peer_ctx->item.seat);
+	if (!pointer)
+		return;
+
+	if (pointer->sprite && weston_view_is_mapped(pointer->sprite)) {
+		surface = pointer->sprite->surface;
+		if (surface->output)
+			scale = surface->output->current_scale;
+		hotspot_x = pointer->hotspot_x * scale;
+		hotspot_y = pointer->hotspot_y * scale;
+	}
+
+	rdp_peer_set_desktop_cursor(peer_ctx, surface);
+
+	if (peer_ctx->is_desktop_cursor_dirty ||
+	    peer_ctx->desktop_cursor_hotspot_x != hotspot_x ||
+	    peer_ctx->desktop_cursor_hotspot_y != hotspot_y) {
+		peer_ctx->is_desktop_cursor_dirty = false;
+		peer_ctx->desktop_cursor_hotspot_x = hotspot_x;
+		peer_ctx->desktop_cursor_hotspot_y = hotspot_y;
+
+		if (!surface || surface->width <= 0 || surface->height <= 0)
+			rdp_rail_send_cursor_hidden(peer_ctx);
+		else if (rdp_rail_send_cursor_shape(peer_ctx, surface,
+						    surface->width * scale,
+						    surface->height * scale,
+						    hotspot_x, hotspot_y) < 0)
+			rdp_debug_error(b, "%s: failed to send cursor shape\n",
+					__func__);
+	}
+
+	if (pointer->x != peer_ctx->client_pointer_x ||
+	    pointer->y != peer_ctx->client_pointer_y)
+		rdp_peer_send_cursor_position(peer_ctx, pointer);
+}
+
+static bool
+rdp_view_is_client_cursor(struct rdp_backend *b, struct weston_view *ev)
+{
+	struct rdp_peers_item *peer;
+
+	wl_list_for_each(peer, &b->peers, link) {
+		struct weston_pointer *pointer;
+
+		if (!(peer->flags & RDP_PEER_ACTIVATED))
+			continue;
+
+		pointer = weston_seat_get_pointer(peer->seat);
+		if (pointer && pointer->sprite == ev)
+			return true;
+	}
+
+	return false;
+}
+
+/* Pointer sprites go to a plane of their own, so they are neither
+ * composited into the shadow surface nor damage it as they move. */
+static void
+rdp_output_assign_planes(struct weston_output *output_base,
+			 void *repaint_data)
+{
+	struct weston_compositor *ec = output_base->compositor;
+	struct rdp_backend *b = to_rdp_backend(ec);
+	bool is_desktop = !(b->rdp_peer &&
+			    b->rdp_peer->context->settings->HiDefRemoteApp);
+	struct weston_view *ev;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (is_desktop && rdp_view_is_client_cursor(b, ev))
+			weston_view_move_to_plane(ev, &b->cursor_plane);
+		else
+			weston_view_move_to_plane(ev, &ec->primary_plane);
+		ev->psf_flags = 0;
+	}
+}
+
 static int
 rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 		   void *repaint_data)
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
-	struct rdp_peers_item *peer;
 	struct rdp_backend *b = to_rdp_backend(ec);
 
 	/* Calculate the time we should complete this frame such that frames
@@ -309,16 +975,38 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 		next_frame_delta = refresh_msec;
 	}
 
+	/* all PDUs of frame go out at once. */
+	rdp_output_batch_begin(b);
+
 	if (b->rdp_peer &&
 		b->rdp_peer->context->settings->HiDefRemoteApp) {
 		/* RAIL mode, repaint RAIL window */
+		RdpPeerContext *peer_ctx = (RdpPeerContext *)b->rdp_peer->context;
+		uint32_t lastFrameId = peer_ctx->currentFrameId;
+
 		rdp_rail_output_repaint(output_base, damage);
+		/* slow down repaint while client is behind. */
+		next_frame_delta = MAX(next_frame_delta,
+				       rdp_frame_pacer_get_interval(&peer_ctx->frame_pacer,
+								    refresh_msec));
+		/* when a frame is sent, its ack completes the repaint with
+		   the time client presented it, unless the timer is first.
+		   Acks are only tracked by the frame pacer. */
+		output->is_frame_ack_pending =
+			peer_ctx->frame_pacer.enabled &&
+			!peer_ctx->isAcknowledgedSuspended &&
+			peer_ctx->currentFrameId != lastFrameId;
+		output->frame_ack_id = peer_ctx->currentFrameId;
 	} else if (output->shadow_surface &&
 			output_base->renderer_state) {
 		/* Add above 'output_base->renderer_state' check since this turns NULL when RDP
 		   connection is disconnected and hit fault at pixman_renderer_output_set_buffer() */
-		pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
-		ec->renderer->repaint_output(&output->base, damage);
+		if (!output_base->repaint_offloaded) {
+			rdp_peers_flush_refresh(b);
+
+			pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
+			ec->renderer->repaint_output(&output->base, damage);
+		}
 		if (pixman_region32_not_empty(damage)) {
 			pixman_region32_t transformed_damage;
 			pixman_region32_init(&transformed_damage);
@@ -327,18 +1015,29 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 						  output_base->transform,
 						  output_base->current_scale,
 						  damage, &transformed_damage);
-			wl_list_for_each(peer, &b->peers, link) {
-				if ((peer->flags & RDP_PEER_ACTIVATED) &&
-					(peer->flags & RDP_PEER_OUTPUT_ENABLED))
-					rdp_peer_refresh_region(&transformed_damage, peer->peer);
-			}
+			rdp_output_drop_unchanged(b, output, &transformed_damage);
+			if (pixman_region32_not_empty(&transformed_damage))
+				rdp_output_refresh(b, output, &transformed_damage);
 			pixman_region32_fini(&transformed_damage);
 		}
 
+		if (b->client_cursor) {
+			struct rdp_peers_item *peer;
+
+			wl_list_for_each(peer, &b->peers, link)
+				rdp_peer_update_cursor((RdpPeerContext *)peer->peer->context);
+			pixman_region32_clear(&b->cursor_plane.damage);
+		}
+
 		pixman_region32_subtract(&ec->primary_plane.damage,
 					&ec->primary_plane.damage, damage);
+
+		/* slow down repaint to what the slowest link carries. */
+		next_frame_delta = MAX(next_frame_delta, rdp_peers_link_interval(b));
 	}
 
+	rdp_output_batch_end(b);
+
 	wl_event_source_timer_update(output->finish_frame_timer, next_frame_delta);
 	return 0;
 }
@@ -349,12 +1048,146 @@ finish_frame_handler(void *data)
 	struct rdp_output *output = data;
 	struct timespec ts;
 
+	output->is_frame_ack_pending = false;
 	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
 	weston_output_finish_frame(&output->base, &ts, 0);
 
 	return 1;
 }
 
+/* frames sent between reports of output counters, at verbose level. */
+#define RDP_OUTPUT_REPORT_FRAMES 256
+
+/* Output of all peers is batched while frames are composed and sent, and
+ * written at once when the outermost batch ends: TCP peers are corked for
+ * the batch. Other transports write each PDU as FreeRDP sends it, there
+ * batches only count bytes and write syscalls per frame. */
+void
+rdp_output_batch_begin(struct rdp_backend *b)
+{
+	struct rdp_peers_item *peer;
+
+	assert_compositor_thread(b);
+
+	if (b->output_batch_depth++)
+		return;
+
+	b->output_writes_at_begin = rdp_read_write_syscalls(b->thread_io_fd);
+	if (!b->cork_frames)
+		return;
+
+	wl_list_for_each(peer, &b->peers, link) {
+		RdpPeerContext *context = (RdpPeerContext *)peer->peer->context;
+		int on = 1;
+
+		if (context->is_output_tcp)
+			setsockopt(peer->peer->sockfd, IPPROTO_TCP, TCP_CORK,
+				   &on, sizeof(on));
+	}
+}
+
+void
+rdp_output_batch_end(struct rdp_backend *b)
+{
+	struct rdp_peers_item *peer;
+	int64_t writes;
+
+	assert(b->output_batch_depth > 0);
+	if (--b->output_batch_depth)
+		return;
+
+	wl_list_for_each(peer, &b->peers, link) {
+		RdpPeerContext *context = (RdpPeerContext *)peer->peer->context;
+		uint64_t sent = freerdp_get_transport_sent(peer->peer->context, FALSE);
+		int off = 0;
+
+		/* uncorking writes what was held back. */
+		if (b->cork_frames && context->is_output_tcp)
+			setsockopt(peer->peer->sockfd, IPPROTO_TCP, TCP_CORK,
+				   &off, sizeof(off));
+		if (sent >= context->output_bytes_last)
+			b->output_bytes += sent - context->output_bytes_last;
+		context->output_bytes_last = sent;
+	}
+
+	writes = rdp_read_write_syscalls(b->thread_io_fd);
+	if (writes >= 0 && b->output_writes_at_begin >= 0)
+		b->output_writes += writes - b->output_writes_at_begin;
+	b->output_batches++;
+}
+
+void
+rdp_peer_frame_sent(RdpPeerContext *peerCtx)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	uint64_t frames;
+
+	peerCtx->link.framesSent++;
+	b->output_frames++;
+
+	frames = b->output_frames - b->output_frames_reported;
+	if (frames < RDP_OUTPUT_REPORT_FRAMES)
+		return;
+
+	b->output_frames_reported = b->output_frames;
+	rdp_debug_verbose(b, "output: %" PRIu64 " frames, %" PRIu64 " bytes/frame, %.2f writes/frame, %" PRIu64 " batches\n",
+			  b->output_frames, b->output_bytes / b->output_frames,
+			  (double)b->output_writes / b->output_frames,
+			  b->output_batches);
+}
+
+void
+dump_output_state(FILE *fp, struct rdp_backend *b)
+{
+	fprintf(fp,"Output batching status:\n");
+	fprintf(fp,"    TCP cork: %s, TCP nodelay: %s, socket buffer: %d\n",
+		b->cork_frames ? "on" : "off", b->tcp_nodelay ? "on" : "off",
+		b->socket_buffer_size);
+	fprintf(fp,"    frames: %" PRIu64 ", batches: %" PRIu64 "\n",
+		b->output_frames, b->output_batches);
+	fprintf(fp,"    bytes per frame: %" PRIu64 "\n",
+		b->output_frames ? b->output_bytes / b->output_frames : 0);
+	if (b->thread_io_fd >= 0)
+		fprintf(fp,"    write syscalls per frame: %.2f\n",
+			b->output_frames ?
+			(double)b->output_writes / b->output_frames : 0.0);
+	fprintf(fp,"\n");
+}
+
+/* Complete repaint of outputs waiting for frameId, or earlier frame, to
+ * be acknowledged by client. ackTime is CLOCK_MONOTONIC taken when ack was
+ * received, and is shortly before now, so it is moved to presentation
+ * clock by the offset between the clocks now. */
+void
+rdp_output_frame_acked(struct rdp_backend *b, uint32_t frameId,
+		       const struct timespec *ackTime)
+{
+	struct weston_compositor *ec = b->compositor;
+	struct rdp_output *output;
+	struct timespec stamp, now, monotonic_now;
+
+	wl_list_for_each(output, &b->output_list, link) {
+		if (!output->base.enabled || !output->is_frame_ack_pending ||
+		    (int32_t)(frameId - output->frame_ack_id) < 0)
+			continue;
+
+		if (ec->presentation_clock == CLOCK_MONOTONIC) {
+			stamp = *ackTime;
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+			weston_compositor_read_presentation_clock(ec, &now);
+			timespec_add_nsec(&stamp, &now,
+					  timespec_sub_to_nsec(ackTime,
+							       &monotonic_now));
+		}
+
+		output->is_frame_ack_pending = false;
+		wl_event_source_timer_update(output->finish_frame_timer, 0);
+		weston_output_finish_frame(&output->base, &stamp,
+					   WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION);
+	}
+}
+
 static struct weston_mode *
 ensure_mode(struct weston_output *output, struct weston_mode *target)
 {
@@ -386,11 +1219,18 @@ rdp_output_set_mode(struct weston_output *base, struct weston_mode *mode)
 	struct rdp_backend *b = to_rdp_backend(base->compositor);
 	struct weston_mode *cur;
 	struct weston_output *output = base;
-	const struct pixman_renderer_output_options options = { .use_shadow = true, };
+	struct weston_head *head;
+	const struct pixman_renderer_output_options options = {
+		.use_shadow = true,
+		.band_threads = b->render_threads,
+	};
 	struct rdp_peers_item *rdpPeer;
 	rdpSettings *settings;
 
-	mode->refresh = b->rdp_monitor_refresh_rate;
+	/* each output repaints at the rate of its own client monitor. */
+	head = weston_output_get_first_head(base);
+	mode->refresh = head ? to_rdp_head(head)->refresh :
+			       b->rdp_monitor_refresh_rate;
 	cur = ensure_mode(base, mode);
 
 	base->current_mode = cur;
@@ -450,6 +1290,44 @@ rdp_head_get_rdpmonitor(const struct weston_head *base)
 	return &h->config;
 }
 
+/* Refresh rate in mHz of monitor at monitorIndex of client layout. RDP
+ * doesn't tell the client monitor's refresh rate, so it is configured. */
+int
+rdp_get_monitor_refresh_rate(struct rdp_backend *b, uint32_t monitorIndex)
+{
+	if (monitorIndex < RDP_MAX_MONITOR &&
+	    b->monitor_refresh_rates[monitorIndex])
+		return b->monitor_refresh_rates[monitorIndex];
+
+	return b->rdp_monitor_refresh_rate;
+}
+
+/* "60,144" gives 60Hz to 1st monitor, and 144Hz to 2nd, an empty or
+ * invalid entry leaves that monitor at the default rate. */
+static void
+rdp_parse_monitor_refresh_rates(struct rdp_backend *b, const char *rates)
+{
+	const char *s = rates;
+	char *end;
+	long hz;
+
+	for (int i = 0; s && *s && i < RDP_MAX_MONITOR; i++) {
+		if (*s != ',') {
+			errno = 0;
+			hz = strtol(s, &end, 10);
+			if (end != s && (*end == ',' || *end == '\0') &&
+			    errno == 0 && hz > 0 && hz <= 1000)
+				b->monitor_refresh_rates[i] = hz * 1000;
+			else
+				weston_log("RDP backend: invalid monitor refresh rate at \"%s\"\n", s);
+		}
+
+		s = strchr(s, ',');
+		if (s)
+			s++;
+	}
+}
+
 struct weston_output *
 rdp_output_get_primary(struct weston_compositor *compositor)
 {
@@ -474,6 +1352,7 @@ rdp_output_enable(struct weston_output *base)
 	struct wl_event_loop *loop;
 	const struct pixman_renderer_output_options options = {
 		.use_shadow = true,
+		.band_threads = b->render_threads,
 	};
 	bool HiDefRemoteApp = false;
 
@@ -500,6 +1379,7 @@ rdp_output_enable(struct weston_output *base)
 
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
 	output->finish_frame_timer = wl_event_loop_add_timer(loop, finish_frame_handler, output);
+	pixman_region32_init(&output->refineRegion);
 
 	return 0;
 }
@@ -519,6 +1399,13 @@ rdp_output_disable(struct weston_output *base)
 	}
 
 	wl_event_source_remove(output->finish_frame_timer);
+	output->is_frame_ack_pending = false;
+	rdp_tile_hashes_reset(&output->tileHashes);
+	if (output->refine_timer) {
+		wl_event_source_remove(output->refine_timer);
+		output->refine_timer = NULL;
+	}
+	pixman_region32_fini(&output->refineRegion);
 
 	return 0;
 }
@@ -584,7 +1471,10 @@ rdp_output_create(struct weston_compositor *compositor, const char *name)
 
 	output->base.start_repaint_loop = rdp_output_start_repaint_loop;
 	output->base.repaint = rdp_output_repaint;
+	output->base.repaint_render = rdp_output_repaint_render;
 	output->base.switch_mode = rdp_output_switch_mode;
+	if (backend->client_cursor)
+		output->base.assign_planes = rdp_output_assign_planes;
 
 	weston_compositor_add_pending_output(&output->base, compositor);
 
@@ -601,6 +1491,7 @@ rdp_head_create(struct weston_compositor *compositor, BOOL isPrimary, rdpMonitor
 	head = xzalloc(sizeof *head);
 
 	head->index = b->head_index++;
+	head->refresh = b->rdp_monitor_refresh_rate;
 	if (config)
 		head->config = *config;
 	else
@@ -632,6 +1523,42 @@ rdp_head_destroy(struct weston_compositor *compositor, struct rdp_head *head)
 	free(head);
 }
 
+static void
+rdp_memory_report(struct wl_listener *listener, void *data)
+{
+	struct rdp_backend *b = container_of(listener, struct rdp_backend,
+					     memory_report_listener);
+	struct weston_memory_report *report = data;
+	struct rdp_peers_item *peer;
+	RdpPeerContext *context;
+	unsigned int count = 0;
+	uint64_t bytes = 0;
+
+	wl_list_for_each(peer, &b->peers, link) {
+		context = (RdpPeerContext *)peer->peer->context;
+		if (context->raw_staging.data) {
+			count++;
+			bytes += context->raw_staging.size;
+		}
+	}
+
+	weston_memory_report_add(report, "rdp-backend", "raw staging",
+				 count, bytes);
+}
+
+/* The raw refresh staging is only used within rdp_peer_refresh_raw(). */
+static void
+rdp_memory_trim(struct wl_listener *listener, void *data)
+{
+	struct rdp_backend *b = container_of(listener, struct rdp_backend,
+					     memory_trim_listener);
+	struct rdp_peers_item *peer;
+
+	wl_list_for_each(peer, &b->peers, link)
+		rdp_staging_buffer_release(
+			&((RdpPeerContext *)peer->peer->context)->raw_staging);
+}
+
 static void
 rdp_destroy(struct weston_compositor *ec)
 {
@@ -640,6 +1567,9 @@ rdp_destroy(struct weston_compositor *ec)
 	struct rdp_peers_item *rdp_peer, *tmp;
 	int i;
 
+	wl_list_remove(&b->memory_report_listener.link);
+	wl_list_remove(&b->memory_trim_listener.link);
+
 	wl_list_for_each_safe(rdp_peer, tmp, &b->peers, link) {
 		freerdp_peer* client = rdp_peer->peer;
 
@@ -653,6 +1583,10 @@ rdp_destroy(struct weston_compositor *ec)
 			wl_event_source_remove(b->listener_events[i]);
 
 	rdp_rail_destroy(b);
+	weston_plane_release(&b->cursor_plane);
+	rdp_trace_close(b);
+	if (b->thread_io_fd >= 0)
+		close(b->thread_io_fd);
 
 	if (b->debugClipboard) {
 		weston_log_scope_destroy(b->debugClipboard);
@@ -726,33 +1660,10 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 
 	context->loop_task_event_source_fd = -1;
 	context->loop_task_event_source = NULL;
-	wl_list_init(&context->loop_task_list);
-
-	context->rfx_context = rfx_context_new(TRUE);
-	if (!context->rfx_context)
-		return FALSE;
-
-	context->rfx_context->mode = RLGR3;
-	context->rfx_context->width = client->context->settings->DesktopWidth;
-	context->rfx_context->height = client->context->settings->DesktopHeight;
-	rfx_context_set_pixel_format(context->rfx_context, DEFAULT_PIXEL_FORMAT);
-
-	context->nsc_context = nsc_context_new();
-	if (!context->nsc_context)
-		goto out_error_nsc;
-
-	nsc_context_set_parameters(context->nsc_context, NSC_COLOR_FORMAT, DEFAULT_PIXEL_FORMAT);
-	context->encode_stream = Stream_New(NULL, 65536);
-	if (!context->encode_stream)
-		goto out_error_stream;
+	context->loop_task_stack = NULL;
+	pixman_region32_init(&context->pending_damage);
 
 	return TRUE;
-
-out_error_nsc:
-	rfx_context_free(context->rfx_context);
-out_error_stream:
-	nsc_context_free(context->nsc_context);
-	return FALSE;
 }
 
 static void
@@ -769,6 +1680,8 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 	/* While RDP client is disconnected, keep compositor sleep state */
 	weston_compositor_sleep(b->compositor);
 
+	/* refresh shared from other peers may be still sent to this peer. */
+	rdp_peers_flush_refresh(b);
 	wl_list_remove(&context->item.link);
 
 	for (i = 0; i < ARRAY_LENGTH(context->events); i++) {
@@ -784,6 +1697,15 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 
 	rdp_clipboard_destroy(context);
 
+	rdp_touch_destroy(context);
+
+	rdp_peer_set_desktop_cursor(context, NULL);
+
+	rdp_encoder_destroy(context);
+
+	if (context->link_probe_timer)
+		wl_event_source_remove(context->link_probe_timer);
+
 	rdp_rail_peer_context_free(client, context);
 
 	rdp_drdynvc_destroy(context);
@@ -806,12 +1728,13 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		context->item.flags &= ~RDP_PEER_ACTIVATED;
 	}
 
-	Stream_Free(context->encode_stream, TRUE);
-	nsc_context_free(context->nsc_context);
-	rfx_context_free(context->rfx_context);
-	free(context->rfx_rects);
+	rdp_staging_buffer_release(&context->raw_staging);
+	pixman_region32_fini(&context->pending_damage);
 }
 
+static void
+rdp_flush_pending_motion(RdpPeerContext *peerContext);
+
 static int
 rdp_client_activity(int fd, uint32_t mask, void *data)
 {
@@ -832,6 +1755,9 @@ rdp_client_activity(int fd, uint32_t mask, void *data)
         	}
 	}
 
+	/* input of this dispatch is done, send coalesced motion. */
+	rdp_flush_pending_motion(peerCtx);
+
 	return 0;
 
 out_clean:
@@ -1039,6 +1965,128 @@ convert_rdp_keyboard_to_xkb_rule_names(
 		xkbRuleNames->model, xkbRuleNames->layout, xkbRuleNames->variant, xkbRuleNames->options);
 }
 
+/* sequence number 0 means no outstanding request. */
+static uint16_t
+rdp_link_next_sequence(struct rdp_link_estimate *link)
+{
+	if (++link->sequenceNumber == 0)
+		link->sequenceNumber = 1;
+	return link->sequenceNumber;
+}
+
+static BOOL
+rdp_link_rtt_measure_response(rdpContext *context, UINT16 sequenceNumber)
+{
+	RdpPeerContext *peerCtx = (RdpPeerContext *)context;
+	struct rdp_link_estimate *link = &peerCtx->link;
+	struct timespec now;
+
+	/* response to a request overwritten by later one is dropped. */
+	if (sequenceNumber != link->rttSequenceNumber)
+		return TRUE;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rdp_link_estimate_rtt(link,
+			      timespec_sub_to_nsec(&now, &link->rttRequestTime) / 1000);
+	link->rttSequenceNumber = 0;
+	return TRUE;
+}
+
+static BOOL
+rdp_link_bandwidth_measure_results(rdpContext *context, UINT16 sequenceNumber)
+{
+	RdpPeerContext *peerCtx = (RdpPeerContext *)context;
+
+	rdp_link_estimate_bandwidth(&peerCtx->link,
+				    context->autodetect->bandwidthMeasureByteCount,
+				    context->autodetect->bandwidthMeasureTimeDelta);
+	return TRUE;
+}
+
+/* Every probe measures round trip, and every RDP_LINK_BANDWIDTH_PROBE_PERIOD
+ * probes, bandwidth is measured over session traffic until next probe.
+ * The estimate limits frame rate and frames in flight, and with a
+ * constrained link, updates are sent coarse and refined once idle. */
+static int
+rdp_link_probe_timer_func(void *data)
+{
+	RdpPeerContext *peerCtx = data;
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	struct rdp_link_estimate *link = &peerCtx->link;
+	rdpContext *context = &peerCtx->_p;
+	rdpAutoDetect *autodetect = context->autodetect;
+	bool wasConstrained = rdp_link_is_constrained(link);
+	uint64_t sent;
+
+	sent = freerdp_get_transport_sent(context, FALSE);
+	rdp_link_estimate_frames(link, sent - link->bytesSent);
+	link->bytesSent = sent;
+
+	if (link->isBandwidthProbing) {
+		autodetect->BandwidthMeasureStop(context, rdp_link_next_sequence(link));
+		link->isBandwidthProbing = false;
+	} else if (link->probeCount % RDP_LINK_BANDWIDTH_PROBE_PERIOD == 0) {
+		link->isBandwidthProbing =
+			autodetect->BandwidthMeasureStart(context,
+							  rdp_link_next_sequence(link));
+	}
+
+	link->rttSequenceNumber = rdp_link_next_sequence(link);
+	clock_gettime(CLOCK_MONOTONIC, &link->rttRequestTime);
+	if (!autodetect->RTTMeasureRequest(context, link->rttSequenceNumber))
+		link->rttSequenceNumber = 0;
+	link->probeCount++;
+
+	rdp_frame_pacer_set_link(&peerCtx->frame_pacer, link);
+
+	if (rdp_link_is_constrained(link) != wasConstrained)
+		rdp_debug(b, "link: %s, bandwidth:%ukbps rtt:%ldus\n",
+			  wasConstrained ? "no longer constrained" : "constrained",
+			  link->bandwidthKbps, (long)link->rttUsec);
+	rdp_debug_verbose(b, "link: bandwidth:%ukbps rtt:%ldus frameBytes:%lu window:%d interval:%dms\n",
+			  link->bandwidthKbps, (long)link->rttUsec,
+			  (unsigned long)link->frameBytes,
+			  rdp_link_get_window(link), rdp_link_get_interval(link));
+
+	wl_event_source_timer_update(peerCtx->link_probe_timer,
+				     RDP_LINK_PROBE_INTERVAL_MSEC);
+	return 0;
+}
+
+static void
+rdp_link_probe_start(RdpPeerContext *peerCtx)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	rdpContext *context = &peerCtx->_p;
+	rdpAutoDetect *autodetect = context->autodetect;
+	struct wl_event_loop *loop;
+
+	if (peerCtx->link_probe_timer)
+		return;
+
+	/* network auto-detect must be supported by client. */
+	if (!b->network_autodetect || !context->settings->NetworkAutoDetect ||
+	    !autodetect || !autodetect->RTTMeasureRequest ||
+	    !autodetect->BandwidthMeasureStart ||
+	    !autodetect->BandwidthMeasureStop) {
+		rdp_debug(b, "link: network auto-detect is not used\n");
+		return;
+	}
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	peerCtx->link_probe_timer =
+		wl_event_loop_add_timer(loop, rdp_link_probe_timer_func, peerCtx);
+	if (!peerCtx->link_probe_timer)
+		return;
+
+	rdp_link_estimate_init(&peerCtx->link);
+	peerCtx->link.bytesSent = freerdp_get_transport_sent(context, FALSE);
+	autodetect->RTTMeasureResponse = rdp_link_rtt_measure_response;
+	autodetect->BandwidthMeasureResults = rdp_link_bandwidth_measure_results;
+	wl_event_source_timer_update(peerCtx->link_probe_timer,
+				     RDP_LINK_PROBE_INTERVAL_MSEC);
+}
+
 static BOOL
 xf_peer_activate(freerdp_peer* client)
 {
@@ -1106,14 +2154,15 @@ xf_peer_activate(freerdp_peer* client)
 	if (settings->RemoteApplicationMode ||
 		settings->RedirectClipboard ||
 		settings->AudioPlayback ||
-		settings->AudioCapture) {
+		settings->AudioCapture ||
+		b->redirect_touch) {
 
 		if (!peerCtx->vcm) {
-			rdp_debug_error(b, "Virtual channel is required for RAIL, clipboard, audio playback/capture\n");
+			rdp_debug_error(b, "Virtual channel is required for RAIL, clipboard, audio playback/capture, touch\n");
 			goto error_exit;
 		}
 
-		/* RAIL, clipboard, Audio playback/capture requires dynamic virtual channel */
+		/* RAIL, clipboard, Audio playback/capture, touch requires dynamic virtual channel */
 		if (!rdp_drdynvc_init(client))
 			goto error_exit;
 
@@ -1129,6 +2178,13 @@ xf_peer_activate(freerdp_peer* client)
 			peerCtx->audio_in_private = b->audio_in_setup(b->compositor, peerCtx->vcm);
 	}
 
+	/* client starts with empty pointer and icon caches at activation. */
+	rdp_slot_cache_reset(&peerCtx->cursor_cache,
+			     settings->PointerCacheSize);
+	rdp_slot_cache_reset(&peerCtx->icon_cache,
+			     settings->RemoteAppNumIconCaches *
+			     settings->RemoteAppNumIconCacheEntries);
+
 	if (settings->HiDefRemoteApp) {
 		/* single monitor case, FreeRDP doesn't call AdjustMonitorsLayout callback, so call now */
 		xf_peer_adjust_monitor_layout(client);
@@ -1162,8 +2218,11 @@ xf_peer_activate(freerdp_peer* client)
 		rdp_debug(b, "%s: OutputWidth:%d, OutputHeight:%d, OutputScaleFactor:%d\n", __FUNCTION__,
 			weston_output->width, weston_output->height, weston_output->scale);
 
-		rfx_context_reset(peerCtx->rfx_context, weston_output->width, weston_output->height);
-		nsc_context_reset(peerCtx->nsc_context, weston_output->width, weston_output->height);
+		/* client resets its decoder, so it needs own refresh again. */
+		rdp_peers_flush_refresh(b);
+		peerCtx->refresh_generation++;
+		peerCtx->shared_refresh_ready = false;
+		pixman_region32_clear(&peerCtx->pending_damage);
 	}
 
 	if (settings->RemoteApplicationMode)
@@ -1184,8 +2243,8 @@ xf_peer_activate(freerdp_peer* client)
 
 	keymap = NULL;
 	if (xkbRuleNames.layout) {
-		keymap = xkb_keymap_new_from_names(b->compositor->xkb_context,
-						   &xkbRuleNames, 0);
+		keymap = weston_compositor_get_keymap(b->compositor,
+						      &xkbRuleNames);
 	}
 
 	if (settings->ClientHostname)
@@ -1211,13 +2270,22 @@ xf_peer_activate(freerdp_peer* client)
 		if (rdp_clipboard_init(client) != 0)
 			goto error_exit;
 
+	/* Touch is optional, continue with pointer only when it fails */
+	if (b->redirect_touch)
+		if (!rdp_touch_init(client))
+			rdp_debug_error(b, "RDP touch input is not available\n");
+
 	peersItem->flags |= RDP_PEER_ACTIVATED;
 
+	rdp_link_probe_start(peerCtx);
+
 	if (!settings->HiDefRemoteApp && output) {
 		/* disable pointer on the client side */
 		pointer = client->context->update->pointer;
 		pointer_system.type = SYSPTR_NULL;
 		pointer->PointerSystem(client->context, &pointer_system);
+		/* client draws own pointer, shape goes out at next repaint. */
+		peerCtx->is_desktop_cursor_dirty = true;
 
 		/* sends a full refresh */
 		box.x1 = 0;
@@ -1226,7 +2294,9 @@ xf_peer_activate(freerdp_peer* client)
 		box.y2 = output->base.height;
 		pixman_region32_init_with_extents(&damage, &box);
 
-		rdp_peer_refresh_region(&damage, client);
+		rdp_peer_refresh_region(&damage, client, NULL,
+					b->refine_quality ? RDP_GFX_QUALITY_LOSSLESS :
+							    RDP_GFX_QUALITY_DEFAULT);
 
 		pixman_region32_fini(&damage);
 	}
@@ -1240,6 +2310,7 @@ error_exit:
 		b->audio_out_teardown(peerCtx->audio_out_private);
 	if (settings->AudioCapture && peerCtx->audio_in_private)
 		b->audio_in_teardown(peerCtx->audio_in_private);
+	rdp_encoder_destroy(peerCtx);
 	rdp_rail_peer_context_free(client, peerCtx);
 	rdp_drdynvc_destroy(peerCtx);
 
@@ -1255,6 +2326,7 @@ xf_peer_post_connect(freerdp_peer *client)
 static BOOL
 rdp_translate_and_notify_mouse_position(RdpPeerContext *peerContext, UINT16 x, UINT16 y)
 {
+	struct weston_pointer *pointer;
 	struct timespec time;
 	int sx, sy;
 
@@ -1276,11 +2348,31 @@ rdp_translate_and_notify_mouse_position(RdpPeerContext *peerContext, UINT16 x, U
 	if (to_weston_coordinate(peerContext, &sx, &sy, NULL, NULL)) {
 		weston_compositor_get_time(&time);
 		notify_motion_absolute(peerContext->item.seat, &time, sx, sy);
+		pointer = weston_seat_get_pointer(peerContext->item.seat);
+		if (pointer) {
+			/* client already shows its pointer here. */
+			peerContext->client_pointer_x = pointer->x;
+			peerContext->client_pointer_y = pointer->y;
+		}
 		return TRUE;
 	}
 	return FALSE;
 }
 
+/* Motion held by coalescing must be sent before any event ordered after it. */
+static void
+rdp_flush_pending_motion(RdpPeerContext *peerContext)
+{
+	if (!peerContext->motion_pending)
+		return;
+
+	peerContext->motion_pending = false;
+	if (rdp_translate_and_notify_mouse_position(peerContext,
+						    peerContext->motion_pending_x,
+						    peerContext->motion_pending_y))
+		notify_pointer_frame(peerContext->item.seat);
+}
+
 static void
 dump_mouseinput(RdpPeerContext *peerContext, UINT16 flags, UINT16 x, UINT16 y, bool is_ex)
 {
@@ -1415,6 +2507,15 @@ xf_mouseEvent(rdpInput *input, UINT16 flags, UINT16 x, UINT16 y)
 
 	dump_mouseinput(peerContext, flags, x, y, false);
 
+	/* Only keep the last of consecutive motions, position is absolute. */
+	if (peerContext->rdpBackend->coalesce_mouse_motion && flags == PTR_FLAGS_MOVE) {
+		peerContext->motion_pending = true;
+		peerContext->motion_pending_x = x;
+		peerContext->motion_pending_y = y;
+		return TRUE;
+	}
+	rdp_flush_pending_motion(peerContext);
+
 	/* Per RDP spec, the x,y position is valid on all input mouse messages,
 	 * except for PTR_FLAGS_WHEEL and PTR_FLAGS_HWHEEL event. Take the opportunity
 	 * to resample our x,y position even when PTR_FLAGS_MOVE isn't explicitly set,
@@ -1481,6 +2582,7 @@ xf_extendedMouseEvent(rdpInput *input, UINT16 flags, UINT16 x, UINT16 y)
 	struct timespec time;
 
 	dump_mouseinput(peerContext, flags, x, y, true);
+	rdp_flush_pending_motion(peerContext);
 
 	if (rdp_translate_and_notify_mouse_position(peerContext, x, y))
 		need_frame = true;
@@ -1519,6 +2621,8 @@ xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 	struct weston_output *output;
 	pixman_region32_t damage;
 
+	rdp_flush_pending_motion(peerCtx);
+
 	rdp_debug_verbose(b, "RDP backend: %s ScrLk:%d, NumLk:%d, CapsLk:%d, KanaLk:%d\n",
 		__func__,
 		flags & KBD_SYNC_SCROLL_LOCK ? 1 : 0,
@@ -1552,7 +2656,9 @@ xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 	}
 
 	if (output)
-		rdp_peer_refresh_region(&damage, client);
+		rdp_peer_refresh_region(&damage, client, NULL,
+					b->refine_quality ? RDP_GFX_QUALITY_LOSSLESS :
+							    RDP_GFX_QUALITY_DEFAULT);
 
 	pixman_region32_fini(&damage);
 
@@ -1577,6 +2683,8 @@ xf_input_keyboard_event(rdpInput *input, UINT16 flags, UINT16 code)
 	if (!(peerContext->item.flags & RDP_PEER_ACTIVATED))
 		return TRUE;
 
+	rdp_flush_pending_motion(peerContext);
+
 	if (flags & KBD_FLAGS_DOWN) {
 		keyState = WL_KEYBOARD_KEY_STATE_PRESSED;
 		notify = 1;
@@ -1693,6 +2801,9 @@ xf_suppress_output(rdpContext *context, BYTE allow, const RECTANGLE_16 *area)
 	else
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
 
+	if (context->settings->HiDefRemoteApp)
+		rdp_rail_suppress_output(peerContext, allow, area);
+
 	return TRUE;
 }
 
@@ -1779,6 +2890,37 @@ is_tls_enabled(struct rdp_backend *b)
 	return (b->server_cert && b->server_key) || using_session_tls(b);
 }
 
+/* TCP peers get configured TCP_NODELAY, and are corked while a frame is
+   sent, see rdp_output_batch_begin. */
+static void
+rdp_peer_tune_socket(struct rdp_backend *b, RdpPeerContext *peerCtx, int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	int size = b->socket_buffer_size;
+	int nodelay = b->tcp_nodelay;
+
+	if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+		return;
+
+	if (size > 0) {
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0)
+			rdp_debug_error(b, "%s: failed to set SO_SNDBUF (%s)\n",
+					__func__, strerror(errno));
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+			rdp_debug_error(b, "%s: failed to set SO_RCVBUF (%s)\n",
+					__func__, strerror(errno));
+	}
+
+	if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+		return;
+
+	peerCtx->is_output_tcp = true;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0)
+		rdp_debug_error(b, "%s: failed to set TCP_NODELAY (%s)\n",
+				__func__, strerror(errno));
+}
+
 static int
 rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 {
@@ -1797,6 +2939,7 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 
 	peerCtx = (RdpPeerContext *) client->context;
 	peerCtx->rdpBackend = b;
+	rdp_peer_tune_socket(b, peerCtx, client->sockfd);
 
 	settings = client->context->settings;
 	/* configure security settings */
@@ -1890,6 +3033,9 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	if (!rdp_rail_peer_init(client, peerCtx))
 		goto error_rail_initialize;
 
+	/* if encoder threads can't be created, encode at display loop. */
+	rdp_encoder_create(peerCtx, b->encoder_threads);
+
 	/* This tracks the single peer connected. This field only used for RAIL mode
 	   and, with RAIL mode, there can be only one peer per backend, and that
 	   will be validated at xf_peer_activate once connection mode is reflected
@@ -1934,6 +3080,85 @@ rdp_incoming_peer(freerdp_listener *instance, freerdp_peer *client)
 }
 
 #if HAVE_OPENSSL
+/* Generating RSA key dominates session TLS setup, so key can be kept for
+ * this long in XDG_RUNTIME_DIR. Certificate is still made for each session.
+ */
+#define RDP_SESSION_TLS_KEY_LIFETIME (24 * 60 * 60) /* sec */
+#define RDP_SESSION_TLS_KEY_FILE "weston-rdp-session-key.pem"
+
+static char *
+rdp_session_tls_key_path(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char *path;
+
+	if (!dir || !*dir)
+		return NULL;
+	if (asprintf(&path, "%s/%s", dir, RDP_SESSION_TLS_KEY_FILE) < 0)
+		return NULL;
+	return path;
+}
+
+static EVP_PKEY *
+rdp_load_session_tls_key(struct rdp_backend *b, const char *path)
+{
+	EVP_PKEY *pkey = NULL;
+	struct stat st;
+	FILE *fp;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return NULL;
+
+	/* only trust key only we can access, and rotate it after its lifetime */
+	if (fstat(fd, &st) < 0 ||
+	    !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+	    (st.st_mode & (S_IRWXG | S_IRWXO)) ||
+	    time(NULL) - st.st_mtime > RDP_SESSION_TLS_KEY_LIFETIME) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	fp = fdopen(fd, "r");
+	if (!fp) {
+		close(fd);
+		return NULL;
+	}
+	pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (!pkey)
+		rdp_debug_error(b, "%s: unable to read %s\n", __func__, path);
+
+	return pkey;
+}
+
+static void
+rdp_save_session_tls_key(struct rdp_backend *b, const char *path, const char *pem)
+{
+	char *tmp_path;
+	size_t len = strlen(pem);
+	int fd;
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0)
+		return;
+
+	/* mkstemp creates file with 0600 */
+	fd = mkostemp(tmp_path, O_CLOEXEC);
+	if (fd < 0) {
+		free(tmp_path);
+		return;
+	}
+	if (write(fd, pem, len) != (ssize_t)len || fsync(fd) < 0 ||
+	    rename(tmp_path, path) < 0) {
+		rdp_debug_error(b, "%s: unable to write %s\n", __func__, path);
+		unlink(tmp_path);
+	}
+	close(fd);
+	free(tmp_path);
+}
+
 static void
 rdp_generate_session_tls(struct rdp_backend *b)
 {
@@ -1950,17 +3175,30 @@ rdp_generate_session_tls(struct rdp_backend *b)
 	X509_EXTENSION *ext;
 	const EVP_MD *md;
 	const char session_name[] = "weston";
+	char *key_path = NULL;
+	bool key_cached = false;
+	struct timespec start_time, end_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-	pkey = EVP_PKEY_new();
-	assert(pkey != NULL);
-	rsa_bn = BN_new();
-	assert(rsa_bn != NULL);
-	rsa = RSA_new();
-	assert(rsa != NULL);
-	BN_set_word(rsa_bn, RSA_F4);
-	assert(RSA_generate_key_ex(rsa, 2048, rsa_bn, NULL) == 1);
-	BN_clear_free(rsa_bn);
-	EVP_PKEY_assign_RSA(pkey, rsa);
+	if (b->session_tls_cache)
+		key_path = rdp_session_tls_key_path();
+
+	pkey = key_path ? rdp_load_session_tls_key(b, key_path) : NULL;
+	if (pkey) {
+		key_cached = true;
+	} else {
+		pkey = EVP_PKEY_new();
+		assert(pkey != NULL);
+		rsa_bn = BN_new();
+		assert(rsa_bn != NULL);
+		rsa = RSA_new();
+		assert(rsa != NULL);
+		BN_set_word(rsa_bn, RSA_F4);
+		assert(RSA_generate_key_ex(rsa, 2048, rsa_bn, NULL) == 1);
+		BN_clear_free(rsa_bn);
+		EVP_PKEY_assign_RSA(pkey, rsa);
+	}
 
 	bio = BIO_new(BIO_s_mem());
 	assert(bio != NULL);
@@ -1970,6 +3208,10 @@ rdp_generate_session_tls(struct rdp_backend *b)
 	memcpy(b->server_key_content, mem->data, mem->length);
 	BIO_free_all(bio);
 
+	if (key_path && !key_cached)
+		rdp_save_session_tls_key(b, key_path, b->server_key_content);
+	free(key_path);
+
 	x509 = X509_new();
 	X509_set_version(x509, 2);
 	RAND_bytes((unsigned char *)&serial, sizeof(serial));
@@ -2002,6 +3244,11 @@ rdp_generate_session_tls(struct rdp_backend *b)
 
 	X509_free(x509);
 	EVP_PKEY_free(pkey);
+
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	rdp_debug(b, "RDP backend: session TLS generated in %" PRId64 " msec (key %s)\n",
+		  timespec_sub_to_msec(&end_time, &start_time),
+		  key_cached ? "cached" : "generated");
 }
 #endif
 
@@ -2011,7 +3258,7 @@ static const struct weston_rdp_output_api api = {
 	rdp_output_get_primary,
 };
 
-static int create_vsock_fd(int port)
+static int create_vsock_fd(int port, int bufferSize)
 {
 	struct sockaddr_vm socket_address;
 
@@ -2022,8 +3269,6 @@ static int create_vsock_fd(int port)
 		return -1;
 	}
 
-	const int bufferSize = 65536;
-
 	if (setsockopt(socket_fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize)) < 0) {
 		weston_log("Fail to setsockopt SO_SNDBUF");
 		return -1;
@@ -2058,7 +3303,8 @@ static int create_vsock_fd(int port)
 	return socket_fd;
 }
 
-static int use_vsock_fd(int port)
+/* vsock buffers default to 64KB, accepted sockets inherit them. */
+static int use_vsock_fd(int port, int bufferSize)
 {
 	char *fd_str = getenv("USE_VSOCK");
 	if (!fd_str) {
@@ -2073,7 +3319,7 @@ static int use_vsock_fd(int port)
 			fd = -1;
 		}
 	} else {
-		fd = create_vsock_fd(port);
+		fd = create_vsock_fd(port, bufferSize);
 		weston_log("Created vsock for external connections: %d\n", fd);
 	}
 
@@ -2102,8 +3348,11 @@ rdp_backend_create(struct weston_compositor *compositor,
 		return NULL;
 
 	b->compositor_tid = rdp_get_tid();
+	/* write syscalls per frame are counted when /proc is available. */
+	b->thread_io_fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
 	b->compositor = compositor;
 	b->base.destroy = rdp_destroy;
+	b->base.repaint_begin = rdp_repaint_begin;
 	b->base.create_output = rdp_output_create;
 	b->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 	b->server_cert = config->server_cert ? strdup(config->server_cert) : NULL;
@@ -2112,6 +3361,7 @@ rdp_backend_create(struct weston_compositor *compositor,
 	b->force_no_compression = config->force_no_compression;
 	b->redirect_clipboard = config->redirect_clipboard;
 	b->rdp_monitor_refresh_rate = config->rdp_monitor_refresh_rate * 1000;
+	rdp_parse_monitor_refresh_rates(b, config->monitor_refresh_rates);
 	b->audio_in_setup = config->audio_in_setup;
 	b->audio_in_teardown = config->audio_in_teardown;
 	b->audio_out_setup = config->audio_out_setup;
@@ -2124,7 +3374,8 @@ rdp_backend_create(struct weston_compositor *compositor,
 	b->debug = weston_log_ctx_add_log_scope(compositor->weston_log_ctx,
 						   "rdp-backend",
 						   "Debug messages from RDP backend\n",
-						    NULL, NULL, NULL);
+						    rdp_debug_subscribe,
+						    rdp_debug_unsubscribe, b);
 	if (b->debug) {
 		s = getenv("WESTON_RDP_DEBUG_LEVEL");
 		if (s) {
@@ -2135,6 +3386,7 @@ rdp_backend_create(struct weston_compositor *compositor,
 		} else {
 			b->debugLevel = RDP_DEBUG_LEVEL_DEFAULT;
 		}
+		rdp_debug_update_level(b);
 	}
 	rdp_debug(b, "RDP backend: WESTON_RDP_DEBUG_LEVEL: %d\n", b->debugLevel);
 	/* After here, rdp_debug() is ready to be used */
@@ -2142,7 +3394,8 @@ rdp_backend_create(struct weston_compositor *compositor,
 	b->debugClipboard = weston_log_ctx_add_log_scope(b->compositor->weston_log_ctx,
 							 "rdp-backend-clipboard",
 							 "Debug messages from RDP backend clipboard\n",
-							  NULL, NULL, NULL);
+							  rdp_debug_clipboard_subscribe,
+							  rdp_debug_clipboard_unsubscribe, b);
 	if (b->debugClipboard) {
 		s = getenv("WESTON_RDP_DEBUG_CLIPBOARD_LEVEL");
 		if (s) {
@@ -2155,10 +3408,75 @@ rdp_backend_create(struct weston_compositor *compositor,
 			   log with verbose mode to assist debugging */
 			b->debugClipboardLevel = RDP_DEBUG_LEVEL_VERBOSE; // RDP_DEBUG_CLIPBOARD_LEVEL_DEFAULT;
 		}
+		rdp_debug_update_level(b);
 	}
 	rdp_debug_clipboard(b, "RDP backend: WESTON_RDP_DEBUG_CLIPBOARD_LEVEL: %d\n", b->debugClipboardLevel);
 
 	rdp_debug(b, "RDP backend: rdp_monitor_refresh_rate: %d\n", b->rdp_monitor_refresh_rate);
+	for (int i = 0; i < RDP_MAX_MONITOR; i++) {
+		if (b->monitor_refresh_rates[i])
+			rdp_debug(b, "RDP backend: monitor %d refresh rate: %d\n",
+				  i, b->monitor_refresh_rates[i]);
+	}
+
+	s = getenv("WESTON_RDP_TRACE_FILE");
+	if (s)
+		rdp_trace_open(b, s);
+
+	b->encoder_threads = config->encoder_threads;
+	if (b->encoder_threads < 0) {
+		/* leave half of CPUs to compositor and clients */
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		b->encoder_threads = cpus > 1 ? MIN(cpus / 2, 4) : 0;
+	}
+	rdp_debug(b, "RDP backend: encoder_threads: %d\n", b->encoder_threads);
+
+	b->render_threads = config->render_threads;
+	if (b->render_threads < 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		b->render_threads = cpus > 1 ? MIN(cpus / 2, 4) : 0;
+	}
+	rdp_debug(b, "RDP backend: render_threads: %d\n", b->render_threads);
+
+	b->damage_max_rects = config->damage_max_rects;
+	b->damage_rect_cost = MAX(config->damage_rect_cost, 0);
+	rdp_debug(b, "RDP backend: damage_max_rects: %d, damage_rect_cost: %d\n",
+		  b->damage_max_rects, b->damage_rect_cost);
+
+	b->shared_encoding = config->shared_encoding;
+	rdp_debug(b, "RDP backend: shared_encoding: %d\n", b->shared_encoding);
+
+	b->coalesce_mouse_motion = config->coalesce_mouse_motion;
+	rdp_debug(b, "RDP backend: coalesce_mouse_motion: %d\n", b->coalesce_mouse_motion);
+
+	b->session_tls_cache = config->session_tls_cache;
+	rdp_debug(b, "RDP backend: session_tls_cache: %d\n", b->session_tls_cache);
+
+	b->redirect_touch = config->redirect_touch;
+	rdp_debug(b, "RDP backend: redirect_touch: %d\n", b->redirect_touch);
+
+	b->refine_quality = config->refine_quality;
+	rdp_debug(b, "RDP backend: refine_quality: %d\n", b->refine_quality);
+
+	b->network_autodetect = config->network_autodetect;
+	rdp_debug(b, "RDP backend: network_autodetect: %d\n", b->network_autodetect);
+
+	b->loop_channels = config->loop_channels;
+	rdp_debug(b, "RDP backend: loop_channels: %d\n", b->loop_channels);
+
+	b->socket_buffer_size = config->socket_buffer_size;
+	rdp_debug(b, "RDP backend: socket_buffer_size: %d\n", b->socket_buffer_size);
+
+	b->tcp_nodelay = config->tcp_nodelay;
+	rdp_debug(b, "RDP backend: tcp_nodelay: %d\n", b->tcp_nodelay);
+
+	b->cork_frames = config->cork_frames;
+	rdp_debug(b, "RDP backend: cork_frames: %d\n", b->cork_frames);
+
+	b->client_cursor = config->client_cursor;
+	rdp_debug(b, "RDP backend: client_cursor: %d\n", b->client_cursor);
 
 	clock_getres(CLOCK_MONOTONIC, &ts);
 	rdp_debug(b, "RDP backend: timer resolution tv_sec:%ld tv_nsec:%ld\n", (intmax_t)ts.tv_sec, ts.tv_nsec);
@@ -2181,7 +3499,8 @@ rdp_backend_create(struct weston_compositor *compositor,
 
 	compositor->backend = &b->base;
 
-	fd = use_vsock_fd(config->port);
+	fd = use_vsock_fd(config->port, config->socket_buffer_size > 0 ?
+					config->socket_buffer_size : 65536);
 	/* if we are using VSOCK to connect to the rdp backend, we don't need to enforce the TLS
 	   encryption, since FreeRDP will consider AF_UNIX and AF_VSOCK as a local connection */
 	if (fd <= 0 || config->env_socket)
@@ -2260,6 +3579,17 @@ rdp_backend_create(struct weston_compositor *compositor,
 		goto err_output;
 	}
 
+	weston_plane_init(&b->cursor_plane, compositor, 0, 0);
+	weston_compositor_stack_plane(compositor, &b->cursor_plane,
+				      &compositor->primary_plane);
+
+	b->memory_report_listener.notify = rdp_memory_report;
+	wl_signal_add(&compositor->memory_report_signal,
+		      &b->memory_report_listener);
+	b->memory_trim_listener.notify = rdp_memory_trim;
+	wl_signal_add(&compositor->memory_trim_signal,
+		      &b->memory_trim_listener);
+
 	return b;
 
 err_listener:
@@ -2273,6 +3603,9 @@ err_compositor:
 
 	weston_compositor_shutdown(compositor);
 err_free_strings:
+	rdp_trace_close(b);
+	if (b->thread_io_fd >= 0)
+		close(b->thread_io_fd);
 	if (b->debugClipboard)
 		weston_log_scope_destroy(b->debugClipboard);
 	if (b->debug)
@@ -2299,6 +3632,7 @@ config_init_to_defaults(struct weston_rdp_backend_config *config)
 	config->force_no_compression = 0;
 	config->redirect_clipboard = false;
 	config->rdp_monitor_refresh_rate = WESTON_RDP_MODE_FREQ;
+	config->monitor_refresh_rates = NULL;
 	config->rail_config.use_rdpapplist = false;
 	config->rail_config.use_shared_memory = false;
 	config->rail_config.enable_hi_dpi_support = false;
@@ -2311,6 +3645,36 @@ config_init_to_defaults(struct weston_rdp_backend_config *config)
 	config->rail_config.enable_distro_name_title = false;
 	config->rail_config.enable_copy_warning_title = false;
 	config->rail_config.enable_display_power_by_screenupdate = false;
+	config->rail_config.gfx_codec = WESTON_RDP_GFX_CODEC_AUTO;
+	config->rail_config.gfx_codec_progressive_min_area =
+		WESTON_RDP_GFX_CODEC_PROGRESSIVE_MIN_AREA;
+	config->rail_config.enable_gfx_avc = true;
+	config->rail_config.gfx_avc_min_area = WESTON_RDP_GFX_AVC_MIN_AREA;
+	config->rail_config.enable_gfx_scroll = false;
+	config->rail_config.enable_gfx_cache = false;
+	config->rail_config.enable_gfx_downscale = false;
+	config->rail_config.enable_frame_pacing = false;
+	config->rail_config.enable_shm_direct_copy = false;
+	config->rail_config.preview_refresh_interval = 0;
+	config->rail_config.enable_gfx_classify = false;
+	config->rail_config.gfx_content_overrides = NULL;
+	config->rail_config.reconnect_grace_sec = 0;
+	config->rail_config.enable_subsurface_flattening = false;
+	config->encoder_threads = WESTON_RDP_ENCODER_THREADS_AUTO;
+	config->render_threads = 0;
+	config->damage_max_rects = WESTON_RDP_DAMAGE_MAX_RECTS;
+	config->damage_rect_cost = WESTON_RDP_DAMAGE_RECT_COST;
+	config->shared_encoding = false;
+	config->coalesce_mouse_motion = false;
+	config->session_tls_cache = false;
+	config->redirect_touch = false;
+	config->refine_quality = false;
+	config->network_autodetect = false;
+	config->loop_channels = false;
+	config->socket_buffer_size = 0;
+	config->tcp_nodelay = true;
+	config->cork_frames = false;
+	config->client_cursor = false;
 	config->audio_in_setup = NULL;
 	config->audio_in_teardown = NULL;
 	config->audio_out_setup = NULL;
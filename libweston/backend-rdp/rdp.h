@@ -35,6 +35,9 @@
 #include <freerdp/codec/color.h>
 #include <freerdp/codec/rfx.h>
 #include <freerdp/codec/nsc.h>
+#include <freerdp/codec/planar.h>
+#include <freerdp/codec/h264.h>
+#include <freerdp/codec/progressive.h>
 #include <freerdp/locale/keyboard.h>
 #include <freerdp/server/rail.h>
 #include <freerdp/server/drdynvc.h>
@@ -43,6 +46,7 @@
 #include <freerdp/server/rdpsnd.h>
 #include <freerdp/server/audin.h>
 #include <freerdp/server/cliprdr.h>
+#include <freerdp/server/rdpei.h>
 #ifdef HAVE_FREERDP_GFXREDIR_H
 #include <freerdp/server/gfxredir.h>
 #endif // HAVE_FREERDP_GFXREDIR_H
@@ -56,7 +60,7 @@
 #include <libweston/backend-rdp.h>
 #include <libweston/weston-log.h>
 
-#include "hash.h"
+#include "shared/hash.h"
 #include "backend.h"
 
 #include "shared/helpers.h"
@@ -65,12 +69,17 @@
 
 #define MAX_FREERDP_FDS 32
 #define RDP_MAX_MONITOR 16 // RDP max monitors.
+#define RDP_TOUCH_MAX_CONTACTS 256 // RDPEI contactId is a single byte.
 
 #define DEFAULT_PIXEL_FORMAT PIXEL_FORMAT_BGRA32
 
 struct rdp_output;
 struct rdp_clipboard_data_source;
 struct rdp_backend;
+struct rdp_encoder;
+
+/* id range up to this size tracks used ids in bitmap. */
+#define RDP_ID_MANAGER_BITMAP_MAX_IDS 0x10000
 
 struct rdp_id_manager {
 	struct rdp_backend *rdp_backend;
@@ -79,11 +88,122 @@ struct rdp_id_manager {
 	UINT32 id_high_limit;
 	UINT32 id_total;
 	UINT32 id_used;
+	/* until ids wrap around, next id is never used, so no need to check. */
+	bool id_wrapped;
+	UINT64 *id_bitmap; /* NULL for large range */
+	UINT64 id_allocated; /* stats */
+	UINT64 id_probes;
+	UINT32 id_max_probes;
 	pthread_mutex_t mutex;
 	pid_t mutex_tid;
 	struct hash_table *hash_table;
 };
 
+/* RDPGFX encoder contexts, these are not thread safe,
+   thus each encoder thread owns its own. */
+struct rdp_gfx_codec_context {
+	PROGRESSIVE_CONTEXT *progressive_context;
+	BITMAP_PLANAR_CONTEXT *planar_context;
+	uint32_t planar_context_width;
+	uint32_t planar_context_height;
+	/* desktop refresh, see rdp_peer_refresh_rfx and rdp_peer_refresh_nsc. */
+	RFX_CONTEXT *rfx_context;
+	uint32_t rfx_generation;
+	NSC_CONTEXT *nsc_context;
+};
+
+/* RDPGFX bitmap cache is filled by fixed size tiles aligned to surface. */
+#define RDP_GFX_CACHE_TILE_SIZE 64
+
+/* tiles of damage whose content didn't change since sent are dropped,
+   see rdp_tile_hashes_filter. */
+#define RDP_TILE_HASH_SIZE 64
+
+struct rdp_gfx_cache_entry {
+	uint64_t key; /* content hash of tile */
+	uint16_t slot;
+	uint32_t generation; /* update which added this entry */
+	struct wl_list link; /* rdp_gfx_cache::lru */
+};
+
+/* Server side view of client's bitmap cache, only used at display loop. */
+struct rdp_gfx_cache {
+	struct hash_table *table; /* folded key to rdp_gfx_cache_entry */
+	struct rdp_gfx_cache_entry *entries; /* indexed by slot - 1 */
+	uint32_t numSlots;
+	uint32_t numUsed;
+	uint32_t generation;
+	struct wl_list lru; /* most recently used first */
+};
+
+/* Server side view of a small client cache indexed by slot, such as
+   pointer cache (25 slots for mstsc) or RAIL icon cache (at most 3 caches
+   of 12 entries). Client advertises its size in capabilities. */
+#define RDP_SLOT_CACHE_MAX_SLOTS 64
+
+struct rdp_slot_cache_entry {
+	uint64_t key; /* content hash */
+	uint32_t lastUsed;
+};
+
+struct rdp_slot_cache {
+	uint32_t numSlots;
+	uint32_t numUsed;
+	uint32_t useCount;
+	struct rdp_slot_cache_entry entries[RDP_SLOT_CACHE_MAX_SLOTS];
+};
+
+/* RDPGFX frames in flight and repaint interval, adapted from frame
+   acknowledgements. Only used at display loop. */
+#define RDP_FRAME_PACER_HISTORY 32
+
+struct rdp_frame_pacer_frame {
+	uint32_t frameId;
+	struct timespec sent; /* CLOCK_MONOTONIC, zero once acked */
+};
+
+struct rdp_frame_pacer {
+	bool enabled;
+	int window; /* frames allowed in flight */
+	int acksInWindow; /* acks since window was last grown */
+	uint32_t lastSentFrameId;
+	uint32_t recoveryFrameId; /* window is not shrunk again until this is acked */
+	uint32_t queueDepth; /* last reported by client */
+	int64_t srttUsec; /* smoothed ack latency */
+	int64_t minRttUsec; /* base ack latency */
+	bool isRepaintDeferred; /* repaint was skipped as window was full */
+	int linkWindow; /* 0, or frames in flight the link carries */
+	int linkIntervalMsec; /* 0, or time to send one frame over the link */
+	struct rdp_frame_pacer_frame frames[RDP_FRAME_PACER_HISTORY];
+};
+
+/* Link capacity of peer, measured by RDP network auto-detect requests
+   every RDP_LINK_PROBE_INTERVAL_MSEC, see rdp_link_probe_timer_func.
+   Only updated at display loop. */
+#define RDP_LINK_PROBE_INTERVAL_MSEC 1000
+
+struct rdp_link_estimate {
+	uint16_t sequenceNumber; /* of last request */
+	uint16_t rttSequenceNumber; /* of outstanding RTT request, if any */
+	struct timespec rttRequestTime; /* CLOCK_MONOTONIC */
+	bool isBandwidthProbing; /* between bandwidth measure start and stop */
+	int probeCount;
+	int64_t rttUsec; /* smoothed, 0 until measured */
+	uint32_t bandwidthKbps; /* smoothed, 0 until measured */
+	uint32_t framesSent; /* since last probe */
+	uint64_t bytesSent; /* transport bytes sent, at last probe */
+	uint64_t frameBytes; /* smoothed bytes sent per frame */
+};
+
+#ifdef HAVE_FREERDP_GFXREDIR_H
+/* gfxredir shared memory pool, opened once at client and recycled. */
+struct rdp_shared_memory_section {
+	struct weston_rdp_shared_memory shared_memory;
+	uint32_t pool_id;
+	struct wl_list link; /* RdpPeerContext::shared_memory_idle_list */
+};
+#endif /* HAVE_FREERDP_GFXREDIR_H */
+
 struct rdp_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -94,8 +214,20 @@ struct rdp_backend {
 	uint32_t head_index;
 	struct weston_log_scope *debug;
 	uint32_t debugLevel;
+	uint32_t debugLevelActive;
+	uint32_t debugSubscriptions;
 	struct weston_log_scope *debugClipboard;
 	uint32_t debugClipboardLevel;
+	uint32_t debugClipboardLevelActive;
+	uint32_t debugClipboardSubscriptions;
+	FILE *trace; /* WESTON_RDP_TRACE_FILE, see rdptrace.h */
+
+	/* tiles of updates hashed and found unchanged, and updates dropped
+	   entirely, see rdp_tile_hashes_account */
+	uint64_t tileHashChecked;
+	uint64_t tileHashUnchanged;
+	uint64_t tileHashReported;
+	uint32_t tileHashDroppedUpdates;
 
 	struct wl_list peers;
 
@@ -125,6 +257,8 @@ struct rdp_backend {
 	struct weston_binding *debug_binding_W;
 
 	struct wl_listener create_window_listener;
+	struct wl_listener memory_report_listener;
+	struct wl_listener memory_trim_listener;
 
 	bool enable_window_zorder_sync;
 	bool enable_window_snap_arrange;
@@ -138,6 +272,55 @@ struct rdp_backend {
 	uint32_t debug_desktop_scaling_factor; /* must be between 100 to 500 */
 
 	int rdp_monitor_refresh_rate;
+	int monitor_refresh_rates[RDP_MAX_MONITOR]; /* mHz by client monitor, 0 if not set */
+
+	int gfx_codec; /* enum weston_rdp_gfx_codec */
+	int gfx_codec_progressive_min_area;
+	bool enable_gfx_avc;
+	int gfx_avc_min_area;
+	bool enable_gfx_scroll;
+	bool enable_gfx_cache;
+	bool enable_gfx_downscale;
+	bool enable_frame_pacing;
+	bool enable_shm_direct_copy;
+	int preview_refresh_interval;
+	bool enable_gfx_classify;
+	char *gfx_content_overrides;
+	int reconnect_grace_sec;
+	/* windows of the disconnected client until it reconnects or
+	   reconnect_grace_timer fires, see rdp_rail_park_window() */
+	struct wl_list parked_window_list; /* weston_surface_rail_state::parked_link */
+	struct wl_event_source *reconnect_grace_timer;
+	bool enable_subsurface_flattening;
+	int encoder_threads;
+	int render_threads;
+	int damage_max_rects;
+	int damage_rect_cost;
+	bool shared_encoding;
+	bool coalesce_mouse_motion;
+	bool session_tls_cache;
+	bool redirect_touch;
+	bool refine_quality;
+	bool network_autodetect;
+	bool loop_channels;
+	int socket_buffer_size;
+	bool tcp_nodelay;
+	bool cork_frames;
+	bool client_cursor;
+	/* pointer sprites of peers' seats in full desktop mode, drawn by
+	   each client rather than composited, see rdp_output_assign_planes. */
+	struct weston_plane cursor_plane;
+
+	/* output of all peers is batched while frames are composed and sent,
+	   see rdp_output_batch_begin. */
+	int output_batch_depth;
+	int thread_io_fd; /* /proc/thread-self/io of display loop, or -1 */
+	int64_t output_writes_at_begin;
+	uint64_t output_frames; /* frames sent, to any peer */
+	uint64_t output_bytes; /* transport bytes sent, to any peer */
+	uint64_t output_writes; /* write syscalls of display loop in batches */
+	uint64_t output_batches;
+	uint64_t output_frames_reported;
 
 	struct weston_surface *proxy_surface;
 
@@ -179,6 +362,7 @@ struct rdp_head {
 	struct weston_head base;
 	uint32_t index;
 	bool matched;
+	int refresh; /* mHz, of client monitor */
 	rdpMonitor config;
 	/*TODO: these region/rectangles can be moved to rdp_output */
 	pixman_rectangle32_t workareaClient; // in client coordinate.
@@ -190,6 +374,17 @@ struct rdp_output {
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
 	uint32_t index;
+	/* RAIL frame sent at last repaint, which completes the repaint once
+	   client acknowledges it, finish_frame_timer is the fallback. */
+	bool is_frame_ack_pending;
+	uint32_t frame_ack_id;
+	/* shadow surface as sent to peers */
+	struct weston_rdp_tile_hashes tileHashes;
+	/* sent coarse to NSCodec peers while in motion, see rdp_output_refine */
+	pixman_region32_t refineRegion;
+	uint32_t refine_motion_count;
+	struct timespec refine_last_update_time;
+	struct wl_event_source *refine_timer;
 
 	struct wl_list link; // rdp_backend::output_list
 };
@@ -205,26 +400,59 @@ struct rdp_peer_context {
 
 	struct rdp_backend *rdpBackend;
 	struct wl_event_source *events[MAX_FREERDP_FDS+1]; // +1 for WTSVirtualChannelManagerGetFileDescriptor
-	RFX_CONTEXT *rfx_context;
-	wStream *encode_stream;
-	RFX_RECT *rfx_rects;
-	NSC_CONTEXT *nsc_context;
+	/* bumped as client resets its decoder, RemoteFX contexts are reset
+	   by refresh of new generation, see rdp_peer_refresh_get_rfx. */
+	uint32_t refresh_generation;
+	struct weston_rdp_staging_buffer raw_staging; /* rdp_peer_refresh_raw */
+	/* damage held while client can't keep up, sent at once when it does. */
+	pixman_region32_t pending_damage;
+	/* peer has had own refresh since activation, which sends codec
+	   headers, so it can take refresh encoded for other peers. */
+	bool shared_refresh_ready;
 
 	struct rdp_peers_item item;
 
 	bool button_state[5];
 	bool mouseButtonSwap;
+	/* last motion not yet notified, see coalesce_mouse_motion */
+	bool motion_pending;
+	UINT16 motion_pending_x;
+	UINT16 motion_pending_y;
 	int verticalAccumWheelRotationPrecise;
 	int verticalAccumWheelRotationDiscrete;
 	int horizontalAccumWheelRotationPrecise;
 	int horizontalAccumWheelRotationDiscrete;
 
+	// Touch support, see rdptouch.c
+	RdpeiServerContext *rdpei_server_context;
+	struct wl_event_source *rdpei_event_source;
+	struct weston_touch_device *touch_device;
+	uint32_t touch_contacts[RDP_TOUCH_MAX_CONTACTS / 32]; /* contacts down */
+
 	// RAIL support
 	HANDLE vcm;
 	RailServerContext *rail_server_context;
 	DrdynvcServerContext *drdynvc_server_context;
 	DispServerContext *disp_server_context;
+	struct wl_event_source *layout_change_timer;
+	struct disp_schedule_monitor_layout_change_data *pending_layout_change;
+	struct wl_event_source *shadow_refresh_timer;
+	bool is_shadow_refresh_armed;
+	struct wl_event_source *refine_timer;
+	bool is_refine_armed;
+	struct wl_event_source *preview_refresh_timer;
+	bool is_preview_refresh_armed;
+	/* window encoding state is released once no content is sent for
+	   a while, see rdp_rail_release_idle_windows(). */
+	struct wl_event_source *idle_release_timer;
+	bool is_idle_release_armed;
+	struct timespec last_content_time; /* CLOCK_MONOTONIC */
+	/* windows restored at reconnect are not updated until client
+	   offered its persistent cache, or cache_import_timer fires. */
+	bool isCacheImportPending;
+	struct wl_event_source *cache_import_timer;
 	RdpgfxServerContext *rail_grfx_server_context;
+	struct wl_event_source *rail_grfx_event_source; /* loop_channels only */
 #ifdef HAVE_FREERDP_GFXREDIR_H
 	GfxRedirServerContext *gfxredir_server_context;
 #endif // HAVE_FREERDP_GFXREDIR_H
@@ -241,25 +469,78 @@ struct rdp_peer_context {
 #ifdef HAVE_FREERDP_GFXREDIR_H
 	struct rdp_id_manager poolId;
 	struct rdp_id_manager bufferId;
+	struct wl_list shared_memory_idle_list; /* rdp_shared_memory_section::link */
+	uint32_t shared_memory_idle_count;
+	size_t shared_memory_idle_size;
 #endif // HAVE_FREERDP_GFXREDIR_H
+	/* RDPGFX codec support (negotiated caps and encoder contexts) */
+	uint32_t gfxCapsVersion;
+	uint32_t gfxCapsFlags;
+	struct rdp_gfx_codec_context gfx_codec_context; /* for compositor thread */
+	bool avc_unavailable; /* H.264 encoder is not available in FreeRDP */
+	struct rdp_gfx_cache gfx_cache;
+	struct rdp_slot_cache cursor_cache;
+	struct rdp_slot_cache icon_cache;
+
 	uint32_t currentFrameId;
 	uint32_t acknowledgedFrameId;
 	bool isAcknowledgedSuspended;
+	struct rdp_frame_pacer frame_pacer;
+	struct rdp_link_estimate link;
+	struct wl_event_source *link_probe_timer;
+	bool is_output_tcp; /* socket is corked by rdp_output_batch_begin */
+	uint64_t output_bytes_last; /* transport bytes sent, at last batch end */
 	struct wl_client *clientExec;
 	struct wl_listener clientExec_destroy_listener;
 	struct weston_surface *cursorSurface;
-
-	// list of outstanding event_source sent from FreeRDP thread to display loop.
+	/* pointer of own seat in full desktop mode, see rdp_peer_update_cursor. */
+	struct weston_surface *desktop_cursor;
+	struct wl_listener desktop_cursor_commit_listener;
+	struct wl_listener desktop_cursor_destroy_listener;
+	bool is_desktop_cursor_dirty;
+	int32_t desktop_cursor_hotspot_x;
+	int32_t desktop_cursor_hotspot_y;
+	/* pointer position last set by client input, in weston space */
+	wl_fixed_t client_pointer_x;
+	wl_fixed_t client_pointer_y;
+
+	// outstanding tasks sent from FreeRDP thread to display loop.
 	int loop_task_event_source_fd;
 	struct wl_event_source *loop_task_event_source;
-	pthread_mutex_t loop_task_list_mutex;
-	struct wl_list loop_task_list; // struct rdp_loop_task::link
+	// lock-free stack pushed by FreeRDP threads, newest first, drained
+	// at once by display loop. Accessed only with atomic builtins.
+	struct rdp_loop_task *loop_task_stack;
+	uint32_t loop_task_depth; // tasks queued, updated atomically
+	// statistics, only used at display loop.
+	uint32_t loop_task_depth_max;
+	uint64_t loop_task_wakeups;
+	uint64_t loop_task_dispatched;
+	uint64_t loop_task_latency_usec_total;
+	uint64_t loop_task_latency_usec_max;
+
+	// encoder threads, NULL when encoding is done at display loop.
+	struct rdp_encoder *encoder;
 
 	// RAIL power management.
 	struct wl_listener idle_listener;
 	struct wl_listener wake_listener;
 
 	bool is_window_zorder_dirty;
+	/* window orders of a repaint go out in one update, see
+	   rdp_rail_window_orders_begin(). */
+	bool is_window_orders_batched;
+	bool is_window_orders_open;
+	/* desktop area the client lets through SuppressOutput, in client
+	   coordinates, RAIL windows outside of it are not updated. */
+	bool is_output_area_set;
+	pixman_box32_t output_area;
+	struct wl_list dirty_window_list; /* weston_surface_rail_state::dirty_link */
+	/* window z order last sent to client, and scratch to build next one,
+	   swapped when sent. */
+	uint32_t *window_zorder;
+	uint32_t *window_zorder_next;
+	uint32_t window_zorder_count;
+	uint32_t window_zorder_capacity;
 
 	// Multiple monitor support (monitor topology)
 	int32_t desktop_top, desktop_left, desktop_width, desktop_height;
@@ -269,6 +550,7 @@ struct rdp_peer_context {
 
 	// Clipboard support
 	CliprdrServerContext* clipboard_server_context;
+	struct wl_event_source *clipboard_event_source; /* loop_channels only */
 
 	struct rdp_clipboard_data_source* clipboard_client_data_source;
 	struct rdp_clipboard_data_source* clipboard_inflight_client_data_source;
@@ -284,9 +566,27 @@ typedef struct rdp_peer_context RdpPeerContext;
 typedef void (*rdp_loop_task_func_t)(bool freeOnly, void *data);
 
 struct rdp_loop_task {
-	struct wl_list link;
+	struct rdp_loop_task *next; // RdpPeerContext::loop_task_stack
 	RdpPeerContext *peerCtx;
 	rdp_loop_task_func_t func;
+	struct timespec queued; // for dispatch latency
+};
+
+struct rdp_encoder_job;
+
+/* encode is called at encoder thread (or display loop when no encoder
+   thread), and done is called at display loop in the order of submission. */
+typedef void (*rdp_encoder_encode_func_t)(struct rdp_encoder_job *job,
+					  struct rdp_gfx_codec_context *codec);
+typedef void (*rdp_encoder_done_func_t)(bool freeOnly, struct rdp_encoder_job *job);
+
+struct rdp_encoder_job {
+	struct wl_list link; // rdp_encoder::job_list
+	struct wl_list queue_link; // rdp_encoder::queue_list
+	RdpPeerContext *peerCtx;
+	rdp_encoder_encode_func_t encode;
+	rdp_encoder_done_func_t done;
+	bool isEncoded;
 };
 
 #define RDP_RAIL_MARKER_WINDOW_ID  0xFFFFFFFE
@@ -299,40 +599,64 @@ struct rdp_loop_task {
 #define RDP_DEBUG_LEVEL_DEBUG   4
 #define RDP_DEBUG_LEVEL_VERBOSE 5
 
+/* Messages above this level are compiled out, see the rdp-debug-level-max
+ * build option. */
+#ifndef RDP_DEBUG_LEVEL_MAX
+#define RDP_DEBUG_LEVEL_MAX RDP_DEBUG_LEVEL_VERBOSE
+#endif
+
+/* debugLevelActive is debugLevel while the scope has subscribers and
+ * RDP_DEBUG_LEVEL_NONE otherwise, so a message which is not going to be
+ * written costs a single branch, without evaluating its arguments. */
+#define rdp_debug_enabled(b, level) \
+	((level) <= RDP_DEBUG_LEVEL_MAX && (b)->debugLevelActive >= (level))
+#define rdp_debug_clipboard_enabled(b, level) \
+	((level) <= RDP_DEBUG_LEVEL_MAX && \
+	 (b)->debugClipboardLevelActive >= (level))
+
 /* To enable rdp_debug message, add "--logger-scopes=rdp-backend". */
 #define RDP_DEBUG_LEVEL_DEFAULT RDP_DEBUG_LEVEL_INFO
 
-#define rdp_debug_verbose(b, ...) \
-	if (b->debugLevel >= RDP_DEBUG_LEVEL_VERBOSE) \
-		rdp_debug_print(b->debug, false, __VA_ARGS__)
-#define rdp_debug_verbose_continue(b, ...) \
-	if (b->debugLevel >= RDP_DEBUG_LEVEL_VERBOSE) \
-		rdp_debug_print(b->debug, true,  __VA_ARGS__)
-#define rdp_debug(b, ...) \
-	if (b->debugLevel >= RDP_DEBUG_LEVEL_INFO) \
-		rdp_debug_print(b->debug, false, __VA_ARGS__)
-#define rdp_debug_continue(b, ...) \
-	if (b->debugLevel >= RDP_DEBUG_LEVEL_INFO) \
-		rdp_debug_print(b->debug, true,  __VA_ARGS__)
-#define rdp_debug_error(b, ...) \
-	if (b->debugLevel >= RDP_DEBUG_LEVEL_ERR) \
-		rdp_debug_print(b->debug, false, __VA_ARGS__)
+#define rdp_debug_verbose(b, ...) do { \
+	if (rdp_debug_enabled(b, RDP_DEBUG_LEVEL_VERBOSE)) \
+		rdp_debug_print((b)->debug, false, __VA_ARGS__); \
+} while (0)
+#define rdp_debug_verbose_continue(b, ...) do { \
+	if (rdp_debug_enabled(b, RDP_DEBUG_LEVEL_VERBOSE)) \
+		rdp_debug_print((b)->debug, true,  __VA_ARGS__); \
+} while (0)
+#define rdp_debug(b, ...) do { \
+	if (rdp_debug_enabled(b, RDP_DEBUG_LEVEL_INFO)) \
+		rdp_debug_print((b)->debug, false, __VA_ARGS__); \
+} while (0)
+#define rdp_debug_continue(b, ...) do { \
+	if (rdp_debug_enabled(b, RDP_DEBUG_LEVEL_INFO)) \
+		rdp_debug_print((b)->debug, true,  __VA_ARGS__); \
+} while (0)
+#define rdp_debug_error(b, ...) do { \
+	if (rdp_debug_enabled(b, RDP_DEBUG_LEVEL_ERR)) \
+		rdp_debug_print((b)->debug, false, __VA_ARGS__); \
+} while (0)
 
 /* To enable rdp_debug_clipboard message, add "--logger-scopes=rdp-backend-clipboard". */
 #define RDP_DEBUG_CLIPBOARD_LEVEL_DEFAULT RDP_DEBUG_LEVEL_ERR
 
-#define rdp_debug_clipboard_verbose(b, ...) \
-	if (b->debugClipboardLevel >= RDP_DEBUG_LEVEL_VERBOSE) \
-		rdp_debug_print(b->debugClipboard, false, __VA_ARGS__)
-#define rdp_debug_clipboard_verbose_continue(b, ...) \
-	if (b->debugClipboardLevel >= RDP_DEBUG_LEVEL_VERBOSE) \
-		rdp_debug_print(b->debugClipboard, true,  __VA_ARGS__)
-#define rdp_debug_clipboard(b, ...) \
-	if (b->debugClipboardLevel >= RDP_DEBUG_LEVEL_INFO) \
-		rdp_debug_print(b->debugClipboard, false, __VA_ARGS__)
-#define rdp_debug_clipboard_continue(b, ...) \
-	if (b->debugClipboardLevel >= RDP_DEBUG_LEVEL_INFO) \
-		rdp_debug_print(b->debugClipboard, true,  __VA_ARGS__)
+#define rdp_debug_clipboard_verbose(b, ...) do { \
+	if (rdp_debug_clipboard_enabled(b, RDP_DEBUG_LEVEL_VERBOSE)) \
+		rdp_debug_print((b)->debugClipboard, false, __VA_ARGS__); \
+} while (0)
+#define rdp_debug_clipboard_verbose_continue(b, ...) do { \
+	if (rdp_debug_clipboard_enabled(b, RDP_DEBUG_LEVEL_VERBOSE)) \
+		rdp_debug_print((b)->debugClipboard, true,  __VA_ARGS__); \
+} while (0)
+#define rdp_debug_clipboard(b, ...) do { \
+	if (rdp_debug_clipboard_enabled(b, RDP_DEBUG_LEVEL_INFO)) \
+		rdp_debug_print((b)->debugClipboard, false, __VA_ARGS__); \
+} while (0)
+#define rdp_debug_clipboard_continue(b, ...) do { \
+	if (rdp_debug_clipboard_enabled(b, RDP_DEBUG_LEVEL_INFO)) \
+		rdp_debug_print((b)->debugClipboard, true,  __VA_ARGS__); \
+} while (0)
 
 /* To enable rdp_debug message, add "--logger-scopes=rdp-backend". */
 
@@ -341,10 +665,209 @@ void convert_rdp_keyboard_to_xkb_rule_names(UINT32 KeyboardType, UINT32 Keyboard
 struct rdp_head * rdp_head_create(struct weston_compositor *compositor, BOOL isPrimary, rdpMonitor *config);
 void rdp_head_destroy(struct weston_compositor *compositor, struct rdp_head *head);
 struct weston_output *rdp_output_get_primary(struct weston_compositor *compositor);
+int rdp_get_monitor_refresh_rate(struct rdp_backend *b, uint32_t monitorIndex);
+void rdp_output_frame_acked(struct rdp_backend *b, uint32_t frameId,
+			    const struct timespec *ackTime);
+void rdp_output_batch_begin(struct rdp_backend *b);
+void rdp_output_batch_end(struct rdp_backend *b);
+void rdp_peer_frame_sent(RdpPeerContext *peerCtx);
+void dump_output_state(FILE *fp, struct rdp_backend *b);
+
+// rdpcodec.c
+/* quality of update, content sent coarse while it keeps changing is
+   re-sent lossless once it stays still for RDP_REFINE_IDLE_MSEC. */
+enum rdp_gfx_quality {
+	RDP_GFX_QUALITY_DEFAULT = 0,
+	RDP_GFX_QUALITY_COARSE,
+	RDP_GFX_QUALITY_LOSSLESS,
+};
+
+#define RDP_REFINE_IDLE_MSEC 200
+
+/* content of damage, text and UI is sent lossless, image with progressive,
+   and video with AVC420. */
+enum rdp_gfx_content {
+	RDP_GFX_CONTENT_UNKNOWN = 0,
+	RDP_GFX_CONTENT_TEXT,
+	RDP_GFX_CONTENT_IMAGE,
+	RDP_GFX_CONTENT_VIDEO,
+};
+
+struct rdp_gfx_codec_output {
+	uint16_t codecId;
+	BYTE *data;
+	UINT32 length;
+	bool free_data; /* data is allocated by encoder and must be freed by caller */
+	RDPGFX_AVC420_BITMAP_STREAM avc420; /* valid when codecId is AVC420 */
+};
+
+void rdp_gfx_codec_set_caps(RdpPeerContext *peerCtx, uint32_t version, uint32_t flags);
+uint16_t rdp_gfx_codec_select(RdpPeerContext *peerCtx, int width, int height,
+			      enum rdp_gfx_quality quality);
+bool rdp_gfx_codec_is_lossy(uint16_t codecId);
+enum rdp_gfx_content rdp_gfx_codec_classify(const BYTE *bits, int stride,
+					    int width, int height);
+bool rdp_motion_update(struct timespec *lastUpdateTime, uint32_t *motionCount,
+		       const struct timespec *now);
+bool rdp_gfx_codec_encode(RdpPeerContext *peerCtx, struct rdp_gfx_codec_context *codec,
+			  uint16_t codecId, BYTE *src, int src_width, int src_height, int src_stride,
+			  const pixman_box32_t *rect, struct rdp_gfx_codec_output *output);
+int rdp_gfx_codec_alpha_max_size(int width, int height, bool hasAlpha);
+int rdp_gfx_codec_build_alpha(const BYTE *src, int src_stride, int width, int height,
+			      bool hasAlpha, BYTE *alpha);
+bool rdp_gfx_codec_detect_scroll(const BYTE *oldBits, int oldStride,
+				 const BYTE *newBits, int newStride,
+				 int width, int height,
+				 int *dx, int *dy, pixman_box32_t *dest);
+void rdp_gfx_codec_output_release(struct rdp_gfx_codec_output *output);
+bool rdp_gfx_codec_update_avc_state(RdpPeerContext *peerCtx,
+				    struct weston_surface_rail_state *rail_state,
+				    int damage_area, int window_area,
+				    bool *needRefresh);
+bool rdp_gfx_codec_encode_avc420(RdpPeerContext *peerCtx,
+				 struct weston_surface_rail_state *rail_state,
+				 BYTE *src, int width, int height, int stride,
+				 struct rdp_gfx_codec_output *output);
+void rdp_gfx_codec_avc_destroy(struct weston_surface_rail_state *rail_state);
+void rdp_gfx_codec_context_destroy(struct rdp_gfx_codec_context *codec);
+
+// rdpcache.c
+void rdp_gfx_cache_init(struct rdp_gfx_cache *cache);
+bool rdp_gfx_cache_reset(struct rdp_gfx_cache *cache, uint32_t capsFlags);
+void rdp_gfx_cache_destroy(struct rdp_gfx_cache *cache);
+void rdp_gfx_cache_clear(struct rdp_gfx_cache *cache);
+void rdp_gfx_cache_begin_update(struct rdp_gfx_cache *cache);
+bool rdp_gfx_cache_tile_key(const BYTE *bits, int stride, int width, int height,
+			    uint64_t *key);
+uint16_t rdp_gfx_cache_lookup(struct rdp_gfx_cache *cache, uint64_t key);
+uint16_t rdp_gfx_cache_add(struct rdp_gfx_cache *cache, uint64_t key, bool noEvict);
+uint64_t rdp_content_hash(const BYTE *bits, int stride, int rowBytes, int height,
+			  uint64_t seed);
+void rdp_tile_hashes_reset(struct weston_rdp_tile_hashes *tiles);
+int rdp_tile_hashes_filter(struct weston_rdp_tile_hashes *tiles,
+			   int width, int height, pixman_region32_t *damage,
+			   const pixman_box32_t *rect, const BYTE *bits,
+			   int stride, bool keepDamage, int *unchanged);
+void rdp_tile_hashes_account(struct rdp_backend *b, int checked, int unchanged,
+			     bool isDropped);
+void rdp_slot_cache_reset(struct rdp_slot_cache *cache, uint32_t numSlots);
+int rdp_slot_cache_lookup(struct rdp_slot_cache *cache, uint64_t key);
+int rdp_slot_cache_add(struct rdp_slot_cache *cache, uint64_t key);
+
+// rdpencoder.c
+bool rdp_encoder_create(RdpPeerContext *peerCtx, int num_threads);
+void rdp_encoder_destroy(RdpPeerContext *peerCtx);
+void rdp_encoder_submit(RdpPeerContext *peerCtx, struct rdp_encoder_job *job,
+			rdp_encoder_encode_func_t encode, rdp_encoder_done_func_t done);
+void rdp_encoder_flush(RdpPeerContext *peerCtx);
+int rdp_encoder_get_num_threads(RdpPeerContext *peerCtx);
+
+// rdpsurfcmd.c
+/* damage which is not covered by SurfaceToSurface is split into rects,
+   and each rect is sent by its own surface command. */
+struct rdp_rail_surface_command_rect {
+	pixman_box32_t rect; /* in surface coordinate */
+	uint16_t codecId;
+	BYTE *data; /* points into damage snapshot of job */
+	BYTE *alpha; /* points into rail_state->staging_alpha */
+	int alphaSize;
+	struct rdp_gfx_codec_output output;
+};
+
+/* tile of damage which is either copied from client's bitmap cache,
+   or stored into it once surface commands are sent. */
+struct rdp_rail_surface_command_cache_tile {
+	pixman_box32_t rect; /* in surface coordinate */
+	uint64_t key;
+	uint16_t slot;
+	bool isHit;
+};
+
+struct rdp_rail_surface_command_job {
+	struct rdp_encoder_job base;
+	struct weston_surface_rail_state *rail_state;
+	uint32_t window_id;
+	uint32_t surface_id;
+	uint32_t frame_id;
+	int surface_width;
+	int surface_height;
+	pixman_box32_t rect; /* damage extents in surface coordinate */
+	pixman_region32_t damage; /* in surface coordinate, within rect */
+	bool hasAlpha;
+	bool useAvc;
+	enum rdp_gfx_quality quality;
+	enum rdp_gfx_content contentOverride; /* of window, UNKNOWN to classify */
+	enum rdp_gfx_content content; /* of largest classified rect */
+	int contentArea;
+	bool useStagingSurface; /* keep rail_state->staging_surface in sync */
+	bool detectScroll;
+	BYTE *data; /* damage packed in BGRA32, in rail_state->staging_damage */
+	int stride;
+	BYTE *surfaceData; /* in rail_state->staging_surface, once updated */
+	bool isScrolled;
+	pixman_box32_t scrollRect; /* SurfaceToSurface destination in surface coordinate */
+	int scrollDx;
+	int scrollDy;
+	int numCacheTiles;
+	struct rdp_rail_surface_command_cache_tile *cacheTiles;
+	int numRects;
+	struct rdp_rail_surface_command_rect *rects;
+};
+
+void rdp_rail_scale_box(pixman_box32_t *box, int from_width, int from_height,
+			int to_width, int to_height);
+void rdp_rail_surface_command_lookup_cache(RdpPeerContext *peer_ctx,
+					   struct rdp_rail_surface_command_job *job);
+bool rdp_rail_surface_command_drop_unchanged(RdpPeerContext *peer_ctx,
+					     struct rdp_rail_surface_command_job *job,
+					     bool keepDamage);
+void rdp_rail_surface_command_encode(struct rdp_encoder_job *base,
+				     struct rdp_gfx_codec_context *codec);
+void rdp_rail_surface_command_done(bool freeOnly, struct rdp_encoder_job *base);
+
+// rdppacer.c
+void rdp_frame_pacer_init(struct rdp_frame_pacer *pacer, bool enabled);
+void rdp_frame_pacer_frame_sent(struct rdp_frame_pacer *pacer, uint32_t frameId);
+int64_t rdp_frame_pacer_frame_acked(struct rdp_backend *b,
+				    struct rdp_frame_pacer *pacer,
+				    uint32_t frameId, uint32_t queueDepth,
+				    const struct timespec *ackTime);
+bool rdp_frame_pacer_can_send(const struct rdp_frame_pacer *pacer,
+			      uint32_t framesInFlight);
+int rdp_frame_pacer_get_interval(const struct rdp_frame_pacer *pacer,
+				 int refresh_msec);
+void rdp_link_estimate_init(struct rdp_link_estimate *link);
+void rdp_link_estimate_rtt(struct rdp_link_estimate *link, int64_t rttUsec);
+void rdp_link_estimate_bandwidth(struct rdp_link_estimate *link,
+				 uint32_t byteCount, uint32_t timeDeltaMsec);
+void rdp_link_estimate_frames(struct rdp_link_estimate *link, uint64_t bytesSent);
+bool rdp_link_is_constrained(const struct rdp_link_estimate *link);
+int rdp_link_get_interval(const struct rdp_link_estimate *link);
+int rdp_link_get_window(const struct rdp_link_estimate *link);
+void rdp_frame_pacer_set_link(struct rdp_frame_pacer *pacer,
+			      const struct rdp_link_estimate *link);
+
+// rdptrace.c
+bool rdp_trace_open(struct rdp_backend *b, const char *path);
+void rdp_trace_close(struct rdp_backend *b);
+void rdp_trace_config(struct rdp_backend *b, RdpPeerContext *peer_ctx);
+void rdp_trace_surface_command(struct rdp_backend *b,
+			       const struct rdp_rail_surface_command_job *job,
+			       bool useCache, uint64_t readback_nsec);
+void rdp_trace_frame_end(struct rdp_backend *b, uint32_t frame_id);
+void rdp_trace_frame_ack(struct rdp_backend *b, uint32_t frame_id,
+			 uint32_t queue_depth, const struct timespec *ack_time);
 
 // rdputil.c
 pid_t rdp_get_tid(void);
 void rdp_debug_print(struct weston_log_scope *log_scope, bool cont, char *fmt, ...);
+void rdp_debug_update_level(struct rdp_backend *b);
+void rdp_debug_subscribe(struct weston_log_subscription *sub, void *data);
+void rdp_debug_unsubscribe(struct weston_log_subscription *sub, void *data);
+void rdp_debug_clipboard_subscribe(struct weston_log_subscription *sub, void *data);
+void rdp_debug_clipboard_unsubscribe(struct weston_log_subscription *sub, void *data);
+
+#define RDP_READ_FD_MAX_CHUNK (1024 * 1024)
 
 int
 rdp_wl_array_read_fd(struct wl_array *array, int fd);
@@ -355,10 +878,17 @@ assert_compositor_thread(struct rdp_backend *b);
 void
 assert_not_compositor_thread(struct rdp_backend *b);
 
+void
+assert_channel_thread(struct rdp_backend *b);
+
 #ifdef HAVE_FREERDP_GFXREDIR_H
 BOOL rdp_allocate_shared_memory(struct rdp_backend *b, struct weston_rdp_shared_memory *shared_memory);
 void rdp_free_shared_memory(struct rdp_backend *b, struct weston_rdp_shared_memory *shared_memory);
 #endif // HAVE_FREERDP_GFXREDIR_H
+void *rdp_staging_buffer_reserve(struct weston_rdp_staging_buffer *buffer, size_t size);
+void rdp_staging_buffer_release(struct weston_rdp_staging_buffer *buffer);
+void rdp_damage_optimize(pixman_region32_t *damage, const pixman_box32_t *bounds,
+			 int alignment, int max_rects, int rect_cost);
 BOOL rdp_id_manager_init(struct rdp_backend *rdp_backend, struct rdp_id_manager *id_manager, UINT32 low_limit, UINT32 high_limit);
 void rdp_id_manager_free(struct rdp_id_manager *id_manager);
 void rdp_id_manager_lock(struct rdp_id_manager *id_manager);
@@ -366,6 +896,7 @@ void rdp_id_manager_unlock(struct rdp_id_manager *id_manager);
 void *rdp_id_manager_lookup(struct rdp_id_manager *id_manager, UINT32 id);
 void rdp_id_manager_for_each(struct rdp_id_manager *id_manager, hash_table_iterator_func_t func, void *data);
 BOOL rdp_id_manager_allocate_id(struct rdp_id_manager *id_manager, void *object, UINT32 *new_id);
+BOOL rdp_id_manager_reserve_id(struct rdp_id_manager *id_manager, void *object, UINT32 id);
 void rdp_id_manager_free_id(struct rdp_id_manager *id_manager, UINT32 id);
 void dump_id_manager_state(FILE *fp, struct rdp_id_manager *id_manager, char* title);
 bool rdp_defer_rdp_task_to_display_loop(RdpPeerContext *peerCtx, wl_event_loop_fd_func_t func, void *data, struct wl_event_source **event_source);
@@ -374,6 +905,8 @@ bool rdp_event_loop_add_fd(struct wl_event_loop *loop, int fd, uint32_t mask, wl
 void rdp_dispatch_task_to_display_loop(RdpPeerContext *peerCtx, rdp_loop_task_func_t func, struct rdp_loop_task *task);
 bool rdp_initialize_dispatch_task_event_source(RdpPeerContext *peerCtx);
 void rdp_destroy_dispatch_task_event_source(RdpPeerContext *peerCtx);
+void dump_dispatch_task_state(FILE *fp, RdpPeerContext *peerCtx);
+int64_t rdp_read_write_syscalls(int fd);
 
 // rdprail.c
 int rdp_rail_backend_create(struct rdp_backend *b, struct weston_rdp_backend_config *config);
@@ -383,10 +916,20 @@ void rdp_rail_sync_window_status(freerdp_peer *client);
 bool rdp_rail_peer_init(freerdp_peer *client, RdpPeerContext *peerCtx);
 void rdp_rail_peer_context_free(freerdp_peer *client, RdpPeerContext *context);
 void rdp_rail_output_repaint(struct weston_output *output, pixman_region32_t *damage);
+void rdp_rail_suppress_output(RdpPeerContext *peerCtx, bool allow, const RECTANGLE_16 *area);
+void rdp_rail_schedule_refine(RdpPeerContext *peer_ctx);
+void rdp_rail_send_cursor_hidden(RdpPeerContext *peer_ctx);
+int rdp_rail_send_cursor_shape(RdpPeerContext *peer_ctx,
+			       struct weston_surface *surface,
+			       int width, int height,
+			       uint32_t hotSpotX, uint32_t hotSpotY);
 bool rdp_drdynvc_init(freerdp_peer *client);
 void rdp_drdynvc_destroy(RdpPeerContext *context);
 
 // rdpdisp.c
+bool
+disp_monitor_layout_is_current(struct rdp_backend *b, rdpMonitor *config, uint32_t count);
+
 bool
 handle_adjust_monitor_layout(freerdp_peer *client, int monitor_count, rdpMonitor *monitors);
 
@@ -406,6 +949,10 @@ disp_get_output_scale_from_monitor(struct rdp_backend *b, const rdpMonitor *conf
 int rdp_clipboard_init(freerdp_peer* client);
 void rdp_clipboard_destroy(RdpPeerContext *peerCtx);
 
+// rdptouch.c
+bool rdp_touch_init(freerdp_peer *client);
+void rdp_touch_destroy(RdpPeerContext *peerCtx);
+
 static inline struct rdp_head *
 to_rdp_head(const struct weston_head *base)
 {
@@ -456,6 +1003,10 @@ rdp_matrix_transform_scale(struct weston_matrix *matrix, int *sx, int *sy)
 
 #define RDP_RAIL_WINDOW_RESIZE_MARGIN 8
 
+/* RDPGFX surface of a window is allocated in multiples of this, and
+   kept while window is resized within it. */
+#define RDP_RAIL_SURFACE_SIZE_ALIGN 256
+
 static inline bool
 is_window_shadow_remoting_disabled(RdpPeerContext *peerCtx)
 {
@@ -0,0 +1,484 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "rdp.h"
+
+#include "shared/xalloc.h"
+
+/* client bitmap cache budget, RDPGFX_CAPS_FLAG_SMALL_CACHE limits it to
+   16MB in 4096 slots, otherwise 100MB in 25600 slots. */
+#define RDP_GFX_CACHE_SLOTS 25600
+#define RDP_GFX_CACHE_SIZE (100 * 1024 * 1024)
+#define RDP_GFX_CACHE_SMALL_SLOTS 4096
+#define RDP_GFX_CACHE_SMALL_SIZE (16 * 1024 * 1024)
+
+/* hash_table is keyed by 32 bits, fold 64 bits cache key into it. */
+static uint32_t
+rdp_gfx_cache_fold_key(uint64_t key)
+{
+	return (uint32_t)(key ^ (key >> 32));
+}
+
+void
+rdp_gfx_cache_init(struct rdp_gfx_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+	wl_list_init(&cache->lru);
+}
+
+/* Size the cache to what client advertised in its caps, and drop all entries. */
+bool
+rdp_gfx_cache_reset(struct rdp_gfx_cache *cache, uint32_t capsFlags)
+{
+	uint32_t tileSize = RDP_GFX_CACHE_TILE_SIZE * RDP_GFX_CACHE_TILE_SIZE * 4;
+	uint32_t numSlots;
+
+	if (capsFlags & RDPGFX_CAPS_FLAG_SMALL_CACHE)
+		numSlots = MIN(RDP_GFX_CACHE_SMALL_SLOTS,
+			       RDP_GFX_CACHE_SMALL_SIZE / tileSize);
+	else
+		numSlots = MIN(RDP_GFX_CACHE_SLOTS,
+			       RDP_GFX_CACHE_SIZE / tileSize);
+
+	rdp_gfx_cache_destroy(cache);
+
+	cache->table = hash_table_create();
+	if (!cache->table)
+		return false;
+
+	cache->entries = xzalloc(sizeof(*cache->entries) * numSlots);
+	cache->numSlots = numSlots;
+
+	return true;
+}
+
+void
+rdp_gfx_cache_destroy(struct rdp_gfx_cache *cache)
+{
+	if (cache->table)
+		hash_table_destroy(cache->table);
+	free(cache->entries);
+	rdp_gfx_cache_init(cache);
+}
+
+/* Forget all entries, such as when client drops its cache at ResetGraphics. */
+void
+rdp_gfx_cache_clear(struct rdp_gfx_cache *cache)
+{
+	struct rdp_gfx_cache_entry *entry, *tmp;
+
+	wl_list_for_each_safe(entry, tmp, &cache->lru, link) {
+		hash_table_remove(cache->table, rdp_gfx_cache_fold_key(entry->key));
+		wl_list_remove(&entry->link);
+	}
+	cache->numUsed = 0;
+}
+
+/* Start a group of lookups whose SurfaceToCache are sent after all of
+ * their CacheToSurface, entries added within the group are not visible
+ * to lookups of the same group as client has not received them yet. */
+void
+rdp_gfx_cache_begin_update(struct rdp_gfx_cache *cache)
+{
+	cache->generation++;
+}
+
+static inline uint64_t
+rdp_gfx_cache_rotl(uint64_t v, int bits)
+{
+	return (v << bits) | (v >> (64 - bits));
+}
+
+static inline uint64_t
+rdp_gfx_cache_mix(uint64_t hash, uint64_t v)
+{
+	v *= 0x87c37b91114253d5ULL;
+	v = rdp_gfx_cache_rotl(v, 31);
+	v *= 0x4cf5ad432745937fULL;
+	hash ^= v;
+	return rdp_gfx_cache_rotl(hash, 27) * 5 + 0x52dce729;
+}
+
+/* final avalanche (MurmurHash3 fmix64) */
+static inline uint64_t
+rdp_gfx_cache_fmix(uint64_t hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/* Compute cache key of tile, keys are content hashes, thus same content
+ * in any window or session maps to same key.
+ *
+ * Returns false when tile is a single color, such tiles are cheaper to
+ * send by any codec than to cache.
+ */
+bool
+rdp_gfx_cache_tile_key(const BYTE *bits, int stride, int width, int height,
+		       uint64_t *key)
+{
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)width << 32 | height);
+	uint64_t firstPixels;
+	bool isUniform;
+
+	/* width is at least 2 pixels, so first 8 bytes are 2 pixels. */
+	assert(width >= 2 && (width % 2) == 0);
+	memcpy(&firstPixels, bits, sizeof firstPixels);
+	isUniform = memcmp(bits, bits + 4, 4) == 0;
+
+	for (int i = 0; i < height; i++, bits += stride) {
+		for (int j = 0; j < width * 4; j += 8) {
+			uint64_t v;
+
+			memcpy(&v, bits + j, sizeof v);
+			isUniform &= v == firstPixels;
+			hash = rdp_gfx_cache_mix(hash, v);
+		}
+	}
+
+	*key = rdp_gfx_cache_fmix(hash);
+
+	return !isUniform;
+}
+
+/* Content hash of any rectangle of rowBytes by height, seed tells apart
+ * same bytes meant as different images. */
+uint64_t
+rdp_content_hash(const BYTE *bits, int stride, int rowBytes, int height,
+		 uint64_t seed)
+{
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ seed;
+
+	for (int i = 0; i < height; i++, bits += stride) {
+		int j;
+
+		for (j = 0; j + 8 <= rowBytes; j += 8) {
+			uint64_t v;
+
+			memcpy(&v, bits + j, sizeof v);
+			hash = rdp_gfx_cache_mix(hash, v);
+		}
+		if (j < rowBytes) {
+			uint64_t v = 0;
+
+			memcpy(&v, bits + j, rowBytes - j);
+			hash = rdp_gfx_cache_mix(hash, v);
+		}
+	}
+
+	return rdp_gfx_cache_fmix(hash ^ ((uint64_t)rowBytes << 32 | height));
+}
+
+/* Content hash of a tile, only ever compared with hashes of tiles of the
+ * same image, so it needn't match rdp_content_hash(). The SSE2 path mixes
+ * 16 bytes per step with a position dependent key (XXH3 style), so moved
+ * content doesn't hash the same. */
+static uint64_t
+rdp_tile_hash(const BYTE *bits, int stride, int rowBytes, int height)
+{
+#if defined(__SSE2__)
+	const __m128i step = _mm_set1_epi64x(0x9e3779b97f4a7c15LL);
+	__m128i acc = _mm_set_epi64x(0x165667b19e3779f9LL, 0x27d4eb2f165667c5LL);
+	uint64_t lanes[2];
+	uint64_t hash = 0;
+
+	for (int i = 0; i < height; i++, bits += stride) {
+		__m128i key = _mm_set_epi64x(0xbe4ba423396cfeb8LL, 0x1cad21f72c81017cLL + i);
+		int j;
+
+		for (j = 0; j + 16 <= rowBytes; j += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(bits + j));
+			__m128i k = _mm_xor_si128(v, key);
+
+			acc = _mm_add_epi64(acc, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+			acc = _mm_add_epi64(acc, _mm_mul_epu32(k, _mm_srli_epi64(k, 32)));
+			key = _mm_add_epi64(key, step);
+		}
+		if (j < rowBytes)
+			hash = rdp_gfx_cache_mix(hash,
+						 rdp_content_hash(bits + j, stride,
+								  rowBytes - j, 1, i));
+	}
+
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	hash = rdp_gfx_cache_mix(hash, lanes[0]);
+	hash = rdp_gfx_cache_mix(hash, lanes[1]);
+
+	return rdp_gfx_cache_fmix(hash ^ ((uint64_t)rowBytes << 32 | height));
+#else
+	return rdp_content_hash(bits, stride, rowBytes, height, 0);
+#endif
+}
+
+void
+rdp_tile_hashes_reset(struct weston_rdp_tile_hashes *tiles)
+{
+	free(tiles->hashes);
+	memset(tiles, 0, sizeof(*tiles));
+}
+
+/* Drop tiles of damage whose content is the same as when they were last
+ * sent, and remember the content of the rest.
+ *
+ * The image is width by height, and bits points at pixel (rect->x1,
+ * rect->y1) of it, only pixels within rect are available. Tiles not
+ * entirely within rect are sent as damaged and forgotten, as are tiles
+ * only partly damaged which changed, since the client only gets the
+ * damaged part of them. With keepDamage, nothing is dropped, but the
+ * content is still remembered.
+ *
+ * Returns the number of tiles hashed, *unchanged is set to the number
+ * of them which were dropped, or would have been.
+ */
+int
+rdp_tile_hashes_filter(struct weston_rdp_tile_hashes *tiles,
+		       int width, int height, pixman_region32_t *damage,
+		       const pixman_box32_t *rect, const BYTE *bits,
+		       int stride, bool keepDamage, int *unchanged)
+{
+	const int tileSize = RDP_TILE_HASH_SIZE;
+	pixman_box32_t *extents = pixman_region32_extents(damage);
+	pixman_region32_t same;
+	int checked = 0;
+
+	*unchanged = 0;
+
+	if (tiles->width != width || tiles->height != height) {
+		rdp_tile_hashes_reset(tiles);
+		tiles->columns = (width + tileSize - 1) / tileSize;
+		tiles->rows = (height + tileSize - 1) / tileSize;
+		tiles->hashes = calloc((size_t)tiles->columns * tiles->rows,
+				       sizeof(*tiles->hashes));
+		if (!tiles->hashes) {
+			rdp_tile_hashes_reset(tiles);
+			return 0;
+		}
+		tiles->width = width;
+		tiles->height = height;
+	}
+
+	pixman_region32_init(&same);
+	for (int y = MAX(extents->y1, 0) / tileSize * tileSize;
+	     y < MIN(extents->y2, height); y += tileSize) {
+		for (int x = MAX(extents->x1, 0) / tileSize * tileSize;
+		     x < MIN(extents->x2, width); x += tileSize) {
+			uint64_t *stored = &tiles->hashes[(y / tileSize) * tiles->columns +
+							  x / tileSize];
+			pixman_box32_t box = {
+				x, y, MIN(x + tileSize, width), MIN(y + tileSize, height)
+			};
+			pixman_region_overlap_t overlap;
+			uint64_t hash;
+
+			overlap = pixman_region32_contains_rectangle(damage, &box);
+			if (overlap == PIXMAN_REGION_OUT)
+				continue;
+
+			if (box.x1 < rect->x1 || box.y1 < rect->y1 ||
+			    box.x2 > rect->x2 || box.y2 > rect->y2) {
+				*stored = 0;
+				continue;
+			}
+
+			hash = rdp_tile_hash(bits + (box.y1 - rect->y1) * stride +
+						    (box.x1 - rect->x1) * 4,
+					     stride, (box.x2 - box.x1) * 4,
+					     box.y2 - box.y1);
+			/* 0 is kept for unknown content */
+			hash |= !hash;
+			checked++;
+
+			if (hash == *stored) {
+				(*unchanged)++;
+				if (!keepDamage)
+					pixman_region32_union_rect(&same, &same,
+								   box.x1, box.y1,
+								   box.x2 - box.x1,
+								   box.y2 - box.y1);
+			} else {
+				*stored = overlap == PIXMAN_REGION_IN ? hash : 0;
+			}
+		}
+	}
+	pixman_region32_subtract(damage, damage, &same);
+	pixman_region32_fini(&same);
+
+	return checked;
+}
+
+/* hit rate is reported at most once per this many tiles hashed. */
+#define RDP_TILE_HASH_REPORT_TILES 4096
+
+void
+rdp_tile_hashes_account(struct rdp_backend *b, int checked, int unchanged,
+			bool isDropped)
+{
+	b->tileHashChecked += checked;
+	b->tileHashUnchanged += unchanged;
+	if (isDropped)
+		b->tileHashDroppedUpdates++;
+
+	if (b->tileHashChecked - b->tileHashReported < RDP_TILE_HASH_REPORT_TILES)
+		return;
+
+	b->tileHashReported = b->tileHashChecked;
+	rdp_debug(b, "tile hash: %" PRIu64 " of %" PRIu64 " tiles unchanged (%.1f%%), %u updates dropped\n",
+		  b->tileHashUnchanged, b->tileHashChecked,
+		  100.0 * b->tileHashUnchanged / b->tileHashChecked,
+		  b->tileHashDroppedUpdates);
+}
+
+/* Returns cache slot holding key and marks it most recently used,
+ * or 0 when key is not in cache. */
+uint16_t
+rdp_gfx_cache_lookup(struct rdp_gfx_cache *cache, uint64_t key)
+{
+	struct rdp_gfx_cache_entry *entry;
+
+	if (!cache->table)
+		return 0;
+
+	entry = hash_table_lookup(cache->table, rdp_gfx_cache_fold_key(key));
+	if (!entry || entry->key != key ||
+	    entry->generation == cache->generation)
+		return 0;
+
+	wl_list_remove(&entry->link);
+	wl_list_insert(&cache->lru, &entry->link);
+
+	return entry->slot;
+}
+
+/* Assign cache slot to key, evicting least recently used entry when
+ * cache is full unless noEvict is set.
+ *
+ * Returns assigned slot, or 0 when key can't be cached.
+ */
+uint16_t
+rdp_gfx_cache_add(struct rdp_gfx_cache *cache, uint64_t key, bool noEvict)
+{
+	uint32_t folded = rdp_gfx_cache_fold_key(key);
+	struct rdp_gfx_cache_entry *entry;
+
+	if (!cache->table || cache->numSlots == 0)
+		return 0;
+
+	/* another key folds into the same hash, keep the existing one. */
+	if (hash_table_lookup(cache->table, folded))
+		return 0;
+
+	if (cache->numUsed < cache->numSlots) {
+		entry = &cache->entries[cache->numUsed++];
+		/* slots are 1 based. */
+		entry->slot = cache->numUsed;
+	} else if (!noEvict && !wl_list_empty(&cache->lru)) {
+		/* reuse slot of least recently used entry, client overwrites
+		   slot at SurfaceToCache, so no explicit eviction is needed. */
+		entry = wl_container_of(cache->lru.prev, entry, link);
+		hash_table_remove(cache->table, rdp_gfx_cache_fold_key(entry->key));
+		wl_list_remove(&entry->link);
+	} else {
+		return 0;
+	}
+
+	if (hash_table_insert(cache->table, folded, entry) < 0) {
+		/* slot stays unused until cache is cleared. */
+		return 0;
+	}
+	entry->key = key;
+	entry->generation = cache->generation;
+	wl_list_insert(&cache->lru, &entry->link);
+
+	return entry->slot;
+}
+
+/* Size slot cache to what client advertised, and drop all entries. */
+void
+rdp_slot_cache_reset(struct rdp_slot_cache *cache, uint32_t numSlots)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->numSlots = MIN(numSlots, RDP_SLOT_CACHE_MAX_SLOTS);
+}
+
+/* Returns slot holding key and marks it most recently used, or -1 when
+ * key is not in cache. */
+int
+rdp_slot_cache_lookup(struct rdp_slot_cache *cache, uint64_t key)
+{
+	for (uint32_t i = 0; i < cache->numUsed; i++) {
+		if (cache->entries[i].key == key) {
+			cache->entries[i].lastUsed = ++cache->useCount;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Assign slot to key, reusing least recently used one when cache is
+ * full. Client stores the content at the slot given in the order which
+ * sends it, so no explicit eviction is needed.
+ *
+ * Returns assigned slot, or -1 when client has no such cache.
+ */
+int
+rdp_slot_cache_add(struct rdp_slot_cache *cache, uint64_t key)
+{
+	uint32_t index = 0;
+
+	if (cache->numSlots == 0)
+		return -1;
+
+	if (cache->numUsed < cache->numSlots) {
+		index = cache->numUsed++;
+	} else {
+		for (uint32_t i = 1; i < cache->numUsed; i++) {
+			if (cache->entries[i].lastUsed <
+			    cache->entries[index].lastUsed)
+				index = i;
+		}
+	}
+
+	cache->entries[index].key = key;
+	cache->entries[index].lastUsed = ++cache->useCount;
+
+	return index;
+}
@@ -32,8 +32,10 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <linux/input.h>
 #include <stdio.h>
+#include <png.h>
 
 #include "rdp.h"
 
@@ -43,6 +45,7 @@
    Registered clipboard formats are identified by values in the range 0xC000 through 0xFFFF. */
 #define CF_PRIVATE_RTF  49309 /* fake format ID for "Rich Text Format". */
 #define CF_PRIVATE_HTML 49405 /* fake format ID for "HTML Format".*/
+#define CF_PRIVATE_PNG  49406 /* fake format ID for "PNG". */
 
 					       /*          1           2           3           4         5         6           7         8      */
 					       /*01234567890 1 2345678901234 5 67890123456 7 89012345678901234567890 1 234567890123456789012 3 4*/
@@ -92,6 +95,7 @@ struct rdp_clipboard_supported_format clipboard_supported_formats[] = {
 	{ CF_DIB,          NULL,               "image/bmp",                clipboard_process_bmp       },
 	{ CF_PRIVATE_RTF,  "Rich Text Format", "text/rtf",                 clipboard_process_text_raw  },
 	{ CF_PRIVATE_HTML, "HTML Format",      "text/html",                clipboard_process_html      },
+	{ CF_PRIVATE_PNG,  "PNG",              "image/png",                NULL                        },
 };
 #define RDP_NUM_CLIPBOARD_FORMATS ARRAY_LENGTH(clipboard_supported_formats)
 
@@ -109,6 +113,17 @@ enum rdp_clipboard_data_source_state {
 	RDP_CLIPBOARD_SOURCE_FAILED, /* failure occured */
 };
 
+/* data of previously requested format, kept for the lifetime of the source */
+struct rdp_clipboard_cached_data {
+	struct wl_array data_contents;
+	bool is_data_processed;
+	BITMAPFILEHEADER processed_header;
+	uint32_t processed_header_size;
+	void *processed_data_start;
+	uint32_t processed_data_size;
+	bool processed_data_is_send;
+};
+
 struct rdp_clipboard_data_source {
 	struct weston_data_source base;
 	struct rdp_loop_task task_base;
@@ -121,14 +136,24 @@ struct rdp_clipboard_data_source {
 	enum rdp_clipboard_data_source_state state;
 	uint32_t data_response_fail_count;
 	uint32_t inflight_write_count;
+	void *inflight_header_to_write;
+	size_t inflight_header_size;
 	void *inflight_data_to_write;
 	size_t inflight_data_size;
 	bool is_data_processed;
+	/* written ahead of processed data, so data itself is not rewritten */
+	BITMAPFILEHEADER processed_header;
+	uint32_t processed_header_size;
 	void *processed_data_start;
 	uint32_t processed_data_size;
 	bool processed_data_is_send;
 	bool is_canceled;
+	/* image/png is offered for client's CF_DIB, and encoded on demand */
+	bool is_png_from_dib;
+	/* data_contents holds DIB which is yet to be encoded to PNG */
+	bool is_png_pending;
 	uint32_t client_format_id_table[RDP_NUM_CLIPBOARD_FORMATS];
+	struct rdp_clipboard_cached_data cached_data[RDP_NUM_CLIPBOARD_FORMATS];
 };
 
 struct rdp_clipboard_data_request {
@@ -137,6 +162,13 @@ struct rdp_clipboard_data_request {
 	uint32_t requested_format_index;
 };
 
+struct rdp_clipboard_png_job {
+	struct rdp_encoder_job base;
+	struct rdp_clipboard_data_source *source;
+	struct wl_array png_data;
+	bool success;
+};
+
 static char *
 clipboard_data_source_state_to_string(struct rdp_clipboard_data_source *source)
 {
@@ -449,12 +481,9 @@ clipboard_process_bmp(struct rdp_clipboard_data_source *source, bool is_send)
 	BITMAPFILEHEADER *bmfh = NULL;
 	BITMAPINFOHEADER *bmih = NULL;
 	uint32_t color_table_size = 0;
-	struct wl_array data_contents;
 
 	assert(!source->is_data_processed);
 
-	wl_array_init(&data_contents);
-
 	if (is_send) {
 		/* Linux to Windows (remove BITMAPFILEHEADER) */
 		if (source->data_contents.size <= sizeof(*bmfh))
@@ -468,13 +497,12 @@ clipboard_process_bmp(struct rdp_clipboard_data_source *source, bool is_send)
 		source->processed_data_size = source->data_contents.size - sizeof(*bmfh);
 	} else {
 		/* Windows to Linux (insert BITMAPFILEHEADER) */
-		BITMAPFILEHEADER _bmfh = {};
-
 		if (source->data_contents.size <= sizeof(*bmih))
 			goto error_return;
 
 		bmih = source->data_contents.data;
-		bmfh = &_bmfh;
+		bmfh = &source->processed_header;
+		memset(bmfh, 0, sizeof(*bmfh));
 		if (bmih->biCompression == BI_BITFIELDS)
 			color_table_size = sizeof(RGBQUAD) * 3;
 		else
@@ -494,29 +522,18 @@ clipboard_process_bmp(struct rdp_clipboard_data_source *source, bool is_send)
 		if (source->data_contents.size < (bmfh->bfSize - sizeof(*bmfh)))
 			goto error_return;
 
-		if (!wl_array_add(&data_contents, bmfh->bfSize))
-			goto error_return;
-		assert(data_contents.size == bmfh->bfSize);
-
-		/* copy generated BITMAPFILEHEADER */
-		memcpy(data_contents.data, bmfh, sizeof(*bmfh));
-		/* copy rest of bitmap data from source */
-		memcpy((char *)data_contents.data + sizeof(*bmfh),
-		       source->data_contents.data, bmfh->bfSize - sizeof(*bmfh));
-
-		/* swap the data_contents with new one */
-		wl_array_release(&source->data_contents);
-		source->data_contents = data_contents;
+		/* generated BITMAPFILEHEADER is written ahead of source data. */
 		source->is_data_processed = true;
+		source->processed_header_size = sizeof(*bmfh);
 		source->processed_data_start = source->data_contents.data;
-		source->processed_data_size = source->data_contents.size;
+		source->processed_data_size = bmfh->bfSize - sizeof(*bmfh);
 	}
 
 	rdp_debug_clipboard_verbose(b, "RDP %s (%p:%s): %s (%d bytes)\n",
 				    __func__, source,
 				    clipboard_data_source_state_to_string(source),
 				    is_send ? "send" : "receive",
-				    (uint32_t)source->data_contents.size);
+				    source->processed_header_size + source->processed_data_size);
 
 	/*
 	rdp_debug_clipboard_verbose_continue(b, "    BITMAPFILEHEADER.bfType:0x%x\n", bmfh->bfType);
@@ -579,11 +596,90 @@ error_return:
 		   __func__, source, clipboard_data_source_state_to_string(source),
 		   is_send ? "send" : "receive", (uint32_t)source->data_contents.size);
 
-	wl_array_release(&data_contents);
-
 	return false;
 }
 
+static void
+clipboard_png_write(png_structp png, png_bytep data, png_size_t size)
+{
+	struct wl_array *png_data = png_get_io_ptr(png);
+	void *p;
+
+	p = wl_array_add(png_data, size);
+	if (!p)
+		png_error(png, "out of memory");
+	memcpy(p, data, size);
+}
+
+static void
+clipboard_png_flush(png_structp png)
+{
+}
+
+/* Encode 24 or 32 bpp DIB to PNG, this is called at encoder thread. */
+static bool
+clipboard_encode_png(const void *dib, size_t dib_size, struct wl_array *png_data)
+{
+	const BITMAPINFOHEADER *bmih = dib;
+	png_structp png;
+	png_infop info;
+	const uint8_t *bits;
+	uint64_t stride, offset;
+	uint32_t width, height, y;
+	bool is_top_down;
+
+	if (dib_size < sizeof(*bmih) || bmih->biSize < sizeof(*bmih))
+		return false;
+	if (bmih->biBitCount != 24 && bmih->biBitCount != 32)
+		return false;
+	if (bmih->biCompression != BI_RGB && bmih->biCompression != BI_BITFIELDS)
+		return false;
+	if (bmih->biWidth <= 0 || bmih->biHeight == 0)
+		return false;
+
+	width = bmih->biWidth;
+	height = abs(bmih->biHeight);
+	is_top_down = bmih->biHeight < 0;
+	stride = DIB_WIDTH_BYTES((uint64_t)width * bmih->biBitCount);
+	offset = bmih->biSize + sizeof(RGBQUAD) * (uint64_t)bmih->biClrUsed;
+	/* color masks follow plain BITMAPINFOHEADER, assumed to be BGR. */
+	if (bmih->biCompression == BI_BITFIELDS && bmih->biSize == sizeof(*bmih))
+		offset += sizeof(RGBQUAD) * 3;
+	if (offset > dib_size || stride * height > dib_size - offset)
+		return false;
+	bits = (const uint8_t *)dib + offset;
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png)
+		return false;
+	info = png_create_info_struct(png);
+	if (!info) {
+		png_destroy_write_struct(&png, NULL);
+		return false;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		return false;
+	}
+
+	png_set_write_fn(png, png_data, clipboard_png_write, clipboard_png_flush);
+	/* clipboard data is short lived, favor speed over size. */
+	png_set_compression_level(png, Z_BEST_SPEED);
+	png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
+		     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		     PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	png_set_bgr(png);
+	if (bmih->biBitCount == 32)
+		png_set_filler(png, 0, PNG_FILLER_AFTER);
+	for (y = 0; y < height; y++)
+		png_write_row(png, (png_bytep)(bits + (is_top_down ? y : height - 1 - y) * stride));
+	png_write_end(png, info);
+	png_destroy_write_struct(&png, &info);
+
+	return true;
+}
+
 static char *
 clipboard_format_id_to_string(UINT32 formatId, bool is_server_format_id)
 {
@@ -649,6 +745,9 @@ clipboard_format_id_to_string(UINT32 formatId, bool is_server_format_id)
 
 		if (formatId == CF_PRIVATE_RTF)
 			return "CF_PRIVATE_RTF";
+
+		if (formatId == CF_PRIVATE_PNG)
+			return "CF_PRIVATE_PNG";
 	} else {
 		/* From MSDN, RegisterClipboardFormat API.
 		   Registered clipboard formats are identified by values in the range 0xC000 through 0xFFFF. */
@@ -717,6 +816,7 @@ clipboard_process_source(struct rdp_clipboard_data_source *source, bool is_send)
 		return true;
 	}
 
+	source->processed_header_size = 0;
 	source->processed_data_start = NULL;
 	source->processed_data_size = 0;
 
@@ -731,6 +831,60 @@ clipboard_process_source(struct rdp_clipboard_data_source *source, bool is_send)
 	return true;
 }
 
+/* Swap current data into the cache and data of given format out of it, so
+ * data received and converted once is not requested from client again.
+ * Returns true when data of given format was in the cache. */
+static bool
+clipboard_data_source_swap_cached(struct rdp_clipboard_data_source *source, int index)
+{
+	struct rdp_clipboard_cached_data *cached;
+
+	if (source->format_index >= 0 && source->data_contents.size) {
+		cached = &source->cached_data[source->format_index];
+		wl_array_release(&cached->data_contents);
+		cached->data_contents = source->data_contents;
+		cached->is_data_processed = source->is_data_processed;
+		cached->processed_header = source->processed_header;
+		cached->processed_header_size = source->processed_header_size;
+		cached->processed_data_start = source->processed_data_start;
+		cached->processed_data_size = source->processed_data_size;
+		cached->processed_data_is_send = source->processed_data_is_send;
+		wl_array_init(&source->data_contents);
+	} else {
+		wl_array_release(&source->data_contents);
+		wl_array_init(&source->data_contents);
+	}
+	source->is_data_processed = false;
+	source->format_index = -1;
+
+	cached = &source->cached_data[index];
+	if (!cached->data_contents.size)
+		return false;
+
+	/* wl_array data doesn't move, so processed pointer stays valid */
+	source->data_contents = cached->data_contents;
+	source->is_data_processed = cached->is_data_processed;
+	source->processed_header = cached->processed_header;
+	source->processed_header_size = cached->processed_header_size;
+	source->processed_data_start = cached->processed_data_start;
+	source->processed_data_size = cached->processed_data_size;
+	source->processed_data_is_send = cached->processed_data_is_send;
+	source->format_index = index;
+	wl_array_init(&cached->data_contents);
+	return true;
+}
+
+static void
+clipboard_data_source_release_cached(struct rdp_clipboard_data_source *source)
+{
+	unsigned int i;
+
+	for (i = 0; i < RDP_NUM_CLIPBOARD_FORMATS; i++) {
+		wl_array_release(&source->cached_data[i].data_contents);
+		wl_array_init(&source->cached_data[i].data_contents);
+	}
+}
+
 static void
 clipboard_data_source_unref(struct rdp_clipboard_data_source *source)
 {
@@ -763,6 +917,7 @@ clipboard_data_source_unref(struct rdp_clipboard_data_source *source)
 			       &source->base);
 
 	wl_array_release(&source->data_contents);
+	clipboard_data_source_release_cached(source);
 
 	wl_array_for_each(p, &source->base.mime_types)
 		free(*p);
@@ -930,6 +1085,7 @@ clipboard_data_source_fail(bool freeOnly, void *arg)
 		/* clear previous requested format so it can be requested later again. */
 		source->format_index = -1;
 	}
+	source->is_png_pending = false;
 
 	/* data has never been sent to write(), thus must be no inflight write. */
 	assert(source->inflight_write_count == 0);
@@ -945,6 +1101,99 @@ clipboard_data_source_fail(bool freeOnly, void *arg)
 	clipboard_data_source_unref(source);
 }
 
+static int
+clipboard_data_source_write(int fd, uint32_t mask, void *arg);
+
+static void
+clipboard_png_job_encode(struct rdp_encoder_job *base, struct rdp_gfx_codec_context *codec)
+{
+	struct rdp_clipboard_png_job *job = container_of(base, struct rdp_clipboard_png_job, base);
+	struct rdp_clipboard_data_source *source = job->source;
+
+	/* data_contents is not touched by display loop while encoding,
+	   as the source is inflight and its write is paused. */
+	job->success = clipboard_encode_png(source->data_contents.data,
+					    source->data_contents.size,
+					    &job->png_data);
+}
+
+/* PNG is ready, replace DIB with it and resume write to the application. */
+static void
+clipboard_png_job_done(bool freeOnly, struct rdp_encoder_job *base)
+{
+	struct rdp_clipboard_png_job *job = container_of(base, struct rdp_clipboard_png_job, base);
+	struct rdp_clipboard_data_source *source = job->source;
+	RdpPeerContext *ctx = base->peerCtx;
+	struct rdp_backend *b = ctx->rdpBackend;
+	struct wl_event_loop *loop = wl_display_get_event_loop(b->compositor->wl_display);
+	struct rdp_clipboard_cached_data *cached;
+
+	assert(source->is_png_pending);
+	source->is_png_pending = false;
+
+	if (!freeOnly && job->success) {
+		rdp_debug_clipboard(b, "RDP %s (%p:%s) DIB (%zu bytes) to PNG (%zu bytes)\n",
+				    __func__, source,
+				    clipboard_data_source_state_to_string(source),
+				    source->data_contents.size, job->png_data.size);
+
+		/* DIB was transferred anyway, keep it for image/bmp. */
+		cached = &source->cached_data[clipboard_find_supported_format_by_format_id(CF_DIB)];
+		if (!cached->data_contents.size) {
+			cached->data_contents = source->data_contents;
+			cached->is_data_processed = false;
+		} else {
+			wl_array_release(&source->data_contents);
+		}
+		source->data_contents = job->png_data;
+	} else {
+		if (!freeOnly)
+			weston_log("RDP %s (%p:%s) failed to encode PNG\n",
+				   __func__, source,
+				   clipboard_data_source_state_to_string(source));
+		/* empty data fails the write below, and the format can be requested again. */
+		wl_array_release(&job->png_data);
+		wl_array_release(&source->data_contents);
+		wl_array_init(&source->data_contents);
+		source->format_index = -1;
+	}
+
+	if (!freeOnly &&
+	    !rdp_event_loop_add_fd(loop, source->data_source_fd, WL_EVENT_WRITABLE,
+				   clipboard_data_source_write, source,
+				   &source->transfer_event_source)) {
+		source->state = RDP_CLIPBOARD_SOURCE_FAILED;
+		weston_log("RDP %s (%p:%s) rdp_event_loop_add_fd failed\n",
+			   __func__, source,
+			   clipboard_data_source_state_to_string(source));
+	}
+
+	/* reference taken at submit */
+	clipboard_data_source_unref(source);
+	free(job);
+}
+
+/* Pause the write and encode DIB to PNG at encoder thread. */
+static bool
+clipboard_data_source_encode_png(RdpPeerContext *ctx, struct rdp_clipboard_data_source *source)
+{
+	struct rdp_clipboard_png_job *job;
+
+	job = zalloc(sizeof *job);
+	if (!job)
+		return false;
+
+	job->source = source;
+	wl_array_init(&job->png_data);
+	source->refcount++;
+
+	wl_event_source_remove(source->transfer_event_source);
+	source->transfer_event_source = NULL;
+
+	rdp_encoder_submit(ctx, &job->base, clipboard_png_job_encode, clipboard_png_job_done);
+	return true;
+}
+
 /* Send client's clipboard data to the requesting application at server side */
 static int
 clipboard_data_source_write(int fd, uint32_t mask, void *arg)
@@ -953,8 +1202,11 @@ clipboard_data_source_write(int fd, uint32_t mask, void *arg)
 	freerdp_peer *client = (freerdp_peer *)source->context;
 	RdpPeerContext *ctx = (RdpPeerContext *)client->context;
 	struct rdp_backend *b = ctx->rdpBackend;
+	void *header_to_write;
+	size_t header_size;
 	void *data_to_write;
 	size_t data_size;
+	struct iovec iov[2];
 	ssize_t size;
 
 	rdp_debug_clipboard_verbose(b, "RDP %s (%p:%s) fd:%d\n", __func__,
@@ -993,18 +1245,37 @@ clipboard_data_source_write(int fd, uint32_t mask, void *arg)
 					    __func__, source,
 					    clipboard_data_source_state_to_string(source),
 					    source->inflight_write_count);
+		header_to_write = source->inflight_header_to_write;
+		header_size = source->inflight_header_size;
 		data_to_write = source->inflight_data_to_write;
 		data_size = source->inflight_data_size;
 	} else {
 		fcntl(source->data_source_fd, F_SETFL, O_WRONLY | O_NONBLOCK);
+		if (source->is_png_pending) {
+			if (!clipboard_data_source_encode_png(ctx, source)) {
+				source->state = RDP_CLIPBOARD_SOURCE_FAILED;
+				goto fail;
+			}
+			/* write is resumed once PNG is ready */
+			return 0;
+		}
 		clipboard_process_source(source, false);
+		header_to_write = &source->processed_header;
+		header_size = source->processed_header_size;
 		data_to_write = source->processed_data_start;
 		data_size = source->processed_data_size;
 	}
 	while (data_to_write && data_size) {
 		source->state = RDP_CLIPBOARD_SOURCE_TRANSFERING;
+		iov[0].iov_base = header_to_write;
+		iov[0].iov_len = header_size;
+		iov[1].iov_base = data_to_write;
+		iov[1].iov_len = data_size;
 		do {
-			size = write(source->data_source_fd, data_to_write, data_size);
+			if (header_size)
+				size = writev(source->data_source_fd, iov, 2);
+			else
+				size = write(source->data_source_fd, data_to_write, data_size);
 		} while (size == -1 && errno == EINTR);
 
 		if (size <= 0) {
@@ -1017,11 +1288,20 @@ clipboard_data_source_write(int fd, uint32_t mask, void *arg)
 				break;
 			}
 			/* buffer is full, wait until data_source_fd is writable again */
+			source->inflight_header_to_write = header_to_write;
+			source->inflight_header_size = header_size;
 			source->inflight_data_to_write = data_to_write;
 			source->inflight_data_size = data_size;
 			source->inflight_write_count++;
 			return 0;
 		} else {
+			if (header_size) {
+				size_t written = MIN(header_size, (size_t)size);
+
+				header_size -= written;
+				header_to_write = (char *)header_to_write + written;
+				size -= written;
+			}
 			assert(data_size >= (size_t)size);
 			data_size -= size;
 			data_to_write = (char *)data_to_write + size;
@@ -1040,6 +1320,13 @@ clipboard_data_source_write(int fd, uint32_t mask, void *arg)
 	}
 
 fail:
+	/* DIB never got encoded, it must not be taken as PNG later. */
+	if (source->is_png_pending) {
+		wl_array_release(&source->data_contents);
+		wl_array_init(&source->data_contents);
+		source->is_png_pending = false;
+		source->format_index = -1;
+	}
 	/* Here write is either completed, canceled or failed, so close the pipe. */
 	close(source->data_source_fd);
 	source->data_source_fd = -1;
@@ -1048,6 +1335,8 @@ fail:
 	source->transfer_event_source = NULL;
 	/* and reset the inflight transfer state. */
 	source->inflight_write_count = 0;
+	source->inflight_header_to_write = NULL;
+	source->inflight_header_size = 0;
 	source->inflight_data_to_write = NULL;
 	source->inflight_data_size = 0;
 	ctx->clipboard_inflight_client_data_source = NULL;
@@ -1134,7 +1423,8 @@ clipboard_data_source_send(struct weston_data_source *base,
 		assert(source->inflight_write_count == 0);
 		assert(source->inflight_data_to_write == NULL);
 		assert(source->inflight_data_size == 0);
-		if (index == source->format_index) {
+		if (index == source->format_index ||
+		    clipboard_data_source_swap_cached(source, index)) {
 			bool ret;
 
 			/* data is already in data_contents, no need to pull from client */
@@ -1159,12 +1449,13 @@ clipboard_data_source_send(struct weston_data_source *base,
 				goto error_return_unref_source;
 			}
 		} else {
-			/* purge cached data */
-			wl_array_release(&source->data_contents);
-			wl_array_init(&source->data_contents);
-			source->is_data_processed = false;
+			/* previous data was moved to cache by swap above */
+			assert(source->data_contents.size == 0);
 			/* update requesting format property */
 			source->format_index = index;
+			/* client is asked for CF_DIB, it's encoded to PNG at write */
+			source->is_png_pending = source->is_png_from_dib &&
+				clipboard_supported_formats[index].format_id == CF_PRIVATE_PNG;
 			/* request clipboard data from client */
 			formatDataRequest.msgType = CB_FORMAT_DATA_REQUEST;
 			formatDataRequest.dataLen = 4;
@@ -1235,10 +1526,16 @@ clipboard_data_source_cancel(struct weston_data_source *base)
 	assert(source->transfer_event_source == NULL);
 	wl_array_release(&source->data_contents);
 	wl_array_init(&source->data_contents);
+	clipboard_data_source_release_cached(source);
 	source->is_data_processed = false;
+	source->processed_header_size = 0;
 	source->format_index = -1;
 	memset(source->client_format_id_table, 0, sizeof(source->client_format_id_table));
+	source->is_png_from_dib = false;
+	source->is_png_pending = false;
 	source->inflight_write_count = 0;
+	source->inflight_header_to_write = NULL;
+	source->inflight_header_size = 0;
 	source->inflight_data_to_write = NULL;
 	source->inflight_data_size = 0;
 	if (source->data_source_fd != -1) {
@@ -1407,6 +1704,7 @@ clipboard_set_selection(struct wl_listener *listener, void *data)
 	CLIPRDR_FORMAT format[RDP_NUM_CLIPBOARD_FORMATS] = {};
 	const char **mime_type;
 	int index, num_supported_format = 0, num_avail_format = 0;
+	uint32_t seen_formats = 0;
 
 	rdp_debug_clipboard(b, "RDP %s (base:%p)\n", __func__, selection_data_source);
 
@@ -1435,12 +1733,15 @@ clipboard_set_selection(struct wl_listener *listener, void *data)
 		num_avail_format++;
 	}
 
-	/* check supported clipboard formats */
+	/* check supported clipboard formats, a source may offer many MIME
+	   types and repeat them, but each format is announced only once. */
 	wl_array_for_each(mime_type, &selection_data_source->mime_types) {
 		index = clipboard_find_supported_format_by_mime_type(*mime_type);
-		if (index >= 0) {
+		if (index >= 0 && !(seen_formats & (1u << index))) {
 			CLIPRDR_FORMAT *f = &format[num_supported_format];
 
+			seen_formats |= 1u << index;
+
 			f->formatId = clipboard_supported_formats[index].format_id;
 			f->formatName = clipboard_supported_formats[index].format_name;
 			rdp_debug_clipboard(b, "RDP %s (base:%p) supported formats[%d]: %d: %s\n",
@@ -1516,6 +1817,40 @@ clipboard_client_capabilities(CliprdrServerContext *context, const CLIPRDR_CAPAB
 	return 0;
 }
 
+/* make format available in data source, with format id given from client */
+static void
+clipboard_data_source_add_format(struct rdp_clipboard_data_source *source,
+				 int index, uint32_t format_id)
+{
+	freerdp_peer *client = (freerdp_peer *)source->context;
+	RdpPeerContext *ctx = (RdpPeerContext *)client->context;
+	struct rdp_backend *b = ctx->rdpBackend;
+	char **p, *s;
+
+	/* save format id given from client, client can handle its own format id for private format. */
+	source->client_format_id_table[index] = format_id;
+	s = strdup(clipboard_supported_formats[index].mime_type);
+	if (s) {
+		p = wl_array_add(&source->base.mime_types, sizeof *p);
+		if (p) {
+			rdp_debug_clipboard(b, "Client: %s (%p:%s) mine_type:\"%s\" index:%d formatId:%d\n",
+					    __func__, source,
+					    clipboard_data_source_state_to_string(source),
+					    s, index, format_id);
+			*p = s;
+		} else {
+			rdp_debug_clipboard(b, "Client: %s (%p:%s) wl_array_add failed\n",
+					    __func__, source,
+					    clipboard_data_source_state_to_string(source));
+			free(s);
+		}
+	} else {
+		rdp_debug_clipboard(b, "Client: %s (%p:%s) strdup failed\n",
+				    __func__, source,
+				    clipboard_data_source_state_to_string(source));
+	}
+}
+
 /* client reports the supported format list in client's clipboard */
 static UINT
 clipboard_client_format_list(CliprdrServerContext *context, const CLIPRDR_FORMAT_LIST *formatList)
@@ -1525,9 +1860,9 @@ clipboard_client_format_list(CliprdrServerContext *context, const CLIPRDR_FORMAT
 	RdpPeerContext *ctx = (RdpPeerContext *)client->context;
 	struct rdp_backend *b = ctx->rdpBackend;
 	struct rdp_clipboard_data_source *source = NULL;
-	char **p, *s;
+	int dib_index, png_index;
 
-	assert_not_compositor_thread(b);
+	assert_channel_thread(b);
 
 	rdp_debug_clipboard(b, "Client: %s clipboard format list: numFormats:%d\n", __func__, formatList->numFormats);
 	for (uint32_t i = 0; i < formatList->numFormats; i++) {
@@ -1558,30 +1893,19 @@ clipboard_client_format_list(CliprdrServerContext *context, const CLIPRDR_FORMAT
 		CLIPRDR_FORMAT *format = &formatList->formats[i];
 		int index = clipboard_find_supported_format_by_format_id_and_name(format->formatId, format->formatName);
 
-		if (index >= 0) {
-			/* save format id given from client, client can handle its own format id for private format. */
-			source->client_format_id_table[index] = format->formatId;
-			s = strdup(clipboard_supported_formats[index].mime_type);
-			if (s) {
-				p = wl_array_add(&source->base.mime_types, sizeof *p);
-				if (p) {
-					rdp_debug_clipboard(b, "Client: %s (%p:%s) mine_type:\"%s\" index:%d formatId:%d\n",
-							    __func__, source,
-							    clipboard_data_source_state_to_string(source),
-							    s, index, format->formatId);
-					*p = s;
-				} else {
-					rdp_debug_clipboard(b, "Client: %s (%p:%s) wl_array_add failed\n",
-							    __func__, source,
-							    clipboard_data_source_state_to_string(source));
-					free(s);
-				}
-			} else {
-				rdp_debug_clipboard(b, "Client: %s (%p:%s) strdup failed\n",
-						    __func__, source,
-						    clipboard_data_source_state_to_string(source));
-			}
-		}
+		if (index >= 0)
+			clipboard_data_source_add_format(source, index, format->formatId);
+	}
+
+	/* most applications ask for image/png rather than image/bmp, so offer
+	   it for CF_DIB unless client provides PNG by itself. */
+	dib_index = clipboard_find_supported_format_by_format_id(CF_DIB);
+	png_index = clipboard_find_supported_format_by_format_id(CF_PRIVATE_PNG);
+	if (source->client_format_id_table[dib_index] &&
+	    !source->client_format_id_table[png_index]) {
+		source->is_png_from_dib = true;
+		clipboard_data_source_add_format(source, png_index,
+						 source->client_format_id_table[dib_index]);
 	}
 
 	if (formatList->numFormats != 0 &&
@@ -1626,7 +1950,7 @@ clipboard_client_format_data_response(CliprdrServerContext *context, const CLIPR
 			    formatDataResponse->msgFlags,
 			    formatDataResponse->dataLen);
 
-	assert_not_compositor_thread(b);
+	assert_channel_thread(b);
 
 	if (!source) {
 		rdp_debug_clipboard(b, "Client: %s client send data without server asking. protocol error", __func__);
@@ -1694,7 +2018,7 @@ clipboard_client_format_list_response(CliprdrServerContext *context,
 	struct rdp_backend *b = ctx->rdpBackend;
 
 	rdp_debug_clipboard(b, "Client: %s msgFlags:0x%x\n", __func__, formatListResponse->msgFlags);
-	assert_not_compositor_thread(b);
+	assert_channel_thread(b);
 	return 0;
 }
 
@@ -1713,7 +2037,7 @@ clipboard_client_format_data_request(CliprdrServerContext *context,
 			    __func__, formatDataRequest->requestedFormatId,
 			    clipboard_format_id_to_string(formatDataRequest->requestedFormatId, true));
 
-	assert_not_compositor_thread(b);
+	assert_channel_thread(b);
 
 	/* Make sure clients requested the format we knew */
 	index = clipboard_find_supported_format_by_format_id(formatDataRequest->requestedFormatId);
@@ -1739,6 +2063,57 @@ error_return:
 	return 0;
 }
 
+/* clipboard channel driven by display loop, see rdp_backend::loop_channels. */
+static int
+clipboard_channel_activity(int fd, uint32_t mask, void *data)
+{
+	RdpPeerContext *ctx = data;
+	CliprdrServerContext *clip_ctx = ctx->clipboard_server_context;
+	UINT error;
+
+	error = clip_ctx->CheckEventHandle(clip_ctx);
+	if (error != CHANNEL_RC_OK) {
+		rdp_debug_error(ctx->rdpBackend,
+				"%s: failed to handle messages (0x%x)\n",
+				__func__, error);
+		wl_event_source_remove(ctx->clipboard_event_source);
+		ctx->clipboard_event_source = NULL;
+	}
+
+	return 0;
+}
+
+/* what channel thread does at start, when channel is driven by display loop. */
+static UINT
+clipboard_server_init(CliprdrServerContext *clip_ctx)
+{
+	CLIPRDR_GENERAL_CAPABILITY_SET generalCapabilitySet = {};
+	CLIPRDR_CAPABILITIES capabilities = {};
+	CLIPRDR_MONITOR_READY monitorReady = {};
+	UINT error;
+
+	generalCapabilitySet.capabilitySetType = CB_CAPSTYPE_GENERAL;
+	generalCapabilitySet.capabilitySetLength = 12;
+	generalCapabilitySet.version = CB_CAPS_VERSION_2;
+	if (clip_ctx->useLongFormatNames)
+		generalCapabilitySet.generalFlags |= CB_USE_LONG_FORMAT_NAMES;
+	if (clip_ctx->streamFileClipEnabled)
+		generalCapabilitySet.generalFlags |= CB_STREAM_FILECLIP_ENABLED;
+	if (clip_ctx->fileClipNoFilePaths)
+		generalCapabilitySet.generalFlags |= CB_FILECLIP_NO_FILE_PATHS;
+	if (clip_ctx->canLockClipData)
+		generalCapabilitySet.generalFlags |= CB_CAN_LOCK_CLIPDATA;
+	capabilities.msgType = CB_CLIP_CAPS;
+	capabilities.cCapabilitiesSets = 1;
+	capabilities.capabilitySets = (CLIPRDR_CAPABILITY_SET *)&generalCapabilitySet;
+	error = clip_ctx->ServerCapabilities(clip_ctx, &capabilities);
+	if (error != CHANNEL_RC_OK)
+		return error;
+
+	monitorReady.msgType = CB_MONITOR_READY;
+	return clip_ctx->MonitorReady(clip_ctx, &monitorReady);
+}
+
 /********************\
  * Public functions *
 \********************/
@@ -1775,8 +2150,21 @@ rdp_clipboard_init(freerdp_peer *client)
 	clip_ctx->streamFileClipEnabled = FALSE;
 	clip_ctx->fileClipNoFilePaths = FALSE;
 	clip_ctx->canLockClipData = TRUE;
-	if (clip_ctx->Start(ctx->clipboard_server_context) != 0)
+	if (b->loop_channels) {
+		int fd;
+
+		if (clip_ctx->Open(clip_ctx) != CHANNEL_RC_OK)
+			goto error;
+		fd = GetEventFileDescriptor(clip_ctx->GetEventHandle(clip_ctx));
+		if (!rdp_event_loop_add_fd(wl_display_get_event_loop(b->compositor->wl_display),
+					   fd, WL_EVENT_READABLE,
+					   clipboard_channel_activity, ctx,
+					   &ctx->clipboard_event_source) ||
+		    clipboard_server_init(clip_ctx) != CHANNEL_RC_OK)
+			goto error;
+	} else if (clip_ctx->Start(ctx->clipboard_server_context) != 0) {
 		goto error;
+	}
 
 	ctx->clipboard_selection_listener.notify = clipboard_set_selection;
 	wl_signal_add(&seat->selection_signal,
@@ -1785,7 +2173,13 @@ rdp_clipboard_init(freerdp_peer *client)
 	return 0;
 
 error:
+	if (ctx->clipboard_event_source) {
+		wl_event_source_remove(ctx->clipboard_event_source);
+		ctx->clipboard_event_source = NULL;
+	}
 	if (ctx->clipboard_server_context) {
+		if (b->loop_channels)
+			ctx->clipboard_server_context->Close(ctx->clipboard_server_context);
 		cliprdr_server_context_free(ctx->clipboard_server_context);
 		ctx->clipboard_server_context = NULL;
 	}
@@ -1818,8 +2212,15 @@ rdp_clipboard_destroy(RdpPeerContext *ctx)
 		clipboard_data_source_unref(data_source);
 	}
 
+	if (ctx->clipboard_event_source) {
+		wl_event_source_remove(ctx->clipboard_event_source);
+		ctx->clipboard_event_source = NULL;
+	}
 	if (ctx->clipboard_server_context) {
-		ctx->clipboard_server_context->Stop(ctx->clipboard_server_context);
+		if (b->loop_channels)
+			ctx->clipboard_server_context->Close(ctx->clipboard_server_context);
+		else
+			ctx->clipboard_server_context->Stop(ctx->clipboard_server_context);
 		cliprdr_server_context_free(ctx->clipboard_server_context);
 		ctx->clipboard_server_context = NULL;
 	}
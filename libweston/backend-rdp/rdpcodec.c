@@ -0,0 +1,1048 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freerdp/codec/region.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "rdp.h"
+
+#include "libweston-internal.h"
+#include "shared/xalloc.h"
+
+/* damage smaller than this is sent uncompressed, codec header overhead
+   and encoding cost do not pay off for a handful of pixels. */
+#define RDP_GFX_CODEC_UNCOMPRESSED_MAX_AREA (32 * 32)
+
+/* size of RDPGFX_CODECID_ALPHA header ('L', 'A', compression (2 bytes)) */
+#define RDP_GFX_ALPHA_CODEC_HEADER_SIZE 4
+
+/* AVC420 video mode heuristics. A window enters video mode after this many
+   back to back large updates (each covering at least half of the window),
+   and leaves it after this many small updates, or when updates stall. */
+#define RDP_GFX_AVC_ENTER_UPDATE_COUNT 10
+#define RDP_GFX_AVC_LEAVE_UPDATE_COUNT 30
+#define RDP_GFX_AVC_ENTER_MAX_INTERVAL_MSEC 200
+#define RDP_GFX_AVC_LEAVE_MIN_INTERVAL_MSEC 1000
+
+/* content is in motion after this many updates in a row, each within
+   this interval of the previous one. */
+#define RDP_MOTION_UPDATE_COUNT 3
+#define RDP_MOTION_MAX_INTERVAL_MSEC 50
+
+/* damage smaller than this is left to the default codec choice. */
+#define RDP_GFX_CLASSIFY_MIN_AREA (64 * 64)
+/* pixels sampled per row and column of damage. */
+#define RDP_GFX_CLASSIFY_SAMPLES 32
+/* text and UI are drawn with a handful of colors, antialiasing aside. */
+#define RDP_GFX_CLASSIFY_MAX_TEXT_COLORS 24
+#define RDP_GFX_CLASSIFY_COLOR_SLOTS 64
+/* neighbors differing at most this much, summed over channels, are
+   part of a gradient rather than an edge. */
+#define RDP_GFX_CLASSIFY_SMOOTH_DELTA 48
+
+/* scroll detection only runs on damage at least this wide and tall. */
+#define RDP_GFX_SCROLL_MIN_SIZE 64
+/* rows sampled to derive candidate scroll offsets from. */
+#define RDP_GFX_SCROLL_ANCHORS 4
+#define RDP_GFX_SCROLL_MAX_CANDIDATES 16
+/* pixels compared to locate a horizontally shifted row. */
+#define RDP_GFX_SCROLL_KEY_PIXELS 16
+
+void
+rdp_gfx_codec_set_caps(RdpPeerContext *peerCtx, uint32_t version, uint32_t flags)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+
+	peerCtx->gfxCapsVersion = version;
+	peerCtx->gfxCapsFlags = flags;
+
+	rdp_debug(b, "%s: version:0x%x flags:0x%x codec:%d progressive_min_area:%d\n",
+		  __func__, version, flags, b->gfx_codec,
+		  b->gfx_codec_progressive_min_area);
+}
+
+static bool
+rdp_gfx_codec_is_progressive_supported(RdpPeerContext *peerCtx)
+{
+	/* version 8 and 8.1 thin clients only support planar and clear codec. */
+	if (peerCtx->gfxCapsVersion == RDPGFX_CAPVERSION_8 ||
+	    peerCtx->gfxCapsVersion == RDPGFX_CAPVERSION_81)
+		return !(peerCtx->gfxCapsFlags & RDPGFX_CAPS_FLAG_THINCLIENT);
+
+	return peerCtx->gfxCapsVersion != 0;
+}
+
+/* Coarse quality favors progressive, whose tiles are lossy, and lossless
+ * quality takes planar, for content sent coarse before. Explicitly
+ * configured codec is used as is. */
+uint16_t
+rdp_gfx_codec_select(RdpPeerContext *peerCtx, int width, int height,
+		     enum rdp_gfx_quality quality)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	int area = width * height;
+
+	switch (b->gfx_codec) {
+	case WESTON_RDP_GFX_CODEC_UNCOMPRESSED:
+		return RDPGFX_CODECID_UNCOMPRESSED;
+	case WESTON_RDP_GFX_CODEC_PLANAR:
+		return RDPGFX_CODECID_PLANAR;
+	case WESTON_RDP_GFX_CODEC_PROGRESSIVE:
+		if (rdp_gfx_codec_is_progressive_supported(peerCtx))
+			return RDPGFX_CODECID_CAPROGRESSIVE;
+		return RDPGFX_CODECID_PLANAR;
+	case WESTON_RDP_GFX_CODEC_AUTO:
+	default:
+		break;
+	}
+
+	if (area <= RDP_GFX_CODEC_UNCOMPRESSED_MAX_AREA)
+		return RDPGFX_CODECID_UNCOMPRESSED;
+
+	if (quality == RDP_GFX_QUALITY_DEFAULT &&
+	    rdp_link_is_constrained(&peerCtx->link))
+		quality = RDP_GFX_QUALITY_COARSE;
+
+	if (quality == RDP_GFX_QUALITY_LOSSLESS)
+		return RDPGFX_CODECID_PLANAR;
+
+	if ((quality == RDP_GFX_QUALITY_COARSE ||
+	     area >= b->gfx_codec_progressive_min_area) &&
+	    rdp_gfx_codec_is_progressive_supported(peerCtx))
+		return RDPGFX_CODECID_CAPROGRESSIVE;
+
+	return RDPGFX_CODECID_PLANAR;
+}
+
+bool
+rdp_gfx_codec_is_lossy(uint16_t codecId)
+{
+	return codecId == RDPGFX_CODECID_CAPROGRESSIVE ||
+	       codecId == RDPGFX_CODECID_AVC420;
+}
+
+/* Tell text and UI from photo-like image by sampling damage. Text and UI
+ * take few colors and change at hard edges, while images take many colors
+ * changing gradually. Video is told by update rate of window instead, see
+ * rdp_gfx_codec_update_avc_state(). */
+enum rdp_gfx_content
+rdp_gfx_codec_classify(const BYTE *bits, int stride, int width, int height)
+{
+	uint32_t colors[RDP_GFX_CLASSIFY_COLOR_SLOTS];
+	int numColors = 0;
+	int smooth = 0;
+	int sharp = 0;
+	int stepX, stepY;
+
+	if (width < 2 || width * height < RDP_GFX_CLASSIFY_MIN_AREA)
+		return RDP_GFX_CONTENT_UNKNOWN;
+
+	/* alpha is masked off, so all ones never matches a color. */
+	memset(colors, 0xff, sizeof(colors));
+	stepX = MAX((width - 1) / RDP_GFX_CLASSIFY_SAMPLES, 1);
+	stepY = MAX(height / RDP_GFX_CLASSIFY_SAMPLES, 1);
+	for (int y = 0; y < height; y += stepY) {
+		const uint32_t *row = (const uint32_t *)(bits + y * stride);
+
+		for (int x = 0; x + 1 < width; x += stepX) {
+			uint32_t p = row[x] & 0xffffff;
+			uint32_t q = row[x + 1] & 0xffffff;
+			int delta;
+
+			if (numColors <= RDP_GFX_CLASSIFY_MAX_TEXT_COLORS) {
+				uint32_t slot = (p * 0x9e3779b1u) >> 26;
+
+				while (colors[slot] != p && colors[slot] != 0xffffffff)
+					slot = (slot + 1) % RDP_GFX_CLASSIFY_COLOR_SLOTS;
+				if (colors[slot] != p) {
+					colors[slot] = p;
+					numColors++;
+				}
+			}
+
+			if (p == q)
+				continue;
+
+			delta = abs((int)(p & 0xff) - (int)(q & 0xff)) +
+				abs((int)((p >> 8) & 0xff) - (int)((q >> 8) & 0xff)) +
+				abs((int)(p >> 16) - (int)(q >> 16));
+			if (delta <= RDP_GFX_CLASSIFY_SMOOTH_DELTA)
+				smooth++;
+			else
+				sharp++;
+		}
+	}
+
+	if (numColors > RDP_GFX_CLASSIFY_MAX_TEXT_COLORS && smooth > sharp)
+		return RDP_GFX_CONTENT_IMAGE;
+
+	return RDP_GFX_CONTENT_TEXT;
+}
+
+/* Track update rate of content, returns true while it is in motion. */
+bool
+rdp_motion_update(struct timespec *lastUpdateTime, uint32_t *motionCount,
+		  const struct timespec *now)
+{
+	int64_t interval = timespec_sub_to_msec(now, lastUpdateTime);
+
+	*lastUpdateTime = *now;
+	if (interval < RDP_MOTION_MAX_INTERVAL_MSEC) {
+		if (*motionCount < RDP_MOTION_UPDATE_COUNT)
+			(*motionCount)++;
+	} else {
+		*motionCount = 0;
+	}
+
+	return *motionCount >= RDP_MOTION_UPDATE_COUNT;
+}
+
+static bool
+rdp_gfx_codec_encode_planar(RdpPeerContext *peerCtx,
+			    struct rdp_gfx_codec_context *codec,
+			    BYTE *src, int src_stride,
+			    const pixman_box32_t *rect,
+			    struct rdp_gfx_codec_output *output)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	uint32_t width = rect->x2 - rect->x1;
+	uint32_t height = rect->y2 - rect->y1;
+	BYTE *bits = src + (rect->y1 * src_stride) + (rect->x1 * 4);
+
+	if (!codec->planar_context) {
+		/* alpha is always sent separately with RDPGFX_CODECID_ALPHA. */
+		codec->planar_context =
+			freerdp_bitmap_planar_context_new(PLANAR_FORMAT_HEADER_RLE |
+							  PLANAR_FORMAT_HEADER_NA,
+							  width, height);
+		if (!codec->planar_context) {
+			rdp_debug_error(b, "%s: failed to create planar context\n", __func__);
+			return false;
+		}
+		codec->planar_context_width = width;
+		codec->planar_context_height = height;
+	} else if (codec->planar_context_width < width ||
+		   codec->planar_context_height < height) {
+		/* planar context only grows, keep the largest size seen so far. */
+		width = MAX(width, codec->planar_context_width);
+		height = MAX(height, codec->planar_context_height);
+		if (!freerdp_bitmap_planar_context_reset(codec->planar_context,
+							 width, height)) {
+			rdp_debug_error(b, "%s: failed to reset planar context (%dx%d)\n",
+					__func__, width, height);
+			return false;
+		}
+		codec->planar_context_width = width;
+		codec->planar_context_height = height;
+	}
+
+	output->length = 0;
+	output->data = freerdp_bitmap_compress_planar(codec->planar_context,
+						      bits, PIXEL_FORMAT_BGRA32,
+						      rect->x2 - rect->x1,
+						      rect->y2 - rect->y1,
+						      src_stride, NULL,
+						      &output->length);
+	if (!output->data || output->length == 0) {
+		rdp_debug_error(b, "%s: planar compression failed\n", __func__);
+		free(output->data);
+		output->data = NULL;
+		return false;
+	}
+	output->free_data = true;
+
+	return true;
+}
+
+static bool
+rdp_gfx_codec_encode_progressive(RdpPeerContext *peerCtx,
+				 struct rdp_gfx_codec_context *codec,
+				 BYTE *src, int src_width, int src_height,
+				 int src_stride, const pixman_box32_t *rect,
+				 struct rdp_gfx_codec_output *output)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	REGION16 region;
+	RECTANGLE_16 rect16;
+	BYTE *data = NULL;
+	UINT32 length = 0;
+	int rc;
+
+	if (!codec->progressive_context) {
+		codec->progressive_context = progressive_context_new(TRUE);
+		if (!codec->progressive_context) {
+			rdp_debug_error(b, "%s: failed to create progressive context\n", __func__);
+			return false;
+		}
+	}
+
+	/* progressive tiles are placed in surface coordinates, thus source is
+	   entire surface and damage is given as invalid region. */
+	rect16.left = rect->x1;
+	rect16.top = rect->y1;
+	rect16.right = rect->x2;
+	rect16.bottom = rect->y2;
+	region16_init(&region);
+	region16_union_rect(&region, &region, &rect16);
+	rc = progressive_compress(codec->progressive_context,
+				  src, src_stride * src_height,
+				  PIXEL_FORMAT_BGRA32,
+				  src_width, src_height, src_stride,
+				  &region, &data, &length);
+	region16_uninit(&region);
+	if (rc < 0 || !data || length == 0) {
+		rdp_debug_error(b, "%s: progressive compression failed (%d)\n", __func__, rc);
+		return false;
+	}
+	/* encoded data is owned by progressive context, and it is overwritten
+	   by next compression, so hand a copy to caller. */
+	output->data = xmalloc(length);
+	memcpy(output->data, data, length);
+	output->length = length;
+	output->free_data = true;
+
+	return true;
+}
+
+/* Encode given rect of src image with codecId.
+ *
+ * src is the entire surface image in BGRA32, and rect is in src coordinate.
+ * Uncompressed codec is not handled here since it requires packed bitmap.
+ * codec contexts are not thread safe, thus each thread must use its own.
+ */
+bool
+rdp_gfx_codec_encode(RdpPeerContext *peerCtx, struct rdp_gfx_codec_context *codec,
+		     uint16_t codecId,
+		     BYTE *src, int src_width, int src_height, int src_stride,
+		     const pixman_box32_t *rect, struct rdp_gfx_codec_output *output)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+
+	assert(rect->x1 >= 0 && rect->y1 >= 0);
+	assert(rect->x2 <= src_width && rect->y2 <= src_height);
+
+	output->codecId = codecId;
+	output->data = NULL;
+	output->length = 0;
+	output->free_data = false;
+
+	switch (codecId) {
+	case RDPGFX_CODECID_PLANAR:
+		return rdp_gfx_codec_encode_planar(peerCtx, codec, src, src_stride,
+						   rect, output);
+	case RDPGFX_CODECID_CAPROGRESSIVE:
+		return rdp_gfx_codec_encode_progressive(peerCtx, codec, src,
+							src_width, src_height,
+							src_stride, rect, output);
+	default:
+		rdp_debug_error(b, "%s: unsupported codec 0x%x\n", __func__, codecId);
+		return false;
+	}
+}
+
+int
+rdp_gfx_codec_alpha_max_size(int width, int height, bool hasAlpha)
+{
+	/* 8 = max of ALPHA_RLE_SEGMENT for single alpha value. */
+	if (hasAlpha)
+		return RDP_GFX_ALPHA_CODEC_HEADER_SIZE + MAX(width * height, 8);
+
+	return RDP_GFX_ALPHA_CODEC_HEADER_SIZE + 8;
+}
+
+/* Returns true when every pixel of the BGRA32 bitmap has alpha 0xFF. */
+static bool
+rdp_gfx_codec_alpha_is_opaque(const BYTE *src, int src_stride,
+			      int width, int height)
+{
+	for (int i = 0; i < height; i++, src += src_stride) {
+		const BYTE *pixel = src;
+		int j = 0;
+#if defined(__SSE2__)
+		const __m128i colorMask = _mm_set1_epi32(0x00FFFFFF);
+		__m128i acc = _mm_set1_epi32(-1);
+
+		for (; j + 4 <= width; j += 4, pixel += 16)
+			acc = _mm_and_si128(acc, _mm_loadu_si128((const __m128i *)pixel));
+		acc = _mm_or_si128(acc, colorMask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(acc, _mm_set1_epi32(-1))) != 0xFFFF)
+			return false;
+#elif defined(__ARM_NEON)
+		uint8x16_t acc = vdupq_n_u8(0xFF);
+		uint64x2_t acc64;
+
+		for (; j + 16 <= width; j += 16, pixel += 64)
+			acc = vandq_u8(acc, vld4q_u8(pixel).val[3]);
+		acc64 = vreinterpretq_u64_u8(acc);
+		if ((vgetq_lane_u64(acc64, 0) & vgetq_lane_u64(acc64, 1)) != UINT64_MAX)
+			return false;
+#endif
+		for (; j < width; j++, pixel += 4) {
+			if (pixel[3] != 0xFF) /* 3 = xxxA. */
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Copy alpha channel of BGRA32 bitmap into tightly packed 8bpp plane. */
+static void
+rdp_gfx_codec_alpha_extract(const BYTE *src, int src_stride,
+			    int width, int height, BYTE *dst)
+{
+	for (int i = 0; i < height; i++, src += src_stride) {
+		const BYTE *pixel = src;
+		int j = 0;
+#if defined(__SSE2__)
+		for (; j + 16 <= width; j += 16, pixel += 64, dst += 16) {
+			__m128i a0 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)pixel), 24);
+			__m128i a1 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(pixel + 16)), 24);
+			__m128i a2 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(pixel + 32)), 24);
+			__m128i a3 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(pixel + 48)), 24);
+
+			/* values are 0..255, so neither pack saturates. */
+			_mm_storeu_si128((__m128i *)dst,
+					 _mm_packus_epi16(_mm_packs_epi32(a0, a1),
+							  _mm_packs_epi32(a2, a3)));
+		}
+#elif defined(__ARM_NEON)
+		for (; j + 16 <= width; j += 16, pixel += 64, dst += 16)
+			vst1q_u8(dst, vld4q_u8(pixel).val[3]);
+#endif
+		for (; j < width; j++, pixel += 4, dst++)
+			*dst = pixel[3]; /* 3 = xxxA. */
+	}
+}
+
+/* Write one CLEARCODEC_ALPHA_RLE_SEGMENT, returns new position or -1
+ * when it doesn't fit in dst_size. */
+static int
+rdp_gfx_codec_alpha_rle_segment(BYTE *dst, int pos, int dst_size,
+				BYTE value, uint32_t count)
+{
+	/* 8 = alpha value + 1 + 2 + size in int. */
+	if (pos + 8 > dst_size)
+		return -1;
+
+	dst[pos++] = value;
+	if (count < 0xFF) {
+		dst[pos++] = (BYTE)count;
+	} else if (count < 0xFFFF) {
+		dst[pos++] = 0xFF;
+		dst[pos++] = count & 0xFF;
+		dst[pos++] = (count >> 8) & 0xFF;
+	} else {
+		dst[pos++] = 0xFF;
+		dst[pos++] = 0xFF;
+		dst[pos++] = 0xFF;
+		dst[pos++] = count & 0xFF;
+		dst[pos++] = (count >> 8) & 0xFF;
+		dst[pos++] = (count >> 16) & 0xFF;
+		dst[pos++] = (count >> 24) & 0xFF;
+	}
+
+	return pos;
+}
+
+/* Run-length encode alpha channel of BGRA32 bitmap. Runs continue across
+ * rows. Returns encoded size, or -1 when it would not be smaller than
+ * dst_size, in which case the caller sends the plane uncompressed. */
+static int
+rdp_gfx_codec_alpha_rle(const BYTE *src, int src_stride, int width, int height,
+			BYTE *dst, int dst_size)
+{
+	BYTE value = src[3];
+	uint32_t count = 0;
+	int pos = 0;
+
+	for (int i = 0; i < height; i++, src += src_stride) {
+		const BYTE *pixel = src;
+		int j = 0;
+
+		while (j < width) {
+#if defined(__SSE2__)
+			const __m128i alphaMask = _mm_set1_epi32(0xFF000000);
+			const __m128i ref = _mm_set1_epi32((uint32_t)value << 24);
+
+			/* skip over 4 pixels at a time while inside a run. */
+			while (j + 4 <= width &&
+			       _mm_movemask_epi8(_mm_cmpeq_epi32(
+					_mm_and_si128(_mm_loadu_si128((const __m128i *)pixel), alphaMask),
+					ref)) == 0xFFFF) {
+				j += 4;
+				pixel += 16;
+				count += 4;
+			}
+#elif defined(__ARM_NEON)
+			const uint8x16_t ref = vdupq_n_u8(value);
+
+			/* skip over 16 pixels at a time while inside a run. */
+			while (j + 16 <= width) {
+				uint64x2_t eq = vreinterpretq_u64_u8(
+					vceqq_u8(vld4q_u8(pixel).val[3], ref));
+
+				if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) != UINT64_MAX)
+					break;
+				j += 16;
+				pixel += 64;
+				count += 16;
+			}
+#endif
+			if (j == width)
+				break;
+
+			if (pixel[3] != value) {
+				pos = rdp_gfx_codec_alpha_rle_segment(dst, pos, dst_size,
+								      value, count);
+				if (pos < 0)
+					return -1;
+				value = pixel[3];
+				count = 0;
+			}
+			count++;
+			j++;
+			pixel += 4;
+		}
+	}
+
+	return rdp_gfx_codec_alpha_rle_segment(dst, pos, dst_size, value, count);
+}
+
+/* Build RDPGFX_CODECID_ALPHA payload from BGRA32 bitmap.
+ *
+ * The alpha plane is run-length encoded when that is smaller than the raw
+ * plane, which is the common case for windows with drop shadows or rounded
+ * corners. A fully opaque bitmap collapses to a single segment.
+ *
+ * alpha must be at least rdp_gfx_codec_alpha_max_size() bytes,
+ * returns size of alpha codec payload.
+ */
+int
+rdp_gfx_codec_build_alpha(const BYTE *src, int src_stride, int width, int height,
+			  bool hasAlpha, BYTE *alpha)
+{
+	BYTE *payload = &alpha[RDP_GFX_ALPHA_CODEC_HEADER_SIZE];
+	int bitmapSize = width * height;
+	int size;
+
+	/* set up alpha codec header */
+	alpha[0] = 'L';	/* signature */
+	alpha[1] = 'A';	/* signature */
+	alpha[2] = 1; /* compression: RDP spec indicate this is non-zero value for compressed, but it must be 1.*/
+	alpha[3] = 0; /* compression */
+
+	/* whether buffer has alpha or not, always use alpha to avoid mstsc bug */
+	if (!hasAlpha || rdp_gfx_codec_alpha_is_opaque(src, src_stride, width, height)) {
+		/* CLEARCODEC_ALPHA_RLE_SEGMENT */
+		size = rdp_gfx_codec_alpha_rle_segment(payload, 0, 8, 0xFF, bitmapSize);
+		assert(size > 0);
+		return RDP_GFX_ALPHA_CODEC_HEADER_SIZE + size;
+	}
+
+	size = rdp_gfx_codec_alpha_rle(src, src_stride, width, height,
+				       payload, bitmapSize);
+	if (size > 0)
+		return RDP_GFX_ALPHA_CODEC_HEADER_SIZE + size;
+
+	alpha[2] = 0; /* uncompressed */
+	rdp_gfx_codec_alpha_extract(src, src_stride, width, height, payload);
+
+	return RDP_GFX_ALPHA_CODEC_HEADER_SIZE + bitmapSize;
+}
+
+static uint64_t
+rdp_gfx_codec_row_hash(const BYTE *row, int width)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL; /* FNV-1a offset basis */
+	int length = width * 4;
+	int i = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		uint64_t v;
+
+		memcpy(&v, row + i, sizeof v);
+		hash = (hash ^ v) * 0x100000001b3ULL; /* FNV-1a prime */
+	}
+	if (i < length) {
+		uint32_t v;
+
+		memcpy(&v, row + i, sizeof v);
+		hash = (hash ^ v) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Find longest run of rows where new row i is equal to old row i - dy,
+ * using row hashes first, then verifying pixels. Returns run length and
+ * first row of run in start. */
+static int
+rdp_gfx_codec_scroll_vertical_run(const BYTE *oldBits, int oldStride,
+				  const BYTE *newBits, int newStride,
+				  int width, int height,
+				  const uint64_t *oldHash, const uint64_t *newHash,
+				  int dy, int *start)
+{
+	int best = 0;
+	int run = 0;
+
+	for (int i = MAX(0, dy); i < MIN(height, height + dy); i++) {
+		if (newHash[i] == oldHash[i - dy] &&
+		    memcmp(newBits + i * newStride,
+			   oldBits + (i - dy) * oldStride, width * 4) == 0) {
+			if (++run > best) {
+				best = run;
+				*start = i - run + 1;
+			}
+		} else {
+			run = 0;
+		}
+	}
+
+	return best;
+}
+
+static bool
+rdp_gfx_codec_detect_scroll_vertical(const BYTE *oldBits, int oldStride,
+				     const BYTE *newBits, int newStride,
+				     int width, int height,
+				     int *dy, pixman_box32_t *dest)
+{
+	uint64_t *oldHash = xmalloc(sizeof(uint64_t) * height * 2);
+	uint64_t *newHash = oldHash + height;
+	const int candidatesPerAnchor =
+		RDP_GFX_SCROLL_MAX_CANDIDATES / RDP_GFX_SCROLL_ANCHORS;
+	int candidates[RDP_GFX_SCROLL_MAX_CANDIDATES];
+	int numCandidates = 0;
+	int maxCandidates;
+	int bestRun = 0;
+	int bestStart = 0;
+	int bestDy = 0;
+
+	for (int i = 0; i < height; i++) {
+		oldHash[i] = rdp_gfx_codec_row_hash(oldBits + i * oldStride, width);
+		newHash[i] = rdp_gfx_codec_row_hash(newBits + i * newStride, width);
+	}
+
+	/* rows which differ from the row above are likely unique enough to
+	   locate where they came from, such as a line of text. */
+	for (int k = 1; k <= RDP_GFX_SCROLL_ANCHORS; k++) {
+		int anchor = height * k / (RDP_GFX_SCROLL_ANCHORS + 1);
+
+		while (anchor < height &&
+		       (newHash[anchor] == newHash[anchor - 1] ||
+			newHash[anchor] == oldHash[anchor]))
+			anchor++;
+		if (anchor == height)
+			continue;
+
+		/* search outward from anchor as scroll offsets are mostly small,
+		   and limit candidates per anchor so that a row repeated many
+		   times (such as blank line) does not crowd out other anchors. */
+		maxCandidates = MIN(numCandidates + candidatesPerAnchor,
+				    RDP_GFX_SCROLL_MAX_CANDIDATES);
+		for (int d = 1; d < height && numCandidates < maxCandidates; d++) {
+			for (int sign = -1; sign <= 1; sign += 2) {
+				int j = anchor + d * sign;
+				bool seen = false;
+
+				/* match the row above as well, so anchor lines up
+				   with the same edge in old image. */
+				if (j < 1 || j >= height ||
+				    numCandidates == maxCandidates ||
+				    oldHash[j] != newHash[anchor] ||
+				    oldHash[j - 1] != newHash[anchor - 1])
+					continue;
+				for (int n = 0; n < numCandidates; n++)
+					seen |= candidates[n] == anchor - j;
+				if (!seen)
+					candidates[numCandidates++] = anchor - j;
+			}
+		}
+	}
+
+	for (int n = 0; n < numCandidates; n++) {
+		int start = 0;
+		int run = rdp_gfx_codec_scroll_vertical_run(oldBits, oldStride,
+							    newBits, newStride,
+							    width, height,
+							    oldHash, newHash,
+							    candidates[n], &start);
+		if (run > bestRun) {
+			bestRun = run;
+			bestStart = start;
+			bestDy = candidates[n];
+		}
+	}
+	free(oldHash);
+
+	if (bestRun < height / 2)
+		return false;
+
+	*dy = bestDy;
+	dest->x1 = 0;
+	dest->y1 = bestStart;
+	dest->x2 = width;
+	dest->y2 = bestStart + bestRun;
+
+	return true;
+}
+
+/* Returns true when overlapping part of new row is old row shifted by dx. */
+static bool
+rdp_gfx_codec_scroll_row_match(const BYTE *oldRow, const BYTE *newRow,
+			       int width, int dx)
+{
+	if (dx > 0)
+		return memcmp(newRow + dx * 4, oldRow, (width - dx) * 4) == 0;
+
+	return memcmp(newRow, oldRow - dx * 4, (width + dx) * 4) == 0;
+}
+
+static bool
+rdp_gfx_codec_detect_scroll_horizontal(const BYTE *oldBits, int oldStride,
+				       const BYTE *newBits, int newStride,
+				       int width, int height,
+				       int *dx, pixman_box32_t *dest)
+{
+	const int keyLength = RDP_GFX_SCROLL_KEY_PIXELS * 4;
+	int candidates[RDP_GFX_SCROLL_MAX_CANDIDATES];
+	int numCandidates = 0;
+	int bestRun = 0;
+	int bestStart = 0;
+	int bestDx = 0;
+
+	if (width < RDP_GFX_SCROLL_KEY_PIXELS * 2)
+		return false;
+
+	/* take a few pixels from middle of changed rows as key, and look for
+	   them in the same row of old image. */
+	for (int k = 1; k <= RDP_GFX_SCROLL_ANCHORS; k++) {
+		int row = height * k / (RDP_GFX_SCROLL_ANCHORS + 1);
+		const BYTE *oldRow = oldBits + row * oldStride;
+		const BYTE *newRow = newBits + row * newStride;
+		int key = width / 2;
+
+		if (memcmp(oldRow, newRow, width * 4) == 0)
+			continue;
+
+		/* skip over flat color, it matches anywhere. */
+		while (key + RDP_GFX_SCROLL_KEY_PIXELS < width &&
+		       memcmp(newRow + key * 4, newRow + (key + 1) * 4, 4) == 0)
+			key++;
+		if (key + RDP_GFX_SCROLL_KEY_PIXELS >= width)
+			continue;
+
+		for (int j = 0; j + RDP_GFX_SCROLL_KEY_PIXELS <= width &&
+		     numCandidates < RDP_GFX_SCROLL_MAX_CANDIDATES; j++) {
+			bool seen = false;
+
+			if (j == key ||
+			    memcmp(oldRow + j * 4, newRow + key * 4, keyLength) != 0)
+				continue;
+			for (int n = 0; n < numCandidates; n++)
+				seen |= candidates[n] == key - j;
+			if (!seen)
+				candidates[numCandidates++] = key - j;
+		}
+	}
+
+	for (int n = 0; n < numCandidates; n++) {
+		int shift = candidates[n];
+		int run = 0;
+
+		if (abs(shift) > width / 2)
+			continue;
+
+		for (int i = 0; i < height; i++) {
+			if (rdp_gfx_codec_scroll_row_match(oldBits + i * oldStride,
+							   newBits + i * newStride,
+							   width, shift)) {
+				if (++run > bestRun) {
+					bestRun = run;
+					bestStart = i - run + 1;
+					bestDx = shift;
+				}
+			} else {
+				run = 0;
+			}
+		}
+	}
+
+	if (bestRun < height / 2)
+		return false;
+
+	*dx = bestDx;
+	dest->x1 = MAX(0, bestDx);
+	dest->y1 = bestStart;
+	dest->x2 = width + MIN(0, bestDx);
+	dest->y2 = bestStart + bestRun;
+
+	return true;
+}
+
+/* Detect vertical or horizontal scroll between old and new image of same size.
+ *
+ * When found, returns true with dest, a rect in new image which can be
+ * copied from old image at dest offset by -dx, -dy. dest covers at least
+ * half of image so that SurfaceToSurface pays for itself.
+ */
+bool
+rdp_gfx_codec_detect_scroll(const BYTE *oldBits, int oldStride,
+			    const BYTE *newBits, int newStride,
+			    int width, int height,
+			    int *dx, int *dy, pixman_box32_t *dest)
+{
+	*dx = 0;
+	*dy = 0;
+
+	if (width < RDP_GFX_SCROLL_MIN_SIZE || height < RDP_GFX_SCROLL_MIN_SIZE)
+		return false;
+
+	if (rdp_gfx_codec_detect_scroll_vertical(oldBits, oldStride,
+						 newBits, newStride,
+						 width, height, dy, dest))
+		return true;
+
+	return rdp_gfx_codec_detect_scroll_horizontal(oldBits, oldStride,
+						      newBits, newStride,
+						      width, height, dx, dest);
+}
+
+void
+rdp_gfx_codec_output_release(struct rdp_gfx_codec_output *output)
+{
+	if (output->free_data)
+		free(output->data);
+	output->data = NULL;
+	output->length = 0;
+	output->free_data = false;
+
+	if (output->codecId == RDPGFX_CODECID_AVC420)
+		free_h264_metablock(&output->avc420.meta);
+	memset(&output->avc420, 0, sizeof(output->avc420));
+}
+
+static bool
+rdp_gfx_codec_is_avc420_supported(RdpPeerContext *peerCtx)
+{
+	switch (peerCtx->gfxCapsVersion) {
+	case 0:
+	case RDPGFX_CAPVERSION_8:
+		return false;
+	case RDPGFX_CAPVERSION_81:
+		return peerCtx->gfxCapsFlags & RDPGFX_CAPS_FLAG_AVC420_ENABLED;
+	default:
+		/* version 10 and later support AVC unless explicitly disabled. */
+		return !(peerCtx->gfxCapsFlags & RDPGFX_CAPS_FLAG_AVC_DISABLED);
+	}
+}
+
+/* Track damage rate and area of window to decide whether the window is
+ * better encoded as video stream.
+ *
+ * Returns true when this update should be sent with AVC420, in which case
+ * entire window must be updated. needRefresh is set when window just left
+ * video mode, so entire window should be re-sent with lossless codec.
+ */
+bool
+rdp_gfx_codec_update_avc_state(RdpPeerContext *peerCtx,
+			       struct weston_surface_rail_state *rail_state,
+			       int damage_area, int window_area,
+			       bool *needRefresh)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	int content = rail_state->contentOverride ?
+		      rail_state->contentOverride : rail_state->content;
+	struct timespec now;
+	int64_t interval;
+	bool isLargeUpdate;
+
+	*needRefresh = false;
+
+	/* text would blur as video, whatever its update rate. */
+	if (!b->enable_gfx_avc || peerCtx->avc_unavailable ||
+	    b->gfx_codec != WESTON_RDP_GFX_CODEC_AUTO ||
+	    content == RDP_GFX_CONTENT_TEXT ||
+	    !rdp_gfx_codec_is_avc420_supported(peerCtx)) {
+		if (rail_state->isAvcEnabled) {
+			rail_state->isAvcEnabled = false;
+			*needRefresh = true;
+		}
+		return false;
+	}
+
+	weston_compositor_read_presentation_clock(b->compositor, &now);
+	interval = timespec_sub_to_msec(&now, &rail_state->avc_last_update_time);
+	rail_state->avc_last_update_time = now;
+
+	isLargeUpdate = content == RDP_GFX_CONTENT_VIDEO ||
+			(window_area >= b->gfx_avc_min_area &&
+			 damage_area * 2 >= window_area);
+
+	if (rail_state->isAvcEnabled) {
+		if (isLargeUpdate && interval < RDP_GFX_AVC_LEAVE_MIN_INTERVAL_MSEC)
+			rail_state->avc_small_update_count = 0;
+		else
+			rail_state->avc_small_update_count++;
+
+		if (interval >= RDP_GFX_AVC_LEAVE_MIN_INTERVAL_MSEC ||
+		    rail_state->avc_small_update_count >= RDP_GFX_AVC_LEAVE_UPDATE_COUNT) {
+			rdp_debug(b, "%s: windowId:0x%x leaves AVC420 mode\n",
+				  __func__, rail_state->window_id);
+			rail_state->isAvcEnabled = false;
+			rail_state->avc_large_update_count = 0;
+			rail_state->avc_small_update_count = 0;
+			*needRefresh = true;
+		}
+	} else {
+		if (isLargeUpdate && interval < RDP_GFX_AVC_ENTER_MAX_INTERVAL_MSEC)
+			rail_state->avc_large_update_count++;
+		else
+			rail_state->avc_large_update_count = 0;
+
+		if (rail_state->avc_large_update_count >= RDP_GFX_AVC_ENTER_UPDATE_COUNT) {
+			rdp_debug(b, "%s: windowId:0x%x enters AVC420 mode\n",
+				  __func__, rail_state->window_id);
+			rail_state->isAvcEnabled = true;
+			rail_state->avc_large_update_count = 0;
+			rail_state->avc_small_update_count = 0;
+		}
+	}
+
+	return rail_state->isAvcEnabled;
+}
+
+/* Encode entire window image as AVC420 frame.
+ *
+ * Encoder keeps reference frames, thus its context is per window, and it
+ * must be destroyed by rdp_gfx_codec_avc_destroy() when surface is resized.
+ * Only one frame per window can be in encoding at a time.
+ */
+bool
+rdp_gfx_codec_encode_avc420(RdpPeerContext *peerCtx,
+			    struct weston_surface_rail_state *rail_state,
+			    BYTE *src, int width, int height, int stride,
+			    struct rdp_gfx_codec_output *output)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	H264_CONTEXT *h264 = rail_state->avc_context;
+	INT32 rc;
+
+	output->codecId = RDPGFX_CODECID_AVC420;
+	output->data = NULL;
+	output->length = 0;
+	output->free_data = false;
+	memset(&output->avc420, 0, sizeof(output->avc420));
+
+	if (!h264) {
+		h264 = h264_context_new(TRUE);
+		if (!h264) {
+			/* FreeRDP is built without H.264 encoder, don't try again. */
+			rdp_debug_error(b, "%s: H.264 encoder is not available\n", __func__);
+			peerCtx->avc_unavailable = true;
+			return false;
+		}
+		if (!h264_context_reset(h264, width, height)) {
+			rdp_debug_error(b, "%s: failed to reset H.264 encoder (%dx%d)\n",
+					__func__, width, height);
+			h264_context_free(h264);
+			return false;
+		}
+		rail_state->avc_context = h264;
+	}
+
+#if FREERDP_VERSION_MAJOR >= 3
+	RECTANGLE_16 rect16 = { 0, 0, width, height };
+
+	rc = avc420_compress(h264, src, PIXEL_FORMAT_BGRA32, stride,
+			     width, height, &rect16,
+			     &output->avc420.data, &output->avc420.length,
+			     &output->avc420.meta);
+#else
+	rc = avc420_compress(h264, src, PIXEL_FORMAT_BGRA32, stride,
+			     width, height,
+			     &output->avc420.data, &output->avc420.length,
+			     &output->avc420.meta);
+#endif
+	if (rc < 0 || !output->avc420.data || output->avc420.length == 0) {
+		rdp_debug_error(b, "%s: H.264 compression failed (%d)\n", __func__, rc);
+		free_h264_metablock(&output->avc420.meta);
+		memset(&output->avc420, 0, sizeof(output->avc420));
+		return false;
+	}
+	/* encoded data is owned by H.264 context */
+	output->length = output->avc420.length;
+
+	return true;
+}
+
+void
+rdp_gfx_codec_avc_destroy(struct weston_surface_rail_state *rail_state)
+{
+	if (rail_state->avc_context) {
+		h264_context_free(rail_state->avc_context);
+		rail_state->avc_context = NULL;
+	}
+}
+
+void
+rdp_gfx_codec_context_destroy(struct rdp_gfx_codec_context *codec)
+{
+	if (codec->progressive_context) {
+		progressive_context_free(codec->progressive_context);
+		codec->progressive_context = NULL;
+	}
+
+	if (codec->planar_context) {
+		freerdp_bitmap_planar_context_free(codec->planar_context);
+		codec->planar_context = NULL;
+	}
+	codec->planar_context_width = 0;
+	codec->planar_context_height = 0;
+
+	if (codec->rfx_context) {
+		rfx_context_free(codec->rfx_context);
+		codec->rfx_context = NULL;
+	}
+
+	if (codec->nsc_context) {
+		nsc_context_free(codec->nsc_context);
+		codec->nsc_context = NULL;
+	}
+}
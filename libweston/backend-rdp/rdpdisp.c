@@ -117,7 +117,8 @@ match_any(struct rdp_backend *rdp, rdpMonitor *a, rdpMonitor *b)
 }
 
 static void
-update_head(struct rdp_backend *rdp, struct rdp_head *head, rdpMonitor *config)
+update_head(struct rdp_backend *rdp, struct rdp_head *head, rdpMonitor *config,
+	    int refresh)
 {
 	struct weston_mode mode = {};
 	int scale;
@@ -129,11 +130,13 @@ update_head(struct rdp_backend *rdp, struct rdp_head *head, rdpMonitor *config)
 	if (!match_position(rdp, &head->config, config))
 		changed = true;
 
-	if (!match_dimensions(rdp, &head->config, config)) {
+	if (!match_dimensions(rdp, &head->config, config) ||
+	    head->refresh != refresh) {
+		head->refresh = refresh;
 		mode.flags = WL_OUTPUT_MODE_PREFERRED;
 		mode.width = config->width;
 		mode.height = config->height;
-		mode.refresh = rdp->rdp_monitor_refresh_rate;
+		mode.refresh = refresh;
 		weston_output_mode_set_native(head->base.output,
 					      &mode, scale);
 		changed = true;
@@ -165,7 +168,8 @@ match_heads(struct rdp_backend *rdp, rdpMonitor *config, uint32_t count,
 
 			if (cmp(rdp, &current->config, &config[i])) {
 				*done |= 1 << i;
-				update_head(rdp, current, &config[i]);
+				update_head(rdp, current, &config[i],
+					    rdp_get_monitor_refresh_rate(rdp, i));
 				break;
 			}
 		}
@@ -236,8 +240,12 @@ disp_start_monitor_layout_change(freerdp_peer *client, rdpMonitor *config, UINT3
 					   config[i].height);
 
 		/* Create new heads for any without matches */
-		if (!(done & (1 << i)))
-			rdp_head_create(b->compositor, config[i].is_primary, &config[i]);
+		if (!(done & (1 << i))) {
+			current = rdp_head_create(b->compositor,
+						  config[i].is_primary,
+						  &config[i]);
+			current->refresh = rdp_get_monitor_refresh_rate(b, i);
+		}
 	}
 	peerCtx->desktop_left = desktop.extents.x1;
 	peerCtx->desktop_top = desktop.extents.y1;
@@ -293,6 +301,35 @@ disp_monitor_sanity_check_layout(RdpPeerContext *peerCtx, rdpMonitor *config, ui
 	return true;
 }
 
+bool
+disp_monitor_layout_is_current(struct rdp_backend *b, rdpMonitor *config, uint32_t count)
+{
+	struct weston_head *iter;
+	struct rdp_head *current;
+	uint32_t heads = 0;
+	uint32_t found = 0;
+	uint32_t i;
+
+	wl_list_for_each(iter, &b->compositor->head_list, compositor_link) {
+		current = to_rdp_head(iter);
+		if (!iter->output)
+			return false;
+		heads++;
+
+		for (i = 0; i < count; i++) {
+			if (current->config.is_primary == config[i].is_primary &&
+			    current->config.attributes.desktopScaleFactor ==
+				config[i].attributes.desktopScaleFactor &&
+			    match_exact(b, &current->config, &config[i])) {
+				found++;
+				break;
+			}
+		}
+	}
+
+	return heads == count && found == count;
+}
+
 bool
 handle_adjust_monitor_layout(freerdp_peer *client, int monitor_count, rdpMonitor *monitors)
 {
@@ -0,0 +1,341 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "rdp.h"
+
+#include "shared/xalloc.h"
+
+/* Encoder threads for RDPGFX surface commands.
+ *
+ * Display loop takes snapshot of surfaces (which requires scene graph and
+ * renderer access), then submits jobs here. Jobs are encoded by worker
+ * threads in parallel, and finished jobs are handed back to display loop
+ * strictly in the order of submission, so PDUs are sent in the same order
+ * as they were when everything was done at display loop. Jobs without
+ * encode function (such as EndFrame) are used to keep ordering with
+ * encoded ones.
+ */
+
+struct rdp_encoder_worker {
+	pthread_t thread;
+	struct rdp_encoder *encoder;
+	struct rdp_gfx_codec_context codec;
+};
+
+struct rdp_encoder {
+	RdpPeerContext *peerCtx;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond; /* signaled when job is queued or exiting */
+	pthread_cond_t encoded_cond; /* signaled when job is encoded */
+	struct wl_list job_list; /* all outstanding jobs, in submission order */
+	struct wl_list queue_list; /* jobs waiting for worker */
+	int event_source_fd;
+	struct wl_event_source *event_source;
+	bool exit;
+	int num_workers;
+	struct rdp_encoder_worker *workers;
+};
+
+static void *
+rdp_encoder_worker_thread(void *arg)
+{
+	struct rdp_encoder_worker *worker = arg;
+	struct rdp_encoder *encoder = worker->encoder;
+	struct rdp_encoder_job *job;
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (!encoder->exit) {
+		if (wl_list_empty(&encoder->queue_list)) {
+			pthread_cond_wait(&encoder->queue_cond, &encoder->mutex);
+			continue;
+		}
+
+		job = container_of(encoder->queue_list.next,
+				   struct rdp_encoder_job, queue_link);
+		wl_list_remove(&job->queue_link);
+		wl_list_init(&job->queue_link);
+		pthread_mutex_unlock(&encoder->mutex);
+
+		job->encode(job, &worker->codec);
+
+		pthread_mutex_lock(&encoder->mutex);
+		job->isEncoded = true;
+		pthread_cond_broadcast(&encoder->encoded_cond);
+		eventfd_write(encoder->event_source_fd, 1);
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+/* hand encoded jobs back to caller, stop at first job still in encoding
+   to preserve the order of submission. */
+static void
+rdp_encoder_complete_jobs(struct rdp_encoder *encoder)
+{
+	struct rdp_encoder_job *job;
+
+	assert_compositor_thread(encoder->peerCtx->rdpBackend);
+
+	rdp_output_batch_begin(encoder->peerCtx->rdpBackend);
+	for (;;) {
+		pthread_mutex_lock(&encoder->mutex);
+		if (wl_list_empty(&encoder->job_list)) {
+			pthread_mutex_unlock(&encoder->mutex);
+			break;
+		}
+		job = container_of(encoder->job_list.next,
+				   struct rdp_encoder_job, link);
+		if (!job->isEncoded) {
+			pthread_mutex_unlock(&encoder->mutex);
+			break;
+		}
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&encoder->mutex);
+
+		/* job will be freed by callee. */
+		job->done(false, job);
+	}
+	rdp_output_batch_end(encoder->peerCtx->rdpBackend);
+}
+
+static int
+rdp_encoder_dispatch(int fd, uint32_t mask, void *arg)
+{
+	struct rdp_encoder *encoder = arg;
+	eventfd_t dummy;
+
+	eventfd_read(encoder->event_source_fd, &dummy);
+
+	rdp_encoder_complete_jobs(encoder);
+
+	return 0;
+}
+
+void
+rdp_encoder_submit(RdpPeerContext *peerCtx, struct rdp_encoder_job *job,
+		   rdp_encoder_encode_func_t encode, rdp_encoder_done_func_t done)
+{
+	struct rdp_encoder *encoder = peerCtx->encoder;
+
+	assert_compositor_thread(peerCtx->rdpBackend);
+
+	job->peerCtx = peerCtx;
+	job->encode = encode;
+	job->done = done;
+	job->isEncoded = false;
+	wl_list_init(&job->queue_link);
+
+	if (!encoder) {
+		/* no encoder thread, do everything here. */
+		if (encode)
+			encode(job, &peerCtx->gfx_codec_context);
+		job->isEncoded = true;
+		done(false, job);
+		return;
+	}
+
+	pthread_mutex_lock(&encoder->mutex);
+	wl_list_insert(encoder->job_list.prev, &job->link);
+	if (encode) {
+		wl_list_insert(encoder->queue_list.prev, &job->queue_link);
+		pthread_cond_signal(&encoder->queue_cond);
+	} else {
+		job->isEncoded = true;
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	/* job without encode can be done right away if nothing is ahead. */
+	if (!encode)
+		rdp_encoder_complete_jobs(encoder);
+}
+
+/* Wait all outstanding jobs to be encoded and hand them back.
+ *
+ * This must be called before anything shared with jobs is modified, such as
+ * surface content which is referenced by job, or surface to be deleted.
+ */
+void
+rdp_encoder_flush(RdpPeerContext *peerCtx)
+{
+	struct rdp_encoder *encoder = peerCtx->encoder;
+	struct rdp_encoder_job *job;
+	bool isEncoded;
+
+	if (!encoder)
+		return;
+
+	assert_compositor_thread(peerCtx->rdpBackend);
+
+	pthread_mutex_lock(&encoder->mutex);
+	for (;;) {
+		isEncoded = true;
+		wl_list_for_each(job, &encoder->job_list, link) {
+			if (!job->isEncoded) {
+				isEncoded = false;
+				break;
+			}
+		}
+		if (isEncoded)
+			break;
+		pthread_cond_wait(&encoder->encoded_cond, &encoder->mutex);
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	rdp_encoder_complete_jobs(encoder);
+	assert(wl_list_empty(&encoder->job_list));
+}
+
+/* number of jobs which can be encoded in parallel, 1 without encoder. */
+int
+rdp_encoder_get_num_threads(RdpPeerContext *peerCtx)
+{
+	struct rdp_encoder *encoder = peerCtx->encoder;
+
+	return encoder ? encoder->num_workers : 1;
+}
+
+bool
+rdp_encoder_create(RdpPeerContext *peerCtx, int num_threads)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	struct rdp_encoder *encoder;
+	struct wl_event_loop *loop;
+	int i;
+
+	assert(peerCtx->encoder == NULL);
+
+	if (num_threads <= 0)
+		return true;
+
+	encoder = xzalloc(sizeof *encoder);
+	encoder->peerCtx = peerCtx;
+	wl_list_init(&encoder->job_list);
+	wl_list_init(&encoder->queue_list);
+
+	if (pthread_mutex_init(&encoder->mutex, NULL) != 0) {
+		rdp_debug_error(b, "%s: pthread_mutex_init failed. %s\n", __func__, strerror(errno));
+		goto error_mutex;
+	}
+	pthread_cond_init(&encoder->queue_cond, NULL);
+	pthread_cond_init(&encoder->encoded_cond, NULL);
+
+	encoder->event_source_fd = eventfd(0, EFD_CLOEXEC);
+	if (encoder->event_source_fd == -1) {
+		rdp_debug_error(b, "%s: eventfd failed. %s\n", __func__, strerror(errno));
+		goto error_event_source_fd;
+	}
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	if (!rdp_event_loop_add_fd(loop, encoder->event_source_fd,
+				   WL_EVENT_READABLE, rdp_encoder_dispatch,
+				   encoder, &encoder->event_source))
+		goto error_event_loop_add_fd;
+
+	encoder->workers = xzalloc(num_threads * sizeof(*encoder->workers));
+	for (i = 0; i < num_threads; i++) {
+		struct rdp_encoder_worker *worker = &encoder->workers[i];
+
+		worker->encoder = encoder;
+		if (pthread_create(&worker->thread, NULL,
+				   rdp_encoder_worker_thread, worker) != 0) {
+			rdp_debug_error(b, "%s: pthread_create failed. %s\n", __func__, strerror(errno));
+			break;
+		}
+		encoder->num_workers++;
+	}
+	if (encoder->num_workers == 0) {
+		free(encoder->workers);
+		wl_event_source_remove(encoder->event_source);
+		goto error_event_loop_add_fd;
+	}
+
+	rdp_debug(b, "%s: %d encoder threads\n", __func__, encoder->num_workers);
+
+	peerCtx->encoder = encoder;
+	return true;
+
+error_event_loop_add_fd:
+	close(encoder->event_source_fd);
+
+error_event_source_fd:
+	pthread_cond_destroy(&encoder->encoded_cond);
+	pthread_cond_destroy(&encoder->queue_cond);
+	pthread_mutex_destroy(&encoder->mutex);
+
+error_mutex:
+	free(encoder);
+	return false;
+}
+
+void
+rdp_encoder_destroy(RdpPeerContext *peerCtx)
+{
+	struct rdp_encoder *encoder = peerCtx->encoder;
+	struct rdp_encoder_job *job, *tmp;
+	int i;
+
+	if (!encoder)
+		return;
+
+	assert_compositor_thread(peerCtx->rdpBackend);
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->exit = true;
+	pthread_cond_broadcast(&encoder->queue_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->num_workers; i++) {
+		pthread_join(encoder->workers[i].thread, NULL);
+		rdp_gfx_codec_context_destroy(&encoder->workers[i].codec);
+	}
+	free(encoder->workers);
+
+	/* peer is going away, so outstanding jobs are just freed. */
+	wl_list_for_each_safe(job, tmp, &encoder->job_list, link) {
+		wl_list_remove(&job->link);
+		job->done(true /* freeOnly */, job);
+	}
+
+	wl_event_source_remove(encoder->event_source);
+	close(encoder->event_source_fd);
+	pthread_cond_destroy(&encoder->encoded_cond);
+	pthread_cond_destroy(&encoder->queue_cond);
+	pthread_mutex_destroy(&encoder->mutex);
+	free(encoder);
+
+	peerCtx->encoder = NULL;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "rdp.h"
+
+/* queueDepth values with special meaning in RDPGFX_FRAME_ACKNOWLEDGE_PDU. */
+#define RDP_FRAME_PACER_QUEUE_DEPTH_UNAVAILABLE 0x00000000
+#define RDP_FRAME_PACER_QUEUE_DEPTH_SUSPEND 0xFFFFFFFF
+
+/* frames in flight, RDP_FRAME_PACER_INITIAL_WINDOW is the former fixed limit. */
+#define RDP_FRAME_PACER_MIN_WINDOW 1
+#define RDP_FRAME_PACER_INITIAL_WINDOW 2
+#define RDP_FRAME_PACER_MAX_WINDOW 8
+
+/* ack latency above twice the base latency plus this is congestion. */
+#define RDP_FRAME_PACER_RTT_SLACK_USEC 8000
+
+/* repaint interval is never stretched beyond this. */
+#define RDP_FRAME_PACER_MAX_INTERVAL_MSEC 200
+
+/* below this bandwidth, updates of default quality are sent coarse. */
+#define RDP_LINK_CONSTRAINED_KBPS 10000
+
+void
+rdp_frame_pacer_init(struct rdp_frame_pacer *pacer, bool enabled)
+{
+	memset(pacer, 0, sizeof(*pacer));
+	pacer->enabled = enabled;
+	pacer->window = RDP_FRAME_PACER_INITIAL_WINDOW;
+}
+
+/* Called once frame is handed to FreeRDP, at EndFrame. */
+void
+rdp_frame_pacer_frame_sent(struct rdp_frame_pacer *pacer, uint32_t frameId)
+{
+	struct rdp_frame_pacer_frame *frame =
+		&pacer->frames[frameId % RDP_FRAME_PACER_HISTORY];
+
+	pacer->lastSentFrameId = frameId;
+	if (!pacer->enabled)
+		return;
+
+	frame->frameId = frameId;
+	clock_gettime(CLOCK_MONOTONIC, &frame->sent);
+}
+
+/* Update latency estimate and frame window from client acknowledgement,
+ * returns the ack latency in us or -1 when the ack is not counted.
+ *
+ * This is AIMD as in TCP congestion control: the window grows by one
+ * frame every window worth of acks, and halves at most once per round
+ * trip when client reports its decode queue backing up or when ack
+ * latency grows well beyond the base latency. ackTime is taken with
+ * CLOCK_MONOTONIC when ack is received.
+ */
+int64_t
+rdp_frame_pacer_frame_acked(struct rdp_backend *b,
+			    struct rdp_frame_pacer *pacer,
+			    uint32_t frameId, uint32_t queueDepth,
+			    const struct timespec *ackTime)
+{
+	struct rdp_frame_pacer_frame *frame =
+		&pacer->frames[frameId % RDP_FRAME_PACER_HISTORY];
+	bool isCongested;
+	int64_t rtt;
+
+	if (!pacer->enabled ||
+	    queueDepth == RDP_FRAME_PACER_QUEUE_DEPTH_SUSPEND)
+		return -1;
+
+	/* history is overwritten when acks are far behind, or ack is repeated. */
+	if (frame->frameId != frameId || timespec_is_zero(&frame->sent))
+		return -1;
+
+	rtt = MAX(timespec_sub_to_nsec(ackTime, &frame->sent) / 1000, 0);
+	frame->sent.tv_sec = 0;
+	frame->sent.tv_nsec = 0;
+
+	pacer->queueDepth = queueDepth;
+	if (pacer->srttUsec == 0) {
+		pacer->srttUsec = rtt;
+		pacer->minRttUsec = rtt;
+	} else {
+		pacer->srttUsec += (rtt - pacer->srttUsec) / 8;
+		/* base latency follows slowly when client or route changes. */
+		if (rtt < pacer->minRttUsec)
+			pacer->minRttUsec = rtt;
+		else
+			pacer->minRttUsec += (rtt - pacer->minRttUsec) / 256;
+	}
+
+	isCongested = (queueDepth != RDP_FRAME_PACER_QUEUE_DEPTH_UNAVAILABLE &&
+		       queueDepth > 1) ||
+		      rtt > pacer->minRttUsec * 2 + RDP_FRAME_PACER_RTT_SLACK_USEC;
+	if (isCongested) {
+		/* frames sent before last decrease saw the same congestion. */
+		if ((int32_t)(frameId - pacer->recoveryFrameId) > 0) {
+			pacer->window = MAX(pacer->window / 2,
+					    RDP_FRAME_PACER_MIN_WINDOW);
+			pacer->recoveryFrameId = pacer->lastSentFrameId;
+			pacer->acksInWindow = 0;
+		}
+	} else if (++pacer->acksInWindow >= pacer->window) {
+		pacer->window = MIN(pacer->window + 1, RDP_FRAME_PACER_MAX_WINDOW);
+		pacer->acksInWindow = 0;
+	}
+
+	rdp_debug_verbose(b, "frame pacer: frameId:0x%x rtt:%ldus srtt:%ldus minRtt:%ldus queueDepth:%u congested:%d window:%d\n",
+			  frameId, (long)rtt, (long)pacer->srttUsec,
+			  (long)pacer->minRttUsec, queueDepth, isCongested,
+			  pacer->window);
+
+	return rtt;
+}
+
+bool
+rdp_frame_pacer_can_send(const struct rdp_frame_pacer *pacer,
+			 uint32_t framesInFlight)
+{
+	int window = pacer->window;
+
+	if (pacer->linkWindow)
+		window = MIN(window, pacer->linkWindow);
+	return framesInFlight < (uint32_t)window;
+}
+
+/* Repaint interval spreading a window of frames over one round trip,
+   but not faster than monitor refresh. */
+int
+rdp_frame_pacer_get_interval(const struct rdp_frame_pacer *pacer,
+			     int refresh_msec)
+{
+	int interval;
+
+	if (!pacer->enabled || pacer->srttUsec == 0)
+		return refresh_msec;
+
+	interval = (int)(pacer->srttUsec / pacer->window / 1000);
+	interval = MAX(interval, pacer->linkIntervalMsec);
+	interval = MIN(interval, RDP_FRAME_PACER_MAX_INTERVAL_MSEC);
+	return MAX(interval, refresh_msec);
+}
+
+/* Link limits are applied on top of what acks tell, they are reset to
+   none when link estimate is not available. */
+void
+rdp_frame_pacer_set_link(struct rdp_frame_pacer *pacer,
+			 const struct rdp_link_estimate *link)
+{
+	pacer->linkWindow = rdp_link_get_window(link);
+	pacer->linkIntervalMsec = rdp_link_get_interval(link);
+}
+
+void
+rdp_link_estimate_init(struct rdp_link_estimate *link)
+{
+	memset(link, 0, sizeof(*link));
+}
+
+void
+rdp_link_estimate_rtt(struct rdp_link_estimate *link, int64_t rttUsec)
+{
+	if (link->rttUsec == 0)
+		link->rttUsec = MAX(rttUsec, 1);
+	else
+		link->rttUsec += (rttUsec - link->rttUsec) / 8;
+}
+
+/* byteCount is what client received over timeDeltaMsec, between bandwidth
+   measure start and stop, which is ordinary traffic of the session. Thus
+   it is only counted when enough was sent to tell link capacity, on idle
+   session the former estimate is kept. */
+void
+rdp_link_estimate_bandwidth(struct rdp_link_estimate *link,
+			    uint32_t byteCount, uint32_t timeDeltaMsec)
+{
+	uint32_t kbps;
+
+	if (timeDeltaMsec == 0 || byteCount < 64 * 1024)
+		return;
+
+	kbps = (uint32_t)MIN((uint64_t)byteCount * 8 / timeDeltaMsec, UINT32_MAX);
+	/* measured throughput is a lower bound of capacity, so rises are
+	   taken at once, and drops are followed slowly. */
+	if (kbps >= link->bandwidthKbps)
+		link->bandwidthKbps = kbps;
+	else
+		link->bandwidthKbps -= (link->bandwidthKbps - kbps) / 4;
+}
+
+/* bytesSent is what was sent to peer since last call, over framesSent
+   frames. */
+void
+rdp_link_estimate_frames(struct rdp_link_estimate *link, uint64_t bytesSent)
+{
+	uint64_t frameBytes;
+
+	if (link->framesSent == 0)
+		return;
+
+	frameBytes = bytesSent / link->framesSent;
+	link->framesSent = 0;
+	if (link->frameBytes == 0)
+		link->frameBytes = frameBytes;
+	else
+		link->frameBytes = (link->frameBytes * 7 + frameBytes) / 8;
+}
+
+bool
+rdp_link_is_constrained(const struct rdp_link_estimate *link)
+{
+	return link->bandwidthKbps != 0 &&
+	       link->bandwidthKbps < RDP_LINK_CONSTRAINED_KBPS;
+}
+
+/* time in msec to send an average frame, 0 when unknown. */
+int
+rdp_link_get_interval(const struct rdp_link_estimate *link)
+{
+	if (link->bandwidthKbps == 0 || link->frameBytes == 0)
+		return 0;
+
+	return (int)MIN(link->frameBytes * 8 / link->bandwidthKbps,
+			RDP_FRAME_PACER_MAX_INTERVAL_MSEC);
+}
+
+/* Frames in flight to keep link busy over a round trip, the bandwidth
+   delay product in frames plus the one being sent, 0 when unknown. */
+int
+rdp_link_get_window(const struct rdp_link_estimate *link)
+{
+	uint64_t bdpBytes;
+
+	if (link->bandwidthKbps == 0 || link->rttUsec == 0 ||
+	    link->frameBytes == 0)
+		return 0;
+
+	bdpBytes = (uint64_t)link->bandwidthKbps * link->rttUsec / 8000;
+	return (int)MIN(bdpBytes / link->frameBytes + 1,
+			RDP_FRAME_PACER_MAX_WINDOW);
+}
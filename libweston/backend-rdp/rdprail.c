@@ -27,6 +27,7 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -46,6 +47,7 @@
 
 #include "libweston-internal.h"
 #include "shared/xalloc.h"
+#include "shared/timespec-util.h"
 
 #define RAIL_WINDOW_FULLSCREEN_STYLE (WS_POPUP | WS_VISIBLE | WS_CLIPSIBLINGS | WS_GROUP | WS_TABSTOP)
 #define RAIL_WINDOW_NORMAL_STYLE (RAIL_WINDOW_FULLSCREEN_STYLE | WS_THICKFRAME | WS_CAPTION)
@@ -55,7 +57,9 @@
 
 extern PWtsApiFunctionTable FreeRDP_InitWtsApi(void);
 
+static void rdp_rail_create_window(struct wl_listener *listener, void *data);
 static void rdp_rail_destroy_window(struct wl_listener *listener, void *data);
+static void rdp_rail_discard_parked_window(struct weston_surface_rail_state *rail_state);
 static void rdp_rail_schedule_update_window(struct wl_listener *listener, void *data);
 static void rdp_rail_dump_window_label(struct weston_surface *surface, char *label, uint32_t label_size);
 
@@ -1025,8 +1029,8 @@ rail_client_LanguageImeInfo_callback(bool freeOnly, void *arg)
 							       new_keyboard_layout,
 							       &xkbRuleNames);
 			if (xkbRuleNames.layout) {
-				keymap = xkb_keymap_new_from_names(b->compositor->xkb_context,
-								   &xkbRuleNames, 0);
+				keymap = weston_compositor_get_keymap(b->compositor,
+								      &xkbRuleNames);
 				if (keymap) {
 					weston_seat_update_keymap(peer_ctx->item.seat, keymap);
 					xkb_keymap_unref(keymap);
@@ -1042,9 +1046,8 @@ rail_client_LanguageImeInfo_callback(bool freeOnly, void *arg)
 						settings->KeyboardSubType);
 
                                 rdp_debug_error(b, "%s: Resetting default keymap\n", __func__);
-                                keymap = xkb_keymap_new_from_names(peer_ctx->item.seat->compositor->xkb_context,
-                                                                   &peer_ctx->item.seat->compositor->xkb_names,
-                                                                   0);
+                                keymap = weston_compositor_get_keymap(peer_ctx->item.seat->compositor,
+                                                                      &peer_ctx->item.seat->compositor->xkb_names);
                                 weston_seat_update_keymap(peer_ctx->item.seat, keymap);
                                 xkb_keymap_unref(keymap);
                                 settings->KeyboardLayout = new_keyboard_layout;
@@ -1168,10 +1171,33 @@ rail_grfx_client_caps_advertise(RdpgfxServerContext *context, const RDPGFX_CAPS_
 		}
 	}
 
+	/* choose the highest version known to server */
+	RDPGFX_CAPSET *selectedCapsSet = NULL;
+
+	for (int i = 0; i < capsAdvertise->capsSetCount; i++) {
+		RDPGFX_CAPSET *capsSet = &(capsAdvertise->capsSets[i]);
+
+		if (capsSet->version > RDPGFX_CAPVERSION_106)
+			continue;
+		if (!selectedCapsSet ||
+		    capsSet->version > selectedCapsSet->version)
+			selectedCapsSet = capsSet;
+	}
+	if (!selectedCapsSet)
+		selectedCapsSet = capsAdvertise->capsSets;
+	rdp_debug(b, "Server: GrfxCaps selected version:0x%x flags:0x%x\n",
+		  selectedCapsSet->version, selectedCapsSet->flags);
+	rdp_gfx_codec_set_caps(peer_ctx, selectedCapsSet->version,
+			       selectedCapsSet->flags);
+	if (b->enable_gfx_cache &&
+	    !rdp_gfx_cache_reset(&peer_ctx->gfx_cache, selectedCapsSet->flags))
+		rdp_debug_error(b, "%s: failed to create bitmap cache\n", __func__);
+	rdp_trace_config(b, peer_ctx);
+
 	/* send caps confirm */
 	RDPGFX_CAPS_CONFIRM_PDU capsConfirm = {};
 
-	capsConfirm.capsSet = capsAdvertise->capsSets; /* TODO: choose right one.*/
+	capsConfirm.capsSet = selectedCapsSet;
 	gfx_ctx->CapsConfirm(gfx_ctx, &capsConfirm);
 
 	/* ready to use graphics channel */
@@ -1179,6 +1205,60 @@ rail_grfx_client_caps_advertise(RdpgfxServerContext *context, const RDPGFX_CAPS_
 	return CHANNEL_RC_OK;
 }
 
+struct rdp_rail_cache_import_data {
+	struct rdp_loop_task task_base;
+	freerdp_peer *client;
+	uint16_t count;
+	uint64_t keys[];
+};
+
+static void
+rail_grfx_client_cache_import_offer_callback(bool freeOnly, void *arg)
+{
+	struct rdp_rail_cache_import_data *data = wl_container_of(arg, data, task_base);
+	freerdp_peer *client = data->client;
+	RdpPeerContext *peer_ctx = (RdpPeerContext *)client->context;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	RdpgfxServerContext *gfx_ctx = peer_ctx->rail_grfx_server_context;
+	RDPGFX_CACHE_IMPORT_REPLY_PDU *reply;
+
+	assert_compositor_thread(b);
+
+	if (freeOnly)
+		goto free;
+
+	/* cache keys are content hashes, thus entries persisted by client
+	   from earlier sessions are valid as is. Reply slots must line up
+	   with offered entries, so import stops at first one not taken. */
+	reply = xzalloc(sizeof(*reply));
+	if (b->enable_gfx_cache) {
+		rdp_gfx_cache_begin_update(&peer_ctx->gfx_cache);
+		for (int i = 0; i < data->count; i++) {
+			uint16_t slot = rdp_gfx_cache_add(&peer_ctx->gfx_cache,
+							  data->keys[i],
+							  true /* noEvict */);
+			if (!slot)
+				break;
+			reply->cacheSlots[i] = slot;
+			reply->importedEntriesCount++;
+		}
+	}
+	rdp_debug(b, "Server: GrfxCacheImportReply imported %d of %d entries\n",
+		  reply->importedEntriesCount, data->count);
+	gfx_ctx->CacheImportReply(gfx_ctx, reply);
+	free(reply);
+
+	/* windows kept across reconnect can now refer imported entries. */
+	if (peer_ctx->isCacheImportPending) {
+		peer_ctx->isCacheImportPending = false;
+		wl_event_source_timer_update(peer_ctx->cache_import_timer, 0);
+		weston_compositor_damage_all(b->compositor);
+	}
+
+free:
+	free(data);
+}
+
 static UINT
 rail_grfx_client_cache_import_offer(RdpgfxServerContext *context,
 				    const RDPGFX_CACHE_IMPORT_OFFER_PDU *cacheImportOffer)
@@ -1186,11 +1266,91 @@ rail_grfx_client_cache_import_offer(RdpgfxServerContext *context,
 	freerdp_peer *client = context->custom;
 	RdpPeerContext *peer_ctx = (RdpPeerContext *)client->context;
 	struct rdp_backend *b = peer_ctx->rdpBackend;
-
-	rdp_debug_verbose(b, "Client: GrfxCacheImportOffer\n");
+	struct rdp_rail_cache_import_data *data;
+	uint16_t count = MIN(cacheImportOffer->cacheEntriesCount,
+			     RDPGFX_CACHE_ENTRY_MAX_COUNT);
+
+	rdp_debug_verbose(b, "Client: GrfxCacheImportOffer(count:%d)\n",
+			  cacheImportOffer->cacheEntriesCount);
+
+	assert_channel_thread(b);
+
+	data = xmalloc(sizeof(*data) + sizeof(data->keys[0]) * count);
+	data->client = client;
+	data->count = count;
+	for (int i = 0; i < count; i++)
+		data->keys[i] = cacheImportOffer->cacheEntries[i].cacheKey;
+	rdp_dispatch_task_to_display_loop(peer_ctx,
+					  rail_grfx_client_cache_import_offer_callback,
+					  &data->task_base);
 	return CHANNEL_RC_OK;
 }
 
+struct rdp_rail_frame_ack_data {
+	struct rdp_loop_task task_base;
+	freerdp_peer *client;
+	uint32_t frameId;
+	uint32_t queueDepth;
+	struct timespec ackTime;
+};
+
+static void
+rail_client_frame_ack_callback(bool freeOnly, void *arg)
+{
+	struct rdp_rail_frame_ack_data *data = wl_container_of(arg, data, task_base);
+	freerdp_peer *client = data->client;
+	RdpPeerContext *peer_ctx = (RdpPeerContext *)client->context;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct rdp_frame_pacer *pacer = &peer_ctx->frame_pacer;
+	int64_t rtt;
+
+	assert_compositor_thread(b);
+
+	if (freeOnly)
+		goto free;
+
+	rdp_trace_frame_ack(b, data->frameId, data->queueDepth, &data->ackTime);
+	rtt = rdp_frame_pacer_frame_acked(b, pacer, data->frameId,
+					  data->queueDepth, &data->ackTime);
+	if (rtt >= 0 && !wl_list_empty(&b->compositor->output_list))
+		weston_output_metrics_add(rdp_output_get_primary(b->compositor),
+					  WESTON_OUTPUT_METRIC_CLIENT_ACK, rtt);
+
+	/* repaint waiting for this frame is presented. */
+	rdp_output_frame_acked(b, data->frameId, &data->ackTime);
+
+	/* damage left by skipped repaint is sent once window opens. */
+	if (pacer->isRepaintDeferred &&
+	    rdp_frame_pacer_can_send(pacer, peer_ctx->currentFrameId -
+					    peer_ctx->acknowledgedFrameId)) {
+		pacer->isRepaintDeferred = false;
+		weston_compositor_schedule_repaint(b->compositor);
+	}
+
+free:
+	free(data);
+}
+
+/* Frame acks arrive at channel thread, pacer is updated at display loop. */
+static void
+rail_client_dispatch_frame_ack(RdpPeerContext *peer_ctx, freerdp_peer *client,
+			       uint32_t frameId, uint32_t queueDepth)
+{
+	struct rdp_rail_frame_ack_data *data;
+
+	if (!peer_ctx->frame_pacer.enabled)
+		return;
+
+	data = xzalloc(sizeof(*data));
+	data->client = client;
+	data->frameId = frameId;
+	data->queueDepth = queueDepth;
+	clock_gettime(CLOCK_MONOTONIC, &data->ackTime);
+	rdp_dispatch_task_to_display_loop(peer_ctx,
+					  rail_client_frame_ack_callback,
+					  &data->task_base);
+}
+
 static UINT
 rail_grfx_client_frame_acknowledge(RdpgfxServerContext *context,
 				   const RDPGFX_FRAME_ACKNOWLEDGE_PDU *frameAcknowledge)
@@ -1202,9 +1362,31 @@ rail_grfx_client_frame_acknowledge(RdpgfxServerContext *context,
 			  frameAcknowledge->queueDepth, frameAcknowledge->frameId, frameAcknowledge->totalFramesDecoded);
 	peer_ctx->acknowledgedFrameId = frameAcknowledge->frameId;
 	peer_ctx->isAcknowledgedSuspended = (frameAcknowledge->queueDepth == 0xffffffff);
+	rail_client_dispatch_frame_ack(peer_ctx, client,
+				       frameAcknowledge->frameId,
+				       frameAcknowledge->queueDepth);
 	return CHANNEL_RC_OK;
 }
 
+/* graphics channel driven by display loop, see rdp_backend::loop_channels. */
+static int
+rail_grfx_channel_activity(int fd, uint32_t mask, void *data)
+{
+	RdpPeerContext *peer_ctx = data;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	UINT error;
+
+	error = rdpgfx_server_handle_messages(peer_ctx->rail_grfx_server_context);
+	if (error != CHANNEL_RC_OK && error != ERROR_NO_DATA) {
+		rdp_debug_error(b, "%s: failed to handle messages (0x%x)\n",
+				__func__, error);
+		wl_event_source_remove(peer_ctx->rail_grfx_event_source);
+		peer_ctx->rail_grfx_event_source = NULL;
+	}
+
+	return 0;
+}
+
 #ifdef HAVE_FREERDP_GFXREDIR_H
 static UINT
 gfxredir_client_graphics_redirection_legacy_caps(GfxRedirServerContext *context,
@@ -1320,6 +1502,9 @@ gfxredir_client_present_buffer_ack(GfxRedirServerContext *context,
 			  presentAck->presentId);
 
 	peer_ctx->acknowledgedFrameId = (uint32_t)presentAck->presentId;
+	/* no queue depth in gfxredir, pace by ack latency only. */
+	rail_client_dispatch_frame_ack(peer_ctx, client,
+				       (uint32_t)presentAck->presentId, 0);
 
 	/* when accessing ID outside of wayland display loop thread, aquire lock */
 	rdp_id_manager_lock(&peer_ctx->windowId);
@@ -1361,6 +1546,181 @@ rdp_rail_create_cursor(struct weston_surface *surface)
 				peer_ctx->cursorSurface, surface);
 	peer_ctx->cursorSurface = surface;
 
+	/* hold client buffer past repaint to hash shape from it. */
+	surface->keep_buffer = true;
+
+	return 0;
+}
+
+/* Hash cursor shape straight from client wl_shm buffer, so shapes
+ * already in client's pointer cache need no read back. Returns false
+ * when buffer is not shm, then shape is hashed after read back. */
+static bool
+rdp_rail_cursor_shm_key(struct weston_surface *surface, uint64_t seed,
+			uint64_t *key)
+{
+	struct weston_buffer *buffer = surface->buffer_ref.buffer;
+	struct wl_shm_buffer *shm_buffer;
+	uint32_t format;
+
+	if (!buffer || !buffer->resource)
+		return false;
+
+	shm_buffer = wl_shm_buffer_get(buffer->resource);
+	if (!shm_buffer)
+		return false;
+
+	format = wl_shm_buffer_get_format(shm_buffer);
+	if (format != WL_SHM_FORMAT_ARGB8888 &&
+	    format != WL_SHM_FORMAT_XRGB8888)
+		return false;
+
+	/* shm and read back keys never match, as seed differs. */
+	seed ^= (uint64_t)format << 32 | 1;
+	wl_shm_buffer_begin_access(shm_buffer);
+	*key = rdp_content_hash(wl_shm_buffer_get_data(shm_buffer),
+				wl_shm_buffer_get_stride(shm_buffer),
+				wl_shm_buffer_get_width(shm_buffer) * 4,
+				wl_shm_buffer_get_height(shm_buffer),
+				seed);
+	wl_shm_buffer_end_access(shm_buffer);
+
+	return true;
+}
+
+void
+rdp_rail_send_cursor_hidden(RdpPeerContext *peer_ctx)
+{
+	rdpUpdate *update = peer_ctx->item.peer->context->update;
+	POINTER_SYSTEM_UPDATE pointerSystem = {};
+
+	pointerSystem.type = SYSPTR_NULL;
+	update->BeginPaint(update->context);
+	update->pointer->PointerSystem(update->context,
+				       &pointerSystem);
+	update->EndPaint(update->context);
+}
+
+/* Sends cursor shape of surface at width x height in client space, the
+ * shape is read back only when neither client's pointer cache nor the
+ * compositor's cursor image cache has it. Also used in full desktop
+ * mode, see rdp_peer_update_cursor(). */
+int
+rdp_rail_send_cursor_shape(RdpPeerContext *peer_ctx,
+			   struct weston_surface *surface,
+			   int width, int height,
+			   uint32_t hotSpotX, uint32_t hotSpotY)
+{
+	struct weston_compositor *compositor = surface->compositor;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	rdpUpdate *update = peer_ctx->item.peer->context->update;
+	POINTER_LARGE_UPDATE pointerUpdate = {};
+	POINTER_CACHED_UPDATE pointerCached = {};
+	int cursorBpp = 4; /* Bytes Per Pixel. */
+	int pointerBitsSize = width * cursorBpp * height;
+	BYTE *pointerBits;
+	const struct weston_cursor_image *cached;
+	/* same bits at other size or hotspot is another shape. */
+	uint64_t seed = (uint64_t)width << 48 |
+			(uint64_t)height << 32 |
+			hotSpotX << 16 | hotSpotY;
+	uint64_t key;
+	bool hasKey;
+	int cacheIndex = -1;
+	int content_buffer_width;
+	int content_buffer_height;
+
+	weston_surface_get_content_size(surface,
+					&content_buffer_width,
+					&content_buffer_height);
+
+	hasKey = rdp_rail_cursor_shm_key(surface, seed, &key);
+	if (hasKey)
+		cacheIndex = rdp_slot_cache_lookup(&peer_ctx->cursor_cache,
+						   key);
+	if (cacheIndex >= 0)
+		goto SendCached;
+
+	/* the client lost the shape (e.g. reconnected), but it was
+	   read back before, so send that copy again. */
+	cached = hasKey ?
+		weston_compositor_find_cursor_image_by_key(compositor, key) :
+		NULL;
+	if (cached &&
+	    cached->width == width &&
+	    cached->height == height) {
+		rdp_debug_verbose(b, "CursorUpdate: no read back, shape in compositor cache\n");
+		pointerBits = xmalloc(pointerBitsSize);
+		memcpy(pointerBits, cached->pixels, pointerBitsSize);
+		goto SendLarge;
+	}
+
+	pointerBits = xmalloc(pointerBitsSize);
+
+	/* client expects y-flip image for cursor */
+	if (weston_surface_copy_content(surface,
+					pointerBits,
+					pointerBitsSize, 0,
+					width,
+					height,
+					0, 0,
+					content_buffer_width,
+					content_buffer_height,
+					true /* y-flip */,
+					true /* is_argb */) < 0) {
+		rdp_debug_error(b, "weston_surface_copy_content failed for cursor shape\n");
+		free(pointerBits);
+		return -1;
+	}
+
+	/* not shm, still save bandwidth when client has the shape. */
+	if (!hasKey) {
+		key = rdp_content_hash(pointerBits,
+				       width * cursorBpp,
+				       width * cursorBpp,
+				       height, seed);
+		cacheIndex = rdp_slot_cache_lookup(&peer_ctx->cursor_cache,
+						   key);
+		if (cacheIndex >= 0) {
+			free(pointerBits);
+			goto SendCached;
+		}
+	}
+	weston_compositor_add_cursor_image(compositor, NULL, 0, key,
+					   width, height,
+					   hotSpotX, hotSpotY,
+					   pointerBits);
+
+SendLarge:
+	cacheIndex = rdp_slot_cache_add(&peer_ctx->cursor_cache, key);
+
+	pointerUpdate.xorBpp = cursorBpp * 8; /* Bits Per Pixel. */
+	/* client stores shape at cacheIndex for later PointerCached. */
+	pointerUpdate.cacheIndex = MAX(cacheIndex, 0);
+	pointerUpdate.hotSpotX = hotSpotX;
+	pointerUpdate.hotSpotY = hotSpotY;
+	pointerUpdate.width = width;
+	pointerUpdate.height = height;
+	pointerUpdate.lengthAndMask = 0;
+	pointerUpdate.lengthXorMask = pointerBitsSize;
+	pointerUpdate.xorMaskData = pointerBits;
+	pointerUpdate.andMaskData = NULL;
+
+	rdp_debug_verbose(b, "CursorUpdate(width %d, height %d)\n", width, height);
+	update->BeginPaint(update->context);
+	update->pointer->PointerLarge(update->context, &pointerUpdate);
+	update->EndPaint(update->context);
+
+	free(pointerBits);
+	return 0;
+
+SendCached:
+	pointerCached.cacheIndex = cacheIndex;
+	rdp_debug_verbose(b, "CursorUpdate(cached %d)\n", cacheIndex);
+	update->BeginPaint(update->context);
+	update->pointer->PointerCached(update->context, &pointerCached);
+	update->EndPaint(update->context);
+
 	return 0;
 }
 
@@ -1372,7 +1732,6 @@ rdp_rail_update_cursor(struct weston_surface *surface)
 	struct weston_surface_rail_state *rail_state = surface->backend_state;
 	struct rdp_backend *b = to_rdp_backend(compositor);
 	RdpPeerContext *peer_ctx = (RdpPeerContext *)b->rdp_peer->context;
-	rdpUpdate *update = b->rdp_peer->context->update;
 	BOOL isCursorResized = FALSE;
 	BOOL isCursorHidden = FALSE;
 	BOOL isCursorDamanged = FALSE;
@@ -1411,55 +1770,14 @@ rdp_rail_update_cursor(struct weston_surface *surface)
 	rail_state->clientPos = newClientPos;
 	pixman_region32_clear(&rail_state->damage);
 
-	if (isCursorHidden) {
-		/* hide pointer */
-		POINTER_SYSTEM_UPDATE pointerSystem = {};
-
-		pointerSystem.type = SYSPTR_NULL;
-		update->BeginPaint(update->context);
-		update->pointer->PointerSystem(update->context,
-					       &pointerSystem);
-		update->EndPaint(update->context);
-	} else if (isCursorResized || isCursorDamanged) {
-		POINTER_LARGE_UPDATE pointerUpdate = {};
-		int cursorBpp = 4; /* Bytes Per Pixel. */
-		int pointerBitsSize = newClientPos.width * cursorBpp*newClientPos.height;
-		BYTE *pointerBits = xmalloc(pointerBitsSize);
-
-		/* client expects y-flip image for cursor */
-		if (weston_surface_copy_content(surface,
-						pointerBits,
-						pointerBitsSize, 0,
-						newClientPos.width,
-						newClientPos.height,
-						0, 0,
-						content_buffer_width,
-						content_buffer_height,
-						true /* y-flip */,
-						true /* is_argb */) < 0) {
-			rdp_debug_error(b, "weston_surface_copy_content failed for cursor shape\n");
-			free(pointerBits);
-			return -1;
-		}
-
-		pointerUpdate.xorBpp = cursorBpp * 8; /* Bits Per Pixel. */
-		pointerUpdate.cacheIndex = 0;
-		pointerUpdate.hotSpotX = pointer ? pointer->hotspot_x : 0;
-		pointerUpdate.hotSpotY = pointer ? pointer->hotspot_y : 0;
-		pointerUpdate.width = newClientPos.width;
-		pointerUpdate.height = newClientPos.height;
-		pointerUpdate.lengthAndMask = 0;
-		pointerUpdate.lengthXorMask = pointerBitsSize;
-		pointerUpdate.xorMaskData = pointerBits;
-		pointerUpdate.andMaskData = NULL;
-
-		rdp_debug_verbose(b, "CursorUpdate(width %d, height %d)\n", newPos.width, newPos.height);
-		update->BeginPaint(update->context);
-		update->pointer->PointerLarge(update->context, &pointerUpdate);
-		update->EndPaint(update->context);
-
-		free(pointerBits);
-	}
+	if (isCursorHidden)
+		rdp_rail_send_cursor_hidden(peer_ctx);
+	else if (isCursorResized || isCursorDamanged)
+		return rdp_rail_send_cursor_shape(peer_ctx, surface,
+						  newClientPos.width,
+						  newClientPos.height,
+						  pointer ? pointer->hotspot_x : 0,
+						  pointer ? pointer->hotspot_y : 0);
 
 	return 0;
 }
@@ -1483,6 +1801,355 @@ rdp_showstate_to_string(uint32_t showstate)
 	}
 }
 
+/* Queue window to be visited at next repaint. */
+static void
+rdp_rail_mark_window_dirty(RdpPeerContext *peer_ctx,
+			   struct weston_surface_rail_state *rail_state)
+{
+	if (wl_list_empty(&rail_state->dirty_link))
+		wl_list_insert(peer_ctx->dirty_window_list.prev,
+			       &rail_state->dirty_link);
+}
+
+static void
+rdp_rail_mark_window_dirty_iter(void *element, void *data)
+{
+	struct weston_surface *surface = element;
+
+	rdp_rail_mark_window_dirty(data, surface->backend_state);
+}
+
+/* View of subsurface, placed relative to its parent's view. */
+static struct weston_view *
+rdp_rail_subsurface_view(struct weston_surface *surface)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (view->geometry.parent)
+			return view;
+	}
+
+	return NULL;
+}
+
+static bool
+rdp_rail_buffer_is_plain(struct weston_surface *surface)
+{
+	const struct weston_buffer_viewport *vp = &surface->buffer_viewport;
+
+	return vp->buffer.transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+	       vp->buffer.src_width == wl_fixed_from_int(-1) &&
+	       vp->surface.width == -1;
+}
+
+/* Subsurface is composited into its parent's window content, instead of
+ * being remoted as a window with its own rdpgfx surface, when it is a
+ * direct child of toplevel placed above it, has no subsurface of its own,
+ * shares parent's buffer scale and lies entirely inside parent. */
+static bool
+rdp_rail_subsurface_can_flatten(struct rdp_backend *b,
+				struct weston_surface *surface)
+{
+	struct weston_surface *parent;
+	struct weston_subsurface *sub;
+	struct weston_view *view;
+	bool isAboveParent = false;
+	int x, y;
+
+	if (!b->enable_subsurface_flattening)
+		return false;
+
+#ifdef HAVE_FREERDP_GFXREDIR_H
+	/* shared memory buffer is filled by copy, not composited. */
+	if (b->use_gfxredir)
+		return false;
+#endif /* HAVE_FREERDP_GFXREDIR_H */
+
+	if (!surface->role_name ||
+	    strcmp(surface->role_name, "wl_subsurface") != 0)
+		return false;
+
+	parent = weston_surface_get_main_surface(surface);
+	if (parent == surface)
+		return false;
+
+	/* list is from top, parent's own entry separates above and below. */
+	wl_list_for_each(sub, &parent->subsurface_list, parent_link) {
+		if (sub->surface == parent)
+			break;
+		if (sub->surface == surface) {
+			isAboveParent = true;
+			break;
+		}
+	}
+	if (!isAboveParent)
+		return false;
+
+	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+		if (sub->surface != surface)
+			return false;
+	}
+
+	view = rdp_rail_subsurface_view(surface);
+	if (!view || view->alpha != 1.0f ||
+	    !wl_list_empty(&view->geometry.transformation_list))
+		return false;
+
+	if (!rdp_rail_buffer_is_plain(surface) ||
+	    !rdp_rail_buffer_is_plain(parent) ||
+	    surface->buffer_viewport.buffer.scale !=
+	    parent->buffer_viewport.buffer.scale)
+		return false;
+
+	x = (int)view->geometry.x;
+	y = (int)view->geometry.y;
+	return x == view->geometry.x && y == view->geometry.y &&
+	       x >= 0 && y >= 0 &&
+	       surface->width > 0 && surface->height > 0 &&
+	       x + surface->width <= parent->width &&
+	       y + surface->height <= parent->height;
+}
+
+/* damage is in parent surface coordinate. */
+static void
+rdp_rail_damage_flattened_parent(struct weston_surface *surface,
+				 pixman_region32_t *damage)
+{
+	struct rdp_backend *b = to_rdp_backend(surface->compositor);
+	struct weston_surface *parent = weston_surface_get_main_surface(surface);
+	struct weston_surface_rail_state *parent_rail_state;
+
+	if (parent == surface || !b->rdp_peer ||
+	    !pixman_region32_not_empty(damage))
+		return;
+
+	/* parent window is not created yet or parked, then its content is
+	   sent entirely when it is (re-)created. */
+	parent_rail_state = parent->backend_state;
+	if (!parent_rail_state || !parent_rail_state->isWindowCreated)
+		return;
+
+	pixman_region32_union(&parent_rail_state->damage,
+			      &parent_rail_state->damage, damage);
+	parent_rail_state->contentGeneration++;
+	rdp_rail_mark_window_dirty((RdpPeerContext *)b->rdp_peer->context,
+				   parent_rail_state);
+}
+
+/* Flattened subsurface which is no longer simple, e.g. moved partly out
+ * of its parent or given a transform, is remoted as a window of its own
+ * from then on. Returns true when it was converted. */
+static bool
+rdp_rail_recheck_flattened(struct weston_surface *surface)
+{
+	struct rdp_backend *b = to_rdp_backend(surface->compositor);
+
+	/* unmapped subsurface stays flattened, it has nothing to show. */
+	if (!weston_surface_is_mapped(surface) ||
+	    !rdp_rail_subsurface_view(surface) ||
+	    rdp_rail_subsurface_can_flatten(b, surface))
+		return false;
+
+	rdp_debug_verbose(b, "%s: surface:%p is no longer composited into parent\n",
+			  __func__, surface);
+
+	/* parent is damaged where subsurface was composited. */
+	rdp_rail_destroy_window(NULL, surface);
+	assert(!surface->backend_state);
+
+	rdp_rail_create_window(NULL, surface);
+	return true;
+}
+
+static void
+rdp_rail_schedule_update_flattened(struct wl_listener *listener, void *data)
+{
+	struct weston_surface *surface = data;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+	struct weston_geometry *old = &rail_state->flattenedGeometry;
+	struct weston_geometry geometry = {};
+	struct weston_view *view = rdp_rail_subsurface_view(surface);
+	pixman_region32_t damage;
+
+	if (rdp_rail_recheck_flattened(surface))
+		return;
+
+	if (view && weston_surface_is_mapped(surface)) {
+		geometry.x = (int)view->geometry.x;
+		geometry.y = (int)view->geometry.y;
+		geometry.width = surface->width;
+		geometry.height = surface->height;
+	}
+
+	pixman_region32_init(&damage);
+	if (geometry.x != old->x || geometry.y != old->y ||
+	    geometry.width != old->width || geometry.height != old->height) {
+		/* moved, resized or unmapped, both areas are redrawn. */
+		pixman_region32_union_rect(&damage, &damage,
+					   old->x, old->y,
+					   old->width, old->height);
+		pixman_region32_union_rect(&damage, &damage,
+					   geometry.x, geometry.y,
+					   geometry.width, geometry.height);
+		*old = geometry;
+	} else {
+		pixman_region32_intersect_rect(&damage, &surface->damage,
+					       0, 0,
+					       geometry.width, geometry.height);
+		pixman_region32_translate(&damage, geometry.x, geometry.y);
+	}
+	rdp_rail_damage_flattened_parent(surface, &damage);
+	pixman_region32_fini(&damage);
+}
+
+static void
+rdp_rail_flatten_subsurface(struct weston_surface_rail_state *rail_state)
+{
+	struct weston_surface *surface = rail_state->surface;
+	struct rdp_backend *b = to_rdp_backend(surface->compositor);
+
+	rdp_debug_verbose(b, "%s: surface:%p is composited into parent:%p\n",
+			  __func__, surface,
+			  weston_surface_get_main_surface(surface));
+
+	rail_state->isFlattened = true;
+	rail_state->destroy_listener.notify = rdp_rail_destroy_window;
+	wl_signal_add(&surface->destroy_signal, &rail_state->destroy_listener);
+	rail_state->repaint_listener.notify = rdp_rail_schedule_update_flattened;
+	wl_signal_add(&surface->repaint_signal, &rail_state->repaint_listener);
+
+	/* content of this subsurface is now part of parent's. */
+	rdp_rail_schedule_update_flattened(&rail_state->repaint_listener,
+					   surface);
+}
+
+static void
+rdp_rail_unflatten_subsurface(struct weston_surface_rail_state *rail_state)
+{
+	struct weston_surface *surface = rail_state->surface;
+	struct weston_geometry *old = &rail_state->flattenedGeometry;
+	pixman_region32_t damage;
+
+	pixman_region32_init_rect(&damage, old->x, old->y,
+				  old->width, old->height);
+	rdp_rail_damage_flattened_parent(surface, &damage);
+	pixman_region32_fini(&damage);
+
+	wl_list_remove(&rail_state->repaint_listener.link);
+	rail_state->repaint_listener.notify = NULL;
+	wl_list_remove(&rail_state->destroy_listener.link);
+	rail_state->destroy_listener.notify = NULL;
+	rail_state->isFlattened = false;
+}
+
+/* Composites flattened subsurfaces of window over its content read back
+ * to data, which holds src area of content buffer scaled to width x
+ * height. */
+static void
+rdp_rail_composite_flattened(struct weston_surface *surface,
+			     void *data, int stride,
+			     const pixman_box32_t *src,
+			     int width, int height)
+{
+	struct rdp_backend *b = to_rdp_backend(surface->compositor);
+	int32_t scale = surface->buffer_viewport.buffer.scale;
+	double x_scale = (double)(src->x2 - src->x1) / width;
+	double y_scale = (double)(src->y2 - src->y1) / height;
+	pixman_image_t *target = NULL;
+	struct weston_subsurface *sub;
+
+	/* bottom-most first. */
+	wl_list_for_each_reverse(sub, &surface->subsurface_list, parent_link) {
+		struct weston_surface_rail_state *sub_rail_state =
+			sub->surface->backend_state;
+		struct weston_geometry *geometry;
+		pixman_image_t *image;
+		pixman_transform_t transform;
+		pixman_box32_t box;
+		int content_width, content_height;
+		int box_width, box_height;
+		int dst_x1, dst_y1, dst_x2, dst_y2;
+		void *bits;
+
+		if (!sub_rail_state || !sub_rail_state->isFlattened)
+			continue;
+
+		geometry = &sub_rail_state->flattenedGeometry;
+		if (geometry->width <= 0 || geometry->height <= 0)
+			continue;
+
+		weston_surface_get_content_size(sub->surface,
+						&content_width,
+						&content_height);
+		box.x1 = MAX(geometry->x * scale, src->x1);
+		box.y1 = MAX(geometry->y * scale, src->y1);
+		box.x2 = MIN(geometry->x * scale + content_width, src->x2);
+		box.y2 = MIN(geometry->y * scale + content_height, src->y2);
+		box_width = box.x2 - box.x1;
+		box_height = box.y2 - box.y1;
+		if (box_width <= 0 || box_height <= 0)
+			continue;
+
+		dst_x1 = (int)((box.x1 - src->x1) / x_scale);
+		dst_y1 = (int)((box.y1 - src->y1) / y_scale);
+		dst_x2 = MIN((int)((box.x2 - src->x1) / x_scale + 0.5), width);
+		dst_y2 = MIN((int)((box.y2 - src->y1) / y_scale + 0.5), height);
+		if (dst_x2 <= dst_x1 || dst_y2 <= dst_y1)
+			continue;
+
+		bits = xmalloc(box_width * box_height * 4);
+		if (weston_surface_copy_content(sub->surface, bits,
+						box_width * box_height * 4, 0,
+						box_width, box_height,
+						box.x1 - geometry->x * scale,
+						box.y1 - geometry->y * scale,
+						box_width, box_height,
+						false /* y-flip */,
+						true /* is_argb */) < 0) {
+			rdp_debug_error(b, "weston_surface_copy_content failed for subsurface:%p\n",
+					sub->surface);
+			free(bits);
+			continue;
+		}
+
+		if (!target)
+			target = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+							  width, height,
+							  data, stride);
+		image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+						 box_width, box_height,
+						 bits, box_width * 4);
+		if (target && image) {
+			if (box_width != dst_x2 - dst_x1 ||
+			    box_height != dst_y2 - dst_y1) {
+				/* window is downscaled. */
+				pixman_transform_init_scale(&transform,
+							    pixman_double_to_fixed((double)box_width / (dst_x2 - dst_x1)),
+							    pixman_double_to_fixed((double)box_height / (dst_y2 - dst_y1)));
+				pixman_image_set_transform(image, &transform);
+				pixman_image_set_filter(image, PIXMAN_FILTER_BILINEAR,
+							NULL, 0);
+			}
+			pixman_image_composite32(PIXMAN_OP_OVER,
+						 image, /* src */
+						 NULL, /* mask */
+						 target, /* dest */
+						 0, 0, /* src_x, src_y */
+						 0, 0, /* mask_x, mask_y */
+						 dst_x1, dst_y1, /* dest_x, dest_y */
+						 dst_x2 - dst_x1, /* width */
+						 dst_y2 - dst_y1 /* height */);
+		}
+		if (image)
+			pixman_image_unref(image);
+		free(bits);
+	}
+
+	if (target)
+		pixman_image_unref(target);
+}
+
 static void
 rdp_rail_create_window(struct wl_listener *listener, void *data)
 {
@@ -1551,25 +2218,40 @@ rdp_rail_create_window(struct wl_listener *listener, void *data)
 
 	if (!rail_state) {
 		rail_state = xzalloc(sizeof *rail_state);
+		rail_state->surface = surface;
+		wl_list_init(&rail_state->dirty_link);
+		wl_list_init(&rail_state->parked_link);
 		surface->backend_state = rail_state;
 	} else {
 		/* If ever encouter error for this window, no more attempt to create window */
-		if (rail_state->error)
+		if (rail_state->error || rail_state->isFlattened)
 			return;
 	}
 
-	/* windowId can be assigned only after activation completed */
-	if (!rdp_id_manager_allocate_id(&peer_ctx->windowId, surface, &window_id)) {
-		rail_state->error = true;
-		rdp_debug_error(b, "CreateWindow(): fail to insert windowId (windowId:0x%x surface:%p).\n",
-				window_id, surface);
+	if (rail_state->isParked) {
+		/* same window back for reconnected client, its windowId was
+		   reserved by rdp_rail_unpark_windows(), destroy listener kept. */
+		window_id = rail_state->window_id;
+		rail_state->isParked = false;
+		wl_list_remove(&rail_state->parked_link);
+		wl_list_init(&rail_state->parked_link);
+	} else if (rdp_rail_subsurface_can_flatten(b, surface)) {
+		rdp_rail_flatten_subsurface(rail_state);
 		return;
+	} else {
+		/* windowId can be assigned only after activation completed */
+		if (!rdp_id_manager_allocate_id(&peer_ctx->windowId, surface, &window_id)) {
+			rail_state->error = true;
+			rdp_debug_error(b, "CreateWindow(): fail to insert windowId (windowId:0x%x surface:%p).\n",
+					window_id, surface);
+			return;
+		}
+		rail_state->window_id = window_id;
+		/* Once this surface is inserted to hash table, we want to be notified for destroy */
+		assert(!rail_state->destroy_listener.notify);
+		rail_state->destroy_listener.notify = rdp_rail_destroy_window;
+		wl_signal_add(&surface->destroy_signal, &rail_state->destroy_listener);
 	}
-	rail_state->window_id = window_id;
-	/* Once this surface is inserted to hash table, we want to be notified for destroy */
-	assert(!rail_state->destroy_listener.notify);
-	rail_state->destroy_listener.notify = rdp_rail_destroy_window;
-	wl_signal_add(&surface->destroy_signal, &rail_state->destroy_listener);
 
 	if (surface->role_name != NULL) {
 		if (strcmp(surface->role_name, "wl_subsurface") == 0) {
@@ -1751,6 +2433,8 @@ rdp_rail_create_window(struct wl_listener *listener, void *data)
 	pixman_region32_init_rect(&rail_state->damage, 0, 0,
 				  surface->width_from_buffer,
 				  surface->height_from_buffer);
+	pixman_region32_init(&rail_state->shadow_damage);
+	pixman_region32_init(&rail_state->refineRegion);
 
 	/* as new window created, mark z order dirty */
 	/* TODO: ideally this better be triggered from shell, but shell isn't notified
@@ -1765,22 +2449,156 @@ Exit:
 		rail_state->repaint_listener.notify = rdp_rail_schedule_update_window;
 		wl_signal_add(&surface->repaint_signal,
 			      &rail_state->repaint_listener);
+		rdp_rail_mark_window_dirty(peer_ctx, rail_state);
+#ifdef HAVE_FREERDP_GFXREDIR_H
+		/* hold client buffer past repaint to copy from it directly. */
+		if (b->use_gfxredir && b->enable_shm_direct_copy)
+			surface->keep_buffer = true;
+#endif /* HAVE_FREERDP_GFXREDIR_H */
 	}
 
 	return;
 }
 
 #ifdef HAVE_FREERDP_GFXREDIR_H
+/* gfxredir sections released by windows are kept opened at client, so
+ * a window resized or created later can use them without creating and
+ * mapping file on shared memory mount again. */
+#define RDP_SHARED_MEMORY_POOL_MAX_IDLE_COUNT 16
+#define RDP_SHARED_MEMORY_POOL_MAX_IDLE_SIZE (64 * 1024 * 1024)
+
+/* Sections are sized by classes of 4 steps per power of two, so at most
+   a quarter of section is wasted. */
+static size_t
+rdp_shared_memory_class_size(size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t base = page_size;
+	size_t step;
+
+	while (base * 2 < size)
+		base *= 2;
+	step = MAX(base / 4, page_size);
+	return (size + step - 1) / step * step;
+}
+
 static void
-rdp_destroy_shared_buffer(struct weston_surface *surface)
+rdp_free_shared_memory_section(RdpPeerContext *peer_ctx,
+			       struct rdp_shared_memory_section *section)
 {
-	struct weston_compositor *compositor = surface->compositor;
-	struct weston_surface_rail_state *rail_state = surface->backend_state;
-	struct rdp_backend *b = to_rdp_backend(compositor);
-	RdpPeerContext *peer_ctx = (RdpPeerContext *)b->rdp_peer->context;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
 	GfxRedirServerContext *redir_ctx = peer_ctx->gfxredir_server_context;
 
-	assert(b->use_gfxredir);
+	if (section->pool_id) {
+		GFXREDIR_CLOSE_POOL_PDU closePool = {};
+
+		if (redir_ctx) {
+			closePool.poolId = section->pool_id;
+			redir_ctx->ClosePool(redir_ctx, &closePool);
+		}
+
+		rdp_id_manager_free_id(&peer_ctx->poolId, section->pool_id);
+		section->pool_id = 0;
+	}
+
+	rdp_free_shared_memory(b, &section->shared_memory);
+	free(section);
+}
+
+/* Take idle section of the size class, or create and open new one. */
+static struct rdp_shared_memory_section *
+rdp_get_shared_memory_section(RdpPeerContext *peer_ctx, size_t size)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	GfxRedirServerContext *redir_ctx = peer_ctx->gfxredir_server_context;
+	size_t class_size = rdp_shared_memory_class_size(size);
+	struct rdp_shared_memory_section *section;
+	/* +1 for NULL terminate. */
+	unsigned short section_name[RDP_SHARED_MEMORY_NAME_SIZE + 1];
+	GFXREDIR_OPEN_POOL_PDU open_pool = {};
+
+	wl_list_for_each(section, &peer_ctx->shared_memory_idle_list, link) {
+		if (section->shared_memory.size == class_size) {
+			wl_list_remove(&section->link);
+			peer_ctx->shared_memory_idle_count--;
+			peer_ctx->shared_memory_idle_size -= class_size;
+			return section;
+		}
+	}
+
+	/* name is read from kernel at allocation. */
+	section = xzalloc(sizeof *section);
+	section->shared_memory.size = class_size;
+	if (!rdp_allocate_shared_memory(b, &section->shared_memory))
+		goto error;
+
+	if (!rdp_id_manager_allocate_id(&peer_ctx->poolId, section,
+					&section->pool_id))
+		goto error;
+
+	/* In Linux wchar_t is 4 types, but Windows wants 2 bytes wchar...
+	 * convert to 2 bytes wchar_t.
+	 */
+	for (uint32_t i = 0; i < RDP_SHARED_MEMORY_NAME_SIZE; i++)
+		section_name[i] = section->shared_memory.name[i];
+	section_name[RDP_SHARED_MEMORY_NAME_SIZE] = 0;
+
+	open_pool.poolId = section->pool_id;
+	open_pool.poolSize = class_size;
+	open_pool.sectionNameLength = RDP_SHARED_MEMORY_NAME_SIZE + 1;
+	open_pool.sectionName = section_name;
+	if (redir_ctx->OpenPool(redir_ctx, &open_pool) != 0) {
+		rdp_id_manager_free_id(&peer_ctx->poolId, section->pool_id);
+		section->pool_id = 0;
+		goto error;
+	}
+
+	return section;
+
+error:
+	rdp_free_shared_memory_section(peer_ctx, section);
+	return NULL;
+}
+
+static void
+rdp_put_shared_memory_section(RdpPeerContext *peer_ctx,
+			      struct rdp_shared_memory_section *section)
+{
+	wl_list_insert(&peer_ctx->shared_memory_idle_list, &section->link);
+	peer_ctx->shared_memory_idle_count++;
+	peer_ctx->shared_memory_idle_size += section->shared_memory.size;
+
+	/* close least recently released ones beyond the limits. */
+	while (peer_ctx->shared_memory_idle_count > RDP_SHARED_MEMORY_POOL_MAX_IDLE_COUNT ||
+	       peer_ctx->shared_memory_idle_size > RDP_SHARED_MEMORY_POOL_MAX_IDLE_SIZE) {
+		section = wl_container_of(peer_ctx->shared_memory_idle_list.prev,
+					  section, link);
+		wl_list_remove(&section->link);
+		peer_ctx->shared_memory_idle_count--;
+		peer_ctx->shared_memory_idle_size -= section->shared_memory.size;
+		rdp_free_shared_memory_section(peer_ctx, section);
+	}
+}
+
+static void
+rdp_destroy_shared_memory_pool(RdpPeerContext *peer_ctx)
+{
+	struct rdp_shared_memory_section *section, *tmp;
+
+	wl_list_for_each_safe(section, tmp, &peer_ctx->shared_memory_idle_list, link) {
+		wl_list_remove(&section->link);
+		rdp_free_shared_memory_section(peer_ctx, section);
+	}
+	peer_ctx->shared_memory_idle_count = 0;
+	peer_ctx->shared_memory_idle_size = 0;
+}
+
+/* Destroy buffer at client, section stays with window. */
+static void
+rdp_destroy_shared_buffer_id(RdpPeerContext *peer_ctx,
+			     struct weston_surface_rail_state *rail_state)
+{
+	GfxRedirServerContext *redir_ctx = peer_ctx->gfxredir_server_context;
 
 	if (rail_state->buffer_id) {
 		GFXREDIR_DESTROY_BUFFER_PDU destroyBuffer = {};
@@ -1793,19 +2611,141 @@ rdp_destroy_shared_buffer(struct weston_surface *surface)
 		rail_state->buffer_id = 0;
 	}
 
-	if (rail_state->pool_id) {
-		GFXREDIR_CLOSE_POOL_PDU closePool = {};
+	rail_state->surfaceBuffer = NULL;
+}
 
-		closePool.poolId = rail_state->pool_id;
-		redir_ctx->ClosePool(redir_ctx, &closePool);
+static void
+rdp_destroy_shared_buffer(struct weston_surface *surface)
+{
+	struct weston_compositor *compositor = surface->compositor;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+	struct rdp_backend *b = to_rdp_backend(compositor);
+	RdpPeerContext *peer_ctx = (RdpPeerContext *)b->rdp_peer->context;
+
+	assert(b->use_gfxredir);
 
-		rdp_id_manager_free_id(&peer_ctx->poolId, rail_state->pool_id);
-		rail_state->pool_id = 0;
+	rdp_destroy_shared_buffer_id(peer_ctx, rail_state);
+
+	if (rail_state->shared_memory_section) {
+		rdp_put_shared_memory_section(peer_ctx,
+					      rail_state->shared_memory_section);
+		rail_state->shared_memory_section = NULL;
 	}
+	rail_state->pool_id = 0;
+}
+
+/* Copy damage straight from client wl_shm buffer into shared section,
+ * instead of reading it back from renderer. Content coordinate is
+ * buffer coordinate, as in surface_copy_content. Returns false when
+ * buffer can't be copied as is, then caller falls back to renderer.
+ */
+static bool
+rdp_copy_shm_content(struct weston_surface *surface,
+		     BYTE *dst, int dst_stride,
+		     int x, int y, int width, int height)
+{
+	struct weston_buffer *buffer = surface->buffer_ref.buffer;
+	struct wl_shm_buffer *shm_buffer;
+	const BYTE *src;
+	uint32_t format;
+	int src_stride;
 
-	rdp_free_shared_memory(b, &rail_state->shared_memory);
+	if (!buffer || !buffer->resource)
+		return false;
 
-	rail_state->surfaceBuffer = NULL;
+	shm_buffer = wl_shm_buffer_get(buffer->resource);
+	if (!shm_buffer)
+		return false;
+
+	/* both are same layout as PIXMAN_a8r8g8b8 of renderer copy. */
+	format = wl_shm_buffer_get_format(shm_buffer);
+	if (format != WL_SHM_FORMAT_ARGB8888 &&
+	    format != WL_SHM_FORMAT_XRGB8888)
+		return false;
+
+	if (x < 0 || y < 0 ||
+	    x + width > wl_shm_buffer_get_width(shm_buffer) ||
+	    y + height > wl_shm_buffer_get_height(shm_buffer))
+		return false;
+
+	src_stride = wl_shm_buffer_get_stride(shm_buffer);
+	wl_shm_buffer_begin_access(shm_buffer);
+	src = (const BYTE *)wl_shm_buffer_get_data(shm_buffer) +
+	      y * src_stride + x * 4;
+	for (int i = 0; i < height; i++) {
+		if (format == WL_SHM_FORMAT_ARGB8888) {
+			memcpy(dst, src, width * 4);
+		} else {
+			const uint32_t *s = (const uint32_t *)src;
+			uint32_t *d = (uint32_t *)dst;
+
+			/* X channel is undefined, make it opaque. */
+			for (int j = 0; j < width; j++)
+				d[j] = s[j] | 0xff000000;
+		}
+		src += src_stride;
+		dst += dst_stride;
+	}
+	wl_shm_buffer_end_access(shm_buffer);
+
+	return true;
+}
+
+/* Create buffer for window on section of the size class, section is
+   kept as is when window is resized within its class. */
+static bool
+rdp_create_shared_buffer(struct weston_surface *surface,
+			 int width, int height, int stride, size_t size)
+{
+	struct weston_compositor *compositor = surface->compositor;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+	struct rdp_backend *b = to_rdp_backend(compositor);
+	RdpPeerContext *peer_ctx = (RdpPeerContext *)b->rdp_peer->context;
+	GfxRedirServerContext *redir_ctx = peer_ctx->gfxredir_server_context;
+	struct rdp_shared_memory_section *section = rail_state->shared_memory_section;
+	GFXREDIR_CREATE_BUFFER_PDU create_buffer = {};
+	uint32_t new_buffer_id = 0;
+
+	assert(b->use_gfxredir);
+	assert(rail_state->buffer_id == 0);
+
+	if (section &&
+	    section->shared_memory.size != rdp_shared_memory_class_size(size)) {
+		rdp_put_shared_memory_section(peer_ctx, section);
+		section = NULL;
+	}
+	if (!section) {
+		section = rdp_get_shared_memory_section(peer_ctx, size);
+		if (!section)
+			goto error;
+	}
+	rail_state->shared_memory_section = section;
+	rail_state->pool_id = section->pool_id;
+
+	if (!rdp_id_manager_allocate_id(&peer_ctx->bufferId, (void *)surface, &new_buffer_id))
+		goto error;
+
+	create_buffer.poolId = section->pool_id;
+	create_buffer.bufferId = new_buffer_id;
+	create_buffer.offset = 0;
+	create_buffer.stride = stride;
+	create_buffer.width = width;
+	create_buffer.height = height;
+	create_buffer.format = GFXREDIR_BUFFER_PIXEL_FORMAT_ARGB_8888;
+	if (redir_ctx->CreateBuffer(redir_ctx, &create_buffer) != 0) {
+		rdp_id_manager_free_id(&peer_ctx->bufferId, new_buffer_id);
+		goto error;
+	}
+
+	rail_state->surfaceBuffer = section->shared_memory.addr;
+	rail_state->buffer_id = create_buffer.bufferId;
+	rail_state->bufferWidth = width;
+	rail_state->bufferHeight = height;
+	return true;
+
+error:
+	rdp_destroy_shared_buffer(surface);
+	return false;
 }
 #endif /* HAVE_FREERDP_GFXREDIR_H */
 
@@ -1826,6 +2766,16 @@ rdp_rail_destroy_window(struct wl_listener *listener, void *data)
 	if (!rail_state)
 		return;
 
+	if (rail_state->isParked) {
+		rdp_rail_discard_parked_window(rail_state);
+		return;
+	}
+
+	if (rail_state->isFlattened) {
+		rdp_rail_unflatten_subsurface(rail_state);
+		goto Exit;
+	}
+
 	window_id = rail_state->window_id;
 	if (!window_id)
 		goto Exit;
@@ -1846,8 +2796,12 @@ rdp_rail_destroy_window(struct wl_listener *listener, void *data)
 		if (peer_ctx->cursorSurface == surface)
 			peer_ctx->cursorSurface = NULL;
 		rail_state->isCursor = false;
+		surface->keep_buffer = false;
 	} else {
 		if (rail_state->isWindowCreated) {
+			/* outstanding surface commands may refer this window. */
+			rdp_encoder_flush(peer_ctx);
+
 			if (rail_state->surface_id || rail_state->buffer_id) {
 				/* When update is pending, need to wait reply from client */
 				/* TODO: Defer destroy to FreeRDP callback ? */
@@ -1896,10 +2850,16 @@ rdp_rail_destroy_window(struct wl_listener *listener, void *data)
 						       rail_state->surface_id);
 				rail_state->surface_id = 0;
 			}
+			rdp_gfx_codec_avc_destroy(rail_state);
+			rdp_staging_buffer_release(&rail_state->staging_damage);
+			rdp_staging_buffer_release(&rail_state->staging_alpha);
+			rdp_staging_buffer_release(&rail_state->staging_surface);
 			rail_state->isWindowCreated = FALSE;
 		}
 	}
 	pixman_region32_fini(&rail_state->damage);
+	pixman_region32_fini(&rail_state->shadow_damage);
+	pixman_region32_fini(&rail_state->refineRegion);
 
 	rdp_id_manager_free_id(&peer_ctx->windowId, window_id);
 	rail_state->window_id = 0;
@@ -1920,7 +2880,15 @@ rdp_rail_destroy_window(struct wl_listener *listener, void *data)
 		rail_state->destroy_listener.notify = NULL;
 	}
 
+#ifdef HAVE_FREERDP_GFXREDIR_H
+	if (b->use_gfxredir && b->enable_shm_direct_copy)
+		surface->keep_buffer = false;
+#endif /* HAVE_FREERDP_GFXREDIR_H */
+
 Exit:
+	wl_list_remove(&rail_state->dirty_link);
+	rdp_tile_hashes_reset(&rail_state->tileHashes);
+	free(rail_state->title);
 	free(rail_state);
 	surface->backend_state = NULL;
 
@@ -1934,6 +2902,7 @@ rdp_rail_schedule_update_window(struct wl_listener *listener, void *data)
 	struct weston_compositor *compositor = surface->compositor;
 	struct rdp_backend *b = to_rdp_backend(compositor);
 	struct weston_surface_rail_state *rail_state = surface->backend_state;
+	struct weston_subsurface *sub;
 	uint32_t window_id;
 
 	if (!rail_state || rail_state->error)
@@ -1945,39 +2914,338 @@ rdp_rail_schedule_update_window(struct wl_listener *listener, void *data)
 
 	assert_compositor_thread(b);
 
+	/* resize or transform of parent may leave its flattened
+	   subsurfaces no longer simple. */
+	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+		struct weston_surface_rail_state *sub_rail_state =
+			sub->surface->backend_state;
+
+		if (sub_rail_state && sub_rail_state->isFlattened)
+			rdp_rail_recheck_flattened(sub->surface);
+	}
+
+	rdp_rail_mark_window_dirty((RdpPeerContext *)b->rdp_peer->context,
+				   rail_state);
+
 	/* negative width/height is not allowed */
 	if (surface->width < 0 || surface->height < 0) {
 		rdp_debug_error(b, "surface width and height are negative\n");
 		return;
 	}
 
-	/* TODO: what width or hight 0 means? should window be hidden? */
-	if (surface->width == 0 || surface->height == 0) {
-		rdp_debug_verbose(b, "surface width and height are zero WindowId:0x%x (%dx%d)\n",
-				  rail_state->window_id, surface->width, surface->height);
-		return;
-	}
+	/* TODO: what width or hight 0 means? should window be hidden? */
+	if (surface->width == 0 || surface->height == 0) {
+		rdp_debug_verbose(b, "surface width and height are zero WindowId:0x%x (%dx%d)\n",
+				  rail_state->window_id, surface->width, surface->height);
+		return;
+	}
+
+	if (!pixman_region32_union(&rail_state->damage,
+				   &rail_state->damage,
+				   &surface->damage)) {
+		/* if union failed, make entire size of bufer based on current buffer */
+		pixman_region32_clear(&rail_state->damage);
+		pixman_region32_init_rect(&rail_state->damage, 0, 0,
+					  surface->width_from_buffer,
+					  surface->height_from_buffer);
+	}
+	if (pixman_region32_not_empty(&surface->damage))
+		rail_state->contentGeneration++;
+
+	return;
+}
+
+/* Window orders generated during a repaint are collected into a single
+ * update, ended and drained once by rdp_rail_window_orders_end(), or
+ * earlier by rdp_rail_window_orders_flush() when other PDUs must not
+ * overtake them. Outside of a batch each order is sent in its own update. */
+static void
+rdp_rail_window_orders_begin(RdpPeerContext *peer_ctx)
+{
+	peer_ctx->is_window_orders_batched = true;
+}
+
+static rdpUpdate *
+rdp_rail_window_orders_prepare(RdpPeerContext *peer_ctx)
+{
+	rdpUpdate *update = peer_ctx->rdpBackend->rdp_peer->context->update;
+
+	if (!peer_ctx->is_window_orders_open) {
+		update->BeginPaint(update->context);
+		peer_ctx->is_window_orders_open = true;
+	}
+
+	return update;
+}
+
+static void
+rdp_rail_window_orders_done(RdpPeerContext *peer_ctx)
+{
+	rdpUpdate *update = peer_ctx->rdpBackend->rdp_peer->context->update;
+
+	if (peer_ctx->is_window_orders_batched)
+		return;
+
+	update->EndPaint(update->context);
+	peer_ctx->is_window_orders_open = false;
+}
+
+static void
+rdp_rail_window_orders_flush(RdpPeerContext *peer_ctx)
+{
+	freerdp_peer *client = peer_ctx->rdpBackend->rdp_peer;
+
+	if (!peer_ctx->is_window_orders_open)
+		return;
+
+	client->context->update->EndPaint(client->context);
+	peer_ctx->is_window_orders_open = false;
+	client->DrainOutputBuffer(client);
+}
+
+static void
+rdp_rail_window_orders_end(RdpPeerContext *peer_ctx)
+{
+	rdp_rail_window_orders_flush(peer_ctx);
+	peer_ctx->is_window_orders_batched = false;
+}
+
+struct update_window_iter_data {
+	uint32_t output_id;
+	uint32_t startedFrameId;
+	BOOL needEndFrame;
+	BOOL isUpdatePending;
+	/* set by rdp_rail_update_window for the window just visited */
+	BOOL isContentDeferred;
+};
+
+/* Whether all shown views of the window were fully covered by other
+ * windows at this repaint (see weston_view::occluded). */
+static bool
+rdp_rail_window_is_occluded(struct weston_surface *surface)
+{
+	struct weston_view *view;
+	bool occluded = false;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		/* only views in weston_compositor::view_list are shown */
+		if (wl_list_empty(&view->link))
+			continue;
+		if (!view->occluded)
+			return false;
+		occluded = true;
+	}
+
+	return occluded;
+}
+
+/* Whether the client said, by SuppressOutput, that the window's area on
+ * its desktop is not shown at all. */
+static bool
+rdp_rail_window_is_suppressed(RdpPeerContext *peer_ctx,
+			      struct weston_surface_rail_state *rail_state)
+{
+	const struct weston_rdp_rail_window_pos *pos = &rail_state->clientPos;
+	const pixman_box32_t *area = &peer_ctx->output_area;
+
+	if (!(peer_ctx->item.flags & RDP_PEER_OUTPUT_ENABLED))
+		return true;
+
+	if (!peer_ctx->is_output_area_set || !pos->width || !pos->height)
+		return false;
+
+	return pos->x >= area->x2 || pos->y >= area->y2 ||
+	       pos->x + (int32_t)pos->width <= area->x1 ||
+	       pos->y + (int32_t)pos->height <= area->y1;
+}
+
+static void
+rdp_rail_preview_refresh_iter(void *element, void *data)
+{
+	struct weston_surface *surface = element;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+
+	if (pixman_region32_not_empty(&rail_state->damage)) {
+		rail_state->isPreviewRefreshDue = true;
+		rdp_rail_mark_window_dirty(data, rail_state);
+	}
+}
+
+static int
+rdp_rail_preview_refresh_timer_func(void *arg)
+{
+	RdpPeerContext *peer_ctx = arg;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+
+	peer_ctx->is_preview_refresh_armed = false;
+	rdp_id_manager_for_each(&peer_ctx->windowId,
+				rdp_rail_preview_refresh_iter, peer_ctx);
+	weston_compositor_schedule_repaint(b->compositor);
+
+	return 0;
+}
+
+/* Content held back for minimized or covered windows is sent at most
+ * once per preview_refresh_interval, 0 holds it until window is shown. */
+static void
+rdp_rail_schedule_preview_refresh(RdpPeerContext *peer_ctx)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct wl_event_loop *loop;
+
+	if (!b->preview_refresh_interval || peer_ctx->is_preview_refresh_armed)
+		return;
+
+	if (!peer_ctx->preview_refresh_timer) {
+		loop = wl_display_get_event_loop(b->compositor->wl_display);
+		peer_ctx->preview_refresh_timer =
+			wl_event_loop_add_timer(loop,
+						rdp_rail_preview_refresh_timer_func,
+						peer_ctx);
+		if (!peer_ctx->preview_refresh_timer)
+			return;
+	}
+	wl_event_source_timer_update(peer_ctx->preview_refresh_timer,
+				     b->preview_refresh_interval);
+	peer_ctx->is_preview_refresh_armed = true;
+}
+
+/* Region of the window, in surface coordinates, covered by opaque windows
+ * above it at this repaint (see weston_view::clip). Returns false when
+ * that can't be told, such as for transformed or multiple views. */
+static bool
+rdp_rail_window_get_hidden_region(struct weston_surface *surface,
+				  pixman_region32_t *hidden)
+{
+	struct weston_view *view, *shown = NULL;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		/* only views in weston_compositor::view_list are shown */
+		if (wl_list_empty(&view->link))
+			continue;
+		if (shown)
+			return false;
+		shown = view;
+	}
+
+	if (!shown || shown->transform.enabled)
+		return false;
+
+	pixman_region32_copy(hidden, &shown->clip);
+	pixman_region32_translate(hidden, -shown->geometry.x,
+				  -shown->geometry.y);
+
+	return true;
+}
+
+/* Build damage of job from surface damage, scaled to buffer and placed
+ * in surface coordinate, clipped to job->rect. */
+static void
+rdp_rail_surface_command_init_damage(struct weston_surface *surface,
+				     struct rdp_rail_surface_command_job *job,
+				     pixman_region32_t *damage,
+				     const struct weston_geometry *geometry,
+				     int buffer_width, int buffer_height)
+{
+	pixman_box32_t *rects;
+	int nrects;
+
+	pixman_region32_init(&job->damage);
+	rects = pixman_region32_rectangles(damage, &nrects);
+	for (int i = 0; i < nrects; i++) {
+		pixman_box32_t box = rects[i];
+
+		rdp_matrix_transform_position(&surface->surface_to_buffer_matrix,
+					      &box.x1, &box.y1);
+		rdp_matrix_transform_position(&surface->surface_to_buffer_matrix,
+					      &box.x2, &box.y2);
+		box.x1 -= geometry->x;
+		box.y1 -= geometry->y;
+		box.x2 -= geometry->x;
+		box.y2 -= geometry->y;
+		rdp_rail_scale_box(&box, buffer_width, buffer_height,
+				   job->surface_width, job->surface_height);
+		pixman_region32_union_rect(&job->damage, &job->damage,
+					   box.x1, box.y1,
+					   box.x2 - box.x1, box.y2 - box.y1);
+	}
+	pixman_region32_intersect_rect(&job->damage, &job->damage,
+				       job->rect.x1, job->rect.y1,
+				       job->rect.x2 - job->rect.x1,
+				       job->rect.y2 - job->rect.y1);
+}
+
+static int
+rdp_rail_surface_align_size(int size)
+{
+	return (size + RDP_RAIL_SURFACE_SIZE_ALIGN - 1) &
+	       ~(RDP_RAIL_SURFACE_SIZE_ALIGN - 1);
+}
+
+/* A window being resized keeps its RDPGFX surface, and maps the part of
+ * it its new size takes, until it outgrows the surface or shrinks well
+ * below it. */
+static bool
+rdp_rail_surface_fits(struct weston_surface_rail_state *rail_state,
+		      int width, int height)
+{
+	return width <= rail_state->surfaceWidth &&
+	       height <= rail_state->surfaceHeight &&
+	       rail_state->surfaceWidth - rdp_rail_surface_align_size(width) <=
+		       RDP_RAIL_SURFACE_SIZE_ALIGN &&
+	       rail_state->surfaceHeight - rdp_rail_surface_align_size(height) <=
+		       RDP_RAIL_SURFACE_SIZE_ALIGN;
+}
+
+/* Content type of window set by rail_config.gfx_content_overrides,
+ * "app_id=type,..." where type is text, image or video. */
+static enum rdp_gfx_content
+rdp_rail_get_content_override(struct rdp_backend *b,
+			      struct weston_surface *surface)
+{
+	const struct weston_rdprail_shell_api *api = b->rdprail_shell_api;
+	const char *s = b->gfx_content_overrides;
+	char appId[520] = {};
+	char imageName[520] = {};
+	size_t len;
+
+	if (!s || !*s || !api || !api->get_window_app_id)
+		return RDP_GFX_CONTENT_UNKNOWN;
+
+	api->get_window_app_id(b->rdprail_shell_context, surface,
+			       &appId[0], sizeof(appId),
+			       &imageName[0], sizeof(imageName));
+	len = strlen(appId);
+	if (!len)
+		return RDP_GFX_CONTENT_UNKNOWN;
 
-	if (!pixman_region32_union(&rail_state->damage,
-				   &rail_state->damage,
-				   &surface->damage)) {
-		/* if union failed, make entire size of bufer based on current buffer */
-		pixman_region32_clear(&rail_state->damage);
-		pixman_region32_init_rect(&rail_state->damage, 0, 0,
-					  surface->width_from_buffer,
-					  surface->height_from_buffer);
+	while (s && *s) {
+		const char *type = strchr(s, '=');
+		size_t typeLen;
+
+		if (!type)
+			break;
+		type++;
+		typeLen = strcspn(type, ",");
+		if ((size_t)(type - 1 - s) == len && strncmp(s, appId, len) == 0) {
+			if (typeLen == 4 && strncmp(type, "text", 4) == 0)
+				return RDP_GFX_CONTENT_TEXT;
+			if (typeLen == 5 && strncmp(type, "image", 5) == 0)
+				return RDP_GFX_CONTENT_IMAGE;
+			if (typeLen == 5 && strncmp(type, "video", 5) == 0)
+				return RDP_GFX_CONTENT_VIDEO;
+			rdp_debug_error(b, "invalid content override \"%.*s\" for app_id:%s\n",
+					(int)typeLen, type, appId);
+			break;
+		}
+		s = strchr(type, ',');
+		if (s)
+			s++;
 	}
 
-	return;
+	return RDP_GFX_CONTENT_UNKNOWN;
 }
 
-struct update_window_iter_data {
-	uint32_t output_id;
-	uint32_t startedFrameId;
-	BOOL needEndFrame;
-	BOOL isUpdatePending;
-};
-
 static int
 rdp_rail_update_window(struct weston_surface *surface,
 		       struct update_window_iter_data *iter_data)
@@ -2327,9 +3595,15 @@ rdp_rail_update_window(struct weston_surface *surface,
 					    title) > 0)
 						title = window_title_mod;
 				}
-				if (utf8_string_to_rail_string(title, &rail_window_title_string)) {
+				/* forced updates re-send the window state, but the
+				   title only goes out when it changed. */
+				if ((!rail_state->title ||
+				     strcmp(rail_state->title, title) != 0) &&
+				    utf8_string_to_rail_string(title, &rail_window_title_string)) {
 					window_order_info.fieldFlags |= WINDOW_ORDER_FIELD_TITLE;
 					window_state_order.titleInfo = rail_window_title_string;
+					free(rail_state->title);
+					rail_state->title = strdup(title);
 				}
 			}
 
@@ -2488,33 +3762,60 @@ rdp_rail_update_window(struct weston_surface *surface,
 					  newClientPos.x, newClientPos.y);
 		}
 
-		update = b->rdp_peer->context->update;
-		update->BeginPaint(update->context);
+		update = rdp_rail_window_orders_prepare(peer_ctx);
 		update->window->WindowUpdate(update->context, &window_order_info, &window_state_order);
-		update->EndPaint(update->context);
+		rdp_rail_window_orders_done(peer_ctx);
 
 		free(rail_window_title_string.string);
 
 		rail_state->forceUpdateWindowState = false;
 	}
 
+	/* The content of a window covered by other windows, or minimized, is
+	   not seen by the user, so keep its damage (and skip the readback)
+	   until it is shown again. The client keeps the surface with the
+	   last content sent, so only what changed meanwhile is sent then.
+	   The caller keeps the window dirty meanwhile. Client builds taskbar
+	   and Alt-Tab previews from that surface, so with preview refresh
+	   it is brought up to date at that interval. */
+	if (rail_state->isFirstUpdateDone &&
+	    !rail_state->forceRecreateSurface &&
+	    pixman_region32_not_empty(&rail_state->damage)) {
+		if (rdp_rail_window_is_suppressed(peer_ctx, rail_state)) {
+			iter_data->isContentDeferred = TRUE;
+			return 0;
+		}
+		if ((rail_state->showState == RDP_WINDOW_SHOW_MINIMIZED ||
+		     rdp_rail_window_is_occluded(surface)) &&
+		    !rail_state->isPreviewRefreshDue) {
+			rdp_rail_schedule_preview_refresh(peer_ctx);
+			iter_data->isContentDeferred = TRUE;
+			return 0;
+		}
+	}
+	rail_state->isPreviewRefreshDue = false;
+
 	/* update window buffer contents */
 	{
-#ifdef HAVE_FREERDP_GFXREDIR_H
-		GfxRedirServerContext *redir_ctx = peer_ctx->gfxredir_server_context;
-#endif /* HAVE_FREERDP_GFXREDIR_H */
 		BOOL isBufferSizeChanged = FALSE;
+		bool isMappedSizeChanged = false;
 		float scaleFactorWidth = 1.0f, scaleFactorHeight = 1.0f;
 		int damage_width, damage_height;
 		int copy_buffer_stride, copy_buffer_size;
 		int copy_buffer_width, copy_buffer_height;
+		int surface_width, surface_height; /* RDPGFX surface */
 		int client_buffer_width, client_buffer_height;
 		int content_buffer_width, content_buffer_height;
 		int bufferBpp = 4; /* Bytes Per Pixel. */
 		bool hasAlpha = view ? !weston_view_is_opaque(view, &view->transform.boundingbox) : false;
 		pixman_box32_t damage_box = *pixman_region32_extents(&rail_state->damage);
+		bool isEntireBufferDamaged = false;
 		long page_size = sysconf(_SC_PAGESIZE);
 
+		/* merge small rects, extents are left as is. */
+		rdp_damage_optimize(&rail_state->damage, NULL, 1,
+				    b->damage_max_rects, b->damage_rect_cost);
+
 		/* clientBuffer represents Windows size on client desktop */
 		/* this size is adjusted on whether including or excluding window shadow */
 		client_buffer_width = newClientPos.width;
@@ -2540,6 +3841,8 @@ rdp_rail_update_window(struct weston_surface *surface,
 		copy_buffer_height = content_buffer_window_geometry.height;
 		copy_buffer_stride = copy_buffer_width * bufferBpp;
 		copy_buffer_size = ((copy_buffer_stride * copy_buffer_height) + page_size - 1) & ~(page_size - 1);
+		surface_width = copy_buffer_width;
+		surface_height = copy_buffer_height;
 
 		if (content_buffer_width && content_buffer_height &&
 		    copy_buffer_width && copy_buffer_height) {
@@ -2556,79 +3859,70 @@ rdp_rail_update_window(struct weston_surface *surface,
 						   content_buffer_width;
 				scaleFactorHeight = (float)surface->height /
 						    content_buffer_height;
+
+				/* when client shows window smaller than content
+				   buffer, such as HiDPI content on lower DPI monitor,
+				   scale it down here, so less is read back and sent. */
+				if (b->enable_gfx_downscale &&
+				    client_buffer_width > 0 && client_buffer_height > 0 &&
+				    client_buffer_width < copy_buffer_width &&
+				    client_buffer_height < copy_buffer_height) {
+					surface_width = client_buffer_width;
+					surface_height = client_buffer_height;
+				}
 			}
 
-			if (rail_state->bufferWidth != copy_buffer_width ||
-			    rail_state->bufferHeight != copy_buffer_height)
+			if (rail_state->bufferWidth != surface_width ||
+			    rail_state->bufferHeight != surface_height)
 				isBufferSizeChanged = TRUE;
 
 			if (isBufferSizeChanged || rail_state->forceRecreateSurface ||
 			    (rail_state->surfaceBuffer == NULL && rail_state->surface_id == 0)) {
+				/* the window must take its new size before the
+				   surface of that size is mapped to it. */
+				rdp_rail_window_orders_flush(peer_ctx);
 
 #ifdef HAVE_FREERDP_GFXREDIR_H
 				if (b->use_gfxredir) {
 					assert(rail_state->isUpdatePending == FALSE);
 
-					if (rail_state->surfaceBuffer) {
-						rdp_destroy_shared_buffer(surface);
-						/* at window resize, reset name as old name might still be referenced by client */
-						rail_state->shared_memory.name[0] = '\0';
-					}
-					assert(rail_state->surfaceBuffer == NULL);
-					assert(rail_state->shared_memory.addr == NULL);
-					rail_state->shared_memory.size = copy_buffer_size;
-					if (rdp_allocate_shared_memory(b, &rail_state->shared_memory)) {
-						uint32_t new_pool_id = 0;
-
-						if (rdp_id_manager_allocate_id(&peer_ctx->poolId, surface, &new_pool_id)) {
-							/* +1 for NULL terminate. */
-							unsigned short section_name[RDP_SHARED_MEMORY_NAME_SIZE + 1];
-							/* In Linux wchar_t is 4 types, but Windows wants 2 bytes wchar...
-							 * convert to 2 bytes wchar_t.
-							 */
-							for (uint32_t i = 0; i < RDP_SHARED_MEMORY_NAME_SIZE; i++)
-								section_name[i] = rail_state->shared_memory.name[i];
-							section_name[RDP_SHARED_MEMORY_NAME_SIZE] = 0;
-
-							GFXREDIR_OPEN_POOL_PDU open_pool = {};
-							open_pool.poolId = new_pool_id;
-							open_pool.poolSize = copy_buffer_size;
-							open_pool.sectionNameLength = RDP_SHARED_MEMORY_NAME_SIZE + 1;
-							open_pool.sectionName = section_name;
-
-							if (redir_ctx->OpenPool(redir_ctx, &open_pool) == 0) {
-								uint32_t new_buffer_id = 0;
-
-								if (rdp_id_manager_allocate_id(&peer_ctx->bufferId, (void *)surface, &new_buffer_id)) {
-									GFXREDIR_CREATE_BUFFER_PDU create_buffer = {};
-
-									create_buffer.poolId = open_pool.poolId;
-									create_buffer.bufferId = new_buffer_id;
-									create_buffer.offset = 0;
-									create_buffer.stride = copy_buffer_stride;
-									create_buffer.width = copy_buffer_width;
-									create_buffer.height = copy_buffer_height;
-									create_buffer.format = GFXREDIR_BUFFER_PIXEL_FORMAT_ARGB_8888;
-									if (redir_ctx->CreateBuffer(redir_ctx, &create_buffer) == 0) {
-										rail_state->surfaceBuffer = rail_state->shared_memory.addr;
-										rail_state->buffer_id = create_buffer.bufferId;
-										rail_state->pool_id = open_pool.poolId;
-										rail_state->bufferWidth = copy_buffer_width;
-										rail_state->bufferHeight = copy_buffer_height;
-									}
-								}
-							}
-						}
-						/* if failed, clean up */
-						if (!rail_state->surfaceBuffer)
-							rdp_destroy_shared_buffer(surface);
-					}
+					/* buffer is re-created, but its section is kept
+					   while new size is within the same class. */
+					rdp_destroy_shared_buffer_id(peer_ctx, rail_state);
+					rdp_create_shared_buffer(surface,
+								 copy_buffer_width,
+								 copy_buffer_height,
+								 copy_buffer_stride,
+								 copy_buffer_size);
 				} else {
 #else
 				{
 #endif /* HAVE_FREERDP_GFXREDIR_H */
-					if (rdp_id_manager_allocate_id(&peer_ctx->surfaceId, surface, &new_surface_id)) {
+					if (rail_state->surface_id &&
+					    !rail_state->forceRecreateSurface &&
+					    rdp_rail_surface_fits(rail_state,
+								  surface_width,
+								  surface_height)) {
+						rdp_debug_verbose(b,
+								  "MapSurface(surfaceId:0x%x - (%d, %d) of (%d, %d) for windowsId:0x%x)\n",
+								  rail_state->surface_id,
+								  surface_width,
+								  surface_height,
+								  rail_state->surfaceWidth,
+								  rail_state->surfaceHeight,
+								  window_id);
+						rail_state->bufferWidth = surface_width;
+						rail_state->bufferHeight = surface_height;
+						isMappedSizeChanged = true;
+						/* H.264 stream and staging buffers are tied to mapped size */
+						rdp_gfx_codec_avc_destroy(rail_state);
+						rdp_staging_buffer_release(&rail_state->staging_damage);
+						rdp_staging_buffer_release(&rail_state->staging_alpha);
+						rdp_staging_buffer_release(&rail_state->staging_surface);
+					} else if (rdp_id_manager_allocate_id(&peer_ctx->surfaceId, surface, &new_surface_id)) {
 						RdpgfxServerContext *gfx_ctx;
+						int aligned_width = rdp_rail_surface_align_size(surface_width);
+						int aligned_height = rdp_rail_surface_align_size(surface_height);
 
 						gfx_ctx = peer_ctx->rail_grfx_server_context;
 						RDPGFX_CREATE_SURFACE_PDU createSurface = {};
@@ -2636,27 +3930,37 @@ rdp_rail_update_window(struct weston_surface *surface,
 						rdp_debug_verbose(b,
 								  "CreateSurface(surfaceId:0x%x - (%d, %d) size:%d for windowsId:0x%x)\n",
 								  new_surface_id,
-								  copy_buffer_width,
-								  copy_buffer_height,
-								  copy_buffer_size,
+								  aligned_width,
+								  aligned_height,
+								  aligned_width * aligned_height * bufferBpp,
 								  window_id);
 						createSurface.surfaceId = (uint16_t)new_surface_id;
-						createSurface.width = copy_buffer_width;
-						createSurface.height = copy_buffer_height;
+						createSurface.width = aligned_width;
+						createSurface.height = aligned_height;
 						/* regardless buffer as alpha or not, always use alpha to avoid mstsc bug */
 						createSurface.pixelFormat = GFX_PIXEL_FORMAT_ARGB_8888;
 						if (gfx_ctx->CreateSurface(gfx_ctx, &createSurface) == 0) {
 							/* store new surface id */
 							old_surface_id = rail_state->surface_id;
 							rail_state->surface_id = new_surface_id;
-							rail_state->bufferWidth = copy_buffer_width;
-							rail_state->bufferHeight = copy_buffer_height;
+							rdp_tile_hashes_reset(&rail_state->tileHashes);
+							rail_state->surfaceWidth = aligned_width;
+							rail_state->surfaceHeight = aligned_height;
+							rail_state->bufferWidth = surface_width;
+							rail_state->bufferHeight = surface_height;
+							/* H.264 stream and staging buffers are tied to surface size */
+							rdp_gfx_codec_avc_destroy(rail_state);
+							rdp_staging_buffer_release(&rail_state->staging_damage);
+							rdp_staging_buffer_release(&rail_state->staging_alpha);
+							rdp_staging_buffer_release(&rail_state->staging_surface);
 						}
 					}
 				}
 				rail_state->forceRecreateSurface = false;
 
 				/* make entire content buffer damaged */
+				isEntireBufferDamaged = true;
+				pixman_region32_clear(&rail_state->refineRegion);
 				damage_box.x1 = 0;
 				damage_box.y1 = 0;
 				damage_box.x2 = content_buffer_width;
@@ -2738,7 +4042,18 @@ rdp_rail_update_window(struct weston_surface *surface,
 						  scaleFactorWidth,
 						  scaleFactorHeight);
 
-				if (weston_surface_copy_content(surface,
+				if (b->enable_shm_direct_copy &&
+				    copy_damage_width == damage_width &&
+				    copy_damage_height == damage_height &&
+				    rdp_copy_shm_content(surface,
+							 copy_buffer_bits,
+							 copy_buffer_stride,
+							 damage_box.x1,
+							 damage_box.y1,
+							 damage_width,
+							 damage_height)) {
+					rdp_debug_verbose(b, "copied from client shm buffer directly\n");
+				} else if (weston_surface_copy_content(surface,
 								copy_buffer_bits,
 								copy_buffer_size,
 								copy_buffer_stride,
@@ -2795,6 +4110,9 @@ rdp_rail_update_window(struct weston_surface *surface,
 				}
 
 				if (redir_ctx->PresentBuffer(redir_ctx, &present_buffer) == 0) {
+					rdp_frame_pacer_frame_sent(&peer_ctx->frame_pacer,
+								   present_buffer.presentId);
+					rdp_peer_frame_sent(peer_ctx);
 					rail_state->isUpdatePending = TRUE;
 					iter_data->isUpdatePending = TRUE;
 				} else {
@@ -2805,29 +4123,112 @@ rdp_rail_update_window(struct weston_surface *surface,
 			} else
 #endif /* HAVE_FREERDP_GFXREDIR_H */
 			if (rail_state->surface_id) {
-				RDPGFX_SURFACE_COMMAND surfaceCommand = {};
-				int damageStride = damage_width * bufferBpp;
-				int damageSize = damageStride * damage_height;
-				BYTE *data = NULL;
-				int alphaCodecHeaderSize = 4;
-				BYTE *alpha = NULL;
-				int alphaSize;
-				RdpgfxServerContext *gfx_ctx = peer_ctx->rail_grfx_server_context;
-				data = xmalloc(damageSize);
-
-				if (hasAlpha)
-					alphaSize = alphaCodecHeaderSize +
-						    damage_width *
-						    damage_height;
-				else {
-					/* 8 = max of ALPHA_RLE_SEGMENT for single alpha value. */
-					alphaSize = alphaCodecHeaderSize + 8;
+				struct rdp_rail_surface_command_job *job;
+				pixman_box32_t rect, src, flattenSrc;
+				int damageStride;
+				int damageSize;
+				bool useAvc;
+				bool useCache;
+				bool needRefresh;
+				bool isRefine = rail_state->isRefining && !isEntireBufferDamaged;
+				enum rdp_gfx_quality quality = RDP_GFX_QUALITY_DEFAULT;
+				struct timespec readbackBegin = {}, readbackEnd = {};
+
+				/* app_id is known by the time window shows content. */
+				if (!rail_state->isContentOverrideResolved) {
+					rail_state->contentOverride =
+						rdp_rail_get_content_override(b, surface);
+					rail_state->isContentOverrideResolved = true;
+					if (rail_state->contentOverride)
+						rdp_debug(b, "windowId:0x%x content is overridden to %d\n",
+							  window_id, rail_state->contentOverride);
+				}
+
+				if (isRefine) {
+					/* window is idle, so video mode is over, and
+					   refinement replaces what it left behind. */
+					rail_state->isAvcEnabled = false;
+					useAvc = false;
+					needRefresh = false;
+					quality = RDP_GFX_QUALITY_LOSSLESS;
+				} else {
+					useAvc = rdp_gfx_codec_update_avc_state(peer_ctx, rail_state,
+										damage_width * damage_height,
+										copy_buffer_width * copy_buffer_height,
+										&needRefresh);
+					if (b->refine_quality &&
+					    b->gfx_codec == WESTON_RDP_GFX_CODEC_AUTO) {
+						struct timespec now;
+
+						weston_compositor_read_presentation_clock(compositor, &now);
+						/* constrained link gets coarse updates too. */
+						if (rdp_motion_update(&rail_state->refine_last_update_time,
+								      &rail_state->refine_motion_count,
+								      &now) ||
+						    rdp_link_is_constrained(&peer_ctx->link))
+							quality = RDP_GFX_QUALITY_COARSE;
+					}
+				}
+				if (useAvc || needRefresh || isRefine) {
+					/* AVC420 encodes entire window as video frame, and when
+					   leaving video mode, entire window is re-sent to replace
+					   lossy image with lossless one. Refinement re-sends
+					   the lossy part of window, see rdp_rail_schedule_refine. */
+					damage_box.x1 = content_buffer_window_geometry.x;
+					damage_box.y1 = content_buffer_window_geometry.y;
+					damage_box.x2 = content_buffer_window_geometry.x + copy_buffer_width;
+					damage_box.y2 = content_buffer_window_geometry.y + copy_buffer_height;
+					damage_width = copy_buffer_width;
+					damage_height = copy_buffer_height;
 				}
-				alpha = xmalloc(alphaSize);
 
+				/* damage in surface coordinate, and the area of content
+				   buffer which is scaled into it when surface is
+				   downscaled. */
+				rect.x1 = damage_box.x1 - content_buffer_window_geometry.x;
+				rect.y1 = damage_box.y1 - content_buffer_window_geometry.y;
+				rect.x2 = damage_box.x2 - content_buffer_window_geometry.x;
+				rect.y2 = damage_box.y2 - content_buffer_window_geometry.y;
+				rdp_rail_scale_box(&rect, copy_buffer_width, copy_buffer_height,
+						   surface_width, surface_height);
+				src = rect;
+				rdp_rail_scale_box(&src, surface_width, surface_height,
+						   copy_buffer_width, copy_buffer_height);
+				damage_width = rect.x2 - rect.x1;
+				damage_height = rect.y2 - rect.y1;
+				damageStride = damage_width * bufferBpp;
+				damageSize = damageStride * damage_height;
+
+				job = xzalloc(sizeof *job);
+				job->rail_state = rail_state;
+				job->window_id = window_id;
+				job->surface_id = rail_state->surface_id;
+				job->surface_width = surface_width;
+				job->surface_height = surface_height;
+				job->rect = rect;
+				job->hasAlpha = hasAlpha;
+				job->useAvc = useAvc;
+				job->quality = quality;
+				job->contentOverride = rail_state->contentOverride;
+				/* window image is kept up to date while scroll detection is
+				   enabled, including video mode, AVC420 only skips detection. */
+				job->useStagingSurface = b->enable_gfx_scroll;
+				job->detectScroll = b->enable_gfx_scroll && !useAvc && !isRefine;
+				job->stride = damageStride;
+				/* encoder is flushed before next update of this window,
+				   thus staging buffers of window can be lent to job. */
+				job->data = rdp_staging_buffer_reserve(&rail_state->staging_damage,
+								       damageSize);
+
+				/* snapshot of damage is taken here, and encoded at encoder thread. */
+				if (b->trace)
+					clock_gettime(CLOCK_MONOTONIC, &readbackBegin);
 				if (weston_surface_copy_content(surface,
-								data, damageSize, 0, 0, 0,
-								damage_box.x1, damage_box.y1, damage_width, damage_height,
+								job->data, damageSize, 0,
+								damage_width, damage_height,
+								content_buffer_window_geometry.x + src.x1,
+								content_buffer_window_geometry.y + src.y1,
+								src.x2 - src.x1, src.y2 - src.y1,
 								false /* y-flip */, true /* is_argb */) < 0) {
 					rdp_debug_error(b,
 							"weston_surface_copy_content failed for windowId:0x%x, damageSize:%d, damage:(%d,%d) %dx%d, content:%dx%d\n",
@@ -2838,99 +4239,84 @@ rdp_rail_update_window(struct weston_surface *surface,
 							damage_height,
 							content_buffer_width,
 							content_buffer_height);
-					free(data);
-					free(alpha);
+					free(job);
 					return -1;
 				}
-
-				/* generate alpha only bitmap */
-				/* set up alpha codec header */
-				alpha[0] = 'L';	/* signature */
-				alpha[1] = 'A';	/* signature */
-				alpha[2] = hasAlpha ? 0 : 1; /* compression: RDP spec indicate this is non-zero value for compressed, but it must be 1.*/
-				alpha[3] = 0; /* compression */
-
-				if (hasAlpha) {
-					BYTE *alphaBits = &data[0];
-
-					for (int i = 0; i < damage_height; i++, alphaBits+=damageStride) {
-						BYTE *srcAlphaPixel = alphaBits + 3; /* 3 = xxxA. */
-						BYTE *dstAlphaPixel = &alpha[alphaCodecHeaderSize + (i * damage_width)];
-
-						for (int j = 0; j < damage_width; j++, srcAlphaPixel += bufferBpp, dstAlphaPixel++) {
-							*dstAlphaPixel = *srcAlphaPixel;
-						}
-					}
+				flattenSrc.x1 = content_buffer_window_geometry.x + src.x1;
+				flattenSrc.y1 = content_buffer_window_geometry.y + src.y1;
+				flattenSrc.x2 = content_buffer_window_geometry.x + src.x2;
+				flattenSrc.y2 = content_buffer_window_geometry.y + src.y2;
+				rdp_rail_composite_flattened(surface, job->data, damageStride,
+							     &flattenSrc,
+							     damage_width, damage_height);
+				if (b->trace)
+					clock_gettime(CLOCK_MONOTONIC, &readbackEnd);
+
+				if (isRefine) {
+					pixman_region32_init(&job->damage);
+					pixman_region32_intersect_rect(&job->damage,
+								       &rail_state->refineRegion,
+								       job->rect.x1, job->rect.y1,
+								       damage_width, damage_height);
+				} else if (useAvc || needRefresh || isEntireBufferDamaged)
+					pixman_region32_init_rect(&job->damage,
+								  job->rect.x1, job->rect.y1,
+								  damage_width, damage_height);
+				else
+					rdp_rail_surface_command_init_damage(surface, job,
+									     &rail_state->damage,
+									     &content_buffer_window_geometry,
+									     copy_buffer_width,
+									     copy_buffer_height);
+
+				/* clients often commit unchanged content with full damage. */
+				if (rdp_rail_surface_command_drop_unchanged(peer_ctx, job,
+									    needRefresh || isRefine)) {
+					rdp_debug_verbose(b, "unchanged update dropped for windowId:0x%x\n",
+							  window_id);
+					pixman_region32_fini(&job->damage);
+					free(job);
 				} else {
-					/* whether buffer has alpha or not, always use alpha to avoid mstsc bug */
-					/* CLEARCODEC_ALPHA_RLE_SEGMENT */
-					int bitmapSize = damage_width * damage_height;
-
-					alpha[alphaCodecHeaderSize] = 0xFF; /* alpha value (opaque) */
-					if (bitmapSize < 0xFF) {
-						alpha[alphaCodecHeaderSize + 1] = (BYTE)bitmapSize;
-						alphaSize = alphaCodecHeaderSize + 2; /* alpha value + size in byte. */
-					} else if (bitmapSize < 0xFFFF) {
-						alpha[alphaCodecHeaderSize+1] = 0xFF;
-						*(short*)&(alpha[alphaCodecHeaderSize+2]) = (short)bitmapSize;
-						alphaSize = alphaCodecHeaderSize+4; /* alpha value + 1 + size in short. */
-					} else {
-						alpha[alphaCodecHeaderSize+1] = 0xFF;
-						*(short*)&(alpha[alphaCodecHeaderSize+2]) = 0xFFFF;
-						*(int*)&(alpha[alphaCodecHeaderSize+4]) = bitmapSize;
-						alphaSize = alphaCodecHeaderSize+8; /* alpha value + 1 + 2 + size in int. */
+					/* video frames rarely repeat, don't let them churn the cache.
+					   Neither lossy tiles nor refinement, which must send all
+					   of its damage, go through the cache. */
+					useCache = b->enable_gfx_cache && !useAvc && !isRefine &&
+						   quality != RDP_GFX_QUALITY_COARSE;
+					if (useCache)
+						rdp_rail_surface_command_lookup_cache(peer_ctx, job);
+
+					if (iter_data->needEndFrame == FALSE) {
+						/* if frame is not started yet, send StartFrame first before sendng surface command. */
+						RDPGFX_START_FRAME_PDU startFrame = {};
+						RdpgfxServerContext *gfx_ctx = peer_ctx->rail_grfx_server_context;
+
+						startFrame.frameId = ++peer_ctx->currentFrameId;
+						startFrame.timestamp =
+							weston_rdp_media_clock_to_gfx(weston_rdp_media_clock_msec());
+						rdp_debug_verbose(b, "StartFrame(frameId:0x%x, windowId:0x%x)\n",
+								  startFrame.frameId,
+								  window_id);
+						gfx_ctx->StartFrame(gfx_ctx,
+								    &startFrame);
+						iter_data->startedFrameId = startFrame.frameId;
+						iter_data->needEndFrame = TRUE;
+						iter_data->isUpdatePending = TRUE;
 					}
+					job->frame_id = iter_data->startedFrameId;
+
+					if (b->trace)
+						rdp_trace_surface_command(b, job, useCache,
+									  timespec_sub_to_nsec(&readbackEnd,
+											       &readbackBegin));
+					rdp_encoder_submit(peer_ctx, &job->base,
+							   rdp_rail_surface_command_encode,
+							   rdp_rail_surface_command_done);
 				}
-
-				if (iter_data->needEndFrame == FALSE) {
-					/* if frame is not started yet, send StartFrame first before sendng surface command. */
-					RDPGFX_START_FRAME_PDU startFrame = {};
-					startFrame.frameId = ++peer_ctx->currentFrameId;
-					rdp_debug_verbose(b, "StartFrame(frameId:0x%x, windowId:0x%x)\n",
-							  startFrame.frameId,
-							  window_id);
-					gfx_ctx->StartFrame(gfx_ctx,
-							    &startFrame);
-					iter_data->startedFrameId = startFrame.frameId;
-					iter_data->needEndFrame = TRUE;
-					iter_data->isUpdatePending = TRUE;
-				}
-
-				surfaceCommand.surfaceId = rail_state->surface_id;
-				surfaceCommand.contextId = 0;
-				surfaceCommand.format = PIXEL_FORMAT_BGRA32;
-				surfaceCommand.left = damage_box.x1 - content_buffer_window_geometry.x;
-				surfaceCommand.top = damage_box.y1 - content_buffer_window_geometry.y;
-				surfaceCommand.right = damage_box.x2 - content_buffer_window_geometry.x;
-				surfaceCommand.bottom = damage_box.y2 - content_buffer_window_geometry.y;
-				surfaceCommand.width = damage_width;
-				surfaceCommand.height = damage_height;
-				surfaceCommand.extra = NULL;
-
-				/* send alpha channel */
-				surfaceCommand.codecId = RDPGFX_CODECID_ALPHA;
-				surfaceCommand.length = alphaSize;
-				surfaceCommand.data = &alpha[0];
-				rdp_debug_verbose(b, "SurfaceCommand(frameId:0x%x, windowId:0x%x) for alpha\n",
-						  iter_data->startedFrameId,
-						  window_id);
-				gfx_ctx->SurfaceCommand(gfx_ctx,
-							&surfaceCommand);
-
-				/* send bitmap data */
-				surfaceCommand.codecId = RDPGFX_CODECID_UNCOMPRESSED;
-				surfaceCommand.length = damageSize;
-				surfaceCommand.data = &data[0];
-				rdp_debug_verbose(b, "SurfaceCommand(frameId:0x%x, windowId:0x%x) for bitmap\n",
-						  iter_data->startedFrameId,
-						  window_id);
-				gfx_ctx->SurfaceCommand(gfx_ctx, &surfaceCommand);
-
-				free(data);
-				free(alpha);
 			}
 
 			pixman_region32_clear(&rail_state->damage);
+			rail_state->isRefining = false;
+			rail_state->sentContentGeneration = rail_state->contentGeneration;
 
 			/* TODO: this is a temporary workaround, some windows are not visible to shell
 			   (such as subsurfaces, override_redirect), so z order update is 
@@ -2950,7 +4336,7 @@ rdp_rail_update_window(struct weston_surface *surface,
 #endif /* HAVE_FREERDP_GFXREDIR_H */
 			RdpgfxServerContext *gfx_ctx = peer_ctx->rail_grfx_server_context;
 
-			if (new_surface_id ||
+			if (new_surface_id || isMappedSizeChanged ||
 			    rail_state->bufferScaleFactorWidth != scaleFactorWidth ||
 			    rail_state->bufferScaleFactorHeight != scaleFactorHeight) {
 				/* map surface to window */
@@ -2970,8 +4356,8 @@ rdp_rail_update_window(struct weston_surface *surface,
 				RDPGFX_MAP_SURFACE_TO_SCALED_WINDOW_PDU mapSurfaceToScaledWindow = {
 					.surfaceId = (uint16_t)rail_state->surface_id,
 					.windowId = window_id,
-					.mappedWidth = copy_buffer_width,
-					.mappedHeight = copy_buffer_height,
+					.mappedWidth = rail_state->bufferWidth,
+					.mappedHeight = rail_state->bufferHeight,
 					.targetWidth = client_buffer_width,
 					.targetHeight = client_buffer_height,
 				};
@@ -2997,31 +4383,323 @@ rdp_rail_update_window(struct weston_surface *surface,
 	return 0;
 }
 
+/* Shadow area damage held back is sent at most this often while the
+ * window content keeps being updated. */
+#define RDP_RAIL_SHADOW_REFRESH_DELAY_MS 500
+
+static void
+rdp_rail_shadow_refresh_iter(void *element, void *data)
+{
+	struct weston_surface *surface = element;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+
+	if (pixman_region32_not_empty(&rail_state->shadow_damage)) {
+		rail_state->isShadowRefreshDue = true;
+		rdp_rail_mark_window_dirty(data, rail_state);
+	}
+}
+
+static int
+rdp_rail_shadow_refresh_timer_func(void *arg)
+{
+	RdpPeerContext *peer_ctx = arg;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+
+	peer_ctx->is_shadow_refresh_armed = false;
+	rdp_id_manager_for_each(&peer_ctx->windowId,
+				rdp_rail_shadow_refresh_iter, peer_ctx);
+	weston_compositor_schedule_repaint(b->compositor);
+
+	return 0;
+}
+
+struct rdp_rail_refine_iter_data {
+	RdpPeerContext *peer_ctx;
+	struct timespec now;
+	int64_t next_msec; /* until next window becomes idle, 0 if none */
+	bool isDue;
+};
+
 static void
-rdp_rail_update_window_iter(void *element, void *data)
+rdp_rail_refine_iter(void *element, void *data)
 {
 	struct weston_surface *surface = element;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+	struct rdp_rail_refine_iter_data *iter_data = data;
+	int64_t idle;
+
+	if (!pixman_region32_not_empty(&rail_state->refineRegion))
+		return;
+
+	idle = timespec_sub_to_msec(&iter_data->now,
+				    &rail_state->refine_last_update_time);
+	if (idle >= RDP_REFINE_IDLE_MSEC) {
+		rail_state->isRefineDue = true;
+		rdp_rail_mark_window_dirty(iter_data->peer_ctx, rail_state);
+		iter_data->isDue = true;
+	} else if (!iter_data->next_msec ||
+		   RDP_REFINE_IDLE_MSEC - idle < iter_data->next_msec) {
+		iter_data->next_msec = RDP_REFINE_IDLE_MSEC - idle;
+	}
+}
+
+static int
+rdp_rail_refine_timer_func(void *arg)
+{
+	RdpPeerContext *peer_ctx = arg;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct rdp_rail_refine_iter_data iter_data = { .peer_ctx = peer_ctx };
+
+	peer_ctx->is_refine_armed = false;
+	weston_compositor_read_presentation_clock(b->compositor, &iter_data.now);
+	rdp_id_manager_for_each(&peer_ctx->windowId,
+				rdp_rail_refine_iter, &iter_data);
+	if (iter_data.next_msec) {
+		wl_event_source_timer_update(peer_ctx->refine_timer,
+					     iter_data.next_msec);
+		peer_ctx->is_refine_armed = true;
+	}
+	if (iter_data.isDue)
+		weston_compositor_schedule_repaint(b->compositor);
+
+	return 0;
+}
+
+/* Content which keeps changing is sent with lossy codec, progressive or
+ * AVC420, and once the window stays idle for RDP_REFINE_IDLE_MSEC, what
+ * is left lossy at client is re-sent lossless. Called as lossy content
+ * is sent. */
+void
+rdp_rail_schedule_refine(RdpPeerContext *peer_ctx)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct wl_event_loop *loop;
+
+	if (peer_ctx->is_refine_armed)
+		return;
+
+	if (!peer_ctx->refine_timer) {
+		loop = wl_display_get_event_loop(b->compositor->wl_display);
+		peer_ctx->refine_timer =
+			wl_event_loop_add_timer(loop,
+						rdp_rail_refine_timer_func,
+						peer_ctx);
+		/* without timer, content stays as sent. */
+		if (!peer_ctx->refine_timer)
+			return;
+	}
+	wl_event_source_timer_update(peer_ctx->refine_timer,
+				     RDP_REFINE_IDLE_MSEC);
+	peer_ctx->is_refine_armed = true;
+}
+
+/* With window shadow remoted, the window's surface spans the shadow
+ * around window geometry as well. Clients typically damage the entire
+ * surface at each frame, while the shadow only changes with window
+ * geometry or activation, so damage on the shadow is moved aside while
+ * window geometry stays the same, and sent with an update without
+ * content damage, or later from the shadow refresh timer. */
+static void
+rdp_rail_hold_shadow_damage(struct weston_surface *surface)
+{
+	struct rdp_backend *b = to_rdp_backend(surface->compositor);
+	const struct weston_rdprail_shell_api *api = b->rdprail_shell_api;
+	RdpPeerContext *peer_ctx = (RdpPeerContext *)b->rdp_peer->context;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+	struct weston_geometry geometry;
+	pixman_region32_t content;
+	struct wl_event_loop *loop;
+
+	if (is_window_shadow_remoting_disabled(peer_ctx) ||
+	    rail_state->isWindowSnapped ||
+	    !api || !api->get_window_geometry)
+		return;
+
+	/* entire surface is sent when it is re-created. */
+	if (!rail_state->isFirstUpdateDone || rail_state->forceRecreateSurface) {
+		pixman_region32_clear(&rail_state->shadow_damage);
+		return;
+	}
+
+	api->get_window_geometry(surface, &geometry);
+	if (geometry.x != rail_state->shadowGeometry.x ||
+	    geometry.y != rail_state->shadowGeometry.y ||
+	    geometry.width != rail_state->shadowGeometry.width ||
+	    geometry.height != rail_state->shadowGeometry.height ||
+	    rail_state->isShadowRefreshDue) {
+		/* shadow is redrawn for new geometry, send it. */
+		rail_state->shadowGeometry = geometry;
+		rail_state->isShadowRefreshDue = false;
+		pixman_region32_union(&rail_state->damage, &rail_state->damage,
+				      &rail_state->shadow_damage);
+		pixman_region32_clear(&rail_state->shadow_damage);
+		return;
+	}
+
+	pixman_region32_init(&content);
+	pixman_region32_intersect_rect(&content, &rail_state->damage,
+				       geometry.x, geometry.y,
+				       geometry.width, geometry.height);
+	if (!pixman_region32_not_empty(&content)) {
+		/* only shadow is damaged, such as on activation change. */
+		pixman_region32_union(&rail_state->damage, &rail_state->damage,
+				      &rail_state->shadow_damage);
+		pixman_region32_clear(&rail_state->shadow_damage);
+		pixman_region32_fini(&content);
+		return;
+	}
+
+	pixman_region32_subtract(&rail_state->damage, &rail_state->damage,
+				 &content);
+	pixman_region32_union(&rail_state->shadow_damage,
+			      &rail_state->shadow_damage, &rail_state->damage);
+	pixman_region32_copy(&rail_state->damage, &content);
+	pixman_region32_fini(&content);
+
+	if (!pixman_region32_not_empty(&rail_state->shadow_damage) ||
+	    peer_ctx->is_shadow_refresh_armed)
+		return;
+
+	if (!peer_ctx->shadow_refresh_timer) {
+		loop = wl_display_get_event_loop(b->compositor->wl_display);
+		peer_ctx->shadow_refresh_timer =
+			wl_event_loop_add_timer(loop,
+						rdp_rail_shadow_refresh_timer_func,
+						peer_ctx);
+		if (!peer_ctx->shadow_refresh_timer) {
+			/* can't defer, send it right away. */
+			pixman_region32_union(&rail_state->damage,
+					      &rail_state->damage,
+					      &rail_state->shadow_damage);
+			pixman_region32_clear(&rail_state->shadow_damage);
+			return;
+		}
+	}
+	wl_event_source_timer_update(peer_ctx->shadow_refresh_timer,
+				     RDP_RAIL_SHADOW_REFRESH_DELAY_MS);
+	peer_ctx->is_shadow_refresh_armed = true;
+}
+
+/* Returns false when window must be visited again at later repaint. */
+static bool
+rdp_rail_update_dirty_window(struct weston_surface *surface,
+			     struct update_window_iter_data *iter_data)
+{
 	struct weston_compositor *compositor = surface->compositor;
 	struct rdp_backend *b = to_rdp_backend(compositor);
-	struct update_window_iter_data *iter_data = data;
 	struct weston_surface_rail_state *rail_state = surface->backend_state;
+	pixman_region32_t hidden;
+	bool has_hidden = false;
 
-	/* this iter is looping from window hash table, thus it must have
+	/* this is looping from dirty window list, thus it must have
 	 * rail_state initialized.
 	 **/
 	assert(rail_state);
 
 	if (!(surface->output_mask & (1u << iter_data->output_id)))
-		return;
+		return false;
+
+	/* window is created before role is known, take it back while it
+	   has not shown anything yet, parent sends it at next repaint. */
+	if (!rail_state->isCursor && !rail_state->isFirstUpdateDone &&
+	    rdp_rail_subsurface_can_flatten(b, surface)) {
+		rdp_rail_destroy_window(NULL, surface);
+		assert(!surface->backend_state);
 
-	if (rail_state->isCursor)
+		rdp_rail_create_window(NULL, surface);
+		weston_compositor_schedule_repaint(compositor);
+		return true;
+	}
+
+	if (rail_state->isCursor) {
 		rdp_rail_update_cursor(surface);
-	else if (rail_state->isUpdatePending == FALSE)
+	} else if (rail_state->isUpdatePending == FALSE) {
+		rdp_rail_hold_shadow_damage(surface);
+
+		/* window stayed idle since lossy content was sent, re-send
+		   that part lossless, unless new content is on its way. */
+		if (rail_state->isRefineDue) {
+			rail_state->isRefineDue = false;
+			if (!pixman_region32_not_empty(&rail_state->damage) &&
+			    pixman_region32_not_empty(&rail_state->refineRegion)) {
+				pixman_region32_union_rect(&rail_state->damage,
+							   &rail_state->damage,
+							   0, 0,
+							   surface->width,
+							   surface->height);
+				rail_state->isRefining = true;
+			}
+		}
+
+		/* damage under other windows is held back, and sent once
+		   that part of the window is exposed. */
+		pixman_region32_init(&hidden);
+		if (rail_state->isFirstUpdateDone &&
+		    !rail_state->forceRecreateSurface &&
+		    !rail_state->isPreviewRefreshDue &&
+		    !rail_state->isRefining &&
+		    rdp_rail_window_get_hidden_region(surface, &hidden)) {
+			pixman_region32_intersect(&hidden, &hidden,
+						  &rail_state->damage);
+			pixman_region32_subtract(&rail_state->damage,
+						 &rail_state->damage, &hidden);
+			has_hidden = pixman_region32_not_empty(&hidden);
+		}
+
+		iter_data->isContentDeferred = FALSE;
 		rdp_rail_update_window(surface, iter_data);
-	else
+
+		if (rail_state->isRefining) {
+			/* not sent, try again at next update of the window. */
+			pixman_region32_clear(&rail_state->damage);
+			rail_state->isRefining = false;
+			rail_state->isRefineDue = true;
+		}
+
+		if (has_hidden) {
+			pixman_region32_union(&rail_state->damage,
+					      &rail_state->damage, &hidden);
+			rdp_rail_schedule_preview_refresh(
+				(RdpPeerContext *)b->rdp_peer->context);
+		}
+		pixman_region32_fini(&hidden);
+		if (iter_data->isContentDeferred || has_hidden)
+			return false;
+	} else {
 		rdp_debug_verbose(b, "window update is skipped for windowId:0x%x, isUpdatePending = %d\n",
 				  rail_state->window_id,
 				  rail_state->isUpdatePending);
+		return false;
+	}
+
+	return true;
+}
+
+/* Visit only windows changed since last repaint, instead of walking
+ * all windows. Windows not done at this repaint, such as ones on other
+ * output, stay in the list. */
+static void
+rdp_rail_update_dirty_windows(RdpPeerContext *peer_ctx,
+			      struct update_window_iter_data *iter_data)
+{
+	struct weston_surface_rail_state *rail_state;
+	struct wl_list dirty_list;
+
+	/* windows can be marked dirty again, or destroyed, while updating. */
+	wl_list_init(&dirty_list);
+	wl_list_insert_list(&dirty_list, &peer_ctx->dirty_window_list);
+	wl_list_init(&peer_ctx->dirty_window_list);
+
+	while (!wl_list_empty(&dirty_list)) {
+		rail_state = wl_container_of(dirty_list.next, rail_state,
+					     dirty_link);
+		wl_list_remove(&rail_state->dirty_link);
+		wl_list_init(&rail_state->dirty_link);
+
+		/* rail_state is intact when update is not done. */
+		if (!rdp_rail_update_dirty_window(rail_state->surface, iter_data))
+			rdp_rail_mark_window_dirty(peer_ctx, rail_state);
+	}
 }
 
 static uint32_t
@@ -3038,8 +4716,14 @@ rdp_insert_window_zorder_array(struct weston_view *view,
 
 	/* insert subsurface first to zorder list */
 	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+		struct weston_surface_rail_state *sub_rail_state =
+			sub->surface->backend_state;
 		struct weston_view *sub_view;
 
+		/* part of this window's content. */
+		if (sub_rail_state && sub_rail_state->isFlattened)
+			continue;
+
 		wl_list_for_each(sub_view, &sub->surface->views, surface_link) {
 			if (sub_view->parent_view != view)
 				continue;
@@ -3067,7 +4751,7 @@ rdp_insert_window_zorder_array(struct weston_view *view,
 					__func__, iCurrent, WindowIdArraySize);
 			return UINT_MAX;
 		}
-		if (b->debugLevel >= RDP_DEBUG_LEVEL_VERBOSE) {
+		if (rdp_debug_enabled(b, RDP_DEBUG_LEVEL_VERBOSE)) {
 			char label[256];
 
 			rdp_rail_dump_window_label(surface,
@@ -3105,54 +4789,211 @@ rdp_rail_sync_window_zorder(struct weston_compositor *compositor)
 		return;
 	/* +1 for marker window (aka proxy_surface) */
 	numWindowId++;
-	windowIdArray = xzalloc(numWindowId * sizeof(uint32_t));
+	/* arrays are kept across syncs, and only grown. */
+	if (numWindowId > peer_ctx->window_zorder_capacity) {
+		uint32_t capacity = MAX(numWindowId,
+					peer_ctx->window_zorder_capacity * 2);
+
+		peer_ctx->window_zorder =
+			xrealloc(peer_ctx->window_zorder,
+				 capacity * sizeof(uint32_t));
+		peer_ctx->window_zorder_next =
+			xrealloc(peer_ctx->window_zorder_next,
+				 capacity * sizeof(uint32_t));
+		peer_ctx->window_zorder_capacity = capacity;
+	}
+	windowIdArray = peer_ctx->window_zorder_next;
 
 	rdp_debug_verbose(b, "Dump Window Z order\n");
 	/* walk windows in z-order */
 	struct weston_layer *layer;
 
-	wl_list_for_each(layer, &compositor->layer_list, link) {
-		struct weston_view *view;
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		struct weston_view *view;
+
+		wl_list_for_each(view, &layer->view_list.link, layer_link.link) {
+			if (view->surface == b->proxy_surface) {
+				rdp_debug_verbose(b, "    window[%d]: %x: %s\n",
+						  iCurrent,
+						  RDP_RAIL_MARKER_WINDOW_ID,
+						  "marker window");
+				windowIdArray[iCurrent++] = RDP_RAIL_MARKER_WINDOW_ID;
+			} else {
+				iCurrent = rdp_insert_window_zorder_array(view,
+									  windowIdArray,
+									  numWindowId,
+									  iCurrent);
+				if (iCurrent == UINT_MAX)
+					return;
+			}
+		}
+	}
+	assert(iCurrent <= numWindowId);
+	/* focus changes often end up with same order, skip those. */
+	if (iCurrent == peer_ctx->window_zorder_count &&
+	    memcmp(windowIdArray, peer_ctx->window_zorder,
+		   iCurrent * sizeof(uint32_t)) == 0) {
+		rdp_debug_verbose(b, "    Window Z order unchanged\n");
+		return;
+	}
+	if (iCurrent > 0) {
+		rdp_debug_verbose(b, "    send Window Z order: numWindowIds:%d\n",
+				  iCurrent);
+
+		window_order_info.fieldFlags = WINDOW_ORDER_TYPE_DESKTOP |
+					       WINDOW_ORDER_FIELD_DESKTOP_ZORDER |
+					       WINDOW_ORDER_FIELD_DESKTOP_ACTIVE_WND;
+		monitored_desktop_order.activeWindowId = windowIdArray[0];
+		monitored_desktop_order.numWindowIds = iCurrent;
+		monitored_desktop_order.windowIds = windowIdArray;
+
+		rdp_rail_window_orders_prepare(peer_ctx);
+		client->context->update->window->MonitoredDesktop(client->context,
+								  &window_order_info,
+								  &monitored_desktop_order);
+		rdp_rail_window_orders_done(peer_ctx);
+		if (!peer_ctx->is_window_orders_batched)
+			client->DrainOutputBuffer(client);
+	}
+
+	peer_ctx->window_zorder_next = peer_ctx->window_zorder;
+	peer_ctx->window_zorder = windowIdArray;
+	peer_ctx->window_zorder_count = iCurrent;
+}
+
+void
+rdp_rail_suppress_output(RdpPeerContext *peerCtx, bool allow,
+			 const RECTANGLE_16 *area)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+
+	assert_compositor_thread(b);
+
+	peerCtx->is_output_area_set = allow && area;
+	if (peerCtx->is_output_area_set) {
+		/* RECTANGLE_16 right and bottom are exclusive. */
+		peerCtx->output_area.x1 = area->left;
+		peerCtx->output_area.y1 = area->top;
+		peerCtx->output_area.x2 = area->right;
+		peerCtx->output_area.y2 = area->bottom;
+	}
+
+	rdp_debug(b, "%s: allow:%d area:(%d,%d)-(%d,%d)\n", __func__, allow,
+		  area ? area->left : 0, area ? area->top : 0,
+		  area ? area->right : 0, area ? area->bottom : 0);
+
+	/* send what was held back while windows were not shown. */
+	if (allow) {
+		rdp_id_manager_for_each(&peerCtx->windowId,
+					rdp_rail_mark_window_dirty_iter,
+					peerCtx);
+		weston_compositor_schedule_repaint(b->compositor);
+	}
+}
+
+/* Window encoding state kept between updates is released when no window
+ * content has been sent for this long. */
+#define RDP_RAIL_IDLE_RELEASE_DELAY_MS 10000
+
+static void
+rdp_rail_release_idle_window_iter(void *element, void *data)
+{
+	struct weston_surface *surface = element;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+
+	/* re-allocated at next update, and AVC420 restarts with IDR frame. */
+	rdp_gfx_codec_avc_destroy(rail_state);
+	rdp_staging_buffer_release(&rail_state->staging_damage);
+	rdp_staging_buffer_release(&rail_state->staging_alpha);
+	rdp_staging_buffer_release(&rail_state->staging_surface);
+}
+
+static void
+rdp_rail_release_idle_windows(RdpPeerContext *peer_ctx)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+
+	rdp_debug(b, "%s: releasing window encoding state\n", __func__);
+
+	/* staging buffers and AVC420 context are lent to encoder jobs. */
+	rdp_encoder_flush(peer_ctx);
+	rdp_id_manager_for_each(&peer_ctx->windowId,
+				rdp_rail_release_idle_window_iter, NULL);
+}
+
+static int
+rdp_rail_idle_release_timer_func(void *arg)
+{
+	RdpPeerContext *peer_ctx = arg;
+	struct timespec now;
+	int64_t idle_msec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	idle_msec = timespec_sub_to_msec(&now, &peer_ctx->last_content_time);
+	if (idle_msec < RDP_RAIL_IDLE_RELEASE_DELAY_MS) {
+		/* content was sent since timer was armed. */
+		wl_event_source_timer_update(peer_ctx->idle_release_timer,
+					     RDP_RAIL_IDLE_RELEASE_DELAY_MS - idle_msec);
+		return 0;
+	}
+
+	peer_ctx->is_idle_release_armed = false;
+	rdp_rail_release_idle_windows(peer_ctx);
+
+	return 0;
+}
+
+/* Called when window content is sent, the timer is armed once, and
+ * re-armed by itself for the time left, not at each update. */
+static void
+rdp_rail_mark_content_sent(RdpPeerContext *peer_ctx)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct wl_event_loop *loop;
+
+	clock_gettime(CLOCK_MONOTONIC, &peer_ctx->last_content_time);
+	if (peer_ctx->is_idle_release_armed)
+		return;
 
-		wl_list_for_each(view, &layer->view_list.link, layer_link.link) {
-			if (view->surface == b->proxy_surface) {
-				rdp_debug_verbose(b, "    window[%d]: %x: %s\n",
-						  iCurrent,
-						  RDP_RAIL_MARKER_WINDOW_ID,
-						  "marker window");
-				windowIdArray[iCurrent++] = RDP_RAIL_MARKER_WINDOW_ID;
-			} else {
-				iCurrent = rdp_insert_window_zorder_array(view,
-									  windowIdArray,
-									  numWindowId,
-									  iCurrent);
-				if (iCurrent == UINT_MAX)
-					goto Exit;
-			}
-		}
+	if (!peer_ctx->idle_release_timer) {
+		loop = wl_display_get_event_loop(b->compositor->wl_display);
+		peer_ctx->idle_release_timer =
+			wl_event_loop_add_timer(loop,
+						rdp_rail_idle_release_timer_func,
+						peer_ctx);
+		if (!peer_ctx->idle_release_timer)
+			return;
 	}
-	assert(iCurrent <= numWindowId);
-	if (iCurrent > 0) {
-		rdp_debug_verbose(b, "    send Window Z order: numWindowIds:%d\n",
-				  iCurrent);
+	wl_event_source_timer_update(peer_ctx->idle_release_timer,
+				     RDP_RAIL_IDLE_RELEASE_DELAY_MS);
+	peer_ctx->is_idle_release_armed = true;
+}
 
-		window_order_info.fieldFlags = WINDOW_ORDER_TYPE_DESKTOP |
-					       WINDOW_ORDER_FIELD_DESKTOP_ZORDER |
-					       WINDOW_ORDER_FIELD_DESKTOP_ACTIVE_WND;
-		monitored_desktop_order.activeWindowId = windowIdArray[0];
-		monitored_desktop_order.numWindowIds = iCurrent;
-		monitored_desktop_order.windowIds = windowIdArray;
+struct rdp_rail_end_frame_job {
+	struct rdp_encoder_job base;
+	uint32_t frame_id;
+};
 
-		client->context->update->window->MonitoredDesktop(client->context,
-								  &window_order_info,
-								  &monitored_desktop_order);
-		client->DrainOutputBuffer(client);
-	}
+static void
+rdp_rail_end_frame_done(bool freeOnly, struct rdp_encoder_job *base)
+{
+	struct rdp_rail_end_frame_job *job =
+		container_of(base, struct rdp_rail_end_frame_job, base);
+	RdpPeerContext *peer_ctx = base->peerCtx;
 
-Exit:
-	free(windowIdArray);
+	if (!freeOnly) {
+		RDPGFX_END_FRAME_PDU endFrame = {};
+		RdpgfxServerContext *gfx_ctx = peer_ctx->rail_grfx_server_context;
 
-	return;
+		endFrame.frameId = job->frame_id;
+		rdp_debug_verbose(peer_ctx->rdpBackend, "EndFrame(frameId:0x%x)\n",
+				  endFrame.frameId);
+		gfx_ctx->EndFrame(gfx_ctx, &endFrame);
+		rdp_frame_pacer_frame_sent(&peer_ctx->frame_pacer, job->frame_id);
+		rdp_peer_frame_sent(peer_ctx);
+	}
+
+	free(job);
 }
 
 void
@@ -3162,15 +5003,33 @@ rdp_rail_output_repaint(struct weston_output *output,
 	struct weston_compositor *ec = output->compositor;
 	struct rdp_backend *b = to_rdp_backend(ec);
 	RdpPeerContext *peer_ctx = (RdpPeerContext *)b->rdp_peer->context;
+	struct rdp_frame_pacer *pacer = &peer_ctx->frame_pacer;
+
+	/* previous frame must be sent before surfaces are updated. */
+	rdp_encoder_flush(peer_ctx);
+
+	/* repainted again once client's cache import is done. */
+	if (peer_ctx->isCacheImportPending)
+		return;
 
 	if (peer_ctx->isAcknowledgedSuspended ||
-	    ((peer_ctx->currentFrameId - peer_ctx->acknowledgedFrameId) < 2)) {
+	    rdp_frame_pacer_can_send(pacer, peer_ctx->currentFrameId -
+					    peer_ctx->acknowledgedFrameId)) {
 		struct update_window_iter_data iter_data = {};
 
+		rdp_rail_window_orders_begin(peer_ctx);
+
 		/* notify window z order to client first,
 		   mstsc/msrdc needs this to be sent before window update. */
 		if (peer_ctx->is_window_zorder_dirty) {
+			/* stacking or window set changed, which may not be
+			   notified by surface repaint, so visit all windows. */
+			rdp_id_manager_for_each(&peer_ctx->windowId,
+						rdp_rail_mark_window_dirty_iter,
+						peer_ctx);
+			WESTON_ALLOC_SCOPE_BEGIN("rdp-window-zorder");
 			rdp_rail_sync_window_zorder(b->compositor);
+			WESTON_ALLOC_SCOPE_END();
 			peer_ctx->is_window_zorder_dirty = false;
 		}
 		rdp_debug_verbose(b, "currentFrameId:0x%x, acknowledgedFrameId:0x%x, isAcknowledgedSuspended:%d\n",
@@ -3179,19 +5038,22 @@ rdp_rail_output_repaint(struct weston_output *output,
 				   peer_ctx->isAcknowledgedSuspended);
 
 		iter_data.output_id = output->id;
-		rdp_id_manager_for_each(&peer_ctx->windowId,
-					rdp_rail_update_window_iter,
-					&iter_data);
+		WESTON_ALLOC_SCOPE_BEGIN("rdp-update-window");
+		rdp_rail_update_dirty_windows(peer_ctx, &iter_data);
+		WESTON_ALLOC_SCOPE_END();
+		rdp_rail_window_orders_end(peer_ctx);
 		if (iter_data.needEndFrame) {
-			/* if frame is started at above iteration, send EndFrame here. */
-			RDPGFX_END_FRAME_PDU endFrame = {};
-			RdpgfxServerContext *gfx_ctx;
-			gfx_ctx = peer_ctx->rail_grfx_server_context;
-
-			endFrame.frameId = iter_data.startedFrameId;
-			rdp_debug_verbose(b, "EndFrame(frameId:0x%x)\n", endFrame.frameId);
-			gfx_ctx->EndFrame(gfx_ctx, &endFrame);
+			/* if frame is started at above iteration, send EndFrame
+			   after all surface commands of this frame are sent. */
+			struct rdp_rail_end_frame_job *job = xzalloc(sizeof *job);
+
+			job->frame_id = iter_data.startedFrameId;
+			rdp_trace_frame_end(b, job->frame_id);
+			rdp_encoder_submit(peer_ctx, &job->base, NULL,
+					   rdp_rail_end_frame_done);
 		}
+		if (iter_data.isUpdatePending)
+			rdp_rail_mark_content_sent(peer_ctx);
 		if (iter_data.isUpdatePending &&
 		    b->enable_display_power_by_screenupdate) {
 			/* By default, compositor won't update idle timer by screen activity,
@@ -3200,10 +5062,13 @@ rdp_rail_output_repaint(struct weston_output *output,
 			weston_compositor_wake(b->compositor);
 		}
 	} else {
-		rdp_debug_verbose(b, "frame update is skipped. currentFrameId:%d, acknowledgedFrameId:%d, isAcknowledgedSuspended:%d\n",
+		rdp_debug_verbose(b, "frame update is skipped. currentFrameId:%d, acknowledgedFrameId:%d, isAcknowledgedSuspended:%d, window:%d\n",
 				  peer_ctx->currentFrameId,
 				  peer_ctx->acknowledgedFrameId,
-				  peer_ctx->isAcknowledgedSuspended);
+				  peer_ctx->isAcknowledgedSuspended,
+				  pacer->window);
+		if (pacer->enabled)
+			pacer->isRepaintDeferred = true;
 	}
 	return;
 }
@@ -3211,13 +5076,34 @@ rdp_rail_output_repaint(struct weston_output *output,
 static void
 disp_force_recreate_iter(void *element, void *data)
 {
+	RdpPeerContext *peerCtx = data;
 	struct weston_surface *surface = element;
 	struct weston_surface_rail_state *rail_state = surface->backend_state;
+	bool use_gfxredir = false;
+	bool scale_changed;
+
+#ifdef HAVE_FREERDP_GFXREDIR_H
+	use_gfxredir = peerCtx->rdpBackend->use_gfxredir;
+#endif /* HAVE_FREERDP_GFXREDIR_H */
 
-	rail_state->forceRecreateSurface = TRUE;
-	rail_state->forceUpdateWindowState = TRUE;
+	scale_changed = !surface->output ||
+			surface->output->current_scale != rail_state->output_scale;
+
+	/* ResetGraphics makes the client drop every gfx surface, so those
+	 * always need to be recreated. Shared buffers used by gfxredir
+	 * survive the reset and are only rebuilt when the window's monitor
+	 * changed scale. */
+	if (!use_gfxredir || scale_changed)
+		rail_state->forceRecreateSurface = TRUE;
+	if (scale_changed)
+		rail_state->forceUpdateWindowState = TRUE;
+	rdp_rail_mark_window_dirty(peerCtx, rail_state);
 }
 
+/* Docking and undocking typically produce a burst of layout PDUs, only
+ * the last one of a burst is applied. */
+#define DISP_MONITOR_LAYOUT_CHANGE_DELAY_MS 100
+
 struct disp_schedule_monitor_layout_change_data {
 	struct rdp_loop_task _base;
 	DispServerContext *context;
@@ -3226,9 +5112,8 @@ struct disp_schedule_monitor_layout_change_data {
 };
 
 static void
-disp_monitor_layout_change_callback(bool freeOnly, void *dataIn)
+disp_apply_monitor_layout_change(struct disp_schedule_monitor_layout_change_data *data)
 {
-	struct disp_schedule_monitor_layout_change_data *data = wl_container_of(dataIn, data, _base);
 	DispServerContext *context = data->context;
 	freerdp_peer *client = (freerdp_peer *)context->custom;
 	RdpPeerContext *peerCtx = (RdpPeerContext *)client->context;
@@ -3238,12 +5123,18 @@ disp_monitor_layout_change_callback(bool freeOnly, void *dataIn)
 
 	assert_compositor_thread(b);
 
-	if (freeOnly)
-		goto out;
+	/* nothing to do when client re-sends the layout already in use. */
+	if (disp_monitor_layout_is_current(b, data->monitors, data->count)) {
+		rdp_debug(b, "%s: monitor layout is unchanged, skipped\n", __func__);
+		return;
+	}
+
+	/* surface commands must be sent before graphics is reset. */
+	rdp_encoder_flush(peerCtx);
 
 	/* Skip reset graphics on failure */
 	if (!handle_adjust_monitor_layout(client, data->count, data->monitors))
-		goto out;
+		return;
 
 	reset_monitor_def = xmalloc(sizeof(MONITOR_DEF) * data->count);
 
@@ -3261,14 +5152,73 @@ disp_monitor_layout_change_callback(bool freeOnly, void *dataIn)
 	reset_graphics.monitorCount = data->count;
 	reset_graphics.monitorDefArray = reset_monitor_def;
 	peerCtx->rail_grfx_server_context->ResetGraphics(peerCtx->rail_grfx_server_context, &reset_graphics);
+	/* client drops its bitmap cache along with surfaces. */
+	rdp_gfx_cache_clear(&peerCtx->gfx_cache);
 
-	/* force recreate all surface and redraw. */
-	rdp_id_manager_for_each(&peerCtx->windowId, disp_force_recreate_iter, NULL);
+	/* recreate surfaces dropped by the client and redraw. */
+	rdp_id_manager_for_each(&peerCtx->windowId, disp_force_recreate_iter, peerCtx);
 	weston_compositor_damage_all(b->compositor);
-out:
+
 	free(reset_monitor_def);
-	free(data);
-	return;
+}
+
+static int
+disp_monitor_layout_change_timer_func(void *arg)
+{
+	RdpPeerContext *peerCtx = arg;
+	struct disp_schedule_monitor_layout_change_data *data;
+
+	assert_compositor_thread(peerCtx->rdpBackend);
+
+	data = peerCtx->pending_layout_change;
+	peerCtx->pending_layout_change = NULL;
+	if (data) {
+		disp_apply_monitor_layout_change(data);
+		free(data);
+	}
+
+	return 0;
+}
+
+static void
+disp_monitor_layout_change_callback(bool freeOnly, void *dataIn)
+{
+	struct disp_schedule_monitor_layout_change_data *data = wl_container_of(dataIn, data, _base);
+	DispServerContext *context = data->context;
+	freerdp_peer *client = (freerdp_peer *)context->custom;
+	RdpPeerContext *peerCtx = (RdpPeerContext *)client->context;
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	struct wl_event_loop *loop;
+
+	assert_compositor_thread(b);
+
+	if (freeOnly) {
+		free(data);
+		return;
+	}
+
+	if (!peerCtx->layout_change_timer) {
+		loop = wl_display_get_event_loop(b->compositor->wl_display);
+		peerCtx->layout_change_timer =
+			wl_event_loop_add_timer(loop,
+						disp_monitor_layout_change_timer_func,
+						peerCtx);
+		if (!peerCtx->layout_change_timer) {
+			/* can't defer, apply right away. */
+			disp_apply_monitor_layout_change(data);
+			free(data);
+			return;
+		}
+	}
+
+	/* a newer layout supersedes the one still waiting to be applied. */
+	if (peerCtx->pending_layout_change) {
+		rdp_debug(b, "%s: pending monitor layout is superseded\n", __func__);
+		free(peerCtx->pending_layout_change);
+	}
+	peerCtx->pending_layout_change = data;
+	wl_event_source_timer_update(peerCtx->layout_change_timer,
+				     DISP_MONITOR_LAYOUT_CHANGE_DELAY_MS);
 }
 
 static unsigned int
@@ -3330,6 +5280,13 @@ rdp_rail_idle_handler(struct wl_listener *listener, void *data)
 		displayRequest.active = FALSE;
 		rail_ctx->ServerPowerDisplayRequest(rail_ctx, &displayRequest);
 	}
+
+	/* nothing is expected to be sent until wake. */
+	if (peer_ctx->is_idle_release_armed) {
+		wl_event_source_timer_update(peer_ctx->idle_release_timer, 0);
+		peer_ctx->is_idle_release_armed = false;
+	}
+	rdp_rail_release_idle_windows(peer_ctx);
 }
 
 static void
@@ -3373,9 +5330,12 @@ rdp_rail_peer_activate(freerdp_peer* client)
 	RDPAPPLIST_SERVER_CAPS_PDU app_list_caps = {};
 #endif /* HAVE_FREERDP_RDPAPPLIST_H */
 	uint waitRetry;
+	struct timespec start_time, end_time;
 
 	assert_compositor_thread(b);
 
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
 	/* In RAIL mode, client must not be resized */
 	assert(b->no_clients_resize == 0);
 	/* Server must not ask client to resize */
@@ -3434,15 +5394,8 @@ rdp_rail_peer_activate(freerdp_peer* client)
 		client->DrainOutputBuffer(client);
 	}
 
-	/* wait handshake reponse from client */
-	waitRetry = 0;
-	while (!peer_ctx->handshakeCompleted) {
-		if (++waitRetry > 10000) /* timeout after 100 sec. */
-			goto error_exit;
-		usleep(10000); /* wait 0.01 sec. */
-		client->CheckFileDescriptor(client);
-		WTSVirtualChannelManagerCheckFileDescriptor(peer_ctx->vcm);
-	}
+	/* Other channels don't depend on RAIL handshake, so open them while
+	   handshake response is in flight and wait for all of them at once. */
 
 	/* open Disp channel */
 	disp_ctx = disp_server_context_new(peer_ctx->vcm);
@@ -3469,9 +5422,20 @@ rdp_rail_peer_activate(freerdp_peer* client)
 	gfx_ctx->CapsAdvertise = rail_grfx_client_caps_advertise;
 	gfx_ctx->CacheImportOffer = rail_grfx_client_cache_import_offer;
 	gfx_ctx->FrameAcknowledge = rail_grfx_client_frame_acknowledge;
+	if (b->loop_channels)
+		rdpgfx_server_set_own_thread(gfx_ctx, FALSE);
 	if (!gfx_ctx->Open(gfx_ctx))
 		goto error_exit;
 	rail_grfx_server_opened = TRUE;
+	if (b->loop_channels) {
+		int fd = GetEventFileDescriptor(rdpgfx_server_get_event_handle(gfx_ctx));
+
+		if (!rdp_event_loop_add_fd(wl_display_get_event_loop(b->compositor->wl_display),
+					   fd, WL_EVENT_READABLE,
+					   rail_grfx_channel_activity, peer_ctx,
+					   &peer_ctx->rail_grfx_event_source))
+			goto error_exit;
+	}
 
 #ifdef HAVE_FREERDP_GFXREDIR_H
 	/* open Graphics Redirection channel. */
@@ -3526,9 +5490,16 @@ rdp_rail_peer_activate(freerdp_peer* client)
 	}
 #endif /* HAVE_FREERDP_RDPAPPLIST_H */
 
-	/* wait graphics channel (and optionally graphics redir channel) reponse from client */
+	/* wait handshake, graphics channel (and optionally graphics redir channel)
+	   reponse from client */
 	waitRetry = 0;
-	while (!peer_ctx->activationGraphicsCompleted
+	client->DrainOutputBuffer(client);
+	client->CheckFileDescriptor(client);
+	WTSVirtualChannelManagerCheckFileDescriptor(peer_ctx->vcm);
+	if (peer_ctx->rail_grfx_event_source)
+		rdpgfx_server_handle_messages(gfx_ctx);
+	while (!peer_ctx->handshakeCompleted ||
+		!peer_ctx->activationGraphicsCompleted
 #ifdef HAVE_FREERDP_GFXREDIR_H
 		|| (gfxredir_server_opened && !peer_ctx->activationGraphicsRedirectionCompleted)
 #endif /* HAVE_FREERDP_GFXREDIR_H */
@@ -3538,8 +5509,14 @@ rdp_rail_peer_activate(freerdp_peer* client)
 		usleep(10000); /* wait 0.01 sec. */
 		client->CheckFileDescriptor(client);
 		WTSVirtualChannelManagerCheckFileDescriptor(peer_ctx->vcm);
+		if (peer_ctx->rail_grfx_event_source)
+			rdpgfx_server_handle_messages(gfx_ctx);
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	rdp_debug(b, "RDP backend: RAIL channels activated in %" PRId64 " msec\n",
+		  timespec_sub_to_msec(&end_time, &start_time));
+
 	/* subscribe idle/wake signal from compositor */
 	peer_ctx->idle_listener.notify = rdp_rail_idle_handler;
 	wl_signal_add(&b->compositor->idle_signal, &peer_ctx->idle_listener);
@@ -3573,6 +5550,10 @@ error_exit:
 	}
 #endif /* HAVE_FREERDP_GFXREDIR_H */
 
+	if (peer_ctx->rail_grfx_event_source) {
+		wl_event_source_remove(peer_ctx->rail_grfx_event_source);
+		peer_ctx->rail_grfx_event_source = NULL;
+	}
 	if (rail_grfx_server_opened)
 		gfx_ctx->Close(gfx_ctx);
 	if (gfx_ctx) {
@@ -3711,12 +5692,15 @@ rdp_rail_sync_window_status(freerdp_peer *client)
 
 	peer_ctx->activationRailCompleted = true;
 
+	rdp_rail_unpark_windows(peer_ctx);
+
 	wl_list_for_each_reverse(view, &b->compositor->view_list, link) {
 		struct weston_surface *surface = view->surface;
 		struct weston_subsurface *sub;
 		struct weston_surface_rail_state *rail_state = surface->backend_state;
 
-		if (!rail_state || rail_state->window_id == 0) {
+		if (!rail_state || rail_state->window_id == 0 ||
+		    rail_state->isParked) {
 			rdp_rail_create_window(NULL, surface);
 			rail_state = surface->backend_state;
 			if (rail_state && rail_state->window_id) {
@@ -3726,7 +5710,8 @@ rdp_rail_sync_window_status(freerdp_peer *client)
 					struct weston_surface_rail_state *sub_rail_state = sub->surface->backend_state;
 					if (sub->surface == surface)
 						continue;
-					if (!sub_rail_state || sub_rail_state->window_id == 0)
+					if (!sub_rail_state || sub_rail_state->window_id == 0 ||
+					    sub_rail_state->isParked)
 						rdp_rail_create_window(NULL, sub->surface);
 				}
 			}
@@ -3734,9 +5719,21 @@ rdp_rail_sync_window_status(freerdp_peer *client)
 		}
 	}
 
+	/* parked but not re-created (e.g. no longer mapped), let go. */
+	{
+		struct weston_surface_rail_state *rail_state, *tmp;
+
+		wl_list_for_each_safe(rail_state, tmp, &b->parked_window_list, parked_link) {
+			rdp_id_manager_free_id(&peer_ctx->windowId,
+					       rail_state->window_id);
+			rdp_rail_discard_parked_window(rail_state);
+		}
+	}
+
 	if (anyWindowCreated) {
 		/* resync window zorder with RDP client */
 		peer_ctx->is_window_zorder_dirty = true;
+		peer_ctx->window_zorder_count = 0;
 		/* this assume repaint to be scheduled on idle loop, not directly from here */
 		weston_compositor_wake(b->compositor);
 		weston_compositor_damage_all(b->compositor);
@@ -3811,10 +5808,11 @@ rdp_rail_send_window_minmax_info(
 }
 
 static void
-rdp_rail_start_window_move(
+rdp_rail_start_local_move_size(
 	struct weston_surface* surface,
 	int pointerGrabX,
-	int pointerGrabY)
+	int pointerGrabY,
+	uint16_t moveSizeType)
 {
 	struct weston_compositor *compositor = surface->compositor;
 	struct weston_surface_rail_state *rail_state = surface->backend_state;
@@ -3873,13 +5871,20 @@ rdp_rail_start_window_move(
 	rdp_debug(b, "WindowsPosition: Pre-move (%d,%d) at client.\n", posX, posY);
 	rdp_debug(b, "pointerGrab: (%d,%d)\n", pointerGrabX, pointerGrabY);
 
-	/* Start the local Window move.
+	/* Start the local Window move or resize. A move is given the grab
+	 * offset into the window, a resize the grab position on the desktop.
 	 */
 	move_order.windowId = rail_state->window_id;
 	move_order.isMoveSizeStart = true;
-	move_order.moveSizeType = RAIL_WMSZ_MOVE;
-	move_order.posX = pointerGrabX - posX;
-	move_order.posY = pointerGrabY - posY;
+	move_order.moveSizeType = moveSizeType;
+	if (moveSizeType == RAIL_WMSZ_MOVE) {
+		move_order.posX = pointerGrabX - posX;
+		move_order.posY = pointerGrabY - posY;
+	} else {
+		move_order.posX = pointerGrabX;
+		move_order.posY = pointerGrabY;
+	}
+	rail_state->localMoveSizeType = moveSizeType;
 
 	rdp_debug(b,
 		  "Move order: windowId:0x%x, isMoveSizeStart:%d, moveType:%d, pos:(%d,%d)\n",
@@ -3895,6 +5900,58 @@ rdp_rail_start_window_move(
 	rdp_debug(b, "============== StartWindowMove ==============\n");
 }
 
+static void
+rdp_rail_start_window_move(
+	struct weston_surface* surface,
+	int pointerGrabX,
+	int pointerGrabY)
+{
+	rdp_rail_start_local_move_size(surface, pointerGrabX, pointerGrabY,
+				       RAIL_WMSZ_MOVE);
+}
+
+static void
+rdp_rail_start_window_resize(
+	struct weston_surface* surface,
+	int pointerGrabX,
+	int pointerGrabY,
+	uint32_t edges)
+{
+	uint16_t moveSizeType;
+
+	switch (edges) {
+	case WL_SHELL_SURFACE_RESIZE_LEFT:
+		moveSizeType = RAIL_WMSZ_LEFT;
+		break;
+	case WL_SHELL_SURFACE_RESIZE_RIGHT:
+		moveSizeType = RAIL_WMSZ_RIGHT;
+		break;
+	case WL_SHELL_SURFACE_RESIZE_TOP:
+		moveSizeType = RAIL_WMSZ_TOP;
+		break;
+	case WL_SHELL_SURFACE_RESIZE_TOP_LEFT:
+		moveSizeType = RAIL_WMSZ_TOPLEFT;
+		break;
+	case WL_SHELL_SURFACE_RESIZE_TOP_RIGHT:
+		moveSizeType = RAIL_WMSZ_TOPRIGHT;
+		break;
+	case WL_SHELL_SURFACE_RESIZE_BOTTOM:
+		moveSizeType = RAIL_WMSZ_BOTTOM;
+		break;
+	case WL_SHELL_SURFACE_RESIZE_BOTTOM_LEFT:
+		moveSizeType = RAIL_WMSZ_BOTTOMLEFT;
+		break;
+	case WL_SHELL_SURFACE_RESIZE_BOTTOM_RIGHT:
+		moveSizeType = RAIL_WMSZ_BOTTOMRIGHT;
+		break;
+	default:
+		return;
+	}
+
+	rdp_rail_start_local_move_size(surface, pointerGrabX, pointerGrabY,
+				       moveSizeType);
+}
+
 static void
 rdp_rail_end_window_move(struct weston_surface *surface)
 {
@@ -3954,9 +6011,11 @@ rdp_rail_end_window_move(struct weston_surface *surface)
 
 	move_order.windowId = rail_state->window_id;
 	move_order.isMoveSizeStart = false;
-	move_order.moveSizeType = RAIL_WMSZ_MOVE;
+	move_order.moveSizeType = rail_state->localMoveSizeType ?
+				  rail_state->localMoveSizeType : RAIL_WMSZ_MOVE;
 	move_order.posX = posX;
 	move_order.posY = posY;
+	rail_state->localMoveSizeType = 0;
 
 	rdp_debug(b, "Move order: windowId:0x%x, isMoveSizeStart:%d, moveType:%d, pos:(%d,%d)\n",
 		  move_order.windowId,
@@ -3979,6 +6038,174 @@ rdp_rail_destroy_window_iter(void *element, void *data)
 	rdp_rail_destroy_window(NULL, surface);
 }
 
+/* Window state kept for the client to reconnect to, window is re-created
+ * at client with the same windowId, and its content is sent again. */
+static void
+rdp_rail_park_window(RdpPeerContext *peer_ctx, struct weston_surface *surface)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+
+	/* nothing is sent, connection is gone. */
+	rdp_gfx_codec_avc_destroy(rail_state);
+	rdp_staging_buffer_release(&rail_state->staging_damage);
+	rdp_staging_buffer_release(&rail_state->staging_alpha);
+	rdp_staging_buffer_release(&rail_state->staging_surface);
+	rail_state->isStagingSurfaceValid = false;
+	rdp_tile_hashes_reset(&rail_state->tileHashes);
+
+	if (rail_state->surface_id) {
+		rdp_id_manager_free_id(&peer_ctx->surfaceId,
+				       rail_state->surface_id);
+		rail_state->surface_id = 0;
+	}
+	rdp_id_manager_free_id(&peer_ctx->windowId, rail_state->window_id);
+
+	pixman_region32_fini(&rail_state->damage);
+	pixman_region32_fini(&rail_state->shadow_damage);
+	pixman_region32_fini(&rail_state->refineRegion);
+
+	if (rail_state->repaint_listener.notify) {
+		wl_list_remove(&rail_state->repaint_listener.link);
+		rail_state->repaint_listener.notify = NULL;
+	}
+	wl_list_remove(&rail_state->dirty_link);
+	wl_list_init(&rail_state->dirty_link);
+
+	rail_state->isUpdatePending = false;
+	rail_state->isWindowCreated = false;
+	rail_state->isFirstUpdateDone = false;
+	rail_state->forceRecreateSurface = true;
+	rail_state->forceUpdateWindowState = true;
+	rail_state->isRefineDue = false;
+	rail_state->isRefining = false;
+	rail_state->isPreviewRefreshDue = false;
+	rail_state->isShadowRefreshDue = false;
+	rail_state->surfaceWidth = 0;
+	rail_state->surfaceHeight = 0;
+	free(rail_state->title);
+	rail_state->title = NULL;
+
+	rail_state->isParked = true;
+	wl_list_insert(&b->parked_window_list, &rail_state->parked_link);
+
+	rdp_debug(b, "%s: windowId:0x%x surface:%p\n", __func__,
+		  rail_state->window_id, surface);
+}
+
+static void
+rdp_rail_park_window_iter(void *element, void *data)
+{
+	RdpPeerContext *peer_ctx = data;
+	struct weston_surface *surface = element;
+	struct weston_surface_rail_state *rail_state = surface->backend_state;
+
+	if (rail_state->isCursor || !rail_state->isWindowCreated)
+		rdp_rail_destroy_window(NULL, surface);
+	else
+		rdp_rail_park_window(peer_ctx, surface);
+}
+
+static void
+rdp_rail_discard_parked_window(struct weston_surface_rail_state *rail_state)
+{
+	struct weston_surface *surface = rail_state->surface;
+
+	assert(rail_state->isParked);
+
+	if (rail_state->destroy_listener.notify) {
+		wl_list_remove(&rail_state->destroy_listener.link);
+		rail_state->destroy_listener.notify = NULL;
+	}
+	wl_list_remove(&rail_state->parked_link);
+	wl_list_remove(&rail_state->dirty_link);
+	rdp_tile_hashes_reset(&rail_state->tileHashes);
+	free(rail_state->title);
+	free(rail_state);
+	surface->backend_state = NULL;
+}
+
+static void
+rdp_rail_discard_parked_windows(struct rdp_backend *b)
+{
+	struct weston_surface_rail_state *rail_state, *tmp;
+
+	wl_list_for_each_safe(rail_state, tmp, &b->parked_window_list, parked_link)
+		rdp_rail_discard_parked_window(rail_state);
+}
+
+static int
+rdp_rail_reconnect_grace_timer_func(void *arg)
+{
+	struct rdp_backend *b = arg;
+
+	rdp_debug(b, "%s: client did not reconnect, discarding windows\n",
+		  __func__);
+	rdp_rail_discard_parked_windows(b);
+
+	return 0;
+}
+
+/* Until client offers its persistent cache, surface commands would miss
+ * cache entries it is about to import, so repaint is held back for this
+ * long at most. */
+#define RDP_RAIL_CACHE_IMPORT_WAIT_MS 500
+
+static int
+rdp_rail_cache_import_timer_func(void *arg)
+{
+	RdpPeerContext *peer_ctx = arg;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+
+	rdp_debug(b, "%s: no cache import offer from client\n", __func__);
+	peer_ctx->isCacheImportPending = false;
+	weston_compositor_damage_all(b->compositor);
+
+	return 0;
+}
+
+/* Windows parked by previous connection take back their windowId, they
+ * are re-created at client by rdp_rail_sync_window_status(). */
+static void
+rdp_rail_unpark_windows(RdpPeerContext *peer_ctx)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct weston_surface_rail_state *rail_state, *tmp;
+	struct wl_event_loop *loop;
+	bool anyWindowParked = false;
+
+	if (b->reconnect_grace_timer)
+		wl_event_source_timer_update(b->reconnect_grace_timer, 0);
+
+	wl_list_for_each_safe(rail_state, tmp, &b->parked_window_list, parked_link) {
+		if (!rdp_id_manager_reserve_id(&peer_ctx->windowId,
+					       rail_state->surface,
+					       rail_state->window_id)) {
+			rdp_debug_error(b, "%s: fail to reserve windowId:0x%x\n",
+					__func__, rail_state->window_id);
+			rdp_rail_discard_parked_window(rail_state);
+			continue;
+		}
+		anyWindowParked = true;
+	}
+
+	if (!anyWindowParked || !b->enable_gfx_cache)
+		return;
+
+	if (!peer_ctx->cache_import_timer) {
+		loop = wl_display_get_event_loop(b->compositor->wl_display);
+		peer_ctx->cache_import_timer =
+			wl_event_loop_add_timer(loop,
+						rdp_rail_cache_import_timer_func,
+						peer_ctx);
+		if (!peer_ctx->cache_import_timer)
+			return;
+	}
+	wl_event_source_timer_update(peer_ctx->cache_import_timer,
+				     RDP_RAIL_CACHE_IMPORT_WAIT_MS);
+	peer_ctx->isCacheImportPending = true;
+}
+
 void
 rdp_rail_peer_context_free(freerdp_peer *client, RdpPeerContext *context)
 {
@@ -3986,17 +6213,82 @@ rdp_rail_peer_context_free(freerdp_peer *client, RdpPeerContext *context)
 	RdpgfxServerContext *gfx_ctx;
 	DispServerContext *disp_ctx;
 
+	struct rdp_backend *b = context->rdpBackend;
+	bool park = b->reconnect_grace_sec > 0 &&
+		    context->activationRailCompleted;
+
 	rail_ctx = context->rail_server_context;
 	gfx_ctx = context->rail_grfx_server_context;
 	disp_ctx = context->disp_server_context;
 
-	rdp_id_manager_for_each(&context->windowId,
-				rdp_rail_destroy_window_iter,
-				NULL);
+#ifdef HAVE_FREERDP_GFXREDIR_H
+	/* shared memory sections are gone with the connection. */
+	if (b->use_gfxredir)
+		park = false;
+#endif /* HAVE_FREERDP_GFXREDIR_H */
+
+	if (park) {
+		rdp_id_manager_for_each(&context->windowId,
+					rdp_rail_park_window_iter,
+					context);
+		if (!b->reconnect_grace_timer) {
+			struct wl_event_loop *loop =
+				wl_display_get_event_loop(b->compositor->wl_display);
+
+			b->reconnect_grace_timer =
+				wl_event_loop_add_timer(loop,
+							rdp_rail_reconnect_grace_timer_func,
+							b);
+		}
+		if (b->reconnect_grace_timer)
+			wl_event_source_timer_update(b->reconnect_grace_timer,
+						     b->reconnect_grace_sec * 1000);
+		else
+			rdp_rail_discard_parked_windows(b);
+	} else {
+		rdp_id_manager_for_each(&context->windowId,
+					rdp_rail_destroy_window_iter,
+					NULL);
+	}
+#ifdef HAVE_FREERDP_GFXREDIR_H
+	rdp_destroy_shared_memory_pool(context);
+#endif /* HAVE_FREERDP_GFXREDIR_H */
+	free(context->window_zorder);
+	free(context->window_zorder_next);
+
+	rdp_gfx_codec_context_destroy(&context->gfx_codec_context);
+	rdp_gfx_cache_destroy(&context->gfx_cache);
+
+	if (context->layout_change_timer) {
+		wl_event_source_remove(context->layout_change_timer);
+		context->layout_change_timer = NULL;
+	}
+	free(context->pending_layout_change);
+	context->pending_layout_change = NULL;
+
+	if (context->shadow_refresh_timer) {
+		wl_event_source_remove(context->shadow_refresh_timer);
+		context->shadow_refresh_timer = NULL;
+	}
+	if (context->refine_timer) {
+		wl_event_source_remove(context->refine_timer);
+		context->refine_timer = NULL;
+	}
+	if (context->preview_refresh_timer) {
+		wl_event_source_remove(context->preview_refresh_timer);
+		context->preview_refresh_timer = NULL;
+	}
+	if (context->idle_release_timer) {
+		wl_event_source_remove(context->idle_release_timer);
+		context->idle_release_timer = NULL;
+	}
+	if (context->cache_import_timer) {
+		wl_event_source_remove(context->cache_import_timer);
+		context->cache_import_timer = NULL;
+	}
 
 #ifdef HAVE_FREERDP_RDPAPPLIST_H
 	if (context->applist_server_context) {
-		struct rdp_backend *b = context->rdpBackend;
 		if (context->isAppListEnabled)
 			context->rdpBackend->rdprail_shell_api->stop_app_list_update(context->rdpBackend->rdprail_shell_context);
 		context->applist_server_context->Close(context->applist_server_context);
@@ -4007,7 +6299,6 @@ rdp_rail_peer_context_free(freerdp_peer *client, RdpPeerContext *context)
 
 #ifdef HAVE_FREERDP_GFXREDIR_H
 	if (context->gfxredir_server_context) {
-		struct rdp_backend *b = context->rdpBackend;
 		GfxRedirServerContext *redir_ctx;
 		redir_ctx = context->gfxredir_server_context;
 
@@ -4017,6 +6308,10 @@ rdp_rail_peer_context_free(freerdp_peer *client, RdpPeerContext *context)
 	}
 #endif /* HAVE_FREERDP_GFXREDIR_H */
 
+	if (context->rail_grfx_event_source) {
+		wl_event_source_remove(context->rail_grfx_event_source);
+		context->rail_grfx_event_source = NULL;
+	}
 	if (gfx_ctx) {
 		gfx_ctx->Close(gfx_ctx);
 		rdpgfx_server_context_free(gfx_ctx);
@@ -4122,6 +6417,7 @@ rdp_rail_peer_init(freerdp_peer *client, RdpPeerContext *peer_ctx)
 		goto error_return;
 	}
 #ifdef HAVE_FREERDP_GFXREDIR_H
+	wl_list_init(&peer_ctx->shared_memory_idle_list);
 	/* RDP pool ID must be within 32 bits range, exclude 0. */
 	if (!rdp_id_manager_init(b, &peer_ctx->poolId, 0x1, 0xFFFFFFFF)) {
 		rdp_debug_error(b, "unable to create windowId.\n");
@@ -4136,6 +6432,9 @@ rdp_rail_peer_init(freerdp_peer *client, RdpPeerContext *peer_ctx)
 
 	peer_ctx->currentFrameId = 0;
 	peer_ctx->acknowledgedFrameId = 0;
+	wl_list_init(&peer_ctx->dirty_window_list);
+	rdp_frame_pacer_init(&peer_ctx->frame_pacer, b->enable_frame_pacing);
+	rdp_gfx_cache_init(&peer_ctx->gfx_cache);
 
 	return TRUE;
 
@@ -4335,6 +6634,8 @@ rdp_rail_dump_window_iter(void *element, void *data)
 		surface->input.extents.x2, surface->input.extents.y2);
 	fprintf(fp, "    bufferWidth:%d, bufferHeight:%d\n",
 		rail_state->bufferWidth, rail_state->bufferHeight);
+	fprintf(fp, "    surfaceWidth:%d, surfaceHeight:%d\n",
+		rail_state->surfaceWidth, rail_state->surfaceHeight);
 	fprintf(fp, "    bufferScaleFactorWidth:%.2f, bufferScaleFactorHeight:%.2f\n",
 		rail_state->bufferScaleFactorWidth, rail_state->bufferScaleFactorHeight);
 	fprintf(fp, "    content_buffer_width:%d, content_buffer_height:%d\n",
@@ -4358,6 +6659,13 @@ rdp_rail_dump_window_iter(void *element, void *data)
 		rail_state->forceRecreateSurface, rail_state->error);
 	fprintf(fp, "    isUdatePending:%d, isFirstUpdateDone:%d\n",
 		rail_state->isUpdatePending, rail_state->isFirstUpdateDone);
+	fprintf(fp, "    contentGeneration:%u, sentContentGeneration:%u\n",
+		rail_state->contentGeneration, rail_state->sentContentGeneration);
+	fprintf(fp, "    isPreviewRefreshDue:%d\n", rail_state->isPreviewRefreshDue);
+	fprintf(fp, "    shadowGeometry:(%d, %d) %dx%d, shadow damage held:%d\n",
+		rail_state->shadowGeometry.x, rail_state->shadowGeometry.y,
+		rail_state->shadowGeometry.width, rail_state->shadowGeometry.height,
+		pixman_region32_not_empty(&rail_state->shadow_damage));
 	fprintf(fp, "    surface:0x%p\n", surface);
 	wl_list_for_each(view, &surface->views, surface_link) {
 		fprintf(fp, "    view: %p\n", view);
@@ -4431,6 +6739,8 @@ rdp_rail_dump_window_binding(struct weston_keyboard *keyboard,
 		dump_id_manager_state(fp, &peer_ctx->poolId, "poolId");
 		dump_id_manager_state(fp, &peer_ctx->bufferId, "bufferId");
 #endif /* HAVE_FREERDP_GFXREDIR_H */
+		dump_dispatch_task_state(fp, peer_ctx);
+		dump_output_state(fp, b);
 		context.peer_ctx = peer_ctx;
 		context.fp = fp;
 		rdp_id_manager_for_each(&peer_ctx->windowId, rdp_rail_dump_window_iter, (void*)&context);
@@ -4490,6 +6800,9 @@ rdp_rail_set_window_icon(struct weston_surface *surface, pixman_image_t *icon)
 	int max_icon_height;
 	int target_icon_width;
 	int target_icon_height;
+	uint64_t key;
+	int cacheSlot;
+	int numCacheEntries;
 
 	if (!b || !b->rdp_peer) {
 		rdp_debug_error(b, "set_window_icon(): rdp_peer is not initalized\n");
@@ -4504,10 +6817,11 @@ rdp_rail_set_window_icon(struct weston_surface *surface, pixman_image_t *icon)
 
 	assert_compositor_thread(b);
 
-	if (!rail_state || rail_state->window_id == 0) {
+	if (!rail_state || rail_state->window_id == 0 || rail_state->isParked) {
 		rdp_rail_create_window(NULL, (void *)surface);
 		rail_state = surface->backend_state;
-		if (!rail_state || rail_state->window_id == 0)
+		if (!rail_state || rail_state->window_id == 0 ||
+		    rail_state->isParked)
 			return;
 	}
 
@@ -4544,6 +6858,31 @@ rdp_rail_set_window_icon(struct weston_surface *surface, pixman_image_t *icon)
 	else
 		target_icon_height = height;
 
+	/* windows of same app often share icon, client keeps those sent
+	   with cache slot, so send each distinct icon only once. */
+	key = rdp_content_hash((const BYTE *)pixman_image_get_data(icon), stride,
+			       width * PIXMAN_FORMAT_BPP(format) / 8, height,
+			       (uint64_t)format << 32 |
+			       target_icon_width << 16 | target_icon_height);
+	numCacheEntries = b->rdp_peer->context->settings->RemoteAppNumIconCacheEntries;
+	cacheSlot = rdp_slot_cache_lookup(&peer_ctx->icon_cache, key);
+	if (cacheSlot >= 0) {
+		WINDOW_CACHED_ICON_ORDER cached_icon_order = {};
+
+		rdp_debug_verbose(b, "rdp_rail_set_window_icon: cached icon slot:%d\n",
+				  cacheSlot);
+		order_info.windowId = rail_state->window_id;
+		order_info.fieldFlags = WINDOW_ORDER_TYPE_WINDOW | WINDOW_ORDER_CACHED_ICON;
+		cached_icon_order.cachedIcon.cacheEntry = cacheSlot % numCacheEntries;
+		cached_icon_order.cachedIcon.cacheId = cacheSlot / numCacheEntries;
+
+		update->BeginPaint(update->context);
+		update->window->WindowCachedIcon(update->context, &order_info,
+						 &cached_icon_order);
+		update->EndPaint(update->context);
+		return;
+	}
+
 	/* create icon bitmap with flip in Y-axis, and client always expects a8r8g8b8 format. */
 	scaled_icon = pixman_image_create_bits_no_clear(PIXMAN_a8r8g8b8,
 							target_icon_width,
@@ -4632,8 +6971,14 @@ rdp_rail_set_window_icon(struct weston_surface *surface, pixman_image_t *icon)
 
 	order_info.windowId = rail_state->window_id;
 	order_info.fieldFlags = WINDOW_ORDER_TYPE_WINDOW | WINDOW_ORDER_ICON;
-	icon_info.cacheEntry = 0xFFFF; /* no cache */
-	icon_info.cacheId = 0xFF; /* no cache */
+	cacheSlot = rdp_slot_cache_add(&peer_ctx->icon_cache, key);
+	if (cacheSlot >= 0) {
+		icon_info.cacheEntry = cacheSlot % numCacheEntries;
+		icon_info.cacheId = cacheSlot / numCacheEntries;
+	} else {
+		icon_info.cacheEntry = 0xFFFF; /* no cache */
+		icon_info.cacheId = 0xFF; /* no cache */
+	}
 	icon_info.bpp = 32;
 	icon_info.width = (uint32_t)width;
 	icon_info.height = (uint32_t)height;
@@ -4853,6 +7198,7 @@ struct weston_rdprail_api rdprail_api = {
 	.get_primary_output = rdp_rail_get_primary_output,
 	.notify_window_zorder_change = rdp_rail_notify_window_zorder_change,
 	.notify_window_proxy_surface = rdp_rail_notify_window_proxy_surface,
+	.start_window_resize = rdp_rail_start_window_resize,
 };
 
 int
@@ -4964,6 +7310,10 @@ rdp_rail_backend_create(struct rdp_backend *b, struct weston_rdp_backend_config
 
 	b->use_gfxredir = use_gfxredir;
 	rdp_debug(b, "RDP backend: use_gfxredir = %d\n", b->use_gfxredir);
+
+	b->enable_shm_direct_copy = config->rail_config.enable_shm_direct_copy;
+	rdp_debug(b, "RDP backend: enable_shm_direct_copy = %d\n",
+		  b->enable_shm_direct_copy);
 #endif /* HAVE_FREERDP_GFXREDIR_H */
 
 	b->enable_hi_dpi_support = config->rail_config.enable_hi_dpi_support;
@@ -5006,6 +7356,60 @@ rdp_rail_backend_create(struct rdp_backend *b, struct weston_rdp_backend_config
 	rdp_debug(b, "RDP backend: enable_copy_warning_title = %d\n",
 		  b->enable_copy_warning_title);
 
+	b->gfx_codec = config->rail_config.gfx_codec;
+	rdp_debug(b, "RDP backend: gfx_codec = %d\n",
+		  b->gfx_codec);
+
+	b->gfx_codec_progressive_min_area = config->rail_config.gfx_codec_progressive_min_area;
+	rdp_debug(b, "RDP backend: gfx_codec_progressive_min_area = %d\n",
+		  b->gfx_codec_progressive_min_area);
+
+	b->enable_gfx_avc = config->rail_config.enable_gfx_avc;
+	rdp_debug(b, "RDP backend: enable_gfx_avc = %d\n",
+		  b->enable_gfx_avc);
+
+	b->gfx_avc_min_area = config->rail_config.gfx_avc_min_area;
+	rdp_debug(b, "RDP backend: gfx_avc_min_area = %d\n",
+		  b->gfx_avc_min_area);
+
+	b->enable_gfx_scroll = config->rail_config.enable_gfx_scroll;
+	rdp_debug(b, "RDP backend: enable_gfx_scroll = %d\n",
+		  b->enable_gfx_scroll);
+
+	b->enable_gfx_cache = config->rail_config.enable_gfx_cache;
+	rdp_debug(b, "RDP backend: enable_gfx_cache = %d\n",
+		  b->enable_gfx_cache);
+
+	b->enable_gfx_downscale = config->rail_config.enable_gfx_downscale;
+	rdp_debug(b, "RDP backend: enable_gfx_downscale = %d\n",
+		  b->enable_gfx_downscale);
+
+	b->enable_frame_pacing = config->rail_config.enable_frame_pacing;
+	rdp_debug(b, "RDP backend: enable_frame_pacing = %d\n",
+		  b->enable_frame_pacing);
+
+	b->preview_refresh_interval = MAX(config->rail_config.preview_refresh_interval, 0);
+	rdp_debug(b, "RDP backend: preview_refresh_interval = %d\n",
+		  b->preview_refresh_interval);
+
+	b->enable_gfx_classify = config->rail_config.enable_gfx_classify;
+	rdp_debug(b, "RDP backend: enable_gfx_classify = %d\n",
+		  b->enable_gfx_classify);
+
+	if (config->rail_config.gfx_content_overrides)
+		b->gfx_content_overrides = strdup(config->rail_config.gfx_content_overrides);
+	rdp_debug(b, "RDP backend: gfx_content_overrides = %s\n",
+		  b->gfx_content_overrides ? b->gfx_content_overrides : "(none)");
+
+	b->reconnect_grace_sec = MAX(config->rail_config.reconnect_grace_sec, 0);
+	rdp_debug(b, "RDP backend: reconnect_grace_sec = %d\n",
+		  b->reconnect_grace_sec);
+	wl_list_init(&b->parked_window_list);
+
+	b->enable_subsurface_flattening = config->rail_config.enable_subsurface_flattening;
+	rdp_debug(b, "RDP backend: enable_subsurface_flattening = %d\n",
+		  b->enable_subsurface_flattening);
+
 	b->rdprail_shell_name = NULL;
 
 	/* M to dump all outstanding monitor info */
@@ -5037,7 +7441,12 @@ rdp_rail_destroy(struct rdp_backend *b)
 		b->create_window_listener.notify = NULL;
 	}
 
+	rdp_rail_discard_parked_windows(b);
+	if (b->reconnect_grace_timer)
+		wl_event_source_remove(b->reconnect_grace_timer);
+
 	free(b->rdprail_shell_name);
+	free(b->gfx_content_overrides);
 
 	if (b->debug_binding_M)
 		weston_binding_destroy(b->debug_binding_M);
@@ -0,0 +1,561 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rdp.h"
+
+#include "shared/xalloc.h"
+
+/* Scale box from one size to another, rounding outward. */
+void
+rdp_rail_scale_box(pixman_box32_t *box, int from_width, int from_height,
+		   int to_width, int to_height)
+{
+	if (from_width == to_width && from_height == to_height)
+		return;
+
+	box->x1 = (int64_t)box->x1 * to_width / from_width;
+	box->y1 = (int64_t)box->y1 * to_height / from_height;
+	box->x2 = MIN(((int64_t)box->x2 * to_width + from_width - 1) / from_width,
+		      to_width);
+	box->y2 = MIN(((int64_t)box->y2 * to_height + from_height - 1) / from_height,
+		      to_height);
+}
+
+/* Look up grid aligned tiles of damage snapshot in client's bitmap cache.
+ *
+ * This runs at display loop at submission, which is the same order
+ * as commands reach client, thus the server side view of cache stays
+ * in sync with client's while jobs are encoded in parallel.
+ */
+void
+rdp_rail_surface_command_lookup_cache(RdpPeerContext *peer_ctx,
+				      struct rdp_rail_surface_command_job *job)
+{
+	struct rdp_gfx_cache *cache = &peer_ctx->gfx_cache;
+	const int tileSize = RDP_GFX_CACHE_TILE_SIZE;
+	int x1 = (job->rect.x1 + tileSize - 1) / tileSize * tileSize;
+	int y1 = (job->rect.y1 + tileSize - 1) / tileSize * tileSize;
+	int x2 = job->rect.x2 / tileSize * tileSize;
+	int y2 = job->rect.y2 / tileSize * tileSize;
+
+	if (x2 <= x1 || y2 <= y1 || cache->numSlots == 0)
+		return;
+
+	rdp_gfx_cache_begin_update(cache);
+	job->cacheTiles = xmalloc(sizeof(*job->cacheTiles) *
+				  ((x2 - x1) / tileSize) * ((y2 - y1) / tileSize));
+	for (int y = y1; y < y2; y += tileSize) {
+		for (int x = x1; x < x2; x += tileSize) {
+			struct rdp_rail_surface_command_cache_tile *tile =
+				&job->cacheTiles[job->numCacheTiles];
+			BYTE *bits = job->data +
+				     (y - job->rect.y1) * job->stride +
+				     (x - job->rect.x1) * 4;
+			pixman_box32_t box = { x, y, x + tileSize, y + tileSize };
+			uint64_t key;
+			uint16_t slot;
+
+			if (pixman_region32_contains_rectangle(&job->damage, &box) !=
+			    PIXMAN_REGION_IN)
+				continue;
+
+			if (!rdp_gfx_cache_tile_key(bits, job->stride,
+						    tileSize, tileSize, &key))
+				continue;
+
+			slot = rdp_gfx_cache_lookup(cache, key);
+			tile->isHit = slot != 0;
+			if (!slot)
+				slot = rdp_gfx_cache_add(cache, key, false);
+			if (!slot)
+				continue;
+
+			tile->rect = box;
+			tile->key = key;
+			tile->slot = slot;
+			job->numCacheTiles++;
+		}
+	}
+}
+
+/* Drop tiles of damage snapshot which client already has, clients often
+ * commit with full damage while little or nothing changed. Video frames
+ * are lossy, so client's image is unknown after them. With keepDamage,
+ * the snapshot is sent as is, but its content is still remembered.
+ *
+ * Returns true when nothing is left to send.
+ */
+bool
+rdp_rail_surface_command_drop_unchanged(RdpPeerContext *peer_ctx,
+					struct rdp_rail_surface_command_job *job,
+					bool keepDamage)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct weston_surface_rail_state *rail_state = job->rail_state;
+	bool isDropped;
+	int checked;
+	int unchanged;
+
+	if (job->useAvc) {
+		rdp_tile_hashes_reset(&rail_state->tileHashes);
+		return false;
+	}
+
+	checked = rdp_tile_hashes_filter(&rail_state->tileHashes,
+					 job->surface_width, job->surface_height,
+					 &job->damage, &job->rect, job->data,
+					 job->stride, keepDamage, &unchanged);
+	isDropped = !pixman_region32_not_empty(&job->damage);
+	rdp_tile_hashes_account(b, checked, unchanged, isDropped);
+
+	return isDropped;
+}
+
+/* Place damage snapshot into window image kept in rail_state->staging_surface,
+ * so it holds the same image as client's surface. */
+static BYTE *
+rdp_rail_surface_command_update_staging_surface(struct rdp_rail_surface_command_job *job)
+{
+	struct weston_surface_rail_state *rail_state = job->rail_state;
+	int surfaceStride = job->surface_width * 4;
+	size_t surfaceSize = (size_t)surfaceStride * job->surface_height;
+	int width = job->rect.x2 - job->rect.x1;
+	int height = job->rect.y2 - job->rect.y1;
+	bool isFresh = rail_state->staging_surface.size < surfaceSize;
+	BYTE *surfaceBits;
+
+	if (job->surfaceData)
+		return job->surfaceData;
+
+	job->surfaceData = rdp_staging_buffer_reserve(&rail_state->staging_surface,
+						      surfaceSize);
+	surfaceBits = job->surfaceData +
+		      job->rect.y1 * surfaceStride +
+		      job->rect.x1 * 4;
+	for (int i = 0; i < height; i++)
+		memcpy(surfaceBits + i * surfaceStride,
+		       job->data + i * job->stride,
+		       width * 4);
+
+	/* newly allocated image is only usable as reference when
+	   entire window has been placed into it. */
+	if (isFresh)
+		rail_state->isStagingSurfaceValid =
+			width == job->surface_width &&
+			height == job->surface_height;
+
+	return job->surfaceData;
+}
+
+/* Text and UI are sent lossless and images with progressive, by app_id
+ * override of window, or as classified. Refinement stays lossless. */
+static enum rdp_gfx_quality
+rdp_rail_surface_command_rect_quality(RdpPeerContext *peer_ctx,
+				      struct rdp_rail_surface_command_job *job,
+				      struct rdp_rail_surface_command_rect *r)
+{
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	enum rdp_gfx_content content = job->contentOverride;
+	int width = r->rect.x2 - r->rect.x1;
+	int height = r->rect.y2 - r->rect.y1;
+
+	if (!b->enable_gfx_classify ||
+	    b->gfx_codec != WESTON_RDP_GFX_CODEC_AUTO ||
+	    job->quality == RDP_GFX_QUALITY_LOSSLESS)
+		return job->quality;
+
+	if (content == RDP_GFX_CONTENT_UNKNOWN) {
+		content = rdp_gfx_codec_classify(r->data, job->stride,
+						 width, height);
+		if (content != RDP_GFX_CONTENT_UNKNOWN &&
+		    width * height > job->contentArea) {
+			job->content = content;
+			job->contentArea = width * height;
+		}
+	}
+
+	switch (content) {
+	case RDP_GFX_CONTENT_TEXT:
+		return RDP_GFX_QUALITY_LOSSLESS;
+	case RDP_GFX_CONTENT_IMAGE:
+	case RDP_GFX_CONTENT_VIDEO:
+		return RDP_GFX_QUALITY_COARSE;
+	default:
+		return job->quality;
+	}
+}
+
+void
+rdp_rail_surface_command_encode(struct rdp_encoder_job *base,
+				struct rdp_gfx_codec_context *codec)
+{
+	struct rdp_rail_surface_command_job *job =
+		container_of(base, struct rdp_rail_surface_command_job, base);
+	RdpPeerContext *peer_ctx = base->peerCtx;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	struct weston_surface_rail_state *rail_state = job->rail_state;
+	int width = job->rect.x2 - job->rect.x1;
+	int height = job->rect.y2 - job->rect.y1;
+	int surfaceStride = job->surface_width * 4;
+	pixman_region32_t region;
+	pixman_box32_t *rects;
+	int alphaSize = 0;
+	BYTE *alpha;
+
+	/* compare against what client already has in its surface */
+	if (job->detectScroll && rail_state->isStagingSurfaceValid &&
+	    rail_state->staging_surface.size >= (size_t)surfaceStride * job->surface_height) {
+		const BYTE *oldBits = (BYTE *)rail_state->staging_surface.data +
+				      job->rect.y1 * surfaceStride +
+				      job->rect.x1 * 4;
+		pixman_box32_t dest;
+
+		if (rdp_gfx_codec_detect_scroll(oldBits, surfaceStride,
+						job->data, job->stride,
+						width, height,
+						&job->scrollDx, &job->scrollDy,
+						&dest)) {
+			job->isScrolled = true;
+			job->scrollRect.x1 = job->rect.x1 + dest.x1;
+			job->scrollRect.y1 = job->rect.y1 + dest.y1;
+			job->scrollRect.x2 = job->rect.x1 + dest.x2;
+			job->scrollRect.y2 = job->rect.y1 + dest.y2;
+		}
+	}
+
+	if (job->useStagingSurface)
+		rdp_rail_surface_command_update_staging_surface(job);
+
+	pixman_region32_init(&region);
+	pixman_region32_copy(&region, &job->damage);
+	if (job->isScrolled) {
+		pixman_region32_t scrolled;
+
+		pixman_region32_init_rect(&scrolled,
+					  job->scrollRect.x1, job->scrollRect.y1,
+					  job->scrollRect.x2 - job->scrollRect.x1,
+					  job->scrollRect.y2 - job->scrollRect.y1);
+		pixman_region32_subtract(&region, &region, &scrolled);
+		pixman_region32_fini(&scrolled);
+	}
+	for (int i = 0; i < job->numCacheTiles; i++) {
+		pixman_box32_t *tile = &job->cacheTiles[i].rect;
+		pixman_region32_t cached;
+
+		if (!job->cacheTiles[i].isHit)
+			continue;
+
+		pixman_region32_init_rect(&cached, tile->x1, tile->y1,
+					  tile->x2 - tile->x1,
+					  tile->y2 - tile->y1);
+		pixman_region32_subtract(&region, &region, &cached);
+		pixman_region32_fini(&cached);
+	}
+	rects = pixman_region32_rectangles(&region, &job->numRects);
+	job->rects = xzalloc(sizeof(*job->rects) * MAX(job->numRects, 1));
+	for (int i = 0; i < job->numRects; i++) {
+		struct rdp_rail_surface_command_rect *r = &job->rects[i];
+		int rectWidth = rects[i].x2 - rects[i].x1;
+		int rectHeight = rects[i].y2 - rects[i].y1;
+
+		r->rect = rects[i];
+		r->data = job->data +
+			  (r->rect.y1 - job->rect.y1) * job->stride +
+			  (r->rect.x1 - job->rect.x1) * 4;
+		if (job->useAvc) {
+			r->codecId = RDPGFX_CODECID_AVC420;
+		} else {
+			enum rdp_gfx_quality quality =
+				rdp_rail_surface_command_rect_quality(peer_ctx, job, r);
+
+			r->codecId = rdp_gfx_codec_select(peer_ctx, rectWidth, rectHeight,
+							  quality);
+		}
+		alphaSize += rdp_gfx_codec_alpha_max_size(rectWidth, rectHeight,
+							  job->hasAlpha);
+	}
+	pixman_region32_fini(&region);
+
+	alpha = rdp_staging_buffer_reserve(&rail_state->staging_alpha, alphaSize);
+	for (int i = 0; i < job->numRects; i++) {
+		struct rdp_rail_surface_command_rect *r = &job->rects[i];
+		int rectWidth = r->rect.x2 - r->rect.x1;
+		int rectHeight = r->rect.y2 - r->rect.y1;
+		uint16_t codecId = r->codecId;
+
+		if (codecId == RDPGFX_CODECID_AVC420) {
+			if (!rdp_gfx_codec_encode_avc420(peer_ctx, rail_state, r->data,
+							 rectWidth, rectHeight, job->stride,
+							 &r->output))
+				codecId = rdp_gfx_codec_select(peer_ctx, rectWidth, rectHeight,
+							       job->quality);
+		}
+
+		if (codecId == RDPGFX_CODECID_PLANAR) {
+			/* planar is placed by surface command's dest rect,
+			   thus damage can be compressed as is. */
+			pixman_box32_t codec_box = { 0, 0, rectWidth, rectHeight };
+
+			if (!rdp_gfx_codec_encode(peer_ctx, codec, codecId, r->data,
+						  rectWidth, rectHeight, job->stride,
+						  &codec_box, &r->output))
+				codecId = RDPGFX_CODECID_UNCOMPRESSED;
+		} else if (codecId == RDPGFX_CODECID_CAPROGRESSIVE) {
+			/* progressive takes window sized surface image. */
+			BYTE *surfaceData = rdp_rail_surface_command_update_staging_surface(job);
+
+			if (!rdp_gfx_codec_encode(peer_ctx, codec, codecId, surfaceData,
+						  job->surface_width, job->surface_height,
+						  surfaceStride, &r->rect, &r->output))
+				codecId = RDPGFX_CODECID_UNCOMPRESSED;
+		}
+		if (r->output.codecId != codecId)
+			rdp_debug_error(b, "codec 0x%x failed for windowId:0x%x, fallback to codec 0x%x\n",
+					r->output.codecId, job->window_id, codecId);
+		r->codecId = codecId;
+
+		if (codecId == RDPGFX_CODECID_UNCOMPRESSED) {
+			/* uncompressed bitmap must be packed. */
+			r->output.codecId = codecId;
+			r->output.length = rectWidth * 4 * rectHeight;
+			if (rectWidth * 4 == job->stride) {
+				r->output.data = r->data;
+			} else {
+				r->output.data = xmalloc(r->output.length);
+				r->output.free_data = true;
+				for (int j = 0; j < rectHeight; j++)
+					memcpy(r->output.data + j * rectWidth * 4,
+					       r->data + j * job->stride,
+					       rectWidth * 4);
+			}
+		}
+
+		/* generate alpha only bitmap */
+		r->alpha = alpha;
+		r->alphaSize = rdp_gfx_codec_build_alpha(r->data, job->stride,
+							 rectWidth, rectHeight,
+							 job->hasAlpha, r->alpha);
+		alpha += rdp_gfx_codec_alpha_max_size(rectWidth, rectHeight,
+						      job->hasAlpha);
+	}
+}
+
+/* Keep track of the part of window client has with lossy codec, which
+ * is re-sent lossless once the window stays idle. */
+static void
+rdp_rail_surface_command_track_refine(RdpPeerContext *peer_ctx,
+				      struct rdp_rail_surface_command_job *job)
+{
+	struct weston_surface_rail_state *rail_state = job->rail_state;
+	pixman_region32_t *refine = &rail_state->refineRegion;
+
+	/* moved content keeps its quality. */
+	if (job->isScrolled && pixman_region32_not_empty(refine))
+		pixman_region32_union_rect(refine, refine,
+					   job->scrollRect.x1, job->scrollRect.y1,
+					   job->scrollRect.x2 - job->scrollRect.x1,
+					   job->scrollRect.y2 - job->scrollRect.y1);
+
+	for (int i = 0; i < job->numRects; i++) {
+		pixman_box32_t *rect = &job->rects[i].rect;
+
+		if (rdp_gfx_codec_is_lossy(job->rects[i].codecId)) {
+			pixman_region32_union_rect(refine, refine,
+						   rect->x1, rect->y1,
+						   rect->x2 - rect->x1,
+						   rect->y2 - rect->y1);
+		} else {
+			pixman_region32_t sent;
+
+			pixman_region32_init_rect(&sent, rect->x1, rect->y1,
+						  rect->x2 - rect->x1,
+						  rect->y2 - rect->y1);
+			pixman_region32_subtract(refine, refine, &sent);
+			pixman_region32_fini(&sent);
+		}
+	}
+
+	if (pixman_region32_not_empty(refine))
+		rdp_rail_schedule_refine(peer_ctx);
+}
+
+void
+rdp_rail_surface_command_done(bool freeOnly, struct rdp_encoder_job *base)
+{
+	struct rdp_rail_surface_command_job *job =
+		container_of(base, struct rdp_rail_surface_command_job, base);
+	RdpPeerContext *peer_ctx = base->peerCtx;
+	struct rdp_backend *b = peer_ctx->rdpBackend;
+	RdpgfxServerContext *gfx_ctx = peer_ctx->rail_grfx_server_context;
+	uint64_t sent = 0;
+
+	assert_compositor_thread(b);
+
+	if (freeOnly)
+		goto out;
+
+	if (job->isScrolled) {
+		/* move content client already has, then fill in the rest. */
+		RDPGFX_SURFACE_TO_SURFACE_PDU surfaceToSurface = {};
+		RDPGFX_POINT16 destPt;
+
+		surfaceToSurface.surfaceIdSrc = job->surface_id;
+		surfaceToSurface.surfaceIdDest = job->surface_id;
+		surfaceToSurface.rectSrc.left = job->scrollRect.x1 - job->scrollDx;
+		surfaceToSurface.rectSrc.top = job->scrollRect.y1 - job->scrollDy;
+		surfaceToSurface.rectSrc.right = job->scrollRect.x2 - job->scrollDx;
+		surfaceToSurface.rectSrc.bottom = job->scrollRect.y2 - job->scrollDy;
+		destPt.x = job->scrollRect.x1;
+		destPt.y = job->scrollRect.y1;
+		surfaceToSurface.destPtsCount = 1;
+		surfaceToSurface.destPts = &destPt;
+		rdp_debug_verbose(b, "SurfaceToSurface(frameId:0x%x, windowId:0x%x) (%d,%d)-(%d,%d) by (%d,%d)\n",
+				  job->frame_id, job->window_id,
+				  job->scrollRect.x1, job->scrollRect.y1,
+				  job->scrollRect.x2, job->scrollRect.y2,
+				  job->scrollDx, job->scrollDy);
+		gfx_ctx->SurfaceToSurface(gfx_ctx, &surfaceToSurface);
+	}
+
+	/* copy tiles client already has in its cache */
+	for (int i = 0; i < job->numCacheTiles; i++) {
+		struct rdp_rail_surface_command_cache_tile *tile = &job->cacheTiles[i];
+		RDPGFX_CACHE_TO_SURFACE_PDU cacheToSurface = {};
+		RDPGFX_POINT16 destPt;
+
+		if (!tile->isHit)
+			continue;
+
+		destPt.x = tile->rect.x1;
+		destPt.y = tile->rect.y1;
+		cacheToSurface.cacheSlot = tile->slot;
+		cacheToSurface.surfaceId = job->surface_id;
+		cacheToSurface.destPtsCount = 1;
+		cacheToSurface.destPts = &destPt;
+		rdp_debug_verbose(b, "CacheToSurface(frameId:0x%x, windowId:0x%x) slot:%d at (%d,%d)\n",
+				  job->frame_id, job->window_id, tile->slot,
+				  destPt.x, destPt.y);
+		gfx_ctx->CacheToSurface(gfx_ctx, &cacheToSurface);
+	}
+
+	for (int i = 0; i < job->numRects; i++) {
+		struct rdp_rail_surface_command_rect *r = &job->rects[i];
+		RDPGFX_SURFACE_COMMAND surfaceCommand = {};
+		RDPGFX_SURFACE_COMMAND alphaCommand;
+
+		surfaceCommand.surfaceId = job->surface_id;
+		surfaceCommand.contextId = 0;
+		surfaceCommand.format = PIXEL_FORMAT_BGRA32;
+		surfaceCommand.left = r->rect.x1;
+		surfaceCommand.top = r->rect.y1;
+		surfaceCommand.right = r->rect.x2;
+		surfaceCommand.bottom = r->rect.y2;
+		surfaceCommand.width = r->rect.x2 - r->rect.x1;
+		surfaceCommand.height = r->rect.y2 - r->rect.y1;
+
+		alphaCommand = surfaceCommand;
+		alphaCommand.codecId = RDPGFX_CODECID_ALPHA;
+		alphaCommand.length = r->alphaSize;
+		alphaCommand.data = r->alpha;
+		alphaCommand.extra = NULL;
+
+		surfaceCommand.codecId = r->codecId;
+		surfaceCommand.length = r->output.length;
+		surfaceCommand.data = r->output.data;
+		if (r->codecId == RDPGFX_CODECID_AVC420)
+			surfaceCommand.extra = &r->output.avc420;
+		sent += surfaceCommand.length + alphaCommand.length;
+
+		if (r->codecId == RDPGFX_CODECID_UNCOMPRESSED) {
+			/* send alpha channel */
+			rdp_debug_verbose(b, "SurfaceCommand(frameId:0x%x, windowId:0x%x) for alpha\n",
+					  job->frame_id, job->window_id);
+			gfx_ctx->SurfaceCommand(gfx_ctx, &alphaCommand);
+
+			/* send bitmap data */
+			rdp_debug_verbose(b, "SurfaceCommand(frameId:0x%x, windowId:0x%x) for bitmap\n",
+					  job->frame_id, job->window_id);
+			gfx_ctx->SurfaceCommand(gfx_ctx, &surfaceCommand);
+		} else {
+			/* send compressed bitmap data, compressed codecs
+			   do not carry alpha, so alpha must follow. */
+			rdp_debug_verbose(b, "SurfaceCommand(frameId:0x%x, windowId:0x%x) for bitmap codec:0x%x length:%d\n",
+					  job->frame_id, job->window_id,
+					  r->codecId, r->output.length);
+			gfx_ctx->SurfaceCommand(gfx_ctx, &surfaceCommand);
+
+			/* send alpha channel */
+			rdp_debug_verbose(b, "SurfaceCommand(frameId:0x%x, windowId:0x%x) for alpha\n",
+					  job->frame_id, job->window_id);
+			gfx_ctx->SurfaceCommand(gfx_ctx, &alphaCommand);
+		}
+	}
+
+	/* now that surface has new tiles, store them into cache */
+	for (int i = 0; i < job->numCacheTiles; i++) {
+		struct rdp_rail_surface_command_cache_tile *tile = &job->cacheTiles[i];
+		RDPGFX_SURFACE_TO_CACHE_PDU surfaceToCache = {};
+
+		if (tile->isHit)
+			continue;
+
+		surfaceToCache.surfaceId = job->surface_id;
+		surfaceToCache.cacheKey = tile->key;
+		surfaceToCache.cacheSlot = tile->slot;
+		surfaceToCache.rectSrc.left = tile->rect.x1;
+		surfaceToCache.rectSrc.top = tile->rect.y1;
+		surfaceToCache.rectSrc.right = tile->rect.x2;
+		surfaceToCache.rectSrc.bottom = tile->rect.y2;
+		rdp_debug_verbose(b, "SurfaceToCache(frameId:0x%x, windowId:0x%x) slot:%d from (%d,%d)\n",
+				  job->frame_id, job->window_id, tile->slot,
+				  tile->rect.x1, tile->rect.y1);
+		gfx_ctx->SurfaceToCache(gfx_ctx, &surfaceToCache);
+	}
+
+	if (job->content != RDP_GFX_CONTENT_UNKNOWN)
+		job->rail_state->content = job->content;
+
+	weston_surface_client_stats_add(job->rail_state->surface,
+					WESTON_CLIENT_STAT_REMOTE_BYTES, sent);
+
+	/* explicitly configured codec is never refined. */
+	if (b->refine_quality && b->gfx_codec == WESTON_RDP_GFX_CODEC_AUTO)
+		rdp_rail_surface_command_track_refine(peer_ctx, job);
+
+out:
+	/* data and alpha are owned by rail_state, and reused at next update. */
+	for (int i = 0; i < job->numRects; i++)
+		rdp_gfx_codec_output_release(&job->rects[i].output);
+	free(job->rects);
+	free(job->cacheTiles);
+	pixman_region32_fini(&job->damage);
+	free(job);
+}
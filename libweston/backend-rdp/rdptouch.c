@@ -0,0 +1,262 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rdp.h"
+
+static bool
+rdp_touch_contact_is_down(RdpPeerContext *peerCtx, uint32_t id)
+{
+	return peerCtx->touch_contacts[id / 32] & (1u << (id % 32));
+}
+
+static void
+rdp_touch_contact_set_down(RdpPeerContext *peerCtx, uint32_t id, bool down)
+{
+	if (down)
+		peerCtx->touch_contacts[id / 32] |= 1u << (id % 32);
+	else
+		peerCtx->touch_contacts[id / 32] &= ~(1u << (id % 32));
+}
+
+static void
+rdp_touch_cancel(RdpPeerContext *peerCtx)
+{
+	memset(peerCtx->touch_contacts, 0, sizeof peerCtx->touch_contacts);
+	notify_touch_cancel(peerCtx->touch_device);
+}
+
+/* Returns true if a touch event was notified for the contact. */
+static bool
+rdp_touch_notify_contact(RdpPeerContext *peerCtx, const struct timespec *time,
+			 const RDPINPUT_CONTACT_DATA *contact)
+{
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	uint32_t id = contact->contactId;
+	bool was_down;
+	int touch_type;
+	int32_t sx, sy;
+
+	if (id >= RDP_TOUCH_MAX_CONTACTS) {
+		rdp_debug_error(b, "%s: invalid contactId:%u\n", __func__, id);
+		return false;
+	}
+
+	was_down = rdp_touch_contact_is_down(peerCtx, id);
+	if (contact->contactFlags & CONTACT_FLAG_UP) {
+		if (!was_down)
+			return false;
+		touch_type = WL_TOUCH_UP;
+	} else if (contact->contactFlags & (CONTACT_FLAG_DOWN | CONTACT_FLAG_UPDATE)) {
+		/* hovering contact, not in contact with the screen */
+		if (!(contact->contactFlags & CONTACT_FLAG_INCONTACT))
+			return false;
+		touch_type = was_down ? WL_TOUCH_MOTION : WL_TOUCH_DOWN;
+	} else {
+		return false;
+	}
+
+	/* same as pointer, the position is relative to the client's desktop */
+	sx = contact->x + peerCtx->desktop_left;
+	sy = contact->y + peerCtx->desktop_top;
+	if (touch_type != WL_TOUCH_UP &&
+	    !to_weston_coordinate(peerCtx, &sx, &sy, NULL, NULL)) {
+		/* outside of any output, a new contact is dropped, and
+		   an active one stays where it was last reported. */
+		return false;
+	}
+
+	rdp_debug_verbose(b, "RDP touch: contact:%u flags:0x%x (%d, %d) type:%d\n",
+			  id, contact->contactFlags, sx, sy, touch_type);
+
+	notify_touch(peerCtx->touch_device, time, id, sx, sy, touch_type);
+	rdp_touch_contact_set_down(peerCtx, id, touch_type != WL_TOUCH_UP);
+
+	return true;
+}
+
+static UINT
+rdp_touch_client_ready(RdpeiServerContext *context)
+{
+	RdpPeerContext *peerCtx = context->user_data;
+	struct rdp_backend *b = peerCtx->rdpBackend;
+
+	rdp_debug(b, "RDP touch: client version:0x%x maxTouchPoints:%u protocolFlags:0x%x\n",
+		  context->clientVersion, context->maxTouchPoints,
+		  context->protocolFlags);
+
+	return CHANNEL_RC_OK;
+}
+
+/* Each RDPINPUT_TOUCH_FRAME carries every active contact of one client
+ * frame, notify all of its contacts and close it with a single frame. */
+static UINT
+rdp_touch_client_touch_event(RdpeiServerContext *context,
+			     const RDPINPUT_TOUCH_EVENT *touchEvent)
+{
+	RdpPeerContext *peerCtx = context->user_data;
+	struct timespec time;
+	uint16_t i, j;
+
+	assert_compositor_thread(peerCtx->rdpBackend);
+
+	weston_compositor_get_time(&time);
+
+	for (i = 0; i < touchEvent->frameCount; i++) {
+		const RDPINPUT_TOUCH_FRAME *frame = &touchEvent->frames[i];
+		bool need_frame = false;
+		bool canceled = false;
+
+		for (j = 0; j < frame->contactCount; j++) {
+			const RDPINPUT_CONTACT_DATA *contact = &frame->contacts[j];
+
+			if (contact->contactFlags & CONTACT_FLAG_CANCELED) {
+				canceled = true;
+				break;
+			}
+
+			if (rdp_touch_notify_contact(peerCtx, &time, contact))
+				need_frame = true;
+		}
+
+		/* weston can only cancel the whole touch sequence */
+		if (canceled)
+			rdp_touch_cancel(peerCtx);
+		else if (need_frame)
+			notify_touch_frame(peerCtx->touch_device);
+	}
+
+	return CHANNEL_RC_OK;
+}
+
+static int
+rdp_touch_activity(int fd, uint32_t mask, void *data)
+{
+	RdpPeerContext *peerCtx = data;
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	UINT error;
+
+	error = rdpei_server_handle_messages(peerCtx->rdpei_server_context);
+	if (error != CHANNEL_RC_OK) {
+		rdp_debug_error(b, "RDP touch: failed to handle messages (0x%x), touch input disabled\n",
+				error);
+		wl_event_source_remove(peerCtx->rdpei_event_source);
+		peerCtx->rdpei_event_source = NULL;
+		if (peerCtx->touch_device)
+			rdp_touch_cancel(peerCtx);
+	}
+
+	return 0;
+}
+
+bool
+rdp_touch_init(freerdp_peer *client)
+{
+	RdpPeerContext *peerCtx = (RdpPeerContext *)client->context;
+	struct rdp_backend *b = peerCtx->rdpBackend;
+	struct weston_seat *seat = peerCtx->item.seat;
+	struct wl_event_loop *loop;
+	RdpeiServerContext *rdpei_ctx;
+	UINT error;
+	int fd;
+
+	assert(seat);
+
+	assert_compositor_thread(b);
+
+	rdpei_ctx = rdpei_server_context_new(peerCtx->vcm);
+	if (!rdpei_ctx)
+		return false;
+	peerCtx->rdpei_server_context = rdpei_ctx;
+	rdpei_ctx->user_data = peerCtx;
+	rdpei_ctx->onClientReady = rdp_touch_client_ready;
+	rdpei_ctx->onTouchEvent = rdp_touch_client_touch_event;
+
+	error = rdpei_server_init(rdpei_ctx);
+	if (error != CHANNEL_RC_OK) {
+		rdp_debug_error(b, "RDP touch: failed to open channel (0x%x)\n", error);
+		goto error_exit;
+	}
+
+#ifdef HAVE_RDPEI_SC_READY_FEATURES
+	error = rdpei_server_send_sc_ready(rdpei_ctx, RDPINPUT_PROTOCOL_V10, 0);
+#else
+	error = rdpei_server_send_sc_ready(rdpei_ctx, RDPINPUT_PROTOCOL_V10);
+#endif
+	if (error != CHANNEL_RC_OK) {
+		rdp_debug_error(b, "RDP touch: failed to send ready (0x%x)\n", error);
+		goto error_exit;
+	}
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	fd = GetEventFileDescriptor(rdpei_server_get_event_handle(rdpei_ctx));
+	if (!rdp_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+				   rdp_touch_activity, peerCtx,
+				   &peerCtx->rdpei_event_source))
+		goto error_exit;
+
+	weston_seat_init_touch(seat);
+	peerCtx->touch_device =
+		weston_touch_create_touch_device(seat->touch_state,
+						 "rdp-touch", NULL, NULL);
+	if (!peerCtx->touch_device) {
+		weston_seat_release_touch(seat);
+		goto error_exit;
+	}
+
+	return true;
+
+error_exit:
+	rdp_touch_destroy(peerCtx);
+	return false;
+}
+
+void
+rdp_touch_destroy(RdpPeerContext *peerCtx)
+{
+	assert_compositor_thread(peerCtx->rdpBackend);
+
+	if (peerCtx->rdpei_event_source) {
+		wl_event_source_remove(peerCtx->rdpei_event_source);
+		peerCtx->rdpei_event_source = NULL;
+	}
+
+	if (peerCtx->touch_device) {
+		weston_touch_device_destroy(peerCtx->touch_device);
+		peerCtx->touch_device = NULL;
+		weston_seat_release_touch(peerCtx->item.seat);
+	}
+	memset(peerCtx->touch_contacts, 0, sizeof peerCtx->touch_contacts);
+
+	if (peerCtx->rdpei_server_context) {
+		rdpei_server_context_free(peerCtx->rdpei_server_context);
+		peerCtx->rdpei_server_context = NULL;
+	}
+}
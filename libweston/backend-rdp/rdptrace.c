@@ -0,0 +1,208 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "rdp.h"
+#include "rdptrace.h"
+
+/* Capture of window updates for offline replay through the surface
+ * command encoder, see rdptrace.h for the format. Records are written
+ * from the display loop only, in the order they happen. */
+
+static void
+rdp_trace_write(struct rdp_backend *b, uint32_t type,
+		const struct iovec *iov, int iovcnt,
+		const struct timespec *time)
+{
+	struct rdp_trace_record record = {};
+	struct timespec now;
+	bool ok;
+
+	if (!time) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		time = &now;
+	}
+
+	record.type = type;
+	for (int i = 0; i < iovcnt; i++)
+		record.size += iov[i].iov_len;
+	record.time_nsec = timespec_to_nsec(time);
+
+	ok = fwrite(&record, sizeof record, 1, b->trace) == 1;
+	for (int i = 0; ok && i < iovcnt; i++)
+		ok = iov[i].iov_len == 0 ||
+		     fwrite(iov[i].iov_base, iov[i].iov_len, 1, b->trace) == 1;
+	if (!ok) {
+		rdp_debug_error(b, "RDP trace: write failed, stopping capture: %s\n",
+				strerror(errno));
+		rdp_trace_close(b);
+	}
+}
+
+bool
+rdp_trace_open(struct rdp_backend *b, const char *path)
+{
+	struct rdp_trace_header header = {
+		.magic = RDP_TRACE_MAGIC,
+		.version = RDP_TRACE_VERSION,
+	};
+
+	b->trace = fopen(path, "we");
+	if (!b->trace) {
+		rdp_debug_error(b, "RDP trace: failed to open %s: %s\n",
+				path, strerror(errno));
+		return false;
+	}
+
+	if (fwrite(&header, sizeof header, 1, b->trace) != 1) {
+		rdp_trace_close(b);
+		return false;
+	}
+
+	rdp_debug(b, "RDP trace: capturing into %s\n", path);
+	return true;
+}
+
+void
+rdp_trace_close(struct rdp_backend *b)
+{
+	if (!b->trace)
+		return;
+
+	fclose(b->trace);
+	b->trace = NULL;
+}
+
+void
+rdp_trace_config(struct rdp_backend *b, RdpPeerContext *peer_ctx)
+{
+	struct rdp_trace_config config = {};
+	struct iovec iov;
+
+	if (!b->trace)
+		return;
+
+	config.caps_version = peer_ctx->gfxCapsVersion;
+	config.caps_flags = peer_ctx->gfxCapsFlags;
+	config.gfx_codec = b->gfx_codec;
+	config.progressive_min_area = b->gfx_codec_progressive_min_area;
+	if (peer_ctx->gfx_cache.numSlots)
+		config.flags |= RDP_TRACE_CONFIG_CACHE;
+
+	iov.iov_base = &config;
+	iov.iov_len = sizeof config;
+	rdp_trace_write(b, RDP_TRACE_CONFIG, &iov, 1, NULL);
+}
+
+void
+rdp_trace_surface_command(struct rdp_backend *b,
+			  const struct rdp_rail_surface_command_job *job,
+			  bool useCache, uint64_t readback_nsec)
+{
+	struct rdp_trace_surface_command cmd = {};
+	int width = job->rect.x2 - job->rect.x1;
+	int height = job->rect.y2 - job->rect.y1;
+	struct iovec iov[3];
+	pixman_box32_t *rects;
+	int nrects;
+
+	if (!b->trace)
+		return;
+
+	/* snapshot is packed by the job, which replay relies on. */
+	assert(job->stride == width * 4);
+
+	rects = pixman_region32_rectangles((pixman_region32_t *)&job->damage,
+					   &nrects);
+	cmd.window_id = job->window_id;
+	cmd.frame_id = job->frame_id;
+	cmd.surface_width = job->surface_width;
+	cmd.surface_height = job->surface_height;
+	cmd.x1 = job->rect.x1;
+	cmd.y1 = job->rect.y1;
+	cmd.x2 = job->rect.x2;
+	cmd.y2 = job->rect.y2;
+	if (job->hasAlpha)
+		cmd.flags |= RDP_TRACE_COMMAND_HAS_ALPHA;
+	if (job->useAvc)
+		cmd.flags |= RDP_TRACE_COMMAND_USE_AVC;
+	if (job->useStagingSurface)
+		cmd.flags |= RDP_TRACE_COMMAND_STAGING;
+	if (job->detectScroll)
+		cmd.flags |= RDP_TRACE_COMMAND_SCROLL;
+	if (useCache)
+		cmd.flags |= RDP_TRACE_COMMAND_CACHE;
+	cmd.num_damage_rects = nrects;
+	cmd.readback_nsec = readback_nsec;
+
+	iov[0].iov_base = &cmd;
+	iov[0].iov_len = sizeof cmd;
+	iov[1].iov_base = rects;
+	iov[1].iov_len = sizeof(*rects) * nrects;
+	iov[2].iov_base = job->data;
+	iov[2].iov_len = (size_t)job->stride * height;
+	rdp_trace_write(b, RDP_TRACE_SURFACE_COMMAND, iov, ARRAY_LENGTH(iov), NULL);
+}
+
+void
+rdp_trace_frame_end(struct rdp_backend *b, uint32_t frame_id)
+{
+	struct rdp_trace_frame frame = {};
+	struct iovec iov;
+
+	if (!b->trace)
+		return;
+
+	frame.frame_id = frame_id;
+	iov.iov_base = &frame;
+	iov.iov_len = sizeof frame;
+	rdp_trace_write(b, RDP_TRACE_FRAME_END, &iov, 1, NULL);
+}
+
+void
+rdp_trace_frame_ack(struct rdp_backend *b, uint32_t frame_id,
+		    uint32_t queue_depth, const struct timespec *ack_time)
+{
+	struct rdp_trace_frame_ack ack = {};
+	struct iovec iov;
+
+	if (!b->trace)
+		return;
+
+	ack.frame_id = frame_id;
+	ack.queue_depth = queue_depth;
+	iov.iov_base = &ack;
+	iov.iov_len = sizeof ack;
+	rdp_trace_write(b, RDP_TRACE_FRAME_ACK, &iov, 1, ack_time);
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RDP_TRACE_H
+#define RDP_TRACE_H
+
+#include <stdint.h>
+
+/* Stream format of WESTON_RDP_TRACE_FILE, in host byte order.
+ *
+ * The stream starts with a struct rdp_trace_header, followed by records,
+ * each a struct rdp_trace_record and 'size' bytes of payload. Time is
+ * CLOCK_MONOTONIC in ns.
+ *
+ * RDP_TRACE_SURFACE_COMMAND is one window update as submitted to the
+ * encoder, its payload is struct rdp_trace_surface_command, then
+ * num_damage_rects pixman_box32_t of damage in surface coordinate, then
+ * the damage snapshot, (x2 - x1) * 4 bytes per row of the job rect.
+ */
+
+#define RDP_TRACE_MAGIC		0x52545257 /* "WRTR" */
+#define RDP_TRACE_VERSION	1
+
+struct rdp_trace_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+enum rdp_trace_record_type {
+	/* struct rdp_trace_config, at caps confirm of each peer */
+	RDP_TRACE_CONFIG = 1,
+	/* struct rdp_trace_surface_command and its data */
+	RDP_TRACE_SURFACE_COMMAND = 2,
+	/* struct rdp_trace_frame, once all commands of frame are submitted */
+	RDP_TRACE_FRAME_END = 3,
+	/* struct rdp_trace_frame_ack, time is when client's ack arrived */
+	RDP_TRACE_FRAME_ACK = 4,
+};
+
+struct rdp_trace_record {
+	uint32_t type;		/**< enum rdp_trace_record_type */
+	uint32_t size;		/**< of the payload that follows */
+	uint64_t time_nsec;
+};
+
+#define RDP_TRACE_CONFIG_CACHE		(1 << 0)
+
+struct rdp_trace_config {
+	uint32_t caps_version;
+	uint32_t caps_flags;
+	int32_t gfx_codec;	/**< enum weston_rdp_gfx_codec */
+	int32_t progressive_min_area;
+	uint32_t flags;		/**< RDP_TRACE_CONFIG_* */
+};
+
+#define RDP_TRACE_COMMAND_HAS_ALPHA	(1 << 0)
+#define RDP_TRACE_COMMAND_USE_AVC	(1 << 1)
+#define RDP_TRACE_COMMAND_STAGING	(1 << 2)
+#define RDP_TRACE_COMMAND_SCROLL	(1 << 3)
+#define RDP_TRACE_COMMAND_CACHE		(1 << 4)
+
+struct rdp_trace_surface_command {
+	uint32_t window_id;
+	uint32_t frame_id;
+	int32_t surface_width;
+	int32_t surface_height;
+	int32_t x1, y1, x2, y2;	/**< job rect in surface coordinate */
+	uint32_t flags;		/**< RDP_TRACE_COMMAND_* */
+	uint32_t num_damage_rects;
+	uint64_t readback_nsec;	/**< time spent in weston_surface_copy_content */
+};
+
+struct rdp_trace_frame {
+	uint32_t frame_id;
+	uint32_t padding;
+};
+
+struct rdp_trace_frame_ack {
+	uint32_t frame_id;
+	uint32_t queue_depth;
+};
+
+#endif /* RDP_TRACE_H */
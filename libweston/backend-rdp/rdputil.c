@@ -26,6 +26,7 @@
 #include "config.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,6 +42,9 @@
 
 #include "rdp.h"
 
+#include "shared/timespec-util.h"
+#include "shared/xalloc.h"
+
 pid_t rdp_get_tid()
 {
 #ifdef SYS_gettid
@@ -52,33 +56,41 @@ pid_t rdp_get_tid()
 
 static int cached_tm_mday = -1;
 
+/* Messages come from several threads, which each keep the formatted time
+ * of the current second. */
+static __thread time_t cached_sec = -1;
+static __thread char cached_timestr[32];
+
 static char *
 rdp_log_timestamp(char *buf, size_t len)
 {
 	struct timeval tv;
-	struct tm *brokendown_time;
+	struct tm brokendown_time;
 	char datestr[128];
-	char timestr[128];
 
 	gettimeofday(&tv, NULL);
 
-	brokendown_time = localtime(&tv.tv_sec);
-	if (brokendown_time == NULL) {
-		snprintf(buf, len, "%s", "[(NULL)localtime] ");
-		return buf;
-	}
-
 	memset(datestr, 0, sizeof(datestr));
-	if (brokendown_time->tm_mday != cached_tm_mday) {
-		strftime(datestr, sizeof(datestr), "Date: %Y-%m-%d %Z\n",
-			 brokendown_time);
-		cached_tm_mday = brokendown_time->tm_mday;
+	if (tv.tv_sec != cached_sec) {
+		if (localtime_r(&tv.tv_sec, &brokendown_time) == NULL) {
+			snprintf(buf, len, "%s", "[(NULL)localtime] ");
+			return buf;
+		}
+
+		if (brokendown_time.tm_mday != cached_tm_mday) {
+			strftime(datestr, sizeof(datestr), "Date: %Y-%m-%d %Z\n",
+				 &brokendown_time);
+			cached_tm_mday = brokendown_time.tm_mday;
+		}
+
+		strftime(cached_timestr, sizeof(cached_timestr), "%H:%M:%S",
+			 &brokendown_time);
+		cached_sec = tv.tv_sec;
 	}
 
-	strftime(timestr, sizeof(timestr), "%H:%M:%S", brokendown_time);
 	/* if datestr is empty it prints only timestr*/
 	snprintf(buf, len, "%s[%s.%03li]", datestr,
-		 timestr, (tv.tv_usec / 1000));
+		 cached_timestr, (tv.tv_usec / 1000));
 
 	return buf;
 }
@@ -109,6 +121,54 @@ void rdp_debug_print(struct weston_log_scope *log_scope, bool cont, char *fmt, .
 	}
 }
 
+/* Recomputes the levels the rdp_debug macros compare against */
+void
+rdp_debug_update_level(struct rdp_backend *b)
+{
+	b->debugLevelActive = b->debugSubscriptions ?
+			      b->debugLevel : RDP_DEBUG_LEVEL_NONE;
+	b->debugClipboardLevelActive = b->debugClipboardSubscriptions ?
+				       b->debugClipboardLevel : RDP_DEBUG_LEVEL_NONE;
+}
+
+void
+rdp_debug_subscribe(struct weston_log_subscription *sub, void *data)
+{
+	struct rdp_backend *b = data;
+
+	b->debugSubscriptions++;
+	rdp_debug_update_level(b);
+}
+
+void
+rdp_debug_unsubscribe(struct weston_log_subscription *sub, void *data)
+{
+	struct rdp_backend *b = data;
+
+	assert(b->debugSubscriptions > 0);
+	b->debugSubscriptions--;
+	rdp_debug_update_level(b);
+}
+
+void
+rdp_debug_clipboard_subscribe(struct weston_log_subscription *sub, void *data)
+{
+	struct rdp_backend *b = data;
+
+	b->debugClipboardSubscriptions++;
+	rdp_debug_update_level(b);
+}
+
+void
+rdp_debug_clipboard_unsubscribe(struct weston_log_subscription *sub, void *data)
+{
+	struct rdp_backend *b = data;
+
+	assert(b->debugClipboardSubscriptions > 0);
+	b->debugClipboardSubscriptions--;
+	rdp_debug_update_level(b);
+}
+
 void assert_compositor_thread(struct rdp_backend *b)
 {
 	assert(b->compositor_tid == rdp_get_tid());
@@ -119,6 +179,13 @@ void assert_not_compositor_thread(struct rdp_backend *b)
 	assert(b->compositor_tid != rdp_get_tid());
 }
 
+/* channel callbacks run at channel thread, or at display loop for channels
+   driven by it, see rdp_backend::loop_channels. */
+void assert_channel_thread(struct rdp_backend *b)
+{
+	assert(b->loop_channels || b->compositor_tid != rdp_get_tid());
+}
+
 #ifdef HAVE_FREERDP_GFXREDIR_H
 BOOL
 rdp_allocate_shared_memory(struct rdp_backend *b, struct weston_rdp_shared_memory *shared_memory)
@@ -227,6 +294,187 @@ rdp_free_shared_memory(struct rdp_backend *b, struct weston_rdp_shared_memory *s
 }
 #endif // HAVE_FREERDP_GFXREDIR_H
 
+/* Returns buffer at least given size, buffer is only re-allocated when it
+   needs to grow, and the content is not preserved when it does. */
+void *
+rdp_staging_buffer_reserve(struct weston_rdp_staging_buffer *buffer, size_t size)
+{
+	if (buffer->size < size) {
+		free(buffer->data);
+		buffer->data = xmalloc(size);
+		buffer->size = size;
+	}
+
+	return buffer->data;
+}
+
+void
+rdp_staging_buffer_release(struct weston_rdp_staging_buffer *buffer)
+{
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->size = 0;
+}
+
+/* damage with more rects than this is merged into its extents. */
+#define RDP_DAMAGE_MAX_INPUT_RECTS 256
+
+static uint64_t
+rdp_damage_box_area(const pixman_box32_t *box)
+{
+	return (uint64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+static bool
+rdp_damage_box_overlap(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 &&
+	       a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+/* pixels added by replacing a and b with their bounding box. */
+static uint64_t
+rdp_damage_merge_waste(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	pixman_box32_t bbox = {
+		MIN(a->x1, b->x1), MIN(a->y1, b->y1),
+		MAX(a->x2, b->x2), MAX(a->y2, b->y2),
+	};
+	uint64_t covered = rdp_damage_box_area(a) + rdp_damage_box_area(b);
+
+	if (rdp_damage_box_overlap(a, b)) {
+		pixman_box32_t overlap = {
+			MAX(a->x1, b->x1), MAX(a->y1, b->y1),
+			MIN(a->x2, b->x2), MIN(a->y2, b->y2),
+		};
+
+		covered -= rdp_damage_box_area(&overlap);
+	}
+
+	return rdp_damage_box_area(&bbox) - covered;
+}
+
+static void
+rdp_damage_merge_boxes(pixman_box32_t *boxes, int *count, int i, int j)
+{
+	boxes[i].x1 = MIN(boxes[i].x1, boxes[j].x1);
+	boxes[i].y1 = MIN(boxes[i].y1, boxes[j].y1);
+	boxes[i].x2 = MAX(boxes[i].x2, boxes[j].x2);
+	boxes[i].y2 = MAX(boxes[i].y2, boxes[j].y2);
+	boxes[j] = boxes[--(*count)];
+}
+
+/* Merge pairs which overlap or cost no more than max_waste pixels,
+ * until no such pair is left. Boxes are disjoint afterward. */
+static void
+rdp_damage_merge_cheap(pixman_box32_t *boxes, int *count, uint64_t max_waste)
+{
+	bool merged;
+
+	do {
+		merged = false;
+		for (int i = 0; i < *count; i++) {
+			for (int j = i + 1; j < *count; j++) {
+				if (!rdp_damage_box_overlap(&boxes[i], &boxes[j]) &&
+				    rdp_damage_merge_waste(&boxes[i], &boxes[j]) > max_waste)
+					continue;
+				rdp_damage_merge_boxes(boxes, count, i, j);
+				merged = true;
+				/* boxes[i] grew, compare it again with the rest. */
+				j = i;
+			}
+		}
+	} while (merged);
+}
+
+/* Simplify damage before it is read back and encoded.
+ *
+ * Each rect costs a readback, PDU and codec headers, so rects are
+ * merged into their bounding box when the extra pixels cost less than
+ * rect_cost pixels, then merged by least waste until at most max_rects
+ * remain. When alignment is larger than 1, rects are first grown to
+ * that grid, such as RemoteFX tiles, and clipped to bounds.
+ * max_rects of 0 leaves damage as is.
+ */
+void
+rdp_damage_optimize(pixman_region32_t *damage, const pixman_box32_t *bounds,
+		    int alignment, int max_rects, int rect_cost)
+{
+	pixman_box32_t extents = *pixman_region32_extents(damage);
+	pixman_box32_t *rects;
+	pixman_box32_t *boxes;
+	int count = 0;
+	int target;
+	int nrects;
+
+	if (max_rects <= 0)
+		return;
+
+	rects = pixman_region32_rectangles(damage, &nrects);
+	if (nrects <= 1 && alignment <= 1)
+		return;
+
+	/* merging is quadratic, huge regions are treated as a whole. */
+	if (nrects > RDP_DAMAGE_MAX_INPUT_RECTS) {
+		rects = &extents;
+		nrects = 1;
+	}
+
+	boxes = xmalloc(sizeof(*boxes) * MAX(nrects, 1));
+	for (int i = 0; i < nrects; i++) {
+		pixman_box32_t box = rects[i];
+
+		if (alignment > 1) {
+			box.x1 = box.x1 / alignment * alignment;
+			box.y1 = box.y1 / alignment * alignment;
+			box.x2 = (box.x2 + alignment - 1) / alignment * alignment;
+			box.y2 = (box.y2 + alignment - 1) / alignment * alignment;
+		}
+		if (bounds) {
+			box.x1 = MAX(box.x1, bounds->x1);
+			box.y1 = MAX(box.y1, bounds->y1);
+			box.x2 = MIN(box.x2, bounds->x2);
+			box.y2 = MIN(box.y2, bounds->y2);
+		}
+		if (box.x1 < box.x2 && box.y1 < box.y2)
+			boxes[count++] = box;
+	}
+
+	rdp_damage_merge_cheap(boxes, &count, rect_cost);
+
+	/* pixman splits disjoint boxes into bands, which can add rects,
+	   so lower the target until the resulting region fits. */
+	for (target = max_rects; target > 0; target /= 2) {
+		while (count > target) {
+			uint64_t best = UINT64_MAX;
+			int best_i = 0, best_j = 1;
+
+			for (int i = 0; i < count; i++) {
+				for (int j = i + 1; j < count; j++) {
+					uint64_t waste = rdp_damage_merge_waste(&boxes[i], &boxes[j]);
+
+					if (waste < best) {
+						best = waste;
+						best_i = i;
+						best_j = j;
+					}
+				}
+			}
+			rdp_damage_merge_boxes(boxes, &count, best_i, best_j);
+			/* merged box may now overlap others. */
+			rdp_damage_merge_cheap(boxes, &count, 0);
+		}
+
+		pixman_region32_fini(damage);
+		pixman_region32_init_rects(damage, boxes, count);
+		pixman_region32_rectangles(damage, &nrects);
+		if (nrects <= max_rects)
+			break;
+	}
+
+	free(boxes);
+}
+
 BOOL
 rdp_id_manager_init(struct rdp_backend *rdp_backend, struct rdp_id_manager *id_manager, UINT32 low_limit, UINT32 high_limit)
 {
@@ -241,6 +489,13 @@ rdp_id_manager_init(struct rdp_backend *rdp_backend, struct rdp_id_manager *id_m
 	id_manager->id_low_limit = low_limit;
 	id_manager->id_high_limit = high_limit;
 	id_manager->id = low_limit;
+	id_manager->id_wrapped = false;
+	id_manager->id_allocated = 0;
+	id_manager->id_probes = 0;
+	id_manager->id_max_probes = 0;
+	if (id_manager->id_total <= RDP_ID_MANAGER_BITMAP_MAX_IDS)
+		id_manager->id_bitmap = xzalloc((id_manager->id_total + 63) / 64 *
+						sizeof(UINT64));
 	id_manager->hash_table = hash_table_create();
 	if (id_manager->hash_table) {
 		pthread_mutex_init(&id_manager->mutex, NULL);
@@ -264,6 +519,8 @@ rdp_id_manager_free(struct rdp_id_manager *id_manager)
 		hash_table_destroy(id_manager->hash_table);
 		pthread_mutex_destroy(&id_manager->mutex);
 	}
+	free(id_manager->id_bitmap);
+	id_manager->id_bitmap = NULL;
 	id_manager->mutex_tid = 0;
 	id_manager->hash_table = NULL;
 	id_manager->id = 0;
@@ -315,31 +572,102 @@ rdp_id_manager_for_each(struct rdp_id_manager *id_manager, hash_table_iterator_f
 	hash_table_for_each(id_manager->hash_table, func, data);
 }
 
+static void
+rdp_id_manager_advance(struct rdp_id_manager *id_manager, UINT32 count)
+{
+	if (id_manager->id_high_limit - id_manager->id <= count) {
+		id_manager->id = id_manager->id_low_limit;
+		id_manager->id_wrapped = true;
+	} else {
+		id_manager->id += count;
+	}
+}
+
 BOOL
 rdp_id_manager_allocate_id(struct rdp_id_manager *id_manager, void *object, UINT32 *new_id)
 {
 	UINT32 id = 0;
+	UINT32 probes = 0;
 
 	assert_compositor_thread(id_manager->rdp_backend);
 	assert(id_manager->hash_table);
 
-	for(;id_manager->id_used < id_manager->id_total;) {
-		id = id_manager->id++;
-		if (id_manager->id == id_manager->id_high_limit)
-			id_manager->id = id_manager->id_low_limit;
-		/* Make sure this id is not currently used */
-		if (rdp_id_manager_lookup(id_manager, id) == NULL) {
-			if (hash_table_insert(id_manager->hash_table, id, object) < 0)
-				break;
-			/* successfully to reserve new id for given object */
-			id_manager->id_used++;
-			*new_id = id;
+	/* ids are handed out in order and wrap, so a freed id is not reused
+	   right away while client may still refer it. */
+	while (id_manager->id_used < id_manager->id_total) {
+		UINT32 bit = id_manager->id - id_manager->id_low_limit;
+		bool is_free;
+
+		id = id_manager->id;
+		probes++;
+		if (id_manager->id_bitmap) {
+			UINT64 word = id_manager->id_bitmap[bit / 64];
+
+			/* skip over fully used 64 ids at once */
+			if (word == ~(UINT64)0) {
+				rdp_id_manager_advance(id_manager, 64 - (bit % 64));
+				id = 0;
+				continue;
+			}
+			is_free = !(word & ((UINT64)1 << (bit % 64)));
+		} else {
+			is_free = !id_manager->id_wrapped ||
+				  rdp_id_manager_lookup(id_manager, id) == NULL;
+		}
+		rdp_id_manager_advance(id_manager, 1);
+		if (!is_free) {
+			id = 0;
+			continue;
+		}
+
+		if (hash_table_insert(id_manager->hash_table, id, object) < 0) {
+			id = 0;
 			break;
 		}
+		/* successfully to reserve new id for given object */
+		if (id_manager->id_bitmap)
+			id_manager->id_bitmap[bit / 64] |= (UINT64)1 << (bit % 64);
+		id_manager->id_used++;
+		*new_id = id;
+		break;
 	}
+
+	id_manager->id_allocated++;
+	id_manager->id_probes += probes;
+	if (probes > id_manager->id_max_probes)
+		id_manager->id_max_probes = probes;
+
 	return id != 0;
 }
 
+/* Takes the given id for object, for an id that must stay the same for
+ * another peer, see rdp_rail_unpark_windows(). */
+BOOL
+rdp_id_manager_reserve_id(struct rdp_id_manager *id_manager, void *object, UINT32 id)
+{
+	UINT32 bit = id - id_manager->id_low_limit;
+
+	assert_compositor_thread(id_manager->rdp_backend);
+	assert(id_manager->hash_table);
+
+	if (id < id_manager->id_low_limit || id >= id_manager->id_high_limit)
+		return FALSE;
+	if (rdp_id_manager_lookup(id_manager, id))
+		return FALSE;
+	if (hash_table_insert(id_manager->hash_table, id, object) < 0)
+		return FALSE;
+
+	if (id_manager->id_bitmap)
+		id_manager->id_bitmap[bit / 64] |= (UINT64)1 << (bit % 64);
+	id_manager->id_used++;
+
+	/* until wrap, ids ahead of the allocator must be unused. */
+	if (!id_manager->id_wrapped && id >= id_manager->id)
+		rdp_id_manager_advance(id_manager, id - id_manager->id + 1);
+
+	return TRUE;
+}
+
 void
 rdp_id_manager_free_id(struct rdp_id_manager *id_manager, UINT32 id)
 {
@@ -349,6 +677,11 @@ rdp_id_manager_free_id(struct rdp_id_manager *id_manager, UINT32 id)
 	pthread_mutex_lock(&id_manager->mutex);
 	hash_table_remove(id_manager->hash_table, id);
 	pthread_mutex_unlock(&id_manager->mutex);
+	if (id_manager->id_bitmap) {
+		UINT32 bit = id - id_manager->id_low_limit;
+
+		id_manager->id_bitmap[bit / 64] &= ~((UINT64)1 << (bit % 64));
+	}
 	id_manager->id_used--;
 }
 
@@ -361,6 +694,27 @@ dump_id_manager_state(FILE *fp, struct rdp_id_manager *id_manager, char* title)
 	fprintf(fp,"    hightest ID: %u\n", id_manager->id_high_limit);
 	fprintf(fp,"    total IDs: %u\n", id_manager->id_total);
 	fprintf(fp,"    used IDs: %u\n", id_manager->id_used);
+	fprintf(fp,"    allocator: %s%s\n",
+		id_manager->id_bitmap ? "bitmap" : "sequential",
+		id_manager->id_wrapped ? " (wrapped)" : "");
+	fprintf(fp,"    allocations: %" PRIu64 ", avg probes: %" PRIu64 ", max probes: %u\n",
+		id_manager->id_allocated,
+		id_manager->id_allocated ? id_manager->id_probes / id_manager->id_allocated : 0,
+		id_manager->id_max_probes);
+	if (id_manager->hash_table) {
+		struct hash_table_stats stats;
+
+		hash_table_get_stats(id_manager->hash_table, &stats);
+		fprintf(fp,"    hash table: size: %u, entries: %u, deleted: %u\n",
+			stats.size, stats.entries, stats.deleted_entries);
+		fprintf(fp,"    hash table: resizes: %u, rehashes: %u\n",
+			stats.resizes, stats.rehashes);
+		fprintf(fp,"    hash table: searches: %" PRIu64 ", avg probes: %" PRIu64 ".%02" PRIu64 ", max probes: %u\n",
+			stats.searches,
+			stats.searches ? stats.probes / stats.searches : 0,
+			stats.searches ? (stats.probes * 100 / stats.searches) % 100 : 0,
+			stats.max_probes);
+	}
 	fprintf(fp,"\n");
 }
 
@@ -380,44 +734,91 @@ rdp_event_loop_add_fd(struct wl_event_loop *loop, int fd, uint32_t mask, wl_even
 void
 rdp_dispatch_task_to_display_loop(RdpPeerContext *peerCtx, rdp_loop_task_func_t func, struct rdp_loop_task *task)
 {
-	/* this function is ONLY used to queue the task from FreeRDP thread,
-	   and the task to be processed at wayland display loop thread. */
-	assert_not_compositor_thread(peerCtx->rdpBackend);
+	struct rdp_loop_task *head;
 
 	task->peerCtx = peerCtx;
 	task->func = func;
+	clock_gettime(CLOCK_MONOTONIC, &task->queued);
+
+	/* channels driven by display loop run the task right away, unless
+	   earlier tasks are still queued, or peer is still being activated,
+	   which doesn't expect tasks to be run until it's done. */
+	if (peerCtx->rdpBackend->compositor_tid == rdp_get_tid() &&
+	    (peerCtx->item.flags & RDP_PEER_ACTIVATED) &&
+	    !__atomic_load_n(&peerCtx->loop_task_stack, __ATOMIC_ACQUIRE)) {
+		peerCtx->loop_task_dispatched++;
+		func(false, task);
+		return;
+	}
 
-	pthread_mutex_lock(&peerCtx->loop_task_list_mutex);
-	/* this inserts at head */
-	wl_list_insert(&peerCtx->loop_task_list, &task->link);
-	pthread_mutex_unlock(&peerCtx->loop_task_list_mutex);
+	__atomic_add_fetch(&peerCtx->loop_task_depth, 1, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&peerCtx->loop_task_stack, __ATOMIC_RELAXED);
+	do {
+		task->next = head;
+	} while (!__atomic_compare_exchange_n(&peerCtx->loop_task_stack,
+					      &head, task, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	/* display loop drains all queued tasks at wakeup, so only wake it
+	   when stack was empty, not for each task. */
+	if (head == NULL)
+		eventfd_write(peerCtx->loop_task_event_source_fd, 1);
+}
+
+/* Take all queued tasks, in the order they were queued. */
+static struct rdp_loop_task *
+rdp_dispatch_task_take_all(RdpPeerContext *peerCtx)
+{
+	struct rdp_loop_task *task, *next, *first = NULL;
+
+	task = __atomic_exchange_n(&peerCtx->loop_task_stack, NULL,
+				   __ATOMIC_ACQUIRE);
+	/* stack is newest first, reverse it. */
+	for (; task; task = next) {
+		next = task->next;
+		task->next = first;
+		first = task;
+	}
 
-	eventfd_write(peerCtx->loop_task_event_source_fd, 1);
+	return first;
 }
 
 static int
 rdp_dispatch_task(int fd, uint32_t mask, void *arg)
 {
 	RdpPeerContext *peerCtx = (RdpPeerContext *)arg;
-	struct rdp_loop_task *task, *tmp;
+	struct rdp_loop_task *task, *next;
+	struct timespec now;
+	uint32_t depth;
 	eventfd_t dummy;
 
 	/* this must be called back at wayland display loop thread */
 	assert_compositor_thread(peerCtx->rdpBackend);
 
+	/* read before taking tasks, so a task queued after taking them
+	   wakes up again. */
 	eventfd_read(peerCtx->loop_task_event_source_fd, &dummy);
 
-	pthread_mutex_lock(&peerCtx->loop_task_list_mutex);
-	/* dequeue the first task which is at last, so use reverse. */
-	assert(!wl_list_empty(&peerCtx->loop_task_list));
-	wl_list_for_each_reverse_safe(task, tmp, &peerCtx->loop_task_list, link) {
-		wl_list_remove(&task->link);
-		break;
-	}
-	pthread_mutex_unlock(&peerCtx->loop_task_list_mutex);
+	depth = __atomic_load_n(&peerCtx->loop_task_depth, __ATOMIC_RELAXED);
+	peerCtx->loop_task_depth_max = MAX(peerCtx->loop_task_depth_max, depth);
+	peerCtx->loop_task_wakeups++;
 
-	/* Dispatch and task will be freed by caller. */
-	task->func(false, task);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (task = rdp_dispatch_task_take_all(peerCtx); task; task = next) {
+		uint64_t latency = timespec_sub_to_nsec(&now, &task->queued) / 1000;
+
+		/* task may be freed or queued again by its func. */
+		next = task->next;
+		__atomic_sub_fetch(&peerCtx->loop_task_depth, 1, __ATOMIC_RELAXED);
+		peerCtx->loop_task_dispatched++;
+		peerCtx->loop_task_latency_usec_total += latency;
+		peerCtx->loop_task_latency_usec_max =
+			MAX(peerCtx->loop_task_latency_usec_max, latency);
+
+		/* Dispatch and task will be freed by caller. */
+		task->func(false, task);
+	}
 
 	return 0;
 }
@@ -428,19 +829,14 @@ rdp_initialize_dispatch_task_event_source(RdpPeerContext *peerCtx)
 	struct rdp_backend *b = peerCtx->rdpBackend;
 	struct wl_event_loop *loop;
 
-	if (pthread_mutex_init(&peerCtx->loop_task_list_mutex, NULL) == -1) {
-		rdp_debug_error(b, "%s: pthread_mutex_init failed. %s\n", __func__, strerror(errno));
-		goto error_mutex;
-	}
-
 	assert(peerCtx->loop_task_event_source_fd == -1);
-	peerCtx->loop_task_event_source_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+	peerCtx->loop_task_event_source_fd = eventfd(0, EFD_CLOEXEC);
 	if (peerCtx->loop_task_event_source_fd == -1) {
-		rdp_debug_error(b, "%s: eventfd(EFD_SEMAPHORE) failed. %s\n", __func__, strerror(errno));
+		rdp_debug_error(b, "%s: eventfd failed. %s\n", __func__, strerror(errno));
 		goto error_event_source_fd;
 	}
 
-	assert(wl_list_empty(&peerCtx->loop_task_list));
+	assert(peerCtx->loop_task_stack == NULL);
 
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
 	assert(peerCtx->loop_task_event_source == NULL);
@@ -457,16 +853,13 @@ error_event_loop_add_fd:
 	peerCtx->loop_task_event_source_fd = -1;
 
 error_event_source_fd:
-	pthread_mutex_destroy(&peerCtx->loop_task_list_mutex);
-
-error_mutex:
 	return false;
 }
 
 void
 rdp_destroy_dispatch_task_event_source(RdpPeerContext *peerCtx)
 {
-	struct rdp_loop_task *task, *tmp;
+	struct rdp_loop_task *task, *next;
 
 	/* This function must be called all virtual channel thread at FreeRDP is terminated,
 	   that ensures no more incoming tasks. */
@@ -476,20 +869,57 @@ rdp_destroy_dispatch_task_event_source(RdpPeerContext *peerCtx)
 		peerCtx->loop_task_event_source = NULL;
 	}
 
-	wl_list_for_each_reverse_safe(task, tmp, &peerCtx->loop_task_list, link) {
-		wl_list_remove(&task->link);
+	for (task = rdp_dispatch_task_take_all(peerCtx); task; task = next) {
+		next = task->next;
 		/* inform caller task is not really scheduled prior to context destruction,
 		   inform them to clean them up. */
 		task->func(true /* freeOnly */, task);
 	}
-	assert(wl_list_empty(&peerCtx->loop_task_list));
+	peerCtx->loop_task_depth = 0;
 
 	if (peerCtx->loop_task_event_source_fd != -1) {
 		close(peerCtx->loop_task_event_source_fd);
 		peerCtx->loop_task_event_source_fd = -1;
 	}
+}
+
+/* write syscalls made by thread, read from its /proc/thread-self/io,
+   or -1 when not available. */
+int64_t
+rdp_read_write_syscalls(int fd)
+{
+	char buf[512];
+	ssize_t len;
+	char *s;
+
+	if (fd < 0)
+		return -1;
 
-	pthread_mutex_destroy(&peerCtx->loop_task_list_mutex);
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	s = strstr(buf, "syscw:");
+	if (!s)
+		return -1;
+	return strtoll(s + strlen("syscw:"), NULL, 10);
+}
+
+void
+dump_dispatch_task_state(FILE *fp, RdpPeerContext *peerCtx)
+{
+	fprintf(fp,"Display loop task queue status:\n");
+	fprintf(fp,"    queued tasks: %u\n",
+		__atomic_load_n(&peerCtx->loop_task_depth, __ATOMIC_RELAXED));
+	fprintf(fp,"    max queued tasks at wakeup: %u\n", peerCtx->loop_task_depth_max);
+	fprintf(fp,"    wakeups: %" PRIu64 "\n", peerCtx->loop_task_wakeups);
+	fprintf(fp,"    dispatched tasks: %" PRIu64 "\n", peerCtx->loop_task_dispatched);
+	fprintf(fp,"    average latency: %" PRIu64 " usec\n",
+		peerCtx->loop_task_dispatched ?
+		peerCtx->loop_task_latency_usec_total / peerCtx->loop_task_dispatched : 0);
+	fprintf(fp,"    max latency: %" PRIu64 " usec\n", peerCtx->loop_task_latency_usec_max);
+	fprintf(fp,"\n");
 }
 
 /* This is a little tricky - it makes sure there's always at least
@@ -503,14 +933,18 @@ rdp_wl_array_read_fd(struct wl_array *array, int fd)
 {
 	int len, size;
 	char *data;
-
-	/* Make sure we have at least 1024 bytes of space left */
-	if (array->alloc - array->size < 1024) {
-		if (!wl_array_add(array, 1024)) {
+	size_t space;
+
+	/* Make sure we have at least 1024 bytes of space left, growing with
+	 * the data read so far so large transfers need few reads and
+	 * reallocations. */
+	space = MIN(MAX(array->size, (size_t)1024), (size_t)RDP_READ_FD_MAX_CHUNK);
+	if (array->alloc - array->size < space) {
+		if (!wl_array_add(array, space)) {
 			errno = ENOMEM;
 			return -1;
 		}
-		array->size -= 1024;
+		array->size -= space;
 	}
 	data = (char *)array->data + array->size;
 	/* Leave one char in case the caller needs space for a
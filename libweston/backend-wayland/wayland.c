@@ -58,8 +58,10 @@
 #include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "presentation-time-server-protocol.h"
 #include "linux-dmabuf.h"
+#include "libweston-internal.h"
 #include <libweston/windowed-output-api.h>
 
 #define WINDOW_TITLE "Weston Compositor"
@@ -80,6 +82,11 @@ struct wayland_backend {
 		struct xdg_wm_base *xdg_wm_base;
 		struct zwp_fullscreen_shell_v1 *fshell;
 		struct wl_shm *shm;
+		struct wl_subcompositor *subcompositor;
+		struct zwp_linux_dmabuf_v1 *dmabuf;
+		/* struct weston_dmabuf_feedback_format_table_entry, the
+		 * formats and modifiers the parent takes dmabufs in */
+		struct wl_array dmabuf_formats;
 
 		struct wl_list output_list;
 
@@ -97,6 +104,9 @@ struct wayland_backend {
 	struct wl_cursor *cursor;
 
 	struct wl_list input_list;
+
+	/* struct wayland_passthrough_buffer::link */
+	struct wl_list passthrough_buffers;
 };
 
 struct wayland_output {
@@ -139,6 +149,31 @@ struct wayland_output {
 	struct weston_mode mode;
 
 	struct wl_callback *frame_cb;
+
+	/* A client dmabuf covering the whole output is handed to the parent
+	 * on a subsurface instead of being composited, see
+	 * wayland_output_assign_planes(). */
+	struct {
+		struct weston_plane plane;
+		struct wl_surface *surface;
+		struct wl_subsurface *subsurface;
+		struct weston_view *view; /* on plane, NULL if none */
+		bool attached; /* whether surface has a buffer */
+	} passthrough;
+};
+
+/* The parent's wl_buffer for a client dmabuf, which lives as long as the
+ * client's buffer. */
+struct wayland_passthrough_buffer {
+	struct wayland_backend *backend;
+	struct wl_list link; /* wayland_backend::passthrough_buffers */
+
+	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+
+	struct wl_buffer *parent_buffer;
+	/* whether the parent uses it, buffer isn't released until then */
+	bool busy;
 };
 
 struct wayland_parent_output {
@@ -515,6 +550,281 @@ wayland_output_start_repaint_loop(struct weston_output *output_base)
 	return 0;
 }
 
+static void
+passthrough_buffer_release(void *data, struct wl_buffer *parent_buffer)
+{
+	struct wayland_passthrough_buffer *pb = data;
+
+	if (!pb->busy)
+		return;
+
+	pb->busy = false;
+	pb->buffer->busy_count--;
+	if (pb->buffer->busy_count == 0)
+		wl_buffer_send_release(pb->buffer->resource);
+}
+
+static const struct wl_buffer_listener passthrough_buffer_listener = {
+	passthrough_buffer_release
+};
+
+static void
+passthrough_buffer_destroy(struct wayland_passthrough_buffer *pb)
+{
+	wl_buffer_destroy(pb->parent_buffer);
+	wl_list_remove(&pb->buffer_destroy_listener.link);
+	wl_list_remove(&pb->link);
+	free(pb);
+}
+
+static void
+passthrough_buffer_handle_destroy(struct wl_listener *listener, void *data)
+{
+	struct wayland_passthrough_buffer *pb =
+		container_of(listener, struct wayland_passthrough_buffer,
+			     buffer_destroy_listener);
+
+	passthrough_buffer_destroy(pb);
+}
+
+static bool
+wayland_backend_parent_takes_dmabuf(struct wayland_backend *b,
+				    const struct dmabuf_attributes *attributes)
+{
+	struct weston_dmabuf_feedback_format_table_entry *entry;
+
+	wl_array_for_each(entry, &b->parent.dmabuf_formats) {
+		if (entry->format == attributes->format &&
+		    entry->modifier == attributes->modifier[0])
+			return true;
+	}
+
+	return false;
+}
+
+/* Returns the parent's wl_buffer for the client dmabuf buffer, importing
+ * it on first use. */
+static struct wayland_passthrough_buffer *
+wayland_passthrough_buffer_get(struct wayland_backend *b,
+			       struct weston_buffer *buffer)
+{
+	struct wayland_passthrough_buffer *pb;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct zwp_linux_buffer_params_v1 *params;
+	const struct dmabuf_attributes *attributes;
+	int i;
+
+	wl_list_for_each(pb, &b->passthrough_buffers, link)
+		if (pb->buffer == buffer)
+			return pb;
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	attributes = &dmabuf->attributes;
+
+	pb = zalloc(sizeof *pb);
+	if (!pb)
+		return NULL;
+
+	params = zwp_linux_dmabuf_v1_create_params(b->parent.dmabuf);
+	for (i = 0; i < attributes->n_planes; i++)
+		zwp_linux_buffer_params_v1_add(params, attributes->fd[i], i,
+					       attributes->offset[i],
+					       attributes->stride[i],
+					       attributes->modifier[i] >> 32,
+					       attributes->modifier[i] & 0xffffffff);
+	pb->parent_buffer =
+		zwp_linux_buffer_params_v1_create_immed(params,
+							attributes->width,
+							attributes->height,
+							attributes->format,
+							attributes->flags);
+	zwp_linux_buffer_params_v1_destroy(params);
+	wl_buffer_add_listener(pb->parent_buffer,
+			       &passthrough_buffer_listener, pb);
+
+	pb->backend = b;
+	pb->buffer = buffer;
+	pb->buffer_destroy_listener.notify = passthrough_buffer_handle_destroy;
+	wl_signal_add(&buffer->destroy_signal, &pb->buffer_destroy_listener);
+	wl_list_insert(&b->passthrough_buffers, &pb->link);
+
+	return pb;
+}
+
+/* Whether the parent can show the view instead of us: it must be the
+ * topmost view on the output, an opaque client dmabuf of the output's
+ * size right on top of it, in a format the parent takes. */
+static bool
+wayland_output_view_passthrough(struct wayland_output *output,
+				struct weston_view *ev)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	struct linux_dmabuf_buffer *dmabuf;
+	float x, y;
+
+	if (!b->parent.subcompositor || !b->parent.dmabuf)
+		return false;
+
+	if (output->base.current_scale != 1 ||
+	    output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    output->base.zoom.active)
+		return false;
+
+	if (!buffer)
+		return false;
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (!dmabuf)
+		return false;
+
+	if (ev->transform.enabled || ev->alpha < 1.0 ||
+	    vp->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    vp->buffer.scale != 1 ||
+	    vp->buffer.src_width != wl_fixed_from_int(-1) ||
+	    vp->surface.width != -1)
+		return false;
+
+	weston_view_to_global_float(ev, 0, 0, &x, &y);
+	if (x != output->base.x || y != output->base.y ||
+	    dmabuf->attributes.width != output->base.width ||
+	    dmabuf->attributes.height != output->base.height)
+		return false;
+
+	if (!weston_view_is_opaque(ev, &output->base.region))
+		return false;
+
+	return wayland_backend_parent_takes_dmabuf(b, &dmabuf->attributes);
+}
+
+static void
+wayland_output_assign_planes(struct weston_output *output_base,
+			     void *repaint_data)
+{
+	struct wayland_output *output = to_wayland_output(output_base);
+	struct weston_compositor *ec = output->base.compositor;
+	struct weston_view *ev, *top = NULL;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (ev->output_mask & (1u << output->base.id)) {
+			top = ev;
+			break;
+		}
+	}
+
+	if (top && !wayland_output_view_passthrough(output, top))
+		top = NULL;
+	output->passthrough.view = top;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!(ev->output_mask & (1u << output->base.id)))
+			continue;
+
+		if (ev == top) {
+			weston_view_move_to_plane(ev, &output->passthrough.plane);
+			ev->psf_flags = WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+		} else {
+			weston_view_move_to_plane(ev, &ec->primary_plane);
+			ev->psf_flags = 0;
+		}
+	}
+}
+
+static int
+wayland_output_create_passthrough_surface(struct wayland_output *output)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+	struct wl_region *region;
+
+	output->passthrough.surface =
+		wl_compositor_create_surface(b->parent.compositor);
+	if (!output->passthrough.surface)
+		return -1;
+	wl_surface_set_user_data(output->passthrough.surface, output);
+
+	/* input goes to the output's surface underneath */
+	region = wl_compositor_create_region(b->parent.compositor);
+	wl_surface_set_input_region(output->passthrough.surface, region);
+	wl_region_destroy(region);
+
+	output->passthrough.subsurface =
+		wl_subcompositor_get_subsurface(b->parent.subcompositor,
+						output->passthrough.surface,
+						output->parent.surface);
+	if (!output->passthrough.subsurface) {
+		wl_surface_destroy(output->passthrough.surface);
+		output->passthrough.surface = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+wayland_output_destroy_passthrough_surface(struct wayland_output *output)
+{
+	if (!output->passthrough.surface)
+		return;
+
+	wl_subsurface_destroy(output->passthrough.subsurface);
+	output->passthrough.subsurface = NULL;
+	wl_surface_destroy(output->passthrough.surface);
+	output->passthrough.surface = NULL;
+	output->passthrough.attached = false;
+}
+
+/* Commits the passthrough view's buffer, or the lack of one, to the
+ * subsurface. The subsurface is synchronized, so this shows along with
+ * the next commit of the output's surface. */
+static void
+wayland_output_update_passthrough(struct wayland_output *output)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+	struct weston_view *ev = output->passthrough.view;
+	struct wayland_passthrough_buffer *pb;
+	int32_t x = 0, y = 0;
+
+	if (!ev) {
+		if (output->passthrough.attached) {
+			wl_surface_attach(output->passthrough.surface,
+					  NULL, 0, 0);
+			wl_surface_commit(output->passthrough.surface);
+			output->passthrough.attached = false;
+		}
+		return;
+	}
+
+	if (output->passthrough.attached &&
+	    !pixman_region32_not_empty(&output->passthrough.plane.damage))
+		return;
+
+	pixman_region32_clear(&output->passthrough.plane.damage);
+
+	if (!output->passthrough.surface &&
+	    wayland_output_create_passthrough_surface(output) < 0)
+		return;
+
+	pb = wayland_passthrough_buffer_get(b, ev->surface->buffer_ref.buffer);
+	if (!pb)
+		return;
+
+	if (!pb->busy) {
+		pb->busy = true;
+		pb->buffer->busy_count++;
+	}
+
+	if (output->frame)
+		frame_interior(output->frame, &x, &y, NULL, NULL);
+	wl_subsurface_set_position(output->passthrough.subsurface, x, y);
+
+	wl_surface_attach(output->passthrough.surface, pb->parent_buffer, 0, 0);
+	wl_surface_damage(output->passthrough.surface, 0, 0,
+			  output->base.width, output->base.height);
+	wl_surface_commit(output->passthrough.surface);
+	output->passthrough.attached = true;
+}
+
 #ifdef ENABLE_EGL
 static int
 wayland_output_repaint_gl(struct weston_output *output_base,
@@ -528,6 +838,7 @@ wayland_output_repaint_gl(struct weston_output *output_base,
 	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
 
 	wayland_output_update_gl_border(output);
+	wayland_output_update_passthrough(output);
 
 	ec->renderer->repaint_output(&output->base, damage);
 
@@ -650,6 +961,7 @@ wayland_output_repaint_pixman(struct weston_output *output_base,
 	sb = wayland_output_get_shm_buffer(output);
 
 	wayland_output_update_shm_border(sb);
+	wayland_output_update_passthrough(output);
 	pixman_renderer_output_set_buffer(output_base, sb->pm_image);
 	b->compositor->renderer->repaint_output(output_base, &sb->damage);
 
@@ -726,6 +1038,10 @@ wayland_output_disable(struct weston_output *base)
 
 	wayland_output_destroy_shm_buffers(output);
 
+	wayland_output_destroy_passthrough_surface(output);
+	weston_plane_release(&output->passthrough.plane);
+	output->passthrough.view = NULL;
+
 	wayland_backend_destroy_output_surface(output);
 
 	if (output->frame)
@@ -1267,8 +1583,12 @@ wayland_output_enable(struct weston_output *base)
 #endif
 	}
 
+	weston_plane_init(&output->passthrough.plane, b->compositor, 0, 0);
+	weston_compositor_stack_plane(b->compositor, &output->passthrough.plane,
+				      &b->compositor->primary_plane);
+
 	output->base.start_repaint_loop = wayland_output_start_repaint_loop;
-	output->base.assign_planes = NULL;
+	output->base.assign_planes = wayland_output_assign_planes;
 	output->base.set_backlight = NULL;
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = wayland_output_switch_mode;
@@ -2554,6 +2874,33 @@ static const struct xdg_wm_base_listener wm_base_listener = {
 	xdg_wm_base_ping,
 };
 
+static void
+dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *dmabuf, uint32_t format)
+{
+	/* superseded by the modifier event */
+}
+
+static void
+dmabuf_modifier(void *data, struct zwp_linux_dmabuf_v1 *dmabuf,
+		uint32_t format, uint32_t modifier_hi, uint32_t modifier_lo)
+{
+	struct wayland_backend *b = data;
+	struct weston_dmabuf_feedback_format_table_entry *entry;
+
+	entry = wl_array_add(&b->parent.dmabuf_formats, sizeof *entry);
+	if (!entry)
+		return;
+
+	entry->format = format;
+	entry->pad = 0;
+	entry->modifier = ((uint64_t)modifier_hi << 32) | modifier_lo;
+}
+
+static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
+	dmabuf_format,
+	dmabuf_modifier
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		       const char *interface, uint32_t version)
@@ -2586,6 +2933,17 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		b->parent.shm =
 			wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, "wl_subcompositor") == 0) {
+		b->parent.subcompositor =
+			wl_registry_bind(registry, name,
+					 &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0 &&
+		   version >= 3) {
+		b->parent.dmabuf =
+			wl_registry_bind(registry, name,
+					 &zwp_linux_dmabuf_v1_interface, 3);
+		zwp_linux_dmabuf_v1_add_listener(b->parent.dmabuf,
+						 &dmabuf_listener, b);
 	}
 }
 
@@ -2646,6 +3004,13 @@ wayland_destroy(struct weston_compositor *ec)
 	if (b->parent.shm)
 		wl_shm_destroy(b->parent.shm);
 
+	if (b->parent.subcompositor)
+		wl_subcompositor_destroy(b->parent.subcompositor);
+
+	if (b->parent.dmabuf)
+		zwp_linux_dmabuf_v1_destroy(b->parent.dmabuf);
+	wl_array_release(&b->parent.dmabuf_formats);
+
 	if (b->parent.xdg_wm_base)
 		xdg_wm_base_destroy(b->parent.xdg_wm_base);
 
@@ -2756,6 +3121,8 @@ wayland_backend_create(struct weston_compositor *compositor,
 
 	wl_list_init(&b->parent.output_list);
 	wl_list_init(&b->input_list);
+	wl_list_init(&b->passthrough_buffers);
+	wl_array_init(&b->parent.dmabuf_formats);
 	b->parent.registry = wl_display_get_registry(b->parent.wl_display);
 	wl_registry_add_listener(b->parent.registry, &registry_listener, b);
 	wl_display_roundtrip(b->parent.wl_display);
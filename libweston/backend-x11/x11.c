@@ -432,21 +432,41 @@ x11_output_repaint_gl(struct weston_output *output_base,
 	return 0;
 }
 
+/* Push one box covering all damage instead of a request per rectangle,
+ * unless that would copy more than this many times the damaged area,
+ * or there are more rectangles than are worth a request each. */
+#define SHM_PUT_COALESCE_RATIO 2
+#define SHM_PUT_MAX_RECTS 16
+
+static void
+x11_output_put_shm_box(struct x11_backend *b, struct x11_output *output,
+		       const pixman_box32_t *box)
+{
+	if (box->x2 <= box->x1 || box->y2 <= box->y1)
+		return;
+
+	xcb_shm_put_image(b->conn, output->window, output->gc,
+			  pixman_image_get_width(output->hw_surface),
+			  pixman_image_get_height(output->hw_surface),
+			  box->x1, box->y1,
+			  box->x2 - box->x1, box->y2 - box->y1,
+			  box->x1, box->y1, output->depth,
+			  XCB_IMAGE_FORMAT_Z_PIXMAP, 0, output->segment, 0);
+}
+
 static void
-set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region)
+x11_output_put_shm_damage(struct weston_output *output_base,
+			  pixman_region32_t *damage)
 {
 	struct x11_output *output = to_x11_output(output_base);
-	struct weston_compositor *ec = output->base.compositor;
-	struct x11_backend *b = to_x11_backend(ec);
+	struct x11_backend *b = to_x11_backend(output_base->compositor);
 	pixman_region32_t transformed_region;
-	pixman_box32_t *rects;
-	xcb_rectangle_t *output_rects;
-	xcb_void_cookie_t cookie;
+	pixman_box32_t *rects, *extents;
+	uint64_t area = 0;
 	int nrects, i;
-	xcb_generic_error_t *err;
 
 	pixman_region32_init(&transformed_region);
-	pixman_region32_copy(&transformed_region, region);
+	pixman_region32_copy(&transformed_region, damage);
 	pixman_region32_translate(&transformed_region,
 				  -output_base->x, -output_base->y);
 	weston_transformed_region(output_base->width, output_base->height,
@@ -455,35 +475,27 @@ set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region
 				  &transformed_region, &transformed_region);
 
 	rects = pixman_region32_rectangles(&transformed_region, &nrects);
-	output_rects = calloc(nrects, sizeof(xcb_rectangle_t));
-
-	if (output_rects == NULL) {
-		pixman_region32_fini(&transformed_region);
-		return;
-	}
-
-	for (i = 0; i < nrects; i++) {
-		output_rects[i].x = rects[i].x1;
-		output_rects[i].y = rects[i].y1;
-		output_rects[i].width = rects[i].x2 - rects[i].x1;
-		output_rects[i].height = rects[i].y2 - rects[i].y1;
+	extents = pixman_region32_extents(&transformed_region);
+
+	for (i = 0; i < nrects; i++)
+		area += (uint64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	/* Errors come back through the event loop, so there is no need
+	 * to wait for each request to complete. */
+	if (nrects > SHM_PUT_MAX_RECTS ||
+	    (uint64_t)(extents->x2 - extents->x1) *
+	    (extents->y2 - extents->y1) <= SHM_PUT_COALESCE_RATIO * area) {
+		x11_output_put_shm_box(b, output, extents);
+	} else {
+		for (i = 0; i < nrects; i++)
+			x11_output_put_shm_box(b, output, &rects[i]);
 	}
 
 	pixman_region32_fini(&transformed_region);
-
-	cookie = xcb_set_clip_rectangles_checked(b->conn, XCB_CLIP_ORDERING_UNSORTED,
-					output->gc,
-					0, 0, nrects,
-					output_rects);
-	err = xcb_request_check(b->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to set clip rects, err: %d\n", err->error_code);
-		free(err);
-	}
-	free(output_rects);
+	xcb_flush(b->conn);
 }
 
-
 static int
 x11_output_repaint_shm(struct weston_output *output_base,
 		       pixman_region32_t *damage,
@@ -491,29 +503,15 @@ x11_output_repaint_shm(struct weston_output *output_base,
 {
 	struct x11_output *output = to_x11_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
-	struct x11_backend *b = to_x11_backend(ec);
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
 
+	/* The renderer only repaints and copies out the damaged part of
+	 * the shadow, so only that part of the shm image needs pushing. */
 	pixman_renderer_output_set_buffer(output_base, output->hw_surface);
 	ec->renderer->repaint_output(output_base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
-	set_clip_for_output(output_base, damage);
-	cookie = xcb_shm_put_image_checked(b->conn, output->window, output->gc,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0, output->depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
-					0, output->segment, 0);
-	err = xcb_request_check(b->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to put shm image, err: %d\n", err->error_code);
-		free(err);
-	}
+	x11_output_put_shm_damage(output_base, damage);
 
 	wl_event_source_timer_update(output->finish_frame_timer, 10);
 	return 0;
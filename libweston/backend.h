@@ -170,6 +170,54 @@ weston_output_transform_coordinate(struct weston_output *output,
 				   double device_x, double device_y,
 				   double *x, double *y);
 
+/** Frame time and latency metrics of an output, in microseconds */
+enum weston_output_metric {
+	/** From start of repaint to the frame posted to the backend */
+	WESTON_OUTPUT_METRIC_REPAINT = 0,
+	/** From start of repaint to the frame presented */
+	WESTON_OUTPUT_METRIC_PRESENT,
+	/** Between presentation of consecutive frames */
+	WESTON_OUTPUT_METRIC_FRAME_INTERVAL,
+	/** From the oldest input shown in a frame to the frame presented */
+	WESTON_OUTPUT_METRIC_INPUT,
+	/** From frame sent to acknowledged by a remote client */
+	WESTON_OUTPUT_METRIC_CLIENT_ACK,
+	/** Between a backend's predicted and the actual repaint duration,
+	 *  see weston_output::repaint_window_nsec */
+	WESTON_OUTPUT_METRIC_REPAINT_PREDICTION,
+	WESTON_OUTPUT_METRIC_COUNT
+};
+
+void
+weston_output_metrics_add(struct weston_output *output,
+			  enum weston_output_metric metric,
+			  int64_t usec);
+
+/* Work done on behalf of a client, see client-stats.c */
+enum weston_client_stat {
+	/** Surface commits applied */
+	WESTON_CLIENT_STAT_COMMITS,
+	/** Surface damage committed, in surface pixels */
+	WESTON_CLIENT_STAT_DAMAGE_PIXELS,
+	/** Buffer content uploaded by the renderer, in bytes */
+	WESTON_CLIENT_STAT_UPLOAD_BYTES,
+	/** Surface content read back with weston_surface_copy_content() */
+	WESTON_CLIENT_STAT_READBACK_BYTES,
+	/** Encoded surface content sent to remote clients, in bytes */
+	WESTON_CLIENT_STAT_REMOTE_BYTES,
+	/** wl_surface.frame callbacks sent */
+	WESTON_CLIENT_STAT_FRAME_CALLBACKS,
+	WESTON_CLIENT_STAT_COUNT
+};
+
+void
+weston_client_stats_add(struct wl_client *client,
+			enum weston_client_stat stat, uint64_t value);
+
+void
+weston_surface_client_stats_add(struct weston_surface *surface,
+				enum weston_client_stat stat, uint64_t value);
+
 /* weston_seat */
 
 void
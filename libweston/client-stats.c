@@ -0,0 +1,377 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <libweston/libweston.h>
+#include <libweston/weston-log.h>
+#include "backend.h"
+#include "libweston-internal.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Per-client cost accounting.
+ *
+ * Whatever does work on behalf of a client adds it to the client's
+ * counters with weston_client_stats_add(). The 'client-stats' debug scope
+ * streams, every CLIENT_STATS_WINDOW_MSEC, the rates of the clients that
+ * were busy in that window; the one-shot 'client-stats-dump' scope prints
+ * the totals of every connected client and its rates since the previous
+ * dump.
+ *
+ * With weston_compositor::client_commit_rate set, a client that commits
+ * more often than that within a second, across all of its surfaces, has
+ * its frame callbacks held back until that second is over, see
+ * weston_surface_client_budget_delay().
+ */
+
+#define CLIENT_STATS_WINDOW_MSEC 1000
+#define CLIENT_BUDGET_WINDOW_MSEC 1000
+
+struct weston_client_stats {
+	struct wl_listener destroy_listener;
+	uint64_t total[WESTON_CLIENT_STAT_COUNT];
+	uint64_t window_base[WESTON_CLIENT_STAT_COUNT];
+	uint64_t dump_base[WESTON_CLIENT_STAT_COUNT];
+	struct timespec dump_time; /* CLOCK_MONOTONIC, of the previous dump
+				      or creation */
+
+	/* commits in the second since budget_start, against
+	   weston_compositor::client_commit_rate */
+	struct timespec budget_start; /* CLOCK_MONOTONIC */
+	uint32_t budget_commits;
+};
+
+static const char * const stat_names[WESTON_CLIENT_STAT_COUNT] = {
+	[WESTON_CLIENT_STAT_COMMITS] = "commits",
+	[WESTON_CLIENT_STAT_DAMAGE_PIXELS] = "damage-px",
+	[WESTON_CLIENT_STAT_UPLOAD_BYTES] = "upload-bytes",
+	[WESTON_CLIENT_STAT_READBACK_BYTES] = "readback-bytes",
+	[WESTON_CLIENT_STAT_REMOTE_BYTES] = "remote-bytes",
+	[WESTON_CLIENT_STAT_FRAME_CALLBACKS] = "frame-callbacks",
+};
+
+static void
+client_stats_handle_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_client_stats *stats =
+		container_of(listener, struct weston_client_stats,
+			     destroy_listener);
+
+	free(stats);
+}
+
+static struct weston_client_stats *
+client_stats_get(struct wl_client *client, bool create)
+{
+	struct weston_client_stats *stats;
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(client,
+						  client_stats_handle_destroy);
+	if (listener)
+		return container_of(listener, struct weston_client_stats,
+				    destroy_listener);
+
+	if (!create)
+		return NULL;
+
+	stats = zalloc(sizeof *stats);
+	if (!stats)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &stats->dump_time);
+	stats->destroy_listener.notify = client_stats_handle_destroy;
+	wl_client_add_destroy_listener(client, &stats->destroy_listener);
+
+	return stats;
+}
+
+/** Account work done on behalf of a client
+ *
+ * \param client The client, NULL for the compositor's own surfaces, which
+ *               are not accounted.
+ * \param stat What was done.
+ * \param value How much: a count, pixels or bytes, see the stat.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT void
+weston_client_stats_add(struct wl_client *client,
+			enum weston_client_stat stat, uint64_t value)
+{
+	struct weston_client_stats *stats;
+
+	if (!client || value == 0)
+		return;
+
+	stats = client_stats_get(client, true);
+	if (stats)
+		stats->total[stat] += value;
+}
+
+/** Account work done for a surface to the client that owns it
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT void
+weston_surface_client_stats_add(struct weston_surface *surface,
+				enum weston_client_stat stat, uint64_t value)
+{
+	if (surface->resource)
+		weston_client_stats_add(wl_resource_get_client(surface->resource),
+					stat, value);
+}
+
+/* Accounts a commit of surface, which damaged damage_area surface pixels,
+ * to its client. */
+void
+weston_surface_client_stats_commit(struct weston_surface *surface,
+				   uint64_t damage_area)
+{
+	struct weston_compositor *ec = surface->compositor;
+	struct weston_client_stats *stats;
+	struct timespec now;
+
+	if (!surface->resource)
+		return;
+
+	stats = client_stats_get(wl_resource_get_client(surface->resource),
+				 true);
+	if (!stats)
+		return;
+
+	stats->total[WESTON_CLIENT_STAT_COMMITS]++;
+	stats->total[WESTON_CLIENT_STAT_DAMAGE_PIXELS] += damage_area;
+
+	if (ec->client_commit_rate == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_sub_to_msec(&now, &stats->budget_start) >=
+	    CLIENT_BUDGET_WINDOW_MSEC) {
+		stats->budget_start = now;
+		stats->budget_commits = 0;
+	}
+	stats->budget_commits++;
+}
+
+/* How long the frame callbacks of surface are to be held back, in msec:
+ * until the end of the second in which its client went over
+ * weston_compositor::client_commit_rate, 0 if it did not. */
+uint32_t
+weston_surface_client_budget_delay(struct weston_surface *surface)
+{
+	struct weston_compositor *ec = surface->compositor;
+	struct weston_client_stats *stats;
+	struct timespec now;
+	int64_t elapsed;
+
+	if (ec->client_commit_rate == 0 || !surface->resource)
+		return 0;
+
+	stats = client_stats_get(wl_resource_get_client(surface->resource),
+				 false);
+	if (!stats || stats->budget_commits <= ec->client_commit_rate)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = timespec_sub_to_msec(&now, &stats->budget_start);
+	if (elapsed >= CLIENT_BUDGET_WINDOW_MSEC)
+		return 0;
+
+	return CLIENT_BUDGET_WINDOW_MSEC - elapsed;
+}
+
+/* To the streaming scope, or to sub of a one-shot scope if set. */
+static void
+client_stats_print(struct weston_log_scope *scope,
+		   struct weston_log_subscription *sub,
+		   struct wl_client *client, const uint64_t *total,
+		   const uint64_t *base, int64_t msec)
+{
+	char line[128];
+	pid_t pid = 0;
+	int i;
+
+	wl_client_get_credentials(client, &pid, NULL, NULL);
+
+	for (i = -1; i < WESTON_CLIENT_STAT_COUNT; i++) {
+		if (i < 0)
+			snprintf(line, sizeof line, "  client %p (PID %d):\n",
+				 client, pid);
+		else
+			snprintf(line, sizeof line,
+				 "    %-16s %14" PRIu64 " %12.1f/s\n",
+				 stat_names[i], total[i],
+				 msec > 0 ? (total[i] - base[i]) * 1000.0 / msec :
+				 0.0);
+
+		if (sub)
+			weston_log_subscription_printf(sub, "%s", line);
+		else
+			weston_log_scope_printf(scope, "%s", line);
+	}
+}
+
+static int
+client_stats_timer_func(void *data)
+{
+	struct weston_compositor *ec = data;
+	struct wl_list *clients = wl_display_get_client_list(ec->wl_display);
+	struct weston_client_stats *stats;
+	struct wl_client *client;
+	struct timespec now;
+	int64_t msec;
+	bool busy;
+	int i;
+
+	if (!weston_log_scope_is_enabled(ec->debug_client_stats))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msec = timespec_sub_to_msec(&now, &ec->client_stats_window_start);
+	ec->client_stats_window_start = now;
+
+	weston_log_scope_printf(ec->debug_client_stats,
+				"client stats, last %" PRId64 " ms:\n", msec);
+
+	wl_client_for_each(client, clients) {
+		stats = client_stats_get(client, false);
+		if (!stats)
+			continue;
+
+		busy = false;
+		for (i = 0; i < WESTON_CLIENT_STAT_COUNT; i++)
+			if (stats->total[i] != stats->window_base[i])
+				busy = true;
+
+		if (busy)
+			client_stats_print(ec->debug_client_stats, NULL,
+					   client, stats->total,
+					   stats->window_base, msec);
+		for (i = 0; i < WESTON_CLIENT_STAT_COUNT; i++)
+			stats->window_base[i] = stats->total[i];
+	}
+
+	wl_event_source_timer_update(ec->client_stats_timer,
+				     CLIENT_STATS_WINDOW_MSEC);
+
+	return 0;
+}
+
+/**
+ * Called when the 'client-stats' debug scope is bound by a client. Starts
+ * the window timer, which stops by itself once the scope has no
+ * subscribers left.
+ */
+static void
+debug_client_stats_cb(struct weston_log_subscription *sub, void *data)
+{
+	struct weston_compositor *ec = data;
+	struct wl_event_loop *loop;
+
+	if (!ec->client_stats_timer) {
+		loop = wl_display_get_event_loop(ec->wl_display);
+		ec->client_stats_timer =
+			wl_event_loop_add_timer(loop, client_stats_timer_func,
+						ec);
+		if (!ec->client_stats_timer)
+			return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ec->client_stats_window_start);
+	wl_event_source_timer_update(ec->client_stats_timer,
+				     CLIENT_STATS_WINDOW_MSEC);
+}
+
+/**
+ * Called when the 'client-stats-dump' debug scope is bound by a client.
+ * This one-shot weston-debug scope prints the counters of every connected
+ * client and its rates since the previous dump, and then terminates the
+ * stream.
+ */
+static void
+debug_client_stats_dump_cb(struct weston_log_subscription *sub, void *data)
+{
+	struct weston_compositor *ec = data;
+	struct wl_list *clients = wl_display_get_client_list(ec->wl_display);
+	struct weston_client_stats *stats;
+	struct wl_client *client;
+	struct timespec now;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	weston_log_subscription_printf(sub, "client stats, totals and rates "
+				       "since the previous dump:\n");
+
+	wl_client_for_each(client, clients) {
+		stats = client_stats_get(client, false);
+		if (!stats)
+			continue;
+
+		client_stats_print(NULL, sub, client,
+				   stats->total, stats->dump_base,
+				   timespec_sub_to_msec(&now, &stats->dump_time));
+		for (i = 0; i < WESTON_CLIENT_STAT_COUNT; i++)
+			stats->dump_base[i] = stats->total[i];
+		stats->dump_time = now;
+	}
+
+	weston_log_subscription_complete(sub);
+}
+
+void
+weston_compositor_client_stats_init(struct weston_compositor *ec)
+{
+	ec->debug_client_stats =
+		weston_compositor_add_log_scope(ec, "client-stats",
+						"Per-client commit, damage, upload, readback and remote rates\n",
+						debug_client_stats_cb, NULL, ec);
+	ec->debug_client_stats_dump =
+		weston_compositor_add_log_scope(ec, "client-stats-dump",
+						"Dump per-client counters and rates since the previous dump\n",
+						debug_client_stats_dump_cb,
+						NULL, ec);
+}
+
+void
+weston_compositor_client_stats_destroy(struct weston_compositor *ec)
+{
+	if (ec->client_stats_timer)
+		wl_event_source_remove(ec->client_stats_timer);
+	ec->client_stats_timer = NULL;
+	weston_log_scope_destroy(ec->debug_client_stats);
+	ec->debug_client_stats = NULL;
+	weston_log_scope_destroy(ec->debug_client_stats_dump);
+	ec->debug_client_stats_dump = NULL;
+}
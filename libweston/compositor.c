@@ -52,6 +52,8 @@
 #include <time.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "timeline.h"
 
@@ -59,10 +61,14 @@
 #include <libweston/weston-log.h>
 #include "linux-dmabuf.h"
 #include "viewporter-server-protocol.h"
+#ifdef HAVE_FRACTIONAL_SCALE
+#include "fractional-scale-v1-server-protocol.h"
+#endif
 #include "presentation-time-server-protocol.h"
 #include "xdg-output-unstable-v1-server-protocol.h"
 #include "linux-explicit-synchronization-unstable-v1-server-protocol.h"
 #include "linux-explicit-synchronization.h"
+#include "shared/alloc-profile.h"
 #include "shared/fd-util.h"
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
@@ -469,6 +475,8 @@ weston_surface_state_init(struct weston_surface_state *state)
 
 	pixman_region32_init(&state->damage_surface);
 	pixman_region32_init(&state->damage_buffer);
+	wl_array_init(&state->damage_surface_rects);
+	wl_array_init(&state->damage_buffer_rects);
 	pixman_region32_init(&state->opaque);
 	region_init_infinite(&state->input);
 
@@ -502,6 +510,8 @@ weston_surface_state_fini(struct weston_surface_state *state)
 	pixman_region32_fini(&state->opaque);
 	pixman_region32_fini(&state->damage_surface);
 	pixman_region32_fini(&state->damage_buffer);
+	wl_array_release(&state->damage_surface_rects);
+	wl_array_release(&state->damage_buffer_rects);
 
 	if (state->buffer)
 		wl_list_remove(&state->buffer_destroy_listener.link);
@@ -548,6 +558,7 @@ weston_surface_create(struct weston_compositor *compositor)
 	surface->buffer_viewport.surface.width = -1;
 
 	weston_surface_state_init(&surface->pending);
+	weston_surface_state_init(&surface->deferred.state);
 
 	pixman_region32_init(&surface->damage);
 	pixman_region32_init(&surface->opaque);
@@ -557,6 +568,7 @@ weston_surface_create(struct weston_compositor *compositor)
 
 	wl_list_init(&surface->frame_callback_list);
 	wl_list_init(&surface->feedback_list);
+	wl_list_init(&surface->throttle_link);
 
 	wl_list_init(&surface->subsurface_list);
 	wl_list_init(&surface->subsurface_list_pending);
@@ -1212,6 +1224,35 @@ weston_surface_update_output_mask(struct weston_surface *es, uint32_t mask)
 	weston_schedule_surface_protection_update(es->compositor);
 }
 
+/** Tell the client the scale to render the surface at on its output
+ *
+ * Sent only when it differs from the last one sent, so this can be called
+ * whenever the surface or its output may have changed.
+ */
+static void
+weston_surface_send_preferred_scale(struct weston_surface *es)
+{
+#ifdef HAVE_FRACTIONAL_SCALE
+	struct weston_output *output = es->output;
+	uint32_t scale;
+
+	if (!es->fractional_scale_resource || !output)
+		return;
+
+	if (output->fractional_scale > 0.0f)
+		scale = (uint32_t)(output->fractional_scale * 120.0f + 0.5f);
+	else
+		scale = output->current_scale * 120;
+
+	if (scale == es->fractional_scale_sent)
+		return;
+
+	es->fractional_scale_sent = scale;
+	wp_fractional_scale_v1_send_preferred_scale(es->fractional_scale_resource,
+						    scale);
+#endif
+}
+
 static void
 notify_view_output_destroy(struct wl_listener *listener, void *data)
 {
@@ -1296,6 +1337,7 @@ weston_surface_assign_output(struct weston_surface *es)
 
 	es->output = new_output;
 	weston_surface_update_output_mask(es, mask);
+	weston_surface_send_preferred_scale(es);
 }
 
 /** Recalculate which output(s) the view is displayed on
@@ -1457,6 +1499,45 @@ weston_view_update_transform_disable(struct weston_view *view)
 	}
 }
 
+static bool
+matrix_is_translation(const struct weston_matrix *matrix)
+{
+	int i;
+
+	if (matrix->type & ~WESTON_MATRIX_TRANSFORM_TRANSLATE)
+		return false;
+	if (matrix->type != 0)
+		return true;
+
+	/* Type 0 is also what a hand-filled matrix carries, so it only
+	 * counts when everything but the offset is the identity. */
+	for (i = 0; i < 16; i++) {
+		if (i >= 12 && i <= 14)
+			continue;
+		if (matrix->d[i] != (i % 5 == 0 ? 1.0f : 0.0f))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+view_transforms_are_translations(struct weston_view *view)
+{
+	struct weston_view *parent = view->geometry.parent;
+	struct weston_transform *tform;
+
+	if (parent && !matrix_is_translation(&parent->transform.matrix))
+		return false;
+
+	wl_list_for_each(tform, &view->geometry.transformation_list, link) {
+		if (!matrix_is_translation(&tform->matrix))
+			return false;
+	}
+
+	return true;
+}
+
 static int
 weston_view_update_transform_enable(struct weston_view *view)
 {
@@ -1475,11 +1556,27 @@ weston_view_update_transform_enable(struct weston_view *view)
 	view->transform.position.matrix.d[13] = view->geometry.y;
 
 	weston_matrix_init(matrix);
-	wl_list_for_each(tform, &view->geometry.transformation_list, link)
-		weston_matrix_multiply(matrix, &tform->matrix);
+	if (view_transforms_are_translations(view)) {
+		/* Most views, e.g. all sub-surfaces without transformations,
+		 * only add up offsets, skip the matrix products. */
+		wl_list_for_each(tform, &view->geometry.transformation_list, link) {
+			matrix->d[12] += tform->matrix.d[12];
+			matrix->d[13] += tform->matrix.d[13];
+			matrix->d[14] += tform->matrix.d[14];
+		}
+		if (parent) {
+			matrix->d[12] += parent->transform.matrix.d[12];
+			matrix->d[13] += parent->transform.matrix.d[13];
+			matrix->d[14] += parent->transform.matrix.d[14];
+		}
+		matrix->type = WESTON_MATRIX_TRANSFORM_TRANSLATE;
+	} else {
+		wl_list_for_each(tform, &view->geometry.transformation_list, link)
+			weston_matrix_multiply(matrix, &tform->matrix);
 
-	if (parent)
-		weston_matrix_multiply(matrix, &parent->transform.matrix);
+		if (parent)
+			weston_matrix_multiply(matrix, &parent->transform.matrix);
+	}
 
 	if (weston_matrix_invert(inverse, matrix) < 0) {
 		/* Oops, bad total transformation, not invertible */
@@ -1574,6 +1671,8 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_assign_output(view);
 
+	view->surface->compositor->pick_index.dirty = true;
+
 	wl_signal_emit(&view->surface->compositor->transform_signal,
 		       view->surface);
 }
@@ -2069,43 +2168,214 @@ weston_compositor_get_time(struct timespec *time)
 	clock_gettime(CLOCK_REALTIME, time);
 }
 
-/** weston_compositor_pick_view
- * \ingroup compositor
- */
-WL_EXPORT struct weston_view *
-weston_compositor_pick_view(struct weston_compositor *compositor,
-			    wl_fixed_t x, wl_fixed_t y,
-			    wl_fixed_t *vx, wl_fixed_t *vy)
+static bool
+weston_view_pick_at(struct weston_view *view,
+		    wl_fixed_t x, wl_fixed_t y,
+		    wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
 	wl_fixed_t view_x, view_y;
 	int view_ix, view_iy;
 	int ix = wl_fixed_to_int(x);
 	int iy = wl_fixed_to_int(y);
 
+	if (!pixman_region32_contains_point(
+			&view->transform.boundingbox, ix, iy, NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+static int
+compare_int32(const void *a, const void *b)
+{
+	int32_t ia = *(const int32_t *)a;
+	int32_t ib = *(const int32_t *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+/* Returns the strip containing x, or -1 if x is outside of all strips. */
+static int
+pick_index_find_strip(const int32_t *edges, int num_edges, int32_t x)
+{
+	int lo = 0;
+	int hi = num_edges - 1;
+	int mid;
+
+	if (num_edges < 2 || x < edges[0] || x >= edges[num_edges - 1])
+		return -1;
+
+	/* edges[lo] <= x < edges[hi] */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (edges[mid] <= x)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static bool
+weston_compositor_build_pick_index(struct weston_compositor *compositor)
+{
+	struct weston_view *view, **views;
+	pixman_box32_t *box;
+	int32_t *edges;
+	uint32_t *strips, *entries;
+	int num_views, num_edges, num_strips;
+	int first, last;
+	int i, j, k;
+
+	compositor->pick_index.views.size = 0;
+	compositor->pick_index.edges.size = 0;
+	compositor->pick_index.strips.size = 0;
+	compositor->pick_index.entries.size = 0;
+
 	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
+		views = wl_array_add(&compositor->pick_index.views,
+				     sizeof *views);
+		if (!views)
+			return false;
+		*views = view;
+
+		box = pixman_region32_extents(&view->transform.boundingbox);
+		if (box->x1 >= box->x2 || box->y1 >= box->y2)
 			continue;
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+		edges = wl_array_add(&compositor->pick_index.edges,
+				     2 * sizeof *edges);
+		if (!edges)
+			return false;
+		edges[0] = box->x1;
+		edges[1] = box->x2;
+	}
+
+	views = compositor->pick_index.views.data;
+	num_views = compositor->pick_index.views.size / sizeof *views;
+
+	edges = compositor->pick_index.edges.data;
+	num_edges = compositor->pick_index.edges.size / sizeof *edges;
+	if (num_edges > 0) {
+		qsort(edges, num_edges, sizeof *edges, compare_int32);
+		for (i = 1, j = 0; i < num_edges; i++) {
+			if (edges[i] != edges[j])
+				edges[++j] = edges[i];
+		}
+		num_edges = j + 1;
+		compositor->pick_index.edges.size = num_edges * sizeof *edges;
+	}
+	num_strips = num_edges > 1 ? num_edges - 1 : 0;
+
+	/* Count views per strip, then turn counts into start offsets. */
+	strips = wl_array_add(&compositor->pick_index.strips,
+			      (num_strips + 1) * sizeof *strips);
+	if (!strips)
+		return false;
+	memset(strips, 0, (num_strips + 1) * sizeof *strips);
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
+	for (i = 0; i < num_views; i++) {
+		box = pixman_region32_extents(&views[i]->transform.boundingbox);
+		if (box->x1 >= box->x2 || box->y1 >= box->y2)
 			continue;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
+		first = pick_index_find_strip(edges, num_edges, box->x1);
+		last = pick_index_find_strip(edges, num_edges, box->x2 - 1);
+		for (k = first; k <= last; k++)
+			strips[k + 1]++;
+	}
+	for (k = 0; k < num_strips; k++)
+		strips[k + 1] += strips[k];
+
+	entries = wl_array_add(&compositor->pick_index.entries,
+			       strips[num_strips] * sizeof *entries);
+	if (!entries && strips[num_strips] > 0)
+		return false;
+
+	/* Fill in view_list order, so each strip keeps the stacking order.
+	 * strips[k] is advanced while filling, and restored below. */
+	for (i = 0; i < num_views; i++) {
+		box = pixman_region32_extents(&views[i]->transform.boundingbox);
+		if (box->x1 >= box->x2 || box->y1 >= box->y2)
 			continue;
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+		first = pick_index_find_strip(edges, num_edges, box->x1);
+		last = pick_index_find_strip(edges, num_edges, box->x2 - 1);
+		for (k = first; k <= last; k++)
+			entries[strips[k]++] = i;
+	}
+	for (k = num_strips; k > 0; k--)
+		strips[k] = strips[k - 1];
+	strips[0] = 0;
+
+	compositor->pick_index.dirty = false;
+
+	return true;
+}
+
+/** weston_compositor_pick_view
+ * \ingroup compositor
+ *
+ * Finds the topmost view accepting input at the given global coordinates.
+ * Only views whose bounding box spans the vertical strip around x are
+ * tested, the strip being found by binary search in the pick index.
+ */
+WL_EXPORT struct weston_view *
+weston_compositor_pick_view(struct weston_compositor *compositor,
+			    wl_fixed_t x, wl_fixed_t y,
+			    wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view *view, **views;
+	int32_t *edges;
+	uint32_t *strips, *entries;
+	int num_edges;
+	int strip;
+	uint32_t k;
+
+	if (compositor->pick_index.dirty &&
+	    !weston_compositor_build_pick_index(compositor)) {
+		/* Out of memory, fall back to walking the whole list. */
+		compositor->pick_index.dirty = true;
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (weston_view_pick_at(view, x, y, vx, vy))
+				return view;
+		}
+		goto not_found;
+	}
+
+	views = compositor->pick_index.views.data;
+	edges = compositor->pick_index.edges.data;
+	num_edges = compositor->pick_index.edges.size / sizeof *edges;
+	strips = compositor->pick_index.strips.data;
+	entries = compositor->pick_index.entries.data;
+
+	strip = pick_index_find_strip(edges, num_edges, wl_fixed_to_int(x));
+	if (strip < 0)
+		goto not_found;
+
+	for (k = strips[strip]; k < strips[strip + 1]; k++) {
+		view = views[entries[k]];
+		if (weston_view_pick_at(view, x, y, vx, vy))
+			return view;
 	}
 
+not_found:
 	*vx = wl_fixed_from_int(-1000000);
 	*vy = wl_fixed_from_int(-1000000);
 	return NULL;
@@ -2138,6 +2408,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	view->surface->compositor->view_list_dirty = true;
+	view->surface->compositor->pick_index.dirty = true;
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -2165,6 +2437,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	struct weston_view *view;
 
 	surface->is_mapped = false;
+	surface->compositor->view_list_dirty = true;
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
@@ -2194,6 +2467,8 @@ weston_view_destroy(struct weston_view *view)
 
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	view->surface->compositor->view_list_dirty = true;
+	view->surface->compositor->pick_index.dirty = true;
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -2230,6 +2505,11 @@ weston_surface_destroy(struct weston_surface *surface)
 
 	weston_surface_state_fini(&surface->pending);
 
+	if (surface->deferred.fence_source)
+		wl_event_source_remove(surface->deferred.fence_source);
+	weston_surface_state_fini(&surface->deferred.state);
+	weston_buffer_reference(&surface->deferred.buffer_ref, NULL);
+
 	weston_buffer_reference(&surface->buffer_ref, NULL);
 	weston_buffer_release_reference(&surface->buffer_release_ref, NULL);
 
@@ -2239,6 +2519,7 @@ weston_surface_destroy(struct weston_surface *surface)
 
 	wl_list_for_each_safe(cb, next, &surface->frame_callback_list, link)
 		wl_resource_destroy(cb->resource);
+	wl_list_remove(&surface->throttle_link);
 
 	weston_presentation_feedback_discard_list(&surface->feedback_list);
 
@@ -2249,6 +2530,8 @@ weston_surface_destroy(struct weston_surface *surface)
 
 	fd_clear(&surface->acquire_fence_fd);
 
+	weston_dmabuf_feedback_destroy(surface->dmabuf_feedback);
+
 	free(surface);
 }
 
@@ -2267,6 +2550,9 @@ destroy_surface(struct wl_resource *resource)
 	if (surface->viewport_resource)
 		wl_resource_set_user_data(surface->viewport_resource, NULL);
 
+	if (surface->fractional_scale_resource)
+		wl_resource_set_user_data(surface->fractional_scale_resource, NULL);
+
 	if (surface->synchronization_resource) {
 		wl_resource_set_user_data(surface->synchronization_resource,
 					  NULL);
@@ -2469,7 +2755,7 @@ static void
 view_accumulate_damage(struct weston_view *view,
 		       pixman_region32_t *opaque)
 {
-	pixman_region32_t damage;
+	pixman_region32_t damage, visible;
 
 	pixman_region32_init(&damage);
 	if (view->transform.enabled) {
@@ -2490,9 +2776,39 @@ view_accumulate_damage(struct weston_view *view,
 			      &view->plane->damage, &damage);
 	pixman_region32_fini(&damage);
 	pixman_region32_copy(&view->clip, opaque);
+
+	/* Views are visited front to back, so 'opaque' together with the
+	 * planes above covers everything in front of this view. */
+	pixman_region32_init(&visible);
+	pixman_region32_subtract(&visible, &view->transform.boundingbox,
+				 opaque);
+	pixman_region32_subtract(&visible, &visible, &view->plane->clip);
+	view->occluded = !pixman_region32_not_empty(&visible);
+	pixman_region32_fini(&visible);
+
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
+/* Whether every view of the surface on the primary plane is occluded.
+ * Renderers then skip the texture upload and keep the damage until the
+ * surface is uncovered, which needs the buffer to stay around. */
+static bool
+surface_upload_deferred(struct weston_surface *surface)
+{
+	struct weston_view *view;
+	bool deferred = false;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (view->plane != &surface->compositor->primary_plane)
+			continue;
+		if (!view->occluded)
+			return false;
+		deferred = true;
+	}
+
+	return deferred;
+}
+
 static void
 output_accumulate_damage(struct weston_output *output)
 {
@@ -2540,9 +2856,11 @@ output_accumulate_damage(struct weston_output *output)
 		 * around for migrating the surface into a non-primary plane
 		 * later, keep_buffer is true. Otherwise, drop the core
 		 * reference now, and allow early buffer release. This enables
-		 * clients to use single-buffering.
+		 * clients to use single-buffering. An occluded surface has
+		 * not been uploaded yet, so keep the buffer for that too.
 		 */
-		if (!ev->surface->keep_buffer) {
+		if (!ev->surface->keep_buffer &&
+		    !surface_upload_deferred(ev->surface)) {
 			weston_buffer_reference(&ev->surface->buffer_ref, NULL);
 			weston_buffer_release_reference(
 				&ev->surface->buffer_release_ref, NULL);
@@ -2659,11 +2977,26 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/* The view list only depends on the layer list, the views of each layer,
+ * and the order and mappedness of their sub-surfaces. Changes to any of
+ * those set compositor->view_list_dirty, otherwise only the transforms
+ * need refreshing.
+ */
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
 	struct weston_view *view, *tmp;
 	struct weston_layer *layer;
+	struct weston_view **views;
+	size_t num_views, i;
+
+	if (!compositor->view_list_dirty) {
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+		return;
+	}
+
+	TL_POINT(compositor, "core_build_view_list_begin", TLP_END);
 
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
@@ -2682,6 +3015,25 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* The view list was rebuilt, but the pick index can be kept if the
+	 * stacking order came out the same. */
+	if (!compositor->pick_index.dirty) {
+		views = compositor->pick_index.views.data;
+		num_views = compositor->pick_index.views.size / sizeof *views;
+		i = 0;
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (i == num_views || views[i] != view)
+				break;
+			i++;
+		}
+		if (i != num_views || &view->link != &compositor->view_list)
+			compositor->pick_index.dirty = true;
+	}
+
+	compositor->view_list_dirty = false;
+
+	TL_POINT(compositor, "core_build_view_list_end", TLP_END);
 }
 
 static void
@@ -2709,23 +3061,188 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+/* One output's frame between the scene graph pass and posting it, so that
+ * the renderer work in between can be moved to a repaint worker.
+ */
+struct weston_output_repaint_frame {
+	struct weston_output *output;
+	pixman_region32_t damage;
+	struct wl_list frame_callback_list;
+	bool rendered; /* by repaint_render on a repaint worker */
+};
+
+static void
+send_frame_callbacks(struct wl_list *frame_callback_list, uint32_t msecs)
+{
+	struct weston_frame_callback *cb, *cnext;
+
+	wl_list_for_each_safe(cb, cnext, frame_callback_list, link) {
+		weston_client_stats_add(wl_resource_get_client(cb->resource),
+					WESTON_CLIENT_STAT_FRAME_CALLBACKS, 1);
+		wl_callback_send_done(cb->resource, msecs);
+		wl_resource_destroy(cb->resource);
+	}
+}
+
+/* Whether none of the views of the surface shows anything on any output,
+ * going by the clip regions of the last damage accumulation. */
+static bool
+weston_surface_is_occluded(struct weston_surface *surface)
+{
+	struct weston_compositor *ec = surface->compositor;
+	struct weston_output *output;
+	struct weston_view *view;
+	pixman_region32_t visible;
+	bool occluded = true;
+
+	pixman_region32_init(&visible);
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		/* only views in weston_compositor::view_list are shown */
+		if (wl_list_empty(&view->link) || !view->plane)
+			continue;
+
+		pixman_region32_subtract(&visible, &view->transform.boundingbox,
+					 &view->clip);
+		pixman_region32_subtract(&visible, &visible, &view->plane->clip);
+
+		wl_list_for_each(output, &ec->output_list, link) {
+			pixman_box32_t *box;
+			pixman_region32_t on_output;
+
+			if (!(view->output_mask & (1u << output->id)))
+				continue;
+
+			box = pixman_region32_extents(&output->region);
+			pixman_region32_init(&on_output);
+			pixman_region32_intersect_rect(&on_output, &visible,
+						       box->x1, box->y1,
+						       box->x2 - box->x1,
+						       box->y2 - box->y1);
+			occluded = !pixman_region32_not_empty(&on_output);
+			pixman_region32_fini(&on_output);
+
+			if (!occluded)
+				goto out;
+		}
+	}
+
+out:
+	pixman_region32_fini(&visible);
+
+	return occluded;
+}
+
+/* Arms the throttle timer for the earliest release deadline of the
+ * throttled surfaces, or disarms it if there are none. */
+static void
+throttle_timer_rearm(struct weston_compositor *ec, const struct timespec *now)
+{
+	struct weston_surface *surface;
+	int64_t delay, min_delay = INT64_MAX;
+
+	wl_list_for_each(surface, &ec->throttled_surface_list, throttle_link) {
+		delay = timespec_sub_to_msec(&surface->throttle_deadline, now);
+		min_delay = MIN(min_delay, delay);
+	}
+
+	if (min_delay == INT64_MAX)
+		min_delay = 0;
+	else
+		min_delay = MAX(min_delay, 1);
+
+	wl_event_source_timer_update(ec->throttle_timer, min_delay);
+}
+
 static int
-weston_output_repaint(struct weston_output *output, void *repaint_data)
+throttle_timer_handler(void *data)
+{
+	struct weston_compositor *ec = data;
+	struct weston_surface *surface, *tmp;
+	struct timespec now;
+
+	weston_compositor_read_presentation_clock(ec, &now);
+
+	wl_list_for_each_safe(surface, tmp, &ec->throttled_surface_list,
+			      throttle_link) {
+		if (timespec_sub_to_nsec(&surface->throttle_deadline, &now) > 0)
+			continue;
+
+		send_frame_callbacks(&surface->frame_callback_list,
+				     timespec_to_msec(&now));
+		wl_list_remove(&surface->throttle_link);
+		wl_list_init(&surface->throttle_link);
+	}
+
+	throttle_timer_rearm(ec, &now);
+
+	return 0;
+}
+
+/* Returns true if the frame callbacks of the surface are held back until
+ * the throttle timer sends them: while nothing of the surface is visible,
+ * or while its client is over its commit budget. */
+static bool
+weston_surface_throttle_frame_callbacks(struct weston_surface *surface)
+{
+	struct weston_compositor *ec = surface->compositor;
+	struct wl_event_loop *loop;
+	struct timespec now;
+	uint32_t interval;
+
+	if (wl_list_empty(&surface->frame_callback_list))
+		return false;
+
+	interval = weston_surface_client_budget_delay(surface);
+	if (interval == 0 && ec->occluded_frame_interval_msec != 0 &&
+	    weston_surface_is_occluded(surface))
+		interval = ec->occluded_frame_interval_msec;
+
+	if (interval == 0) {
+		wl_list_remove(&surface->throttle_link);
+		wl_list_init(&surface->throttle_link);
+		return false;
+	}
+
+	if (!wl_list_empty(&surface->throttle_link))
+		return true;
+
+	if (!ec->throttle_timer) {
+		loop = wl_display_get_event_loop(ec->wl_display);
+		ec->throttle_timer = wl_event_loop_add_timer(loop,
+							     throttle_timer_handler,
+							     ec);
+		if (!ec->throttle_timer)
+			return false;
+	}
+
+	/* each surface keeps its own deadline, an occluded surface and one
+	 * over its commit budget wait for very different times */
+	weston_compositor_read_presentation_clock(ec, &now);
+	timespec_add_msec(&surface->throttle_deadline, &now, interval);
+	wl_list_insert(&ec->throttled_surface_list, &surface->throttle_link);
+	throttle_timer_rearm(ec, &now);
+	TL_POINT(ec, "core_frame_callback_throttled", TLP_SURFACE(surface),
+		 TLP_END);
+
+	return true;
+}
+
+static void
+weston_output_repaint_prepare(struct weston_output *output,
+			      void *repaint_data,
+			      struct weston_output_repaint_frame *frame)
 {
 	struct weston_compositor *ec = output->compositor;
 	struct weston_view *ev;
-	struct weston_animation *animation, *next;
-	struct weston_frame_callback *cb, *cnext;
-	struct wl_list frame_callback_list;
-	pixman_region32_t output_damage;
-	int r;
-	uint32_t frame_time_msec;
 	enum weston_hdcp_protection highest_requested = WESTON_HDCP_DISABLE;
 
-	if (output->destroying)
-		return 0;
-
+	WESTON_ALLOC_SCOPE_BEGIN("output-repaint");
 	TL_POINT(ec, "core_repaint_begin", TLP_OUTPUT(output), TLP_END);
+	weston_output_metrics_repaint_begin(output);
+
+	frame->output = output;
+	frame->rendered = false;
 
 	/* Rebuild the surface list and update surface transforms up front. */
 	weston_compositor_build_view_list(ec);
@@ -2756,34 +3273,62 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		}
 	}
 
-	wl_list_init(&frame_callback_list);
+	output_accumulate_damage(output);
+
+	/* Done after accumulating damage, which updates the clip regions
+	 * the occlusion test of the throttling relies on. */
+	wl_list_init(&frame->frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
 		/* Note: This operation is safe to do multiple times on the
 		 * same surface.
 		 */
 		if (ev->surface->output == output) {
-			wl_list_insert_list(&frame_callback_list,
-					    &ev->surface->frame_callback_list);
-			wl_list_init(&ev->surface->frame_callback_list);
+			if (!weston_surface_throttle_frame_callbacks(ev->surface)) {
+				wl_list_insert_list(&frame->frame_callback_list,
+						    &ev->surface->frame_callback_list);
+				wl_list_init(&ev->surface->frame_callback_list);
+			}
 
 			weston_output_take_feedback_list(output, ev->surface);
 		}
 	}
 
-	output_accumulate_damage(output);
-
-	pixman_region32_init(&output_damage);
-	pixman_region32_intersect(&output_damage,
+	pixman_region32_init(&frame->damage);
+	pixman_region32_intersect(&frame->damage,
 				  &ec->primary_plane.damage, &output->region);
-	pixman_region32_subtract(&output_damage,
-				 &output_damage, &ec->primary_plane.clip);
+	pixman_region32_subtract(&frame->damage,
+				 &frame->damage, &ec->primary_plane.clip);
 
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
-	r = output->repaint(output, &output_damage, repaint_data);
+	if (output->zoom.offscreen)
+		weston_output_zoom_frame_damage(output, &frame->damage);
+	WESTON_ALLOC_SCOPE_END();
+}
+
+static void
+weston_output_repaint_done(struct weston_output_repaint_frame *frame)
+{
+	struct weston_output *output = frame->output;
+
+	pixman_region32_fini(&frame->damage);
+
+	send_frame_callbacks(&frame->frame_callback_list,
+			     timespec_to_msec(&output->frame_time));
+}
+
+static int
+weston_output_repaint_finish(struct weston_output_repaint_frame *frame,
+			     void *repaint_data)
+{
+	struct weston_output *output = frame->output;
+	struct weston_compositor *ec = output->compositor;
+	struct weston_animation *animation, *next;
+	int r;
 
-	pixman_region32_fini(&output_damage);
+	WESTON_ALLOC_SCOPE_BEGIN("output-repaint");
+	r = output->repaint(output, &frame->damage, repaint_data);
 
 	output->repaint_needed = false;
 	if (r == 0)
@@ -2791,12 +3336,7 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 
 	weston_compositor_repick(ec);
 
-	frame_time_msec = timespec_to_msec(&output->frame_time);
-
-	wl_list_for_each_safe(cb, cnext, &frame_callback_list, link) {
-		wl_callback_send_done(cb->resource, frame_time_msec);
-		wl_resource_destroy(cb->resource);
-	}
+	weston_output_repaint_done(frame);
 
 	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
 		animation->frame_counter++;
@@ -2804,10 +3344,26 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	}
 
 	TL_POINT(ec, "core_repaint_posted", TLP_OUTPUT(output), TLP_END);
+	if (r == 0)
+		weston_output_metrics_repaint_posted(output);
+	WESTON_ALLOC_SCOPE_END();
 
 	return r;
 }
 
+static int
+weston_output_repaint(struct weston_output *output, void *repaint_data)
+{
+	struct weston_output_repaint_frame frame;
+
+	if (output->destroying)
+		return 0;
+
+	weston_output_repaint_prepare(output, repaint_data, &frame);
+
+	return weston_output_repaint_finish(&frame, repaint_data);
+}
+
 static void
 weston_output_schedule_repaint_reset(struct weston_output *output)
 {
@@ -2816,21 +3372,20 @@ weston_output_schedule_repaint_reset(struct weston_output *output)
 		 TLP_OUTPUT(output), TLP_END);
 }
 
-static int
-weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
-			    void *repaint_data)
+static bool
+weston_output_repaint_is_due(struct weston_output *output,
+			     const struct timespec *now)
 {
 	struct weston_compositor *compositor = output->compositor;
-	int ret = 0;
 	int64_t msec_to_repaint;
 
 	/* We're not ready yet; come back to make a decision later. */
 	if (output->repaint_status != REPAINT_SCHEDULED)
-		return ret;
+		return false;
 
 	msec_to_repaint = timespec_sub_to_msec(&output->next_repaint, now);
 	if (msec_to_repaint > 1)
-		return ret;
+		return false;
 
 	/* If we're sleeping, drop the repaint machinery entirely; we will
 	 * explicitly repaint all outputs when we come back. */
@@ -2843,6 +3398,23 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 	if (!output->repaint_needed)
 		goto err;
 
+	return true;
+
+err:
+	weston_output_schedule_repaint_reset(output);
+	return false;
+}
+
+static int
+weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
+			    void *repaint_data)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int ret = 0;
+
+	if (!weston_output_repaint_is_due(output, now))
+		return ret;
+
 	/* If repaint fails, we aren't going to get weston_output_finish_frame
 	 * to trigger a new repaint, so drop it from repaint and hope
 	 * something schedules a successful repaint later. As repainting may
@@ -2850,14 +3422,235 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 	 * output. */
 	ret = weston_output_repaint(output, repaint_data);
 	weston_compositor_read_presentation_clock(compositor, now);
-	if (ret != 0)
-		goto err;
+	if (ret != 0) {
+		weston_output_schedule_repaint_reset(output);
+		return ret;
+	}
 
 	output->repainted = true;
 	return ret;
+}
+
+/* Worker threads for parallel repaint, see
+ * weston_compositor_set_parallel_repaint().
+ *
+ * The scene graph pass of all due outputs is done on the display loop
+ * first. Then the renderer work of those outputs which have a
+ * repaint_render hook is spread over the workers, and the display loop
+ * thread takes its share too. Once all of them are rendered, posting
+ * the frames goes on serially on the display loop as before.
+ */
+struct weston_repaint_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond; /* signaled when frames are queued or exiting */
+	pthread_cond_t done_cond; /* signaled when all queued frames are rendered */
+	struct weston_output_repaint_frame **queue;
+	int queue_length;
+	int queue_next;
+	int outstanding;
+	bool exit;
+	int num_threads;
+	pthread_t *threads;
+};
+
+/* Called with pool->mutex held, returns with it held. */
+static bool
+weston_repaint_pool_render_next(struct weston_repaint_pool *pool)
+{
+	struct weston_output_repaint_frame *frame;
+
+	if (pool->queue_next >= pool->queue_length)
+		return false;
+
+	frame = pool->queue[pool->queue_next++];
+	pthread_mutex_unlock(&pool->mutex);
+
+	frame->rendered = frame->output->repaint_render(frame->output,
+							&frame->damage);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (--pool->outstanding == 0)
+		pthread_cond_broadcast(&pool->done_cond);
+
+	return true;
+}
+
+static void *
+weston_repaint_pool_thread(void *arg)
+{
+	struct weston_repaint_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->exit) {
+		if (!weston_repaint_pool_render_next(pool))
+			pthread_cond_wait(&pool->queue_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+weston_repaint_pool_render(struct weston_repaint_pool *pool,
+			   struct weston_output_repaint_frame **queue,
+			   int length)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->queue = queue;
+	pool->queue_length = length;
+	pool->queue_next = 0;
+	pool->outstanding = length;
+	pthread_cond_broadcast(&pool->queue_cond);
+
+	while (weston_repaint_pool_render_next(pool))
+		;
+
+	while (pool->outstanding > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->queue = NULL;
+	pool->queue_length = 0;
+	pool->queue_next = 0;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+weston_repaint_pool_destroy(struct weston_repaint_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->exit = true;
+	pthread_cond_broadcast(&pool->queue_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->queue_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+static struct weston_repaint_pool *
+weston_repaint_pool_create(int num_threads)
+{
+	struct weston_repaint_pool *pool;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = zalloc(num_threads * sizeof pool->threads[0]);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->queue_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (pool->num_threads = 0; pool->num_threads < num_threads;
+	     pool->num_threads++) {
+		if (pthread_create(&pool->threads[pool->num_threads], NULL,
+				   weston_repaint_pool_thread, pool) != 0) {
+			weston_repaint_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+/* Parallel counterpart of the weston_output_maybe_repaint() loop. */
+static int
+weston_compositor_repaint_outputs_parallel(struct weston_compositor *compositor,
+					   struct timespec *now,
+					   void *repaint_data)
+{
+	struct weston_output *output;
+	struct weston_output_repaint_frame *frames;
+	struct weston_output_repaint_frame **queue;
+	int num_outputs, num_frames = 0, num_queued = 0;
+	int i, r, ret = 0;
+
+	num_outputs = wl_list_length(&compositor->output_list);
+	frames = zalloc(num_outputs * sizeof frames[0]);
+	queue = zalloc(num_outputs * sizeof queue[0]);
+	if (!frames || !queue) {
+		free(frames);
+		free(queue);
+		wl_list_for_each(output, &compositor->output_list, link) {
+			ret = weston_output_maybe_repaint(output, now,
+							  repaint_data);
+			if (ret)
+				break;
+		}
+		return ret;
+	}
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (!weston_output_repaint_is_due(output, now) ||
+		    output->destroying)
+			continue;
+
+		weston_output_repaint_prepare(output, repaint_data,
+					      &frames[num_frames]);
+		if (output->repaint_render) {
+			output->repaint_offloaded = true;
+			queue[num_queued++] = &frames[num_frames];
+		}
+		num_frames++;
+	}
+
+	if (num_queued > 0) {
+		TL_POINT(compositor, "core_repaint_render_begin", TLP_END);
+		weston_repaint_pool_render(compositor->repaint_pool,
+					   queue, num_queued);
+		TL_POINT(compositor, "core_repaint_render_end", TLP_END);
+	}
+
+	for (i = 0; i < num_frames; i++) {
+		output = frames[i].output;
+
+		/* Renderers leave the frame signal to us when offloaded,
+		 * listeners expect to be called on the display loop. If
+		 * nothing was rendered, repaint() renders as usual. */
+		if (frames[i].rendered)
+			wl_signal_emit(&output->frame_signal,
+				       &frames[i].damage);
+		else
+			output->repaint_offloaded = false;
+
+		/* Like the serial loop, stop posting at the first failure.
+		 * The rest is dropped from repaint, but their clients still
+		 * get their frame callbacks. */
+		if (ret != 0) {
+			output->repaint_offloaded = false;
+			weston_output_schedule_repaint_reset(output);
+			weston_output_repaint_done(&frames[i]);
+			continue;
+		}
+
+		r = weston_output_repaint_finish(&frames[i], repaint_data);
+		output->repaint_offloaded = false;
+		if (r != 0) {
+			weston_output_schedule_repaint_reset(output);
+			ret = r;
+			continue;
+		}
+
+		output->repainted = true;
+	}
+
+	weston_compositor_read_presentation_clock(compositor, now);
+
+	free(queue);
+	free(frames);
 
-err:
-	weston_output_schedule_repaint_reset(output);
 	return ret;
 }
 
@@ -2920,10 +3713,17 @@ output_repaint_timer_handler(void *data)
 	if (compositor->backend->repaint_begin)
 		repaint_data = compositor->backend->repaint_begin(compositor);
 
-	wl_list_for_each(output, &compositor->output_list, link) {
-		ret = weston_output_maybe_repaint(output, &now, repaint_data);
-		if (ret)
-			break;
+	if (compositor->repaint_pool) {
+		ret = weston_compositor_repaint_outputs_parallel(compositor,
+								 &now,
+								 repaint_data);
+	} else {
+		wl_list_for_each(output, &compositor->output_list, link) {
+			ret = weston_output_maybe_repaint(output, &now,
+							  repaint_data);
+			if (ret)
+				break;
+		}
 	}
 
 	if (ret == 0) {
@@ -3017,6 +3817,8 @@ weston_output_finish_frame(struct weston_output *output,
 							 CLOCK_MONOTONIC);
 	TL_POINT(compositor, "core_repaint_finished", TLP_OUTPUT(output),
 		 TLP_VBLANK(&vblank_monotonic), TLP_END);
+	weston_output_metrics_presented(output, &vblank_monotonic,
+					presented_flags);
 
 	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
 	weston_presentation_feedback_present_list(&output->feedback_list,
@@ -3026,9 +3828,18 @@ weston_output_finish_frame(struct weston_output *output,
 
 	output->frame_time = *stamp;
 
+	if (output->unpaced_repaint) {
+		output->next_repaint = now;
+		goto out;
+	}
+
 	timespec_add_nsec(&output->next_repaint, stamp, refresh_nsec);
-	timespec_add_msec(&output->next_repaint, &output->next_repaint,
-			  -compositor->repaint_msec);
+	if (output->repaint_window_nsec > 0)
+		timespec_add_nsec(&output->next_repaint, &output->next_repaint,
+				  -output->repaint_window_nsec);
+	else
+		timespec_add_msec(&output->next_repaint, &output->next_repaint,
+				  -compositor->repaint_msec);
 	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
 
 	if (msec_rel < -1000 || msec_rel > 1000) {
@@ -3090,11 +3901,14 @@ weston_layer_entry_insert(struct weston_layer_entry *list,
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	entry->layer->compositor->view_list_dirty = true;
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		entry->layer->compositor->view_list_dirty = true;
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -3132,6 +3946,7 @@ weston_layer_set_position(struct weston_layer *layer,
 	struct weston_layer *below;
 
 	wl_list_remove(&layer->link);
+	layer->compositor->view_list_dirty = true;
 
 	/* layer_list is ordered from top to bottom, the last layer being the
 	 * background with the smallest position value */
@@ -3156,6 +3971,7 @@ weston_layer_unset_position(struct weston_layer *layer)
 {
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
+	layer->compositor->view_list_dirty = true;
 }
 
 WL_EXPORT void
@@ -3198,6 +4014,22 @@ weston_layer_mask_is_infinite(struct weston_layer *layer)
 	       layer->mask.y2 == INT32_MAX;
 }
 
+/** Hints that the views of the layer rarely change
+ *
+ * \param layer The layer.
+ * \param is_static Whether the content of the layer is mostly static.
+ *
+ * Renderers may keep static layers at the bottom of the scene composited
+ * into a single image, so that damage over them is repainted from that
+ * image instead of from each of their views. This is only a hint, any
+ * change of the views is still repainted.
+ */
+WL_EXPORT void
+weston_layer_set_static(struct weston_layer *layer, bool is_static)
+{
+	layer->is_static = is_static;
+}
+
 /**
  * \ingroup output
  */
@@ -3274,6 +4106,83 @@ surface_attach(struct wl_client *client,
 	surface->pending.newly_attached = 1;
 }
 
+/* Pending damage rectangles are folded into the region at this count, so
+ * damage requests without a commit can't grow the array without bound. */
+#define DAMAGE_RECTS_FOLD 256
+
+static void
+damage_rects_flush(pixman_region32_t *region, struct wl_array *rects,
+		   int max_rects)
+{
+	pixman_box32_t *box, extents;
+	pixman_region32_t damage;
+	int n = rects->size / sizeof *box;
+
+	if (n == 0)
+		return;
+
+	if (max_rects > 0 && n + pixman_region32_n_rects(region) > max_rects) {
+		/* More rectangles than the cap, damage their extents */
+		extents = *pixman_region32_extents(region);
+		if (!pixman_region32_not_empty(region))
+			extents = *(pixman_box32_t *)rects->data;
+		wl_array_for_each(box, rects) {
+			extents.x1 = MIN(extents.x1, box->x1);
+			extents.y1 = MIN(extents.y1, box->y1);
+			extents.x2 = MAX(extents.x2, box->x2);
+			extents.y2 = MAX(extents.y2, box->y2);
+		}
+		pixman_region32_fini(region);
+		pixman_region32_init_with_extents(region, &extents);
+	} else {
+		pixman_region32_init_rects(&damage, rects->data, n);
+		pixman_region32_union(region, region, &damage);
+		pixman_region32_fini(&damage);
+	}
+
+	rects->size = 0;
+}
+
+/* Damage rectangles are collected in an array and added to the region once
+ * per commit, instead of reallocating the region on every request. */
+static void
+damage_rects_add(struct weston_surface *surface, struct wl_resource *resource,
+		 pixman_region32_t *region, struct wl_array *rects,
+		 int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	pixman_box32_t *box;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	if (rects->size / sizeof *box >= DAMAGE_RECTS_FOLD)
+		damage_rects_flush(region, rects,
+				   surface->compositor->surface_damage_max_rects);
+
+	box = wl_array_add(rects, sizeof *box);
+	if (!box) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	box->x1 = x;
+	box->y1 = y;
+	box->x2 = MIN((int64_t)x + width, INT32_MAX);
+	box->y2 = MIN((int64_t)y + height, INT32_MAX);
+}
+
+static void
+weston_surface_state_flush_damage(struct weston_surface *surface,
+				  struct weston_surface_state *state)
+{
+	int max_rects = surface->compositor->surface_damage_max_rects;
+
+	damage_rects_flush(&state->damage_surface,
+			   &state->damage_surface_rects, max_rects);
+	damage_rects_flush(&state->damage_buffer,
+			   &state->damage_buffer_rects, max_rects);
+}
+
 static void
 surface_damage(struct wl_client *client,
 	       struct wl_resource *resource,
@@ -3281,12 +4190,9 @@ surface_damage(struct wl_client *client,
 {
 	struct weston_surface *surface = wl_resource_get_user_data(resource);
 
-	if (width <= 0 || height <= 0)
-		return;
-
-	pixman_region32_union_rect(&surface->pending.damage_surface,
-				   &surface->pending.damage_surface,
-				   x, y, width, height);
+	damage_rects_add(surface, resource, &surface->pending.damage_surface,
+			 &surface->pending.damage_surface_rects,
+			 x, y, width, height);
 }
 
 static void
@@ -3296,12 +4202,9 @@ surface_damage_buffer(struct wl_client *client,
 {
 	struct weston_surface *surface = wl_resource_get_user_data(resource);
 
-	if (width <= 0 || height <= 0)
-		return;
-
-	pixman_region32_union_rect(&surface->pending.damage_buffer,
-				   &surface->pending.damage_buffer,
-				   x, y, width, height);
+	damage_rects_add(surface, resource, &surface->pending.damage_buffer,
+			 &surface->pending.damage_buffer_rects,
+			 x, y, width, height);
 }
 
 static void
@@ -3320,7 +4223,7 @@ surface_frame(struct wl_client *client,
 	struct weston_frame_callback *cb;
 	struct weston_surface *surface = wl_resource_get_user_data(resource);
 
-	cb = malloc(sizeof *cb);
+	cb = zalloc(sizeof *cb);
 	if (cb == NULL) {
 		wl_resource_post_no_memory(resource);
 		return;
@@ -3397,6 +4300,18 @@ static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
+	struct wl_list *current = surface->subsurface_list.next;
+
+	/* Both lists hold the same sub-surfaces, only look for a change
+	 * of order. */
+	wl_list_for_each(sub, &surface->subsurface_list_pending,
+			 parent_link_pending) {
+		if (current != &sub->parent_link) {
+			surface->compositor->view_list_dirty = true;
+			break;
+		}
+		current = current->next;
+	}
 
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
@@ -3637,6 +4552,12 @@ weston_surface_commit_state(struct weston_surface *surface,
 {
 	struct weston_view *view;
 	pixman_region32_t opaque;
+	pixman_region32_t damage;
+	pixman_box32_t *boxes;
+	uint64_t damage_area = 0;
+	int i, n;
+
+	weston_surface_state_flush_damage(surface, state);
 
 	/* wl_surface.set_buffer_transform */
 	/* wl_surface.set_buffer_scale */
@@ -3679,10 +4600,20 @@ weston_surface_commit_state(struct weston_surface *surface,
 	     pixman_region32_not_empty(&state->damage_buffer))
 		TL_POINT(surface->compositor, "core_commit_damage", TLP_SURFACE(surface), TLP_END);
 
-	pixman_region32_union(&surface->damage, &surface->damage,
-			      &state->damage_surface);
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, &state->damage_surface);
+	apply_damage_buffer(&damage, surface, state);
+	pixman_region32_intersect_rect(&damage, &damage,
+				       0, 0, surface->width, surface->height);
 
-	apply_damage_buffer(&surface->damage, surface, state);
+	boxes = pixman_region32_rectangles(&damage, &n);
+	for (i = 0; i < n; i++)
+		damage_area += (uint64_t)(boxes[i].x2 - boxes[i].x1) *
+			       (boxes[i].y2 - boxes[i].y1);
+	weston_surface_client_stats_commit(surface, damage_area);
+
+	pixman_region32_union(&surface->damage, &surface->damage, &damage);
+	pixman_region32_fini(&damage);
 
 	pixman_region32_intersect_rect(&surface->damage, &surface->damage,
 				       0, 0, surface->width, surface->height);
@@ -3748,6 +4679,171 @@ static void
 weston_subsurface_parent_commit(struct weston_subsurface *sub,
 				int parent_is_synchronized);
 
+/* Accumulate the pending state of the surface on top of dst, as if both
+ * had been committed in order, and reset the pending state. */
+static void
+weston_surface_state_merge_pending(struct weston_surface *surface,
+				   struct weston_surface_state *dst)
+{
+	/*
+	 * If this commit would cause the surface to move by the
+	 * attach(dx, dy) parameters, the old damage region must be
+	 * translated to correspond to the new surface coordinate system
+	 * origin.
+	 */
+	weston_surface_state_flush_damage(surface, &surface->pending);
+	pixman_region32_translate(&dst->damage_surface,
+				  -surface->pending.sx, -surface->pending.sy);
+	pixman_region32_union(&dst->damage_surface,
+			      &dst->damage_surface,
+			      &surface->pending.damage_surface);
+	pixman_region32_clear(&surface->pending.damage_surface);
+
+	if (surface->pending.newly_attached) {
+		dst->newly_attached = 1;
+		weston_surface_state_set_buffer(dst, surface->pending.buffer);
+		weston_presentation_feedback_discard_list(&dst->feedback_list);
+		/* zwp_surface_synchronization_v1.set_acquire_fence */
+		fd_move(&dst->acquire_fence_fd,
+			&surface->pending.acquire_fence_fd);
+		/* zwp_surface_synchronization_v1.get_release */
+		weston_buffer_release_move(&dst->buffer_release_ref,
+					   &surface->pending.buffer_release_ref);
+	}
+	dst->desired_protection = surface->pending.desired_protection;
+	dst->protection_mode = surface->pending.protection_mode;
+	assert(surface->pending.acquire_fence_fd == -1);
+	assert(surface->pending.buffer_release_ref.buffer_release == NULL);
+	dst->sx += surface->pending.sx;
+	dst->sy += surface->pending.sy;
+
+	apply_damage_buffer(&dst->damage_surface, surface, &surface->pending);
+
+	dst->buffer_viewport.changed |=
+		surface->pending.buffer_viewport.changed;
+	dst->buffer_viewport.buffer =
+		surface->pending.buffer_viewport.buffer;
+	dst->buffer_viewport.surface =
+		surface->pending.buffer_viewport.surface;
+
+	weston_surface_reset_pending_buffer(surface);
+
+	pixman_region32_copy(&dst->opaque, &surface->pending.opaque);
+
+	pixman_region32_copy(&dst->input, &surface->pending.input);
+
+	wl_list_insert_list(&dst->frame_callback_list,
+			    &surface->pending.frame_callback_list);
+	wl_list_init(&surface->pending.frame_callback_list);
+
+	wl_list_insert_list(&dst->feedback_list,
+			    &surface->pending.feedback_list);
+	wl_list_init(&surface->pending.feedback_list);
+}
+
+static bool
+fence_is_signaled(int fence_fd)
+{
+	struct pollfd pfd = {
+		.fd = fence_fd,
+		.events = POLLIN,
+	};
+
+	/* errors count as signaled, so a bad fence can't hold the surface
+	 * back forever; the renderer deals with it as before */
+	return poll(&pfd, 1, 0) != 0;
+}
+
+static void
+weston_surface_apply_deferred_commit(struct weston_surface *surface)
+{
+	struct weston_subsurface *sub;
+
+	if (surface->deferred.fence_source) {
+		wl_event_source_remove(surface->deferred.fence_source);
+		surface->deferred.fence_source = NULL;
+	}
+
+	weston_surface_commit_state(surface, &surface->deferred.state);
+	weston_buffer_reference(&surface->deferred.buffer_ref, NULL);
+	surface->deferred.has_data = false;
+
+	weston_surface_commit_subsurface_order(surface);
+
+	weston_surface_schedule_repaint(surface);
+
+	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+		if (sub->surface != surface)
+			weston_subsurface_parent_commit(sub, 0);
+	}
+}
+
+static int
+deferred_commit_fence_handler(int fd, uint32_t mask, void *data)
+{
+	struct weston_surface *surface = data;
+
+	TL_POINT(surface->compositor, "core_commit_fence_signaled",
+		 TLP_SURFACE(surface), TLP_END);
+
+	weston_surface_apply_deferred_commit(surface);
+
+	return 0;
+}
+
+/* Returns true if the pending state was taken over, either held back
+ * until its acquire fence signals or applied together with an earlier
+ * held back commit. Only surfaces without sub-surfaces are deferred, as
+ * their children would otherwise be committed before them. */
+static bool
+weston_surface_defer_commit(struct weston_surface *surface)
+{
+	struct weston_compositor *compositor = surface->compositor;
+	struct wl_event_loop *loop;
+	int fence_fd;
+
+	if (!surface->deferred.has_data) {
+		if (!compositor->defer_fenced_commits ||
+		    !surface->pending.newly_attached ||
+		    surface->pending.acquire_fence_fd < 0 ||
+		    !wl_list_empty(&surface->subsurface_list) ||
+		    fence_is_signaled(surface->pending.acquire_fence_fd))
+			return false;
+	}
+
+	/* Later commits queue behind a deferred one to keep their order */
+	if (surface->pending.newly_attached)
+		weston_buffer_reference(&surface->deferred.buffer_ref,
+					surface->pending.buffer);
+	weston_surface_state_merge_pending(surface, &surface->deferred.state);
+	surface->deferred.has_data = true;
+
+	if (surface->deferred.fence_source) {
+		wl_event_source_remove(surface->deferred.fence_source);
+		surface->deferred.fence_source = NULL;
+	}
+
+	fence_fd = surface->deferred.state.acquire_fence_fd;
+	if (fence_fd < 0 || fence_is_signaled(fence_fd)) {
+		weston_surface_apply_deferred_commit(surface);
+		return true;
+	}
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	surface->deferred.fence_source =
+		wl_event_loop_add_fd(loop, fence_fd, WL_EVENT_READABLE,
+				     deferred_commit_fence_handler, surface);
+	if (!surface->deferred.fence_source) {
+		weston_surface_apply_deferred_commit(surface);
+		return true;
+	}
+
+	TL_POINT(compositor, "core_commit_deferred", TLP_SURFACE(surface),
+		 TLP_END);
+
+	return true;
+}
+
 static void
 surface_commit(struct wl_client *client, struct wl_resource *resource)
 {
@@ -3819,6 +4915,9 @@ surface_commit(struct wl_client *client, struct wl_resource *resource)
 		return;
 	}
 
+	if (weston_surface_defer_commit(surface))
+		return;
+
 	weston_surface_commit(surface);
 
 	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
@@ -3979,6 +5078,39 @@ static const struct wl_compositor_interface compositor_interface = {
 	compositor_create_region
 };
 
+/* Mark the branch from this sub-surface up to the main surface as having
+ * state a parent commit must apply. An already dirty sub-surface has dirty
+ * ancestors too. */
+static void
+weston_subsurface_mark_branch_dirty(struct weston_subsurface *sub)
+{
+	while (sub && !sub->branch_dirty) {
+		sub->branch_dirty = true;
+
+		if (!sub->parent)
+			break;
+
+		sub = weston_surface_to_subsurface(sub->parent);
+	}
+}
+
+static void
+weston_subsurface_update_branch_dirty(struct weston_subsurface *sub)
+{
+	struct weston_subsurface *child;
+
+	sub->branch_dirty = sub->has_cached_data || sub->position.set;
+	if (sub->branch_dirty)
+		return;
+
+	wl_list_for_each(child, &sub->surface->subsurface_list, parent_link) {
+		if (child->surface != sub->surface && child->branch_dirty) {
+			sub->branch_dirty = true;
+			return;
+		}
+	}
+}
+
 static void
 weston_subsurface_commit_from_cache(struct weston_subsurface *sub)
 {
@@ -3999,65 +5131,14 @@ weston_subsurface_commit_to_cache(struct weston_subsurface *sub)
 {
 	struct weston_surface *surface = sub->surface;
 
-	/*
-	 * If this commit would cause the surface to move by the
-	 * attach(dx, dy) parameters, the old damage region must be
-	 * translated to correspond to the new surface coordinate system
-	 * origin.
-	 */
-	pixman_region32_translate(&sub->cached.damage_surface,
-				  -surface->pending.sx, -surface->pending.sy);
-	pixman_region32_union(&sub->cached.damage_surface,
-			      &sub->cached.damage_surface,
-			      &surface->pending.damage_surface);
-	pixman_region32_clear(&surface->pending.damage_surface);
-
-	if (surface->pending.newly_attached) {
-		sub->cached.newly_attached = 1;
-		weston_surface_state_set_buffer(&sub->cached,
-						surface->pending.buffer);
+	if (surface->pending.newly_attached)
 		weston_buffer_reference(&sub->cached_buffer_ref,
 					surface->pending.buffer);
-		weston_presentation_feedback_discard_list(
-					&sub->cached.feedback_list);
-		/* zwp_surface_synchronization_v1.set_acquire_fence */
-		fd_move(&sub->cached.acquire_fence_fd,
-			&surface->pending.acquire_fence_fd);
-		/* zwp_surface_synchronization_v1.get_release */
-		weston_buffer_release_move(&sub->cached.buffer_release_ref,
-					   &surface->pending.buffer_release_ref);
-	}
-	sub->cached.desired_protection = surface->pending.desired_protection;
-	sub->cached.protection_mode = surface->pending.protection_mode;
-	assert(surface->pending.acquire_fence_fd == -1);
-	assert(surface->pending.buffer_release_ref.buffer_release == NULL);
-	sub->cached.sx += surface->pending.sx;
-	sub->cached.sy += surface->pending.sy;
-
-	apply_damage_buffer(&sub->cached.damage_surface, surface, &surface->pending);
-
-	sub->cached.buffer_viewport.changed |=
-		surface->pending.buffer_viewport.changed;
-	sub->cached.buffer_viewport.buffer =
-		surface->pending.buffer_viewport.buffer;
-	sub->cached.buffer_viewport.surface =
-		surface->pending.buffer_viewport.surface;
-
-	weston_surface_reset_pending_buffer(surface);
-
-	pixman_region32_copy(&sub->cached.opaque, &surface->pending.opaque);
-
-	pixman_region32_copy(&sub->cached.input, &surface->pending.input);
-
-	wl_list_insert_list(&sub->cached.frame_callback_list,
-			    &surface->pending.frame_callback_list);
-	wl_list_init(&surface->pending.frame_callback_list);
 
-	wl_list_insert_list(&sub->cached.feedback_list,
-			    &surface->pending.feedback_list);
-	wl_list_init(&surface->pending.feedback_list);
+	weston_surface_state_merge_pending(surface, &sub->cached);
 
 	sub->has_cached_data = 1;
+	weston_subsurface_mark_branch_dirty(sub);
 }
 
 static bool
@@ -4098,6 +5179,8 @@ weston_subsurface_commit(struct weston_subsurface *sub)
 			if (tmp->surface != surface)
 				weston_subsurface_parent_commit(tmp, 0);
 		}
+
+		weston_subsurface_update_branch_dirty(sub);
 	}
 }
 
@@ -4120,6 +5203,8 @@ weston_subsurface_synchronized_commit(struct weston_subsurface *sub)
 		if (tmp->surface != surface)
 			weston_subsurface_parent_commit(tmp, 1);
 	}
+
+	weston_subsurface_update_branch_dirty(sub);
 }
 
 static void
@@ -4127,6 +5212,12 @@ weston_subsurface_parent_commit(struct weston_subsurface *sub,
 				int parent_is_synchronized)
 {
 	struct weston_view *view;
+
+	/* Nothing cached or positioned in this branch, a leaf change
+	 * elsewhere in the tree need not walk it. */
+	if (!sub->branch_dirty)
+		return;
+
 	if (sub->position.set) {
 		wl_list_for_each(view, &sub->surface->views, surface_link)
 			weston_view_set_position(view,
@@ -4138,6 +5229,8 @@ weston_subsurface_parent_commit(struct weston_subsurface *sub,
 
 	if (parent_is_synchronized || sub->synchronized)
 		weston_subsurface_synchronized_commit(sub);
+	else
+		weston_subsurface_update_branch_dirty(sub);
 }
 
 static int
@@ -4163,6 +5256,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		surface->compositor->view_list_dirty = true;
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -4338,6 +5432,9 @@ weston_surface_get_bounding_box(struct weston_surface *surface)
  * The rectangle defined by src_x, src_y, width, height must fit in
  * the surface contents. Otherwise an error is returned.
  *
+ * When target_width and target_height differ from the source size, the
+ * area is scaled to the target size with bilinear filtering.
+ *
  * Use weston_surface_get_content_size to determine the content size; the
  * needed target buffer size and rectangle limits.
  *
@@ -4355,7 +5452,7 @@ weston_surface_copy_content(struct weston_surface *surface,
 			    bool y_flip, bool is_argb)
 {
 	struct weston_renderer *rer = surface->compositor->renderer;
-	int cw, ch;
+	int cw, ch, ret;
 	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
 
 	if (!target_width)
@@ -4384,8 +5481,84 @@ weston_surface_copy_content(struct weston_surface *surface,
 	if (target_stride * target_height > size)
 		return -1;
 
-	return rer->surface_copy_content(surface, target, size, target_stride, target_width, target_height,
-					 src_x, src_y, src_width, src_height, y_flip, is_argb);
+	ret = rer->surface_copy_content(surface, target, size, target_stride, target_width, target_height,
+					src_x, src_y, src_width, src_height, y_flip, is_argb);
+	if (ret == 0)
+		weston_surface_client_stats_add(surface,
+						WESTON_CLIENT_STAT_READBACK_BYTES,
+						(uint64_t)target_stride *
+						target_height);
+
+	return ret;
+}
+
+struct read_pixels_idle {
+	weston_renderer_read_done_func_t done;
+	void *data;
+	int status;
+};
+
+static void
+read_pixels_idle_notify(void *data)
+{
+	struct read_pixels_idle *idle = data;
+
+	idle->done(idle->data, idle->status);
+	free(idle);
+}
+
+/** Read back output pixels without waiting for the GPU
+ *
+ * \param output The output to read from.
+ * \param format Pixel format of the result, as in read_pixels.
+ * \param pixels Destination, must stay valid until done is called.
+ * \param x,y,width,height Area to read, as in read_pixels.
+ * \param done Called from the event loop once pixels holds the result,
+ * with status 0 on success or -1 on failure, including destruction of
+ * the output before the read completed.
+ * \param data User data for done.
+ * \return 0 if done will be called, -1 on immediate failure in which
+ * case done is not called.
+ *
+ * The read is queued on the renderer, so it can overlap with rendering
+ * the next frame. done is never called before this function returns.
+ * Renderers without asynchronous read back fall back to a synchronous
+ * read with done deferred to an idle callback.
+ */
+WL_EXPORT int
+weston_renderer_read_pixels_async(struct weston_output *output,
+				  pixman_format_code_t format, void *pixels,
+				  uint32_t x, uint32_t y,
+				  uint32_t width, uint32_t height,
+				  weston_renderer_read_done_func_t done,
+				  void *data)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_renderer *rer = compositor->renderer;
+	struct wl_event_loop *loop;
+	struct read_pixels_idle *idle;
+
+	if (rer->read_pixels_async)
+		return rer->read_pixels_async(output, format, pixels,
+					      x, y, width, height,
+					      done, data);
+
+	idle = zalloc(sizeof *idle);
+	if (!idle)
+		return -1;
+
+	idle->done = done;
+	idle->data = data;
+	idle->status = rer->read_pixels(output, format, pixels,
+					x, y, width, height);
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	if (!wl_event_loop_add_idle(loop, read_pixels_idle_notify, idle)) {
+		free(idle);
+		return -1;
+	}
+
+	return 0;
 }
 
 static void
@@ -4400,6 +5573,7 @@ subsurface_set_position(struct wl_client *client,
 	sub->position.x = x;
 	sub->position.y = y;
 	sub->position.set = 1;
+	weston_subsurface_mark_branch_dirty(sub);
 }
 
 static struct weston_subsurface *
@@ -4512,6 +5686,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	sub->surface->compositor->view_list_dirty = true;
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -4578,6 +5753,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	parent->compositor->view_list_dirty = true;
 }
 
 static void
@@ -4620,6 +5796,7 @@ weston_subsurface_destroy(struct weston_subsurface *sub)
 	} else {
 		/* the dummy weston_subsurface for the parent itself */
 		assert(sub->parent_destroy_listener.notify == NULL);
+		sub->surface->compositor->view_list_dirty = true;
 		wl_list_remove(&sub->parent_link);
 		wl_list_remove(&sub->parent_link_pending);
 	}
@@ -4686,6 +5863,7 @@ weston_subsurface_create_for_parent(struct weston_surface *parent)
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	parent->compositor->view_list_dirty = true;
 
 	return sub;
 }
@@ -5886,29 +7064,16 @@ weston_compositor_reflow_outputs(struct weston_compositor *compositor,
 }
 
 static void
-weston_output_update_matrix(struct weston_output *output)
+weston_output_transform_matrix(struct weston_output *output,
+			       struct weston_matrix *matrix)
 {
-	float magnification;
-
-	weston_matrix_init(&output->matrix);
-	weston_matrix_translate(&output->matrix, -output->x, -output->y, 0);
-
-	if (output->zoom.active) {
-		magnification = 1 / (1 - output->zoom.spring_z.current);
-		weston_output_update_zoom(output);
-		weston_matrix_translate(&output->matrix, -output->zoom.trans_x,
-					-output->zoom.trans_y, 0);
-		weston_matrix_scale(&output->matrix, magnification,
-				    magnification, 1.0);
-	}
-
 	switch (output->transform) {
 	case WL_OUTPUT_TRANSFORM_FLIPPED:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		weston_matrix_translate(&output->matrix, -output->width, 0, 0);
-		weston_matrix_scale(&output->matrix, -1, 1, 1);
+		weston_matrix_translate(matrix, -output->width, 0, 0);
+		weston_matrix_scale(matrix, -1, 1, 1);
 		break;
 	}
 
@@ -5919,26 +7084,51 @@ weston_output_update_matrix(struct weston_output *output)
 		break;
 	case WL_OUTPUT_TRANSFORM_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		weston_matrix_translate(&output->matrix, -output->width, 0, 0);
-		weston_matrix_rotate_xy(&output->matrix, 0, -1);
+		weston_matrix_translate(matrix, -output->width, 0, 0);
+		weston_matrix_rotate_xy(matrix, 0, -1);
 		break;
 	case WL_OUTPUT_TRANSFORM_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		weston_matrix_translate(&output->matrix,
+		weston_matrix_translate(matrix,
 					-output->width, -output->height, 0);
-		weston_matrix_rotate_xy(&output->matrix, -1, 0);
+		weston_matrix_rotate_xy(matrix, -1, 0);
 		break;
 	case WL_OUTPUT_TRANSFORM_270:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		weston_matrix_translate(&output->matrix, 0, -output->height, 0);
-		weston_matrix_rotate_xy(&output->matrix, 0, 1);
+		weston_matrix_translate(matrix, 0, -output->height, 0);
+		weston_matrix_rotate_xy(matrix, 0, 1);
 		break;
 	}
 
 	if (output->current_scale != 1)
-		weston_matrix_scale(&output->matrix,
+		weston_matrix_scale(matrix,
 				    output->current_scale,
 				    output->current_scale, 1);
+}
+
+static void
+weston_output_update_matrix(struct weston_output *output)
+{
+	float magnification;
+
+	weston_matrix_init(&output->matrix);
+	weston_matrix_translate(&output->matrix, -output->x, -output->y, 0);
+
+	output->zoom.scene_matrix = output->matrix;
+	weston_output_transform_matrix(output, &output->zoom.scene_matrix);
+	weston_matrix_invert(&output->zoom.scene_inverse,
+			     &output->zoom.scene_matrix);
+
+	if (output->zoom.active) {
+		magnification = 1 / (1 - output->zoom.spring_z.current);
+		weston_output_update_zoom(output);
+		weston_matrix_translate(&output->matrix, -output->zoom.trans_x,
+					-output->zoom.trans_y, 0);
+		weston_matrix_scale(&output->matrix, magnification,
+				    magnification, 1.0);
+	}
+
+	weston_output_transform_matrix(output, &output->matrix);
 
 	output->dirty = 0;
 
@@ -6169,6 +7359,7 @@ weston_compositor_remove_output(struct weston_output *output)
 	}
 
 	weston_presentation_feedback_discard_list(&output->feedback_list);
+	weston_output_release_zoom(output);
 
 	weston_compositor_reflow_outputs(compositor, output, -output->width);
 
@@ -6209,6 +7400,72 @@ weston_output_set_scale(struct weston_output *output,
 	output->scale = scale;
 }
 
+/** Sets the preferred fractional scale for a given output.
+ *
+ * \param output The weston_output object that the scale is set for.
+ * \param scale  Scale clients should render at on the given output, or 0
+ *               to use the output's current integer scale.
+ *
+ * Clients supporting wp_fractional_scale_v1 render their surfaces on this
+ * output at this scale and size them with wp_viewport, so backends which
+ * present at a non-integer scale get buffers of the exact size. Unlike
+ * weston_output_set_scale(), this can be changed while the output is
+ * enabled.
+ *
+ * \ingroup output
+ */
+WL_EXPORT void
+weston_output_set_fractional_scale(struct weston_output *output,
+				   float scale)
+{
+	struct weston_view *view;
+
+	if (output->fractional_scale == scale)
+		return;
+
+	output->fractional_scale = scale;
+
+	wl_list_for_each(view, &output->compositor->view_list, link) {
+		if (view->surface->output == output)
+			weston_surface_send_preferred_scale(view->surface);
+	}
+}
+
+/** Sets a color transform applied by the renderer to an output
+ *
+ * \param output The weston_output object to set the color transform of.
+ * \param lut    A 3D lookup table of size * size * size RGB triplets, red
+ *               varying fastest, then green, then blue. NULL removes it.
+ * \param size   Number of grid points on each axis, at least 2.
+ *
+ * The lookup table maps sRGB content, as clients draw it, to the output's
+ * color space, and is interpolated between grid points. The renderer
+ * copies the table, so the caller may free it once this returns.
+ *
+ * \return 0 on success, -1 if the renderer can't transform colors.
+ *
+ * \ingroup output
+ */
+WL_EXPORT int
+weston_output_set_color_lut(struct weston_output *output,
+			    const uint16_t *lut, unsigned int size)
+{
+	struct weston_renderer *renderer = output->compositor->renderer;
+
+	if (lut && size < 2)
+		return -1;
+
+	if (!output->enabled || !renderer->output_set_color_lut)
+		return -1;
+
+	if (renderer->output_set_color_lut(output, lut, size) < 0)
+		return -1;
+
+	weston_output_damage(output);
+
+	return 0;
+}
+
 /** Sets the output transform for a given output.
  *
  * \param output    The weston_output object that the transform is set for.
@@ -6681,6 +7938,7 @@ weston_output_release(struct weston_output *output)
 	wl_list_for_each_safe(head, tmp, &output->head_list, output_link)
 		weston_head_detach(head);
 
+	weston_output_metrics_release(output);
 	free(output->name);
 }
 
@@ -7082,6 +8340,96 @@ bind_viewporter(struct wl_client *client,
 				       NULL, NULL);
 }
 
+#ifdef HAVE_FRACTIONAL_SCALE
+static void
+destroy_fractional_scale(struct wl_resource *resource)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(resource);
+
+	if (!surface)
+		return;
+
+	surface->fractional_scale_resource = NULL;
+	surface->fractional_scale_sent = 0;
+}
+
+static void
+fractional_scale_destroy(struct wl_client *client,
+			 struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct wp_fractional_scale_v1_interface fractional_scale_interface = {
+	fractional_scale_destroy,
+};
+
+static void
+fractional_scale_manager_destroy(struct wl_client *client,
+				 struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+fractional_scale_manager_get_fractional_scale(struct wl_client *client,
+					      struct wl_resource *manager,
+					      uint32_t id,
+					      struct wl_resource *surface_resource)
+{
+	int version = wl_resource_get_version(manager);
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct wl_resource *resource;
+
+	if (surface->fractional_scale_resource) {
+		wl_resource_post_error(manager,
+			WP_FRACTIONAL_SCALE_MANAGER_V1_ERROR_FRACTIONAL_SCALE_EXISTS,
+			"a fractional scale for that surface already exists");
+		return;
+	}
+
+	resource = wl_resource_create(client, &wp_fractional_scale_v1_interface,
+				      version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &fractional_scale_interface,
+				       surface, destroy_fractional_scale);
+
+	surface->fractional_scale_resource = resource;
+	surface->fractional_scale_sent = 0;
+	weston_surface_send_preferred_scale(surface);
+}
+
+static const struct wp_fractional_scale_manager_v1_interface fractional_scale_manager_interface = {
+	fractional_scale_manager_destroy,
+	fractional_scale_manager_get_fractional_scale
+};
+
+static void
+bind_fractional_scale_manager(struct wl_client *client,
+			      void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &wp_fractional_scale_manager_v1_interface,
+				      version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource,
+				       &fractional_scale_manager_interface,
+				       NULL, NULL);
+}
+#endif /* HAVE_FRACTIONAL_SCALE */
+
 static void
 destroy_presentation_feedback(struct wl_resource *feedback_resource)
 {
@@ -7500,6 +8848,13 @@ weston_compositor_create(struct wl_display *display,
 			      ec, bind_viewporter))
 		goto fail;
 
+#ifdef HAVE_FRACTIONAL_SCALE
+	if (!wl_global_create(ec->wl_display,
+			      &wp_fractional_scale_manager_v1_interface, 1,
+			      ec, bind_fractional_scale_manager))
+		goto fail;
+#endif
+
 	if (!wl_global_create(ec->wl_display, &zxdg_output_manager_v1_interface, 2,
 			      ec, bind_xdg_output_manager))
 		goto fail;
@@ -7512,6 +8867,12 @@ weston_compositor_create(struct wl_display *display,
 		goto fail;
 
 	wl_list_init(&ec->view_list);
+	ec->view_list_dirty = true;
+	ec->pick_index.dirty = true;
+	wl_array_init(&ec->pick_index.views);
+	wl_array_init(&ec->pick_index.edges);
+	wl_array_init(&ec->pick_index.strips);
+	wl_array_init(&ec->pick_index.entries);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -7526,6 +8887,9 @@ weston_compositor_create(struct wl_display *display,
 	wl_list_init(&ec->debug_binding_list);
 
 	wl_list_init(&ec->plugin_api_list);
+	wl_list_init(&ec->throttled_surface_list);
+	wl_list_init(&ec->cursor_image_list);
+	wl_list_init(&ec->keymap_cache_list);
 
 	weston_plane_init(&ec->primary_plane, ec, 0, 0);
 	weston_compositor_stack_plane(ec, &ec->primary_plane, NULL);
@@ -7559,6 +8923,24 @@ weston_compositor_create(struct wl_display *display,
 						weston_timeline_create_subscription,
 						weston_timeline_destroy_subscription,
 						ec);
+
+	ec->timeline_binary =
+		weston_compositor_add_log_scope(ec, "timeline-binary",
+						"Timeline event points, binary format\n",
+						weston_timeline_binary_create_subscription,
+						weston_timeline_destroy_subscription,
+						ec);
+
+	ec->debug_output_metrics =
+		weston_compositor_add_log_scope(ec, "output-metrics",
+						"Frame time and latency histograms of outputs\n",
+						weston_output_metrics_debug_cb,
+						NULL, ec);
+	weston_compositor_memory_report_init(ec);
+	weston_compositor_client_stats_init(ec);
+#ifdef WESTON_ALLOC_PROFILE
+	weston_alloc_profile_init(ec);
+#endif
 	return ec;
 
 fail:
@@ -7628,6 +9010,42 @@ weston_compositor_set_default_pointer_grab(struct weston_compositor *ec,
 	}
 }
 
+/** Enable or disable parallel repaint of outputs
+ *
+ * \param compositor The compositor instance.
+ * \param num_threads Number of threads to render outputs with, counting
+ * the display loop thread. 0 or 1 disables parallel repaint.
+ * \return 0 on success, -1 if the worker threads could not be started,
+ * in which case parallel repaint is left disabled.
+ *
+ * When enabled, the renderer work of all outputs due in one repaint cycle
+ * runs concurrently once the scene graph pass for them is done, and only
+ * then the frames are posted. It only applies to outputs whose backend
+ * implements weston_output::repaint_render, and requires the renderer to
+ * be safe to use from several threads for different outputs; other
+ * outputs are rendered in weston_output::repaint as usual.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT int
+weston_compositor_set_parallel_repaint(struct weston_compositor *compositor,
+				       int num_threads)
+{
+	if (compositor->repaint_pool) {
+		weston_repaint_pool_destroy(compositor->repaint_pool);
+		compositor->repaint_pool = NULL;
+	}
+
+	if (num_threads <= 1)
+		return 0;
+
+	compositor->repaint_pool = weston_repaint_pool_create(num_threads - 1);
+	if (!compositor->repaint_pool)
+		return -1;
+
+	return 0;
+}
+
 /** weston_compositor_set_presentation_clock
  * \ingroup compositor
  */
@@ -7920,15 +9338,41 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 
 	weston_plugin_api_destroy_list(compositor);
 
+	weston_dmabuf_feedback_destroy(compositor->default_dmabuf_feedback);
+	compositor->default_dmabuf_feedback = NULL;
+	weston_dmabuf_feedback_format_table_destroy(compositor->dmabuf_feedback_format_table);
+	compositor->dmabuf_feedback_format_table = NULL;
+
 	if (compositor->heads_changed_source)
 		wl_event_source_remove(compositor->heads_changed_source);
 
+	if (compositor->throttle_timer)
+		wl_event_source_remove(compositor->throttle_timer);
+
 	weston_log_scope_destroy(compositor->debug_scene);
 	compositor->debug_scene = NULL;
 
 	weston_log_scope_destroy(compositor->timeline);
 	compositor->timeline = NULL;
 
+	weston_log_scope_destroy(compositor->timeline_binary);
+	compositor->timeline_binary = NULL;
+
+	weston_log_scope_destroy(compositor->debug_output_metrics);
+	compositor->debug_output_metrics = NULL;
+	weston_compositor_metrics_destroy(compositor);
+	weston_compositor_memory_report_destroy(compositor);
+	weston_compositor_client_stats_destroy(compositor);
+	weston_compositor_cursor_cache_destroy(compositor);
+
+	wl_array_release(&compositor->pick_index.views);
+	wl_array_release(&compositor->pick_index.edges);
+	wl_array_release(&compositor->pick_index.strips);
+	wl_array_release(&compositor->pick_index.entries);
+
+	if (compositor->repaint_pool)
+		weston_repaint_pool_destroy(compositor->repaint_pool);
+
 	free(compositor);
 }
 
@@ -0,0 +1,193 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libweston/libweston.h>
+#include "libweston-internal.h"
+#include "shared/helpers.h"
+
+/* Cursors are small and few; this keeps a full theme at two sizes plus
+ * the shapes the clients currently use. */
+#define CURSOR_CACHE_MAX_IMAGES 128
+#define CURSOR_CACHE_MAX_BYTES (8 * 1024 * 1024)
+
+static size_t
+cursor_image_bytes(const struct weston_cursor_image *image)
+{
+	return (size_t) image->width * image->height * 4;
+}
+
+static void
+cursor_image_destroy(struct weston_compositor *compositor,
+		     struct weston_cursor_image *image)
+{
+	compositor->cursor_image_count--;
+	compositor->cursor_image_bytes -= cursor_image_bytes(image);
+	wl_list_remove(&image->link);
+	free(image->name);
+	free(image->pixels);
+	free(image);
+}
+
+static const struct weston_cursor_image *
+cursor_image_use(struct weston_compositor *compositor,
+		 struct weston_cursor_image *image)
+{
+	/* Most recently used first, the tail is evicted first. */
+	wl_list_remove(&image->link);
+	wl_list_insert(&compositor->cursor_image_list, &image->link);
+
+	return image;
+}
+
+/** Find a cursor theme image in the compositor's cursor cache
+ *
+ * \param compositor The compositor.
+ * \param name The cursor name, qualified by the theme it came from.
+ * \param size The nominal cursor size it was loaded at.
+ * \return The image, or NULL if it is not cached. It stays valid until
+ * the next weston_compositor_add_cursor_image() call.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT const struct weston_cursor_image *
+weston_compositor_find_cursor_image(struct weston_compositor *compositor,
+				    const char *name, int size)
+{
+	struct weston_cursor_image *image;
+
+	wl_list_for_each(image, &compositor->cursor_image_list, link) {
+		if (image->name && image->size == size &&
+		    strcmp(image->name, name) == 0)
+			return cursor_image_use(compositor, image);
+	}
+
+	return NULL;
+}
+
+/** Find a cursor image by content hash in the compositor's cursor cache
+ *
+ * \param compositor The compositor.
+ * \param key The content hash the image was added with.
+ * \return The image, or NULL if it is not cached. It stays valid until
+ * the next weston_compositor_add_cursor_image() call.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT const struct weston_cursor_image *
+weston_compositor_find_cursor_image_by_key(struct weston_compositor *compositor,
+					   uint64_t key)
+{
+	struct weston_cursor_image *image;
+
+	wl_list_for_each(image, &compositor->cursor_image_list, link) {
+		if (!image->name && image->key == key)
+			return cursor_image_use(compositor, image);
+	}
+
+	return NULL;
+}
+
+/** Add a cursor image to the compositor's cursor cache
+ *
+ * \param compositor The compositor.
+ * \param name The cursor name qualified by its theme, or NULL for an
+ * image only looked up by \c key.
+ * \param size The nominal size of a named cursor, ignored otherwise.
+ * \param key The content hash of an unnamed cursor, ignored otherwise.
+ * The hash must cover everything the producer derived the pixels from.
+ * \param width The image width.
+ * \param height The image height.
+ * \param hotspot_x The hotspot x coordinate.
+ * \param hotspot_y The hotspot y coordinate.
+ * \param pixels ARGB8888 pixels with a stride of \c width * 4, copied.
+ * \return The cached image, or NULL on failure. Least recently used
+ * images are evicted to make room.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT const struct weston_cursor_image *
+weston_compositor_add_cursor_image(struct weston_compositor *compositor,
+				   const char *name, int size, uint64_t key,
+				   int32_t width, int32_t height,
+				   int32_t hotspot_x, int32_t hotspot_y,
+				   const void *pixels)
+{
+	struct weston_cursor_image *image, *tail;
+	size_t bytes = (size_t) width * height * 4;
+
+	if (width <= 0 || height <= 0 || bytes > CURSOR_CACHE_MAX_BYTES)
+		return NULL;
+
+	image = zalloc(sizeof *image);
+	if (!image)
+		return NULL;
+
+	image->pixels = malloc(bytes);
+	if (name)
+		image->name = strdup(name);
+	if (!image->pixels || (name && !image->name)) {
+		free(image->pixels);
+		free(image->name);
+		free(image);
+		return NULL;
+	}
+
+	image->size = name ? size : 0;
+	image->key = name ? 0 : key;
+	image->width = width;
+	image->height = height;
+	image->hotspot_x = hotspot_x;
+	image->hotspot_y = hotspot_y;
+	memcpy(image->pixels, pixels, bytes);
+
+	while (!wl_list_empty(&compositor->cursor_image_list) &&
+	       (compositor->cursor_image_count >= CURSOR_CACHE_MAX_IMAGES ||
+		compositor->cursor_image_bytes + bytes > CURSOR_CACHE_MAX_BYTES)) {
+		tail = wl_container_of(compositor->cursor_image_list.prev,
+				       tail, link);
+		cursor_image_destroy(compositor, tail);
+	}
+
+	wl_list_insert(&compositor->cursor_image_list, &image->link);
+	compositor->cursor_image_count++;
+	compositor->cursor_image_bytes += bytes;
+
+	return image;
+}
+
+void
+weston_compositor_cursor_cache_destroy(struct weston_compositor *compositor)
+{
+	struct weston_cursor_image *image, *tmp;
+
+	wl_list_for_each_safe(image, tmp, &compositor->cursor_image_list, link)
+		cursor_image_destroy(compositor, image);
+}
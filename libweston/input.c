@@ -30,6 +30,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <assert.h>
@@ -105,15 +106,84 @@ send_timestamp(struct wl_resource *resource,
 
 static void
 send_timestamps_for_input_resource(struct wl_resource *input_resource,
-				   struct wl_list *list,
+				   struct wl_array *focus_timestamps,
 				   const struct timespec *time)
 {
-	struct wl_resource *resource;
+	struct wl_resource **resource;
 
-	wl_resource_for_each(resource, list) {
-		if (wl_resource_get_user_data(resource) == input_resource)
-			send_timestamp(resource, time);
+	wl_array_for_each(resource, focus_timestamps) {
+		if (wl_resource_get_user_data(*resource) == input_resource)
+			send_timestamp(*resource, time);
+	}
+}
+
+/* Collect the timestamps resources that belong to one of the focus
+ * resources, so that sending an event does not have to walk the timestamps
+ * of every client for every focus resource. */
+static void
+update_focus_timestamps(struct wl_array *focus_timestamps,
+			struct wl_list *timestamps_list,
+			struct wl_list *focus_resource_list)
+{
+	struct wl_resource *resource, *input_resource, **entry;
+
+	focus_timestamps->size = 0;
+	if (!focus_resource_list)
+		return;
+
+	wl_resource_for_each(resource, timestamps_list) {
+		wl_resource_for_each(input_resource, focus_resource_list) {
+			if (wl_resource_get_user_data(resource) !=
+			    input_resource)
+				continue;
+
+			entry = wl_array_add(focus_timestamps, sizeof *entry);
+			if (entry)
+				*entry = resource;
+			break;
+		}
+	}
+}
+
+static struct wl_array *
+pointer_focus_timestamps(struct weston_pointer *pointer)
+{
+	if (!pointer->focus_timestamps_valid) {
+		update_focus_timestamps(&pointer->focus_timestamps,
+					&pointer->timestamps_list,
+					pointer->focus_client ?
+					&pointer->focus_client->pointer_resources :
+					NULL);
+		pointer->focus_timestamps_valid = true;
+	}
+
+	return &pointer->focus_timestamps;
+}
+
+static struct wl_array *
+keyboard_focus_timestamps(struct weston_keyboard *keyboard)
+{
+	if (!keyboard->focus_timestamps_valid) {
+		update_focus_timestamps(&keyboard->focus_timestamps,
+					&keyboard->timestamps_list,
+					&keyboard->focus_resource_list);
+		keyboard->focus_timestamps_valid = true;
+	}
+
+	return &keyboard->focus_timestamps;
+}
+
+static struct wl_array *
+touch_focus_timestamps(struct weston_touch *touch)
+{
+	if (!touch->focus_timestamps_valid) {
+		update_focus_timestamps(&touch->focus_timestamps,
+					&touch->timestamps_list,
+					&touch->focus_resource_list);
+		touch->focus_timestamps_valid = true;
 	}
+
+	return &touch->focus_timestamps;
 }
 
 static void
@@ -269,6 +339,7 @@ weston_pointer_ensure_pointer_client(struct weston_pointer *pointer,
 	    pointer->focus->surface->resource &&
 	    wl_resource_get_client(pointer->focus->surface->resource) == client) {
 		pointer->focus_client = pointer_client;
+		pointer->focus_timestamps_valid = false;
 	}
 
 	return pointer_client;
@@ -279,8 +350,10 @@ weston_pointer_cleanup_pointer_client(struct weston_pointer *pointer,
 				      struct weston_pointer_client *pointer_client)
 {
 	if (weston_pointer_client_is_empty(pointer_client)) {
-		if (pointer->focus_client == pointer_client)
+		if (pointer->focus_client == pointer_client) {
 			pointer->focus_client = NULL;
+			pointer->focus_timestamps_valid = false;
+		}
 		wl_list_remove(&pointer_client->link);
 		weston_pointer_client_destroy(pointer_client);
 	}
@@ -301,6 +374,7 @@ unbind_pointer_client_resource(struct wl_resource *resource)
 		assert(pointer_client);
 		remove_input_resource_from_timestamps(resource,
 						      &pointer->timestamps_list);
+		pointer->focus_timestamps_valid = false;
 		weston_pointer_cleanup_pointer_client(pointer, pointer_client);
 	}
 }
@@ -523,8 +597,8 @@ pointer_send_motion(struct weston_pointer *pointer,
 	msecs = timespec_to_msec(time);
 	wl_resource_for_each(resource, resource_list) {
 		send_timestamps_for_input_resource(resource,
-                                                   &pointer->timestamps_list,
-                                                   time);
+						   pointer_focus_timestamps(pointer),
+						   time);
 		wl_pointer_send_motion(resource, msecs, sx, sy);
 	}
 }
@@ -609,8 +683,8 @@ weston_pointer_send_button(struct weston_pointer *pointer,
 	msecs = timespec_to_msec(time);
 	wl_resource_for_each(resource, resource_list) {
 		send_timestamps_for_input_resource(resource,
-                                                   &pointer->timestamps_list,
-                                                   time);
+						   pointer_focus_timestamps(pointer),
+						   time);
 		wl_pointer_send_button(resource, serial, msecs, button, state);
 	}
 }
@@ -670,7 +744,7 @@ weston_pointer_send_axis(struct weston_pointer *pointer,
 
 		if (event->value) {
 			send_timestamps_for_input_resource(resource,
-							   &pointer->timestamps_list,
+							   pointer_focus_timestamps(pointer),
 							   time);
 			wl_pointer_send_axis(resource, msecs,
 					     event->axis,
@@ -678,7 +752,7 @@ weston_pointer_send_axis(struct weston_pointer *pointer,
 		} else if (wl_resource_get_version(resource) >=
 			 WL_POINTER_AXIS_STOP_SINCE_VERSION) {
 			send_timestamps_for_input_resource(resource,
-							   &pointer->timestamps_list,
+							   pointer_focus_timestamps(pointer),
 							   time);
 			wl_pointer_send_axis_stop(resource, msecs,
 						  event->axis);
@@ -832,7 +906,7 @@ weston_touch_send_down(struct weston_touch *touch, const struct timespec *time,
 	msecs = timespec_to_msec(time);
 	wl_resource_for_each(resource, resource_list) {
 		send_timestamps_for_input_resource(resource,
-						   &touch->timestamps_list,
+						   touch_focus_timestamps(touch),
 						   time);
 		wl_touch_send_down(resource, serial, msecs,
 				   touch->focus->surface->resource,
@@ -876,7 +950,7 @@ weston_touch_send_up(struct weston_touch *touch, const struct timespec *time,
 	msecs = timespec_to_msec(time);
 	wl_resource_for_each(resource, resource_list) {
 		send_timestamps_for_input_resource(resource,
-						   &touch->timestamps_list,
+						   touch_focus_timestamps(touch),
 						   time);
 		wl_touch_send_up(resource, serial, msecs, touch_id);
 	}
@@ -920,7 +994,7 @@ weston_touch_send_motion(struct weston_touch *touch,
 	msecs = timespec_to_msec(time);
 	wl_resource_for_each(resource, resource_list) {
 		send_timestamps_for_input_resource(resource,
-						   &touch->timestamps_list,
+						   touch_focus_timestamps(touch),
 						   time);
 		wl_touch_send_motion(resource, msecs,
 				     touch_id, sx, sy);
@@ -1022,7 +1096,7 @@ weston_keyboard_send_key(struct weston_keyboard *keyboard,
 	msecs = timespec_to_msec(time);
 	wl_resource_for_each(resource, resource_list) {
 		send_timestamps_for_input_resource(resource,
-						   &keyboard->timestamps_list,
+						   keyboard_focus_timestamps(keyboard),
 						   time);
 		wl_keyboard_send_key(resource, serial, msecs, key, state);
 	}
@@ -1229,6 +1303,7 @@ weston_pointer_create(struct weston_seat *seat)
 	wl_list_init(&pointer->focus_view_listener.link);
 	wl_signal_init(&pointer->destroy_signal);
 	wl_list_init(&pointer->timestamps_list);
+	wl_array_init(&pointer->focus_timestamps);
 
 	pointer->sprite_destroy_listener.notify = pointer_handle_sprite_destroy;
 
@@ -1267,6 +1342,7 @@ weston_pointer_destroy(struct weston_pointer *pointer)
 	wl_list_remove(&pointer->focus_view_listener.link);
 	wl_list_remove(&pointer->output_destroy_listener.link);
 	wl_list_remove(&pointer->timestamps_list);
+	wl_array_release(&pointer->focus_timestamps);
 	free(pointer);
 }
 
@@ -1300,6 +1376,7 @@ weston_keyboard_create(void)
 	keyboard->grab = &keyboard->default_grab;
 	wl_signal_init(&keyboard->focus_signal);
 	wl_list_init(&keyboard->timestamps_list);
+	wl_array_init(&keyboard->focus_timestamps);
 
 	return keyboard;
 }
@@ -1331,6 +1408,7 @@ weston_keyboard_destroy(struct weston_keyboard *keyboard)
 	wl_array_release(&keyboard->keys);
 	wl_list_remove(&keyboard->focus_resource_listener.link);
 	wl_list_remove(&keyboard->timestamps_list);
+	wl_array_release(&keyboard->focus_timestamps);
 	free(keyboard);
 }
 
@@ -1361,6 +1439,7 @@ weston_touch_create(void)
 	touch->grab = &touch->default_grab;
 	wl_signal_init(&touch->focus_signal);
 	wl_list_init(&touch->timestamps_list);
+	wl_array_init(&touch->focus_timestamps);
 
 	return touch;
 }
@@ -1385,6 +1464,7 @@ weston_touch_destroy(struct weston_touch *touch)
 	wl_list_remove(&touch->focus_view_listener.link);
 	wl_list_remove(&touch->focus_resource_listener.link);
 	wl_list_remove(&touch->timestamps_list);
+	wl_array_release(&touch->focus_timestamps);
 	free(touch);
 }
 
@@ -1460,6 +1540,7 @@ weston_pointer_set_focus(struct weston_pointer *pointer,
 		}
 
 		pointer->focus_client = NULL;
+		pointer->focus_timestamps_valid = false;
 	}
 
 	pointer_client = find_pointer_client_for_view(pointer, view);
@@ -1475,6 +1556,7 @@ weston_pointer_set_focus(struct weston_pointer *pointer,
 							 kbd);
 
 		pointer->focus_client = pointer_client;
+		pointer->focus_timestamps_valid = false;
 
 		focus_resource_list = &pointer->focus_client->pointer_resources;
 		wl_resource_for_each(resource, focus_resource_list) {
@@ -1583,6 +1665,7 @@ weston_keyboard_set_focus(struct weston_keyboard *keyboard,
 						 &keyboard->focus_resource_listener);
 
 	keyboard->focus = surface;
+	keyboard->focus_timestamps_valid = false;
 	wl_signal_emit(&keyboard->focus_signal, keyboard);
 }
 
@@ -1788,6 +1871,7 @@ notify_motion(struct weston_seat *seat,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(ec);
+	weston_compositor_metrics_note_input(ec);
 	pointer->grab->interface->motion(pointer->grab, time, event);
 }
 
@@ -1836,6 +1920,7 @@ notify_motion_absolute(struct weston_seat *seat, const struct timespec *time,
 	struct weston_pointer_motion_event event = { 0 };
 
 	weston_compositor_wake(ec);
+	weston_compositor_metrics_note_input(ec);
 
 	event = (struct weston_pointer_motion_event) {
 		.mask = WESTON_POINTER_MOTION_ABS,
@@ -1882,6 +1967,8 @@ notify_button(struct weston_seat *seat, const struct timespec *time,
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
+	weston_compositor_metrics_note_input(compositor);
+
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
 		weston_compositor_idle_inhibit(compositor);
 		if (pointer->button_count == 0) {
@@ -1914,6 +2001,7 @@ notify_axis(struct weston_seat *seat, const struct timespec *time,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
 	weston_compositor_wake(compositor);
+	weston_compositor_metrics_note_input(compositor);
 
 	if (weston_compositor_run_axis_binding(compositor, pointer,
 					       time, event))
@@ -2123,7 +2211,7 @@ send_modifiers(struct wl_resource *resource, uint32_t serial, struct weston_keyb
 }
 
 static struct weston_xkb_info *
-weston_xkb_info_create(struct xkb_keymap *keymap);
+weston_xkb_info_get(struct weston_compositor *ec, struct xkb_keymap *keymap);
 
 static void
 update_keymap(struct weston_seat *seat)
@@ -2135,7 +2223,8 @@ update_keymap(struct weston_seat *seat)
 	xkb_mod_mask_t latched_mods;
 	xkb_mod_mask_t locked_mods;
 
-	xkb_info = weston_xkb_info_create(keyboard->pending_keymap);
+	xkb_info = weston_xkb_info_get(seat->compositor,
+				       keyboard->pending_keymap);
 
 	xkb_keymap_unref(keyboard->pending_keymap);
 	keyboard->pending_keymap = NULL;
@@ -2194,6 +2283,8 @@ notify_key(struct weston_seat *seat, const struct timespec *time, uint32_t key,
 	struct weston_keyboard_grab *grab = keyboard->grab;
 	uint32_t *k, *end;
 
+	weston_compositor_metrics_note_input(compositor);
+
 	end = keyboard->keys.data + keyboard->keys.size;
 	for (k = keyboard->keys.data; k < end; k++) {
 		if (*k == key) {
@@ -2342,6 +2433,7 @@ weston_touch_set_focus(struct weston_touch *touch, struct weston_view *view)
 	wl_list_init(&touch->focus_resource_listener.link);
 	wl_list_remove(&touch->focus_view_listener.link);
 	wl_list_init(&touch->focus_view_listener.link);
+	touch->focus_timestamps_valid = false;
 
 	if (!wl_list_empty(focus_resource_list)) {
 		move_resources(&touch->resource_list,
@@ -2566,6 +2658,8 @@ notify_touch_normalized(struct weston_touch_device *device,
 	struct weston_seat *seat = device->aggregate->seat;
 	struct weston_touch *touch = device->aggregate;
 
+	weston_compositor_metrics_note_input(seat->compositor);
+
 	if (touch_type != WL_TOUCH_UP) {
 		if (weston_touch_device_can_calibrate(device))
 			assert(norm != NULL);
@@ -2835,6 +2929,7 @@ destroy_keyboard_resource(struct wl_resource *resource)
 	if (keyboard) {
 		remove_input_resource_from_timestamps(resource,
 						      &keyboard->timestamps_list);
+		keyboard->focus_timestamps_valid = false;
 	}
 }
 
@@ -2928,6 +3023,7 @@ destroy_touch_resource(struct wl_resource *resource)
 	if (touch) {
 		remove_input_resource_from_timestamps(resource,
 						      &touch->timestamps_list);
+		touch->focus_timestamps_valid = false;
 	}
 }
 
@@ -3115,6 +3211,15 @@ weston_compositor_set_xkb_rule_names(struct weston_compositor *ec,
 	return 0;
 }
 
+/* Compiled keymaps kept by weston_compositor_get_keymap() */
+#define KEYMAP_CACHE_MAX 8
+
+struct weston_keymap_cache_entry {
+	struct wl_list link; /* weston_compositor::keymap_cache_list */
+	char *names;
+	struct weston_xkb_info *xkb_info;
+};
+
 static void
 weston_xkb_info_destroy(struct weston_xkb_info *xkb_info)
 {
@@ -3127,9 +3232,45 @@ weston_xkb_info_destroy(struct weston_xkb_info *xkb_info)
 	free(xkb_info);
 }
 
+static void
+weston_keymap_cache_entry_destroy(struct weston_keymap_cache_entry *entry)
+{
+	wl_list_remove(&entry->link);
+	weston_xkb_info_destroy(entry->xkb_info);
+	free(entry->names);
+	free(entry);
+}
+
+void
+weston_compositor_keymap_cache_report(struct weston_compositor *ec,
+				      struct weston_memory_report *report)
+{
+	struct weston_keymap_cache_entry *entry;
+	uint64_t bytes = 0;
+
+	wl_list_for_each(entry, &ec->keymap_cache_list, link)
+		bytes += os_ro_anonymous_file_size(entry->xkb_info->keymap_rofile);
+
+	weston_memory_report_add(report, "compositor", "keymaps",
+				 ec->keymap_cache_count, bytes);
+}
+
+/* Seats hold their own reference to the keymap they use. */
+void
+weston_compositor_keymap_cache_trim(struct weston_compositor *ec)
+{
+	struct weston_keymap_cache_entry *entry, *tmp;
+
+	wl_list_for_each_safe(entry, tmp, &ec->keymap_cache_list, link)
+		weston_keymap_cache_entry_destroy(entry);
+	ec->keymap_cache_count = 0;
+}
+
 void
 weston_compositor_xkb_destroy(struct weston_compositor *ec)
 {
+	weston_compositor_keymap_cache_trim(ec);
+
 	free((char *) ec->xkb_names.rules);
 	free((char *) ec->xkb_names.model);
 	free((char *) ec->xkb_names.layout);
@@ -3231,6 +3372,100 @@ weston_compositor_build_global_keymap(struct weston_compositor *ec)
 	return 0;
 }
 
+/* Keymaps compiled by weston_compositor_get_keymap() share their
+ * weston_xkb_info, and so the keymap string sent to clients.
+ */
+static struct weston_xkb_info *
+weston_xkb_info_get(struct weston_compositor *ec, struct xkb_keymap *keymap)
+{
+	struct weston_keymap_cache_entry *entry;
+
+	wl_list_for_each(entry, &ec->keymap_cache_list, link) {
+		if (entry->xkb_info->keymap == keymap) {
+			entry->xkb_info->ref_count++;
+			return entry->xkb_info;
+		}
+	}
+
+	return weston_xkb_info_create(keymap);
+}
+
+static char *
+xkb_rule_names_to_string(const struct xkb_rule_names *names)
+{
+	char *str;
+
+	if (asprintf(&str, "%s:%s:%s:%s:%s",
+		     names->rules ? names->rules : "",
+		     names->model ? names->model : "",
+		     names->layout ? names->layout : "",
+		     names->variant ? names->variant : "",
+		     names->options ? names->options : "") < 0)
+		return NULL;
+
+	return str;
+}
+
+/** Get a compiled keymap for the given rule names
+ *
+ * \param ec The compositor
+ * \param names The rule names to compile the keymap from
+ * \return A new reference to the keymap, or NULL on failure
+ *
+ * The last few keymaps are kept compiled along with their keymap file, so
+ * switching back to a recently used layout does not compile the keymap
+ * again, and weston_seat_update_keymap() only has to send it.
+ */
+WL_EXPORT struct xkb_keymap *
+weston_compositor_get_keymap(struct weston_compositor *ec,
+			     const struct xkb_rule_names *names)
+{
+	struct weston_keymap_cache_entry *entry, *tail;
+	struct xkb_keymap *keymap;
+	char *key;
+
+	key = xkb_rule_names_to_string(names);
+	if (!key)
+		return xkb_keymap_new_from_names(ec->xkb_context, names, 0);
+
+	wl_list_for_each(entry, &ec->keymap_cache_list, link) {
+		if (strcmp(entry->names, key) == 0) {
+			free(key);
+			/* keep the list in most recently used order */
+			wl_list_remove(&entry->link);
+			wl_list_insert(&ec->keymap_cache_list, &entry->link);
+			return xkb_keymap_ref(entry->xkb_info->keymap);
+		}
+	}
+
+	keymap = xkb_keymap_new_from_names(ec->xkb_context, names, 0);
+	if (!keymap) {
+		free(key);
+		return NULL;
+	}
+
+	entry = zalloc(sizeof *entry);
+	if (entry)
+		entry->xkb_info = weston_xkb_info_create(keymap);
+	if (!entry || !entry->xkb_info) {
+		free(entry);
+		free(key);
+		return keymap;
+	}
+	entry->names = key;
+
+	if (ec->keymap_cache_count >= KEYMAP_CACHE_MAX) {
+		tail = wl_container_of(ec->keymap_cache_list.prev,
+				       tail, link);
+		weston_keymap_cache_entry_destroy(tail);
+		ec->keymap_cache_count--;
+	}
+	wl_list_insert(&ec->keymap_cache_list, &entry->link);
+	ec->keymap_cache_count++;
+
+	return keymap;
+}
+
 WL_EXPORT void
 weston_seat_update_keymap(struct weston_seat *seat, struct xkb_keymap *keymap)
 {
@@ -3265,7 +3500,8 @@ weston_seat_init_keyboard(struct weston_seat *seat, struct xkb_keymap *keymap)
 	}
 
 	if (keymap != NULL) {
-		keyboard->xkb_info = weston_xkb_info_create(keymap);
+		keyboard->xkb_info = weston_xkb_info_get(seat->compositor,
+							 keymap);
 		if (keyboard->xkb_info == NULL)
 			goto err;
 	} else {
@@ -4921,6 +5157,51 @@ input_timestamps_manager_destroy(struct wl_client *client,
 	wl_resource_destroy(resource);
 }
 
+static void
+keyboard_timestamps_destroy(struct wl_resource *resource)
+{
+	struct wl_resource *keyboard_resource =
+		wl_resource_get_user_data(resource);
+	struct weston_keyboard *keyboard = NULL;
+
+	if (keyboard_resource)
+		keyboard = wl_resource_get_user_data(keyboard_resource);
+	if (keyboard)
+		keyboard->focus_timestamps_valid = false;
+
+	unbind_resource(resource);
+}
+
+static void
+pointer_timestamps_destroy(struct wl_resource *resource)
+{
+	struct wl_resource *pointer_resource =
+		wl_resource_get_user_data(resource);
+	struct weston_pointer *pointer = NULL;
+
+	if (pointer_resource)
+		pointer = wl_resource_get_user_data(pointer_resource);
+	if (pointer)
+		pointer->focus_timestamps_valid = false;
+
+	unbind_resource(resource);
+}
+
+static void
+touch_timestamps_destroy(struct wl_resource *resource)
+{
+	struct wl_resource *touch_resource =
+		wl_resource_get_user_data(resource);
+	struct weston_touch *touch = NULL;
+
+	if (touch_resource)
+		touch = wl_resource_get_user_data(touch_resource);
+	if (touch)
+		touch->focus_timestamps_valid = false;
+
+	unbind_resource(resource);
+}
+
 static void
 input_timestamps_manager_get_keyboard_timestamps(struct wl_client *client,
 						 struct wl_resource *resource,
@@ -4942,6 +5223,7 @@ input_timestamps_manager_get_keyboard_timestamps(struct wl_client *client,
 	if (keyboard) {
 		wl_list_insert(&keyboard->timestamps_list,
 			       wl_resource_get_link(input_ts));
+		keyboard->focus_timestamps_valid = false;
 	} else {
 		wl_list_init(wl_resource_get_link(input_ts));
 	}
@@ -4949,7 +5231,7 @@ input_timestamps_manager_get_keyboard_timestamps(struct wl_client *client,
 	wl_resource_set_implementation(input_ts,
 				       &input_timestamps_interface,
 				       keyboard_resource,
-				       unbind_resource);
+				       keyboard_timestamps_destroy);
 }
 
 static void
@@ -4973,6 +5255,7 @@ input_timestamps_manager_get_pointer_timestamps(struct wl_client *client,
 	if (pointer) {
 		wl_list_insert(&pointer->timestamps_list,
 			       wl_resource_get_link(input_ts));
+		pointer->focus_timestamps_valid = false;
 	} else {
 		wl_list_init(wl_resource_get_link(input_ts));
 	}
@@ -4980,7 +5263,7 @@ input_timestamps_manager_get_pointer_timestamps(struct wl_client *client,
 	wl_resource_set_implementation(input_ts,
 				       &input_timestamps_interface,
 				       pointer_resource,
-				       unbind_resource);
+				       pointer_timestamps_destroy);
 }
 
 static void
@@ -5003,6 +5286,7 @@ input_timestamps_manager_get_touch_timestamps(struct wl_client *client,
 	if (touch) {
 		wl_list_insert(&touch->timestamps_list,
 			       wl_resource_get_link(input_ts));
+		touch->focus_timestamps_valid = false;
 	} else {
 		wl_list_init(wl_resource_get_link(input_ts));
 	}
@@ -5010,7 +5294,7 @@ input_timestamps_manager_get_touch_timestamps(struct wl_client *client,
 	wl_resource_set_implementation(input_ts,
 				       &input_timestamps_interface,
 				       touch_resource,
-				       unbind_resource);
+				       touch_timestamps_destroy);
 }
 
 static const struct zwp_input_timestamps_manager_v1_interface
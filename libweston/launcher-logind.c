@@ -67,6 +67,19 @@ struct launcher_logind {
 	struct wl_event_source *dbus_ctx;
 	char *spath;
 	DBusPendingCall *pending_active;
+
+	struct wl_list kept_devices; /* launcher_logind_kept_device::link */
+};
+
+/* An input device closed while the session is inactive, which we keep
+ * taken instead of releasing it. Reopening it then needs no TakeDevice
+ * round trip to logind on the way back, since logind hands out the new fd
+ * in its ResumeDevice signal already. With many input devices, those
+ * round trips made up most of the VT switch time. */
+struct launcher_logind_kept_device {
+	struct wl_list link;
+	dev_t rdev;
+	int fd; /* from ResumeDevice, -1 until then */
 };
 
 static int
@@ -165,12 +178,40 @@ launcher_logind_pause_device_complete(struct launcher_logind *wl, uint32_t major
 	}
 }
 
+static struct launcher_logind_kept_device *
+launcher_logind_find_kept(struct launcher_logind *wl, dev_t rdev)
+{
+	struct launcher_logind_kept_device *kept;
+
+	wl_list_for_each(kept, &wl->kept_devices, link)
+		if (kept->rdev == rdev)
+			return kept;
+
+	return NULL;
+}
+
+static void
+launcher_logind_release_kept(struct launcher_logind *wl)
+{
+	struct launcher_logind_kept_device *kept, *tmp;
+
+	wl_list_for_each_safe(kept, tmp, &wl->kept_devices, link) {
+		if (kept->fd >= 0)
+			close(kept->fd);
+		launcher_logind_release_device(wl, major(kept->rdev),
+					       minor(kept->rdev));
+		wl_list_remove(&kept->link);
+		free(kept);
+	}
+}
+
 static int
 launcher_logind_open(struct weston_launcher *launcher, const char *path, int flags)
 {
 	struct launcher_logind *wl = wl_container_of(launcher, wl, base);
+	struct launcher_logind_kept_device *kept;
 	struct stat st;
-	int fl, r, fd;
+	int fl, r, fd = -1;
 
 	r = stat(path, &st);
 	if (r < 0)
@@ -180,8 +221,20 @@ launcher_logind_open(struct weston_launcher *launcher, const char *path, int fla
 		return -1;
 	}
 
-	fd = launcher_logind_take_device(wl, major(st.st_rdev),
-				       minor(st.st_rdev), NULL);
+	kept = launcher_logind_find_kept(wl, st.st_rdev);
+	if (kept) {
+		/* Without an fd from ResumeDevice yet, start over. */
+		fd = kept->fd;
+		if (fd < 0)
+			launcher_logind_release_device(wl, major(st.st_rdev),
+						       minor(st.st_rdev));
+		wl_list_remove(&kept->link);
+		free(kept);
+	}
+
+	if (fd < 0)
+		fd = launcher_logind_take_device(wl, major(st.st_rdev),
+						 minor(st.st_rdev), NULL);
 	if (fd < 0)
 		return fd;
 
@@ -220,6 +273,7 @@ static void
 launcher_logind_close(struct weston_launcher *launcher, int fd)
 {
 	struct launcher_logind *wl = wl_container_of(launcher, wl, base);
+	struct launcher_logind_kept_device *kept;
 	struct stat st;
 	int r;
 
@@ -235,6 +289,18 @@ launcher_logind_close(struct weston_launcher *launcher, int fd)
 		return;
 	}
 
+	if (!wl->compositor->session_active &&
+	    major(st.st_rdev) != DRM_MAJOR &&
+	    !launcher_logind_find_kept(wl, st.st_rdev)) {
+		kept = zalloc(sizeof *kept);
+		if (kept) {
+			kept->rdev = st.st_rdev;
+			kept->fd = -1;
+			wl_list_insert(&wl->kept_devices, &kept->link);
+			return;
+		}
+	}
+
 	launcher_logind_release_device(wl, major(st.st_rdev),
 				     minor(st.st_rdev));
 }
@@ -280,6 +346,10 @@ launcher_logind_set_active(struct launcher_logind *wl, bool active)
 
 	wl_signal_emit(&wl->compositor->session_signal,
 		       wl->compositor);
+
+	/* What was not reopened on resume is gone or unwanted. */
+	if (active)
+		launcher_logind_release_kept(wl);
 }
 
 static void
@@ -498,8 +568,10 @@ device_paused(struct launcher_logind *wl, DBusMessage *m)
 static void
 device_resumed(struct launcher_logind *wl, DBusMessage *m)
 {
+	struct launcher_logind_kept_device *kept;
 	bool r;
 	uint32_t major, minor;
+	int fd;
 
 	r = dbus_message_get_args(m, NULL,
 				  DBUS_TYPE_UINT32, &major,
@@ -512,9 +584,21 @@ device_resumed(struct launcher_logind *wl, DBusMessage *m)
 
 	/* DeviceResumed messages provide us a new file-descriptor for
 	 * resumed devices. For DRM devices it's the same as before, for evdev
-	 * devices it's a new open-file. As we reopen evdev devices, anyway,
-	 * there is no need for us to handle this event for evdev. For DRM, we
-	 * notify the compositor to wake up. */
+	 * devices it's a new open-file. Evdev devices closed while paused
+	 * were kept, and are about to be reopened, which takes this fd. For
+	 * DRM, we notify the compositor to wake up. */
+
+	kept = launcher_logind_find_kept(wl, makedev(major, minor));
+	if (kept &&
+	    dbus_message_get_args(m, NULL,
+				  DBUS_TYPE_UINT32, &major,
+				  DBUS_TYPE_UINT32, &minor,
+				  DBUS_TYPE_UNIX_FD, &fd,
+				  DBUS_TYPE_INVALID)) {
+		if (kept->fd >= 0)
+			close(kept->fd);
+		kept->fd = fd;
+	}
 
 	if (wl->sync_drm && wl->compositor->backend->device_changed)
 		wl->compositor->backend->device_changed(wl->compositor,
@@ -740,6 +824,7 @@ launcher_logind_connect(struct weston_launcher **out, struct weston_compositor *
 	wl->base.iface = &launcher_logind_iface;
 	wl->compositor = compositor;
 	wl->sync_drm = sync_drm;
+	wl_list_init(&wl->kept_devices);
 
 	wl->seat = strdup(seat_id);
 	if (!wl->seat) {
@@ -831,6 +916,7 @@ launcher_logind_destroy(struct weston_launcher *launcher)
 		dbus_pending_call_unref(wl->pending_active);
 	}
 
+	launcher_logind_release_kept(wl);
 	launcher_logind_release_control(wl);
 	launcher_logind_destroy_dbus(wl);
 	weston_dbus_close(wl->dbus, wl->dbus_ctx);
@@ -112,11 +112,48 @@ handle_pointer_motion(struct libinput_device *libinput_device,
 		.dy_unaccel = dy_unaccel,
 	};
 
+	if (device->seat->compositor->accumulate_pointer_motion) {
+		struct weston_pointer_motion_event *pending =
+			&device->pending_motion;
+
+		/* Sum up both deltas, so relative pointer clients still
+		 * get all of the unaccelerated motion. */
+		if (device->motion_pending) {
+			pending->time = time;
+			pending->dx += event.dx;
+			pending->dy += event.dy;
+			pending->dx_unaccel += event.dx_unaccel;
+			pending->dy_unaccel += event.dy_unaccel;
+		} else {
+			*pending = event;
+			device->motion_pending = true;
+		}
+
+		return false;
+	}
+
 	notify_motion(device->seat, &time, &event);
 
 	return true;
 }
 
+/* Send the relative motion merged by handle_pointer_motion(). */
+void
+evdev_device_flush_motion(struct evdev_device *device)
+{
+	struct weston_pointer_motion_event *event = &device->pending_motion;
+
+	if (!device->motion_pending)
+		return;
+
+	device->motion_pending = false;
+	wl_list_remove(&device->motion_link);
+	wl_list_init(&device->motion_link);
+
+	notify_motion(device->seat, &event->time, event);
+	notify_pointer_frame(device->seat);
+}
+
 static bool
 handle_pointer_motion_absolute(
 	struct libinput_device *libinput_device,
@@ -701,6 +738,7 @@ evdev_device_create(struct libinput_device *libinput_device,
 
 	device->seat = seat;
 	wl_list_init(&device->link);
+	wl_list_init(&device->motion_link);
 	device->device = libinput_device;
 
 	if (libinput_device_has_capability(libinput_device,
@@ -729,6 +767,8 @@ evdev_device_create(struct libinput_device *libinput_device,
 void
 evdev_device_destroy(struct evdev_device *device)
 {
+	evdev_device_flush_motion(device);
+
 	if (device->seat_caps & EVDEV_SEAT_POINTER)
 		weston_seat_release_pointer(device->seat);
 	if (device->seat_caps & EVDEV_SEAT_KEYBOARD)
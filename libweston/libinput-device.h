@@ -52,6 +52,12 @@ struct evdev_device {
 	char *output_name;
 	int fd;
 	bool override_wl_calibration;
+
+	/* relative motion merged until the end of the libinput event
+	 * batch, see weston_compositor::accumulate_pointer_motion */
+	bool motion_pending;
+	struct weston_pointer_motion_event pending_motion;
+	struct wl_list motion_link; /* udev_input::motion_pending_list */
 };
 
 void
@@ -64,6 +70,9 @@ evdev_device_create(struct libinput_device *libinput_device,
 int
 evdev_device_process_event(struct libinput_event *event);
 
+void
+evdev_device_flush_motion(struct evdev_device *device);
+
 void
 evdev_device_set_output(struct evdev_device *device,
 			struct weston_output *output);
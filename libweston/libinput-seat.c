@@ -203,15 +203,45 @@ process_event(struct libinput_event *event)
 		return;
 }
 
+static void
+udev_input_flush_motion(struct udev_input *input)
+{
+	struct evdev_device *device, *next;
+
+	wl_list_for_each_safe(device, next, &input->motion_pending_list,
+			      motion_link)
+		evdev_device_flush_motion(device);
+}
+
 static void
 process_events(struct udev_input *input)
 {
 	struct libinput_event *event;
+	struct evdev_device *device;
 
 	while ((event = libinput_get_event(input->libinput))) {
+		/* Relative motion is merged over the whole batch, up to the
+		 * next event of another kind, which must not overtake it. */
+		if (libinput_event_get_type(event) !=
+		    LIBINPUT_EVENT_POINTER_MOTION) {
+			udev_input_flush_motion(input);
+			process_event(event);
+			libinput_event_destroy(event);
+			continue;
+		}
+
 		process_event(event);
+		device = libinput_device_get_user_data(
+				libinput_event_get_device(event));
+		if (device && device->motion_pending &&
+		    wl_list_empty(&device->motion_link))
+			wl_list_insert(input->motion_pending_list.prev,
+				       &device->motion_link);
 		libinput_event_destroy(event);
 	}
+
+	/* a single repick for the whole batch */
+	udev_input_flush_motion(input);
 }
 
 static int
@@ -331,6 +361,7 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 
 	input->compositor = c;
 	input->configure_device = configure_device;
+	wl_list_init(&input->motion_pending_list);
 
 	log_priority = getenv("WESTON_LIBINPUT_LOG_PRIORITY");
 
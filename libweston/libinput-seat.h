@@ -51,6 +51,7 @@ struct udev_input {
 	struct weston_compositor *compositor;
 	int suspended;
 	udev_configure_device_t configure_device;
+	struct wl_list motion_pending_list; /* evdev_device::motion_link */
 };
 
 int
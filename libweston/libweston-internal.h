@@ -151,6 +151,44 @@ weston_compositor_xkb_destroy(struct weston_compositor *ec);
 int
 weston_input_init(struct weston_compositor *compositor);
 
+void
+weston_compositor_metrics_note_input(struct weston_compositor *compositor);
+
+void
+weston_compositor_metrics_destroy(struct weston_compositor *compositor);
+
+void
+weston_compositor_cursor_cache_destroy(struct weston_compositor *compositor);
+
+void
+weston_compositor_keymap_cache_report(struct weston_compositor *ec,
+				      struct weston_memory_report *report);
+
+void
+weston_compositor_keymap_cache_trim(struct weston_compositor *ec);
+
+void
+weston_compositor_memory_report_init(struct weston_compositor *ec);
+
+void
+weston_compositor_memory_report_destroy(struct weston_compositor *ec);
+
+void
+weston_compositor_client_stats_init(struct weston_compositor *ec);
+
+void
+weston_compositor_client_stats_destroy(struct weston_compositor *ec);
+
+void
+weston_surface_client_stats_commit(struct weston_surface *surface,
+				   uint64_t damage_area);
+
+uint32_t
+weston_surface_client_budget_delay(struct weston_surface *surface);
+
+void
+weston_alloc_profile_init(struct weston_compositor *compositor);
+
 /* weston_output */
 
 void
@@ -159,6 +197,32 @@ weston_output_disable_planes_incr(struct weston_output *output);
 void
 weston_output_disable_planes_decr(struct weston_output *output);
 
+void
+weston_output_metrics_repaint_begin(struct weston_output *output);
+
+void
+weston_output_metrics_repaint_posted(struct weston_output *output);
+
+void
+weston_output_metrics_presented(struct weston_output *output,
+				const struct timespec *stamp,
+				uint32_t presented_flags);
+void
+weston_output_metrics_release(struct weston_output *output);
+
+struct weston_log_subscription;
+
+void
+weston_output_metrics_debug_cb(struct weston_log_subscription *sub,
+			       void *data);
+
+void
+weston_output_zoom_frame_damage(struct weston_output *output,
+				pixman_region32_t *damage);
+
+void
+weston_output_release_zoom(struct weston_output *output);
+
 /* weston_plane */
 
 void
@@ -207,6 +271,10 @@ weston_seat_release_touch(struct weston_seat *seat);
 void
 weston_seat_update_keymap(struct weston_seat *seat, struct xkb_keymap *keymap);
 
+struct xkb_keymap *
+weston_compositor_get_keymap(struct weston_compositor *ec,
+			     const struct xkb_rule_names *names);
+
 void
 wl_data_device_set_keyboard_focus(struct weston_seat *seat);
 
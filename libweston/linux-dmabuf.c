@@ -27,13 +27,22 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 
 #include <libweston/libweston.h>
 #include "linux-dmabuf.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 #include "libweston-internal.h"
+#include "shared/os-compatibility.h"
+#include "shared/timespec-util.h"
+
+/* How long a scanout tranche change must be wanted before it is sent, so
+ * a view flickering between a plane and the renderer does not make the
+ * client reallocate over and over */
+#define DMABUF_FEEDBACK_ACTION_DELAY_MSEC 1000
 
 static void
 linux_dmabuf_buffer_destroy(struct linux_dmabuf_buffer *buffer)
@@ -466,9 +475,450 @@ linux_dmabuf_buffer_get_user_data(struct linux_dmabuf_buffer *buffer)
 	return buffer->user_data;
 }
 
+/** Create the format table advertised in dmabuf feedback
+ *
+ * \param compositor The compositor, its renderer must support dmabuf import.
+ * \return The table, or NULL on failure.
+ *
+ * The table lists every format/modifier pair the renderer can import, and
+ * tranches refer to its entries by index. It is shared by all the feedback
+ * objects of the compositor.
+ */
+WL_EXPORT struct weston_dmabuf_feedback_format_table *
+weston_dmabuf_feedback_format_table_create(struct weston_compositor *compositor)
+{
+	struct weston_dmabuf_feedback_format_table *table;
+	struct weston_dmabuf_feedback_format_table_entry *entry;
+	int *formats = NULL;
+	uint64_t *modifiers = NULL;
+	uint64_t modifier_invalid = DRM_FORMAT_MOD_INVALID;
+	int num_formats, num_modifiers;
+	unsigned int count = 0;
+	void *map;
+	int i, j;
+
+	table = zalloc(sizeof *table);
+	if (!table)
+		return NULL;
+
+	table->fd = -1;
+	wl_array_init(&table->entries);
+
+	compositor->renderer->query_dmabuf_formats(compositor, &formats,
+						   &num_formats);
+
+	for (i = 0; i < num_formats; i++) {
+		compositor->renderer->query_dmabuf_modifiers(compositor,
+							     formats[i],
+							     &modifiers,
+							     &num_modifiers);
+		if (num_modifiers == 0) {
+			num_modifiers = 1;
+			modifiers = &modifier_invalid;
+		}
+
+		/* tranches index the table with 16 bits */
+		for (j = 0; j < num_modifiers && count <= UINT16_MAX; j++) {
+			entry = wl_array_add(&table->entries, sizeof *entry);
+			if (!entry)
+				break;
+			entry->format = formats[i];
+			entry->pad = 0;
+			entry->modifier = modifiers[j];
+			count++;
+		}
+
+		if (modifiers != &modifier_invalid)
+			free(modifiers);
+	}
+	free(formats);
+
+	table->size = table->entries.size;
+	if (table->size == 0)
+		goto err;
+
+	table->fd = os_create_anonymous_file(table->size);
+	if (table->fd < 0)
+		goto err;
+
+	map = mmap(NULL, table->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   table->fd, 0);
+	if (map == MAP_FAILED)
+		goto err;
+
+	memcpy(map, table->entries.data, table->size);
+	munmap(map, table->size);
+
+	return table;
+
+err:
+	weston_log("Error: failed to create the dmabuf feedback format table\n");
+	weston_dmabuf_feedback_format_table_destroy(table);
+	return NULL;
+}
+
+WL_EXPORT void
+weston_dmabuf_feedback_format_table_destroy(struct weston_dmabuf_feedback_format_table *table)
+{
+	if (!table)
+		return;
+
+	if (table->fd >= 0)
+		close(table->fd);
+	wl_array_release(&table->entries);
+	free(table);
+}
+
+static int
+format_table_get_index(struct weston_dmabuf_feedback_format_table *table,
+		       uint32_t format, uint64_t modifier)
+{
+	struct weston_dmabuf_feedback_format_table_entry *entry;
+	int index = 0;
+
+	wl_array_for_each(entry, &table->entries) {
+		if (entry->format == format && entry->modifier == modifier)
+			return index;
+		index++;
+	}
+
+	return -1;
+}
+
+/** Create a dmabuf feedback object
+ *
+ * \param main_device The device clients should allocate buffers on by
+ * default, usually the one the renderer runs on.
+ * \return The feedback, without any tranche, or NULL on failure.
+ */
+WL_EXPORT struct weston_dmabuf_feedback *
+weston_dmabuf_feedback_create(dev_t main_device)
+{
+	struct weston_dmabuf_feedback *dmabuf_feedback;
+
+	dmabuf_feedback = zalloc(sizeof *dmabuf_feedback);
+	if (!dmabuf_feedback)
+		return NULL;
+
+	dmabuf_feedback->main_device = main_device;
+	wl_list_init(&dmabuf_feedback->tranche_list);
+	wl_list_init(&dmabuf_feedback->resource_list);
+
+	return dmabuf_feedback;
+}
+
+/** Destroy a dmabuf feedback object
+ *
+ * Client resources still bound to it become inert.
+ */
+WL_EXPORT void
+weston_dmabuf_feedback_destroy(struct weston_dmabuf_feedback *dmabuf_feedback)
+{
+	struct weston_dmabuf_feedback_tranche *tranche, *tmp;
+	struct wl_resource *res, *res_tmp;
+
+	if (!dmabuf_feedback)
+		return;
+
+	wl_list_for_each_safe(tranche, tmp, &dmabuf_feedback->tranche_list, link)
+		weston_dmabuf_feedback_tranche_destroy(tranche);
+
+	wl_resource_for_each_safe(res, res_tmp, &dmabuf_feedback->resource_list) {
+		wl_list_remove(wl_resource_get_link(res));
+		wl_list_init(wl_resource_get_link(res));
+		wl_resource_set_user_data(res, NULL);
+	}
+
+	free(dmabuf_feedback);
+}
+
+/** Add a tranche to a dmabuf feedback object
+ *
+ * \param dmabuf_feedback The feedback to add the tranche to.
+ * \param table The compositor format table.
+ * \param target_device The device the buffers are used on.
+ * \param flags enum zwp_linux_dmabuf_feedback_v1_tranche_flags
+ * \param preference Tranches are ordered by this, highest first.
+ * \return The tranche, or NULL on failure.
+ *
+ * A renderer tranche (no flags) is filled with the whole table; scanout
+ * tranches start empty and are filled with
+ * weston_dmabuf_feedback_tranche_add_format().
+ */
+WL_EXPORT struct weston_dmabuf_feedback_tranche *
+weston_dmabuf_feedback_tranche_create(struct weston_dmabuf_feedback *dmabuf_feedback,
+				      struct weston_dmabuf_feedback_format_table *table,
+				      dev_t target_device, uint32_t flags,
+				      enum weston_dmabuf_feedback_tranche_preference preference)
+{
+	struct weston_dmabuf_feedback_tranche *tranche, *pos;
+	unsigned int i, count;
+	uint16_t *index;
+
+	tranche = zalloc(sizeof *tranche);
+	if (!tranche)
+		return NULL;
+
+	tranche->target_device = target_device;
+	tranche->flags = flags;
+	tranche->preference = preference;
+	wl_array_init(&tranche->formats_indices);
+
+	if (flags == 0) {
+		count = table->entries.size /
+			sizeof(struct weston_dmabuf_feedback_format_table_entry);
+		index = wl_array_add(&tranche->formats_indices,
+				     count * sizeof *index);
+		if (!index) {
+			free(tranche);
+			return NULL;
+		}
+		for (i = 0; i < count; i++)
+			index[i] = i;
+	}
+
+	wl_list_for_each(pos, &dmabuf_feedback->tranche_list, link) {
+		if (pos->preference < preference)
+			break;
+	}
+	wl_list_insert(pos->link.prev, &tranche->link);
+
+	return tranche;
+}
+
+WL_EXPORT void
+weston_dmabuf_feedback_tranche_destroy(struct weston_dmabuf_feedback_tranche *tranche)
+{
+	wl_array_release(&tranche->formats_indices);
+	wl_list_remove(&tranche->link);
+	free(tranche);
+}
+
+/** Add a format/modifier pair to a tranche
+ *
+ * \return false if the pair is not in the format table, i.e. the renderer
+ * could not import such buffers, or on allocation failure.
+ */
+WL_EXPORT bool
+weston_dmabuf_feedback_tranche_add_format(struct weston_dmabuf_feedback_tranche *tranche,
+					  struct weston_dmabuf_feedback_format_table *table,
+					  uint32_t format, uint64_t modifier)
+{
+	uint16_t *index;
+	int i;
+
+	i = format_table_get_index(table, format, modifier);
+	if (i < 0)
+		return false;
+
+	wl_array_for_each(index, &tranche->formats_indices) {
+		if (*index == i)
+			return true;
+	}
+
+	index = wl_array_add(&tranche->formats_indices, sizeof *index);
+	if (!index)
+		return false;
+	*index = i;
+
+	return true;
+}
+
+WL_EXPORT struct weston_dmabuf_feedback_tranche *
+weston_dmabuf_feedback_find_tranche(struct weston_dmabuf_feedback *dmabuf_feedback,
+				    enum weston_dmabuf_feedback_tranche_preference preference)
+{
+	struct weston_dmabuf_feedback_tranche *tranche;
+
+	wl_list_for_each(tranche, &dmabuf_feedback->tranche_list, link) {
+		if (tranche->preference == preference)
+			return tranche;
+	}
+
+	return NULL;
+}
+
+/** Debounce a change of the tranches
+ *
+ * \param dmabuf_feedback The feedback to change.
+ * \param action The change the backend would like to make now.
+ * \param now The current time.
+ * \return true if the same action has been asked for without interruption
+ * for long enough, and should be applied.
+ */
+WL_EXPORT bool
+weston_dmabuf_feedback_action_ready(struct weston_dmabuf_feedback *dmabuf_feedback,
+				    enum weston_dmabuf_feedback_action action,
+				    const struct timespec *now)
+{
+	if (action != dmabuf_feedback->action_needed) {
+		dmabuf_feedback->action_needed = action;
+		dmabuf_feedback->action_time = *now;
+		return false;
+	}
+
+	if (action == ACTION_NONE)
+		return false;
+
+	if (timespec_sub_to_msec(now, &dmabuf_feedback->action_time) <
+	    DMABUF_FEEDBACK_ACTION_DELAY_MSEC)
+		return false;
+
+	dmabuf_feedback->action_needed = ACTION_NONE;
+	return true;
+}
+
+static void
+weston_dmabuf_feedback_send(struct weston_dmabuf_feedback *dmabuf_feedback,
+			    struct weston_dmabuf_feedback_format_table *table,
+			    struct wl_resource *res, bool advertise_format_table)
+{
+	struct weston_dmabuf_feedback_tranche *tranche;
+	struct wl_array device;
+	dev_t *dev;
+
+	wl_array_init(&device);
+	dev = wl_array_add(&device, sizeof *dev);
+	if (!dev) {
+		wl_resource_post_no_memory(res);
+		return;
+	}
+
+	if (advertise_format_table)
+		zwp_linux_dmabuf_feedback_v1_send_format_table(res, table->fd,
+							       table->size);
+
+	*dev = dmabuf_feedback->main_device;
+	zwp_linux_dmabuf_feedback_v1_send_main_device(res, &device);
+
+	wl_list_for_each(tranche, &dmabuf_feedback->tranche_list, link) {
+		if (tranche->formats_indices.size == 0)
+			continue;
+
+		*dev = tranche->target_device;
+		zwp_linux_dmabuf_feedback_v1_send_tranche_target_device(res,
+									&device);
+		zwp_linux_dmabuf_feedback_v1_send_tranche_flags(res,
+								tranche->flags);
+		zwp_linux_dmabuf_feedback_v1_send_tranche_formats(res,
+								  &tranche->formats_indices);
+		zwp_linux_dmabuf_feedback_v1_send_tranche_done(res);
+	}
+
+	zwp_linux_dmabuf_feedback_v1_send_done(res);
+
+	wl_array_release(&device);
+}
+
+/** Send the updated tranches to every client bound to the feedback */
+WL_EXPORT void
+weston_dmabuf_feedback_send_all(struct weston_dmabuf_feedback *dmabuf_feedback,
+				struct weston_dmabuf_feedback_format_table *table)
+{
+	struct wl_resource *res;
+
+	wl_resource_for_each(res, &dmabuf_feedback->resource_list)
+		weston_dmabuf_feedback_send(dmabuf_feedback, table, res, false);
+}
+
+static void
+dmabuf_feedback_resource_destroy(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+dmabuf_feedback_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct zwp_linux_dmabuf_feedback_v1_interface
+zwp_linux_dmabuf_feedback_implementation = {
+	dmabuf_feedback_destroy
+};
+
+static void
+dmabuf_feedback_bind(struct wl_client *client,
+		     struct wl_resource *linux_dmabuf_resource,
+		     uint32_t id,
+		     struct weston_dmabuf_feedback *dmabuf_feedback,
+		     struct weston_dmabuf_feedback_format_table *table)
+{
+	struct wl_resource *res;
+
+	res = wl_resource_create(client, &zwp_linux_dmabuf_feedback_v1_interface,
+				 wl_resource_get_version(linux_dmabuf_resource),
+				 id);
+	if (!res) {
+		wl_resource_post_no_memory(linux_dmabuf_resource);
+		return;
+	}
+
+	wl_list_insert(&dmabuf_feedback->resource_list,
+		       wl_resource_get_link(res));
+	wl_resource_set_implementation(res,
+				       &zwp_linux_dmabuf_feedback_implementation,
+				       dmabuf_feedback,
+				       dmabuf_feedback_resource_destroy);
+
+	weston_dmabuf_feedback_send(dmabuf_feedback, table, res, true);
+}
+
+static void
+linux_dmabuf_get_default_feedback(struct wl_client *client,
+				  struct wl_resource *resource,
+				  uint32_t id)
+{
+	struct weston_compositor *compositor =
+		wl_resource_get_user_data(resource);
+
+	dmabuf_feedback_bind(client, resource, id,
+			     compositor->default_dmabuf_feedback,
+			     compositor->dmabuf_feedback_format_table);
+}
+
+static void
+linux_dmabuf_get_surface_feedback(struct wl_client *client,
+				  struct wl_resource *resource,
+				  uint32_t id,
+				  struct wl_resource *surface_resource)
+{
+	struct weston_compositor *compositor =
+		wl_resource_get_user_data(resource);
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct weston_dmabuf_feedback *default_feedback =
+		compositor->default_dmabuf_feedback;
+	struct weston_dmabuf_feedback_format_table *table =
+		compositor->dmabuf_feedback_format_table;
+
+	/* Surfaces start with the renderer tranche of the default feedback,
+	 * the backend may add scanout tranches later */
+	if (!surface->dmabuf_feedback) {
+		surface->dmabuf_feedback =
+			weston_dmabuf_feedback_create(default_feedback->main_device);
+		if (!surface->dmabuf_feedback ||
+		    !weston_dmabuf_feedback_tranche_create(surface->dmabuf_feedback,
+							   table,
+							   default_feedback->main_device,
+							   0, RENDERER_PREF)) {
+			weston_dmabuf_feedback_destroy(surface->dmabuf_feedback);
+			surface->dmabuf_feedback = NULL;
+			wl_resource_post_no_memory(resource);
+			return;
+		}
+	}
+
+	dmabuf_feedback_bind(client, resource, id, surface->dmabuf_feedback,
+			     table);
+}
+
 static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_implementation = {
 	linux_dmabuf_destroy,
-	linux_dmabuf_create_params
+	linux_dmabuf_create_params,
+	linux_dmabuf_get_default_feedback,
+	linux_dmabuf_get_surface_feedback
 };
 
 static void
@@ -493,6 +943,10 @@ bind_linux_dmabuf(struct wl_client *client,
 	wl_resource_set_implementation(resource, &linux_dmabuf_implementation,
 				       compositor, NULL);
 
+	/* Version 4 clients get formats and modifiers from the feedback */
+	if (version >= ZWP_LINUX_DMABUF_V1_GET_DEFAULT_FEEDBACK_SINCE_VERSION)
+		return;
+
 	/*
 	 * Use EGL_EXT_image_dma_buf_import_modifiers to query and advertise
 	 * format/modifier codes.
@@ -540,14 +994,23 @@ bind_linux_dmabuf(struct wl_client *client,
  * lifetime. There is no way to deinit explicitly, globals will be reaped
  * when the wl_display gets destroyed.
  *
+ * Version 4, with dmabuf feedback, is advertised if the backend has set up
+ * weston_compositor::default_dmabuf_feedback before calling this.
+ *
  * \param compositor The compositor to init for.
  * \return Zero on success, -1 on failure.
  */
 WL_EXPORT int
 linux_dmabuf_setup(struct weston_compositor *compositor)
 {
+	int version = 3;
+
+	if (compositor->default_dmabuf_feedback &&
+	    compositor->dmabuf_feedback_format_table)
+		version = 4;
+
 	if (!wl_global_create(compositor->wl_display,
-			      &zwp_linux_dmabuf_v1_interface, 3,
+			      &zwp_linux_dmabuf_v1_interface, version,
 			      compositor, bind_linux_dmabuf))
 		return -1;
 
@@ -27,6 +27,10 @@
 #define WESTON_LINUX_DMABUF_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <wayland-util.h>
 
 #define MAX_DMABUF_PLANES 4
 #ifndef DRM_FORMAT_MOD_INVALID
@@ -80,6 +84,96 @@ struct linux_dmabuf_buffer {
 	bool direct_display;
 };
 
+/* One entry of the format table shared with clients, the layout is fixed
+ * by the zwp_linux_dmabuf_feedback_v1 protocol */
+struct weston_dmabuf_feedback_format_table_entry {
+	uint32_t format;
+	uint32_t pad;
+	uint64_t modifier;
+};
+
+/** Every format/modifier pair the renderer can import */
+struct weston_dmabuf_feedback_format_table {
+	int fd;
+	unsigned int size;
+
+	/* struct weston_dmabuf_feedback_format_table_entry */
+	struct wl_array entries;
+};
+
+enum weston_dmabuf_feedback_tranche_preference {
+	RENDERER_PREF = 0,
+	SCANOUT_PREF = 1
+};
+
+struct weston_dmabuf_feedback_tranche {
+	/* weston_dmabuf_feedback::tranche_list, by descending preference */
+	struct wl_list link;
+
+	dev_t target_device;
+	uint32_t flags; /* enum zwp_linux_dmabuf_feedback_v1_tranche_flags */
+	enum weston_dmabuf_feedback_tranche_preference preference;
+
+	/* uint16_t indices into the format table */
+	struct wl_array formats_indices;
+};
+
+enum weston_dmabuf_feedback_action {
+	ACTION_NONE = 0,
+	ACTION_ADD_SCANOUT_TRANCHE,
+	ACTION_REMOVE_SCANOUT_TRANCHE
+};
+
+struct weston_dmabuf_feedback {
+	dev_t main_device;
+	struct wl_list tranche_list;
+	struct wl_list resource_list;
+
+	/* debounces scanout tranche changes, see
+	 * weston_dmabuf_feedback_action_ready() */
+	enum weston_dmabuf_feedback_action action_needed;
+	struct timespec action_time;
+};
+
+struct weston_dmabuf_feedback_format_table *
+weston_dmabuf_feedback_format_table_create(struct weston_compositor *compositor);
+
+void
+weston_dmabuf_feedback_format_table_destroy(struct weston_dmabuf_feedback_format_table *table);
+
+struct weston_dmabuf_feedback *
+weston_dmabuf_feedback_create(dev_t main_device);
+
+void
+weston_dmabuf_feedback_destroy(struct weston_dmabuf_feedback *dmabuf_feedback);
+
+struct weston_dmabuf_feedback_tranche *
+weston_dmabuf_feedback_tranche_create(struct weston_dmabuf_feedback *dmabuf_feedback,
+				      struct weston_dmabuf_feedback_format_table *table,
+				      dev_t target_device, uint32_t flags,
+				      enum weston_dmabuf_feedback_tranche_preference preference);
+
+void
+weston_dmabuf_feedback_tranche_destroy(struct weston_dmabuf_feedback_tranche *tranche);
+
+bool
+weston_dmabuf_feedback_tranche_add_format(struct weston_dmabuf_feedback_tranche *tranche,
+					  struct weston_dmabuf_feedback_format_table *table,
+					  uint32_t format, uint64_t modifier);
+
+struct weston_dmabuf_feedback_tranche *
+weston_dmabuf_feedback_find_tranche(struct weston_dmabuf_feedback *dmabuf_feedback,
+				    enum weston_dmabuf_feedback_tranche_preference preference);
+
+bool
+weston_dmabuf_feedback_action_ready(struct weston_dmabuf_feedback *dmabuf_feedback,
+				    enum weston_dmabuf_feedback_action action,
+				    const struct timespec *now);
+
+void
+weston_dmabuf_feedback_send_all(struct weston_dmabuf_feedback *dmabuf_feedback,
+				struct weston_dmabuf_feedback_format_table *table);
+
 int
 linux_dmabuf_setup(struct weston_compositor *compositor);
 
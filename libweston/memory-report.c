@@ -0,0 +1,199 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libweston/libweston.h>
+#include <libweston/weston-log.h>
+#include "libweston-internal.h"
+
+/* Memory accounting.
+ *
+ * The compositor and the subsystems that keep caches, staging buffers or
+ * textures around report what they hold through memory_report_signal, one
+ * weston_memory_report_add() per kind of item. The 'memory' debug scope
+ * prints that report; the 'memory-trim' scope first asks everyone on
+ * memory_trim_signal to give back what can be recreated on demand, and
+ * prints the report before and after.
+ */
+
+struct weston_memory_report {
+	struct weston_log_subscription *sub;
+	unsigned int count;
+	uint64_t bytes;
+};
+
+/** Add an entry to a memory report
+ *
+ * \param report The report passed with memory_report_signal.
+ * \param subsystem Who holds the memory, e.g. "gl-renderer".
+ * \param item What kind of items they are, e.g. "textures".
+ * \param count The number of items.
+ * \param bytes The memory they take, approximately.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT void
+weston_memory_report_add(struct weston_memory_report *report,
+			 const char *subsystem, const char *item,
+			 unsigned int count, uint64_t bytes)
+{
+	report->count += count;
+	report->bytes += bytes;
+
+	weston_log_subscription_printf(report->sub,
+				       "  %-16s %-24s %8u %12" PRIu64 " KiB\n",
+				       subsystem, item, count,
+				       (bytes + 1023) / 1024);
+}
+
+static void
+memory_report_shm_buffers(struct weston_compositor *ec,
+			  struct weston_memory_report *report)
+{
+	struct weston_view *view;
+	struct weston_buffer *buffer;
+	unsigned int count = 0;
+	uint64_t bytes = 0;
+
+	/* each surface once, through its first view */
+	wl_list_for_each(view, &ec->view_list, link) {
+		if (view->surface->views.next != &view->surface_link)
+			continue;
+
+		buffer = view->surface->buffer_ref.buffer;
+		if (!buffer || !buffer->shm_buffer)
+			continue;
+
+		count++;
+		bytes += (uint64_t) wl_shm_buffer_get_stride(buffer->shm_buffer) *
+			 buffer->height;
+	}
+
+	weston_memory_report_add(report, "compositor", "shm buffer refs",
+				 count, bytes);
+}
+
+static void
+memory_report_print(struct weston_compositor *ec,
+		    struct weston_log_subscription *sub, const char *title)
+{
+	struct weston_memory_report report = { .sub = sub };
+
+	weston_log_subscription_printf(sub, "%s:\n", title);
+
+	weston_memory_report_add(&report, "compositor", "cursor images",
+				 ec->cursor_image_count,
+				 ec->cursor_image_bytes);
+	weston_compositor_keymap_cache_report(ec, &report);
+	memory_report_shm_buffers(ec, &report);
+
+	wl_signal_emit(&ec->memory_report_signal, &report);
+
+	weston_log_subscription_printf(sub,
+				       "  %-41s %8u %12" PRIu64 " KiB\n",
+				       "total", report.count,
+				       (report.bytes + 1023) / 1024);
+}
+
+/** Give back memory that can be recreated on demand
+ *
+ * \param compositor The compositor.
+ *
+ * Empties the cursor image and keymap caches and asks the renderer and
+ * the other subsystems listening on memory_trim_signal to drop their
+ * staging buffers, pooled allocations and caches. Nothing visible
+ * changes; the next uses that need them again are slower. Meant for when
+ * the host is short of memory.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT void
+weston_compositor_trim_memory(struct weston_compositor *compositor)
+{
+	weston_compositor_cursor_cache_destroy(compositor);
+	weston_compositor_keymap_cache_trim(compositor);
+
+	wl_signal_emit(&compositor->memory_trim_signal, compositor);
+}
+
+/**
+ * Called when the 'memory' debug scope is bound by a client. This one-shot
+ * weston-debug scope prints what each subsystem holds, and then terminates
+ * the stream.
+ */
+static void
+debug_memory_cb(struct weston_log_subscription *sub, void *data)
+{
+	struct weston_compositor *ec = data;
+
+	memory_report_print(ec, sub, "memory");
+	weston_log_subscription_complete(sub);
+}
+
+/**
+ * Called when the 'memory-trim' debug scope is bound by a client. This
+ * one-shot weston-debug scope trims the compositor's memory and prints the
+ * report before and after, and then terminates the stream.
+ */
+static void
+debug_memory_trim_cb(struct weston_log_subscription *sub, void *data)
+{
+	struct weston_compositor *ec = data;
+
+	memory_report_print(ec, sub, "before trim");
+	weston_compositor_trim_memory(ec);
+	memory_report_print(ec, sub, "after trim");
+	weston_log_subscription_complete(sub);
+}
+
+void
+weston_compositor_memory_report_init(struct weston_compositor *ec)
+{
+	wl_signal_init(&ec->memory_report_signal);
+	wl_signal_init(&ec->memory_trim_signal);
+
+	ec->debug_memory =
+		weston_compositor_add_log_scope(ec, "memory",
+						"Memory held by compositor subsystems\n",
+						debug_memory_cb, NULL, ec);
+	ec->debug_memory_trim =
+		weston_compositor_add_log_scope(ec, "memory-trim",
+						"Trim compositor memory, report before and after\n",
+						debug_memory_trim_cb, NULL, ec);
+}
+
+void
+weston_compositor_memory_report_destroy(struct weston_compositor *ec)
+{
+	weston_log_scope_destroy(ec->debug_memory);
+	ec->debug_memory = NULL;
+	weston_log_scope_destroy(ec->debug_memory_trim);
+	ec->debug_memory_trim = NULL;
+}
@@ -0,0 +1,544 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libweston/libweston.h>
+#include <libweston/weston-log.h>
+#include "backend.h"
+#include "libweston-internal.h"
+#include "presentation-time-server-protocol.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Histograms count microseconds in buckets of power of two ranges, each
+ * split into 1 << METRICS_SUB_BUCKET_BITS sub-buckets, so reported
+ * percentiles are within 25% of the real value. The last bucket also
+ * takes everything above 2^32 us. */
+#define METRICS_SUB_BUCKET_BITS 2
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_BUCKETS 128
+
+/* Recent values are reported over windows of this length. */
+#define METRICS_WINDOW_MSEC 10000
+
+/* Input which did not get an output repainted within this is assumed to
+ * not have affected it at all. */
+#define METRICS_INPUT_MAX_AGE_MSEC 1000
+
+/* Consecutive frames further apart than this were not a steady stream. */
+#define METRICS_FRAME_INTERVAL_MAX_MSEC 1000
+
+struct weston_metric_histogram {
+	uint64_t count;
+	uint64_t sum_usec;
+	uint64_t max_usec;
+	uint32_t buckets[METRICS_BUCKETS];
+};
+
+struct weston_output_metric {
+	struct weston_metric_histogram total;
+	struct weston_metric_histogram window;	/* being collected */
+	struct weston_metric_histogram last_window;
+};
+
+struct weston_output_metrics {
+	struct weston_output_metric metric[WESTON_OUTPUT_METRIC_COUNT];
+	struct timespec window_start;
+
+	/* CLOCK_MONOTONIC, zero when not set. */
+	struct timespec repaint_begin;	/* of the frame in flight */
+	struct timespec input_pending;	/* oldest input not yet repainted */
+	struct timespec frame_input;	/* oldest input in frame in flight */
+	struct timespec last_present;
+};
+
+static const char * const metric_names[WESTON_OUTPUT_METRIC_COUNT] = {
+	[WESTON_OUTPUT_METRIC_REPAINT] = "repaint",
+	[WESTON_OUTPUT_METRIC_PRESENT] = "present",
+	[WESTON_OUTPUT_METRIC_FRAME_INTERVAL] = "frame-interval",
+	[WESTON_OUTPUT_METRIC_INPUT] = "input-to-present",
+	[WESTON_OUTPUT_METRIC_CLIENT_ACK] = "client-ack",
+	[WESTON_OUTPUT_METRIC_REPAINT_PREDICTION] = "repaint-prediction-error",
+};
+
+static unsigned int
+histogram_bucket(uint64_t usec)
+{
+	unsigned int msb;
+	unsigned int idx;
+
+	if (usec < METRICS_SUB_BUCKETS)
+		return usec;
+
+	msb = 63 - __builtin_clzll(usec);
+	idx = (msb - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS +
+	      ((usec >> (msb - METRICS_SUB_BUCKET_BITS)) &
+	       (METRICS_SUB_BUCKETS - 1));
+
+	return MIN(idx, METRICS_BUCKETS - 1);
+}
+
+/* Highest value counted in the bucket. */
+static uint64_t
+histogram_bucket_max(unsigned int idx)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (idx < METRICS_SUB_BUCKETS)
+		return idx;
+
+	shift = idx / METRICS_SUB_BUCKETS - 1;
+	sub = METRICS_SUB_BUCKETS + idx % METRICS_SUB_BUCKETS;
+
+	return ((sub + 1) << shift) - 1;
+}
+
+static void
+histogram_add(struct weston_metric_histogram *h, uint64_t usec)
+{
+	h->count++;
+	h->sum_usec += usec;
+	h->max_usec = MAX(h->max_usec, usec);
+	h->buckets[histogram_bucket(usec)]++;
+}
+
+/* Upper bound of the given percentile, in permille. */
+static uint64_t
+histogram_percentile(const struct weston_metric_histogram *h,
+		     unsigned int permille)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	rank = (h->count * permille + 999) / 1000;
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return MIN(histogram_bucket_max(i), h->max_usec);
+	}
+
+	return h->max_usec;
+}
+
+static struct weston_output_metrics *
+output_metrics_get(struct weston_output *output)
+{
+	if (!output->metrics) {
+		output->metrics = zalloc(sizeof(*output->metrics));
+		if (!output->metrics)
+			return NULL;
+		clock_gettime(CLOCK_MONOTONIC,
+			      &output->metrics->window_start);
+	}
+
+	return output->metrics;
+}
+
+/* Start new windows when the current one is over. With nothing recorded
+ * for longer than a window, the last one is empty too. */
+static void
+output_metrics_rotate(struct weston_output_metrics *m,
+		      const struct timespec *now)
+{
+	int64_t elapsed = timespec_sub_to_msec(now, &m->window_start);
+	int i;
+
+	if (elapsed < METRICS_WINDOW_MSEC)
+		return;
+
+	for (i = 0; i < WESTON_OUTPUT_METRIC_COUNT; i++) {
+		struct weston_output_metric *metric = &m->metric[i];
+
+		if (elapsed < 2 * METRICS_WINDOW_MSEC)
+			metric->last_window = metric->window;
+		else
+			memset(&metric->last_window, 0,
+			       sizeof(metric->last_window));
+		memset(&metric->window, 0, sizeof(metric->window));
+	}
+
+	if (elapsed < 2 * METRICS_WINDOW_MSEC)
+		timespec_add_msec(&m->window_start, &m->window_start,
+				  METRICS_WINDOW_MSEC);
+	else
+		m->window_start = *now;
+}
+
+static void
+output_metrics_add(struct weston_output_metrics *m,
+		   enum weston_output_metric metric,
+		   const struct timespec *now, int64_t usec)
+{
+	struct weston_output_metric *om = &m->metric[metric];
+
+	if (usec < 0)
+		return;
+
+	output_metrics_rotate(m, now);
+	histogram_add(&om->total, usec);
+	histogram_add(&om->window, usec);
+}
+
+/** Record one value of an output metric
+ *
+ * \param output The output the value belongs to.
+ * \param metric The metric.
+ * \param usec The value in microseconds.
+ *
+ * The core records most metrics itself; backends use this for those only
+ * they know about, like WESTON_OUTPUT_METRIC_CLIENT_ACK and
+ * WESTON_OUTPUT_METRIC_REPAINT_PREDICTION. Must be called
+ * from the display loop thread.
+ *
+ * \ingroup output
+ */
+WL_EXPORT void
+weston_output_metrics_add(struct weston_output *output,
+			  enum weston_output_metric metric,
+			  int64_t usec)
+{
+	struct weston_output_metrics *m = output_metrics_get(output);
+	struct timespec now;
+
+	if (!m)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	output_metrics_add(m, metric, &now, usec);
+}
+
+/** Note an input event for input-to-present latency of all outputs
+ *
+ * Only the first input event since an output last started repainting
+ * counts, so the latency is that of the oldest input a frame can show.
+ */
+void
+weston_compositor_metrics_note_input(struct weston_compositor *compositor)
+{
+	struct weston_output *output;
+	struct timespec now = { 0, 0 };
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		struct weston_output_metrics *m = output_metrics_get(output);
+
+		if (!m || !timespec_is_zero(&m->input_pending))
+			continue;
+
+		if (timespec_is_zero(&now))
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		m->input_pending = now;
+	}
+}
+
+/* At TL_POINT core_repaint_begin. */
+void
+weston_output_metrics_repaint_begin(struct weston_output *output)
+{
+	struct weston_output_metrics *m = output_metrics_get(output);
+
+	if (!m)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &m->repaint_begin);
+
+	m->frame_input = m->input_pending;
+	m->input_pending.tv_sec = 0;
+	m->input_pending.tv_nsec = 0;
+	if (!timespec_is_zero(&m->frame_input) &&
+	    timespec_sub_to_msec(&m->repaint_begin, &m->frame_input) >
+	    METRICS_INPUT_MAX_AGE_MSEC) {
+		m->frame_input.tv_sec = 0;
+		m->frame_input.tv_nsec = 0;
+	}
+}
+
+/* At TL_POINT core_repaint_posted, when the frame was posted. */
+void
+weston_output_metrics_repaint_posted(struct weston_output *output)
+{
+	struct weston_output_metrics *m = output->metrics;
+	struct timespec now;
+
+	if (!m || timespec_is_zero(&m->repaint_begin))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	output_metrics_add(m, WESTON_OUTPUT_METRIC_REPAINT, &now,
+			   timespec_sub_to_nsec(&now, &m->repaint_begin) / 1000);
+}
+
+/* From weston_output_finish_frame(), with the CLOCK_MONOTONIC stamp. */
+void
+weston_output_metrics_presented(struct weston_output *output,
+				const struct timespec *stamp,
+				uint32_t presented_flags)
+{
+	struct weston_output_metrics *m = output->metrics;
+	struct timespec now;
+
+	if (!m)
+		return;
+
+	/* Restarting the repaint loop presents nothing. */
+	if (presented_flags & WP_PRESENTATION_FEEDBACK_INVALID ||
+	    timespec_is_zero(&m->repaint_begin)) {
+		m->last_present.tv_sec = 0;
+		m->last_present.tv_nsec = 0;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	output_metrics_add(m, WESTON_OUTPUT_METRIC_PRESENT, &now,
+			   timespec_sub_to_nsec(stamp, &m->repaint_begin) / 1000);
+
+	if (!timespec_is_zero(&m->frame_input))
+		output_metrics_add(m, WESTON_OUTPUT_METRIC_INPUT, &now,
+				   timespec_sub_to_nsec(stamp,
+							&m->frame_input) / 1000);
+
+	if (!timespec_is_zero(&m->last_present) &&
+	    timespec_sub_to_msec(stamp, &m->last_present) <=
+	    METRICS_FRAME_INTERVAL_MAX_MSEC)
+		output_metrics_add(m, WESTON_OUTPUT_METRIC_FRAME_INTERVAL, &now,
+				   timespec_sub_to_nsec(stamp,
+							&m->last_present) / 1000);
+
+	m->last_present = *stamp;
+	m->repaint_begin.tv_sec = 0;
+	m->repaint_begin.tv_nsec = 0;
+	m->frame_input.tv_sec = 0;
+	m->frame_input.tv_nsec = 0;
+}
+
+void
+weston_output_metrics_release(struct weston_output *output)
+{
+	free(output->metrics);
+	output->metrics = NULL;
+}
+
+static void
+print_histogram(FILE *fp, const struct weston_metric_histogram *h)
+{
+	fprintf(fp, "%8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+		" %8" PRIu64,
+		h->count, h->count ? h->sum_usec / h->count : 0,
+		histogram_percentile(h, 500), histogram_percentile(h, 990),
+		h->max_usec);
+}
+
+/** Print the metrics of all enabled outputs
+ *
+ * \return A newly allocated string, or NULL on failure.
+ *
+ * Times are in microseconds. "total" covers the whole lifetime of the
+ * output, "last" the last complete window of METRICS_WINDOW_MSEC.
+ */
+static char *
+weston_compositor_print_output_metrics(struct weston_compositor *ec)
+{
+	struct weston_output *output;
+	struct timespec now;
+	FILE *fp;
+	char *ret;
+	size_t len;
+	int i;
+
+	fp = open_memstream(&ret, &len);
+	if (!fp)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		struct weston_output_metrics *m = output->metrics;
+
+		fprintf(fp, "Output %d (%s):\n", output->id, output->name);
+		if (!m) {
+			fprintf(fp, "\tno frames\n");
+			continue;
+		}
+
+		output_metrics_rotate(m, &now);
+
+		fprintf(fp, "\t%-16s %44s | %-44s\n", "",
+			"total", "last window");
+		fprintf(fp, "\t%-16s", "usec");
+		for (i = 0; i < 2; i++)
+			fprintf(fp, "%s%8s %8s %8s %8s %8s", i ? " | " : " ",
+				"count", "mean", "p50", "p99", "max");
+		fprintf(fp, "\n");
+		for (i = 0; i < WESTON_OUTPUT_METRIC_COUNT; i++) {
+			if (m->metric[i].total.count == 0)
+				continue;
+
+			fprintf(fp, "\t%-16s ", metric_names[i]);
+			print_histogram(fp, &m->metric[i].total);
+			fprintf(fp, " | ");
+			print_histogram(fp, &m->metric[i].last_window);
+			fprintf(fp, "\n");
+		}
+	}
+
+	if (fclose(fp) != 0) {
+		free(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+/** Called when the 'output-metrics' debug scope is bound by a client.
+ * This one-shot weston-debug scope prints the frame time and latency
+ * histograms summary of all outputs, and then terminates the stream.
+ */
+void
+weston_output_metrics_debug_cb(struct weston_log_subscription *sub,
+			       void *data)
+{
+	struct weston_compositor *ec = data;
+	char *str = weston_compositor_print_output_metrics(ec);
+
+	if (str)
+		weston_log_subscription_printf(sub, "%s", str);
+	free(str);
+	weston_log_subscription_complete(sub);
+}
+
+/* Replace the stats file atomically, readers never see a partial one. */
+static void
+metrics_file_write(struct weston_compositor *ec)
+{
+	char *str;
+	char *tmp;
+	FILE *fp;
+	int err;
+
+	str = weston_compositor_print_output_metrics(ec);
+	if (!str)
+		return;
+
+	if (asprintf(&tmp, "%s.tmp", ec->metrics_file) < 0) {
+		free(str);
+		return;
+	}
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		weston_log("failed to write metrics file %s: %s\n",
+			   tmp, strerror(errno));
+		goto out;
+	}
+
+	fputs(str, fp);
+	err = fclose(fp);
+	if (err == 0)
+		err = rename(tmp, ec->metrics_file);
+	if (err != 0) {
+		weston_log("failed to write metrics file %s: %s\n",
+			   ec->metrics_file, strerror(errno));
+		unlink(tmp);
+	}
+
+out:
+	free(tmp);
+	free(str);
+}
+
+static int
+metrics_file_timer_handler(void *data)
+{
+	struct weston_compositor *ec = data;
+
+	metrics_file_write(ec);
+	wl_event_source_timer_update(ec->metrics_timer, METRICS_WINDOW_MSEC);
+
+	return 0;
+}
+
+/** Write output metrics into a file periodically
+ *
+ * \param compositor The compositor instance.
+ * \param path The file to write, or NULL to stop writing.
+ * \return 0 on success, -1 on failure.
+ *
+ * The file has the contents of the 'output-metrics' debug scope, and is
+ * replaced with an updated one every time a metrics window completes.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT int
+weston_compositor_set_metrics_file(struct weston_compositor *compositor,
+				   const char *path)
+{
+	struct wl_event_loop *loop;
+
+	weston_compositor_metrics_destroy(compositor);
+	if (!path)
+		return 0;
+
+	compositor->metrics_file = strdup(path);
+	if (!compositor->metrics_file)
+		return -1;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	compositor->metrics_timer =
+		wl_event_loop_add_timer(loop, metrics_file_timer_handler,
+					compositor);
+	if (!compositor->metrics_timer) {
+		weston_compositor_metrics_destroy(compositor);
+		return -1;
+	}
+	wl_event_source_timer_update(compositor->metrics_timer,
+				     METRICS_WINDOW_MSEC);
+
+	return 0;
+}
+
+void
+weston_compositor_metrics_destroy(struct weston_compositor *compositor)
+{
+	if (compositor->metrics_timer)
+		wl_event_source_remove(compositor->metrics_timer);
+	compositor->metrics_timer = NULL;
+
+	free(compositor->metrics_file);
+	compositor->metrics_file = NULL;
+}
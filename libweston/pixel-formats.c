@@ -28,12 +28,22 @@
 
 #include <endian.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <drm_fourcc.h>
 #include <wayland-client-protocol.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_KERNELS_X86 1
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "shared/helpers.h"
 #include "wayland-util.h"
 #include "pixel-formats.h"
@@ -311,6 +321,15 @@ static const struct pixel_format_info pixel_format_table[] = {
 		.hsub = 2,
 		.vsub = 2,
 	},
+#ifdef DRM_FORMAT_P010
+	{
+		DRM_FORMAT(P010),
+		SAMPLER_TYPE(EGL_TEXTURE_Y_UV_WL),
+		.num_planes = 2,
+		.hsub = 2,
+		.vsub = 2,
+	},
+#endif
 	{
 		DRM_FORMAT(NV21),
 		SAMPLER_TYPE(EGL_TEXTURE_Y_UV_WL),
@@ -469,6 +488,13 @@ pixel_format_is_opaque(const struct pixel_format_info *info)
 	return !info->opaque_substitute;
 }
 
+WL_EXPORT bool
+pixel_format_is_yuv(const struct pixel_format_info *info)
+{
+	/* All RGB formats in the table give their channel sizes. */
+	return info->bits.r == 0;
+}
+
 WL_EXPORT const struct pixel_format_info *
 pixel_format_get_opaque_substitute(const struct pixel_format_info *info)
 {
@@ -514,3 +540,522 @@ pixel_format_height_for_plane(const struct pixel_format_info *info,
 
 	return height / info->vsub;
 }
+
+/*
+ * Conversion kernels
+ *
+ * Each kernel has a scalar version and, where it pays off, SSE2, SSSE3
+ * or NEON versions. On x86 the vector versions are built with target
+ * attributes and picked at runtime from what the CPU supports, so they
+ * are used even when the rest of libweston is built for a baseline CPU.
+ */
+
+static inline uint32_t
+multiply_alpha(uint32_t alpha, uint32_t color)
+{
+	uint32_t temp = (alpha * color) + 0x80;
+
+	return (temp + (temp >> 8)) >> 8;
+}
+
+static void
+swap_rb_scalar(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t v = src[i];
+
+		dst[i] = (v & 0xff00ff00) |
+			 ((v >> 16) & 0x000000ff) |
+			 ((v << 16) & 0x00ff0000);
+	}
+}
+
+static void
+premultiply_scalar(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t v = src[i];
+		uint32_t a = v >> 24;
+
+		dst[i] = (a << 24) |
+			 (multiply_alpha(a, (v >> 16) & 0xff) << 16) |
+			 (multiply_alpha(a, (v >> 8) & 0xff) << 8) |
+			 multiply_alpha(a, v & 0xff);
+	}
+}
+
+static void
+rgb565_to_xrgb8888_scalar(uint32_t *dst, const uint16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t r = (src[i] >> 11) & 0x1f;
+		uint32_t g = (src[i] >> 5) & 0x3f;
+		uint32_t b = src[i] & 0x1f;
+
+		dst[i] = 0xff000000 |
+			 (((r << 3) | (r >> 2)) << 16) |
+			 (((g << 2) | (g >> 4)) << 8) |
+			 ((b << 3) | (b >> 2));
+	}
+}
+
+static void
+xrgb8888_to_rgb565_scalar(uint16_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = ((src[i] >> 8) & 0xf800) |
+			 ((src[i] >> 5) & 0x07e0) |
+			 ((src[i] >> 3) & 0x001f);
+}
+
+static void
+extract_alpha_scalar(uint8_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = src[i] >> 24;
+}
+
+#if defined(PIXEL_KERNELS_X86)
+__attribute__((target("sse2"))) static void
+swap_rb_sse2(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	const __m128i ag = _mm_set1_epi32(0xff00ff00);
+	const __m128i rb = _mm_set1_epi32(0x00ff00ff);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i s = _mm_and_si128(v, rb);
+
+		s = _mm_or_si128(_mm_srli_epi32(s, 16), _mm_slli_epi32(s, 16));
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_or_si128(_mm_and_si128(v, ag), s));
+	}
+
+	swap_rb_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("ssse3"))) static void
+swap_rb_ssse3(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+					      10, 9, 8, 11, 14, 13, 12, 15);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_shuffle_epi8(v, shuffle));
+	}
+
+	swap_rb_scalar(dst + i, src + i, n - i);
+}
+
+/* Premultiplies two pixels unpacked to 16 bit lanes, with the same
+ * rounding as multiply_alpha(). Alpha is multiplied by 0xff, which
+ * keeps it as it is. */
+__attribute__((target("sse2"))) static inline __m128i
+premultiply_lanes_sse2(__m128i v)
+{
+	const __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i one = _mm_set_epi16(0xff, 0, 0, 0, 0xff, 0, 0, 0);
+	const __m128i bias = _mm_set1_epi16(0x80);
+	__m128i a, t;
+
+	a = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_or_si128(_mm_and_si128(a, rgb), one);
+
+	t = _mm_add_epi16(_mm_mullo_epi16(v, a), bias);
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2"))) static void
+premultiply_sse2(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i lo = premultiply_lanes_sse2(_mm_unpacklo_epi8(v, zero));
+		__m128i hi = premultiply_lanes_sse2(_mm_unpackhi_epi8(v, zero));
+
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_packus_epi16(lo, hi));
+	}
+
+	premultiply_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+rgb565_lanes_sse2(__m128i p)
+{
+	const __m128i mask5 = _mm_set1_epi32(0x1f);
+	const __m128i mask6 = _mm_set1_epi32(0x3f);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	__m128i r, g, b;
+
+	r = _mm_and_si128(_mm_srli_epi32(p, 11), mask5);
+	g = _mm_and_si128(_mm_srli_epi32(p, 5), mask6);
+	b = _mm_and_si128(p, mask5);
+	r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+	g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+	b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+
+	return _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(r, 16)),
+			    _mm_or_si128(_mm_slli_epi32(g, 8), b));
+}
+
+__attribute__((target("sse2"))) static void
+rgb565_to_xrgb8888_sse2(uint32_t *dst, const uint16_t *src, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 rgb565_lanes_sse2(_mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_si128((__m128i *) (dst + i + 4),
+				 rgb565_lanes_sse2(_mm_unpackhi_epi16(v, zero)));
+	}
+
+	rgb565_to_xrgb8888_scalar(dst + i, src + i, n - i);
+}
+
+/* Packs to 16 bit lanes with a bias, as the only pack is signed. */
+__attribute__((target("sse2"))) static inline __m128i
+xrgb8888_lanes_sse2(__m128i p)
+{
+	__m128i v;
+
+	v = _mm_or_si128(
+		_mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xf800)),
+		_mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07e0)));
+	v = _mm_or_si128(v,
+		_mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001f)));
+
+	return _mm_sub_epi32(v, _mm_set1_epi32(0x8000));
+}
+
+__attribute__((target("sse2"))) static void
+xrgb8888_to_rgb565_sse2(uint16_t *dst, const uint32_t *src, size_t n)
+{
+	const __m128i bias = _mm_set1_epi16(-0x8000);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *) (src + i + 4));
+		__m128i v = _mm_packs_epi32(xrgb8888_lanes_sse2(lo),
+					    xrgb8888_lanes_sse2(hi));
+
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_sub_epi16(v, bias));
+	}
+
+	xrgb8888_to_rgb565_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+extract_alpha_sse2(uint8_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i a1 = _mm_loadu_si128((const __m128i *) (src + i + 4));
+		__m128i a2 = _mm_loadu_si128((const __m128i *) (src + i + 8));
+		__m128i a3 = _mm_loadu_si128((const __m128i *) (src + i + 12));
+
+		a0 = _mm_packs_epi32(_mm_srli_epi32(a0, 24),
+				     _mm_srli_epi32(a1, 24));
+		a2 = _mm_packs_epi32(_mm_srli_epi32(a2, 24),
+				     _mm_srli_epi32(a3, 24));
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_packus_epi16(a0, a2));
+	}
+
+	extract_alpha_scalar(dst + i, src + i, n - i);
+}
+#endif /* PIXEL_KERNELS_X86 */
+
+#if defined(__ARM_NEON)
+static void
+swap_rb_neon(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *) (src + i));
+		uint8x16_t t = v.val[0];
+
+		v.val[0] = v.val[2];
+		v.val[2] = t;
+		vst4q_u8((uint8_t *) (dst + i), v);
+	}
+
+	swap_rb_scalar(dst + i, src + i, n - i);
+}
+
+static inline uint8x16_t
+multiply_alpha_neon(uint8x16_t alpha, uint8x16_t color)
+{
+	const uint16x8_t bias = vdupq_n_u16(0x80);
+	uint16x8_t lo, hi;
+
+	lo = vmlal_u8(bias, vget_low_u8(alpha), vget_low_u8(color));
+	hi = vmlal_u8(bias, vget_high_u8(alpha), vget_high_u8(color));
+
+	return vcombine_u8(vaddhn_u16(lo, vshrq_n_u16(lo, 8)),
+			   vaddhn_u16(hi, vshrq_n_u16(hi, 8)));
+}
+
+static void
+premultiply_neon(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *) (src + i));
+
+		v.val[0] = multiply_alpha_neon(v.val[3], v.val[0]);
+		v.val[1] = multiply_alpha_neon(v.val[3], v.val[1]);
+		v.val[2] = multiply_alpha_neon(v.val[3], v.val[2]);
+		vst4q_u8((uint8_t *) (dst + i), v);
+	}
+
+	premultiply_scalar(dst + i, src + i, n - i);
+}
+
+static void
+rgb565_to_xrgb8888_neon(uint32_t *dst, const uint16_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		uint16x8_t p = vld1q_u16(src + i);
+		uint8x8_t r = vmovn_u16(vshrq_n_u16(p, 8));
+		uint8x8_t g = vmovn_u16(vshrq_n_u16(p, 3));
+		uint8x8_t b = vmovn_u16(vshlq_n_u16(p, 3));
+		uint8x8x4_t v;
+
+		r = vand_u8(r, vdup_n_u8(0xf8));
+		g = vand_u8(g, vdup_n_u8(0xfc));
+		v.val[0] = vorr_u8(b, vshr_n_u8(b, 5));
+		v.val[1] = vorr_u8(g, vshr_n_u8(g, 6));
+		v.val[2] = vorr_u8(r, vshr_n_u8(r, 5));
+		v.val[3] = vdup_n_u8(0xff);
+		vst4_u8((uint8_t *) (dst + i), v);
+	}
+
+	rgb565_to_xrgb8888_scalar(dst + i, src + i, n - i);
+}
+
+static void
+xrgb8888_to_rgb565_neon(uint16_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		uint8x8x4_t v = vld4_u8((const uint8_t *) (src + i));
+		uint16x8_t p;
+
+		p = vshll_n_u8(vand_u8(v.val[2], vdup_n_u8(0xf8)), 8);
+		p = vorrq_u16(p, vshll_n_u8(vand_u8(v.val[1],
+						    vdup_n_u8(0xfc)), 3));
+		p = vorrq_u16(p, vmovl_u8(vshr_n_u8(v.val[0], 3)));
+		vst1q_u16(dst + i, p);
+	}
+
+	xrgb8888_to_rgb565_scalar(dst + i, src + i, n - i);
+}
+
+static void
+extract_alpha_neon(uint8_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *) (src + i));
+
+		vst1q_u8(dst + i, v.val[3]);
+	}
+
+	extract_alpha_scalar(dst + i, src + i, n - i);
+}
+#endif /* __ARM_NEON */
+
+static const struct pixel_kernels pixel_kernels_scalar = {
+	.name = "scalar",
+	.swap_rb = swap_rb_scalar,
+	.premultiply = premultiply_scalar,
+	.rgb565_to_xrgb8888 = rgb565_to_xrgb8888_scalar,
+	.xrgb8888_to_rgb565 = xrgb8888_to_rgb565_scalar,
+	.extract_alpha = extract_alpha_scalar,
+};
+
+#if defined(PIXEL_KERNELS_X86)
+static const struct pixel_kernels pixel_kernels_sse2 = {
+	.name = "sse2",
+	.swap_rb = swap_rb_sse2,
+	.premultiply = premultiply_sse2,
+	.rgb565_to_xrgb8888 = rgb565_to_xrgb8888_sse2,
+	.xrgb8888_to_rgb565 = xrgb8888_to_rgb565_sse2,
+	.extract_alpha = extract_alpha_sse2,
+};
+
+/* SSSE3 only adds a byte shuffle, the rest stays SSE2. */
+static const struct pixel_kernels pixel_kernels_ssse3 = {
+	.name = "ssse3",
+	.swap_rb = swap_rb_ssse3,
+	.premultiply = premultiply_sse2,
+	.rgb565_to_xrgb8888 = rgb565_to_xrgb8888_sse2,
+	.xrgb8888_to_rgb565 = xrgb8888_to_rgb565_sse2,
+	.extract_alpha = extract_alpha_sse2,
+};
+#elif defined(__ARM_NEON)
+static const struct pixel_kernels pixel_kernels_neon = {
+	.name = "neon",
+	.swap_rb = swap_rb_neon,
+	.premultiply = premultiply_neon,
+	.rgb565_to_xrgb8888 = rgb565_to_xrgb8888_neon,
+	.xrgb8888_to_rgb565 = xrgb8888_to_rgb565_neon,
+	.extract_alpha = extract_alpha_neon,
+};
+#endif
+
+/* Fills variants with every table the CPU can run, the best last. */
+static int
+pixel_kernels_supported(const struct pixel_kernels **variants)
+{
+	int n = 0;
+
+	variants[n++] = &pixel_kernels_scalar;
+#if defined(PIXEL_KERNELS_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		variants[n++] = &pixel_kernels_sse2;
+	if (__builtin_cpu_supports("ssse3"))
+		variants[n++] = &pixel_kernels_ssse3;
+#elif defined(__ARM_NEON)
+	variants[n++] = &pixel_kernels_neon;
+#endif
+
+	return n;
+}
+
+static struct pixel_kernels pixel_kernels;
+static pthread_once_t pixel_kernels_once = PTHREAD_ONCE_INIT;
+
+static void
+pixel_kernels_init(void)
+{
+	const struct pixel_kernels *variants[PIXEL_KERNELS_MAX_VARIANTS];
+	int n;
+
+	n = pixel_kernels_supported(variants);
+	pixel_kernels = *variants[n - 1];
+}
+
+#ifdef UNIT_TEST
+WL_EXPORT int
+pixel_kernels_get_variants(const struct pixel_kernels **variants)
+{
+	return pixel_kernels_supported(variants);
+}
+#endif
+
+static const struct pixel_kernels *
+get_pixel_kernels(void)
+{
+	pthread_once(&pixel_kernels_once, pixel_kernels_init);
+
+	return &pixel_kernels;
+}
+
+WL_EXPORT void
+pixel_row_swap_rb(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	get_pixel_kernels()->swap_rb(dst, src, n);
+}
+
+WL_EXPORT void
+pixel_row_premultiply(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	get_pixel_kernels()->premultiply(dst, src, n);
+}
+
+WL_EXPORT void
+pixel_row_unpremultiply(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i;
+
+	/* a division per channel, there is no vector version of this */
+	for (i = 0; i < n; i++) {
+		uint32_t v = src[i];
+		uint32_t a = v >> 24;
+		uint32_t r, g, b;
+
+		if (a == 0 || a == 0xff) {
+			dst[i] = a ? v : 0;
+			continue;
+		}
+
+		r = (((v >> 16) & 0xff) * 0xff + a / 2) / a;
+		g = (((v >> 8) & 0xff) * 0xff + a / 2) / a;
+		b = ((v & 0xff) * 0xff + a / 2) / a;
+		dst[i] = (a << 24) | (MIN(r, 0xffu) << 16) |
+			 (MIN(g, 0xffu) << 8) | MIN(b, 0xffu);
+	}
+}
+
+WL_EXPORT void
+pixel_row_rgb565_to_xrgb8888(uint32_t *dst, const uint16_t *src, size_t n)
+{
+	get_pixel_kernels()->rgb565_to_xrgb8888(dst, src, n);
+}
+
+WL_EXPORT void
+pixel_row_xrgb8888_to_rgb565(uint16_t *dst, const uint32_t *src, size_t n)
+{
+	get_pixel_kernels()->xrgb8888_to_rgb565(dst, src, n);
+}
+
+WL_EXPORT void
+pixel_row_extract_alpha(uint8_t *dst, const uint32_t *src, size_t n)
+{
+	get_pixel_kernels()->extract_alpha(dst, src, n);
+}
+
+WL_EXPORT void
+pixel_copy_rows(void *dst, int dst_stride, const void *src, int src_stride,
+		size_t row_bytes, int height, bool y_flip)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	int i;
+
+	if (y_flip) {
+		s += (ptrdiff_t) src_stride * (height - 1);
+		src_stride = -src_stride;
+	}
+
+	for (i = 0; i < height; i++) {
+		memcpy(d, s, row_bytes);
+		d += dst_stride;
+		s += src_stride;
+	}
+}
@@ -26,6 +26,7 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 /**
  * Contains information about pixel formats, mapping format codes from
@@ -189,6 +190,15 @@ pixel_format_get_plane_count(const struct pixel_format_info *format);
 bool
 pixel_format_is_opaque(const struct pixel_format_info *format);
 
+/**
+ * Determine if a pixel format is YUV
+ *
+ * @param format Pixel format info structure
+ * @returns True if the format stores luma and chroma, false if it is RGB
+ */
+bool
+pixel_format_is_yuv(const struct pixel_format_info *format);
+
 /**
  * Get compatible opaque equivalent for a format
  *
@@ -260,3 +270,115 @@ unsigned int
 pixel_format_height_for_plane(const struct pixel_format_info *format,
 			      unsigned int plane,
 			      unsigned int height);
+
+/**
+ * Swap the red and blue channels of a row of 32 bpp pixels
+ *
+ * Converts between ARGB8888 and ABGR8888 (or their X variants) as
+ * pixman sees them. The conversion functions pick vectorized versions
+ * at runtime where the CPU supports them; dst may be the same as src.
+ *
+ * @param dst Destination pixels
+ * @param src Source pixels
+ * @param n Number of pixels
+ */
+void
+pixel_row_swap_rb(uint32_t *dst, const uint32_t *src, size_t n);
+
+/**
+ * Premultiply a row of ARGB8888 pixels with their alpha
+ *
+ * Rounds like pixman does, alpha itself is kept.
+ *
+ * @param dst Destination pixels
+ * @param src Source pixels, not premultiplied
+ * @param n Number of pixels
+ */
+void
+pixel_row_premultiply(uint32_t *dst, const uint32_t *src, size_t n);
+
+/**
+ * Undo the alpha premultiplication of a row of ARGB8888 pixels
+ *
+ * Fully transparent pixels become 0.
+ *
+ * @param dst Destination pixels, not premultiplied
+ * @param src Source pixels
+ * @param n Number of pixels
+ */
+void
+pixel_row_unpremultiply(uint32_t *dst, const uint32_t *src, size_t n);
+
+/**
+ * Convert a row of RGB565 pixels to XRGB8888
+ *
+ * Channels are widened by replicating their high bits, X is set to 0xff.
+ *
+ * @param dst Destination pixels
+ * @param src Source pixels
+ * @param n Number of pixels
+ */
+void
+pixel_row_rgb565_to_xrgb8888(uint32_t *dst, const uint16_t *src, size_t n);
+
+/**
+ * Convert a row of XRGB8888 pixels to RGB565, truncating the channels
+ *
+ * @param dst Destination pixels
+ * @param src Source pixels
+ * @param n Number of pixels
+ */
+void
+pixel_row_xrgb8888_to_rgb565(uint16_t *dst, const uint32_t *src, size_t n);
+
+/**
+ * Extract the alpha channel of a row of ARGB8888 pixels as A8
+ *
+ * @param dst Destination alpha values
+ * @param src Source pixels
+ * @param n Number of pixels
+ */
+void
+pixel_row_extract_alpha(uint8_t *dst, const uint32_t *src, size_t n);
+
+/**
+ * Copy rows of an image, optionally flipping it vertically
+ *
+ * @param dst Destination of the first row
+ * @param dst_stride Destination stride in bytes
+ * @param src Source of the first row
+ * @param src_stride Source stride in bytes
+ * @param row_bytes Bytes to copy per row
+ * @param height Number of rows
+ * @param y_flip Whether the last source row becomes the first
+ */
+void
+pixel_copy_rows(void *dst, int dst_stride, const void *src, int src_stride,
+		size_t row_bytes, int height, bool y_flip);
+
+#define PIXEL_KERNELS_MAX_VARIANTS 4
+
+/** A set of row conversion kernels for one instruction set */
+struct pixel_kernels {
+	const char *name;
+	void (*swap_rb)(uint32_t *dst, const uint32_t *src, size_t n);
+	void (*premultiply)(uint32_t *dst, const uint32_t *src, size_t n);
+	void (*rgb565_to_xrgb8888)(uint32_t *dst, const uint16_t *src,
+				   size_t n);
+	void (*xrgb8888_to_rgb565)(uint16_t *dst, const uint32_t *src,
+				   size_t n);
+	void (*extract_alpha)(uint8_t *dst, const uint32_t *src, size_t n);
+};
+
+#ifdef UNIT_TEST
+/**
+ * Get every kernel set this CPU can run
+ *
+ * The scalar set comes first and is the reference for the others.
+ *
+ * @param variants Array of at least PIXEL_KERNELS_MAX_VARIANTS entries
+ * @return Number of entries filled in
+ */
+int
+pixel_kernels_get_variants(const struct pixel_kernels **variants);
+#endif
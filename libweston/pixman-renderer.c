@@ -28,11 +28,19 @@
 #include "config.h"
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "pixman-renderer.h"
+#include "pixel-formats.h"
 #include "shared/helpers.h"
 
 #include <linux/input.h>
@@ -42,14 +50,39 @@ struct pixman_output_state {
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
 	pixman_region32_t *hw_extra_damage;
+	int band_threads;
+	bool hw_buffer_uncached;
+
+	/* Views at the bottom of the scene in static layers, composited
+	 * into one image, so that damage over them is repainted with one
+	 * composite. See pixman_renderer_prepare_flat(). */
+	pixman_image_t *flat_image;
+	pixman_region32_t flat_valid; /* global, pixels up to date */
+	pixman_region32_t flat_clip; /* global, covered by views above */
+	uint64_t flat_signature;
+	int flat_views; /* drawn from flat_image in this repaint */
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	/* Taken while a solid fill image is composited from, as that sets
+	 * its transform and filter, and outputs may be repainted in
+	 * parallel. Bits images are composited through aliases instead. */
+	pthread_mutex_t image_mutex;
+	/* of image, when that is a solid fill */
+	pixman_color_t solid_color;
+	/* image resampled once to the scale of the output that first drew
+	 * the surface, when that differs from the buffer scale, so that
+	 * translated views are blitted from it; created under image_mutex */
+	pixman_image_t *scaled_image;
+	int scaled_scale;
+	struct weston_matrix scaled_surface_to_buffer;
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_release_reference buffer_release_ref;
+	/* bumped as the content changes, see flat_run_collect() */
+	uint32_t content_serial;
 
 	struct wl_listener buffer_destroy_listener;
 	struct wl_listener surface_destroy_listener;
@@ -61,6 +94,8 @@ struct pixman_renderer {
 
 	int repaint_debug;
 	pixman_image_t *debug_color;
+	pthread_mutex_t debug_mutex;
+	struct pixman_band_pool *band_pool;
 	struct weston_binding *debug_binding;
 
 	struct wl_signal destroy_signal;
@@ -125,10 +160,18 @@ pixman_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+/* With a shadow image, the scene is rendered into it unzoomed, and zoom is
+ * applied by copy_to_hw_buffer(). See weston_output_zoom::offscreen. */
+static bool
+output_zoom_offscreen(struct weston_output *output)
+{
+	return output->zoom.active && output->zoom.offscreen;
+}
+
 static void
 region_global_to_output(struct weston_output *output, pixman_region32_t *region)
 {
-	if (output->zoom.active) {
+	if (output->zoom.active && !output->zoom.offscreen) {
 		weston_matrix_transform_region(region, &output->matrix, region);
 	} else {
 		pixman_region32_translate(region, -output->x, -output->y);
@@ -161,14 +204,18 @@ weston_matrix_to_pixman_transform(pixman_transform_t *pt,
 static void
 pixman_renderer_compute_transform(pixman_transform_t *transform_out,
 				  struct weston_view *ev,
-				  struct weston_output *output)
+				  struct weston_output *output,
+				  const struct weston_matrix *surface_to_source)
 {
 	struct weston_matrix matrix;
 
 	/* Set up the source transformation based on the surface
 	   position, the output position/transform/scale and the client
 	   specified buffer transform/scale */
-	matrix = output->inverse_matrix;
+	if (output_zoom_offscreen(output))
+		matrix = output->zoom.scene_inverse;
+	else
+		matrix = output->inverse_matrix;
 
 	if (ev->transform.enabled) {
 		weston_matrix_multiply(&matrix, &ev->transform.inverse);
@@ -177,7 +224,7 @@ pixman_renderer_compute_transform(pixman_transform_t *transform_out,
 					-ev->geometry.x, -ev->geometry.y, 0);
 	}
 
-	weston_matrix_multiply(&matrix, &ev->surface->surface_to_buffer_matrix);
+	weston_matrix_multiply(&matrix, surface_to_source);
 
 	weston_matrix_to_pixman_transform(transform_out, &matrix);
 }
@@ -321,6 +368,99 @@ composite_clipped(pixman_image_t *src,
 	}
 }
 
+/* New image for the same pixels, so that compositing from it doesn't change
+ * the properties of an image another thread may be compositing from too.
+ * NULL for images without pixel data, such as solid fills.
+ */
+static pixman_image_t *
+create_image_alias(pixman_image_t *image)
+{
+	uint32_t *data = pixman_image_get_data(image);
+
+	if (!data)
+		return NULL;
+
+	return pixman_image_create_bits_no_clear(pixman_image_get_format(image),
+						 pixman_image_get_width(image),
+						 pixman_image_get_height(image),
+						 data,
+						 pixman_image_get_stride(image));
+}
+
+static void
+surface_state_drop_scaled_image(struct pixman_surface_state *ps)
+{
+	if (ps->scaled_image) {
+		pixman_image_unref(ps->scaled_image);
+		ps->scaled_image = NULL;
+	}
+}
+
+/* The surface resampled to the output scale, or NULL if the view is
+ * drawn from the buffer directly. Only the first scale seen is cached,
+ * other outputs keep resampling on every repaint.
+ */
+static pixman_image_t *
+surface_get_scaled_image(struct pixman_surface_state *ps,
+			 struct weston_view *ev, struct weston_output *output)
+{
+	struct weston_surface *surface = ev->surface;
+	int scale = output->current_scale;
+	int width = surface->width * scale;
+	int height = surface->height * scale;
+	struct weston_matrix matrix;
+	pixman_transform_t transform;
+	pixman_image_t *src_image;
+	pixman_image_t *scaled_image;
+
+	if (!view_transformation_is_translation(ev) ||
+	    scale == surface->buffer_viewport.buffer.scale ||
+	    !pixman_image_get_data(ps->image) || width <= 0 || height <= 0)
+		return NULL;
+
+	pthread_mutex_lock(&ps->image_mutex);
+
+	/* The surface size or viewport changed without new content. */
+	if (ps->scaled_image && ps->scaled_scale == scale &&
+	    (pixman_image_get_width(ps->scaled_image) != width ||
+	     pixman_image_get_height(ps->scaled_image) != height ||
+	     memcmp(ps->scaled_surface_to_buffer.d,
+		    surface->surface_to_buffer_matrix.d,
+		    sizeof ps->scaled_surface_to_buffer.d) != 0))
+		surface_state_drop_scaled_image(ps);
+
+	if (!ps->scaled_image) {
+		weston_matrix_init(&matrix);
+		weston_matrix_scale(&matrix, 1.0f / scale, 1.0f / scale, 1);
+		weston_matrix_multiply(&matrix,
+				       &surface->surface_to_buffer_matrix);
+		weston_matrix_to_pixman_transform(&transform, &matrix);
+
+		src_image = create_image_alias(ps->image);
+		ps->scaled_image =
+			pixman_image_create_bits(pixman_image_get_format(ps->image),
+						 width, height, NULL, 0);
+		if (src_image && ps->scaled_image) {
+			composite_whole(PIXMAN_OP_SRC, src_image, NULL,
+					ps->scaled_image, &transform,
+					PIXMAN_FILTER_BILINEAR);
+			ps->scaled_scale = scale;
+			ps->scaled_surface_to_buffer =
+				surface->surface_to_buffer_matrix;
+		} else {
+			surface_state_drop_scaled_image(ps);
+		}
+		if (src_image)
+			pixman_image_unref(src_image);
+	}
+
+	scaled_image = ps->scaled_scale == scale ? ps->scaled_image : NULL;
+
+	pthread_mutex_unlock(&ps->image_mutex);
+
+	return scaled_image;
+}
+
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
@@ -329,42 +469,54 @@ composite_clipped(pixman_image_t *src,
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
  * \param pixman_op Compositing operator, either SRC or OVER.
+ * \param target_image The image to paint into, the output's buffer or an
+ *                     alias of it.
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
-	       pixman_op_t pixman_op)
+	       pixman_op_t pixman_op,
+	       pixman_image_t *target_image)
 {
 	struct pixman_renderer *pr =
 		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
-	pixman_image_t *target_image;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
 	pixman_image_t *mask_image;
+	pixman_image_t *src_image;
+	pixman_image_t *scaled_image = NULL;
+	struct weston_matrix surface_to_scaled;
 	pixman_color_t mask = { 0, };
 
-	if (po->shadow_image)
-		target_image = po->shadow_image;
-	else
-		target_image = po->hw_buffer;
-
  	/* Clip rendering to the damaged output region */
 	pixman_image_set_clip_region32(target_image, repaint_output);
 
-	pixman_renderer_compute_transform(&transform, ev, output);
-
-	if (ev->transform.enabled || output->current_scale != vp->buffer.scale)
-		filter = PIXMAN_FILTER_BILINEAR;
-	else
-		filter = PIXMAN_FILTER_NEAREST;
-
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
 
+	if (!source_clip)
+		scaled_image = surface_get_scaled_image(ps, ev, output);
+
+	if (scaled_image) {
+		weston_matrix_init(&surface_to_scaled);
+		weston_matrix_scale(&surface_to_scaled, output->current_scale,
+				    output->current_scale, 1);
+		pixman_renderer_compute_transform(&transform, ev, output,
+						  &surface_to_scaled);
+		filter = PIXMAN_FILTER_NEAREST;
+	} else {
+		pixman_renderer_compute_transform(&transform, ev, output,
+				&ev->surface->surface_to_buffer_matrix);
+		if (ev->transform.enabled ||
+		    output->current_scale != vp->buffer.scale)
+			filter = PIXMAN_FILTER_BILINEAR;
+		else
+			filter = PIXMAN_FILTER_NEAREST;
+	}
+
 	if (ev->alpha < 1.0) {
 		mask.alpha = 0xffff * ev->alpha;
 		mask_image = pixman_image_create_solid_fill(&mask);
@@ -372,12 +524,21 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		mask_image = NULL;
 	}
 
-	if (source_clip)
+	if (source_clip) {
+		/* composites from boxes of its own */
 		composite_clipped(ps->image, mask_image, target_image,
 				  &transform, filter, source_clip);
-	else
+	} else if ((src_image = create_image_alias(scaled_image ?
+						   scaled_image : ps->image))) {
+		composite_whole(pixman_op, src_image, mask_image,
+				target_image, &transform, filter);
+		pixman_image_unref(src_image);
+	} else {
+		pthread_mutex_lock(&ps->image_mutex);
 		composite_whole(pixman_op, ps->image, mask_image,
 				target_image, &transform, filter);
+		pthread_mutex_unlock(&ps->image_mutex);
+	}
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
@@ -385,7 +546,8 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (pr->repaint_debug) {
+		pthread_mutex_lock(&pr->debug_mutex);
 		pixman_image_composite32(PIXMAN_OP_OVER,
 					 pr->debug_color, /* src */
 					 NULL /* mask */,
@@ -395,13 +557,57 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 					 0, 0, /* dest_x, dest_y */
 					 pixman_image_get_width (target_image), /* width */
 					 pixman_image_get_height (target_image) /* height */);
+		pthread_mutex_unlock(&pr->debug_mutex);
+	}
 
 	pixman_image_set_clip_region32(target_image, NULL);
 }
 
+/* Opaque solid color views are filled rather than composited. */
+static bool
+draw_view_fill(struct weston_view *view, struct weston_output *output,
+	       pixman_region32_t *repaint_global,
+	       pixman_image_t *target_image)
+{
+	struct pixman_renderer *pr =
+		(struct pixman_renderer *) output->compositor->renderer;
+	struct pixman_surface_state *ps = view->surface->renderer_state;
+	pixman_region32_t surf_region;
+	pixman_region32_t repaint_output;
+	pixman_box32_t *boxes;
+	int n;
+
+	if (pixman_image_get_data(ps->image) ||
+	    ps->solid_color.alpha != 0xffff || view->alpha < 1.0 ||
+	    pr->repaint_debug)
+		return false;
+
+	pixman_region32_init_rect(&surf_region, 0, 0,
+				  view->surface->width, view->surface->height);
+	if (view->geometry.scissor_enabled)
+		pixman_region32_intersect(&surf_region, &surf_region,
+					  &view->geometry.scissor);
+
+	pixman_region32_init(&repaint_output);
+	region_intersect_only_translation(&repaint_output, repaint_global,
+					  &surf_region, view);
+	region_global_to_output(output, &repaint_output);
+
+	boxes = pixman_region32_rectangles(&repaint_output, &n);
+	if (n > 0)
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, target_image,
+					&ps->solid_color, n, boxes);
+
+	pixman_region32_fini(&repaint_output);
+	pixman_region32_fini(&surf_region);
+
+	return true;
+}
+
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
-		     pixman_region32_t *repaint_global)
+		     pixman_region32_t *repaint_global,
+		     pixman_image_t *target_image)
 {
 	struct weston_surface *surface = view->surface;
 	/* non-opaque region in surface coordinates: */
@@ -409,6 +615,9 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 	/* region to be painted in output coordinates: */
 	pixman_region32_t repaint_output;
 
+	if (draw_view_fill(view, output, repaint_global, target_image))
+		return;
+
 	pixman_region32_init(&repaint_output);
 
 	/* Blended region is whole surface minus opaque region,
@@ -429,7 +638,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 			region_global_to_output(output, &repaint_output);
 
 			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+				       PIXMAN_OP_SRC, target_image);
 		}
 	}
 
@@ -440,7 +649,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 		region_global_to_output(output, &repaint_output);
 
 		repaint_region(view, output, &repaint_output, NULL,
-			       PIXMAN_OP_OVER);
+			       PIXMAN_OP_OVER, target_image);
 	}
 
 	pixman_region32_fini(&surface_blend);
@@ -450,7 +659,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
-			 pixman_region32_t *repaint_global)
+			 pixman_region32_t *repaint_global,
+			 pixman_image_t *target_image)
 {
 	struct weston_surface *surface = view->surface;
 	pixman_region32_t surf_region;
@@ -476,7 +686,7 @@ draw_view_source_clipped(struct weston_view *view,
 	region_global_to_output(output, &repaint_output);
 
 	repaint_region(view, output, &repaint_output, &buffer_region,
-		       PIXMAN_OP_OVER);
+		       PIXMAN_OP_OVER, target_image);
 
 	pixman_region32_fini(&repaint_output);
 	pixman_region32_fini(&buffer_region);
@@ -485,14 +695,16 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+	  pixman_region32_t *damage, /* in global coordinates */
+	  pixman_image_t *target_image)
 {
-	struct pixman_surface_state *ps = get_surface_state(ev->surface);
+	/* Not created here, this may run on a repaint worker. */
+	struct pixman_surface_state *ps = ev->surface->renderer_state;
 	/* repaint bounding region in global coordinates: */
 	pixman_region32_t repaint;
 
 	/* No buffer attached */
-	if (!ps->image)
+	if (!ps || !ps->image)
 		return;
 
 	pixman_region32_init(&repaint);
@@ -511,7 +723,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, &repaint, target_image);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -520,27 +732,338 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, &repaint, target_image);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
-static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+/* Static layer flattening.
+ *
+ * The views at the bottom of the scene which are in static layers, see
+ * weston_layer_set_static(), form the flat run of an output. They are
+ * composited into flat_image once, and damage over them is repainted from
+ * it. The image is brought up to date where the damage needs it before
+ * the repaint, on the repainting thread, so that bands only read it.
+ * Any change to the views of the run gives another signature, which
+ * drops what the image holds.
+ */
+
+static uint64_t
+flat_hash(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+/* Returns the number of views in the flat run, its signature, its top
+ * view, and whether repainting from flat_image saves anything. */
+static int
+flat_run_collect(struct weston_output *output, uint64_t *signature,
+		 struct weston_view **top, bool *worth)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_view *view;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	int visible = 0;
+	int count = 0;
+
+	*worth = false;
+
+	hash = flat_hash(hash, &output->x, sizeof output->x);
+	hash = flat_hash(hash, &output->y, sizeof output->y);
+	hash = flat_hash(hash, &output->width, sizeof output->width);
+	hash = flat_hash(hash, &output->height, sizeof output->height);
+	hash = flat_hash(hash, &output->current_scale,
+			 sizeof output->current_scale);
+	hash = flat_hash(hash, &output->transform, sizeof output->transform);
+
+	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+		struct pixman_surface_state *ps = view->surface->renderer_state;
+		struct weston_layer *layer = view->layer_link.layer;
+		struct weston_buffer_viewport *vp =
+			&view->surface->buffer_viewport;
+
+		if (!layer || !layer->is_static ||
+		    view->plane != &compositor->primary_plane)
+			break;
+
+		hash = flat_hash(hash, &view, sizeof view);
+		hash = flat_hash(hash, &ps, sizeof ps);
+		if (ps) {
+			hash = flat_hash(hash, &ps->image, sizeof ps->image);
+			hash = flat_hash(hash, &ps->content_serial,
+					 sizeof ps->content_serial);
+		}
+		hash = flat_hash(hash, &view->alpha, sizeof view->alpha);
+		hash = flat_hash(hash, &view->transform.enabled,
+				 sizeof view->transform.enabled);
+		hash = flat_hash(hash, &view->transform.matrix,
+				 sizeof view->transform.matrix);
+		hash = flat_hash(hash,
+				 pixman_region32_extents(&view->transform.boundingbox),
+				 sizeof(pixman_box32_t));
+		hash = flat_hash(hash,
+				 pixman_region32_extents(&view->surface->opaque),
+				 sizeof(pixman_box32_t));
+		hash = flat_hash(hash, &vp->buffer, sizeof vp->buffer);
+		hash = flat_hash(hash, &vp->surface, sizeof vp->surface);
+
+		if (view->output_mask & (1u << output->id)) {
+			visible++;
+			if (!view_transformation_is_translation(view) ||
+			    view->alpha < 1.0)
+				*worth = true;
+		}
+
+		*top = view;
+		count++;
+	}
+
+	/* a single plain view is as cheap to draw as the image */
+	if (visible > 1)
+		*worth = true;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	*signature = hash;
+	return count;
 }
 
 static void
-copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
+pixman_renderer_prepare_flat(struct weston_output *output,
+			     pixman_region32_t *damage,
+			     pixman_image_t *target_image)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = get_output_state(output);
+	int width = pixman_image_get_width(target_image);
+	int height = pixman_image_get_height(target_image);
+	struct weston_view *view, *top = NULL;
+	pixman_region32_t missing;
+	uint64_t signature;
+	bool worth;
+	int count, i;
+
+	po->flat_views = 0;
+
+	/* the debug tint would stick to the image */
+	if (output->zoom.active || pr->repaint_debug)
+		return;
+
+	count = flat_run_collect(output, &signature, &top, &worth);
+	if (count == 0 || !worth)
+		return;
+
+	if (po->flat_image &&
+	    (pixman_image_get_width(po->flat_image) != width ||
+	     pixman_image_get_height(po->flat_image) != height)) {
+		pixman_image_unref(po->flat_image);
+		po->flat_image = NULL;
+	}
+
+	if (!po->flat_image) {
+		po->flat_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+							  width, height,
+							  NULL, 0);
+		if (!po->flat_image)
+			return;
+		pixman_region32_clear(&po->flat_valid);
+	}
+
+	if (po->flat_signature != signature) {
+		po->flat_signature = signature;
+		pixman_region32_clear(&po->flat_valid);
+	}
+
+	/* what is covered from above is neither drawn nor kept */
+	pixman_region32_copy(&po->flat_clip, &top->clip);
+
+	pixman_region32_init(&missing);
+	pixman_region32_subtract(&missing, damage, &po->flat_clip);
+	pixman_region32_subtract(&missing, &missing, &po->flat_valid);
+
+	if (pixman_region32_not_empty(&missing)) {
+		pixman_color_t transparent = { 0, 0, 0, 0 };
+		pixman_region32_t output_missing;
+		pixman_box32_t *boxes;
+		int nboxes;
+
+		pixman_region32_init(&output_missing);
+		pixman_region32_copy(&output_missing, &missing);
+		region_global_to_output(output, &output_missing);
+		boxes = pixman_region32_rectangles(&output_missing, &nboxes);
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, po->flat_image,
+					&transparent, nboxes, boxes);
+		pixman_region32_fini(&output_missing);
+
+		i = 0;
+		wl_list_for_each_reverse(view, &output->compositor->view_list,
+					 link) {
+			if (i++ == count)
+				break;
+			draw_view(view, output, &missing, po->flat_image);
+		}
+
+		pixman_region32_union(&po->flat_valid, &po->flat_valid,
+				      &missing);
+	}
+	pixman_region32_fini(&missing);
+
+	po->flat_views = count;
+}
+
+static void
+draw_flat(struct weston_output *output, pixman_region32_t *damage,
+	  pixman_image_t *target_image)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t repaint;
+	pixman_image_t *src_image;
+
+	pixman_region32_init(&repaint);
+	pixman_region32_subtract(&repaint, damage, &po->flat_clip);
+	region_global_to_output(output, &repaint);
+
+	/* aliased, bands may read it in parallel */
+	src_image = create_image_alias(po->flat_image);
+	if (src_image && pixman_region32_not_empty(&repaint)) {
+		pixman_image_set_clip_region32(target_image, &repaint);
+		pixman_image_composite32(PIXMAN_OP_OVER,
+					 src_image, /* src */
+					 NULL, /* mask */
+					 target_image, /* dest */
+					 0, 0, /* src_x, src_y */
+					 0, 0, /* mask_x, mask_y */
+					 0, 0, /* dest_x, dest_y */
+					 pixman_image_get_width(target_image),
+					 pixman_image_get_height(target_image));
+		pixman_image_set_clip_region32(target_image, NULL);
+	}
+
+	if (src_image)
+		pixman_image_unref(src_image);
+	pixman_region32_fini(&repaint);
+}
+
+static void
+repaint_surfaces(struct weston_output *output, pixman_region32_t *damage,
+		 pixman_image_t *target_image)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_output_state *po = get_output_state(output);
+	struct weston_view *view;
+	int flat = po->flat_views;
+
+	if (flat > 0)
+		draw_flat(output, damage, target_image);
+
+	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+		if (flat > 0) {
+			flat--;
+			continue;
+		}
+
+		if (view->plane == &compositor->primary_plane &&
+		    !view->occluded)
+			draw_view(view, output, damage, target_image);
+	}
+}
+
+#if defined(__SSE2__)
+static void
+copy_row_stream(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	/* Pixels are 4 bytes, so 4-byte steps reach 16-byte alignment. */
+	while (((uintptr_t)dst & 15) && len >= 4) {
+		memcpy(dst, src, 4);
+		dst += 4;
+		src += 4;
+		len -= 4;
+	}
+
+	for (; len >= 64; len -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+	}
+
+	for (; len >= 16; len -= 16, dst += 16, src += 16)
+		_mm_stream_si128((__m128i *)dst,
+				 _mm_loadu_si128((const __m128i *)src));
+
+	memcpy(dst, src, len);
+}
+#endif
+
+/* Copies region, in hw buffer coordinates, with streaming stores that
+ * bypass the cache, which is much faster than pixman's cached writes to
+ * write-combined memory. Returns false when pixman has to do the copy. */
+static bool
+copy_to_hw_buffer_stream(pixman_region32_t *region,
+			 pixman_image_t *shadow_image,
+			 pixman_image_t *hw_buffer)
+{
+#if defined(__SSE2__)
+	pixman_format_code_t format = pixman_image_get_format(hw_buffer);
+	int width = pixman_image_get_width(hw_buffer);
+	int height = pixman_image_get_height(hw_buffer);
+	uint8_t *src_bits, *dst_bits;
+	int src_stride, dst_stride;
+	pixman_box32_t *rects;
+	int nrects, i, x1, x2, y;
+
+	if (format != PIXMAN_x8r8g8b8 && format != PIXMAN_a8r8g8b8)
+		return false;
+	if (pixman_image_get_width(shadow_image) != width ||
+	    pixman_image_get_height(shadow_image) != height)
+		return false;
+
+	src_bits = (uint8_t *)pixman_image_get_data(shadow_image);
+	dst_bits = (uint8_t *)pixman_image_get_data(hw_buffer);
+	if (!src_bits || !dst_bits)
+		return false;
+	src_stride = pixman_image_get_stride(shadow_image);
+	dst_stride = pixman_image_get_stride(hw_buffer);
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; i++) {
+		x1 = MAX(rects[i].x1, 0);
+		x2 = MIN(rects[i].x2, width);
+		if (x2 <= x1)
+			continue;
+
+		for (y = MAX(rects[i].y1, 0);
+		     y < MIN(rects[i].y2, height); y++)
+			copy_row_stream(dst_bits + y * dst_stride + x1 * 4,
+					src_bits + y * src_stride + x1 * 4,
+					(size_t)(x2 - x1) * 4);
+	}
+
+	_mm_sfence();
+	return true;
+#else
+	return false;
+#endif
+}
+
+static void
+copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region,
+		  pixman_image_t *shadow_image, pixman_image_t *hw_buffer,
+		  bool uncached)
+{
 	pixman_region32_t output_region;
 
 	pixman_region32_init(&output_region);
@@ -548,20 +1071,286 @@ copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 
 	region_global_to_output(output, &output_region);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, &output_region);
+	if (uncached && !output_zoom_offscreen(output) &&
+	    copy_to_hw_buffer_stream(&output_region,
+				     shadow_image, hw_buffer)) {
+		pixman_region32_fini(&output_region);
+		return;
+	}
+
+	pixman_image_set_clip_region32 (hw_buffer, &output_region);
 	pixman_region32_fini(&output_region);
 
+	if (output_zoom_offscreen(output)) {
+		/* hw buffer to global, then to the unzoomed shadow */
+		pixman_transform_t transform;
+		struct weston_matrix matrix = output->inverse_matrix;
+
+		weston_matrix_multiply(&matrix, &output->zoom.scene_matrix);
+		weston_matrix_to_pixman_transform(&transform, &matrix);
+		pixman_image_set_transform(shadow_image, &transform);
+		pixman_image_set_filter(shadow_image, PIXMAN_FILTER_BILINEAR,
+					NULL, 0);
+		pixman_image_set_repeat(shadow_image, PIXMAN_REPEAT_PAD);
+	}
+
 	pixman_image_composite32(PIXMAN_OP_SRC,
-				 po->shadow_image, /* src */
+				 shadow_image, /* src */
 				 NULL /* mask */,
-				 po->hw_buffer, /* dest */
+				 hw_buffer, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->hw_buffer), /* width */
-				 pixman_image_get_height (po->hw_buffer) /* height */);
+				 pixman_image_get_width (hw_buffer), /* width */
+				 pixman_image_get_height (hw_buffer) /* height */);
+
+	pixman_image_set_clip_region32 (hw_buffer, NULL);
+
+	if (output_zoom_offscreen(output)) {
+		pixman_image_set_transform(shadow_image, NULL);
+		pixman_image_set_filter(shadow_image, PIXMAN_FILTER_NEAREST,
+					NULL, 0);
+		pixman_image_set_repeat(shadow_image, PIXMAN_REPEAT_NONE);
+	}
+}
+
+/* Band threads.
+ *
+ * With pixman_renderer_output_options::band_threads, the damage of an output
+ * is cut into horizontal bands in global coordinates, and each band is
+ * composited by a thread of its own into aliases of the output's images, so
+ * clip regions set by one band don't affect the others. Pixels of different
+ * bands don't overlap, so the bands need no other synchronization. The
+ * thread repainting the output composites bands too and returns once all
+ * of them are done. The pool is shared by outputs, which may be repainted
+ * in parallel themselves.
+ */
+
+/* Don't cut damage lower than this into more bands. */
+#define PIXMAN_BAND_MIN_HEIGHT 32
+
+struct pixman_band_batch {
+	int outstanding;
+};
+
+struct pixman_band {
+	struct wl_list link; /* pixman_band_pool::queue_list */
+	struct pixman_band_batch *batch;
+	struct weston_output *output;
+	pixman_region32_t damage;
+	pixman_region32_t hw_damage;
+	pixman_image_t *target_image;
+	pixman_image_t *shadow_image; /* NULL unless shadowed */
+	pixman_image_t *hw_buffer; /* NULL unless shadowed */
+	bool hw_buffer_uncached;
+};
+
+struct pixman_band_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond; /* signaled when band is queued or exiting */
+	pthread_cond_t done_cond; /* signaled when a batch is done */
+	struct wl_list queue_list;
+	bool exit;
+	int num_threads;
+	pthread_t *threads;
+};
+
+static void
+pixman_band_render(struct pixman_band *band)
+{
+	repaint_surfaces(band->output, &band->damage, band->target_image);
+
+	if (band->shadow_image)
+		copy_to_hw_buffer(band->output, &band->hw_damage,
+				  band->shadow_image, band->hw_buffer,
+				  band->hw_buffer_uncached);
+}
+
+/* Called with pool->mutex held, returns with it held. */
+static bool
+pixman_band_pool_render_next(struct pixman_band_pool *pool)
+{
+	struct pixman_band *band;
+
+	if (wl_list_empty(&pool->queue_list))
+		return false;
+
+	band = container_of(pool->queue_list.next, struct pixman_band, link);
+	wl_list_remove(&band->link);
+	pthread_mutex_unlock(&pool->mutex);
+
+	pixman_band_render(band);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (--band->batch->outstanding == 0)
+		pthread_cond_broadcast(&pool->done_cond);
+
+	return true;
+}
+
+static void *
+pixman_band_pool_thread(void *arg)
+{
+	struct pixman_band_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->exit) {
+		if (!pixman_band_pool_render_next(pool))
+			pthread_cond_wait(&pool->queue_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
+	return NULL;
+}
+
+static void
+pixman_band_pool_render(struct pixman_band_pool *pool,
+			struct pixman_band *bands, int num_bands)
+{
+	struct pixman_band_batch batch = { .outstanding = num_bands };
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (i = 0; i < num_bands; i++) {
+		bands[i].batch = &batch;
+		wl_list_insert(pool->queue_list.prev, &bands[i].link);
+	}
+	pthread_cond_broadcast(&pool->queue_cond);
+
+	while (batch.outstanding > 0) {
+		if (!pixman_band_pool_render_next(pool) &&
+		    batch.outstanding > 0)
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+pixman_band_pool_destroy(struct pixman_band_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->exit = true;
+	pthread_cond_broadcast(&pool->queue_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->queue_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+static struct pixman_band_pool *
+pixman_band_pool_create(int num_threads)
+{
+	struct pixman_band_pool *pool;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = zalloc(num_threads * sizeof pool->threads[0]);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->queue_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	wl_list_init(&pool->queue_list);
+
+	for (pool->num_threads = 0; pool->num_threads < num_threads;
+	     pool->num_threads++) {
+		if (pthread_create(&pool->threads[pool->num_threads], NULL,
+				   pixman_band_pool_thread, pool) != 0) {
+			pixman_band_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+/* Returns false if the damage is not worth cutting, or out of memory, so
+ * that the caller composites it as a whole. */
+static bool
+repaint_bands(struct weston_output *output, pixman_region32_t *output_damage,
+	      pixman_region32_t *hw_damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_image_t *target_image;
+	struct pixman_band *bands;
+	pixman_box32_t *extents;
+	int num_bands, height, y1, y2, i;
+	bool ok = true;
+
+	/* hw_damage covers output_damage */
+	extents = pixman_region32_extents(hw_damage);
+	height = extents->y2 - extents->y1;
+	num_bands = MIN(po->band_threads, height / PIXMAN_BAND_MIN_HEIGHT);
+	if (num_bands < 2)
+		return false;
+
+	bands = zalloc(num_bands * sizeof bands[0]);
+	if (!bands)
+		return false;
+
+	target_image = po->shadow_image ? po->shadow_image : po->hw_buffer;
+
+	for (i = 0; i < num_bands; i++) {
+		struct pixman_band *band = &bands[i];
+		pixman_region32_t rect;
+
+		y1 = extents->y1 + height * i / num_bands;
+		y2 = extents->y1 + height * (i + 1) / num_bands;
+		pixman_region32_init_rect(&rect, extents->x1, y1,
+					  extents->x2 - extents->x1, y2 - y1);
+
+		band->output = output;
+		pixman_region32_init(&band->damage);
+		pixman_region32_intersect(&band->damage, output_damage, &rect);
+		pixman_region32_init(&band->hw_damage);
+		pixman_region32_intersect(&band->hw_damage, hw_damage, &rect);
+		pixman_region32_fini(&rect);
+
+		band->target_image = create_image_alias(target_image);
+		if (!band->target_image)
+			ok = false;
+
+		if (po->shadow_image) {
+			band->shadow_image = create_image_alias(po->shadow_image);
+			band->hw_buffer = create_image_alias(po->hw_buffer);
+			band->hw_buffer_uncached = po->hw_buffer_uncached;
+			if (!band->shadow_image || !band->hw_buffer)
+				ok = false;
+		}
+	}
+
+	if (ok)
+		pixman_band_pool_render(pr->band_pool, bands, num_bands);
+
+	for (i = 0; i < num_bands; i++) {
+		struct pixman_band *band = &bands[i];
+
+		if (band->target_image)
+			pixman_image_unref(band->target_image);
+		if (band->shadow_image)
+			pixman_image_unref(band->shadow_image);
+		if (band->hw_buffer)
+			pixman_image_unref(band->hw_buffer);
+		pixman_region32_fini(&band->damage);
+		pixman_region32_fini(&band->hw_damage);
+	}
+	free(bands);
+
+	return ok;
 }
 
 static void
@@ -569,6 +1358,7 @@ pixman_renderer_repaint_output(struct weston_output *output,
 			       pixman_region32_t *output_damage)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t *scene_damage = output_damage;
 	pixman_region32_t hw_damage;
 
 	if (!po->hw_buffer) {
@@ -585,15 +1375,33 @@ pixman_renderer_repaint_output(struct weston_output *output,
 		pixman_region32_copy(&hw_damage, output_damage);
 	}
 
-	if (po->shadow_image) {
-		repaint_surfaces(output, output_damage);
-		copy_to_hw_buffer(output, &hw_damage);
+	/* The shadow keeps the unzoomed scene, which only needs what changed
+	 * in the scene. Zoomed bands would sample each other's pixels. */
+	if (output->zoom.offscreen)
+		scene_damage = &output->zoom.scene_damage;
+
+	if (po->shadow_image)
+		pixman_renderer_prepare_flat(output, scene_damage,
+					     po->shadow_image);
+	else
+		pixman_renderer_prepare_flat(output, &hw_damage,
+					     po->hw_buffer);
+
+	if (po->band_threads > 1 && !output_zoom_offscreen(output) &&
+	    repaint_bands(output, scene_damage, &hw_damage)) {
+		/* done in bands */
+	} else if (po->shadow_image) {
+		repaint_surfaces(output, scene_damage, po->shadow_image);
+		copy_to_hw_buffer(output, &hw_damage,
+				  po->shadow_image, po->hw_buffer,
+				  po->hw_buffer_uncached);
 	} else {
-		repaint_surfaces(output, &hw_damage);
+		repaint_surfaces(output, &hw_damage, po->hw_buffer);
 	}
 	pixman_region32_fini(&hw_damage);
 
-	wl_signal_emit(&output->frame_signal, output_damage);
+	if (!output->repaint_offloaded)
+		wl_signal_emit(&output->frame_signal, output_damage);
 
 	/* Actual flip should be done by caller */
 }
@@ -601,7 +1409,14 @@ pixman_renderer_repaint_output(struct weston_output *output,
 static void
 pixman_renderer_flush_damage(struct weston_surface *surface)
 {
-	/* No-op for pixman renderer */
+	/* The buffer is composited from directly, only the resampled copy
+	 * needs to follow the damage. */
+	struct pixman_surface_state *ps = get_surface_state(surface);
+
+	if (pixman_region32_not_empty(&surface->damage)) {
+		surface_state_drop_scaled_image(ps);
+		ps->content_serial++;
+	}
 }
 
 static void
@@ -616,6 +1431,7 @@ buffer_state_handle_buffer_destroy(struct wl_listener *listener, void *data)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	surface_state_drop_scaled_image(ps);
 
 	ps->buffer_destroy_listener.notify = NULL;
 }
@@ -627,6 +1443,7 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	struct wl_shm_buffer *shm_buffer;
 	pixman_format_code_t pixman_format;
 
+	ps->content_serial++;
 	weston_buffer_reference(&ps->buffer_ref, buffer);
 	weston_buffer_release_reference(&ps->buffer_release_ref,
 					es->buffer_release_ref.buffer_release);
@@ -640,6 +1457,7 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	surface_state_drop_scaled_image(ps);
 
 	if (!buffer)
 		return;
@@ -708,8 +1526,10 @@ pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	surface_state_drop_scaled_image(ps);
 	weston_buffer_reference(&ps->buffer_ref, NULL);
 	weston_buffer_release_reference(&ps->buffer_release_ref, NULL);
+	pthread_mutex_destroy(&ps->image_mutex);
 	free(ps);
 }
 
@@ -748,6 +1568,7 @@ pixman_renderer_create_surface(struct weston_surface *surface)
 	surface->renderer_state = ps;
 
 	ps->surface = surface;
+	pthread_mutex_init(&ps->image_mutex, NULL);
 
 	ps->surface_destroy_listener.notify =
 		surface_state_handle_surface_destroy;
@@ -778,8 +1599,10 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	surface_state_drop_scaled_image(ps);
 
 	ps->image = pixman_image_create_solid_fill(&color);
+	ps->solid_color = color;
 }
 
 static void
@@ -789,6 +1612,9 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+	if (pr->band_pool)
+		pixman_band_pool_destroy(pr->band_pool);
+	pthread_mutex_destroy(&pr->debug_mutex);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -809,6 +1635,48 @@ pixman_renderer_surface_get_content_size(struct weston_surface *surface,
 	}
 }
 
+/* Unscaled copy between identical formats: the rows of the client
+ * buffer go straight into the strided target, no pixman images needed.
+ * The flipped case walks the same rows the transformed composite below
+ * would sample, which is only a plain flip of the rect when src_y is 0.
+ */
+static bool
+pixman_renderer_surface_copy_rows(struct pixman_surface_state *ps,
+				  pixman_format_code_t format,
+				  void *target, size_t target_stride,
+				  int target_width, int target_height,
+				  int src_x, int src_y, bool y_flip)
+{
+	struct weston_buffer *buffer = ps->buffer_ref.buffer;
+	uint8_t *data;
+	int stride;
+
+	if (pixman_image_get_format(ps->image) != format)
+		return false;
+
+	if (y_flip && src_y != 0)
+		return false;
+
+	if (src_x + target_width > pixman_image_get_width(ps->image) ||
+	    src_y + target_height > pixman_image_get_height(ps->image))
+		return false;
+
+	data = (uint8_t *) pixman_image_get_data(ps->image);
+	stride = pixman_image_get_stride(ps->image);
+
+	if (buffer && buffer->shm_buffer)
+		wl_shm_buffer_begin_access(buffer->shm_buffer);
+
+	pixel_copy_rows(target, target_stride,
+			data + (ptrdiff_t) src_y * stride + src_x * 4, stride,
+			(size_t) target_width * 4, target_height, y_flip);
+
+	if (buffer && buffer->shm_buffer)
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	return true;
+}
+
 static int
 pixman_renderer_surface_copy_content(struct weston_surface *surface,
 				     void *target, size_t size, size_t target_stride,
@@ -827,6 +1695,12 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 	if (!ps->image)
 		return -1;
 
+	if (src_width == target_width && src_height == target_height &&
+	    pixman_renderer_surface_copy_rows(ps, format, target, target_stride,
+					      target_width, target_height,
+					      src_x, src_y, y_flip))
+		return 0;
+
 	out_buf = pixman_image_create_bits(format, target_width, target_height,
 					   target, target_stride);
 
@@ -848,6 +1722,12 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 					    pixman_double_to_fixed(scale_y));
 	}
 	pixman_image_set_transform(ps->image, &transform);
+	/* smooth when scaled, repaint sets its own filter before use. */
+	pixman_image_set_filter(ps->image,
+				(src_width == target_width &&
+				 src_height == target_height) ?
+					PIXMAN_FILTER_NEAREST : PIXMAN_FILTER_BILINEAR,
+				NULL, 0);
 	pixman_image_composite32(PIXMAN_OP_SRC,
 				 ps->image,    /* src */
 				 NULL,         /* mask */
@@ -894,6 +1774,7 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	renderer->repaint_debug = 0;
 	renderer->debug_color = NULL;
+	pthread_mutex_init(&renderer->debug_mutex, NULL);
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
 	renderer->base.repaint_output = pixman_renderer_repaint_output;
 	renderer->base.flush_damage = pixman_renderer_flush_damage;
@@ -976,6 +1857,25 @@ pixman_renderer_output_create(struct weston_output *output,
 			free(po);
 			return -1;
 		}
+
+		output->zoom.offscreen = true;
+	}
+
+	po->hw_buffer_uncached = options->hw_buffer_uncached;
+	pixman_region32_init(&po->flat_valid);
+	pixman_region32_init(&po->flat_clip);
+
+	if (options->band_threads > 1) {
+		struct pixman_renderer *pr = get_renderer(output->compositor);
+
+		if (!pr->band_pool)
+			pr->band_pool =
+				pixman_band_pool_create(options->band_threads - 1);
+		if (pr->band_pool)
+			po->band_threads = options->band_threads;
+		else
+			weston_log("Pixman-renderer: failed to start band "
+				   "threads, compositing on one thread\n");
 	}
 
 	output->renderer_state = po;
@@ -988,12 +1888,19 @@ pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
+	output->zoom.offscreen = false;
+
 	if (po->shadow_image)
 		pixman_image_unref(po->shadow_image);
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
 
+	if (po->flat_image)
+		pixman_image_unref(po->flat_image);
+	pixman_region32_fini(&po->flat_valid);
+	pixman_region32_fini(&po->flat_clip);
+
 	free(po->shadow_buffer);
 
 	po->shadow_buffer = NULL;
@@ -35,6 +35,12 @@ pixman_renderer_init(struct weston_compositor *ec);
 struct pixman_renderer_output_options {
 	/** Composite into a shadow buffer, copying to the hardware buffer */
 	bool use_shadow;
+	/** Composite damage in horizontal bands on this many threads,
+	 * counting the repainting one. 0 or 1 to not cut it. */
+	int band_threads;
+	/** The hardware buffer is uncached or write-combined memory, such
+	 * as a mapped framebuffer, so copy to it with streaming stores */
+	bool hw_buffer_uncached;
 };
 
 int
@@ -37,15 +37,25 @@ struct gl_shader {
 	GLint tex_uniforms[3];
 	GLint alpha_uniform;
 	GLint color_uniform;
+	GLint color_lut_uniform;
+	GLint color_lut_size_uniform;
 	const char *vertex_source, *fragment_source;
+
+	/* Same shader followed by the output color LUT stage, created on
+	 * first use by shader_color_lut(). */
+	struct gl_shader *color_lut;
+	bool is_color_lut;
 };
 
 struct gl_renderer {
 	struct weston_renderer base;
 	bool fragment_shader_debug;
 	bool fan_debug;
+	bool heatmap_debug;
 	struct weston_binding *fragment_binding;
 	struct weston_binding *fan_binding;
+	struct weston_binding *heatmap_binding;
+	uint32_t heatmap_window_start; /* msec, of the surface stats */
 
 	EGLenum platform;
 	EGLDisplay egl_display;
@@ -58,6 +68,10 @@ struct gl_renderer {
 
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
+	struct wl_array indices;
+	struct wl_array draws;
+	GLuint vertex_buffer;
+	GLuint index_buffer;
 
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
@@ -69,6 +83,24 @@ struct gl_renderer {
 	bool has_platform_base;
 
 	bool has_unpack_subimage;
+	bool has_pack_subimage;
+
+	/* small wl_shm buffers share textures, see gl_atlas_page */
+	bool has_atlas;
+	struct wl_list atlas_pages;
+
+	/* GLES3 pixel buffer object read back, see read_pixels_async */
+	bool has_pbo_read;
+	bool has_pbo_upload;
+
+	/* Linked programs are cached in program_cache_dir, keyed by
+	 * program_cache_key of the driver and the shader sources. */
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+	char *program_cache_dir;
+	uint64_t program_cache_key;
+	PFNGLMAPBUFFERRANGEEXTPROC map_buffer_range;
+	PFNGLUNMAPBUFFEROESPROC unmap_buffer;
 
 	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
 	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
@@ -89,6 +121,18 @@ struct gl_renderer {
 
 	bool has_dmabuf_import;
 	struct wl_list dmabuf_images;
+
+	/* /dev/udmabuf, to sample memfd wl_shm pools in place, or -1 */
+	int udmabuf_dev;
+	struct wl_list shm_udmabuf_pools; /* shm_udmabuf_pool::link */
+	struct wl_list shm_udmabuf_buffers; /* shm_udmabuf_buffer::link */
+	/* catches the fds of wl_shm pools, see shm_pool_fd_logger() */
+	struct wl_protocol_logger *shm_pool_logger;
+	struct wl_listener shm_client_created_listener;
+	struct wl_list shm_pool_fd_clients; /* shm_pool_fd_client::link */
+	int shm_pending_fd;
+	struct shm_pool_fd *shm_pending_pool_fd;
+	int32_t shm_pending_offset;
 	struct wl_list dmabuf_formats;
 
 	bool has_gl_texture_rg;
@@ -102,11 +146,22 @@ struct gl_renderer {
 	struct gl_shader texture_shader_xyuv;
 	struct gl_shader invert_color_shader;
 	struct gl_shader solid_shader;
+	struct gl_shader solid_batch_shader;
 	struct gl_shader *current_shader;
 
 	struct wl_signal destroy_signal;
+	struct wl_list surface_state_list; /* gl_surface_state::link */
+
+	/* Textures of shm surfaces that have been hidden for longer than
+	 * texture_evict_msec are dropped and re-uploaded from the retained
+	 * buffer when the surface is drawn again; 0 disables this. */
+	uint32_t texture_evict_msec;
+	struct wl_event_source *texture_evict_timer;
+	uint32_t repaint_msec; /* start of the current output repaint */
 
 	struct wl_listener output_destroy_listener;
+	struct wl_listener memory_report_listener;
+	struct wl_listener memory_trim_listener;
 
 	bool has_dmabuf_import_modifiers;
 	PFNEGLQUERYDMABUFFORMATSEXTPROC query_dmabuf_formats;
@@ -119,6 +174,18 @@ struct gl_renderer {
 
 	bool has_wait_sync;
 	PFNEGLWAITSYNCKHRPROC wait_sync;
+
+	/* GL_EXT_disjoint_timer_query, for GPU timeline points */
+	bool has_timer_query;
+	void (*gen_queries)(GLsizei n, GLuint *ids);
+	void (*query_counter)(GLuint id, GLenum target);
+	void (*get_query_objectuiv)(GLuint id, GLenum pname, GLuint *params);
+	void (*get_query_objectui64v)(GLuint id, GLenum pname,
+				      uint64_t *params);
+	void (*get_integer64v)(GLenum pname, int64_t *data);
+	struct wl_list timer_query_list; /* gl_timer_query::link */
+	struct wl_list timer_query_free_list;
+	int timer_query_count;
 };
 
 static inline struct gl_renderer *
@@ -32,14 +32,20 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <float.h>
+#include <inttypes.h>
 #include <assert.h>
 #include <linux/input.h>
 #include <drm_fourcc.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include "linux-sync-file.h"
 #include "timeline.h"
@@ -55,6 +61,7 @@
 #include "shared/fd-util.h"
 #include "shared/helpers.h"
 #include "shared/platform.h"
+#include "shared/string-helpers.h"
 #include "shared/timespec-util.h"
 #include "shared/weston-egl-ext.h"
 
@@ -88,6 +95,11 @@ struct gl_output_state {
 	pixman_region32_t buffer_damage[BUFFER_DAMAGE_COUNT];
 	int buffer_damage_index;
 	enum gl_border_status border_damage[BUFFER_DAMAGE_COUNT];
+	/* Outputs whose buffers EGL can't tell the age of, like pbuffers,
+	 * cycle through this many buffers instead, 0 otherwise. Buffers
+	 * have no age until each of them has been painted once. */
+	int buffer_count;
+	int buffers_painted;
 	struct gl_border_image borders[4];
 	enum gl_border_status border_status;
 
@@ -97,6 +109,24 @@ struct gl_output_state {
 
 	/* struct timeline_render_point::link */
 	struct wl_list timeline_render_point_list;
+
+	/* struct gl_read_request::link */
+	struct wl_list read_request_list;
+
+	/* See gl_renderer_output_set_color_lut(). The table is packed into
+	 * a 2D texture of size * size by size texels, one square per blue
+	 * grid point, and uploaded at the next repaint. */
+	GLuint color_lut_tex;
+	unsigned int color_lut_size;
+	uint8_t *color_lut_pending;
+	bool color_lut_dirty;
+
+	/* Repaints per GL_HEATMAP_TILE square of the output in the current
+	 * window, and in the last complete one that the heatmap shows. */
+	uint16_t *heat;
+	uint16_t *heat_shown;
+	int heat_width, heat_height; /* in tiles */
+	uint32_t heat_window_start; /* msec */
 };
 
 enum buffer_type {
@@ -120,8 +150,26 @@ enum import_type {
 	IMPORT_TYPE_GL_CONVERSION
 };
 
+/* Identifies the memory behind a dmabuf independently of the fds the
+ * client passed, so a new wl_buffer for the same buffer can reuse the
+ * EGLImages of an existing one. */
+struct dmabuf_image_key {
+	uint32_t format;
+	int32_t width, height;
+	int n_planes;
+	struct {
+		dev_t dev;
+		ino_t ino;
+		uint32_t offset;
+		uint32_t stride;
+		uint64_t modifier;
+	} plane[MAX_DMABUF_PLANES];
+};
+
 struct dmabuf_image {
 	struct linux_dmabuf_buffer *dmabuf;
+	struct dmabuf_image_key key;
+	bool has_key;
 	int num_images;
 	struct egl_image *images[3];
 	struct wl_list link;
@@ -131,6 +179,50 @@ struct dmabuf_image {
 	struct gl_shader *shader;
 };
 
+/* The memfd behind wl_shm pools, turned into a dmabuf through
+ * /dev/udmabuf once and shared by the imports of all its buffers. */
+struct shm_udmabuf_pool {
+	int memfd;	/* keeps dev/ino from being reused */
+	dev_t dev;
+	ino_t ino;
+	bool unusable;	/* not sealed against shrinking, or sealed for writes */
+	int fd;		/* udmabuf over [0, size) of memfd, or -1 */
+	uint64_t size;
+	int refcount;
+	struct wl_list link; /* gl_renderer::shm_udmabuf_pools */
+};
+
+/* Import of one wl_shm buffer, found again on the buffer's destroy
+ * signal. A NULL image means the buffer is uploaded as usual. */
+struct shm_udmabuf_buffer {
+	struct wl_listener destroy_listener;
+	struct shm_udmabuf_pool *pool;
+	struct egl_image *image;
+	struct wl_list link; /* gl_renderer::shm_udmabuf_buffers */
+};
+
+/* A dup of the fd a client created a wl_shm pool from, libwayland-server
+ * closes its own once the pool is mapped. */
+struct shm_pool_fd {
+	int fd;
+	int refcount;
+};
+
+/* Ties a shm_pool_fd to its wl_shm_pool resource and to the wl_buffer
+ * resources created from it, which may outlive the pool resource. */
+struct shm_pool_fd_ref {
+	struct wl_listener destroy_listener;
+	struct shm_pool_fd *pool_fd;
+	int32_t offset;		/* of a wl_buffer in the pool */
+};
+
+struct shm_pool_fd_client {
+	struct gl_renderer *renderer;
+	struct wl_listener resource_created_listener;
+	struct wl_listener destroy_listener;
+	struct wl_list link; /* gl_renderer::shm_pool_fd_clients */
+};
+
 struct dmabuf_format {
 	uint32_t format;
 	struct wl_list link;
@@ -162,20 +254,71 @@ struct yuv_format_descriptor {
 	struct yuv_plane_descriptor plane[4];
 };
 
+/* Texture atlas.
+ *
+ * Small ARGB shm buffers, like cursors, icons and tooltips, are uploaded
+ * into a slot of a shared page texture instead of a texture of their own,
+ * so that their draws bind the same texture and batch together. A page
+ * holds square cells of one size class, each with a border of one
+ * transparent texel so that linear filtering doesn't bleed between slots.
+ */
+#define GL_ATLAS_PAGE_SIZE 1024
+#define GL_ATLAS_BORDER 1
+#define GL_ATLAS_MIN_CLASS 16
+#define GL_ATLAS_MAX_CELLS						\
+	((GL_ATLAS_PAGE_SIZE / (GL_ATLAS_MIN_CLASS + 2 * GL_ATLAS_BORDER)) *	\
+	 (GL_ATLAS_PAGE_SIZE / (GL_ATLAS_MIN_CLASS + 2 * GL_ATLAS_BORDER)))
+
+/* How long a hidden shm surface keeps its textures while it still holds
+ * its buffer, see gl_surface_evict_textures(). */
+#define GL_TEXTURE_EVICT_DEFAULT_MSEC 60000
+
+static const int gl_atlas_classes[] = {
+	GL_ATLAS_MIN_CLASS, 32, 48, 64, 96, 128
+};
+
+struct gl_atlas_page {
+	struct wl_list link; /* gl_renderer::atlas_pages */
+	GLuint texture;
+	int size_class;
+	int cell; /* size_class plus borders */
+	int cells_per_row;
+	int num_cells;
+	int num_used;
+	uint32_t used[(GL_ATLAS_MAX_CELLS + 31) / 32];
+};
+
 struct gl_surface_state {
 	GLfloat color[4];
 	struct gl_shader *shader;
 
+	/* textures[0] belongs to atlas_page when that is set */
 	GLuint textures[3];
 	int num_textures;
+	/* textures dropped by gl_surface_evict_textures(), to recreate
+	 * before the surface is drawn again */
+	int num_evicted_textures;
+	struct gl_atlas_page *atlas_page;
+	int atlas_cell;
+	int atlas_x, atlas_y; /* of the buffer in the page, in texels */
 	bool needs_full_upload;
 	pixman_region32_t texture_damage;
 
+	/* The ARGB wl_shm content uploaded so far has alpha 1.0 all
+	 * over, so draw_view() needn't blend it. */
+	bool alpha_opaque;
+
 	/* These are only used by SHM surfaces to detect when we need
 	 * to do a full upload to specify a new internal texture
 	 * format */
 	GLenum gl_format[3];
 	GLenum gl_pixel_type;
+	int cpp[3]; /* bytes per texel per plane */
+
+	/* Staging buffer for shm uploads, laid out like the shm buffer,
+	   with has_pbo_upload. */
+	GLuint upload_pbo;
+	size_t upload_pbo_size;
 
 	struct egl_image* images[3];
 	GLenum target;
@@ -195,11 +338,26 @@ struct gl_surface_state {
 	int vsub[3];  /* vertical subsampling per plane */
 
 	struct weston_surface *surface;
+	/* gl_renderer::surface_state_list, most recently drawn first */
+	struct wl_list link;
+	uint32_t last_used_msec;
+
+	/* Render target of surface_copy_content, kept across calls
+	   and grown as needed. */
+	GLuint copy_fbo;
+	GLuint copy_tex;
+	int copy_tex_width;
+	int copy_tex_height;
 
 	/* Whether this surface was used in the current output repaint.
 	   Used only in the context of a gl_renderer_repaint_output call. */
 	bool used_in_output_repaint;
 
+	/* Commits and shm damage in surface pixels, since the last heatmap
+	   window, while heatmap_debug is on. */
+	uint32_t heat_commits;
+	uint64_t heat_damage_area;
+
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
 };
@@ -218,6 +376,36 @@ struct timeline_render_point {
 	struct wl_event_source *event_source;
 };
 
+/* A pair of GL timestamp queries bracketing some GPU work. Once the
+ * results are available they become timeline points for either the
+ * output or the surface. */
+struct gl_timer_query {
+	struct wl_list link; /* gl_renderer::timer_query_list or free list */
+
+	GLuint queries[2];
+	const char *begin_name;
+	const char *end_name;
+	struct weston_output *output;
+	struct weston_surface *surface;
+};
+
+/* Pending pairs beyond this are not recorded, e.g. if the GPU hangs */
+#define GL_TIMER_QUERY_MAX 256
+
+struct gl_read_request {
+	struct wl_list link; /* gl_output_state::read_request_list */
+
+	struct weston_output *output;
+	GLuint pbo;
+	size_t size;
+	void *pixels;
+	int fd;
+	struct wl_event_source *event_source;
+
+	weston_renderer_read_done_func_t done;
+	void *data;
+};
+
 static inline const char *
 dump_format(uint32_t format, char out[4])
 {
@@ -237,6 +425,12 @@ get_output_state(struct weston_output *output)
 static int
 gl_renderer_create_surface(struct weston_surface *surface);
 
+static void
+gl_surface_flush_damage(struct weston_surface *surface, bool force);
+
+static void
+ensure_textures(struct gl_surface_state *gs, int num_textures);
+
 static inline struct gl_surface_state *
 get_surface_state(struct weston_surface *surface)
 {
@@ -330,6 +524,140 @@ timeline_submit_render_sync(struct gl_renderer *gr,
 	wl_list_insert(&go->timeline_render_point_list, &trp->link);
 }
 
+static struct gl_timer_query *
+gpu_timer_begin(struct weston_compositor *ec,
+		const char *begin_name, const char *end_name,
+		struct weston_output *output, struct weston_surface *surface)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_timer_query *tq;
+
+	if (!gr->has_timer_query ||
+	    (!weston_log_scope_is_enabled(ec->timeline) &&
+	     !weston_log_scope_is_enabled(ec->timeline_binary)))
+		return NULL;
+
+	if (!wl_list_empty(&gr->timer_query_free_list)) {
+		tq = wl_container_of(gr->timer_query_free_list.next, tq, link);
+		wl_list_remove(&tq->link);
+	} else {
+		if (gr->timer_query_count >= GL_TIMER_QUERY_MAX)
+			return NULL;
+
+		tq = zalloc(sizeof *tq);
+		if (!tq)
+			return NULL;
+		gr->gen_queries(2, tq->queries);
+		gr->timer_query_count++;
+	}
+
+	tq->begin_name = begin_name;
+	tq->end_name = end_name;
+	tq->output = output;
+	tq->surface = surface;
+	wl_list_insert(gr->timer_query_list.prev, &tq->link);
+
+	gr->query_counter(tq->queries[0], GL_TIMESTAMP_EXT);
+
+	return tq;
+}
+
+static void
+gpu_timer_end(struct gl_renderer *gr, struct gl_timer_query *tq)
+{
+	if (tq)
+		gr->query_counter(tq->queries[1], GL_TIMESTAMP_EXT);
+}
+
+static void
+gpu_timer_release(struct gl_renderer *gr, struct gl_timer_query *tq)
+{
+	wl_list_remove(&tq->link);
+	tq->output = NULL;
+	tq->surface = NULL;
+	wl_list_insert(&gr->timer_query_free_list, &tq->link);
+}
+
+/* Drop the pending queries of an output or surface going away */
+static void
+gpu_timer_discard(struct gl_renderer *gr, struct weston_output *output,
+		  struct weston_surface *surface)
+{
+	struct gl_timer_query *tq, *tmp;
+
+	wl_list_for_each_safe(tq, tmp, &gr->timer_query_list, link) {
+		if ((output && tq->output == output) ||
+		    (surface && tq->surface == surface))
+			gpu_timer_release(gr, tq);
+	}
+}
+
+static void
+gpu_timer_emit(struct weston_compositor *ec, struct gl_timer_query *tq,
+	       const char *name, uint64_t gpu_time, int64_t offset)
+{
+	struct timespec ts;
+
+	timespec_from_nsec(&ts, gpu_time + offset);
+
+	if (tq->output)
+		TL_POINT(ec, name, TLP_GPU(&ts), TLP_OUTPUT(tq->output),
+			 TLP_END);
+	else
+		TL_POINT(ec, name, TLP_GPU(&ts), TLP_SURFACE(tq->surface),
+			 TLP_END);
+}
+
+/* Emit the finished queries without waiting for the GPU.
+ *
+ * GPU timestamps are converted to CLOCK_MONOTONIC, like the sync file
+ * timestamps of renderer_gpu_begin/end, with an offset taken from the
+ * current GPU time.
+ */
+static void
+gpu_timer_collect(struct weston_compositor *ec)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_timer_query *tq, *tmp;
+	struct timespec now;
+	int64_t gpu_now = 0;
+	int64_t offset;
+	GLint disjoint = 0;
+
+	if (wl_list_empty(&gr->timer_query_list))
+		return;
+
+	/* Results cannot be trusted if the GPU clock jumped meanwhile. */
+	glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+
+	gr->get_integer64v(GL_TIMESTAMP_EXT, &gpu_now);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	offset = timespec_to_nsec(&now) - gpu_now;
+
+	wl_list_for_each_safe(tq, tmp, &gr->timer_query_list, link) {
+		GLuint available = 0;
+		uint64_t begin, end;
+
+		/* Queries complete in order, stop at the first busy one. */
+		gr->get_query_objectuiv(tq->queries[1],
+					GL_QUERY_RESULT_AVAILABLE_EXT,
+					&available);
+		if (!available)
+			break;
+
+		if (!disjoint) {
+			gr->get_query_objectui64v(tq->queries[0],
+						  GL_QUERY_RESULT_EXT, &begin);
+			gr->get_query_objectui64v(tq->queries[1],
+						  GL_QUERY_RESULT_EXT, &end);
+			gpu_timer_emit(ec, tq, tq->begin_name, begin, offset);
+			gpu_timer_emit(ec, tq, tq->end_name, end, offset);
+		}
+
+		gpu_timer_release(gr, tq);
+	}
+}
+
 static struct egl_image*
 egl_image_create(struct gl_renderer *gr, EGLenum target,
 		 EGLClientBuffer buffer, const EGLint *attribs)
@@ -413,6 +741,27 @@ dmabuf_image_destroy(struct dmabuf_image *image)
  * Guarantees to produce either zero vertices, or 3-8 vertices with non-zero
  * polygon area.
  */
+static void
+surface_rect_to_global(struct weston_view *ev, pixman_box32_t *surf_rect,
+		       struct polygon8 *surf)
+{
+	int i;
+
+	surf->x[0] = surf_rect->x1;
+	surf->x[1] = surf_rect->x2;
+	surf->x[2] = surf_rect->x2;
+	surf->x[3] = surf_rect->x1;
+	surf->y[0] = surf_rect->y1;
+	surf->y[1] = surf_rect->y1;
+	surf->y[2] = surf_rect->y2;
+	surf->y[3] = surf_rect->y2;
+	surf->n = 4;
+
+	for (i = 0; i < surf->n; i++)
+		weston_view_to_global_float(ev, surf->x[i], surf->y[i],
+					    &surf->x[i], &surf->y[i]);
+}
+
 static int
 calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
 		pixman_box32_t *surf_rect, GLfloat *ex, GLfloat *ey)
@@ -421,11 +770,7 @@ calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
 	struct clip_context ctx;
 	int i, n;
 	GLfloat min_x, max_x, min_y, max_y;
-	struct polygon8 surf = {
-		{ surf_rect->x1, surf_rect->x2, surf_rect->x2, surf_rect->x1 },
-		{ surf_rect->y1, surf_rect->y1, surf_rect->y2, surf_rect->y2 },
-		4
-	};
+	struct polygon8 surf;
 
 	ctx.clip.x1 = rect->x1;
 	ctx.clip.y1 = rect->y1;
@@ -433,9 +778,7 @@ calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
 	ctx.clip.y2 = rect->y2;
 
 	/* transform surface to screen space: */
-	for (i = 0; i < surf.n; i++)
-		weston_view_to_global_float(ev, surf.x[i], surf.y[i],
-					    &surf.x[i], &surf.y[i]);
+	surface_rect_to_global(ev, surf_rect, &surf);
 
 	/* find bounding box: */
 	min_x = max_x = surf.x[0];
@@ -525,18 +868,96 @@ compress_bands(pixman_box32_t *inrects, int nrects,
 	return nout;
 }
 
+/* Writes the position and texture coordinates of the edge points */
+static GLfloat *
+emit_edges(struct weston_view *ev, GLfloat *v,
+	   const GLfloat *ex, const GLfloat *ey, int n)
+{
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	GLfloat sx, sy, bx, by;
+	GLfloat inv_width, inv_height;
+	int k;
+
+	if (gs->atlas_page) {
+		inv_width = 1.0 / GL_ATLAS_PAGE_SIZE;
+		inv_height = 1.0 / GL_ATLAS_PAGE_SIZE;
+	} else {
+		inv_width = 1.0 / gs->pitch;
+		inv_height = 1.0 / gs->height;
+	}
+
+	for (k = 0; k < n; k++) {
+		weston_view_from_global_float(ev, ex[k], ey[k], &sx, &sy);
+		/* position: */
+		*(v++) = ex[k];
+		*(v++) = ey[k];
+		/* texcoord: */
+		weston_surface_to_buffer_float(ev->surface, sx, sy, &bx, &by);
+		*(v++) = (gs->atlas_x + bx) * inv_width;
+		if (gs->y_inverted) {
+			*(v++) = (gs->atlas_y + by) * inv_height;
+		} else {
+			*(v++) = (gs->height - by) * inv_height;
+		}
+	}
+
+	return v;
+}
+
+/* Transformed views: transform each surface rectangle once and clip it
+ * against the clip rectangles CLIP_BATCH_SIZE at a time.
+ */
+static unsigned int
+texture_region_transformed(struct weston_view *ev, GLfloat *v,
+			   unsigned int *vtxcnt,
+			   pixman_box32_t *rects, int nrects,
+			   pixman_box32_t *surf_rects, int nsurf)
+{
+	GLfloat ex[CLIP_BATCH_SIZE][8], ey[CLIP_BATCH_SIZE][8];
+	int n[CLIP_BATCH_SIZE];
+	struct clip_batch batch;
+	struct polygon8 surf;
+	unsigned int nvtx = 0;
+	int i, j, k;
+
+	for (j = 0; j < nsurf; j++) {
+		surface_rect_to_global(ev, &surf_rects[j], &surf);
+
+		for (i = 0; i < nrects; i += batch.count) {
+			batch.count = MIN(nrects - i, CLIP_BATCH_SIZE);
+			for (k = 0; k < batch.count; k++) {
+				batch.x1[k] = rects[i + k].x1;
+				batch.y1[k] = rects[i + k].y1;
+				batch.x2[k] = rects[i + k].x2;
+				batch.y2[k] = rects[i + k].y2;
+			}
+
+			clip_transformed_batch(&batch, &surf, ex, ey, n);
+
+			for (k = 0; k < batch.count; k++) {
+				if (n[k] < 3)
+					continue;
+
+				v = emit_edges(ev, v, ex[k], ey[k], n[k]);
+				vtxcnt[nvtx++] = n[k];
+			}
+		}
+	}
+
+	return nvtx;
+}
+
 static int
 texture_region(struct weston_view *ev, pixman_region32_t *region,
 		pixman_region32_t *surf_region)
 {
-	struct gl_surface_state *gs = get_surface_state(ev->surface);
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v, inv_width, inv_height;
+	GLfloat *v;
 	unsigned int *vtxcnt, nvtx = 0;
 	pixman_box32_t *rects, *surf_rects;
 	pixman_box32_t *raw_rects;
-	int i, j, k, nrects, nsurf, raw_nrects;
+	int i, j, nrects, nsurf, raw_nrects;
 	bool used_band_compression;
 	raw_rects = pixman_region32_rectangles(region, &raw_nrects);
 	surf_rects = pixman_region32_rectangles(surf_region, &nsurf);
@@ -555,14 +976,17 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	v = wl_array_add(&gr->vertices, nrects * nsurf * 8 * 4 * sizeof *v);
 	vtxcnt = wl_array_add(&gr->vtxcnt, nrects * nsurf * sizeof *vtxcnt);
 
-	inv_width = 1.0 / gs->pitch;
-        inv_height = 1.0 / gs->height;
+	if (ev->transform.enabled) {
+		nvtx = texture_region_transformed(ev, v, vtxcnt,
+						  rects, nrects,
+						  surf_rects, nsurf);
+		goto out;
+	}
 
 	for (i = 0; i < nrects; i++) {
 		pixman_box32_t *rect = &rects[i];
 		for (j = 0; j < nsurf; j++) {
 			pixman_box32_t *surf_rect = &surf_rects[j];
-			GLfloat sx, sy, bx, by;
 			GLfloat ex[8], ey[8];          /* edge points in screen space */
 			int n;
 
@@ -585,82 +1009,109 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 				continue;
 
 			/* emit edge points: */
-			for (k = 0; k < n; k++) {
-				weston_view_from_global_float(ev, ex[k], ey[k],
-							      &sx, &sy);
-				/* position: */
-				*(v++) = ex[k];
-				*(v++) = ey[k];
-				/* texcoord: */
-				weston_surface_to_buffer_float(ev->surface,
-							       sx, sy,
-							       &bx, &by);
-				*(v++) = bx * inv_width;
-				if (gs->y_inverted) {
-					*(v++) = by * inv_height;
-				} else {
-					*(v++) = (gs->height - by) * inv_height;
-				}
-			}
-
+			v = emit_edges(ev, v, ex, ey, n);
 			vtxcnt[nvtx++] = n;
 		}
 	}
 
+out:
 	if (used_band_compression)
 		free(rects);
 	return nvtx;
 }
 
-static void
-triangle_fan_debug(struct weston_view *view, int first, int count)
+/* A batch of indexed triangles sharing the same GL state. draw_view()
+ * records these instead of drawing right away, so that consecutive
+ * regions and views with identical state collapse into a single
+ * glDrawElements() call; flush_draws() uploads all vertices and
+ * indices of the repaint once and issues the recorded draws.
+ */
+struct gl_draw {
+	struct gl_shader *shader;
+	GLenum target;
+	GLuint textures[3];
+	int num_textures;
+	GLint filter;
+	GLfloat color[4];
+	GLfloat alpha;
+	bool blend;
+
+	/* indices are relative to first_vertex, so that they fit in
+	 * GLushort */
+	uint32_t first_vertex;
+	uint32_t num_vertices;
+	uint32_t first_index;
+	uint32_t num_indices;
+};
+
+#define GL_DRAW_MAX_VERTICES (UINT16_MAX + 1)
+
+static bool
+gl_draw_state_equal(const struct gl_draw *a, const struct gl_draw *b)
 {
-	struct weston_compositor *compositor = view->surface->compositor;
-	struct gl_renderer *gr = get_renderer(compositor);
 	int i;
-	GLushort *buffer;
-	GLushort *index;
-	int nelems;
-	static int color_idx = 0;
-	static const GLfloat color[][4] = {
-			{ 1.0, 0.0, 0.0, 1.0 },
-			{ 0.0, 1.0, 0.0, 1.0 },
-			{ 0.0, 0.0, 1.0, 1.0 },
-			{ 1.0, 1.0, 1.0, 1.0 },
-	};
 
-	nelems = (count - 1 + count - 2) * 2;
+	if (a->shader != b->shader || a->target != b->target ||
+	    a->num_textures != b->num_textures || a->filter != b->filter ||
+	    a->alpha != b->alpha || a->blend != b->blend)
+		return false;
 
-	buffer = malloc(sizeof(GLushort) * nelems);
-	index = buffer;
+	for (i = 0; i < a->num_textures; i++)
+		if (a->textures[i] != b->textures[i])
+			return false;
 
-	for (i = 1; i < count; i++) {
-		*index++ = first;
-		*index++ = first + i;
-	}
+	for (i = 0; i < 4; i++)
+		if (a->color[i] != b->color[i])
+			return false;
 
-	for (i = 2; i < count; i++) {
-		*index++ = first + i - 1;
-		*index++ = first + i;
-	}
+	return true;
+}
 
-	glUseProgram(gr->solid_shader.program);
-	glUniform4fv(gr->solid_shader.color_uniform, 1,
-			color[color_idx++ % ARRAY_LENGTH(color)]);
-	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
-	glUseProgram(gr->current_shader->program);
-	free(buffer);
+/* Returns the draw that the fan starting at vertex 'first' with 'count'
+ * vertices is to be appended to: the last recorded one if it has the
+ * same state and room left, a new one otherwise.
+ */
+static struct gl_draw *
+gl_draw_get(struct gl_renderer *gr, const struct gl_draw *state,
+	    uint32_t first, uint32_t count)
+{
+	struct gl_draw *draw = NULL;
+
+	if (gr->draws.size > 0)
+		draw = (struct gl_draw *)
+			((char *)gr->draws.data + gr->draws.size) - 1;
+
+	if (draw && gl_draw_state_equal(draw, state) &&
+	    draw->first_vertex + draw->num_vertices == first &&
+	    draw->num_vertices + count <= GL_DRAW_MAX_VERTICES)
+		return draw;
+
+	draw = wl_array_add(&gr->draws, sizeof *draw);
+	if (!draw)
+		return NULL;
+
+	*draw = *state;
+	draw->first_vertex = first;
+	draw->num_vertices = 0;
+	draw->first_index = gr->indices.size / sizeof(GLushort);
+	draw->num_indices = 0;
+
+	return draw;
 }
 
 static void
 repaint_region(struct weston_view *ev, pixman_region32_t *region,
-		pixman_region32_t *surf_region)
+		pixman_region32_t *surf_region, const struct gl_draw *state)
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v;
+	struct gl_draw *draw;
+	GLushort *index;
 	unsigned int *vtxcnt;
-	int i, first, nfans;
+	size_t vertices_size = gr->vertices.size;
+	uint32_t first;
+	int i, nfans;
+	unsigned int k;
 
 	/* The final region to be painted is the intersection of
 	 * 'region' and 'surf_region'. However, 'region' is in the global
@@ -669,31 +1120,38 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 	 * rectangles from both regions, compute the intersection
 	 * polygon for each pair, and store it as a triangle fan if
 	 * it has a non-zero area (at least 3 vertices, actually).
+	 * The fans are appended to the vertices of the previous calls,
+	 * and turned into triangle lists here.
 	 */
 	nfans = texture_region(ev, region, surf_region);
 
-	v = gr->vertices.data;
 	vtxcnt = gr->vtxcnt.data;
+	first = vertices_size / (4 * sizeof(GLfloat));
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glEnableVertexAttribArray(0);
+	for (i = 0; i < nfans; i++) {
+		draw = gl_draw_get(gr, state, first, vtxcnt[i]);
+		if (!draw)
+			break;
 
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
-	glEnableVertexAttribArray(1);
+		index = wl_array_add(&gr->indices,
+				     (vtxcnt[i] - 2) * 3 * sizeof *index);
+		if (!index)
+			break;
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (gr->fan_debug)
-			triangle_fan_debug(ev, first, vtxcnt[i]);
+		for (k = 1; k < vtxcnt[i] - 1; k++) {
+			*index++ = first - draw->first_vertex;
+			*index++ = first - draw->first_vertex + k;
+			*index++ = first - draw->first_vertex + k + 1;
+		}
+
+		draw->num_vertices += vtxcnt[i];
+		draw->num_indices += (vtxcnt[i] - 2) * 3;
 		first += vtxcnt[i];
 	}
 
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
-
-	gr->vertices.size = 0;
+	/* texture_region() reserves room for the worst case, drop what
+	 * is left unused (or was not recorded) */
+	gr->vertices.size = first * 4 * sizeof(GLfloat);
 	gr->vtxcnt.size = 0;
 }
 
@@ -744,61 +1202,222 @@ use_shader(struct gl_renderer *gr, struct gl_shader *shader)
 	gr->current_shader = shader;
 }
 
-static void
-shader_uniforms(struct gl_shader *shader,
-		struct weston_view *view,
-		struct weston_output *output)
+/* Texture unit of the output color LUT, after those of the views */
+#define COLOR_LUT_TEXTURE_UNIT 3
+
+/* Returns the variant of shader that applies the output color LUT of go,
+ * or shader itself if go has none. */
+static struct gl_shader *
+shader_color_lut(struct gl_output_state *go, struct gl_shader *shader)
 {
-	int i;
-	struct gl_surface_state *gs = get_surface_state(view->surface);
-	struct gl_output_state *go = get_output_state(output);
+	struct gl_shader *variant;
 
-	glUniformMatrix4fv(shader->proj_uniform,
-			   1, GL_FALSE, go->output_matrix.d);
-	glUniform4fv(shader->color_uniform, 1, gs->color);
-	glUniform1f(shader->alpha_uniform, view->alpha);
+	if (!go->color_lut_tex)
+		return shader;
 
-	for (i = 0; i < gs->num_textures; i++)
-		glUniform1i(shader->tex_uniforms[i], i);
+	if (shader->color_lut)
+		return shader->color_lut;
+
+	variant = zalloc(sizeof *variant);
+	if (!variant)
+		return shader;
+
+	variant->vertex_source = shader->vertex_source;
+	variant->fragment_source = shader->fragment_source;
+	variant->is_color_lut = true;
+	shader->color_lut = variant;
+
+	return variant;
 }
 
-static int
-ensure_surface_buffer_is_ready(struct gl_renderer *gr,
-			       struct gl_surface_state *gs)
+static void
+shader_free_color_lut(struct gl_shader *shader)
 {
-	EGLint attribs[] = {
-		EGL_SYNC_NATIVE_FENCE_FD_ANDROID,
-		-1,
-		EGL_NONE
+	free(shader->color_lut);
+	shader->color_lut = NULL;
+}
+
+static void
+triangle_debug(struct gl_renderer *gr, struct gl_output_state *go,
+	       const struct gl_draw *draw)
+{
+	const GLushort *tri;
+	GLushort *buffer;
+	GLushort *index;
+	uint32_t i;
+	static int color_idx = 0;
+	static const GLfloat color[][4] = {
+			{ 1.0, 0.0, 0.0, 1.0 },
+			{ 0.0, 1.0, 0.0, 1.0 },
+			{ 0.0, 0.0, 1.0, 1.0 },
+			{ 1.0, 1.0, 1.0, 1.0 },
 	};
-	struct weston_surface *surface = gs->surface;
-	struct weston_buffer *buffer = gs->buffer_ref.buffer;
-	EGLSyncKHR sync;
-	EGLint wait_ret;
-	EGLint destroy_ret;
 
+	buffer = malloc(sizeof(GLushort) * draw->num_indices * 2);
 	if (!buffer)
-		return 0;
-
-	if (surface->acquire_fence_fd < 0)
-		return 0;
+		return;
 
-	/* We should only get a fence if we support EGLSyncKHR, since
-	 * we don't advertise the explicit sync protocol otherwise. */
-	assert(gr->has_native_fence_sync);
-	/* We should only get a fence for non-SHM buffers, since surface
-	 * commit would have failed otherwise. */
-	assert(wl_shm_buffer_get(buffer->resource) == NULL);
+	tri = (const GLushort *)gr->indices.data + draw->first_index;
+	index = buffer;
 
-	attribs[1] = dup(surface->acquire_fence_fd);
-	if (attribs[1] == -1) {
-		linux_explicit_synchronization_send_server_error(
-			gs->surface->synchronization_resource,
-			"Failed to dup acquire fence");
-		return -1;
+	for (i = 0; i < draw->num_indices; i += 3) {
+		*index++ = tri[i];
+		*index++ = tri[i + 1];
+		*index++ = tri[i + 1];
+		*index++ = tri[i + 2];
+		*index++ = tri[i + 2];
+		*index++ = tri[i];
 	}
 
-	sync = gr->create_sync(gr->egl_display,
+	use_shader(gr, &gr->solid_shader);
+	glUniformMatrix4fv(gr->solid_shader.proj_uniform,
+			   1, GL_FALSE, go->output_matrix.d);
+	glUniform1f(gr->solid_shader.alpha_uniform, 1.0);
+	glUniform4fv(gr->solid_shader.color_uniform, 1,
+			color[color_idx++ % ARRAY_LENGTH(color)]);
+
+	/* the line indices come from client memory */
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glDrawElements(GL_LINES, index - buffer, GL_UNSIGNED_SHORT, buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gr->index_buffer);
+	free(buffer);
+}
+
+static void
+draw_apply_state(struct gl_renderer *gr, struct gl_output_state *go,
+		 const struct gl_draw *draw)
+{
+	struct gl_shader *shader = draw->shader;
+	int i;
+
+	use_shader(gr, shader);
+	glUniformMatrix4fv(shader->proj_uniform,
+			   1, GL_FALSE, go->output_matrix.d);
+	glUniform4fv(shader->color_uniform, 1, draw->color);
+	glUniform1f(shader->alpha_uniform, draw->alpha);
+
+	if (shader->is_color_lut) {
+		glUniform1i(shader->color_lut_uniform, COLOR_LUT_TEXTURE_UNIT);
+		glUniform1f(shader->color_lut_size_uniform, go->color_lut_size);
+		glActiveTexture(GL_TEXTURE0 + COLOR_LUT_TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_2D, go->color_lut_tex);
+	}
+
+	for (i = 0; i < draw->num_textures; i++) {
+		glUniform1i(shader->tex_uniforms[i], i);
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(draw->target, draw->textures[i]);
+		glTexParameteri(draw->target, GL_TEXTURE_MIN_FILTER,
+				draw->filter);
+		glTexParameteri(draw->target, GL_TEXTURE_MAG_FILTER,
+				draw->filter);
+	}
+
+	if (draw->blend)
+		glEnable(GL_BLEND);
+	else
+		glDisable(GL_BLEND);
+}
+
+/* Uploads the geometry recorded by repaint_region() since the last flush
+ * to buffer objects, one upload each per call, and issues the draws.
+ */
+static void
+flush_draws(struct gl_renderer *gr, struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	const struct gl_draw *draw;
+	uintptr_t offset;
+
+	if (gr->draws.size == 0)
+		goto out;
+
+	if (!gr->vertex_buffer)
+		glGenBuffers(1, &gr->vertex_buffer);
+	if (!gr->index_buffer)
+		glGenBuffers(1, &gr->index_buffer);
+
+	glBindBuffer(GL_ARRAY_BUFFER, gr->vertex_buffer);
+	glBufferData(GL_ARRAY_BUFFER, gr->vertices.size,
+		     gr->vertices.data, GL_STREAM_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gr->index_buffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, gr->indices.size,
+		     gr->indices.data, GL_STREAM_DRAW);
+
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	wl_array_for_each(draw, &gr->draws) {
+		draw_apply_state(gr, go, draw);
+
+		offset = draw->first_vertex * 4 * sizeof(GLfloat);
+		/* position: */
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+				      4 * sizeof(GLfloat), (void *)offset);
+		/* texcoord: */
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+				      4 * sizeof(GLfloat),
+				      (void *)(offset + 2 * sizeof(GLfloat)));
+
+		glDrawElements(GL_TRIANGLES, draw->num_indices,
+			       GL_UNSIGNED_SHORT,
+			       (void *)(uintptr_t)(draw->first_index *
+						   sizeof(GLushort)));
+		if (gr->fan_debug)
+			triangle_debug(gr, go, draw);
+	}
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	/* the other draws in this file use client side arrays */
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+out:
+	gr->vertices.size = 0;
+	gr->indices.size = 0;
+	gr->draws.size = 0;
+}
+
+static int
+ensure_surface_buffer_is_ready(struct gl_renderer *gr,
+			       struct gl_surface_state *gs)
+{
+	EGLint attribs[] = {
+		EGL_SYNC_NATIVE_FENCE_FD_ANDROID,
+		-1,
+		EGL_NONE
+	};
+	struct weston_surface *surface = gs->surface;
+	struct weston_buffer *buffer = gs->buffer_ref.buffer;
+	EGLSyncKHR sync;
+	EGLint wait_ret;
+	EGLint destroy_ret;
+
+	if (!buffer)
+		return 0;
+
+	if (surface->acquire_fence_fd < 0)
+		return 0;
+
+	/* We should only get a fence if we support EGLSyncKHR, since
+	 * we don't advertise the explicit sync protocol otherwise. */
+	assert(gr->has_native_fence_sync);
+	/* We should only get a fence for non-SHM buffers, since surface
+	 * commit would have failed otherwise. */
+	assert(wl_shm_buffer_get(buffer->resource) == NULL);
+
+	attribs[1] = dup(surface->acquire_fence_fd);
+	if (attribs[1] == -1) {
+		linux_explicit_synchronization_send_server_error(
+			gs->surface->synchronization_resource,
+			"Failed to dup acquire fence");
+		return -1;
+	}
+
+	sync = gr->create_sync(gr->egl_display,
 			       EGL_SYNC_NATIVE_FENCE_ANDROID,
 			       attribs);
 	if (sync == EGL_NO_SYNC_KHR) {
@@ -880,6 +1499,102 @@ setup_censor_overrides(struct weston_output *output,
 	return replaced_shader;
 }
 
+/* Paints an opaque solid color view that is only translated with scissored
+ * clears instead of drawing it. Clears aren't recorded, so this only works
+ * while no draws have been recorded beneath the view.
+ */
+static bool
+draw_view_clear(struct weston_view *ev, struct weston_output *output,
+		pixman_region32_t *repaint) /* in global coordinates */
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_output_state *go = get_output_state(output);
+	pixman_region32_t region;
+	pixman_box32_t *rects;
+	float x, y;
+	int buffer_height;
+	int i, n;
+
+	if (gs->shader != &gr->solid_shader || gs->color[3] < 1.0 ||
+	    ev->alpha < 1.0 || ev->transform.enabled || output->zoom.active ||
+	    go->color_lut_tex || gr->draws.size > 0 ||
+	    gr->fragment_shader_debug || gr->fan_debug)
+		return false;
+
+	weston_view_to_global_float(ev, 0, 0, &x, &y);
+	if (x != (int)x || y != (int)y)
+		return false;
+
+	pixman_region32_init_rect(&region, 0, 0,
+				  ev->surface->width, ev->surface->height);
+	if (ev->geometry.scissor_enabled)
+		pixman_region32_intersect(&region, &region,
+					  &ev->geometry.scissor);
+	pixman_region32_translate(&region, (int)x, (int)y);
+	pixman_region32_intersect(&region, &region, repaint);
+
+	pixman_region32_translate(&region, -output->x, -output->y);
+	weston_transformed_region(output->width, output->height,
+				  output->transform,
+				  output->current_scale,
+				  &region, &region);
+	pixman_region32_translate(&region,
+				  go->borders[GL_RENDERER_BORDER_LEFT].width,
+				  go->borders[GL_RENDERER_BORDER_TOP].height);
+
+	buffer_height = go->borders[GL_RENDERER_BORDER_TOP].height +
+			output->current_mode->height +
+			go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	glClearColor(gs->color[0], gs->color[1], gs->color[2], 1.0);
+	glEnable(GL_SCISSOR_TEST);
+	rects = pixman_region32_rectangles(&region, &n);
+	for (i = 0; i < n; i++) {
+		glScissor(rects[i].x1, buffer_height - rects[i].y2,
+			  rects[i].x2 - rects[i].x1,
+			  rects[i].y2 - rects[i].y1);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+	glDisable(GL_SCISSOR_TEST);
+
+	pixman_region32_fini(&region);
+
+	return true;
+}
+
+static int
+solid_batch_quantize(GLfloat c)
+{
+	return MAX(0.0f, MIN(c, 1.0f)) * 255.0f + 0.5f;
+}
+
+static GLfloat
+solid_batch_pack(GLfloat hi, GLfloat lo)
+{
+	return solid_batch_quantize(hi) * 256 + solid_batch_quantize(lo);
+}
+
+/* Stores color in the texture coordinates of the vertices recorded since
+ * vertices_size, for solid_batch_shader to draw solid views of different
+ * colors in one batch.
+ */
+static void
+solid_batch_color(struct gl_renderer *gr, size_t vertices_size,
+		  const GLfloat color[4])
+{
+	GLfloat *v = (GLfloat *)((char *)gr->vertices.data + vertices_size);
+	GLfloat *end = (GLfloat *)((char *)gr->vertices.data +
+				   gr->vertices.size);
+	GLfloat s = solid_batch_pack(color[0], color[1]);
+	GLfloat t = solid_batch_pack(color[2], color[3]);
+
+	for (; v < end; v += 4) {
+		v[2] = s;
+		v[3] = t;
+	}
+}
+
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
 	  pixman_region32_t *damage) /* in global coordinates */
@@ -887,13 +1602,17 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_output_state *go = get_output_state(output);
 	/* repaint bounding region in global coordinates: */
 	pixman_region32_t repaint;
 	/* opaque region in surface coordinates: */
 	pixman_region32_t surface_opaque;
 	/* non-opaque region in surface coordinates: */
 	pixman_region32_t surface_blend;
-	GLint filter;
+	struct gl_draw state = { 0 };
+	struct gl_shader *shader;
+	size_t vertices_size;
+	bool solid_batch;
 	int i;
 	struct gl_shader *replaced_shader = NULL;
 
@@ -903,6 +1622,10 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!gs->shader && !gs->direct_display)
 		return;
 
+	wl_list_remove(&gs->link);
+	wl_list_insert(&gr->surface_state_list, &gs->link);
+	gs->last_used_msec = gr->repaint_msec;
+
 	pixman_region32_init(&repaint);
 	pixman_region32_intersect(&repaint,
 				  &ev->transform.boundingbox, damage);
@@ -911,33 +1634,37 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
 
+	if (gs->num_evicted_textures && gs->buffer_type == BUFFER_TYPE_SHM)
+		gl_surface_flush_damage(ev->surface, true);
+
 	if (ensure_surface_buffer_is_ready(gr, gs) < 0)
 		goto out;
 
 	replaced_shader = setup_censor_overrides(output, ev);
 
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	if (draw_view_clear(ev, output, &repaint))
+		goto out;
 
-	if (gr->fan_debug) {
-		use_shader(gr, &gr->solid_shader);
-		shader_uniforms(&gr->solid_shader, ev, output);
-	}
+	/* solid colors go with the vertices rather than the state */
+	shader = gs->shader;
+	solid_batch = shader == &gr->solid_shader;
+	if (solid_batch)
+		shader = &gr->solid_batch_shader;
+	else
+		memcpy(state.color, gs->color, sizeof state.color);
 
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
+	state.shader = shader_color_lut(go, shader);
+	state.target = gs->target;
+	state.num_textures = gs->num_textures;
+	for (i = 0; i < gs->num_textures; i++)
+		state.textures[i] = gs->textures[i];
+	state.alpha = ev->alpha;
 
 	if (ev->transform.enabled || output->zoom.active ||
 	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
-		filter = GL_LINEAR;
+		state.filter = GL_LINEAR;
 	else
-		filter = GL_NEAREST;
-
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
-	}
+		state.filter = GL_NEAREST;
 
 	/* blended region is whole surface minus opaque region: */
 	pixman_region32_init_rect(&surface_blend, 0, 0,
@@ -950,12 +1677,22 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 
 	/* XXX: Should we be using ev->transform.opaque here? */
 	pixman_region32_init(&surface_opaque);
+	if (ev->surface->is_opaque ||
+	    (gs->buffer_type == BUFFER_TYPE_SHM && gs->alpha_opaque)) {
+		/* The content is opaque even if the client never said so,
+		 * as with X formats or Xwayland and RAIL surfaces. */
+		pixman_region32_fini(&surface_opaque);
+		pixman_region32_init_rect(&surface_opaque, 0, 0,
+					  ev->surface->width,
+					  ev->surface->height);
+		pixman_region32_subtract(&surface_blend, &surface_blend,
+					 &surface_opaque);
+	} else {
+		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
+	}
 	if (ev->geometry.scissor_enabled)
-		pixman_region32_intersect(&surface_opaque,
-					  &ev->surface->opaque,
+		pixman_region32_intersect(&surface_opaque, &surface_opaque,
 					  &ev->geometry.scissor);
-	else
-		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
 
 	if (pixman_region32_not_empty(&surface_opaque)) {
 		if (gs->shader == &gr->texture_shader_rgba) {
@@ -964,23 +1701,26 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 			 * that forces texture alpha = 1.0.
 			 * Xwayland surfaces need this.
 			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
+			state.shader = shader_color_lut(go,
+						&gr->texture_shader_rgbx);
 		}
 
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
-		else
-			glDisable(GL_BLEND);
+		state.blend = ev->alpha < 1.0;
 
-		repaint_region(ev, &repaint, &surface_opaque);
+		vertices_size = gr->vertices.size;
+		repaint_region(ev, &repaint, &surface_opaque, &state);
+		if (solid_batch)
+			solid_batch_color(gr, vertices_size, gs->color);
 		gs->used_in_output_repaint = true;
 	}
 
 	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
-		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
+		state.shader = shader_color_lut(go, shader);
+		state.blend = true;
+		vertices_size = gr->vertices.size;
+		repaint_region(ev, &repaint, &surface_blend, &state);
+		if (solid_batch)
+			solid_batch_color(gr, vertices_size, gs->color);
 		gs->used_in_output_repaint = true;
 	}
 
@@ -998,11 +1738,15 @@ static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
+		if (view->plane == &compositor->primary_plane &&
+		    !view->occluded)
 			draw_view(view, output, damage);
+
+	flush_draws(gr, output);
 }
 
 static int
@@ -1252,7 +1996,10 @@ output_get_damage(struct weston_output *output,
 	EGLBoolean ret;
 	int i;
 
-	if (gr->has_egl_buffer_age) {
+	if (go->buffer_count > 0) {
+		if (go->buffers_painted >= go->buffer_count)
+			buffer_age = go->buffer_count;
+	} else if (gr->has_egl_buffer_age) {
 		ret = eglQuerySurface(gr->egl_display, go->egl_surface,
 				      EGL_BUFFER_AGE_EXT, &buffer_age);
 		if (ret == EGL_FALSE) {
@@ -1290,7 +2037,7 @@ output_rotate_damage(struct weston_output *output,
 	struct gl_output_state *go = get_output_state(output);
 	struct gl_renderer *gr = get_renderer(output->compositor);
 
-	if (!gr->has_egl_buffer_age)
+	if (!gr->has_egl_buffer_age && go->buffer_count == 0)
 		return;
 
 	go->buffer_damage_index += BUFFER_DAMAGE_COUNT - 1;
@@ -1377,6 +2124,238 @@ pixman_region_to_egl_y_invert(struct weston_output *output,
  * Depending on the underlying hardware, violating that assumption could
  * result in seeing through to another display plane.
  */
+static void
+output_upload_color_lut(struct gl_output_state *go)
+{
+	unsigned int n = go->color_lut_size;
+
+	go->color_lut_dirty = false;
+
+	if (!go->color_lut_pending) {
+		glDeleteTextures(1, &go->color_lut_tex);
+		go->color_lut_tex = 0;
+		return;
+	}
+
+	if (!go->color_lut_tex)
+		glGenTextures(1, &go->color_lut_tex);
+
+	glActiveTexture(GL_TEXTURE0 + COLOR_LUT_TEXTURE_UNIT);
+	glBindTexture(GL_TEXTURE_2D, go->color_lut_tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, n * n, n, 0,
+		     GL_RGBA, GL_UNSIGNED_BYTE, go->color_lut_pending);
+	glActiveTexture(GL_TEXTURE0);
+
+	free(go->color_lut_pending);
+	go->color_lut_pending = NULL;
+}
+
+/* The damage heatmap shows how often each part of an output was repainted
+ * in the last GL_HEATMAP_WINDOW_MSEC, from blue to fully red at
+ * GL_HEATMAP_HOT repaints, and logs the commit and damage rates of the
+ * surfaces that committed in that time. */
+#define GL_HEATMAP_TILE 16
+#define GL_HEATMAP_WINDOW_MSEC 1000
+#define GL_HEATMAP_HOT 30
+#define GL_HEATMAP_BATCH 256 /* quads per draw */
+
+static void
+damage_heatmap_release(struct gl_output_state *go)
+{
+	free(go->heat);
+	free(go->heat_shown);
+	go->heat = NULL;
+	go->heat_shown = NULL;
+	go->heat_width = 0;
+	go->heat_height = 0;
+}
+
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *boxes;
+	uint64_t area = 0;
+	int i, n;
+
+	boxes = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t)(boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1);
+
+	return area;
+}
+
+static void
+damage_heatmap_log_surfaces(struct gl_renderer *gr)
+{
+	struct gl_surface_state *gs;
+	uint32_t window = gr->repaint_msec - gr->heatmap_window_start;
+	uint64_t surface_area;
+	char desc[512];
+
+	if (window < GL_HEATMAP_WINDOW_MSEC)
+		return;
+
+	wl_list_for_each(gs, &gr->surface_state_list, link) {
+		struct weston_surface *surface = gs->surface;
+
+		if (gs->heat_commits == 0)
+			continue;
+
+		if (!surface->get_label ||
+		    surface->get_label(surface, desc, sizeof desc) < 0)
+			strcpy(desc, "[no description available]");
+
+		surface_area = (uint64_t)surface->width * surface->height;
+		weston_log("damage heatmap: %s (%p): %.1f commits/s, "
+			   "%.0f damaged px/s, %.1f surfaces/s\n",
+			   desc, surface,
+			   gs->heat_commits * 1000.0 / window,
+			   gs->heat_damage_area * 1000.0 / window,
+			   surface_area ? (double)gs->heat_damage_area /
+					  surface_area * 1000.0 / window : 0.0);
+
+		gs->heat_commits = 0;
+		gs->heat_damage_area = 0;
+	}
+
+	gr->heatmap_window_start = gr->repaint_msec;
+}
+
+static void
+damage_heatmap_accumulate(struct weston_output *output,
+			  pixman_region32_t *damage)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	int width = (output->width + GL_HEATMAP_TILE - 1) / GL_HEATMAP_TILE;
+	int height = (output->height + GL_HEATMAP_TILE - 1) / GL_HEATMAP_TILE;
+	pixman_box32_t *boxes;
+	int i, n, x, y, x1, y1, x2, y2;
+	uint16_t *tile;
+
+	if (!go->heat || go->heat_width != width ||
+	    go->heat_height != height) {
+		damage_heatmap_release(go);
+		go->heat = zalloc(width * height * sizeof go->heat[0]);
+		go->heat_shown = zalloc(width * height * sizeof go->heat[0]);
+		if (!go->heat || !go->heat_shown) {
+			damage_heatmap_release(go);
+			return;
+		}
+		go->heat_width = width;
+		go->heat_height = height;
+		go->heat_window_start = gr->repaint_msec;
+	}
+
+	if (gr->repaint_msec - go->heat_window_start >= GL_HEATMAP_WINDOW_MSEC) {
+		memcpy(go->heat_shown, go->heat,
+		       width * height * sizeof go->heat[0]);
+		memset(go->heat, 0, width * height * sizeof go->heat[0]);
+		go->heat_window_start = gr->repaint_msec;
+	}
+
+	boxes = pixman_region32_rectangles(damage, &n);
+	for (i = 0; i < n; i++) {
+		x1 = MAX(boxes[i].x1 - output->x, 0) / GL_HEATMAP_TILE;
+		y1 = MAX(boxes[i].y1 - output->y, 0) / GL_HEATMAP_TILE;
+		x2 = MIN((boxes[i].x2 - output->x + GL_HEATMAP_TILE - 1) /
+			 GL_HEATMAP_TILE, width);
+		y2 = MIN((boxes[i].y2 - output->y + GL_HEATMAP_TILE - 1) /
+			 GL_HEATMAP_TILE, height);
+
+		for (y = y1; y < y2; y++) {
+			tile = &go->heat[y * width];
+			for (x = x1; x < x2; x++)
+				if (tile[x] < UINT16_MAX)
+					tile[x]++;
+		}
+	}
+}
+
+static void
+draw_damage_heatmap(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_shader *shader = &gr->solid_batch_shader;
+	GLfloat verts[GL_HEATMAP_BATCH * 4 * 4];
+	GLushort indices[GL_HEATMAP_BATCH * 6];
+	GLfloat *v = verts;
+	GLfloat heat, s, t, x1, y1, x2, y2;
+	GLfloat color[4];
+	int x, y, quads = 0;
+	uint16_t count;
+
+	if (!go->heat_shown)
+		return;
+
+	use_shader(gr, shader);
+	glUniformMatrix4fv(shader->proj_uniform,
+			   1, GL_FALSE, go->output_matrix.d);
+	glUniform1f(shader->alpha_uniform, 1.0);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof(GLfloat), verts);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof(GLfloat), verts + 2);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	for (y = 0; y < go->heat_height; y++) {
+		for (x = 0; x < go->heat_width; x++) {
+			count = go->heat_shown[y * go->heat_width + x];
+			if (count == 0)
+				continue;
+
+			/* premultiplied, blue to red */
+			heat = MIN(count, GL_HEATMAP_HOT) /
+			       (GLfloat)GL_HEATMAP_HOT;
+			color[3] = 0.25f + 0.35f * heat;
+			color[0] = heat * color[3];
+			color[1] = 0.0f;
+			color[2] = (1.0f - heat) * color[3];
+			s = solid_batch_pack(color[0], color[1]);
+			t = solid_batch_pack(color[2], color[3]);
+
+			x1 = output->x + x * GL_HEATMAP_TILE;
+			y1 = output->y + y * GL_HEATMAP_TILE;
+			x2 = MIN(x1 + GL_HEATMAP_TILE, output->x + output->width);
+			y2 = MIN(y1 + GL_HEATMAP_TILE, output->y + output->height);
+
+			indices[quads * 6 + 0] = quads * 4 + 0;
+			indices[quads * 6 + 1] = quads * 4 + 1;
+			indices[quads * 6 + 2] = quads * 4 + 2;
+			indices[quads * 6 + 3] = quads * 4 + 2;
+			indices[quads * 6 + 4] = quads * 4 + 3;
+			indices[quads * 6 + 5] = quads * 4 + 0;
+			*v++ = x1; *v++ = y1; *v++ = s; *v++ = t;
+			*v++ = x2; *v++ = y1; *v++ = s; *v++ = t;
+			*v++ = x2; *v++ = y2; *v++ = s; *v++ = t;
+			*v++ = x1; *v++ = y2; *v++ = s; *v++ = t;
+
+			if (++quads == GL_HEATMAP_BATCH) {
+				glDrawElements(GL_TRIANGLES, quads * 6,
+					       GL_UNSIGNED_SHORT, indices);
+				quads = 0;
+				v = verts;
+			}
+		}
+	}
+	if (quads)
+		glDrawElements(GL_TRIANGLES, quads * 6,
+			       GL_UNSIGNED_SHORT, indices);
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+}
+
 static void
 gl_renderer_repaint_output(struct weston_output *output,
 			      pixman_region32_t *output_damage)
@@ -1392,10 +2371,22 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_region32_t total_damage;
 	enum gl_border_status border_status = BORDER_STATUS_CLEAN;
 	struct weston_view *view;
+	struct gl_timer_query *tq;
+	struct timespec now;
+	bool full_repaint = gr->fan_debug || gr->heatmap_debug;
+	bool fan_debug;
 
 	if (use_output(output) < 0)
 		return;
 
+	gpu_timer_collect(compositor);
+
+	weston_compositor_read_presentation_clock(compositor, &now);
+	gr->repaint_msec = timespec_to_msec(&now);
+
+	if (go->color_lut_dirty)
+		output_upload_color_lut(go);
+
 	/* Clear the used_in_output_repaint flag, so that we can properly track
 	 * which surfaces were used in this output repaint. */
 	wl_list_for_each_reverse(view, &compositor->view_list, link) {
@@ -1428,18 +2419,25 @@ gl_renderer_repaint_output(struct weston_output *output,
 			    2.0 / output->current_mode->width,
 			    -2.0 / output->current_mode->height, 1);
 
-	/* In fan debug mode, redraw everything to make sure that we clear any
-	 * fans left over from previous draws on this buffer.
+	if (gr->heatmap_debug) {
+		damage_heatmap_accumulate(output, output_damage);
+		damage_heatmap_log_surfaces(gr);
+	}
+
+	/* In fan debug and heatmap mode, redraw everything to make sure that
+	 * we clear any fans or heat left over from previous draws on this
+	 * buffer.
 	 * This precludes the use of EGL_EXT_swap_buffers_with_damage and
 	 * EGL_KHR_partial_update, since we damage the whole area. */
-	if (gr->fan_debug) {
+	if (full_repaint) {
 		pixman_region32_t undamaged;
 		pixman_region32_init(&undamaged);
 		pixman_region32_subtract(&undamaged, &output->region,
 					 output_damage);
+		fan_debug = gr->fan_debug;
 		gr->fan_debug = false;
 		repaint_views(output, &undamaged);
-		gr->fan_debug = true;
+		gr->fan_debug = fan_debug;
 		pixman_region32_fini(&undamaged);
 	}
 
@@ -1459,7 +2457,7 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_region32_union(&total_damage, &previous_damage, output_damage);
 	border_status |= go->border_status;
 
-	if (gr->has_egl_partial_update && !gr->fan_debug) {
+	if (gr->has_egl_partial_update && !full_repaint) {
 		int n_egl_rects;
 		EGLint *egl_rects;
 
@@ -1473,7 +2471,13 @@ gl_renderer_repaint_output(struct weston_output *output,
 		free(egl_rects);
 	}
 
+	tq = gpu_timer_begin(compositor, "renderer_gpu_repaint_begin",
+			     "renderer_gpu_repaint_end", output, NULL);
 	repaint_views(output, &total_damage);
+	gpu_timer_end(gr, tq);
+
+	if (gr->heatmap_debug)
+		draw_damage_heatmap(output);
 
 	pixman_region32_fini(&total_damage);
 	pixman_region32_fini(&previous_damage);
@@ -1484,7 +2488,7 @@ gl_renderer_repaint_output(struct weston_output *output,
 
 	go->end_render_sync = create_render_sync(gr);
 
-	if (gr->swap_buffers_with_damage && !gr->fan_debug) {
+	if (gr->swap_buffers_with_damage && !full_repaint) {
 		int n_egl_rects;
 		EGLint *egl_rects;
 
@@ -1509,6 +2513,9 @@ gl_renderer_repaint_output(struct weston_output *output,
 
 	go->border_status = BORDER_STATUS_CLEAN;
 
+	if (go->buffers_painted < go->buffer_count)
+		go->buffers_painted++;
+
 	/* We have to submit the render sync objects after swap buffers, since
 	 * the objects get assigned a valid sync file fd only after a gl flush.
 	 */
@@ -1554,6 +2561,127 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static void
+gl_read_request_destroy(struct gl_read_request *req, int status)
+{
+	wl_list_remove(&req->link);
+	wl_event_source_remove(req->event_source);
+	close(req->fd);
+	glDeleteBuffers(1, &req->pbo);
+
+	req->done(req->data, status);
+	free(req);
+}
+
+static int
+gl_read_request_handler(int fd, uint32_t mask, void *data)
+{
+	struct gl_read_request *req = data;
+	struct gl_renderer *gr = get_renderer(req->output->compositor);
+	void *map;
+	int status = -1;
+
+	/* fence is signaled, so this does not wait for the GPU. */
+	if ((mask & WL_EVENT_READABLE) && use_output(req->output) == 0) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, req->pbo);
+		map = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER, 0, req->size,
+					   GL_MAP_READ_BIT);
+		if (map) {
+			memcpy(req->pixels, map, req->size);
+			gr->unmap_buffer(GL_PIXEL_PACK_BUFFER);
+			status = 0;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	gl_read_request_destroy(req, status);
+
+	return 0;
+}
+
+static int
+gl_renderer_read_pixels_async(struct weston_output *output,
+			      pixman_format_code_t format, void *pixels,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_renderer_read_done_func_t done,
+			      void *data)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct wl_event_loop *loop;
+	struct gl_read_request *req;
+	EGLSyncKHR sync;
+	GLenum gl_format;
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		gl_format = GL_BGRA_EXT;
+		break;
+	case PIXMAN_a8b8g8r8:
+		gl_format = GL_RGBA;
+		break;
+	default:
+		return -1;
+	}
+
+	if (use_output(output) < 0)
+		return -1;
+
+	req = zalloc(sizeof *req);
+	if (req == NULL)
+		return -1;
+
+	req->output = output;
+	req->size = (size_t)width * height * 4;
+	req->pixels = pixels;
+	req->done = done;
+	req->data = data;
+
+	/* read into pixel buffer object, which returns without waiting
+	   for rendering, and get notified by fence when it is done. */
+	glGenBuffers(1, &req->pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, req->pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER, req->size, NULL, GL_STREAM_READ);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format,
+		     GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	sync = create_render_sync(gr);
+	if (sync == EGL_NO_SYNC_KHR)
+		goto err_pbo;
+
+	/* fence fd is only valid once the sync object is flushed. */
+	glFlush();
+	req->fd = gr->dup_native_fence_fd(gr->egl_display, sync);
+	gr->destroy_sync(gr->egl_display, sync);
+	if (req->fd == EGL_NO_NATIVE_FENCE_FD_ANDROID)
+		goto err_pbo;
+
+	loop = wl_display_get_event_loop(output->compositor->wl_display);
+	req->event_source = wl_event_loop_add_fd(loop, req->fd,
+						 WL_EVENT_READABLE,
+						 gl_read_request_handler,
+						 req);
+	if (!req->event_source)
+		goto err_fd;
+
+	wl_list_insert(go->read_request_list.prev, &req->link);
+
+	return 0;
+
+err_fd:
+	close(req->fd);
+err_pbo:
+	glDeleteBuffers(1, &req->pbo);
+	free(req);
+	return -1;
+}
+
 static GLenum gl_format_from_internal(GLenum internal_format)
 {
 	switch (internal_format) {
@@ -1566,16 +2694,215 @@ static GLenum gl_format_from_internal(GLenum internal_format)
 	}
 }
 
+static int
+gl_format_cpp(GLenum format, GLenum type)
+{
+	if (type == GL_UNSIGNED_SHORT_5_6_5)
+		return 2;
+
+	switch (format) {
+	case GL_R8_EXT:
+	case GL_LUMINANCE:
+		return 1;
+	case GL_RG8_EXT:
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+/* Upload one box covering all damage instead of a box per rectangle,
+ * unless that would upload more than this many times the damaged area. */
+#define SHM_UPLOAD_COALESCE_RATIO 2
+
+/* The box to upload in buffer coordinates, either the i'th rectangle of
+ * texture_damage, or extents of them all when coalesced. */
+static pixman_box32_t
+shm_upload_box(struct weston_surface *surface, pixman_box32_t *rectangles,
+	       int i, const pixman_box32_t *coalesced)
+{
+	if (coalesced)
+		return *coalesced;
+
+	return weston_surface_to_buffer_rect(surface, rectangles[i]);
+}
+
+/* Copies the boxes, or the whole buffer if boxes is NULL, into the upload
+ * PBO and leaves it bound, so glTex(Sub)Image2D take offsets into the shm
+ * buffer layout as pointers and upload without waiting for the client's
+ * memory to be read. The PBO is orphaned on each upload, so this doesn't
+ * wait for previous uploads from it either.
+ */
+static bool
+shm_upload_stage(struct gl_renderer *gr, struct gl_surface_state *gs,
+		 struct weston_surface *surface, uint8_t *data,
+		 pixman_box32_t *rectangles, int n,
+		 const pixman_box32_t *coalesced)
+{
+	struct weston_buffer *buffer = gs->buffer_ref.buffer;
+	size_t size = 0;
+	uint8_t *map;
+	int i, j, y;
+
+	for (j = 0; j < gs->num_textures; j++)
+		size = MAX(size, (size_t)gs->offset[j] +
+			   (size_t)(gs->pitch / gs->hsub[j]) * gs->cpp[j] *
+			   (buffer->height / gs->vsub[j]));
+
+	if (!gs->upload_pbo)
+		glGenBuffers(1, &gs->upload_pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gs->upload_pbo);
+	if (size != gs->upload_pbo_size) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL,
+			     GL_STREAM_DRAW);
+		gs->upload_pbo_size = size;
+	}
+
+	map = gr->map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0, size,
+				   GL_MAP_WRITE_BIT |
+				   GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!map) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	if (!rectangles) {
+		memcpy(map, data, size);
+	} else {
+		for (i = 0; i < n; i++) {
+			pixman_box32_t r;
+
+			r = shm_upload_box(surface, rectangles, i, coalesced);
+
+			for (j = 0; j < gs->num_textures; j++) {
+				int stride = (gs->pitch / gs->hsub[j]) * gs->cpp[j];
+				int x1 = r.x1 / gs->hsub[j] * gs->cpp[j];
+				int x2 = r.x2 / gs->hsub[j] * gs->cpp[j];
+
+				for (y = r.y1 / gs->vsub[j];
+				     y < r.y2 / gs->vsub[j]; y++) {
+					size_t offset = gs->offset[j] +
+						(size_t)y * stride + x1;
+
+					memcpy(map + offset, data + offset,
+					       x2 - x1);
+				}
+			}
+		}
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+
+	return true;
+}
+
+/* With a PBO bound, pixel pointers are offsets into it. */
+static const void *
+shm_upload_pixels(uint8_t *data, bool staged, int offset)
+{
+	if (staged)
+		return (const void *)(uintptr_t)offset;
+
+	return data + offset;
+}
+
+static bool
+shm_alpha_is_opaque(const uint8_t *data, int stride, pixman_box32_t box)
+{
+	const uint32_t *row;
+	uint32_t acc = 0xffffffff;
+	int x, y;
+
+	for (y = box.y1; y < box.y2; y++) {
+		row = (const uint32_t *)(data + (size_t)y * stride);
+		for (x = box.x1; x < box.x2; x++)
+			acc &= row[x];
+		if ((acc >> 24) != 0xff)
+			return false;
+	}
+
+	return true;
+}
+
+/* Keeps gs->alpha_opaque up to date with the upload about to happen.
+ * A full upload scans the whole buffer; a partial one only needs to
+ * scan the damage while everything else is known to be opaque. Content
+ * found translucent stays so until the next full upload. */
 static void
-gl_renderer_flush_damage(struct weston_surface *surface)
+shm_scan_alpha(struct gl_renderer *gr, struct gl_surface_state *gs,
+	       struct weston_surface *surface, uint8_t *data)
+{
+	struct weston_buffer *buffer = gs->buffer_ref.buffer;
+	int stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+	pixman_box32_t *rectangles;
+	pixman_box32_t r;
+	bool opaque = true;
+	int i, n;
+
+	if (wl_shm_buffer_get_format(buffer->shm_buffer) !=
+	    WL_SHM_FORMAT_ARGB8888) {
+		gs->alpha_opaque = false;
+		return;
+	}
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	if (gs->needs_full_upload || !gr->has_unpack_subimage) {
+		r.x1 = 0;
+		r.y1 = 0;
+		r.x2 = buffer->width;
+		r.y2 = buffer->height;
+		opaque = shm_alpha_is_opaque(data, stride, r);
+	} else if (gs->alpha_opaque) {
+		rectangles = pixman_region32_rectangles(&gs->texture_damage,
+							&n);
+		for (i = 0; i < n && opaque; i++) {
+			r = weston_surface_to_buffer_rect(surface,
+							  rectangles[i]);
+			r.x1 = MAX(0, MIN(r.x1, buffer->width));
+			r.x2 = MAX(0, MIN(r.x2, buffer->width));
+			r.y1 = MAX(0, MIN(r.y1, buffer->height));
+			r.y2 = MAX(0, MIN(r.y2, buffer->height));
+			opaque = shm_alpha_is_opaque(data, stride, r);
+		}
+	} else {
+		opaque = false;
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	gs->alpha_opaque = opaque;
+}
+
+static bool
+gl_surface_texture_used(struct weston_surface *surface)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (view->plane == &surface->compositor->primary_plane &&
+		    !view->occluded)
+			return true;
+	}
+
+	return false;
+}
+
+/* With force, upload even if no view shows the texture right now. */
+static void
+gl_surface_flush_damage(struct weston_surface *surface, bool force)
 {
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
 	struct weston_buffer *buffer = gs->buffer_ref.buffer;
-	struct weston_view *view;
-	bool texture_used;
 	pixman_box32_t *rectangles;
+	pixman_box32_t extents = { 0 }, *coalesced = NULL;
+	uint64_t area = 0;
 	uint8_t *data;
+	bool staged = false;
+	struct gl_timer_query *tq = NULL;
+	uint64_t upload_bytes = 0;
 	int i, j, n;
 
 	pixman_region32_union(&gs->texture_damage,
@@ -1587,24 +2914,33 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	/* Avoid upload, if the texture won't be used this time.
 	 * We still accumulate the damage in texture_damage, and
 	 * hold the reference to the buffer, in case the surface
-	 * migrates back to the primary plane.
+	 * migrates back to the primary plane or gets uncovered.
 	 */
-	texture_used = false;
-	wl_list_for_each(view, &surface->views, surface_link) {
-		if (view->plane == &surface->compositor->primary_plane) {
-			texture_used = true;
-			break;
-		}
-	}
-	if (!texture_used)
+	if (!force && !gl_surface_texture_used(surface))
 		return;
 
+	if (gs->num_evicted_textures) {
+		ensure_textures(gs, gs->num_evicted_textures);
+		gs->needs_full_upload = true;
+	}
+
 	if (!pixman_region32_not_empty(&gs->texture_damage) &&
 	    !gs->needs_full_upload)
 		goto done;
 
 	data = wl_shm_buffer_get_data(buffer->shm_buffer);
 
+	shm_scan_alpha(gr, gs, surface, data);
+
+	tq = gpu_timer_begin(surface->compositor, "renderer_gpu_upload_begin",
+			     "renderer_gpu_upload_end", NULL, surface);
+
+	if (!gr->has_unpack_subimage || gs->needs_full_upload)
+		for (j = 0; j < gs->num_textures; j++)
+			upload_bytes += (uint64_t)(gs->pitch / gs->hsub[j]) *
+					(buffer->height / gs->vsub[j]) *
+					gs->cpp[j];
+
 	if (!gr->has_unpack_subimage) {
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
 		for (j = 0; j < gs->num_textures; j++) {
@@ -1624,13 +2960,28 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	}
 
 	if (gs->needs_full_upload) {
+		if (gr->has_pbo_upload)
+			staged = shm_upload_stage(gr, gs, surface, data,
+						  NULL, 0, NULL);
+
 		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
 		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
+		if (!staged)
+			wl_shm_buffer_begin_access(buffer->shm_buffer);
 		for (j = 0; j < gs->num_textures; j++) {
 			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
 			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT,
 				      gs->pitch / gs->hsub[j]);
+			if (gs->atlas_page) {
+				glTexSubImage2D(GL_TEXTURE_2D, 0,
+						gs->atlas_x, gs->atlas_y,
+						gs->pitch, gs->height,
+						gl_format_from_internal(gs->gl_format[j]),
+						gs->gl_pixel_type,
+						shm_upload_pixels(data, staged,
+								  gs->offset[j]));
+				continue;
+			}
 			glTexImage2D(GL_TEXTURE_2D, 0,
 				     gs->gl_format[j],
 				     gs->pitch / gs->hsub[j],
@@ -1638,46 +2989,235 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 				     0,
 				     gl_format_from_internal(gs->gl_format[j]),
 				     gs->gl_pixel_type,
-				     data + gs->offset[j]);
+				     shm_upload_pixels(data, staged,
+						       gs->offset[j]));
 		}
-		wl_shm_buffer_end_access(buffer->shm_buffer);
+		if (staged)
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		else
+			wl_shm_buffer_end_access(buffer->shm_buffer);
 		goto done;
 	}
 
 	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
-	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	if (n > 1) {
+		for (i = 0; i < n; i++) {
+			pixman_box32_t r;
+
+			r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+			area += (uint64_t)(r.x2 - r.x1) * (r.y2 - r.y1);
+			if (i == 0) {
+				extents = r;
+				continue;
+			}
+			extents.x1 = MIN(extents.x1, r.x1);
+			extents.y1 = MIN(extents.y1, r.y1);
+			extents.x2 = MAX(extents.x2, r.x2);
+			extents.y2 = MAX(extents.y2, r.y2);
+		}
+		if ((uint64_t)(extents.x2 - extents.x1) *
+		    (extents.y2 - extents.y1) <=
+		    SHM_UPLOAD_COALESCE_RATIO * area) {
+			coalesced = &extents;
+			n = 1;
+		}
+	}
+
+	if (gr->has_pbo_upload)
+		staged = shm_upload_stage(gr, gs, surface, data,
+					  rectangles, n, coalesced);
+
+	if (!staged)
+		wl_shm_buffer_begin_access(buffer->shm_buffer);
 	for (i = 0; i < n; i++) {
 		pixman_box32_t r;
 
-		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+		r = shm_upload_box(surface, rectangles, i, coalesced);
 
 		for (j = 0; j < gs->num_textures; j++) {
+			upload_bytes += (uint64_t)((r.x2 - r.x1) / gs->hsub[j]) *
+					((r.y2 - r.y1) / gs->vsub[j]) *
+					gs->cpp[j];
 			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
 			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT,
 				      gs->pitch / gs->hsub[j]);
 			glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT,
 				      r.x1 / gs->hsub[j]);
 			glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT,
-				      r.y1 / gs->hsub[j]);
+				      r.y1 / gs->vsub[j]);
 			glTexSubImage2D(GL_TEXTURE_2D, 0,
-					r.x1 / gs->hsub[j],
-					r.y1 / gs->vsub[j],
+					gs->atlas_x + r.x1 / gs->hsub[j],
+					gs->atlas_y + r.y1 / gs->vsub[j],
 					(r.x2 - r.x1) / gs->hsub[j],
 					(r.y2 - r.y1) / gs->vsub[j],
 					gl_format_from_internal(gs->gl_format[j]),
 					gs->gl_pixel_type,
-					data + gs->offset[j]);
+					shm_upload_pixels(data, staged,
+							  gs->offset[j]));
 		}
 	}
-	wl_shm_buffer_end_access(buffer->shm_buffer);
+	if (staged)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	else
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+
+done:
+	gpu_timer_end(gr, tq);
+	weston_surface_client_stats_add(surface, WESTON_CLIENT_STAT_UPLOAD_BYTES,
+					upload_bytes);
+
+	pixman_region32_fini(&gs->texture_damage);
+	pixman_region32_init(&gs->texture_damage);
+	gs->needs_full_upload = false;
+
+	weston_buffer_reference(&gs->buffer_ref, NULL);
+	weston_buffer_release_reference(&gs->buffer_release_ref, NULL);
+}
+
+static void
+gl_renderer_flush_damage(struct weston_surface *surface)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+
+	if (gr->heatmap_debug)
+		get_surface_state(surface)->heat_damage_area +=
+			region_area(&surface->damage);
+
+	/* sampled in place, see gl_renderer_attach_shm_udmabuf() */
+	if (get_surface_state(surface)->buffer_type == BUFFER_TYPE_EGL)
+		return;
+
+	gl_surface_flush_damage(surface, false);
+}
+
+static int
+gl_atlas_size_class(struct gl_renderer *gr, int width, int height)
+{
+	unsigned int i;
+
+	if (!gr->has_atlas)
+		return 0;
+
+	for (i = 0; i < ARRAY_LENGTH(gl_atlas_classes); i++)
+		if (width <= gl_atlas_classes[i] &&
+		    height <= gl_atlas_classes[i])
+			return gl_atlas_classes[i];
+
+	return 0;
+}
+
+static struct gl_atlas_page *
+gl_atlas_page_create(struct gl_renderer *gr, int size_class)
+{
+	struct gl_atlas_page *page;
+
+	page = zalloc(sizeof *page);
+	if (!page)
+		return NULL;
+
+	page->size_class = size_class;
+	page->cell = size_class + 2 * GL_ATLAS_BORDER;
+	page->cells_per_row = GL_ATLAS_PAGE_SIZE / page->cell;
+	page->num_cells = page->cells_per_row * page->cells_per_row;
+
+	glGenTextures(1, &page->texture);
+	glBindTexture(GL_TEXTURE_2D, page->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
+		     GL_ATLAS_PAGE_SIZE, GL_ATLAS_PAGE_SIZE, 0,
+		     GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+
+	wl_list_insert(&gr->atlas_pages, &page->link);
+
+	return page;
+}
+
+static void
+gl_atlas_page_destroy(struct gl_atlas_page *page)
+{
+	glDeleteTextures(1, &page->texture);
+	wl_list_remove(&page->link);
+	free(page);
+}
+
+/* Gives gs a cell of a page for a buffer of the size class, instead of
+ * textures of its own. The cell is cleared, so that its border is
+ * transparent and texels the buffer doesn't cover are too. */
+static bool
+gl_surface_atlas_alloc(struct gl_renderer *gr, struct gl_surface_state *gs,
+		       int size_class)
+{
+	struct gl_atlas_page *page, *found = NULL;
+	uint8_t *zero;
+	int i, x, y;
+
+	wl_list_for_each(page, &gr->atlas_pages, link) {
+		if (page->size_class == size_class &&
+		    page->num_used < page->num_cells) {
+			found = page;
+			break;
+		}
+	}
+	if (!found)
+		found = gl_atlas_page_create(gr, size_class);
+	if (!found)
+		return false;
+	page = found;
+
+	zero = zalloc((size_t)page->cell * page->cell * 4);
+	if (!zero) {
+		if (page->num_used == 0)
+			gl_atlas_page_destroy(page);
+		return false;
+	}
+
+	for (i = 0; i < page->num_cells; i++)
+		if (!(page->used[i / 32] & (1u << (i % 32))))
+			break;
+	page->used[i / 32] |= 1u << (i % 32);
+	page->num_used++;
+
+	x = (i % page->cells_per_row) * page->cell;
+	y = (i / page->cells_per_row) * page->cell;
+
+	glBindTexture(GL_TEXTURE_2D, page->texture);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, page->cell, page->cell,
+			GL_BGRA_EXT, GL_UNSIGNED_BYTE, zero);
+	free(zero);
+
+	glDeleteTextures(gs->num_textures, gs->textures);
+	gs->textures[0] = page->texture;
+	gs->num_textures = 1;
+	gs->atlas_page = page;
+	gs->atlas_cell = i;
+	gs->atlas_x = x + GL_ATLAS_BORDER;
+	gs->atlas_y = y + GL_ATLAS_BORDER;
 
-done:
-	pixman_region32_fini(&gs->texture_damage);
-	pixman_region32_init(&gs->texture_damage);
-	gs->needs_full_upload = false;
+	return true;
+}
 
-	weston_buffer_reference(&gs->buffer_ref, NULL);
-	weston_buffer_release_reference(&gs->buffer_release_ref, NULL);
+/* Returns the cell of gs to its page, leaving gs without textures. */
+static void
+gl_surface_atlas_release(struct gl_surface_state *gs)
+{
+	struct gl_atlas_page *page = gs->atlas_page;
+
+	if (!page)
+		return;
+
+	page->used[gs->atlas_cell / 32] &= ~(1u << (gs->atlas_cell % 32));
+	if (--page->num_used == 0)
+		gl_atlas_page_destroy(page);
+
+	gs->textures[0] = 0;
+	gs->num_textures = 0;
+	gs->atlas_page = NULL;
+	gs->atlas_x = 0;
+	gs->atlas_y = 0;
 }
 
 static void
@@ -1685,6 +3225,8 @@ ensure_textures(struct gl_surface_state *gs, int num_textures)
 {
 	int i;
 
+	gs->num_evicted_textures = 0;
+
 	if (num_textures <= gs->num_textures)
 		return;
 
@@ -1711,6 +3253,8 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 	GLenum gl_pixel_type;
 	int pitch;
 	int num_planes;
+	int size_class = 0;
+	int i;
 
 	buffer->shm_buffer = shm_buffer;
 	buffer->width = wl_shm_buffer_get_width(shm_buffer);
@@ -1735,6 +3279,7 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 		gl_format[0] = GL_BGRA_EXT;
 		gl_pixel_type = GL_UNSIGNED_BYTE;
 		es->is_opaque = false;
+		size_class = gl_atlas_size_class(gr, pitch, buffer->height);
 		break;
 	case WL_SHM_FORMAT_RGB565:
 		gs->shader = &gr->texture_shader_rgbx;
@@ -1816,7 +3361,8 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 	    gl_format[1] != gs->gl_format[1] ||
 	    gl_format[2] != gs->gl_format[2] ||
 	    gl_pixel_type != gs->gl_pixel_type ||
-	    gs->buffer_type != BUFFER_TYPE_SHM) {
+	    gs->buffer_type != BUFFER_TYPE_SHM ||
+	    size_class != (gs->atlas_page ? gs->atlas_page->size_class : 0)) {
 		gs->pitch = pitch;
 		gs->height = buffer->height;
 		gs->target = GL_TEXTURE_2D;
@@ -1824,6 +3370,9 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 		gs->gl_format[1] = gl_format[1];
 		gs->gl_format[2] = gl_format[2];
 		gs->gl_pixel_type = gl_pixel_type;
+		for (i = 0; i < num_planes; i++)
+			gs->cpp[i] = gl_format_cpp(gl_format[i],
+						   gl_pixel_type);
 		gs->buffer_type = BUFFER_TYPE_SHM;
 		gs->needs_full_upload = true;
 		gs->y_inverted = true;
@@ -1831,7 +3380,9 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 
 		gs->surface = es;
 
-		ensure_textures(gs, num_planes);
+		gl_surface_atlas_release(gs);
+		if (!size_class || !gl_surface_atlas_alloc(gr, gs, size_class))
+			ensure_textures(gs, num_planes);
 	}
 }
 
@@ -2026,6 +3577,464 @@ import_simple_dmabuf(struct gl_renderer *gr,
 	return image;
 }
 
+/* <linux/udmabuf.h>, duplicated so that building Weston doesn't require
+ * recent kernel headers. */
+#ifndef UDMABUF_CREATE
+struct udmabuf_create {
+	uint32_t memfd;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t size;
+};
+#define UDMABUF_FLAGS_CLOEXEC	0x01
+#define UDMABUF_CREATE		_IOW('u', 0x42, struct udmabuf_create)
+#endif
+
+static void
+shm_pool_fd_unref(struct shm_pool_fd *pool_fd)
+{
+	if (--pool_fd->refcount > 0)
+		return;
+
+	close(pool_fd->fd);
+	free(pool_fd);
+}
+
+static void
+shm_pool_fd_ref_destroyed(struct wl_listener *listener, void *data)
+{
+	struct shm_pool_fd_ref *ref =
+		container_of(listener, struct shm_pool_fd_ref,
+			     destroy_listener);
+
+	shm_pool_fd_unref(ref->pool_fd);
+	free(ref);
+}
+
+static void
+shm_pool_fd_ref_create(struct wl_resource *resource,
+		       struct shm_pool_fd *pool_fd, int32_t offset)
+{
+	struct shm_pool_fd_ref *ref;
+
+	ref = zalloc(sizeof *ref);
+	if (!ref)
+		return;
+
+	ref->pool_fd = pool_fd;
+	ref->offset = offset;
+	pool_fd->refcount++;
+	ref->destroy_listener.notify = shm_pool_fd_ref_destroyed;
+	wl_resource_add_destroy_listener(resource, &ref->destroy_listener);
+}
+
+static struct shm_pool_fd_ref *
+shm_pool_fd_ref_get(struct wl_resource *resource)
+{
+	struct wl_listener *listener;
+
+	listener = wl_resource_get_destroy_listener(resource,
+						    shm_pool_fd_ref_destroyed);
+	if (!listener)
+		return NULL;
+
+	return container_of(listener, struct shm_pool_fd_ref,
+			    destroy_listener);
+}
+
+static void
+shm_pool_fd_clear_pending(struct gl_renderer *gr)
+{
+	if (gr->shm_pending_fd >= 0)
+		close(gr->shm_pending_fd);
+	gr->shm_pending_fd = -1;
+	gr->shm_pending_pool_fd = NULL;
+}
+
+/* libwayland-server keeps no fd of its wl_shm pools, but protocol
+ * loggers see the requests before they are dispatched, while the fd
+ * passed to wl_shm.create_pool is still open. The resources these
+ * requests create then pick up what is pending here. */
+static void
+shm_pool_fd_logger(void *user_data, enum wl_protocol_logger_type type,
+		   const struct wl_protocol_logger_message *message)
+{
+	struct gl_renderer *gr = user_data;
+	struct shm_pool_fd_ref *ref;
+
+	if (type != WL_PROTOCOL_LOGGER_REQUEST)
+		return;
+
+	/* a request that failed created nothing */
+	shm_pool_fd_clear_pending(gr);
+
+	if (message->message == &wl_shm_interface.methods[0]) {
+		/* wl_shm.create_pool(id, fd, size) */
+		gr->shm_pending_fd = fcntl(message->arguments[1].h,
+					   F_DUPFD_CLOEXEC, 0);
+	} else if (message->message == &wl_shm_pool_interface.methods[0]) {
+		/* wl_shm_pool.create_buffer(id, offset, ...) */
+		ref = shm_pool_fd_ref_get(message->resource);
+		if (!ref)
+			return;
+		gr->shm_pending_pool_fd = ref->pool_fd;
+		gr->shm_pending_offset = message->arguments[1].i;
+	}
+}
+
+static void
+shm_pool_fd_resource_created(struct wl_listener *listener, void *data)
+{
+	struct shm_pool_fd_client *fc =
+		container_of(listener, struct shm_pool_fd_client,
+			     resource_created_listener);
+	struct gl_renderer *gr = fc->renderer;
+	struct wl_resource *resource = data;
+	const char *class = wl_resource_get_class(resource);
+	struct shm_pool_fd *pool_fd;
+
+	if (gr->shm_pending_fd >= 0 && strcmp(class, "wl_shm_pool") == 0) {
+		pool_fd = zalloc(sizeof *pool_fd);
+		if (!pool_fd)
+			return;
+
+		pool_fd->fd = gr->shm_pending_fd;
+		pool_fd->refcount = 1;
+		gr->shm_pending_fd = -1;
+		shm_pool_fd_ref_create(resource, pool_fd, 0);
+		shm_pool_fd_unref(pool_fd);
+	} else if (gr->shm_pending_pool_fd &&
+		   strcmp(class, "wl_buffer") == 0) {
+		shm_pool_fd_ref_create(resource, gr->shm_pending_pool_fd,
+				       gr->shm_pending_offset);
+		gr->shm_pending_pool_fd = NULL;
+	}
+}
+
+static void
+shm_pool_fd_client_destroy(struct shm_pool_fd_client *fc)
+{
+	wl_list_remove(&fc->resource_created_listener.link);
+	wl_list_remove(&fc->destroy_listener.link);
+	wl_list_remove(&fc->link);
+	free(fc);
+}
+
+static void
+shm_pool_fd_client_destroyed(struct wl_listener *listener, void *data)
+{
+	struct shm_pool_fd_client *fc =
+		container_of(listener, struct shm_pool_fd_client,
+			     destroy_listener);
+
+	shm_pool_fd_client_destroy(fc);
+}
+
+static void
+shm_pool_fd_client_created(struct wl_listener *listener, void *data)
+{
+	struct gl_renderer *gr =
+		container_of(listener, struct gl_renderer,
+			     shm_client_created_listener);
+	struct wl_client *client = data;
+	struct shm_pool_fd_client *fc;
+
+	fc = zalloc(sizeof *fc);
+	if (!fc)
+		return;
+
+	fc->renderer = gr;
+	fc->resource_created_listener.notify = shm_pool_fd_resource_created;
+	wl_client_add_resource_created_listener(client,
+						&fc->resource_created_listener);
+	fc->destroy_listener.notify = shm_pool_fd_client_destroyed;
+	wl_client_add_destroy_listener(client, &fc->destroy_listener);
+	wl_list_insert(&gr->shm_pool_fd_clients, &fc->link);
+}
+
+static bool
+shm_pool_fd_tracking_init(struct gl_renderer *gr, struct wl_display *display)
+{
+	gr->shm_pool_logger = wl_display_add_protocol_logger(display,
+							     shm_pool_fd_logger,
+							     gr);
+	if (!gr->shm_pool_logger)
+		return false;
+
+	gr->shm_client_created_listener.notify = shm_pool_fd_client_created;
+	wl_display_add_client_created_listener(display,
+					       &gr->shm_client_created_listener);
+
+	return true;
+}
+
+/* Pool fds already handed to resources stay with them. */
+static void
+shm_pool_fd_tracking_fini(struct gl_renderer *gr)
+{
+	struct shm_pool_fd_client *fc, *next;
+
+	if (!gr->shm_pool_logger)
+		return;
+
+	wl_protocol_logger_destroy(gr->shm_pool_logger);
+	gr->shm_pool_logger = NULL;
+	wl_list_remove(&gr->shm_client_created_listener.link);
+	wl_list_for_each_safe(fc, next, &gr->shm_pool_fd_clients, link)
+		shm_pool_fd_client_destroy(fc);
+	shm_pool_fd_clear_pending(gr);
+}
+
+/* (Re)creates the udmabuf of pool so it covers end, the pool may have
+ * grown since. Existing EGLImages hold on to the previous one. */
+static void
+shm_udmabuf_pool_cover(struct gl_renderer *gr, struct shm_udmabuf_pool *pool,
+		       uint64_t end)
+{
+	struct udmabuf_create create = { 0 };
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	int fd;
+
+	if (pool->unusable || pool->size >= end)
+		return;
+
+	if (fstat(pool->memfd, &st) < 0)
+		return;
+
+	create.memfd = pool->memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = st.st_size & ~(uint64_t)(page_size - 1);
+	if (create.size < end)
+		return;
+
+	fd = ioctl(gr->udmabuf_dev, UDMABUF_CREATE, &create);
+	if (fd < 0) {
+		pool->unusable = true;
+		weston_log("gl-renderer: udmabuf of %" PRIu64 " bytes failed: "
+			   "%s\n", (uint64_t)create.size, strerror(errno));
+		return;
+	}
+
+	if (pool->fd >= 0)
+		close(pool->fd);
+	pool->fd = fd;
+	pool->size = create.size;
+}
+
+/* Takes ownership of memfd. */
+static struct shm_udmabuf_pool *
+shm_udmabuf_pool_get(struct gl_renderer *gr, int memfd, uint64_t end)
+{
+	struct shm_udmabuf_pool *pool;
+	struct stat st;
+	int seals;
+
+	if (fstat(memfd, &st) < 0) {
+		close(memfd);
+		return NULL;
+	}
+
+	wl_list_for_each(pool, &gr->shm_udmabuf_pools, link) {
+		if (pool->dev == st.st_dev && pool->ino == st.st_ino) {
+			close(memfd);
+			pool->refcount++;
+			shm_udmabuf_pool_cover(gr, pool, end);
+			return pool;
+		}
+	}
+
+	pool = zalloc(sizeof *pool);
+	if (!pool) {
+		close(memfd);
+		return NULL;
+	}
+
+	pool->memfd = memfd;
+	pool->dev = st.st_dev;
+	pool->ino = st.st_ino;
+	pool->fd = -1;
+	pool->refcount = 1;
+	wl_list_insert(&gr->shm_udmabuf_pools, &pool->link);
+
+	/* udmabuf pins the pages, the client must not be able to
+	 * truncate them away or to forbid writing them */
+	seals = fcntl(memfd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK) || (seals & F_SEAL_WRITE))
+		pool->unusable = true;
+
+	shm_udmabuf_pool_cover(gr, pool, end);
+
+	return pool;
+}
+
+static void
+shm_udmabuf_pool_unref(struct shm_udmabuf_pool *pool)
+{
+	if (--pool->refcount > 0)
+		return;
+
+	if (pool->fd >= 0)
+		close(pool->fd);
+	close(pool->memfd);
+	wl_list_remove(&pool->link);
+	free(pool);
+}
+
+static void
+shm_udmabuf_buffer_destroy(struct shm_udmabuf_buffer *sb)
+{
+	wl_list_remove(&sb->destroy_listener.link);
+	wl_list_remove(&sb->link);
+	if (sb->image)
+		egl_image_unref(sb->image);
+	if (sb->pool)
+		shm_udmabuf_pool_unref(sb->pool);
+	free(sb);
+}
+
+static void
+shm_udmabuf_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+	struct shm_udmabuf_buffer *sb =
+		container_of(listener, struct shm_udmabuf_buffer,
+			     destroy_listener);
+
+	shm_udmabuf_buffer_destroy(sb);
+}
+
+static struct shm_udmabuf_buffer *
+shm_udmabuf_buffer_create(struct gl_renderer *gr, struct weston_buffer *buffer,
+			  struct wl_shm_buffer *shm_buffer, uint32_t drm_format)
+{
+	struct shm_udmabuf_buffer *sb;
+	struct dmabuf_attributes attributes = { 0 };
+	int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+	int32_t height = wl_shm_buffer_get_height(shm_buffer);
+	struct shm_pool_fd_ref *ref;
+	uint64_t offset;
+	int memfd;
+
+	sb = zalloc(sizeof *sb);
+	if (!sb)
+		return NULL;
+
+	sb->destroy_listener.notify = shm_udmabuf_buffer_destroyed;
+	wl_signal_add(&buffer->destroy_signal, &sb->destroy_listener);
+	wl_list_insert(&gr->shm_udmabuf_buffers, &sb->link);
+
+	/* no pool fd was caught for it, its dup may have failed */
+	ref = shm_pool_fd_ref_get(buffer->resource);
+	if (!ref)
+		return sb;
+
+	memfd = fcntl(ref->pool_fd->fd, F_DUPFD_CLOEXEC, 0);
+	if (memfd < 0)
+		return sb;
+
+	offset = ref->offset;
+	sb->pool = shm_udmabuf_pool_get(gr, memfd,
+					offset + (uint64_t)stride * height);
+	if (!sb->pool || sb->pool->fd < 0 ||
+	    offset + (uint64_t)stride * height > sb->pool->size)
+		return sb;
+
+	attributes.width = wl_shm_buffer_get_width(shm_buffer);
+	attributes.height = height;
+	attributes.format = drm_format;
+	attributes.n_planes = 1;
+	attributes.fd[0] = sb->pool->fd;
+	attributes.offset[0] = offset;
+	attributes.stride[0] = stride;
+	attributes.modifier[0] = gr->has_dmabuf_import_modifiers ?
+		DRM_FORMAT_MOD_LINEAR : DRM_FORMAT_MOD_INVALID;
+
+	/* the driver may refuse the stride or offset alignment */
+	sb->image = import_simple_dmabuf(gr, &attributes);
+
+	return sb;
+}
+
+/* Samples a wl_shm buffer in place through the udmabuf of its pool,
+ * when WESTON_GL_SHM_UDMABUF is set. Commits then only rebind the
+ * EGLImage instead of uploading the damage. Returns false for the usual
+ * upload path: formats other than [AX]RGB8888, pools that aren't
+ * suitably sealed memfds, or imports the driver refuses. */
+static bool
+gl_renderer_attach_shm_udmabuf(struct weston_surface *es,
+			       struct weston_buffer *buffer,
+			       struct wl_shm_buffer *shm_buffer)
+{
+	struct gl_renderer *gr = get_renderer(es->compositor);
+	struct gl_surface_state *gs = get_surface_state(es);
+	struct shm_udmabuf_buffer *sb;
+	struct wl_listener *listener;
+	uint32_t drm_format;
+	int i;
+
+	if (gr->udmabuf_dev < 0)
+		return false;
+
+	switch (wl_shm_buffer_get_format(shm_buffer)) {
+	case WL_SHM_FORMAT_XRGB8888:
+		drm_format = DRM_FORMAT_XRGB8888;
+		break;
+	case WL_SHM_FORMAT_ARGB8888:
+		drm_format = DRM_FORMAT_ARGB8888;
+		break;
+	default:
+		return false;
+	}
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 shm_udmabuf_buffer_destroyed);
+	if (listener)
+		sb = container_of(listener, struct shm_udmabuf_buffer,
+				  destroy_listener);
+	else
+		sb = shm_udmabuf_buffer_create(gr, buffer, shm_buffer,
+					       drm_format);
+	if (!sb || !sb->image)
+		return false;
+
+	buffer->shm_buffer = shm_buffer;
+	buffer->width = wl_shm_buffer_get_width(shm_buffer);
+	buffer->height = wl_shm_buffer_get_height(shm_buffer);
+	buffer->y_inverted = true;
+
+	for (i = 0; i < gs->num_images; i++) {
+		egl_image_unref(gs->images[i]);
+		gs->images[i] = NULL;
+	}
+	gs->images[0] = egl_image_ref(sb->image);
+	gs->num_images = 1;
+
+	gl_surface_atlas_release(gs);
+	ensure_textures(gs, 1);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+	gr->image_target_texture_2d(GL_TEXTURE_2D, sb->image->image);
+
+	if (drm_format == DRM_FORMAT_XRGB8888) {
+		gs->shader = &gr->texture_shader_rgbx;
+		es->is_opaque = true;
+	} else {
+		gs->shader = &gr->texture_shader_rgba;
+		es->is_opaque = false;
+	}
+	gs->target = GL_TEXTURE_2D;
+	gs->pitch = buffer->width;
+	gs->height = buffer->height;
+	gs->buffer_type = BUFFER_TYPE_EGL;
+	gs->y_inverted = true;
+	gs->direct_display = false;
+	gs->surface = es;
+	pixman_region32_clear(&gs->texture_damage);
+
+	return true;
+}
+
 /* The kernel header drm_fourcc.h defines the DRM formats below.  We duplicate
  * some of the definitions here so that building Weston won't require
  * bleeding-edge kernel headers.
@@ -2313,16 +4322,78 @@ choose_texture_target(struct gl_renderer *gr,
 	}
 }
 
+static bool
+dmabuf_image_key_init(struct dmabuf_image_key *key,
+		      const struct dmabuf_attributes *attributes)
+{
+	struct stat st;
+	int i;
+
+	/* zeroed so the key can be compared with memcmp() */
+	memset(key, 0, sizeof *key);
+
+	key->format = attributes->format;
+	key->width = attributes->width;
+	key->height = attributes->height;
+	key->n_planes = attributes->n_planes;
+
+	for (i = 0; i < attributes->n_planes; i++) {
+		if (fstat(attributes->fd[i], &st) < 0)
+			return false;
+
+		key->plane[i].dev = st.st_dev;
+		key->plane[i].ino = st.st_ino;
+		key->plane[i].offset = attributes->offset[i];
+		key->plane[i].stride = attributes->stride[i];
+		key->plane[i].modifier = attributes->modifier[i];
+	}
+
+	return true;
+}
+
+/* Live dmabuf_images keep their file descriptors open, so the inodes of a
+ * cached key can't be recycled until every buffer using them is gone. */
+static struct dmabuf_image *
+dmabuf_image_cache_lookup(struct gl_renderer *gr,
+			  const struct dmabuf_image_key *key)
+{
+	struct dmabuf_image *image;
+
+	wl_list_for_each(image, &gr->dmabuf_images, link) {
+		if (image->has_key && image->num_images > 0 &&
+		    memcmp(&image->key, key, sizeof *key) == 0)
+			return image;
+	}
+
+	return NULL;
+}
+
 static struct dmabuf_image *
 import_dmabuf(struct gl_renderer *gr,
 	      struct linux_dmabuf_buffer *dmabuf)
 {
 	struct egl_image *egl_image;
-	struct dmabuf_image *image;
+	struct dmabuf_image *image, *cached;
+	int i;
 
 	image = dmabuf_image_create();
 	image->dmabuf = dmabuf;
 
+	image->has_key = dmabuf_image_key_init(&image->key,
+					       &dmabuf->attributes);
+	cached = image->has_key ?
+		 dmabuf_image_cache_lookup(gr, &image->key) : NULL;
+	if (cached) {
+		image->num_images = cached->num_images;
+		for (i = 0; i < cached->num_images; i++)
+			image->images[i] = egl_image_ref(cached->images[i]);
+		image->import_type = cached->import_type;
+		image->target = cached->target;
+		image->shader = cached->shader;
+
+		return image;
+	}
+
 	egl_image = import_simple_dmabuf(gr, &dmabuf->attributes);
 	if (egl_image) {
 		image->num_images = 1;
@@ -2487,31 +4558,6 @@ gl_renderer_import_dmabuf(struct weston_compositor *ec,
 	return true;
 }
 
-static bool
-import_known_dmabuf(struct gl_renderer *gr,
-                    struct dmabuf_image *image)
-{
-	switch (image->import_type) {
-	case IMPORT_TYPE_DIRECT:
-		image->images[0] = import_simple_dmabuf(gr, &image->dmabuf->attributes);
-		if (!image->images[0])
-			return false;
-		image->num_images = 1;
-		break;
-
-	case IMPORT_TYPE_GL_CONVERSION:
-		if (!import_yuv_dmabuf(gr, image))
-			return false;
-		break;
-
-	default:
-		weston_log("Invalid import type for dmabuf\n");
-		return false;
-	}
-
-	return true;
-}
-
 static bool
 dmabuf_is_opaque(struct linux_dmabuf_buffer *dmabuf)
 {
@@ -2564,12 +4610,10 @@ gl_renderer_attach_dmabuf(struct weston_surface *surface,
 	surface->is_opaque = dmabuf_is_opaque(dmabuf);
 
 	/*
-	 * We try to always hold an imported EGLImage from the dmabuf
-	 * to prevent the client from preventing re-imports. But, we also
-	 * need to re-import every time the contents may change because
-	 * GL driver's caching may need flushing.
-	 *
-	 * Here we release the cache reference which has to be final.
+	 * The EGLImages created at import time, possibly shared with other
+	 * buffers for the same dmabuf, are reused for every attach. Binding
+	 * them to the texture again below is enough for the driver to pick
+	 * up new contents; re-creating them each commit is not needed.
 	 */
 	if (dmabuf->direct_display)
 		return;
@@ -2579,10 +4623,7 @@ gl_renderer_attach_dmabuf(struct weston_surface *surface,
 	/* The dmabuf_image should have been created during the import */
 	assert(image != NULL);
 
-	for (i = 0; i < image->num_images; ++i)
-		egl_image_unref(image->images[i]);
-
-	if (!import_known_dmabuf(gr, image)) {
+	if (image->num_images == 0) {
 		linux_dmabuf_buffer_send_server_error(dmabuf, "EGL dmabuf import failed");
 		return;
 	}
@@ -2617,12 +4658,16 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	weston_buffer_release_reference(&gs->buffer_release_ref,
 					es->buffer_release_ref.buffer_release);
 
+	if (gr->heatmap_debug)
+		gs->heat_commits++;
+
 	if (!buffer) {
 		for (i = 0; i < gs->num_images; i++) {
 			egl_image_unref(gs->images[i]);
 			gs->images[i] = NULL;
 		}
 		gs->num_images = 0;
+		gl_surface_atlas_release(gs);
 		glDeleteTextures(gs->num_textures, gs->textures);
 		gs->num_textures = 0;
 		gs->buffer_type = BUFFER_TYPE_NULL;
@@ -2634,9 +4679,14 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 
 	shm_buffer = wl_shm_buffer_get(buffer->resource);
 
-	if (shm_buffer)
-		gl_renderer_attach_shm(es, buffer, shm_buffer);
-	else if (gr->has_bind_display &&
+	/* EGL and dmabuf buffers need textures of their own */
+	if (!shm_buffer)
+		gl_surface_atlas_release(gs);
+
+	if (shm_buffer) {
+		if (!gl_renderer_attach_shm_udmabuf(es, buffer, shm_buffer))
+			gl_renderer_attach_shm(es, buffer, shm_buffer);
+	} else if (gr->has_bind_display &&
 		 gr->query_buffer(gr->egl_display, (void *)buffer->resource,
 				  EGL_TEXTURE_FORMAT, &format))
 		gl_renderer_attach_egl(es, buffer, format);
@@ -2710,6 +4760,60 @@ pack_color(pixman_format_code_t format, float *c)
 	}
 }
 
+static void
+gl_surface_state_release_copy_target(struct gl_surface_state *gs)
+{
+	if (gs->copy_fbo)
+		glDeleteFramebuffers(1, &gs->copy_fbo);
+	if (gs->copy_tex)
+		glDeleteTextures(1, &gs->copy_tex);
+	gs->copy_fbo = 0;
+	gs->copy_tex = 0;
+	gs->copy_tex_width = 0;
+	gs->copy_tex_height = 0;
+}
+
+static int
+gl_surface_state_ensure_copy_target(struct gl_surface_state *gs,
+				    int width, int height)
+{
+	GLenum status;
+
+	if (gs->copy_fbo &&
+	    gs->copy_tex_width >= width && gs->copy_tex_height >= height) {
+		glBindFramebuffer(GL_FRAMEBUFFER, gs->copy_fbo);
+		return 0;
+	}
+
+	width = MAX(width, gs->copy_tex_width);
+	height = MAX(height, gs->copy_tex_height);
+	gl_surface_state_release_copy_target(gs);
+
+	glGenTextures(1, &gs->copy_tex);
+	glBindTexture(GL_TEXTURE_2D, gs->copy_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height,
+		     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &gs->copy_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, gs->copy_fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, gs->copy_tex, 0);
+
+	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		weston_log("%s: fbo error: %#x\n", __func__, status);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		gl_surface_state_release_copy_target(gs);
+		return -1;
+	}
+
+	gs->copy_tex_width = width;
+	gs->copy_tex_height = height;
+
+	return 0;
+}
+
 static int
 gl_renderer_surface_copy_content(struct weston_surface *surface,
 				 void *target, size_t size, size_t stride,
@@ -2718,10 +4822,6 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 				 int width, int height,
 				 bool y_flip, bool is_argb)
 {
-	/*TODO:add scaling support*/
-	assert(target_width == width);
-	assert(target_height == height);
-
 	static const GLfloat verts[4 * 2] = {
 		0.0f, 0.0f,
 		1.0f, 0.0f,
@@ -2742,14 +4842,20 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	};
 	const pixman_format_code_t format = is_argb ? PIXMAN_a8r8g8b8 : PIXMAN_a8b8g8r8;
 	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
-	const GLenum gl_format = is_argb ? GL_BGRA_EXT : GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
+	/* without GL_EXT_read_format_bgra, BGRA is read as RGBA and
+	   swapped on CPU. */
+	const bool swap_rb = is_argb &&
+		surface->compositor->read_format != PIXMAN_a8r8g8b8;
+	const GLenum gl_format = is_argb && !swap_rb ?
+		GL_BGRA_EXT : GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
+	struct gl_timer_query *tq;
 	int cw, ch;
-	GLuint fbo;
-	GLuint tex;
-	GLenum status;
 	const GLfloat *proj;
+	GLfloat texcoords[4 * 2];
+	GLfloat u0, u1, v0, v1;
+	GLint filter;
 	int i;
 
 	gl_renderer_surface_get_content_size(surface, &cw, &ch);
@@ -2761,38 +4867,49 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 		*(uint32_t *)target = pack_color(format, gs->color);
 		return 0;
 	case BUFFER_TYPE_SHM:
-		gl_renderer_flush_damage(surface);
+		gl_surface_flush_damage(surface, gs->num_evicted_textures != 0);
 		/* fall through */
 	case BUFFER_TYPE_EGL:
 		break;
 	}
 
-	glGenTextures(1, &tex);
-	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cw, ch,
-		     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	glGenFramebuffers(1, &fbo);
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-			       GL_TEXTURE_2D, tex, 0);
-
-	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-	if (status != GL_FRAMEBUFFER_COMPLETE) {
-		weston_log("%s: fbo error: %#x\n", __func__, status);
-		glDeleteFramebuffers(1, &fbo);
-		glDeleteTextures(1, &tex);
+	if (gl_surface_state_ensure_copy_target(gs, target_width,
+						target_height) < 0)
 		return -1;
-	}
 
-	glViewport(0, 0, cw, ch);
-	glDisable(GL_BLEND);
-	use_shader(gr, gs->shader);
-	if (gs->y_inverted ^ y_flip)
+	/* only the source rectangle is drawn, scaled to the target size,
+	   so that scaling is done on GPU and just target is read back. */
+	u0 = (GLfloat)src_x / cw;
+	u1 = (GLfloat)(src_x + width) / cw;
+	if (gs->y_inverted ^ y_flip) {
 		proj = projmat_normal;
-	else
+		v0 = (GLfloat)src_y / ch;
+		v1 = (GLfloat)(src_y + height) / ch;
+	} else {
 		proj = projmat_yinvert;
+		v0 = 1.0f - (GLfloat)(src_y + height) / ch;
+		v1 = 1.0f - (GLfloat)src_y / ch;
+	}
+	if (gs->atlas_page) {
+		u0 = (gs->atlas_x + u0 * gs->pitch) / GL_ATLAS_PAGE_SIZE;
+		u1 = (gs->atlas_x + u1 * gs->pitch) / GL_ATLAS_PAGE_SIZE;
+		v0 = (gs->atlas_y + v0 * gs->height) / GL_ATLAS_PAGE_SIZE;
+		v1 = (gs->atlas_y + v1 * gs->height) / GL_ATLAS_PAGE_SIZE;
+	}
+	texcoords[0] = u0; texcoords[1] = v0;
+	texcoords[2] = u1; texcoords[3] = v0;
+	texcoords[4] = u1; texcoords[5] = v1;
+	texcoords[6] = u0; texcoords[7] = v1;
+	filter = (target_width == width && target_height == height) ?
+		 GL_NEAREST : GL_LINEAR;
+
+	tq = gpu_timer_begin(surface->compositor,
+			     "renderer_gpu_readback_begin",
+			     "renderer_gpu_readback_end", NULL, surface);
+
+	glViewport(0, 0, target_width, target_height);
+	glDisable(GL_BLEND);
+	use_shader(gr, gs->shader);
 
 	glUniformMatrix4fv(gs->shader->proj_uniform, 1, GL_FALSE, proj);
 	glUniform1f(gs->shader->alpha_uniform, 1.0f);
@@ -2802,8 +4919,8 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 
 		glActiveTexture(GL_TEXTURE0 + i);
 		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
 	}
 
 	/* position: */
@@ -2811,7 +4928,7 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	glEnableVertexAttribArray(0);
 
 	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
 	glEnableVertexAttribArray(1);
 
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
@@ -2820,21 +4937,38 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	glDisableVertexAttribArray(0);
 
 	glPixelStorei(GL_PACK_ALIGNMENT, bytespp);
-	if (stride) {
-		/* GL_PACK_ROW_LENGTH can be used when supported,
-		   but it's not supported with EGL2, thus copy row by row. */
+	if (stride && stride != target_width * bytespp &&
+	    !gr->has_pack_subimage) {
+		/* GL_PACK_ROW_LENGTH is not supported with GLES2,
+		   thus copy row by row. */
 		char *dst = (char *)target;
-		for (int i = 0; i < height; i++, dst += stride) {
-			glReadPixels(src_x, src_y+i, width, 1, gl_format,
+		for (int i = 0; i < target_height; i++, dst += stride) {
+			glReadPixels(0, i, target_width, 1, gl_format,
 				     GL_UNSIGNED_BYTE, dst);
 		}
+	} else if (stride && stride != target_width * bytespp) {
+		glPixelStorei(GL_PACK_ROW_LENGTH_NV, stride / bytespp);
+		glReadPixels(0, 0, target_width, target_height, gl_format,
+			     GL_UNSIGNED_BYTE, target);
+		glPixelStorei(GL_PACK_ROW_LENGTH_NV, 0);
 	} else {
-		glReadPixels(src_x, src_y, width, height, gl_format,
+		glReadPixels(0, 0, target_width, target_height, gl_format,
 			     GL_UNSIGNED_BYTE, target);
 	}
 
-	glDeleteFramebuffers(1, &fbo);
-	glDeleteTextures(1, &tex);
+	if (swap_rb) {
+		char *row = (char *)target;
+		size_t row_stride = stride ? stride : target_width * bytespp;
+
+		for (i = 0; i < target_height; i++, row += row_stride)
+			pixel_row_swap_rb((uint32_t *)row, (uint32_t *)row,
+					  target_width);
+	}
+
+	gpu_timer_end(gr, tq);
+
+	/* render target is kept for next copy, don't leave it bound. */
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	return 0;
 }
@@ -2846,10 +4980,17 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 
 	wl_list_remove(&gs->surface_destroy_listener.link);
 	wl_list_remove(&gs->renderer_destroy_listener.link);
+	wl_list_remove(&gs->link);
 
 	gs->surface->renderer_state = NULL;
 
+	gpu_timer_discard(gr, NULL, gs->surface);
+
+	gl_surface_atlas_release(gs);
 	glDeleteTextures(gs->num_textures, gs->textures);
+	if (gs->upload_pbo)
+		glDeleteBuffers(1, &gs->upload_pbo);
+	gl_surface_state_release_copy_target(gs);
 
 	for (i = 0; i < gs->num_images; i++)
 		egl_image_unref(gs->images[i]);
@@ -2920,6 +5061,7 @@ gl_renderer_create_surface(struct weston_surface *surface)
 		surface_state_handle_renderer_destroy;
 	wl_signal_add(&gr->destroy_signal,
 		      &gs->renderer_destroy_listener);
+	wl_list_insert(&gr->surface_state_list, &gs->link);
 
 	if (surface->buffer_ref.buffer) {
 		gl_renderer_attach(surface, surface->buffer_ref.buffer);
@@ -2940,6 +5082,20 @@ static const char vertex_shader[] =
 	"   v_texcoord = texcoord;\n"
 	"}\n";
 
+/* Takes the color of solid views from texcoord, 8 bits per channel packed
+ * in pairs, see solid_batch_color(). */
+static const char vertex_shader_solid_batch[] =
+	"uniform mat4 proj;\n"
+	"attribute vec2 position;\n"
+	"attribute vec2 texcoord;\n"
+	"varying vec4 v_color;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_Position = proj * vec4(position, 0.0, 1.0);\n"
+	"   v_color = vec4(floor(texcoord / 256.0),\n"
+	"                  mod(texcoord, 256.0)).xzyw / 255.0;\n"
+	"}\n";
+
 /* Declare common fragment shader uniforms */
 #define FRAGMENT_CONVERT_YUV						\
 	"  y *= alpha;\n"						\
@@ -2956,6 +5112,33 @@ static const char fragment_debug[] =
 static const char fragment_brace[] =
 	"}\n";
 
+/* The output color LUT stage runs after the shader it is appended to, which
+ * is renamed so that this can declare its uniforms. */
+static const char fragment_color_lut_begin[] =
+	"#define main color_lut_shade\n";
+
+static const char fragment_color_lut_end[] =
+	"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+	"precision highp float;\n"
+	"#endif\n"
+	"uniform sampler2D color_lut;\n"
+	"uniform float color_lut_size;\n"
+	"#undef main\n"
+	"void main()\n"
+	"{\n"
+	"  color_lut_shade();\n"
+	"  float a = gl_FragColor.a;\n"
+	"  if (a <= 0.0)\n"
+	"    return;\n"
+	"  float n = color_lut_size;\n"
+	"  vec3 c = clamp(gl_FragColor.rgb / a, 0.0, 1.0) * (n - 1.0);\n"
+	"  float b = min(floor(c.b), n - 2.0);\n"
+	"  vec2 uv = vec2((b * n + c.r + 0.5) / (n * n), (c.g + 0.5) / n);\n"
+	"  vec3 lo = texture2D(color_lut, uv).rgb;\n"
+	"  vec3 hi = texture2D(color_lut, uv + vec2(1.0 / n, 0.0)).rgb;\n"
+	"  gl_FragColor.rgb = mix(lo, hi, c.b - b) * a;\n"
+	"}\n";
+
 static const char texture_fragment_shader_rgba[] =
 	"precision mediump float;\n"
 	"varying vec2 v_texcoord;\n"
@@ -3049,6 +5232,15 @@ static const char solid_fragment_shader[] =
 	"   gl_FragColor = alpha * color\n;"
 	;
 
+static const char solid_batch_fragment_shader[] =
+	"precision mediump float;\n"
+	"varying vec4 v_color;\n"
+	"uniform float alpha;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_FragColor = alpha * v_color\n;"
+	;
+
 static int
 compile_shader(GLenum type, int count, const char **sources)
 {
@@ -3069,30 +5261,264 @@ compile_shader(GLenum type, int count, const char **sources)
 	return s;
 }
 
+/* Program binary cache.
+ *
+ * Each linked program is saved as a file named by a hash of the driver's
+ * strings and the program's sources, holding the binary format and the
+ * binary. A binary which fails to load, because the driver changed in a way
+ * its strings don't tell, is overwritten by the next link.
+ */
+
+#define PROGRAM_CACHE_MAGIC 0x57504231 /* "WPB1" */
+
+struct program_cache_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t length;
+};
+
+static uint64_t
+program_cache_hash(uint64_t hash, const char *str)
+{
+	/* FNV-1a, including the terminating NUL to separate strings */
+	do {
+		hash ^= (uint8_t)*str;
+		hash *= 0x100000001b3ull;
+	} while (*str++);
+
+	return hash;
+}
+
+static char *
+program_cache_path(struct gl_renderer *gr, struct gl_shader *shader)
+{
+	uint64_t key = gr->program_cache_key;
+	char *path;
+
+	key = program_cache_hash(key, shader->vertex_source);
+	key = program_cache_hash(key, shader->fragment_source);
+	if (gr->fragment_shader_debug)
+		key = program_cache_hash(key, fragment_debug);
+	if (shader->is_color_lut)
+		key = program_cache_hash(key, fragment_color_lut_end);
+
+	if (asprintf(&path, "%s/%016" PRIx64 ".bin",
+		     gr->program_cache_dir, key) < 0)
+		return NULL;
+
+	return path;
+}
+
+static bool
+program_cache_load(struct gl_renderer *gr, struct gl_shader *shader)
+{
+	struct program_cache_header header;
+	void *binary = NULL;
+	GLint status = GL_FALSE;
+	char *path;
+	FILE *fp;
+
+	path = program_cache_path(gr, shader);
+	if (!path)
+		return false;
+
+	fp = fopen(path, "rb");
+	free(path);
+	if (!fp)
+		return false;
+
+	if (fread(&header, sizeof header, 1, fp) != 1 ||
+	    header.magic != PROGRAM_CACHE_MAGIC ||
+	    header.length == 0)
+		goto out;
+
+	binary = malloc(header.length);
+	if (!binary || fread(binary, header.length, 1, fp) != 1)
+		goto out;
+
+	shader->program = glCreateProgram();
+	gr->program_binary(shader->program, header.format,
+			   binary, header.length);
+	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+	if (!status) {
+		glDeleteProgram(shader->program);
+		shader->program = 0;
+	}
+
+out:
+	free(binary);
+	fclose(fp);
+
+	return status;
+}
+
+static void
+program_cache_store(struct gl_renderer *gr, struct gl_shader *shader)
+{
+	struct program_cache_header header;
+	GLint length = 0;
+	GLsizei written = 0;
+	GLenum format;
+	void *binary;
+	char *path, *tmp_path = NULL;
+	FILE *fp;
+	bool ok;
+
+	glGetProgramiv(shader->program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+
+	gr->get_program_binary(shader->program, length, &written,
+			       &format, binary);
+	if (written <= 0)
+		goto out;
+
+	path = program_cache_path(gr, shader);
+	if (!path)
+		goto out;
+
+	/* write aside and rename, so that readers never see a partial file */
+	if (asprintf(&tmp_path, "%s.%d", path, (int)getpid()) < 0) {
+		tmp_path = NULL;
+		goto out_path;
+	}
+
+	fp = fopen(tmp_path, "wb");
+	if (!fp)
+		goto out_path;
+
+	header.magic = PROGRAM_CACHE_MAGIC;
+	header.format = format;
+	header.length = written;
+	ok = fwrite(&header, sizeof header, 1, fp) == 1 &&
+	     fwrite(binary, written, 1, fp) == 1;
+	if (fclose(fp) != 0)
+		ok = false;
+
+	if (!ok || rename(tmp_path, path) < 0)
+		unlink(tmp_path);
+
+out_path:
+	free(tmp_path);
+	free(path);
+out:
+	free(binary);
+}
+
+/* $WESTON_GL_PROGRAM_CACHE_DIR, empty to disable, or weston/gl-programs in
+ * the XDG cache directory. */
+static char *
+program_cache_get_dir(void)
+{
+	const char *env;
+	char *dir, *base = NULL;
+
+	env = getenv("WESTON_GL_PROGRAM_CACHE_DIR");
+	if (env)
+		return *env ? strdup(env) : NULL;
+
+	env = getenv("XDG_CACHE_HOME");
+	if (env && *env) {
+		base = strdup(env);
+	} else {
+		env = getenv("HOME");
+		if (!env || !*env ||
+		    asprintf(&base, "%s/.cache", env) < 0)
+			return NULL;
+		mkdir(base, 0700);
+	}
+	if (!base)
+		return NULL;
+
+	if (asprintf(&dir, "%s/weston", base) < 0) {
+		free(base);
+		return NULL;
+	}
+	mkdir(dir, 0700);
+	free(dir);
+
+	if (asprintf(&dir, "%s/weston/gl-programs", base) < 0)
+		dir = NULL;
+	free(base);
+
+	return dir;
+}
+
+static void
+program_cache_init(struct gl_renderer *gr, const char *extensions)
+{
+	static const GLenum strings[] = {
+		GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION,
+	};
+	GLint num_formats = 0;
+	const char *str;
+	unsigned i;
+
+	if (!weston_check_egl_extension(extensions, "GL_OES_get_program_binary"))
+		return;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &num_formats);
+	if (num_formats <= 0)
+		return;
+
+	gr->get_program_binary =
+		(void *) eglGetProcAddress("glGetProgramBinaryOES");
+	gr->program_binary =
+		(void *) eglGetProcAddress("glProgramBinaryOES");
+	if (!gr->get_program_binary || !gr->program_binary)
+		return;
+
+	gr->program_cache_dir = program_cache_get_dir();
+	if (!gr->program_cache_dir)
+		return;
+
+	if (mkdir(gr->program_cache_dir, 0700) < 0 && errno != EEXIST) {
+		weston_log("warning: no GL program cache, failed to create "
+			   "%s: %s\n", gr->program_cache_dir, strerror(errno));
+		free(gr->program_cache_dir);
+		gr->program_cache_dir = NULL;
+		return;
+	}
+
+	gr->program_cache_key = 0xcbf29ce484222325ull;
+	for (i = 0; i < ARRAY_LENGTH(strings); i++) {
+		str = (const char *)glGetString(strings[i]);
+		gr->program_cache_key =
+			program_cache_hash(gr->program_cache_key,
+					   str ? str : "");
+	}
+}
+
 static int
 shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 		   const char *vertex_source, const char *fragment_source)
 {
 	char msg[512];
 	GLint status;
-	int count;
-	const char *sources[3];
+	int count = 0;
+	const char *sources[5];
+
+	if (renderer->program_cache_dir &&
+	    program_cache_load(renderer, shader))
+		goto uniforms;
 
 	shader->vertex_shader =
 		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
 	if (shader->vertex_shader == GL_NONE)
 		return -1;
 
-	if (renderer->fragment_shader_debug) {
-		sources[0] = fragment_source;
-		sources[1] = fragment_debug;
-		sources[2] = fragment_brace;
-		count = 3;
-	} else {
-		sources[0] = fragment_source;
-		sources[1] = fragment_brace;
-		count = 2;
-	}
+	if (shader->is_color_lut)
+		sources[count++] = fragment_color_lut_begin;
+	sources[count++] = fragment_source;
+	if (renderer->fragment_shader_debug)
+		sources[count++] = fragment_debug;
+	sources[count++] = fragment_brace;
+	if (shader->is_color_lut)
+		sources[count++] = fragment_color_lut_end;
 
 	shader->fragment_shader =
 		compile_shader(GL_FRAGMENT_SHADER, count, sources);
@@ -3113,12 +5539,20 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 		return -1;
 	}
 
+	if (renderer->program_cache_dir)
+		program_cache_store(renderer, shader);
+
+uniforms:
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
 	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
 	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
 	shader->tex_uniforms[2] = glGetUniformLocation(shader->program, "tex2");
 	shader->alpha_uniform = glGetUniformLocation(shader->program, "alpha");
 	shader->color_uniform = glGetUniformLocation(shader->program, "color");
+	shader->color_lut_uniform =
+		glGetUniformLocation(shader->program, "color_lut");
+	shader->color_lut_size_uniform =
+		glGetUniformLocation(shader->program, "color_lut_size");
 
 	return 0;
 }
@@ -3133,6 +5567,9 @@ shader_release(struct gl_shader *shader)
 	shader->vertex_shader = 0;
 	shader->fragment_shader = 0;
 	shader->program = 0;
+
+	if (shader->color_lut)
+		shader_release(shader->color_lut);
 }
 
 void
@@ -3273,6 +5710,7 @@ gl_renderer_output_create(struct weston_output *output,
 		pixman_region32_init(&go->buffer_damage[i]);
 
 	wl_list_init(&go->timeline_render_point_list);
+	wl_list_init(&go->read_request_list);
 
 	go->begin_render_sync = EGL_NO_SYNC_KHR;
 	go->end_render_sync = EGL_NO_SYNC_KHR;
@@ -3341,8 +5779,15 @@ gl_renderer_output_pbuffer_create(struct weston_output *output,
 	}
 
 	ret = gl_renderer_output_create(output, egl_surface);
-	if (ret < 0)
+	if (ret < 0) {
 		eglDestroySurface(gr->egl_display, egl_surface);
+		return ret;
+	}
+
+	/* A pbuffer is a single buffer that keeps its content across
+	 * eglSwapBuffers(), so only the damage since the previous repaint
+	 * needs repainting, whatever EGL_BUFFER_AGE_EXT says. */
+	get_output_state(output)->buffer_count = 1;
 
 	return ret;
 }
@@ -3353,11 +5798,22 @@ gl_renderer_output_destroy(struct weston_output *output)
 	struct gl_renderer *gr = get_renderer(output->compositor);
 	struct gl_output_state *go = get_output_state(output);
 	struct timeline_render_point *trp, *tmp;
+	struct gl_read_request *req, *req_tmp;
 	int i;
 
-	for (i = 0; i < 2; i++)
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
+	wl_list_for_each_safe(req, req_tmp, &go->read_request_list, link)
+		gl_read_request_destroy(req, -1);
+
+	gpu_timer_discard(gr, output, NULL);
+
+	if (go->color_lut_tex)
+		glDeleteTextures(1, &go->color_lut_tex);
+	free(go->color_lut_pending);
+	damage_heatmap_release(go);
+
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
 		       EGL_NO_CONTEXT);
@@ -3379,6 +5835,47 @@ gl_renderer_output_destroy(struct weston_output *output)
 	free(go);
 }
 
+/* Rearranges the table into the texture layout of gl_output_state, to be
+ * uploaded at the next repaint, when the context is current. */
+static int
+gl_renderer_output_set_color_lut(struct weston_output *output,
+				 const uint16_t *lut, unsigned int size)
+{
+	struct gl_output_state *go = get_output_state(output);
+	uint8_t *texels = NULL;
+	unsigned int r, g, b, c;
+	const uint16_t *src;
+	uint8_t *dst;
+
+	if (lut) {
+		texels = malloc((size_t)size * size * size * 4);
+		if (!texels)
+			return -1;
+
+		src = lut;
+		for (b = 0; b < size; b++) {
+			for (g = 0; g < size; g++) {
+				dst = texels + ((size_t)g * size * size +
+						b * size) * 4;
+				for (r = 0; r < size; r++) {
+					for (c = 0; c < 3; c++)
+						dst[c] = (*src++ * 255u +
+							  32767u) / 65535u;
+					dst[3] = 0xff;
+					dst += 4;
+				}
+			}
+		}
+	}
+
+	free(go->color_lut_pending);
+	go->color_lut_pending = texels;
+	go->color_lut_size = lut ? size : 0;
+	go->color_lut_dirty = true;
+
+	return 0;
+}
+
 static int
 gl_renderer_create_fence_fd(struct weston_output *output)
 {
@@ -3396,15 +5893,171 @@ gl_renderer_create_fence_fd(struct weston_output *output)
 	return fd;
 }
 
+static void
+gl_renderer_memory_report(struct wl_listener *listener, void *data)
+{
+	struct gl_renderer *gr =
+		container_of(listener, struct gl_renderer,
+			     memory_report_listener);
+	struct weston_memory_report *report = data;
+	struct gl_surface_state *gs;
+	struct gl_atlas_page *page;
+	unsigned int textures = 0, client_textures = 0, pages = 0;
+	unsigned int pbos = 0, copy_targets = 0;
+	uint64_t texture_bytes = 0, pbo_bytes = 0, copy_bytes = 0;
+	int j;
+
+	wl_list_for_each(gs, &gr->surface_state_list, link) {
+		if (gs->buffer_type == BUFFER_TYPE_EGL) {
+			client_textures += gs->num_textures;
+		} else if (gs->buffer_type == BUFFER_TYPE_SHM &&
+			   !gs->atlas_page && gs->buffer_ref.buffer) {
+			for (j = 0; j < gs->num_textures; j++)
+				texture_bytes += (uint64_t)
+					(gs->pitch / gs->hsub[j]) * gs->cpp[j] *
+					(gs->buffer_ref.buffer->height /
+					 gs->vsub[j]);
+			textures += gs->num_textures;
+		}
+
+		if (gs->upload_pbo) {
+			pbos++;
+			pbo_bytes += gs->upload_pbo_size;
+		}
+		if (gs->copy_tex) {
+			copy_targets++;
+			copy_bytes += (uint64_t) gs->copy_tex_width *
+				      gs->copy_tex_height * 4;
+		}
+	}
+
+	wl_list_for_each(page, &gr->atlas_pages, link)
+		pages++;
+
+	weston_memory_report_add(report, "gl-renderer", "shm textures",
+				 textures, texture_bytes);
+	weston_memory_report_add(report, "gl-renderer", "atlas pages", pages,
+				 (uint64_t) pages * GL_ATLAS_PAGE_SIZE *
+				 GL_ATLAS_PAGE_SIZE * 4);
+	/* backed by the clients' buffers */
+	weston_memory_report_add(report, "gl-renderer", "client textures",
+				 client_textures, 0);
+	weston_memory_report_add(report, "gl-renderer", "upload pbos",
+				 pbos, pbo_bytes);
+	weston_memory_report_add(report, "gl-renderer", "copy targets",
+				 copy_targets, copy_bytes);
+	weston_memory_report_add(report, "gl-renderer", "vertex arrays", 4,
+				 gr->vertices.alloc + gr->vtxcnt.alloc +
+				 gr->indices.alloc + gr->draws.alloc);
+}
+
+/* Drop the textures of a hidden shm surface, keeping a reference to its
+ * buffer so that gl_surface_flush_damage() can upload them again in
+ * full. Surfaces whose buffer has already been released keep theirs,
+ * their content exists nowhere else. */
+static bool
+gl_surface_evict_textures(struct gl_surface_state *gs)
+{
+	struct weston_surface *surface = gs->surface;
+
+	if (gs->buffer_type != BUFFER_TYPE_SHM || gs->atlas_page ||
+	    gs->num_textures == 0 || gl_surface_texture_used(surface))
+		return false;
+
+	if (!gs->buffer_ref.buffer) {
+		if (!surface->buffer_ref.buffer)
+			return false;
+		weston_buffer_reference(&gs->buffer_ref,
+					surface->buffer_ref.buffer);
+	}
+
+	glDeleteTextures(gs->num_textures, gs->textures);
+	gs->num_evicted_textures = gs->num_textures;
+	gs->num_textures = 0;
+
+	if (gs->upload_pbo)
+		glDeleteBuffers(1, &gs->upload_pbo);
+	gs->upload_pbo = 0;
+	gs->upload_pbo_size = 0;
+	gl_surface_state_release_copy_target(gs);
+
+	return true;
+}
+
+static int
+gl_renderer_texture_evict_timer(void *data)
+{
+	struct weston_compositor *ec = data;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs, *tmp;
+	struct timespec now;
+	uint32_t now_msec;
+
+	weston_compositor_read_presentation_clock(ec, &now);
+	now_msec = timespec_to_msec(&now);
+
+	/* Oldest first; stop at the first surface drawn recently enough. */
+	wl_list_for_each_reverse_safe(gs, tmp, &gr->surface_state_list, link) {
+		if (now_msec - gs->last_used_msec < gr->texture_evict_msec)
+			break;
+		gl_surface_evict_textures(gs);
+	}
+
+	wl_event_source_timer_update(gr->texture_evict_timer,
+				     gr->texture_evict_msec);
+
+	return 0;
+}
+
+/* Everything dropped here is recreated the next time it is needed: the
+ * upload staging buffers by the next shm upload, the copy targets by the
+ * next surface_copy_content() and the vertex arrays by the next repaint.
+ * Textures stay unless the surface is hidden and still holds its buffer,
+ * otherwise they hold content that may not be uploaded again. */
+static void
+gl_renderer_memory_trim(struct wl_listener *listener, void *data)
+{
+	struct gl_renderer *gr =
+		container_of(listener, struct gl_renderer,
+			     memory_trim_listener);
+	struct gl_surface_state *gs;
+
+	wl_list_for_each(gs, &gr->surface_state_list, link) {
+		gl_surface_evict_textures(gs);
+		if (gs->upload_pbo)
+			glDeleteBuffers(1, &gs->upload_pbo);
+		gs->upload_pbo = 0;
+		gs->upload_pbo_size = 0;
+		gl_surface_state_release_copy_target(gs);
+	}
+
+	wl_array_release(&gr->vertices);
+	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->indices);
+	wl_array_release(&gr->draws);
+	wl_array_init(&gr->vertices);
+	wl_array_init(&gr->vtxcnt);
+	wl_array_init(&gr->indices);
+	wl_array_init(&gr->draws);
+}
+
 static void
 gl_renderer_destroy(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 	struct dmabuf_image *image, *next;
 	struct dmabuf_format *format, *next_format;
+	struct gl_timer_query *tq, *tq_next;
+	struct gl_atlas_page *page, *next_page;
+	struct shm_udmabuf_buffer *sb, *next_sb;
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
+	wl_list_remove(&gr->memory_report_listener.link);
+	wl_list_remove(&gr->memory_trim_listener.link);
+	if (gr->texture_evict_timer)
+		wl_event_source_remove(gr->texture_evict_timer);
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
@@ -3417,9 +6070,27 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	wl_list_for_each_safe(image, next, &gr->dmabuf_images, link)
 		dmabuf_image_destroy(image);
 
+	wl_list_for_each_safe(sb, next_sb, &gr->shm_udmabuf_buffers, link)
+		shm_udmabuf_buffer_destroy(sb);
+	shm_pool_fd_tracking_fini(gr);
+	if (gr->udmabuf_dev >= 0)
+		close(gr->udmabuf_dev);
+
 	wl_list_for_each_safe(format, next_format, &gr->dmabuf_formats, link)
 		dmabuf_format_destroy(format);
 
+	/* surfaces gave their cells back on destroy_signal; the textures
+	 * of any page left go away with the context */
+	wl_list_for_each_safe(page, next_page, &gr->atlas_pages, link) {
+		wl_list_remove(&page->link);
+		free(page);
+	}
+
+	/* the query objects go away with the context */
+	wl_list_insert_list(&gr->timer_query_free_list, &gr->timer_query_list);
+	wl_list_for_each_safe(tq, tq_next, &gr->timer_query_free_list, link)
+		free(tq);
+
 	if (gr->dummy_surface != EGL_NO_SURFACE)
 		weston_platform_destroy_egl_surface(gr->egl_display,
 						    gr->dummy_surface);
@@ -3431,12 +6102,27 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->indices);
+	wl_array_release(&gr->draws);
+
+	shader_free_color_lut(&gr->texture_shader_rgba);
+	shader_free_color_lut(&gr->texture_shader_rgbx);
+	shader_free_color_lut(&gr->texture_shader_egl_external);
+	shader_free_color_lut(&gr->texture_shader_y_uv);
+	shader_free_color_lut(&gr->texture_shader_y_u_v);
+	shader_free_color_lut(&gr->texture_shader_y_xuxv);
+	shader_free_color_lut(&gr->texture_shader_xyuv);
+	shader_free_color_lut(&gr->solid_shader);
+	shader_free_color_lut(&gr->solid_batch_shader);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
 	if (gr->fan_binding)
 		weston_binding_destroy(gr->fan_binding);
+	if (gr->heatmap_binding)
+		weston_binding_destroy(gr->heatmap_binding);
 
+	free(gr->program_cache_dir);
 	free(gr);
 }
 
@@ -3491,6 +6177,9 @@ gl_renderer_display_create(struct weston_compositor *ec,
 			   const struct gl_renderer_display_options *options)
 {
 	struct gl_renderer *gr;
+	struct wl_event_loop *loop;
+	const char *env;
+	int evict_msec;
 
 	gr = zalloc(sizeof *gr);
 	if (gr == NULL)
@@ -3510,6 +6199,7 @@ gl_renderer_display_create(struct weston_compositor *ec,
 	gr->base.surface_get_content_size =
 		gl_renderer_surface_get_content_size;
 	gr->base.surface_copy_content = gl_renderer_surface_copy_content;
+	gr->base.output_set_color_lut = gl_renderer_output_set_color_lut;
 
 	if (gl_renderer_setup_egl_display(gr, options->egl_native_display) < 0)
 		goto fail;
@@ -3545,6 +6235,12 @@ gl_renderer_display_create(struct weston_compositor *ec,
 		ec->capabilities |= WESTON_CAP_EXPLICIT_SYNC;
 
 	wl_list_init(&gr->dmabuf_images);
+	wl_list_init(&gr->atlas_pages);
+	wl_list_init(&gr->shm_udmabuf_pools);
+	wl_list_init(&gr->shm_udmabuf_buffers);
+	wl_list_init(&gr->shm_pool_fd_clients);
+	gr->udmabuf_dev = -1;
+	gr->shm_pending_fd = -1;
 	if (gr->has_dmabuf_import) {
 		gr->base.import_dmabuf = gl_renderer_import_dmabuf;
 		gr->base.query_dmabuf_formats =
@@ -3553,6 +6249,8 @@ gl_renderer_display_create(struct weston_compositor *ec,
 			gl_renderer_query_dmabuf_modifiers;
 	}
 	wl_list_init(&gr->dmabuf_formats);
+	wl_list_init(&gr->timer_query_list);
+	wl_list_init(&gr->timer_query_free_list);
 
 	if (gr->has_surfaceless_context) {
 		weston_log("EGL_KHR_surfaceless_context available\n");
@@ -3571,6 +6269,7 @@ gl_renderer_display_create(struct weston_compositor *ec,
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUYV);
 
 	wl_signal_init(&gr->destroy_signal);
+	wl_list_init(&gr->surface_state_list);
 
 	if (gl_renderer_setup(ec, gr->dummy_surface) < 0) {
 		if (gr->dummy_surface != EGL_NO_SURFACE)
@@ -3579,6 +6278,26 @@ gl_renderer_display_create(struct weston_compositor *ec,
 		goto fail_with_error;
 	}
 
+	gr->memory_report_listener.notify = gl_renderer_memory_report;
+	wl_signal_add(&ec->memory_report_signal, &gr->memory_report_listener);
+	gr->memory_trim_listener.notify = gl_renderer_memory_trim;
+	wl_signal_add(&ec->memory_trim_signal, &gr->memory_trim_listener);
+
+	gr->texture_evict_msec = GL_TEXTURE_EVICT_DEFAULT_MSEC;
+	env = getenv("WESTON_GL_TEXTURE_EVICT_MS");
+	if (env && safe_strtoint(env, &evict_msec) && evict_msec >= 0)
+		gr->texture_evict_msec = evict_msec;
+	if (gr->texture_evict_msec) {
+		loop = wl_display_get_event_loop(ec->wl_display);
+		gr->texture_evict_timer =
+			wl_event_loop_add_timer(loop,
+						gl_renderer_texture_evict_timer,
+						ec);
+		if (gr->texture_evict_timer)
+			wl_event_source_timer_update(gr->texture_evict_timer,
+						     gr->texture_evict_msec);
+	}
+
 	return 0;
 
 fail_with_error:
@@ -3623,6 +6342,9 @@ compile_shaders(struct weston_compositor *ec)
 	gr->solid_shader.vertex_source = vertex_shader;
 	gr->solid_shader.fragment_source = solid_fragment_shader;
 
+	gr->solid_batch_shader.vertex_source = vertex_shader_solid_batch;
+	gr->solid_batch_shader.fragment_source = solid_batch_fragment_shader;
+
 	return 0;
 }
 
@@ -3645,6 +6367,7 @@ fragment_debug_binding(struct weston_keyboard *keyboard,
 	shader_release(&gr->texture_shader_y_xuxv);
 	shader_release(&gr->texture_shader_xyuv);
 	shader_release(&gr->solid_shader);
+	shader_release(&gr->solid_batch_shader);
 
 	/* Force use_shader() to call glUseProgram(), since we need to use
 	 * the recompiled version of the shader. */
@@ -3666,6 +6389,30 @@ fan_debug_repaint_binding(struct weston_keyboard *keyboard,
 	weston_compositor_damage_all(compositor);
 }
 
+static void
+heatmap_debug_binding(struct weston_keyboard *keyboard,
+		      const struct timespec *time,
+		      uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct weston_output *output;
+	struct gl_surface_state *gs;
+
+	gr->heatmap_debug = !gr->heatmap_debug;
+
+	/* start over with empty windows */
+	wl_list_for_each(output, &compositor->output_list, link)
+		damage_heatmap_release(get_output_state(output));
+	wl_list_for_each(gs, &gr->surface_state_list, link) {
+		gs->heat_commits = 0;
+		gs->heat_damage_area = 0;
+	}
+	gr->heatmap_window_start = gr->repaint_msec;
+
+	weston_compositor_damage_all(compositor);
+}
+
 static uint32_t
 get_gl_version(void)
 {
@@ -3688,6 +6435,7 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	struct gl_renderer *gr = get_renderer(ec);
 	const char *extensions;
 	EGLBoolean ret;
+	GLint max_texture_size;
 
 	EGLint context_attribs[16] = {
 		EGL_CONTEXT_CLIENT_VERSION, 0,
@@ -3785,6 +6533,45 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	    weston_check_egl_extension(extensions, "GL_EXT_unpack_subimage"))
 		gr->has_unpack_subimage = true;
 
+	/* atlas uploads need the buffer's row length */
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	if (gr->has_unpack_subimage &&
+	    max_texture_size >= GL_ATLAS_PAGE_SIZE &&
+	    !getenv("WESTON_GL_NO_ATLAS"))
+		gr->has_atlas = true;
+
+	/* opt-in, the kernel limits udmabuf size and count */
+	if (gr->has_dmabuf_import && gr->udmabuf_dev < 0 &&
+	    getenv("WESTON_GL_SHM_UDMABUF")) {
+		gr->udmabuf_dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+		if (gr->udmabuf_dev >= 0 &&
+		    !shm_pool_fd_tracking_init(gr, ec->wl_display)) {
+			close(gr->udmabuf_dev);
+			gr->udmabuf_dev = -1;
+		}
+	}
+
+	if (gr->gl_version >= GR_GL_VERSION(3, 0) ||
+	    weston_check_egl_extension(extensions, "GL_NV_pack_subimage"))
+		gr->has_pack_subimage = true;
+
+	if (gr->gl_version >= GR_GL_VERSION(3, 0)) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBuffer");
+	}
+
+	if (gr->map_buffer_range && gr->unmap_buffer) {
+		gr->has_pbo_upload = true;
+
+		if (gr->has_native_fence_sync) {
+			gr->has_pbo_read = true;
+			gr->base.read_pixels_async =
+				gl_renderer_read_pixels_async;
+		}
+	}
+
 	if (gr->gl_version >= GR_GL_VERSION(3, 0) ||
 	    weston_check_egl_extension(extensions, "GL_EXT_texture_rg"))
 		gr->has_gl_texture_rg = true;
@@ -3792,6 +6579,25 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = true;
 
+	if (weston_check_egl_extension(extensions,
+				       "GL_EXT_disjoint_timer_query")) {
+		gr->gen_queries = (void *) eglGetProcAddress("glGenQueriesEXT");
+		gr->query_counter =
+			(void *) eglGetProcAddress("glQueryCounterEXT");
+		gr->get_query_objectuiv =
+			(void *) eglGetProcAddress("glGetQueryObjectuivEXT");
+		gr->get_query_objectui64v =
+			(void *) eglGetProcAddress("glGetQueryObjectui64vEXT");
+		gr->get_integer64v =
+			(void *) eglGetProcAddress("glGetInteger64vEXT");
+		gr->has_timer_query = gr->gen_queries && gr->query_counter &&
+				      gr->get_query_objectuiv &&
+				      gr->get_query_objectui64v &&
+				      gr->get_integer64v;
+	}
+
+	program_cache_init(gr, extensions);
+
 	glActiveTexture(GL_TEXTURE0);
 
 	if (compile_shaders(ec))
@@ -3805,6 +6611,10 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		weston_compositor_add_debug_binding(ec, KEY_F,
 						    fan_debug_repaint_binding,
 						    ec);
+	gr->heatmap_binding =
+		weston_compositor_add_debug_binding(ec, KEY_H,
+						    heatmap_debug_binding,
+						    ec);
 
 	gr->output_destroy_listener.notify = output_handle_destroy;
 	wl_signal_add(&ec->output_destroyed_signal,
@@ -3815,6 +6625,20 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload through PBO: %s\n",
+			    gr->has_pbo_upload ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "texture atlas for small wl_shm: %s\n",
+			    gr->has_atlas ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm import through udmabuf: %s\n",
+			    gr->udmabuf_dev >= 0 ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "program binary cache: %s\n",
+			    gr->program_cache_dir ? gr->program_cache_dir : "no");
+	weston_log_continue(STAMP_SPACE "read-back sub-image: %s\n",
+			    gr->has_pack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "asynchronous read-back: %s\n",
+			    gr->has_pbo_read ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "GPU timer queries: %s\n",
+			    gr->has_timer_query ? "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
 
@@ -34,84 +34,159 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/uio.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <libweston/libweston.h>
 #include "shared/helpers.h"
 #include "shared/timespec-util.h"
 #include "backend.h"
 #include "libweston-internal.h"
+#include "pixel-formats.h"
 
 #include "wcap/wcap-decode.h"
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
 	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
 	struct weston_output *output;
 	weston_screenshooter_done_func_t done;
 	void *data;
+
+	/* region to capture, in output framebuffer coordinates. */
+	int32_t x, y, width, height;
+	/* format of the client buffer. */
+	pixman_format_code_t format;
+
+	/* pixels being read back, and the format they are read in. */
+	uint8_t *pixels;
+	pixman_format_code_t read_format;
+	bool yflip;
 };
 
+/* A negative src_stride copies the rows bottom up. */
 static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_rows_swap_RB(uint8_t *dst, int dst_stride, uint8_t *src, int src_stride,
+		  int height, int width)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
+		pixel_row_swap_rb((uint32_t *) dst, (uint32_t *) src, width);
+		dst += dst_stride;
+		src += src_stride;
 	}
 }
 
-static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
+static bool
+screenshooter_format_is_bgr(pixman_format_code_t format)
 {
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
+	return PIXMAN_FORMAT_TYPE(format) == PIXMAN_TYPE_ABGR;
 }
 
-static void
-copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
+static pixman_format_code_t
+screenshooter_shm_format(struct wl_shm_buffer *shm_buffer)
 {
-	uint32_t *dst = vdst;
-	uint32_t *src = vsrc;
-	uint32_t *end = dst + bytes / 4;
-
-	while (dst < end) {
-		uint32_t v = *src++;
-		/*                    A R G B */
-		uint32_t tmp = v & 0xff00ff00;
-		tmp |= (v >> 16) & 0x000000ff;
-		tmp |= (v << 16) & 0x00ff0000;
-		*dst++ = tmp;
+	switch (wl_shm_buffer_get_format(shm_buffer)) {
+	case WL_SHM_FORMAT_XRGB8888:
+		return PIXMAN_x8r8g8b8;
+	case WL_SHM_FORMAT_ABGR8888:
+		return PIXMAN_a8b8g8r8;
+	case WL_SHM_FORMAT_XBGR8888:
+		return PIXMAN_x8b8g8r8;
+	case WL_SHM_FORMAT_ARGB8888:
+	default:
+		return PIXMAN_a8r8g8b8;
 	}
 }
 
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+screenshooter_frame_listener_destroy(struct screenshooter_frame_listener *l)
 {
-	uint8_t *end;
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	free(l->pixels);
+	free(l);
+}
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
+static void
+screenshooter_buffer_destroy_notify(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
+
+	wl_list_remove(&l->buffer_destroy_listener.link);
+	l->buffer = NULL;
 }
 
 static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+screenshooter_read_done(void *data, int status)
 {
-	uint8_t *end;
+	struct screenshooter_frame_listener *l = data;
+	int32_t stride, src_stride;
+	uint8_t *d, *s;
+
+	/* buffer may go away while pixels are read back. */
+	if (status < 0 || !l->buffer) {
+		l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
+	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
+	src_stride = l->width * 4;
+	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
+
+	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
+	if (screenshooter_format_is_bgr(l->read_format) !=
+	    screenshooter_format_is_bgr(l->format)) {
+		s = l->pixels;
+		if (l->yflip) {
+			s += src_stride * (l->height - 1);
+			src_stride = -src_stride;
+		}
+		copy_rows_swap_RB(d, stride, s, src_stride,
+				  l->height, l->width);
+	} else {
+		pixel_copy_rows(d, stride, l->pixels, src_stride,
+				l->width * 4, l->height, l->yflip);
 	}
+	wl_shm_buffer_end_access(l->buffer->shm_buffer);
+
+	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
+	screenshooter_frame_listener_destroy(l);
+}
+
+/* When the renderer reads top down and the client buffer has no
+ * padding, the renderer writes straight into the buffer in its format,
+ * there is nothing to flip or swizzle. */
+static bool
+screenshooter_read_direct(struct screenshooter_frame_listener *l)
+{
+	struct weston_compositor *compositor = l->output->compositor;
+	struct wl_shm_buffer *shm_buffer = l->buffer->shm_buffer;
+	int ret;
+
+	if (l->yflip ||
+	    wl_shm_buffer_get_stride(shm_buffer) != l->width * 4)
+		return false;
+
+	wl_shm_buffer_begin_access(shm_buffer);
+	ret = compositor->renderer->read_pixels(l->output, l->format,
+						wl_shm_buffer_get_data(shm_buffer),
+						l->x, l->y,
+						l->width, l->height);
+	wl_shm_buffer_end_access(shm_buffer);
+
+	return ret == 0;
 }
 
 static void
@@ -122,62 +197,116 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 			     struct screenshooter_frame_listener, listener);
 	struct weston_output *output = l->output;
 	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	int32_t y;
 
 	weston_output_disable_planes_decr(output);
 	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
 
-	if (pixels == NULL) {
+	if (!l->buffer) {
+		l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
+
+	l->yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+
+	if (screenshooter_read_direct(l)) {
+		l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
+
+	l->pixels = malloc(l->width * l->height * 4);
+	if (l->pixels == NULL) {
 		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
+		screenshooter_frame_listener_destroy(l);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
+	if (l->yflip)
+		y = output->current_mode->height - l->y - l->height;
+	else
+		y = l->y;
 
-	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
+	/* the copy to client buffer is done once read back completes,
+	   without stalling the compositor on the GPU. RGBA reads are
+	   always supported, so those buffers need no swizzle either. */
+	if (screenshooter_format_is_bgr(l->format))
+		l->read_format = PIXMAN_a8b8g8r8;
+	else
+		l->read_format = compositor->read_format;
+	if (weston_renderer_read_pixels_async(output,
+					      l->read_format,
+					      l->pixels, l->x, y,
+					      l->width, l->height,
+					      screenshooter_read_done, l) < 0) {
+		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		screenshooter_frame_listener_destroy(l);
+	}
+}
 
-	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
+/* Reads the region back from the renderer after the next repaint, with
+ * every view composited by it. */
+static void
+screenshooter_shoot_rendered(struct screenshooter_frame_listener *l)
+{
+	struct weston_output *output = l->output;
 
-	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
+	free(l->pixels);
+	l->pixels = NULL;
+	l->listener.notify = screenshooter_frame_notify;
+	wl_signal_add(&output->frame_signal, &l->listener);
+	weston_output_disable_planes_incr(output);
+	weston_output_damage(output);
+}
 
-	switch (compositor->read_format) {
-	case PIXMAN_a8r8g8b8:
-	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
-		break;
-	case PIXMAN_x8b8g8r8:
-	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
-		break;
-	default:
-		break;
+static void
+screenshooter_capture_done(void *data, int status)
+{
+	struct screenshooter_frame_listener *l = data;
+
+	if (status < 0 && l->buffer) {
+		screenshooter_shoot_rendered(l);
+		return;
 	}
 
-	wl_shm_buffer_end_access(l->buffer->shm_buffer);
+	screenshooter_read_done(l, status);
+}
 
-	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
-	free(l);
+/* Captures the region as the display shows it, when the backend can,
+ * leaving the views on their planes. */
+static bool
+screenshooter_shoot_captured(struct screenshooter_frame_listener *l)
+{
+	struct weston_output *output = l->output;
+
+	if (!output->capture_pixels_async)
+		return false;
+
+	l->pixels = malloc(l->width * l->height * 4);
+	if (!l->pixels)
+		return false;
+
+	l->read_format = l->format;
+	l->yflip = false;
+	if (output->capture_pixels_async(output, l->read_format, l->pixels,
+					 l->x, l->y, l->width, l->height,
+					 screenshooter_capture_done, l) < 0) {
+		free(l->pixels);
+		l->pixels = NULL;
+		return false;
+	}
+
+	return true;
 }
 
 WL_EXPORT int
-weston_screenshooter_shoot(struct weston_output *output,
-			   struct weston_buffer *buffer,
-			   weston_screenshooter_done_func_t done, void *data)
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data)
 {
 	struct screenshooter_frame_listener *l;
 
@@ -190,38 +319,88 @@ weston_screenshooter_shoot(struct weston_output *output,
 	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
 	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
 
-	if (buffer->width < output->current_mode->width ||
-	    buffer->height < output->current_mode->height) {
+	if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+	    x + width > output->current_mode->width ||
+	    y + height > output->current_mode->height ||
+	    buffer->width < width || buffer->height < height) {
 		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
 		return -1;
 	}
 
-	l = malloc(sizeof *l);
+	l = zalloc(sizeof *l);
 	if (l == NULL) {
 		done(data, WESTON_SCREENSHOOTER_NO_MEMORY);
 		return -1;
 	}
 
 	l->buffer = buffer;
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroy_notify;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
 	l->output = output;
 	l->done = done;
 	l->data = data;
-	l->listener.notify = screenshooter_frame_notify;
-	wl_signal_add(&output->frame_signal, &l->listener);
-	weston_output_disable_planes_incr(output);
-	weston_output_damage(output);
+	l->x = x;
+	l->y = y;
+	l->width = width;
+	l->height = height;
+	l->format = screenshooter_shm_format(buffer->shm_buffer);
+
+	if (!screenshooter_shoot_captured(l))
+		screenshooter_shoot_rendered(l);
 
 	return 0;
 }
 
+WL_EXPORT int
+weston_screenshooter_shoot(struct weston_output *output,
+			   struct weston_buffer *buffer,
+			   weston_screenshooter_done_func_t done, void *data)
+{
+	return weston_screenshooter_shoot_region(output, buffer, 0, 0,
+						 output->current_mode->width,
+						 output->current_mode->height,
+						 done, data);
+}
+
+struct weston_recorder_frame {
+	struct wl_list link; /* weston_recorder::frame_queue */
+	struct weston_recorder *recorder;
+	uint32_t msecs;
+	int nrects;
+	pixman_box32_t *rects;
+	/* rects read back one after another, each tightly packed. */
+	uint32_t *pixels;
+	int pending_reads;
+	bool failed;
+	bool ready;
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
+	int do_yflip;
 	int fd;
 	struct wl_listener frame_listener;
 	int count, destroying;
+	/* frames with read backs still in flight, compositor thread only. */
+	int reading;
+
+	/* Encoding happens on a worker thread so that recording does not
+	 * stall the compositor. Frames are queued in repaint order and the
+	 * worker only takes the head of the queue once all of its read
+	 * backs are done, so the file keeps the order of the frames. */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct wl_list frame_queue;
+	bool exit;
+
+	/* owned by the worker thread */
+	uint32_t *frame, *outbuf, *keyrow;
+	int stride, height;
+	uint64_t total;
+	uint32_t nframes;
+	struct wcap_index_entry *index;
+	uint32_t nentries, index_size;
 };
 
 static uint32_t *
@@ -255,9 +434,332 @@ component_delta(uint32_t next, uint32_t prev)
 	return (dr << 16) | (dg << 8) | (db << 0);
 }
 
+/* Replace a row of pixels by its component_delta() against prev, and
+ * store the pixels into prev for the next frame. */
+static void
+recorder_delta_row(uint32_t *row, uint32_t *prev, int width)
+{
+	uint32_t next;
+	int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+
+	for (; i + 4 <= width; i += 4) {
+		__m128i n = _mm_loadu_si128((const __m128i *)(row + i));
+		__m128i p = _mm_loadu_si128((const __m128i *)(prev + i));
+
+		_mm_storeu_si128((__m128i *)(prev + i), n);
+		_mm_storeu_si128((__m128i *)(row + i),
+				 _mm_and_si128(_mm_sub_epi8(n, p), mask));
+	}
+#elif defined(__ARM_NEON)
+	const uint32x4_t mask = vdupq_n_u32(0x00ffffff);
+
+	for (; i + 4 <= width; i += 4) {
+		uint32x4_t n = vld1q_u32(row + i);
+		uint32x4_t p = vld1q_u32(prev + i);
+		uint8x16_t d = vsubq_u8(vreinterpretq_u8_u32(n),
+					vreinterpretq_u8_u32(p));
+
+		vst1q_u32(prev + i, n);
+		vst1q_u32(row + i, vandq_u32(vreinterpretq_u32_u8(d), mask));
+	}
+#endif
+
+	for (; i < width; i++) {
+		next = row[i];
+		row[i] = component_delta(next, prev[i]);
+		prev[i] = next;
+	}
+}
+
+/* Number of leading values of p equal to value. */
+static int
+recorder_run_length(const uint32_t *p, int n, uint32_t value)
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i v = _mm_set1_epi32(value);
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i eq = _mm_cmpeq_epi32(
+			_mm_loadu_si128((const __m128i *)(p + i)), v);
+
+		if (_mm_movemask_epi8(eq) != 0xffff)
+			break;
+	}
+#elif defined(__ARM_NEON)
+	const uint32x4_t v = vdupq_n_u32(value);
+
+	for (; i + 4 <= n; i += 4) {
+		uint64x2_t eq = vreinterpretq_u64_u32(
+			vceqq_u32(vld1q_u32(p + i), v));
+
+		if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) !=
+		    UINT64_MAX)
+			break;
+	}
+#endif
+
+	for (; i < n && p[i] == value; i++)
+		;
+
+	return i;
+}
+
+/* Run length encodes a row, runs continue from one row to the next. */
+static uint32_t *
+recorder_rle_row(uint32_t *p, const uint32_t *row, int width,
+		 uint32_t *prev, int *run)
+{
+	uint32_t delta;
+	int k, n;
+
+	for (k = 0; k < width; k += n) {
+		delta = row[k];
+		n = recorder_run_length(row + k, width - k, delta);
+		if (*run == 0 || delta == *prev) {
+			*run += n;
+		} else {
+			p = output_run(p, *prev, *run);
+			*run = n;
+		}
+		*prev = delta;
+	}
+
+	return p;
+}
+
+/* Runs on the worker thread, returns the end of the encoded data. */
+static uint32_t *
+weston_recorder_encode(struct weston_recorder *recorder,
+		       struct weston_recorder_frame *frame, uint32_t *p)
+{
+	pixman_box32_t *r = frame->rects;
+	uint32_t *rect = frame->pixels;
+	uint32_t *s, *d, prev;
+	int i, j, width, height, run;
+
+	for (i = 0; i < frame->nrects; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		run = prev = 0; /* quiet gcc */
+		for (j = 0; j < height; j++) {
+			if (recorder->do_yflip)
+				s = rect + width * j;
+			else
+				s = rect + width * (height - j - 1);
+			d = recorder->frame +
+			    recorder->stride * (r[i].y2 - j - 1) + r[i].x1;
+
+			recorder_delta_row(s, d, width);
+			p = recorder_rle_row(p, s, width, &prev, &run);
+		}
+
+		p = output_run(p, prev, run);
+		rect += width * height;
+	}
+
+	return p;
+}
+
+/* Encodes the whole current frame against black, so that decoding can
+ * start from it. */
+static uint32_t *
+weston_recorder_encode_key(struct weston_recorder *recorder, uint32_t *p)
+{
+	uint32_t *s, *row = recorder->keyrow, prev;
+	int j, k, width = recorder->stride, run;
+
+	run = prev = 0;
+	for (j = recorder->height - 1; j >= 0; j--) {
+		s = recorder->frame + width * j;
+		for (k = 0; k < width; k++)
+			row[k] = s[k] & 0x00ffffff;
+		p = recorder_rle_row(p, row, width, &prev, &run);
+	}
+
+	return output_run(p, prev, run);
+}
+
+static int
+weston_recorder_add_keyframe(struct weston_recorder *recorder,
+			     uint32_t msecs)
+{
+	struct wcap_index_entry *index;
+	uint32_t size;
+
+	if (recorder->nentries == recorder->index_size) {
+		size = recorder->index_size ? recorder->index_size * 2 : 64;
+		index = realloc(recorder->index, size * sizeof *index);
+		if (index == NULL)
+			return -1;
+		recorder->index = index;
+		recorder->index_size = size;
+	}
+
+	index = &recorder->index[recorder->nentries++];
+	index->offset = recorder->total;
+	index->msecs = msecs;
+	index->frame = recorder->nframes;
+
+	return 0;
+}
+
+static void
+weston_recorder_write_frame(struct weston_recorder *recorder,
+			    struct weston_recorder_frame *frame)
+{
+	struct wcap_frame_header_v2 header;
+	pixman_box32_t key_rect;
+	struct iovec v[3];
+	uint32_t *p;
+	ssize_t written;
+
+	p = weston_recorder_encode(recorder, frame, recorder->outbuf);
+
+	header.msecs = frame->msecs;
+	header.nrects = frame->nrects;
+	header.flags = 0;
+	v[1].iov_base = frame->rects;
+	v[1].iov_len = frame->nrects * sizeof *frame->rects;
+
+	/* periodic keyframes let the decoder seek without replaying
+	 * the recording from the start */
+	if (recorder->nframes % WCAP_KEYFRAME_INTERVAL == 0 &&
+	    weston_recorder_add_keyframe(recorder, frame->msecs) == 0) {
+		p = weston_recorder_encode_key(recorder, recorder->outbuf);
+		key_rect.x1 = 0;
+		key_rect.y1 = 0;
+		key_rect.x2 = recorder->stride;
+		key_rect.y2 = recorder->height;
+		header.nrects = 1;
+		header.flags = WCAP_FRAME_KEY;
+		v[1].iov_base = &key_rect;
+		v[1].iov_len = sizeof key_rect;
+	}
+
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[2].iov_base = recorder->outbuf;
+	v[2].iov_len = (p - recorder->outbuf) * 4;
+	header.size = v[1].iov_len + v[2].iov_len;
+
+	written = writev(recorder->fd, v, 3);
+	if (written > 0)
+		recorder->total += written;
+	recorder->nframes++;
+}
+
+static void
+weston_recorder_write_index(struct weston_recorder *recorder)
+{
+	struct wcap_trailer trailer;
+	struct iovec v[2];
+	ssize_t written;
+
+	trailer.index_offset = recorder->total;
+	trailer.nentries = recorder->nentries;
+	trailer.keyframe_interval = WCAP_KEYFRAME_INTERVAL;
+	trailer.nframes = recorder->nframes;
+	trailer.magic = WCAP_TRAILER_MAGIC;
+
+	v[0].iov_base = recorder->index;
+	v[0].iov_len = recorder->nentries * sizeof *recorder->index;
+	v[1].iov_base = &trailer;
+	v[1].iov_len = sizeof trailer;
+
+	written = writev(recorder->fd, v, 2);
+	if (written > 0)
+		recorder->total += written;
+}
+
+static void
+weston_recorder_frame_free(struct weston_recorder_frame *frame)
+{
+	free(frame->rects);
+	free(frame->pixels);
+	free(frame);
+}
+
+static void *
+weston_recorder_thread(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->mutex);
+	for (;;) {
+		frame = NULL;
+		if (!wl_list_empty(&recorder->frame_queue))
+			frame = container_of(recorder->frame_queue.next,
+					     struct weston_recorder_frame, link);
+
+		if (!frame || !frame->ready) {
+			if (!frame && recorder->exit)
+				break;
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+			continue;
+		}
+
+		wl_list_remove(&frame->link);
+		pthread_mutex_unlock(&recorder->mutex);
+
+		/* A frame that could not be read back is left out of the
+		 * file as a whole, the next deltas are then still against
+		 * what the decoder has seen. */
+		if (!frame->failed)
+			weston_recorder_write_frame(recorder, frame);
+		weston_recorder_frame_free(frame);
+
+		pthread_mutex_lock(&recorder->mutex);
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	weston_recorder_write_index(recorder);
+
+	return NULL;
+}
+
 static void
 weston_recorder_destroy(struct weston_recorder *recorder);
 
+static void
+weston_recorder_finish(struct weston_recorder *recorder);
+
+static void
+weston_recorder_frame_ready(struct weston_recorder_frame *frame)
+{
+	struct weston_recorder *recorder = frame->recorder;
+
+	pthread_mutex_lock(&recorder->mutex);
+	frame->ready = true;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+}
+
+static void
+weston_recorder_read_done(void *data, int status)
+{
+	struct weston_recorder_frame *frame = data;
+	struct weston_recorder *recorder = frame->recorder;
+
+	if (status < 0)
+		frame->failed = true;
+
+	if (--frame->pending_reads > 0)
+		return;
+
+	weston_recorder_frame_ready(frame);
+
+	/* the frame is now the worker's, do not touch it anymore */
+	if (--recorder->reading == 0 && recorder->destroying == 2)
+		weston_recorder_finish(recorder);
+}
+
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 {
@@ -265,25 +767,11 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = recorder->output;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = timespec_to_msec(&output->frame_time);
+	struct weston_recorder_frame *frame;
 	pixman_box32_t *r;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	int i, n, width, height, y_orig, size;
+	uint32_t *pixels;
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -295,75 +783,72 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 	pixman_region32_fini(&damage);
 
 	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+	if (n == 0)
+		goto out;
+
+	size = 0;
+	for (i = 0; i < n; i++)
+		size += (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	frame = zalloc(sizeof *frame);
+	if (frame == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		goto out;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	frame->recorder = recorder;
+	frame->msecs = timespec_to_msec(&output->frame_time);
+	frame->nrects = n;
+	frame->rects = malloc(n * sizeof *r);
+	frame->pixels = malloc(size * 4);
+	if (frame->rects == NULL || frame->pixels == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		weston_recorder_frame_free(frame);
+		goto out;
+	}
+	memcpy(frame->rects, r, n * sizeof *r);
+
+	pthread_mutex_lock(&recorder->mutex);
+	wl_list_insert(recorder->frame_queue.prev, &frame->link);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	/* read backs complete from the event loop, never from here */
+	frame->pending_reads = n;
+	recorder->reading++;
 
+	pixels = frame->pixels;
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
+		if (recorder->do_yflip)
 			y_orig = output->current_mode->height - r[i].y2;
 		else
 			y_orig = r[i].y1;
 
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
+		if (weston_renderer_read_pixels_async(output,
+						      compositor->read_format,
+						      pixels, r[i].x1, y_orig,
+						      width, height,
+						      weston_recorder_read_done,
+						      frame) < 0) {
+			frame->failed = true;
+			frame->pending_reads--;
 		}
 
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+		pixels += width * height;
+	}
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
+	if (frame->pending_reads == 0) {
+		weston_recorder_frame_ready(frame);
+		recorder->reading--;
 	}
 
-	pixman_region32_fini(&transformed_damage);
 	recorder->count++;
 
+out:
+	pixman_region32_fini(&transformed_damage);
+
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
 }
@@ -374,8 +859,11 @@ weston_recorder_free(struct weston_recorder *recorder)
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
-	free(recorder->rect);
+	pthread_cond_destroy(&recorder->cond);
+	pthread_mutex_destroy(&recorder->mutex);
+	free(recorder->index);
+	free(recorder->keyrow);
+	free(recorder->outbuf);
 	free(recorder->frame);
 	free(recorder);
 }
@@ -387,9 +875,6 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	struct weston_recorder *recorder;
 	int stride, size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -397,26 +882,29 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return NULL;
 	}
 
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+	wl_list_init(&recorder->frame_queue);
+
 	stride = output->current_mode->width;
 	size = stride * 4 * output->current_mode->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	/* RLE never takes more than a word per pixel */
+	recorder->outbuf = malloc(size);
+	recorder->keyrow = malloc(stride * 4);
+	recorder->stride = stride;
+	recorder->height = output->current_mode->height;
 	recorder->output = output;
+	recorder->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if ((recorder->frame == NULL) || (recorder->outbuf == NULL) ||
+	    (recorder->keyrow == NULL)) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
-			weston_log("%s: out of memory\n", __func__);
-			goto err_recorder;
-		}
-	}
-
-	header.magic = WCAP_HEADER_MAGIC;
+	header.magic = WCAP_HEADER_MAGIC_V2;
 
 	switch (compositor->read_format) {
 	case PIXMAN_x8r8g8b8:
@@ -444,6 +932,12 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	header.height = output->current_mode->height;
 	recorder->total += write(recorder->fd, &header, sizeof header);
 
+	if (pthread_create(&recorder->thread, NULL,
+			   weston_recorder_thread, recorder) != 0) {
+		weston_log("%s: failed to create encoding thread\n", __func__);
+		goto err_fd;
+	}
+
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
 	weston_output_disable_planes_incr(output);
@@ -451,18 +945,41 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 
 	return recorder;
 
+err_fd:
+	close(recorder->fd);
 err_recorder:
 	weston_recorder_free(recorder);
 	return NULL;
 }
 
+/* Wait for the worker to write out all queued frames. */
+static void
+weston_recorder_finish(struct weston_recorder *recorder)
+{
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->exit = true;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	pthread_join(recorder->thread, NULL);
+
+	weston_log("recorder stopped, total file size %dM, %d frames\n",
+		   (int) (recorder->total / (1024 * 1024)), recorder->count);
+
+	close(recorder->fd);
+	weston_recorder_free(recorder);
+}
+
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
 	weston_output_disable_planes_decr(recorder->output);
-	weston_recorder_free(recorder);
+
+	/* the last read back to complete finishes the recorder */
+	recorder->destroying = 2;
+	if (recorder->reading == 0)
+		weston_recorder_finish(recorder);
 }
 
 WL_EXPORT struct weston_recorder *
@@ -486,8 +1003,7 @@ weston_recorder_start(struct weston_output *output, const char *filename)
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder, %d frames\n", recorder->count);
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
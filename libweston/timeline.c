@@ -27,6 +27,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
@@ -36,6 +37,9 @@
 #include <libweston/weston-log.h>
 #include "timeline.h"
 #include "weston-log-internal.h"
+#include "shared/helpers.h"
+#include "shared/timeline-binary.h"
+#include "shared/timespec-util.h"
 
 /**
  * Timeline itself is not a subscriber but a scope (a producer of data), and it
@@ -90,6 +94,7 @@ weston_timeline_create_subscription(struct weston_log_subscription *sub,
 		return;
 
 	wl_list_init(&tl_sub->objects);
+	wl_array_init(&tl_sub->names);
 
 	/* attach this timeline_subscription to it */
 	weston_log_subscription_set_data(sub, tl_sub);
@@ -128,6 +133,8 @@ weston_timeline_destroy_subscription(struct weston_log_subscription *sub,
 			      &tl_sub->objects, subscription_link)
 		weston_timeline_destroy_subscription_object(sub_obj);
 
+	wl_array_release(&tl_sub->names);
+	free(tl_sub->buffer);
 	free(tl_sub);
 }
 
@@ -400,6 +407,15 @@ weston_timeline_refresh_subscription_objects(struct weston_compositor *wc,
 		if (sub_obj)
 			sub_obj->force_refresh = true;
 	}
+
+	while ((sub = weston_log_subscription_iterate(wc->timeline_binary,
+						      sub))) {
+		struct weston_timeline_subscription_object *sub_obj;
+
+		sub_obj = weston_timeline_get_subscription_object(sub, object);
+		if (sub_obj)
+			sub_obj->force_refresh = true;
+	}
 }
 
 typedef int (*type_func)(struct timeline_emit_context *ctx, void *obj);
@@ -482,3 +498,307 @@ weston_timeline_point(struct weston_log_scope *timeline_scope,
 
 	}
 }
+
+/* The binary timeline collects records in a buffer per subscription and
+ * writes them out once it is full, or when the oldest point in it is
+ * TIMELINE_BINARY_FLUSH_NS old at the time of a new point. Records still
+ * buffered when the subscription goes away are lost.
+ */
+#define TIMELINE_BINARY_BUFFER_SIZE (64 * 1024)
+#define TIMELINE_BINARY_FLUSH_NS (100 * 1000 * 1000)
+
+struct weston_timeline_name {
+	const char *name;
+	uint32_t id;
+};
+
+/** Create a binary timeline subscription
+ *
+ * Called when the subscription is created.
+ *
+ * @ingroup internal-log
+ */
+void
+weston_timeline_binary_create_subscription(struct weston_log_subscription *sub,
+					   void *user_data)
+{
+	struct weston_timeline_subscription *tl_sub;
+	struct timeline_binary_header *header;
+
+	weston_timeline_create_subscription(sub, user_data);
+
+	tl_sub = weston_log_subscription_get_data(sub);
+	if (!tl_sub)
+		return;
+
+	tl_sub->binary = true;
+	tl_sub->buffer = malloc(TIMELINE_BINARY_BUFFER_SIZE);
+	if (!tl_sub->buffer) {
+		weston_timeline_destroy_subscription(sub, user_data);
+		weston_log_subscription_set_data(sub, NULL);
+		return;
+	}
+
+	/* goes out with the first point */
+	header = (struct timeline_binary_header *)tl_sub->buffer;
+	header->magic = TIMELINE_BINARY_MAGIC;
+	header->version = TIMELINE_BINARY_VERSION;
+	tl_sub->buffer_used = sizeof *header;
+}
+
+static void
+timeline_binary_flush(struct weston_log_subscription *sub,
+		      struct weston_timeline_subscription *tl_sub)
+{
+	if (tl_sub->buffer_used == 0)
+		return;
+
+	weston_log_subscription_write(sub, tl_sub->buffer,
+				      tl_sub->buffer_used);
+	tl_sub->buffer_used = 0;
+}
+
+/* Returns room for 'count' records, flushing the buffer if needed */
+static struct timeline_binary_record *
+timeline_binary_reserve(struct weston_log_subscription *sub,
+			struct weston_timeline_subscription *tl_sub,
+			size_t count)
+{
+	size_t size = count * sizeof(struct timeline_binary_record);
+	struct timeline_binary_record *rec;
+
+	assert(size <= TIMELINE_BINARY_BUFFER_SIZE);
+
+	if (tl_sub->buffer_used + size > TIMELINE_BINARY_BUFFER_SIZE)
+		timeline_binary_flush(sub, tl_sub);
+
+	rec = (struct timeline_binary_record *)
+		(tl_sub->buffer + tl_sub->buffer_used);
+	tl_sub->buffer_used += size;
+
+	return rec;
+}
+
+static void
+timeline_binary_record(struct weston_log_subscription *sub,
+		       struct weston_timeline_subscription *tl_sub,
+		       enum timeline_binary_record_type type,
+		       uint16_t kind, uint32_t id, uint64_t value)
+{
+	struct timeline_binary_record *rec;
+
+	rec = timeline_binary_reserve(sub, tl_sub, 1);
+	rec->type = type;
+	rec->kind = kind;
+	rec->id = id;
+	rec->value = value;
+}
+
+/* Defines a new string and returns its id */
+static uint32_t
+timeline_binary_string(struct weston_log_subscription *sub,
+		       struct weston_timeline_subscription *tl_sub,
+		       const char *str)
+{
+	struct timeline_binary_record *rec;
+	size_t len = strlen(str);
+	size_t count;
+
+	/* the string data has to fit in the buffer with its record */
+	len = MIN(len, TIMELINE_BINARY_BUFFER_SIZE / 2);
+	count = 1 + (len + sizeof *rec - 1) / sizeof *rec;
+
+	rec = timeline_binary_reserve(sub, tl_sub, count);
+	memset(rec, 0, count * sizeof *rec);
+	rec->type = TLB_RECORD_STRING;
+	rec->id = ++tl_sub->next_string_id;
+	rec->value = len;
+	memcpy(rec + 1, str, len);
+
+	return rec->id;
+}
+
+/* Point names are interned by address */
+static uint32_t
+timeline_binary_intern(struct weston_log_subscription *sub,
+		       struct weston_timeline_subscription *tl_sub,
+		       const char *name)
+{
+	struct weston_timeline_name *tn;
+
+	wl_array_for_each(tn, &tl_sub->names)
+		if (tn->name == name)
+			return tn->id;
+
+	tn = wl_array_add(&tl_sub->names, sizeof *tn);
+	if (!tn)
+		return 0;
+
+	tn->name = name;
+	tn->id = timeline_binary_string(sub, tl_sub, name);
+
+	return tn->id;
+}
+
+static void
+timeline_binary_describe_surface(struct weston_log_subscription *sub,
+				 struct weston_timeline_subscription *tl_sub,
+				 struct weston_surface *s,
+				 struct weston_timeline_subscription_object *sub_obj)
+{
+	struct weston_surface *mains;
+	uint32_t main_id = 0;
+	uint32_t desc_id = 0;
+	char d[512];
+
+	if (!weston_timeline_check_object_refresh(sub_obj))
+		return;
+
+	mains = weston_surface_get_main_surface(s);
+	if (mains != s) {
+		struct weston_timeline_subscription_object *main_obj;
+
+		main_obj = weston_timeline_subscription_surface_ensure(tl_sub,
+								       mains);
+		timeline_binary_describe_surface(sub, tl_sub, mains, main_obj);
+		main_id = main_obj->id;
+	}
+
+	if (s->get_label && s->get_label(s, d, sizeof(d)) >= 0 && d[0])
+		desc_id = timeline_binary_string(sub, tl_sub, d);
+
+	timeline_binary_record(sub, tl_sub, TLB_RECORD_OBJECT, TLT_SURFACE,
+			       sub_obj->id, (uint64_t)desc_id << 32 | main_id);
+}
+
+/* Describes the objects of a point before the point refers to them */
+static void
+timeline_binary_describe_objects(struct weston_log_subscription *sub,
+				 struct weston_timeline_subscription *tl_sub,
+				 va_list argp)
+{
+	struct weston_timeline_subscription_object *sub_obj;
+	enum timeline_type otype;
+	uint32_t name_id;
+	void *obj;
+
+	while ((otype = va_arg(argp, enum timeline_type)) != TLT_END) {
+		obj = va_arg(argp, void *);
+
+		if (otype == TLT_OUTPUT) {
+			struct weston_output *output = obj;
+
+			sub_obj = weston_timeline_subscription_output_ensure(tl_sub,
+									     output);
+			if (!weston_timeline_check_object_refresh(sub_obj))
+				continue;
+
+			name_id = output->name ?
+				  timeline_binary_string(sub, tl_sub,
+							 output->name) : 0;
+			timeline_binary_record(sub, tl_sub, TLB_RECORD_OBJECT,
+					       TLT_OUTPUT, sub_obj->id,
+					       (uint64_t)name_id << 32);
+		} else if (otype == TLT_SURFACE) {
+			sub_obj = weston_timeline_subscription_surface_ensure(tl_sub,
+									      obj);
+			timeline_binary_describe_surface(sub, tl_sub, obj,
+							 sub_obj);
+		}
+	}
+}
+
+static void
+timeline_binary_args(struct weston_log_subscription *sub,
+		     struct weston_timeline_subscription *tl_sub,
+		     va_list argp)
+{
+	struct weston_timeline_subscription_object *sub_obj;
+	enum timeline_type otype;
+	uint32_t id;
+	uint64_t value;
+	void *obj;
+
+	while ((otype = va_arg(argp, enum timeline_type)) != TLT_END) {
+		obj = va_arg(argp, void *);
+		id = 0;
+		value = 0;
+
+		switch (otype) {
+		case TLT_OUTPUT:
+		case TLT_SURFACE:
+			sub_obj = weston_timeline_subscription_search(tl_sub, obj);
+			if (!sub_obj)
+				continue;
+			id = sub_obj->id;
+			break;
+		case TLT_VBLANK:
+		case TLT_GPU:
+		case TLT_PRESENT:
+			value = timespec_to_nsec(obj);
+			break;
+		case TLT_MSEC:
+			value = *(int64_t *)obj;
+			break;
+		default:
+			continue;
+		}
+
+		timeline_binary_record(sub, tl_sub, TLB_RECORD_ARG, otype,
+				       id, value);
+	}
+}
+
+/** Disseminates the timeline point to all subscriptions of the binary
+ * timeline scope
+ *
+ * Same as weston_timeline_point(), but emits the records described in
+ * shared/timeline-binary.h.
+ *
+ * @param timeline_scope the binary timeline scope
+ * @param name the name of the timeline point, with static storage duration
+ *
+ * @ingroup log
+ */
+WL_EXPORT void
+weston_timeline_point_binary(struct weston_log_scope *timeline_scope,
+			     const char *name, ...)
+{
+	struct weston_log_subscription *sub = NULL;
+	struct timespec ts;
+	uint64_t now;
+
+	if (!weston_log_scope_is_enabled(timeline_scope))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = timespec_to_nsec(&ts);
+
+	while ((sub = weston_log_subscription_iterate(timeline_scope, sub))) {
+		struct weston_timeline_subscription *tl_sub;
+		uint32_t name_id;
+		va_list argp;
+
+		tl_sub = weston_log_subscription_get_data(sub);
+		if (!tl_sub || !tl_sub->binary)
+			continue;
+
+		if (tl_sub->buffer_used == 0)
+			tl_sub->buffer_start_ns = now;
+
+		va_start(argp, name);
+		timeline_binary_describe_objects(sub, tl_sub, argp);
+		va_end(argp);
+
+		name_id = timeline_binary_intern(sub, tl_sub, name);
+		timeline_binary_record(sub, tl_sub, TLB_RECORD_POINT, 0,
+				       name_id, now);
+
+		va_start(argp, name);
+		timeline_binary_args(sub, tl_sub, argp);
+		va_end(argp);
+
+		if (now - tl_sub->buffer_start_ns >= TIMELINE_BINARY_FLUSH_NS)
+			timeline_binary_flush(sub, tl_sub);
+	}
+}
@@ -53,6 +53,14 @@ enum timeline_type {
 struct weston_timeline_subscription {
 	unsigned int next_id;
 	struct wl_list objects; /**< weston_timeline_subscription_object::subscription_link */
+
+	/* Only for the timeline-binary scope, see shared/timeline-binary.h */
+	bool binary;
+	unsigned int next_string_id;
+	struct wl_array names;		/**< struct weston_timeline_name */
+	char *buffer;			/**< records not yet written out */
+	size_t buffer_used;
+	uint64_t buffer_start_ns;	/**< time of the oldest point in buffer */
 };
 
 /**
@@ -90,7 +98,8 @@ struct weston_timeline_subscription_object {
 
 /** This macro is used to add timeline points.
  *
- * Use TLP_END when done for the vargs.
+ * Use TLP_END when done for the vargs. The name must be a string with
+ * static storage duration, the binary timeline interns it by address.
  *
  * @param ec weston_compositor instance
  *
@@ -98,10 +107,15 @@ struct weston_timeline_subscription_object {
  */
 #define TL_POINT(ec, ...) do { \
 	weston_timeline_point(ec->timeline, __VA_ARGS__); \
+	weston_timeline_point_binary(ec->timeline_binary, __VA_ARGS__); \
 } while (0)
 
 void
 weston_timeline_point(struct weston_log_scope *timeline_scope,
 		      const char *name, ...);
 
+void
+weston_timeline_point_binary(struct weston_log_scope *timeline_scope,
+			     const char *name, ...);
+
 #endif /* WESTON_TIMELINE_H */
@@ -296,21 +296,11 @@ clip_simple(struct clip_context *ctx,
 	return surf->n;
 }
 
-int
-clip_transformed(struct clip_context *ctx,
-		 struct polygon8 *surf,
-		 float *ex,
-		 float *ey)
+static int
+clip_remove_duplicates(const struct polygon8 *surf, float *ex, float *ey)
 {
-	struct polygon8 polygon;
 	int i, n;
 
-	polygon.n = clip_polygon_left(ctx, surf, polygon.x, polygon.y);
-	surf->n = clip_polygon_right(ctx, &polygon, surf->x, surf->y);
-	polygon.n = clip_polygon_top(ctx, surf, polygon.x, polygon.y);
-	surf->n = clip_polygon_bottom(ctx, &polygon, surf->x, surf->y);
-
-	/* Get rid of duplicate vertices */
 	ex[0] = surf->x[0];
 	ey[0] = surf->y[0];
 	n = 1;
@@ -328,3 +318,143 @@ clip_transformed(struct clip_context *ctx,
 
 	return n;
 }
+
+int
+clip_transformed(struct clip_context *ctx,
+		 struct polygon8 *surf,
+		 float *ex,
+		 float *ey)
+{
+	struct polygon8 polygon;
+
+	polygon.n = clip_polygon_left(ctx, surf, polygon.x, polygon.y);
+	surf->n = clip_polygon_right(ctx, &polygon, surf->x, surf->y);
+	polygon.n = clip_polygon_top(ctx, surf, polygon.x, polygon.y);
+	surf->n = clip_polygon_bottom(ctx, &polygon, surf->x, surf->y);
+
+	/* Get rid of duplicate vertices */
+	return clip_remove_duplicates(surf, ex, ey);
+}
+
+/* Clips one polygon against all rectangles of the batch, with the results
+ * of clip_transformed() in ex[k], ey[k] and n[k] for rectangle k, except
+ * that polygons whose bounding box only touches or misses the rectangle
+ * give no vertices, and rectangles inside a convex polygon may start from
+ * another corner. The polygon is left untouched.
+ *
+ * Most rectangles of a damage region either lie inside the polygon,
+ * contain it or miss it, so they are classified first, all lanes at
+ * once in branchless loops that the compiler vectorizes. Only the
+ * rectangles crossing an edge of the polygon go through the
+ * Sutherland-Hodgman passes.
+ */
+void
+clip_transformed_batch(const struct clip_batch *batch,
+		       const struct polygon8 *surf,
+		       float ex[][8],
+		       float ey[][8],
+		       int *n)
+{
+	struct clip_context ctx;
+	struct polygon8 polygon;
+	float min_x, max_x, min_y, max_y;
+	float area = 0.0f;
+	float winding;
+	int outside[CLIP_BATCH_SIZE];
+	int inside[CLIP_BATCH_SIZE];
+	int covered[CLIP_BATCH_SIZE];
+	int i, j, k;
+
+	assert(batch->count <= CLIP_BATCH_SIZE);
+
+	if (surf->n < 2) {
+		for (k = 0; k < batch->count; k++)
+			n[k] = 0;
+		return;
+	}
+
+	min_x = max_x = surf->x[0];
+	min_y = max_y = surf->y[0];
+	for (i = 1; i < surf->n; i++) {
+		min_x = min(min_x, surf->x[i]);
+		max_x = max(max_x, surf->x[i]);
+		min_y = min(min_y, surf->y[i]);
+		max_y = max(max_y, surf->y[i]);
+	}
+
+	for (i = 0; i < surf->n; i++) {
+		j = (i + 1) % surf->n;
+		area += surf->x[i] * surf->y[j] - surf->x[j] * surf->y[i];
+	}
+	winding = area > 0.0f ? 1.0f : -1.0f;
+
+	/* A rectangle is covered by the (convex) polygon when all its
+	 * corners are strictly on the inner side of every edge. */
+	for (k = 0; k < batch->count; k++)
+		covered[k] = area != 0.0f;
+
+	for (i = 0; i < surf->n; i++) {
+		float ax = surf->x[i];
+		float ay = surf->y[i];
+		float dx = (surf->x[(i + 1) % surf->n] - ax) * winding;
+		float dy = (surf->y[(i + 1) % surf->n] - ay) * winding;
+
+		for (k = 0; k < batch->count; k++) {
+			float l = dy * (batch->x1[k] - ax);
+			float r = dy * (batch->x2[k] - ax);
+			float t = dx * (batch->y1[k] - ay);
+			float b = dx * (batch->y2[k] - ay);
+
+			covered[k] &= (t - l > 0.0f) & (t - r > 0.0f) &
+				      (b - l > 0.0f) & (b - r > 0.0f);
+		}
+	}
+
+	for (k = 0; k < batch->count; k++) {
+		outside[k] = (min_x >= batch->x2[k]) | (max_x <= batch->x1[k]) |
+			     (min_y >= batch->y2[k]) | (max_y <= batch->y1[k]);
+		/* matches the edge tests of the path transitions */
+		inside[k] = (min_x >= batch->x1[k]) & (max_x < batch->x2[k]) &
+			    (min_y >= batch->y1[k]) & (max_y < batch->y2[k]);
+	}
+
+	for (k = 0; k < batch->count; k++) {
+		if (outside[k]) {
+			n[k] = 0;
+			continue;
+		}
+
+		if (inside[k]) {
+			n[k] = clip_remove_duplicates(surf, ex[k], ey[k]);
+			continue;
+		}
+
+		if (covered[k]) {
+			/* same winding as the polygon */
+			ex[k][0] = batch->x1[k];
+			ey[k][0] = batch->y1[k];
+			ex[k][2] = batch->x2[k];
+			ey[k][2] = batch->y2[k];
+			if (winding > 0.0f) {
+				ex[k][1] = batch->x2[k];
+				ey[k][1] = batch->y1[k];
+				ex[k][3] = batch->x1[k];
+				ey[k][3] = batch->y2[k];
+			} else {
+				ex[k][1] = batch->x1[k];
+				ey[k][1] = batch->y2[k];
+				ex[k][3] = batch->x2[k];
+				ey[k][3] = batch->y1[k];
+			}
+			n[k] = 4;
+			continue;
+		}
+
+		ctx.clip.x1 = batch->x1[k];
+		ctx.clip.y1 = batch->y1[k];
+		ctx.clip.x2 = batch->x2[k];
+		ctx.clip.y2 = batch->y2[k];
+		polygon = *surf;
+		n[k] = clip_transformed(&ctx, &polygon, ex[k], ey[k]);
+	}
+}
@@ -61,6 +61,26 @@ int
 clip_transformed(struct clip_context *ctx,
 		 struct polygon8 *surf,
 		 float *ex,
-		 float *ey);\
+		 float *ey);
+
+#define CLIP_BATCH_SIZE 4
+
+/* Clip rectangles for clip_transformed_batch(), one per lane, in the
+ * same coordinates as clip_context.clip.
+ */
+struct clip_batch {
+	float x1[CLIP_BATCH_SIZE];
+	float y1[CLIP_BATCH_SIZE];
+	float x2[CLIP_BATCH_SIZE];
+	float y2[CLIP_BATCH_SIZE];
+	int count;
+};
+
+void
+clip_transformed_batch(const struct clip_batch *batch,
+		       const struct polygon8 *surf,
+		       float ex[][8],
+		       float ey[][8],
+		       int *n);
 
 #endif
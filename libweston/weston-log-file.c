@@ -31,13 +31,42 @@
 
 #include "weston-log-internal.h"
 
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+
+/** Writer thread of an asynchronous file subscriber
+ *
+ * Producers append to the ring under the mutex; the thread takes whatever
+ * is queued in one go, so a burst of messages costs one fwrite() and one
+ * fflush() instead of a blocking write per line.
+ */
+struct weston_log_file_writer {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t data_cond;	/* data queued, or exiting */
+	pthread_cond_t space_cond;	/* thread made room */
+
+	char *ring;
+	size_t size;
+	size_t head;	/* first byte not yet written out */
+	size_t used;
+	bool exiting;
+
+	enum weston_log_file_overflow overflow;
+	uint64_t dropped;	/* bytes, not reported yet */
+	uint64_t dropped_total;	/* bytes */
+};
 
 /** File type of stream
  */
 struct weston_debug_log_file {
 	struct weston_log_subscriber base;
 	FILE *file;
+	/* NULL when writing synchronously */
+	struct weston_log_file_writer *writer;
 };
 
 static struct weston_debug_log_file *
@@ -46,20 +75,131 @@ to_weston_debug_log_file(struct weston_log_subscriber *sub)
 	return container_of(sub, struct weston_debug_log_file, base);
 }
 
+static void *
+weston_log_file_writer_thread(void *data)
+{
+	struct weston_debug_log_file *stream = data;
+	struct weston_log_file_writer *w = stream->writer;
+	uint64_t dropped;
+	size_t len;
+
+	pthread_mutex_lock(&w->mutex);
+	for (;;) {
+		while (w->used == 0 && w->dropped == 0 && !w->exiting)
+			pthread_cond_wait(&w->data_cond, &w->mutex);
+		if (w->used == 0 && w->dropped == 0)
+			break;
+
+		/* only the contiguous part, the rest on the next turn.
+		 * Producers never touch [head, head + used), so it is
+		 * read without the lock. */
+		len = MIN(w->used, w->size - w->head);
+		dropped = w->dropped;
+		w->dropped = 0;
+		pthread_mutex_unlock(&w->mutex);
+
+		if (dropped)
+			fprintf(stream->file,
+				"[weston-log: %" PRIu64 " bytes dropped, "
+				"writer fell behind]\n", dropped);
+		if (len)
+			fwrite(w->ring + w->head, len, 1, stream->file);
+		fflush(stream->file);
+
+		pthread_mutex_lock(&w->mutex);
+		w->head = (w->head + len) % w->size;
+		w->used -= len;
+		pthread_cond_broadcast(&w->space_cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	return NULL;
+}
+
+static void
+weston_log_file_write_async(struct weston_debug_log_file *stream,
+			    const char *data, size_t len)
+{
+	struct weston_log_file_writer *w = stream->writer;
+	size_t tail, n;
+
+	pthread_mutex_lock(&w->mutex);
+
+	if (w->overflow == WESTON_LOG_FILE_OVERFLOW_DROP &&
+	    len > w->size - w->used) {
+		/* whole messages only, a torn line is worse than none */
+		w->dropped += len;
+		w->dropped_total += len;
+		len = 0;
+	}
+
+	while (len > 0) {
+		/* wait for room for the whole message when it can fit, so
+		 * blocked writers don't interleave their pieces */
+		while (w->size - w->used < MIN(len, w->size))
+			pthread_cond_wait(&w->space_cond, &w->mutex);
+
+		tail = (w->head + w->used) % w->size;
+		n = MIN(len, w->size - w->used);
+		n = MIN(n, w->size - tail);
+		memcpy(w->ring + tail, data, n);
+		w->used += n;
+		data += n;
+		len -= n;
+		pthread_cond_signal(&w->data_cond);
+	}
+
+	pthread_mutex_unlock(&w->mutex);
+}
+
 static void
 weston_log_file_write(struct weston_log_subscriber *sub,
 		      const char *data, size_t len)
 {
 	struct weston_debug_log_file *stream = to_weston_debug_log_file(sub);
+
+	if (stream->writer) {
+		weston_log_file_write_async(stream, data, len);
+		return;
+	}
+
 	fwrite(data, len, 1, stream->file);
 }
 
+static void
+weston_log_file_writer_destroy(struct weston_debug_log_file *file)
+{
+	struct weston_log_file_writer *w = file->writer;
+
+	/* the thread drains the ring before it exits */
+	pthread_mutex_lock(&w->mutex);
+	w->exiting = true;
+	pthread_cond_signal(&w->data_cond);
+	pthread_mutex_unlock(&w->mutex);
+	pthread_join(w->thread, NULL);
+
+	if (w->dropped_total)
+		fprintf(file->file,
+			"[weston-log: %" PRIu64 " bytes dropped in total]\n",
+			w->dropped_total);
+	fflush(file->file);
+
+	pthread_cond_destroy(&w->space_cond);
+	pthread_cond_destroy(&w->data_cond);
+	pthread_mutex_destroy(&w->mutex);
+	free(w->ring);
+	free(w);
+	file->writer = NULL;
+}
+
 static void
 weston_log_subscriber_destroy_log(struct weston_log_subscriber *subscriber)
 {
 	struct weston_debug_log_file *file = to_weston_debug_log_file(subscriber);
 
 	weston_log_subscriber_release(subscriber);
+	if (file->writer)
+		weston_log_file_writer_destroy(file);
 	free(file);
 }
 
@@ -96,3 +236,68 @@ weston_log_subscriber_create_log(FILE *dump_to)
 
 	return &file->base;
 }
+
+/** Creates a file type of subscriber that writes from its own thread
+ *
+ * Messages are copied to a ring buffer of \c buffer_size bytes and written
+ * out in batches by a writer thread, so a slow disk no longer stalls the
+ * thread logging. When the ring is full, \c overflow decides between
+ * waiting for the writer and dropping the message; dropped bytes are
+ * counted and noted in the file.
+ *
+ * Destroying the subscriber writes out everything still queued. Falls
+ * back to synchronous writes when \c buffer_size is 0.
+ *
+ * @param dump_to if specified, used for writing data to
+ * @param buffer_size size of the ring buffer, in bytes
+ * @param overflow what to do with messages that don't fit the ring
+ * @returns a weston_log_subscriber object or NULL in case of failure
+ *
+ * @sa weston_log_subscriber_create_log, weston_log_subscriber_destroy
+ */
+WL_EXPORT struct weston_log_subscriber *
+weston_log_subscriber_create_log_async(FILE *dump_to, size_t buffer_size,
+				       enum weston_log_file_overflow overflow)
+{
+	struct weston_log_subscriber *sub;
+	struct weston_debug_log_file *file;
+	struct weston_log_file_writer *w;
+
+	sub = weston_log_subscriber_create_log(dump_to);
+	if (!sub || buffer_size == 0)
+		return sub;
+
+	file = to_weston_debug_log_file(sub);
+	w = zalloc(sizeof(*w));
+	if (!w)
+		goto err;
+
+	w->ring = malloc(buffer_size);
+	if (!w->ring)
+		goto err_writer;
+
+	w->size = buffer_size;
+	w->overflow = overflow;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->data_cond, NULL);
+	pthread_cond_init(&w->space_cond, NULL);
+	file->writer = w;
+
+	if (pthread_create(&w->thread, NULL,
+			   weston_log_file_writer_thread, file) != 0)
+		goto err_thread;
+
+	return sub;
+
+err_thread:
+	file->writer = NULL;
+	pthread_cond_destroy(&w->space_cond);
+	pthread_cond_destroy(&w->data_cond);
+	pthread_mutex_destroy(&w->mutex);
+	free(w->ring);
+err_writer:
+	free(w);
+err:
+	weston_log_subscriber_destroy(sub);
+	return NULL;
+}
@@ -32,39 +32,74 @@
 #include "weston-log-internal.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/time.h>
 
+#include "shared/timespec-util.h"
+
+/** A ring of timestamped records, written by a single thread.
+ *
+ * Positions are virtual byte offsets which only ever grow, the offset in
+ * buf is the position modulo size. A record never wraps: a header with
+ * len 0, or less room than a header, means the rest up to the end of buf
+ * is unused.
+ *
+ * append_pos and tail_pos are stored with release semantics by the writer
+ * once a record is complete, so a dump loading them with acquire semantics
+ * never sees a half-written record below append_pos.
+ */
 struct weston_ring_buffer {
-	uint32_t append_pos;	/**< where in the buffer we are */
+	uint64_t append_pos;	/**< where the next record goes */
+	uint64_t tail_pos;	/**< oldest record in the buffer */
 	uint32_t size;		/**< max length of the ring buffer */
 	char *buf;		/**< the buffer itself */
 	FILE *file;		/**< where to write in case we need to dump the buf */
-	bool overlap;		/**< in case buff overlaps, hint from where to print buf contents */
+	bool retired;		/**< its thread exited, free for another one */
+	struct wl_list link;	/**< weston_debug_log_flight_recorder::rings */
+	struct weston_debug_log_flight_recorder *flight_rec;
 };
 
+struct weston_ring_record {
+	uint64_t timestamp;	/**< CLOCK_MONOTONIC, in ns */
+	uint32_t len;		/**< bytes of data following the header */
+};
+
+#define RING_RECORD_ALIGN 8
+
 /** allows easy access to the ring buffer in case of a core dump
  */
 WL_EXPORT struct weston_ring_buffer *weston_primary_flight_recorder_ring_buffer = NULL;
 
 /** A black box type of stream, used to aggregate data continuously, and
  * when needed, to dump its contents for inspection.
+ *
+ * Every thread writing to it gets a ring buffer of its own, so writers
+ * never wait for each other nor interleave inside a record. The lock is
+ * only taken the first time a thread writes, when a thread exits, and
+ * when dumping, which merges the rings by timestamp.
  */
 struct weston_debug_log_flight_recorder {
 	struct weston_log_subscriber base;
-	struct weston_ring_buffer rb;
+	struct weston_ring_buffer rb;	/**< of the thread creating it */
+	size_t size;
+	pthread_key_t key;		/**< the ring buffer of this thread */
+	pthread_mutex_t lock;
+	struct wl_list rings;		/**< weston_ring_buffer::link */
 };
 
 static void
 weston_ring_buffer_init(struct weston_ring_buffer *rb, size_t size, char *buf)
 {
 	rb->append_pos = 0;
-	rb->size = size - 1;
+	rb->tail_pos = 0;
+	rb->size = size & ~(RING_RECORD_ALIGN - 1);
 	rb->buf = buf;
-	rb->overlap = false;
+	rb->retired = false;
 	rb->file = stderr;
 }
 
@@ -74,79 +109,151 @@ to_flight_recorder(struct weston_log_subscriber *sub)
 	return container_of(sub, struct weston_debug_log_flight_recorder, base);
 }
 
-static void
-weston_log_flight_recorder_adjust_end(struct weston_ring_buffer *rb,
-				      size_t bytes_to_advance)
+static size_t
+weston_ring_record_size(uint32_t len)
 {
-	if (rb->append_pos == rb->size - bytes_to_advance)
-		rb->append_pos = 0;
-	else
-		rb->append_pos += bytes_to_advance;
+	size_t size = sizeof(struct weston_ring_record) + len;
+
+	return (size + RING_RECORD_ALIGN - 1) & ~(RING_RECORD_ALIGN - 1);
 }
 
-static void
-weston_log_flight_recorder_write_chunks(struct weston_ring_buffer *rb,
-					const char *data, size_t len)
+/* Returns the size of the record at pos, including the skipped room at the
+ * end of buf for the wrap marker. The header is copied to rec, which has a
+ * len of 0 if the record holds no data. A dump reads rings while their
+ * writers go on, so the header is loaded once and only the copy is
+ * trusted: its len was checked against the room left in buf. */
+static size_t
+weston_ring_buffer_peek(struct weston_ring_buffer *rb, uint64_t pos,
+			struct weston_ring_record *rec)
 {
-	/* no of chunks that matches our buffer size */
-	size_t nr_chunks = len / rb->size;
-
-	/* bytes left that do not fill entire buffer */
-	size_t bytes_left_last_chunk = len % rb->size;
-	const char *c_data = data;
-
-	/* might overlap multiple times, memcpy is redundant,
-	 * that's why we don't even modify append_pos */
-	while (nr_chunks-- > 0) {
-		memcpy(&rb->buf[rb->append_pos], c_data, rb->size);
-		c_data += rb->size;
+	uint32_t offset = pos % rb->size;
+	uint32_t to_end = rb->size - offset;
+	struct weston_ring_record *r;
+
+	rec->len = 0;
+
+	if (to_end < sizeof *r)
+		return to_end;
+
+	r = (struct weston_ring_record *)&rb->buf[offset];
+	rec->timestamp = __atomic_load_n(&r->timestamp, __ATOMIC_RELAXED);
+	rec->len = __atomic_load_n(&r->len, __ATOMIC_RELAXED);
+	if (rec->len == 0 || weston_ring_record_size(rec->len) > to_end) {
+		rec->len = 0;
+		return to_end;
 	}
 
-	if (bytes_left_last_chunk)
-		memcpy(&rb->buf[rb->append_pos], c_data, bytes_left_last_chunk);
+	return weston_ring_record_size(rec->len);
+}
+
+/* Drops the oldest records until 'room' bytes are free */
+static void
+weston_ring_buffer_make_room(struct weston_ring_buffer *rb, size_t room)
+{
+	struct weston_ring_record rec;
+	uint64_t tail_pos = rb->tail_pos;
 
-	/* adjust append_pos */
-	weston_log_flight_recorder_adjust_end(rb, bytes_left_last_chunk);
+	if (rb->append_pos - tail_pos + room <= rb->size)
+		return;
+
+	while (rb->append_pos - tail_pos + room > rb->size)
+		tail_pos += weston_ring_buffer_peek(rb, tail_pos, &rec);
+
+	/* before the dropped records are overwritten */
+	__atomic_store_n(&rb->tail_pos, tail_pos, __ATOMIC_RELEASE);
 }
 
 static void
-weston_log_flight_recorder_write_chunks_overlap(struct weston_ring_buffer *rb,
-					 const char *data, size_t len)
+weston_ring_buffer_append(struct weston_ring_buffer *rb, uint64_t timestamp,
+			  const char *data, size_t len)
 {
-	size_t transfer_remains =
-		(rb->append_pos + len) - rb->size;
-	size_t transfer_to_end = len - transfer_remains;
-	const char *c_data = data;
+	struct weston_ring_record *rec;
+	uint32_t offset = rb->append_pos % rb->size;
+	size_t max_len = rb->size - weston_ring_record_size(0);
+	size_t need;
+
+	/* keep the end of what does not fit */
+	if (len > max_len) {
+		data += len - max_len;
+		len = max_len;
+	}
+	need = weston_ring_record_size(len);
 
-	/* transfer what remains until the end of the buffer */
-	memcpy(&rb->buf[rb->append_pos], c_data, transfer_to_end);
-	c_data += transfer_to_end;
+	if (offset + need > rb->size) {
+		size_t to_end = rb->size - offset;
 
-	/* reset append_pos as we filled up the buffer */
-	rb->append_pos = 0;
+		weston_ring_buffer_make_room(rb, to_end);
+		if (to_end >= sizeof *rec) {
+			rec = (struct weston_ring_record *)&rb->buf[offset];
+			rec->len = 0;
+		}
+		__atomic_store_n(&rb->append_pos, rb->append_pos + to_end,
+				 __ATOMIC_RELEASE);
+		offset = 0;
+	}
+
+	weston_ring_buffer_make_room(rb, need);
+
+	rec = (struct weston_ring_record *)&rb->buf[offset];
+	rec->timestamp = timestamp;
+	rec->len = len;
+	memcpy(rec + 1, data, len);
 
-	/* transfer what remains */
-	weston_log_flight_recorder_write_chunks(rb, c_data, transfer_remains);
-	rb->overlap = true;
+	/* publishes the record to a dump */
+	__atomic_store_n(&rb->append_pos, rb->append_pos + need,
+			 __ATOMIC_RELEASE);
 }
 
 static void
-weston_log_flight_recorder_write_data(struct weston_ring_buffer *rb,
-				      const char *data, size_t len)
+weston_ring_buffer_retire(void *data)
 {
-	/*
-	 * If append_pos is at the beginning of the buffer, we determine if we
-	 * should do it in chunks, and if there are any bytes left we transfer
-	 * those as well.
-	 *
-	 * If the append_pos is somewhere inside the buffer we determine how
-	 * many bytes we need to transfer between we reach the end and overlap,
-	 * then we proceed as in the first step.
-	 */
-	if (rb->append_pos == 0)
-		weston_log_flight_recorder_write_chunks(rb, data, len);
-	else
-		weston_log_flight_recorder_write_chunks_overlap(rb, data, len);
+	struct weston_ring_buffer *rb = data;
+	struct weston_debug_log_flight_recorder *flight_rec = rb->flight_rec;
+
+	pthread_mutex_lock(&flight_rec->lock);
+	rb->retired = true;
+	pthread_mutex_unlock(&flight_rec->lock);
+}
+
+/* The ring buffer of the calling thread, taking over one of an exited
+ * thread or allocating a new one on the first write */
+static struct weston_ring_buffer *
+weston_log_flight_recorder_get_ring(struct weston_debug_log_flight_recorder *flight_rec)
+{
+	struct weston_ring_buffer *rb;
+	char *buf;
+
+	rb = pthread_getspecific(flight_rec->key);
+	if (rb)
+		return rb;
+
+	pthread_mutex_lock(&flight_rec->lock);
+	wl_list_for_each(rb, &flight_rec->rings, link) {
+		if (rb->retired) {
+			rb->retired = false;
+			goto out;
+		}
+	}
+
+	rb = zalloc(sizeof(*rb));
+	buf = malloc(flight_rec->size);
+	if (!rb || !buf) {
+		free(rb);
+		free(buf);
+		rb = NULL;
+		goto out;
+	}
+
+	weston_ring_buffer_init(rb, flight_rec->size, buf);
+	rb->flight_rec = flight_rec;
+	wl_list_insert(flight_rec->rings.prev, &rb->link);
+
+out:
+	pthread_mutex_unlock(&flight_rec->lock);
+	if (rb)
+		pthread_setspecific(flight_rec->key, rb);
+
+	return rb;
 }
 
 static void
@@ -155,26 +262,18 @@ weston_log_flight_recorder_write(struct weston_log_subscriber *sub,
 {
 	struct weston_debug_log_flight_recorder *flight_rec =
 		to_flight_recorder(sub);
-	struct weston_ring_buffer *rb = &flight_rec->rb;
-
-	/* in case the data is bigger than the size of the buf */
-	if (rb->size < len) {
-		weston_log_flight_recorder_write_data(rb, data, len);
-	} else {
-		/* if we can transfer it without wrapping it do it at once */
-		if (rb->append_pos <= rb->size - len) {
-			memcpy(&rb->buf[rb->append_pos], data, len);
-
-			/*
-			 * adjust append_pos, take care of the situation were
-			 * to fill up the entire buf
-			 */
-			weston_log_flight_recorder_adjust_end(rb, len);
-		} else {
-			weston_log_flight_recorder_write_data(rb, data, len);
-		}
-	}
+	struct weston_ring_buffer *rb;
+	struct timespec ts;
 
+	if (len == 0)
+		return;
+
+	rb = weston_log_flight_recorder_get_ring(flight_rec);
+	if (!rb)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	weston_ring_buffer_append(rb, timespec_to_nsec(&ts), data, len);
 }
 
 static void
@@ -186,26 +285,93 @@ weston_log_flight_recorder_map_memory(struct weston_debug_log_flight_recorder *f
 		flight_rec->rb.buf[i] = 0xff;
 }
 
+/* Skips to the next record holding data before end, copying its header
+ * to rec. Records the writer dropped meanwhile are skipped. */
+static bool
+weston_ring_buffer_next(struct weston_ring_buffer *rb, uint64_t *pos,
+			uint64_t end, struct weston_ring_record *rec)
+{
+	uint64_t tail_pos = __atomic_load_n(&rb->tail_pos, __ATOMIC_ACQUIRE);
+
+	if (*pos < tail_pos)
+		*pos = tail_pos;
+
+	while (*pos < end) {
+		size_t size = weston_ring_buffer_peek(rb, *pos, rec);
+
+		if (rec->len)
+			return true;
+		*pos += size;
+	}
+
+	return false;
+}
+
+/* Prints the records of all the ring buffers, oldest first, up to where
+ * each ring was when the dump started. Writers are not stopped, so a
+ * record they overwrite while it is printed may come out garbled, but
+ * never longer than it was. */
 static void
-weston_log_subscriber_display_flight_rec_data(struct weston_ring_buffer *rb,
+weston_log_subscriber_display_flight_rec_data(struct weston_debug_log_flight_recorder *flight_rec,
 					      FILE *file)
 {
+	struct weston_ring_buffer *rb, *oldest_rb = NULL;
+	struct weston_ring_record rec, oldest;
+	uint64_t *oldest_pos;
+	uint64_t *pos, *end;
+	int count = 0;
+	int i;
 	FILE *file_d = stderr;
 	if (file)
 		file_d = file;
 
-	if (!rb->overlap) {
-		if (rb->append_pos)
-			fwrite(rb->buf, sizeof(char), rb->append_pos, file_d);
-		else
-			fwrite(rb->buf, sizeof(char), rb->size, file_d);
-	} else {
-		/* from append_pos to size */
-		fwrite(&rb->buf[rb->append_pos], sizeof(char),
-		       rb->size - rb->append_pos, file_d);
-		/* from 0 to append_pos */
-		fwrite(rb->buf, sizeof(char), rb->append_pos, file_d);
+	pthread_mutex_lock(&flight_rec->lock);
+
+	wl_list_for_each(rb, &flight_rec->rings, link)
+		count++;
+
+	pos = calloc(count, sizeof *pos);
+	end = calloc(count, sizeof *end);
+	if (!pos || !end) {
+		pthread_mutex_unlock(&flight_rec->lock);
+		free(pos);
+		free(end);
+		return;
+	}
+
+	i = 0;
+	wl_list_for_each(rb, &flight_rec->rings, link) {
+		end[i] = __atomic_load_n(&rb->append_pos, __ATOMIC_ACQUIRE);
+		pos[i] = __atomic_load_n(&rb->tail_pos, __ATOMIC_ACQUIRE);
+		i++;
 	}
+
+	while (true) {
+		oldest_pos = NULL;
+		i = 0;
+		wl_list_for_each(rb, &flight_rec->rings, link) {
+			if (weston_ring_buffer_next(rb, &pos[i], end[i], &rec) &&
+			    (!oldest_pos || rec.timestamp < oldest.timestamp)) {
+				oldest = rec;
+				oldest_rb = rb;
+				oldest_pos = &pos[i];
+			}
+			i++;
+		}
+
+		if (!oldest_pos)
+			break;
+
+		/* only the checked copy of len, the header may change */
+		fwrite(&oldest_rb->buf[*oldest_pos % oldest_rb->size +
+				       sizeof oldest],
+		       sizeof(char), oldest.len, file_d);
+		*oldest_pos += weston_ring_record_size(oldest.len);
+	}
+
+	pthread_mutex_unlock(&flight_rec->lock);
+	free(pos);
+	free(end);
 }
 
 WL_EXPORT void
@@ -213,15 +379,16 @@ weston_log_subscriber_display_flight_rec(struct weston_log_subscriber *sub)
 {
 	struct weston_debug_log_flight_recorder *flight_rec =
 		to_flight_recorder(sub);
-	struct weston_ring_buffer *rb = &flight_rec->rb;
 
-	weston_log_subscriber_display_flight_rec_data(rb, rb->file);
+	weston_log_subscriber_display_flight_rec_data(flight_rec,
+						      flight_rec->rb.file);
 }
 
 static void
 weston_log_subscriber_destroy_flight_rec(struct weston_log_subscriber *sub)
 {
 	struct weston_debug_log_flight_recorder *flight_rec = to_flight_recorder(sub);
+	struct weston_ring_buffer *rb, *tmp;
 
 	/* Resets weston_primary_flight_recorder_ring_buffer to NULL if it
 	 * is the destroyed subscriber */
@@ -229,6 +396,16 @@ weston_log_subscriber_destroy_flight_rec(struct weston_log_subscriber *sub)
 		weston_primary_flight_recorder_ring_buffer = NULL;
 
 	weston_log_subscriber_release(sub);
+
+	pthread_key_delete(flight_rec->key);
+	wl_list_for_each_safe(rb, tmp, &flight_rec->rings, link) {
+		if (rb == &flight_rec->rb)
+			continue;
+		free(rb->buf);
+		free(rb);
+	}
+	pthread_mutex_destroy(&flight_rec->lock);
+
 	free(flight_rec->rb.buf);
 	free(flight_rec);
 }
@@ -238,8 +415,11 @@ weston_log_subscriber_destroy_flight_rec(struct weston_log_subscriber *sub)
  * Allocates both the flight recorder and the underlying ring buffer. Use
  * weston_log_subscriber_destroy() to clean-up.
  *
+ * Other threads writing to it get a ring buffer of the same size on their
+ * first write.
+ *
  * @param size specify the maximum size (in bytes) of the backing storage
- * for the flight recorder
+ * for the flight recorder, per thread
  * @returns a weston_log_subscriber object or NULL in case of failure
  */
 WL_EXPORT struct weston_log_subscriber *
@@ -267,7 +447,20 @@ weston_log_subscriber_create_flight_rec(size_t size)
 		return NULL;
 	}
 
+	if (pthread_key_create(&flight_rec->key, weston_ring_buffer_retire) != 0) {
+		free(weston_rb);
+		free(flight_rec);
+		return NULL;
+	}
+
+	pthread_mutex_init(&flight_rec->lock, NULL);
+	wl_list_init(&flight_rec->rings);
+	flight_rec->size = size;
+
 	weston_ring_buffer_init(&flight_rec->rb, size, weston_rb);
+	flight_rec->rb.flight_rec = flight_rec;
+	wl_list_insert(&flight_rec->rings, &flight_rec->rb.link);
+	pthread_setspecific(flight_rec->key, &flight_rec->rb);
 	weston_primary_flight_recorder_ring_buffer = &flight_rec->rb;
 
 	/* write some data to the rb such that the memory gets mapped */
@@ -282,7 +475,8 @@ weston_log_subscriber_create_flight_rec(size_t size)
  * @param file a FILE type already opened. Can also pass stderr/stdout under gdb
  * if the program is loaded into memory.
  *
- * Uses the global exposed weston_primary_flight_recorder_ring_buffer.
+ * Uses the global exposed weston_primary_flight_recorder_ring_buffer, and
+ * prints the records of all threads merged by time.
  *
  */
 WL_EXPORT void
@@ -291,6 +485,6 @@ weston_log_flight_recorder_display_buffer(FILE *file)
 	if (!weston_primary_flight_recorder_ring_buffer)
 		return;
 
-	weston_log_subscriber_display_flight_rec_data(weston_primary_flight_recorder_ring_buffer,
+	weston_log_subscriber_display_flight_rec_data(weston_primary_flight_recorder_ring_buffer->flight_rec,
 						      file);
 }
@@ -78,6 +78,10 @@ weston_log_subscription_add(struct weston_log_scope *scope,
 void
 weston_log_subscription_remove(struct weston_log_subscription *sub);
 
+void
+weston_log_subscription_write(struct weston_log_subscription *sub,
+			      const char *data, size_t len);
+
 void
 weston_log_subscriber_release(struct weston_log_subscriber *subscriber);
 
@@ -114,4 +118,8 @@ void
 weston_timeline_destroy_subscription(struct weston_log_subscription *sub,
 				     void *user_data);
 
+void
+weston_timeline_binary_create_subscription(struct weston_log_subscription *sub,
+					   void *user_data);
+
 #endif /* WESTON_LOG_INTERNAL_H */
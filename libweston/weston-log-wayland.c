@@ -33,12 +33,20 @@
 #include "weston-debug-server-protocol.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/time.h>
 
+/* Data a debug stream holds while the client is not reading fast enough.
+ * Messages that don't fit are dropped whole, so the compositor never
+ * blocks on a client and the stream never has partial messages. */
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+
 /** A debug stream created by a client
  *
  * A client provides a file descriptor for the server to write debug messages
@@ -49,11 +57,24 @@
  * The following is specific to weston-debug protocol.
  * Subscription/unsubscription takes place in the stream_create(), respectively
  * in stream_destroy().
+ *
+ * Writes don't block. What the fd does not take right away is buffered up
+ * to STREAM_BUFFER_SIZE and written once the fd is writable again.
  */
 struct weston_log_debug_wayland {
 	struct weston_log_subscriber base;
 	int fd;				/**< client provided fd */
 	struct wl_resource *resource;	/**< weston_debug_stream_v1 object */
+
+	char *buffer;			/**< STREAM_BUFFER_SIZE bytes, or NULL */
+	size_t buffer_start;		/**< first byte not written yet */
+	size_t buffer_end;		/**< end of buffered data */
+	struct wl_event_source *writable_source;
+	bool complete_pending;		/**< complete once the buffer drains */
+
+	uint64_t dropped_messages;	/**< dropped for lack of buffer space */
+	uint64_t dropped_bytes;
+	uint64_t reported_drops;	/**< dropped_messages when last noted */
 };
 
 static struct weston_log_debug_wayland *
@@ -65,6 +86,15 @@ to_weston_log_debug_wayland(struct weston_log_subscriber *sub)
 static void
 stream_close_unlink(struct weston_log_debug_wayland *stream)
 {
+	if (stream->writable_source)
+		wl_event_source_remove(stream->writable_source);
+	stream->writable_source = NULL;
+
+	free(stream->buffer);
+	stream->buffer = NULL;
+	stream->buffer_start = 0;
+	stream->buffer_end = 0;
+
 	if (stream->fd != -1)
 		close(stream->fd);
 	stream->fd = -1;
@@ -93,6 +123,163 @@ stream_close_on_failure(struct weston_log_debug_wayland *stream,
 	}
 }
 
+/* Writes as much of data as the fd takes without blocking. Returns the
+ * number of bytes written, or -1 after closing the stream on failure. */
+static ssize_t
+stream_write_some(struct weston_log_debug_wayland *stream,
+		  const char *data, size_t len)
+{
+	size_t written = 0;
+	ssize_t ret;
+	int e;
+
+	while (written < len) {
+		ret = write(stream->fd, data + written, len - written);
+		e = errno;
+		if (ret < 0) {
+			if (e == EINTR)
+				continue;
+			if (e == EAGAIN || e == EWOULDBLOCK)
+				break;
+
+			stream_close_on_failure(stream,
+					"Error writing %zu bytes: %s (%d)",
+					len - written, strerror(e), e);
+			return -1;
+		}
+
+		written += ret;
+	}
+
+	return written;
+}
+
+/* Appends to the buffer, all of data or none of it. */
+static bool
+stream_buffer_append(struct weston_log_debug_wayland *stream,
+		     const char *data, size_t len)
+{
+	if (!stream->buffer) {
+		stream->buffer = malloc(STREAM_BUFFER_SIZE);
+		if (!stream->buffer)
+			return false;
+	}
+
+	if (stream->buffer_end + len > STREAM_BUFFER_SIZE) {
+		memmove(stream->buffer, stream->buffer + stream->buffer_start,
+			stream->buffer_end - stream->buffer_start);
+		stream->buffer_end -= stream->buffer_start;
+		stream->buffer_start = 0;
+	}
+
+	if (stream->buffer_end + len > STREAM_BUFFER_SIZE)
+		return false;
+
+	memcpy(stream->buffer + stream->buffer_end, data, len);
+	stream->buffer_end += len;
+
+	return true;
+}
+
+static int
+stream_handle_writable(int fd, uint32_t mask, void *data);
+
+static void
+stream_wait_writable(struct weston_log_debug_wayland *stream)
+{
+	struct wl_client *client;
+	struct wl_event_loop *loop;
+
+	if (stream->writable_source)
+		return;
+
+	client = wl_resource_get_client(stream->resource);
+	loop = wl_display_get_event_loop(wl_client_get_display(client));
+	stream->writable_source =
+		wl_event_loop_add_fd(loop, stream->fd, WL_EVENT_WRITABLE,
+				     stream_handle_writable, stream);
+	if (!stream->writable_source)
+		stream_close_on_failure(stream,
+					"Failed to wait for stream to drain");
+}
+
+/* Queues data behind what is buffered already, writing it right away
+ * when nothing is. */
+static void
+stream_queue(struct weston_log_debug_wayland *stream,
+	     const char *data, size_t len)
+{
+	ssize_t written = 0;
+
+	if (stream->buffer_start == stream->buffer_end) {
+		written = stream_write_some(stream, data, len);
+		if (written < 0 || (size_t)written == len)
+			return;
+	}
+
+	if (!stream_buffer_append(stream, data + written, len - written)) {
+		stream->dropped_messages++;
+		stream->dropped_bytes += len - written;
+		if (stream->buffer_start == stream->buffer_end)
+			return;
+	}
+
+	stream_wait_writable(stream);
+}
+
+/* Tells the client where messages went missing, once it catches up. */
+static void
+stream_note_drops(struct weston_log_debug_wayland *stream)
+{
+	char note[128];
+	int len;
+
+	if (stream->dropped_messages == stream->reported_drops)
+		return;
+
+	len = snprintf(note, sizeof note,
+		       "[weston-debug: stream fell behind, dropped %" PRIu64
+		       " messages, %" PRIu64 " bytes so far]\n",
+		       stream->dropped_messages, stream->dropped_bytes);
+	if (len <= 0 || (size_t)len >= sizeof note)
+		return;
+
+	stream->reported_drops = stream->dropped_messages;
+	stream_queue(stream, note, len);
+}
+
+static int
+stream_handle_writable(int fd, uint32_t mask, void *data)
+{
+	struct weston_log_debug_wayland *stream = data;
+	ssize_t written;
+
+	written = stream_write_some(stream,
+				    stream->buffer + stream->buffer_start,
+				    stream->buffer_end - stream->buffer_start);
+	if (written < 0)
+		return 0;
+
+	stream->buffer_start += written;
+	if (stream->buffer_start < stream->buffer_end)
+		return 0;
+
+	stream->buffer_start = 0;
+	stream->buffer_end = 0;
+	wl_event_source_remove(stream->writable_source);
+	stream->writable_source = NULL;
+
+	if (stream->complete_pending) {
+		stream_close_unlink(stream);
+		weston_debug_stream_v1_send_complete(stream->resource);
+		return 0;
+	}
+
+	stream_note_drops(stream);
+
+	return 0;
+}
+
 /** Write data into a specific debug stream
  *
  * \param sub The subscriber's stream to write into; must not be NULL.
@@ -100,11 +287,12 @@ stream_close_on_failure(struct weston_log_debug_wayland *stream,
  * \param len Number of bytes to write.
  *
  * Writes the given data (binary verbatim) into the debug stream.
- * If \c len is zero or negative, the write is silently dropped.
+ * If \c len is zero, the write is silently dropped.
  *
- * Writing is continued until all data has been written or
- * a write fails. If the write fails due to a signal, it is re-tried.
- * Otherwise on failure, the stream is closed and
+ * The write never blocks. Data the client is not ready for is buffered,
+ * and when the buffer is full the data is dropped and counted instead.
+ * The client finds a note on the drops in the stream once it catches up.
+ * If the write fails otherwise, the stream is closed and
  * \c weston_debug_stream_v1.failure event is sent to the client.
  *
  * \memberof weston_log_debug_wayland
@@ -113,30 +301,12 @@ static void
 weston_log_debug_wayland_write(struct weston_log_subscriber *sub,
 			       const char *data, size_t len)
 {
-	ssize_t len_ = len;
-	ssize_t ret;
-	int e;
 	struct weston_log_debug_wayland *stream = to_weston_log_debug_wayland(sub);
 
-	if (stream->fd == -1)
+	if (stream->fd == -1 || stream->complete_pending || len == 0)
 		return;
 
-	while (len_ > 0) {
-		ret = write(stream->fd, data, len_);
-		e = errno;
-		if (ret < 0) {
-			if (e == EINTR)
-				continue;
-
-			stream_close_on_failure(stream,
-					"Error writing %zd bytes: %s (%d)",
-					len_, strerror(e), e);
-			break;
-		}
-
-		len_ -= ret;
-		data += ret;
-	}
+	stream_queue(stream, data, len);
 }
 
 /** Close the debug stream and send success event
@@ -145,7 +315,7 @@ weston_log_debug_wayland_write(struct weston_log_subscriber *sub,
  *
  * Closes the debug stream and sends \c weston_debug_stream_v1.complete
  * event to the client. This tells the client the debug information dump
- * is complete.
+ * is complete. With data still buffered, that happens once it is written.
  *
  * \memberof weston_log_debug_wayland
  */
@@ -154,6 +324,11 @@ weston_log_debug_wayland_complete(struct weston_log_subscriber *sub)
 {
 	struct weston_log_debug_wayland *stream = to_weston_log_debug_wayland(sub);
 
+	if (stream->writable_source) {
+		stream->complete_pending = true;
+		return;
+	}
+
 	stream_close_unlink(stream);
 	weston_debug_stream_v1_send_complete(stream->resource);
 }
@@ -181,6 +356,9 @@ stream_create(struct weston_log_context *log_ctx, const char *name,
 	stream->fd = streamfd;
 	stream->resource = stream_resource;
 
+	/* Writes must not stall the compositor on a slow client. */
+	fcntl(streamfd, F_SETFL, fcntl(streamfd, F_GETFL) | O_NONBLOCK);
+
 	stream->base.write = weston_log_debug_wayland_write;
 	stream->base.destroy = NULL;
 	stream->base.destroy_subscription = weston_log_debug_wayland_to_destroy;
@@ -36,6 +36,21 @@
 #include "text-cursor-position-server-protocol.h"
 #include "shared/helpers.h"
 
+/* Repaint the output for a changed zoom, which with an offscreen scene
+ * only needs the scene resampled. */
+static void
+weston_zoom_damage(struct weston_output *output)
+{
+	output->dirty = 1;
+
+	if (output->zoom.offscreen) {
+		output->zoom.resample = true;
+		weston_output_schedule_repaint(output);
+	} else {
+		weston_output_damage(output);
+	}
+}
+
 static void
 weston_zoom_frame_z(struct weston_animation *animation,
 		    struct weston_output *output,
@@ -63,8 +78,7 @@ weston_zoom_frame_z(struct weston_animation *animation,
 		wl_list_init(&animation->link);
 	}
 
-	output->dirty = 1;
-	weston_output_damage(output);
+	weston_zoom_damage(output);
 }
 
 static void
@@ -105,7 +119,7 @@ weston_output_update_zoom_transform(struct weston_output *output)
 		output->zoom.trans_y = level * output->height;
 }
 
-static void
+static bool
 weston_zoom_transition(struct weston_output *output)
 {
 	if (output->zoom.level != output->zoom.spring_z.current) {
@@ -115,10 +129,10 @@ weston_zoom_transition(struct weston_output *output)
 			wl_list_insert(output->animation_list.prev,
 				&output->zoom.animation_z.link);
 		}
+		return true;
 	}
 
-	output->dirty = 1;
-	weston_output_damage(output);
+	return false;
 }
 
 WL_EXPORT void
@@ -126,6 +140,9 @@ weston_output_update_zoom(struct weston_output *output)
 {
 	struct weston_seat *seat = output->zoom.seat;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
+	float trans_x = output->zoom.trans_x;
+	float trans_y = output->zoom.trans_y;
+	bool changed;
 
 	if (!pointer)
 		return;
@@ -135,8 +152,67 @@ weston_output_update_zoom(struct weston_output *output)
 	output->zoom.current.x = wl_fixed_to_double(pointer->x);
 	output->zoom.current.y = wl_fixed_to_double(pointer->y);
 
-	weston_zoom_transition(output);
+	changed = weston_zoom_transition(output);
 	weston_output_update_zoom_transform(output);
+
+	/* This also runs from weston_output_update_matrix() each repaint,
+	 * so an offscreen scene is only resampled when the zoom moved. */
+	if (output->zoom.offscreen && !changed &&
+	    trans_x == output->zoom.trans_x &&
+	    trans_y == output->zoom.trans_y)
+		return;
+
+	weston_zoom_damage(output);
+}
+
+/* Grow each rectangle by the pixel a bilinear sample reaches past it. */
+static void
+zoom_region_grow(pixman_region32_t *region)
+{
+	pixman_region32_t src;
+	pixman_box32_t *rects;
+	int nrects, i;
+
+	pixman_region32_init(&src);
+	pixman_region32_copy(&src, region);
+	rects = pixman_region32_rectangles(&src, &nrects);
+	for (i = 0; i < nrects; i++)
+		pixman_region32_union_rect(region, region,
+					   rects[i].x1 - 1, rects[i].y1 - 1,
+					   rects[i].x2 - rects[i].x1 + 2,
+					   rects[i].y2 - rects[i].y1 + 2);
+	pixman_region32_fini(&src);
+}
+
+/** Split the damage of a repaint for an offscreen zoomed scene
+ *
+ * \param output The output being repainted.
+ * \param damage The frame damage in global coordinates.
+ *
+ * Keeps \c damage as the scene damage in zoom.scene_damage and turns
+ * \c damage into what changes on the output, in global coordinates as if
+ * unzoomed: the whole output when the zoom moved, otherwise the scene
+ * damage as seen through the zoom.
+ */
+void
+weston_output_zoom_frame_damage(struct weston_output *output,
+				pixman_region32_t *damage)
+{
+	struct weston_output_zoom *zoom = &output->zoom;
+	struct weston_matrix matrix;
+
+	pixman_region32_copy(&zoom->scene_damage, damage);
+
+	if (zoom->resample) {
+		zoom->resample = false;
+		pixman_region32_copy(damage, &output->region);
+	} else if (zoom->active && pixman_region32_not_empty(damage)) {
+		matrix = output->matrix;
+		weston_matrix_multiply(&matrix, &zoom->scene_inverse);
+		zoom_region_grow(damage);
+		weston_matrix_transform_region(damage, &matrix, damage);
+		pixman_region32_intersect(damage, damage, &output->region);
+	}
 }
 
 static void
@@ -181,4 +257,15 @@ weston_output_init_zoom(struct weston_output *output)
 	output->zoom.animation_z.frame = weston_zoom_frame_z;
 	wl_list_init(&output->zoom.animation_z.link);
 	output->zoom.motion_listener.notify = motion;
+	output->zoom.offscreen = false;
+	output->zoom.resample = false;
+	pixman_region32_init(&output->zoom.scene_damage);
+	weston_matrix_init(&output->zoom.scene_matrix);
+	weston_matrix_init(&output->zoom.scene_inverse);
+}
+
+void
+weston_output_release_zoom(struct weston_output *output)
+{
+	pixman_region32_fini(&output->zoom.scene_damage);
 }
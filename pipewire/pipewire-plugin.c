@@ -26,13 +26,17 @@
 #include "pipewire-plugin.h"
 #include "backend.h"
 #include "libweston-internal.h"
+#include "shared/helpers.h"
 #include "shared/timespec-util.h"
 #include <libweston/backend-drm.h>
 #include <libweston/weston-log.h>
 
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
+#include <linux/dma-buf.h>
 
 #include <spa/param/format-utils.h>
 #include <spa/param/video/format-utils.h>
@@ -42,11 +46,21 @@
 
 #define PROP_RANGE(min, max) 2, (min), (max)
 
+/* More than the virtual output has buffers in flight. */
+#define PIPEWIRE_MAPPING_CACHE_SIZE 4
+
+/* Damage of each frame, as the video damage meta of later PipeWire: an
+ * array of rectangles, ended by one of zero size unless full. More
+ * rectangles than fit are sent as their bounding box. */
+#define PIPEWIRE_TYPE_META__VideoDamage SPA_TYPE_META_BASE "VideoDamage"
+#define PIPEWIRE_DAMAGE_RECTS 16
+
 struct type {
 	struct spa_type_media_type media_type;
 	struct spa_type_media_subtype media_subtype;
 	struct spa_type_format_video format_video;
 	struct spa_type_video_format video_format;
+	uint32_t meta_video_damage;
 };
 
 struct weston_pipewire {
@@ -68,6 +82,13 @@ struct weston_pipewire {
 	struct spa_hook remote_listener;
 };
 
+struct pipewire_mapping {
+	ino_t ino;		/* of the dmabuf */
+	void *ptr;		/* NULL if unused */
+	size_t size;
+	uint32_t last_used;
+};
+
 struct pipewire_output {
 	struct weston_output *output;
 	void (*saved_destroy)(struct weston_output *output);
@@ -84,6 +105,15 @@ struct pipewire_output {
 	struct spa_hook stream_listener;
 
 	struct spa_video_info_raw video_format;
+	int32_t stride;		/* of the stream buffers */
+
+	struct pipewire_mapping mappings[PIPEWIRE_MAPPING_CACHE_SIZE];
+	uint32_t mapping_seq;
+
+	/* repaint damage since the last pushed frame, in buffer
+	 * coordinates */
+	pixman_region32_t damage;
+	struct wl_listener frame_listener;
 
 	struct wl_event_source *finish_frame_timer;
 	struct wl_list link;
@@ -106,6 +136,8 @@ static inline void init_type(struct type *type, struct spa_type_map *map)
 	spa_type_media_subtype_map(map, &type->media_subtype);
 	spa_type_format_video_map(map, &type->format_video);
 	spa_type_video_format_map(map, &type->video_format);
+	type->meta_video_damage =
+		spa_type_map_get_id(map, PIPEWIRE_TYPE_META__VideoDamage);
 }
 
 static void
@@ -178,23 +210,172 @@ lookup_pipewire_output(struct weston_output *base_output)
 	return NULL;
 }
 
+/* The virtual output renders into a few GBM buffers in turn, and hands us
+ * a new dmabuf fd for one of them every frame. Mapping a frame afresh costs
+ * a page fault per page, about as much as copying it, so the buffers stay
+ * mapped. They are found again by the inode of the dmabuf, which cannot be
+ * reused while our mapping holds a reference to it. */
+static void *
+pipewire_output_map_frame(struct pipewire_output *output, int fd, size_t size)
+{
+	struct pipewire_mapping *m, *victim = NULL;
+	struct stat st;
+	int i;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	for (i = 0; i < PIPEWIRE_MAPPING_CACHE_SIZE; i++) {
+		m = &output->mappings[i];
+		if (m->ptr && m->ino == st.st_ino && m->size == size) {
+			m->last_used = ++output->mapping_seq;
+			return m->ptr;
+		}
+	}
+
+	for (i = 0; i < PIPEWIRE_MAPPING_CACHE_SIZE; i++) {
+		m = &output->mappings[i];
+		if (!m->ptr) {
+			victim = m;
+			break;
+		}
+		if (!victim || m->last_used < victim->last_used)
+			victim = m;
+	}
+
+	if (victim->ptr)
+		munmap(victim->ptr, victim->size);
+
+	victim->ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (victim->ptr == MAP_FAILED) {
+		victim->ptr = NULL;
+		return NULL;
+	}
+	victim->ino = st.st_ino;
+	victim->size = size;
+	victim->last_used = ++output->mapping_seq;
+
+	pipewire_output_debug(output, "mapped frame buffer %lu",
+			      (unsigned long) st.st_ino);
+
+	return victim->ptr;
+}
+
+static void
+pipewire_output_unmap_frames(struct pipewire_output *output)
+{
+	int i;
+
+	for (i = 0; i < PIPEWIRE_MAPPING_CACHE_SIZE; i++) {
+		struct pipewire_mapping *m = &output->mappings[i];
+
+		if (m->ptr)
+			munmap(m->ptr, m->size);
+		m->ptr = NULL;
+	}
+}
+
+static void
+pipewire_dmabuf_sync(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags };
+
+	while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 && errno == EINTR)
+		;
+}
+
+static void
+pipewire_output_damage_all(struct pipewire_output *output)
+{
+	pixman_region32_fini(&output->damage);
+	pixman_region32_init_rect(&output->damage, 0, 0,
+				  output->output->current_mode->width,
+				  output->output->current_mode->height);
+}
+
+static void
+pipewire_output_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct pipewire_output *output =
+		container_of(listener, struct pipewire_output, frame_listener);
+	struct weston_output *base = output->output;
+	pixman_region32_t damage, transformed_damage;
+
+	pixman_region32_init(&damage);
+	pixman_region32_init(&transformed_damage);
+	pixman_region32_intersect(&damage, &base->region, data);
+	pixman_region32_translate(&damage, -base->x, -base->y);
+	weston_transformed_region(base->width, base->height,
+				  base->transform, base->current_scale,
+				  &damage, &transformed_damage);
+	pixman_region32_union(&output->damage, &output->damage,
+			      &transformed_damage);
+	pixman_region32_fini(&transformed_damage);
+	pixman_region32_fini(&damage);
+}
+
+static void
+pipewire_output_add_damage_meta(struct pipewire_output *output,
+				struct spa_buffer *spa_buffer)
+{
+	uint32_t type = output->pipewire->type.meta_video_damage;
+	struct spa_meta_video_crop *rects = NULL;
+	pixman_box32_t *boxes, extents;
+	unsigned int i, max = 0;
+	int n;
+
+	for (i = 0; i < spa_buffer->n_metas; i++) {
+		if (spa_buffer->metas[i].type == type) {
+			rects = spa_buffer->metas[i].data;
+			max = spa_buffer->metas[i].size / sizeof(*rects);
+			break;
+		}
+	}
+	if (!rects || max == 0)
+		return;
+
+	boxes = pixman_region32_rectangles(&output->damage, &n);
+	if ((unsigned int) n > max) {
+		extents = *pixman_region32_extents(&output->damage);
+		boxes = &extents;
+		n = 1;
+	}
+
+	for (i = 0; i < (unsigned int) n; i++) {
+		rects[i].x = boxes[i].x1;
+		rects[i].y = boxes[i].y1;
+		rects[i].width = boxes[i].x2 - boxes[i].x1;
+		rects[i].height = boxes[i].y2 - boxes[i].y1;
+	}
+	if (i < max)
+		rects[i] = (struct spa_meta_video_crop) { 0, 0, 0, 0 };
+}
+
 static void
 pipewire_output_handle_frame(struct pipewire_output *output, int fd,
 			     int stride, struct drm_fb *drm_buffer)
 {
 	const struct weston_drm_virtual_output_api *api =
 		output->pipewire->virtual_output_api;
-	size_t size = output->output->height * stride;
+	int32_t height = output->output->height;
+	size_t size = height * stride;
 	struct pw_type *t = output->pipewire->t;
 	struct pw_buffer *buffer;
 	struct spa_buffer *spa_buffer;
 	struct spa_meta_header *h;
-	void *ptr;
+	uint8_t *src, *dst;
+	int32_t y;
 
 	if (pw_stream_get_state(output->stream, NULL) !=
 	    PW_STREAM_STATE_STREAMING)
 		goto out;
 
+	src = pipewire_output_map_frame(output, fd, size);
+	if (!src) {
+		weston_log("Failed to map a frame for pipewire\n");
+		goto out;
+	}
+
 	buffer = pw_stream_dequeue_buffer(output->stream);
 	if (!buffer) {
 		weston_log("Failed to dequeue a pipewire buffer\n");
@@ -209,17 +390,28 @@ pipewire_output_handle_frame(struct pipewire_output *output, int fd,
 		h->seq = output->seq++;
 		h->dts_offset = 0;
 	}
-
-	ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
-	memcpy(spa_buffer->datas[0].data, ptr, size);
-	munmap(ptr, size);
+	pipewire_output_add_damage_meta(output, spa_buffer);
+
+	/* The GBM buffer may be padded differently than the stream
+	 * buffers; copy row by row then. */
+	dst = spa_buffer->datas[0].data;
+	pipewire_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	if (stride == output->stride) {
+		memcpy(dst, src, size);
+	} else {
+		for (y = 0; y < height; y++)
+			memcpy(dst + y * output->stride, src + y * stride,
+			       MIN(stride, output->stride));
+	}
+	pipewire_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
 
 	spa_buffer->datas[0].chunk->offset = 0;
-	spa_buffer->datas[0].chunk->stride = stride;
-	spa_buffer->datas[0].chunk->size = spa_buffer->datas[0].maxsize;
+	spa_buffer->datas[0].chunk->stride = output->stride;
+	spa_buffer->datas[0].chunk->size = height * output->stride;
 
 	pipewire_output_debug(output, "push frame");
 	pw_stream_queue_buffer(output->stream, buffer);
+	pixman_region32_clear(&output->damage);
 
 out:
 	close(fd);
@@ -340,6 +532,8 @@ pipewire_output_destroy(struct weston_output *base_output)
 	output->saved_destroy(base_output);
 
 	pw_stream_destroy(output->stream);
+	pipewire_output_unmap_frames(output);
+	pixman_region32_fini(&output->damage);
 
 	wl_list_remove(&output->link);
 	weston_head_release(output->head);
@@ -439,6 +633,10 @@ pipewire_output_enable(struct weston_output *base_output)
 	base_output->start_repaint_loop = pipewire_output_start_repaint_loop;
 	base_output->set_dpms = pipewire_set_dpms;
 
+	output->frame_listener.notify = pipewire_output_frame_notify;
+	wl_signal_add(&base_output->frame_signal, &output->frame_listener);
+	pipewire_output_damage_all(output);
+
 	loop = wl_display_get_event_loop(c->wl_display);
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop,
@@ -455,8 +653,10 @@ pipewire_output_disable(struct weston_output *base_output)
 	struct pipewire_output *output = lookup_pipewire_output(base_output);
 
 	wl_event_source_remove(output->finish_frame_timer);
+	wl_list_remove(&output->frame_listener.link);
 
 	pw_stream_disconnect(output->stream);
+	pipewire_output_unmap_frames(output);
 
 	return output->saved_disable(base_output);
 }
@@ -489,7 +689,7 @@ pipewire_output_stream_format_changed(void *data, const struct spa_pod *format)
 	uint8_t buffer[1024];
 	struct spa_pod_builder builder =
 		SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-	const struct spa_pod *params[2];
+	const struct spa_pod *params[3];
 	struct pw_type *t = pipewire->t;
 	int32_t width, height, stride, size;
 	const int bpp = 4;
@@ -507,6 +707,7 @@ pipewire_output_stream_format_changed(void *data, const struct spa_pod *format)
 	height = output->video_format.size.height;
 	stride = SPA_ROUND_UP_N(width * bpp, 4);
 	size = height * stride;
+	output->stride = stride;
 
 	pipewire_output_debug(output, "format = %dx%d", width, height);
 
@@ -526,7 +727,16 @@ pipewire_output_stream_format_changed(void *data, const struct spa_pod *format)
 		":", t->param_meta.type, "I", t->meta.Header,
 		":", t->param_meta.size, "i", sizeof(struct spa_meta_header));
 
-	pw_stream_finish_format(output->stream, 0, params, 2);
+	params[2] = spa_pod_builder_object(&builder,
+		t->param.idMeta, t->param_meta.Meta,
+		":", t->param_meta.type, "I", pipewire->type.meta_video_damage,
+		":", t->param_meta.size,
+		"i", sizeof(struct spa_meta_video_crop) * PIPEWIRE_DAMAGE_RECTS);
+
+	/* new buffers hold nothing yet */
+	pipewire_output_damage_all(output);
+
+	pw_stream_finish_format(output->stream, 0, params, 3);
 }
 
 static const struct pw_stream_events stream_events = {
@@ -582,6 +792,7 @@ pipewire_output_create(struct weston_compositor *c, char *name)
 	output->saved_disable = output->output->disable;
 	output->output->disable = pipewire_output_disable;
 	output->pipewire = pipewire;
+	pixman_region32_init(&output->damage);
 	wl_list_insert(pipewire->output_list.prev, &output->link);
 
 	weston_head_init(head, connector_name);
@@ -41,6 +41,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <assert.h>
+#include <time.h>
 
 #include <libweston/libweston.h>
 #include <libweston/config-parser.h>
@@ -72,6 +73,21 @@
 #define EVENT_TIMEOUT_MS 2000 // 2 seconds
 #define MAX_ICON_RETRY_COUNT 5
 
+/* bump when layout of app list index file is changed */
+#define APP_LIST_INDEX_VERSION 1
+#define APP_LIST_INDEX_GROUP "AppListIndex"
+
+/* desktop file changes are gathered until no change is seen for
+   APP_LIST_UPDATE_DELAY_MS, but not held longer than APP_LIST_UPDATE_MAX_DELAY_MS. */
+#define APP_LIST_UPDATE_DELAY_MS 500
+#define APP_LIST_UPDATE_MAX_DELAY_MS 5000
+
+/* blended icons kept per entry, one each for app list and taskbar overlay */
+#define MAX_BLENDED_ICON 2
+
+/* Windows image paths kept by Linux image path, all dropped once full */
+#define MAX_IMAGE_NAME_CACHE 256
+
 struct app_list_context {
 	wHashTable* table;
 	HANDLE thread;
@@ -92,6 +108,7 @@ struct app_list_context {
 	struct {
 		pixman_image_t* image; // use as reply message at load_icon_file.
 		const char *key;       // use as send message at load_icon_file.
+		pixman_image_t* overlay_image; // use as send message at load_icon_file.
 	} load_icon;
 	struct {
 		pid_t pid;
@@ -99,6 +116,11 @@ struct app_list_context {
 		char *image_name;
 		size_t image_name_size;
 	} find_image_name;
+	struct {
+		GHashTable *table;   // Linux image path to Windows image path.
+		uint32_t hit_count;
+		uint32_t miss_count;
+	} image_name_cache;
 	struct {
 		pid_t pid;
 		char *app_id;
@@ -108,6 +130,26 @@ struct app_list_context {
 		char requestedClientLanguageId[32]; // 32 = RDPAPPLIST_LANG_SIZE.
 		char currentClientLanguageId[32];
 	} lang_info;
+	struct {
+		char *path;          // WESTON_RDPRAIL_SHELL_APP_LIST_INDEX, NULL if disabled.
+		GKeyFile *key_file;  // entries looked up and updated on changes.
+		GKeyFile *next;      // entries collected by full scan.
+		uint32_t hit_count;
+		uint32_t miss_count;
+	} index;
+	char *icon_cache_dir; // WESTON_RDPRAIL_SHELL_ICON_CACHE_DIR, NULL if disabled.
+	struct {
+		GHashTable *table;   // "folder index/file name" to struct app_list_pending_change.
+		uint32_t event_count;
+		uint64_t first_event_ms;
+		uint64_t last_event_ms;
+	} pending_change;
+};
+
+struct app_list_pending_change {
+	int folder_index;
+	bool removed;
+	char file[];
 };
 
 struct app_entry {
@@ -121,7 +163,14 @@ struct app_entry {
 	char *icon_file;
 	bool is_icon_file_svg;
 	pixman_image_t* icon_image;
+	struct {
+		pixman_image_t* overlay_image;
+		pixman_image_t* image;
+	} blended_icon[MAX_BLENDED_ICON];
 	uint32_t icon_retry_count;
+	struct timespec mtime;
+	off_t size;
+	char lang_id[32];
 };
 
 /* list of folders to look for icon in specific orders */
@@ -338,12 +387,277 @@ free_app_entry(void *arg)
 		if (e->icon_name) free(e->icon_name);
 		if (e->icon_file) free(e->icon_file);
 		if (e->icon_image) pixman_image_unref(e->icon_image);
+		for (int i = 0; i < MAX_BLENDED_ICON; i++) {
+			if (e->blended_icon[i].image)
+				pixman_image_unref(e->blended_icon[i].image);
+		}
 		if (e->icon_retry_count) context->icon_retry_count--;
 
 		free(e);
 	}
 }
 
+static bool
+app_list_index_usable(struct app_list_context *context, const char *file)
+{
+	/* group names can't contain '[' or ']' */
+	return context->index.key_file && !strpbrk(file, "[]");
+}
+
+static void
+app_list_index_load(struct desktop_shell *shell)
+{
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+	GError *err = NULL;
+
+	if (!context->index.path)
+		return;
+
+	context->index.key_file = g_key_file_new();
+	if (!context->index.key_file)
+		return;
+
+	if (!g_key_file_load_from_file(context->index.key_file, context->index.path,
+				       G_KEY_FILE_NONE, &err)) {
+		shell_rdp_debug(shell, "app list index: %s is not loaded: %s\n",
+			context->index.path, err && err->message ? err->message : "");
+		g_error_free(err);
+	} else if (g_key_file_get_integer(context->index.key_file,
+					  APP_LIST_INDEX_GROUP, "Version", NULL) != APP_LIST_INDEX_VERSION) {
+		shell_rdp_debug(shell, "app list index: %s is outdated, discarded\n",
+			context->index.path);
+		g_key_file_free(context->index.key_file);
+		context->index.key_file = g_key_file_new();
+	}
+}
+
+static void
+app_list_index_save(struct desktop_shell *shell)
+{
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+	GError *err = NULL;
+
+	if (!context->index.key_file || !context->index.path)
+		return;
+
+	/* index is kept in weston's namespace, not in app list's one. */
+	assert(false == context->isAppListNamespaceAttached);
+
+	g_key_file_set_integer(context->index.key_file,
+			       APP_LIST_INDEX_GROUP, "Version", APP_LIST_INDEX_VERSION);
+	if (!g_key_file_save_to_file(context->index.key_file, context->index.path, &err)) {
+		shell_rdp_debug_error(shell, "app list index: failed to save %s: %s\n",
+			context->index.path, err && err->message ? err->message : "");
+		g_error_free(err);
+	}
+}
+
+/* returns true when the index holds a record for the current version of
+   entry->file, and then *is_app tells whether it was an app entry to list. */
+static bool
+app_list_index_lookup(struct desktop_shell *shell, struct app_entry *entry, bool *is_app)
+{
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+	GKeyFile *key_file = context->index.key_file;
+	const char *file = entry->file;
+	char *lang_id;
+	bool match;
+
+	if (!app_list_index_usable(context, file) ||
+	    !g_key_file_has_group(key_file, file))
+		return false;
+
+	lang_id = g_key_file_get_string(key_file, file, "Lang", NULL);
+	match = lang_id && strcmp(lang_id, entry->lang_id) == 0 &&
+		g_key_file_get_int64(key_file, file, "MTime", NULL) == (gint64)entry->mtime.tv_sec &&
+		g_key_file_get_int64(key_file, file, "MTimeNsec", NULL) == (gint64)entry->mtime.tv_nsec &&
+		g_key_file_get_int64(key_file, file, "Size", NULL) == (gint64)entry->size;
+	free(lang_id);
+	if (!match)
+		return false;
+
+	*is_app = g_key_file_get_boolean(key_file, file, "IsApp", NULL);
+	if (*is_app) {
+		entry->name = g_key_file_get_string(key_file, file, "Name", NULL);
+		entry->exec = g_key_file_get_string(key_file, file, "Exec", NULL);
+		if (!entry->name || !entry->exec) {
+			free(entry->name);
+			entry->name = NULL;
+			free(entry->exec);
+			entry->exec = NULL;
+			return false;
+		}
+		entry->try_exec = g_key_file_get_string(key_file, file, "TryExec", NULL);
+		entry->working_dir = g_key_file_get_string(key_file, file, "WorkingDir", NULL);
+		entry->icon_name = g_key_file_get_string(key_file, file, "IconName", NULL);
+		entry->icon_file = g_key_file_get_string(key_file, file, "IconFile", NULL);
+		if (entry->icon_file)
+			entry->is_icon_file_svg = g_key_file_get_boolean(key_file, file, "IconSVG", NULL);
+	}
+
+	context->index.hit_count++;
+	return true;
+}
+
+static void
+app_list_index_store(struct desktop_shell *shell, struct app_entry *entry, bool is_app)
+{
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+	GKeyFile *key_file = context->index.next ? context->index.next : context->index.key_file;
+	const char *file = entry->file;
+
+	if (!app_list_index_usable(context, file))
+		return;
+
+	g_key_file_remove_group(key_file, file, NULL);
+	g_key_file_set_string(key_file, file, "Lang", entry->lang_id);
+	g_key_file_set_int64(key_file, file, "MTime", entry->mtime.tv_sec);
+	g_key_file_set_int64(key_file, file, "MTimeNsec", entry->mtime.tv_nsec);
+	g_key_file_set_int64(key_file, file, "Size", entry->size);
+	g_key_file_set_boolean(key_file, file, "IsApp", is_app);
+	if (!is_app)
+		return;
+
+	g_key_file_set_string(key_file, file, "Name", entry->name);
+	g_key_file_set_string(key_file, file, "Exec", entry->exec);
+	if (entry->try_exec)
+		g_key_file_set_string(key_file, file, "TryExec", entry->try_exec);
+	if (entry->working_dir)
+		g_key_file_set_string(key_file, file, "WorkingDir", entry->working_dir);
+	if (entry->icon_name)
+		g_key_file_set_string(key_file, file, "IconName", entry->icon_name);
+	/* unresolved icon is not recorded, so it's searched again next time. */
+	if (entry->icon_file) {
+		g_key_file_set_string(key_file, file, "IconFile", entry->icon_file);
+		g_key_file_set_boolean(key_file, file, "IconSVG", entry->is_icon_file_svg);
+	}
+}
+
+static char *
+icon_cache_path(struct app_list_context *context, const char *file, struct stat *st)
+{
+	char *key_string;
+	char *checksum;
+	char *path;
+
+	key_string = g_strdup_printf("%s:%lld.%09ld:%lld", file,
+				     (long long)st->st_mtim.tv_sec,
+				     st->st_mtim.tv_nsec,
+				     (long long)st->st_size);
+	checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key_string, -1);
+	path = g_strdup_printf("%s/%s.png", context->icon_cache_dir, checksum);
+	g_free(checksum);
+	g_free(key_string);
+
+	return path;
+}
+
+static void
+app_entry_load_icon(struct desktop_shell *shell, struct app_entry *entry)
+{
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+	void *data = NULL;
+	uint32_t data_len = 0;
+	char *cache_path = NULL;
+	struct stat st;
+
+	attach_app_list_namespace(shell);
+	if (entry->icon_file || find_icon_file(entry)) {
+		if (!entry->is_icon_file_svg)
+			entry->icon_image = load_image(entry->icon_file);
+		else if (context->icon_cache_dir && stat(entry->icon_file, &st) == 0)
+			cache_path = icon_cache_path(context, entry->icon_file, &st);
+	}
+	detach_app_list_namespace(shell);
+
+	if (!entry->icon_file || !entry->is_icon_file_svg)
+		return;
+
+	/* svg rasterized earlier is read back from icon cache, which is
+	   kept in weston's namespace. */
+	if (cache_path && access(cache_path, R_OK) == 0) {
+		entry->icon_image = load_image(cache_path);
+		if (entry->icon_image) {
+			g_free(cache_path);
+			return;
+		}
+	}
+
+	attach_app_list_namespace(shell);
+	data = load_file_svg(shell, entry->icon_file, &data_len);
+	detach_app_list_namespace(shell);
+	if (data) {
+		entry->icon_image = load_image_svg(shell, data, data_len, entry->icon_file);
+		free(data);
+	}
+	if (entry->icon_image && cache_path)
+		save_image_png(shell, entry->icon_image, cache_path);
+	g_free(cache_path);
+}
+
+/* returns icon of entry with overlay blended, entry keeps reference. */
+static pixman_image_t *
+app_entry_get_blended_icon(struct app_entry *entry, pixman_image_t *overlay_image)
+{
+	pixman_image_t *image;
+	int width, height;
+	int i;
+
+	assert(entry->icon_image);
+	assert(overlay_image);
+
+	for (i = 0; i < MAX_BLENDED_ICON; i++) {
+		if (entry->blended_icon[i].overlay_image == overlay_image)
+			return entry->blended_icon[i].image;
+	}
+
+	/* blend onto copy, icon_image itself is kept as loaded. */
+	width = pixman_image_get_width(entry->icon_image);
+	height = pixman_image_get_height(entry->icon_image);
+	image = pixman_image_create_bits_no_clear(PIXMAN_a8r8g8b8,
+						  width, height, NULL, 0);
+	if (!image)
+		return NULL;
+	pixman_image_composite32(PIXMAN_OP_SRC,
+				 entry->icon_image, NULL, image,
+				 0, 0, 0, 0, 0, 0, width, height);
+	shell_blend_overlay_icon(entry->shell, image, overlay_image);
+
+	for (i = 0; i < MAX_BLENDED_ICON; i++) {
+		if (!entry->blended_icon[i].image)
+			break;
+	}
+	if (i == MAX_BLENDED_ICON) {
+		/* all slots are taken, replace oldest one */
+		i = 0;
+		pixman_image_unref(entry->blended_icon[i].image);
+	}
+	entry->blended_icon[i].overlay_image = overlay_image;
+	entry->blended_icon[i].image = image;
+
+	return image;
+}
+
+static bool
+is_same_string(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+static bool
+is_same_app_entry(struct app_entry *a, struct app_entry *b)
+{
+	return is_same_string(a->file, b->file) &&
+		is_same_string(a->name, b->name) &&
+		is_same_string(a->exec, b->exec) &&
+		is_same_string(a->try_exec, b->try_exec) &&
+		is_same_string(a->working_dir, b->working_dir) &&
+		is_same_string(a->icon_file, b->icon_file) &&
+		(a->icon_image == NULL) == (b->icon_image == NULL);
+}
+
 static void
 send_app_entry(struct desktop_shell *shell, char *key, struct app_entry *entry,
 		bool newApp, bool deleteApp, bool deleteProvider, bool in_sync, bool sync_start, bool sync_end)
@@ -389,17 +703,19 @@ send_app_entry(struct desktop_shell *shell, char *key, struct app_entry *entry,
 		app_list_data.appWorkingDir = entry->working_dir;
 		app_list_data.appDesc = entry->name;
 		app_list_data.appIcon = entry->icon_image;
+		/* default icon is already pre-blended if requested */
+		if (shell->is_blend_overlay_icon_app_list &&
+		    entry->icon_image &&
+		    context->default_overlay_icon) {
+			pixman_image_t *blended_icon =
+				app_entry_get_blended_icon(entry, context->default_overlay_icon);
+			if (blended_icon)
+				app_list_data.appIcon = blended_icon;
+		}
 		if (!app_list_data.appIcon)
 			app_list_data.appIcon = context->default_icon;
 		if (app_list_data.appIcon)
 			pixman_image_ref(app_list_data.appIcon);
-		if (shell->is_blend_overlay_icon_app_list &&
-		    app_list_data.appIcon &&
-		    app_list_data.appIcon != context->default_icon &&
-		    context->default_overlay_icon)
-			shell_blend_overlay_icon(shell,
-						 app_list_data.appIcon,
-						 context->default_overlay_icon);
 	}
 
 	shell->rdprail_api->notify_app_list(shell->rdp_backend, &app_list_data);
@@ -464,22 +780,11 @@ retry_find_icon_file(struct desktop_shell *shell)
 		    entry->icon_name &&
 		    entry->icon_file == NULL &&
 		    entry->icon_retry_count < MAX_ICON_RETRY_COUNT) {
-			void *data = NULL;
-			uint32_t data_len = 0;
 			shell_rdp_debug(entry->shell, "%s: icon (%s) retry count (%d)\n",
 				__func__, entry->icon_name, entry->icon_retry_count);
-			attach_app_list_namespace(shell);
-			if (find_icon_file(entry)) {
-				if (entry->is_icon_file_svg) 
-					data = load_file_svg(shell, entry->icon_file, &data_len);
-				else
-					entry->icon_image = load_image(entry->icon_file);
-			}
-			detach_app_list_namespace(shell);
-			if (entry->is_icon_file_svg && data) 
-				entry->icon_image = load_image_svg(shell, data, data_len, entry->icon_file);
-			if (data)
-				free(data);
+			app_entry_load_icon(shell, entry);
+			if (entry->icon_file)
+				app_list_index_store(shell, entry, true);
 			if (entry->icon_image)
 				send_app_entry(shell, *cur, entry, false, false, false, false, false, false);
 		}
@@ -513,16 +818,41 @@ update_app_entry(struct desktop_shell *shell, char *file, struct app_entry *entr
 	char *s;
 	GKeyFile *key_file;
 	GError *err = NULL;
-
-	key_file = g_key_file_new();
-	if (!key_file)
-		return false;
+	struct stat st;
+	bool is_stat = false;
+	bool from_index = false;
+	bool is_app;
 
 	entry->shell = shell;
+	copy_string(entry->lang_id, sizeof entry->lang_id, lang_id);
 
 	entry->file = strdup(file);
 	if (!entry->file)
-		goto exit;
+		return false;
+
+	attach_app_list_namespace(shell);
+	if (stat(file, &st) == 0) {
+		entry->mtime = st.st_mtim;
+		entry->size = st.st_size;
+		is_stat = true;
+	}
+	detach_app_list_namespace(shell);
+
+	/* skip parsing when the file is unchanged since it was indexed */
+	if (is_stat && app_list_index_lookup(shell, entry, &is_app)) {
+		if (!is_app) {
+			app_list_index_store(shell, entry, false);
+			return false;
+		}
+		from_index = true;
+		goto load_icon;
+	}
+	if (is_stat && context->index.key_file)
+		context->index.miss_count++;
+
+	key_file = g_key_file_new();
+	if (!key_file)
+		return false;
 
 	attach_app_list_namespace(shell);
 	if (!g_key_file_load_from_file(key_file, file, G_KEY_FILE_NONE, &err)) {
@@ -602,23 +932,21 @@ update_app_entry(struct desktop_shell *shell, char *file, struct app_entry *entr
 		trim_command_exec(entry->try_exec);
 	entry->working_dir = g_key_file_get_string(key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_PATH, NULL);
 	entry->icon_name = g_key_file_get_locale_string(key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, lang_id, NULL);
+	g_key_file_free(key_file);
+
+load_icon:
 	if (entry->icon_name) {
-		void *data = NULL;
-		uint32_t data_len = 0;
-		attach_app_list_namespace(shell);
-		if (find_icon_file(entry)) {
-			if (entry->is_icon_file_svg) 
-				data = load_file_svg(shell, entry->icon_file, &data_len);
-			else
-				entry->icon_image = load_image(entry->icon_file);
+		app_entry_load_icon(shell, entry);
+		/* indexed icon file may have been removed, search it again */
+		if (from_index && entry->icon_file && !entry->icon_image) {
+			free(entry->icon_file);
+			entry->icon_file = NULL;
+			entry->is_icon_file_svg = false;
+			app_entry_load_icon(shell, entry);
 		}
-		detach_app_list_namespace(shell);
-		if (entry->is_icon_file_svg && data)
-			entry->icon_image = load_image_svg(shell, data, data_len, entry->icon_file);
-		if (data)
-			free(data);
 	}
-	g_key_file_free(key_file);
+	if (is_stat)
+		app_list_index_store(shell, entry, true);
 
 	shell_rdp_debug(shell, "desktop file: %s\n", entry->file);
 	shell_rdp_debug(shell, "    Name[%s]:%s\n", lang_id, entry->name);
@@ -638,6 +966,10 @@ exit:
 
 	g_key_file_free(key_file);
 
+	/* remember this isn't listed, unless it couldn't be stat'ed */
+	if (is_stat)
+		app_list_index_store(shell, entry, false);
+
 	/* caller will clean up partially filled entry upon returning false */
 	return false;
 }
@@ -712,7 +1044,11 @@ app_list_desktop_file_changed(struct desktop_shell *shell, char *folder, char *f
 	if (entry)
 		entry_filled = update_app_entry(shell, full_path, entry);
 
-	if (entry_filled) {
+	if (entry_filled && entry_old && is_same_app_entry(entry_old, entry)) {
+		/* nothing new to tell client, keep the current one */
+		shell_rdp_debug_verbose(shell, "app list entry unchanged: Key:%s\n", key);
+		free_app_entry(entry);
+	} else if (entry_filled) {
 		shell_rdp_debug(shell, "app list entry updated: Key:%s, Name:%s\n", key, entry->name);
 		if (entry_old) {
 			if (HashTable_SetItemValue(context->table, key, (void*)entry) < 0) {
@@ -753,6 +1089,14 @@ app_list_update_all(struct desktop_shell *shell, char *app_list_folder[])
 	struct dirent *ent;
 	char *folder;
 	char *home;
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+
+	/* collect records for files found by this scan only, so records of
+	   files removed meanwhile are dropped from index. */
+	if (context->index.key_file)
+		context->index.next = g_key_file_new();
+	context->index.hit_count = 0;
+	context->index.miss_count = 0;
 
 	for (int i = 0; app_list_folder[i] != NULL; i++) {
 		attach_app_list_namespace(shell);
@@ -776,6 +1120,113 @@ app_list_update_all(struct desktop_shell *shell, char *app_list_folder[])
 			closedir (dir);
 		}
 	}
+
+	if (context->index.next) {
+		g_key_file_free(context->index.key_file);
+		context->index.key_file = context->index.next;
+		context->index.next = NULL;
+		shell_rdp_debug(shell, "app list index: %d entries reused, %d parsed\n",
+			context->index.hit_count, context->index.miss_count);
+		app_list_index_save(shell);
+	}
+}
+
+static uint64_t
+app_list_get_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+app_list_queue_change(struct desktop_shell *shell, char *app_list_folder[],
+		      int folder_index, char *file, bool removed)
+{
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+	struct app_list_pending_change *change;
+	size_t len = strlen(file) + 1;
+	uint64_t now = app_list_get_time_ms();
+
+	change = zalloc(sizeof *change + len);
+	if (!change) {
+		/* can't defer, apply right away */
+		if (removed)
+			app_list_desktop_file_removed(shell, file);
+		else
+			app_list_desktop_file_changed(shell, app_list_folder[folder_index], file);
+		return;
+	}
+	change->folder_index = folder_index;
+	change->removed = removed;
+	memcpy(change->file, file, len);
+
+	/* latest event wins over earlier ones for same file */
+	g_hash_table_replace(context->pending_change.table,
+			     g_strdup_printf("%d/%s", folder_index, file), change);
+
+	if (context->pending_change.event_count++ == 0)
+		context->pending_change.first_event_ms = now;
+	context->pending_change.last_event_ms = now;
+}
+
+/* returns time to wait in milliseconds until pending changes are due, INFINITE if none */
+static DWORD
+app_list_pending_change_timeout(struct desktop_shell *shell)
+{
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+	uint64_t now, due;
+
+	if (!context->pending_change.event_count)
+		return INFINITE;
+
+	now = app_list_get_time_ms();
+	due = MIN(context->pending_change.last_event_ms + APP_LIST_UPDATE_DELAY_MS,
+		  context->pending_change.first_event_ms + APP_LIST_UPDATE_MAX_DELAY_MS);
+
+	return due > now ? (DWORD)(due - now) : 0;
+}
+
+static void
+app_list_flush_pending_changes(struct desktop_shell *shell, char *app_list_folder[])
+{
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+	struct app_list_pending_change *change;
+	GHashTableIter iter;
+	gpointer value;
+	uint32_t num_changed = 0;
+	uint32_t num_removed = 0;
+
+	if (!context->pending_change.event_count)
+		return;
+
+	/* removals go first, so a file moved between folders ends up listed */
+	g_hash_table_iter_init(&iter, context->pending_change.table);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		change = (struct app_list_pending_change *)value;
+		if (change->removed) {
+			app_list_desktop_file_removed(shell, change->file);
+			num_removed++;
+		}
+	}
+
+	g_hash_table_iter_init(&iter, context->pending_change.table);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		change = (struct app_list_pending_change *)value;
+		if (!change->removed) {
+			app_list_desktop_file_changed(shell,
+				app_list_folder[change->folder_index], change->file);
+			num_changed++;
+		}
+	}
+
+	shell_rdp_debug(shell, "app list batch: %d events coalesced to %d updates, %d removals in %d ms\n",
+		context->pending_change.event_count, num_changed, num_removed,
+		(int)(app_list_get_time_ms() - context->pending_change.first_event_ms));
+
+	g_hash_table_remove_all(context->pending_change.table);
+	context->pending_change.event_count = 0;
 }
 
 static void
@@ -822,13 +1273,12 @@ app_list_stop_rdp_notify(struct desktop_shell *shell)
 	send_app_entry(shell, NULL, NULL, false, false, true, false, false, false);
 }
 
-static void
+/* must be called with app list namespace attached */
+static bool
 translate_to_windows_path(struct desktop_shell *shell, char *image_name, size_t image_name_size)
 {
 	bool is_succeeded = false;
 
-	attach_app_list_namespace(shell);
-
 	if (shell->use_wslpath && is_file_exist("/usr/bin/wslpath")) {
 		pid_t pid;
 		int pipe[2] = {};
@@ -899,8 +1349,6 @@ translate_to_windows_path(struct desktop_shell *shell, char *image_name, size_t
 	}
 
 Exit:
-	detach_app_list_namespace(shell);
-
 	if (!is_succeeded) {
 		/* fallback when wslpath doesn't exst, fork/pipe failed, or nothing read,
 		   here simply patch '/' with '\'. */
@@ -913,6 +1361,62 @@ Exit:
 	}
 
 	shell_rdp_debug_verbose(shell, "app_list_monitor_thread: Windows image_path:%s\n", image_name);
+
+	return is_succeeded;
+}
+
+/* Windows image path of the process, translated paths are cached, so
+   windows from same executable don't fork wslpath again. */
+static void
+find_image_name(struct desktop_shell *shell)
+{
+	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
+	char *image_name = context->find_image_name.image_name;
+	size_t image_name_size = context->find_image_name.image_name_size;
+	char path[32];
+	char *linux_image_name;
+	const char *cached;
+	ssize_t len;
+
+	/* read execuable name from /proc, Xwayland app is in user-distro */
+	image_name[0] = '\0';
+	sprintf(path, "/proc/%d/exe", context->find_image_name.pid);
+	if (!context->find_image_name.is_wayland)
+		attach_app_list_namespace(shell);
+	len = readlink(path, image_name, image_name_size - 1);
+	if (len < 0)
+		shell_rdp_debug(shell, "app_list_monitor_thread: readlink failed %s:%s\n", path, strerror(errno));
+	else
+		image_name[len] = '\0';
+	shell_rdp_debug_verbose(shell, "app_list_monitor_thread: Linux image_path:%s\n", image_name);
+
+	if (image_name[0] == '\0')
+		goto Exit;
+
+	cached = g_hash_table_lookup(context->image_name_cache.table, image_name);
+	if (cached) {
+		context->image_name_cache.hit_count++;
+		copy_string(image_name, image_name_size, cached);
+		shell_rdp_debug_verbose(shell, "app_list_monitor_thread: Windows image_path:%s (cached)\n", image_name);
+		goto Exit;
+	}
+	context->image_name_cache.miss_count++;
+
+	/* convert to Windows-style path, in the same attach as readlink for Xwayland app. */
+	linux_image_name = g_strdup(image_name);
+	if (!context->isAppListNamespaceAttached)
+		attach_app_list_namespace(shell);
+	if (translate_to_windows_path(shell, image_name, image_name_size)) {
+		if (g_hash_table_size(context->image_name_cache.table) >= MAX_IMAGE_NAME_CACHE)
+			g_hash_table_remove_all(context->image_name_cache.table);
+		g_hash_table_replace(context->image_name_cache.table,
+				     linux_image_name, g_strdup(image_name));
+	} else {
+		g_free(linux_image_name);
+	}
+
+Exit:
+	detach_app_list_namespace(shell);
 }
 
 static DWORD WINAPI
@@ -945,6 +1449,7 @@ app_list_monitor_thread(LPVOID arg)
 	DWORD num_events = 0;
 	int num_watch = 0;
 	HANDLE events[NUM_CONTROL_EVENT + ARRAY_LENGTH(app_list_folder)] = {};
+	DWORD timeout;
 	struct inotify_event *event;
 	char buf[1024 * (sizeof *event + 16)];
 	char path[512];
@@ -1065,28 +1570,59 @@ app_list_monitor_thread(LPVOID arg)
 		assert(false == context->isAppListNamespaceAttached);
 
 		/* first scan folders to update all existing .desktop files */
-		if (num_watch)
+		if (num_watch) {
+			if (context->icon_cache_dir &&
+			    mkdir(context->icon_cache_dir, 0700) < 0 && errno != EEXIST) {
+				shell_rdp_debug_error(shell, "app_list_monitor_thread: mkdir(%s) failed %s\n",
+					context->icon_cache_dir, strerror(errno));
+				free(context->icon_cache_dir);
+				context->icon_cache_dir = NULL;
+			}
+			app_list_index_load(shell);
 			app_list_update_all(shell, app_list_folder);
+		}
 	}
 
+	context->pending_change.table =
+		g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+	if (!context->pending_change.table) {
+		error = ERROR_OUTOFMEMORY;
+		goto Exit;
+	}
+	context->pending_change.event_count = 0;
+
+	context->image_name_cache.table =
+		g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	if (!context->image_name_cache.table) {
+		error = ERROR_OUTOFMEMORY;
+		goto Exit;
+	}
+	context->image_name_cache.hit_count = 0;
+	context->image_name_cache.miss_count = 0;
+
 	/* now loop as changes are made or stop event is signaled */
 	while (TRUE) {
-		status = WaitForMultipleObjects(num_events, events, FALSE,
-			context->icon_retry_count ? EVENT_TIMEOUT_MS : INFINITE);
+		timeout = app_list_pending_change_timeout(shell);
+		if (context->icon_retry_count)
+			timeout = MIN(timeout, EVENT_TIMEOUT_MS);
+		status = WaitForMultipleObjects(num_events, events, FALSE, timeout);
 		if (status == WAIT_FAILED) {
 			error = GetLastError();
 			break;
 		}
 
-		/* winpr doesn't support auto-reset event */
-		ResetEvent(events[status - WAIT_OBJECT_0]);
-
 		/* Timeout */
 		if (status == WAIT_TIMEOUT) {
-			retry_find_icon_file(shell);
+			if (context->pending_change.event_count)
+				app_list_flush_pending_changes(shell, app_list_folder);
+			else
+				retry_find_icon_file(shell);
 			continue;
 		}
 
+		/* winpr doesn't support auto-reset event */
+		ResetEvent(events[status - WAIT_OBJECT_0]);
+
 		/* Stop Event */
 		if (status == WAIT_OBJECT_0) {
 			shell_rdp_debug(shell, "app_list_monitor_thread: stopEvent is signalled\n");
@@ -1098,6 +1634,8 @@ app_list_monitor_thread(LPVOID arg)
 			shell_rdp_debug(shell, "app_list_monitor_thread: startRdpNotifyEvent is signalled. %d - %s\n",
 				context->isRdpNotifyStarted, context->lang_info.requestedClientLanguageId);
 			if (!context->isRdpNotifyStarted) {
+				/* client gets the list with all changes seen so far */
+				app_list_flush_pending_changes(shell, app_list_folder);
 				app_list_start_rdp_notify(shell, app_list_folder);
 				context->isRdpNotifyStarted = true;
 			}
@@ -1121,8 +1659,14 @@ app_list_monitor_thread(LPVOID arg)
 			if (context->load_icon.key) {
 				entry = (struct app_entry *)HashTable_GetItemValue(context->table, (void*)context->load_icon.key);
 				if (entry && entry->icon_image) {
-					context->load_icon.image = entry->icon_image;
-					pixman_image_ref(context->load_icon.image);
+					if (context->load_icon.overlay_image)
+						context->load_icon.image =
+							app_entry_get_blended_icon(entry,
+										   context->load_icon.overlay_image);
+					else
+						context->load_icon.image = entry->icon_image;
+					if (context->load_icon.image)
+						pixman_image_ref(context->load_icon.image);
 				}
 				shell_rdp_debug(shell, "app_list_monitor_thread: entry %p, image %p\n", entry, context->load_icon.image);
 			}
@@ -1137,24 +1681,7 @@ app_list_monitor_thread(LPVOID arg)
 			shell_rdp_debug_verbose(shell, "app_list_monitor_thread: findImageNameEvent is signalled. pid:%d\n",
 				context->find_image_name.pid);
 
-			/* read execuable name from /proc */
-			context->find_image_name.image_name[0] = '\0';
-			sprintf(path, "/proc/%d/exe", context->find_image_name.pid);
-			if (!context->find_image_name.is_wayland)
-				attach_app_list_namespace(shell);
-			if (readlink(path, context->find_image_name.image_name, context->find_image_name.image_name_size) < 0)
-				shell_rdp_debug(shell, "app_list_monitor_thread: readlink failed %s:%s\n", path, strerror(errno));
-			if (!context->find_image_name.is_wayland)
-				detach_app_list_namespace(shell);
-			shell_rdp_debug_verbose(shell, "app_list_monitor_thread: Linux image_path:%s\n",
-				context->find_image_name.image_name);
-
-			/* If image name is provided, convert to Windows-style path. */
-			if (context->find_image_name.image_name[0] != '\0') {
-				translate_to_windows_path(shell,
-					context->find_image_name.image_name,
-					context->find_image_name.image_name_size);
-			}
+			find_image_name(shell);
 
 			SetEvent(context->replyEvent);
 			continue;
@@ -1186,12 +1713,12 @@ app_list_monitor_thread(LPVOID arg)
 					(event->mask & IN_ISDIR) == 0 &&
 					is_desktop_file(event->name)) {
 					if (event->mask & (IN_CREATE|IN_MODIFY|IN_MOVED_TO)) {
-						shell_rdp_debug(shell, "app_list_monitor_thread: file created/updated (%s)\n", event->name);
-						app_list_desktop_file_changed(shell, app_list_folder[app_list_folder_index[status - WAIT_OBJECT_0 - NUM_CONTROL_EVENT]], event->name);
+						shell_rdp_debug_verbose(shell, "app_list_monitor_thread: file created/updated (%s)\n", event->name);
+						app_list_queue_change(shell, app_list_folder, app_list_folder_index[status - WAIT_OBJECT_0 - NUM_CONTROL_EVENT], event->name, false);
 					}
 					else if (event->mask & (IN_DELETE|IN_MOVED_FROM)) {
-						shell_rdp_debug(shell, "app_list_monitor_thread: file removed (%s)\n", event->name);
-						app_list_desktop_file_removed(shell, event->name);
+						shell_rdp_debug_verbose(shell, "app_list_monitor_thread: file removed (%s)\n", event->name);
+						app_list_queue_change(shell, app_list_folder, app_list_folder_index[status - WAIT_OBJECT_0 - NUM_CONTROL_EVENT], event->name, true);
 					}
 				}
 				cur += (sizeof *event + event->len);
@@ -1202,6 +1729,27 @@ app_list_monitor_thread(LPVOID arg)
 Exit:
 	assert(false == context->isAppListNamespaceAttached);
 
+	/* pending changes are dropped, the list is rebuilt on next start */
+	if (context->pending_change.table) {
+		g_hash_table_destroy(context->pending_change.table);
+		context->pending_change.table = NULL;
+	}
+	context->pending_change.event_count = 0;
+
+	if (context->image_name_cache.table) {
+		shell_rdp_debug(shell, "app_list_monitor_thread: image name cache hit:%u miss:%u\n",
+			context->image_name_cache.hit_count, context->image_name_cache.miss_count);
+		g_hash_table_destroy(context->image_name_cache.table);
+		context->image_name_cache.table = NULL;
+	}
+
+	/* keep changes made since the last full scan */
+	if (context->index.key_file) {
+		app_list_index_save(shell);
+		g_key_file_free(context->index.key_file);
+		context->index.key_file = NULL;
+	}
+
 	for (int i = 0; i < num_watch; i++) {
 		if (events[i + NUM_CONTROL_EVENT])
 			CloseHandle(events[i + NUM_CONTROL_EVENT]);
@@ -1380,7 +1928,7 @@ stop_app_list_monitor(struct desktop_shell *shell)
 }
 #endif // HAVE_WINPR && HAVE_GLIB
 
-pixman_image_t* app_list_load_icon_file(struct desktop_shell *shell, const char *key)
+pixman_image_t* app_list_load_icon_file(struct desktop_shell *shell, const char *key, pixman_image_t *overlay_image)
 {
 #if HAVE_WINPR && HAVE_GLIB
 	struct app_list_context *context = (struct app_list_context *)shell->app_list_context;
@@ -1391,6 +1939,7 @@ pixman_image_t* app_list_load_icon_file(struct desktop_shell *shell, const char
 		assert(context->load_icon.image == NULL);
 		assert(context->load_icon.key == NULL);
 		context->load_icon.key = key;
+		context->load_icon.overlay_image = overlay_image;
 
 		/* signal worker thread to load icon at worker thread */
 		SetEvent(context->loadIconEvent);
@@ -1401,6 +1950,7 @@ pixman_image_t* app_list_load_icon_file(struct desktop_shell *shell, const char
 		image = context->load_icon.image;
 		context->load_icon.image = NULL;
 		context->load_icon.key = NULL;
+		context->load_icon.overlay_image = NULL;
 
 		return image;
 	}
@@ -1503,6 +2053,7 @@ void app_list_init(struct desktop_shell *shell)
 	wObject* obj;
 #endif
 	char *iconpath;
+	char *env_path;
 
 	shell->app_list_context = NULL;
 
@@ -1553,6 +2104,16 @@ void app_list_init(struct desktop_shell *shell)
 					 context->default_icon,
 					 context->default_overlay_icon);
 
+	/* optional index of parsed desktop files, kept across weston restarts */
+	env_path = getenv("WESTON_RDPRAIL_SHELL_APP_LIST_INDEX");
+	if (env_path && *env_path != '\0')
+		context->index.path = strdup(env_path);
+
+	/* optional cache of rasterized svg icons, kept across weston restarts */
+	env_path = getenv("WESTON_RDPRAIL_SHELL_ICON_CACHE_DIR");
+	if (env_path && *env_path != '\0')
+		context->icon_cache_dir = strdup(env_path);
+
 	/* set default language as "en_US". this will be updated once client connected */
 	strcpy(context->lang_info.requestedClientLanguageId, "en_US");
 	strcpy(context->lang_info.currentClientLanguageId,
@@ -1587,6 +2148,8 @@ void app_list_destroy(struct desktop_shell *shell)
 		assert(count == 0);
 		HashTable_Free(table);
 
+		free(context->icon_cache_dir);
+		free(context->index.path);
 		free(context);
 		shell->app_list_context = NULL;
 	}
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #ifdef HAVE_LIBRSVG2
 #include <librsvg/rsvg.h>
@@ -188,6 +189,52 @@ Exit:
 
 	return data;
 }
+
+bool
+save_image_png(struct desktop_shell *shell, pixman_image_t *image, const char *filename)
+{
+	cairo_surface_t *surface;
+	cairo_status_t status;
+	char *tmp_filename;
+	bool ret = false;
+
+	if (pixman_image_get_format(image) != PIXMAN_a8r8g8b8)
+		return false;
+
+	surface = cairo_image_surface_create_for_data(
+			(unsigned char *)pixman_image_get_data(image),
+			CAIRO_FORMAT_ARGB32,
+			pixman_image_get_width(image),
+			pixman_image_get_height(image),
+			pixman_image_get_stride(image));
+	status = cairo_surface_status(surface);
+	if (status != CAIRO_STATUS_SUCCESS) {
+		shell_rdp_debug(shell, "%s: cairo_image_surface_create failed %s %s\n",
+			__func__, filename, cairo_status_to_string(status));
+		cairo_surface_destroy(surface);
+		return false;
+	}
+
+	/* write to temporary file first, so reader never sees partial file */
+	tmp_filename = g_strdup_printf("%s.tmp", filename);
+	status = cairo_surface_write_to_png(surface, tmp_filename);
+	if (status != CAIRO_STATUS_SUCCESS) {
+		shell_rdp_debug(shell, "%s: cairo_surface_write_to_png failed %s %s\n",
+			__func__, tmp_filename, cairo_status_to_string(status));
+		unlink(tmp_filename);
+	} else if (rename(tmp_filename, filename) < 0) {
+		shell_rdp_debug(shell, "%s: rename failed %s %s\n",
+			__func__, filename, strerror(errno));
+		unlink(tmp_filename);
+	} else {
+		ret = true;
+	}
+
+	g_free(tmp_filename);
+	cairo_surface_destroy(surface);
+
+	return ret;
+}
 #else
 pixman_image_t *
 load_image_svg(struct desktop_shell *, const void *, uint32_t)
@@ -201,4 +248,10 @@ load_file_svg(struct desktop_shell *, const char *, uint32_t *data_len)
 	*data_len = 0;
 	return NULL;
 }
+
+bool
+save_image_png(struct desktop_shell *, pixman_image_t *, const char *)
+{
+	return false;
+}
 #endif // HAVE_LIBRSVG2
@@ -168,6 +168,14 @@ struct shell_surface {
 		int last_grab_y;
 	} snapped;
 
+	struct {
+		/* final position reported at the end of a local resize,
+		   applied once the client commits the new size */
+		bool is_pending;
+		int x;
+		int y;
+	} localresize;
+
 	struct {
 		bool is_default_icon_used;
 		bool is_icon_set;
@@ -226,6 +234,7 @@ struct shell_seat {
 };
 
 static const struct weston_pointer_grab_interface move_grab_interface;
+static const struct weston_pointer_grab_interface resize_grab_interface;
 
 static void set_maximized(struct shell_surface *shsurf, bool maximized);
 
@@ -384,6 +393,8 @@ shell_surface_set_window_icon(struct weston_desktop_surface *desktop_surface,
 	struct weston_surface *surface;
 	const struct weston_xwayland_surface_api *api;
 	pixman_image_t *image = NULL;
+	pixman_image_t *overlay_image = NULL;
+	bool is_blended = false;
 	pixman_format_code_t format;
 	const char *id;
 	char *class_name;
@@ -429,22 +440,30 @@ shell_surface_set_window_icon(struct weston_desktop_surface *desktop_surface,
 					return;
 			}
 		}
+		/* app list keeps icons with overlay blended, so those are
+		   not blended again for each window. */
+		if (shsurf->shell->is_blend_overlay_icon_taskbar)
+			overlay_image = shsurf->shell->image_default_app_overlay_icon;
 		if (!image) {
 			/* Next, try icon from .desktop file */
 			id = weston_desktop_surface_get_app_id(desktop_surface);
 			if (id)
-				image = app_list_load_icon_file(shsurf->shell, id);
-			if (image)
+				image = app_list_load_icon_file(shsurf->shell, id, overlay_image);
+			if (image) {
 				shsurf->icon.is_default_icon_used = false;
+				is_blended = true;
+			}
 		}
 		if (!image) {
 			/* If this is X app, try window class name as id for icon */
 			if (api && api->is_xwayland_surface(surface)) {
 				class_name = api->get_class_name(surface);
 				if (class_name) {
-					image = app_list_load_icon_file(shsurf->shell, class_name);
-					if (image)
+					image = app_list_load_icon_file(shsurf->shell, class_name, overlay_image);
+					if (image) {
 						shsurf->icon.is_default_icon_used = false;
+						is_blended = true;
+					}
 					free(class_name);
 				}
 			}
@@ -460,9 +479,8 @@ shell_surface_set_window_icon(struct weston_desktop_surface *desktop_surface,
 		if (!image)
 			return;
 		/* no need to blend default icon as it's already pre-blended if requested. */
-		if (shsurf->shell->is_blend_overlay_icon_taskbar &&
-		    shsurf->shell->image_default_app_icon != image &&
-		    shsurf->shell->image_default_app_overlay_icon)
+		if (!is_blended && overlay_image &&
+		    shsurf->shell->image_default_app_icon != image)
 			shell_blend_overlay_icon(shsurf->shell,
 						 image,
 						 shsurf->shell->image_default_app_overlay_icon);
@@ -592,6 +610,20 @@ shell_grab_start(struct shell_grab *grab,
 			weston_desktop_surface_get_surface(shsurf->desktop_surface),
 			wl_fixed_to_int(pointer->grab_x),
 			wl_fixed_to_int(pointer->grab_y));
+	} else if (shell->is_localresize_supported &&
+		(interface == &resize_grab_interface) &&
+		shell->rdprail_api->start_window_resize) {
+
+		shell->is_localmove_pending = true;
+
+		shell_send_minmax_info(
+			weston_desktop_surface_get_surface(shsurf->desktop_surface));
+
+		shell->rdprail_api->start_window_resize(
+			weston_desktop_surface_get_surface(shsurf->desktop_surface),
+			wl_fixed_to_int(pointer->grab_x),
+			wl_fixed_to_int(pointer->grab_y),
+			shsurf->resize_edges);
 	}
 }
 
@@ -613,6 +645,10 @@ shell_grab_end(struct shell_grab *grab)
 			grab->shsurf->snapped.last_grab_x = wl_fixed_to_int(grab->grab.pointer->x);
 			grab->shsurf->snapped.last_grab_y = wl_fixed_to_int(grab->grab.pointer->y);
 			
+			shell->rdprail_api->end_window_move(surface);
+		} else if (shell->is_localresize_supported &&
+			(grab->grab.interface == &resize_grab_interface) &&
+			shell->rdprail_api->end_window_move) {
 			shell->rdprail_api->end_window_move(surface);
 		}
 
@@ -752,6 +788,7 @@ shell_configuration(struct desktop_shell *shell)
 	bool allow_zap;
 	bool allow_alt_f4_to_close_app;
 	bool is_localmove_supported;
+	bool is_localresize_supported;
 
 	section = weston_config_get_section(wet_get_config(shell->compositor),
 					    "shell", NULL, NULL);
@@ -790,6 +827,15 @@ shell_configuration(struct desktop_shell *shell)
 	shell->is_localmove_supported = is_localmove_supported;
 	shell_rdp_debug(shell, "RDPRAIL-shell: local-move:%d\n", shell->is_localmove_supported);
 
+	/* default to disable local resize, when enabled the client resizes the
+	   window frame by itself and only the final size is applied here */
+	weston_config_section_get_bool(section,
+				       "local-resize", &is_localresize_supported, false);
+	is_localresize_supported = read_rdpshell_config_bool(
+		"WESTON_RDPRAIL_SHELL_LOCAL_RESIZE", is_localresize_supported);
+	shell->is_localresize_supported = is_localresize_supported;
+	shell_rdp_debug(shell, "RDPRAIL-shell: local-resize:%d\n", shell->is_localresize_supported);
+
 	/* distro name is provided from WSL via enviromment variable */
 	shell->distroNameLength = 0;
 	shell->distroName = getenv("WSL2_DISTRO_NAME");
@@ -1374,6 +1420,16 @@ resize_grab_motion(struct weston_pointer_grab *grab,
 	if (!shsurf)
 		return;
 
+	/* the client is resizing the window locally, nothing to do until it
+	   reports the final size, unless the mouse moves here after all. */
+	if (shsurf->shell->is_localmove_pending) {
+		if (pointer->grab_x == pointer->x &&
+		    pointer->grab_y == pointer->y)
+			return;
+		shell_rdp_debug_verbose(shsurf->shell, "%s: mouse move is detected while attempting local resize\n", __func__);
+		shsurf->shell->is_localmove_pending = false;
+	}
+
 	weston_view_from_global_fixed(shsurf->view,
 				      pointer->grab_x, pointer->grab_y,
 				      &from_x, &from_y);
@@ -2469,6 +2525,14 @@ desktop_surface_removed(struct weston_desktop_surface *desktop_surface,
 	if (!shsurf)
 		return;
 
+	if (shell->debugLevel >= RDPRAIL_SHELL_DEBUG_LEVEL_VERBOSE) {
+		struct weston_desktop_surface_configure_stats stats;
+
+		weston_desktop_surface_get_configure_stats(desktop_surface, &stats);
+		shell_rdp_debug_verbose(shell, "%s: surface:%p configures sent:%u for %u changes, superseded:%u\n",
+			__func__, surface, stats.sent, stats.changes, stats.superseded);
+	}
+
 	/* if this is focus proxy, reset to NULL */
 	if (shell->focus_proxy_surface == surface) {
 		shell->focus_proxy_surface = NULL;
@@ -2701,7 +2765,14 @@ desktop_surface_committed(struct weston_desktop_surface *desktop_surface,
 		float to_x, to_y;
 		float x, y;
 
-		if (shsurf->resize_edges) {
+		if (shsurf->localresize.is_pending &&
+		    (surface->width != shsurf->last_width ||
+		     surface->height != shsurf->last_height)) {
+			weston_view_set_position(shsurf->view,
+						 shsurf->localresize.x,
+						 shsurf->localresize.y);
+			shsurf->localresize.is_pending = false;
+		} else if (shsurf->resize_edges) {
 			sx = 0;
 			sy = 0;
 
@@ -3070,6 +3141,7 @@ shell_backend_request_window_move(struct weston_surface *surface, int x, int y,
 {
 	struct weston_view *view;
 	struct shell_surface *shsurf = get_shell_surface(surface);
+	struct weston_geometry geometry;
 
 	view = get_default_view(surface);
 	if (!view)
@@ -3082,9 +3154,19 @@ shell_backend_request_window_move(struct weston_surface *surface, int x, int y,
 	assert(!shsurf->snapped.is_maximized_requested);
 
 	if (surface->width != width || surface->height != height) {
-		//TODO: support window resize (width x height)
 		shell_rdp_debug(shsurf->shell, "%s: surface:%p is resized (%dx%d) -> (%d,%d)\n",
 			__func__, surface, surface->width, surface->height, width, height);
+
+		/* the end of a local resize; the client is asked for the new
+		   size and the window is placed when that size is committed. */
+		geometry = weston_desktop_surface_get_geometry(shsurf->desktop_surface);
+		weston_desktop_surface_set_size(shsurf->desktop_surface,
+			geometry.width + width - surface->width,
+			geometry.height + height - surface->height);
+		shsurf->localresize.is_pending = true;
+		shsurf->localresize.x = x;
+		shsurf->localresize.y = y;
+		return;
 	}
 
 	weston_view_set_position(view, x, y);
@@ -4974,6 +5056,9 @@ wet_shell_init(struct weston_compositor *ec,
 		return -1;
 	}
 
+	/* RAIL windows are decorated by the RDP client. */
+	ec->shell_draws_xwayland_decorations = true;
+
 	shell_configuration(shell);
 
 	shell->transform_listener.notify = transform_handler;
@@ -132,6 +132,7 @@ struct desktop_shell {
 	struct timespec startup_time;
 
 	bool is_localmove_supported;
+	bool is_localresize_supported;
 	bool is_localmove_pending;
 
 	void *app_list_context;
@@ -200,7 +201,7 @@ shell_rdp_debug_print(struct weston_log_scope *scope, bool cont, char *fmt, ...)
 // app-list.c
 void app_list_init(struct desktop_shell *shell);
 void app_list_destroy(struct desktop_shell *shell);
-pixman_image_t *app_list_load_icon_file(struct desktop_shell *shell, const char *key);
+pixman_image_t *app_list_load_icon_file(struct desktop_shell *shell, const char *key, pixman_image_t *overlay_image);
 bool app_list_start_backend_update(struct desktop_shell *shell, char *clientLanguageId);
 void app_list_stop_backend_update(struct desktop_shell *shell);
 void app_list_find_image_name(struct desktop_shell *shell, pid_t pid, char *image_name, size_t image_name_size, bool is_wayland);
@@ -208,3 +209,4 @@ void app_list_associate_window_app_id(struct desktop_shell *shell, pid_t pid, ch
 // img-load.c
 pixman_image_t *load_image_svg(struct desktop_shell *shell, const void *data, uint32_t data_len, const char *filename);
 void *load_file_svg(struct desktop_shell *shell, const char *filename, uint32_t *data_len);
+bool save_image_png(struct desktop_shell *shell, pixman_image_t *image, const char *filename);
@@ -52,6 +52,11 @@
 
 #define MAX_RETRY_COUNT	3
 
+/* Damage of a frame is sent as one region of interest meta per rectangle,
+ * or as their bounding box if there are more. */
+#define REMOTING_DAMAGE_ROI_TYPE "damage"
+#define REMOTING_MAX_DAMAGE_RECTS 16
+
 struct weston_remoting {
 	struct weston_compositor *compositor;
 	struct wl_list output_list;
@@ -107,6 +112,12 @@ struct remoted_output {
 	struct weston_head *head;
 
 	struct weston_remoting *remoting;
+
+	/* repaint damage since the last pushed frame, in buffer
+	 * coordinates */
+	pixman_region32_t damage;
+	struct wl_listener frame_listener;
+
 	struct wl_event_source *finish_frame_timer;
 	struct wl_list link;
 	bool submitted_frame;
@@ -132,6 +143,10 @@ struct gst_frame_buffer_data {
 	GstBuffer *buffer;
 };
 
+#ifndef GST_CAPS_FEATURE_MEMORY_DMABUF
+#define GST_CAPS_FEATURE_MEMORY_DMABUF "memory:DMABuf"
+#endif
+
 /* message type for pipe */
 #define GSTPIPE_MSG_BUS_SYNC		1
 #define GSTPIPE_MSG_BUFFER_RELEASE	2
@@ -183,13 +198,59 @@ remoting_gst_bus_sync_handler(GstBus *bus, GstMessage *message,
 	return GST_BUS_PASS;
 }
 
+static GstCaps *
+remoting_gst_create_caps(struct remoted_output *output, bool dmabuf)
+{
+	struct weston_mode *mode = output->output->current_mode;
+	GstCaps *caps;
+
+	caps = gst_caps_new_simple("video/x-raw",
+				   "format", G_TYPE_STRING,
+					     output->format->gst_format_string,
+				   "width", G_TYPE_INT, mode->width,
+				   "height", G_TYPE_INT, mode->height,
+				   "framerate", GST_TYPE_FRACTION,
+						mode->refresh, 1000,
+				   NULL);
+	if (caps && dmabuf)
+		gst_caps_set_features(caps, 0,
+				      gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_DMABUF,
+							    NULL));
+
+	return caps;
+}
+
+/* Frames are always dmabuf memory. Elements which say so in their caps,
+ * like the VA-API encoders, then take them without a read back, while
+ * the others get system memory caps and map them. */
+static bool
+remoting_gst_peer_accepts_dmabuf(struct remoted_output *output)
+{
+	GstPad *pad;
+	GstCaps *caps;
+	bool ret = false;
+
+	pad = gst_element_get_static_pad(GST_ELEMENT(output->appsrc), "src");
+	if (!pad)
+		return false;
+
+	caps = remoting_gst_create_caps(output, true);
+	if (caps) {
+		ret = gst_pad_peer_query_accept_caps(pad, caps);
+		gst_caps_unref(caps);
+	}
+	gst_object_unref(pad);
+
+	return ret;
+}
+
 static int
 remoting_gst_pipeline_init(struct remoted_output *output)
 {
 	GstCaps *caps;
 	GError *err = NULL;
 	GstStateChangeReturn ret;
-	struct weston_mode *mode = output->output->current_mode;
+	bool dmabuf;
 
 	if (!output->gst_pipeline) {
 		char pipeline_str[1024];
@@ -231,14 +292,11 @@ remoting_gst_pipeline_init(struct remoted_output *output)
 		goto err;
 	}
 
-	caps = gst_caps_new_simple("video/x-raw",
-				   "format", G_TYPE_STRING,
-					     output->format->gst_format_string,
-				   "width", G_TYPE_INT, mode->width,
-				   "height", G_TYPE_INT, mode->height,
-				   "framerate", GST_TYPE_FRACTION,
-						mode->refresh, 1000,
-				   NULL);
+	dmabuf = remoting_gst_peer_accepts_dmabuf(output);
+	weston_log("GST pipeline takes frames as %s memory\n",
+		   dmabuf ? "dmabuf" : "system");
+
+	caps = remoting_gst_create_caps(output, dmabuf);
 	if (!caps) {
 		weston_log("Could not create gstreamer caps.\n");
 		goto err;
@@ -560,6 +618,59 @@ remoting_output_fence_sync_handler(int fd, uint32_t mask, void *data)
 	return 0;
 }
 
+static void
+remoting_output_damage_all(struct remoted_output *output)
+{
+	pixman_region32_fini(&output->damage);
+	pixman_region32_init_rect(&output->damage, 0, 0,
+				  output->output->current_mode->width,
+				  output->output->current_mode->height);
+}
+
+static void
+remoting_output_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct remoted_output *output =
+		container_of(listener, struct remoted_output, frame_listener);
+	struct weston_output *base = output->output;
+	pixman_region32_t damage, transformed_damage;
+
+	pixman_region32_init(&damage);
+	pixman_region32_init(&transformed_damage);
+	pixman_region32_intersect(&damage, &base->region, data);
+	pixman_region32_translate(&damage, -base->x, -base->y);
+	weston_transformed_region(base->width, base->height,
+				  base->transform, base->current_scale,
+				  &damage, &transformed_damage);
+	pixman_region32_union(&output->damage, &output->damage,
+			      &transformed_damage);
+	pixman_region32_fini(&transformed_damage);
+	pixman_region32_fini(&damage);
+}
+
+/* Tells encoders downstream what changed since the previous buffer. */
+static void
+remoting_output_add_damage_meta(struct remoted_output *output, GstBuffer *buf)
+{
+	pixman_box32_t *boxes;
+	int i, n;
+
+	boxes = pixman_region32_rectangles(&output->damage, &n);
+	if (n > REMOTING_MAX_DAMAGE_RECTS) {
+		boxes = pixman_region32_extents(&output->damage);
+		n = 1;
+	}
+
+	for (i = 0; i < n; i++)
+		gst_buffer_add_video_region_of_interest_meta(buf,
+			REMOTING_DAMAGE_ROI_TYPE,
+			boxes[i].x1, boxes[i].y1,
+			boxes[i].x2 - boxes[i].x1,
+			boxes[i].y2 - boxes[i].y1);
+
+	pixman_region32_clear(&output->damage);
+}
+
 static int
 remoting_output_frame(struct weston_output *output_base, int fd, int stride,
 		      struct drm_fb *output_buffer)
@@ -596,6 +707,7 @@ remoting_output_frame(struct weston_output *output_base, int fd, int stride,
 				       1,
 				       &offset,
 				       &stride);
+	remoting_output_add_damage_meta(output, buf);
 
 	cb_data->output = output;
 	cb_data->output_buffer = output_buffer;
@@ -644,6 +756,7 @@ remoting_output_destroy(struct weston_output *output)
 
 	remoting_gst_pipeline_deinit(remoted_output);
 	remoting_gstpipe_release(&remoted_output->gstpipe);
+	pixman_region32_fini(&remoted_output->damage);
 
 	if (remoted_output->host)
 		free(remoted_output->host);
@@ -709,6 +822,10 @@ remoting_output_enable(struct weston_output *output)
 		return ret;
 	}
 
+	remoted_output->frame_listener.notify = remoting_output_frame_notify;
+	wl_signal_add(&output->frame_signal, &remoted_output->frame_listener);
+	remoting_output_damage_all(remoted_output);
+
 	loop = wl_display_get_event_loop(c->wl_display);
 	remoted_output->finish_frame_timer =
 		wl_event_loop_add_timer(loop,
@@ -725,6 +842,7 @@ remoting_output_disable(struct weston_output *output)
 	struct remoted_output *remoted_output = lookup_remoted_output(output);
 
 	wl_event_source_remove(remoted_output->finish_frame_timer);
+	wl_list_remove(&remoted_output->frame_listener.link);
 	remoting_gst_pipeline_deinit(remoted_output);
 
 	return remoted_output->saved_disable(output);
@@ -773,6 +891,7 @@ remoting_output_create(struct weston_compositor *c, char *name)
 	output->saved_disable = output->output->disable;
 	output->output->disable = remoting_output_disable;
 	output->remoting = remoting;
+	pixman_region32_init(&output->damage);
 	wl_list_insert(remoting->output_list.prev, &output->link);
 
 	weston_head_init(head, connector_name);
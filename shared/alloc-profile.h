@@ -0,0 +1,78 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_ALLOC_PROFILE_H
+#define WESTON_ALLOC_PROFILE_H
+
+#include <stddef.h>
+
+/* Allocation profiling, built with -Dalloc-profile=true.
+ *
+ * zalloc() and the x*alloc() helpers note each allocation with its call
+ * site. Hot paths are wrapped in WESTON_ALLOC_SCOPE_BEGIN/END, which
+ * attributes noted allocations to the scope as well, and, when malloc()
+ * can be interposed, the allocations made by libraries within the scope,
+ * such as pixman region growth.
+ *
+ * The functions live in libweston, and are weak so that clients and tools
+ * sharing these headers link without it.
+ */
+
+#ifdef WESTON_ALLOC_PROFILE
+
+void
+weston_alloc_profile_note(const char *file, int line, const char *func,
+			  size_t size) __attribute__((weak));
+
+void
+weston_alloc_profile_push(const char *scope) __attribute__((weak));
+
+void
+weston_alloc_profile_pop(void) __attribute__((weak));
+
+#define WESTON_ALLOC_NOTE(size) \
+	(weston_alloc_profile_note ? \
+	 weston_alloc_profile_note(__FILE__, __LINE__, __func__, (size)) : \
+	 (void)0)
+
+#define WESTON_ALLOC_SCOPE_BEGIN(name) do { \
+	if (weston_alloc_profile_push) \
+		weston_alloc_profile_push(name); \
+} while (0)
+
+#define WESTON_ALLOC_SCOPE_END() do { \
+	if (weston_alloc_profile_pop) \
+		weston_alloc_profile_pop(); \
+} while (0)
+
+#else
+
+#define WESTON_ALLOC_NOTE(size) ((void)0)
+#define WESTON_ALLOC_SCOPE_BEGIN(name) do { } while (0)
+#define WESTON_ALLOC_SCOPE_END() do { } while (0)
+
+#endif /* WESTON_ALLOC_PROFILE */
+
+#endif /* WESTON_ALLOC_PROFILE_H */
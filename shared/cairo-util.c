@@ -344,25 +344,50 @@ rounded_rect(cairo_t *cr, int x0, int y0, int x1, int y1, int radius)
 	cairo_close_path(cr);
 }
 
+static void
+cairo_surface_pixman_image_destroy(void *data)
+{
+	pixman_image_unref(data);
+}
+
+/* Wraps an a8r8g8b8 pixman image, taking over the reference to it. */
 cairo_surface_t *
-load_cairo_surface(const char *filename)
+cairo_surface_from_pixman_image(pixman_image_t *image)
 {
-	pixman_image_t *image;
+	static const cairo_user_data_key_t key;
+	cairo_surface_t *surface;
 	int width, height, stride;
 	void *data;
 
-	image = load_image(filename);
-	if (image == NULL) {
-		return NULL;
-	}
-
 	data = pixman_image_get_data(image);
 	width = pixman_image_get_width(image);
 	height = pixman_image_get_height(image);
 	stride = pixman_image_get_stride(image);
 
-	return cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
-						   width, height, stride);
+	surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
+						      width, height, stride);
+	if (cairo_surface_set_user_data(surface, &key, image,
+					cairo_surface_pixman_image_destroy) !=
+	    CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		pixman_image_unref(image);
+		return NULL;
+	}
+
+	return surface;
+}
+
+cairo_surface_t *
+load_cairo_surface(const char *filename)
+{
+	pixman_image_t *image;
+
+	image = load_image(filename);
+	if (image == NULL) {
+		return NULL;
+	}
+
+	return cairo_surface_from_pixman_image(image);
 }
 
 void
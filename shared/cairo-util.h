@@ -28,6 +28,7 @@
 
 #include <stdint.h>
 #include <cairo.h>
+#include <pixman.h>
 
 #include <wayland-client.h>
 #include <wayland-util.h>
@@ -49,6 +50,9 @@ rounded_rect(cairo_t *cr, int x0, int y0, int x1, int y1, int radius);
 cairo_surface_t *
 load_cairo_surface(const char *filename);
 
+cairo_surface_t *
+cairo_surface_from_pixman_image(pixman_image_t *image);
+
 struct theme {
 	cairo_surface_t *active_frame;
 	cairo_surface_t *inactive_frame;
@@ -42,24 +42,69 @@
 #include <libweston/config-parser.h>
 #include "helpers.h"
 #include "string-helpers.h"
+#include "hash.h"
+
+/* Sections and entries are kept in file order in the lists, which
+ * weston_config_next_section() and the first-match lookup semantics rely
+ * on. Lookups go through two hash tables instead: section_index maps the
+ * hash of a section name, entry_index the hash of a key mixed with the id
+ * of its section. Each table slot holds the first object with that hash,
+ * and objects sharing a hash are chained in file order through hash_next.
+ */
 
 struct weston_config_entry {
 	char *key;
 	char *value;
+	uint32_t hash;
+	struct weston_config_section *section;
+	struct weston_config_entry *hash_next;
 	struct wl_list link;
 };
 
 struct weston_config_section {
 	char *name;
+	uint32_t hash;
+	uint32_t id;
+	struct weston_config *config;
+	struct weston_config_section *hash_next;
 	struct wl_list entry_list;
 	struct wl_list link;
 };
 
 struct weston_config {
 	struct wl_list section_list;
+	struct hash_table *section_index;
+	struct hash_table *entry_index;
+	uint32_t next_section_id;
 	char path[PATH_MAX];
+
+	/* identity of the file at parse time, for weston_config_has_changed() */
+	dev_t st_dev;
+	ino_t st_ino;
+	off_t st_size;
+	struct timespec st_mtim;
 };
 
+static uint32_t
+config_hash_string(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	/* FNV-1a */
+	for (; *str; str++) {
+		hash ^= (unsigned char) *str;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static uint32_t
+config_entry_hash(struct weston_config_section *section, uint32_t key_hash)
+{
+	return key_hash ^ (section->id * 0x9e3779b9u);
+}
+
 static int
 open_config_file(struct weston_config *c, const char *name)
 {
@@ -118,11 +163,15 @@ config_section_get_entry(struct weston_config_section *section,
 			 const char *key)
 {
 	struct weston_config_entry *e;
+	uint32_t hash;
 
 	if (section == NULL)
 		return NULL;
-	wl_list_for_each(e, &section->entry_list, link)
-		if (strcmp(e->key, key) == 0)
+
+	hash = config_entry_hash(section, config_hash_string(key));
+	for (e = hash_table_lookup(section->config->entry_index, hash);
+	     e; e = e->hash_next)
+		if (e->section == section && strcmp(e->key, key) == 0)
 			return e;
 
 	return NULL;
@@ -138,7 +187,10 @@ weston_config_get_section(struct weston_config *config, const char *section,
 
 	if (config == NULL)
 		return NULL;
-	wl_list_for_each(s, &config->section_list, link) {
+
+	for (s = hash_table_lookup(config->section_index,
+				   config_hash_string(section));
+	     s; s = s->hash_next) {
 		if (strcmp(s->name, section) != 0)
 			continue;
 		if (key == NULL)
@@ -342,7 +394,7 @@ weston_config_get_name_from_env(void)
 static struct weston_config_section *
 config_add_section(struct weston_config *config, const char *name)
 {
-	struct weston_config_section *section;
+	struct weston_config_section *section, *s;
 
 	section = malloc(sizeof *section);
 	if (section == NULL)
@@ -354,6 +406,23 @@ config_add_section(struct weston_config *config, const char *name)
 		return NULL;
 	}
 
+	section->hash = config_hash_string(name);
+	section->id = config->next_section_id++;
+	section->config = config;
+	section->hash_next = NULL;
+
+	s = hash_table_lookup(config->section_index, section->hash);
+	if (s) {
+		while (s->hash_next)
+			s = s->hash_next;
+		s->hash_next = section;
+	} else if (hash_table_insert(config->section_index,
+				     section->hash, section) < 0) {
+		free(section->name);
+		free(section);
+		return NULL;
+	}
+
 	wl_list_init(&section->entry_list);
 	wl_list_insert(config->section_list.prev, &section->link);
 
@@ -364,7 +433,8 @@ static struct weston_config_entry *
 section_add_entry(struct weston_config_section *section,
 		  const char *key, const char *value)
 {
-	struct weston_config_entry *entry;
+	struct weston_config *config = section->config;
+	struct weston_config_entry *entry, *e;
 
 	entry = malloc(sizeof *entry);
 	if (entry == NULL)
@@ -383,6 +453,23 @@ section_add_entry(struct weston_config_section *section,
 		return NULL;
 	}
 
+	entry->hash = config_entry_hash(section, config_hash_string(key));
+	entry->section = section;
+	entry->hash_next = NULL;
+
+	e = hash_table_lookup(config->entry_index, entry->hash);
+	if (e) {
+		while (e->hash_next)
+			e = e->hash_next;
+		e->hash_next = entry;
+	} else if (hash_table_insert(config->entry_index,
+				     entry->hash, entry) < 0) {
+		free(entry->value);
+		free(entry->key);
+		free(entry);
+		return NULL;
+	}
+
 	wl_list_insert(section->entry_list.prev, &entry->link);
 
 	return entry;
@@ -399,28 +486,41 @@ weston_config_parse(const char *name)
 	struct weston_config_section *section = NULL;
 	int i, fd;
 
-	config = malloc(sizeof *config);
+	config = calloc(1, sizeof *config);
 	if (config == NULL)
 		return NULL;
 
 	wl_list_init(&config->section_list);
 
+	config->section_index = hash_table_create();
+	config->entry_index = hash_table_create();
+	if (!config->section_index || !config->entry_index) {
+		weston_config_destroy(config);
+		return NULL;
+	}
+
 	fd = open_config_file(config, name);
 	if (fd == -1) {
-		free(config);
+		weston_config_destroy(config);
 		return NULL;
 	}
 
 	if (fstat(fd, &filestat) < 0 ||
 	    !S_ISREG(filestat.st_mode)) {
 		close(fd);
-		free(config);
+		weston_config_destroy(config);
 		return NULL;
 	}
 
+	config->st_dev = filestat.st_dev;
+	config->st_ino = filestat.st_ino;
+	config->st_size = filestat.st_size;
+	config->st_mtim = filestat.st_mtim;
+
 	fp = fdopen(fd, "r");
 	if (fp == NULL) {
-		free(config);
+		close(fd);
+		weston_config_destroy(config);
 		return NULL;
 	}
 
@@ -477,6 +577,62 @@ weston_config_get_full_path(struct weston_config *config)
 	return config == NULL ? NULL : config->path;
 }
 
+/** Check whether the file a configuration was parsed from has changed
+ *
+ * \param config The configuration, as returned by weston_config_parse().
+ * \return true if the file was modified, replaced or removed since it
+ * was parsed, false otherwise.
+ *
+ * Only the file status is compared, the contents are not read.
+ */
+WL_EXPORT
+bool
+weston_config_has_changed(struct weston_config *config)
+{
+	struct stat filestat;
+
+	if (config == NULL)
+		return false;
+
+	if (stat(config->path, &filestat) < 0)
+		return true;
+
+	return filestat.st_dev != config->st_dev ||
+	       filestat.st_ino != config->st_ino ||
+	       filestat.st_size != config->st_size ||
+	       filestat.st_mtim.tv_sec != config->st_mtim.tv_sec ||
+	       filestat.st_mtim.tv_nsec != config->st_mtim.tv_nsec;
+}
+
+/** Parse a configuration again if its file has changed
+ *
+ * \param config Pointer to the configuration to refresh.
+ * \return 1 if the file was parsed again, 0 if it has not changed, -1 if
+ * parsing failed.
+ *
+ * On success the old configuration is destroyed and *config points to the
+ * new one, so any section pointers obtained from the old configuration
+ * become invalid. On failure *config is left untouched.
+ */
+WL_EXPORT
+int
+weston_config_reload(struct weston_config **config)
+{
+	struct weston_config *new_config;
+
+	if (*config == NULL || !weston_config_has_changed(*config))
+		return 0;
+
+	new_config = weston_config_parse((*config)->path);
+	if (new_config == NULL)
+		return -1;
+
+	weston_config_destroy(*config);
+	*config = new_config;
+
+	return 1;
+}
+
 WL_EXPORT
 int
 weston_config_next_section(struct weston_config *config,
@@ -521,5 +677,7 @@ weston_config_destroy(struct weston_config *config)
 		free(s);
 	}
 
+	hash_table_destroy(config->entry_index);
+	hash_table_destroy(config->section_index);
 	free(config);
 }
@@ -0,0 +1,378 @@
+/*
+ * Copyright © 2009 Intel Corporation
+ * Copyright © 1988-2004 Keith Packard and Bart Massey.
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the names of the authors
+ * or their institutions shall not be used in advertising or
+ * otherwise to promote the sale, use or other dealings in this
+ * Software without prior written authorization from the
+ * authors.
+ *
+ * Authors:
+ *    Eric Anholt <eric@anholt.net>
+ *    Keith Packard <keithp@keithp.com>
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "shared/hash.h"
+
+#define HASH_TABLE_MIN_BITS 3
+#define HASH_TABLE_MAX_BITS 31
+
+/* 2^32 / golden ratio; consecutive keys end up far apart in the table */
+#define HASH_TABLE_MULTIPLIER 0x9e3779b9u
+
+struct hash_entry {
+	uint32_t hash;
+	void *data;
+};
+
+struct hash_table {
+	struct hash_entry *table;
+	uint32_t size;
+	uint32_t bits;
+	uint32_t entries;
+	uint32_t deleted_entries;
+	uint32_t iterating;
+	uint32_t resizes;
+	uint32_t rehashes;
+	uint64_t searches;
+	uint64_t probes;
+	uint32_t max_probes;
+};
+
+/* Entries are only marked deleted while the table is being iterated, any
+ * other removal moves the following entries of the probe sequence back so
+ * that lookups never have to skip over tombstones.
+ */
+static const uint32_t deleted_data;
+
+static inline int
+entry_is_free(const struct hash_entry *entry)
+{
+	return entry->data == NULL;
+}
+
+static inline int
+entry_is_deleted(const struct hash_entry *entry)
+{
+	return entry->data == &deleted_data;
+}
+
+static inline int
+entry_is_present(const struct hash_entry *entry)
+{
+	return entry->data != NULL && entry->data != &deleted_data;
+}
+
+static inline uint32_t
+hash_table_home(const struct hash_table *ht, uint32_t hash)
+{
+	return (hash * HASH_TABLE_MULTIPLIER) >> (32 - ht->bits);
+}
+
+static inline uint32_t
+hash_table_next(const struct hash_table *ht, uint32_t address)
+{
+	return (address + 1) & (ht->size - 1);
+}
+
+/* Whether inserting one more entry keeps at least a quarter of the table
+ * free, so probe sequences stay short and always end at a free entry.
+ */
+static inline int
+hash_table_has_room(const struct hash_table *ht, uint32_t used)
+{
+	return (uint64_t)(used + 1) * 4 <= (uint64_t)ht->size * 3;
+}
+
+struct hash_table *
+hash_table_create(void)
+{
+	struct hash_table *ht;
+
+	ht = calloc(1, sizeof(*ht));
+	if (ht == NULL)
+		return NULL;
+
+	ht->bits = HASH_TABLE_MIN_BITS;
+	ht->size = 1u << ht->bits;
+	ht->table = calloc(ht->size, sizeof(*ht->table));
+	if (ht->table == NULL) {
+		free(ht);
+		return NULL;
+	}
+
+	return ht;
+}
+
+/**
+ * Frees the given hash table.
+ */
+void
+hash_table_destroy(struct hash_table *ht)
+{
+	if (!ht)
+		return;
+
+	free(ht->table);
+	free(ht);
+}
+
+static void
+hash_table_count_probes(struct hash_table *ht, uint32_t probes)
+{
+	ht->searches++;
+	ht->probes += probes;
+	if (probes > ht->max_probes)
+		ht->max_probes = probes;
+}
+
+/**
+ * Finds the hash table entry with the given key.
+ *
+ * Returns NULL if no entry is found.
+ */
+static struct hash_entry *
+hash_table_search(struct hash_table *ht, uint32_t hash)
+{
+	uint32_t hash_address;
+	uint32_t probes = 0;
+
+	hash_address = hash_table_home(ht, hash);
+	for (;;) {
+		struct hash_entry *entry = ht->table + hash_address;
+
+		probes++;
+		if (entry_is_free(entry)) {
+			hash_table_count_probes(ht, probes);
+			return NULL;
+		} else if (entry->hash == hash && !entry_is_deleted(entry)) {
+			hash_table_count_probes(ht, probes);
+			return entry;
+		}
+
+		hash_address = hash_table_next(ht, hash_address);
+	}
+}
+
+void *
+hash_table_lookup(struct hash_table *ht, uint32_t hash)
+{
+	struct hash_entry *entry;
+
+	entry = hash_table_search(ht, hash);
+	if (entry != NULL)
+		return entry->data;
+
+	return NULL;
+}
+
+static void
+hash_table_rehash(struct hash_table *ht, uint32_t new_bits)
+{
+	struct hash_entry *old_table, *table, *entry;
+	uint32_t old_size;
+
+	if (new_bits > HASH_TABLE_MAX_BITS)
+		return;
+
+	table = calloc(1u << new_bits, sizeof(*table));
+	if (table == NULL)
+		return;
+
+	if (new_bits == ht->bits)
+		ht->rehashes++;
+	else
+		ht->resizes++;
+
+	old_table = ht->table;
+	old_size = ht->size;
+	ht->table = table;
+	ht->bits = new_bits;
+	ht->size = 1u << new_bits;
+	ht->deleted_entries = 0;
+
+	for (entry = old_table; entry != old_table + old_size; entry++) {
+		uint32_t hash_address;
+
+		if (!entry_is_present(entry))
+			continue;
+
+		hash_address = hash_table_home(ht, entry->hash);
+		while (!entry_is_free(ht->table + hash_address))
+			hash_address = hash_table_next(ht, hash_address);
+		ht->table[hash_address] = *entry;
+	}
+
+	free(old_table);
+}
+
+void
+hash_table_for_each(struct hash_table *ht,
+		    hash_table_iterator_func_t func, void *data)
+{
+	struct hash_entry *entry;
+	uint32_t i;
+
+	ht->iterating++;
+	for (i = 0; i < ht->size; i++) {
+		entry = ht->table + i;
+		if (entry_is_present(entry))
+			func(entry->data, data);
+	}
+	ht->iterating--;
+
+	/* purge the entries removed by func */
+	if (ht->iterating == 0 && ht->deleted_entries > 0)
+		hash_table_rehash(ht, ht->bits);
+}
+
+/**
+ * Inserts the data with the given key into the table, replacing the data
+ * already stored for that key. data must not be NULL.
+ *
+ * Note that insertion may rearrange the table on a resize or rehash,
+ * so it must not be called from hash_table_for_each().
+ */
+int
+hash_table_insert(struct hash_table *ht, uint32_t hash, void *data)
+{
+	struct hash_entry *entry, *deleted = NULL;
+	uint32_t hash_address;
+
+	assert(data != NULL);
+
+	if (!hash_table_has_room(ht, ht->entries + ht->deleted_entries)) {
+		if (!hash_table_has_room(ht, ht->entries))
+			hash_table_rehash(ht, ht->bits + 1);
+		else
+			hash_table_rehash(ht, ht->bits);
+	}
+
+	hash_address = hash_table_home(ht, hash);
+	for (;;) {
+		entry = ht->table + hash_address;
+
+		if (entry_is_free(entry))
+			break;
+
+		if (entry_is_deleted(entry)) {
+			if (!deleted)
+				deleted = entry;
+		} else if (entry->hash == hash) {
+			entry->data = data;
+			return 0;
+		}
+
+		hash_address = hash_table_next(ht, hash_address);
+	}
+
+	if (deleted) {
+		entry = deleted;
+		ht->deleted_entries--;
+	} else if (ht->entries + ht->deleted_entries + 1 >= ht->size) {
+		/* We could hit here if a required resize failed. An
+		 * unchecked-malloc application could ignore this result.
+		 */
+		return -1;
+	}
+
+	entry->hash = hash;
+	entry->data = data;
+	ht->entries++;
+
+	return 0;
+}
+
+/**
+ * This function deletes the entry with the given key.
+ *
+ * While iterating the entry is only marked deleted, so an iteration over
+ * the table deleting entries is safe.
+ */
+void
+hash_table_remove(struct hash_table *ht, uint32_t hash)
+{
+	struct hash_entry *entry;
+	uint32_t hole, hash_address, mask = ht->size - 1;
+
+	entry = hash_table_search(ht, hash);
+	if (entry == NULL)
+		return;
+
+	ht->entries--;
+
+	if (ht->iterating || ht->deleted_entries) {
+		entry->data = (void *) &deleted_data;
+		ht->deleted_entries++;
+		return;
+	}
+
+	/* Move back the entries after the hole that are allowed to live
+	 * there, i.e. the hole lies between their home and their slot. */
+	hole = entry - ht->table;
+	hash_address = hole;
+	for (;;) {
+		struct hash_entry *next;
+		uint32_t home;
+
+		hash_address = hash_table_next(ht, hash_address);
+		next = ht->table + hash_address;
+		if (entry_is_free(next))
+			break;
+
+		home = hash_table_home(ht, next->hash);
+		if (((hash_address - home) & mask) >=
+		    ((hash_address - hole) & mask)) {
+			ht->table[hole] = *next;
+			hole = hash_address;
+		}
+	}
+
+	ht->table[hole].data = NULL;
+}
+
+uint32_t
+hash_table_num_entries(struct hash_table *ht)
+{
+	return ht->entries;
+}
+
+void
+hash_table_get_stats(struct hash_table *ht, struct hash_table_stats *stats)
+{
+	stats->size = ht->size;
+	stats->entries = ht->entries;
+	stats->deleted_entries = ht->deleted_entries;
+	stats->resizes = ht->resizes;
+	stats->rehashes = ht->rehashes;
+	stats->searches = ht->searches;
+	stats->probes = ht->probes;
+	stats->max_probes = ht->max_probes;
+}
@@ -1,6 +1,7 @@
 /*
  * Copyright © 2009 Intel Corporation
  * Copyright © 1988-2004 Keith Packard and Bart Massey.
+ * Copyright © 2020 Microsoft
  *
  * Permission is hereby granted, free of charge, to any person obtaining a
  * copy of this software and associated documentation files (the "Software"),
@@ -32,15 +33,25 @@
  *    Keith Packard <keithp@keithp.com>
  */
 
-#ifndef HASH_H
-#define HASH_H
+#ifndef WESTON_HASH_H
+#define WESTON_HASH_H
 
 #include <stdint.h>
 
+/* A map from 32-bit keys to non-NULL pointers, used to look up X windows
+ * by XID in the Xwayland window manager and RDP objects by id in the RDP
+ * backend.
+ *
+ * Keys are spread with a multiplicative hash, so sequential ids, as handed
+ * out by the X server and the RDP id manager, land in distinct slots. The
+ * table uses linear probing in a power of two sized array. Removing entries
+ * from within hash_table_for_each() is safe; inserting is not.
+ */
+
 struct hash_table;
-struct hash_table *hash_table_create(void);
 typedef void (*hash_table_iterator_func_t)(void *element, void *data);
 
+struct hash_table *hash_table_create(void);
 void hash_table_destroy(struct hash_table *ht);
 void *hash_table_lookup(struct hash_table *ht, uint32_t hash);
 int hash_table_insert(struct hash_table *ht, uint32_t hash, void *data);
@@ -49,4 +60,17 @@ void hash_table_for_each(struct hash_table *ht,
 			 hash_table_iterator_func_t func, void *data);
 uint32_t hash_table_num_entries(struct hash_table *ht);
 
-#endif
+struct hash_table_stats {
+	uint32_t size;
+	uint32_t entries;
+	uint32_t deleted_entries;
+	uint32_t resizes;	/* rehash into bigger table */
+	uint32_t rehashes;	/* rehash in place to purge deleted entries */
+	uint64_t searches;
+	uint64_t probes;
+	uint32_t max_probes;
+};
+
+void hash_table_get_stats(struct hash_table *ht, struct hash_table_stats *stats);
+
+#endif /* WESTON_HASH_H */
@@ -27,12 +27,26 @@
 #include "config.h"
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <png.h>
 #include <pixman.h>
+#include <wayland-util.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "shared/helpers.h"
 #include "image-loader.h"
@@ -60,13 +74,16 @@ pixman_image_destroy_func(pixman_image_t *image, void *data)
 #ifdef HAVE_JPEG
 
 static void
-swizzle_row(JSAMPLE *row, JDIMENSION width)
+swizzle_row_scalar(JSAMPLE *row, JDIMENSION n)
 {
 	JSAMPLE *s;
 	uint32_t *d;
 
-	s = row + (width - 1) * 3;
-	d = (uint32_t *) (row + (width - 1) * 4);
+	if (n == 0)
+		return;
+
+	s = row + (n - 1) * 3;
+	d = (uint32_t *) (row + (n - 1) * 4);
 	while (s >= row) {
 		*d = 0xff000000 | (s[0] << 16) | (s[1] << 8) | (s[2] << 0);
 		s -= 3;
@@ -74,6 +91,54 @@ swizzle_row(JSAMPLE *row, JDIMENSION width)
 	}
 }
 
+/* Expands a row of RGB samples in place to XRGB pixels. The row is walked
+ * back to front, so each block of pixels is read before the wider output
+ * of the blocks before it overwrites it. */
+static void
+swizzle_row(JSAMPLE *row, JDIMENSION width)
+{
+	JDIMENSION n = width;
+
+#if defined(__SSSE3__)
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+					      8, 7, 6, -1, 11, 10, 9, -1);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+
+	/* The 16 byte load reads 4 bytes past the 4 pixels, which is
+	 * still inside the row as it is 4 * width bytes long. */
+	for (; n >= 4; n -= 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (row + (n - 4) * 3));
+
+		v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+		_mm_storeu_si128((__m128i *) (row + (n - 4) * 4), v);
+	}
+#elif defined(__ARM_NEON)
+	for (; n >= 16; n -= 16) {
+		uint8x16x3_t v = vld3q_u8(row + (n - 16) * 3);
+		uint8x16x4_t w;
+
+		w.val[0] = v.val[2];
+		w.val[1] = v.val[1];
+		w.val[2] = v.val[0];
+		w.val[3] = vdupq_n_u8(0xff);
+		vst4q_u8(row + (n - 16) * 4, w);
+	}
+#endif
+
+	swizzle_row_scalar(row, n);
+}
+
+#ifdef UNIT_TEST
+void
+image_loader_swizzle_row(uint8_t *row, size_t width, bool simd)
+{
+	if (simd)
+		swizzle_row(row, width);
+	else
+		swizzle_row_scalar(row, width);
+}
+#endif
+
 static void
 error_exit(j_common_ptr cinfo)
 {
@@ -157,15 +222,50 @@ multiply_alpha(int alpha, int color)
     return ((temp + (temp >> 8)) >> 8);
 }
 
+#if defined(__ARM_NEON)
+static inline uint8x16_t
+multiply_alpha_neon(uint8x16_t alpha, uint8x16_t color)
+{
+	const uint16x8_t bias = vdupq_n_u16(0x80);
+	uint16x8_t lo, hi;
+
+	lo = vmlal_u8(bias, vget_low_u8(alpha), vget_low_u8(color));
+	hi = vmlal_u8(bias, vget_high_u8(alpha), vget_high_u8(color));
+
+	return vcombine_u8(vaddhn_u16(lo, vshrq_n_u16(lo, 8)),
+			   vaddhn_u16(hi, vshrq_n_u16(hi, 8)));
+}
+#endif
+
+#if defined(__SSE2__)
+/* Premultiplies and swizzles two RGBA pixels unpacked to 16 bit lanes. */
+static inline __m128i
+premultiply_sse2(__m128i v)
+{
+	const __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i one = _mm_set_epi16(0xff, 0, 0, 0, 0xff, 0, 0, 0);
+	const __m128i bias = _mm_set1_epi16(0x80);
+	__m128i a, t;
+
+	a = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_or_si128(_mm_and_si128(a, rgb), one);
+
+	/* same rounding as multiply_alpha(), alpha itself is kept */
+	t = _mm_add_epi16(_mm_mullo_epi16(v, a), bias);
+	t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+	t = _mm_shufflelo_epi16(t, _MM_SHUFFLE(3, 0, 1, 2));
+	return _mm_shufflehi_epi16(t, _MM_SHUFFLE(3, 0, 1, 2));
+}
+#endif
+
 static void
-premultiply_data(png_structp   png,
-		 png_row_infop row_info,
-		 png_bytep     data)
+premultiply_row_scalar(uint8_t *p, size_t width)
 {
-    unsigned int i;
-    png_bytep p;
+    size_t i;
 
-    for (i = 0, p = data; i < row_info->rowbytes; i += 4, p += 4) {
+    for (i = 0; i < width; i++, p += 4) {
 	uint32_t alpha = p[3];
 	uint32_t w;
 
@@ -188,6 +288,57 @@ premultiply_data(png_structp   png,
     }
 }
 
+/* Premultiplies a row of RGBA bytes in place into ARGB8888 pixels. */
+static void
+premultiply_row(uint8_t *p, size_t width)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; i + 4 <= width; i += 4, p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i lo = premultiply_sse2(_mm_unpacklo_epi8(v, zero));
+		__m128i hi = premultiply_sse2(_mm_unpackhi_epi8(v, zero));
+
+		_mm_storeu_si128((__m128i *) p, _mm_packus_epi16(lo, hi));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= width; i += 16, p += 64) {
+		uint8x16x4_t v = vld4q_u8(p);
+		uint8x16x4_t w;
+
+		w.val[0] = multiply_alpha_neon(v.val[3], v.val[2]);
+		w.val[1] = multiply_alpha_neon(v.val[3], v.val[1]);
+		w.val[2] = multiply_alpha_neon(v.val[3], v.val[0]);
+		w.val[3] = v.val[3];
+		vst4q_u8(p, w);
+	}
+#endif
+
+	premultiply_row_scalar(p, width - i);
+}
+
+#ifdef UNIT_TEST
+void
+image_loader_premultiply_row(uint8_t *row, size_t width, bool simd)
+{
+	if (simd)
+		premultiply_row(row, width);
+	else
+		premultiply_row_scalar(row, width);
+}
+#endif
+
+static void
+premultiply_data(png_structp   png,
+		 png_row_infop row_info,
+		 png_bytep     data)
+{
+    premultiply_row(data, row_info->rowbytes / 4);
+}
+
 static void
 read_func(png_structp png, png_bytep data, png_size_t size)
 {
@@ -438,3 +589,267 @@ load_image(const char *filename)
 
 	return image;
 }
+
+struct image_load_request {
+	struct image_loader_queue *queue;
+	char *filename;
+	image_loaded_func_t done;
+	void *data;
+	pixman_image_t *image;
+	bool canceled;
+	struct wl_list link;
+};
+
+struct image_loader_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t pending_cond; /* signaled when a request is queued or exiting */
+	struct wl_list pending_list; /* image_load_request::link, waiting for a worker */
+	struct wl_list decoding_list; /* image_load_request::link, taken by a worker */
+	struct wl_list done_list; /* image_load_request::link, waiting for dispatch */
+	bool exit;
+	int event_fd;
+	int num_threads;
+	pthread_t *threads;
+};
+
+static void
+image_load_request_destroy(struct image_load_request *request)
+{
+	if (request->image)
+		pixman_image_unref(request->image);
+	free(request->filename);
+	free(request);
+}
+
+static void *
+image_loader_thread(void *arg)
+{
+	struct image_loader_queue *queue = arg;
+	struct image_load_request *request;
+	pixman_image_t *image;
+
+	pthread_mutex_lock(&queue->mutex);
+	for (;;) {
+		while (!queue->exit && wl_list_empty(&queue->pending_list))
+			pthread_cond_wait(&queue->pending_cond, &queue->mutex);
+		if (queue->exit)
+			break;
+
+		request = wl_container_of(queue->pending_list.next,
+					  request, link);
+		wl_list_remove(&request->link);
+		wl_list_insert(&queue->decoding_list, &request->link);
+		pthread_mutex_unlock(&queue->mutex);
+
+		image = load_image(request->filename);
+
+		pthread_mutex_lock(&queue->mutex);
+		wl_list_remove(&request->link);
+		if (request->canceled) {
+			if (image)
+				pixman_image_unref(image);
+			image_load_request_destroy(request);
+			continue;
+		}
+		request->image = image;
+		wl_list_insert(queue->done_list.prev, &request->link);
+		eventfd_write(queue->event_fd, 1);
+	}
+	pthread_mutex_unlock(&queue->mutex);
+
+	return NULL;
+}
+
+/** Create a queue decoding images on worker threads
+ *
+ * \param num_threads Number of worker threads, at least 1.
+ * \return The queue, or NULL on failure.
+ *
+ * Completed requests are reported through image_loader_queue_dispatch(),
+ * which should be called from the event loop when the fd returned by
+ * image_loader_queue_get_fd() becomes readable.
+ */
+struct image_loader_queue *
+image_loader_queue_create(int num_threads)
+{
+	struct image_loader_queue *queue;
+
+	if (num_threads < 1)
+		num_threads = 1;
+
+	queue = calloc(1, sizeof *queue);
+	if (!queue)
+		return NULL;
+
+	queue->threads = calloc(num_threads, sizeof *queue->threads);
+	if (!queue->threads)
+		goto err_queue;
+
+	queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (queue->event_fd < 0)
+		goto err_threads;
+
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->pending_cond, NULL);
+	wl_list_init(&queue->pending_list);
+	wl_list_init(&queue->decoding_list);
+	wl_list_init(&queue->done_list);
+
+	for (; queue->num_threads < num_threads; queue->num_threads++) {
+		if (pthread_create(&queue->threads[queue->num_threads], NULL,
+				   image_loader_thread, queue) != 0)
+			break;
+	}
+
+	if (queue->num_threads == 0) {
+		image_loader_queue_destroy(queue);
+		return NULL;
+	}
+
+	return queue;
+
+err_threads:
+	free(queue->threads);
+err_queue:
+	free(queue);
+	return NULL;
+}
+
+/** Destroy a queue, canceling all requests
+ *
+ * Requests that were not dispatched yet are dropped without calling their
+ * callback.
+ */
+void
+image_loader_queue_destroy(struct image_loader_queue *queue)
+{
+	struct image_load_request *request, *tmp;
+	int i;
+
+	if (!queue)
+		return;
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->exit = true;
+	pthread_cond_broadcast(&queue->pending_cond);
+	pthread_mutex_unlock(&queue->mutex);
+
+	for (i = 0; i < queue->num_threads; i++)
+		pthread_join(queue->threads[i], NULL);
+
+	/* the workers are gone, nothing is left in decoding_list */
+	wl_list_for_each_safe(request, tmp, &queue->pending_list, link)
+		image_load_request_destroy(request);
+	wl_list_for_each_safe(request, tmp, &queue->done_list, link)
+		image_load_request_destroy(request);
+
+	pthread_cond_destroy(&queue->pending_cond);
+	pthread_mutex_destroy(&queue->mutex);
+	close(queue->event_fd);
+	free(queue->threads);
+	free(queue);
+}
+
+/** Get the fd that becomes readable when requests have completed */
+int
+image_loader_queue_get_fd(struct image_loader_queue *queue)
+{
+	return queue->event_fd;
+}
+
+/** Call the callbacks of the completed requests
+ *
+ * Must be called from the thread that owns the queue. Each callback
+ * receives the decoded image, or NULL if loading failed, and takes the
+ * reference to it.
+ */
+void
+image_loader_queue_dispatch(struct image_loader_queue *queue)
+{
+	struct image_load_request *request;
+	struct wl_list done_list;
+	eventfd_t dummy;
+
+	eventfd_read(queue->event_fd, &dummy);
+
+	pthread_mutex_lock(&queue->mutex);
+	wl_list_init(&done_list);
+	wl_list_insert_list(&done_list, &queue->done_list);
+	wl_list_init(&queue->done_list);
+	pthread_mutex_unlock(&queue->mutex);
+
+	/* callbacks may cancel other requests, so take them one by one */
+	while (!wl_list_empty(&done_list)) {
+		request = wl_container_of(done_list.next, request, link);
+		wl_list_remove(&request->link);
+		if (!request->canceled) {
+			request->done(request->image, request->data);
+			request->image = NULL;
+		}
+		image_load_request_destroy(request);
+	}
+}
+
+/** Load an image on a worker thread
+ *
+ * \param queue The queue running the decode.
+ * \param filename The file to load.
+ * \param done Called from image_loader_queue_dispatch() once loading
+ * finished.
+ * \param data User data passed to done.
+ * \return The request, which stays valid until done is called or until it
+ * is canceled, or NULL on failure.
+ */
+struct image_load_request *
+load_image_async(struct image_loader_queue *queue, const char *filename,
+		 image_loaded_func_t done, void *data)
+{
+	struct image_load_request *request;
+
+	request = calloc(1, sizeof *request);
+	if (!request)
+		return NULL;
+
+	request->filename = strdup(filename);
+	if (!request->filename) {
+		free(request);
+		return NULL;
+	}
+
+	request->queue = queue;
+	request->done = done;
+	request->data = data;
+
+	pthread_mutex_lock(&queue->mutex);
+	wl_list_insert(queue->pending_list.prev, &request->link);
+	pthread_cond_signal(&queue->pending_cond);
+	pthread_mutex_unlock(&queue->mutex);
+
+	return request;
+}
+
+/** Cancel a request, its callback will not be called */
+void
+image_load_request_cancel(struct image_load_request *request)
+{
+	struct image_loader_queue *queue = request->queue;
+	struct image_load_request *r;
+	bool pending = false;
+
+	pthread_mutex_lock(&queue->mutex);
+	wl_list_for_each(r, &queue->pending_list, link) {
+		if (r == request) {
+			pending = true;
+			break;
+		}
+	}
+
+	if (pending) {
+		wl_list_remove(&request->link);
+		image_load_request_destroy(request);
+	} else {
+		/* freed by the worker or by image_loader_queue_dispatch() */
+		request->canceled = true;
+	}
+	pthread_mutex_unlock(&queue->mutex);
+}
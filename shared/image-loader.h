@@ -31,4 +31,44 @@
 pixman_image_t *
 load_image(const char *filename);
 
+struct image_loader_queue;
+struct image_load_request;
+
+typedef void (*image_loaded_func_t)(pixman_image_t *image, void *data);
+
+struct image_loader_queue *
+image_loader_queue_create(int num_threads);
+
+void
+image_loader_queue_destroy(struct image_loader_queue *queue);
+
+int
+image_loader_queue_get_fd(struct image_loader_queue *queue);
+
+void
+image_loader_queue_dispatch(struct image_loader_queue *queue);
+
+struct image_load_request *
+load_image_async(struct image_loader_queue *queue, const char *filename,
+		 image_loaded_func_t done, void *data);
+
+void
+image_load_request_cancel(struct image_load_request *request);
+
+#ifdef UNIT_TEST
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The row conversions of the loaders, with or without their vector
+ * paths, so tests can compare the two. */
+void
+image_loader_premultiply_row(uint8_t *row, size_t width, bool simd);
+
+#ifdef HAVE_JPEG
+void
+image_loader_swizzle_row(uint8_t *row, size_t width, bool simd);
+#endif
+#endif
+
 #endif
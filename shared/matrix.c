@@ -256,6 +256,31 @@ inverse_transform(const double *LU, const unsigned *p, float *v)
 		v[j] = b[j];
 }
 
+/* A matrix built only from translations and scalings is diagonal plus a
+ * translation, and its inverse has a closed form. */
+static int
+matrix_invert_scale_translate(struct weston_matrix *inverse,
+			      const struct weston_matrix *matrix)
+{
+	double sx = matrix->d[0], sy = matrix->d[5], sz = matrix->d[10];
+	double tx = matrix->d[12], ty = matrix->d[13], tz = matrix->d[14];
+	unsigned int type = matrix->type;
+
+	if (sx == 0.0 || sy == 0.0 || sz == 0.0)
+		return -1;
+
+	weston_matrix_init(inverse);
+	inverse->d[0] = 1.0 / sx;
+	inverse->d[5] = 1.0 / sy;
+	inverse->d[10] = 1.0 / sz;
+	inverse->d[12] = -tx / sx;
+	inverse->d[13] = -ty / sy;
+	inverse->d[14] = -tz / sz;
+	inverse->type = type;
+
+	return 0;
+}
+
 WL_EXPORT int
 weston_matrix_invert(struct weston_matrix *inverse,
 		     const struct weston_matrix *matrix)
@@ -264,6 +289,13 @@ weston_matrix_invert(struct weston_matrix *inverse,
 	unsigned perm[4];	/* permutation */
 	unsigned c;
 
+	/* type 0 may also be a matrix filled in by hand, so only trust the
+	 * type when it names the transformations */
+	if (matrix->type != 0 &&
+	    (matrix->type & ~(WESTON_MATRIX_TRANSFORM_TRANSLATE |
+			      WESTON_MATRIX_TRANSFORM_SCALE)) == 0)
+		return matrix_invert_scale_translate(inverse, matrix);
+
 	if (matrix_invert(LU, perm, matrix) < 0)
 		return -1;
 
@@ -202,12 +202,34 @@ os_create_anonymous_file(off_t size)
 			return -1;
 	}
 
+	ret = os_resize_anonymous_file(fd, size);
+	if (ret < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Grow a file created by os_create_anonymous_file() to the given size.
+ *
+ * The same posix_fallocate() rules apply as on creation. Files created
+ * with memfd_create() are sealed against shrinking, so the size must not
+ * be smaller than the current one.
+ *
+ * Returns 0 on success, or -1 with errno set on failure.
+ */
+int
+os_resize_anonymous_file(int fd, off_t size)
+{
+	int ret;
+
 #ifdef HAVE_POSIX_FALLOCATE
 	do {
 		ret = posix_fallocate(fd, 0, size);
 	} while (ret == EINTR);
 	if (ret != 0) {
-		close(fd);
 		errno = ret;
 		return -1;
 	}
@@ -215,13 +237,11 @@ os_create_anonymous_file(off_t size)
 	do {
 		ret = ftruncate(fd, size);
 	} while (ret < 0 && errno == EINTR);
-	if (ret < 0) {
-		close(fd);
+	if (ret < 0)
 		return -1;
-	}
 #endif
 
-	return fd;
+	return 0;
 }
 
 #ifndef HAVE_STRCHRNUL
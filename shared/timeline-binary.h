@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_BINARY_H
+#define WESTON_TIMELINE_BINARY_H
+
+#include <stdint.h>
+
+/* Stream format of the "timeline-binary" log scope, in host byte order.
+ *
+ * The stream starts with a struct timeline_binary_header, followed by
+ * struct timeline_binary_record entries. A TLB_RECORD_POINT record is
+ * followed by one TLB_RECORD_ARG record per argument of the point.
+ *
+ * Point names and object descriptions are interned: a TLB_RECORD_STRING
+ * record defines string 'id' before its first use, and is followed by
+ * 'value' bytes of string data (not NUL terminated) padded with zeroes to
+ * a multiple of the record size. Objects are described by a
+ * TLB_RECORD_OBJECT record before their first use and whenever they
+ * change.
+ */
+
+#define TIMELINE_BINARY_MAGIC		0x424c5457 /* "WTLB" */
+#define TIMELINE_BINARY_VERSION		1
+
+struct timeline_binary_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+enum timeline_binary_record_type {
+	/* id: name string, value: CLOCK_MONOTONIC time in ns */
+	TLB_RECORD_POINT = 1,
+	/* kind: enum timeline_type, id: object id for TLT_OUTPUT and
+	 * TLT_SURFACE, value: time in ns for TLT_VBLANK, TLT_GPU and
+	 * TLT_PRESENT, milliseconds for TLT_MSEC */
+	TLB_RECORD_ARG = 2,
+	/* id: string id, value: length of the string data that follows */
+	TLB_RECORD_STRING = 3,
+	/* kind: TLT_OUTPUT or TLT_SURFACE, id: object id, value: high 32
+	 * bits the name or description string id, low 32 bits the main
+	 * surface object id; 0 means none for both */
+	TLB_RECORD_OBJECT = 4,
+};
+
+struct timeline_binary_record {
+	uint16_t type;		/**< enum timeline_binary_record_type */
+	uint16_t kind;
+	uint32_t id;
+	uint64_t value;
+};
+
+#endif /* WESTON_TIMELINE_BINARY_H */
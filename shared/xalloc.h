@@ -37,6 +37,8 @@ extern "C" {
 
 #include <libweston/zalloc.h>
 
+#include "shared/alloc-profile.h"
+
 
 static inline void *
 fail_on_null(void *p, size_t size, char *file, int32_t line)
@@ -55,10 +57,13 @@ fail_on_null(void *p, size_t size, char *file, int32_t line)
 	return p;
 }
 
-#define xmalloc(s) (fail_on_null(malloc(s), (s), __FILE__, __LINE__))
+#define xmalloc(s) (WESTON_ALLOC_NOTE(s), \
+		    fail_on_null(malloc(s), (s), __FILE__, __LINE__))
 #define xzalloc(s) (fail_on_null(zalloc(s), (s), __FILE__, __LINE__))
-#define xstrdup(s) (fail_on_null(strdup(s), 0, __FILE__, __LINE__))
-#define xrealloc(p, s) (fail_on_null(realloc(p, s), (s), __FILE__, __LINE__))
+#define xstrdup(s) (WESTON_ALLOC_NOTE(0), \
+		    fail_on_null(strdup(s), 0, __FILE__, __LINE__))
+#define xrealloc(p, s) (WESTON_ALLOC_NOTE(s), \
+			fail_on_null(realloc(p, s), (s), __FILE__, __LINE__))
 
 #ifdef  __cplusplus
 }
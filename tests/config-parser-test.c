@@ -630,3 +630,74 @@ ZUC_TEST(config_test, section_from_null)
 	section = weston_config_get_section(NULL, "bucket", NULL, NULL);
 	ZUC_ASSERT_NULL(section);
 }
+
+ZUC_TEST(config_test, many_sections)
+{
+	struct weston_config_section *section;
+	struct weston_config *config;
+	char text[64 * 48] = "", line[48];
+	int32_t n;
+	int i, r;
+
+	for (i = 0; i < 64; i++) {
+		snprintf(line, sizeof line, "[output]\nname=out%d\nscale=%d\n",
+			 i, i);
+		strcat(text, line);
+	}
+
+	config = load_config(text);
+	ZUC_ASSERT_NOT_NULL(config);
+
+	for (i = 0; i < 64; i++) {
+		snprintf(line, sizeof line, "out%d", i);
+		section = weston_config_get_section(config, "output",
+						    "name", line);
+		ZUC_ASSERTG_NOT_NULL(section, out);
+
+		r = weston_config_section_get_int(section, "scale", &n, -1);
+		ZUC_ASSERTG_EQ(0, r, out);
+		ZUC_ASSERTG_EQ(i, n, out);
+	}
+
+out:
+	weston_config_destroy(config);
+}
+
+ZUC_TEST(config_test, reload)
+{
+	struct weston_config_section *section;
+	struct weston_config *config = NULL;
+	char file[] = "/tmp/weston-config-parser-test-XXXXXX";
+	const char *text = "[foo]\na=b\n";
+	char *s = NULL;
+	FILE *fp;
+	int fd;
+
+	fd = mkstemp(file);
+	ZUC_ASSERT_NE(-1, fd);
+	ZUC_ASSERTG_EQ((int)strlen(text), write(fd, text, strlen(text)), out);
+
+	config = weston_config_parse(file);
+	ZUC_ASSERTG_NOT_NULL(config, out);
+	ZUC_ASSERTG_FALSE(weston_config_has_changed(config), out);
+	ZUC_ASSERTG_EQ(0, weston_config_reload(&config), out);
+
+	fp = fopen(file, "w");
+	ZUC_ASSERTG_NOT_NULL(fp, out);
+	fputs("[foo]\na=changed\n", fp);
+	fclose(fp);
+
+	ZUC_ASSERTG_TRUE(weston_config_has_changed(config), out);
+	ZUC_ASSERTG_EQ(1, weston_config_reload(&config), out);
+	ZUC_ASSERTG_FALSE(weston_config_has_changed(config), out);
+
+	section = weston_config_get_section(config, "foo", NULL, NULL);
+	weston_config_section_get_string(section, "a", &s, NULL);
+	ZUC_ASSERTG_STREQ("changed", s, out);
+
+out:
+	free(s);
+	weston_config_destroy(config);
+	close(fd);
+	unlink(file);
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * hash_table microbenchmarks.
+ *
+ * Each key set is inserted into an empty table, looked up, looked up with
+ * keys that are not in the table and removed again. One JSON object per
+ * operation is printed on a line of its own to stdout, and appended to
+ * the file named by WESTON_BENCH_OUTPUT if set:
+ *
+ * {"scene":"hash-<keys>","op":"...","keys":N,"nsec_per_op":T,
+ *  "avg_probes":P,"max_probes":M}
+ *
+ * WESTON_BENCH_ROUNDS overrides the number of times each operation is
+ * repeated.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "shared/hash.h"
+#include "shared/helpers.h"
+
+#include "weston-test-client-helper.h"
+
+#define BENCH_DEFAULT_ROUNDS 20
+/* X servers hand out resource ids from a per-client base */
+#define XID_BASE 0x00400000
+
+struct hash_bench_keys {
+	const char *name;
+	uint32_t count;
+	/* the key of index i, and one that is never in the set */
+	uint32_t (*key)(uint32_t i);
+	uint32_t (*miss)(uint32_t i);
+};
+
+static uint32_t
+xid_key(uint32_t i)
+{
+	return XID_BASE + i;
+}
+
+static uint32_t
+xid_miss(uint32_t i)
+{
+	return (XID_BASE << 1) + i;
+}
+
+/* windows of a few clients, each client with its own id base */
+static uint32_t
+xid_clients_key(uint32_t i)
+{
+	return ((i % 8 + 2) << 21) + i / 8;
+}
+
+static uint32_t
+xid_clients_miss(uint32_t i)
+{
+	return (1 << 21) + i;
+}
+
+/* odd multiplier and xorshift, a bijection keeping keys distinct */
+static uint32_t
+scramble(uint32_t x)
+{
+	x *= 0x2c1b3c6du;
+	x ^= x >> 15;
+	return x;
+}
+
+static uint32_t
+random_key(uint32_t i)
+{
+	return scramble(i * 2);
+}
+
+static uint32_t
+random_miss(uint32_t i)
+{
+	return scramble(i * 2 + 1);
+}
+
+/* folded cache keys, differing in their high bits only */
+static uint32_t
+shifted_key(uint32_t i)
+{
+	return i << 12;
+}
+
+static uint32_t
+shifted_miss(uint32_t i)
+{
+	return (i << 12) | 1;
+}
+
+static const struct hash_bench_keys key_sets[] = {
+	{ "xid-64", 64, xid_key, xid_miss },
+	{ "xid-65536", 65536, xid_key, xid_miss },
+	{ "xid-clients", 4096, xid_clients_key, xid_clients_miss },
+	{ "random", 65536, random_key, random_miss },
+	{ "shifted", 65536, shifted_key, shifted_miss },
+};
+
+static int
+bench_rounds(void)
+{
+	const char *str = getenv("WESTON_BENCH_ROUNDS");
+	int rounds = str ? atoi(str) : 0;
+
+	return rounds > 0 ? rounds : BENCH_DEFAULT_ROUNDS;
+}
+
+static uint64_t
+now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct bench_op {
+	const char *name;
+	uint64_t nsec;
+	/* probe counts of the last round, insertions do not count probes */
+	uint64_t searches;
+	uint64_t probes;
+};
+
+static void
+bench_report(const struct hash_bench_keys *keys, const struct bench_op *op,
+	     int rounds, uint32_t max_probes)
+{
+	const char *path = getenv("WESTON_BENCH_OUTPUT");
+	char *line;
+	FILE *fp;
+	int ret;
+
+	ret = asprintf(&line, "{\"scene\":\"hash-%s\",\"op\":\"%s\","
+		       "\"keys\":%u,\"nsec_per_op\":%.2f,"
+		       "\"avg_probes\":%.2f,\"max_probes\":%u}\n",
+		       keys->name, op->name, keys->count,
+		       (double)op->nsec / ((uint64_t)rounds * keys->count),
+		       op->searches ? (double)op->probes / op->searches : 0.0,
+		       max_probes);
+	assert(ret > 0);
+
+	fputs(line, stdout);
+	fflush(stdout);
+	testlog("%s", line);
+
+	if (path) {
+		fp = fopen(path, "a");
+		assert(fp);
+		fputs(line, fp);
+		fclose(fp);
+	}
+
+	free(line);
+}
+
+enum bench_op_index {
+	BENCH_INSERT,
+	BENCH_LOOKUP,
+	BENCH_LOOKUP_MISS,
+	BENCH_REMOVE,
+};
+
+static void
+bench_op_end(struct bench_op *op, uint64_t start, struct hash_table *ht,
+	     struct hash_table_stats *stats)
+{
+	struct hash_table_stats now;
+
+	op->nsec += now_nsec() - start;
+
+	hash_table_get_stats(ht, &now);
+	op->searches = now.searches - stats->searches;
+	op->probes = now.probes - stats->probes;
+	*stats = now;
+}
+
+static void
+bench_run(const struct hash_bench_keys *keys)
+{
+	struct bench_op ops[] = {
+		[BENCH_INSERT] = { "insert" },
+		[BENCH_LOOKUP] = { "lookup" },
+		[BENCH_LOOKUP_MISS] = { "lookup-miss" },
+		[BENCH_REMOVE] = { "remove" },
+	};
+	struct hash_table_stats stats;
+	int rounds = bench_rounds();
+	uint64_t start, sum = 0;
+	struct hash_table *ht;
+	uint32_t i;
+	unsigned op;
+	int r;
+
+	for (r = 0; r < rounds; r++) {
+		ht = hash_table_create();
+		assert(ht);
+		hash_table_get_stats(ht, &stats);
+
+		start = now_nsec();
+		for (i = 0; i < keys->count; i++)
+			hash_table_insert(ht, keys->key(i),
+					  (void *)(uintptr_t)(i + 1));
+		bench_op_end(&ops[BENCH_INSERT], start, ht, &stats);
+
+		start = now_nsec();
+		for (i = 0; i < keys->count; i++)
+			sum += (uintptr_t)hash_table_lookup(ht, keys->key(i));
+		bench_op_end(&ops[BENCH_LOOKUP], start, ht, &stats);
+
+		start = now_nsec();
+		for (i = 0; i < keys->count; i++)
+			sum += (uintptr_t)hash_table_lookup(ht, keys->miss(i));
+		bench_op_end(&ops[BENCH_LOOKUP_MISS], start, ht, &stats);
+
+		start = now_nsec();
+		for (i = 0; i < keys->count; i++)
+			hash_table_remove(ht, keys->key(i));
+		bench_op_end(&ops[BENCH_REMOVE], start, ht, &stats);
+
+		assert(hash_table_num_entries(ht) == 0);
+		hash_table_destroy(ht);
+	}
+
+	/* every key was found once per round, and no missing key */
+	assert(sum == (uint64_t)rounds * keys->count * (keys->count + 1) / 2);
+
+	for (op = 0; op < ARRAY_LENGTH(ops); op++)
+		bench_report(keys, &ops[op], rounds, stats.max_probes);
+}
+
+TEST_P(hash_bench, key_sets)
+{
+	bench_run(data);
+}
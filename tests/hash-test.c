@@ -0,0 +1,173 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "shared/hash.h"
+
+#include "weston-test-client-helper.h"
+
+/* X servers hand out resource ids from a per-client base */
+#define XID_BASE 0x00400000
+#define KEY_COUNT 4096
+
+static void *
+key_data(uint32_t key)
+{
+	return (void *)(uintptr_t)(key + 1);
+}
+
+static uint32_t
+data_key(void *data)
+{
+	return (uint32_t)(uintptr_t)data - 1;
+}
+
+TEST(hash_insert_lookup_remove)
+{
+	struct hash_table *ht;
+	uint32_t i;
+
+	ht = hash_table_create();
+	assert(ht);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert(hash_table_insert(ht, XID_BASE + i, key_data(i)) == 0);
+	assert(hash_table_num_entries(ht) == KEY_COUNT);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert(hash_table_lookup(ht, XID_BASE + i) == key_data(i));
+	assert(hash_table_lookup(ht, XID_BASE + KEY_COUNT) == NULL);
+	assert(hash_table_lookup(ht, 0) == NULL);
+
+	/* remove every other key, the rest must stay reachable */
+	for (i = 0; i < KEY_COUNT; i += 2)
+		hash_table_remove(ht, XID_BASE + i);
+	assert(hash_table_num_entries(ht) == KEY_COUNT / 2);
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		void *expected = (i & 1) ? key_data(i) : NULL;
+
+		assert(hash_table_lookup(ht, XID_BASE + i) == expected);
+	}
+
+	/* removing a missing key is a no-op */
+	hash_table_remove(ht, XID_BASE);
+	assert(hash_table_num_entries(ht) == KEY_COUNT / 2);
+
+	hash_table_destroy(ht);
+}
+
+TEST(hash_insert_replaces)
+{
+	struct hash_table *ht;
+
+	ht = hash_table_create();
+	assert(ht);
+
+	assert(hash_table_insert(ht, 42, key_data(1)) == 0);
+	assert(hash_table_insert(ht, 42, key_data(2)) == 0);
+	assert(hash_table_num_entries(ht) == 1);
+	assert(hash_table_lookup(ht, 42) == key_data(2));
+
+	hash_table_remove(ht, 42);
+	assert(hash_table_lookup(ht, 42) == NULL);
+	assert(hash_table_num_entries(ht) == 0);
+
+	hash_table_destroy(ht);
+}
+
+TEST(hash_colliding_keys)
+{
+	struct hash_table *ht;
+	uint32_t i;
+
+	ht = hash_table_create();
+	assert(ht);
+
+	/* keys sharing their low bits, as folded 64-bit keys may */
+	for (i = 0; i < KEY_COUNT; i++)
+		assert(hash_table_insert(ht, i << 16, key_data(i)) == 0);
+
+	for (i = 0; i < KEY_COUNT; i += 3)
+		hash_table_remove(ht, i << 16);
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		void *expected = (i % 3) ? key_data(i) : NULL;
+
+		assert(hash_table_lookup(ht, i << 16) == expected);
+	}
+
+	hash_table_destroy(ht);
+}
+
+struct remove_iter_data {
+	struct hash_table *ht;
+	uint32_t visited;
+};
+
+static void
+remove_iter(void *element, void *data)
+{
+	struct remove_iter_data *iter = data;
+	uint32_t key = data_key(element);
+
+	iter->visited++;
+	hash_table_remove(iter->ht, XID_BASE + key);
+	/* neighbours are removed too, and must not be visited later */
+	hash_table_remove(iter->ht, XID_BASE + (key ^ 1));
+}
+
+TEST(hash_remove_while_iterating)
+{
+	struct remove_iter_data iter;
+	struct hash_table *ht;
+	uint32_t i;
+
+	ht = hash_table_create();
+	assert(ht);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert(hash_table_insert(ht, XID_BASE + i, key_data(i)) == 0);
+
+	iter.ht = ht;
+	iter.visited = 0;
+	hash_table_for_each(ht, remove_iter, &iter);
+	assert(iter.visited == KEY_COUNT / 2);
+	assert(hash_table_num_entries(ht) == 0);
+
+	for (i = 0; i < KEY_COUNT; i++)
+		assert(hash_table_lookup(ht, XID_BASE + i) == NULL);
+
+	/* the table is usable again afterwards */
+	assert(hash_table_insert(ht, XID_BASE, key_data(0)) == 0);
+	assert(hash_table_lookup(ht, XID_BASE) == key_data(0));
+
+	hash_table_destroy(ht);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "shared/image-loader.h"
+
+#include "weston-test-client-helper.h"
+#include "pixel-test-helper.h"
+
+/* The loader works on RGBA byte rows in place. */
+#define BUF_LEN (4 * PIXEL_TEST_ROW_LEN)
+
+static uint32_t rng_state = 0x9e3779b9;
+
+TEST(premultiply_matches_scalar)
+{
+	uint8_t ref[BUF_LEN] __attribute__((aligned(16)));
+	uint8_t out[BUF_LEN] __attribute__((aligned(16)));
+	size_t width, off;
+
+	for (width = 0; width <= PIXEL_TEST_MAX_WIDTH; width++) {
+		for (off = 0; off <= PIXEL_TEST_MAX_OFFSET; off++) {
+			pixel_test_fill_random(&rng_state, ref, sizeof ref);
+			memcpy(out, ref, sizeof out);
+
+			image_loader_premultiply_row(ref + 4 * off, width,
+						     false);
+			image_loader_premultiply_row(out + 4 * off, width,
+						     true);
+			if (memcmp(ref, out, sizeof ref) != 0) {
+				testlog("premultiply differs from scalar, "
+					"width %zu offset %zu\n", width, off);
+				assert(0);
+			}
+		}
+	}
+}
+
+/* Every alpha against every channel value, one row per alpha. */
+TEST(premultiply_all_values_match_scalar)
+{
+	uint8_t ref[4 * 256] __attribute__((aligned(16)));
+	uint8_t out[4 * 256] __attribute__((aligned(16)));
+	unsigned int alpha, c;
+
+	for (alpha = 0; alpha <= 0xff; alpha++) {
+		for (c = 0; c <= 0xff; c++) {
+			ref[4 * c + 0] = c;
+			ref[4 * c + 1] = 0xff - c;
+			ref[4 * c + 2] = c ^ 0x55;
+			ref[4 * c + 3] = alpha;
+		}
+		memcpy(out, ref, sizeof out);
+
+		image_loader_premultiply_row(ref, 256, false);
+		image_loader_premultiply_row(out, 256, true);
+		if (memcmp(ref, out, sizeof ref) != 0) {
+			testlog("premultiply differs from scalar, "
+				"alpha %u\n", alpha);
+			assert(0);
+		}
+	}
+}
+
+#ifdef HAVE_JPEG
+TEST(swizzle_matches_scalar)
+{
+	uint8_t ref[BUF_LEN] __attribute__((aligned(16)));
+	uint8_t out[BUF_LEN] __attribute__((aligned(16)));
+	size_t width, off;
+
+	for (width = 0; width <= PIXEL_TEST_MAX_WIDTH; width++) {
+		for (off = 0; off <= PIXEL_TEST_MAX_OFFSET; off++) {
+			pixel_test_fill_random(&rng_state, ref, sizeof ref);
+			memcpy(out, ref, sizeof out);
+
+			image_loader_swizzle_row(ref + 4 * off, width, false);
+			image_loader_swizzle_row(out + 4 * off, width, true);
+			if (memcmp(ref, out, sizeof ref) != 0) {
+				testlog("swizzle differs from scalar, "
+					"width %zu offset %zu\n", width, off);
+				assert(0);
+			}
+		}
+	}
+}
+#endif
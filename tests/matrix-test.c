@@ -182,6 +182,7 @@ randomize_matrix(struct weston_matrix *m)
 #else
 		m->d[i] = frand();
 #endif
+	m->type = WESTON_MATRIX_TRANSFORM_OTHER;
 }
 
 /* Take a matrix, compute inverse, multiply together
@@ -0,0 +1,196 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <assert.h>
+
+#include <libweston/libweston.h>
+#include "compositor/weston.h"
+#include "weston-test-runner.h"
+#include "weston-test-fixture-compositor.h"
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+
+	return weston_test_harness_execute_as_plugin(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+/* Overlapping, nested, edge sharing and single pixel wide boxes, so the
+ * pick index gets strips with several views and views across strips. */
+static const struct {
+	int x, y, width, height;
+} boxes[] = {
+	{   0,   0, 200, 150 },
+	{  50,  20, 100, 100 },
+	{  50, 120, 100,  60 },
+	{ 150,   0,  80, 300 },
+	{  60,  30,  10,  10 },
+	{ 199,  10,   1, 200 },
+	{ 300, 200, 100, 100 },
+	{ 300, 200, 100, 100 },
+	{ 320, 100,  40, 250 },
+	{  10, 250, 380,  20 },
+	{ 120,  60, 160, 160 },
+	{ 380,   0,  20, 400 },
+};
+
+#define NUM_VIEWS ARRAY_LENGTH(boxes)
+
+/* What weston_compositor_pick_view() did before it had an index. */
+static struct weston_view *
+pick_view_linear(struct weston_compositor *compositor,
+		 wl_fixed_t x, wl_fixed_t y, wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view *view;
+	int ix = wl_fixed_to_int(x);
+	int iy = wl_fixed_to_int(y);
+	int view_ix, view_iy;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (!pixman_region32_contains_point(
+				&view->transform.boundingbox, ix, iy, NULL))
+			continue;
+
+		weston_view_from_global_fixed(view, x, y, vx, vy);
+		view_ix = wl_fixed_to_int(*vx);
+		view_iy = wl_fixed_to_int(*vy);
+
+		if (!pixman_region32_contains_point(&view->surface->input,
+						    view_ix, view_iy, NULL))
+			continue;
+
+		if (view->geometry.scissor_enabled &&
+		    !pixman_region32_contains_point(&view->geometry.scissor,
+						    view_ix, view_iy, NULL))
+			continue;
+
+		return view;
+	}
+
+	return NULL;
+}
+
+static void
+check_picks(struct weston_compositor *compositor, const char *step)
+{
+	struct weston_view *view, *expected;
+	wl_fixed_t x, y, vx, vy, expected_vx, expected_vy;
+	int ix, iy;
+
+	for (iy = -7; iy < 430; iy += 3) {
+		for (ix = -7; ix < 430; ix += 2) {
+			x = wl_fixed_from_double(ix + 0.5);
+			y = wl_fixed_from_double(iy + 0.25);
+
+			view = weston_compositor_pick_view(compositor, x, y,
+							   &vx, &vy);
+			expected = pick_view_linear(compositor, x, y,
+						    &expected_vx,
+						    &expected_vy);
+			if (view != expected ||
+			    (view && (vx != expected_vx ||
+				      vy != expected_vy))) {
+				testlog("%s: pick at %d,%d gave %p, "
+					"expected %p\n",
+					step, ix, iy, (void *)view,
+					(void *)expected);
+				assert(0);
+			}
+		}
+	}
+}
+
+PLUGIN_TEST(pick_view_matches_linear_walk)
+{
+	/* struct weston_compositor *compositor; */
+	struct weston_surface *surfaces[NUM_VIEWS];
+	struct weston_view *views[NUM_VIEWS];
+	struct weston_surface *surface;
+	struct weston_view *view;
+	unsigned i;
+
+	for (i = 0; i < NUM_VIEWS; i++) {
+		surface = weston_surface_create(compositor);
+		assert(surface);
+		view = weston_view_create(surface);
+		assert(view);
+
+		surface->width = boxes[i].width;
+		surface->height = boxes[i].height;
+		/* some views only take input on their left half, so a pick
+		 * falls through to the views below */
+		if (i % 3 == 1) {
+			pixman_region32_fini(&surface->input);
+			pixman_region32_init_rect(&surface->input, 0, 0,
+						  boxes[i].width / 2,
+						  boxes[i].height);
+		}
+
+		weston_view_set_position(view, boxes[i].x, boxes[i].y);
+		weston_view_update_transform(view);
+
+		/* The repaint loop does not run in a plugin test, so stack
+		 * the views directly, later ones on top. */
+		surface->is_mapped = true;
+		view->is_mapped = true;
+		wl_list_insert(&compositor->view_list, &view->link);
+
+		surfaces[i] = surface;
+		views[i] = view;
+	}
+	compositor->pick_index.dirty = true;
+
+	check_picks(compositor, "initial");
+
+	for (i = 0; i < NUM_VIEWS; i += 2) {
+		weston_view_set_position(views[i], boxes[i].x + 17,
+					 boxes[i].y - 11);
+		weston_view_update_transform(views[i]);
+	}
+
+	check_picks(compositor, "moved");
+
+	weston_view_unmap(views[1]);
+	weston_view_unmap(views[6]);
+
+	check_picks(compositor, "unmapped");
+
+	/* as weston_compositor_build_view_list() does for a new order */
+	wl_list_remove(&views[0]->link);
+	wl_list_insert(&compositor->view_list, &views[0]->link);
+	compositor->pick_index.dirty = true;
+
+	check_picks(compositor, "restacked");
+
+	for (i = 0; i < NUM_VIEWS; i++)
+		weston_surface_destroy(surfaces[i]);
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "pixel-formats.h"
+
+#include "weston-test-client-helper.h"
+#include "pixel-test-helper.h"
+
+/* Buffers hold elements of the kernel's own size, so offsets and widths
+ * are in elements rather than bytes. */
+#define BUF_LEN PIXEL_TEST_ROW_LEN
+
+static uint32_t rng_state = 0x2545f491;
+
+static void
+fill_random(void *buf, size_t bytes)
+{
+	pixel_test_fill_random(&rng_state, buf, bytes);
+}
+
+static int
+get_variants(const struct pixel_kernels **variants)
+{
+	int n;
+
+	n = pixel_kernels_get_variants(variants);
+	assert(n >= 1 && n <= PIXEL_KERNELS_MAX_VARIANTS);
+	assert(strcmp(variants[0]->name, "scalar") == 0);
+
+	return n;
+}
+
+typedef void (*row_32_32_func_t)(uint32_t *dst, const uint32_t *src,
+				 size_t n);
+
+static row_32_32_func_t
+get_swap_rb(const struct pixel_kernels *kernels)
+{
+	return kernels->swap_rb;
+}
+
+static row_32_32_func_t
+get_premultiply(const struct pixel_kernels *kernels)
+{
+	return kernels->premultiply;
+}
+
+/* Runs a 32 bpp to 32 bpp kernel of every variant over each width and
+ * offset, and compares the whole destination with the scalar one so a
+ * write past the row shows as well. */
+static void
+check_row_32_32(row_32_32_func_t (*get_kernel)(const struct pixel_kernels *))
+{
+	const struct pixel_kernels *variants[PIXEL_KERNELS_MAX_VARIANTS];
+	uint32_t src[BUF_LEN] __attribute__((aligned(16)));
+	uint32_t ref[BUF_LEN] __attribute__((aligned(16)));
+	uint32_t out[BUF_LEN] __attribute__((aligned(16)));
+	int n_variants, v;
+	size_t width, off;
+
+	n_variants = get_variants(variants);
+
+	for (width = 0; width <= PIXEL_TEST_MAX_WIDTH; width++) {
+		for (off = 0; off <= PIXEL_TEST_MAX_OFFSET; off++) {
+			fill_random(src, sizeof src);
+			memset(ref, 0x5a, sizeof ref);
+			get_kernel(variants[0])(ref + off, src + off, width);
+
+			for (v = 1; v < n_variants; v++) {
+				memset(out, 0x5a, sizeof out);
+				get_kernel(variants[v])(out + off, src + off,
+							width);
+				if (memcmp(ref, out, sizeof ref) != 0) {
+					testlog("%s differs from scalar, "
+						"width %zu offset %zu\n",
+						variants[v]->name, width, off);
+					assert(0);
+				}
+			}
+		}
+	}
+}
+
+TEST(swap_rb_matches_scalar)
+{
+	check_row_32_32(get_swap_rb);
+}
+
+TEST(premultiply_matches_scalar)
+{
+	check_row_32_32(get_premultiply);
+}
+
+TEST(rgb565_to_xrgb8888_matches_scalar)
+{
+	const struct pixel_kernels *variants[PIXEL_KERNELS_MAX_VARIANTS];
+	uint16_t src[BUF_LEN] __attribute__((aligned(16)));
+	uint32_t ref[BUF_LEN] __attribute__((aligned(16)));
+	uint32_t out[BUF_LEN] __attribute__((aligned(16)));
+	int n_variants, v;
+	size_t width, off;
+
+	n_variants = get_variants(variants);
+
+	for (width = 0; width <= PIXEL_TEST_MAX_WIDTH; width++) {
+		for (off = 0; off <= PIXEL_TEST_MAX_OFFSET; off++) {
+			fill_random(src, sizeof src);
+			memset(ref, 0x5a, sizeof ref);
+			variants[0]->rgb565_to_xrgb8888(ref + off, src + off,
+							width);
+
+			for (v = 1; v < n_variants; v++) {
+				memset(out, 0x5a, sizeof out);
+				variants[v]->rgb565_to_xrgb8888(out + off,
+								src + off,
+								width);
+				if (memcmp(ref, out, sizeof ref) != 0) {
+					testlog("%s differs from scalar, "
+						"width %zu offset %zu\n",
+						variants[v]->name, width, off);
+					assert(0);
+				}
+			}
+		}
+	}
+}
+
+TEST(xrgb8888_to_rgb565_matches_scalar)
+{
+	const struct pixel_kernels *variants[PIXEL_KERNELS_MAX_VARIANTS];
+	uint32_t src[BUF_LEN] __attribute__((aligned(16)));
+	uint16_t ref[BUF_LEN] __attribute__((aligned(16)));
+	uint16_t out[BUF_LEN] __attribute__((aligned(16)));
+	int n_variants, v;
+	size_t width, off;
+
+	n_variants = get_variants(variants);
+
+	for (width = 0; width <= PIXEL_TEST_MAX_WIDTH; width++) {
+		for (off = 0; off <= PIXEL_TEST_MAX_OFFSET; off++) {
+			fill_random(src, sizeof src);
+			memset(ref, 0x5a, sizeof ref);
+			variants[0]->xrgb8888_to_rgb565(ref + off, src + off,
+							width);
+
+			for (v = 1; v < n_variants; v++) {
+				memset(out, 0x5a, sizeof out);
+				variants[v]->xrgb8888_to_rgb565(out + off,
+								src + off,
+								width);
+				if (memcmp(ref, out, sizeof ref) != 0) {
+					testlog("%s differs from scalar, "
+						"width %zu offset %zu\n",
+						variants[v]->name, width, off);
+					assert(0);
+				}
+			}
+		}
+	}
+}
+
+TEST(extract_alpha_matches_scalar)
+{
+	const struct pixel_kernels *variants[PIXEL_KERNELS_MAX_VARIANTS];
+	uint32_t src[BUF_LEN] __attribute__((aligned(16)));
+	uint8_t ref[BUF_LEN] __attribute__((aligned(16)));
+	uint8_t out[BUF_LEN] __attribute__((aligned(16)));
+	int n_variants, v;
+	size_t width, off;
+
+	n_variants = get_variants(variants);
+
+	for (width = 0; width <= PIXEL_TEST_MAX_WIDTH; width++) {
+		for (off = 0; off <= PIXEL_TEST_MAX_OFFSET; off++) {
+			fill_random(src, sizeof src);
+			memset(ref, 0x5a, sizeof ref);
+			variants[0]->extract_alpha(ref + off, src + off, width);
+
+			for (v = 1; v < n_variants; v++) {
+				memset(out, 0x5a, sizeof out);
+				variants[v]->extract_alpha(out + off, src + off,
+							   width);
+				if (memcmp(ref, out, sizeof ref) != 0) {
+					testlog("%s differs from scalar, "
+						"width %zu offset %zu\n",
+						variants[v]->name, width, off);
+					assert(0);
+				}
+			}
+		}
+	}
+}
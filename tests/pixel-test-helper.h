@@ -0,0 +1,79 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PIXEL_TEST_HELPER_H
+#define PIXEL_TEST_HELPER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shared by the tests comparing vector row kernels with their scalar
+ * version. Rows up to PIXEL_TEST_MAX_WIDTH pixels cover the vector body
+ * and every tail length, and each starts up to PIXEL_TEST_MAX_OFFSET
+ * pixels past a 16 byte aligned base since the vector loads and stores
+ * must not assume alignment. PIXEL_TEST_GUARD pixels after the longest
+ * row catch writes past its end. */
+#define PIXEL_TEST_MAX_WIDTH 67
+#define PIXEL_TEST_MAX_OFFSET 3
+#define PIXEL_TEST_GUARD 16
+#define PIXEL_TEST_ROW_LEN \
+	(PIXEL_TEST_MAX_OFFSET + PIXEL_TEST_MAX_WIDTH + PIXEL_TEST_GUARD)
+
+/* xorshift32, deterministic so a failure reproduces */
+static inline uint32_t
+pixel_test_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+/* Fills buf with random bytes. Every fourth byte, the alpha of a 32 bpp
+ * pixel, is forced to 0 or 0xff half of the time, since those are
+ * special cased by premultiplication. */
+static inline void
+pixel_test_fill_random(uint32_t *state, void *buf, size_t bytes)
+{
+	uint8_t *p = buf;
+	size_t i;
+
+	for (i = 0; i < bytes; i++)
+		p[i] = pixel_test_rand(state) >> 24;
+
+	for (i = 3; i < bytes; i += 4) {
+		switch (pixel_test_rand(state) % 4) {
+		case 0:
+			p[i] = 0;
+			break;
+		case 1:
+			p[i] = 0xff;
+			break;
+		}
+	}
+}
+
+#endif /* PIXEL_TEST_HELPER_H */
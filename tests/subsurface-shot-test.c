@@ -198,3 +198,192 @@ TEST(subsurface_z_order)
 		if (bufs[i])
 			buffer_destroy(bufs[i]);
 }
+
+/* Compares the clip area of the screen with a single color, for checks
+ * that do not need a reference image. */
+static int
+check_screen_color(struct client *client, const struct rectangle *clip,
+		   pixman_color_t *color)
+{
+	struct buffer *shot;
+	pixman_image_t *expected;
+	bool match;
+
+	shot = capture_screenshot_of_output(client);
+	assert(shot);
+
+	expected = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					    pixman_image_get_width(shot->image),
+					    pixman_image_get_height(shot->image),
+					    NULL, 0);
+	assert(expected);
+	fill_image_with_color(expected, color);
+
+	match = check_images_match(shot->image, expected, clip, NULL);
+	testlog("Screen area %d,%d %dx%d %s the expected color\n",
+		clip->x, clip->y, clip->width, clip->height,
+		match ? "has" : "does not have");
+
+	pixman_image_unref(expected);
+	buffer_destroy(shot);
+
+	return match ? 0 : -1;
+}
+
+/* The compositor only rebuilds its view list when the stacking changes,
+ * so each change below has to show on the very next repaint. */
+TEST(subsurface_restack_shows_on_next_repaint)
+{
+	struct client *client;
+	struct wl_subcompositor *subco;
+	struct wl_surface *parent;
+	struct wl_surface *surf;
+	struct wl_subsurface *sub;
+	struct buffer *bufs[2];
+	/* where blue at 120,70 overlaps red at 100,50 */
+	struct rectangle clip = { 130, 80, 60, 60 };
+	int fail = 0;
+	pixman_color_t red;
+	pixman_color_t blue;
+
+	color_rgb888(&red, 255, 0, 0);
+	color_rgb888(&blue, 0, 0, 255);
+
+	client = create_client_and_test_surface(100, 50, 100, 100);
+	assert(client);
+	subco = get_subcompositor(client);
+
+	weston_test_move_pointer(client->test->weston_test, 0, 1, 0, 2, 30);
+
+	parent = client->surface->wl_surface;
+	bufs[0] = surface_commit_color(client, parent, &red, 100, 100);
+
+	surf = wl_compositor_create_surface(client->wl_compositor);
+	sub = wl_subcompositor_get_subsurface(subco, surf, parent);
+	bufs[1] = surface_commit_color(client, surf, &blue, 100, 100);
+	wl_subsurface_set_position(sub, 20, 20);
+	wl_surface_commit(parent);
+
+	fail += check_screen_color(client, &clip, &blue);
+
+	wl_subsurface_place_below(sub, parent);
+	wl_surface_commit(parent);
+
+	fail += check_screen_color(client, &clip, &red);
+
+	wl_subsurface_place_above(sub, parent);
+	wl_surface_commit(parent);
+
+	fail += check_screen_color(client, &clip, &blue);
+
+	assert(fail == 0);
+
+	wl_subsurface_destroy(sub);
+	wl_surface_destroy(surf);
+	buffer_destroy(bufs[0]);
+	buffer_destroy(bufs[1]);
+	wl_subcompositor_destroy(subco);
+	client_destroy(client);
+}
+
+TEST(subsurface_unmap_shows_on_next_repaint)
+{
+	struct client *client;
+	struct wl_subcompositor *subco;
+	struct wl_surface *parent;
+	struct wl_surface *surf;
+	struct wl_subsurface *sub;
+	struct buffer *bufs[2];
+	struct rectangle clip = { 130, 80, 60, 60 };
+	int fail = 0;
+	pixman_color_t red;
+	pixman_color_t blue;
+
+	color_rgb888(&red, 255, 0, 0);
+	color_rgb888(&blue, 0, 0, 255);
+
+	client = create_client_and_test_surface(100, 50, 100, 100);
+	assert(client);
+	subco = get_subcompositor(client);
+
+	weston_test_move_pointer(client->test->weston_test, 0, 1, 0, 2, 30);
+
+	parent = client->surface->wl_surface;
+	bufs[0] = surface_commit_color(client, parent, &red, 100, 100);
+
+	surf = wl_compositor_create_surface(client->wl_compositor);
+	sub = wl_subcompositor_get_subsurface(subco, surf, parent);
+	bufs[1] = surface_commit_color(client, surf, &blue, 100, 100);
+	wl_subsurface_set_position(sub, 20, 20);
+	wl_surface_commit(parent);
+
+	fail += check_screen_color(client, &clip, &blue);
+
+	/* a sync sub-surface applies its state on the parent commit */
+	wl_surface_attach(surf, NULL, 0, 0);
+	wl_surface_commit(surf);
+	wl_surface_commit(parent);
+
+	fail += check_screen_color(client, &clip, &red);
+
+	wl_surface_attach(surf, bufs[1]->proxy, 0, 0);
+	wl_surface_damage(surf, 0, 0, 100, 100);
+	wl_surface_commit(surf);
+	wl_surface_commit(parent);
+
+	fail += check_screen_color(client, &clip, &blue);
+
+	assert(fail == 0);
+
+	wl_subsurface_destroy(sub);
+	wl_surface_destroy(surf);
+	buffer_destroy(bufs[0]);
+	buffer_destroy(bufs[1]);
+	wl_subcompositor_destroy(subco);
+	client_destroy(client);
+}
+
+TEST(layer_change_shows_on_next_repaint)
+{
+	struct client *client;
+	struct surface *top;
+	struct buffer *bufs[2];
+	/* where green at 150,100 overlaps red at 100,50 */
+	struct rectangle clip = { 160, 110, 30, 30 };
+	int fail = 0;
+	pixman_color_t red;
+	pixman_color_t green;
+
+	color_rgb888(&red, 255, 0, 0);
+	color_rgb888(&green, 0, 255, 0);
+
+	client = create_client_and_test_surface(100, 50, 100, 100);
+	assert(client);
+
+	weston_test_move_pointer(client->test->weston_test, 0, 1, 0, 2, 30);
+
+	bufs[0] = surface_commit_color(client, client->surface->wl_surface,
+				       &red, 100, 100);
+
+	fail += check_screen_color(client, &clip, &red);
+
+	/* the first commit adds the new surface on top of its layer */
+	top = create_test_surface(client);
+	weston_test_move_surface(client->test->weston_test, top->wl_surface,
+				 150, 100);
+	bufs[1] = surface_commit_color(client, top->wl_surface,
+				       &green, 100, 100);
+
+	fail += check_screen_color(client, &clip, &green);
+
+	/* destroying it takes its view out of the layer */
+	surface_destroy(top);
+
+	fail += check_screen_color(client, &clip, &red);
+
+	assert(fail == 0);
+
+	buffer_destroy(bufs[0]);
+	buffer_destroy(bufs[1]);
+	client_destroy(client);
+}
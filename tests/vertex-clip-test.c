@@ -26,11 +26,15 @@
 #include "config.h"
 
 #include <assert.h>
+#include <math.h>
+#include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 #include "weston-test-runner.h"
 
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "vertex-clipping.h"
 
 #define BOUNDING_BOX_TOP_Y 100.0f
@@ -221,3 +225,158 @@ TEST(float_difference_same)
 	assert(float_difference(1.0f, 1.0f) == 0.0f);
 }
 
+
+static void
+populate_clip_batch(struct clip_batch *batch)
+{
+	/* the bounding box, containing, disjoint and covered rects */
+	static const float boxes[CLIP_BATCH_SIZE][4] = {
+		{ BOUNDING_BOX_LEFT_X, BOUNDING_BOX_BOTTOM_Y,
+		  BOUNDING_BOX_RIGHT_X, BOUNDING_BOX_TOP_Y },
+		{ 0.0f, 0.0f, 1000.0f, 1000.0f },
+		{ 500.0f, 500.0f, 600.0f, 600.0f },
+		{ 70.0f, 70.0f, 80.0f, 80.0f },
+	};
+	int k;
+
+	for (k = 0; k < CLIP_BATCH_SIZE; k++) {
+		batch->x1[k] = boxes[k][0];
+		batch->y1[k] = boxes[k][1];
+		batch->x2[k] = boxes[k][2];
+		batch->y2[k] = boxes[k][3];
+	}
+	batch->count = CLIP_BATCH_SIZE;
+}
+
+/* Same vertices in the same order, possibly starting from another one */
+static bool
+polygon_equal_cyclic(const float *ax, const float *ay,
+		     const float *bx, const float *by, int n)
+{
+	int i, start;
+
+	for (start = 0; start < n; start++) {
+		for (i = 0; i < n; i++) {
+			if (ax[i] != bx[(start + i) % n] ||
+			    ay[i] != by[(start + i) % n])
+				break;
+		}
+		if (i == n)
+			return true;
+	}
+
+	return false;
+}
+
+TEST_P(clip_batch_matches_transformed, test_data)
+{
+	struct vertex_clip_test_data *tdata = data;
+	struct clip_context ctx;
+	struct clip_batch batch;
+	struct polygon8 polygon;
+	float batch_x[CLIP_BATCH_SIZE][8];
+	float batch_y[CLIP_BATCH_SIZE][8];
+	float vertices_x[8];
+	float vertices_y[8];
+	int batch_n[CLIP_BATCH_SIZE];
+	int emitted, k;
+
+	populate_clip_batch(&batch);
+	clip_transformed_batch(&batch, &tdata->surface,
+			       batch_x, batch_y, batch_n);
+
+	for (k = 0; k < batch.count; k++) {
+		ctx.clip.x1 = batch.x1[k];
+		ctx.clip.y1 = batch.y1[k];
+		ctx.clip.x2 = batch.x2[k];
+		ctx.clip.y2 = batch.y2[k];
+		deep_copy_polygon8(&tdata->surface, &polygon);
+		emitted = clip_transformed(&ctx, &polygon,
+					   vertices_x, vertices_y);
+
+		/* rects only touching the polygon may be dropped early */
+		if (emitted < 3) {
+			assert(batch_n[k] < 3);
+			continue;
+		}
+
+		assert(batch_n[k] == emitted);
+		assert(polygon_equal_cyclic(batch_x[k], batch_y[k],
+					    vertices_x, vertices_y, emitted));
+	}
+}
+
+#define BENCH_GRID 64
+#define BENCH_RECT 16.0f
+#define BENCH_ROUNDS 50
+
+/* A rotated and scaled view over a grid of damage rects, as the GL
+ * renderer sees it, clipped one rect at a time and in batches.
+ */
+TEST(clip_batch_throughput)
+{
+	struct clip_context ctx;
+	struct clip_batch batch;
+	struct polygon8 surf, polygon;
+	struct timespec start, end;
+	float batch_x[CLIP_BATCH_SIZE][8];
+	float batch_y[CLIP_BATCH_SIZE][8];
+	float vertices_x[8];
+	float vertices_y[8];
+	int batch_n[CLIP_BATCH_SIZE];
+	long scalar_vertices = 0, batch_vertices = 0;
+	int64_t scalar_ns, batch_ns;
+	float c = BENCH_GRID * BENCH_RECT / 2.0f;
+	int r, i, k, n;
+
+	for (i = 0; i < 4; i++) {
+		float a = M_PI / 6.0 + i * M_PI / 2.0;
+
+		surf.x[i] = c + cosf(a) * c;
+		surf.y[i] = c + sinf(a) * c;
+	}
+	surf.n = 4;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		for (i = 0; i < BENCH_GRID * BENCH_GRID; i++) {
+			ctx.clip.x1 = (i % BENCH_GRID) * BENCH_RECT;
+			ctx.clip.y1 = (i / BENCH_GRID) * BENCH_RECT;
+			ctx.clip.x2 = ctx.clip.x1 + BENCH_RECT;
+			ctx.clip.y2 = ctx.clip.y1 + BENCH_RECT;
+			polygon = surf;
+			n = clip_transformed(&ctx, &polygon,
+					     vertices_x, vertices_y);
+			if (n >= 3)
+				scalar_vertices += n;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	scalar_ns = timespec_sub_to_nsec(&end, &start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		for (i = 0; i < BENCH_GRID * BENCH_GRID; i += batch.count) {
+			batch.count = CLIP_BATCH_SIZE;
+			for (k = 0; k < batch.count; k++) {
+				batch.x1[k] = ((i + k) % BENCH_GRID) * BENCH_RECT;
+				batch.y1[k] = ((i + k) / BENCH_GRID) * BENCH_RECT;
+				batch.x2[k] = batch.x1[k] + BENCH_RECT;
+				batch.y2[k] = batch.y1[k] + BENCH_RECT;
+			}
+			clip_transformed_batch(&batch, &surf,
+					       batch_x, batch_y, batch_n);
+			for (k = 0; k < batch.count; k++)
+				if (batch_n[k] >= 3)
+					batch_vertices += batch_n[k];
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	batch_ns = timespec_sub_to_nsec(&end, &start);
+
+	testlog("%d rects x %d rounds: scalar %.3f ms, batch %.3f ms\n",
+		BENCH_GRID * BENCH_GRID, BENCH_ROUNDS,
+		scalar_ns / 1e6, batch_ns / 1e6);
+
+	assert(batch_vertices == scalar_vertices);
+}
@@ -0,0 +1,547 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Headless compositor benchmarks.
+ *
+ * Each scene is run with each renderer, and one JSON object per run is
+ * printed on a line of its own to stdout, and appended to the file named
+ * by WESTON_BENCH_OUTPUT if set:
+ *
+ * {"scene":"...","renderer":"...","frames":N,"seconds":S,"fps":F,
+ *  "cpu_usec_per_frame":C,"allocs_per_frame":A}
+ *
+ * The client runs on a thread of the compositor process, so CPU time and
+ * allocations of that thread are left out. Allocations are counted only
+ * when the C library allows interposing malloc(), otherwise
+ * allocs_per_frame is null. WESTON_BENCH_FRAMES overrides the number of
+ * frames measured per run.
+ */
+
+#include "config.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "weston-test-client-helper.h"
+#include "weston-test-fixture-compositor.h"
+
+#define BENCH_WIDTH 1024
+#define BENCH_HEIGHT 768
+#define BENCH_WARMUP_FRAMES 20
+#define BENCH_DEFAULT_FRAMES 300
+
+#ifdef HAVE_LIBC_MALLOC
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_uint_fast64_t alloc_count;
+static __thread uint64_t thread_alloc_count;
+
+static inline void
+count_alloc(void)
+{
+	atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+	thread_alloc_count++;
+}
+
+void *
+malloc(size_t size)
+{
+	count_alloc();
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	count_alloc();
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	count_alloc();
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+struct renderer_arg {
+	enum renderer_type type;
+	const char *name;
+};
+
+static const struct renderer_arg renderers[] = {
+	{ RENDERER_NOOP, "noop" },
+	{ RENDERER_PIXMAN, "pixman" },
+	{ RENDERER_GL, "gl" },
+};
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness,
+	      const struct renderer_arg *arg)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+	setup.renderer = arg->type;
+	setup.width = BENCH_WIDTH;
+	setup.height = BENCH_HEIGHT;
+	setup.unthrottled = true;
+	setup.shell = SHELL_TEST_DESKTOP;
+
+	return weston_test_harness_execute_as_client(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP_WITH_ARG(fixture_setup, renderers);
+
+struct bench_sample {
+	struct timespec wall;
+	struct timespec process_cpu;
+	struct timespec thread_cpu;
+	uint64_t allocs;
+	uint64_t thread_allocs;
+};
+
+static void
+bench_sample_take(struct bench_sample *s)
+{
+	clock_gettime(CLOCK_MONOTONIC, &s->wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &s->process_cpu);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &s->thread_cpu);
+#ifdef HAVE_LIBC_MALLOC
+	s->allocs = atomic_load(&alloc_count);
+	s->thread_allocs = thread_alloc_count;
+#else
+	s->allocs = 0;
+	s->thread_allocs = 0;
+#endif
+}
+
+static double
+timespec_diff_sec(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+static void
+bench_report(const char *scene, int frames,
+	     const struct bench_sample *begin, const struct bench_sample *end)
+{
+	const char *renderer = renderers[get_test_fixture_index()].name;
+	const char *path = getenv("WESTON_BENCH_OUTPUT");
+	double seconds = timespec_diff_sec(&end->wall, &begin->wall);
+	double cpu = timespec_diff_sec(&end->process_cpu, &begin->process_cpu) -
+		     timespec_diff_sec(&end->thread_cpu, &begin->thread_cpu);
+	char allocs[32] = "null";
+	char *line;
+	FILE *fp;
+	int ret;
+
+#ifdef HAVE_LIBC_MALLOC
+	snprintf(allocs, sizeof allocs, "%.1f",
+		 (double)((end->allocs - begin->allocs) -
+			  (end->thread_allocs - begin->thread_allocs)) / frames);
+#endif
+
+	ret = asprintf(&line, "{\"scene\":\"%s\",\"renderer\":\"%s\","
+		       "\"frames\":%d,\"seconds\":%.3f,\"fps\":%.1f,"
+		       "\"cpu_usec_per_frame\":%.1f,\"allocs_per_frame\":%s}\n",
+		       scene, renderer, frames, seconds, frames / seconds,
+		       cpu * 1e6 / frames, allocs);
+	assert(ret > 0);
+
+	fputs(line, stdout);
+	fflush(stdout);
+	testlog("%s", line);
+
+	if (path) {
+		fp = fopen(path, "a");
+		assert(fp);
+		fputs(line, fp);
+		fclose(fp);
+	}
+
+	free(line);
+}
+
+static int
+bench_frames(void)
+{
+	const char *str = getenv("WESTON_BENCH_FRAMES");
+	int frames = str ? atoi(str) : 0;
+
+	return frames > 0 ? frames : BENCH_DEFAULT_FRAMES;
+}
+
+struct bench_scene {
+	const char *name;
+	void *(*create)(void);
+	/* commit a frame with frame callback, wait for it to be presented */
+	void (*frame)(void *state, int frame);
+	void (*destroy)(void *state);
+};
+
+static void
+bench_run(const struct bench_scene *scene)
+{
+	struct bench_sample begin, end;
+	int frames = bench_frames();
+	void *state;
+	int i;
+
+	state = scene->create();
+
+	for (i = 0; i < BENCH_WARMUP_FRAMES; i++)
+		scene->frame(state, i);
+
+	bench_sample_take(&begin);
+	for (i = 0; i < frames; i++)
+		scene->frame(state, BENCH_WARMUP_FRAMES + i);
+	bench_sample_take(&end);
+
+	bench_report(scene->name, frames, &begin, &end);
+
+	scene->destroy(state);
+}
+
+/* With done, also request a frame callback setting it. */
+static void
+surface_commit_full(struct surface *surface, int *done)
+{
+	wl_surface_attach(surface->wl_surface, surface->buffer->proxy, 0, 0);
+	wl_surface_damage_buffer(surface->wl_surface, 0, 0,
+				 surface->width, surface->height);
+	if (done)
+		frame_callback_set(surface->wl_surface, done);
+	wl_surface_commit(surface->wl_surface);
+}
+
+/*
+ * Many clients with one shm surface each, all updated every frame.
+ */
+
+#define SHM_CLIENTS 16
+#define SHM_CLIENT_SIZE 192
+
+struct shm_clients {
+	struct client *clients[SHM_CLIENTS];
+};
+
+static void *
+shm_clients_create(void)
+{
+	struct shm_clients *s = xzalloc(sizeof *s);
+	int columns = BENCH_WIDTH / SHM_CLIENT_SIZE;
+	int i;
+
+	for (i = 0; i < SHM_CLIENTS; i++)
+		s->clients[i] = create_client_and_test_surface(
+			(i % columns) * SHM_CLIENT_SIZE + i,
+			(i / columns) * SHM_CLIENT_SIZE + i,
+			SHM_CLIENT_SIZE, SHM_CLIENT_SIZE);
+
+	return s;
+}
+
+static void
+shm_clients_frame(void *state, int frame)
+{
+	struct shm_clients *s = state;
+	int done[SHM_CLIENTS];
+	int i;
+
+	for (i = 0; i < SHM_CLIENTS; i++) {
+		surface_commit_full(s->clients[i]->surface, &done[i]);
+		wl_display_flush(s->clients[i]->wl_display);
+	}
+
+	for (i = 0; i < SHM_CLIENTS; i++)
+		frame_callback_wait(s->clients[i], &done[i]);
+}
+
+static void
+shm_clients_destroy(void *state)
+{
+	struct shm_clients *s = state;
+	int i;
+
+	for (i = 0; i < SHM_CLIENTS; i++)
+		client_destroy(s->clients[i]);
+	free(s);
+}
+
+/*
+ * One client with a tree of synchronized subsurfaces, all updated every
+ * frame.
+ */
+
+#define SUBSURFACE_FANOUT 4
+#define SUBSURFACE_DEPTH 3
+#define SUBSURFACE_MAX 84 /* 4 + 16 + 64 */
+#define SUBSURFACE_SIZE 48
+
+struct subsurface_tree {
+	struct client *client;
+	struct wl_subcompositor *subco;
+	int count;
+	struct surface *surfaces[SUBSURFACE_MAX];
+	struct wl_subsurface *subsurfaces[SUBSURFACE_MAX];
+};
+
+static void
+subsurface_tree_add(struct subsurface_tree *s, struct wl_surface *parent,
+		    int depth)
+{
+	struct surface *surface;
+	int i;
+
+	if (depth == SUBSURFACE_DEPTH)
+		return;
+
+	for (i = 0; i < SUBSURFACE_FANOUT; i++) {
+		assert(s->count < SUBSURFACE_MAX);
+
+		surface = create_test_surface(s->client);
+		surface->width = SUBSURFACE_SIZE;
+		surface->height = SUBSURFACE_SIZE;
+		surface->buffer = create_shm_buffer_a8r8g8b8(s->client,
+							     SUBSURFACE_SIZE,
+							     SUBSURFACE_SIZE);
+		s->subsurfaces[s->count] =
+			wl_subcompositor_get_subsurface(s->subco,
+							surface->wl_surface,
+							parent);
+		wl_subsurface_set_position(s->subsurfaces[s->count],
+					   (i + 1) * SUBSURFACE_SIZE / 2,
+					   (depth + 1) * SUBSURFACE_SIZE / 2);
+		s->surfaces[s->count++] = surface;
+
+		subsurface_tree_add(s, surface->wl_surface, depth + 1);
+	}
+}
+
+static void *
+subsurface_tree_create(void)
+{
+	struct subsurface_tree *s = xzalloc(sizeof *s);
+
+	s->client = create_client_and_test_surface(0, 0, BENCH_WIDTH / 2,
+						   BENCH_HEIGHT / 2);
+	s->subco = bind_to_singleton_global(s->client,
+					    &wl_subcompositor_interface, 1);
+	subsurface_tree_add(s, s->client->surface->wl_surface, 0);
+
+	return s;
+}
+
+static void
+subsurface_tree_frame(void *state, int frame)
+{
+	struct subsurface_tree *s = state;
+	int done;
+	int i;
+
+	/* children first, synchronized state is applied by the root */
+	for (i = s->count - 1; i >= 0; i--)
+		surface_commit_full(s->surfaces[i], NULL);
+
+	surface_commit_full(s->client->surface, &done);
+	frame_callback_wait(s->client, &done);
+}
+
+static void
+subsurface_tree_destroy(void *state)
+{
+	struct subsurface_tree *s = state;
+	int i;
+
+	for (i = 0; i < s->count; i++) {
+		wl_subsurface_destroy(s->subsurfaces[i]);
+		surface_destroy(s->surfaces[i]);
+	}
+	wl_subcompositor_destroy(s->subco);
+	client_destroy(s->client);
+	free(s);
+}
+
+/*
+ * Surfaces with buffer transforms, buffer scale and viewport scaling,
+ * which the renderers sample through a non-identity texture transform.
+ * The test shell cannot rotate views, so these stand in for transformed
+ * views.
+ */
+
+#define TRANSFORMED_SURFACES 8
+#define TRANSFORMED_SIZE 160
+
+struct transformed_surfaces {
+	struct client *client;
+	struct wl_subcompositor *subco;
+	struct wp_viewporter *viewporter;
+	struct surface *surfaces[TRANSFORMED_SURFACES];
+	struct wl_subsurface *subsurfaces[TRANSFORMED_SURFACES];
+	struct wp_viewport *viewports[TRANSFORMED_SURFACES];
+};
+
+static void *
+transformed_surfaces_create(void)
+{
+	struct transformed_surfaces *s = xzalloc(sizeof *s);
+	struct surface *surface;
+	int i;
+
+	s->client = create_client_and_test_surface(0, 0, BENCH_WIDTH,
+						   BENCH_HEIGHT);
+	s->subco = bind_to_singleton_global(s->client,
+					    &wl_subcompositor_interface, 1);
+	s->viewporter = bind_to_singleton_global(s->client,
+						 &wp_viewporter_interface, 1);
+
+	for (i = 0; i < TRANSFORMED_SURFACES; i++) {
+		surface = create_test_surface(s->client);
+		surface->width = TRANSFORMED_SIZE;
+		surface->height = TRANSFORMED_SIZE;
+		surface->buffer = create_shm_buffer_a8r8g8b8(s->client,
+							     TRANSFORMED_SIZE,
+							     TRANSFORMED_SIZE);
+		s->subsurfaces[i] =
+			wl_subcompositor_get_subsurface(s->subco,
+							surface->wl_surface,
+							s->client->surface->wl_surface);
+		wl_subsurface_set_desync(s->subsurfaces[i]);
+		wl_subsurface_set_position(s->subsurfaces[i],
+					   (i % 4) * (BENCH_WIDTH / 4),
+					   (i / 4) * (BENCH_HEIGHT / 2));
+
+		/* one of each wl_output_transform */
+		wl_surface_set_buffer_transform(surface->wl_surface, i);
+		wl_surface_set_buffer_scale(surface->wl_surface, 1 + i % 2);
+		s->viewports[i] =
+			wp_viewporter_get_viewport(s->viewporter,
+						   surface->wl_surface);
+		wp_viewport_set_destination(s->viewports[i],
+					    BENCH_WIDTH / 4 - 8,
+					    BENCH_HEIGHT / 2 - 8);
+		s->surfaces[i] = surface;
+	}
+
+	return s;
+}
+
+static void
+transformed_surfaces_frame(void *state, int frame)
+{
+	struct transformed_surfaces *s = state;
+	int done;
+	int i;
+
+	for (i = 0; i < TRANSFORMED_SURFACES; i++)
+		surface_commit_full(s->surfaces[i], NULL);
+
+	surface_commit_full(s->client->surface, &done);
+	frame_callback_wait(s->client, &done);
+}
+
+static void
+transformed_surfaces_destroy(void *state)
+{
+	struct transformed_surfaces *s = state;
+	int i;
+
+	for (i = 0; i < TRANSFORMED_SURFACES; i++) {
+		wp_viewport_destroy(s->viewports[i]);
+		wl_subsurface_destroy(s->subsurfaces[i]);
+		surface_destroy(s->surfaces[i]);
+	}
+	wp_viewporter_destroy(s->viewporter);
+	wl_subcompositor_destroy(s->subco);
+	client_destroy(s->client);
+	free(s);
+}
+
+/*
+ * One output sized surface, damaged in many small scattered rectangles
+ * every frame.
+ */
+
+#define DAMAGE_RECTS 256
+#define DAMAGE_RECT_SIZE 16
+
+static void *
+heavy_damage_create(void)
+{
+	return create_client_and_test_surface(0, 0, BENCH_WIDTH,
+					      BENCH_HEIGHT);
+}
+
+static void
+heavy_damage_frame(void *state, int frame)
+{
+	struct client *client = state;
+	struct surface *surface = client->surface;
+	uint32_t seed = frame * 2654435761u;
+	int done;
+	int i;
+
+	wl_surface_attach(surface->wl_surface, surface->buffer->proxy, 0, 0);
+	for (i = 0; i < DAMAGE_RECTS; i++) {
+		seed = seed * 1103515245 + 12345;
+		wl_surface_damage_buffer(surface->wl_surface,
+					 (seed >> 8) % (BENCH_WIDTH - DAMAGE_RECT_SIZE),
+					 (seed >> 20) % (BENCH_HEIGHT - DAMAGE_RECT_SIZE),
+					 DAMAGE_RECT_SIZE, DAMAGE_RECT_SIZE);
+	}
+	frame_callback_set(surface->wl_surface, &done);
+	wl_surface_commit(surface->wl_surface);
+
+	frame_callback_wait(client, &done);
+}
+
+static void
+heavy_damage_destroy(void *state)
+{
+	client_destroy(state);
+}
+
+static const struct bench_scene scenes[] = {
+	{ "shm-clients", shm_clients_create, shm_clients_frame,
+	  shm_clients_destroy },
+	{ "subsurface-tree", subsurface_tree_create, subsurface_tree_frame,
+	  subsurface_tree_destroy },
+	{ "transformed-surfaces", transformed_surfaces_create,
+	  transformed_surfaces_frame, transformed_surfaces_destroy },
+	{ "heavy-damage", heavy_damage_create, heavy_damage_frame,
+	  heavy_damage_destroy },
+};
+
+TEST_P(bench, scenes)
+{
+	bench_run(data);
+}
@@ -100,7 +100,12 @@ get_lock_path(void)
 	char *lock_path;
 
 	suffix = "weston-test-suite-drm-lock";
-	env_path = getenv("XDG_RUNTIME_DIR");
+
+	/* Set by the test runner when fixtures run in private runtime
+	 * directories, so that the lock is still shared by everyone. */
+	env_path = getenv("WESTON_TEST_SUITE_LOCK_DIR");
+	if (!env_path)
+		env_path = getenv("XDG_RUNTIME_DIR");
 	if (!env_path) {
 		fprintf(stderr, "Failed to compute lock file path. " \
 			"XDG_RUNTIME_DIR is not set.\n");
@@ -178,6 +183,8 @@ compositor_setup_defaults_(struct compositor_setup *setup,
 		.height = 240,
 		.scale = 1,
 		.transform = WL_OUTPUT_TRANSFORM_NORMAL,
+		.refresh = 0,
+		.unthrottled = false,
 		.config_file = NULL,
 		.extra_module = NULL,
 		.logging_scopes = NULL,
@@ -390,6 +397,17 @@ execute_compositor(const struct compositor_setup *setup,
 		prog_args_take(&args, tmp);
 	}
 
+	if (setup->refresh != 0) {
+		assert(setup->backend == WESTON_BACKEND_HEADLESS);
+		asprintf(&tmp, "--refresh=%d", setup->refresh);
+		prog_args_take(&args, tmp);
+	}
+
+	if (setup->unthrottled) {
+		assert(setup->backend == WESTON_BACKEND_HEADLESS);
+		prog_args_take(&args, strdup("--unthrottled"));
+	}
+
 	if (setup->config_file) {
 		asprintf(&tmp, "--config=%s", setup->config_file);
 		prog_args_take(&args, tmp);
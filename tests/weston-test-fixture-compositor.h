@@ -87,6 +87,12 @@ struct compositor_setup {
 	int scale;
 	/** Default output transform, one of WL_OUTPUT_TRANSFORM_*. */
 	enum wl_output_transform transform;
+	/** Output refresh rate in mHz, headless backend only,
+	 * or 0 for backend default. */
+	int refresh;
+	/** Whether to repaint as fast as possible rather than at the
+	 * refresh rate, headless backend only. */
+	bool unthrottled;
 	/** The absolute path to \c weston.ini to use,
 	 * or NULL for \c --no-config . */
 	const char *config_file;
@@ -116,6 +122,8 @@ compositor_setup_defaults_(struct compositor_setup *setup,
  * - height: 240
  * - scale: 1
  * - transform: WL_OUTPUT_TRANSFORM_NORMAL
+ * - refresh: backend default
+ * - unthrottled: no
  * - config_file: none
  * - extra_module: none
  * - logging_scopes: compositor defaults
@@ -26,6 +26,7 @@
 #include "config.h"
 
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -34,6 +35,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <getopt.h>
+#include <dirent.h>
 
 #include "weston-test-runner.h"
 #include "weston-testsuite-data.h"
@@ -165,6 +167,7 @@ struct weston_test_harness {
 	int32_t fixt_ind;
 	char *chosen_testname;
 	int32_t case_ind;
+	int jobs;
 
 	struct wet_testsuite_data data;
 };
@@ -315,6 +318,8 @@ help(const char *exe)
 		"Options:\n"
 		"  -f, --fixture N  Run only fixture index N. Indices start from 1.\n"
 		"  -h, --help       Print this help and exit with success.\n"
+		"  -j, --jobs N     Run up to N fixtures concurrently, 0 for one per CPU.\n"
+		"                   Defaults to $WESTON_TEST_JOBS, or 1.\n"
 		"  -l, --list       List all tests in this executable and exit with success.\n"
 		"testname:          Optional; name of the test to execute instead of all tests.\n"
 		"index:             Optional; for a multi-case test, run the given case only.\n",
@@ -328,11 +333,21 @@ parse_command_line(struct weston_test_harness *harness, int argc, char **argv)
 	static const struct option opts[] = {
 		{ "fixture", required_argument, NULL,      'f' },
 		{ "help",    no_argument,       NULL,      'h' },
+		{ "jobs",    required_argument, NULL,      'j' },
 		{ "list",    no_argument,       NULL,      'l' },
 		{ 0,         0,                 NULL,      0  }
 	};
+	const char *jobs_env;
 
-	while ((c = getopt_long(argc, argv, "f:hl", opts, NULL)) != -1) {
+	jobs_env = getenv("WESTON_TEST_JOBS");
+	if (jobs_env && !safe_strtoint(jobs_env, &harness->jobs)) {
+		fprintf(stderr,
+			"Error: '%s' does not look like a number (WESTON_TEST_JOBS).\n",
+			jobs_env);
+		exit(RESULT_HARD_ERROR);
+	}
+
+	while ((c = getopt_long(argc, argv, "f:hj:l", opts, NULL)) != -1) {
 		switch (c) {
 		case 'f':
 			if (!safe_strtoint(optarg, &harness->fixt_ind)) {
@@ -346,6 +361,14 @@ parse_command_line(struct weston_test_harness *harness, int argc, char **argv)
 		case 'h':
 			help(argv[0]);
 			exit(RESULT_OK);
+		case 'j':
+			if (!safe_strtoint(optarg, &harness->jobs)) {
+				fprintf(stderr,
+					"Error: '%s' does not look like a number (command line).\n",
+					optarg);
+				exit(RESULT_HARD_ERROR);
+			}
+			break;
 		case 'l':
 			list_tests();
 			exit(RESULT_OK);
@@ -370,6 +393,13 @@ parse_command_line(struct weston_test_harness *harness, int argc, char **argv)
 		optind++;
 	}
 
+	if (harness->jobs < 0) {
+		fprintf(stderr, "Error: the number of jobs cannot be negative.\n");
+		exit(RESULT_HARD_ERROR);
+	}
+	if (harness->jobs == 0)
+		harness->jobs = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
 	if (optind < argc) {
 		fprintf(stderr, "Unexpected extra arguments given (command line).\n\n");
 		help(argv[0]);
@@ -388,6 +418,7 @@ weston_test_harness_create(int argc, char **argv)
 
 	harness->fixt_ind = -1;
 	harness->case_ind = -1;
+	harness->jobs = 1;
 	parse_command_line(harness, argc, argv);
 
 	fsa = fixture_setup_array_get_();
@@ -564,21 +595,274 @@ fixture_report(const struct wet_testsuite_data *d, enum test_result_code ret)
 		d->passed, d->skipped, d->failed, d->total);
 }
 
+/** Run one fixture and return its result for the program exit status */
+static enum test_result_code
+run_fixture(struct weston_test_harness *harness, int fi)
+{
+	const struct fixture_setup_array *fsa = fixture_setup_array_get_();
+	const void *arg = (const char *)fsa->array + fi * fsa->element_size;
+	enum test_result_code ret;
+
+	testlog("--- Fixture %d...\n", fi + 1);
+	harness->data.fixture_iteration = fi;
+	harness->data.passed = 0;
+	harness->data.skipped = 0;
+	harness->data.failed = 0;
+
+	ret = fixture_setup_run_(harness, arg);
+	fixture_report(&harness->data, ret);
+
+	if (ret == RESULT_SKIP) {
+		tap_skip_fixture(&harness->data);
+		return RESULT_OK;
+	}
+
+	if (ret != RESULT_OK)
+		return ret;
+
+	return counts_to_result(&harness->data);
+}
+
+static void
+merge_result(enum test_result_code *result, enum test_result_code ret)
+{
+	if (ret != RESULT_OK && *result != RESULT_HARD_ERROR)
+		*result = ret;
+}
+
+/** A fixture running in a child process
+ *
+ * The child writes its TAP output and log into the files 'out' and 'err',
+ * which the parent copies to its own stdout and stderr in fixture order,
+ * so that the combined output is the same as from a serial run.
+ *
+ * Each child gets a private XDG_RUNTIME_DIR so that the compositor socket,
+ * its lock file and anything tests create there cannot collide with the
+ * other fixtures running at the same time.
+ *
+ * \ingroup testharness_private
+ */
+struct fixture_job {
+	pid_t pid;
+	FILE *out;
+	FILE *err;
+	char *runtime_dir;
+	bool done;
+	enum test_result_code result;
+};
+
+static void
+remove_runtime_dir(const char *path)
+{
+	struct dirent *ent;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((ent = readdir(dir))) {
+		if (strcmp(ent->d_name, ".") == 0 ||
+		    strcmp(ent->d_name, "..") == 0)
+			continue;
+		if (unlinkat(dirfd(dir), ent->d_name, 0) < 0)
+			testlog("Could not remove %s/%s: %s\n",
+				path, ent->d_name, strerror(errno));
+	}
+	closedir(dir);
+
+	rmdir(path);
+}
+
+static void
+fixture_job_start(struct weston_test_harness *harness,
+		  struct fixture_job *job, int fi, int counter)
+{
+	const char *parent_dir = getenv("XDG_RUNTIME_DIR");
+	enum test_result_code ret;
+
+	job->done = true;
+	job->result = RESULT_HARD_ERROR;
+
+	if (!parent_dir) {
+		testlog("Cannot run fixtures in parallel: "
+			"XDG_RUNTIME_DIR is not set.\n");
+		return;
+	}
+
+	if (asprintf(&job->runtime_dir, "%s/weston-test-XXXXXX",
+		     parent_dir) < 0) {
+		job->runtime_dir = NULL;
+		return;
+	}
+	if (!mkdtemp(job->runtime_dir)) {
+		testlog("Could not create a runtime directory %s: %s\n",
+			job->runtime_dir, strerror(errno));
+		return;
+	}
+
+	job->out = tmpfile();
+	job->err = tmpfile();
+	if (!job->out || !job->err) {
+		testlog("Could not create output files: %s\n",
+			strerror(errno));
+		return;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+
+	job->pid = fork();
+	if (job->pid < 0) {
+		testlog("fork() failed: %s\n", strerror(errno));
+		return;
+	}
+
+	if (job->pid == 0) {
+		dup2(fileno(job->out), STDOUT_FILENO);
+		dup2(fileno(job->err), STDERR_FILENO);
+		/* keep the TAP lines written before a crash */
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		setenv("XDG_RUNTIME_DIR", job->runtime_dir, 1);
+
+		harness->data.counter = counter;
+		ret = run_fixture(harness, fi);
+
+		fflush(stdout);
+		fflush(stderr);
+		_exit(ret);
+	}
+
+	job->done = false;
+}
+
+static enum test_result_code
+status_to_result(int status)
+{
+	if (WIFEXITED(status)) {
+		switch (WEXITSTATUS(status)) {
+		case RESULT_OK:
+			return RESULT_OK;
+		case RESULT_FAIL:
+			return RESULT_FAIL;
+		}
+	} else if (WIFSIGNALED(status)) {
+		testlog("Fixture process killed by signal %d.\n",
+			WTERMSIG(status));
+	}
+
+	return RESULT_HARD_ERROR;
+}
+
+static void
+copy_output(FILE *from, FILE *to)
+{
+	char buf[4096];
+	size_t len;
+
+	rewind(from);
+	while ((len = fread(buf, 1, sizeof buf, from)) > 0)
+		fwrite(buf, 1, len, to);
+	fflush(to);
+}
+
+static void
+fixture_job_finish(struct fixture_job *job)
+{
+	if (job->out) {
+		copy_output(job->out, stdout);
+		fclose(job->out);
+	}
+	if (job->err) {
+		copy_output(job->err, stderr);
+		fclose(job->err);
+	}
+	if (job->runtime_dir) {
+		remove_runtime_dir(job->runtime_dir);
+		free(job->runtime_dir);
+	}
+}
+
+/** Run fixtures [fi, fi_end) in up to harness->jobs child processes */
+static enum test_result_code
+run_fixtures_parallel(struct weston_test_harness *harness, int fi, int fi_end)
+{
+	enum test_result_code result = RESULT_OK;
+	struct fixture_job *jobs;
+	int count = fi_end - fi;
+	int next_start = 0;
+	int next_report = 0;
+	int running = 0;
+
+	jobs = zalloc(count * sizeof(*jobs));
+	assert(jobs);
+
+	/* Children take the DRM lock from the shared runtime directory */
+	if (getenv("XDG_RUNTIME_DIR"))
+		setenv("WESTON_TEST_SUITE_LOCK_DIR",
+		       getenv("XDG_RUNTIME_DIR"), 0);
+
+	while (next_report < count) {
+		int status;
+		pid_t pid;
+		int i;
+
+		while (running < harness->jobs && next_start < count) {
+			struct fixture_job *job = &jobs[next_start];
+
+			fixture_job_start(harness, job, fi + next_start,
+					  harness->data.counter +
+					  next_start * harness->data.total);
+			if (!job->done)
+				running++;
+			next_start++;
+		}
+
+		while (next_report < count && jobs[next_report].done) {
+			fixture_job_finish(&jobs[next_report]);
+			merge_result(&result, jobs[next_report].result);
+			next_report++;
+		}
+
+		if (running == 0)
+			continue;
+
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			testlog("waitpid() failed: %s\n", strerror(errno));
+			abort();
+		}
+
+		for (i = 0; i < next_start; i++) {
+			if (jobs[i].done || jobs[i].pid != pid)
+				continue;
+
+			jobs[i].done = true;
+			jobs[i].result = status_to_result(status);
+			running--;
+			break;
+		}
+	}
+
+	free(jobs);
+
+	return result;
+}
+
 int
 main(int argc, char *argv[])
 {
 	struct weston_test_harness *harness;
-	enum test_result_code ret;
 	enum test_result_code result = RESULT_OK;
 	const struct fixture_setup_array *fsa;
-	const char *array_data;
 	int fi;
 	int fi_end;
 
 	harness = weston_test_harness_create(argc, argv);
 
 	fsa = fixture_setup_array_get_();
-	array_data = fsa->array;
 
 	if (harness->fixt_ind == -1) {
 		fi = 0;
@@ -591,27 +875,13 @@ main(int argc, char *argv[])
 	tap_plan(&harness->data, fi_end - fi);
 	testlog("Iterating through %d fixtures.\n", fi_end - fi);
 
-	for (; fi < fi_end; fi++) {
-		const void *arg = array_data + fi * fsa->element_size;
-
-		testlog("--- Fixture %d...\n", fi + 1);
-		harness->data.fixture_iteration = fi;
-		harness->data.passed = 0;
-		harness->data.skipped = 0;
-		harness->data.failed = 0;
-
-		ret = fixture_setup_run_(harness, arg);
-		fixture_report(&harness->data, ret);
-
-		if (ret == RESULT_SKIP) {
-			tap_skip_fixture(&harness->data);
-			continue;
-		}
-
-		if (ret != RESULT_OK && result != RESULT_HARD_ERROR)
-			result = ret;
-		else if (counts_to_result(&harness->data) != RESULT_OK)
-			result = RESULT_FAIL;
+	if (harness->jobs > 1 && fi_end - fi > 1) {
+		testlog("Running up to %d fixtures in parallel.\n",
+			harness->jobs);
+		result = run_fixtures_parallel(harness, fi, fi_end);
+	} else {
+		for (; fi < fi_end; fi++)
+			merge_result(&result, run_fixture(harness, fi));
 	}
 
 	weston_test_harness_destroy(harness);
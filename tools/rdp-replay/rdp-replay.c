@@ -0,0 +1,646 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Replays a capture of the RDP backend, recorded with
+ *
+ *	WESTON_RDP_TRACE_FILE=/tmp/rdp.trace weston --backend=rdp-backend.so
+ *
+ * through the same surface command encoder (rdpsurfcmd.c, rdpcodec.c and
+ * rdpcache.c) the backend uses, against a loopback RDPGFX channel which
+ * only counts the bytes of each PDU. One JSON object is printed per frame
+ * with the bytes emitted, the time spent encoding and the readback time
+ * spent at capture, followed by a summary.
+ *
+ * Encoding runs on the calling thread, one job at a time, so encode time
+ * is the CPU cost of the frame rather than its latency on the encoder
+ * threads.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "libweston/backend-rdp/rdp.h"
+#include "libweston/backend-rdp/rdptrace.h"
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/xalloc.h"
+
+/* MS-RDPEGFX 2.2.1.5 RDPGFX_HEADER */
+#define RDPGFX_PDU_HEADER_SIZE 8
+
+struct replay_window {
+	struct wl_list link; /* replay::window_list */
+	uint32_t window_id;
+	uint16_t surface_id;
+	int width;
+	int height;
+	struct weston_surface_rail_state rail_state;
+};
+
+struct replay_frame {
+	uint32_t frame_id;
+	uint32_t commands;
+	uint64_t bytes;
+	uint64_t encode_nsec;
+	uint64_t readback_nsec;
+	uint64_t end_time_nsec; /* trace time of FRAME_END, 0 until then */
+	int64_t ack_nsec; /* FRAME_END to ack, -1 if not acknowledged */
+	uint32_t queue_depth;
+};
+
+struct replay {
+	struct rdp_backend backend;
+	RdpPeerContext *peer_ctx;
+	RdpgfxServerContext gfx_ctx;
+	struct rdp_gfx_codec_context codec;
+
+	struct wl_list window_list;
+	uint16_t next_surface_id;
+
+	struct replay_frame *frames;
+	int num_frames;
+	int max_frames;
+	struct replay_frame *current; /* frame whose PDUs are being counted */
+
+	int codec_override; /* -1 to use the captured one */
+	bool no_cache;
+	bool summary_only;
+};
+
+/* Stubs of the backend parts the encoder touches, rdputil.c and libweston
+ * would pull in the whole compositor. */
+
+void
+rdp_debug_print(struct weston_log_scope *log_scope, bool cont, char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+void
+assert_compositor_thread(struct rdp_backend *b)
+{
+}
+
+void *
+rdp_staging_buffer_reserve(struct weston_rdp_staging_buffer *buffer, size_t size)
+{
+	if (buffer->size < size) {
+		free(buffer->data);
+		buffer->data = xmalloc(size);
+		buffer->size = size;
+	}
+
+	return buffer->data;
+}
+
+void
+rdp_staging_buffer_release(struct weston_rdp_staging_buffer *buffer)
+{
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->size = 0;
+}
+
+void
+weston_compositor_read_presentation_clock(const struct weston_compositor *compositor,
+					  struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/* lossy content is counted as sent, refinement is not replayed. */
+void
+rdp_rail_schedule_refine(RdpPeerContext *peer_ctx)
+{
+}
+
+/* no link estimate in a replay, codec choice is the unconstrained one. */
+bool
+rdp_link_is_constrained(const struct rdp_link_estimate *link)
+{
+	return false;
+}
+
+void
+weston_surface_client_stats_add(struct weston_surface *surface,
+				enum weston_client_stat stat, uint64_t value)
+{
+}
+
+static void
+replay_count(struct replay *r, uint64_t bytes)
+{
+	if (r->current)
+		r->current->bytes += RDPGFX_PDU_HEADER_SIZE + bytes;
+}
+
+/* sizes of PDU bodies are from MS-RDPEGFX 2.2.2 */
+
+static UINT
+replay_surface_command(RdpgfxServerContext *context,
+		       const RDPGFX_SURFACE_COMMAND *cmd)
+{
+	struct replay *r = context->custom;
+	uint64_t bytes = 17 + cmd->length; /* RDPGFX_WIRE_TO_SURFACE_PDU_1 */
+
+	if (cmd->codecId == RDPGFX_CODECID_AVC420 && cmd->extra) {
+		const RDPGFX_AVC420_BITMAP_STREAM *avc = cmd->extra;
+
+		/* RFX_AVC420_METABLOCK */
+		bytes += 4 + avc->meta.numRegionRects * (8 + 2);
+	}
+	replay_count(r, bytes);
+
+	return CHANNEL_RC_OK;
+}
+
+static UINT
+replay_surface_to_surface(RdpgfxServerContext *context,
+			  const RDPGFX_SURFACE_TO_SURFACE_PDU *pdu)
+{
+	replay_count(context->custom, 14 + 4 * pdu->destPtsCount);
+
+	return CHANNEL_RC_OK;
+}
+
+static UINT
+replay_surface_to_cache(RdpgfxServerContext *context,
+			const RDPGFX_SURFACE_TO_CACHE_PDU *pdu)
+{
+	replay_count(context->custom, 20);
+
+	return CHANNEL_RC_OK;
+}
+
+static UINT
+replay_cache_to_surface(RdpgfxServerContext *context,
+			const RDPGFX_CACHE_TO_SURFACE_PDU *pdu)
+{
+	replay_count(context->custom, 6 + 4 * pdu->destPtsCount);
+
+	return CHANNEL_RC_OK;
+}
+
+static void
+replay_window_release(struct replay_window *window)
+{
+	struct weston_surface_rail_state *rail_state = &window->rail_state;
+
+	rdp_gfx_codec_avc_destroy(rail_state);
+	rdp_staging_buffer_release(&rail_state->staging_damage);
+	rdp_staging_buffer_release(&rail_state->staging_alpha);
+	rdp_staging_buffer_release(&rail_state->staging_surface);
+	memset(rail_state, 0, sizeof *rail_state);
+}
+
+static void
+replay_destroy_windows(struct replay *r)
+{
+	struct replay_window *window, *tmp;
+
+	wl_list_for_each_safe(window, tmp, &r->window_list, link) {
+		replay_window_release(window);
+		wl_list_remove(&window->link);
+		free(window);
+	}
+}
+
+/* Window of the command, a new surface is made, as the backend does,
+ * when the window is resized. */
+static struct replay_window *
+replay_get_window(struct replay *r, const struct rdp_trace_surface_command *cmd)
+{
+	struct replay_window *window;
+
+	wl_list_for_each(window, &r->window_list, link)
+		if (window->window_id == cmd->window_id)
+			break;
+
+	if (&window->link == &r->window_list) {
+		window = xzalloc(sizeof *window);
+		window->window_id = cmd->window_id;
+		wl_list_insert(&r->window_list, &window->link);
+	}
+
+	if (window->width != cmd->surface_width ||
+	    window->height != cmd->surface_height) {
+		replay_window_release(window);
+		window->surface_id = ++r->next_surface_id;
+		window->width = cmd->surface_width;
+		window->height = cmd->surface_height;
+	}
+
+	return window;
+}
+
+static struct replay_frame *
+replay_get_frame(struct replay *r, uint32_t frame_id, bool create)
+{
+	struct replay_frame *frame;
+
+	/* acks lag a few frames at most, look from the end. */
+	for (int i = r->num_frames - 1; i >= 0; i--)
+		if (r->frames[i].frame_id == frame_id)
+			return &r->frames[i];
+
+	if (!create)
+		return NULL;
+
+	if (r->num_frames == r->max_frames) {
+		r->max_frames = MAX(r->max_frames * 2, 256);
+		r->frames = xrealloc(r->frames, sizeof(*r->frames) * r->max_frames);
+	}
+	frame = &r->frames[r->num_frames++];
+	memset(frame, 0, sizeof *frame);
+	frame->frame_id = frame_id;
+	frame->ack_nsec = -1;
+	/* RDPGFX_START_FRAME_PDU and RDPGFX_END_FRAME_PDU */
+	frame->bytes = RDPGFX_PDU_HEADER_SIZE + 8 + RDPGFX_PDU_HEADER_SIZE + 4;
+
+	return frame;
+}
+
+static int
+replay_config(struct replay *r, const void *payload, uint32_t size)
+{
+	const struct rdp_trace_config *config = payload;
+	RdpPeerContext *peer_ctx = r->peer_ctx;
+
+	if (size < sizeof *config)
+		return -1;
+
+	/* new connection, client starts with no surfaces and empty cache */
+	replay_destroy_windows(r);
+	rdp_gfx_cache_destroy(&peer_ctx->gfx_cache);
+
+	r->backend.gfx_codec = r->codec_override >= 0 ?
+			       r->codec_override : config->gfx_codec;
+	r->backend.gfx_codec_progressive_min_area = config->progressive_min_area;
+	rdp_gfx_codec_set_caps(peer_ctx, config->caps_version, config->caps_flags);
+	if ((config->flags & RDP_TRACE_CONFIG_CACHE) && !r->no_cache &&
+	    !rdp_gfx_cache_reset(&peer_ctx->gfx_cache, config->caps_flags))
+		fprintf(stderr, "failed to create bitmap cache\n");
+
+	return 0;
+}
+
+static int
+replay_surface_command_record(struct replay *r, const void *payload,
+			      uint32_t size)
+{
+	const struct rdp_trace_surface_command *cmd = payload;
+	struct rdp_rail_surface_command_job *job;
+	struct replay_window *window;
+	const pixman_box32_t *rects;
+	const BYTE *bits;
+	struct timespec begin, end;
+	int width, height;
+	size_t data_size;
+
+	if (size < sizeof *cmd)
+		return -1;
+
+	width = cmd->x2 - cmd->x1;
+	height = cmd->y2 - cmd->y1;
+	if (width <= 0 || height <= 0 ||
+	    cmd->x1 < 0 || cmd->y1 < 0 ||
+	    cmd->x2 > cmd->surface_width || cmd->y2 > cmd->surface_height)
+		return -1;
+	data_size = (size_t)width * 4 * height;
+	if (size != sizeof *cmd + sizeof(*rects) * cmd->num_damage_rects + data_size)
+		return -1;
+	rects = (const pixman_box32_t *)(cmd + 1);
+	bits = (const BYTE *)(rects + cmd->num_damage_rects);
+
+	window = replay_get_window(r, cmd);
+	r->current = replay_get_frame(r, cmd->frame_id, true);
+	r->current->commands++;
+	r->current->readback_nsec += cmd->readback_nsec;
+
+	job = xzalloc(sizeof *job);
+	job->base.peerCtx = r->peer_ctx;
+	job->rail_state = &window->rail_state;
+	job->window_id = cmd->window_id;
+	job->surface_id = window->surface_id;
+	job->frame_id = cmd->frame_id;
+	job->surface_width = cmd->surface_width;
+	job->surface_height = cmd->surface_height;
+	job->rect.x1 = cmd->x1;
+	job->rect.y1 = cmd->y1;
+	job->rect.x2 = cmd->x2;
+	job->rect.y2 = cmd->y2;
+	job->hasAlpha = cmd->flags & RDP_TRACE_COMMAND_HAS_ALPHA;
+	job->useAvc = cmd->flags & RDP_TRACE_COMMAND_USE_AVC;
+	job->useStagingSurface = cmd->flags & RDP_TRACE_COMMAND_STAGING;
+	job->detectScroll = cmd->flags & RDP_TRACE_COMMAND_SCROLL;
+	job->stride = width * 4;
+	/* stands in for weston_surface_copy_content, not part of encode */
+	job->data = rdp_staging_buffer_reserve(&window->rail_state.staging_damage,
+					       data_size);
+	memcpy(job->data, bits, data_size);
+	pixman_region32_init_rects(&job->damage, rects, cmd->num_damage_rects);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	if ((cmd->flags & RDP_TRACE_COMMAND_CACHE) &&
+	    r->peer_ctx->gfx_cache.numSlots)
+		rdp_rail_surface_command_lookup_cache(r->peer_ctx, job);
+	rdp_rail_surface_command_encode(&job->base, &r->codec);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	r->current->encode_nsec += timespec_sub_to_nsec(&end, &begin);
+
+	/* sends through the loopback channel, and frees job */
+	rdp_rail_surface_command_done(false, &job->base);
+	r->current = NULL;
+
+	return 0;
+}
+
+static int
+replay_frame_end(struct replay *r, const struct rdp_trace_record *rec,
+		 const void *payload)
+{
+	const struct rdp_trace_frame *end = payload;
+	struct replay_frame *frame;
+
+	if (rec->size < sizeof *end)
+		return -1;
+
+	frame = replay_get_frame(r, end->frame_id, true);
+	frame->end_time_nsec = rec->time_nsec;
+
+	return 0;
+}
+
+static int
+replay_frame_ack(struct replay *r, const struct rdp_trace_record *rec,
+		 const void *payload)
+{
+	const struct rdp_trace_frame_ack *ack = payload;
+	struct replay_frame *frame;
+
+	if (rec->size < sizeof *ack)
+		return -1;
+
+	/* acks of frames before the capture started have no frame */
+	frame = replay_get_frame(r, ack->frame_id, false);
+	if (frame && frame->end_time_nsec &&
+	    rec->time_nsec >= frame->end_time_nsec) {
+		frame->ack_nsec = rec->time_nsec - frame->end_time_nsec;
+		frame->queue_depth = ack->queue_depth;
+	}
+
+	return 0;
+}
+
+static int
+replay_run(struct replay *r, FILE *fp)
+{
+	struct rdp_trace_header header;
+	struct rdp_trace_record rec;
+	void *payload = NULL;
+	size_t payload_size = 0;
+	int ret = 0;
+
+	if (fread(&header, sizeof header, 1, fp) != 1 ||
+	    header.magic != RDP_TRACE_MAGIC) {
+		fprintf(stderr, "not an RDP trace\n");
+		return -1;
+	}
+	if (header.version != RDP_TRACE_VERSION) {
+		fprintf(stderr, "unsupported version %u\n", header.version);
+		return -1;
+	}
+
+	while (ret == 0 && fread(&rec, sizeof rec, 1, fp) == 1) {
+		if (rec.size > payload_size) {
+			payload_size = rec.size;
+			payload = xrealloc(payload, payload_size);
+		}
+		if (rec.size && fread(payload, rec.size, 1, fp) != 1) {
+			/* capture stopped mid record, keep what is complete */
+			fprintf(stderr, "truncated record, stopping\n");
+			break;
+		}
+
+		switch (rec.type) {
+		case RDP_TRACE_CONFIG:
+			ret = replay_config(r, payload, rec.size);
+			break;
+		case RDP_TRACE_SURFACE_COMMAND:
+			ret = replay_surface_command_record(r, payload, rec.size);
+			break;
+		case RDP_TRACE_FRAME_END:
+			ret = replay_frame_end(r, &rec, payload);
+			break;
+		case RDP_TRACE_FRAME_ACK:
+			ret = replay_frame_ack(r, &rec, payload);
+			break;
+		default:
+			fprintf(stderr, "unknown record type %u, skipping\n",
+				rec.type);
+			break;
+		}
+		if (ret < 0)
+			fprintf(stderr, "bad record of type %u\n", rec.type);
+	}
+
+	free(payload);
+
+	return ret;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+print_results(struct replay *r, FILE *out)
+{
+	uint64_t bytes = 0, encode_nsec = 0, readback_nsec = 0;
+	uint64_t *encode;
+	int acked = 0;
+	int64_t ack_nsec = 0;
+
+	encode = xzalloc(sizeof(*encode) * MAX(r->num_frames, 1));
+	for (int i = 0; i < r->num_frames; i++) {
+		struct replay_frame *frame = &r->frames[i];
+
+		if (!r->summary_only) {
+			fprintf(out, "{\"frame\":%u,\"commands\":%u,\"bytes\":%" PRIu64
+				",\"encode_us\":%.1f,\"readback_us\":%.1f",
+				frame->frame_id, frame->commands, frame->bytes,
+				frame->encode_nsec / 1000.0,
+				frame->readback_nsec / 1000.0);
+			if (frame->ack_nsec >= 0)
+				fprintf(out, ",\"ack_us\":%.1f,\"queue_depth\":%u",
+					frame->ack_nsec / 1000.0,
+					frame->queue_depth);
+			fputs("}\n", out);
+		}
+
+		bytes += frame->bytes;
+		encode_nsec += frame->encode_nsec;
+		readback_nsec += frame->readback_nsec;
+		encode[i] = frame->encode_nsec;
+		if (frame->ack_nsec >= 0) {
+			ack_nsec += frame->ack_nsec;
+			acked++;
+		}
+	}
+	qsort(encode, r->num_frames, sizeof(*encode), compare_u64);
+
+	fprintf(out, "{\"summary\":true,\"frames\":%d,\"bytes\":%" PRIu64
+		",\"bytes_per_frame\":%.0f,\"encode_us\":%.1f"
+		",\"encode_us_per_frame\":%.1f,\"encode_us_p99\":%.1f"
+		",\"readback_us_per_frame\":%.1f,\"ack_us_mean\":%.1f}\n",
+		r->num_frames, bytes,
+		r->num_frames ? (double)bytes / r->num_frames : 0.0,
+		encode_nsec / 1000.0,
+		r->num_frames ? encode_nsec / 1000.0 / r->num_frames : 0.0,
+		r->num_frames ? encode[(r->num_frames - 1) * 99 / 100] / 1000.0 : 0.0,
+		r->num_frames ? readback_nsec / 1000.0 / r->num_frames : 0.0,
+		acked ? ack_nsec / 1000.0 / acked : 0.0);
+
+	free(encode);
+}
+
+static int
+parse_codec(const char *name)
+{
+	if (strcmp(name, "auto") == 0)
+		return WESTON_RDP_GFX_CODEC_AUTO;
+	if (strcmp(name, "uncompressed") == 0)
+		return WESTON_RDP_GFX_CODEC_UNCOMPRESSED;
+	if (strcmp(name, "planar") == 0)
+		return WESTON_RDP_GFX_CODEC_PLANAR;
+	if (strcmp(name, "progressive") == 0)
+		return WESTON_RDP_GFX_CODEC_PROGRESSIVE;
+
+	return -1;
+}
+
+static void
+usage(int error_code)
+{
+	fprintf(stderr, "Usage: rdp-replay [OPTIONS] FILE\n\n"
+		"Replays a WESTON_RDP_TRACE_FILE capture through the RDP surface\n"
+		"command encoder, and prints bytes and timing per frame as JSON.\n\n"
+		"\t--codec=NAME\tauto, uncompressed, planar or progressive instead\n"
+		"\t\t\tof the codec used at capture\n"
+		"\t--no-cache\tdo not use the bitmap cache\n"
+		"\t--summary\tonly print the summary\n"
+		"\t--verbose\tprint encoder debug messages\n"
+		"\t--help\t\tthis help text\n\n");
+
+	exit(error_code);
+}
+
+int main(int argc, char *argv[])
+{
+	struct replay r = { .codec_override = -1 };
+	bool verbose = false;
+	FILE *fp;
+	int i, j, ret;
+
+	for (i = 1, j = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--help") == 0) {
+			usage(EXIT_SUCCESS);
+		} else if (strncmp(argv[i], "--codec=", 8) == 0) {
+			r.codec_override = parse_codec(argv[i] + 8);
+			if (r.codec_override < 0) {
+				fprintf(stderr, "unknown codec: %s\n", argv[i] + 8);
+				usage(EXIT_FAILURE);
+			}
+		} else if (strcmp(argv[i], "--no-cache") == 0) {
+			r.no_cache = true;
+		} else if (strcmp(argv[i], "--summary") == 0) {
+			r.summary_only = true;
+		} else if (strcmp(argv[i], "--verbose") == 0) {
+			verbose = true;
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			fprintf(stderr,
+				"unknown option or invalid argument: %s\n", argv[i]);
+			usage(EXIT_FAILURE);
+		} else {
+			argv[j++] = argv[i];
+		}
+	}
+	argc = j;
+
+	if (argc != 2)
+		usage(EXIT_FAILURE);
+
+	fp = fopen(argv[1], "r");
+	if (!fp) {
+		perror(argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	r.backend.debugLevel = verbose ? RDP_DEBUG_LEVEL_VERBOSE : RDP_DEBUG_LEVEL_ERR;
+	r.backend.debugLevelActive = r.backend.debugLevel;
+	r.backend.gfx_codec = WESTON_RDP_GFX_CODEC_AUTO;
+	r.gfx_ctx.custom = &r;
+	r.gfx_ctx.SurfaceCommand = replay_surface_command;
+	r.gfx_ctx.SurfaceToSurface = replay_surface_to_surface;
+	r.gfx_ctx.SurfaceToCache = replay_surface_to_cache;
+	r.gfx_ctx.CacheToSurface = replay_cache_to_surface;
+	r.peer_ctx = xzalloc(sizeof *r.peer_ctx);
+	r.peer_ctx->rdpBackend = &r.backend;
+	r.peer_ctx->rail_grfx_server_context = &r.gfx_ctx;
+	rdp_gfx_cache_init(&r.peer_ctx->gfx_cache);
+	wl_list_init(&r.window_list);
+
+	ret = replay_run(&r, fp);
+	fclose(fp);
+
+	print_results(&r, stdout);
+
+	replay_destroy_windows(&r);
+	rdp_gfx_cache_destroy(&r.peer_ctx->gfx_cache);
+	rdp_gfx_codec_context_destroy(&r.codec);
+	free(r.peer_ctx);
+	free(r.frames);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,517 @@
+/*
+ * Copyright © 2020 Microsoft
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Converts a stream of the "timeline-binary" log scope, for example
+ * recorded with
+ *
+ *	weston-debug -o timeline.bin timeline-binary
+ *
+ * to the Chrome trace event JSON format, which chrome://tracing and
+ * Perfetto (ui.perfetto.dev) can open.
+ *
+ * Every timeline point becomes an instant event on the track of its output,
+ * or on the compositor track if it has none. The GPU timestamps of
+ * renderer_gpu_begin/end also become a slice on a GPU track per output,
+ * and so do those of the GL timer query points renderer_gpu_<phase>_begin
+ * and _end, as slices named after the phase. Surface phases without an
+ * output go to GPU track 0.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "shared/timeline-binary.h"
+
+/* enum timeline_type of libweston/timeline.h */
+#define TLT_OUTPUT	1
+#define TLT_SURFACE	2
+#define TLT_VBLANK	3
+#define TLT_GPU		4
+#define TLT_MSEC	5
+#define TLT_PRESENT	6
+
+#define MAX_ARGS 16
+#define GPU_TID_BASE 1000
+
+struct object {
+	uint32_t kind;
+	uint32_t name;		/* string id */
+	uint32_t main_surface;	/* object id */
+};
+
+struct decoder {
+	const char *data;
+	size_t size;
+	size_t pos;
+
+	char **strings;
+	uint32_t num_strings;
+
+	struct object *objects;
+	uint32_t num_objects;
+
+	FILE *out;
+	bool first_event;
+};
+
+static void
+usage(int error_code)
+{
+	fprintf(stderr, "Usage: timeline-decode [OPTIONS] FILE\n\n"
+		"Converts a timeline-binary stream to Chrome trace JSON.\n\n"
+		"\t--output=FILE\twrite the JSON to FILE instead of stdout\n"
+		"\t--help\t\tthis help text\n\n");
+
+	exit(error_code);
+}
+
+static char *
+read_file(const char *filename, size_t *size)
+{
+	FILE *fp;
+	char *data = NULL;
+	size_t alloc = 0;
+	size_t len = 0;
+	size_t n;
+
+	fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+	if (!fp) {
+		perror(filename);
+		return NULL;
+	}
+
+	do {
+		if (len == alloc) {
+			char *tmp;
+
+			alloc = alloc ? alloc * 2 : 1 << 20;
+			tmp = realloc(data, alloc);
+			if (!tmp) {
+				free(data);
+				data = NULL;
+				break;
+			}
+			data = tmp;
+		}
+
+		n = fread(data + len, 1, alloc - len, fp);
+		len += n;
+	} while (n > 0);
+
+	if (fp != stdin)
+		fclose(fp);
+
+	*size = len;
+	return data;
+}
+
+static const char *
+get_string(struct decoder *dec, uint32_t id)
+{
+	if (id == 0 || id > dec->num_strings || !dec->strings[id - 1])
+		return NULL;
+
+	return dec->strings[id - 1];
+}
+
+static struct object *
+get_object(struct decoder *dec, uint32_t id)
+{
+	if (id == 0 || id > dec->num_objects || dec->objects[id - 1].kind == 0)
+		return NULL;
+
+	return &dec->objects[id - 1];
+}
+
+/* Grows an array of 'elem' sized items so that index id - 1 exists */
+static void *
+array_ensure(void *array, uint32_t *count, uint32_t id, size_t elem)
+{
+	char *tmp;
+
+	if (id <= *count)
+		return array;
+
+	tmp = realloc(array, id * elem);
+	if (!tmp)
+		return NULL;
+
+	memset(tmp + *count * elem, 0, (id - *count) * elem);
+	*count = id;
+
+	return tmp;
+}
+
+static void
+print_quoted(FILE *out, const char *str)
+{
+	const unsigned char *c;
+
+	if (!str) {
+		fputs("null", out);
+		return;
+	}
+
+	fputc('"', out);
+	for (c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(out, "\\%c", *c);
+		else if (*c < 0x20)
+			fprintf(out, "\\u%04x", *c);
+		else
+			fputc(*c, out);
+	}
+	fputc('"', out);
+}
+
+static void
+begin_event(struct decoder *dec)
+{
+	fputs(dec->first_event ? "\n" : ",\n", dec->out);
+	dec->first_event = false;
+}
+
+static void
+print_ts(FILE *out, uint64_t ns)
+{
+	fprintf(out, "%" PRIu64 ".%03u", ns / 1000, (unsigned)(ns % 1000));
+}
+
+static void
+emit_track_name(struct decoder *dec, uint32_t tid, const char *prefix,
+		const char *name)
+{
+	char buf[256];
+
+	snprintf(buf, sizeof buf, "%s%s", prefix, name ? name : "?");
+
+	begin_event(dec);
+	fprintf(dec->out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%u,\"args\":{\"name\":", tid);
+	print_quoted(dec->out, buf);
+	fputs("}}", dec->out);
+}
+
+#define GPU_PHASE_PREFIX "renderer_gpu_"
+
+static void
+emit_gpu_slice(struct decoder *dec, const char *name, size_t len, bool begin,
+	       uint64_t gpu_ns, uint32_t output)
+{
+	begin_event(dec);
+	fprintf(dec->out, "{\"name\":\"%.*s\",\"ph\":\"%s\",\"ts\":",
+		(int)len, name, begin ? "B" : "E");
+	print_ts(dec->out, gpu_ns);
+	fprintf(dec->out, ",\"pid\":1,\"tid\":%u}",
+		GPU_TID_BASE + output);
+}
+
+static void
+emit_point(struct decoder *dec, uint32_t name_id, uint64_t ns,
+	   const struct timeline_binary_record *args, int nargs)
+{
+	const char *name = get_string(dec, name_id);
+	uint32_t output = 0;
+	uint64_t gpu_ns = 0;
+	struct object *obj;
+	int i;
+
+	for (i = 0; i < nargs; i++) {
+		if (args[i].kind == TLT_OUTPUT)
+			output = args[i].id;
+		else if (args[i].kind == TLT_GPU)
+			gpu_ns = args[i].value;
+	}
+
+	begin_event(dec);
+	fputs("{\"name\":", dec->out);
+	print_quoted(dec->out, name ? name : "?");
+	fputs(",\"ph\":\"i\",\"s\":\"t\",\"ts\":", dec->out);
+	print_ts(dec->out, ns);
+	fprintf(dec->out, ",\"pid\":1,\"tid\":%u,\"args\":{", output);
+
+	for (i = 0; i < nargs; i++) {
+		const struct timeline_binary_record *arg = &args[i];
+
+		if (i > 0)
+			fputc(',', dec->out);
+
+		switch (arg->kind) {
+		case TLT_OUTPUT:
+			obj = get_object(dec, arg->id);
+			fputs("\"output\":", dec->out);
+			print_quoted(dec->out,
+				     obj ? get_string(dec, obj->name) : NULL);
+			break;
+		case TLT_SURFACE:
+			obj = get_object(dec, arg->id);
+			fprintf(dec->out, "\"surface\":%u,\"surface_desc\":",
+				arg->id);
+			print_quoted(dec->out,
+				     obj ? get_string(dec, obj->name) : NULL);
+			if (obj && obj->main_surface)
+				fprintf(dec->out, ",\"main_surface\":%u",
+					obj->main_surface);
+			break;
+		case TLT_VBLANK:
+			fputs("\"vblank_us\":", dec->out);
+			print_ts(dec->out, arg->value);
+			break;
+		case TLT_GPU:
+			fputs("\"gpu_us\":", dec->out);
+			print_ts(dec->out, arg->value);
+			break;
+		case TLT_PRESENT:
+			fputs("\"next_present_us\":", dec->out);
+			print_ts(dec->out, arg->value);
+			break;
+		case TLT_MSEC:
+			fprintf(dec->out, "\"msec\":%" PRId64,
+				(int64_t)arg->value);
+			break;
+		default:
+			fprintf(dec->out, "\"arg%d\":%" PRIu64, i, arg->value);
+			break;
+		}
+	}
+	fputs("}}", dec->out);
+
+	if (!name || !gpu_ns)
+		return;
+
+	if (strcmp(name, "renderer_gpu_begin") == 0 ||
+	    strcmp(name, "renderer_gpu_end") == 0) {
+		emit_gpu_slice(dec, "gpu", 3,
+			       strcmp(name, "renderer_gpu_begin") == 0,
+			       gpu_ns, output);
+	} else if (strncmp(name, GPU_PHASE_PREFIX,
+			   strlen(GPU_PHASE_PREFIX)) == 0) {
+		const char *phase = name + strlen(GPU_PHASE_PREFIX);
+		size_t len = strlen(phase);
+
+		if (len > 6 && strcmp(phase + len - 6, "_begin") == 0)
+			emit_gpu_slice(dec, phase, len - 6, true,
+				       gpu_ns, output);
+		else if (len > 4 && strcmp(phase + len - 4, "_end") == 0)
+			emit_gpu_slice(dec, phase, len - 4, false,
+				       gpu_ns, output);
+	}
+}
+
+static int
+decode_string(struct decoder *dec, const struct timeline_binary_record *rec)
+{
+	size_t len = rec->value;
+	size_t padded = (len + sizeof *rec - 1) / sizeof *rec * sizeof *rec;
+	char **strings;
+	char *str;
+
+	if (rec->id == 0 || dec->size - dec->pos < padded)
+		return -1;
+
+	strings = array_ensure(dec->strings, &dec->num_strings, rec->id,
+			       sizeof *strings);
+	str = malloc(len + 1);
+	if (!strings || !str) {
+		free(str);
+		return -1;
+	}
+	dec->strings = strings;
+
+	memcpy(str, dec->data + dec->pos, len);
+	str[len] = '\0';
+	dec->pos += padded;
+
+	free(dec->strings[rec->id - 1]);
+	dec->strings[rec->id - 1] = str;
+
+	return 0;
+}
+
+static int
+decode_object(struct decoder *dec, const struct timeline_binary_record *rec)
+{
+	struct object *objects;
+	struct object *obj;
+
+	if (rec->id == 0)
+		return -1;
+
+	objects = array_ensure(dec->objects, &dec->num_objects, rec->id,
+			       sizeof *objects);
+	if (!objects)
+		return -1;
+	dec->objects = objects;
+
+	obj = &dec->objects[rec->id - 1];
+	obj->kind = rec->kind;
+	obj->name = rec->value >> 32;
+	obj->main_surface = rec->value & 0xffffffff;
+
+	if (obj->kind == TLT_OUTPUT) {
+		emit_track_name(dec, rec->id, "output ",
+				get_string(dec, obj->name));
+		emit_track_name(dec, GPU_TID_BASE + rec->id, "gpu ",
+				get_string(dec, obj->name));
+	}
+
+	return 0;
+}
+
+static int
+decode(struct decoder *dec)
+{
+	const struct timeline_binary_header *header;
+	struct timeline_binary_record args[MAX_ARGS];
+	struct timeline_binary_record rec;
+	bool have_point = false;
+	uint32_t point_name = 0;
+	uint64_t point_ns = 0;
+	int nargs = 0;
+
+	if (dec->size < sizeof *header)
+		return -1;
+
+	header = (const struct timeline_binary_header *)dec->data;
+	if (header->magic != TIMELINE_BINARY_MAGIC) {
+		fprintf(stderr, "not a timeline-binary stream\n");
+		return -1;
+	}
+	if (header->version != TIMELINE_BINARY_VERSION) {
+		fprintf(stderr, "unsupported version %u\n", header->version);
+		return -1;
+	}
+	dec->pos = sizeof *header;
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", dec->out);
+	emit_track_name(dec, 0, "", "compositor");
+
+	while (dec->size - dec->pos >= sizeof rec) {
+		memcpy(&rec, dec->data + dec->pos, sizeof rec);
+		dec->pos += sizeof rec;
+
+		if (rec.type == TLB_RECORD_ARG) {
+			if (have_point && nargs < MAX_ARGS)
+				args[nargs++] = rec;
+			continue;
+		}
+
+		/* anything else ends the arguments of the current point */
+		if (have_point)
+			emit_point(dec, point_name, point_ns, args, nargs);
+		have_point = false;
+
+		switch (rec.type) {
+		case TLB_RECORD_POINT:
+			have_point = true;
+			point_name = rec.id;
+			point_ns = rec.value;
+			nargs = 0;
+			break;
+		case TLB_RECORD_STRING:
+			if (decode_string(dec, &rec) < 0) {
+				fprintf(stderr, "bad string record\n");
+				return -1;
+			}
+			break;
+		case TLB_RECORD_OBJECT:
+			if (decode_object(dec, &rec) < 0) {
+				fprintf(stderr, "bad object record\n");
+				return -1;
+			}
+			break;
+		default:
+			fprintf(stderr, "unknown record type %u, skipping\n",
+				rec.type);
+			break;
+		}
+	}
+
+	if (have_point)
+		emit_point(dec, point_name, point_ns, args, nargs);
+
+	fputs("\n]}\n", dec->out);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct decoder dec = { .first_event = true };
+	const char *output = NULL;
+	char *data;
+	uint32_t k;
+	int i, j, ret;
+
+	for (i = 1, j = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--help") == 0) {
+			usage(EXIT_SUCCESS);
+		} else if (strncmp(argv[i], "--output=", 9) == 0) {
+			output = argv[i] + 9;
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			fprintf(stderr,
+				"unknown option or invalid argument: %s\n", argv[i]);
+			usage(EXIT_FAILURE);
+		} else {
+			argv[j++] = argv[i];
+		}
+	}
+	argc = j;
+
+	if (argc != 2)
+		usage(EXIT_FAILURE);
+
+	data = read_file(argv[1], &dec.size);
+	if (!data)
+		exit(EXIT_FAILURE);
+	dec.data = data;
+
+	dec.out = output ? fopen(output, "w") : stdout;
+	if (!dec.out) {
+		perror(output);
+		free(data);
+		exit(EXIT_FAILURE);
+	}
+
+	ret = decode(&dec);
+
+	if (dec.out != stdout)
+		fclose(dec.out);
+
+	for (k = 0; k < dec.num_strings; k++)
+		free(dec.strings[k]);
+	free(dec.strings);
+	free(dec.objects);
+	free(data);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
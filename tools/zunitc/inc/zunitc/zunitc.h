@@ -249,6 +249,18 @@ zuc_set_random(int random);
 void
 zuc_set_spawn(bool spawn);
 
+/**
+ * Sets how many forked tests may run at the same time.
+ * Values below 1 use one per online CPU. Has no effect unless tests are
+ * spawned, and the results are reported in the same order as with 1.
+ * Defaults to 1.
+ *
+ * @param jobs the number of tests to run in parallel.
+ * @see zuc_set_spawn()
+ */
+void
+zuc_set_jobs(int jobs);
+
 /**
  * Enables output in the JUnit XML format.
  * Defaults to false.
@@ -43,6 +43,7 @@ struct zuc_context {
 	int random;
 	unsigned int seed;
 	bool spawn;
+	int jobs;
 	bool break_on_failure;
 	bool output_tap;
 	bool output_junit;
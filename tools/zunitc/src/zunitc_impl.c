@@ -27,6 +27,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -83,6 +84,7 @@ static struct zuc_context g_ctx = {
 	.repeat = 0,
 	.random = 0,
 	.spawn = true,
+	.jobs = 1,
 	.break_on_failure = false,
 	.fds = {-1, -1},
 
@@ -147,6 +149,16 @@ zuc_set_spawn(bool spawn)
 	g_ctx.spawn = spawn;
 }
 
+void
+zuc_set_jobs(int jobs)
+{
+	if (jobs < 1) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = (cpus > 0) ? cpus : 1;
+	}
+	g_ctx.jobs = jobs;
+}
+
 void
 zuc_set_break_on_failure(bool break_on_failure)
 {
@@ -529,6 +541,7 @@ zuc_initialize(int *argc, char *argv[], bool *help_flagged)
 	bool opt_list = false;
 	int opt_repeat = 0;
 	int opt_random = 0;
+	int opt_jobs = 1;
 	bool opt_break_on_failure = false;
 	bool opt_junit = false;
 	char *opt_filter = NULL;
@@ -541,6 +554,7 @@ zuc_initialize(int *argc, char *argv[], bool *help_flagged)
 		{ WESTON_OPTION_BOOLEAN, "zuc-list-tests", 0, &opt_list },
 		{ WESTON_OPTION_INTEGER, "zuc-repeat", 0, &opt_repeat },
 		{ WESTON_OPTION_INTEGER, "zuc-random", 0, &opt_random },
+		{ WESTON_OPTION_INTEGER, "zuc-jobs", 0, &opt_jobs },
 		{ WESTON_OPTION_BOOLEAN, "zuc-break-on-failure", 0,
 		  &opt_break_on_failure },
 #if ENABLE_JUNIT_XML
@@ -632,6 +646,7 @@ zuc_initialize(int *argc, char *argv[], bool *help_flagged)
 		printf("Usage: %s [OPTIONS]\n"
 		       "  --zuc-break-on-failure\n"
 		       "  --zuc-filter=FILTER\n"
+		       "  --zuc-jobs=N              [0 for one per CPU]\n"
 		       "  --zuc-list-tests\n"
 		       "  --zuc-nofork\n"
 #if ENABLE_JUNIT_XML
@@ -651,6 +666,7 @@ zuc_initialize(int *argc, char *argv[], bool *help_flagged)
 		zuc_set_repeat(opt_repeat);
 		zuc_set_random(opt_random);
 		zuc_set_spawn(!opt_nofork);
+		zuc_set_jobs(opt_jobs);
 		zuc_set_break_on_failure(opt_break_on_failure);
 		zuc_set_output_junit(opt_junit);
 		rc = EXIT_SUCCESS;
@@ -1017,6 +1033,50 @@ zuc_list_tests(void)
 	}
 }
 
+static long
+elapsed_ms(const struct timespec *begin, const struct timespec *end)
+{
+	long elapsed = (end->tv_sec - begin->tv_sec) * MS_PER_SEC;
+
+	if (end->tv_sec != begin->tv_sec) {
+		elapsed -= (begin->tv_nsec) / NANO_PER_MS;
+		elapsed += (end->tv_nsec) / NANO_PER_MS;
+	} else {
+		elapsed += (end->tv_nsec - begin->tv_nsec) / NANO_PER_MS;
+	}
+	return elapsed;
+}
+
+static void
+handle_child_exit(struct zuc_test *test, const siginfo_t *info)
+{
+	switch (info->si_code) {
+	case CLD_EXITED: {
+		int exit_code = info->si_status;
+		switch(exit_code) {
+		case EXIT_SUCCESS:
+			break;
+		case ZUC_EXIT_SKIP:
+			if (!test_has_skip(g_ctx.curr_test) &&
+			    !test_has_failure(g_ctx.curr_test))
+				ZUC_SKIP("Child exited SKIP");
+			break;
+		default:
+			/* unexpected failure */
+			if (!test_has_failure(g_ctx.curr_test))
+				ZUC_ASSERT_EQ(0, exit_code);
+		}
+		break;
+	}
+	case CLD_KILLED:
+	case CLD_DUMPED:
+		printf("%s:%d: error: signaled: %d\n",
+		       __FILE__, __LINE__, info->si_status);
+		mark_failed(test, ZUC_CHECK_ERROR);
+		break;
+	}
+}
+
 static void
 spawn_test(struct zuc_test *test, void *test_data,
 	   void (*cleanup_fn)(void *data), void *cleanup_data)
@@ -1086,31 +1146,7 @@ spawn_test(struct zuc_test *test, void *test_data,
 			       __FILE__, __LINE__, errno);
 			mark_failed(test, ZUC_CHECK_ERROR);
 		} else {
-			switch (info.si_code) {
-			case CLD_EXITED: {
-				int exit_code = info.si_status;
-				switch(exit_code) {
-				case EXIT_SUCCESS:
-					break;
-				case ZUC_EXIT_SKIP:
-					if (!test_has_skip(g_ctx.curr_test) &&
-					    !test_has_failure(g_ctx.curr_test))
-						ZUC_SKIP("Child exited SKIP");
-					break;
-				default:
-					/* unexpected failure */
-					if (!test_has_failure(g_ctx.curr_test))
-						ZUC_ASSERT_EQ(0, exit_code);
-				}
-				break;
-			}
-			case CLD_KILLED:
-			case CLD_DUMPED:
-				printf("%s:%d: error: signaled: %d\n",
-				       __FILE__, __LINE__, info.si_status);
-				mark_failed(test, ZUC_CHECK_ERROR);
-				break;
-			}
+			handle_child_exit(test, &info);
 		}
 	}
 	}
@@ -1120,7 +1156,6 @@ static void
 run_single_test(struct zuc_test *test,const struct zuc_fixture *fxt,
 		void *case_data, bool spawn)
 {
-	long elapsed = 0;
 	struct timespec begin;
 	struct timespec end;
 	void *test_data = NULL;
@@ -1159,14 +1194,7 @@ run_single_test(struct zuc_test *test,const struct zuc_fixture *fxt,
 
 	clock_gettime(TARGET_TIMER, &end);
 
-	elapsed = (end.tv_sec - begin.tv_sec) * MS_PER_SEC;
-	if (end.tv_sec != begin.tv_sec) {
-		elapsed -= (begin.tv_nsec) / NANO_PER_MS;
-		elapsed += (end.tv_nsec) / NANO_PER_MS;
-	} else {
-		elapsed += (end.tv_nsec - begin.tv_nsec) / NANO_PER_MS;
-	}
-	test->elapsed = elapsed;
+	test->elapsed = elapsed_ms(&begin, &end);
 
 	if (cleanup_fn)
 		cleanup_fn(cleanup_data);
@@ -1226,6 +1254,317 @@ run_single_case(struct zuc_case *test_case)
 	g_ctx.curr_case = NULL;
 }
 
+/**
+ * A single test forked by run_cases_parallel().
+ */
+struct zuc_job {
+	struct zuc_test *test;
+	int case_index;
+	bool first;		/**< first test of its case */
+	bool last;		/**< last test of its case */
+	void *test_data;
+	void *cleanup_data;
+	pid_t pid;
+	int fd;			/**< read end of the event pipe, or -1 */
+	FILE *out;		/**< captured stdout of the child */
+	struct timespec begin;
+	struct timespec end;
+	siginfo_t info;
+	bool running;
+	bool done;
+};
+
+static void
+start_job(struct zuc_job *job, void **case_data)
+{
+	struct zuc_test *test = job->test;
+	struct zuc_case *test_case = test->test_case;
+	const struct zuc_fixture *fxt = test_case->fxt;
+	int fds[2];
+
+	if (job->first) {
+		g_ctx.curr_case = test_case;
+		case_data[job->case_index] = fxt ? (void *)fxt->data : NULL;
+		if (fxt && fxt->set_up_test_case)
+			case_data[job->case_index] =
+				fxt->set_up_test_case(fxt->data);
+		g_ctx.curr_case = NULL;
+	}
+
+	job->done = true;
+	if (test->disabled)
+		return;
+
+	g_ctx.curr_case = test_case;
+	g_ctx.curr_test = test;
+
+	if (fxt && fxt->set_up) {
+		job->test_data = fxt->set_up(case_data[job->case_index]);
+		job->cleanup_data = job->test_data;
+	} else {
+		job->test_data = case_data[job->case_index];
+	}
+
+	clock_gettime(TARGET_TIMER, &job->begin);
+	job->end = job->begin;
+
+	/* Need to re-check these, as fixtures might have changed test state. */
+	if (test->fatal || test->skipped || (!test->fn && !test->fn_f))
+		goto out;
+
+	job->out = tmpfile();
+	if (!job->out || pipe2(fds, O_CLOEXEC)) {
+		printf("%s:%d: error: Unable to create pipe: %d\n",
+		       __FILE__, __LINE__, errno);
+		mark_failed(test, ZUC_CHECK_ERROR);
+		goto out;
+	}
+
+	fflush(NULL); /* important. avoid duplication of output */
+	job->pid = fork();
+	switch (job->pid) {
+	case -1: /* Error forking */
+		printf("%s:%d: error: Problem with fork: %d\n",
+		       __FILE__, __LINE__, errno);
+		mark_failed(test, ZUC_CHECK_ERROR);
+		close(fds[0]);
+		close(fds[1]);
+		break;
+	case 0: { /* child */
+		int rc = EXIT_SUCCESS;
+		close(fds[0]);
+		g_ctx.fds[1] = fds[1];
+		dup2(fileno(job->out), STDOUT_FILENO);
+
+		/* The log of this test goes to the captured output. */
+		dispatch_test_started(&g_ctx, test);
+
+		if (test->fn_f)
+			test->fn_f(job->test_data);
+		else
+			test->fn();
+
+		if (test_has_failure(test))
+			rc = EXIT_FAILURE;
+		else if (test_has_skip(test))
+			rc = ZUC_EXIT_SKIP;
+
+		/* Avoid confusing memory tools like valgrind */
+		if (fxt && fxt->tear_down)
+			fxt->tear_down(job->cleanup_data);
+
+		zuc_cleanup();
+		exit(rc);
+	}
+	default: /* parent */
+		close(fds[1]);
+		job->fd = fds[0];
+		job->running = true;
+		job->done = false;
+		break;
+	}
+
+out:
+	g_ctx.curr_test = NULL;
+	g_ctx.curr_case = NULL;
+}
+
+static void
+reap_job(struct zuc_job *job)
+{
+	close(job->fd);
+	job->fd = -1;
+
+	if (waitid(P_PID, job->pid, &job->info, WEXITED)) {
+		printf("%s:%d: error: waitid failed. (%d)\n",
+		       __FILE__, __LINE__, errno);
+		job->info.si_code = CLD_KILLED;
+		job->info.si_status = 0;
+	}
+	clock_gettime(TARGET_TIMER, &job->end);
+
+	job->running = false;
+	job->done = true;
+}
+
+static void
+report_job(struct zuc_job *job, void **case_data)
+{
+	struct zuc_test *test = job->test;
+	struct zuc_case *test_case = test->test_case;
+	const struct zuc_fixture *fxt = test_case->fxt;
+
+	g_ctx.curr_case = test_case;
+
+	if (job->first)
+		dispatch_case_started(&g_ctx, test_case,
+				      test_case->test_count - test_case->disabled,
+				      test_case->disabled);
+
+	if (test->disabled) {
+		dispatch_test_disabled(&g_ctx, test);
+	} else {
+		g_ctx.curr_test = test;
+
+		if (job->pid > 0) {
+			char buf[4096];
+			size_t len;
+
+			rewind(job->out);
+			while ((len = fread(buf, 1, sizeof(buf), job->out)) > 0)
+				fwrite(buf, 1, len, stdout);
+			fflush(stdout);
+
+			handle_child_exit(test, &job->info);
+		} else {
+			dispatch_test_started(&g_ctx, test);
+		}
+		if (job->out)
+			fclose(job->out);
+
+		test->elapsed = elapsed_ms(&job->begin, &job->end);
+
+		if (fxt && fxt->tear_down)
+			fxt->tear_down(job->cleanup_data);
+
+		if (test->deferred) {
+			if (test_has_failure(test))
+				migrate_deferred_events(test, false);
+			else
+				free_events(&test->deferred);
+		}
+
+		dispatch_test_ended(&g_ctx, test);
+
+		if (test->skipped)
+			test_case->skipped++;
+		if (test->failed)
+			test_case->failed++;
+		if (test->fatal)
+			test_case->fatal++;
+		if (!test->failed && !test->fatal)
+			test_case->passed++;
+		test_case->elapsed += test->elapsed;
+
+		g_ctx.curr_test = NULL;
+	}
+
+	if (job->last) {
+		if (fxt && fxt->tear_down_test_case)
+			fxt->tear_down_test_case(case_data[job->case_index]);
+
+		dispatch_case_ended(&g_ctx, test_case);
+	}
+
+	g_ctx.curr_case = NULL;
+}
+
+/**
+ * Runs the tests of all cases in up to g_ctx.jobs forked children at a
+ * time.
+ *
+ * Tests are handed out from one queue in their normal order, so each
+ * child takes the next pending test as soon as a slot is free, no matter
+ * which case it belongs to. Events and output of each test are held back
+ * until the tests before it are reported, so listeners see the same
+ * sequence as in a serial run.
+ */
+static void
+run_cases_parallel(void)
+{
+	struct zuc_job *jobs;
+	struct pollfd *pfds;
+	struct zuc_job **pjobs;
+	void **case_data;
+	int count = 0;
+	int next_start = 0;
+	int next_report = 0;
+	int running = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < g_ctx.case_count; ++i)
+		if (g_ctx.cases[i]->test_count > g_ctx.cases[i]->disabled)
+			count += g_ctx.cases[i]->test_count;
+	if (count == 0)
+		return;
+
+	jobs = zalloc(count * sizeof(*jobs));
+	pfds = zalloc(g_ctx.jobs * sizeof(*pfds));
+	pjobs = zalloc(g_ctx.jobs * sizeof(*pjobs));
+	case_data = zalloc(g_ctx.case_count * sizeof(*case_data));
+	ZUC_ASSERT_NOT_NULL(jobs);
+	ZUC_ASSERT_NOT_NULL(pfds);
+	ZUC_ASSERT_NOT_NULL(pjobs);
+	ZUC_ASSERT_NOT_NULL(case_data);
+
+	count = 0;
+	for (i = 0; i < g_ctx.case_count; ++i) {
+		struct zuc_case *test_case = g_ctx.cases[i];
+
+		if (test_case->test_count == test_case->disabled)
+			continue;
+
+		for (j = 0; j < test_case->test_count; ++j) {
+			struct zuc_job *job = &jobs[count++];
+
+			job->test = test_case->tests[j];
+			job->case_index = i;
+			job->first = (j == 0);
+			job->last = (j == test_case->test_count - 1);
+			job->fd = -1;
+		}
+	}
+
+	while (next_report < count) {
+		int nfds = 0;
+
+		while (running < g_ctx.jobs && next_start < count) {
+			start_job(&jobs[next_start], case_data);
+			if (jobs[next_start].running)
+				running++;
+			next_start++;
+		}
+
+		while (next_report < count && jobs[next_report].done)
+			report_job(&jobs[next_report++], case_data);
+
+		for (i = next_report; i < next_start; ++i) {
+			if (!jobs[i].running)
+				continue;
+			pfds[nfds].fd = jobs[i].fd;
+			pfds[nfds].events = POLLIN;
+			pjobs[nfds] = &jobs[i];
+			nfds++;
+		}
+		if (nfds == 0)
+			continue;
+
+		if (poll(pfds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("%s:%d: error: poll failed. (%d)\n",
+			       __FILE__, __LINE__, errno);
+			abort();
+		}
+
+		for (i = 0; i < nfds; ++i) {
+			if (!pfds[i].revents)
+				continue;
+			if (zuc_process_message(pjobs[i]->test,
+						pjobs[i]->fd) <= 0) {
+				reap_job(pjobs[i]);
+				running--;
+			}
+		}
+	}
+
+	free(case_data);
+	free(pjobs);
+	free(pfds);
+	free(jobs);
+}
+
 static void
 reset_test_values(struct zuc_case **cases, int case_count)
 {
@@ -1280,8 +1619,12 @@ run_single_pass(void)
 	dispatch_run_started(&g_ctx, live_case_count, live_test_count,
 			     disabled_test_count);
 
+	if (g_ctx.spawn && g_ctx.jobs > 1)
+		run_cases_parallel();
+
 	for (i = 0; i <  g_ctx.case_count; ++i) {
-		run_single_case(g_ctx.cases[i]);
+		if (!g_ctx.spawn || g_ctx.jobs <= 1)
+			run_single_case(g_ctx.cases[i]);
 		total_failed += g_ctx.cases[i]->test_count
 			- (g_ctx.cases[i]->passed + g_ctx.cases[i]->disabled);
 		total_passed += g_ctx.cases[i]->passed;
@@ -29,16 +29,22 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/mman.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <cairo.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "wcap-decode.h"
 
 static void
@@ -98,75 +104,179 @@ int clamp_uv(int u)
 		return clamp;
 }
 
+/* Converts a row of pixels to luma, and stores the chroma contribution
+ * of each pixel as rgb_to_yuv() accumulates it, for the caller to sum
+ * and clamp. */
+static void
+convert_row(uint32_t format, const uint32_t *p, int n,
+	    unsigned char *y, int *u, int *v)
+{
+	int i = 0, rs, bs;
+
+	switch (format) {
+	case WCAP_FORMAT_XRGB8888:
+		rs = 16;
+		bs = 0;
+		break;
+	case WCAP_FORMAT_XBGR8888:
+		rs = 0;
+		bs = 16;
+		break;
+	default:
+		assert(0);
+	}
+
+#if defined(__SSE2__)
+	/* Coefficients above 32767 are split over two 16 bit products,
+	 * so that _mm_madd_epi16() gives the exact 32 bit sums. */
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i lo = _mm_set1_epi32(0xffff);
+	const __m128i cy0 = _mm_set1_epi32(19595 | (19235 << 16));
+	const __m128i cy1 = _mm_set1_epi32(19234 | (7472 << 16));
+	const __m128i cu = _mm_set1_epi32(23364 | (23363 << 16));
+	const __m128i cv = _mm_set1_epi32(18481 | (18481 << 16));
+	const __m128i rshift = _mm_cvtsi32_si128(rs);
+	const __m128i bshift = _mm_cvtsi32_si128(bs);
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i r = _mm_and_si128(_mm_srl_epi32(px, rshift), mask);
+		__m128i g = _mm_and_si128(_mm_srli_epi32(px, 8), mask);
+		__m128i b = _mm_and_si128(_mm_srl_epi32(px, bshift), mask);
+		__m128i l, dr, db;
+		int32_t l8;
+
+		l = _mm_add_epi32(
+			_mm_madd_epi16(_mm_or_si128(r, _mm_slli_epi32(g, 16)),
+				       cy0),
+			_mm_madd_epi16(_mm_or_si128(g, _mm_slli_epi32(b, 16)),
+				       cy1));
+		l = _mm_srli_epi32(l, 16);
+
+		dr = _mm_sub_epi32(r, l);
+		db = _mm_sub_epi32(b, l);
+		dr = _mm_or_si128(_mm_and_si128(dr, lo), _mm_slli_epi32(dr, 16));
+		db = _mm_or_si128(_mm_and_si128(db, lo), _mm_slli_epi32(db, 16));
+		_mm_storeu_si128((__m128i *)(u + i), _mm_madd_epi16(dr, cu));
+		_mm_storeu_si128((__m128i *)(v + i), _mm_madd_epi16(db, cv));
+
+		l = _mm_packs_epi32(l, l);
+		l = _mm_packus_epi16(l, l);
+		l8 = _mm_cvtsi128_si32(l);
+		memcpy(y + i, &l8, sizeof l8);
+	}
+#elif defined(__ARM_NEON)
+	const uint32x4_t mask = vdupq_n_u32(0xff);
+	const int32x4_t rshift = vdupq_n_s32(-rs);
+	const int32x4_t bshift = vdupq_n_s32(-bs);
+
+	for (; i + 4 <= n; i += 4) {
+		uint32x4_t px = vld1q_u32(p + i);
+		uint32x4_t r = vandq_u32(vshlq_u32(px, rshift), mask);
+		uint32x4_t g = vandq_u32(vshrq_n_u32(px, 8), mask);
+		uint32x4_t b = vandq_u32(vshlq_u32(px, bshift), mask);
+		uint32x4_t l;
+		uint16x4_t l16;
+		int32x4_t dr, db;
+
+		l = vmulq_n_u32(r, 19595);
+		l = vmlaq_n_u32(l, g, 38469);
+		l = vmlaq_n_u32(l, b, 7472);
+		l = vshrq_n_u32(l, 16);
+
+		dr = vsubq_s32(vreinterpretq_s32_u32(r),
+			       vreinterpretq_s32_u32(l));
+		db = vsubq_s32(vreinterpretq_s32_u32(b),
+			       vreinterpretq_s32_u32(l));
+		vst1q_s32(u + i, vmulq_n_s32(dr, 46727));
+		vst1q_s32(v + i, vmulq_n_s32(db, 36962));
+
+		l16 = vmovn_u32(l);
+		vst1_lane_u32((uint32_t *) (y + i),
+			      vreinterpret_u32_u8(vmovn_u16(vcombine_u16(l16, l16))),
+			      0);
+	}
+#endif
+
+	for (; i < n; i++) {
+		u[i] = 0;
+		v[i] = 0;
+		y[i] = rgb_to_yuv(format, p[i], &u[i], &v[i]);
+	}
+}
+
 static void
 convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 {
-	unsigned char *y1, *y2, *u, *v;
-	uint32_t *p1, *p2, *end;
-	int i, u_accum, v_accum, stride0, stride1;
+	unsigned char *y1, *u, *v;
+	int *rows, *u1, *u2, *v1, *v2;
+	int i, x, stride0, stride1;
 	uint32_t format = decoder->format;
 
 	stride0 = decoder->width;
 	stride1 = decoder->width / 2;
+
+	rows = malloc(4 * stride0 * sizeof *rows);
+	assert(rows);
+	u1 = rows;
+	u2 = u1 + stride0;
+	v1 = u2 + stride0;
+	v2 = v1 + stride0;
+
 	for (i = 0; i < decoder->height; i += 2) {
 		y1 = out + stride0 * i;
-		y2 = y1 + stride0;
 		v = out + stride0 * decoder->height + stride1 * i / 2;
 		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
-		p2 = p1 + decoder->width;
-		end = p1 + decoder->width;
-
-		while (p1 < end) {
-			u_accum = 0;
-			v_accum = 0;
-			y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
-			y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
-			y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
-			y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
-			u[0] = clamp_uv(u_accum);
-			v[0] = clamp_uv(v_accum);
-
-			y1 += 2;
-			p1 += 2;
-			y2 += 2;
-			p2 += 2;
-			u++;
-			v++;
+
+		convert_row(format, decoder->frame + decoder->width * i,
+			    decoder->width, y1, u1, v1);
+		convert_row(format, decoder->frame + decoder->width * (i + 1),
+			    decoder->width, y1 + stride0, u2, v2);
+
+		for (x = 0; x < stride1; x++) {
+			u[x] = clamp_uv(u1[2 * x] + u1[2 * x + 1] +
+					u2[2 * x] + u2[2 * x + 1]);
+			v[x] = clamp_uv(v1[2 * x] + v1[2 * x + 1] +
+					v2[2 * x] + v2[2 * x + 1]);
 		}
 	}
+
+	free(rows);
 }
 
 static void
 convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
 {
-
 	unsigned char *yp, *up, *vp;
-	uint32_t *rp, *end;
-	int u, v;
-	int i, stride, psize;
+	int *rows, *u, *v;
+	int i, x, stride, psize;
 	uint32_t format = decoder->format;
 
 	stride = decoder->width;
 	psize = stride * decoder->height;
+
+	rows = malloc(2 * stride * sizeof *rows);
+	assert(rows);
+	u = rows;
+	v = u + stride;
+
 	for (i = 0; i < decoder->height; i++) {
 		yp = out + stride * i;
 		up = yp + (psize * 2);
 		vp = yp + (psize * 1);
-		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;
-		while (rp < end) {
-			u = 0;
-			v = 0;
-			yp[0] = rgb_to_yuv(format, rp[0], &u, &v);
-			up[0] = clamp_uv(u/.3);
-			vp[0] = clamp_uv(v/.3);
-			up++;
-			vp++;
-			yp++;
-			rp++;
+
+		convert_row(format, decoder->frame + decoder->width * i,
+			    decoder->width, yp, u, v);
+
+		/* same as dividing by .3 for every value the row
+		 * conversion gives, without going through doubles */
+		for (x = 0; x < stride; x++) {
+			up[x] = clamp_uv(u[x] * 10 / 3);
+			vp[x] = clamp_uv(v[x] * 10 / 3);
 		}
 	}
+
+	free(rows);
 }
 
 static void
@@ -193,17 +303,95 @@ output_yuv_frame(struct wcap_decoder *decoder, int depth)
 	fwrite(out, 1, size, stdout);
 }
 
+struct export_job {
+	pthread_t thread;
+	const char *filename;
+	int first, last;
+	int failed;
+};
+
+/* Each thread decodes its part of the range with a decoder of its own,
+ * starting from the keyframe before its first frame. */
+static void *
+export_thread(void *data)
+{
+	struct export_job *job = data;
+	struct wcap_decoder *decoder;
+	char filename[200];
+	int i;
+
+	decoder = wcap_decoder_create(job->filename);
+	if (decoder == NULL) {
+		job->failed = 1;
+		return NULL;
+	}
+
+	for (i = job->first; i <= job->last; i++) {
+		if (!wcap_decoder_seek(decoder, i))
+			break;
+		snprintf(filename, sizeof filename, "wcap-frame-%d.png", i);
+		write_png(decoder, filename);
+		fprintf(stderr, "wrote %s\n", filename);
+	}
+
+	wcap_decoder_destroy(decoder);
+
+	return NULL;
+}
+
+static int
+export_frames(const char *filename, int first, int last, int nthreads)
+{
+	struct export_job *jobs;
+	int i, n, failed = 0;
+
+	if (nthreads > last - first + 1)
+		nthreads = last - first + 1;
+
+	jobs = calloc(nthreads, sizeof *jobs);
+	if (jobs == NULL)
+		return -1;
+
+	n = (last - first + nthreads) / nthreads;
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].filename = filename;
+		jobs[i].first = first + i * n;
+		jobs[i].last = jobs[i].first + n - 1;
+		if (jobs[i].last > last)
+			jobs[i].last = last;
+		if (pthread_create(&jobs[i].thread, NULL,
+				   export_thread, &jobs[i]) != 0) {
+			nthreads = i;
+			failed = 1;
+			break;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		failed |= jobs[i].failed;
+	}
+
+	free(jobs);
+
+	return failed ? -1 : 0;
+}
+
 static void
 usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
 		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
+		"\t[--frames=<first:last>] [--threads=<n>]\n"
 		"\t[--rate=<num:denom>] <wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
+		"\t--frames=<first:last>\twrite out the given range of frames\n"
+		"\t\t\t\tas pngs\n"
+		"\t--threads=<n>\t\tnumber of threads for --frames\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
 		"\t\t\t\tspecified as an integer fraction\n\n");
 
@@ -215,6 +403,7 @@ int main(int argc, char *argv[])
 	struct wcap_decoder *decoder;
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
 	int num = 30, denom = 1;
+	int first = -1, last = -1, nthreads = 1;
 	char filename[200];
 	char *mode;
 	uint32_t msecs, frame_time;
@@ -228,6 +417,11 @@ int main(int argc, char *argv[])
 			usage(EXIT_SUCCESS);
 		} else if (strcmp(argv[i], "--all") == 0) {
 			all = 1;
+		} else if (sscanf(argv[i], "--frames=%d:%d",
+				  &first, &last) == 2) {
+			;
+		} else if (sscanf(argv[i], "--threads=%d", &nthreads) == 1) {
+			;
 		} else if (sscanf(argv[i], "--frame=%d", &output_frame) == 1) {
 			;
 		} else if (sscanf(argv[i], "--rate=%d", &num) == 1) {
@@ -253,12 +447,36 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (first != -1 && (first < 0 || last < first)) {
+		fprintf(stderr, "invalid frame range\n");
+		exit(EXIT_FAILURE);
+	}
+	if (nthreads < 1) {
+		fprintf(stderr, "invalid number of threads\n");
+		exit(EXIT_FAILURE);
+	}
+
 	decoder = wcap_decoder_create(argv[1]);
 	if (decoder == NULL) {
 		fprintf(stderr, "Creating wcap decoder failed\n");
 		exit(EXIT_FAILURE);
 	}
 
+	if (first != -1) {
+		if (decoder->version == 2 && (uint32_t) last >= decoder->nframes)
+			last = decoder->nframes - 1;
+		wcap_decoder_destroy(decoder);
+
+		if (last < first)
+			exit(EXIT_SUCCESS);
+		if (export_frames(argv[1], first, last, nthreads) < 0) {
+			fprintf(stderr, "exporting frames failed\n");
+			exit(EXIT_FAILURE);
+		}
+
+		exit(EXIT_SUCCESS);
+	}
+
 	if (yuv4mpeg2 && isatty(1)) {
 		fprintf(stderr, "Not dumping yuv4mpeg2 data to terminal.  Pipe output to a file or a process.\n");
 		fprintf(stderr, "For example, to encode to webm, use something like\n\n");
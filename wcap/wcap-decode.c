@@ -29,7 +29,6 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/mman.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -38,16 +37,65 @@
 
 #include <cairo.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "wcap-decode.h"
 
+/* Frame pixels always have the X channel set, and so do the results
+ * since deltas never carry into it. */
+static void
+wcap_decoder_clear(struct wcap_decoder *decoder)
+{
+	int i, count = decoder->width * decoder->height;
+
+	for (i = 0; i < count; i++)
+		decoder->frame[i] = 0xff000000;
+}
+
+static void
+wcap_add_run(uint32_t *d, int n, uint32_t delta)
+{
+	int i = 0;
+
+	delta &= 0x00ffffff;
+	if (delta == 0)
+		return;
+
+#if defined(__SSE2__)
+	const __m128i v = _mm_set1_epi32(delta);
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(d + i));
+
+		_mm_storeu_si128((__m128i *)(d + i), _mm_add_epi8(x, v));
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(delta));
+
+	for (; i + 4 <= n; i += 4) {
+		uint8x16_t x = vreinterpretq_u8_u32(vld1q_u32(d + i));
+
+		vst1q_u32(d + i, vreinterpretq_u32_u8(vaddq_u8(x, v)));
+	}
+#endif
+
+	/* component-wise add without carries between the channels */
+	for (; i < n; i++)
+		d[i] = ((d[i] & 0x7f7f7f7f) + (delta & 0x7f7f7f7f)) ^
+		       ((d[i] ^ delta) & 0x80808080);
+}
+
 static void
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			      struct wcap_rectangle *rect)
 {
 	uint32_t v, *p = decoder->p, *d;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
-	unsigned char r, g, b, dr, dg, db;
+	int x, i, j, l, n, count = width * height;
 
 	d = decoder->frame + (rect->y2 - 1) * decoder->width;
 	x = rect->x1;
@@ -61,21 +109,22 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			j = 1 << (l - 0xe0 + 7);
 		}
 
-		dr = (v >> 16);
-		dg = (v >>  8);
-		db = (v >>  0);
-		for (k = 0; k < j; k++) {
-			r = (d[x] >> 16) + dr;
-			g = (d[x] >>  8) + dg;
-			b = (d[x] >>  0) + db;
-			d[x] = 0xff000000 | (r << 16) | (g << 8) | b;
-			x++;
+		/* a run never writes past the rectangle, even if the
+		 * encoding is broken */
+		l = j < count - i ? j : count - i;
+		i += j;
+		while (l > 0) {
+			n = rect->x2 - x;
+			if (n > l)
+				n = l;
+			wcap_add_run(d + x, n, v);
+			x += n;
+			l -= n;
 			if (x == rect->x2) {
 				x = rect->x1;
 				d -= decoder->width;
 			}
 		}
-		i += j;
 	}
 
 	if (i != count)
@@ -90,23 +139,152 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 {
 	struct wcap_rectangle *rects;
 	struct wcap_frame_header *header;
-	uint32_t i;
+	struct wcap_frame_header_v2 *header_v2;
+	uint32_t i, nrects;
+	void *next = NULL;
 
 	if (decoder->p == decoder->end)
 		return 0;
 
-	header = decoder->p;
-	decoder->msecs = header->msecs;
+	if (decoder->version == 2) {
+		header_v2 = decoder->p;
+		decoder->msecs = header_v2->msecs;
+		nrects = header_v2->nrects;
+		rects = (void *) (header_v2 + 1);
+		next = (void *) rects + header_v2->size;
+		if (header_v2->flags & WCAP_FRAME_KEY)
+			wcap_decoder_clear(decoder);
+	} else {
+		header = decoder->p;
+		decoder->msecs = header->msecs;
+		nrects = header->nrects;
+		rects = (void *) (header + 1);
+	}
 	decoder->count++;
 
-	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
-	for (i = 0; i < header->nrects; i++)
+	decoder->p = (uint32_t *) (rects + nrects);
+	for (i = 0; i < nrects; i++)
 		wcap_decoder_decode_rectangle(decoder, &rects[i]);
 
+	if (next)
+		decoder->p = next;
+
+	return 1;
+}
+
+/* Makes the given frame the current one, that is the one the next
+ * wcap_decoder_get_frame() comes after. Starts over from the closest
+ * keyframe at or before it, when there is an index. */
+int
+wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t frame)
+{
+	struct wcap_index_entry *entry;
+	uint32_t k;
+
+	if (decoder->count == frame + 1)
+		return 1;
+
+	if (decoder->nentries > 0) {
+		k = frame / decoder->keyframe_interval;
+		if (k >= decoder->nentries)
+			k = decoder->nentries - 1;
+		while (k > 0 && decoder->index[k].frame > frame)
+			k--;
+
+		entry = &decoder->index[k];
+		if (entry->frame <= frame &&
+		    (frame < decoder->count || entry->frame >= decoder->count)) {
+			decoder->p = decoder->map + entry->offset;
+			decoder->count = entry->frame;
+		}
+	}
+
+	if (frame < decoder->count) {
+		decoder->p = decoder->start;
+		decoder->count = 0;
+		wcap_decoder_clear(decoder);
+	}
+
+	while (decoder->count <= frame)
+		if (!wcap_decoder_get_frame(decoder))
+			return 0;
+
 	return 1;
 }
 
+/* Recordings that were cut short have no trailer, walk the frame
+ * headers instead. Also drops a partially written last frame. */
+static int
+wcap_decoder_build_index(struct wcap_decoder *decoder)
+{
+	struct wcap_frame_header_v2 *header;
+	struct wcap_index_entry *index;
+	void *p = decoder->start, *next;
+	uint32_t n = 0, size = 0;
+
+	while (p + sizeof *header <= decoder->end) {
+		header = p;
+		next = (void *) (header + 1) + header->size;
+		if (next > decoder->end)
+			break;
+
+		if (header->flags & WCAP_FRAME_KEY) {
+			if (decoder->nentries == size) {
+				size = size ? size * 2 : 64;
+				index = realloc(decoder->index,
+						size * sizeof *index);
+				if (index == NULL)
+					return -1;
+				decoder->index = index;
+			}
+			index = &decoder->index[decoder->nentries++];
+			index->offset = p - decoder->map;
+			index->msecs = header->msecs;
+			index->frame = n;
+		}
+
+		n++;
+		p = next;
+	}
+
+	decoder->end = p;
+	decoder->nframes = n;
+	decoder->keyframe_interval = WCAP_KEYFRAME_INTERVAL;
+
+	return 0;
+}
+
+static int
+wcap_decoder_read_index(struct wcap_decoder *decoder)
+{
+	struct wcap_trailer trailer;
+	size_t size;
+
+	if (decoder->end - decoder->start < (ssize_t) sizeof trailer)
+		return wcap_decoder_build_index(decoder);
+
+	memcpy(&trailer, decoder->end - sizeof trailer, sizeof trailer);
+	size = trailer.nentries * sizeof *decoder->index;
+	if (trailer.magic != WCAP_TRAILER_MAGIC ||
+	    trailer.keyframe_interval == 0 ||
+	    trailer.index_offset < (uint64_t) (decoder->start - decoder->map) ||
+	    trailer.index_offset + size + sizeof trailer != decoder->size)
+		return wcap_decoder_build_index(decoder);
+
+	decoder->index = malloc(size ? size : 1);
+	if (decoder->index == NULL)
+		return -1;
+
+	/* the index is not necessarily aligned for 64 bit reads */
+	memcpy(decoder->index, decoder->map + trailer.index_offset, size);
+	decoder->nentries = trailer.nentries;
+	decoder->keyframe_interval = trailer.keyframe_interval;
+	decoder->nframes = trailer.nframes;
+	decoder->end = decoder->map + trailer.index_offset;
+
+	return 0;
+}
+
 struct wcap_decoder *
 wcap_decoder_create(const char *filename)
 {
@@ -115,7 +293,7 @@ wcap_decoder_create(const char *filename)
 	int frame_size;
 	struct stat buf;
 
-	decoder = malloc(sizeof *decoder);
+	decoder = calloc(1, sizeof *decoder);
 	if (decoder == NULL)
 		return NULL;
 
@@ -127,6 +305,13 @@ wcap_decoder_create(const char *filename)
 
 	fstat(decoder->fd, &buf);
 	decoder->size = buf.st_size;
+	if (decoder->size < sizeof *header) {
+		fprintf(stderr, "file too short\n");
+		close(decoder->fd);
+		free(decoder);
+		return NULL;
+	}
+
 	decoder->map = mmap(NULL, decoder->size,
 			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
 	if (decoder->map == MAP_FAILED) {
@@ -141,19 +326,38 @@ wcap_decoder_create(const char *filename)
 	decoder->count = 0;
 	decoder->width = header->width;
 	decoder->height = header->height;
-	decoder->p = header + 1;
+	decoder->start = header + 1;
+	decoder->p = decoder->start;
 	decoder->end = decoder->map + decoder->size;
 
+	switch (header->magic) {
+	case WCAP_HEADER_MAGIC:
+		decoder->version = 1;
+		break;
+	case WCAP_HEADER_MAGIC_V2:
+		decoder->version = 2;
+		if (wcap_decoder_read_index(decoder) < 0)
+			goto err;
+		break;
+	default:
+		fprintf(stderr, "not a wcap file\n");
+		goto err;
+	}
+
 	frame_size = header->width * header->height * 4;
 	decoder->frame = malloc(frame_size);
-	if (decoder->frame == NULL) {
-		close(decoder->fd);
-		free(decoder);
-		return NULL;
-	}
-	memset(decoder->frame, 0, frame_size);
+	if (decoder->frame == NULL)
+		goto err;
+	wcap_decoder_clear(decoder);
 
 	return decoder;
+
+err:
+	free(decoder->index);
+	munmap(decoder->map, decoder->size);
+	close(decoder->fd);
+	free(decoder);
+	return NULL;
 }
 
 void
@@ -161,6 +365,7 @@ wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
 	munmap(decoder->map, decoder->size);
 	close(decoder->fd);
+	free(decoder->index);
 	free(decoder->frame);
 	free(decoder);
 }
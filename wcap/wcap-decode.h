@@ -29,6 +29,13 @@
 #include <stdint.h>
 
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434132
+#define WCAP_TRAILER_MAGIC	0x58444e49
+
+/* A keyframe is stored every this many frames in a v2 file. */
+#define WCAP_KEYFRAME_INTERVAL	300
+
+#define WCAP_FRAME_KEY		(1 << 0)
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
@@ -46,6 +53,28 @@ struct wcap_frame_header {
 	uint32_t nrects;
 };
 
+struct wcap_frame_header_v2 {
+	uint32_t msecs;
+	uint32_t nrects;
+	uint32_t flags;
+	/* bytes of rectangles and pixel data following the header */
+	uint32_t size;
+};
+
+struct wcap_index_entry {
+	uint64_t offset;
+	uint32_t msecs;
+	uint32_t frame;
+};
+
+struct wcap_trailer {
+	uint64_t index_offset;
+	uint32_t nentries;
+	uint32_t keyframe_interval;
+	uint32_t nframes;
+	uint32_t magic;
+};
+
 struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
@@ -53,15 +82,23 @@ struct wcap_rectangle {
 struct wcap_decoder {
 	int fd;
 	size_t size;
-	void *map, *p, *end;
+	void *map, *p, *end, *start;
 	uint32_t *frame;
 	uint32_t format;
 	uint32_t msecs;
 	uint32_t count;
 	int width, height;
+
+	/* v2 only, read from the trailer or rebuilt if there is none */
+	int version;
+	struct wcap_index_entry *index;
+	uint32_t nentries;
+	uint32_t keyframe_interval;
+	uint32_t nframes;
 };
 
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t frame);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 
@@ -27,6 +27,8 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -40,30 +42,73 @@
 #include <libweston/xwayland-api.h>
 #include "shared/helpers.h"
 #include "shared/string-helpers.h"
+#include "shared/timespec-util.h"
 
 static int
-weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
+weston_xserver_spawn(struct weston_xserver *wxs, const char *reason)
 {
-	struct weston_xserver *wxs = data;
 	char display[8];
 
 	snprintf(display, sizeof display, ":%d", wxs->display);
 
+	clock_gettime(CLOCK_MONOTONIC, &wxs->spawn_time);
 	wxs->pid = wxs->spawn_func(wxs->user_data, display, wxs->abstract_fd, wxs->unix_fd);
 	if (wxs->pid == -1) {
 		weston_log("Failed to spawn the Xwayland server\n");
-		return 1;
+		wxs->pid = 0;
+		return -1;
 	}
 
-	weston_log("Spawned Xwayland server, pid %d\n", wxs->pid);
+	weston_log("Spawned Xwayland server, pid %d (%s)\n", wxs->pid, reason);
 	if (wxs->abstract_source) {
 		wl_event_source_remove(wxs->abstract_source);
+		wxs->abstract_source = NULL;
 	}
 	wl_event_source_remove(wxs->unix_source);
+	wxs->unix_source = NULL;
+
+	return 0;
+}
+
+static int
+weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
+{
+	struct weston_xserver *wxs = data;
+
+	weston_xserver_spawn(wxs, "client connection");
 
 	return 1;
 }
 
+static int
+weston_xserver_idle_handler(void *data)
+{
+	struct weston_xserver *wxs = data;
+
+	if (wxs->pid <= 0)
+		return 0;
+
+	/* The next X client connection starts a new server. */
+	weston_log("Xwayland had no windows for %u ms, stopping pid %d\n",
+		   wxs->idle_timeout_msec, wxs->pid);
+	kill(wxs->pid, SIGTERM);
+
+	return 0;
+}
+
+void
+weston_xserver_update_idle(struct weston_xserver *wxs)
+{
+	bool idle;
+
+	if (!wxs->idle_timer)
+		return;
+
+	idle = wxs->pid > 0 && wxs->wm && wxs->wm->client_window_count == 0;
+	wl_event_source_timer_update(wxs->idle_timer,
+				     idle ? wxs->idle_timeout_msec : 0);
+}
+
 static void
 weston_xserver_shutdown(struct weston_xserver *wxs)
 {
@@ -79,6 +124,10 @@ weston_xserver_shutdown(struct weston_xserver *wxs)
 		}
 		wl_event_source_remove(wxs->unix_source);
 	}
+	if (wxs->idle_timer) {
+		wl_event_source_remove(wxs->idle_timer);
+		wxs->idle_timer = NULL;
+	}
 	if (wxs->abstract_fd) {
 		close(wxs->abstract_fd);
 	}
@@ -326,8 +375,19 @@ weston_xwayland_xserver_loaded(struct weston_xwayland *xwayland,
 			       struct wl_client *client, int wm_fd)
 {
 	struct weston_xserver *wxs = (struct weston_xserver *)xwayland;
+	struct timespec ready, done;
+
+	clock_gettime(CLOCK_MONOTONIC, &ready);
 	wxs->wm = weston_wm_create(wxs, wm_fd);
 	wxs->client = client;
+	clock_gettime(CLOCK_MONOTONIC, &done);
+
+	weston_log("Xwayland server ready %" PRId64 " ms after spawn, "
+		   "window manager took %" PRId64 " ms\n",
+		   timespec_sub_to_msec(&ready, &wxs->spawn_time),
+		   timespec_sub_to_msec(&done, &ready));
+
+	weston_xserver_update_idle(wxs);
 }
 
 static void
@@ -338,6 +398,7 @@ weston_xwayland_xserver_exited(struct weston_xwayland *xwayland,
 
 	wxs->pid = 0;
 	wxs->client = NULL;
+	weston_xserver_update_idle(wxs);
 
 	if (wxs->abstract_fd) {
 		wxs->abstract_source =
@@ -363,11 +424,56 @@ weston_xwayland_xserver_exited(struct weston_xwayland *xwayland,
 	}
 }
 
+static int
+weston_xwayland_prewarm(struct weston_xwayland *xwayland)
+{
+	struct weston_xserver *wxs = (struct weston_xserver *)xwayland;
+
+	if (!wxs->loop)
+		return -1;
+	if (wxs->pid != 0)
+		return 0;
+
+	return weston_xserver_spawn(wxs, "prewarm");
+}
+
+static int
+weston_xwayland_set_idle_timeout(struct weston_xwayland *xwayland,
+				 uint32_t timeout_msec)
+{
+	struct weston_xserver *wxs = (struct weston_xserver *)xwayland;
+
+	if (!wxs->loop)
+		return -1;
+
+	wxs->idle_timeout_msec = timeout_msec;
+	if (timeout_msec == 0) {
+		if (wxs->idle_timer)
+			wl_event_source_remove(wxs->idle_timer);
+		wxs->idle_timer = NULL;
+		return 0;
+	}
+
+	if (!wxs->idle_timer) {
+		wxs->idle_timer =
+			wl_event_loop_add_timer(wxs->loop,
+						weston_xserver_idle_handler,
+						wxs);
+		if (!wxs->idle_timer)
+			return -1;
+	}
+	weston_xserver_update_idle(wxs);
+
+	return 0;
+}
+
 const struct weston_xwayland_api api = {
 	weston_xwayland_get,
 	weston_xwayland_listen,
 	weston_xwayland_xserver_loaded,
 	weston_xwayland_xserver_exited,
+	weston_xwayland_prewarm,
+	weston_xwayland_set_idle_timeout,
 };
 extern const struct weston_xwayland_surface_api surface_api;
 
@@ -317,7 +317,11 @@ weston_wm_handle_selection_notify(struct weston_wm *wm,
 	}
 }
 
-static const size_t incr_chunk_size = 64 * 1024;
+/* INCR chunks start small so that short transfers stay cheap, and double
+ * with every full chunk the requestor consumes, up to what the server
+ * takes in a single request. */
+#define INCR_CHUNK_SIZE_MIN	(64 * 1024)
+#define INCR_CHUNK_SIZE_MAX	(4 * 1024 * 1024)
 
 static void
 weston_wm_send_selection_notify(struct weston_wm *wm, xcb_atom_t property)
@@ -394,9 +398,25 @@ weston_wm_flush_source_data(struct weston_wm *wm)
 	length = wm->source_data.size;
 	wm->source_data.size = 0;
 
+	if (wm->incr && (uint32_t) length >= wm->incr_chunk_size)
+		wm->incr_chunk_size = MIN(wm->incr_chunk_size * 2,
+					  wm->incr_chunk_max);
+
 	return length;
 }
 
+static void
+weston_wm_abort_data_source(struct weston_wm *wm, int fd)
+{
+	weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
+	if (wm->property_source)
+		wl_event_source_remove(wm->property_source);
+	wm->property_source = NULL;
+	close(fd);
+	wm->data_source_fd = -1;
+	wl_array_release(&wm->source_data);
+}
+
 static int
 weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 {
@@ -404,24 +424,28 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 	int len, current, available;
 	void *p;
 
+	/* Read straight into the buffer that goes out with the next
+	 * ChangeProperty. It holds exactly one chunk and only grows while
+	 * empty, after a flush, so data is never moved around; libxcb
+	 * writes requests this large directly from it. */
 	current = wm->source_data.size;
-	if (wm->source_data.size < incr_chunk_size)
-		p = wl_array_add(&wm->source_data, incr_chunk_size);
-	else
-		p = (char *) wm->source_data.data + wm->source_data.size;
-	available = wm->source_data.alloc - current;
+	if (wm->source_data.alloc < wm->incr_chunk_size) {
+		if (!wl_array_add(&wm->source_data,
+				  wm->incr_chunk_size - current)) {
+			weston_log("out of memory for data source fd:%d\n", fd);
+			weston_wm_abort_data_source(wm, fd);
+			return 1;
+		}
+		wm->source_data.size = current;
+	}
+	p = (char *) wm->source_data.data + current;
+	available = wm->incr_chunk_size - current;
 
 	len = read(fd, p, available);
 	if (len == -1) {
 		weston_log("read error from data source fd:%d %s\n",
 			   fd, strerror(errno));
-		weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
-		if (wm->property_source)
-			wl_event_source_remove(wm->property_source);
-		wm->property_source = NULL;
-		close(fd);
-		wm->data_source_fd = -1;
-		wl_array_release(&wm->source_data);
+		weston_wm_abort_data_source(wm, fd);
 		return 1;
 	}
 
@@ -432,7 +456,7 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 		len, available, mask, len, (char *) p);*/
 
 	wm->source_data.size = current + len;
-	if (wm->source_data.size >= incr_chunk_size) {
+	if (wm->source_data.size >= wm->incr_chunk_size) {
 		if (!wm->incr) {
 			weston_log("got %zu bytes, starting incr\n",
 				wm->source_data.size);
@@ -443,7 +467,7 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 					    wm->selection_request.property,
 					    wm->atom.incr,
 					    32, /* format */
-					    1, &incr_chunk_size);
+					    1, &wm->incr_chunk_size);
 			wm->selection_property_set = 1;
 			wm->flush_property_on_delete = 1;
 			if (wm->property_source)
@@ -521,6 +545,7 @@ weston_wm_send_data(struct weston_wm *wm, xcb_atom_t target, const char *mime_ty
 	}
 
 	wl_array_init(&wm->source_data);
+	wm->incr_chunk_size = MIN(INCR_CHUNK_SIZE_MIN, wm->incr_chunk_max);
 	wm->selection_target = target;
 	wm->data_source_fd = p[0];
 	wm->property_source = wl_event_loop_add_fd(wm->server->loop,
@@ -792,7 +817,7 @@ weston_wm_seat_destroyed(struct wl_listener *listener, void *data)
 void
 weston_wm_selection_init(struct weston_wm *wm)
 {
-	uint32_t values[1], mask;
+	uint32_t values[1], mask, max_request;
 
 	wl_list_init(&wm->selection_listener.link);
 	wl_list_init(&wm->seat_create_listener.link);
@@ -800,6 +825,11 @@ weston_wm_selection_init(struct weston_wm *wm)
 
 	wm->selection_request.requestor = XCB_NONE;
 
+	/* The maximum request length is in 4 byte units and includes the
+	 * 24 bytes of ChangeProperty header. */
+	max_request = xcb_get_maximum_request_length(wm->conn) * 4;
+	wm->incr_chunk_max = MIN(max_request - 24, INCR_CHUNK_SIZE_MAX);
+
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE;
 	wm->selection_window = xcb_generate_id(wm->conn);
 	xcb_create_window(wm->conn,
@@ -39,14 +39,18 @@
 #include <limits.h>
 #include <assert.h>
 #include <X11/Xcursor/Xcursor.h>
+#include <xcb/sync.h>
 #include <linux/input.h>
 
 #include <libweston/libweston.h>
 #include "xwayland.h"
 #include "xwayland-internal-interface.h"
+#ifdef HAVE_XWAYLAND_SHELL
+#include "xwayland-shell-v1-server-protocol.h"
+#endif
 
 #include "shared/cairo-util.h"
-#include "hash.h"
+#include "shared/hash.h"
 #include "shared/helpers.h"
 
 struct wm_size_hints {
@@ -128,6 +132,14 @@ struct motif_wm_hints {
 #define _NET_WM_MOVERESIZE_MOVE_KEYBOARD    10   /* move via keyboard */
 #define _NET_WM_MOVERESIZE_CANCEL           11   /* cancel operation */
 
+/* How long a configure waits for the client to acknowledge the previous
+ * _NET_WM_SYNC_REQUEST before it is sent anyway */
+#define WM_SYNC_REQUEST_TIMEOUT_MSEC	200
+
+/* Property refreshes coalesced by weston_wm_window_schedule_refresh() */
+#define WM_WINDOW_REFRESH_NAME	(1 << 0)
+#define WM_WINDOW_REFRESH_ICON	(1 << 1)
+
 struct weston_output_weak_ref {
 	struct weston_output *output;
 	struct wl_listener destroy_listener;
@@ -140,6 +152,7 @@ struct weston_wm_window {
 	struct frame *frame;
 	cairo_surface_t *cairo_surface;
 	uint32_t surface_id;
+	uint64_t surface_serial;
 	struct weston_surface *surface;
 	struct weston_desktop_xwayland_surface *shsurf;
 	struct wl_listener surface_destroy_listener;
@@ -149,6 +162,7 @@ struct weston_wm_window {
 	int pid;
 	char *machine;
 	char *class;
+	char *class_name;
 	char *name;
 	struct weston_wm_window *transient_for;
 	uint32_t protocols;
@@ -171,10 +185,21 @@ struct weston_wm_window {
 	int maximized_vert;
 	int maximized_horz;
 	int take_focus;
+	int sync_request;
+	xcb_sync_counter_t sync_counter;
+	xcb_sync_alarm_t sync_alarm;
+	xcb_sync_counter_t sync_alarm_counter;
+	int64_t sync_value;
+	bool sync_pending;
+	bool configure_deferred;
+	struct wl_event_source *sync_timer;
 	int no_shadow;
+	bool icon_unavailable;
+	uint64_t icon_hash;
+	uint32_t pending_refresh;
+	struct wl_event_source *refresh_source;
 	struct wm_size_hints size_hints;
 	struct motif_wm_hints motif_hints;
-	struct wl_list link;
 	int decor_top;
 	int decor_bottom;
 	int decor_left;
@@ -196,6 +221,12 @@ weston_wm_set_net_active_window(struct weston_wm *wm, xcb_window_t window);
 static void
 weston_wm_window_schedule_repaint(struct weston_wm_window *window);
 
+static void
+weston_wm_schedule_flush(struct weston_wm *wm);
+
+static void
+weston_wm_window_update_sync_alarm(struct weston_wm_window *window);
+
 static int
 legacy_fullscreen(struct weston_wm *wm,
 		  struct weston_wm_window *window,
@@ -305,7 +336,9 @@ get_atom_name(xcb_connection_t *c, xcb_atom_t atom)
 }
 
 static xcb_cursor_t
-xcb_cursor_image_load_cursor(struct weston_wm *wm, const XcursorImage *img)
+xcb_cursor_pixels_load_cursor(struct weston_wm *wm,
+			      int width, int height, int xhot, int yhot,
+			      const uint32_t *pixels)
 {
 	xcb_connection_t *c = wm->conn;
 	xcb_screen_iterator_t s = xcb_setup_roots_iterator(xcb_get_setup(c));
@@ -314,10 +347,10 @@ xcb_cursor_image_load_cursor(struct weston_wm *wm, const XcursorImage *img)
 	xcb_pixmap_t pix;
 	xcb_render_picture_t pic;
 	xcb_cursor_t cursor;
-	int stride = img->width * 4;
+	int stride = width * 4;
 
 	pix = xcb_generate_id(c);
-	xcb_create_pixmap(c, 32, pix, screen->root, img->width, img->height);
+	xcb_create_pixmap(c, 32, pix, screen->root, width, height);
 
 	pic = xcb_generate_id(c);
 	xcb_render_create_picture(c, pic, pix, wm->format_rgba.id, 0, 0);
@@ -326,12 +359,12 @@ xcb_cursor_image_load_cursor(struct weston_wm *wm, const XcursorImage *img)
 	xcb_create_gc(c, gc, pix, 0, 0);
 
 	xcb_put_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, pix, gc,
-		      img->width, img->height, 0, 0, 0, 32,
-		      stride * img->height, (uint8_t *) img->pixels);
+		      width, height, 0, 0, 0, 32,
+		      stride * height, (const uint8_t *) pixels);
 	xcb_free_gc(c, gc);
 
 	cursor = xcb_generate_id(c);
-	xcb_render_create_cursor(c, cursor, pic, img->xhot, img->yhot);
+	xcb_render_create_cursor(c, cursor, pic, xhot, yhot);
 
 	xcb_render_free_picture(c, pic);
 	xcb_free_pixmap(c, pix);
@@ -339,23 +372,17 @@ xcb_cursor_image_load_cursor(struct weston_wm *wm, const XcursorImage *img)
 	return cursor;
 }
 
-static xcb_cursor_t
-xcb_cursor_images_load_cursor(struct weston_wm *wm, const XcursorImages *images)
-{
-	/* TODO: treat animated cursors as well */
-	if (images->nimage != 1)
-		return -1;
-
-	return xcb_cursor_image_load_cursor(wm, images->images[0]);
-}
-
 static xcb_cursor_t
 xcb_cursor_library_load_cursor(struct weston_wm *wm, const char *file)
 {
+	struct weston_compositor *compositor = wm->server->compositor;
+	const struct weston_cursor_image *cached;
 	xcb_cursor_t cursor;
 	XcursorImages *images;
+	XcursorImage *img;
 	char *v = NULL;
 	char *theme = NULL;
+	char name[256];
 	int size = 0;
 
 	if (!file)
@@ -370,11 +397,34 @@ xcb_cursor_library_load_cursor(struct weston_wm *wm, const char *file)
 
 	theme = getenv("XCURSOR_THEME");
 
+	/* A restarted X server gets its cursors without touching the
+	 * theme files again. */
+	snprintf(name, sizeof name, "xcursor:%s:%s", theme ? theme : "", file);
+	cached = weston_compositor_find_cursor_image(compositor, name, size);
+	if (cached)
+		return xcb_cursor_pixels_load_cursor(wm, cached->width,
+						     cached->height,
+						     cached->hotspot_x,
+						     cached->hotspot_y,
+						     cached->pixels);
+
 	images = XcursorLibraryLoadImages (file, theme, size);
 	if (!images)
 		return -1;
 
-	cursor = xcb_cursor_images_load_cursor (wm, images);
+	/* TODO: treat animated cursors as well */
+	if (images->nimage != 1) {
+		XcursorImagesDestroy (images);
+		return -1;
+	}
+
+	img = images->images[0];
+	weston_compositor_add_cursor_image(compositor, name, size, 0,
+					   img->width, img->height,
+					   img->xhot, img->yhot, img->pixels);
+	cursor = xcb_cursor_pixels_load_cursor(wm, img->width, img->height,
+					       img->xhot, img->yhot,
+					       img->pixels);
 	XcursorImagesDestroy (images);
 
 	return cursor;
@@ -487,20 +537,118 @@ dump_property(FILE *fp, struct weston_wm *wm,
 	}
 }
 
+struct weston_wm_property_request;
+
+typedef void (*weston_wm_property_done_func_t)(struct weston_wm *wm,
+		struct weston_wm_property_request *request,
+		xcb_get_property_reply_t *reply);
+
+/* An outstanding xcb_get_property request. Replies are collected from
+ * weston_wm_handle_event() so the compositor never blocks on the X server
+ * for them; the window may be gone by the time the reply arrives, so
+ * completion handlers look it up again by id.
+ */
+struct weston_wm_property_request {
+	struct wl_list link; /* weston_wm::property_request_list */
+	xcb_get_property_cookie_t cookie;
+	xcb_window_t window_id;
+	xcb_atom_t property;
+	weston_wm_property_done_func_t done;
+	char *log;
+};
+
+static bool
+weston_wm_get_property_async(struct weston_wm *wm, xcb_window_t window_id,
+			     xcb_atom_t property, xcb_atom_t type,
+			     uint32_t long_length,
+			     weston_wm_property_done_func_t done, char *log)
+{
+	struct weston_wm_property_request *request;
+
+	request = zalloc(sizeof *request);
+	if (!request) {
+		weston_log("failed to allocate property request\n");
+		free(log);
+		return false;
+	}
+
+	request->cookie = xcb_get_property(wm->conn, 0, window_id,
+					   property, type, 0, long_length);
+	request->window_id = window_id;
+	request->property = property;
+	request->done = done;
+	request->log = log;
+	wl_list_insert(wm->property_request_list.prev, &request->link);
+
+	return true;
+}
+
 static void
-read_and_dump_property(FILE *fp, struct weston_wm *wm,
-		       xcb_window_t window, xcb_atom_t property)
+weston_wm_property_request_destroy(struct weston_wm_property_request *request)
 {
-	xcb_get_property_reply_t *reply;
-	xcb_get_property_cookie_t cookie;
+	wl_list_remove(&request->link);
+	free(request->log);
+	free(request);
+}
+
+static int
+weston_wm_dispatch_property_replies(struct weston_wm *wm)
+{
+	struct weston_wm_property_request *request, *next;
+	xcb_generic_error_t *error;
+	void *reply;
+	int count = 0;
 
-	cookie = xcb_get_property(wm->conn, 0, window,
-				  property, XCB_ATOM_ANY, 0, 2048);
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	/* Replies arrive in request order, so stop at the first request
+	 * that is still in flight. */
+	wl_list_for_each_safe(request, next, &wm->property_request_list, link) {
+		error = NULL;
+		reply = NULL;
+		if (!xcb_poll_for_reply(wm->conn, request->cookie.sequence,
+					&reply, &error))
+			break;
 
-	dump_property(fp, wm, property, reply);
+		/* A NULL reply is a bad window, typically */
+		request->done(wm, request, reply);
+		free(reply);
+		free(error);
+		weston_wm_property_request_destroy(request);
+		count++;
+	}
 
-	free(reply);
+	return count;
+}
+
+static void
+weston_wm_discard_property_requests(struct weston_wm *wm)
+{
+	struct weston_wm_property_request *request, *next;
+
+	wl_list_for_each_safe(request, next, &wm->property_request_list, link) {
+		xcb_discard_reply(wm->conn, request->cookie.sequence);
+		weston_wm_property_request_destroy(request);
+	}
+}
+
+static void
+weston_wm_dump_property_done(struct weston_wm *wm,
+			     struct weston_wm_property_request *request,
+			     xcb_get_property_reply_t *reply)
+{
+	FILE *fp;
+	char *logstr;
+	size_t logsize;
+
+	fp = open_memstream(&logstr, &logsize);
+	if (!fp)
+		return;
+
+	fputs(request->log, fp);
+	dump_property(fp, wm, request->property, reply);
+
+	if (fclose(fp) == 0)
+		weston_log_scope_write(wm->server->wm_debug, logstr, logsize);
+	free(logstr);
 }
 
 static char *
@@ -549,6 +697,7 @@ window_type_atom_to_string(struct weston_wm *wm, xcb_atom_t atom)
 #define TYPE_NET_WM_STATE	XCB_ATOM_CUT_BUFFER2
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 #define TYPE_WM_WINDOW_TYPE	XCB_ATOM_CUT_BUFFER4
+#define TYPE_WM_CLASS		XCB_ATOM_CUT_BUFFER5
 
 static void
 weston_wm_window_read_properties(struct weston_wm_window *window)
@@ -561,9 +710,10 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		xcb_atom_t type;
 		void *ptr;
 	} props[] = {
-		{ XCB_ATOM_WM_CLASS,           XCB_ATOM_STRING,            F(class) },
+		{ XCB_ATOM_WM_CLASS,           TYPE_WM_CLASS,              NULL },
 		{ XCB_ATOM_WM_NAME,            XCB_ATOM_STRING,            F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR,   XCB_ATOM_WINDOW,            F(transient_for) },
+		{ wm->atom.net_wm_sync_request_counter, XCB_ATOM_CARDINAL, F(sync_counter) },
 		{ wm->atom.wm_protocols,       TYPE_WM_PROTOCOLS,          NULL },
 		{ wm->atom.wm_normal_hints,    TYPE_WM_NORMAL_HINTS,       NULL },
 		{ wm->atom.net_wm_state,       TYPE_NET_WM_STATE,          NULL },
@@ -580,6 +730,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	void *p;
 	uint32_t *xid;
 	xcb_atom_t *atom;
+	const char *text;
+	int len, instance_len;
 	uint32_t i;
 	char name[1024];
 
@@ -599,6 +751,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	window->motif_hints.flags = 0;
 	window->delete_window = 0;
 	window->take_focus = 0;
+	window->sync_request = 0;
+	window->sync_counter = XCB_NONE;
 
 	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
 		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
@@ -625,6 +779,21 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 				strndup(xcb_get_property_value(reply),
 					xcb_get_property_value_length(reply));
 			break;
+		case TYPE_WM_CLASS:
+			/* WM_CLASS is the instance name followed by the
+			   class name, each NUL terminated. */
+			free(window->class);
+			free(window->class_name);
+			window->class_name = NULL;
+			text = xcb_get_property_value(reply);
+			len = xcb_get_property_value_length(reply);
+			window->class = strndup(text, len);
+			instance_len = strnlen(text, len);
+			if (instance_len + 1 < len)
+				window->class_name =
+					strndup(text + instance_len + 1,
+						len - instance_len - 1);
+			break;
 		case XCB_ATOM_WINDOW:
 			xid = xcb_get_property_value(reply);
 			if (!wm_lookup_window(wm, *xid, p))
@@ -660,6 +829,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 					window->delete_window = 1;
 				} else if (atom[i] == wm->atom.wm_take_focus) {
 					window->take_focus = 1;
+				} else if (atom[i] == wm->atom.net_wm_sync_request) {
+					window->sync_request = 1;
 				}
 			break;
 		case TYPE_WM_NORMAL_HINTS:
@@ -699,6 +870,12 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		free(reply);
 	}
 
+	weston_wm_window_update_sync_alarm(window);
+
+	/* Neither the title bar nor the shadow is ours to draw. */
+	if (wm->server->compositor->shell_draws_xwayland_decorations)
+		window->decorate = 0;
+
 	if (window->pid > 0) {
 		gethostname(name, sizeof(name));
 		for (i = 0; i < sizeof(name); i++) {
@@ -720,6 +897,7 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 #undef TYPE_MOTIF_WM_HINTS
 #undef TYPE_NET_WM_STATE
 #undef TYPE_WM_NORMAL_HINTS
+#undef TYPE_WM_CLASS
 
 static void
 weston_wm_window_get_frame_size(struct weston_wm_window *window,
@@ -1054,20 +1232,43 @@ weston_wm_create_surface(struct wl_listener *listener, void *data)
 		container_of(listener,
 			     struct weston_wm, create_surface_listener);
 	struct weston_wm_window *window;
+	uint32_t id;
 
 	if (wl_resource_get_client(surface->resource) != wm->server->client)
 		return;
 
 	wm_printf(wm, "XWM: create weston_surface %p\n", surface);
 
-	wl_list_for_each(window, &wm->unpaired_window_list, link)
-		if (window->surface_id ==
-		    wl_resource_get_id(surface->resource)) {
-			xserver_map_shell_surface(window, surface);
-			window->surface_id = 0;
-			wl_list_remove(&window->link);
-			break;
-		}
+	id = wl_resource_get_id(surface->resource);
+	window = hash_table_lookup(wm->unpaired_window_hash, id);
+	if (window) {
+		hash_table_remove(wm->unpaired_window_hash, id);
+		window->surface_id = 0;
+		xserver_map_shell_surface(window, surface);
+	}
+}
+
+/* Stop waiting for the wl_surface of the window, e.g. when it is unmapped
+ * before Xwayland created or associated it. Otherwise we could be assigned
+ * a surface that was mapped before the unmap request.
+ */
+static void
+weston_wm_window_forget_surface(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	uint32_t key = window->surface_serial;
+
+	if (window->surface_id &&
+	    hash_table_lookup(wm->unpaired_window_hash,
+			      window->surface_id) == window)
+		hash_table_remove(wm->unpaired_window_hash,
+				  window->surface_id);
+	window->surface_id = 0;
+
+	if (window->surface_serial &&
+	    hash_table_lookup(wm->serial_window_hash, key) == window)
+		hash_table_remove(wm->serial_window_hash, key);
+	window->surface_serial = 0;
 }
 
 static void
@@ -1143,7 +1344,7 @@ weston_wm_window_activate(struct wl_listener *listener, void *data)
 		weston_wm_window_schedule_repaint(wm->focus_window);
 	}
 
-	xcb_flush(wm->conn);
+	weston_wm_schedule_flush(wm);
 
 }
 
@@ -1179,7 +1380,7 @@ weston_wm_window_set_allow_commits(struct weston_wm_window *window, bool allow)
 			    XCB_ATOM_CARDINAL,
 			    32, /* format */
 			    1, property);
-	xcb_flush(wm->conn);
+	weston_wm_schedule_flush(wm);
 }
 
 #define ICCCM_WITHDRAWN_STATE	0
@@ -1320,12 +1521,15 @@ weston_wm_window_create_frame(struct weston_wm_window *window)
 	weston_wm_configure_window(wm, window->id,
 				   XCB_CONFIG_WINDOW_BORDER_WIDTH, values);
 
-	window->cairo_surface =
-		cairo_xcb_surface_create_with_xrender_format(wm->conn,
-							     wm->screen,
-							     window->frame_id,
-							     &wm->format_rgba,
-							     width, height);
+	/* The shell draws the decorations, so the frame window only ever
+	 * holds the client window and is never painted. */
+	if (!wm->server->compositor->shell_draws_xwayland_decorations)
+		window->cairo_surface =
+			cairo_xcb_surface_create_with_xrender_format(wm->conn,
+								     wm->screen,
+								     window->frame_id,
+								     &wm->format_rgba,
+								     width, height);
 
 	hash_table_insert(wm->window_hash, window->frame_id, window);
 	weston_wm_window_send_configure_notify(window);
@@ -1456,14 +1660,7 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 	if (!wm_lookup_window(wm, unmap_notify->window, &window))
 		return;
 
-	if (window->surface_id) {
-		/* Make sure we're not on the unpaired surface list or we
-		 * could be assigned a surface during surface creation that
-		 * was mapped before this unmap request.
-		 */
-		wl_list_remove(&window->link);
-		window->surface_id = 0;
-	}
+	weston_wm_window_forget_surface(window);
 	if (wm->focus_window == window)
 		wm->focus_window = NULL;
 	if (window->surface)
@@ -1484,6 +1681,9 @@ weston_wm_window_draw_decoration(struct weston_wm_window *window)
 	int width, height;
 	const char *how;
 
+	if (!window->cairo_surface)
+		return;
+
 	weston_wm_window_get_frame_size(window, &width, &height);
 
 	cairo_xcb_surface_set_size(window->cairo_surface, width, height);
@@ -1517,7 +1717,7 @@ weston_wm_window_draw_decoration(struct weston_wm_window *window)
 
 	cairo_destroy(cr);
 	cairo_surface_flush(window->cairo_surface);
-	xcb_flush(window->wm->conn);
+	weston_wm_schedule_flush(window->wm);
 }
 
 static void
@@ -1641,42 +1841,47 @@ weston_wm_window_schedule_repaint(struct weston_wm_window *window)
 				       weston_wm_window_do_repaint, window);
 }
 
+static uint64_t
+icon_hash(uint32_t width, uint32_t height, const uint32_t *bits)
+{
+	const uint8_t *p = (const uint8_t *) bits;
+	size_t size = (size_t) width * height * sizeof *bits;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t i;
+
+	/* FNV-1a over the dimensions and the pixels */
+	hash = (hash ^ width) * 0x100000001b3ull;
+	hash = (hash ^ height) * 0x100000001b3ull;
+	for (i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
 static bool
-weston_wm_window_set_icon(struct weston_wm *wm,
-	struct weston_wm_window *window, xcb_window_t window_id)
+weston_wm_window_apply_icon(struct weston_wm_window *window,
+			    xcb_get_property_reply_t *reply, bool dedup)
 {
-	bool is_set_window_icon_called = false;
+	struct weston_wm *wm = window->wm;
 	const struct weston_desktop_xwayland_interface *xwayland_interface =
 		wm->server->compositor->xwayland_interface;
-	xcb_get_property_reply_t *reply;
-	xcb_get_property_cookie_t cookie;
 	char *data;
 	int length;
 	uint32_t *cur, *selected_bits;
 	uint32_t width, selected_width;
 	uint32_t height, selected_height;
+	uint64_t hash;
 
-	if (!xwayland_interface->set_window_icon)
-		return false;
-
-	if (!window->shsurf) {
-		/* shell surface is not associated yet */
-		return false;
-	}
-
-	cookie = xcb_get_property(wm->conn, 0, window_id,
-				wm->atom.net_wm_icon, XCB_ATOM_CARDINAL, 0,  0x1fffffff);
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
-	if (!reply)
+	if (!reply || !window->shsurf)
 		return false;
 	length = xcb_get_property_value_length(reply);
-	if (!length) {
-		free(reply);
+	if (!length)
 		return false;
-	}
 	assert(reply->type == XCB_ATOM_CARDINAL);
 	data = xcb_get_property_value(reply);
-	wm_printf(wm, "weston_wm_window_set_icon: data:%p, length:%d\n", data, length);
+	wm_printf(wm, "weston_wm_window_apply_icon: data:%p, length:%d\n", data, length);
 
 	selected_bits = NULL;
 	selected_width = 0;
@@ -1696,14 +1901,139 @@ weston_wm_window_set_icon(struct weston_wm *wm,
 
 	wm_printf(wm, "    selected icon (%d x %d) at %p\n", selected_width, selected_height, selected_bits);
 
-	if (selected_width && selected_height && selected_bits) {
-		xwayland_interface->set_window_icon(window->shsurf, selected_width, selected_height, 32, selected_bits);
-		is_set_window_icon_called = true;
+	if (!selected_width || !selected_height || !selected_bits)
+		return false;
+
+	/* Clients like to re-set an unchanged icon; converting and sending
+	 * it to the RDP client again is not free, so skip those. */
+	hash = icon_hash(selected_width, selected_height, selected_bits);
+	if (dedup && hash == window->icon_hash) {
+		wm_printf(wm, "    icon unchanged, not forwarded\n");
+		return true;
 	}
+	window->icon_hash = hash;
 
-	free(reply);
+	xwayland_interface->set_window_icon(window->shsurf, selected_width, selected_height, 32, selected_bits);
+
+	return true;
+}
+
+static void
+weston_wm_window_icon_done(struct weston_wm *wm,
+			   struct weston_wm_property_request *request,
+			   xcb_get_property_reply_t *reply)
+{
+	struct weston_wm_window *window;
+
+	if (!wm_lookup_window(wm, request->window_id, &window))
+		return;
 
-	return is_set_window_icon_called;
+	if (!weston_wm_window_apply_icon(window, reply, true))
+		window->icon_unavailable = true;
+}
+
+static void
+weston_wm_window_trigger_icon_done(struct weston_wm *wm,
+				   struct weston_wm_property_request *request,
+				   xcb_get_property_reply_t *reply)
+{
+	const struct weston_desktop_xwayland_interface *xwayland_interface =
+		wm->server->compositor->xwayland_interface;
+	struct weston_wm_window *window;
+
+	if (!wm_lookup_window(wm, request->window_id, &window))
+		return;
+
+	if (weston_wm_window_apply_icon(window, reply, false))
+		return;
+
+	/* The shell is waiting for this callback; with no icon from X it
+	 * retries trigger_set_window_icon(), which now fails and lets it
+	 * fall back to its own icon lookup. */
+	window->icon_unavailable = true;
+	if (window->shsurf)
+		xwayland_interface->set_window_icon(window->shsurf, 0, 0, 0, NULL);
+}
+
+static bool
+weston_wm_window_read_icon(struct weston_wm_window *window,
+			   weston_wm_property_done_func_t done)
+{
+	struct weston_wm *wm = window->wm;
+	const struct weston_desktop_xwayland_interface *xwayland_interface =
+		wm->server->compositor->xwayland_interface;
+
+	if (!xwayland_interface->set_window_icon)
+		return false;
+
+	if (!window->shsurf) {
+		/* shell surface is not associated yet */
+		return false;
+	}
+
+	return weston_wm_get_property_async(wm, window->id,
+					    wm->atom.net_wm_icon,
+					    XCB_ATOM_CARDINAL, 0x1fffffff,
+					    done, NULL);
+}
+
+static int
+weston_wm_window_frame_interval_msec(struct weston_wm_window *window)
+{
+	struct weston_output *output = NULL;
+
+	if (window->surface)
+		output = window->surface->output;
+	if (!output || !output->current_mode ||
+	    output->current_mode->refresh <= 0)
+		return 16;
+
+	/* refresh is in mHz */
+	return MAX(1, 1000000 / output->current_mode->refresh);
+}
+
+static int
+weston_wm_window_refresh(void *data)
+{
+	struct weston_wm_window *window = data;
+	uint32_t pending = window->pending_refresh;
+
+	window->pending_refresh = 0;
+
+	if (pending & WM_WINDOW_REFRESH_NAME)
+		weston_wm_window_schedule_repaint(window);
+
+	if ((pending & WM_WINDOW_REFRESH_ICON) &&
+	    weston_wm_window_read_icon(window, weston_wm_window_icon_done))
+		weston_wm_schedule_flush(window->wm);
+
+	return 0;
+}
+
+/* Chatty clients change their title or icon many times per second.
+ * Fold those into at most one refresh per output frame. */
+static void
+weston_wm_window_schedule_refresh(struct weston_wm_window *window,
+				  uint32_t what)
+{
+	struct weston_wm *wm = window->wm;
+
+	if (!window->refresh_source) {
+		window->refresh_source =
+			wl_event_loop_add_timer(wm->server->loop,
+						weston_wm_window_refresh,
+						window);
+		if (!window->refresh_source) {
+			window->pending_refresh |= what;
+			weston_wm_window_refresh(window);
+			return;
+		}
+	}
+
+	if (!window->pending_refresh)
+		wl_event_source_timer_update(window->refresh_source,
+			weston_wm_window_frame_interval_msec(window));
+	window->pending_refresh |= what;
 }
 
 static void
@@ -1762,28 +2092,35 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 		if (property_notify->state == XCB_PROPERTY_DELETE)
 			fprintf(fp, "deleted %s\n",
 					get_atom_name(wm->conn, property_notify->atom));
-		else
-			read_and_dump_property(fp, wm, property_notify->window,
-					       property_notify->atom);
 
-		if (fclose(fp) == 0)
-			weston_log_scope_write(wm->server->wm_debug,
-						 logstr, logsize);
+		if (fclose(fp) == 0) {
+			if (property_notify->state == XCB_PROPERTY_DELETE) {
+				weston_log_scope_write(wm->server->wm_debug,
+							 logstr, logsize);
+			} else {
+				/* The property is logged when its value
+				 * arrives; the request owns logstr. */
+				weston_wm_get_property_async(wm,
+					property_notify->window,
+					property_notify->atom,
+					XCB_ATOM_ANY, 2048,
+					weston_wm_dump_property_done, logstr);
+				logstr = NULL;
+			}
+		}
 		free(logstr);
-	} else {
-		/* read_and_dump_property() is a X11 roundtrip.
-		 * Mimic it to maintain ordering semantics between debug
-		 * and non-debug paths.
-		 */
-		get_atom_name(wm->conn, property_notify->atom);
 	}
 
 	if (property_notify->atom == wm->atom.net_wm_name ||
 	    property_notify->atom == XCB_ATOM_WM_NAME)
-		weston_wm_window_schedule_repaint(window);
+		weston_wm_window_schedule_refresh(window,
+						  WM_WINDOW_REFRESH_NAME);
 
-	if (property_notify->atom == wm->atom.net_wm_icon)
-		weston_wm_window_set_icon(wm, window, property_notify->window);
+	if (property_notify->atom == wm->atom.net_wm_icon) {
+		window->icon_unavailable = false;
+		weston_wm_window_schedule_refresh(window,
+						  WM_WINDOW_REFRESH_ICON);
+	}
 }
 
 static void
@@ -1838,6 +2175,9 @@ weston_wm_window_create(struct weston_wm *wm,
 	free(geometry_reply);
 
 	hash_table_insert(wm->window_hash, id, window);
+
+	if (wm->client_window_count++ == 0)
+		weston_xserver_update_idle(wm->server);
 }
 
 static void
@@ -1851,6 +2191,11 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 		wl_event_source_remove(window->configure_source);
 	if (window->repaint_source)
 		wl_event_source_remove(window->repaint_source);
+	if (window->refresh_source)
+		wl_event_source_remove(window->refresh_source);
+	if (window->sync_timer)
+		wl_event_source_remove(window->sync_timer);
+	weston_wm_window_destroy_sync_alarm(window);
 	if (window->cairo_surface)
 		cairo_surface_destroy(window->cairo_surface);
 
@@ -1866,13 +2211,17 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 	if (window->frame)
 		frame_destroy(window->frame);
 
-	if (window->surface_id)
-		wl_list_remove(&window->link);
+	weston_wm_window_forget_surface(window);
 
 	if (window->surface)
 		wl_list_remove(&window->surface_destroy_listener.link);
 
 	hash_table_remove(window->wm->window_hash, window->id);
+
+	if (--wm->client_window_count == 0)
+		weston_xserver_update_idle(wm->server);
+
+	free(window->class_name);
 	free(window);
 }
 
@@ -2187,7 +2536,7 @@ weston_wm_window_handle_surface_id(struct weston_wm_window *window,
 	struct weston_wm *wm = window->wm;
 	struct wl_resource *resource;
 
-	if (window->surface_id != 0) {
+	if (window->surface_id != 0 || window->surface_serial != 0) {
 		wm_printf(wm, "already have surface id for window %d\n",
 			  window->id);
 		return;
@@ -2197,8 +2546,8 @@ weston_wm_window_handle_surface_id(struct weston_wm_window *window,
 	 * wl_surface before sending this client message.  Even so, we
 	 * can end up handling the X event before the wayland requests
 	 * and thus when we try to look up the surface ID, the surface
-	 * hasn't been created yet.  In that case put the window on
-	 * the unpaired window list and continue when the surface gets
+	 * hasn't been created yet.  In that case put the window in
+	 * the unpaired window hash and continue when the surface gets
 	 * created. */
 	uint32_t id = client_message->data.data32[0];
 	resource = wl_client_get_object(wm->server->client, id);
@@ -2207,12 +2556,289 @@ weston_wm_window_handle_surface_id(struct weston_wm_window *window,
 		xserver_map_shell_surface(window,
 					  wl_resource_get_user_data(resource));
 	}
-	else {
+	else if (hash_table_insert(wm->unpaired_window_hash, id, window) == 0) {
 		window->surface_id = id;
-		wl_list_insert(&wm->unpaired_window_list, &window->link);
 	}
 }
 
+#ifdef HAVE_XWAYLAND_SHELL
+struct weston_wm_xwayland_surface {
+	struct weston_wm *wm;
+	struct wl_resource *resource;
+	struct weston_surface *surface;
+	struct wl_listener surface_destroy_listener;
+	uint64_t serial;
+	bool pending;
+	struct wl_list link; /* weston_wm::xwayland_surface_list */
+};
+
+static void
+weston_wm_xwayland_surface_unpend(struct weston_wm_xwayland_surface *xsurf)
+{
+	uint32_t key = xsurf->serial;
+
+	if (!xsurf->pending)
+		return;
+
+	if (hash_table_lookup(xsurf->wm->serial_surface_hash, key) == xsurf)
+		hash_table_remove(xsurf->wm->serial_surface_hash, key);
+	xsurf->pending = false;
+}
+
+static struct weston_surface *
+weston_wm_take_serial_surface(struct weston_wm *wm, uint64_t serial)
+{
+	struct weston_wm_xwayland_surface *xsurf;
+
+	xsurf = hash_table_lookup(wm->serial_surface_hash, (uint32_t)serial);
+	if (!xsurf || xsurf->serial != serial)
+		return NULL;
+
+	weston_wm_xwayland_surface_unpend(xsurf);
+
+	return xsurf->surface;
+}
+
+static void
+xwayland_surface_handle_surface_destroy(struct wl_listener *listener,
+					void *data)
+{
+	struct weston_wm_xwayland_surface *xsurf =
+		container_of(listener, struct weston_wm_xwayland_surface,
+			     surface_destroy_listener);
+
+	if (xsurf->wm)
+		weston_wm_xwayland_surface_unpend(xsurf);
+	wl_list_remove(&xsurf->surface_destroy_listener.link);
+	xsurf->surface = NULL;
+}
+
+static void
+xwayland_surface_set_serial(struct wl_client *client,
+			    struct wl_resource *resource,
+			    uint32_t serial_lo, uint32_t serial_hi)
+{
+	struct weston_wm_xwayland_surface *xsurf =
+		wl_resource_get_user_data(resource);
+	uint64_t serial = ((uint64_t)serial_hi << 32) | serial_lo;
+	struct weston_wm *wm = xsurf->wm;
+	struct weston_wm_window *window;
+
+	if (!wm)
+		return;
+
+	if (xsurf->serial != 0) {
+		wl_resource_post_error(resource,
+				       XWAYLAND_SURFACE_V1_ERROR_ALREADY_ASSOCIATED,
+				       "surface already has a serial");
+		return;
+	}
+
+	if (serial <= wm->last_surface_serial) {
+		wl_resource_post_error(resource,
+				       XWAYLAND_SURFACE_V1_ERROR_INVALID_SERIAL,
+				       "serial %" PRIu64 " is not monotonic",
+				       serial);
+		return;
+	}
+	wm->last_surface_serial = serial;
+	xsurf->serial = serial;
+
+	if (!xsurf->surface)
+		return;
+
+	/* The association takes effect on the next commit, which Xwayland
+	 * sends right after this request. Mapping now is equivalent, the
+	 * shell surface waits for a buffer either way. */
+	window = hash_table_lookup(wm->serial_window_hash, serial_lo);
+	if (window && window->surface_serial == serial) {
+		hash_table_remove(wm->serial_window_hash, serial_lo);
+		window->surface_serial = 0;
+		xserver_map_shell_surface(window, xsurf->surface);
+	} else if (hash_table_insert(wm->serial_surface_hash,
+				     serial_lo, xsurf) == 0) {
+		xsurf->pending = true;
+	}
+}
+
+static void
+xwayland_surface_destroy(struct wl_client *client,
+			 struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct xwayland_surface_v1_interface xwayland_surface_implementation = {
+	xwayland_surface_set_serial,
+	xwayland_surface_destroy,
+};
+
+static void
+xwayland_surface_destroy_resource(struct wl_resource *resource)
+{
+	struct weston_wm_xwayland_surface *xsurf =
+		wl_resource_get_user_data(resource);
+
+	if (xsurf->wm) {
+		weston_wm_xwayland_surface_unpend(xsurf);
+		wl_list_remove(&xsurf->link);
+	}
+	if (xsurf->surface)
+		wl_list_remove(&xsurf->surface_destroy_listener.link);
+
+	free(xsurf);
+}
+
+static void
+xwayland_shell_get_xwayland_surface(struct wl_client *client,
+				    struct wl_resource *resource,
+				    uint32_t id,
+				    struct wl_resource *surface_resource)
+{
+	struct weston_wm *wm = wl_resource_get_user_data(resource);
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct weston_wm_xwayland_surface *xsurf;
+
+	if (surface->role_name) {
+		wl_resource_post_error(resource, XWAYLAND_SHELL_V1_ERROR_ROLE,
+				       "surface already has role %s",
+				       surface->role_name);
+		return;
+	}
+
+	xsurf = zalloc(sizeof *xsurf);
+	if (!xsurf) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	xsurf->resource =
+		wl_resource_create(client, &xwayland_surface_v1_interface,
+				   wl_resource_get_version(resource), id);
+	if (!xsurf->resource) {
+		free(xsurf);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(xsurf->resource,
+				       &xwayland_surface_implementation,
+				       xsurf,
+				       xwayland_surface_destroy_resource);
+
+	xsurf->wm = wm;
+	xsurf->surface = surface;
+	xsurf->surface_destroy_listener.notify =
+		xwayland_surface_handle_surface_destroy;
+	wl_signal_add(&surface->destroy_signal,
+		      &xsurf->surface_destroy_listener);
+	wl_list_insert(&wm->xwayland_surface_list, &xsurf->link);
+}
+
+static void
+xwayland_shell_destroy(struct wl_client *client,
+		       struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct xwayland_shell_v1_interface xwayland_shell_implementation = {
+	xwayland_shell_destroy,
+	xwayland_shell_get_xwayland_surface,
+};
+
+static void
+bind_xwayland_shell(struct wl_client *client,
+		    void *data, uint32_t version, uint32_t id)
+{
+	struct weston_wm *wm = data;
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &xwayland_shell_v1_interface,
+				      version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	if (client != wm->server->client) {
+		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
+				       "permission to bind xwayland_shell_v1 denied");
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &xwayland_shell_implementation,
+				       wm, NULL);
+}
+
+static void
+weston_wm_xwayland_shell_init(struct weston_wm *wm)
+{
+	wm->xwayland_shell_global =
+		wl_global_create(wm->server->wl_display,
+				 &xwayland_shell_v1_interface, 1,
+				 wm, bind_xwayland_shell);
+}
+
+static void
+weston_wm_xwayland_shell_destroy(struct weston_wm *wm)
+{
+	struct weston_wm_xwayland_surface *xsurf, *next;
+
+	if (wm->xwayland_shell_global)
+		wl_global_destroy(wm->xwayland_shell_global);
+
+	/* the resources outlive us if the client is still around */
+	wl_list_for_each_safe(xsurf, next, &wm->xwayland_surface_list, link) {
+		xsurf->wm = NULL;
+		xsurf->pending = false;
+		wl_list_remove(&xsurf->link);
+	}
+}
+#else
+static struct weston_surface *
+weston_wm_take_serial_surface(struct weston_wm *wm, uint64_t serial)
+{
+	return NULL;
+}
+
+static void
+weston_wm_xwayland_shell_init(struct weston_wm *wm)
+{
+}
+
+static void
+weston_wm_xwayland_shell_destroy(struct weston_wm *wm)
+{
+}
+#endif /* HAVE_XWAYLAND_SHELL */
+
+static void
+weston_wm_window_handle_surface_serial(struct weston_wm_window *window,
+				       xcb_client_message_event_t *client_message)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_surface *surface;
+	uint64_t serial;
+
+	if (window->surface_id != 0 || window->surface_serial != 0) {
+		wm_printf(wm, "already have surface serial for window %d\n",
+			  window->id);
+		return;
+	}
+
+	/* Either the X client message or xwayland_surface_v1.set_serial
+	 * can come first, whichever does waits for the other one. */
+	serial = ((uint64_t)client_message->data.data32[1] << 32) |
+		 client_message->data.data32[0];
+	surface = weston_wm_take_serial_surface(wm, serial);
+	if (surface)
+		xserver_map_shell_surface(window, surface);
+	else if (hash_table_insert(wm->serial_window_hash,
+				   (uint32_t)serial, window) == 0)
+		window->surface_serial = serial;
+}
+
 static void
 weston_wm_handle_client_message(struct weston_wm *wm,
 				xcb_generic_event_t *event)
@@ -2242,6 +2868,8 @@ weston_wm_handle_client_message(struct weston_wm *wm,
 		weston_wm_window_handle_state(window, client_message);
 	else if (client_message->type == wm->atom.wl_surface_id)
 		weston_wm_window_handle_surface_id(window, client_message);
+	else if (client_message->type == wm->atom.wl_surface_serial)
+		weston_wm_window_handle_surface_serial(window, client_message);
 	else if (client_message->type == wm->atom.wm_change_state)
 		weston_wm_window_handle_iconic_state(window, client_message);
 }
@@ -2408,7 +3036,7 @@ weston_wm_window_set_cursor(struct weston_wm *wm, xcb_window_t window_id,
 	cursor_value_list = wm->cursors[cursor];
 	xcb_change_window_attributes (wm->conn, window_id,
 				      XCB_CW_CURSOR, &cursor_value_list);
-	xcb_flush(wm->conn);
+	weston_wm_schedule_flush(wm);
 }
 
 static void
@@ -2630,6 +3258,180 @@ weston_wm_handle_focus_in(struct weston_wm *wm, xcb_generic_event_t *event)
 		weston_wm_send_focus_window(wm, wm->focus_window);
 }
 
+static void
+weston_wm_flush_idle(void *data)
+{
+	struct weston_wm *wm = data;
+
+	wm->flush_source = NULL;
+	xcb_flush(wm->conn);
+}
+
+/* Requests made outside of weston_wm_handle_event() are flushed once per
+ * event loop iteration instead of at every call site. Idle sources run
+ * before the compositor flushes its clients, so these requests still
+ * reach the X server ahead of the Wayland events sent in the same
+ * iteration. */
+static void
+weston_wm_schedule_flush(struct weston_wm *wm)
+{
+	if (wm->flush_source)
+		return;
+
+	wm->flush_source = wl_event_loop_add_idle(wm->server->loop,
+						  weston_wm_flush_idle, wm);
+	if (!wm->flush_source)
+		xcb_flush(wm->conn);
+}
+
+static void
+weston_wm_window_destroy_sync_alarm(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+
+	if (window->sync_alarm == XCB_NONE)
+		return;
+
+	xcb_sync_destroy_alarm(wm->conn, window->sync_alarm);
+	hash_table_remove(wm->window_hash, window->sync_alarm);
+	window->sync_alarm = XCB_NONE;
+	window->sync_alarm_counter = XCB_NONE;
+}
+
+static void
+weston_wm_window_sync_done(struct weston_wm_window *window)
+{
+	window->sync_pending = false;
+	if (window->sync_timer)
+		wl_event_source_timer_update(window->sync_timer, 0);
+
+	if (window->configure_deferred) {
+		window->configure_deferred = false;
+		weston_wm_window_configure(window);
+	}
+}
+
+static void
+weston_wm_window_update_sync_alarm(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	uint32_t values[6];
+	xcb_sync_counter_t counter = XCB_NONE;
+
+	if (wm->sync && wm->sync->present && window->sync_request)
+		counter = window->sync_counter;
+
+	if (counter == window->sync_alarm_counter)
+		return;
+
+	weston_wm_window_destroy_sync_alarm(window);
+	if (window->sync_pending)
+		weston_wm_window_sync_done(window);
+
+	if (counter == XCB_NONE)
+		return;
+
+	/* The alarm fires once the client has set the counter to the
+	 * value of the last _NET_WM_SYNC_REQUEST, i.e. has painted. */
+	window->sync_alarm = xcb_generate_id(wm->conn);
+	values[0] = counter;
+	values[1] = XCB_SYNC_VALUETYPE_ABSOLUTE;
+	values[2] = (uint32_t) (window->sync_value >> 32);
+	values[3] = (uint32_t) window->sync_value;
+	values[4] = XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON;
+	values[5] = 1; /* events */
+	xcb_sync_create_alarm(wm->conn, window->sync_alarm,
+			      XCB_SYNC_CA_COUNTER |
+			      XCB_SYNC_CA_VALUE_TYPE |
+			      XCB_SYNC_CA_VALUE |
+			      XCB_SYNC_CA_TEST_TYPE |
+			      XCB_SYNC_CA_EVENTS,
+			      values);
+	window->sync_alarm_counter = counter;
+	hash_table_insert(wm->window_hash, window->sync_alarm, window);
+}
+
+static int
+weston_wm_window_sync_timeout(void *data)
+{
+	struct weston_wm_window *window = data;
+
+	wm_printf(window->wm, "XWM: win %d did not answer sync request %" PRId64
+		  " in time\n", window->id, window->sync_value);
+	weston_wm_window_sync_done(window);
+
+	return 0;
+}
+
+/* Ask the client to tell us when it has painted the size we are about
+ * to configure; further configures wait for that. */
+static void
+weston_wm_window_send_sync_request(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	xcb_client_message_event_t client_message;
+	uint32_t values[2];
+
+	if (window->sync_alarm == XCB_NONE)
+		return;
+
+	if (!window->sync_timer) {
+		window->sync_timer =
+			wl_event_loop_add_timer(wm->server->loop,
+						weston_wm_window_sync_timeout,
+						window);
+		if (!window->sync_timer)
+			return;
+	}
+
+	window->sync_value++;
+
+	values[0] = (uint32_t) (window->sync_value >> 32);
+	values[1] = (uint32_t) window->sync_value;
+	xcb_sync_change_alarm(wm->conn, window->sync_alarm,
+			      XCB_SYNC_CA_VALUE, values);
+
+	memset(&client_message, 0, sizeof client_message);
+	client_message.response_type = XCB_CLIENT_MESSAGE;
+	client_message.format = 32;
+	client_message.window = window->id;
+	client_message.type = wm->atom.wm_protocols;
+	client_message.data.data32[0] = wm->atom.net_wm_sync_request;
+	client_message.data.data32[1] = XCB_TIME_CURRENT_TIME;
+	client_message.data.data32[2] = values[1];
+	client_message.data.data32[3] = values[0];
+	xcb_send_event(wm->conn, 0, window->id,
+		       XCB_EVENT_MASK_NO_EVENT,
+		       (char *) &client_message);
+
+	window->sync_pending = true;
+	wl_event_source_timer_update(window->sync_timer,
+				     WM_SYNC_REQUEST_TIMEOUT_MSEC);
+}
+
+static void
+weston_wm_handle_sync_alarm_notify(struct weston_wm *wm,
+				   xcb_generic_event_t *event)
+{
+	xcb_sync_alarm_notify_event_t *alarm_notify =
+		(xcb_sync_alarm_notify_event_t *) event;
+	struct weston_wm_window *window;
+	int64_t value;
+
+	if (!wm_lookup_window(wm, alarm_notify->alarm, &window) ||
+	    window->sync_alarm != alarm_notify->alarm)
+		return;
+
+	value = ((int64_t) alarm_notify->counter_value.hi << 32) |
+		alarm_notify->counter_value.lo;
+
+	wm_printf(wm, "XWM: win %d sync counter %" PRId64 " (waiting for %" PRId64 ")\n",
+		  window->id, value, window->sync_value);
+
+	if (window->sync_pending && value >= window->sync_value)
+		weston_wm_window_sync_done(window);
+}
+
 static int
 weston_wm_handle_event(int fd, uint32_t mask, void *data)
 {
@@ -2650,6 +3452,15 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 			continue;
 		}
 
+		if (wm->sync && wm->sync->present &&
+		    EVENT_TYPE(event) ==
+		    wm->sync->first_event + XCB_SYNC_ALARM_NOTIFY) {
+			weston_wm_handle_sync_alarm_notify(wm, event);
+			free(event);
+			count++;
+			continue;
+		}
+
 		switch (EVENT_TYPE(event)) {
 		case XCB_BUTTON_PRESS:
 		case XCB_BUTTON_RELEASE:
@@ -2706,8 +3517,15 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 		count++;
 	}
 
-	if (count != 0)
+	count += weston_wm_dispatch_property_replies(wm);
+
+	/* Requests made by the handlers go out with this flush. */
+	if (count != 0) {
+		if (wm->flush_source)
+			wl_event_source_remove(wm->flush_source);
+		wm->flush_source = NULL;
 		xcb_flush(wm->conn);
+	}
 
 	return count;
 }
@@ -2795,6 +3613,8 @@ weston_wm_get_resources(struct weston_wm *wm)
 		{ "_KDE_NET_WM_WINDOW_TYPE_OVERRIDE",	F(atom.kde_net_wm_window_type_override) },
 
 		{ "_NET_WM_MOVERESIZE", F(atom.net_wm_moveresize) },
+		{ "_NET_WM_SYNC_REQUEST", F(atom.net_wm_sync_request) },
+		{ "_NET_WM_SYNC_REQUEST_COUNTER", F(atom.net_wm_sync_request_counter) },
 		{ "_NET_SUPPORTING_WM_CHECK",
 					F(atom.net_supporting_wm_check) },
 		{ "_NET_SUPPORTED",     F(atom.net_supported) },
@@ -2826,6 +3646,7 @@ weston_wm_get_resources(struct weston_wm *wm)
 		{ "XdndActionCopy",	F(atom.xdnd_action_copy) },
 		{ "_XWAYLAND_ALLOW_COMMITS",	F(atom.allow_commits) },
 		{ "WL_SURFACE_ID",	F(atom.wl_surface_id) },
+		{ "WL_SURFACE_SERIAL",	F(atom.wl_surface_serial) },
 		{ "_WESTON_FOCUS_PING",	F(atom.weston_focus_ping) }
 	};
 #undef F
@@ -2841,6 +3662,7 @@ weston_wm_get_resources(struct weston_wm *wm)
 
 	xcb_prefetch_extension_data (wm->conn, &xcb_xfixes_id);
 	xcb_prefetch_extension_data (wm->conn, &xcb_composite_id);
+	xcb_prefetch_extension_data (wm->conn, &xcb_sync_id);
 
 	formats_cookie = xcb_render_query_pict_formats(wm->conn);
 
@@ -2870,6 +3692,16 @@ weston_wm_get_resources(struct weston_wm *wm)
 
 	free(xfixes_reply);
 
+	/* SYNC is only used for _NET_WM_SYNC_REQUEST alarms. */
+	wm->sync = xcb_get_extension_data(wm->conn, &xcb_sync_id);
+	if (wm->sync && wm->sync->present)
+		xcb_discard_reply(wm->conn,
+				  xcb_sync_initialize(wm->conn,
+						      XCB_SYNC_MAJOR_VERSION,
+						      XCB_SYNC_MINOR_VERSION).sequence);
+	else
+		weston_log("sync not available\n");
+
 	formats_reply = xcb_render_query_pict_formats_reply(wm->conn,
 							    formats_cookie, 0);
 	if (formats_reply == NULL)
@@ -2947,6 +3779,15 @@ weston_wm_create_wm_window(struct weston_wm *wm)
 				XCB_TIME_CURRENT_TIME);
 }
 
+static void
+weston_wm_destroy_hashes(struct weston_wm *wm)
+{
+	hash_table_destroy(wm->window_hash);
+	hash_table_destroy(wm->unpaired_window_hash);
+	hash_table_destroy(wm->serial_window_hash);
+	hash_table_destroy(wm->serial_surface_hash);
+}
+
 struct weston_wm *
 weston_wm_create(struct weston_xserver *wxs, int fd)
 {
@@ -2954,7 +3795,7 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	struct wl_event_loop *loop;
 	xcb_screen_iterator_t s;
 	uint32_t values[1];
-	xcb_atom_t supported[7];
+	xcb_atom_t supported[8];
 
 	wm = zalloc(sizeof *wm);
 	if (wm == NULL)
@@ -2962,7 +3803,12 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 
 	wm->server = wxs;
 	wm->window_hash = hash_table_create();
-	if (wm->window_hash == NULL) {
+	wm->unpaired_window_hash = hash_table_create();
+	wm->serial_window_hash = hash_table_create();
+	wm->serial_surface_hash = hash_table_create();
+	if (wm->window_hash == NULL || wm->unpaired_window_hash == NULL ||
+	    wm->serial_window_hash == NULL || wm->serial_surface_hash == NULL) {
+		weston_wm_destroy_hashes(wm);
 		free(wm);
 		return NULL;
 	}
@@ -2972,7 +3818,7 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	if (xcb_connection_has_error(wm->conn)) {
 		weston_log("xcb_connect_to_fd failed\n");
 		close(fd);
-		hash_table_destroy(wm->window_hash);
+		weston_wm_destroy_hashes(wm);
 		free(wm);
 		return NULL;
 	}
@@ -3001,6 +3847,9 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 					  XCB_COMPOSITE_REDIRECT_MANUAL);
 
 	wm->theme = theme_create();
+	/* No shadow either; the frame window matches the client window. */
+	if (wm->theme && wxs->compositor->shell_draws_xwayland_decorations)
+		wm->theme->margin = 0;
 
 	supported[0] = wm->atom.net_wm_moveresize;
 	supported[1] = wm->atom.net_wm_state;
@@ -3009,6 +3858,7 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	supported[4] = wm->atom.net_wm_state_maximized_horz;
 	supported[5] = wm->atom.net_active_window;
 	supported[6] = wm->atom.net_frame_extents;
+	supported[7] = wm->atom.net_wm_sync_request;
 	xcb_change_property(wm->conn,
 			    XCB_PROP_MODE_REPLACE,
 			    wm->screen->root,
@@ -3034,7 +3884,9 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	wm->kill_listener.notify = weston_wm_kill_client;
 	wl_signal_add(&wxs->compositor->kill_signal,
 		      &wm->kill_listener);
-	wl_list_init(&wm->unpaired_window_list);
+	wl_list_init(&wm->property_request_list);
+	wl_list_init(&wm->xwayland_surface_list);
+	weston_wm_xwayland_shell_init(wm);
 
 	weston_wm_create_cursors(wm);
 	weston_wm_window_set_cursor(wm, wm->screen->root, XWM_CURSOR_LEFT_PTR);
@@ -3052,8 +3904,12 @@ void
 weston_wm_destroy(struct weston_wm *wm)
 {
 	/* FIXME: Free windows in hash. */
-	hash_table_destroy(wm->window_hash);
+	weston_wm_xwayland_shell_destroy(wm);
+	weston_wm_destroy_hashes(wm);
 	weston_wm_destroy_cursors(wm);
+	weston_wm_discard_property_requests(wm);
+	if (wm->flush_source)
+		wl_event_source_remove(wm->flush_source);
 	xcb_disconnect(wm->conn);
 	wl_event_source_remove(wm->source);
 	wl_list_remove(&wm->seat_create_listener.link);
@@ -3098,6 +3954,15 @@ weston_wm_window_configure(void *data)
 		window->configure_source = NULL;
 	}
 
+	/* During interactive resize a new size comes with every pointer
+	 * motion. Only the latest one is sent, once the client has
+	 * painted the previous one. */
+	if (window->sync_pending) {
+		window->configure_deferred = true;
+		return;
+	}
+
+	weston_wm_window_send_sync_request(window);
 	weston_wm_window_set_allow_commits(window, false);
 
 	weston_wm_window_get_child_position(window, &x, &y);
@@ -3201,7 +4066,7 @@ send_position(struct weston_surface *surface, int32_t x, int32_t y)
 		weston_wm_configure_window(wm, window->frame_id, mask, values);
 
 		weston_wm_window_send_configure_notify(window);
-		xcb_flush(wm->conn);
+		weston_wm_schedule_flush(wm);
 	}
 }
 
@@ -3244,38 +4109,18 @@ static char *
 get_class_name(struct weston_surface *surface)
 {
 	struct weston_wm_window *window = get_wm_window(surface);
-	struct weston_wm *wm;
-	xcb_get_property_reply_t *reply;
-	xcb_get_property_cookie_t cookie;
-	char *data;
-	int length;
-	char *name = NULL;
 
 	if (!window || !window->wm)
 		return NULL;
 
-	wm = window->wm;
-	cookie = xcb_get_property(wm->conn, 0, window->id,
-				XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0,  0x1fffffff);
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
-	if (!reply)
-		return NULL;
-	length = xcb_get_property_value_length(reply);
-	if (!length) {
-		free(reply);
+	/* WM_CLASS is cached by weston_wm_window_read_properties(), so
+	 * this is answered without a round trip to the X server. */
+	wm_printf(window->wm, "get_class_name: name:%s\n",
+		  window->class_name ? window->class_name : "(none)");
+	if (!window->class_name || !*window->class_name)
 		return NULL;
-	}
-	assert(reply->type == XCB_ATOM_STRING);
-	data = xcb_get_property_value(reply);
-	while (*data != '\0') // class name is 2 strings, skip first one.
-		data++;
-	data++; // skip null.
-	wm_printf(wm, "get_class_name: name:%s, length:%d\n", data, length);
-	if (*data) // make sure 2nd string is not just null.
-		name = strdup(data);
-	free(reply);
 
-	return name;
+	return strdup(window->class_name);
 }
 
 static bool
@@ -3287,8 +4132,16 @@ trigger_set_window_icon(struct weston_surface *surface)
 	if (!window || !window->wm)
 		return false;
 
+	if (window->icon_unavailable)
+		return false;
+
 	wm = window->wm;
-	return weston_wm_window_set_icon(wm, window, window->id);
+	if (!weston_wm_window_read_icon(window,
+					weston_wm_window_trigger_icon_done))
+		return false;
+
+	weston_wm_schedule_flush(wm);
+	return true;
 }
 
 static void
@@ -3483,11 +4336,14 @@ xserver_map_shell_surface(struct weston_wm_window *window,
 	} else {
 		weston_wm_window_set_pending_state(window);
 		weston_wm_window_set_allow_commits(window, true);
-		xcb_flush(wm->conn);
+		weston_wm_schedule_flush(wm);
 	}
 
-	if (!window->override_redirect)
-		weston_wm_window_set_icon(wm, window, window->id);
+	/* a new shell surface has no icon yet */
+	window->icon_hash = 0;
+	if (!window->override_redirect &&
+	    weston_wm_window_read_icon(window, weston_wm_window_icon_done))
+		weston_wm_schedule_flush(wm);
 }
 
 const struct weston_xwayland_surface_api surface_api = {
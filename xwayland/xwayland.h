@@ -24,6 +24,7 @@
  */
 
 #include <stdio.h>
+#include <time.h>
 #include <wayland-server.h>
 #include <xcb/xcb.h>
 #include <xcb/xfixes.h>
@@ -53,13 +54,19 @@ struct weston_xserver {
 	weston_xwayland_spawn_xserver_func_t spawn_func;
 	void *user_data;
 
+	struct timespec spawn_time;
+	uint32_t idle_timeout_msec;
+	struct wl_event_source *idle_timer;
+
 	struct weston_log_scope *wm_debug;
 };
 
 struct weston_wm {
 	xcb_connection_t *conn;
 	const xcb_query_extension_reply_t *xfixes;
+	const xcb_query_extension_reply_t *sync;
 	struct wl_event_source *source;
+	struct wl_event_source *flush_source;
 	xcb_screen_t *screen;
 	struct hash_table *window_hash;
 	struct weston_xserver *server;
@@ -74,7 +81,17 @@ struct weston_wm {
 	struct wl_listener create_surface_listener;
 	struct wl_listener activate_listener;
 	struct wl_listener kill_listener;
-	struct wl_list unpaired_window_list;
+	/* windows waiting for their wl_surface, by WL_SURFACE_ID and by
+	 * the low 32 bits of the WL_SURFACE_SERIAL */
+	struct hash_table *unpaired_window_hash;
+	struct hash_table *serial_window_hash;
+	/* xwayland_surface_v1 with a serial but no window yet */
+	struct hash_table *serial_surface_hash;
+	struct wl_list xwayland_surface_list;
+	struct wl_global *xwayland_shell_global;
+	uint64_t last_surface_serial;
+	struct wl_list property_request_list;
+	int client_window_count;
 
 	xcb_window_t selection_window;
 	xcb_window_t selection_owner;
@@ -84,6 +101,8 @@ struct weston_wm {
 	xcb_get_property_reply_t *property_reply;
 	int property_start;
 	struct wl_array source_data;
+	uint32_t incr_chunk_size;
+	uint32_t incr_chunk_max;
 	xcb_selection_request_event_t selection_request;
 	xcb_atom_t selection_target;
 	xcb_timestamp_t selection_timestamp;
@@ -100,6 +119,8 @@ struct weston_wm {
 		xcb_atom_t		 wm_protocols;
 		xcb_atom_t		 wm_normal_hints;
 		xcb_atom_t		 wm_take_focus;
+		xcb_atom_t		 net_wm_sync_request;
+		xcb_atom_t		 net_wm_sync_request_counter;
 		xcb_atom_t		 wm_delete_window;
 		xcb_atom_t		 wm_state;
 		xcb_atom_t		 wm_s0;
@@ -162,6 +183,7 @@ struct weston_wm {
 		xcb_atom_t		 xdnd_type_list;
 		xcb_atom_t		 xdnd_action_copy;
 		xcb_atom_t		 wl_surface_id;
+		xcb_atom_t		 wl_surface_serial;
 		xcb_atom_t		 allow_commits;
 		xcb_atom_t		 weston_focus_ping;
 	} atom;
@@ -180,6 +202,9 @@ int
 weston_wm_handle_selection_event(struct weston_wm *wm,
 				 xcb_generic_event_t *event);
 
+void
+weston_xserver_update_idle(struct weston_xserver *wxs);
+
 struct weston_wm *
 weston_wm_create(struct weston_xserver *wxs, int fd);
 void